@@ -1,7 +1,6 @@
 #ifndef KVM__KVM_CONFIG_ARCH_H
 #define KVM__KVM_CONFIG_ARCH_H
 
-int vcpu_affinity_parser(const struct option *opt, const char *arg, int unset);
 int sve_vl_parser(const struct option *opt, const char *arg, int unset);
 
 #define ARM_OPT_ARCH_RUN(cfg)						\
@@ -13,14 +12,16 @@ int sve_vl_parser(const struct option *opt, const char *arg, int unset);
 			" main thread, unless --vcpu-affinity is set"),	\
 	OPT_BOOLEAN('\0', "disable-mte", &(cfg)->mte_disabled,		\
 			"Disable Memory Tagging Extension"),		\
-	OPT_CALLBACK('\0', "vcpu-affinity", kvm, "cpulist",  		\
-			"Specify the CPU affinity that will apply to "	\
-			"all VCPUs", vcpu_affinity_parser, kvm),	\
 	OPT_U64('\0', "kaslr-seed", &(cfg)->kaslr_seed,			\
 			"Specify random seed for Kernel Address Space "	\
 			"Layout Randomization (KASLR)"),		\
 	OPT_BOOLEAN('\0', "no-pvtime", &(cfg)->no_pvtime, "Disable"	\
 			" stolen time"),				\
+	OPT_STRING('\0', "pvtime-cpus", &(cfg)->pvtime_cpus, "cpulist",	\
+		   "Only give stolen time to these vCPUs"),		\
+	OPT_STRING('\0', "pmu-events", &(cfg)->pmu_events, "list",	\
+		   "Only let the guest count these PMU events, such as"	\
+		   " 0x8,0x11-0x13"),					\
 	OPT_CALLBACK('\0', "sve-max-vl", NULL, "vector length",		\
 		     "Specify the max SVE vector length (in bits) for "	\
 		     "all vCPUs", sve_vl_parser, kvm),
@@ -176,14 +176,15 @@ static int find_pmu(struct kvm *kvm)
 	if (!cpumask)
 		die_perror("calloc");
 
-	if (!kvm->arch.vcpu_affinity_cpuset) {
+	if (!kvm->cfg.vcpu_affinity) {
 		this_cpu = sched_getcpu();
 		if (this_cpu < 0)
 			return -errno;
 		cpumask_set_cpu(this_cpu, cpumask);
 	} else {
 		for (i = 0; i < CPU_SETSIZE; i ++) {
-			if (CPU_ISSET(i, kvm->arch.vcpu_affinity_cpuset))
+			if (CPU_ISSET_S(i, CPU_ALLOC_SIZE(NR_CPUS),
+					 kvm->cfg.vcpu_affinity))
 				cpumask_set_cpu(i, cpumask);
 		}
 	}
@@ -191,6 +192,37 @@ static int find_pmu(struct kvm *kvm)
 	return find_pmu_cpumask(kvm, cpumask);
 }
 
+/*
+ * Allow the events of --pmu-events, a list of numbers and ranges such as
+ * "0x8,0x11-0x13". Once a range is allowed, KVM denies all the others.
+ */
+static void pmu__set_event_filter(struct kvm *kvm)
+{
+	struct kvm_pmu_event_filter filter = {
+		.action	= KVM_PMU_EVENT_ALLOW,
+	};
+	const char *p = kvm->cfg.arch.pmu_events;
+	unsigned long first, last;
+	char *end;
+
+	while (*p) {
+		first = last = strtoul(p, &end, 0);
+		if (end != p && *end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 0);
+		}
+		if (end == p || (*end && *end != ',') || first > last ||
+		    last > 0xffff)
+			die("Invalid --pmu-events: %s", kvm->cfg.arch.pmu_events);
+
+		filter.base_event = first;
+		filter.nevents = last - first + 1;
+		set_pmu_attr(kvm->cpus[0], &filter, KVM_ARM_VCPU_PMU_V3_FILTER);
+
+		p = *end ? end + 1 : end;
+	}
+}
+
 void pmu__generate_fdt_nodes(void *fdt, struct kvm *kvm)
 {
 	const char compatible[] = "arm,armv8-pmuv3";
@@ -226,6 +258,9 @@ void pmu__generate_fdt_nodes(void *fdt, struct kvm *kvm)
 		 */
 		if (pmu_id > 0)
 			set_pmu_attr(vcpu, &pmu_id, KVM_ARM_VCPU_PMU_V3_SET_PMU);
+		/* The filter is for the whole VM, once its PMU is chosen */
+		if (i == 0 && kvm->cfg.arch.pmu_events)
+			pmu__set_event_filter(kvm);
 		set_pmu_attr(vcpu, NULL, KVM_ARM_VCPU_PMU_V3_INIT);
 	}
 
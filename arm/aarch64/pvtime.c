@@ -1,13 +1,26 @@
 #include "kvm/kvm.h"
 #include "kvm/kvm-cpu.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/metrics.h"
+#include "kvm/read-write.h"
 #include "kvm/util.h"
 
 #include <linux/byteorder.h>
+#include <linux/cpumask.h>
 #include <linux/types.h>
 
 #define ARM_PVTIME_STRUCT_SIZE		(64)
 
+/* What KVM keeps up to date for each vCPU, see DEN0057A */
+struct pvtime_stolen_time {
+	__le32	revision;
+	__le32	attributes;
+	__le64	stolen_time;
+};
+
 static void *usr_mem;
+/* The vCPUs that were given a stolen time structure */
+static cpumask_t pvtime_vcpus;
 
 static int pvtime__alloc_region(struct kvm *kvm)
 {
@@ -58,6 +71,16 @@ int kvm_cpu__setup_pvtime(struct kvm_cpu *vcpu)
 	if (kvm_cfg->no_pvtime)
 		return 0;
 
+	if (kvm_cfg->pvtime_cpus) {
+		cpumask_t cpus;
+
+		cpumask_clear(&cpus);
+		if (cpulist_parse(kvm_cfg->pvtime_cpus, &cpus))
+			die("Invalid --pvtime-cpus: %s", kvm_cfg->pvtime_cpus);
+		if (!cpumask_test_cpu(vcpu->cpu_id, &cpus))
+			return 0;
+	}
+
 	has_stolen_time = kvm__supports_extension(vcpu->kvm,
 						  KVM_CAP_STEAL_TIME);
 	if (!has_stolen_time) {
@@ -82,8 +105,10 @@ int kvm_cpu__setup_pvtime(struct kvm_cpu *vcpu)
 
 	pvtime_attr.addr = (u64)&pvtime_guest_addr;
 	ret = ioctl(vcpu->vcpu_fd, KVM_SET_DEVICE_ATTR, &pvtime_attr);
-	if (!ret)
+	if (!ret) {
+		cpumask_set_cpu(vcpu->cpu_id, &pvtime_vcpus);
 		return 0;
+	}
 
 	ret = -errno;
 	perror("KVM_SET_DEVICE_ATTR failed\n");
@@ -96,3 +121,71 @@ int kvm_cpu__teardown_pvtime(struct kvm *kvm)
 {
 	return pvtime__teardown_region(kvm);
 }
+
+/* In ns, as KVM last updated it for @vcpu_id */
+static u64 pvtime__stolen(unsigned long vcpu_id)
+{
+	struct pvtime_stolen_time *st;
+
+	if (!usr_mem || !cpumask_test_cpu(vcpu_id, &pvtime_vcpus))
+		return KVM_CPU_NO_STEAL_TIME;
+
+	st = usr_mem + vcpu_id * ARM_PVTIME_STRUCT_SIZE;
+	return le64_to_cpu(__atomic_load_n(&st->stolen_time, __ATOMIC_RELAXED));
+}
+
+static void pvtime__handle_stats(struct kvm *kvm, int fd, u32 type, u32 len,
+				 u8 *msg)
+{
+	u32 nr = kvm->nrcpus, i;
+	u64 *reply;
+
+	if (WARN_ON(type != KVM_IPC_STEAL_STATS || len))
+		return;
+
+	reply = calloc(nr, sizeof(*reply));
+	if (!reply)
+		nr = 0;
+
+	for (i = 0; i < nr; i++)
+		reply[i] = pvtime__stolen(i);
+
+	if (write_in_full(fd, &nr, sizeof(nr)) < 0 ||
+	    write_in_full(fd, reply, nr * sizeof(*reply)) < 0)
+		pr_warning("Failed sending stolen time");
+
+	free(reply);
+}
+
+static void pvtime__collect(struct kvm *kvm, struct metrics *m)
+{
+	u64 stolen;
+	int i;
+
+	if (!usr_mem)
+		return;
+
+	metrics__family(m, "vcpu_steal_ns_total", "counter",
+			"Time the vCPU was runnable but not running on the host");
+	for (i = 0; i < kvm->nrcpus; i++) {
+		stolen = pvtime__stolen(i);
+		if (stolen != KVM_CPU_NO_STEAL_TIME)
+			metrics__sample(m, stolen, "vcpu=\"%d\"", i);
+	}
+}
+
+static struct metrics_collector pvtime__metrics = {
+	.collect	= pvtime__collect,
+};
+
+static int pvtime__init(struct kvm *kvm)
+{
+	if (kvm->cfg.arch.no_pvtime)
+		return 0;
+
+	metrics__register(&pvtime__metrics);
+
+	return kvm_ipc__register_handler(KVM_IPC_STEAL_STATS,
+					 pvtime__handle_stats);
+}
+late_init(pvtime__init);
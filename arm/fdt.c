@@ -1,3 +1,4 @@
+#include "kvm/boot-cache.h"
 #include "kvm/devices.h"
 #include "kvm/fdt.h"
 #include "kvm/kvm.h"
@@ -30,10 +31,70 @@ static void dump_fdt(const char *dtb_file, void *fdt)
 	close(fd);
 }
 
+static void generate_memory_nodes(void *fdt, struct kvm *kvm)
+{
+	u64 mem_reg_prop[2], offset, size;
+	char name[32];
+	int i;
+
+	if (!kvm->cfg.nr_guest_numa) {
+		mem_reg_prop[0] = cpu_to_fdt64(kvm->arch.memory_guest_start);
+		mem_reg_prop[1] = cpu_to_fdt64(kvm->ram_size);
+
+		_FDT(fdt_begin_node(fdt, "memory"));
+		_FDT(fdt_property_string(fdt, "device_type", "memory"));
+		_FDT(fdt_property(fdt, "reg", mem_reg_prop, sizeof(mem_reg_prop)));
+		_FDT(fdt_end_node(fdt));
+		return;
+	}
+
+	/* One node per guest NUMA node, matching its RAM bank */
+	for (i = 0; i < kvm->cfg.nr_guest_numa; i++) {
+		size = kvm__numa_node_mem(kvm, i, &offset);
+		if (!size)
+			continue;
+
+		offset += kvm->arch.memory_guest_start;
+		mem_reg_prop[0] = cpu_to_fdt64(offset);
+		mem_reg_prop[1] = cpu_to_fdt64(size);
+
+		snprintf(name, sizeof(name), "memory@%llx", offset);
+		_FDT(fdt_begin_node(fdt, name));
+		_FDT(fdt_property_string(fdt, "device_type", "memory"));
+		_FDT(fdt_property(fdt, "reg", mem_reg_prop, sizeof(mem_reg_prop)));
+		_FDT(fdt_property_cell(fdt, "numa-node-id", i));
+		_FDT(fdt_end_node(fdt));
+	}
+}
+
+static void generate_distance_map(void *fdt, struct kvm *kvm)
+{
+	u32 matrix[KVM_MAX_NUMA_BANKS * KVM_MAX_NUMA_BANKS * 3];
+	int i, j, n = 0;
+
+	if (!kvm->cfg.nr_guest_numa)
+		return;
+
+	for (i = 0; i < kvm->cfg.nr_guest_numa; i++) {
+		for (j = 0; j < kvm->cfg.nr_guest_numa; j++) {
+			matrix[n++] = cpu_to_fdt32(i);
+			matrix[n++] = cpu_to_fdt32(j);
+			matrix[n++] = cpu_to_fdt32(i == j ?
+						   KVM_NUMA_LOCAL_DISTANCE :
+						   KVM_NUMA_REMOTE_DISTANCE);
+		}
+	}
+
+	_FDT(fdt_begin_node(fdt, "distance-map"));
+	_FDT(fdt_property_string(fdt, "compatible", "numa-distance-map-v1"));
+	_FDT(fdt_property(fdt, "distance-matrix", matrix, n * sizeof(u32)));
+	_FDT(fdt_end_node(fdt));
+}
+
 #define CPU_NAME_MAX_LEN 15
 static void generate_cpu_nodes(void *fdt, struct kvm *kvm)
 {
-	int cpu;
+	int cpu, numa_node;
 
 	_FDT(fdt_begin_node(fdt, "cpus"));
 	_FDT(fdt_property_cell(fdt, "#address-cells", 0x1));
@@ -55,6 +116,11 @@ static void generate_cpu_nodes(void *fdt, struct kvm *kvm)
 			_FDT(fdt_property_string(fdt, "enable-method", "psci"));
 
 		_FDT(fdt_property_cell(fdt, "reg", mpidr));
+
+		numa_node = kvm__numa_node_of_cpu(kvm, cpu);
+		if (numa_node >= 0)
+			_FDT(fdt_property_cell(fdt, "numa-node-id", numa_node));
+
 		_FDT(fdt_end_node(fdt));
 	}
 
@@ -100,14 +166,62 @@ static struct psci_fns psci_0_2_aarch64_fns = {
 	.migrate = PSCI_0_2_FN64_MIGRATE,
 };
 
+/* What the tree depends on besides what boot_cache__key_init() hashes */
+static void boot_cache_key_arch(struct kvm *kvm, struct boot_cache_key *key)
+{
+	struct kvm_config_arch *cfg = &kvm->cfg.arch;
+	int cpu;
+
+	boot_cache__key_add_val(key, kvm->arch.memory_guest_start);
+	boot_cache__key_add_val(key, kvm->arch.initrd_guest_start);
+	boot_cache__key_add_val(key, kvm->arch.initrd_size);
+	boot_cache__key_add_val(key, kvm->arch.dtb_guest_start);
+	boot_cache__key_add_val(key, cfg->force_cntfrq);
+	boot_cache__key_add_val(key, cfg->aarch32_guest);
+	boot_cache__key_add_val(key, cfg->has_pmuv3);
+	boot_cache__key_add_val(key, cfg->mte_disabled);
+	boot_cache__key_add_val(key, cfg->irqchip);
+	boot_cache__key_add_val(key, cfg->sve_max_vq);
+	boot_cache__key_add_val(key, cfg->no_pvtime);
+	boot_cache__key_add_val(key,
+			kvm__supports_extension(kvm, KVM_CAP_ARM_PSCI_0_2));
+	boot_cache__key_add_str(key, fdt_stdout_path);
+
+	for (cpu = 0; cpu < kvm->nrcpus; cpu++) {
+		struct kvm_cpu *vcpu = kvm->cpus[cpu];
+
+		boot_cache__key_add_val(key, kvm_cpu__get_vcpu_mpidr(vcpu));
+		boot_cache__key_add_str(key, vcpu->cpu_compatible);
+	}
+}
+
+/* The seed is the one thing that may differ between identical guests */
+static int setup_fdt_cached(struct kvm *kvm, struct boot_cache_key *key,
+			    void *fdt_dest)
+{
+	int chosen;
+
+	if (boot_cache__load(kvm, key, "dtb", fdt_dest, FDT_MAX_SIZE) < 0)
+		return -ENOENT;
+
+	chosen = fdt_path_offset(fdt_dest, "/chosen");
+	if (chosen < 0 ||
+	    fdt_setprop_inplace_u64(fdt_dest, chosen, "kaslr-seed",
+				    kvm->cfg.arch.kaslr_seed) < 0)
+		return -EINVAL;
+
+	free(fdt_stdout_path);
+	fdt_stdout_path = NULL;
+
+	return 0;
+}
+
 static int setup_fdt(struct kvm *kvm)
 {
 	struct device_header *dev_hdr;
+	struct boot_cache_key key;
+	u64 start = kvm_cpu__now();
 	u8 staging_fdt[FDT_MAX_SIZE];
-	u64 mem_reg_prop[]	= {
-		cpu_to_fdt64(kvm->arch.memory_guest_start),
-		cpu_to_fdt64(kvm->ram_size),
-	};
 	struct psci_fns *fns;
 	void *fdt		= staging_fdt;
 	void *fdt_dest		= guest_flat_to_host(kvm,
@@ -117,6 +231,11 @@ static int setup_fdt(struct kvm *kvm)
 	void (*generate_cpu_peripheral_fdt_nodes)(void *, struct kvm *)
 					= kvm->cpus[0]->generate_fdt_nodes;
 
+	boot_cache__key_init(kvm, &key);
+	boot_cache_key_arch(kvm, &key);
+	if (setup_fdt_cached(kvm, &key, fdt_dest) == 0)
+		goto out;
+
 	/* Create new tree without a reserve map */
 	_FDT(fdt_create(fdt, FDT_MAX_SIZE));
 	_FDT(fdt_finish_reservemap(fdt));
@@ -158,10 +277,8 @@ static int setup_fdt(struct kvm *kvm)
 	_FDT(fdt_end_node(fdt));
 
 	/* Memory */
-	_FDT(fdt_begin_node(fdt, "memory"));
-	_FDT(fdt_property_string(fdt, "device_type", "memory"));
-	_FDT(fdt_property(fdt, "reg", mem_reg_prop, sizeof(mem_reg_prop)));
-	_FDT(fdt_end_node(fdt));
+	generate_memory_nodes(fdt, kvm);
+	generate_distance_map(fdt, kvm);
 
 	/* CPU and peripherals (interrupt controller, timers, etc) */
 	generate_cpu_nodes(fdt, kvm);
@@ -228,7 +345,10 @@ static int setup_fdt(struct kvm *kvm)
 
 	_FDT(fdt_open_into(fdt, fdt_dest, FDT_MAX_SIZE));
 	_FDT(fdt_pack(fdt_dest));
+	boot_cache__store(kvm, &key, "dtb", fdt_dest, fdt_totalsize(fdt_dest),
+			  start);
 
+out:
 	if (kvm->cfg.arch.dump_dtb_filename)
 		dump_fdt(kvm->cfg.arch.dump_dtb_filename, fdt_dest);
 	return 0;
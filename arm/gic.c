@@ -1,6 +1,7 @@
 #include "kvm/fdt.h"
 #include "kvm/irq.h"
 #include "kvm/kvm.h"
+#include "kvm/probe.h"
 #include "kvm/virtio.h"
 
 #include "arm-common/gic.h"
@@ -70,7 +71,7 @@ static int irq__setup_irqfd_lines(struct kvm *kvm)
 
 static int irq__routing_init(struct kvm *kvm)
 {
-	int r;
+	int gsi, r;
 	int irqlines = ALIGN(irq__get_nr_allocated_lines(), 32);
 
 	/*
@@ -79,19 +80,12 @@ static int irq__routing_init(struct kvm *kvm)
 	 * don't need to commit these setting right now. The first actual
 	 * user (MSI routing) will engage these mappings then.
 	 */
-	for (next_gsi = 0; next_gsi < irqlines; next_gsi++) {
-		r = irq__allocate_routing_entry();
+	for (gsi = 0; gsi < irqlines; gsi++) {
+		r = irq__add_irqchip_route(kvm, gsi, IRQCHIP_GIC, gsi);
 		if (r)
 			return r;
-
-		irq_routing->entries[irq_routing->nr++] =
-			(struct kvm_irq_routing_entry) {
-				.gsi = next_gsi,
-				.type = KVM_IRQ_ROUTING_IRQCHIP,
-				.u.irqchip.irqchip = IRQCHIP_GIC,
-				.u.irqchip.pin = next_gsi,
-		};
 	}
+	irq__set_next_gsi(kvm, gsi);
 
 	return 0;
 }
@@ -278,7 +272,7 @@ int gic__create(struct kvm *kvm, enum irqchip_type type)
 		gic_msi_size = KVM_VGIC_V3_ITS_SIZE;
 		/* fall through */
 	case IRQCHIP_GICV3:
-		gic_redists_size = kvm->cfg.nrcpus * ARM_GIC_REDIST_SIZE;
+		gic_redists_size = kvm->cfg.max_cpus * ARM_GIC_REDIST_SIZE;
 		gic_redists_base = ARM_GIC_DIST_BASE - gic_redists_size;
 		gic_msi_base = gic_redists_base - gic_msi_size;
 		break;
@@ -337,6 +331,14 @@ static int gic__init_gic(struct kvm *kvm)
 	kvm->msix_needs_devid = kvm__supports_vm_extension(kvm,
 							   KVM_CAP_MSI_DEVID);
 
+	/*
+	 * A GICv4.1 host injects the MSIs of passthrough devices as vLPIs,
+	 * without going through KVM, when their irqfds target an ITS route.
+	 */
+	if (kvm->cfg.num_vfio_devices &&
+	    kvm->cfg.arch.irqchip != IRQCHIP_GICV3_ITS)
+		pr_warning("VFIO MSIs can't be injected directly without the gicv3-its irqchip");
+
 	vgic_is_init = true;
 
 	return irq__setup_irqfd_lines(kvm);
@@ -421,6 +423,8 @@ void kvm__irq_line(struct kvm *kvm, int irq, int level)
 		.level	= !!level,
 	};
 
+	kvm__probe(irq_line, irq, level);
+
 	if (irq < GIC_SPI_IRQ_BASE || irq > GIC_MAX_IRQ)
 		pr_warning("Ignoring invalid GIC IRQ %d", irq);
 	else if (ioctl(kvm->vm_fd, KVM_IRQ_LINE, &irq_level) < 0)
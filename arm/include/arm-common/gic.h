@@ -42,6 +42,7 @@ u32 gic__get_fdt_irq_cpumask(struct kvm *kvm);
 int gic__add_irqfd(struct kvm *kvm, unsigned int gsi, int trigger_fd,
 		   int resample_fd);
 void gic__del_irqfd(struct kvm *kvm, unsigned int gsi, int trigger_fd);
+#define irq__line_gsi(line)	((line) - GIC_SPI_IRQ_BASE)
 #define irq__add_irqfd gic__add_irqfd
 #define irq__del_irqfd gic__del_irqfd
 
@@ -5,7 +5,6 @@
 
 struct kvm_config_arch {
 	const char	*dump_dtb_filename;
-	const char	*vcpu_affinity;
 	unsigned int	force_cntfrq;
 	bool		aarch32_guest;
 	bool		has_pmuv3;
@@ -15,6 +14,8 @@ struct kvm_config_arch {
 	u64		fw_addr;
 	unsigned int	sve_max_vq;
 	bool		no_pvtime;
+	const char	*pvtime_cpus;
+	const char	*pmu_events;
 };
 
 int irqchip_parser(const struct option *opt, const char *arg, int unset);
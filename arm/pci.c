@@ -97,7 +97,8 @@ void pci__generate_fdt_nodes(void *fdt, struct kvm *kvm)
 		*entry = (struct of_interrupt_map_entry) {
 			.pci_irq_mask = {
 				.pci_addr = {
-					.hi	= cpu_to_fdt32(of_pci_b_ddddd(dev_num)),
+					.hi	= cpu_to_fdt32(of_pci_b_ddddd(pci__dev_slot(dev_num)) |
+							    of_pci_b_fff(pci__dev_fn(dev_num))),
 					.mid	= 0,
 					.lo	= 0,
 				},
@@ -124,7 +125,8 @@ void pci__generate_fdt_nodes(void *fdt, struct kvm *kvm)
 	if (nentries) {
 		struct of_pci_irq_mask irq_mask = {
 			.pci_addr = {
-				.hi	= cpu_to_fdt32(of_pci_b_ddddd(-1)),
+				.hi	= cpu_to_fdt32(of_pci_b_ddddd(-1) |
+						    of_pci_b_fff(-1)),
 				.mid	= 0,
 				.lo	= 0,
 			},
@@ -0,0 +1,229 @@
+#include "kvm/boot-cache.h"
+
+#include "kvm/boot-trace.h"
+#include "kvm/devices.h"
+#include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/pci.h"
+#include "kvm/read-write.h"
+#include "kvm/util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#define BOOT_CACHE_MAGIC	0x6b627463	/* "ctbk" */
+#define BOOT_CACHE_VERSION	1
+
+#define FNV64_OFFSET		0xcbf29ce484222325ULL
+#define FNV64_PRIME		0x100000001b3ULL
+
+struct boot_cache_header {
+	u32	magic;
+	u32	version;
+	u64	key;
+	u64	len;
+	/* How long generating the data took, in nanoseconds */
+	u64	gen_ns;
+	/* Of the data, torn or damaged files are misses */
+	u64	csum;
+};
+
+static u64 boot_cache__fnv(u64 hash, const void *data, size_t len)
+{
+	const u8 *p = data;
+
+	while (len--)
+		hash = (hash ^ *p++) * FNV64_PRIME;
+
+	return hash;
+}
+
+void boot_cache__key_add(struct boot_cache_key *key, const void *data,
+			 size_t len)
+{
+	if (key->enabled)
+		key->hash = boot_cache__fnv(key->hash, data, len);
+}
+
+/* With its NUL, so that "ab" "c" and "a" "bc" differ */
+void boot_cache__key_add_str(struct boot_cache_key *key, const char *str)
+{
+	boot_cache__key_add(key, str ? str : "", str ? strlen(str) + 1 : 1);
+}
+
+/*
+ * The build of lkvm, the host kernel, the memory and vCPUs of the guest,
+ * its command line and the devices on each bus, with the configuration
+ * space of the PCI ones. The caller adds what its architecture reads.
+ */
+void boot_cache__key_init(struct kvm *kvm, struct boot_cache_key *key)
+{
+	struct device_header *dev_hdr;
+	struct kvm_mem_bank *bank;
+	struct utsname uts;
+	struct stat st;
+	u64 offset;
+	int i;
+
+	*key = (struct boot_cache_key) {
+		.hash		= FNV64_OFFSET,
+		.enabled	= kvm->cfg.boot_cache != NULL,
+	};
+	if (!key->enabled)
+		return;
+
+	boot_cache__key_add_str(key, KVMTOOLS_VERSION);
+	boot_cache__key_add_str(key, BUILD_ARCH);
+	if (stat("/proc/self/exe", &st) == 0) {
+		boot_cache__key_add_val(key, (u64)st.st_dev);
+		boot_cache__key_add_val(key, (u64)st.st_ino);
+		boot_cache__key_add_val(key, (u64)st.st_size);
+		boot_cache__key_add_val(key, (u64)st.st_mtim.tv_sec);
+		boot_cache__key_add_val(key, (u64)st.st_mtim.tv_nsec);
+	}
+	if (uname(&uts) == 0) {
+		boot_cache__key_add_str(key, uts.release);
+		boot_cache__key_add_str(key, uts.version);
+		boot_cache__key_add_str(key, uts.machine);
+	}
+
+	boot_cache__key_add_val(key, kvm->ram_size);
+	boot_cache__key_add_val(key, kvm->nrcpus);
+	mutex_lock(&kvm->mem_banks_lock);
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		boot_cache__key_add_val(key, bank->guest_phys_addr);
+		boot_cache__key_add_val(key, bank->size);
+		boot_cache__key_add_val(key, (u32)bank->type);
+	}
+	mutex_unlock(&kvm->mem_banks_lock);
+
+	boot_cache__key_add_val(key, kvm->cfg.nr_guest_numa);
+	for (i = 0; i < kvm->cfg.nr_guest_numa; i++) {
+		boot_cache__key_add_val(key, kvm__numa_node_mem(kvm, i, &offset));
+		boot_cache__key_add_val(key, offset);
+	}
+	for (i = 0; i < kvm->nrcpus; i++)
+		boot_cache__key_add_val(key, kvm__numa_node_of_cpu(kvm, i));
+
+	boot_cache__key_add_val(key, kvm->cfg.firmware_filename != NULL);
+	boot_cache__key_add_str(key, kvm->cfg.kernel_cmdline);
+	boot_cache__key_add_str(key, kvm->cfg.real_cmdline);
+	boot_cache__key_add_val(key, kvm->cfg.active_console);
+
+	for (i = 0; i < DEVICE_BUS_MAX; i++) {
+		for (dev_hdr = device__first_dev(i); dev_hdr;
+		     dev_hdr = device__next_dev(dev_hdr)) {
+			boot_cache__key_add_val(key, i);
+			boot_cache__key_add_val(key, dev_hdr->dev_num);
+			/* The standard header: IDs, BARs and interrupt */
+			if (i == DEVICE_BUS_PCI)
+				boot_cache__key_add(key, dev_hdr->data,
+						    PCI_STD_HEADER_SIZEOF);
+		}
+	}
+}
+
+static void boot_cache__path(struct kvm *kvm, struct boot_cache_key *key,
+			     const char *what, char *path, size_t len)
+{
+	snprintf(path, len, "%s/%s-%016llx.%s", kvm->cfg.boot_cache,
+		 BUILD_ARCH, (unsigned long long)key->hash, what);
+}
+
+ssize_t boot_cache__load(struct kvm *kvm, struct boot_cache_key *key,
+			 const char *what, void *buf, size_t size)
+{
+	struct boot_cache_header hdr;
+	u64 start = kvm_cpu__now();
+	char path[PATH_MAX];
+	ssize_t r = -ENOENT;
+	int fd;
+
+	if (!key->enabled)
+		return -ENOENT;
+
+	boot_cache__path(kvm, key, what, path, sizeof(path));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		goto miss;
+
+	if (read_in_full(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    hdr.magic != BOOT_CACHE_MAGIC ||
+	    hdr.version != BOOT_CACHE_VERSION || hdr.key != key->hash ||
+	    !hdr.len || hdr.len > size ||
+	    read_in_full(fd, buf, hdr.len) != (ssize_t)hdr.len ||
+	    boot_cache__fnv(FNV64_OFFSET, buf, hdr.len) != hdr.csum) {
+		pr_warning("Ignoring the stale or damaged %s", path);
+		r = -EINVAL;
+	} else {
+		r = hdr.len;
+	}
+	close(fd);
+
+miss:
+	if (r < 0) {
+		if (boot_trace_enabled)
+			boot_trace__mark("boot-cache", "%s: miss", what);
+		return r;
+	}
+
+	if (boot_trace_enabled) {
+		u64 end = kvm_cpu__now();
+
+		boot_trace__span("boot-cache", what, start, end);
+		boot_trace__mark("boot-cache", "%s: hit, %lld us saved", what,
+				 ((long long)hdr.gen_ns -
+				  (long long)(end - start)) / 1000);
+	}
+
+	return r;
+}
+
+/* Through a temporary file, so that others never load half of it */
+void boot_cache__store(struct kvm *kvm, struct boot_cache_key *key,
+		       const char *what, const void *buf, size_t len,
+		       u64 start)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	struct boot_cache_header hdr = {
+		.magic		= BOOT_CACHE_MAGIC,
+		.version	= BOOT_CACHE_VERSION,
+		.key		= key->hash,
+		.len		= len,
+		.gen_ns		= kvm_cpu__now() - start,
+		.csum		= boot_cache__fnv(FNV64_OFFSET, buf, len),
+	};
+	int fd, r = 0;
+
+	if (!key->enabled)
+		return;
+
+	boot_cache__path(kvm, key, what, path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		r = -errno;
+		goto err;
+	}
+
+	if (write_in_full(fd, &hdr, sizeof(hdr)) < 0 ||
+	    write_in_full(fd, buf, len) < 0)
+		r = -errno;
+	if (close(fd) < 0 && !r)
+		r = -errno;
+	if (!r && rename(tmp, path) < 0)
+		r = -errno;
+	if (r)
+		unlink(tmp);
+
+err:
+	if (r)
+		pr_warning("Unable to store %s in the boot cache: %s", what,
+			   strerror(-r));
+}
@@ -0,0 +1,182 @@
+#include "kvm/boot-trace.h"
+
+#include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/mutex.h"
+#include "kvm/util.h"
+#include "kvm/util-init.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct boot_trace_event {
+	char		*name;
+	const char	*cat;
+	/* Nanoseconds since the start of lkvm run */
+	u64		ts;
+	/* 0 for instant events */
+	u64		dur;
+	bool		instant;
+	pid_t		tid;
+};
+
+bool boot_trace_enabled;
+bool boot_trace_exits_pending;
+
+static DEFINE_MUTEX(boot_trace_lock);
+static struct boot_trace_event *boot_trace_events;
+static unsigned int boot_trace_nr, boot_trace_size;
+static u64 boot_trace_origin;
+static bool boot_trace_seen_pio, boot_trace_seen_mmio;
+
+static void boot_trace__add(const char *cat, char *name, u64 start, u64 end,
+			    bool instant)
+{
+	struct boot_trace_event *events;
+
+	if (!name)
+		return;
+
+	mutex_lock(&boot_trace_lock);
+	if (boot_trace_nr == boot_trace_size) {
+		boot_trace_size = boot_trace_size ? boot_trace_size * 2 : 64;
+		events = realloc(boot_trace_events,
+				 boot_trace_size * sizeof(*events));
+		if (!events) {
+			mutex_unlock(&boot_trace_lock);
+			free(name);
+			return;
+		}
+		boot_trace_events = events;
+	}
+
+	boot_trace_events[boot_trace_nr++] = (struct boot_trace_event) {
+		.name		= name,
+		.cat		= cat,
+		.ts		= start - boot_trace_origin,
+		.dur		= end - start,
+		.instant	= instant,
+		.tid		= syscall(SYS_gettid),
+	};
+	mutex_unlock(&boot_trace_lock);
+}
+
+void boot_trace__span(const char *cat, const char *name, u64 start, u64 end)
+{
+	boot_trace__add(cat, strdup(name), start, end, false);
+}
+
+void boot_trace__mark(const char *cat, const char *fmt, ...)
+{
+	u64 now = kvm_cpu__now();
+	va_list args;
+	char *name;
+
+	va_start(args, fmt);
+	if (vasprintf(&name, fmt, args) < 0)
+		name = NULL;
+	va_end(args);
+
+	boot_trace__add(cat, name, now, now, true);
+}
+
+void boot_trace__first_exit(bool mmio, u64 addr)
+{
+	bool *seen = mmio ? &boot_trace_seen_mmio : &boot_trace_seen_pio;
+
+	if (__atomic_exchange_n(seen, true, __ATOMIC_RELAXED))
+		return;
+
+	boot_trace__mark("exit", "first %s exit at %#llx", mmio ? "MMIO" : "PIO",
+			 (unsigned long long)addr);
+
+	if (__atomic_load_n(&boot_trace_seen_pio, __ATOMIC_RELAXED) &&
+	    __atomic_load_n(&boot_trace_seen_mmio, __ATOMIC_RELAXED))
+		__atomic_store_n(&boot_trace_exits_pending, false,
+				 __ATOMIC_RELAXED);
+}
+
+void boot_trace__start(struct kvm *kvm)
+{
+	boot_trace_origin = kvm->start_ns;
+	boot_trace_exits_pending = true;
+	__atomic_store_n(&boot_trace_enabled, true, __ATOMIC_RELEASE);
+
+	boot_trace__span("run", "parse options", kvm->start_ns, kvm_cpu__now());
+}
+
+static void boot_trace__write_name(FILE *f, const char *name)
+{
+	for (; *name; name++) {
+		if (*name == '"' || *name == '\\')
+			fputc('\\', f);
+		fputc(*name, f);
+	}
+}
+
+/* One event per line, which scripts can also go through */
+static int boot_trace__write(const char *filename)
+{
+	struct boot_trace_event *e;
+	pid_t pid = getpid();
+	unsigned int i;
+	FILE *f;
+
+	f = fopen(filename, "w");
+	if (!f)
+		return -errno;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (i = 0; i < boot_trace_nr; i++) {
+		e = &boot_trace_events[i];
+		fprintf(f, "{\"name\":\"");
+		boot_trace__write_name(f, e->name);
+		fprintf(f, "\",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,",
+			e->cat, e->instant ? "i" : "X", e->ts / 1e3);
+		if (e->instant)
+			fprintf(f, "\"s\":\"p\",");
+		else
+			fprintf(f, "\"dur\":%.3f,", e->dur / 1e3);
+		fprintf(f, "\"pid\":%d,\"tid\":%d}%s\n", pid, e->tid,
+			i + 1 < boot_trace_nr ? "," : "");
+	}
+	fprintf(f, "]}\n");
+
+	if (fclose(f))
+		return -errno;
+
+	return 0;
+}
+
+static int boot_trace__exit(struct kvm *kvm)
+{
+	unsigned int i;
+	int r;
+
+	if (!boot_trace_enabled)
+		return 0;
+
+	boot_trace_enabled = false;
+	boot_trace__span("run", "run", kvm->start_ns, kvm_cpu__now());
+
+	mutex_lock(&boot_trace_lock);
+	r = boot_trace__write(kvm->cfg.boot_trace);
+	if (r < 0)
+		pr_warning("Unable to write the boot trace to %s: %s",
+			   kvm->cfg.boot_trace, strerror(-r));
+
+	for (i = 0; i < boot_trace_nr; i++)
+		free(boot_trace_events[i].name);
+	free(boot_trace_events);
+	boot_trace_events = NULL;
+	boot_trace_nr = boot_trace_size = 0;
+	mutex_unlock(&boot_trace_lock);
+
+	return 0;
+}
+late_exit(boot_trace__exit);
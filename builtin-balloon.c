@@ -12,9 +12,10 @@
 static const char *instance_name;
 static u64 inflate;
 static u64 deflate;
+static bool hint;
 
 static const char * const balloon_usage[] = {
-	"lkvm balloon [-n name] [-p pid] [-i amount] [-d amount]",
+	"lkvm balloon [-n name] [-p pid] [-i amount] [-d amount] [--hint]",
 	NULL
 };
 
@@ -24,6 +25,8 @@ static const struct option balloon_options[] = {
 	OPT_GROUP("Balloon options:"),
 	OPT_U64('i', "inflate", &inflate, "Amount to inflate (in MB)"),
 	OPT_U64('d', "deflate", &deflate, "Amount to deflate (in MB)"),
+	OPT_BOOLEAN('\0', "hint", &hint,
+		    "Ask the guest for its free pages, and drop them"),
 	OPT_END(),
 };
 
@@ -50,7 +53,7 @@ int kvm_cmd_balloon(int argc, const char **argv, const char *prefix)
 
 	parse_balloon_options(argc, argv);
 
-	if (inflate == 0 && deflate == 0)
+	if (inflate == 0 && deflate == 0 && !hint)
 		kvm_balloon_help();
 
 	if (instance_name == NULL)
@@ -61,6 +64,12 @@ int kvm_cmd_balloon(int argc, const char **argv, const char *prefix)
 	if (instance <= 0)
 		die("Failed locating instance");
 
+	if (hint) {
+		r = kvm_ipc__send(instance, KVM_IPC_BALLOON_HINT);
+		close(instance);
+		return r < 0 ? -1 : 0;
+	}
+
 	if (inflate)
 		amount = inflate;
 	else if (deflate)
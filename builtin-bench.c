@@ -0,0 +1,582 @@
+#include <kvm/util.h>
+#include <kvm/kvm-cmd.h>
+#include <kvm/builtin-bench.h>
+#include <kvm/kvm.h>
+#include <kvm/parse-options.h>
+#include <kvm/disk-image.h>
+#include <kvm/disk-stats.h>
+#include <kvm/disk-trace.h>
+#include <kvm/mutex.h>
+#include <kvm/read-write.h>
+#include <kvm/threadpool.h>
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Drives a disk image through the same disk_image__read/write() paths and
+ * engines as virtio-blk, so that the backends can be compared without a
+ * guest. Each thread keeps its requests in flight, reissuing them as they
+ * complete, until the time is up. With --replay, a single thread issues the
+ * requests of a trace= recording instead, at the times they were issued or
+ * as fast as the requests in flight allow.
+ */
+
+/* Requests in flight during a replay, unless -q says otherwise */
+#define BENCH_REPLAY_IODEPTH	256
+
+struct bench_thread;
+
+struct bench_req {
+	struct bench_thread	*thread;
+	struct bench_req	*next;
+	struct iovec		iov;
+	/* DISK_TRACE_*, and bytes it completes with when successful */
+	int			op;
+	size_t			len;
+	u64			start;
+};
+
+struct bench_thread {
+	pthread_t		thread;
+	struct mutex		lock;
+	pthread_cond_t		cond;
+	/* Completed requests, waiting to be reissued */
+	struct bench_req	*done;
+	struct bench_req	*reqs;
+	void			*bufs;
+	/* Blocks that sequential requests go through, and the next one */
+	u64			first_block;
+	u64			nr_blocks;
+	u64			next_block;
+	u64			seed;
+};
+
+static struct kvm bench_kvm;
+static struct disk_image *bench_disk;
+static struct disk_stats bench_stats;
+static u64 bench_errors;
+static bool bench_stop;
+
+static u64 bench_disk_blocks;
+static unsigned int block_size = 4096;
+static unsigned int iodepth;
+static unsigned int nr_threads = 1;
+static unsigned int read_pct = 100;
+static unsigned int runtime = 10;
+static bool random_io;
+static const char *replay_path;
+static bool full_speed;
+
+static const char * const bench_usage[] = {
+	"lkvm bench disk --disk <image> [options]",
+	NULL
+};
+
+static const struct option bench_options[] = {
+	OPT_GROUP("Disk options:"),
+	OPT_CALLBACK('d', "disk", &bench_kvm, "image",
+		     "Disk image, with the options of lkvm run --disk",
+		     disk_img_name_parser, &bench_kvm),
+	OPT_CALLBACK('\0', "disk-engine", NULL,
+		     "sync|aio|io_uring[,sqpoll][,fixedbufs]",
+		     "I/O engine used for raw disk images",
+		     disk_engine_parser, NULL),
+	OPT_GROUP("Workload options:"),
+	OPT_UINTEGER('b', "block-size", &block_size,
+		     "Bytes of each request, 4096 by default"),
+	OPT_UINTEGER('q', "iodepth", &iodepth,
+		     "Requests that each thread keeps in flight, 1 by default,"
+		     " 256 for a replay"),
+	OPT_UINTEGER('j', "threads", &nr_threads,
+		     "Threads issuing requests, 1 by default"),
+	OPT_UINTEGER('r', "read-pct", &read_pct,
+		     "Percentage of reads, the others write over the image,"
+		     " 100 by default"),
+	OPT_BOOLEAN('R', "random", &random_io,
+		    "Random offsets rather than sequential ones"),
+	OPT_UINTEGER('t', "time", &runtime,
+		     "Seconds to run for, 10 by default"),
+	OPT_GROUP("Replay options:"),
+	OPT_STRING('\0', "replay", &replay_path, "trace",
+		   "Issue the requests recorded by trace= instead"),
+	OPT_BOOLEAN('\0', "full-speed", &full_speed,
+		    "Don't wait for the times the requests were issued at"),
+	OPT_END()
+};
+
+void kvm_bench_help(void)
+{
+	usage_with_options(bench_usage, bench_options);
+}
+
+static void parse_bench_options(int argc, const char **argv)
+{
+	while (argc != 0) {
+		argc = parse_options(argc, argv, bench_options, bench_usage,
+				     PARSE_OPT_STOP_AT_NON_OPTION);
+		if (argc != 0)
+			kvm_bench_help();
+	}
+}
+
+static u64 bench_rand(struct bench_thread *t)
+{
+	t->seed ^= t->seed << 13;
+	t->seed ^= t->seed >> 7;
+	t->seed ^= t->seed << 17;
+
+	return t->seed;
+}
+
+static void bench_submit(struct bench_thread *t, struct bench_req *req)
+{
+	u64 block, sector;
+
+	if (random_io) {
+		block = bench_rand(t) % bench_disk_blocks;
+	} else {
+		block = t->next_block++;
+		if (t->next_block == t->first_block + t->nr_blocks)
+			t->next_block = t->first_block;
+	}
+	sector = block * (block_size >> SECTOR_SHIFT);
+
+	req->op = read_pct < 100 && bench_rand(t) % 100 >= read_pct ?
+		  DISK_TRACE_WRITE : DISK_TRACE_READ;
+	req->len = req->iov.iov_len = block_size;
+	req->start = disk_stats__now();
+
+	if (req->op == DISK_TRACE_WRITE)
+		disk_image__write(bench_disk, sector, &req->iov, 1, req);
+	else
+		disk_image__read(bench_disk, sector, &req->iov, 1, req);
+}
+
+/* From the engine's thread, or from bench_submit() for synchronous ones */
+static void bench_complete(void *param, long len)
+{
+	struct bench_req *req = param;
+	struct bench_thread *t = req->thread;
+
+	if (len != (long)req->len)
+		__sync_fetch_and_add(&bench_errors, 1);
+	else if (req->op < DISK_STATS_NR_OPS)
+		disk_stats__account(&bench_stats, req->op, len, req->start);
+
+	mutex_lock(&t->lock);
+	req->next = t->done;
+	t->done = req;
+	pthread_cond_signal(&t->cond);
+	mutex_unlock(&t->lock);
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct bench_req *req, *next;
+	unsigned int i, inflight = iodepth;
+
+	kvm__set_thread_name("kvm-bench");
+
+	for (i = 0; i < iodepth; i++)
+		bench_submit(t, &t->reqs[i]);
+
+	while (inflight) {
+		mutex_lock(&t->lock);
+		while (!t->done)
+			pthread_cond_wait(&t->cond, &t->lock.mutex);
+		req = t->done;
+		t->done = NULL;
+		mutex_unlock(&t->lock);
+
+		for (; req; req = next) {
+			next = req->next;
+			if (__atomic_load_n(&bench_stop, __ATOMIC_RELAXED))
+				inflight--;
+			else
+				bench_submit(t, req);
+		}
+	}
+
+	return NULL;
+}
+
+static void bench_thread_init(struct bench_thread *t, unsigned int index)
+{
+	unsigned int i;
+
+	mutex_init(&t->lock);
+	pthread_cond_init(&t->cond, NULL);
+
+	t->first_block = bench_disk_blocks * index / nr_threads;
+	t->nr_blocks = bench_disk_blocks * (index + 1) / nr_threads -
+		       t->first_block;
+	t->next_block = t->first_block;
+	t->seed = 0x9e3779b97f4a7c15ULL * (index + 1);
+
+	t->reqs = calloc(iodepth, sizeof(*t->reqs));
+	/* Page-aligned, as O_DIRECT images need */
+	t->bufs = mmap(NULL, (size_t)iodepth * block_size,
+		       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		       -1, 0);
+	if (!t->reqs || t->bufs == MAP_FAILED)
+		die("Unable to allocate %u requests of %u bytes", iodepth,
+		    block_size);
+	memset(t->bufs, 0xa5, (size_t)iodepth * block_size);
+
+	for (i = 0; i < iodepth; i++) {
+		t->reqs[i].thread = t;
+		t->reqs[i].iov.iov_base = t->bufs + (size_t)i * block_size;
+	}
+}
+
+static void bench_thread_exit(struct bench_thread *t)
+{
+	munmap(t->bufs, (size_t)iodepth * block_size);
+	free(t->reqs);
+	pthread_cond_destroy(&t->cond);
+}
+
+static void bench_report(const char *name, int op, u64 elapsed_ns)
+{
+	static const unsigned int pcts[] = { 50, 90, 99 };
+	struct disk_stats_hist hist = {};
+	struct disk_stats_hist *h;
+	unsigned int i, j;
+
+	for (i = 0; i < DISK_STATS_NR_SIZES; i++) {
+		h = &bench_stats.hist[op][i];
+		hist.count += h->count;
+		hist.total_ns += h->total_ns;
+		for (j = 0; j < DISK_STATS_NR_BUCKETS; j++)
+			hist.buckets[j] += h->buckets[j];
+	}
+
+	if (!hist.count)
+		return;
+
+	printf("%-6s %10.0f IOPS %10.1f MB/s  avg %8.1fus",
+	       name, hist.count * 1e9 / elapsed_ns,
+	       bench_stats.bytes[op] * 1e3 / elapsed_ns,
+	       hist.total_ns / 1e3 / hist.count);
+	for (i = 0; i < ARRAY_SIZE(pcts); i++)
+		printf("  p%u %8.1fus", pcts[i],
+		       disk_stats__percentile(&hist, pcts[i]) / 1e3);
+	printf("  max %8.1fus\n", disk_stats__percentile(&hist, 100) / 1e3);
+}
+
+static void bench_open_disk(void)
+{
+	int r;
+
+	if (bench_kvm.nr_disks != 1)
+		die("lkvm bench disk needs one --disk");
+
+	r = disk_image__init(&bench_kvm);
+	if (r < 0)
+		die("Unable to open %s: %s", bench_kvm.cfg.disk_image[0].filename,
+		    strerror(-r));
+
+	bench_disk = bench_kvm.disks[0];
+	if (bench_disk->wwpn || bench_disk->vhost_user)
+		die("Only disk images can be measured");
+
+	disk_image__set_callback(bench_disk, bench_complete);
+}
+
+static int do_bench_disk(void)
+{
+	struct bench_thread *threads;
+	u64 start, elapsed;
+	unsigned int i;
+
+	if (!block_size || block_size % SECTOR_SIZE)
+		die("The block size must be a multiple of %lu", SECTOR_SIZE);
+	if (!iodepth)
+		iodepth = 1;
+	if (!nr_threads || read_pct > 100)
+		kvm_bench_help();
+
+	bench_open_disk();
+	if (read_pct < 100 && bench_disk->readonly)
+		die("The image is read-only, it can't take writes");
+
+	bench_disk_blocks = bench_disk->size / block_size;
+	if (bench_disk_blocks < nr_threads)
+		die("The image has fewer blocks of %u bytes than threads",
+		    block_size);
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		die("Unable to allocate %u threads", nr_threads);
+	for (i = 0; i < nr_threads; i++)
+		bench_thread_init(&threads[i], i);
+
+	printf("%s: %u byte %s requests, %u%% reads, %u thread(s) x %u in flight, %us\n",
+	       bench_kvm.cfg.disk_image[0].filename, block_size,
+	       random_io ? "random" : "sequential", read_pct, nr_threads,
+	       iodepth, runtime);
+
+	start = disk_stats__now();
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i].thread, NULL, bench_thread,
+				   &threads[i]))
+			die_perror("pthread_create");
+	}
+
+	sleep(runtime);
+	__atomic_store_n(&bench_stop, true, __ATOMIC_RELAXED);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+	elapsed = disk_stats__now() - start;
+
+	bench_report("read", DISK_STATS_READ, elapsed);
+	bench_report("write", DISK_STATS_WRITE, elapsed);
+	if (bench_errors)
+		printf("%llu requests failed\n", (unsigned long long)bench_errors);
+
+	for (i = 0; i < nr_threads; i++)
+		bench_thread_exit(&threads[i]);
+	free(threads);
+
+	disk_image__exit(&bench_kvm);
+
+	return bench_errors ? -EIO : 0;
+}
+
+static int bench_record_cmp(const void *a, const void *b)
+{
+	const struct disk_trace_record *ra = a, *rb = b;
+
+	if (ra->issue != rb->issue)
+		return ra->issue < rb->issue ? -1 : 1;
+
+	return 0;
+}
+
+/* The records of a trace, sorted by the time they were issued at */
+static struct disk_trace_record *bench_load_trace(const char *path, u64 *nr)
+{
+	struct disk_trace_record *records;
+	struct disk_trace_header header;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		die_perror(path);
+
+	if (read_in_full(fd, &header, sizeof(header)) != sizeof(header) ||
+	    header.magic != DISK_TRACE_MAGIC)
+		die("%s isn't a disk trace", path);
+	if (header.version != DISK_TRACE_VERSION ||
+	    header.record_size != sizeof(*records))
+		die("%s is a trace of version %u, with records of %u bytes",
+		    path, header.version, header.record_size);
+
+	*nr = (st.st_size - sizeof(header)) / sizeof(*records);
+	records = malloc(*nr * sizeof(*records));
+	if (!records && *nr)
+		die("Unable to allocate %llu records", (unsigned long long)*nr);
+
+	if (read_in_full(fd, records, *nr * sizeof(*records)) !=
+	    (ssize_t)(*nr * sizeof(*records)))
+		die("Unable to read %s", path);
+	close(fd);
+
+	qsort(records, *nr, sizeof(*records), bench_record_cmp);
+
+	return records;
+}
+
+/* A request of the replay that completed, or wait for one */
+static struct bench_req *bench_replay_get(struct bench_thread *t,
+					  struct bench_req **free_reqs)
+{
+	struct bench_req *req;
+
+	if (!*free_reqs) {
+		mutex_lock(&t->lock);
+		while (!t->done)
+			pthread_cond_wait(&t->cond, &t->lock.mutex);
+		*free_reqs = t->done;
+		t->done = NULL;
+		mutex_unlock(&t->lock);
+	}
+
+	req = *free_reqs;
+	*free_reqs = req->next;
+
+	return req;
+}
+
+static void bench_replay_issue(struct bench_req *req,
+			       struct disk_trace_record *rec)
+{
+	int r;
+
+	req->op = rec->op;
+	req->len = req->iov.iov_len = rec->len;
+	req->start = disk_stats__now();
+
+	switch (rec->op) {
+	case DISK_TRACE_READ:
+		disk_image__read(bench_disk, rec->sector, &req->iov, 1, req);
+		break;
+	case DISK_TRACE_WRITE:
+		disk_image__write(bench_disk, rec->sector, &req->iov, 1, req);
+		break;
+	case DISK_TRACE_FLUSH:
+		disk_image__flush_async(bench_disk, req);
+		break;
+	case DISK_TRACE_DISCARD:
+	case DISK_TRACE_WRITE_ZEROES:
+		req->len = 0;
+		if (rec->op == DISK_TRACE_DISCARD)
+			r = disk_image__discard(bench_disk, rec->sector,
+						rec->len >> SECTOR_SHIFT);
+		else
+			r = disk_image__write_zeroes(bench_disk, rec->sector,
+						     rec->len >> SECTOR_SHIFT,
+						     false);
+		bench_complete(req, r);
+		break;
+	}
+}
+
+static int do_bench_replay(void)
+{
+	struct bench_req *req, *free_reqs = NULL;
+	struct disk_trace_record *records, *rec;
+	u64 nr, i, start, elapsed, now, at;
+	u64 skipped = 0, lag = 0, max_len = SECTOR_SIZE, span = 0;
+	unsigned int nr_free = 0;
+	struct bench_thread t = {};
+	bool writes = false;
+
+	if (!iodepth)
+		iodepth = BENCH_REPLAY_IODEPTH;
+
+	records = bench_load_trace(replay_path, &nr);
+	bench_open_disk();
+
+	/* Skip what the image can't take, and size the buffers for the rest */
+	for (i = 0; i < nr; i++) {
+		rec = &records[i];
+		if (rec->op >= DISK_TRACE_NR_OPS ||
+		    (rec->op != DISK_TRACE_FLUSH &&
+		     ((rec->sector << SECTOR_SHIFT) + rec->len > bench_disk->size ||
+		      rec->len % SECTOR_SIZE))) {
+			rec->op = DISK_TRACE_NR_OPS;
+			skipped++;
+			continue;
+		}
+		writes |= rec->op != DISK_TRACE_READ;
+		max_len = max_t(u64, max_len, rec->len);
+		span = max(span, rec->complete - records[0].issue);
+	}
+
+	if (writes && bench_disk->readonly)
+		die("The image is read-only, the trace has writes");
+
+	/* Page-aligned buffers, as O_DIRECT images need */
+	block_size = ALIGN(max_len, (u64)getpagesize());
+	nr_threads = 1;
+	bench_disk_blocks = 1;
+	bench_thread_init(&t, 0);
+	for (i = 0; i < iodepth; i++) {
+		t.reqs[i].next = free_reqs;
+		free_reqs = &t.reqs[i];
+	}
+
+	/* Flushes without an asynchronous engine go through the thread pool */
+	thread_pool__init(&bench_kvm);
+
+	printf("%s: replaying %llu requests of %s, %s, %u in flight at most\n",
+	       bench_kvm.cfg.disk_image[0].filename,
+	       (unsigned long long)(nr - skipped), replay_path,
+	       full_speed ? "at full speed" : "with their timing", iodepth);
+	if (skipped)
+		printf("%llu request(s) don't fit the image, skipped\n",
+		       (unsigned long long)skipped);
+
+	start = disk_stats__now();
+	for (i = 0; i < nr; i++) {
+		rec = &records[i];
+		if (rec->op == DISK_TRACE_NR_OPS)
+			continue;
+
+		at = start + rec->issue - records[0].issue;
+		now = disk_stats__now();
+		if (!full_speed && now < at)
+			usleep((at - now) / 1000);
+
+		req = bench_replay_get(&t, &free_reqs);
+
+		now = disk_stats__now();
+		if (!full_speed && now > at)
+			lag += now - at;
+
+		bench_replay_issue(req, rec);
+	}
+
+	/* Wait for the requests still in flight */
+	for (req = free_reqs; req; req = req->next)
+		nr_free++;
+	while (nr_free < iodepth) {
+		mutex_lock(&t.lock);
+		while (!t.done)
+			pthread_cond_wait(&t.cond, &t.lock.mutex);
+		req = t.done;
+		t.done = NULL;
+		mutex_unlock(&t.lock);
+
+		for (; req; req = req->next)
+			nr_free++;
+	}
+	elapsed = disk_stats__now() - start;
+
+	bench_report("read", DISK_STATS_READ, elapsed);
+	bench_report("write", DISK_STATS_WRITE, elapsed);
+	bench_report("flush", DISK_STATS_FLUSH, elapsed);
+	printf("%.2fs, the trace took %.2fs", elapsed / 1e9, span / 1e9);
+	if (!full_speed && nr > skipped)
+		printf(", requests issued %.1fus late on average",
+		       lag / 1e3 / (nr - skipped));
+	printf("\n");
+	if (bench_errors)
+		printf("%llu requests failed\n", (unsigned long long)bench_errors);
+
+	thread_pool__exit(&bench_kvm);
+	bench_thread_exit(&t);
+	free(records);
+
+	disk_image__exit(&bench_kvm);
+
+	return bench_errors ? -EIO : 0;
+}
+
+int kvm_cmd_bench(int argc, const char **argv, const char *prefix)
+{
+	if (argc < 1 || strcmp(argv[0], "disk"))
+		kvm_bench_help();
+
+	INIT_LIST_HEAD(&bench_kvm.mem_banks);
+	parse_bench_options(argc - 1, &argv[1]);
+
+	if (replay_path)
+		return do_bench_replay();
+
+	return do_bench_disk();
+}
@@ -0,0 +1,102 @@
+#include <kvm/util.h>
+#include <kvm/kvm-cmd.h>
+#include <kvm/builtin-cpu.h>
+#include <kvm/kvm.h>
+#include <kvm/kvm-cpu.h>
+#include <kvm/parse-options.h>
+#include <kvm/kvm-ipc.h>
+#include <kvm/read-write.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *instance_name;
+static int cpu = -1;
+
+static const char * const cpu_usage[] = {
+	"lkvm cpu add -n name [--cpu N]",
+	"lkvm cpu remove -n name [--cpu N]",
+	NULL
+};
+
+static const struct option cpu_options[] = {
+	OPT_GROUP("General options:"),
+	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
+	OPT_INTEGER('\0', "cpu", &cpu,
+		    "vCPU to add or remove, the first parked or the last running one by default"),
+	OPT_END()
+};
+
+static void parse_cpu_options(int argc, const char **argv)
+{
+	while (argc != 0) {
+		argc = parse_options(argc, argv, cpu_options, cpu_usage,
+				     PARSE_OPT_STOP_AT_NON_OPTION);
+		if (argc != 0)
+			kvm_cpu_help();
+	}
+}
+
+void kvm_cpu_help(void)
+{
+	usage_with_options(cpu_usage, cpu_options);
+}
+
+int kvm_cmd_cpu(int argc, const char **argv, const char *prefix)
+{
+	struct kvm_cpu_hotplug_reply reply;
+	struct kvm_cpu_hotplug_msg msg;
+	int instance;
+	int r;
+
+	if (argc < 1)
+		kvm_cpu_help();
+
+	if (!strcmp(argv[0], "add"))
+		msg.op = KVM_CPU_HOTPLUG_ADD;
+	else if (!strcmp(argv[0], "remove"))
+		msg.op = KVM_CPU_HOTPLUG_REMOVE;
+	else
+		kvm_cpu_help();
+
+	parse_cpu_options(argc - 1, argv + 1);
+
+	if (instance_name == NULL)
+		kvm_cpu_help();
+
+	msg.cpu = cpu;
+
+	instance = kvm__get_sock_by_instance(instance_name);
+
+	if (instance <= 0)
+		die("Failed locating instance");
+
+	r = kvm_ipc__send_msg(instance, KVM_IPC_CPU_HOTPLUG, sizeof(msg),
+			      (u8 *)&msg);
+	if (r < 0)
+		goto out;
+
+	if (read_in_full(instance, &reply, sizeof(reply)) != sizeof(reply)) {
+		pr_err("Could not retrieve the vCPUs of %s", instance_name);
+		r = -1;
+		goto out;
+	}
+
+	r = reply.status;
+	if (r == -EBUSY && msg.op == KVM_CPU_HOTPLUG_REMOVE && reply.cpu)
+		pr_err("The guest didn't give vCPU %d up, is it offline?",
+		       reply.cpu);
+	else if (r < 0)
+		pr_err("Unable to %s a vCPU of %s: %s", argv[0], instance_name,
+		       strerror(-r));
+	else
+		printf("vCPU %d %s, %u of %u online\n", reply.cpu,
+		       msg.op == KVM_CPU_HOTPLUG_ADD ? "added" : "removed",
+		       reply.nr_online, reply.nr_possible);
+
+out:
+	close(instance);
+
+	return r;
+}
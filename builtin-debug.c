@@ -2,13 +2,18 @@
 #include <kvm/kvm-cmd.h>
 #include <kvm/builtin-debug.h>
 #include <kvm/kvm.h>
+#include <kvm/kvm-cpu.h>
 #include <kvm/parse-options.h>
 #include <kvm/kvm-ipc.h>
 #include <kvm/read-write.h>
+#include <kvm/virtio-net.h>
 
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <unistd.h>
 
 #define BUFFER_SIZE 100
 
@@ -17,9 +22,14 @@ static int nmi = -1;
 static bool dump;
 static const char *instance_name;
 static const char *sysrq;
+static const char *capture_path;
+static int capture_size = 16;
+static int capture_dev;
+static bool capture_stop;
+static const char *regs_path;
 
 static const char * const debug_usage[] = {
-	"lkvm debug [--all] [-n name] [-d] [-m vcpu]",
+	"lkvm debug [--all] [-n name] [-d] [-m vcpu] [--regs file] [--net-capture file]",
 	NULL
 };
 
@@ -28,6 +38,17 @@ static const struct option debug_options[] = {
 	OPT_BOOLEAN('d', "dump", &dump, "Generate a debug dump from guest"),
 	OPT_INTEGER('m', "nmi", &nmi, "Generate NMI on VCPU"),
 	OPT_STRING('s', "sysrq", &sysrq, "sysrq", "Inject a sysrq"),
+	OPT_STRING('\0', "regs", &regs_path, "file",
+		   "Save the registers of all vCPUs, in binary, '-' for stdout"),
+	OPT_GROUP("Network capture options:"),
+	OPT_STRING('\0', "net-capture", &capture_path, "file",
+		   "Capture the frames of a network device into a pcapng file"),
+	OPT_INTEGER('\0', "net-capture-size", &capture_size,
+		    "Size of the capture file in MB, older frames are overwritten"),
+	OPT_INTEGER('\0', "net-capture-dev", &capture_dev,
+		    "Network device to capture, in the order they were given"),
+	OPT_BOOLEAN('\0', "net-capture-stop", &capture_stop,
+		    "Stop capturing"),
 	OPT_GROUP("Instance options:"),
 	OPT_BOOLEAN('a', "all", &all, "Debug all instances"),
 	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
@@ -49,12 +70,112 @@ void kvm_debug_help(void)
 	usage_with_options(debug_usage, debug_options);
 }
 
+static int do_net_capture(const char *name, int sock)
+{
+	struct net_capture_msg msg = {
+		.dev	= capture_dev,
+	};
+	char cwd[PATH_MAX];
+	s32 status;
+	int r;
+
+	if (!capture_stop) {
+		if (capture_size <= 0)
+			die("Invalid capture size %d", capture_size);
+		msg.size_mb = capture_size;
+
+		/* The guest doesn't necessarily run from this directory */
+		if (capture_path[0] == '/')
+			r = snprintf(msg.path, sizeof(msg.path), "%s", capture_path);
+		else if (getcwd(cwd, sizeof(cwd)))
+			r = snprintf(msg.path, sizeof(msg.path), "%s/%s", cwd,
+				     capture_path);
+		else
+			die_perror("getcwd");
+		if (r >= (int)sizeof(msg.path))
+			die("Capture file path too long");
+	}
+
+	r = kvm_ipc__send_msg(sock, KVM_IPC_NET_CAPTURE, sizeof(msg), (u8 *)&msg);
+	if (r < 0)
+		return r;
+
+	if (read_in_full(sock, &status, sizeof(status)) != sizeof(status)) {
+		pr_err("Could not retrieve the capture status from %s", name);
+		return -1;
+	}
+
+	if (status < 0) {
+		pr_err("Unable to %s capturing on %s: %s",
+		       capture_stop ? "stop" : "start", name, strerror(-status));
+		return status;
+	}
+
+	return 0;
+}
+
+/* The reply is saved as it is, walking its records for their length */
+static int do_regs(const char *name, int sock)
+{
+	struct kvm_cpu_regs_head head;
+	struct kvm_cpu_regs_record rec;
+	u8 buf[KVM_CPU_REGS_MAX];
+	int fd = STDOUT_FILENO;
+	u32 i;
+	int r;
+
+	if (strcmp(regs_path, "-")) {
+		fd = open(regs_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			die_perror(regs_path);
+	}
+
+	r = kvm_ipc__send(sock, KVM_IPC_VCPU_REGS);
+	if (r < 0)
+		goto out;
+
+	r = -1;
+	if (read_in_full(sock, &head, sizeof(head)) != sizeof(head) ||
+	    write_in_full(fd, &head, sizeof(head)) < 0)
+		goto err;
+
+	for (i = 0; i < head.nr; i++) {
+		if (read_in_full(sock, &rec, sizeof(rec)) != sizeof(rec) ||
+		    rec.len > sizeof(buf) ||
+		    read_in_full(sock, buf, rec.len) != (ssize_t)rec.len ||
+		    write_in_full(fd, &rec, sizeof(rec)) < 0 ||
+		    write_in_full(fd, buf, rec.len) < 0)
+			goto err;
+	}
+
+	r = 0;
+	goto out;
+err:
+	pr_err("Could not save the vCPU registers of %s", name);
+out:
+	if (fd != STDOUT_FILENO)
+		close(fd);
+	return r;
+}
+
 static int do_debug(const char *name, int sock)
 {
 	char buff[BUFFER_SIZE];
 	struct debug_cmd_params cmd = {.dbg_type = 0};
 	int r;
 
+	if (capture_path || capture_stop) {
+		r = do_net_capture(name, sock);
+		if (r < 0 || (!regs_path && !dump && nmi == -1 && !sysrq))
+			return r;
+	}
+
+	if (regs_path) {
+		r = do_regs(name, sock);
+		if (r < 0 || (!dump && nmi == -1 && !sysrq))
+			return r;
+	}
+
 	if (dump)
 		cmd.dbg_type |= KVM_DEBUG_CMD_TYPE_DUMP;
 
@@ -0,0 +1,137 @@
+#include <kvm/util.h>
+#include <kvm/kvm-cmd.h>
+#include <kvm/builtin-dump.h>
+#include <kvm/kvm.h>
+#include <kvm/parse-options.h>
+#include <kvm/kvm-ipc.h>
+#include <kvm/dump.h>
+#include <kvm/read-write.h>
+
+#include <linux/sizes.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *instance_name;
+static const char *core_path;
+static unsigned int threads = DUMP_DEFAULT_THREADS;
+static bool live;
+static bool compress;
+
+static const char * const dump_usage[] = {
+	"lkvm dump -n name --core file [--live | --compress] [-j threads]",
+	NULL
+};
+
+static const struct option dump_options[] = {
+	OPT_GROUP("General options:"),
+	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
+	OPT_STRING('\0', "core", &core_path, "file",
+		   "Write an ELF core of guest RAM and of the vCPU registers"),
+	OPT_BOOLEAN('\0', "live", &live,
+		    "Copy RAM while the guest runs, then what it dirtied"),
+	OPT_BOOLEAN('z', "compress", &compress,
+		    "Write the core as a gzip stream"),
+	OPT_UINTEGER('j', "threads", &threads,
+		     "Threads writing or compressing the core"),
+	OPT_END()
+};
+
+static void parse_dump_options(int argc, const char **argv)
+{
+	while (argc != 0) {
+		argc = parse_options(argc, argv, dump_options, dump_usage,
+				     PARSE_OPT_STOP_AT_NON_OPTION);
+		if (argc != 0)
+			kvm_dump_help();
+	}
+}
+
+void kvm_dump_help(void)
+{
+	usage_with_options(dump_usage, dump_options);
+}
+
+int kvm_cmd_dump(int argc, const char **argv, const char *prefix)
+{
+	struct dump_params params = {};
+	struct dump_stats stats;
+	char cwd[PATH_MAX];
+	int instance;
+	s32 status;
+	int r;
+
+	parse_dump_options(argc, argv);
+
+	if (instance_name == NULL || core_path == NULL)
+		kvm_dump_help();
+
+	if (live && compress)
+		die("--live can't go back over a compressed core");
+	if (!threads || threads > DUMP_MAX_THREADS)
+		die("--threads must be between 1 and %d", DUMP_MAX_THREADS);
+
+	/* The guest doesn't necessarily run from this directory */
+	if (core_path[0] == '/')
+		r = snprintf(params.path, sizeof(params.path), "%s", core_path);
+	else if (getcwd(cwd, sizeof(cwd)))
+		r = snprintf(params.path, sizeof(params.path), "%s/%s", cwd,
+			     core_path);
+	else
+		die_perror("getcwd");
+	if (r >= (int)sizeof(params.path))
+		die("Core file path too long");
+
+	params.threads = threads;
+	if (live)
+		params.flags |= DUMP_F_LIVE;
+	if (compress)
+		params.flags |= DUMP_F_COMPRESS;
+
+	instance = kvm__get_sock_by_instance(instance_name);
+
+	if (instance <= 0)
+		die("Failed locating instance");
+
+	r = kvm_ipc__send_msg(instance, KVM_IPC_DUMP, sizeof(params),
+			      (u8 *)&params);
+	if (r < 0)
+		goto out;
+
+	if (read_in_full(instance, &status, sizeof(status)) != sizeof(status)) {
+		pr_err("Could not retrieve the dump status of %s", instance_name);
+		r = -1;
+		goto out;
+	}
+
+	r = status;
+	if (r < 0) {
+		pr_err("Unable to dump %s: %s", instance_name, strerror(-r));
+		goto out;
+	}
+
+	if (read_in_full(instance, &stats, sizeof(stats)) != sizeof(stats)) {
+		pr_err("Could not retrieve the dump statistics of %s",
+		       instance_name);
+		r = -1;
+		goto out;
+	}
+
+	printf("%s: %llu MB of RAM, %llu MB of zero pages, %llu MB written",
+	       params.path, (unsigned long long)stats.ram_bytes / SZ_1M,
+	       (unsigned long long)stats.zero_bytes / SZ_1M,
+	       (unsigned long long)stats.written_bytes / SZ_1M);
+	if (live)
+		printf(" (%llu MB again, %u rounds)",
+		       (unsigned long long)stats.rewritten_bytes / SZ_1M,
+		       stats.rounds);
+	printf(" in %.3f s, guest paused for %.3f ms\n",
+	       stats.total_ns / 1e9, stats.pause_ns / 1e6);
+
+out:
+	close(instance);
+
+	return r;
+}
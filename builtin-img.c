@@ -0,0 +1,596 @@
+#include <kvm/util.h>
+#include <kvm/kvm-cmd.h>
+#include <kvm/builtin-img.h>
+#include <kvm/kvm.h>
+#include <kvm/parse-options.h>
+#include <kvm/disk-image.h>
+#include <kvm/disk-stats.h>
+#include <kvm/mutex.h>
+#include <kvm/qcow.h>
+#include <kvm/read-write.h>
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Creates, converts and describes disk images offline, with the same format
+ * code that serves them to guests. Conversion is a pipeline: threads read
+ * chunks of the source, find the clusters that are all zeroes and compress
+ * the others, while the calling thread writes the chunks out in order, so
+ * that the clusters of the new image are laid out sequentially.
+ */
+
+/* Chunks that a thread reads and compresses at a time */
+#define IMG_CHUNK_SIZE		(1UL << 20)
+/* Granularity of the zero detection of raw images */
+#define IMG_RAW_UNIT		4096UL
+
+enum {
+	IMG_FORMAT_RAW,
+	IMG_FORMAT_QCOW2,
+};
+
+struct img_chunk {
+	/* Chunk number, once ready */
+	u64			index;
+	bool			ready;
+	void			*buf;
+	/* Compressed units, a unit apart */
+	void			*cbuf;
+	/*
+	 * Length of each unit in cbuf: 0 if it's all zeroes, the unit size if
+	 * it goes as it is in buf.
+	 */
+	u32			*clen;
+};
+
+struct img_convert {
+	struct disk_image	*src;
+	struct disk_image	*dst;
+	u64			size;
+	u64			unit_size;
+	u64			chunk_size;
+	u64			nr_chunks;
+	bool			compress;
+
+	struct mutex		lock;
+	pthread_cond_t		cond;
+	u64			next_read;
+	u64			next_write;
+	int			error;
+	struct img_chunk	*slots;
+	unsigned int		nr_slots;
+
+	u64			zero_units;
+	u64			compressed_units;
+	u64			compressed_bytes;
+};
+
+static struct kvm img_src_kvm;
+static struct kvm img_dst_kvm;
+
+static const char *format = "qcow2";
+static const char *cluster_size_str;
+static const char *compression_type = "zlib";
+static const char *backing;
+static bool extended_l2;
+static bool compress;
+static unsigned int nr_threads;
+
+static const char * const img_usage[] = {
+	"lkvm img create [options] <image> <size>",
+	"lkvm img convert [options] <source> <image>",
+	"lkvm img info <image>",
+	NULL
+};
+
+static const struct option img_options[] = {
+	OPT_GROUP("Image options:"),
+	OPT_STRING('f', "format", &format, "raw|qcow2",
+		   "Format of the image written, qcow2 by default"),
+	OPT_STRING('\0', "cluster-size", &cluster_size_str, "bytes",
+		   "Cluster size of qcow2 images, 64K by default"),
+	OPT_BOOLEAN('\0', "extended-l2", &extended_l2,
+		    "Extended L2 entries, with subclusters"),
+	OPT_STRING('\0', "compression-type", &compression_type, "zlib|zstd",
+		   "Compression of qcow2 images, zlib by default"),
+	OPT_STRING('b', "backing", &backing, "image",
+		   "Backing file of the qcow2 image created"),
+	OPT_GROUP("Convert options:"),
+	OPT_BOOLEAN('c', "compress", &compress,
+		    "Compress the clusters of the qcow2 image"),
+	OPT_UINTEGER('j', "threads", &nr_threads,
+		     "Threads reading and compressing, one per CPU by default"),
+	OPT_END()
+};
+
+void kvm_img_help(void)
+{
+	usage_with_options(img_usage, img_options);
+}
+
+/* Options anywhere on the command line, up to nr other arguments */
+static int parse_img_options(int argc, const char **argv, const char **args,
+			     int nr)
+{
+	int n = 0;
+
+	while (argc != 0) {
+		argc = parse_options(argc, argv, img_options, img_usage,
+				     PARSE_OPT_STOP_AT_NON_OPTION);
+		if (argc == 0)
+			break;
+		if (n == nr)
+			kvm_img_help();
+		args[n++] = argv[0];
+		argc--;
+		argv++;
+	}
+
+	return n;
+}
+
+static int img_format(void)
+{
+	if (!strcmp(format, "raw"))
+		return IMG_FORMAT_RAW;
+	if (!strcmp(format, "qcow2"))
+		return IMG_FORMAT_QCOW2;
+
+	die("Unknown image format \"%s\"", format);
+}
+
+static int img_compression_type(void)
+{
+	if (!strcmp(compression_type, "zlib"))
+		return QCOW2_COMPRESSION_ZLIB;
+	if (!strcmp(compression_type, "zstd"))
+		return QCOW2_COMPRESSION_ZSTD;
+
+	die("Unknown compression type \"%s\"", compression_type);
+}
+
+static u32 img_cluster_bits(void)
+{
+	u64 size = 1 << 16;
+
+	if (cluster_size_str)
+		size = disk_size_parser(cluster_size_str);
+	if (!is_power_of_two(size))
+		die("The cluster size must be a power of two");
+
+	return __builtin_ctzll(size);
+}
+
+static void img_create(const char *filename, u64 size, int fmt)
+{
+	int fd, r;
+
+	if (fmt == IMG_FORMAT_RAW && (backing || extended_l2 || compress ||
+				      cluster_size_str))
+		die("Raw images have no clusters, compression or backing file");
+
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die_perror(filename);
+
+	if (fmt == IMG_FORMAT_RAW) {
+		r = ftruncate(fd, size) < 0 ? -errno : 0;
+	} else {
+		r = qcow_create(fd, size, img_cluster_bits(), extended_l2,
+				img_compression_type(), backing);
+	}
+
+	if (r < 0)
+		die("Unable to create %s: %s", filename, strerror(-r));
+
+	if (close(fd) < 0)
+		die_perror("close");
+}
+
+static struct disk_image *img_open(struct kvm *kvm, const char *filename,
+				   bool readonly)
+{
+	int r;
+
+	INIT_LIST_HEAD(&kvm->mem_banks);
+	kvm->cfg.disk_image = calloc(1, sizeof(*kvm->cfg.disk_image));
+	if (!kvm->cfg.disk_image)
+		die("Out of memory");
+
+	kvm->cfg.disk_image[0] = (struct disk_image_params) {
+		.filename	= filename,
+		.readonly	= readonly,
+		.iothread	= -1,
+	};
+	kvm->nr_disks = 1;
+
+	r = disk_image__init(kvm);
+	if (r < 0)
+		die("Unable to open %s: %s", filename, strerror(-r));
+
+	return kvm->disks[0];
+}
+
+static bool img_is_zero(const void *buf, size_t len)
+{
+	const u64 *p = buf;
+
+	/* The first word weeds out nearly all data */
+	if (*p)
+		return false;
+
+	return !memcmp(buf, buf + sizeof(*p), len - sizeof(*p));
+}
+
+static int img_fill_chunk(struct img_convert *c, struct img_chunk *chunk,
+			  u64 index)
+{
+	u64 offset = index * c->chunk_size;
+	u64 len = min_t(u64, c->chunk_size, c->size - offset);
+	u64 nr_units = DIV_ROUND_UP(len, c->unit_size);
+	struct iovec iov = {
+		.iov_base	= chunk->buf,
+		.iov_len	= len,
+	};
+	ssize_t r;
+	void *unit;
+	u64 i;
+
+	r = disk_image__read(c->src, offset >> SECTOR_SHIFT, &iov, 1, NULL);
+	if (r != (ssize_t)len)
+		return r < 0 ? r : -EIO;
+
+	/* A partial last cluster is compressed whole */
+	memset(chunk->buf + len, 0, nr_units * c->unit_size - len);
+
+	for (i = 0; i < nr_units; i++) {
+		unit = chunk->buf + i * c->unit_size;
+
+		if (img_is_zero(unit, c->unit_size)) {
+			chunk->clen[i] = 0;
+			continue;
+		}
+
+		chunk->clen[i] = c->unit_size;
+		if (!c->compress)
+			continue;
+
+		r = qcow_compress_cluster(c->dst, unit,
+					  chunk->cbuf + i * c->unit_size);
+		if (r >= 0)
+			chunk->clen[i] = r;
+		else if (r != -ENOSPC)
+			return r;
+	}
+
+	return 0;
+}
+
+static void *img_worker(void *arg)
+{
+	struct img_convert *c = arg;
+	struct img_chunk *chunk;
+	u64 index;
+	int r;
+
+	kvm__set_thread_name("kvm-img");
+
+	for (;;) {
+		mutex_lock(&c->lock);
+		/* Wait for the writer to be done with the slot */
+		while (!c->error && c->next_read < c->nr_chunks &&
+		       c->next_read >= c->next_write + c->nr_slots)
+			pthread_cond_wait(&c->cond, &c->lock.mutex);
+		if (c->error || c->next_read == c->nr_chunks) {
+			mutex_unlock(&c->lock);
+			break;
+		}
+		index = c->next_read++;
+		mutex_unlock(&c->lock);
+
+		chunk = &c->slots[index % c->nr_slots];
+		r = img_fill_chunk(c, chunk, index);
+
+		mutex_lock(&c->lock);
+		chunk->index = index;
+		chunk->ready = true;
+		if (r < 0)
+			c->error = r;
+		pthread_cond_broadcast(&c->cond);
+		mutex_unlock(&c->lock);
+	}
+
+	return NULL;
+}
+
+static int img_write_data(struct img_convert *c, void *buf, u64 offset,
+			  u64 len)
+{
+	struct iovec iov = {
+		.iov_base	= buf,
+		.iov_len	= min_t(u64, len, c->size - offset),
+	};
+	ssize_t r;
+
+	r = disk_image__write(c->dst, offset >> SECTOR_SHIFT, &iov, 1, NULL);
+	if (r != (ssize_t)iov.iov_len)
+		return r < 0 ? r : -EIO;
+
+	return 0;
+}
+
+/* Zero units are skipped, the new image reads as zeroes there */
+static int img_write_chunk(struct img_convert *c, struct img_chunk *chunk)
+{
+	u64 offset = chunk->index * c->chunk_size;
+	u64 len = min_t(u64, c->chunk_size, c->size - offset);
+	u64 nr_units = DIV_ROUND_UP(len, c->unit_size);
+	u64 i, j;
+	int r;
+
+	for (i = 0; i < nr_units; i = j) {
+		j = i + 1;
+
+		if (!chunk->clen[i]) {
+			c->zero_units++;
+			continue;
+		}
+
+		if (chunk->clen[i] < c->unit_size) {
+			r = qcow_write_compressed(c->dst,
+						  offset + i * c->unit_size,
+						  chunk->cbuf + i * c->unit_size,
+						  chunk->clen[i]);
+			if (r < 0)
+				return r;
+			c->compressed_units++;
+			c->compressed_bytes += chunk->clen[i];
+			continue;
+		}
+
+		/* Runs of data units in a single write */
+		while (j < nr_units && chunk->clen[j] == c->unit_size)
+			j++;
+
+		r = img_write_data(c, chunk->buf + i * c->unit_size,
+				   offset + i * c->unit_size,
+				   (j - i) * c->unit_size);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static int img_convert_run(struct img_convert *c)
+{
+	struct img_chunk *chunk;
+	pthread_t *threads;
+	u64 nr_units, index;
+	unsigned int i;
+	int r = 0;
+
+	nr_units = c->chunk_size / c->unit_size;
+	c->nr_chunks = DIV_ROUND_UP(c->size, c->chunk_size);
+	c->nr_slots = 2 * nr_threads;
+	c->slots = calloc(c->nr_slots, sizeof(*c->slots));
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!c->slots || !threads)
+		die("Out of memory");
+
+	for (i = 0; i < c->nr_slots; i++) {
+		chunk = &c->slots[i];
+		chunk->buf = malloc(c->chunk_size);
+		chunk->cbuf = c->compress ? malloc(c->chunk_size) : NULL;
+		chunk->clen = calloc(nr_units, sizeof(*chunk->clen));
+		if (!chunk->buf || (c->compress && !chunk->cbuf) || !chunk->clen)
+			die("Out of memory");
+	}
+
+	mutex_init(&c->lock);
+	pthread_cond_init(&c->cond, NULL);
+
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, img_worker, c))
+			die_perror("pthread_create");
+	}
+
+	for (index = 0; index < c->nr_chunks; index++) {
+		chunk = &c->slots[index % c->nr_slots];
+
+		mutex_lock(&c->lock);
+		while (!c->error && !(chunk->ready && chunk->index == index))
+			pthread_cond_wait(&c->cond, &c->lock.mutex);
+		r = c->error;
+		mutex_unlock(&c->lock);
+		if (r < 0)
+			break;
+
+		r = img_write_chunk(c, chunk);
+
+		mutex_lock(&c->lock);
+		chunk->ready = false;
+		c->next_write++;
+		if (r < 0)
+			c->error = r;
+		pthread_cond_broadcast(&c->cond);
+		mutex_unlock(&c->lock);
+		if (r < 0)
+			break;
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < c->nr_slots; i++) {
+		free(c->slots[i].buf);
+		free(c->slots[i].cbuf);
+		free(c->slots[i].clen);
+	}
+	free(c->slots);
+	free(threads);
+	pthread_cond_destroy(&c->cond);
+
+	return r;
+}
+
+static int do_img_create(int argc, const char **argv)
+{
+	const char *args[2];
+	u64 size;
+
+	if (parse_img_options(argc, argv, args, 2) != 2)
+		kvm_img_help();
+
+	size = disk_size_parser(args[1]);
+	if (!size || size % SECTOR_SIZE)
+		die("The size must be a non-zero multiple of %lu", SECTOR_SIZE);
+
+	img_create(args[0], size, img_format());
+
+	return 0;
+}
+
+static int do_img_convert(int argc, const char **argv)
+{
+	struct img_convert c = {};
+	const char *args[2];
+	u64 start, elapsed;
+	int fmt, r;
+
+	if (parse_img_options(argc, argv, args, 2) != 2)
+		kvm_img_help();
+
+	fmt = img_format();
+	if (backing)
+		die("Converted images have no backing file");
+	if (compress && fmt != IMG_FORMAT_QCOW2)
+		die("Only qcow2 images can be compressed");
+	if (!nr_threads)
+		nr_threads = max_t(long, sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+	c.src = img_open(&img_src_kvm, args[0], true);
+	if (c.src->wwpn || c.src->vhost_user)
+		die("Only disk images can be converted");
+	c.size = c.src->size;
+	if (c.size % SECTOR_SIZE)
+		die("%s isn't a multiple of %lu bytes", args[0], SECTOR_SIZE);
+
+	img_create(args[1], c.size, fmt);
+	c.dst = img_open(&img_dst_kvm, args[1], false);
+
+	c.compress = compress;
+	c.unit_size = IMG_RAW_UNIT;
+	if (fmt == IMG_FORMAT_QCOW2)
+		c.unit_size = qcow_image(c.dst)->cluster_size;
+	c.chunk_size = max_t(u64, IMG_CHUNK_SIZE, c.unit_size);
+
+	start = disk_stats__now();
+	r = img_convert_run(&c);
+	if (r == 0)
+		r = disk_image__flush(c.dst);
+	elapsed = disk_stats__now() - start;
+
+	disk_image__exit(&img_dst_kvm);
+	disk_image__exit(&img_src_kvm);
+
+	if (r < 0)
+		die("Converting %s failed: %s", args[0], strerror(-r));
+
+	printf("%s: %llu MB in %.1fs, %llu of %llu bytes zero",
+	       args[1], (unsigned long long)(c.size >> 20), elapsed / 1e9,
+	       (unsigned long long)(c.zero_units * c.unit_size),
+	       (unsigned long long)c.size);
+	if (c.compress)
+		printf(", %llu clusters compressed to %llu bytes",
+		       (unsigned long long)c.compressed_units,
+		       (unsigned long long)c.compressed_bytes);
+	printf("\n");
+
+	return 0;
+}
+
+static void img_info_qcow(struct qcow *q)
+{
+	struct qcow_header *h = q->header;
+	char name[PATH_MAX];
+	size_t len;
+
+	printf("format: qcow%s, version %u\n",
+	       q->version == QCOW1_VERSION ? "" : "2", q->version);
+	printf("cluster size: %llu\n", (unsigned long long)q->cluster_size);
+
+	if (q->version == QCOW1_VERSION)
+		return;
+
+	printf("compression type: %s\n",
+	       h->compression_type == QCOW2_COMPRESSION_ZSTD ? "zstd" : "zlib");
+	printf("extended l2: %s\n", q->extended_l2 ? "yes" : "no");
+	printf("dirty: %s\n", h->incompatible_features & QCOW2_INCOMPAT_DIRTY ?
+	       "yes" : "no");
+
+	if (!h->backing_file_offset)
+		return;
+
+	len = min_t(size_t, h->backing_file_size, sizeof(name) - 1);
+	if (pread_in_full(q->fd, name, len, h->backing_file_offset) < 0)
+		return;
+	name[len] = '\0';
+	printf("backing file: %s\n", name);
+}
+
+static int do_img_info(int argc, const char **argv)
+{
+	struct disk_image *disk;
+	const char *args[1];
+	struct stat st;
+	struct qcow *q;
+
+	if (parse_img_options(argc, argv, args, 1) != 1)
+		kvm_img_help();
+
+	disk = img_open(&img_src_kvm, args[0], true);
+	if (disk->wwpn || disk->vhost_user)
+		die("%s isn't a disk image", args[0]);
+
+	q = qcow_image(disk);
+
+	printf("image: %s\n", args[0]);
+	if (!q)
+		printf("format: raw\n");
+	printf("virtual size: %llu (%llu MB)\n", (unsigned long long)disk->size,
+	       (unsigned long long)(disk->size >> 20));
+	if (stat(args[0], &st) == 0 && S_ISREG(st.st_mode))
+		printf("disk size: %llu\n", (unsigned long long)st.st_blocks * 512);
+
+	if (q)
+		img_info_qcow(q);
+
+	disk_image__exit(&img_src_kvm);
+
+	return 0;
+}
+
+int kvm_cmd_img(int argc, const char **argv, const char *prefix)
+{
+	if (argc < 1)
+		kvm_img_help();
+
+	if (!strcmp(argv[0], "create"))
+		return do_img_create(argc - 1, &argv[1]);
+	if (!strcmp(argv[0], "convert"))
+		return do_img_convert(argc - 1, &argv[1]);
+	if (!strcmp(argv[0], "info"))
+		return do_img_info(argc - 1, &argv[1]);
+
+	kvm_img_help();
+}
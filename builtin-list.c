@@ -4,12 +4,14 @@
 #include <kvm/kvm.h>
 #include <kvm/parse-options.h>
 #include <kvm/kvm-ipc.h>
+#include <kvm/status.h>
 
 #include <dirent.h>
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <errno.h>
 
 static bool run;
 static bool rootfs;
@@ -70,11 +72,19 @@ int get_vmstate(int sock)
 
 static int print_guest(const char *name, int sock)
 {
+	struct kvm_status_page status;
 	pid_t pid;
 	int vmstate;
 
-	pid = get_pid(sock);
-	vmstate = get_vmstate(sock);
+	/* The status page saves the instance two round trips */
+	if (!kvm_status__read(name, &status) &&
+	    (!kill(status.pid, 0) || errno == EPERM)) {
+		pid = status.pid;
+		vmstate = status.state;
+	} else {
+		pid = get_pid(sock);
+		vmstate = get_vmstate(sock);
+	}
 
 	if ((int)pid < 0 || vmstate < 0)
 		return -1;
@@ -0,0 +1,100 @@
+#include <kvm/util.h>
+#include <kvm/kvm-cmd.h>
+#include <kvm/builtin-memory.h>
+#include <kvm/kvm.h>
+#include <kvm/parse-options.h>
+#include <kvm/kvm-ipc.h>
+#include <kvm/read-write.h>
+#include <kvm/virtio-mem.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *instance_name;
+static u64 size_mb;
+static bool size_set;
+
+static int size_parser(const struct option *opt, const char *arg, int unset)
+{
+	char *end;
+
+	size_mb = strtoull(arg, &end, 10);
+	if (*end)
+		die("Invalid size: %s", arg);
+	size_set = true;
+
+	return 0;
+}
+
+static const char * const memory_usage[] = {
+	"lkvm memory [-n name] --size <MB>",
+	NULL
+};
+
+static const struct option memory_options[] = {
+	OPT_GROUP("Instance options:"),
+	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
+	OPT_GROUP("Memory options:"),
+	OPT_CALLBACK('s', "size", NULL, "MB",
+		     "Memory that the guest should have plugged with virtio-mem",
+		     size_parser, NULL),
+	OPT_END()
+};
+
+void kvm_memory_help(void)
+{
+	usage_with_options(memory_usage, memory_options);
+}
+
+static void parse_memory_options(int argc, const char **argv)
+{
+	while (argc != 0) {
+		argc = parse_options(argc, argv, memory_options, memory_usage,
+				     PARSE_OPT_STOP_AT_NON_OPTION);
+		if (argc != 0)
+			kvm_memory_help();
+	}
+}
+
+int kvm_cmd_memory(int argc, const char **argv, const char *prefix)
+{
+	struct virtio_mem_resize resize;
+	s32 status;
+	int instance;
+	int r;
+
+	parse_memory_options(argc, argv);
+
+	if (instance_name == NULL || !size_set)
+		kvm_memory_help();
+
+	instance = kvm__get_sock_by_instance(instance_name);
+
+	if (instance <= 0)
+		die("Failed locating instance");
+
+	resize.requested_mb = size_mb;
+	r = kvm_ipc__send_msg(instance, KVM_IPC_VIRTIO_MEM, sizeof(resize),
+			      (u8 *)&resize);
+	if (r < 0)
+		goto out;
+
+	if (read_in_full(instance, &status, sizeof(status)) != sizeof(status)) {
+		pr_err("Could not retrieve the virtio-mem status from %s",
+		       instance_name);
+		r = -1;
+		goto out;
+	}
+
+	r = status;
+	if (r < 0)
+		pr_err("Unable to resize the memory of %s: %s", instance_name,
+		       strerror(-r));
+
+out:
+	close(instance);
+
+	return r;
+}
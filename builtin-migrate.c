@@ -0,0 +1,123 @@
+#include <kvm/util.h>
+#include <kvm/kvm-cmd.h>
+#include <kvm/builtin-migrate.h>
+#include <kvm/kvm.h>
+#include <kvm/parse-options.h>
+#include <kvm/kvm-ipc.h>
+#include <kvm/migrate.h>
+#include <kvm/read-write.h>
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *instance_name;
+static const char *migrate_dest;
+static unsigned int channels = MIGRATE_DEFAULT_CHANNELS;
+static unsigned int downtime_ms = MIGRATE_DEFAULT_DOWNTIME_MS;
+static bool zero_pages = true;
+static bool compress;
+
+static const char * const migrate_usage[] = {
+	"lkvm migrate [-n name] [options] <tcp:host:port|unix:path>",
+	NULL
+};
+
+static const struct option migrate_options[] = {
+	OPT_GROUP("General options:"),
+	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
+	OPT_UINTEGER('\0', "channels", &channels,
+		     "Number of connections to send RAM over"),
+	OPT_UINTEGER('\0', "downtime", &downtime_ms,
+		     "Longest pause of the guest to aim for, in ms"),
+	OPT_BOOLEAN('\0', "zero-pages", &zero_pages,
+		    "Send pages of zeroes without their content"),
+	OPT_BOOLEAN('\0', "compress", &compress,
+		    "Compress pages with zlib"),
+	OPT_END()
+};
+
+static void parse_migrate_options(int argc, const char **argv)
+{
+	while (argc != 0) {
+		argc = parse_options(argc, argv, migrate_options,
+				     migrate_usage,
+				     PARSE_OPT_STOP_AT_NON_OPTION);
+		if (argc == 0)
+			break;
+		if (migrate_dest)
+			kvm_migrate_help();
+		migrate_dest = argv[0];
+		argc--;
+		argv++;
+	}
+}
+
+void kvm_migrate_help(void)
+{
+	usage_with_options(migrate_usage, migrate_options);
+}
+
+int kvm_cmd_migrate(int argc, const char **argv, const char *prefix)
+{
+	struct migrate_params params = {};
+	char cwd[PATH_MAX];
+	s32 status;
+	int instance;
+	int r;
+
+	parse_migrate_options(argc, argv);
+
+	if (instance_name == NULL || migrate_dest == NULL)
+		kvm_migrate_help();
+
+	if (!channels || channels > MIGRATE_MAX_CHANNELS)
+		die("--channels must be between 1 and %d", MIGRATE_MAX_CHANNELS);
+
+	/* The guest doesn't necessarily run from this directory */
+	if (!strncmp(migrate_dest, "unix:", 5) && migrate_dest[5] != '/') {
+		if (!getcwd(cwd, sizeof(cwd)))
+			die_perror("getcwd");
+		r = snprintf(params.dest, sizeof(params.dest), "unix:%s/%s",
+			     cwd, migrate_dest + 5);
+	} else {
+		r = snprintf(params.dest, sizeof(params.dest), "%s",
+			     migrate_dest);
+	}
+	if (r >= (int)sizeof(params.dest))
+		die("Migration address too long");
+
+	params.channels = channels;
+	params.downtime_ms = downtime_ms;
+	params.zero_pages = zero_pages;
+	params.compress = compress;
+
+	instance = kvm__get_sock_by_instance(instance_name);
+
+	if (instance <= 0)
+		die("Failed locating instance");
+
+	r = kvm_ipc__send_msg(instance, KVM_IPC_MIGRATE, sizeof(params),
+			      (u8 *)&params);
+	if (r < 0)
+		goto out;
+
+	if (read_in_full(instance, &status, sizeof(status)) != sizeof(status)) {
+		pr_err("Could not retrieve the migration status from %s",
+		       instance_name);
+		r = -1;
+		goto out;
+	}
+
+	r = status;
+	if (r < 0)
+		pr_err("Unable to migrate %s: %s", instance_name, strerror(-r));
+	else
+		printf("Guest %s migrated to %s\n", instance_name, params.dest);
+
+out:
+	close(instance);
+
+	return r;
+}
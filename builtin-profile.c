@@ -0,0 +1,127 @@
+#include <kvm/util.h>
+#include <kvm/kvm-cmd.h>
+#include <kvm/builtin-profile.h>
+#include <kvm/kvm.h>
+#include <kvm/parse-options.h>
+#include <kvm/kvm-ipc.h>
+#include <kvm/profile.h>
+#include <kvm/read-write.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *instance_name;
+static const char *output;
+static unsigned int seconds = PROFILE_DEFAULT_SECONDS;
+static unsigned int freq = PROFILE_DEFAULT_FREQ;
+static bool callchain;
+
+static const char * const profile_usage[] = {
+	"lkvm profile [-n name] [options]",
+	NULL
+};
+
+static const struct option profile_options[] = {
+	OPT_GROUP("General options:"),
+	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
+	OPT_UINTEGER('t', "time", &seconds, "How long to sample, in seconds"),
+	OPT_UINTEGER('F', "freq", &freq, "Samples per second of each vCPU"),
+	OPT_BOOLEAN('g', "callchain", &callchain,
+		    "Walk the frame pointers of the guest kernel"),
+	OPT_STRING('o', "output", &output, "file",
+		   "Write the folded stacks to a file"),
+	OPT_END()
+};
+
+static void parse_profile_options(int argc, const char **argv)
+{
+	while (argc != 0) {
+		argc = parse_options(argc, argv, profile_options,
+				     profile_usage,
+				     PARSE_OPT_STOP_AT_NON_OPTION);
+		if (argc != 0)
+			kvm_profile_help();
+	}
+}
+
+void kvm_profile_help(void)
+{
+	usage_with_options(profile_usage, profile_options);
+}
+
+int kvm_cmd_profile(int argc, const char **argv, const char *prefix)
+{
+	struct profile_params params = {};
+	char *buf = NULL;
+	int instance, fd = STDOUT_FILENO;
+	s32 status;
+	u32 len;
+	int r;
+
+	parse_profile_options(argc, argv);
+
+	if (instance_name == NULL)
+		kvm_profile_help();
+
+	if (!freq || freq > PROFILE_MAX_FREQ)
+		die("--freq must be between 1 and %d", PROFILE_MAX_FREQ);
+	if (!seconds || seconds > PROFILE_MAX_SECONDS)
+		die("--time must be between 1 and %d", PROFILE_MAX_SECONDS);
+
+	params.duration_ms = seconds * 1000;
+	params.freq = freq;
+	if (callchain)
+		params.flags |= PROFILE_F_CALLCHAIN;
+
+	if (output) {
+		fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			die_perror("open");
+	}
+
+	instance = kvm__get_sock_by_instance(instance_name);
+
+	if (instance <= 0)
+		die("Failed locating instance");
+
+	r = kvm_ipc__send_msg(instance, KVM_IPC_PROFILE, sizeof(params),
+			      (u8 *)&params);
+	if (r < 0)
+		goto out;
+
+	if (read_in_full(instance, &status, sizeof(status)) != sizeof(status)) {
+		pr_err("Could not retrieve the profile of %s", instance_name);
+		r = -1;
+		goto out;
+	}
+
+	r = status;
+	if (r < 0) {
+		pr_err("Unable to profile %s: %s", instance_name, strerror(-r));
+		goto out;
+	}
+
+	if (read_in_full(instance, &len, sizeof(len)) != sizeof(len) ||
+	    !(buf = malloc(len + 1)) ||
+	    read_in_full(instance, buf, len) != (ssize_t)len) {
+		pr_err("Could not retrieve the profile of %s", instance_name);
+		r = -1;
+		goto out;
+	}
+
+	if (write_in_full(fd, buf, len) < 0) {
+		pr_err("Could not write the profile: %s", strerror(errno));
+		r = -1;
+	}
+
+out:
+	free(buf);
+	close(instance);
+	if (output)
+		close(fd);
+
+	return r;
+}
@@ -0,0 +1,119 @@
+#include <kvm/util.h>
+#include <kvm/kvm-cmd.h>
+#include <kvm/builtin-ratelimit.h>
+#include <kvm/kvm.h>
+#include <kvm/parse-options.h>
+#include <kvm/kvm-ipc.h>
+#include <kvm/ratelimit.h>
+#include <kvm/read-write.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *instance_name;
+static int disk = -1;
+static int net = -1;
+static const char *bps;
+static const char *iops;
+static const char *pps;
+static unsigned int burst;
+
+static const char * const ratelimit_usage[] = {
+	"lkvm ratelimit -n name (--disk N | --net N) [--bps rate] [--iops rate | --pps rate] [--burst ms]",
+	NULL
+};
+
+static const struct option ratelimit_options[] = {
+	OPT_GROUP("General options:"),
+	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
+	OPT_INTEGER('\0', "disk", &disk,
+		    "Disk to limit, in the order they were given"),
+	OPT_INTEGER('\0', "net", &net,
+		    "Network device to limit, in the order they were given"),
+	OPT_GROUP("Limits, 0 or left out for none:"),
+	OPT_STRING('\0', "bps", &bps, "rate",
+		   "Bytes per second, with an optional K, M or G suffix"),
+	OPT_STRING('\0', "iops", &iops, "rate", "Requests per second of a disk"),
+	OPT_STRING('\0', "pps", &pps, "rate",
+		   "Frames per second of each queue of a network device"),
+	OPT_UINTEGER('\0', "burst", &burst,
+		     "How long an idle device may go at full speed, in ms"),
+	OPT_END()
+};
+
+static void parse_ratelimit_options(int argc, const char **argv)
+{
+	while (argc != 0) {
+		argc = parse_options(argc, argv, ratelimit_options,
+				     ratelimit_usage,
+				     PARSE_OPT_STOP_AT_NON_OPTION);
+		if (argc != 0)
+			kvm_ratelimit_help();
+	}
+}
+
+void kvm_ratelimit_help(void)
+{
+	usage_with_options(ratelimit_usage, ratelimit_options);
+}
+
+int kvm_cmd_ratelimit(int argc, const char **argv, const char *prefix)
+{
+	struct ratelimit_msg msg = {};
+	int instance;
+	s32 status;
+	int r;
+
+	parse_ratelimit_options(argc, argv);
+
+	if (instance_name == NULL || (disk < 0) == (net < 0))
+		kvm_ratelimit_help();
+
+	if (disk >= 0) {
+		if (pps)
+			die("--pps is for network devices, use --iops");
+		msg.dev_type = RATELIMIT_DEV_BLK;
+		msg.dev = disk;
+	} else {
+		if (iops)
+			die("--iops is for disks, use --pps");
+		msg.dev_type = RATELIMIT_DEV_NET;
+		msg.dev = net;
+	}
+
+	if (burst > RATELIMIT_MAX_BURST_MS)
+		die("--burst must be at most %d", RATELIMIT_MAX_BURST_MS);
+
+	msg.params.bytes = bps ? ratelimit__parse_rate(bps) : 0;
+	msg.params.ops = ratelimit__parse_rate(iops ?: pps ?: "0");
+	msg.params.burst_ms = burst;
+
+	instance = kvm__get_sock_by_instance(instance_name);
+
+	if (instance <= 0)
+		die("Failed locating instance");
+
+	r = kvm_ipc__send_msg(instance, KVM_IPC_RATELIMIT, sizeof(msg),
+			      (u8 *)&msg);
+	if (r < 0)
+		goto out;
+
+	if (read_in_full(instance, &status, sizeof(status)) != sizeof(status)) {
+		pr_err("Could not retrieve the rate limit status of %s",
+		       instance_name);
+		r = -1;
+		goto out;
+	}
+
+	r = status;
+	if (r < 0)
+		pr_err("Unable to set the rate limit on %s: %s", instance_name,
+		       strerror(-r));
+
+out:
+	close(instance);
+
+	return r;
+}
@@ -14,6 +14,10 @@
 #include "kvm/virtio-rng.h"
 #include "kvm/ioeventfd.h"
 #include "kvm/virtio-9p.h"
+#include "kvm/virtio-fs.h"
+#include "kvm/virtio-pmem.h"
+#include "kvm/pci-shmem.h"
+#include "kvm/virtio-vdpa.h"
 #include "kvm/barrier.h"
 #include "kvm/kvm-cpu.h"
 #include "kvm/ioport.h"
@@ -33,10 +37,13 @@
 #include "kvm/guest_compat.h"
 #include "kvm/kvm-ipc.h"
 #include "kvm/builtin-debug.h"
+#include "kvm/snapshot.h"
+#include "kvm/migrate.h"
 
 #include <linux/types.h>
 #include <linux/err.h>
 #include <linux/sizes.h>
+#include <linux/cpumask.h>
 
 #include <sys/utsname.h>
 #include <sys/types.h>
@@ -145,6 +152,285 @@ static int mem_parser(const struct option *opt, const char *arg, int unset)
 	return 0;
 }
 
+static int mem_backend_parser(const struct option *opt, const char *arg,
+			      int unset)
+{
+	struct kvm *kvm = opt->ptr;
+	char *next;
+
+	if (!strcmp(opt->long_name, "hugepage-size")) {
+		kvm->cfg.hugepage_size = parse_mem_option(arg, &next);
+		if (*next != '\0' || (kvm->cfg.hugepage_size != SZ_2M &&
+				      kvm->cfg.hugepage_size != SZ_1G))
+			die("Huge pages must be 2M or 1G: %s", arg);
+		return 0;
+	}
+
+	if (!strcmp(arg, "anon"))
+		kvm->cfg.mem_backend = KVM_MEM_BACKEND_ANON;
+	else if (!strcmp(arg, "thp"))
+		kvm->cfg.mem_backend = KVM_MEM_BACKEND_THP;
+	else if (!strcmp(arg, "hugetlbfs"))
+		kvm->cfg.mem_backend = KVM_MEM_BACKEND_HUGETLBFS;
+	else if (!strcmp(arg, "memfd"))
+		kvm->cfg.mem_backend = KVM_MEM_BACKEND_MEMFD;
+	else
+		die("Unknown memory backend: %s", arg);
+
+	return 0;
+}
+
+static int restore_mode_parser(const struct option *opt, const char *arg,
+			       int unset)
+{
+	struct kvm *kvm = opt->ptr;
+
+	if (!strcmp(arg, "mmap"))
+		kvm->cfg.restore_uffd = false;
+	else if (!strcmp(arg, "uffd"))
+		kvm->cfg.restore_uffd = true;
+	else
+		die("Unknown restore mode: %s", arg);
+
+	return 0;
+}
+
+/*
+ * Parse one value of each guest node for a key of --numa, separated by ':'.
+ * Returns the number of values, with *next after the last one.
+ */
+static int numa_topology_values(struct kvm *kvm, const char *arg,
+				const char *key, const char *p, char **next)
+{
+	struct kvm_numa_node *node;
+	int i = 0;
+	long val;
+
+	for (;;) {
+		if (i == KVM_MAX_NUMA_BANKS)
+			die("Too many guest NUMA nodes: %s", arg);
+		node = &kvm->cfg.guest_numa[i++];
+
+		if (!strcmp(key, "mem")) {
+			node->mem_size = parse_mem_option(p, next);
+		} else {
+			val = strtol(p, next, 10);
+			if (*next == p || val < 0)
+				die("Invalid NUMA %s: %s", key, arg);
+
+			if (!strcmp(key, "host")) {
+				if (val >= KVM_MAX_NUMA_NODE)
+					die("Invalid NUMA %s: %s", key, arg);
+				node->host_node = val;
+			} else {
+				node->first_cpu = node->last_cpu = val;
+				if (**next == '-') {
+					p = *next + 1;
+					val = strtol(p, next, 10);
+					if (*next == p || val < node->first_cpu)
+						die("Invalid NUMA %s: %s", key, arg);
+					node->last_cpu = val;
+				}
+			}
+		}
+
+		if (**next != ':')
+			return i;
+		p = *next + 1;
+	}
+}
+
+/* nodes=<n>,cpus=<first>[-<last>]:...,mem=<size>:...[,host=<node>:...] */
+static int numa_topology_parser(struct kvm *kvm, const char *arg)
+{
+	int nr_nodes = 0, nr_cpus = 0, nr_mems = 0, nr_hosts = 0, i;
+	const char *p = arg;
+	char *next;
+
+	for (i = 0; i < KVM_MAX_NUMA_BANKS; i++)
+		kvm->cfg.guest_numa[i].host_node = -1;
+
+	while (*p) {
+		if (!strncmp(p, "nodes=", 6)) {
+			nr_nodes = strtol(p + 6, &next, 10);
+			if (next == p + 6 || nr_nodes < 1 ||
+			    nr_nodes > KVM_MAX_NUMA_BANKS)
+				die("Invalid number of NUMA nodes: %s", arg);
+		} else if (!strncmp(p, "cpus=", 5)) {
+			nr_cpus = numa_topology_values(kvm, arg, "cpus", p + 5, &next);
+		} else if (!strncmp(p, "mem=", 4)) {
+			nr_mems = numa_topology_values(kvm, arg, "mem", p + 4, &next);
+		} else if (!strncmp(p, "host=", 5)) {
+			nr_hosts = numa_topology_values(kvm, arg, "host", p + 5, &next);
+		} else {
+			die("Unknown NUMA option: %s", p);
+		}
+
+		if (*next != ',' && *next != '\0')
+			die("Invalid NUMA topology: %s", arg);
+		p = *next ? next + 1 : next;
+	}
+
+	if (!nr_nodes)
+		nr_nodes = nr_cpus;
+	if (!nr_nodes || nr_cpus != nr_nodes || nr_mems != nr_nodes ||
+	    (nr_hosts && nr_hosts != nr_nodes))
+		die("--numa needs cpus= and mem= for each of its nodes: %s", arg);
+
+	kvm->cfg.nr_guest_numa = nr_nodes;
+
+	return 0;
+}
+
+static int numa_parser(const struct option *opt, const char *arg, int unset)
+{
+	struct kvm *kvm = opt->ptr;
+	const char *p = arg;
+	char *next;
+	long node;
+
+	if (!strcmp(opt->long_name, "numa"))
+		return numa_topology_parser(kvm, arg);
+
+	if (!strcmp(opt->long_name, "numa-policy")) {
+		if (!strcmp(arg, "bind"))
+			kvm->cfg.numa_policy = KVM_NUMA_BIND;
+		else if (!strcmp(arg, "preferred"))
+			kvm->cfg.numa_policy = KVM_NUMA_PREFERRED;
+		else if (!strcmp(arg, "interleave"))
+			kvm->cfg.numa_policy = KVM_NUMA_INTERLEAVE;
+		else
+			die("Unknown NUMA policy: %s", arg);
+		return 0;
+	}
+
+	kvm->cfg.nr_numa_nodes = 0;
+	do {
+		if (kvm->cfg.nr_numa_nodes == KVM_MAX_NUMA_BANKS)
+			die("Too many NUMA nodes: %s", arg);
+
+		node = strtol(p, &next, 10);
+		if (next == p || node < 0 || node >= KVM_MAX_NUMA_NODE ||
+		    (*next != ',' && *next != '\0'))
+			die("Invalid NUMA node list: %s", arg);
+
+		kvm->cfg.numa_nodes[kvm->cfg.nr_numa_nodes++] = node;
+		p = next + 1;
+	} while (*next == ',');
+
+	return 0;
+}
+
+static int mem_merge_parser(const struct option *opt, const char *arg,
+			    int unset)
+{
+	struct kvm *kvm = opt->ptr;
+	enum kvm_mem_merge merge;
+	const char *p = arg;
+	size_t len;
+
+	kvm->cfg.nr_mem_merge = 0;
+	do {
+		if (kvm->cfg.nr_mem_merge == KVM_MAX_NUMA_BANKS)
+			die("Too many RAM banks: %s", arg);
+
+		len = strcspn(p, ",");
+		if (len == 2 && !strncmp(p, "on", 2))
+			merge = KVM_MEM_MERGE_ON;
+		else if (len == 6 && !strncmp(p, "nohuge", 6))
+			merge = KVM_MEM_MERGE_NOHUGE;
+		else if (len == 3 && !strncmp(p, "off", 3))
+			merge = KVM_MEM_MERGE_OFF;
+		else
+			die("Invalid KSM merging: %s", arg);
+
+		kvm->cfg.mem_merge[kvm->cfg.nr_mem_merge++] = merge;
+		p += len;
+	} while (*p++ == ',');
+
+	return 0;
+}
+
+static cpu_set_t *cpuset_parse(const char *arg)
+{
+	size_t size = CPU_ALLOC_SIZE(NR_CPUS);
+	cpumask_t cpumask;
+	cpu_set_t *set;
+	int cpu;
+
+	if (cpulist_parse(arg, &cpumask))
+		die("Invalid CPU list: %s", arg);
+
+	set = CPU_ALLOC(NR_CPUS);
+	if (!set)
+		die_perror("CPU_ALLOC");
+	CPU_ZERO_S(size, set);
+
+	for_each_cpu(cpu, &cpumask)
+		CPU_SET_S(cpu, size, set);
+
+	if (!CPU_COUNT_S(size, set))
+		die("Empty CPU list: %s", arg);
+
+	return set;
+}
+
+/* cpulist for all vCPUs, or vcpu:cpu[,vcpu:cpu...] */
+static int affinity_parser(const struct option *opt, const char *arg, int unset)
+{
+	size_t size = CPU_ALLOC_SIZE(NR_CPUS);
+	struct kvm *kvm = opt->ptr;
+	struct kvm_vcpu_pin *pin;
+	const char *p = arg;
+	char *next;
+	long vcpu, cpu;
+
+	if (!strcmp(opt->long_name, "io-affinity")) {
+		kvm->cfg.io_affinity = cpuset_parse(arg);
+		return 0;
+	}
+
+	if (!strchr(arg, ':')) {
+		kvm->cfg.vcpu_affinity = cpuset_parse(arg);
+		return 0;
+	}
+
+	/* The vCPUs with no CPU of their own run on the CPUs of the others */
+	if (!kvm->cfg.vcpu_affinity) {
+		kvm->cfg.vcpu_affinity = CPU_ALLOC(NR_CPUS);
+		if (!kvm->cfg.vcpu_affinity)
+			die_perror("CPU_ALLOC");
+		CPU_ZERO_S(size, kvm->cfg.vcpu_affinity);
+	}
+
+	do {
+		vcpu = strtol(p, &next, 10);
+		if (next == p || vcpu < 0 || *next != ':')
+			die("Invalid vCPU affinity: %s", arg);
+
+		p = next + 1;
+		cpu = strtol(p, &next, 10);
+		if (next == p || cpu < 0 || cpu >= NR_CPUS ||
+		    (*next != ',' && *next != '\0'))
+			die("Invalid vCPU affinity: %s", arg);
+
+		pin = realloc(kvm->cfg.vcpu_pins,
+			      (kvm->cfg.nr_vcpu_pins + 1) * sizeof(*pin));
+		if (!pin)
+			die_perror("realloc");
+		kvm->cfg.vcpu_pins = pin;
+		pin[kvm->cfg.nr_vcpu_pins++] = (struct kvm_vcpu_pin) {
+			.vcpu	= vcpu,
+			.cpu	= cpu,
+		};
+
+		CPU_SET_S(cpu, size, kvm->cfg.vcpu_affinity);
+		p = next + 1;
+	} while (*next == ',');
+
+	return 0;
+}
+
 static int loglevel_parser(const struct option *opt, const char *arg, int unset)
 {
 	if (strcmp(opt->long_name, "debug") == 0) {
@@ -194,38 +480,153 @@ static int loglevel_parser(const struct option *opt, const char *arg, int unset)
 	OPT_STRING('\0', "name", &(cfg)->guest_name, "guest name",	\
 			"A name for the guest"),			\
 	OPT_INTEGER('c', "cpus", &(cfg)->nrcpus, "Number of CPUs"),	\
+	OPT_INTEGER('\0', "max-cpus", &(cfg)->max_cpus,			\
+		    "Number of CPUs that 'lkvm cpu add' can go up to"),	\
 	OPT_CALLBACK('m', "mem", NULL, MEM_OPT_HELP_SHORT,		\
 		     MEM_OPT_HELP_LONG, mem_parser, kvm),		\
 	OPT_CALLBACK('d', "disk", kvm, "image or rootfs_dir", "Disk "	\
 			" image or rootfs directory", img_name_parser,	\
 			kvm),						\
+	OPT_CALLBACK('\0', "disk-engine", NULL,			\
+		     "sync|aio|io_uring[,sqpoll][,fixedbufs][,shared]",	\
+		     "I/O engine used for raw disk images",		\
+		     disk_engine_parser, NULL),				\
 	OPT_BOOLEAN('\0', "balloon", &(cfg)->balloon, "Enable virtio"	\
 			" balloon"),					\
+	OPT_BOOLEAN('\0', "balloon-lazy", &(cfg)->balloon_lazy, "Let the"\
+			" host reclaim the balloon only under pressure"),	\
+	OPT_CALLBACK('\0', "balloon-auto", NULL,			\
+		     "min=<MB>,max=<MB>[,step=<MB>,interval=<ms>,"	\
+		     "reserve=<MB>,psi_high=<%>,psi_low=<%>]",		\
+		     "Size the balloon after host memory pressure",	\
+		     virtio_bln_auto_parser, kvm),			\
+	OPT_U64('\0', "virtio-mem", &(cfg)->virtio_mem_mb, "Memory in MB"\
+			" that lkvm memory can plug into the guest"),	\
 	OPT_BOOLEAN('\0', "vnc", &(cfg)->vnc, "Enable VNC framebuffer"),\
 	OPT_BOOLEAN('\0', "gtk", &(cfg)->gtk, "Enable GTK framebuffer"),\
 	OPT_BOOLEAN('\0', "sdl", &(cfg)->sdl, "Enable SDL framebuffer"),\
+	OPT_BOOLEAN('\0', "gpu", &(cfg)->virtio_gpu, "Drive the"	\
+			" framebuffer with virtio-gpu instead of VESA"),	\
+	OPT_BOOLEAN('\0', "input", &(cfg)->virtio_input, "Send the"	\
+			" keyboard and pointer of the UI to virtio-input"),	\
 	OPT_BOOLEAN('\0', "rng", &(cfg)->virtio_rng, "Enable virtio"	\
 			" Random Number Generator"),			\
 	OPT_BOOLEAN('\0', "nodefaults", &(cfg)->nodefaults, "Disable"   \
 			" implicit configuration that cannot be"	\
 			" disabled otherwise"),				\
-	OPT_CALLBACK('\0', "9p", NULL, "dir_to_share,tag_name",		\
+	OPT_CALLBACK('\0', "9p", NULL, "dir_to_share,tag_name[,lower=dir]",	\
 		     "Enable virtio 9p to share files between host and"	\
 		     " guest", virtio_9p_rootdir_parser, kvm),		\
+	OPT_CALLBACK('\0', "9p-cache", NULL, "<ms>|loose",		\
+		     "Cache the attributes of the 9p files, up to <ms>"	\
+		     " without inotify, or as long as possible when the"	\
+		     " guest mounts with cache=loose",			\
+		     virtio_9p_cache_parser, kvm),			\
+	OPT_CALLBACK('\0', "virtiofs", NULL,				\
+		     "dir,tag[,dax=<MB>][,cache=none|auto|always]",	\
+		     "Share a directory with the guest through virtio-fs",	\
+		     virtio_fs_parser, kvm),				\
+	OPT_CALLBACK('\0', "pmem", NULL, "file[,ro]",			\
+		     "Map a file into the guest with virtio-pmem, for"	\
+		     " DAX", virtio_pmem_parser, kvm),			\
+	OPT_CALLBACK('\0', "shmem", NULL,				\
+		     "<MB>[,hugetlbfs=<dir>][,vectors=<n>]",		\
+		     "Share memory with host processes through an"	\
+		     " ivshmem PCI device", pci_shmem_parser, NULL),	\
 	OPT_STRING('\0', "console", &(cfg)->console, "serial, virtio or"\
 			" hv", "Console to use"),			\
+	OPT_CALLBACK('\0', "console-port", NULL,			\
+		     "name,socket=<path>|file=<path>",			\
+		     "Add a named virtio-console port",			\
+		     virtio_console_port_parser, NULL),			\
 	OPT_U64('\0', "vsock", &(cfg)->vsock_cid,			\
 			"Guest virtio socket CID"),			\
+	OPT_STRING('\0', "vsock-uds", &(cfg)->vsock_uds, "path",	\
+			"Forward virtio sockets to unix sockets at "	\
+			"path and path_<port>"),			\
 	OPT_STRING('\0', "dev", &(cfg)->dev, "device_file",		\
 			"KVM device file"),				\
-	OPT_CALLBACK('\0', "tty", NULL, "tty id",			\
-		     "Remap guest TTY into a pty on the host",		\
+	OPT_CALLBACK('\0', "tty", NULL,				\
+		     "id[,pty|socket=<path>|file=<path>]",		\
+		     "Remap guest TTY into a pty, socket or file on the host",\
 		     tty_parser, NULL),					\
 	OPT_STRING('\0', "sandbox", &(cfg)->sandbox, "script",		\
 			"Run this script when booting into custom"	\
 			" rootfs"),					\
 	OPT_STRING('\0', "hugetlbfs", &(cfg)->hugetlbfs_path, "path",	\
 			"Hugetlbfs path"),				\
+	OPT_CALLBACK('\0', "mem-backend", NULL,			\
+		     "anon|thp|hugetlbfs|memfd",			\
+		     "How guest RAM is allocated", mem_backend_parser,	\
+		     kvm),						\
+	OPT_BOOLEAN('\0', "mem-prealloc", &(cfg)->mem_prealloc,	\
+		    "Fault in all of guest RAM before starting"),	\
+	OPT_BOOLEAN('\0', "guest-memfd", &(cfg)->guest_memfd,	\
+		    "Back the private memory of the guest with"	\
+		    " guest_memfd"),					\
+	OPT_STRING('\0', "restore", &(cfg)->restore_dir, "dir",	\
+			"Resume the guest saved to this directory by"	\
+			" lkvm snapshot"),				\
+	OPT_CALLBACK('\0', "restore-mode", NULL, "mmap|uffd",		\
+		     "Map the memory of the snapshot, or load it on"	\
+		     " demand with userfaultfd", restore_mode_parser,	\
+		     kvm),						\
+	OPT_STRING('\0', "template-save", &(cfg)->template_save, "dir",\
+			"Save the guest to this directory once it has"	\
+			" booted, and exit"),				\
+	OPT_STRING('\0', "incoming", &(cfg)->incoming,		\
+			"tcp:<host>:<port>|unix:<path>",		\
+			"Run the guest that lkvm migrate sends to this"	\
+			" address"),					\
+	OPT_STRING('\0', "metrics", &(cfg)->metrics,			\
+			"tcp:<host>:<port>|unix:<path>",		\
+			"Serve Prometheus metrics of the guest on this"	\
+			" address"),					\
+	OPT_INTEGER('\0', "status-interval",				\
+		    &(cfg)->status_interval_ms,			\
+		    "Refresh the status page of the guest every this"	\
+		    " many ms, 0 to not publish one"),			\
+	OPT_CALLBACK('\0', "hugepage-size", NULL, "2M|1G",		\
+		     "Back a memfd with huge pages of this size",	\
+		     mem_backend_parser, kvm),				\
+	OPT_CALLBACK('\0', "numa", NULL,				\
+		     "nodes=<n>,cpus=<cpus>:..,mem=<size>:..[,host=<node>:..]",\
+		     "Guest NUMA nodes, with their vCPUs, RAM and optional"\
+		     " host node", numa_parser, kvm),			\
+	OPT_CALLBACK('\0', "numa-node", NULL, "node[,node...]",	\
+		     "Host NUMA node of each RAM bank, the last one"	\
+		     " applies to any further banks", numa_parser, kvm),\
+	OPT_CALLBACK('\0', "numa-policy", NULL,			\
+		     "bind|preferred|interleave",			\
+		     "How RAM is placed on --numa-node nodes, interleave"\
+		     " spreads each bank over all of them",		\
+		     numa_parser, kvm),					\
+	OPT_CALLBACK('\0', "mem-merge", NULL, "on|nohuge|off[,...]",	\
+		     "Whether KSM merges each RAM bank, nohuge without"	\
+		     " transparent huge pages. The last one applies to"	\
+		     " any further banks", mem_merge_parser, kvm),	\
+	OPT_BOOLEAN('\0', "mem-merge-process",			\
+		    &(cfg)->mem_merge_process, "Let KSM merge all the"	\
+		    " private memory of the process"),			\
+	OPT_CALLBACK('\0', "vcpu-affinity", NULL,			\
+		     "cpulist|vcpu:cpu[,vcpu:cpu...]",			\
+		     "Host CPUs of all vCPUs, or of each vCPU",		\
+		     affinity_parser, kvm),				\
+	OPT_CALLBACK('\0', "io-affinity", NULL, "cpulist",		\
+		     "Host CPUs of the threads other than vCPUs. The"	\
+		     " vCPUs default to the remaining ones",		\
+		     affinity_parser, kvm),				\
+	OPT_BOOLEAN('\0', "no-device-numa", &(cfg)->no_device_numa,	\
+		    "Don't move device threads and buffers to the host"	\
+		    " node of their disk or NIC"),			\
+	OPT_INTEGER('\0', "iothreads", &(cfg)->nr_iothreads,		\
+		    "Serve the virtqueues of the devices from this many"	\
+		    " shared threads"),					\
+	OPT_INTEGER('\0', "vcpu-fifo", &(cfg)->vcpu_fifo_priority,	\
+		    "Run vCPUs as SCHED_FIFO with this priority"),	\
+	OPT_INTEGER('\0', "halt-poll-ns", &(cfg)->halt_poll_ns,	\
+		    "How long KVM polls a halted vCPU for wakeups"	\
+		    " before it sleeps, 0 to never poll"),		\
 	OPT_CALLBACK_NOOPT('\0', "virtio-legacy",			\
 			   &(cfg)->virtio_transport, "",		\
 			   "Use legacy virtio transport (Deprecated:"	\
@@ -235,6 +636,13 @@ static int loglevel_parser(const struct option *opt, const char *arg, int unset)
 		     VIRTIO_TRANS_OPT_HELP_SHORT,		        \
 		     "Type of virtio transport",			\
 		     virtio_transport_parser, NULL),			\
+	OPT_BOOLEAN('\0', "virtio-doorbell", &(cfg)->virtio_doorbell,	\
+		    "Add a device that kicks the queues of all virtio"	\
+		    " devices with one write"),			\
+	OPT_CALLBACK('\0', "ioeventfd", &(cfg)->ioeventfd_strict,	\
+		     "auto|strict", "Whether queue notifications may"	\
+		     " trap to userspace when ioeventfd setup fails",	\
+		     ioeventfd_parser, NULL),				\
 	OPT_CALLBACK('\0', "loglevel", NULL, "[error|warning|info|debug]",\
 			"Set the verbosity level", loglevel_parser, NULL),\
 									\
@@ -243,6 +651,12 @@ static int loglevel_parser(const struct option *opt, const char *arg, int unset)
 			"Kernel to boot in virtual machine"),		\
 	OPT_STRING('i', "initrd", &(cfg)->initrd_filename, "initrd",	\
 			"Initial RAM disk image"),			\
+	OPT_STRING('\0', "vmlinux", &(cfg)->vmlinux_filename, "vmlinux",\
+			"Symbols of the kernel, for backtraces and"	\
+			" profiles"),					\
+	OPT_BOOLEAN('\0', "map-images", &(cfg)->map_images, "Map the"	\
+			" kernel and initrd copy-on-write instead of"	\
+			" reading them into guest memory"),		\
 	OPT_STRING('p', "params", &(cfg)->kernel_cmdline, "params",	\
 			"Kernel command line arguments"),		\
 	OPT_STRING('f', "firmware", &(cfg)->firmware_filename, "firmware",\
@@ -258,10 +672,21 @@ static int loglevel_parser(const struct option *opt, const char *arg, int unset)
 	OPT_BOOLEAN('\0', "no-dhcp", &(cfg)->no_dhcp, "Disable kernel"	\
 			" DHCP in rootfs mode"),			\
 									\
+	OPT_GROUP("vDPA options:"),					\
+	OPT_CALLBACK('\0', "vdpa", NULL, "/dev/vhost-vdpa-N",		\
+		     "Give a vhost-vdpa device of the host to the guest",\
+		     virtio_vdpa_parser, kvm),				\
+									\
 	OPT_GROUP("VFIO options:"),					\
-	OPT_CALLBACK('\0', "vfio-pci", NULL, "[domain:]bus:dev.fn",	\
+	OPT_CALLBACK('\0', "vfio-pci", NULL,				\
+		     "[domain:]bus:dev.fn[,ioeventfd=off][,doorbell=<bar>:<offset>]",\
 		     "Assign a PCI device to the virtual machine",	\
 		     vfio_device_parser, kvm),				\
+	OPT_BOOLEAN('\0', "vfio-iommufd", &(cfg)->vfio_iommufd,		\
+		    "Use iommufd instead of a VFIO container"),	\
+	OPT_INTEGER('\0', "vfio-dma-threads", &(cfg)->vfio_dma_threads,	\
+		    "Threads mapping guest RAM for DMA with iommufd,"	\
+		    " one per host CPU by default"),			\
 									\
 	OPT_GROUP("Debug options:"),					\
 	OPT_CALLBACK_NOOPT('\0', "debug", kvm, NULL,			\
@@ -276,43 +701,20 @@ static int loglevel_parser(const struct option *opt, const char *arg, int unset)
 			"Enable MMIO debugging"),			\
 	OPT_INTEGER('\0', "debug-iodelay", &(cfg)->debug_iodelay,	\
 			"Delay IO by millisecond"),			\
+	OPT_BOOLEAN('\0', "debug-startup", &(cfg)->startup_debug,	\
+			"Time each initialisation and teardown step"),	\
+	OPT_STRING('\0', "boot-trace", &(cfg)->boot_trace, "file",	\
+			"Write a Chrome trace of the startup to file"),	\
+	OPT_STRING('\0', "boot-cache", &(cfg)->boot_cache, "dir",	\
+			"Reuse the device trees generated in dir"),	\
+	OPT_INTEGER('\0', "exit-bench", &(cfg)->exit_bench,		\
+			"Add the device of the exit-dispatch benchmark,"\
+			" that times this many accesses of each kind"),	\
 									\
 	OPT_ARCH(RUN, cfg)						\
 	OPT_END()							\
 	};
 
-static void *kvm_cpu_thread(void *arg)
-{
-	char name[16];
-
-	current_kvm_cpu = arg;
-
-	sprintf(name, "kvm-vcpu-%lu", current_kvm_cpu->cpu_id);
-	kvm__set_thread_name(name);
-
-	if (kvm_cpu__start(current_kvm_cpu))
-		goto panic_kvm;
-
-	return (void *) (intptr_t) 0;
-
-panic_kvm:
-	pr_err("KVM exit reason: %u (\"%s\")",
-		current_kvm_cpu->kvm_run->exit_reason,
-		kvm_exit_reasons[current_kvm_cpu->kvm_run->exit_reason]);
-
-	if (current_kvm_cpu->kvm_run->exit_reason == KVM_EXIT_UNKNOWN) {
-		pr_err("KVM exit code: %llu",
-			(unsigned long long)current_kvm_cpu->kvm_run->hw.hardware_exit_reason);
-	}
-
-	kvm_cpu__set_debug_fd(STDOUT_FILENO);
-	kvm_cpu__show_registers(current_kvm_cpu);
-	kvm_cpu__show_code(current_kvm_cpu);
-	kvm_cpu__show_page_tables(current_kvm_cpu);
-
-	return (void *) (intptr_t) 1;
-}
-
 static char kernel[PATH_MAX];
 
 static const char *host_kernels[] = {
@@ -476,14 +878,14 @@ void kvm_run_help(void)
 static int kvm_run_set_sandbox(struct kvm *kvm)
 {
 	const char *guestfs_name = kvm->cfg.custom_rootfs_name;
-	char path[PATH_MAX], script[PATH_MAX], *tmp;
+	char path[PATH_MAX], new_path[PATH_MAX + 16], script[PATH_MAX], *tmp;
 
 	snprintf(path, PATH_MAX, "%s%s/virt/sandbox.sh", kvm__get_dir(), guestfs_name);
 
-	remove(path);
-
-	if (kvm->cfg.sandbox == NULL)
+	if (kvm->cfg.sandbox == NULL) {
+		remove(path);
 		return 0;
+	}
 
 	tmp = realpath(kvm->cfg.sandbox, NULL);
 	if (tmp == NULL)
@@ -492,7 +894,13 @@ static int kvm_run_set_sandbox(struct kvm *kvm)
 	snprintf(script, PATH_MAX, "/host/%s", tmp);
 	free(tmp);
 
-	return symlink(script, path);
+	/* Guests of a sandbox pool share the rootfs, and may be booting */
+	snprintf(new_path, sizeof(new_path), "%s.%d", path, getpid());
+	remove(new_path);
+	if (symlink(script, new_path) < 0)
+		return -errno;
+
+	return rename(new_path, path) < 0 ? -errno : 0;
 }
 
 static void kvm_write_sandbox_cmd_exactly(int fd, const char *arg)
@@ -547,15 +955,15 @@ static void resolve_program(const char *src, char *dst, size_t len)
 		strlcpy(dst, src, len);
 }
 
-static void kvm_run_write_sandbox_cmd(struct kvm *kvm, const char **argv, int argc)
+void kvm_run_write_sandbox_cmd(const char *script, const char **argv, int argc)
 {
 	const char script_hdr[] = "#! /bin/bash\n\n";
 	char program[PATH_MAX];
 	int fd;
 
-	remove(kvm->cfg.sandbox);
+	remove(script);
 
-	fd = open(kvm->cfg.sandbox, O_RDWR | O_CREAT, 0777);
+	fd = open(script, O_RDWR | O_CREAT, 0777);
 	if (fd < 0)
 		die("Failed creating sandbox script");
 
@@ -590,7 +998,13 @@ static void kvm_run_set_real_cmdline(struct kvm *kvm)
 	video = kvm->cfg.vnc || kvm->cfg.sdl || kvm->cfg.gtk;
 
 	memset(real_cmdline, 0, sizeof(real_cmdline));
-	kvm__arch_set_cmdline(real_cmdline, video);
+	kvm__arch_set_cmdline(kvm, real_cmdline, video);
+
+	/* The parked vCPUs are possible CPUs, which the guest keeps offline */
+	if (kvm->cfg.max_cpus > kvm->cfg.nrcpus)
+		snprintf(real_cmdline + strlen(real_cmdline),
+			 sizeof(real_cmdline) - strlen(real_cmdline),
+			 " maxcpus=%d", kvm->cfg.nrcpus);
 
 	if (video) {
 		strcat(real_cmdline, " console=tty0");
@@ -641,9 +1055,18 @@ static void kvm_run_validate_cfg(struct kvm *kvm)
 	    (kvm->cfg.sdl && kvm->cfg.gtk))
 		die("Only one of --vnc, --sdl or --gtk can be specified");
 
+	if (kvm->cfg.virtio_gpu && !(kvm->cfg.vnc || kvm->cfg.sdl || kvm->cfg.gtk))
+		die("--gpu needs one of --vnc, --sdl or --gtk");
+
+	if (kvm->cfg.virtio_input && !(kvm->cfg.vnc || kvm->cfg.sdl || kvm->cfg.gtk))
+		die("--input needs one of --vnc, --sdl or --gtk");
+
 	if (kvm->cfg.firmware_filename && kvm->cfg.initrd_filename)
 		pr_warning("Ignoring initrd file when loading a firmware image");
 
+	if (kvm->cfg.halt_poll_ns < -1)
+		die("--halt-poll-ns cannot be negative");
+
 	if (kvm->cfg.ram_size) {
 		available_ram = host_ram_size();
 		if (available_ram && kvm->cfg.ram_size > available_ram) {
@@ -656,6 +1079,130 @@ static void kvm_run_validate_cfg(struct kvm *kvm)
 	kvm__arch_validate_cfg(kvm);
 }
 
+/*
+ * Check that the guest NUMA nodes cover all vCPUs and RAM, which they give
+ * defaults to, and bind the RAM bank of each node to its host node.
+ */
+static void kvm_run_numa_setup(struct kvm *kvm)
+{
+	struct kvm_numa_node *node, *other;
+	int i, j, nr_cpus = 0;
+	u64 ram_size = 0;
+
+#ifndef ARCH_HAS_GUEST_NUMA
+	die("--numa is not supported on this architecture");
+#endif
+
+	for (i = 0; i < kvm->cfg.nr_guest_numa; i++) {
+		node = &kvm->cfg.guest_numa[i];
+
+		if (!node->mem_size || node->mem_size % SZ_2M)
+			die("The RAM of NUMA node %d must be a multiple of 2M", i);
+		if (kvm->cfg.hugepage_size && node->mem_size % kvm->cfg.hugepage_size)
+			die("The RAM of NUMA node %d must be a multiple of the huge page size", i);
+		ram_size += node->mem_size;
+
+		for (j = 0; j < i; j++) {
+			other = &kvm->cfg.guest_numa[j];
+			if (node->first_cpu <= other->last_cpu &&
+			    other->first_cpu <= node->last_cpu)
+				die("NUMA nodes %d and %d share CPUs", j, i);
+		}
+		nr_cpus += node->last_cpu - node->first_cpu + 1;
+
+		if (node->host_node >= 0) {
+			if (kvm->cfg.nr_numa_nodes > i)
+				die("--numa host= and --numa-node cannot be combined");
+			kvm->cfg.numa_nodes[kvm->cfg.nr_numa_nodes++] = node->host_node;
+		}
+	}
+
+	if (!kvm->cfg.nrcpus)
+		kvm->cfg.nrcpus = nr_cpus;
+	for (i = 0; i < kvm->cfg.nr_guest_numa; i++) {
+		if (kvm->cfg.guest_numa[i].last_cpu >= kvm->cfg.nrcpus)
+			nr_cpus = -1;
+	}
+	if (nr_cpus != kvm->cfg.nrcpus)
+		die("The NUMA nodes must hold each of the %d vCPUs once",
+		    kvm->cfg.nrcpus);
+
+	if (!kvm->cfg.ram_size)
+		kvm->cfg.ram_size = ram_size;
+	if (ram_size != kvm->cfg.ram_size)
+		die("The NUMA nodes hold %lluMB of RAM, not the %lluMB of the guest",
+		    (unsigned long long)ram_size >> MB_SHIFT,
+		    (unsigned long long)kvm->cfg.ram_size >> MB_SHIFT);
+}
+
+/* The vCPUs past --cpus are created parked, for "lkvm cpu add" */
+static void kvm_run_cpu_hotplug_setup(struct kvm *kvm)
+{
+	if (!kvm->cfg.max_cpus)
+		kvm->cfg.max_cpus = kvm->cfg.nrcpus;
+	if (kvm->cfg.max_cpus < kvm->cfg.nrcpus)
+		die("--max-cpus %d is less than the %d vCPUs of --cpus",
+		    kvm->cfg.max_cpus, kvm->cfg.nrcpus);
+	if (kvm->cfg.max_cpus == kvm->cfg.nrcpus)
+		return;
+
+#ifndef ARCH_HAS_CPU_HOTPLUG
+	die("--max-cpus is not supported on this architecture");
+#endif
+	if (kvm->cfg.nr_guest_numa)
+		die("--max-cpus and --numa cannot be combined yet");
+	/* A snapshot has all of its vCPUs, parked or not */
+	if (kvm->cfg.restore_dir || kvm->cfg.incoming)
+		die("--max-cpus doesn't apply to a restored guest");
+}
+
+/*
+ * Check the vCPUs named by --vcpu-affinity, and keep the vCPUs given no
+ * affinity off the --io-affinity CPUs.
+ */
+static void kvm_run_affinity_setup(struct kvm *kvm)
+{
+	size_t size = CPU_ALLOC_SIZE(NR_CPUS);
+	cpu_set_t *vcpus;
+	int i, min_prio, max_prio;
+
+	for (i = 0; i < kvm->cfg.nr_vcpu_pins; i++) {
+		if (kvm->cfg.vcpu_pins[i].vcpu >= kvm->cfg.max_cpus)
+			die("--vcpu-affinity names vCPU %d of %d",
+			    kvm->cfg.vcpu_pins[i].vcpu, kvm->cfg.max_cpus);
+	}
+
+	if (kvm->cfg.vcpu_fifo_priority) {
+		min_prio = sched_get_priority_min(SCHED_FIFO);
+		max_prio = sched_get_priority_max(SCHED_FIFO);
+		if (kvm->cfg.vcpu_fifo_priority < min_prio ||
+		    kvm->cfg.vcpu_fifo_priority > max_prio)
+			die("--vcpu-fifo priority must be between %d and %d",
+			    min_prio, max_prio);
+	}
+
+	if (!kvm->cfg.io_affinity || kvm->cfg.vcpu_affinity)
+		return;
+
+	vcpus = CPU_ALLOC(NR_CPUS);
+	if (!vcpus)
+		die_perror("CPU_ALLOC");
+	if (sched_getaffinity(0, size, vcpus))
+		die_perror("sched_getaffinity");
+
+	for (i = 0; i < NR_CPUS; i++) {
+		if (CPU_ISSET_S(i, size, kvm->cfg.io_affinity))
+			CPU_CLR_S(i, size, vcpus);
+	}
+
+	if (CPU_COUNT_S(size, vcpus)) {
+		kvm->cfg.vcpu_affinity = vcpus;
+	} else {
+		pr_warning("--io-affinity leaves no CPU to the vCPUs");
+		CPU_FREE(vcpus);
+	}
+}
+
 static struct kvm *kvm_cmd_run_init(int argc, const char **argv)
 {
 	static char default_name[20];
@@ -665,6 +1212,7 @@ static struct kvm *kvm_cmd_run_init(int argc, const char **argv)
 	if (IS_ERR(kvm))
 		return kvm;
 
+	kvm->start_ns = kvm_cpu__now();
 	nr_online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
 	kvm->cfg.custom_rootfs_name = "default";
 	/*
@@ -675,6 +1223,9 @@ static struct kvm *kvm_cmd_run_init(int argc, const char **argv)
 	 * the default value.
 	 */
 	kvm->cfg.ram_addr = kvm__arch_default_ram_address();
+	/* Likewise, zero disables halt-polling */
+	kvm->cfg.halt_poll_ns = -1;
+	kvm->cfg.status_interval_ms = 1000;
 
 	while (argc != 0) {
 		BUILD_OPTIONS(options, &kvm->cfg, kvm);
@@ -686,7 +1237,7 @@ static struct kvm *kvm_cmd_run_init(int argc, const char **argv)
 			if (strcmp(argv[0], "--") == 0) {
 				if (kvm_run_wrapper == KVM_RUN_SANDBOX) {
 					kvm->cfg.sandbox = DEFAULT_SANDBOX_FILENAME;
-					kvm_run_write_sandbox_cmd(kvm, argv+1, argc-1);
+					kvm_run_write_sandbox_cmd(kvm->cfg.sandbox, argv+1, argc-1);
 					break;
 				}
 			}
@@ -704,7 +1255,7 @@ static struct kvm *kvm_cmd_run_init(int argc, const char **argv)
 				 * sandbox command
 				 */
 				kvm->cfg.sandbox = DEFAULT_SANDBOX_FILENAME;
-				kvm_run_write_sandbox_cmd(kvm, argv, argc);
+				kvm_run_write_sandbox_cmd(kvm->cfg.sandbox, argv, argc);
 			} else {
 				/*
 				 * first unhandled parameter is treated as a kernel
@@ -720,7 +1271,15 @@ static struct kvm *kvm_cmd_run_init(int argc, const char **argv)
 
 	kvm_run_validate_cfg(kvm);
 
-	if (!kvm->cfg.kernel_filename && !kvm->cfg.firmware_filename) {
+	/* The snapshot has the number of vCPUs and RAM size of the guest */
+	if (kvm->cfg.restore_dir && snapshot__prepare_restore(kvm) < 0)
+		die("Unable to restore from %s", kvm->cfg.restore_dir);
+	/* And so does the source of a migration */
+	if (kvm->cfg.incoming && migrate__prepare_incoming(kvm) < 0)
+		die("Unable to receive a guest on %s", kvm->cfg.incoming);
+
+	if (!kvm->cfg.kernel_filename && !kvm->cfg.firmware_filename &&
+	    !kvm->cfg.restore_dir && !kvm->cfg.incoming) {
 		kvm->cfg.kernel_filename = find_kernel();
 
 		if (!kvm->cfg.kernel_filename) {
@@ -729,17 +1288,23 @@ static struct kvm *kvm_cmd_run_init(int argc, const char **argv)
 		}
 	}
 
-	if (kvm->cfg.kernel_filename) {
+	if (kvm->cfg.kernel_filename && !kvm->cfg.vmlinux_filename)
 		kvm->cfg.vmlinux_filename = find_vmlinux();
-		kvm->vmlinux = kvm->cfg.vmlinux_filename;
-	}
+	kvm->vmlinux = kvm->cfg.vmlinux_filename;
+
+	if (kvm->cfg.nr_guest_numa)
+		kvm_run_numa_setup(kvm);
 
 	if (kvm->cfg.nrcpus == 0)
 		kvm->cfg.nrcpus = nr_online_cpus;
 
+	kvm_run_cpu_hotplug_setup(kvm);
+
 	if (!kvm->cfg.ram_size)
 		kvm->cfg.ram_size = get_ram_size(kvm->cfg.nrcpus);
 
+	kvm_run_affinity_setup(kvm);
+
 	if (!kvm->cfg.dev)
 		kvm->cfg.dev = DEFAULT_KVM_DEV;
 
@@ -784,10 +1349,15 @@ static struct kvm *kvm_cmd_run_init(int argc, const char **argv)
 
 	if (!kvm->cfg.nodefaults &&
 	    !kvm->cfg.using_rootfs &&
-	    !kvm->cfg.disk_image[0].filename &&
+	    !kvm->nr_disks &&
 	    !kvm->cfg.initrd_filename) {
 		char tmp[PATH_MAX];
 
+#ifdef CONFIG_MICRO
+		die("%s-micro has no 9p root, give it a --disk or an --initrd",
+		    KVM_BINARY_NAME);
+#endif
+
 		kvm_setup_create_new(kvm->cfg.custom_rootfs_name);
 		kvm_setup_resolv(kvm->cfg.custom_rootfs_name);
 
@@ -810,7 +1380,17 @@ static struct kvm *kvm_cmd_run_init(int argc, const char **argv)
 	else
 		kvm_run_set_real_cmdline(kvm);
 
-	if (kvm->cfg.kernel_filename) {
+	if (kvm->cfg.restore_dir) {
+		pr_info("# %s run --restore %s -m %Lu -c %d --name %s",
+			KVM_BINARY_NAME, kvm->cfg.restore_dir,
+			(unsigned long long)kvm->cfg.ram_size >> MB_SHIFT,
+			kvm->cfg.nrcpus, kvm->cfg.guest_name);
+	} else if (kvm->cfg.incoming) {
+		pr_info("# %s run --incoming %s -m %Lu -c %d --name %s",
+			KVM_BINARY_NAME, kvm->cfg.incoming,
+			(unsigned long long)kvm->cfg.ram_size >> MB_SHIFT,
+			kvm->cfg.nrcpus, kvm->cfg.guest_name);
+	} else if (kvm->cfg.kernel_filename) {
 		pr_info("# %s run -k %s -m %Lu -c %d --name %s", KVM_BINARY_NAME,
 			kvm->cfg.kernel_filename,
 			(unsigned long long)kvm->cfg.ram_size >> MB_SHIFT,
@@ -825,6 +1405,11 @@ static struct kvm *kvm_cmd_run_init(int argc, const char **argv)
 	if (init_list__init(kvm) < 0)
 		die ("Initialisation failed");
 
+	if (kvm->cfg.restore_dir && snapshot__restore(kvm) < 0)
+		die("Unable to restore from %s", kvm->cfg.restore_dir);
+	if (kvm->cfg.incoming && migrate__incoming(kvm) < 0)
+		die("Unable to receive a guest on %s", kvm->cfg.incoming);
+
 	return kvm;
 }
 
@@ -832,8 +1417,8 @@ static int kvm_cmd_run_work(struct kvm *kvm)
 {
 	int i;
 
-	for (i = 0; i < kvm->nrcpus; i++) {
-		if (pthread_create(&kvm->cpus[i]->thread, NULL, kvm_cpu_thread, kvm->cpus[i]) != 0)
+	for (i = 0; i < kvm->cfg.nrcpus; i++) {
+		if (pthread_create(&kvm->cpus[i]->thread, NULL, kvm_cpu__thread, kvm->cpus[i]) != 0)
 			die("unable to create KVM VCPU thread");
 	}
 
@@ -1,9 +1,567 @@
 #include "kvm/builtin-sandbox.h"
 #include "kvm/builtin-run.h"
+#include "kvm/parse-options.h"
+#include "kvm/read-write.h"
+#include "kvm/util.h"
+#include "kvm/kvm.h"
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/*
+ * With --pool, lkvm sandbox keeps that many guests booted, each waiting on
+ * its console for a job, and hands them out to the clients of a unix
+ * socket. A guest runs a single job and shuts down, so that the next one
+ * starts clean, and a new guest boots in its place in the background.
+ *
+ * A client writes the command as a sandbox script under /tmp, which guests
+ * see through /host, and sends its path. The pool streams back the output
+ * of the job and then its exit status.
+ */
+#define SANDBOX_POOL_MAX		64
+#define SANDBOX_POOL_READY		"@@lkvm-sandbox-ready@@"
+#define SANDBOX_POOL_EXIT		"@@lkvm-sandbox-exit "
+#define SANDBOX_POOL_LINE		4096
+
+enum {
+	SANDBOX_MSG_OUTPUT	= 1,
+	SANDBOX_MSG_EXIT	= 2,
+};
+
+struct sandbox_msg {
+	u32			type;
+	u32			len;
+};
+
+enum sandbox_vm_state {
+	SANDBOX_VM_NONE,
+	SANDBOX_VM_BOOTING,
+	SANDBOX_VM_READY,
+	SANDBOX_VM_BUSY,
+	/* The job is done, the guest is shutting down */
+	SANDBOX_VM_DONE,
+};
+
+struct sandbox_vm {
+	enum sandbox_vm_state	state;
+	pid_t			pid;
+	/* Master side of the pty that is the console of the guest */
+	int			fd;
+	int			client;
+	size_t			len;
+	char			line[SANDBOX_POOL_LINE];
+};
+
+struct sandbox_client {
+	int			fd;
+	char			script[PATH_MAX];
+};
+
+static int pool_size;
+static const char *pool_socket;
+
+static struct sandbox_vm pool_vms[SANDBOX_POOL_MAX];
+static struct sandbox_client pool_waiting[SANDBOX_POOL_MAX];
+static int pool_nr_waiting;
+static int pool_listen_fd = -1;
+static bool pool_warm;
+static volatile sig_atomic_t pool_stop;
+
+static int run_argc;
+static const char **run_argv;
+
+static const char * const sandbox_usage[] = {
+	"lkvm sandbox [run options] -- <command> [args...]",
+	"lkvm sandbox [run options] --pool <n> --pool-socket <path>",
+	"lkvm sandbox --pool-socket <path> -- <command> [args...]",
+	NULL
+};
+
+static const struct option sandbox_options[] = {
+	OPT_GROUP("Sandbox pool options:"),
+	OPT_INTEGER('\0', "pool", &pool_size,
+		    "Guests to keep booted, waiting for commands"),
+	OPT_STRING('\0', "pool-socket", &pool_socket, "path",
+		   "Socket of the pool, to serve or to send a command to"),
+	OPT_END()
+};
+
+/* What each guest of the pool runs instead of a command */
+static const char sandbox_pool_agent[] =
+	"#! /bin/sh\n"
+	"stty raw -echo 2>/dev/null\n"
+	"echo \"" SANDBOX_POOL_READY "\"\n"
+	"read -r job\n"
+	"/bin/sh \"/host$job\" </dev/null\n"
+	"echo \"" SANDBOX_POOL_EXIT "$?@@\"\n";
+
+static int sandbox_pool__write_msg(int fd, u32 type, const void *data, u32 len)
+{
+	struct sandbox_msg msg = { .type = type, .len = len };
+
+	if (fd < 0)
+		return -EBADF;
+
+	if (write_in_full(fd, &msg, sizeof(msg)) < 0 ||
+	    (len && write_in_full(fd, data, len) < 0))
+		return -errno;
+
+	return 0;
+}
+
+static void sandbox_pool__finish(struct sandbox_vm *vm, int status)
+{
+	s32 code = status;
+
+	sandbox_pool__write_msg(vm->client, SANDBOX_MSG_EXIT, &code,
+				sizeof(code));
+	close(vm->client);
+	vm->client = -1;
+}
+
+static void sandbox_pool__dispatch(struct sandbox_vm *vm,
+				   struct sandbox_client *client)
+{
+	char job[PATH_MAX + 1];
+	int len;
+
+	len = snprintf(job, sizeof(job), "%s\n", client->script);
+	vm->client = client->fd;
+	vm->state = SANDBOX_VM_BUSY;
+
+	if (write_in_full(vm->fd, job, len) < 0) {
+		pr_warning("Unable to hand a job to guest %d", vm->pid);
+		sandbox_pool__finish(vm, -1);
+		vm->state = SANDBOX_VM_DONE;
+	}
+}
+
+/* Hand the oldest waiting client to the guest that just became ready */
+static void sandbox_pool__ready(struct sandbox_vm *vm)
+{
+	vm->state = SANDBOX_VM_READY;
+	pool_warm = true;
+
+	if (!pool_nr_waiting)
+		return;
+
+	sandbox_pool__dispatch(vm, &pool_waiting[0]);
+	memmove(pool_waiting, pool_waiting + 1,
+		--pool_nr_waiting * sizeof(*pool_waiting));
+}
+
+static void sandbox_pool__line(struct sandbox_vm *vm, char *line, size_t len,
+			       bool complete)
+{
+	size_t n = len;
+
+	/* Guests that didn't make the console raw end their lines with \r */
+	while (n && (line[n - 1] == '\r' || line[n - 1] == '\n'))
+		n--;
+
+	switch (vm->state) {
+	case SANDBOX_VM_BOOTING:
+		if (n == strlen(SANDBOX_POOL_READY) &&
+		    !memcmp(line, SANDBOX_POOL_READY, n))
+			sandbox_pool__ready(vm);
+		break;
+	case SANDBOX_VM_BUSY:
+		if (complete && n > strlen(SANDBOX_POOL_EXIT) &&
+		    !memcmp(line, SANDBOX_POOL_EXIT, strlen(SANDBOX_POOL_EXIT))) {
+			sandbox_pool__finish(vm,
+				atoi(line + strlen(SANDBOX_POOL_EXIT)));
+			vm->state = SANDBOX_VM_DONE;
+			break;
+		}
+		sandbox_pool__write_msg(vm->client, SANDBOX_MSG_OUTPUT, line,
+					len);
+		break;
+	default:
+		break;
+	}
+}
+
+static int sandbox_pool__output(struct sandbox_vm *vm)
+{
+	char *start, *end;
+	ssize_t n;
+
+	n = read(vm->fd, vm->line + vm->len, sizeof(vm->line) - vm->len);
+	if (n <= 0)
+		return n < 0 && errno == EINTR ? 0 : -1;
+
+	vm->len += n;
+	start = vm->line;
+	while ((end = memchr(start, '\n', vm->line + vm->len - start))) {
+		end++;
+		sandbox_pool__line(vm, start, end - start, true);
+		start = end;
+	}
+
+	vm->len -= start - vm->line;
+	memmove(vm->line, start, vm->len);
+
+	/* A line that long is only output, pass it on in pieces */
+	if (vm->len == sizeof(vm->line)) {
+		sandbox_pool__line(vm, vm->line, vm->len, false);
+		vm->len = 0;
+	}
+
+	return 0;
+}
+
+static void sandbox_pool__close_fds(void)
+{
+	int i;
+
+	close(pool_listen_fd);
+	for (i = 0; i < SANDBOX_POOL_MAX; i++) {
+		if (pool_vms[i].state != SANDBOX_VM_NONE)
+			close(pool_vms[i].fd);
+		if (pool_vms[i].client >= 0)
+			close(pool_vms[i].client);
+	}
+	for (i = 0; i < pool_nr_waiting; i++)
+		close(pool_waiting[i].fd);
+}
+
+static int sandbox_pool__spawn(struct sandbox_vm *vm, const char *prefix)
+{
+	struct termios term;
+	int master, slave;
+	pid_t pid;
+
+	if (openpty(&master, &slave, NULL, NULL, NULL) < 0)
+		return -errno;
+
+	if (tcgetattr(slave, &term) == 0) {
+		cfmakeraw(&term);
+		tcsetattr(slave, TCSANOW, &term);
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		close(master);
+		close(slave);
+		return -errno;
+	}
+
+	if (pid == 0) {
+		close(master);
+		sandbox_pool__close_fds();
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		setsid();
+		if (dup2(slave, STDIN_FILENO) < 0 ||
+		    dup2(slave, STDOUT_FILENO) < 0)
+			die_perror("dup2");
+		close(slave);
+
+		exit(kvm_cmd_run(run_argc, run_argv, prefix) ? 1 : 0);
+	}
+
+	close(slave);
+
+	*vm = (struct sandbox_vm) {
+		.state	= SANDBOX_VM_BOOTING,
+		.pid	= pid,
+		.fd	= master,
+		.client	= -1,
+	};
+
+	return 0;
+}
+
+static void sandbox_pool__reap(struct sandbox_vm *vm)
+{
+	int status;
+
+	close(vm->fd);
+	waitpid(vm->pid, &status, 0);
+
+	if (vm->client >= 0) {
+		pr_warning("Guest %d exited before its job was done", vm->pid);
+		sandbox_pool__finish(vm, -1);
+	} else if (vm->state == SANDBOX_VM_BOOTING) {
+		/* The first one failing would only fail again */
+		if (!pool_warm && !pool_stop)
+			die("The first sandbox of the pool didn't boot");
+		pr_warning("Guest %d exited while booting", vm->pid);
+	}
+
+	vm->state = SANDBOX_VM_NONE;
+}
+
+static void sandbox_pool__accept(void)
+{
+	struct sandbox_client client;
+	u32 len;
+	int i;
+
+	client.fd = accept(pool_listen_fd, NULL, NULL);
+	if (client.fd < 0)
+		return;
+
+	if (read_in_full(client.fd, &len, sizeof(len)) != sizeof(len) ||
+	    len >= PATH_MAX ||
+	    read_in_full(client.fd, client.script, len) != (ssize_t)len ||
+	    memchr(client.script, '\n', len) || memchr(client.script, 1, len)) {
+		close(client.fd);
+		return;
+	}
+	client.script[len] = '\0';
+
+	for (i = 0; i < pool_size; i++) {
+		if (pool_vms[i].state == SANDBOX_VM_READY) {
+			sandbox_pool__dispatch(&pool_vms[i], &client);
+			return;
+		}
+	}
+
+	if (pool_nr_waiting == SANDBOX_POOL_MAX) {
+		close(client.fd);
+		return;
+	}
+
+	pool_waiting[pool_nr_waiting++] = client;
+}
+
+static int sandbox_pool__listen(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(pool_socket) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, pool_socket);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	unlink(pool_socket);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, SANDBOX_POOL_MAX) < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	return fd;
+}
+
+static void sandbox_pool__sig(int sig)
+{
+	pool_stop = 1;
+}
+
+static const char *sandbox_pool__write_agent(void)
+{
+	static char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%ssandbox-pool.sh", kvm__get_dir());
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+	if (fd < 0)
+		return NULL;
+
+	if (write_in_full(fd, sandbox_pool_agent,
+			  sizeof(sandbox_pool_agent) - 1) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	close(fd);
+	return path;
+}
+
+static int sandbox_pool__serve(int argc, const char **argv, const char *prefix)
+{
+	struct pollfd fds[SANDBOX_POOL_MAX + 1];
+	struct sandbox_vm *vms[SANDBOX_POOL_MAX];
+	const char *agent;
+	int i, nr, r;
+
+	if (pool_size < 1 || pool_size > SANDBOX_POOL_MAX)
+		die("The pool must have between 1 and %d guests",
+		    SANDBOX_POOL_MAX);
+	if (!pool_socket)
+		die("A pool needs --pool-socket");
+	if (argc > 0 && !strcmp(argv[argc - 1], "--"))
+		argc--;
+
+	agent = sandbox_pool__write_agent();
+	if (!agent)
+		die_perror("Unable to write the sandbox pool script");
+
+	/* The guests boot with the run options, running the agent */
+	run_argv = calloc(argc + 3, sizeof(*run_argv));
+	if (!run_argv)
+		die("Out of memory");
+	memcpy(run_argv, argv, argc * sizeof(*argv));
+	run_argv[argc] = "--sandbox";
+	run_argv[argc + 1] = agent;
+	run_argc = argc + 2;
+
+	pool_listen_fd = sandbox_pool__listen();
+	if (pool_listen_fd < 0)
+		die("Unable to listen on %s: %s", pool_socket,
+		    strerror(-pool_listen_fd));
+
+	for (i = 0; i < SANDBOX_POOL_MAX; i++)
+		pool_vms[i].client = -1;
+
+	signal(SIGINT, sandbox_pool__sig);
+	signal(SIGTERM, sandbox_pool__sig);
+	signal(SIGPIPE, SIG_IGN);
+
+	pr_info("Serving %d sandboxes on %s", pool_size, pool_socket);
+
+	while (!pool_stop) {
+		/*
+		 * The first guest may have to set the rootfs up, the others
+		 * only boot once it did.
+		 */
+		for (i = 0; i < (pool_warm ? pool_size : 1); i++) {
+			if (pool_vms[i].state != SANDBOX_VM_NONE)
+				continue;
+			r = sandbox_pool__spawn(&pool_vms[i], prefix);
+			if (r < 0)
+				pr_warning("Unable to start a sandbox: %s",
+					   strerror(-r));
+		}
+
+		fds[0] = (struct pollfd) { .fd = pool_listen_fd, .events = POLLIN };
+		for (i = 0, nr = 1; i < pool_size; i++) {
+			if (pool_vms[i].state == SANDBOX_VM_NONE)
+				continue;
+			vms[nr - 1] = &pool_vms[i];
+			fds[nr++] = (struct pollfd) {
+				.fd	= pool_vms[i].fd,
+				.events	= POLLIN,
+			};
+		}
+
+		if (poll(fds, nr, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die_perror("poll");
+		}
+
+		for (i = 1; i < nr; i++) {
+			if (fds[i].revents && sandbox_pool__output(vms[i - 1]) < 0)
+				sandbox_pool__reap(vms[i - 1]);
+		}
+
+		if (fds[0].revents & POLLIN)
+			sandbox_pool__accept();
+	}
+
+	for (i = 0; i < pool_size; i++) {
+		if (pool_vms[i].state != SANDBOX_VM_NONE)
+			kill(pool_vms[i].pid, SIGTERM);
+	}
+	for (i = 0; i < pool_size; i++) {
+		if (pool_vms[i].state != SANDBOX_VM_NONE)
+			sandbox_pool__reap(&pool_vms[i]);
+	}
+
+	unlink(pool_socket);
+	return 0;
+}
+
+/* Run a command in a guest of the pool, as lkvm sandbox would */
+static int sandbox_pool__run(int argc, const char **argv)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char script[] = "/tmp/lkvm-sandbox-XXXXXX";
+	struct sandbox_msg msg;
+	char buf[SANDBOX_POOL_LINE];
+	s32 code = -1;
+	u32 len;
+	int fd, tmp;
+
+	if (argc > 0 && !strcmp(argv[0], "--")) {
+		argc--;
+		argv++;
+	}
+	if (argc < 1)
+		usage_with_options(sandbox_usage, sandbox_options);
+	if (strlen(pool_socket) >= sizeof(addr.sun_path))
+		die("Socket path too long: %s", pool_socket);
+	strcpy(addr.sun_path, pool_socket);
+
+	tmp = mkstemp(script);
+	if (tmp < 0)
+		die_perror("mkstemp");
+	close(tmp);
+	kvm_run_write_sandbox_cmd(script, argv, argc);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		unlink(script);
+		die("Unable to connect to %s: %s", pool_socket, strerror(errno));
+	}
+
+	len = strlen(script);
+	if (write_in_full(fd, &len, sizeof(len)) < 0 ||
+	    write_in_full(fd, script, len) < 0)
+		goto out;
+
+	while (read_in_full(fd, &msg, sizeof(msg)) == sizeof(msg)) {
+		if (msg.type == SANDBOX_MSG_EXIT) {
+			if (msg.len != sizeof(code) ||
+			    read_in_full(fd, &code, sizeof(code)) != sizeof(code))
+				code = -1;
+			break;
+		}
+
+		while (msg.len) {
+			len = min_t(u32, msg.len, sizeof(buf));
+			if (read_in_full(fd, buf, len) != (ssize_t)len)
+				goto out;
+			if (msg.type == SANDBOX_MSG_OUTPUT)
+				write_in_full(STDOUT_FILENO, buf, len);
+			msg.len -= len;
+		}
+	}
+
+out:
+	close(fd);
+	unlink(script);
+
+	if (code < 0)
+		pr_err("The sandbox didn't run the command");
+
+	return code < 0 ? 255 : code;
+}
 
 int kvm_cmd_sandbox(int argc, const char **argv, const char *prefix)
 {
 	kvm_run_set_wrapper_sandbox();
 
+	argc = parse_options(argc, argv, sandbox_options, sandbox_usage,
+			     PARSE_OPT_KEEP_UNKNOWN | PARSE_OPT_KEEP_DASHDASH |
+			     PARSE_OPT_NO_INTERNAL_HELP);
+
+	if (pool_size)
+		return sandbox_pool__serve(argc, argv, prefix);
+	if (pool_socket)
+		return sandbox_pool__run(argc, argv);
+
 	return kvm_cmd_run(argc, argv, prefix);
 }
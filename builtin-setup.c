@@ -17,13 +17,16 @@
 #include <fcntl.h>
 
 static const char *instance_name;
+static bool overlay;
 
 static const char * const setup_usage[] = {
-	"lkvm setup [name]",
+	"lkvm setup [--overlay] [name]",
 	NULL
 };
 
 static const struct option setup_options[] = {
+	OPT_BOOLEAN('\0', "overlay", &overlay, "Only keep the changes of the"
+		    " guest, over a rootfs shared with the other overlays"),
 	OPT_END()
 };
 
@@ -121,6 +124,27 @@ static const char *guestfs_symlinks[] = {
 	"/etc/ld.so.conf",
 };
 
+/* Whether guestfs_name is an overlay, whose lower directory goes in lower */
+bool kvm_setup_overlay_lower(const char *guestfs_name, char *lower)
+{
+	char link[PATH_MAX];
+
+	snprintf(link, PATH_MAX, "%s%s.lower", kvm__get_dir(), guestfs_name);
+
+	return realpath(link, lower) != NULL;
+}
+
+/* The rootfs holding the files that kvmtool provides to the guest */
+static const char *guestfs_files(const char *guestfs_name)
+{
+	char lower[PATH_MAX];
+
+	if (kvm_setup_overlay_lower(guestfs_name, lower))
+		return KVM_OVERLAY_BASE;
+
+	return guestfs_name;
+}
+
 #ifdef CONFIG_GUEST_INIT
 static int extract_file(const char *guestfs_name, const char *filename,
 			const void *data, size_t size)
@@ -129,7 +153,7 @@ static int extract_file(const char *guestfs_name, const char *filename,
 	int fd, ret;
 
 	snprintf(path, PATH_MAX, "%s%s/%s", kvm__get_dir(),
-				guestfs_name, filename);
+				guestfs_files(guestfs_name), filename);
 
 	fd = open(path, O_EXCL | O_CREAT | O_WRONLY, 0755);
 	if (fd < 0) {
@@ -228,7 +252,8 @@ void kvm_setup_resolv(const char *guestfs_name)
 {
 	char path[PATH_MAX];
 
-	snprintf(path, PATH_MAX, "%s%s/etc/resolv.conf", kvm__get_dir(), guestfs_name);
+	snprintf(path, PATH_MAX, "%s%s/etc/resolv.conf", kvm__get_dir(),
+		 guestfs_files(guestfs_name));
 
 	copy_file("/etc/resolv.conf", path);
 }
@@ -256,6 +281,35 @@ static int do_setup(const char *guestfs_name)
 	return copy_passwd(guestfs_name);
 }
 
+/*
+ * The files of an overlay rootfs are those of the base, set up once, and the
+ * guest writes its changes to its own directory. Only the sandbox script of
+ * the guest is put there by kvmtool.
+ */
+static int do_setup_overlay(const char *guestfs_name)
+{
+	char base[PATH_MAX], link[PATH_MAX];
+	struct stat st;
+	int ret;
+
+	snprintf(base, PATH_MAX, "%s%s", kvm__get_dir(), KVM_OVERLAY_BASE);
+	if (stat(base, &st) < 0) {
+		ret = do_setup(KVM_OVERLAY_BASE);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = make_dir(guestfs_name);
+	if (ret < 0)
+		return ret;
+
+	make_guestfs_dir(guestfs_name, "/virt");
+
+	snprintf(link, PATH_MAX, "%s%s.lower", kvm__get_dir(), guestfs_name);
+
+	return symlink(base, link);
+}
+
 int kvm_setup_create_new(const char *guestfs_name)
 {
 	return do_setup(guestfs_name);
@@ -270,7 +324,7 @@ int kvm_cmd_setup(int argc, const char **argv, const char *prefix)
 	if (instance_name == NULL)
 		kvm_setup_help();
 
-	r = do_setup(instance_name);
+	r = overlay ? do_setup_overlay(instance_name) : do_setup(instance_name);
 	if (r == 0) {
 		pr_info("A new rootfs '%s' has been created in '%s%s'.",
 			instance_name, kvm__get_dir(), instance_name);
@@ -0,0 +1,104 @@
+#include <kvm/util.h>
+#include <kvm/kvm-cmd.h>
+#include <kvm/builtin-snapshot.h>
+#include <kvm/kvm.h>
+#include <kvm/parse-options.h>
+#include <kvm/kvm-ipc.h>
+#include <kvm/read-write.h>
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *instance_name;
+static const char *snapshot_dir;
+static bool incremental;
+
+static const char * const snapshot_usage[] = {
+	"lkvm snapshot [-n name] [-i] <directory>",
+	NULL
+};
+
+static const struct option snapshot_options[] = {
+	OPT_GROUP("General options:"),
+	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
+	OPT_BOOLEAN('i', "incremental", &incremental,
+		    "Only save what changed since the previous incremental"
+		    " snapshot, as a layer over it"),
+	OPT_END()
+};
+
+static void parse_snapshot_options(int argc, const char **argv)
+{
+	while (argc != 0) {
+		argc = parse_options(argc, argv, snapshot_options,
+				     snapshot_usage,
+				     PARSE_OPT_STOP_AT_NON_OPTION);
+		if (argc == 0)
+			break;
+		if (snapshot_dir)
+			kvm_snapshot_help();
+		snapshot_dir = argv[0];
+		argc--;
+		argv++;
+	}
+}
+
+void kvm_snapshot_help(void)
+{
+	usage_with_options(snapshot_usage, snapshot_options);
+}
+
+int kvm_cmd_snapshot(int argc, const char **argv, const char *prefix)
+{
+	char path[PATH_MAX], cwd[PATH_MAX];
+	s32 status;
+	int instance;
+	int r;
+
+	parse_snapshot_options(argc, argv);
+
+	if (instance_name == NULL || snapshot_dir == NULL)
+		kvm_snapshot_help();
+
+	/* The guest doesn't necessarily run from this directory */
+	if (snapshot_dir[0] == '/')
+		r = snprintf(path, sizeof(path), "%s", snapshot_dir);
+	else if (getcwd(cwd, sizeof(cwd)))
+		r = snprintf(path, sizeof(path), "%s/%s", cwd, snapshot_dir);
+	else
+		die_perror("getcwd");
+	if (r >= (int)sizeof(path))
+		die("Snapshot directory path too long");
+
+	instance = kvm__get_sock_by_instance(instance_name);
+
+	if (instance <= 0)
+		die("Failed locating instance");
+
+	r = kvm_ipc__send_msg(instance,
+			      incremental ? KVM_IPC_SNAPSHOT_LAYER :
+					    KVM_IPC_SNAPSHOT, strlen(path),
+			      (u8 *)path);
+	if (r < 0)
+		goto out;
+
+	if (read_in_full(instance, &status, sizeof(status)) != sizeof(status)) {
+		pr_err("Could not retrieve the snapshot status from %s",
+		       instance_name);
+		r = -1;
+		goto out;
+	}
+
+	r = status;
+	if (r < 0)
+		pr_err("Unable to snapshot %s: %s", instance_name, strerror(-r));
+	else
+		printf("Guest %s saved to %s\n", instance_name, path);
+
+out:
+	close(instance);
+
+	return r;
+}
@@ -4,15 +4,42 @@
 #include <kvm/kvm.h>
 #include <kvm/parse-options.h>
 #include <kvm/kvm-ipc.h>
+#include <kvm/kvm-cpu.h>
+#include <kvm/kvm-stats.h>
+#include <kvm/footprint.h>
+#include <kvm/ksm.h>
+#include <kvm/lock-stat.h>
+#include <kvm/disk-stats.h>
+#include <kvm/read-write.h>
+#include <kvm/threadpool.h>
+#include <kvm/virtio.h>
+#include <kvm/virtio-balloon.h>
+#include <kvm/8250-serial.h>
+#include <kvm/uip.h>
 
 #include <sys/select.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 
+#include <linux/kvm.h>
 #include <linux/virtio_balloon.h>
 
 static bool mem;
+static bool disk;
+static bool traps;
+static bool exits;
+static bool pool;
+static bool balloon;
+static bool serial;
+static bool net;
+static bool steal;
+static bool kvm_stats;
+static bool footprint;
+static bool ksm;
+static bool locks;
+static bool vqs;
 static bool all;
 static const char *instance_name;
 
@@ -24,6 +51,30 @@ static const char * const stat_usage[] = {
 static const struct option stat_options[] = {
 	OPT_GROUP("Commands options:"),
 	OPT_BOOLEAN('m', "memory", &mem, "Display memory statistics"),
+	OPT_BOOLEAN('d', "disk", &disk, "Display disk latency statistics"),
+	OPT_BOOLEAN('t', "traps", &traps, "Display I/O trap lookup statistics"),
+	OPT_BOOLEAN('e', "exits", &exits, "Display a live view of vCPU exits"
+		    " and the time spent handling them"),
+	OPT_BOOLEAN('p', "pool", &pool, "Display thread pool queue depths"
+		    " and job latencies"),
+	OPT_BOOLEAN('b', "balloon", &balloon, "Display the state of the"
+		    " automatic balloon controller"),
+	OPT_BOOLEAN('s', "serial", &serial, "Display serial port"
+		    " statistics"),
+	OPT_BOOLEAN('N', "net", &net, "Display the flow tables of the user"
+		    " mode network"),
+	OPT_BOOLEAN('S', "steal", &steal, "Display the time stolen from each"
+		    " vCPU by the host"),
+	OPT_BOOLEAN('k', "kvm", &kvm_stats, "Display the statistics that KVM"
+		    " keeps of the VM and its vCPUs"),
+	OPT_BOOLEAN('f', "footprint", &footprint, "Display the memory of the"
+		    " lkvm process, by what uses it"),
+	OPT_BOOLEAN('K', "ksm", &ksm, "Display how much guest memory KSM"
+		    " merged"),
+	OPT_BOOLEAN('l', "locks", &locks, "Display the contention of each"
+		    " mutex_lock(), with LOCK_STAT=1 builds"),
+	OPT_BOOLEAN('q', "vq", &vqs, "Display the occupancy, kicks and"
+		    " interrupts of each virtqueue"),
 	OPT_GROUP("Instance options:"),
 	OPT_BOOLEAN('a', "all", &all, "All instances"),
 	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
@@ -112,6 +163,1021 @@ static int do_memstat(const char *name, int sock)
 	return 0;
 }
 
+static int do_balloonstat(const char *name, int sock)
+{
+	static const char * const actions[] = {
+		[VIRTIO_BLN_AUTO_HOLD]		= "hold",
+		[VIRTIO_BLN_AUTO_INFLATE]	= "inflate",
+		[VIRTIO_BLN_AUTO_DEFLATE]	= "deflate",
+	};
+	struct virtio_bln_auto_stats st;
+	int r;
+
+	r = kvm_ipc__send(sock, KVM_IPC_BALLOON_STATS);
+	if (r < 0)
+		return r;
+
+	if (read_in_full(sock, &st, sizeof(st)) != sizeof(st)) {
+		pr_err("Could not retrieve balloon stats from %s", name);
+		return -1;
+	}
+
+	printf("\n\n\t*** Balloon controller of %s ***\n\n", name);
+	if (!st.enabled) {
+		printf("\tNot enabled, see --balloon-auto\n\n");
+		return 0;
+	}
+
+	printf("\tLast decision:       %s\n",
+	       st.action < ARRAY_SIZE(actions) ? actions[st.action] : "?");
+	printf("\tHost pressure:       %u.%02u%%\n", st.host_psi / 100,
+	       st.host_psi % 100);
+	printf("\tGuest available:     %llu MB\n",
+	       (unsigned long long)st.guest_avail_mb);
+	printf("\tBalloon target:      %llu MB\n",
+	       (unsigned long long)st.target_mb);
+	printf("\tBalloon actual:      %llu MB\n",
+	       (unsigned long long)st.actual_mb);
+	printf("\tInflations:          %llu\n",
+	       (unsigned long long)st.inflations);
+	printf("\tDeflations:          %llu\n",
+	       (unsigned long long)st.deflations);
+	printf("\tStats timeouts:      %llu\n\n",
+	       (unsigned long long)st.stat_timeouts);
+
+	return 0;
+}
+
+static void print_disk_hist(const char *op, unsigned int size,
+			    struct disk_stats_hist *hist)
+{
+	if (!hist->count)
+		return;
+
+	printf("\t%-6s %-7s %10llu %10.1f %10.1f %10.1f %10.1f\n", op,
+	       disk_stats__size_name(size), (unsigned long long)hist->count,
+	       hist->total_ns / 1000.0 / hist->count,
+	       disk_stats__percentile(hist, 50) / 1000.0,
+	       disk_stats__percentile(hist, 90) / 1000.0,
+	       disk_stats__percentile(hist, 99) / 1000.0);
+}
+
+static int do_diskstat(const char *name, int sock)
+{
+	static const char * const ops[DISK_STATS_NR_OPS] = {
+		[DISK_STATS_READ]	= "read",
+		[DISK_STATS_WRITE]	= "write",
+		[DISK_STATS_FLUSH]	= "flush",
+	};
+	struct disk_stats_msg *msgs;
+	unsigned int op, size;
+	u32 nr, i;
+	int r;
+
+	r = kvm_ipc__send(sock, KVM_IPC_DISK_STATS);
+	if (r < 0)
+		return r;
+
+	if (read_in_full(sock, &nr, sizeof(nr)) != sizeof(nr)) {
+		pr_err("Could not retrieve disk stats from %s", name);
+		return -1;
+	}
+
+	msgs = calloc(nr, sizeof(*msgs));
+	if (!msgs)
+		return -ENOMEM;
+
+	r = read_in_full(sock, msgs, nr * sizeof(*msgs));
+	if (r != (int)(nr * sizeof(*msgs))) {
+		pr_err("Could not retrieve disk stats from %s", name);
+		free(msgs);
+		return -1;
+	}
+
+	printf("\n\n\t*** Disk latency statistics for %s (in usecs) ***\n", name);
+	for (i = 0; i < nr; i++) {
+		printf("\n\tDisk %u:\n", msgs[i].index);
+		printf("\t%-6s %-7s %10s %10s %10s %10s %10s\n", "op", "size",
+		       "requests", "mean", "p50", "p90", "p99");
+
+		for (op = 0; op < DISK_STATS_NR_OPS; op++)
+			for (size = 0; size < DISK_STATS_NR_SIZES; size++)
+				print_disk_hist(ops[op], size,
+						&msgs[i].stats.hist[op][size]);
+
+		if (msgs[i].stats.bounced)
+			printf("\tO_DIRECT requests bounced: %llu\n",
+			       (unsigned long long)msgs[i].stats.bounced);
+		if (msgs[i].stats.nowait_reads)
+			printf("\tReads served inline from the page cache: %llu of %llu (%.1f%%)\n",
+			       (unsigned long long)msgs[i].stats.nowait_hits,
+			       (unsigned long long)msgs[i].stats.nowait_reads,
+			       100.0 * msgs[i].stats.nowait_hits /
+			       msgs[i].stats.nowait_reads);
+		if (msgs[i].stats.ra_bytes)
+			printf("\tReadahead: %llu bytes, %llu reads within it, %llu past it\n",
+			       (unsigned long long)msgs[i].stats.ra_bytes,
+			       (unsigned long long)msgs[i].stats.ra_hits,
+			       (unsigned long long)msgs[i].stats.ra_misses);
+	}
+	printf("\n");
+
+	free(msgs);
+
+	return 0;
+}
+
+static void print_trap_stats(const char *bus, u64 hits, u64 misses)
+{
+	u64 total = hits + misses;
+
+	printf("\t%-6s %12llu %12llu %7.1f%%\n", bus,
+	       (unsigned long long)hits, (unsigned long long)misses,
+	       total ? hits * 100.0 / total : 0.0);
+}
+
+static int do_trapstat(const char *name, int sock)
+{
+	struct kvm_iotrap_stats *stats, sum = {};
+	u32 nr, i, bus;
+	int r;
+
+	r = kvm_ipc__send(sock, KVM_IPC_IOTRAP_STATS);
+	if (r < 0)
+		return r;
+
+	if (read_in_full(sock, &nr, sizeof(nr)) != sizeof(nr)) {
+		pr_err("Could not retrieve I/O trap stats from %s", name);
+		return -1;
+	}
+
+	stats = calloc(nr, sizeof(*stats));
+	if (!stats)
+		return -ENOMEM;
+
+	r = read_in_full(sock, stats, nr * sizeof(*stats));
+	if (r != (int)(nr * sizeof(*stats))) {
+		pr_err("Could not retrieve I/O trap stats from %s", name);
+		free(stats);
+		return -1;
+	}
+
+	printf("\n\n\t*** I/O trap lookups for %s ***\n", name);
+	for (i = 0; i < nr; i++) {
+		printf("\n\tvCPU %u:\n", i);
+		printf("\t%-6s %12s %12s %8s\n", "bus", "cached", "searched",
+		       "hit rate");
+		print_trap_stats("mmio", stats[i].buses[KVM_IOTRAP_BUS_MMIO].hits,
+				 stats[i].buses[KVM_IOTRAP_BUS_MMIO].misses);
+		print_trap_stats("pio", stats[i].buses[KVM_IOTRAP_BUS_PIO].hits,
+				 stats[i].buses[KVM_IOTRAP_BUS_PIO].misses);
+
+		for (bus = 0; bus < KVM_IOTRAP_NR_BUSES; bus++) {
+			sum.buses[bus].hits += stats[i].buses[bus].hits;
+			sum.buses[bus].misses += stats[i].buses[bus].misses;
+		}
+	}
+
+	printf("\n\tTotal:\n");
+	print_trap_stats("mmio", sum.buses[KVM_IOTRAP_BUS_MMIO].hits,
+			 sum.buses[KVM_IOTRAP_BUS_MMIO].misses);
+	print_trap_stats("pio", sum.buses[KVM_IOTRAP_BUS_PIO].hits,
+			 sum.buses[KVM_IOTRAP_BUS_PIO].misses);
+	printf("\n");
+
+	free(stats);
+
+	return 0;
+}
+
+static int do_poolstat(const char *name, int sock)
+{
+	struct thread_pool__stats *stats;
+	u32 nr, i;
+	int r;
+
+	r = kvm_ipc__send(sock, KVM_IPC_THREADPOOL_STATS);
+	if (r < 0)
+		return r;
+
+	if (read_in_full(sock, &nr, sizeof(nr)) != sizeof(nr)) {
+		pr_err("Could not retrieve thread pool stats from %s", name);
+		return -1;
+	}
+
+	stats = calloc(nr, sizeof(*stats));
+	if (!stats && nr)
+		return -ENOMEM;
+
+	r = read_in_full(sock, stats, nr * sizeof(*stats));
+	if (r != (int)(nr * sizeof(*stats))) {
+		pr_err("Could not retrieve thread pool stats from %s", name);
+		free(stats);
+		return -1;
+	}
+
+	printf("\n\n\t*** Thread pool workers of %s ***\n\n", name);
+	printf("\t%-8s %12s %12s %8s %8s %10s %10s\n", "worker", "jobs",
+	       "stolen", "queued", "max", "wait us", "run us");
+	for (i = 0; i < nr; i++) {
+		printf("\t%-8u %12llu %12llu %8llu %8llu", i,
+		       (unsigned long long)stats[i].jobs,
+		       (unsigned long long)stats[i].stolen,
+		       (unsigned long long)stats[i].depth,
+		       (unsigned long long)stats[i].max_depth);
+		if (stats[i].jobs)
+			printf(" %10.1f %10.1f\n",
+			       stats[i].wait_ns / 1e3 / stats[i].jobs,
+			       stats[i].run_ns / 1e3 / stats[i].jobs);
+		else
+			printf(" %10s %10s\n", "-", "-");
+	}
+	printf("\n");
+
+	free(stats);
+
+	return 0;
+}
+
+static int do_serialstat(const char *name, int sock)
+{
+	struct serial8250_stats *stats;
+	u32 nr, i;
+	int r;
+
+	r = kvm_ipc__send(sock, KVM_IPC_SERIAL_STATS);
+	if (r < 0)
+		return r;
+
+	if (read_in_full(sock, &nr, sizeof(nr)) != sizeof(nr)) {
+		pr_err("Could not retrieve serial stats from %s", name);
+		return -1;
+	}
+
+	stats = calloc(nr, sizeof(*stats));
+	if (!stats && nr)
+		return -ENOMEM;
+
+	r = read_in_full(sock, stats, nr * sizeof(*stats));
+	if (r != (int)(nr * sizeof(*stats))) {
+		pr_err("Could not retrieve serial stats from %s", name);
+		free(stats);
+		return -1;
+	}
+
+	printf("\n\n\t*** Serial port output of %s ***\n\n", name);
+	printf("\t%-6s %14s %12s %10s %12s %10s\n", "port", "bytes", "writes",
+	       "stalls", "bytes/s", "queued");
+	for (i = 0; i < nr; i++)
+		printf("\tttyS%-2u %14llu %12llu %10llu %12llu %10llu\n", i,
+		       (unsigned long long)stats[i].tx_bytes,
+		       (unsigned long long)stats[i].tx_writes,
+		       (unsigned long long)stats[i].tx_stalls,
+		       (unsigned long long)stats[i].tx_rate,
+		       (unsigned long long)stats[i].tx_ring);
+	printf("\n\t*** Serial port input of %s ***\n\n", name);
+	printf("\t%-6s %14s %12s %10s\n", "port", "bytes", "interrupts",
+	       "bytes/irq");
+	for (i = 0; i < nr; i++)
+		printf("\tttyS%-2u %14llu %12llu %10llu\n", i,
+		       (unsigned long long)stats[i].rx_bytes,
+		       (unsigned long long)stats[i].rx_irqs,
+		       (unsigned long long)(stats[i].rx_irqs ?
+			stats[i].rx_bytes / stats[i].rx_irqs : 0));
+	printf("\n");
+
+	free(stats);
+
+	return 0;
+}
+
+static void print_flow_stats(u32 dev, const char *proto,
+			     struct uip_flow_stats *stats)
+{
+	printf("\tnet%-3u %-5s %8u %8u %6u %8u %14llu %12llu %8.2f\n", dev,
+	       proto, stats->flows, stats->buckets, stats->longest_chain,
+	       stats->resizes, (unsigned long long)stats->lookups,
+	       (unsigned long long)stats->misses,
+	       stats->lookups ? (double)stats->probes / stats->lookups : 0.0);
+}
+
+static int do_netstat(const char *name, int sock)
+{
+	struct uip_flow_stats *stats;
+	u32 nr, i;
+	int r;
+
+	r = kvm_ipc__send(sock, KVM_IPC_NET_STATS);
+	if (r < 0)
+		return r;
+
+	if (read_in_full(sock, &nr, sizeof(nr)) != sizeof(nr)) {
+		pr_err("Could not retrieve network stats from %s", name);
+		return -1;
+	}
+
+	/* A TCP then a UDP table for each NIC */
+	stats = calloc(nr * 2, sizeof(*stats));
+	if (!stats && nr)
+		return -ENOMEM;
+
+	r = read_in_full(sock, stats, nr * 2 * sizeof(*stats));
+	if (r != (int)(nr * 2 * sizeof(*stats))) {
+		pr_err("Could not retrieve network stats from %s", name);
+		free(stats);
+		return -1;
+	}
+
+	printf("\n\n\t*** User mode network flows of %s ***\n\n", name);
+	printf("\t%-6s %-5s %8s %8s %6s %8s %14s %12s %8s\n", "nic", "proto",
+	       "flows", "buckets", "chain", "resizes", "lookups", "misses",
+	       "probes");
+	for (i = 0; i < nr; i++) {
+		if (!stats[i * 2].buckets)
+			continue;
+		print_flow_stats(i, "tcp", &stats[i * 2]);
+		print_flow_stats(i, "udp", &stats[i * 2 + 1]);
+	}
+	printf("\n");
+
+	free(stats);
+
+	return 0;
+}
+
+#define EXIT_STATS_TOP_TRAPS	20
+
+struct exit_sample {
+	u64				time;
+	u32				nr_cpus;
+	struct kvm_cpu_exit_stats	*cpus;
+	u32				nr_traps;
+	struct kvm_iotrap_profile	*traps;
+};
+
+static void free_exit_sample(struct exit_sample *sample)
+{
+	free(sample->cpus);
+	free(sample->traps);
+	*sample = (struct exit_sample) {};
+}
+
+/* Take the next sample out of the replies to the streamed request */
+static int read_exit_sample(const char *name, int sock,
+			    struct exit_sample *sample)
+{
+	static void *buf;
+	static size_t size;
+	struct kvm_ipc_frame frame;
+	ssize_t len, off;
+
+	*sample = (struct exit_sample) {};
+
+	len = kvm_ipc__read_reply(sock, &frame, &buf, &size);
+	if (len < 0 || frame.status < 0 || len < (ssize_t)sizeof(u32))
+		goto err;
+
+	sample->time = kvm_cpu__now();
+	memcpy(&sample->nr_cpus, buf, sizeof(u32));
+	off = sizeof(u32);
+
+	sample->cpus = calloc(sample->nr_cpus, sizeof(*sample->cpus));
+	if (!sample->cpus)
+		return -ENOMEM;
+
+	if (len - off < (ssize_t)(sample->nr_cpus * sizeof(*sample->cpus) +
+				  sizeof(u32)))
+		goto err;
+	memcpy(sample->cpus, buf + off, sample->nr_cpus * sizeof(*sample->cpus));
+	off += sample->nr_cpus * sizeof(*sample->cpus);
+	memcpy(&sample->nr_traps, buf + off, sizeof(u32));
+	off += sizeof(u32);
+
+	sample->traps = calloc(sample->nr_traps, sizeof(*sample->traps));
+	if (!sample->traps && sample->nr_traps)
+		goto err;
+
+	if (len - off < (ssize_t)(sample->nr_traps * sizeof(*sample->traps)))
+		goto err;
+	memcpy(sample->traps, buf + off, sample->nr_traps * sizeof(*sample->traps));
+
+	return 0;
+err:
+	pr_err("Could not retrieve exit stats from %s", name);
+	free_exit_sample(sample);
+	return -1;
+}
+
+static struct kvm_iotrap_profile *find_trap(struct exit_sample *sample,
+					    struct kvm_iotrap_profile *trap)
+{
+	u32 i;
+
+	for (i = 0; i < sample->nr_traps; i++)
+		if (sample->traps[i].addr == trap->addr &&
+		    sample->traps[i].bus == trap->bus)
+			return &sample->traps[i];
+
+	return NULL;
+}
+
+static int cmp_trap_ns(const void *a, const void *b)
+{
+	const struct kvm_iotrap_profile *ta = a, *tb = b;
+
+	if (ta->ns == tb->ns)
+		return 0;
+
+	return ta->ns < tb->ns ? 1 : -1;
+}
+
+/* Print what happened since @prev, or since the start if it is empty */
+static void print_exit_sample(const char *name, struct exit_sample *cur,
+			      struct exit_sample *prev)
+{
+	static const char * const buses[KVM_IOTRAP_NR_BUSES + 1] = {
+		[KVM_IOTRAP_BUS_MMIO]	= "mmio",
+		[KVM_IOTRAP_BUS_PIO]	= "pio",
+		[KVM_IOTRAP_NR_BUSES]	= "other",
+	};
+	struct kvm_iotrap_profile *traps;
+	struct kvm_cpu_halt_stats halt;
+	u64 count, ns, total_ns = 0;
+	u32 cpu, reason, i, nr = 0;
+	double secs = 0;
+
+	if (prev->time)
+		secs = (cur->time - prev->time) / 1e9;
+
+	if (secs)
+		printf("\n\t*** vCPU exits for %s, per second ***\n", name);
+	else
+		printf("\n\t*** vCPU exits for %s, since start ***\n", name);
+
+	printf("\n\t%-16s %12s %12s\n", "reason", "exits", "usecs");
+	for (reason = 0; reason < KVM_CPU_NR_EXIT_REASONS; reason++) {
+		count = ns = 0;
+		for (cpu = 0; cpu < cur->nr_cpus; cpu++) {
+			count += cur->cpus[cpu].reasons[reason].count;
+			ns += cur->cpus[cpu].reasons[reason].ns;
+			if (cpu < prev->nr_cpus) {
+				count -= prev->cpus[cpu].reasons[reason].count;
+				ns -= prev->cpus[cpu].reasons[reason].ns;
+			}
+		}
+
+		if (!count)
+			continue;
+
+		if (kvm_cpu__exit_reason(reason))
+			printf("\t%-16s", kvm_cpu__exit_reason(reason));
+		else
+			printf("\t%-16u", reason);
+		printf(" %12.0f %12.0f\n", secs ? count / secs : count,
+		       (secs ? ns / secs : ns) / 1000.0);
+	}
+
+	printf("\n\t%-16s %12s %12s %12s %8s %10s\n", "vCPU", "exits", "busy",
+	       "wakeups", "polled", "avg wait");
+	for (cpu = 0; cpu < cur->nr_cpus; cpu++) {
+		halt = cur->cpus[cpu].halt;
+		count = ns = 0;
+		for (reason = 0; reason < KVM_CPU_NR_EXIT_REASONS; reason++) {
+			count += cur->cpus[cpu].reasons[reason].count;
+			ns += cur->cpus[cpu].reasons[reason].ns;
+			if (cpu < prev->nr_cpus) {
+				count -= prev->cpus[cpu].reasons[reason].count;
+				ns -= prev->cpus[cpu].reasons[reason].ns;
+			}
+		}
+
+		if (cpu < prev->nr_cpus) {
+			halt.polls -= prev->cpus[cpu].halt.polls;
+			halt.successful_polls -= prev->cpus[cpu].halt.successful_polls;
+			halt.wakeups -= prev->cpus[cpu].halt.wakeups;
+			halt.wait_ns -= prev->cpus[cpu].halt.wait_ns;
+		}
+
+		printf("\t%-16u %12.0f", cpu, secs ? count / secs : count);
+		if (secs)
+			printf(" %11.1f%%", ns / (secs * 1e7));
+		else
+			printf(" %10.0fms", ns / 1e6);
+
+		/* Wakeups from halts, the halts polling ended, time asleep */
+		printf(" %12.0f", secs ? halt.wakeups / secs : halt.wakeups);
+		if (halt.polls)
+			printf(" %7.1f%%", halt.successful_polls * 100.0 / halt.polls);
+		else
+			printf(" %8s", "-");
+		if (halt.wakeups)
+			printf(" %8.0fus\n", halt.wait_ns / 1e3 / halt.wakeups);
+		else
+			printf(" %10s\n", "-");
+	}
+
+	traps = calloc(cur->nr_traps, sizeof(*traps));
+	if (!traps)
+		return;
+
+	for (i = 0; i < cur->nr_traps; i++) {
+		struct kvm_iotrap_profile *old = find_trap(prev, &cur->traps[i]);
+
+		traps[nr] = cur->traps[i];
+		if (old) {
+			traps[nr].count -= old->count;
+			traps[nr].ns -= old->ns;
+		}
+		total_ns += traps[nr].ns;
+		if (traps[nr].count)
+			nr++;
+	}
+	qsort(traps, nr, sizeof(*traps), cmp_trap_ns);
+
+	printf("\n\t%-6s %-18s %12s %12s %8s %6s\n", "bus", "trap", "accesses",
+	       "usecs", "avg ns", "time");
+	for (i = 0; i < min_t(u32, nr, EXIT_STATS_TOP_TRAPS); i++) {
+		printf("\t%-6s 0x%-16llx %12.0f %12.0f %8llu %5.1f%%\n",
+		       buses[min_t(u32, traps[i].bus, KVM_IOTRAP_NR_BUSES)],
+		       (unsigned long long)traps[i].addr,
+		       secs ? traps[i].count / secs : traps[i].count,
+		       (secs ? traps[i].ns / secs : traps[i].ns) / 1000.0,
+		       (unsigned long long)(traps[i].ns / traps[i].count),
+		       traps[i].ns * 100.0 / total_ns);
+	}
+	printf("\n");
+
+	free(traps);
+}
+
+static int do_exitstat(const char *name, int sock, bool live)
+{
+	struct exit_sample prev = {}, cur;
+	int r;
+
+	/* Have the samples sent every second, rather than asking each time */
+	if (kvm_ipc__hello(sock) < KVM_IPC_VERSION ||
+	    kvm_ipc__request(sock, KVM_IPC_EXIT_STATS, 1, live ? 1000 : 0,
+			     0, NULL) < 0) {
+		pr_err("Could not request exit stats from %s", name);
+		return -1;
+	}
+
+	r = read_exit_sample(name, sock, &cur);
+	if (r < 0)
+		return r;
+
+	print_exit_sample(name, &cur, &prev);
+
+	while (live) {
+		prev = cur;
+
+		r = read_exit_sample(name, sock, &cur);
+		if (r < 0)
+			break;
+
+		/* Clear the terminal, top-style */
+		printf("\033[H\033[2J");
+		print_exit_sample(name, &cur, &prev);
+		fflush(stdout);
+		free_exit_sample(&prev);
+	}
+
+	free_exit_sample(live ? &prev : &cur);
+
+	return r;
+}
+
+static int do_stealstat(const char *name, int sock)
+{
+	u64 *stolen;
+	u32 nr, i;
+	int r;
+
+	r = kvm_ipc__send(sock, KVM_IPC_STEAL_STATS);
+	if (r < 0)
+		return r;
+
+	if (read_in_full(sock, &nr, sizeof(nr)) != sizeof(nr)) {
+		pr_err("Could not retrieve stolen time from %s", name);
+		return -1;
+	}
+
+	stolen = calloc(nr, sizeof(*stolen));
+	if (!stolen && nr)
+		return -ENOMEM;
+
+	r = read_in_full(sock, stolen, nr * sizeof(*stolen));
+	if (r != (int)(nr * sizeof(*stolen))) {
+		pr_err("Could not retrieve stolen time from %s", name);
+		free(stolen);
+		return -1;
+	}
+
+	printf("\n\n\t*** Stolen time of %s ***\n\n", name);
+	printf("\t%-6s %16s\n", "vCPU", "stolen (us)");
+	for (i = 0; i < nr; i++) {
+		if (stolen[i] == KVM_CPU_NO_STEAL_TIME)
+			printf("\t%-6u %16s\n", i, "-");
+		else
+			printf("\t%-6u %16llu\n", i,
+			       (unsigned long long)stolen[i] / 1000);
+	}
+	printf("\n");
+
+	free(stolen);
+
+	return 0;
+}
+
+static const char *kvm_stat_unit(struct kvm_stats_record *rec)
+{
+	switch (rec->flags & KVM_STATS_UNIT_MASK) {
+	case KVM_STATS_UNIT_BYTES:
+		return "bytes";
+	case KVM_STATS_UNIT_CYCLES:
+		return "cycles";
+	case KVM_STATS_UNIT_SECONDS:
+		switch (rec->exponent) {
+		case -9:
+			return "ns";
+		case -6:
+			return "us";
+		case -3:
+			return "ms";
+		case 0:
+			return "s";
+		}
+		return "?s";
+	}
+
+	return "";
+}
+
+/* Of the vCPUs, the total of each statistic but the peaks, the maximum */
+static u32 sum_kvm_stats(struct kvm_stats_record *recs, u32 nr,
+			 struct kvm_stats_record *sum, u64 *max)
+{
+	u32 i, j, nr_sum = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (recs[i].vcpu == KVM_STATS_VM)
+			continue;
+
+		for (j = 0; j < nr_sum; j++) {
+			if (!strcmp(sum[j].name, recs[i].name))
+				break;
+		}
+
+		if (j == nr_sum) {
+			sum[nr_sum++] = recs[i];
+			max[j] = recs[i].value;
+			continue;
+		}
+
+		max[j] = max_t(u64, max[j], recs[i].value);
+		if ((recs[i].flags & KVM_STATS_TYPE_MASK) == KVM_STATS_TYPE_PEAK)
+			sum[j].value = max[j];
+		else
+			sum[j].value += recs[i].value;
+	}
+
+	return nr_sum;
+}
+
+static int do_kvmstat(const char *name, int sock)
+{
+	struct kvm_stats_record *recs, *sum;
+	u32 nr, nr_sum, i;
+	u64 *max;
+	int r;
+
+	r = kvm_ipc__send(sock, KVM_IPC_KVM_STATS);
+	if (r < 0)
+		return r;
+
+	if (read_in_full(sock, &nr, sizeof(nr)) != sizeof(nr)) {
+		pr_err("Could not retrieve KVM stats from %s", name);
+		return -1;
+	}
+
+	recs = calloc(nr, sizeof(*recs));
+	sum = calloc(nr, sizeof(*sum));
+	max = calloc(nr, sizeof(*max));
+	if ((!recs || !sum || !max) && nr) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = read_in_full(sock, recs, nr * sizeof(*recs));
+	if (r != (int)(nr * sizeof(*recs))) {
+		pr_err("Could not retrieve KVM stats from %s", name);
+		r = -1;
+		goto out;
+	}
+	r = 0;
+
+	if (!nr) {
+		printf("\n\tKVM of %s has no binary statistics\n\n", name);
+		goto out;
+	}
+
+	printf("\n\n\t*** KVM statistics of %s ***\n\n", name);
+	printf("\t%-32s %18s %s\n", "VM", "value", "unit");
+	for (i = 0; i < nr; i++) {
+		recs[i].name[KVM_STATS_NAME_LEN - 1] = '\0';
+		if (recs[i].vcpu != KVM_STATS_VM || !recs[i].value)
+			continue;
+		printf("\t%-32s %18llu %s\n", recs[i].name,
+		       (unsigned long long)recs[i].value, kvm_stat_unit(&recs[i]));
+	}
+
+	nr_sum = sum_kvm_stats(recs, nr, sum, max);
+
+	printf("\n\t%-32s %18s %18s %s\n", "vCPUs", "total", "max", "unit");
+	for (i = 0; i < nr_sum; i++) {
+		if (!sum[i].value)
+			continue;
+		printf("\t%-32s %18llu %18llu %s\n", sum[i].name,
+		       (unsigned long long)sum[i].value,
+		       (unsigned long long)max[i], kvm_stat_unit(&sum[i]));
+	}
+	printf("\n");
+
+out:
+	free(max);
+	free(sum);
+	free(recs);
+
+	return r;
+}
+
+static int do_footprint(const char *name, int sock)
+{
+	static const char * const kinds[] = {
+		[KVM_FOOTPRINT_RAM]	= "guest RAM",
+		[KVM_FOOTPRINT_DEVICE]	= "device memory",
+		[KVM_FOOTPRINT_STACKS]	= "thread stacks",
+		[KVM_FOOTPRINT_HEAP]	= "heap",
+		[KVM_FOOTPRINT_CODE]	= "code",
+		[KVM_FOOTPRINT_FILES]	= "file mappings",
+		[KVM_FOOTPRINT_OTHER]	= "other",
+	};
+	struct kvm_footprint fp;
+	u64 rss = 0, size = 0;
+	int r, i;
+
+	r = kvm_ipc__send(sock, KVM_IPC_FOOTPRINT);
+	if (r < 0)
+		return r;
+
+	if (read_in_full(sock, &fp, sizeof(fp)) != sizeof(fp)) {
+		pr_err("Could not retrieve the memory footprint of %s", name);
+		return -1;
+	}
+
+	printf("\n\n\t*** Memory footprint of %s ***\n\n", name);
+	printf("\t%-16s %14s %14s\n", "", "RSS (kB)", "mapped (kB)");
+	for (i = 0; i < KVM_FOOTPRINT_NR; i++) {
+		printf("\t%-16s %14llu %14llu\n", kinds[i],
+		       (unsigned long long)fp.rss[i] >> 10,
+		       (unsigned long long)fp.size[i] >> 10);
+		rss += fp.rss[i];
+		size += fp.size[i];
+	}
+	printf("\t%-16s %14llu %14llu\n", "total", (unsigned long long)rss >> 10,
+	       (unsigned long long)size >> 10);
+	printf("\t%-16s %14llu %14llu\n", "without RAM",
+	       (unsigned long long)(rss - fp.rss[KVM_FOOTPRINT_RAM]) >> 10,
+	       (unsigned long long)(size - fp.size[KVM_FOOTPRINT_RAM]) >> 10);
+	printf("\n\t%u threads, %u stacks found\n\n", fp.nr_threads,
+	       fp.nr_stacks);
+
+	return 0;
+}
+
+static int do_ksmstat(const char *name, int sock)
+{
+	static const char * const merges[] = {
+		[KVM_MEM_MERGE_ON]	= "on",
+		[KVM_MEM_MERGE_NOHUGE]	= "nohuge",
+		[KVM_MEM_MERGE_OFF]	= "off",
+	};
+	long pagesize = getpagesize();
+	struct kvm_ksm_stats st;
+	u32 i;
+	int r;
+
+	r = kvm_ipc__send(sock, KVM_IPC_KSM_STATS);
+	if (r < 0)
+		return r;
+
+	if (read_in_full(sock, &st, sizeof(st)) != sizeof(st)) {
+		pr_err("Could not retrieve the KSM stats of %s", name);
+		return -1;
+	}
+
+	printf("\n\n\t*** KSM of %s ***\n\n", name);
+	printf("\tksmd:                %s\n", st.ksmd_run < 0 ? "unknown" :
+	       st.ksmd_run == 1 ? "running" : "stopped");
+	printf("\tWhole process:       %s\n", st.merge_any ? "on" : "off");
+	for (i = 0; i < min_t(u32, st.nr_banks, KVM_MAX_NUMA_BANKS); i++)
+		printf("\tRAM bank %u:          %s\n", i,
+		       st.bank_merge[i] < ARRAY_SIZE(merges) ?
+		       merges[st.bank_merge[i]] : "?");
+
+	if (!st.available) {
+		printf("\n\tThe kernel has no KSM stats of processes\n\n");
+		return 0;
+	}
+
+	printf("\tMerged pages:        %llu (%llu kB)\n",
+	       (unsigned long long)st.merging_pages,
+	       (unsigned long long)st.merging_pages * pagesize >> 10);
+	printf("\tMerged zero pages:   %llu (%llu kB)\n",
+	       (unsigned long long)st.zero_pages,
+	       (unsigned long long)st.zero_pages * pagesize >> 10);
+	printf("\tRmap items:          %llu\n",
+	       (unsigned long long)st.rmap_items);
+	printf("\tProfit:              %lld kB\n\n",
+	       (long long)st.profit / 1024);
+
+	return 0;
+}
+
+static int do_vqstat(const char *name, int sock)
+{
+	struct virtio_vq_stats_msg *msgs;
+	struct virtio_vq_stats *st;
+	u32 nr, i;
+	int r;
+
+	r = kvm_ipc__send(sock, KVM_IPC_VQ_STATS);
+	if (r < 0)
+		return r;
+
+	if (read_in_full(sock, &nr, sizeof(nr)) != sizeof(nr)) {
+		pr_err("Could not retrieve virtqueue stats from %s", name);
+		return -1;
+	}
+
+	msgs = calloc(nr, sizeof(*msgs));
+	if (!msgs && nr)
+		return -ENOMEM;
+
+	r = read_in_full(sock, msgs, nr * sizeof(*msgs));
+	if (r != (int)(nr * sizeof(*msgs))) {
+		pr_err("Could not retrieve virtqueue stats from %s", name);
+		free(msgs);
+		return -1;
+	}
+
+	printf("\n\n\t*** Virtqueues of %s ***\n\n", name);
+	printf("\t%-12s %5s %10s %10s %10s %10s %8s %8s %6s\n", "device",
+	       "queue", "requests", "kicks", "irqs", "suppressed", "req/kick",
+	       "avail", "max");
+	for (i = 0; i < nr; i++) {
+		st = &msgs[i].stats;
+		if (!st->pops && !st->kicks && !st->irqs)
+			continue;
+
+		msgs[i].device[sizeof(msgs[i].device) - 1] = '\0';
+		printf("\t%-12s %5u %10llu %10llu %10llu %10llu ",
+		       msgs[i].device, msgs[i].queue,
+		       (unsigned long long)st->pops,
+		       (unsigned long long)st->kicks,
+		       (unsigned long long)st->irqs,
+		       (unsigned long long)st->suppressed);
+		if (st->kicks)
+			printf("%8.2f ", (double)st->pops / st->kicks);
+		else
+			printf("%8s ", "-");
+		if (st->avail_samples)
+			printf("%8.2f %6llu\n",
+			       (double)st->avail_total / st->avail_samples,
+			       (unsigned long long)st->avail_max);
+		else
+			printf("%8s %6s\n", "-", "-");
+	}
+	printf("\n");
+
+	free(msgs);
+
+	return 0;
+}
+
+static int cmp_lock_wait(const void *a, const void *b)
+{
+	const struct kvm_lock_stat *la = a, *lb = b;
+
+	if (la->wait_ns == lb->wait_ns)
+		return la->acquired < lb->acquired ? 1 : -1;
+
+	return la->wait_ns < lb->wait_ns ? 1 : -1;
+}
+
+static int do_lockstat(const char *name, int sock)
+{
+	struct kvm_lock_stat_hdr hdr;
+	struct kvm_lock_stat *recs;
+	u32 i;
+	int r;
+
+	r = kvm_ipc__send(sock, KVM_IPC_LOCK_STATS);
+	if (r < 0)
+		return r;
+
+	if (read_in_full(sock, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    hdr.nr > KVM_LOCK_STAT_MAX) {
+		pr_err("Could not retrieve lock statistics from %s", name);
+		return -1;
+	}
+
+	printf("\n\n\t*** Lock contention of %s ***\n\n", name);
+	if (!hdr.enabled) {
+		printf("\tlkvm was not built with LOCK_STAT=1\n\n");
+		return 0;
+	}
+
+	recs = calloc(hdr.nr, sizeof(*recs));
+	if (!recs && hdr.nr)
+		return -ENOMEM;
+
+	if (read_in_full(sock, recs, hdr.nr * sizeof(*recs)) !=
+	    (ssize_t)(hdr.nr * sizeof(*recs))) {
+		pr_err("Could not retrieve lock statistics from %s", name);
+		free(recs);
+		return -1;
+	}
+	qsort(recs, hdr.nr, sizeof(*recs), cmp_lock_wait);
+
+	printf("\t%-48s %12s %12s %12s %10s %12s\n", "site", "acquired",
+	       "contended", "wait us", "max us", "hold us");
+	for (i = 0; i < hdr.nr; i++) {
+		recs[i].site[sizeof(recs[i].site) - 1] = '\0';
+		printf("\t%-48s %12llu %12llu %12llu %10llu %12llu\n",
+		       recs[i].site, (unsigned long long)recs[i].acquired,
+		       (unsigned long long)recs[i].contended,
+		       (unsigned long long)recs[i].wait_ns / 1000,
+		       (unsigned long long)recs[i].max_wait_ns / 1000,
+		       (unsigned long long)recs[i].hold_ns / 1000);
+	}
+	printf("\n");
+
+	free(recs);
+	return 0;
+}
+
+static int do_stat(const char *name, int sock)
+{
+	int r = 0;
+
+	if (mem)
+		r = do_memstat(name, sock);
+
+	if (!r && disk)
+		r = do_diskstat(name, sock);
+
+	if (!r && traps)
+		r = do_trapstat(name, sock);
+
+	if (!r && pool)
+		r = do_poolstat(name, sock);
+
+	if (!r && balloon)
+		r = do_balloonstat(name, sock);
+
+	if (!r && serial)
+		r = do_serialstat(name, sock);
+
+	if (!r && net)
+		r = do_netstat(name, sock);
+
+	if (!r && steal)
+		r = do_stealstat(name, sock);
+
+	if (!r && kvm_stats)
+		r = do_kvmstat(name, sock);
+
+	if (!r && footprint)
+		r = do_footprint(name, sock);
+
+	if (!r && ksm)
+		r = do_ksmstat(name, sock);
+
+	if (!r && locks)
+		r = do_lockstat(name, sock);
+
+	if (!r && vqs)
+		r = do_vqstat(name, sock);
+
+	/* Refresh every second, unless asked about all instances */
+	if (!r && exits)
+		r = do_exitstat(name, sock, !all);
+
+	return r;
+}
+
 int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 {
 	int instance;
@@ -119,11 +1185,13 @@ int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 
 	parse_stat_options(argc, argv);
 
-	if (!mem)
+	if (!mem && !disk && !traps && !pool && !balloon && !serial &&
+	    !net && !steal && !kvm_stats && !footprint && !ksm && !locks &&
+	    !vqs && !exits)
 		usage_with_options(stat_usage, stat_options);
 
-	if (mem && all)
-		return kvm__enumerate_instances(do_memstat);
+	if (all)
+		return kvm__enumerate_instances(do_stat);
 
 	if (instance_name == NULL)
 		kvm_stat_help();
@@ -133,8 +1201,7 @@ int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 	if (instance <= 0)
 		die("Failed locating instance");
 
-	if (mem)
-		r = do_memstat(instance_name, instance);
+	r = do_stat(instance_name, instance);
 
 	close(instance);
 
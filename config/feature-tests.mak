@@ -157,6 +157,16 @@ int main(void)
 }
 endef
 
+define SOURCE_ZSTD
+#include <zstd.h>
+
+int main(void)
+{
+	ZSTD_freeDCtx(ZSTD_createDCtx());
+	return 0;
+}
+endef
+
 define SOURCE_AIO
 #include <libaio.h>
 
@@ -167,6 +177,45 @@ int main(void)
 }
 endef
 
+define SOURCE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+int main(void)
+{
+	struct io_uring_params p = { .flags = IORING_SETUP_SQPOLL };
+
+	return syscall(__NR_io_uring_setup, IORING_OP_READ_FIXED, &p);
+}
+endef
+
+define SOURCE_AF_XDP
+#include <linux/bpf.h>
+#include <linux/if_xdp.h>
+#include <sys/socket.h>
+
+int main(void)
+{
+	struct sockaddr_xdp sxdp = { .sxdp_flags = XDP_USE_NEED_WAKEUP };
+	union bpf_attr attr = { .link_create.attach_type = BPF_XDP };
+
+	return sxdp.sxdp_flags + attr.link_create.attach_type +
+	       BPF_MAP_TYPE_XSKMAP + XDP_UMEM_PGOFF_COMPLETION_RING;
+}
+endef
+
+define SOURCE_SDT
+#include <sys/sdt.h>
+
+int main(void)
+{
+	int arg = 0;
+
+	STAP_PROBEV(lkvm, test, arg);
+	return arg;
+}
+endef
+
 define SOURCE_STATIC
 #include <stdlib.h>
 
@@ -0,0 +1,32 @@
+#
+# lkvm-micro, for guests that boot from a virtio disk and only need virtio
+# blk, net, vsock, console and rng, over virtio-pci or virtio-mmio. It has
+# none of the legacy PC devices, no UI, and no user mode network, which
+# makes a smaller binary that starts faster. micro-stubs.c stands in for
+# what is left out.
+#
+
+MICRO_OUT	+= virtio/9p.o virtio/9p-pdu.o virtio/9p-cache.o virtio/9p-overlay.o
+MICRO_OUT	+= virtio/fs.o
+MICRO_OUT	+= virtio/balloon.o virtio/mem.o virtio/pmem.o
+MICRO_OUT	+= virtio/gpu.o virtio/input.o
+MICRO_OUT	+= virtio/scsi.o
+MICRO_OUT	+= virtio/vdpa.o
+MICRO_OUT	+= virtio/doorbell.o
+MICRO_OUT	+= vfio/core.o vfio/ioeventfd.o vfio/pci.o
+MICRO_OUT	+= hw/i8042.o hw/rtc.o hw/serial.o hw/cfi_flash.o
+MICRO_OUT	+= hw/pci-shmem.o hw/vesa.o framebuffer.o
+MICRO_OUT	+= ui/gtk3.o ui/sdl.o ui/vnc.o
+MICRO_OUT	+= $(filter net/uip/%.o,$(OBJS))
+
+MICRO_OBJS	= $(patsubst %.o,%.micro.o,\
+		    $(filter-out $(MICRO_OUT),$(OBJS) $(OBJS_DYNOPT)) micro-stubs.o)
+
+# No UI libraries, and no guest init, which is for the 9p root
+CFLAGS_MICRO	= $(filter-out -DCONFIG_HAS_GTK3 -DCONFIG_HAS_SDL \
+		    -DCONFIG_HAS_VNCSERVER $(CFLAGS_GTK3),$(CFLAGS_DYNOPT)) \
+		  -DCONFIG_MICRO -UCONFIG_GUEST_INIT -UCONFIG_GUEST_PRE_INIT
+LIBS_MICRO	= $(filter-out $(LDFLAGS_GTK3) -lSDL -lvncserver,$(LIBS_DYNOPT))
+
+MICRO_DEPS	= $(foreach obj,$(MICRO_OBJS),\
+		    $(subst $(comma),_,$(dir $(obj)).$(notdir $(obj)).d))
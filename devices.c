@@ -1,16 +1,22 @@
 #include "kvm/devices.h"
 #include "kvm/kvm.h"
+#include "kvm/pci.h"
 
 #include <linux/err.h>
 #include <linux/rbtree.h>
 
+/* As many devices as device__find_dev() can name */
+#define DEVICE_TABLE_SIZE	256
+
 struct device_bus {
 	struct rb_root	root;
 	int		dev_num;
+	/* By number, for config space accesses to find theirs in one load */
+	struct device_header *table[DEVICE_TABLE_SIZE];
 };
 
 static struct device_bus device_trees[DEVICE_BUS_MAX] = {
-	[0 ... (DEVICE_BUS_MAX - 1)] = { RB_ROOT, 0 },
+	[0 ... (DEVICE_BUS_MAX - 1)] = { RB_ROOT, 0, {} },
 };
 
 int device__register(struct device_header *dev)
@@ -25,6 +31,10 @@ int device__register(struct device_header *dev)
 	}
 
 	bus = &device_trees[dev->bus_type];
+	if (dev->bus_type == DEVICE_BUS_PCI && bus->dev_num >= PCI_MAX_DEVICES) {
+		pr_warning("No PCI slot or function left for another device");
+		return -ENOSPC;
+	}
 	dev->dev_num = bus->dev_num++;
 
 	node = &bus->root.rb_node;
@@ -43,36 +53,29 @@ int device__register(struct device_header *dev)
 
 	rb_link_node(&dev->node, parent, node);
 	rb_insert_color(&dev->node, &bus->root);
+	if (dev->dev_num < DEVICE_TABLE_SIZE)
+		__atomic_store_n(&bus->table[dev->dev_num], dev,
+				 __ATOMIC_RELEASE);
 	return 0;
 }
 
 void device__unregister(struct device_header *dev)
 {
 	struct device_bus *bus = &device_trees[dev->bus_type];
+
+	if (dev->dev_num < DEVICE_TABLE_SIZE)
+		__atomic_store_n(&bus->table[dev->dev_num], NULL,
+				 __ATOMIC_RELEASE);
 	rb_erase(&dev->node, &bus->root);
 }
 
 struct device_header *device__find_dev(enum device_bus_type bus_type, u8 dev_num)
 {
-	struct rb_node *node;
-
 	if (bus_type >= DEVICE_BUS_MAX)
 		return ERR_PTR(-EINVAL);
 
-	node = device_trees[bus_type].root.rb_node;
-	while (node) {
-		struct device_header *dev = rb_entry(node, struct device_header,
-						     node);
-		if (dev_num < dev->dev_num) {
-			node = node->rb_left;
-		} else if (dev_num > dev->dev_num) {
-			node = node->rb_right;
-		} else {
-			return dev;
-		}
-	}
-
-	return NULL;
+	return __atomic_load_n(&device_trees[bus_type].table[dev_num],
+			       __ATOMIC_ACQUIRE);
 }
 
 struct device_header *device__first_dev(enum device_bus_type bus_type)
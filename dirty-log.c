@@ -0,0 +1,352 @@
+#include "kvm/dirty-log.h"
+
+#include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/mutex.h"
+#include "kvm/util.h"
+
+#include <linux/bitmap.h>
+#include <linux/kvm.h>
+#include <linux/list.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* 64KB of ring per vCPU, after which it exits to have it harvested */
+#define DIRTY_RING_ENTRIES	4096
+
+#define DIRTY_NO_PAGE		(~0ULL)
+
+struct dirty_ring {
+	struct kvm_dirty_gfn	*gfns;
+	u32			fetch;
+};
+
+static u32 dirty_ring_entries;
+static struct dirty_ring *dirty_rings;
+
+static DEFINE_MUTEX(dirty_lock);
+/* Harvested from the rings, until the next dirty_log__sync() */
+static unsigned long *dirty_pages;
+unsigned long *dirty_log_devices;
+static unsigned long *dirty_devices_map;
+
+static void *dirty_ram_start;
+static u64 dirty_nr_pages;
+static long dirty_page_size;
+/* The first page of each memory slot of RAM, DIRTY_NO_PAGE for the others */
+static u64 *dirty_slot_page;
+static u32 dirty_nr_slots;
+
+/* Before the vCPUs are created */
+void dirty_log__enable_ring(struct kvm *kvm)
+{
+	struct kvm_enable_cap cap = { .cap = KVM_CAP_DIRTY_LOG_RING };
+	int max;
+
+	/* The framebuffer needs KVM_GET_DIRTY_LOG, which rings replace */
+	if (kvm->cfg.vnc || kvm->cfg.sdl || kvm->cfg.gtk)
+		return;
+
+	max = ioctl(kvm->vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_DIRTY_LOG_RING);
+	if (max <= 0)
+		return;
+
+	cap.args[0] = min_t(u64, max,
+			    DIRTY_RING_ENTRIES * sizeof(struct kvm_dirty_gfn));
+	if (ioctl(kvm->vm_fd, KVM_ENABLE_CAP, &cap) < 0) {
+		pr_debug("Unable to enable the dirty ring: %s", strerror(errno));
+		return;
+	}
+
+	dirty_ring_entries = cap.args[0] / sizeof(struct kvm_dirty_gfn);
+}
+
+bool dirty_log__has_ring(void)
+{
+	return dirty_ring_entries > 0;
+}
+
+static int dirty_log__map_rings(struct kvm *kvm)
+{
+	int i;
+
+	if (dirty_rings)
+		return 0;
+
+	dirty_rings = calloc(kvm->nrcpus, sizeof(*dirty_rings));
+	if (!dirty_rings)
+		return -ENOMEM;
+
+	for (i = 0; i < kvm->nrcpus; i++) {
+		void *p = mmap(NULL,
+			       dirty_ring_entries * sizeof(struct kvm_dirty_gfn),
+			       PROT_READ | PROT_WRITE, MAP_SHARED,
+			       kvm->cpus[i]->vcpu_fd,
+			       KVM_DIRTY_LOG_PAGE_OFFSET * dirty_page_size);
+
+		if (p == MAP_FAILED)
+			return -errno;
+		dirty_rings[i].gfns = p;
+	}
+
+	return 0;
+}
+
+/* Collect the entries of all rings, with dirty_lock held */
+static void dirty_log__harvest(struct kvm *kvm)
+{
+	u32 nr = 0;
+	int i;
+
+	for (i = 0; i < kvm->nrcpus; i++) {
+		struct dirty_ring *ring = &dirty_rings[i];
+
+		for (;;) {
+			struct kvm_dirty_gfn *gfn;
+			u32 slot;
+			u64 page;
+
+			gfn = &ring->gfns[ring->fetch % dirty_ring_entries];
+			if (!(__atomic_load_n(&gfn->flags, __ATOMIC_ACQUIRE) &
+			      KVM_DIRTY_GFN_F_DIRTY))
+				break;
+
+			slot = gfn->slot & 0xffff;
+			if (dirty_pages && slot < dirty_nr_slots &&
+			    dirty_slot_page[slot] != DIRTY_NO_PAGE) {
+				page = dirty_slot_page[slot] + gfn->offset;
+				if (page < dirty_nr_pages)
+					set_bit(page, dirty_pages);
+			}
+
+			__atomic_store_n(&gfn->flags, KVM_DIRTY_GFN_F_RESET,
+					 __ATOMIC_RELEASE);
+			ring->fetch++;
+			nr++;
+		}
+	}
+
+	if (nr && ioctl(kvm->vm_fd, KVM_RESET_DIRTY_RINGS) < 0)
+		pr_warning("KVM_RESET_DIRTY_RINGS: %s", strerror(errno));
+}
+
+/* KVM_EXIT_DIRTY_RING_FULL: the vCPU can't run until its ring has room */
+void dirty_log__ring_full(struct kvm_cpu *vcpu)
+{
+	mutex_lock(&dirty_lock);
+	if (dirty_rings)
+		dirty_log__harvest(vcpu->kvm);
+	mutex_unlock(&dirty_lock);
+}
+
+static int dirty_log__set_banks(struct kvm *kvm, bool enable)
+{
+	struct kvm_mem_bank *bank;
+	int r;
+
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		if (bank->type != KVM_MEM_TYPE_RAM)
+			continue;
+
+		r = kvm__set_dirty_log(kvm, bank->guest_phys_addr, enable);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+int dirty_log__start(struct kvm *kvm)
+{
+	struct kvm_mem_bank *bank;
+	size_t size;
+	u32 i;
+	int r;
+
+	/* One user at a time: migration, a live dump or incremental snapshots */
+	mutex_lock(&dirty_lock);
+	r = dirty_pages ? -EBUSY : 0;
+	mutex_unlock(&dirty_lock);
+	if (r)
+		return r;
+
+	dirty_page_size = getpagesize();
+	dirty_ram_start = kvm->ram_start;
+	dirty_nr_pages = kvm->ram_size / dirty_page_size;
+	size = BITS_TO_LONGS(dirty_nr_pages) * sizeof(long);
+
+	/* Devices may still look at the map of a previous run, keep it */
+	if (!dirty_devices_map) {
+		dirty_devices_map = calloc(1, size);
+		if (!dirty_devices_map)
+			return -ENOMEM;
+	}
+	memset(dirty_devices_map, 0, size);
+
+	dirty_nr_slots = 0;
+	list_for_each_entry(bank, &kvm->mem_banks, list)
+		dirty_nr_slots = max(dirty_nr_slots, bank->slot + 1);
+
+	free(dirty_slot_page);
+	dirty_slot_page = malloc(dirty_nr_slots * sizeof(*dirty_slot_page));
+	mutex_lock(&dirty_lock);
+	dirty_pages = calloc(1, size);
+	mutex_unlock(&dirty_lock);
+	if (!dirty_slot_page || !dirty_pages) {
+		r = -ENOMEM;
+		goto err;
+	}
+
+	for (i = 0; i < dirty_nr_slots; i++)
+		dirty_slot_page[i] = DIRTY_NO_PAGE;
+	list_for_each_entry(bank, &kvm->mem_banks, list)
+		if (bank->type == KVM_MEM_TYPE_RAM)
+			dirty_slot_page[bank->slot] =
+				(bank->host_addr - kvm->ram_start) /
+				dirty_page_size;
+
+	if (dirty_ring_entries) {
+		r = dirty_log__map_rings(kvm);
+		if (r < 0)
+			goto err;
+	}
+
+	__atomic_store_n(&dirty_log_devices, dirty_devices_map,
+			 __ATOMIC_RELEASE);
+
+	r = dirty_log__set_banks(kvm, true);
+	if (r < 0)
+		goto err;
+
+	return 0;
+
+err:
+	dirty_log__stop(kvm);
+	return r;
+}
+
+void dirty_log__stop(struct kvm *kvm)
+{
+	dirty_log__set_banks(kvm, false);
+	__atomic_store_n(&dirty_log_devices, NULL, __ATOMIC_RELEASE);
+
+	mutex_lock(&dirty_lock);
+	free(dirty_pages);
+	dirty_pages = NULL;
+	/* Leave the rings empty for the next run */
+	if (dirty_rings)
+		dirty_log__harvest(kvm);
+	mutex_unlock(&dirty_lock);
+}
+
+/* OR @src, of @nr bits, into @dst from bit @first */
+static void dirty_log__or(unsigned long *dst, u64 first,
+			  const unsigned long *src, u64 nr)
+{
+	u64 i, j;
+
+	for (i = 0; i < BITS_TO_LONGS(nr); i++) {
+		unsigned long w = src[i];
+
+		if (!w)
+			continue;
+
+		for (j = 0; j < BITS_PER_LONG; j++)
+			if ((w & (1UL << j)) && i * BITS_PER_LONG + j < nr)
+				set_bit(first + i * BITS_PER_LONG + j, dst);
+	}
+}
+
+/*
+ * Move the pages that the vCPUs wrote since the last call to @bitmap.
+ * Returns how many pages @bitmap now has.
+ */
+long dirty_log__sync(struct kvm *kvm, unsigned long *bitmap)
+{
+	struct kvm_mem_bank *bank;
+	unsigned long *log = NULL;
+	u64 i, nr_longs = BITS_TO_LONGS(dirty_nr_pages);
+	int r = 0;
+
+	mutex_lock(&dirty_lock);
+	if (!dirty_pages) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	if (dirty_rings) {
+		dirty_log__harvest(kvm);
+	} else {
+		list_for_each_entry(bank, &kvm->mem_banks, list) {
+			u64 nr = bank->size / dirty_page_size;
+			unsigned long *p;
+
+			if (bank->type != KVM_MEM_TYPE_RAM)
+				continue;
+
+			p = realloc(log, BITS_TO_LONGS(nr) * sizeof(long));
+			if (!p) {
+				r = -ENOMEM;
+				goto out;
+			}
+			log = p;
+
+			r = kvm__get_dirty_log(kvm, bank->guest_phys_addr, log);
+			if (r < 0)
+				goto out;
+
+			dirty_log__or(dirty_pages,
+				      (bank->host_addr - kvm->ram_start) /
+				      dirty_page_size, log, nr);
+		}
+	}
+
+	for (i = 0; i < nr_longs; i++) {
+		bitmap[i] |= dirty_pages[i];
+		dirty_pages[i] = 0;
+	}
+
+out:
+	mutex_unlock(&dirty_lock);
+	free(log);
+
+	return r < 0 ? r : (long)bitmap_weight(bitmap, dirty_nr_pages);
+}
+
+/*
+ * Add the pages that devices may have written since dirty_log__start(). Once
+ * they are stopped, these are all sent again.
+ */
+void dirty_log__sync_devices(unsigned long *bitmap)
+{
+	u64 i;
+
+	for (i = 0; i < BITS_TO_LONGS(dirty_nr_pages); i++)
+		bitmap[i] |= __atomic_load_n(&dirty_devices_map[i],
+					     __ATOMIC_RELAXED);
+}
+
+void __dirty_log__mark(const void *host, size_t len)
+{
+	unsigned long *map = __atomic_load_n(&dirty_log_devices,
+					     __ATOMIC_ACQUIRE);
+	u64 page, last;
+
+	if (!map || !len || host < dirty_ram_start)
+		return;
+
+	page = (host - dirty_ram_start) / dirty_page_size;
+	last = (host + len - 1 - dirty_ram_start) / dirty_page_size;
+	if (last >= dirty_nr_pages)
+		return;
+
+	for (; page <= last; page++)
+		__atomic_fetch_or(&map[BIT_WORD(page)],
+				  1UL << (page % BITS_PER_LONG),
+				  __ATOMIC_RELAXED);
+}
@@ -2,13 +2,17 @@
 #include <pthread.h>
 #include <sys/eventfd.h>
 
-#include "kvm/brlock.h"
+#include "kvm/barrier.h"
 #include "kvm/disk-image.h"
+#include "kvm/host-numa.h"
 #include "kvm/kvm.h"
+#include "kvm/probe.h"
 #include "linux/list.h"
 
 #define AIO_MAX 256
 
+static int disk_aio_start(struct disk_image *disk);
+
 static int aio_submit(struct disk_image *disk, int nr, struct iocb **ios)
 {
 	int ret;
@@ -21,6 +25,7 @@ static int aio_submit(struct disk_image *disk, int nr, struct iocb **ios)
 	 */
 restart:
 	ret = io_submit(disk->ctx, nr, ios);
+	kvm__probe(aio_submit, disk, nr, ret);
 	if (ret == -EAGAIN)
 		goto restart;
 	else if (ret <= 0)
@@ -30,19 +35,73 @@ restart:
 	return ret;
 }
 
+/*
+ * Requests are queued on the disk and only handed to the kernel by
+ * raw_image__submit_async(), so that all the requests collected during a
+ * plug need a single io_submit().
+ */
+static int aio_submit_pending(struct disk_image *disk)
+{
+	struct iocb *ios[AIO_MAX];
+	int i, nr, ret;
+
+	nr = disk->aio_nr_pending;
+	if (!nr)
+		return 0;
+
+	for (i = 0; i < nr; i++)
+		ios[i] = &disk->aio_pending[i];
+
+	disk->aio_nr_pending = 0;
+
+	ret = aio_submit(disk, nr, ios);
+	if (ret == nr)
+		return 0;
+
+	/* Requests that didn't make it to the kernel won't get an event */
+	for (i = ret > 0 ? ret : 0; i < nr; i++) {
+		if (ret > 0)
+			__sync_fetch_and_sub(&disk->aio_inflight, 1);
+		disk_image__complete(disk, ios[i]->data, ret < 0 ? ret : -EIO);
+	}
+
+	return ret < 0 ? ret : -EIO;
+}
+
+static ssize_t aio_queue(struct disk_image *disk, struct iocb *iocb)
+{
+	mutex_lock(&disk->aio_lock);
+	if (disk->aio_nr_pending == AIO_MAX)
+		aio_submit_pending(disk);
+	disk->aio_pending[disk->aio_nr_pending++] = *iocb;
+	mutex_unlock(&disk->aio_lock);
+
+	return 0;
+}
+
 ssize_t raw_image__read_async(struct disk_image *disk, u64 sector,
 			      const struct iovec *iov, int iovcount,
 			      void *param)
 {
 	struct iocb iocb;
 	u64 offset = sector << SECTOR_SHIFT;
-	struct iocb *ios[1] = { &iocb };
+	ssize_t r;
+
+	r = raw_image__read_nowait(disk, sector, iov, iovcount);
+	if (r >= 0) {
+		disk_image__complete(disk, param, r);
+		return r;
+	}
+
+	r = disk_aio_start(disk);
+	if (r)
+		return r;
 
 	io_prep_preadv(&iocb, disk->fd, iov, iovcount, offset);
 	io_set_eventfd(&iocb, disk->evt);
 	iocb.data = param;
 
-	return aio_submit(disk, 1, ios);
+	return aio_queue(disk, &iocb);
 }
 
 ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
@@ -51,13 +110,51 @@ ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
 {
 	struct iocb iocb;
 	u64 offset = sector << SECTOR_SHIFT;
-	struct iocb *ios[1] = { &iocb };
+	int r;
+
+	r = disk_aio_start(disk);
+	if (r)
+		return r;
 
 	io_prep_pwritev(&iocb, disk->fd, iov, iovcount, offset);
 	io_set_eventfd(&iocb, disk->evt);
 	iocb.data = param;
 
-	return aio_submit(disk, 1, ios);
+	return aio_queue(disk, &iocb);
+}
+
+/*
+ * An fdsync only covers the writes that completed before it was submitted,
+ * which is all that a flush of the guest asks for.
+ */
+int raw_image__flush_async(struct disk_image *disk, void *param)
+{
+	struct iocb iocb;
+	int r;
+
+	r = disk_aio_start(disk);
+	if (r)
+		return r;
+
+	if (!disk->aio_fdsync)
+		return -EOPNOTSUPP;
+
+	io_prep_fdsync(&iocb, disk->fd);
+	io_set_eventfd(&iocb, disk->evt);
+	iocb.data = param;
+
+	return aio_queue(disk, &iocb);
+}
+
+int raw_image__submit_async(struct disk_image *disk)
+{
+	int ret;
+
+	mutex_lock(&disk->aio_lock);
+	ret = aio_submit_pending(disk);
+	mutex_unlock(&disk->aio_lock);
+
+	return ret;
 }
 
 /*
@@ -69,7 +166,11 @@ ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
  */
 int raw_image__wait(struct disk_image *disk)
 {
-	u64 inflight = disk->aio_inflight;
+	u64 inflight;
+
+	raw_image__submit_async(disk);
+
+	inflight = disk->aio_inflight;
 
 	while (disk->aio_inflight) {
 		usleep(100);
@@ -87,8 +188,11 @@ static int disk_aio_get_events(struct disk_image *disk)
 
 	do {
 		nr = io_getevents(disk->ctx, 1, ARRAY_SIZE(event), event, &notime);
+		kvm__probe(aio_complete, disk, nr);
+		disk_image__batch_begin(disk);
 		for (i = 0; i < nr; i++)
-			disk->disk_req_cb(event[i].data, event[i].res);
+			disk_image__complete(disk, event[i].data, event[i].res);
+		disk_image__batch_end(disk);
 
 		/* Pairs with wmb() in aio_submit() */
 		rmb();
@@ -105,6 +209,7 @@ static void *disk_aio_thread(void *param)
 	u64 dummy;
 
 	kvm__set_thread_name("disk-image-io");
+	host_numa__bind_thread(disk->numa_node);
 
 	while (read(disk->evt, &dummy, sizeof(dummy)) > 0) {
 		if (disk_aio_get_events(disk))
@@ -114,37 +219,99 @@ static void *disk_aio_thread(void *param)
 	return NULL;
 }
 
-int disk_aio_setup(struct disk_image *disk)
+/* Older kernels and some filesystems refuse IOCB_CMD_FDSYNC */
+static bool disk_aio_probe_fdsync(struct disk_image *disk)
+{
+	struct iocb iocb, *ios[1] = { &iocb };
+	struct io_event event;
+
+	io_prep_fdsync(&iocb, disk->fd);
+	if (io_submit(disk->ctx, 1, ios) != 1)
+		return false;
+
+	return io_getevents(disk->ctx, 1, 1, &event, NULL) == 1 &&
+	       event.res == 0;
+}
+
+/*
+ * The context, its eventfd and completion thread come with the first request
+ * of the guest, a disk that it never reads doesn't cost a thread.
+ */
+static int disk_aio_start_locked(struct disk_image *disk)
 {
 	int r;
 
-	/* No need to setup AIO if the disk ops won't make use of it */
-	if (!disk->ops->async)
-		return 0;
+	disk->aio_pending = calloc(AIO_MAX, sizeof(*disk->aio_pending));
+	if (!disk->aio_pending)
+		return -ENOMEM;
 
 	disk->evt = eventfd(0, 0);
-	if (disk->evt < 0)
-		return -errno;
-
-	io_setup(AIO_MAX, &disk->ctx);
-	r = pthread_create(&disk->thread, NULL, disk_aio_thread, disk);
-	if (r) {
+	if (disk->evt < 0) {
 		r = -errno;
-		close(disk->evt);
-		return r;
+		goto err_free;
 	}
 
+	r = io_setup(AIO_MAX, &disk->ctx);
+	if (r)
+		goto err_close;
+
+	disk->aio_fdsync = disk_aio_probe_fdsync(disk);
+	r = -kvm__start_device_thread(&disk->thread, disk_aio_thread, disk);
+	if (r)
+		goto err_destroy;
+
+	/* Pairs with the rmb() of disk_aio_start() */
+	wmb();
+	disk->aio_started = true;
+	return 0;
+
+err_destroy:
+	io_destroy(disk->ctx);
+err_close:
+	close(disk->evt);
+err_free:
+	free(disk->aio_pending);
+	disk->aio_pending = NULL;
+	return r;
+}
+
+static int disk_aio_start(struct disk_image *disk)
+{
+	int r = 0;
+
+	if (disk->aio_started) {
+		rmb();
+		return 0;
+	}
+
+	mutex_lock(&disk->aio_lock);
+	if (!disk->aio_started)
+		r = disk_aio_start_locked(disk);
+	mutex_unlock(&disk->aio_lock);
+
+	return r;
+}
+
+int disk_aio_setup(struct disk_image *disk)
+{
+	/* No need to setup AIO if the disk ops won't make use of it */
+	if (!disk->ops->async)
+		return 0;
+
+	mutex_init(&disk->aio_lock);
 	disk->async = true;
 	return 0;
 }
 
 void disk_aio_destroy(struct disk_image *disk)
 {
-	if (!disk->async)
+	if (!disk->aio_started)
 		return;
 
 	pthread_cancel(disk->thread);
 	pthread_join(disk->thread, NULL);
 	close(disk->evt);
 	io_destroy(disk->ctx);
+	free(disk->aio_pending);
+	disk->aio_started = false;
 }
@@ -1,17 +1,10 @@
 #include "kvm/disk-image.h"
 
 #include <linux/err.h>
+#include <linux/kernel.h>
 #include <mntent.h>
-
-/*
- * raw image and blk dev are similar, so reuse raw image ops.
- */
-static struct disk_image_operations blk_dev_ops = {
-	.read	= raw_image__read,
-	.write	= raw_image__write,
-	.wait	= raw_image__wait,
-	.async	= true,
-};
+#include <stdio.h>
+#include <sys/sysmacros.h>
 
 static bool is_mounted(struct stat *st)
 {
@@ -35,8 +28,89 @@ static bool is_mounted(struct stat *st)
 	return false;
 }
 
+static int blkdev__discard(struct disk_image *disk, u64 sector, u64 nr_sectors)
+{
+	u64 range[2] = { sector << SECTOR_SHIFT, nr_sectors << SECTOR_SHIFT };
+
+	if (ioctl(disk->fd, BLKDISCARD, range) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int blkdev__write_zeroes(struct disk_image *disk, u64 sector,
+				u64 nr_sectors, bool unmap)
+{
+	u64 range[2] = { sector << SECTOR_SHIFT, nr_sectors << SECTOR_SHIFT };
+
+	/* The kernel unmaps on its own when the device guarantees zeroes */
+	if (ioctl(disk->fd, BLKZEROOUT, range) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* From sysfs, where partitions have the limits of their disk one level up */
+static u64 blkdev__queue_limit(struct stat *st, const char *limit)
+{
+	static const char * const fmts[] = {
+		"/sys/dev/block/%u:%u/queue/%s",
+		"/sys/dev/block/%u:%u/../queue/%s",
+	};
+	unsigned long long val;
+	char path[PATH_MAX];
+	unsigned int i;
+	FILE *f;
+	int r;
+
+	for (i = 0; i < ARRAY_SIZE(fmts); i++) {
+		snprintf(path, sizeof(path), fmts[i], major(st->st_rdev),
+			 minor(st->st_rdev), limit);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+
+		r = fscanf(f, "%llu", &val);
+		fclose(f);
+		if (r == 1)
+			return val;
+	}
+
+	return 0;
+}
+
+static void blkdev__get_topology(struct disk_image *disk, struct stat *st)
+{
+	struct disk_topology *t = &disk->topology;
+	unsigned int val;
+	u64 max_seg, max_req;
+	int off;
+
+	if (ioctl(disk->fd, BLKPBSZGET, &val) == 0)
+		t->phys_block_size = val;
+	if (ioctl(disk->fd, BLKALIGNOFF, &off) == 0 && off > 0)
+		t->alignment_offset = off;
+	if (ioctl(disk->fd, BLKIOMIN, &val) == 0)
+		t->min_io_size = val;
+	if (ioctl(disk->fd, BLKIOOPT, &val) == 0)
+		t->opt_io_size = val;
+
+	/* No segment of a request can be larger than the request itself */
+	max_seg = blkdev__queue_limit(st, "max_segment_size");
+	max_req = blkdev__queue_limit(st, "max_sectors_kb") * 1024;
+	if (max_seg && max_req)
+		max_seg = min(max_seg, max_req);
+	else
+		max_seg = max(max_seg, max_req);
+	t->max_seg_size = min_t(u64, max_seg, UINT32_MAX);
+}
+
+/* The raw image operations of the current engine, discarding with ioctls */
+static struct disk_image_operations blkdev_ops;
+
 struct disk_image *blkdev__probe(const char *filename, int flags, struct stat *st)
 {
+	struct disk_image *disk;
 	int fd, r;
 	u64 size;
 
@@ -68,5 +142,16 @@ struct disk_image *blkdev__probe(const char *filename, int flags, struct stat *s
 	 * mmap large disk. There is not enough virtual address space
 	 * in 32-bit host. However, this works on 64-bit host.
 	 */
-	return disk_image__new(fd, size, &blk_dev_ops, DISK_IMAGE_REGULAR);
+	/*
+	 * raw image and blk dev are similar, so reuse raw image ops.
+	 */
+	blkdev_ops		= *raw_image__ops(false);
+	blkdev_ops.discard	= blkdev__discard;
+	blkdev_ops.write_zeroes	= blkdev__write_zeroes;
+
+	disk = disk_image__new(fd, size, &blkdev_ops, DISK_IMAGE_REGULAR);
+	if (!IS_ERR_OR_NULL(disk))
+		blkdev__get_topology(disk, st);
+
+	return disk;
 }
@@ -0,0 +1,728 @@
+#include "kvm/disk-image.h"
+#include "kvm/iovec.h"
+#include "kvm/mutex.h"
+#include "kvm/kvm.h"
+
+#include <linux/bitops.h>
+#include <linux/err.h>
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+
+/*
+ * A cache file on fast local storage in front of another disk image, such as
+ * a golden image on a network filesystem. Block n of the image is kept at the
+ * same offset of the cache file, which is sparse and as large as the image.
+ * Which blocks the cache holds, and which ones it holds newer data for with
+ * cache-writeback, is recorded in "<cache>.meta" so that the cache survives
+ * restarts.
+ *
+ * Blocks that are in the cache are read from it without locking. Filling
+ * blocks and writing hold the cache lock, so that a fill can't put data from
+ * before a write in the cache.
+ */
+
+#define DISK_CACHE_BLOCK_SHIFT	16
+#define DISK_CACHE_BLOCK_SIZE	(1ULL << DISK_CACHE_BLOCK_SHIFT)
+/* Missing blocks in a row are read from the image together, up to this many */
+#define DISK_CACHE_FILL_BLOCKS	16
+
+#define DISK_CACHE_MAGIC	0x4843564b	/* "KVCH" */
+#define DISK_CACHE_VERSION	1
+/* The valid, then the dirty bitmap follow the header */
+#define DISK_CACHE_HEADER_SIZE	4096
+
+struct disk_cache_header {
+	u32			magic;
+	u32			version;
+	u32			block_size;
+	/* Cleared while in use: after a crash, only dirty blocks are kept */
+	u32			clean;
+	u64			size;
+	/* Of the image when the cache was closed, to notice other writers */
+	u64			mtime_ns;
+	u64			nr_dirty;
+};
+
+struct disk_cache {
+	struct disk_image	*backing;
+	const char		*filename;
+	bool			writeback;
+	u64			size;
+	u64			nr_blocks;
+	int			fd;
+	int			meta_fd;
+	void			*meta;
+	size_t			meta_size;
+	struct disk_cache_header *hdr;
+	/* Blocks that the cache file holds */
+	unsigned long		*valid;
+	/* Blocks only written to the cache so far, under the lock */
+	unsigned long		*dirty;
+	struct mutex		lock;
+	/* For filling blocks, under the lock */
+	void			*buf;
+
+	/* With cache-trace, the blocks to warm up or the file recording them */
+	u64			*warmup;
+	u64			nr_warmup;
+	pthread_t		warmup_thread;
+	bool			warming;
+	bool			stop;
+	FILE			*trace;
+	unsigned long		*seen;
+};
+
+struct disk_cache_wait {
+	struct mutex		lock;
+	pthread_cond_t		cond;
+	bool			done;
+	long			len;
+};
+
+static void disk_cache__backing_done(void *param, long len)
+{
+	struct disk_cache_wait *wait = param;
+
+	mutex_lock(&wait->lock);
+	wait->len = len;
+	wait->done = true;
+	pthread_cond_signal(&wait->cond);
+	mutex_unlock(&wait->lock);
+}
+
+/* Whatever the engine of the image, wait for the request to complete */
+static ssize_t disk_cache__backing_io(struct disk_cache *c, bool write,
+				      u64 sector, const struct iovec *iov,
+				      int iovcount)
+{
+	struct disk_cache_wait wait = {};
+
+	mutex_init(&wait.lock);
+	pthread_cond_init(&wait.cond, NULL);
+
+	if (write)
+		disk_image__write(c->backing, sector, iov, iovcount, &wait);
+	else
+		disk_image__read(c->backing, sector, iov, iovcount, &wait);
+
+	mutex_lock(&wait.lock);
+	while (!wait.done)
+		pthread_cond_wait(&wait.cond, &wait.lock.mutex);
+	mutex_unlock(&wait.lock);
+	pthread_cond_destroy(&wait.cond);
+
+	return wait.len;
+}
+
+static bool disk_cache__test(unsigned long *map, u64 block)
+{
+	return __atomic_load_n(&map[BIT_WORD(block)], __ATOMIC_ACQUIRE) &
+	       (1UL << (block % BITS_PER_LONG));
+}
+
+static void disk_cache__set(unsigned long *map, u64 block)
+{
+	__atomic_fetch_or(&map[BIT_WORD(block)], 1UL << (block % BITS_PER_LONG),
+			  __ATOMIC_RELEASE);
+}
+
+static void disk_cache__clear(unsigned long *map, u64 block)
+{
+	__atomic_fetch_and(&map[BIT_WORD(block)],
+			   ~(1UL << (block % BITS_PER_LONG)), __ATOMIC_RELEASE);
+}
+
+/* The last block is short when the image size isn't a multiple of blocks */
+static u64 disk_cache__block_end(struct disk_cache *c, u64 block)
+{
+	return min_t(u64, (block + 1) << DISK_CACHE_BLOCK_SHIFT, c->size);
+}
+
+static void disk_cache__record(struct disk_cache *c, u64 block)
+{
+	unsigned long bit = 1UL << (block % BITS_PER_LONG);
+
+	if (!c->trace)
+		return;
+
+	if (!(__atomic_fetch_or(&c->seen[BIT_WORD(block)], bit,
+				__ATOMIC_RELAXED) & bit))
+		fprintf(c->trace, "%llu\n", (unsigned long long)block);
+}
+
+/*
+ * Copy the blocks from @block that aren't in the cache, up to @nr, from the
+ * image into the cache and c->buf. Returns how many. Called with the lock.
+ */
+static ssize_t disk_cache__fill(struct disk_cache *c, u64 block, u64 nr)
+{
+	u64 start = block << DISK_CACHE_BLOCK_SHIFT;
+	struct iovec iov;
+	ssize_t r;
+	u64 i, len;
+
+	nr = min_t(u64, nr, DISK_CACHE_FILL_BLOCKS);
+	for (i = 0; i < nr && block + i < c->nr_blocks; i++) {
+		if (disk_cache__test(c->valid, block + i))
+			break;
+	}
+	if (!i)
+		return 0;
+
+	nr = i;
+	len = disk_cache__block_end(c, block + nr - 1) - start;
+	iov = (struct iovec) {
+		.iov_base	= c->buf,
+		.iov_len	= len,
+	};
+
+	r = disk_cache__backing_io(c, false, start >> SECTOR_SHIFT, &iov, 1);
+	if (r < 0)
+		return r;
+	/* Past the end of an image that isn't a multiple of sectors */
+	if ((u64)r < len)
+		memset(c->buf + r, 0, len - r);
+
+	if (pwrite_in_full(c->fd, c->buf, len, start) != (ssize_t)len)
+		return -EIO;
+
+	for (i = 0; i < nr; i++)
+		disk_cache__set(c->valid, block + i);
+
+	return nr;
+}
+
+static ssize_t disk_cache__read(struct disk_image *disk, u64 sector,
+				const struct iovec *iov, int iovcount,
+				void *param)
+{
+	struct disk_cache *c = disk->priv;
+	size_t len = iov_size(iov, iovcount);
+	u64 pos = sector << SECTOR_SHIFT;
+	u64 end = pos + len, block, run;
+	struct iovec_cursor cur;
+	struct iovec *window;
+	ssize_t r = 0;
+	int i, n;
+
+	if (end > c->size)
+		return -EINVAL;
+
+	window = malloc(iovcount * sizeof(*window));
+	if (!window)
+		return -ENOMEM;
+
+	iovec_cursor__init(&cur, iov, iovcount);
+
+	while (pos < end) {
+		block = pos >> DISK_CACHE_BLOCK_SHIFT;
+		disk_cache__record(c, block);
+
+		if (!disk_cache__test(c->valid, block)) {
+			mutex_lock(&c->lock);
+			r = disk_cache__fill(c, block,
+					     DIV_ROUND_UP(end, DISK_CACHE_BLOCK_SIZE) - block);
+			if (r > 0) {
+				run = min(end, disk_cache__block_end(c, block + r - 1)) - pos;
+				iovec_cursor__to(&cur, c->buf +
+						 (pos - (block << DISK_CACHE_BLOCK_SHIFT)),
+						 run);
+			}
+			mutex_unlock(&c->lock);
+
+			if (r < 0)
+				break;
+			if (r > 0) {
+				for (i = 1; i < r; i++)
+					disk_cache__record(c, block + i);
+				pos += run;
+				continue;
+			}
+			/* Another thread filled it meanwhile */
+		}
+
+		/* Read the blocks from here that the cache holds in one go */
+		run = disk_cache__block_end(c, block);
+		while (run < end &&
+		       disk_cache__test(c->valid, run >> DISK_CACHE_BLOCK_SHIFT)) {
+			disk_cache__record(c, run >> DISK_CACHE_BLOCK_SHIFT);
+			run = disk_cache__block_end(c, run >> DISK_CACHE_BLOCK_SHIFT);
+		}
+		run = min(run, end) - pos;
+
+		n = iovec_window(window, cur.iov, cur.cnt, cur.off, run);
+		if (preadv_in_full(c->fd, window, n, pos) != (ssize_t)run) {
+			r = -EIO;
+			break;
+		}
+		iovec_cursor__skip(&cur, run);
+		pos += run;
+	}
+
+	free(window);
+
+	return r < 0 ? r : (ssize_t)len;
+}
+
+/* The image gets the write, and the cache the blocks it holds or that are whole */
+static ssize_t disk_cache__write_through(struct disk_cache *c,
+					 const struct iovec *iov, int iovcount,
+					 u64 pos, u64 end)
+{
+	struct iovec_cursor cur;
+	struct iovec *window;
+	u64 block, next, run;
+	ssize_t r;
+	bool ok;
+	int n;
+
+	window = malloc(iovcount * sizeof(*window));
+	if (!window)
+		return -ENOMEM;
+
+	r = disk_cache__backing_io(c, true, pos >> SECTOR_SHIFT, iov, iovcount);
+	ok = r == (ssize_t)(end - pos);
+
+	iovec_cursor__init(&cur, iov, iovcount);
+	for (; pos < end; pos = next) {
+		block = pos >> DISK_CACHE_BLOCK_SHIFT;
+		next = min(end, disk_cache__block_end(c, block));
+		run = next - pos;
+
+		if (ok && (disk_cache__test(c->valid, block) ||
+			   (pos == block << DISK_CACHE_BLOCK_SHIFT &&
+			    next == disk_cache__block_end(c, block)))) {
+			n = iovec_window(window, cur.iov, cur.cnt, cur.off, run);
+			if (pwritev_in_full(c->fd, window, n, pos) == (ssize_t)run)
+				disk_cache__set(c->valid, block);
+			else
+				disk_cache__clear(c->valid, block);
+		} else if (!ok) {
+			/* Whatever the image has now, read it again */
+			disk_cache__clear(c->valid, block);
+		}
+		iovec_cursor__skip(&cur, run);
+	}
+
+	free(window);
+
+	return r;
+}
+
+/* Only the cache gets the write, the image gets it on close */
+static ssize_t disk_cache__write_cached(struct disk_cache *c,
+					const struct iovec *iov, int iovcount,
+					u64 pos, u64 end)
+{
+	u64 first = pos >> DISK_CACHE_BLOCK_SHIFT;
+	u64 last = (end - 1) >> DISK_CACHE_BLOCK_SHIFT;
+	u64 block;
+	ssize_t r;
+
+	/* Blocks that the write only covers part of must be complete first */
+	if (pos != first << DISK_CACHE_BLOCK_SHIFT) {
+		r = disk_cache__fill(c, first, 1);
+		if (r < 0)
+			return r;
+	}
+	if (end != disk_cache__block_end(c, last)) {
+		r = disk_cache__fill(c, last, 1);
+		if (r < 0)
+			return r;
+	}
+
+	r = pwritev_in_full(c->fd, iov, iovcount, pos);
+	if (r != (ssize_t)(end - pos))
+		return -EIO;
+
+	for (block = first; block <= last; block++) {
+		if (!disk_cache__test(c->dirty, block)) {
+			disk_cache__set(c->dirty, block);
+			c->hdr->nr_dirty++;
+		}
+		disk_cache__set(c->valid, block);
+	}
+
+	return r;
+}
+
+static ssize_t disk_cache__write(struct disk_image *disk, u64 sector,
+				 const struct iovec *iov, int iovcount,
+				 void *param)
+{
+	struct disk_cache *c = disk->priv;
+	u64 pos = sector << SECTOR_SHIFT;
+	u64 end = pos + iov_size(iov, iovcount);
+	ssize_t r;
+
+	if (end > c->size)
+		return -EINVAL;
+	if (end == pos)
+		return 0;
+
+	mutex_lock(&c->lock);
+	if (c->writeback)
+		r = disk_cache__write_cached(c, iov, iovcount, pos, end);
+	else
+		r = disk_cache__write_through(c, iov, iovcount, pos, end);
+	mutex_unlock(&c->lock);
+
+	return r;
+}
+
+static int disk_cache__flush(struct disk_image *disk)
+{
+	struct disk_cache *c = disk->priv;
+
+	if (!c->writeback)
+		return disk_image__flush(c->backing);
+
+	/* The data, then the dirty bits that say it's newer than the image's */
+	if (fdatasync(c->fd) < 0 || msync(c->meta, c->meta_size, MS_SYNC) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* Write the dirty blocks to the image */
+static int disk_cache__clean(struct disk_cache *c)
+{
+	u64 block, nr, start, len;
+	struct iovec iov;
+	ssize_t r;
+
+	if (!c->hdr->nr_dirty)
+		return 0;
+
+	for (block = 0; block < c->nr_blocks; block += nr) {
+		if (!c->dirty[BIT_WORD(block)]) {
+			nr = BITS_PER_LONG - block % BITS_PER_LONG;
+			continue;
+		}
+
+		nr = 1;
+		if (!disk_cache__test(c->dirty, block))
+			continue;
+
+		while (nr < DISK_CACHE_FILL_BLOCKS && block + nr < c->nr_blocks &&
+		       disk_cache__test(c->dirty, block + nr))
+			nr++;
+
+		start = block << DISK_CACHE_BLOCK_SHIFT;
+		len = disk_cache__block_end(c, block + nr - 1) - start;
+		if (pread_in_full(c->fd, c->buf, len, start) != (ssize_t)len)
+			return -EIO;
+
+		iov = (struct iovec) {
+			.iov_base	= c->buf,
+			.iov_len	= len,
+		};
+		r = disk_cache__backing_io(c, true, start >> SECTOR_SHIFT, &iov, 1);
+		if (r != (ssize_t)len)
+			return r < 0 ? r : -EIO;
+	}
+
+	r = disk_image__flush(c->backing);
+	if (r < 0)
+		return r;
+
+	memset(c->dirty, 0, BITS_TO_LONGS(c->nr_blocks) * sizeof(long));
+	c->hdr->nr_dirty = 0;
+
+	return msync(c->meta, c->meta_size, MS_SYNC) < 0 ? -errno : 0;
+}
+
+static u64 disk_cache__mtime(struct disk_cache *c)
+{
+	struct stat st;
+
+	if (stat(c->filename, &st) < 0)
+		return 0;
+
+	return (u64)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+}
+
+static int disk_cache__open_meta(struct disk_cache *c, const char *filename)
+{
+	size_t map = BITS_TO_LONGS(c->nr_blocks) * sizeof(long);
+	struct disk_cache_header hdr = {};
+	char path[PATH_MAX];
+	bool fresh;
+	u64 mtime, i;
+
+	snprintf(path, sizeof(path), "%s.meta", filename);
+	c->meta_fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (c->meta_fd < 0)
+		return -errno;
+
+	if (pread_in_full(c->meta_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		hdr.magic = 0;
+
+	fresh = hdr.magic != DISK_CACHE_MAGIC ||
+		hdr.version != DISK_CACHE_VERSION ||
+		hdr.block_size != DISK_CACHE_BLOCK_SIZE || hdr.size != c->size;
+	if (fresh && hdr.magic == DISK_CACHE_MAGIC && hdr.nr_dirty) {
+		pr_err("%s has blocks that weren't written back to an image of another size",
+		       filename);
+		return -EBUSY;
+	}
+
+	c->meta_size = DISK_CACHE_HEADER_SIZE + 2 * map;
+	if ((fresh && ftruncate(c->meta_fd, 0) < 0) ||
+	    ftruncate(c->meta_fd, c->meta_size) < 0)
+		return -errno;
+
+	c->meta = mmap(NULL, c->meta_size, PROT_RW, MAP_SHARED, c->meta_fd, 0);
+	if (c->meta == MAP_FAILED) {
+		c->meta = NULL;
+		return -errno;
+	}
+
+	c->hdr = c->meta;
+	c->valid = c->meta + DISK_CACHE_HEADER_SIZE;
+	c->dirty = (void *)c->valid + map;
+
+	mtime = disk_cache__mtime(c);
+	if (fresh) {
+		*c->hdr = (struct disk_cache_header) {
+			.magic		= DISK_CACHE_MAGIC,
+			.version	= DISK_CACHE_VERSION,
+			.block_size	= DISK_CACHE_BLOCK_SIZE,
+			.clean		= 1,
+			.size		= c->size,
+			.mtime_ns	= mtime,
+		};
+	}
+
+	c->hdr->nr_dirty = 0;
+	for (i = 0; i < BITS_TO_LONGS(c->nr_blocks); i++)
+		c->hdr->nr_dirty += __builtin_popcountl(c->dirty[i]);
+
+	if (!c->hdr->clean || c->hdr->mtime_ns != mtime) {
+		pr_info("%s changed or %s wasn't closed, dropping its clean blocks",
+			c->filename, filename);
+		for (i = 0; i < BITS_TO_LONGS(c->nr_blocks); i++)
+			c->valid[i] = c->dirty[i];
+	}
+
+	c->hdr->clean = 0;
+	if (msync(c->meta, c->meta_size, MS_SYNC) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* Warm up from an existing trace, or record the blocks of this run in it */
+static int disk_cache__open_trace(struct disk_cache *c, const char *path)
+{
+	unsigned long long block;
+	u64 *warmup, max = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		if (errno != ENOENT)
+			return -errno;
+
+		c->seen = calloc(BITS_TO_LONGS(c->nr_blocks), sizeof(long));
+		if (!c->seen)
+			return -ENOMEM;
+		c->trace = fopen(path, "w");
+		return c->trace ? 0 : -errno;
+	}
+
+	while (fscanf(f, "%llu", &block) == 1) {
+		if (c->nr_warmup == max) {
+			max = max ? max * 2 : 1024;
+			warmup = realloc(c->warmup, max * sizeof(*warmup));
+			if (!warmup) {
+				fclose(f);
+				return -ENOMEM;
+			}
+			c->warmup = warmup;
+		}
+		c->warmup[c->nr_warmup++] = block;
+	}
+
+	fclose(f);
+
+	return 0;
+}
+
+static void *disk_cache__warmup_thread(void *arg)
+{
+	struct disk_cache *c = arg;
+	ssize_t r = 0;
+	u64 i, nr;
+
+	kvm__set_thread_name("disk-cache-warmup");
+
+	for (i = 0; i < c->nr_warmup; i += max_t(ssize_t, r, 1)) {
+		if (__atomic_load_n(&c->stop, __ATOMIC_RELAXED))
+			break;
+
+		/* Blocks that the trace has in a row are read together */
+		for (nr = 1; i + nr < c->nr_warmup; nr++) {
+			if (c->warmup[i + nr] != c->warmup[i] + nr)
+				break;
+		}
+
+		mutex_lock(&c->lock);
+		r = disk_cache__fill(c, c->warmup[i], nr);
+		mutex_unlock(&c->lock);
+
+		if (r < 0) {
+			pr_warning("Warming up the disk cache failed: %s",
+				   strerror(-r));
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void disk_cache__destroy(struct disk_cache *c)
+{
+	if (c->trace)
+		fclose(c->trace);
+	if (c->meta)
+		munmap(c->meta, c->meta_size);
+	if (c->meta_fd >= 0)
+		close(c->meta_fd);
+	if (c->fd >= 0)
+		close(c->fd);
+
+	free(c->seen);
+	free(c->warmup);
+	free(c->buf);
+	free(c);
+}
+
+static int disk_cache__close(struct disk_image *disk)
+{
+	struct disk_cache *c = disk->priv;
+	struct disk_image *backing = c->backing;
+	int r;
+
+	if (c->warming) {
+		__atomic_store_n(&c->stop, true, __ATOMIC_RELAXED);
+		pthread_join(c->warmup_thread, NULL);
+	}
+
+	r = disk_cache__clean(c);
+	if (r < 0)
+		pr_warning("Unable to write the disk cache back, keeping its dirty blocks: %s",
+			   strerror(-r));
+
+	/*
+	 * The clean blocks hold what the image has, whether or not that worked.
+	 * Closing the image may still update it, as QCOW images do.
+	 */
+	disk_image__close(backing);
+	if (fdatasync(c->fd) == 0) {
+		c->hdr->mtime_ns = disk_cache__mtime(c);
+		c->hdr->clean = 1;
+	}
+	msync(c->meta, c->meta_size, MS_SYNC);
+
+	disk_cache__destroy(c);
+
+	return r;
+}
+
+static struct disk_image_operations disk_cache_ops = {
+	.read	= disk_cache__read,
+	.write	= disk_cache__write,
+	.flush	= disk_cache__flush,
+	.close	= disk_cache__close,
+};
+
+/*
+ * Put the cache file of @params in front of @backing. On failure, @backing
+ * is left to the caller.
+ */
+struct disk_image *disk_cache__open(struct disk_image *backing,
+				    struct disk_image_params *params)
+{
+	struct disk_image *disk;
+	struct disk_cache *c;
+	struct stat st;
+	int r;
+
+	if (params->cache_writeback && backing->readonly) {
+		pr_err("cache-writeback needs a writable image");
+		return ERR_PTR(-EROFS);
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return ERR_PTR(-ENOMEM);
+
+	*c = (struct disk_cache) {
+		.backing	= backing,
+		.filename	= params->filename,
+		.writeback	= params->cache_writeback,
+		.size		= backing->size,
+		.nr_blocks	= DIV_ROUND_UP(backing->size, DISK_CACHE_BLOCK_SIZE),
+		.fd		= -1,
+		.meta_fd	= -1,
+	};
+	mutex_init(&c->lock);
+	disk_image__set_callback(backing, disk_cache__backing_done);
+
+	c->buf = malloc(DISK_CACHE_FILL_BLOCKS * DISK_CACHE_BLOCK_SIZE);
+	if (!c->buf) {
+		r = -ENOMEM;
+		goto err_destroy;
+	}
+
+	c->fd = open(params->cache, O_RDWR | O_CREAT, 0600);
+	if (c->fd < 0 || fstat(c->fd, &st) < 0) {
+		r = -errno;
+		goto err_destroy;
+	}
+	if ((u64)st.st_size < c->size && ftruncate(c->fd, c->size) < 0) {
+		r = -errno;
+		goto err_destroy;
+	}
+
+	r = disk_cache__open_meta(c, params->cache);
+	if (r < 0)
+		goto err_destroy;
+
+	/* Without cache-writeback, the image first gets what a previous run left */
+	if (!c->writeback) {
+		r = disk_cache__clean(c);
+		if (r < 0)
+			goto err_destroy;
+	}
+
+	if (params->cache_trace) {
+		r = disk_cache__open_trace(c, params->cache_trace);
+		if (r < 0)
+			goto err_destroy;
+	}
+
+	disk = disk_image__new(backing->fd, backing->size, &disk_cache_ops,
+			       DISK_IMAGE_REGULAR);
+	if (IS_ERR(disk)) {
+		r = PTR_ERR(disk);
+		goto err_destroy;
+	}
+	disk->priv = c;
+	disk->readonly = backing->readonly;
+	disk->topology = backing->topology;
+	disk->numa_node = backing->numa_node;
+
+	if (c->nr_warmup)
+		c->warming = !pthread_create(&c->warmup_thread, NULL,
+					     disk_cache__warmup_thread, c);
+
+	return disk;
+
+err_destroy:
+	disk_cache__destroy(c);
+	return ERR_PTR(r);
+}
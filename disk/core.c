@@ -1,31 +1,97 @@
 #include "kvm/disk-image.h"
+#include "kvm/disk-trace.h"
+#include "kvm/host-numa.h"
 #include "kvm/qcow.h"
 #include "kvm/virtio-blk.h"
+#include "kvm/virtio-vdpa.h"
+#include "kvm/virtio.h"
 #include "kvm/kvm.h"
 #include "kvm/iovec.h"
+#include "kvm/mutex.h"
+#include "kvm/probe.h"
+#include "kvm/threadpool.h"
 
 #include <linux/err.h>
+#include <limits.h>
 #include <poll.h>
 
 int debug_iodelay;
+int disk_engine;
+unsigned int disk_engine_flags;
 
-static int disk_image__close(struct disk_image *disk);
+static __thread struct disk_plug *current_plug;
+static __thread int completion_batch;
+
+static void disk_image__flush_plug(struct disk_plug *plug);
+static void disk_flusher__init(struct disk_image *disk, struct kvm *kvm);
+
+static const char *disk_cache_modes[] = {
+	[DISK_CACHE_MODE_WRITEBACK]	= "writeback",
+	[DISK_CACHE_MODE_WRITETHROUGH]	= "writethrough",
+	[DISK_CACHE_MODE_UNSAFE]	= "unsafe",
+	[DISK_CACHE_MODE_DIRECTSYNC]	= "directsync",
+};
+
+static int disk_cache_mode_parser(const char *arg)
+{
+	size_t len = strcspn(arg, ",");
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(disk_cache_modes); i++) {
+		if (strlen(disk_cache_modes[i]) == len &&
+		    !strncmp(arg, disk_cache_modes[i], len))
+			return i;
+	}
+
+	die("Unknown disk cache mode \"%.*s\"", (int)len, arg);
+}
+
+u64 disk_size_parser(const char *arg)
+{
+	char *end;
+	u64 val;
+
+	val = strtoull(arg, &end, 10);
+	switch (*end) {
+	case 'K': case 'k': val <<= 10; break;
+	case 'M': case 'm': val <<= 20; break;
+	case 'G': case 'g': val <<= 30; break;
+	case 'T': case 't': val <<= 40; break;
+	}
+
+	return val;
+}
 
 int disk_img_name_parser(const struct option *opt, const char *arg, int unset)
 {
 	const char *cur;
 	char *sep;
 	struct kvm *kvm = opt->ptr;
+	struct disk_image_params *params;
 
-	if (kvm->nr_disks >= MAX_DISK_IMAGES)
-		die("Currently only 4 images are supported");
+	/* A vDPA block device is its own virtio-blk, with its own backend */
+	if (strncmp(arg, "vdpa:", 5) == 0) {
+		if (virtio_vdpa__register(kvm, arg + 5) < 0)
+			die("Failed adding vDPA device %s", arg + 5);
+		return 0;
+	}
 
-	kvm->cfg.disk_image[kvm->nr_disks].filename = arg;
+	params = realloc(kvm->cfg.disk_image,
+			 (kvm->nr_disks + 1) * sizeof(*params));
+	if (!params)
+		die("Failed adding new disk image");
+	kvm->cfg.disk_image = params;
+
+	params = &kvm->cfg.disk_image[kvm->nr_disks];
+	*params = (struct disk_image_params) {
+		.filename	= arg,
+		.iothread	= -1,
+	};
 	cur = arg;
 
 	if (strncmp(arg, "scsi:", 5) == 0) {
 		sep = strstr(arg, ":");
-		kvm->cfg.disk_image[kvm->nr_disks].wwpn = sep + 1;
+		params->wwpn = sep + 1;
 
 		/* Old invocation had two parameters. Ignore the second one. */
 		sep = strstr(sep + 1, ":");
@@ -33,25 +99,146 @@ int disk_img_name_parser(const struct option *opt, const char *arg, int unset)
 			*sep = 0;
 			cur = sep + 1;
 		}
+	} else if (strncmp(arg, "vhost-user:", 11) == 0) {
+		params->vhost_user = arg + 11;
+		kvm->cfg.mem_shared = true;
 	}
 
 	do {
 		sep = strstr(cur, ",");
 		if (sep) {
 			if (strncmp(sep + 1, "ro", 2) == 0)
-				kvm->cfg.disk_image[kvm->nr_disks].readonly = true;
+				params->readonly = true;
 			else if (strncmp(sep + 1, "direct", 6) == 0)
-				kvm->cfg.disk_image[kvm->nr_disks].direct = true;
+				params->direct = true;
+			else if (strncmp(sep + 1, "scsi", 4) == 0)
+				params->scsi = true;
+			else if (strncmp(sep + 1, "mq=", 3) == 0)
+				params->nr_queues = atoi(sep + 4);
+			else if (strncmp(sep + 1, "pin", 3) == 0)
+				params->pin_queues = true;
+			else if (strncmp(sep + 1, "poll=", 5) == 0)
+				params->poll_us = atoi(sep + 6);
+			else if (strncmp(sep + 1, "iothread=", 9) == 0)
+				params->iothread = atoi(sep + 10);
+			else if (strncmp(sep + 1, "l2cache=", 8) == 0)
+				params->l2_cache_size =
+					disk_size_parser(sep + 9);
+			else if (strncmp(sep + 1, "preallocation=metadata", 22) == 0)
+				params->prealloc = true;
+			else if (strncmp(sep + 1, "cachemode=", 10) == 0)
+				params->cache_mode =
+					disk_cache_mode_parser(sep + 11);
+			else if (strncmp(sep + 1, "cache=", 6) == 0)
+				params->cache = sep + 7;
+			else if (strncmp(sep + 1, "cache-writeback", 15) == 0)
+				params->cache_writeback = true;
+			else if (strncmp(sep + 1, "cache-trace=", 12) == 0)
+				params->cache_trace = sep + 13;
+			else if (strncmp(sep + 1, "trace=", 6) == 0)
+				params->trace = sep + 7;
+			else if (strncmp(sep + 1, "crypt-key=", 10) == 0)
+				params->crypt_key = sep + 11;
+			else if (strncmp(sep + 1, "sparse", 6) == 0)
+				params->sparse = true;
+			else if (strncmp(sep + 1, "readahead=", 10) == 0)
+				params->readahead = disk_size_parser(sep + 11) ?:
+						    DISK_READAHEAD_OFF;
+			else if (strncmp(sep + 1, "bps=", 4) == 0)
+				params->ratelimit.bytes =
+					ratelimit__parse_rate(sep + 5);
+			else if (strncmp(sep + 1, "iops=", 5) == 0)
+				params->ratelimit.ops =
+					ratelimit__parse_rate(sep + 6);
+			else if (strncmp(sep + 1, "burst=", 6) == 0)
+				params->ratelimit.burst_ms = atoi(sep + 7);
+			else if (strncmp(sep + 1, "weight=", 7) == 0)
+				params->weight = atoi(sep + 8);
+			else if (strncmp(sep + 1, "qsize=", 6) == 0)
+				params->queue_size = atoi(sep + 7);
 			*sep = 0;
 			cur = sep + 1;
 		}
 	} while (sep);
 
+	if (params->cache_mode == DISK_CACHE_MODE_DIRECTSYNC)
+		params->direct = true;
+
+	if (params->weight > DISK_WEIGHT_MAX)
+		die("Disk weight must be between 1 and %d", DISK_WEIGHT_MAX);
+	if (virtio_vq__check_size(params->queue_size))
+		die("Disk queue size must be a power of two between 4 and %d",
+		    VIRTIO_PACKED_QUEUE_MAX_SIZE);
+
 	kvm->nr_disks++;
 
 	return 0;
 }
 
+int disk_engine_parser(const struct option *opt, const char *arg, int unset)
+{
+	char *buf, *cur, *sep;
+
+	buf = strdup(arg);
+	if (!buf)
+		die("Out of memory");
+
+	sep = strchr(buf, ',');
+	if (sep)
+		*sep++ = '\0';
+
+	if (!strcmp(buf, "sync")) {
+		disk_engine = DISK_ENGINE_SYNC;
+#ifdef CONFIG_HAS_AIO
+	} else if (!strcmp(buf, "aio")) {
+		disk_engine = DISK_ENGINE_AIO;
+#endif
+#ifdef CONFIG_HAS_IO_URING
+	} else if (!strcmp(buf, "io_uring")) {
+		disk_engine = DISK_ENGINE_IO_URING;
+#endif
+	} else {
+		die("Unsupported disk engine \"%s\"", buf);
+	}
+
+	for (cur = sep; cur; cur = sep) {
+		sep = strchr(cur, ',');
+		if (sep)
+			*sep++ = '\0';
+
+		if (disk_engine != DISK_ENGINE_IO_URING)
+			die("Disk engine option \"%s\" requires io_uring", cur);
+
+		if (!strcmp(cur, "sqpoll"))
+			disk_engine_flags |= DISK_ENGINE_F_SQPOLL;
+		else if (!strcmp(cur, "fixedbufs"))
+			disk_engine_flags |= DISK_ENGINE_F_FIXEDBUFS;
+		else if (!strcmp(cur, "shared"))
+			disk_engine_flags |= DISK_ENGINE_F_SHARED;
+		else
+			die("Unknown disk engine option \"%s\"", cur);
+	}
+
+	free(buf);
+	return 0;
+}
+
+static int disk_image__setup_engine(struct disk_image *disk)
+{
+	if (disk_engine == DISK_ENGINE_IO_URING)
+		return disk_uring_setup(disk);
+
+	return disk_aio_setup(disk);
+}
+
+static void disk_image__destroy_engine(struct disk_image *disk)
+{
+	if (disk_engine == DISK_ENGINE_IO_URING)
+		disk_uring_destroy(disk);
+	else
+		disk_aio_destroy(disk);
+}
+
 struct disk_image *disk_image__new(int fd, u64 size,
 				   struct disk_image_operations *ops,
 				   int use_mmap)
@@ -64,9 +251,11 @@ struct disk_image *disk_image__new(int fd, u64 size,
 		return ERR_PTR(-ENOMEM);
 
 	*disk = (struct disk_image) {
-		.fd	= fd,
-		.size	= size,
-		.ops	= ops,
+		.fd		= fd,
+		.size		= size,
+		.ops		= ops,
+		/* Before the engine threads that go there start */
+		.numa_node	= host_numa__fd_node(fd),
 	};
 
 	if (use_mmap == DISK_IMAGE_MMAP) {
@@ -80,7 +269,7 @@ struct disk_image *disk_image__new(int fd, u64 size,
 		}
 	}
 
-	r = disk_aio_setup(disk);
+	r = disk_image__setup_engine(disk);
 	if (r)
 		goto err_unmap_disk;
 
@@ -94,7 +283,29 @@ err_free_disk:
 	return ERR_PTR(r);
 }
 
-static struct disk_image *disk_image__open(const char *filename, bool readonly, bool direct)
+/*
+ * Of an image in a file, the block size of its filesystem: writes of less
+ * than that read the rest of the block first on most of them. QCOW images
+ * already set their cluster size as the optimal one.
+ */
+void disk_image__file_topology(struct disk_image *disk, struct stat *st)
+{
+	struct disk_topology *t = &disk->topology;
+	u32 blksize = st->st_blksize;
+
+	if (!S_ISREG(st->st_mode) || blksize < SECTOR_SIZE ||
+	    !is_power_of_two(blksize))
+		return;
+
+	t->phys_block_size = min_t(u32, blksize, DISK_MAX_PHYS_BLOCK);
+	t->min_io_size = t->phys_block_size;
+	t->opt_io_size = max(t->opt_io_size, blksize);
+}
+
+static struct disk_image *disk_image__open(const char *filename, bool readonly,
+					   bool direct, u64 l2_cache_size,
+					   bool prealloc, bool sparse,
+					   int cache_mode)
 {
 	struct disk_image *disk;
 	struct stat st;
@@ -104,91 +315,214 @@ static struct disk_image *disk_image__open(const char *filename, bool readonly,
 		flags = O_RDONLY;
 	else
 		flags = O_RDWR;
-	if (direct)
-		flags |= O_DIRECT;
+
+	/* F_SETFL can't set O_DSYNC later, unlike O_DIRECT */
+	if (cache_mode == DISK_CACHE_MODE_WRITETHROUGH ||
+	    cache_mode == DISK_CACHE_MODE_DIRECTSYNC)
+		flags |= O_DSYNC;
 
 	if (stat(filename, &st) < 0)
 		return ERR_PTR(-errno);
 
 	/* blk device ?*/
-	disk = blkdev__probe(filename, flags, &st);
+	disk = blkdev__probe(filename, flags | (direct ? O_DIRECT : 0), &st);
 	if (!IS_ERR_OR_NULL(disk)) {
 		disk->readonly = readonly;
-		return disk;
+		goto out_direct;
 	}
 
+	/* The probes below read headers into unaligned buffers */
 	fd = open(filename, flags);
 	if (fd < 0)
 		return ERR_PTR(fd);
 
 	/* qcow image ?*/
-	disk = qcow_probe(fd, true);
-	if (!IS_ERR_OR_NULL(disk)) {
-		pr_warning("Forcing read-only support for QCOW");
-		disk->readonly = true;
+	disk = qcow_probe(fd, filename, readonly, l2_cache_size, prealloc);
+	if (IS_ERR(disk)) {
+		close(fd);
 		return disk;
 	}
+	if (disk) {
+		if (direct)
+			pr_warning("O_DIRECT is not supported on QCOW images, ignoring");
+		disk->readonly = readonly || !disk->ops->write;
+		disk_image__file_topology(disk, &st);
+		return disk;
+	}
+
+	if (direct && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) < 0) {
+		close(fd);
+		return ERR_PTR(-errno);
+	}
 
 	/* raw image ?*/
 	disk = raw_image__probe(fd, &st, readonly);
 	if (!IS_ERR_OR_NULL(disk)) {
 		disk->readonly = readonly;
-		return disk;
+		disk_image__file_topology(disk, &st);
+		/* Writes to a private mapping never reach the file */
+		if (sparse && S_ISREG(st.st_mode) &&
+		    disk->ops->read != raw_image__read_mmap &&
+		    disk_sparse__init(disk) < 0)
+			pr_warning("Unable to track the holes of %s", filename);
+		goto out_direct;
 	}
 
 	if (close(fd) < 0)
 		pr_warning("close() failed");
 
 	return ERR_PTR(-ENOSYS);
+
+out_direct:
+	/* O_DIRECT reads would block on the device all the same */
+	disk->nowait = !direct;
+	if (direct && disk_direct__init(disk, &st) < 0)
+		pr_warning("No O_DIRECT bounce buffers, misaligned requests will fail");
+
+	return disk;
+}
+
+struct disk_opener {
+	pthread_t			thread;
+	bool				started;
+	struct disk_image_params	*params;
+	struct disk_image		*disk;
+};
+
+static void *disk_image__opener(void *arg)
+{
+	struct disk_opener *opener = arg;
+	struct disk_image_params *params = opener->params;
+	struct disk_image *disk, *layer;
+
+	disk = disk_image__open(params->filename, params->readonly,
+				params->direct, params->l2_cache_size,
+				params->prealloc, params->sparse,
+				params->cache_mode);
+	/* Below the cache, whose fills are reads of the image too */
+	if (!IS_ERR_OR_NULL(disk) && params->readahead != DISK_READAHEAD_OFF &&
+	    disk_readahead__init(disk, params->readahead) < 0)
+		pr_warning("No readahead for %s", params->filename);
+
+	if (!IS_ERR_OR_NULL(disk) && params->cache) {
+		layer = disk_cache__open(disk, params);
+		if (IS_ERR(layer))
+			disk_image__close(disk);
+		disk = layer;
+	}
+
+	/* Above the cache, which only ever holds ciphertext */
+	if (!IS_ERR_OR_NULL(disk) && params->crypt_key) {
+		layer = disk_crypt__open(disk, params);
+		if (IS_ERR(layer))
+			disk_image__close(disk);
+		disk = layer;
+	}
+
+	opener->disk = disk;
+	return NULL;
+}
+
+/*
+ * Opening an image can mean reading its metadata or preallocating it, so
+ * with several of them each one gets a thread.
+ */
+static void disk_image__open_files(struct disk_image_params *params,
+				   int count, struct disk_opener *openers)
+{
+	int i, nr_files = 0;
+
+	for (i = 0; i < count; i++) {
+		if (params[i].filename && !params[i].wwpn && !params[i].vhost_user) {
+			openers[i].params = &params[i];
+			nr_files++;
+		}
+	}
+
+	for (i = 0; i < count && nr_files > 1; i++) {
+		if (openers[i].params)
+			openers[i].started = !pthread_create(&openers[i].thread,
+							     NULL, disk_image__opener,
+							     &openers[i]);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (openers[i].started)
+			pthread_join(openers[i].thread, NULL);
+		else if (openers[i].params)
+			disk_image__opener(&openers[i]);
+	}
 }
 
 static struct disk_image **disk_image__open_all(struct kvm *kvm)
 {
+	struct disk_opener *openers;
 	struct disk_image **disks;
 	const char *filename;
 	const char *wwpn;
-	bool readonly;
-	bool direct;
+	const char *vhost_user;
 	void *err;
 	int i;
-	struct disk_image_params *params = (struct disk_image_params *)&kvm->cfg.disk_image;
+	struct disk_image_params *params = kvm->cfg.disk_image;
 	int count = kvm->nr_disks;
 
 	if (!count)
 		return ERR_PTR(-EINVAL);
-	if (count > MAX_DISK_IMAGES)
-		return ERR_PTR(-ENOSPC);
 
 	disks = calloc(count, sizeof(*disks));
-	if (!disks)
+	openers = calloc(count, sizeof(*openers));
+	if (!disks || !openers) {
+		free(disks);
+		free(openers);
 		return ERR_PTR(-ENOMEM);
+	}
+
+	disk_image__open_files(params, count, openers);
+	for (i = 0; i < count; i++)
+		disks[i] = openers[i].disk;
+	free(openers);
 
 	for (i = 0; i < count; i++) {
 		filename = params[i].filename;
-		readonly = params[i].readonly;
-		direct = params[i].direct;
 		wwpn = params[i].wwpn;
+		vhost_user = params[i].vhost_user;
 
-		if (wwpn) {
-			disks[i] = malloc(sizeof(struct disk_image));
+		if (wwpn || vhost_user) {
+			disks[i] = calloc(1, sizeof(struct disk_image));
 			if (!disks[i]) {
 				err = ERR_PTR(-ENOMEM);
 				goto error;
 			}
 			disks[i]->wwpn = wwpn;
+			disks[i]->vhost_user = vhost_user;
+			disks[i]->nr_queues = params[i].nr_queues;
 			continue;
 		}
 
 		if (!filename)
 			continue;
 
-		disks[i] = disk_image__open(filename, readonly, direct);
 		if (IS_ERR_OR_NULL(disks[i])) {
 			pr_err("Loading disk image '%s' failed", filename);
 			err = disks[i];
 			goto error;
 		}
 		disks[i]->debug_iodelay = kvm->cfg.debug_iodelay;
+		disks[i]->nr_queues = params[i].nr_queues;
+		disks[i]->scsi = params[i].scsi;
+		disk_uring_register_ram(disks[i], kvm);
+		disks[i]->pin_queues = params[i].pin_queues;
+		disks[i]->poll_us = params[i].poll_us;
+		disks[i]->iothread = params[i].iothread;
+		disks[i]->ratelimit = params[i].ratelimit;
+		disks[i]->weight = params[i].weight;
+		disks[i]->queue_size = params[i].queue_size;
+		disks[i]->cache_mode = params[i].cache_mode;
+		disk_flusher__init(disks[i], kvm);
+		if (params[i].trace &&
+		    disk_trace__open(disks[i], params[i].trace) < 0)
+			pr_warning("Unable to record the requests to %s in %s",
+				   filename, params[i].trace);
 	}
 
 	return disks;
@@ -197,10 +531,7 @@ error:
 		if (IS_ERR_OR_NULL(disks[i]))
 			continue;
 
-		if (disks[i]->wwpn)
-			free(disks[i]);
-		else
-			disk_image__close(disks[i]);
+		disk_image__close(disks[i]);
 	}
 	free(disks);
 	return err;
@@ -214,21 +545,242 @@ int disk_image__wait(struct disk_image *disk)
 	return 0;
 }
 
-int disk_image__flush(struct disk_image *disk)
+/*
+ * Push requests queued by the read/write handlers to the backend. Engines
+ * that submit each request immediately don't implement this.
+ */
+int disk_image__submit(struct disk_image *disk)
+{
+	if (disk->ops->submit)
+		return disk->ops->submit(disk);
+
+	return 0;
+}
+
+/*
+ * With O_DSYNC every write is stable once it completes, unless a backend
+ * keeps metadata or data of its own that only its flush writes back, or
+ * writes zeroes by punching holes.
+ */
+bool disk_image__write_through(struct disk_image *disk)
+{
+	return (disk->cache_mode == DISK_CACHE_MODE_WRITETHROUGH ||
+		disk->cache_mode == DISK_CACHE_MODE_DIRECTSYNC) &&
+	       !disk->ops->flush && !disk->sparse;
+}
+
+static bool disk_image__needs_flush(struct disk_image *disk)
+{
+	return disk->cache_mode != DISK_CACHE_MODE_UNSAFE &&
+	       !disk_image__write_through(disk);
+}
+
+static int disk_image__do_flush(struct disk_image *disk)
 {
 	if (disk->ops->flush)
 		return disk->ops->flush(disk);
 
-	return fsync(disk->fd);
+	return fsync(disk->fd) < 0 ? -errno : 0;
+}
+
+int disk_image__flush(struct disk_image *disk)
+{
+	/* Writes collected so far must reach the backend before the flush */
+	if (current_plug && current_plug->disk == disk)
+		disk_image__flush_plug(current_plug);
+
+	if (!disk_image__needs_flush(disk))
+		return 0;
+
+	return disk_image__do_flush(disk);
+}
+
+/*
+ * Flushes of backends that can't issue them asynchronously are run by the
+ * thread pool. The ones that come in while a flush runs wait for the next,
+ * which covers them all.
+ */
+struct disk_flusher {
+	struct thread_pool__job	job;
+	struct mutex		lock;
+	void			**pending;
+	int			nr_pending;
+	int			max_pending;
+	/* Only touched by the job */
+	void			**running;
+	int			max_running;
+};
+
+static void disk_flusher__run(struct kvm *kvm, void *data)
+{
+	struct disk_image *disk = data;
+	struct disk_flusher *flusher = disk->flusher;
+	void **params;
+	int i, nr, max;
+	long r;
+
+	mutex_lock(&flusher->lock);
+	params = flusher->pending;
+	max = flusher->max_pending;
+	nr = flusher->nr_pending;
+	flusher->pending = flusher->running;
+	flusher->max_pending = flusher->max_running;
+	flusher->nr_pending = 0;
+	mutex_unlock(&flusher->lock);
+
+	flusher->running = params;
+	flusher->max_running = max;
+
+	if (!nr)
+		return;
+
+	r = disk_image__do_flush(disk);
+
+	disk_image__batch_begin(disk);
+	for (i = 0; i < nr; i++)
+		disk_image__complete(disk, params[i], r);
+	disk_image__batch_end(disk);
+}
+
+static int disk_flusher__queue(struct disk_image *disk, void *param)
+{
+	struct disk_flusher *flusher = disk->flusher;
+	void **pending;
+	int max;
+
+	mutex_lock(&flusher->lock);
+	if (flusher->nr_pending == flusher->max_pending) {
+		max = flusher->max_pending * 2 ?: 16;
+		pending = realloc(flusher->pending, max * sizeof(*pending));
+		if (!pending) {
+			mutex_unlock(&flusher->lock);
+			return -ENOMEM;
+		}
+		flusher->pending = pending;
+		flusher->max_pending = max;
+	}
+	flusher->pending[flusher->nr_pending++] = param;
+	mutex_unlock(&flusher->lock);
+
+	thread_pool__do_job(&flusher->job);
+
+	return 0;
 }
 
-static int disk_image__close(struct disk_image *disk)
+static void disk_flusher__init(struct disk_image *disk, struct kvm *kvm)
+{
+	struct disk_flusher *flusher;
+
+	flusher = calloc(1, sizeof(*flusher));
+	if (!flusher)
+		return;
+
+	mutex_init(&flusher->lock);
+	thread_pool__init_job(&flusher->job, kvm, disk_flusher__run, disk);
+	disk->flusher = flusher;
+}
+
+static void disk_flusher__exit(struct disk_image *disk)
+{
+	struct disk_flusher *flusher = disk->flusher;
+
+	if (!flusher)
+		return;
+
+	thread_pool__cancel_job(&flusher->job);
+	free(flusher->pending);
+	free(flusher->running);
+	free(flusher);
+	disk->flusher = NULL;
+}
+
+/*
+ * Complete param once the writes that completed so far are stable, without
+ * waiting for it. Writes still in flight aren't covered, as with a flush of
+ * the guest.
+ */
+int disk_image__flush_async(struct disk_image *disk, void *param)
+{
+	int r;
+
+	if (current_plug && current_plug->disk == disk)
+		disk_image__flush_plug(current_plug);
+
+	if (!disk_image__needs_flush(disk)) {
+		disk_image__complete(disk, param, 0);
+		return 0;
+	}
+
+	if (disk->ops->flush_async && !disk->ops->flush_async(disk, param))
+		return 0;
+
+	if (disk->flusher && !disk_flusher__queue(disk, param))
+		return 0;
+
+	r = disk_image__do_flush(disk);
+	disk_image__complete(disk, param, r);
+
+	return r;
+}
+
+int disk_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors)
+{
+	int ret;
+
+	if (!disk->ops->discard)
+		return -EOPNOTSUPP;
+
+	if (current_plug && current_plug->disk == disk)
+		disk_image__flush_plug(current_plug);
+
+	ret = disk->ops->discard(disk, sector, nr_sectors);
+	if (disk->sparse)
+		disk_sparse__forget(disk, sector, nr_sectors);
+
+	/* Discarding is only a hint, it's fine if the backend can't */
+	return ret == -EOPNOTSUPP ? 0 : ret;
+}
+
+int disk_image__write_zeroes(struct disk_image *disk, u64 sector,
+			     u64 nr_sectors, bool unmap)
+{
+	int ret;
+
+	if (!disk->ops->write_zeroes)
+		return -EOPNOTSUPP;
+
+	if (current_plug && current_plug->disk == disk)
+		disk_image__flush_plug(current_plug);
+
+	ret = disk->ops->write_zeroes(disk, sector, nr_sectors, unmap);
+	if (disk->sparse)
+		disk_sparse__forget(disk, sector, nr_sectors);
+
+	/* Zeroing with fallocate() isn't covered by O_DSYNC */
+	if (!ret && disk_image__write_through(disk) && fdatasync(disk->fd) < 0)
+		ret = -errno;
+
+	return ret;
+}
+
+int disk_image__close(struct disk_image *disk)
 {
 	/* If there was no disk image then there's nothing to do: */
 	if (!disk)
 		return 0;
 
-	disk_aio_destroy(disk);
+	/* Placeholders for devices that a vhost backend implements */
+	if (disk->wwpn || disk->vhost_user) {
+		free(disk);
+		return 0;
+	}
+
+	disk_flusher__exit(disk);
+	disk_image__destroy_engine(disk);
+	disk_trace__close(disk);
+	disk_direct__exit(disk);
+	disk_sparse__exit(disk);
+	disk_readahead__exit(disk);
 
 	if (disk->ops && disk->ops->close)
 		return disk->ops->close(disk);
@@ -241,74 +793,351 @@ static int disk_image__close(struct disk_image *disk)
 	return 0;
 }
 
+static void *disk_image__close_thread(void *arg)
+{
+	kvm__set_thread_name("disk-close");
+	disk_image__close(arg);
+
+	return NULL;
+}
+
+/*
+ * Draining the engine of a disk and flushing a qcow image can each take a
+ * while, and the disks have nothing in common, so close them all at once.
+ */
 static int disk_image__close_all(struct disk_image **disks, int count)
 {
-	while (count)
-		disk_image__close(disks[--count]);
+	pthread_t *threads = NULL;
+	int i, nr_threads = 0;
+
+	if (count > 1)
+		threads = calloc(count, sizeof(*threads));
+
+	while (count) {
+		struct disk_image *disk = disks[--count];
+
+		if (threads && !pthread_create(&threads[nr_threads], NULL,
+					       disk_image__close_thread, disk))
+			nr_threads++;
+		else
+			disk_image__close(disk);
+	}
 
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
 	free(disks);
 
 	return 0;
 }
 
 /*
- * Fill iov with disk data, starting from sector 'sector'.
- * Return amount of bytes read.
+ * A merged request is passed to the backend in place of its members, and a
+ * split request in place of each part of a request the backend breaks up.
+ * The low bits of the pointer tell disk_image__complete() what it is
+ * completing.
  */
-ssize_t disk_image__read(struct disk_image *disk, u64 sector,
-			 const struct iovec *iov, int iovcount, void *param)
+#define DISK_IO_MERGED		1UL
+#define DISK_IO_SPLIT		2UL
+#define DISK_IO_TAGS		(DISK_IO_MERGED | DISK_IO_SPLIT)
+
+struct disk_merged_io {
+	int			nr;
+	struct disk_io_member {
+		void		*param;
+		size_t		len;
+	}			*members;
+	struct iovec		*iov;
+};
+
+static void disk_image__complete_merged(struct disk_image *disk,
+					struct disk_merged_io *mio, long len)
+{
+	int i;
+
+	/* Split the result between the original requests, in disk order */
+	for (i = 0; i < mio->nr; i++) {
+		struct disk_io_member *m = &mio->members[i];
+		long res;
+
+		if (len < 0) {
+			res = len;
+		} else if ((size_t)len >= m->len) {
+			res = m->len;
+			len -= m->len;
+		} else {
+			res = -EIO;
+			len = 0;
+		}
+
+		kvm__probe(disk_complete, disk, m->param, res);
+		if (disk->disk_req_cb)
+			disk->disk_req_cb(m->param, res);
+	}
+
+	free(mio);
+}
+
+/*
+ * Backends that break a request into several I/Os embed a disk_split_io at
+ * the start of a malloc()ed block. The caller holds the initial reference,
+ * each part gets one with disk_split_io__get(), and the original request is
+ * completed and the block freed once all of them are dropped. A part that
+ * completes short fails the request, as a short read or write would.
+ */
+void disk_split_io__init(struct disk_split_io *split, void *param, long len)
+{
+	*split = (struct disk_split_io) {
+		.param		= param,
+		.len		= len,
+		.pending	= 1,
+	};
+}
+
+void *disk_split_io__get(struct disk_split_io *split, size_t len)
+{
+	__sync_fetch_and_add(&split->expected, len);
+	__sync_fetch_and_add(&split->pending, 1);
+
+	return (void *)((unsigned long)split | DISK_IO_SPLIT);
+}
+
+void disk_split_io__put(struct disk_image *disk, struct disk_split_io *split,
+			long res)
+{
+	if (res < 0)
+		__sync_bool_compare_and_swap(&split->err, 0, res);
+	else
+		__sync_fetch_and_add(&split->done, res);
+
+	if (__sync_sub_and_fetch(&split->pending, 1))
+		return;
+
+	if (split->done < split->expected)
+		__sync_bool_compare_and_swap(&split->err, 0, -EIO);
+
+	disk_image__complete(disk, split->param,
+			     split->err ? split->err : split->len);
+	free(split);
+}
+
+void disk_image__complete(struct disk_image *disk, void *param, long len)
+{
+	void *ptr = (void *)((unsigned long)param & ~DISK_IO_TAGS);
+
+	switch ((unsigned long)param & DISK_IO_TAGS) {
+	case DISK_IO_MERGED:
+		disk_image__complete_merged(disk, ptr, len);
+		break;
+	case DISK_IO_SPLIT:
+		disk_split_io__put(disk, ptr, len);
+		break;
+	default:
+		kvm__probe(disk_complete, disk, param, len);
+		if (disk->disk_req_cb)
+			disk->disk_req_cb(param, len);
+	}
+}
+
+static ssize_t disk_image__do_io(struct disk_image *disk, struct disk_io *io)
 {
 	ssize_t total = 0;
 
-	if (debug_iodelay)
-		msleep(debug_iodelay);
+	if (disk->readahead && !io->write)
+		disk_readahead__read(disk, io);
 
-	if (disk->ops->read) {
-		total = disk->ops->read(disk, sector, iov, iovcount, param);
-		if (total < 0) {
-			pr_info("disk_image__read error: total=%ld\n", (long)total);
-			return total;
-		}
+	if (disk->sparse && (io->write ? disk_sparse__write(disk, io) :
+					 disk_sparse__read(disk, io))) {
+		disk_image__complete(disk, io->param, io->len);
+		return io->len;
 	}
 
-	if (!disk->async && disk->disk_req_cb)
-		disk->disk_req_cb(param, total);
+	if (disk->direct && !disk_direct__aligned(disk, io->iov, io->iovcount)) {
+		total = disk_direct__bounce(disk, io->write, io->sector, io->iov,
+					    io->iovcount);
+		disk_image__complete(disk, io->param, total);
+		return total;
+	}
+
+	if (io->write) {
+		if (disk->ops->write)
+			total = disk->ops->write(disk, io->sector, io->iov,
+						 io->iovcount, io->param);
+	} else {
+		if (disk->ops->read)
+			total = disk->ops->read(disk, io->sector, io->iov,
+						io->iovcount, io->param);
+	}
+
+	if (total < 0) {
+		pr_info("disk_image__%s error: total=%ld\n",
+			io->write ? "write" : "read", (long)total);
+		/* The backend won't complete a request it refused */
+		disk_image__complete(disk, io->param, total);
+		return total;
+	}
+
+	if (!disk->async)
+		disk_image__complete(disk, io->param, total);
 
 	return total;
 }
 
 /*
- * Write iov to disk, starting from sector 'sector'.
- * Return amount of bytes written.
+ * Issue nr requests covering contiguous sectors as a single one. If we can't
+ * allocate the merged descriptor, fall back to issuing them one by one.
  */
-ssize_t disk_image__write(struct disk_image *disk, u64 sector,
-			  const struct iovec *iov, int iovcount, void *param)
+static void disk_image__do_merged_io(struct disk_image *disk,
+				     struct disk_io *ios, int nr, int iovcount)
 {
-	ssize_t total = 0;
+	struct disk_merged_io *mio;
+	struct disk_io io;
+	int i, j = 0;
+
+	mio = malloc(sizeof(*mio) + nr * sizeof(*mio->members) +
+		     iovcount * sizeof(*mio->iov));
+	if (!mio) {
+		for (i = 0; i < nr; i++)
+			disk_image__do_io(disk, &ios[i]);
+		return;
+	}
+
+	mio->nr = nr;
+	mio->members = (void *)(mio + 1);
+	mio->iov = (void *)(mio->members + nr);
+
+	io = (struct disk_io) {
+		.write		= ios[0].write,
+		.sector		= ios[0].sector,
+		.iov		= mio->iov,
+		.iovcount	= iovcount,
+		.param		= (void *)((unsigned long)mio | DISK_IO_MERGED),
+	};
+
+	for (i = 0; i < nr; i++) {
+		mio->members[i].param = ios[i].param;
+		mio->members[i].len = ios[i].len;
+		memcpy(&mio->iov[j], ios[i].iov, ios[i].iovcount * sizeof(*mio->iov));
+		j += ios[i].iovcount;
+		io.len += ios[i].len;
+	}
+
+	disk_image__do_io(disk, &io);
+}
+
+static bool disk_io__mergeable(struct disk_io *prev, struct disk_io *next,
+			       int iovcount)
+{
+	return prev->write == next->write &&
+	       !(prev->len & (SECTOR_SIZE - 1)) &&
+	       prev->sector + (prev->len >> SECTOR_SHIFT) == next->sector &&
+	       iovcount + next->iovcount <= IOV_MAX;
+}
+
+static void disk_image__flush_plug(struct disk_plug *plug)
+{
+	struct disk_image *disk = plug->disk;
+	int i, j, iovcount;
+
+	for (i = 0; i < plug->nr; i = j) {
+		iovcount = plug->ios[i].iovcount;
+
+		for (j = i + 1; j < plug->nr; j++) {
+			if (!disk_io__mergeable(&plug->ios[j - 1], &plug->ios[j],
+						iovcount))
+				break;
+			iovcount += plug->ios[j].iovcount;
+		}
+
+		if (j - i == 1)
+			disk_image__do_io(disk, &plug->ios[i]);
+		else
+			disk_image__do_merged_io(disk, &plug->ios[i], j - i,
+						 iovcount);
+	}
+
+	plug->nr = 0;
+	disk_image__submit(disk);
+}
+
+/*
+ * Start collecting the requests the current thread issues on disk. Callers
+ * must keep the iovecs alive until disk_image__unplug().
+ */
+void disk_image__plug(struct disk_image *disk, struct disk_plug *plug)
+{
+	plug->disk = disk;
+	plug->nr = 0;
+	current_plug = plug;
+	disk_image__batch_begin(disk);
+}
+
+void disk_image__unplug(struct disk_plug *plug)
+{
+	disk_image__flush_plug(plug);
+	current_plug = NULL;
+	disk_image__batch_end(plug->disk);
+}
+
+static ssize_t disk_image__queue_io(struct disk_image *disk, struct disk_io *io)
+{
+	struct disk_plug *plug = current_plug;
+	ssize_t total;
 
 	if (debug_iodelay)
 		msleep(debug_iodelay);
 
-	if (disk->ops->write) {
-		/*
-		 * Try writev based operation first
-		 */
+	io->len = iov_size(io->iov, io->iovcount);
+	kvm__probe(disk_submit, disk, io->write, io->sector, io->len, io->param);
 
-		total = disk->ops->write(disk, sector, iov, iovcount, param);
-		if (total < 0) {
-			pr_info("disk_image__write error: total=%ld\n", (long)total);
-			return total;
-		}
-	} else {
-		/* Do nothing */
+	if (plug && plug->disk == disk) {
+		if (plug->nr == DISK_PLUG_MAX)
+			disk_image__flush_plug(plug);
+		plug->ios[plug->nr++] = *io;
+		return io->len;
 	}
 
-	if (!disk->async && disk->disk_req_cb)
-		disk->disk_req_cb(param, total);
+	total = disk_image__do_io(disk, io);
+	disk_image__submit(disk);
 
 	return total;
 }
 
+/*
+ * Fill iov with disk data, starting from sector 'sector'.
+ * Return amount of bytes read.
+ */
+ssize_t disk_image__read(struct disk_image *disk, u64 sector,
+			 const struct iovec *iov, int iovcount, void *param)
+{
+	struct disk_io io = {
+		.sector		= sector,
+		.iov		= iov,
+		.iovcount	= iovcount,
+		.param		= param,
+	};
+
+	return disk_image__queue_io(disk, &io);
+}
+
+/*
+ * Write iov to disk, starting from sector 'sector'.
+ * Return amount of bytes written.
+ */
+ssize_t disk_image__write(struct disk_image *disk, u64 sector,
+			  const struct iovec *iov, int iovcount, void *param)
+{
+	struct disk_io io = {
+		.write		= true,
+		.sector		= sector,
+		.iov		= iov,
+		.iovcount	= iovcount,
+		.param		= param,
+	};
+
+	return disk_image__queue_io(disk, &io);
+}
+
 ssize_t disk_image__get_serial(struct disk_image *disk, struct iovec *iov,
 			       int iovcount, ssize_t len)
 {
@@ -344,6 +1173,35 @@ void disk_image__set_callback(struct disk_image *disk,
 	disk->disk_req_cb = disk_req_cb;
 }
 
+/*
+ * Requests completed by this thread between disk_image__batch_begin() and
+ * disk_image__batch_end() may be held back by the device, until the batch
+ * callback runs at the end.
+ */
+void disk_image__set_batch_callback(struct disk_image *disk,
+				    void (*disk_batch_cb)(void *param),
+				    void *param)
+{
+	disk->disk_batch_cb_param = param;
+	disk->disk_batch_cb = disk_batch_cb;
+}
+
+void disk_image__batch_begin(struct disk_image *disk)
+{
+	completion_batch++;
+}
+
+void disk_image__batch_end(struct disk_image *disk)
+{
+	if (!--completion_batch && disk->disk_batch_cb)
+		disk->disk_batch_cb(disk->disk_batch_cb_param);
+}
+
+bool disk_image__batching(void)
+{
+	return completion_batch;
+}
+
 int disk_image__init(struct kvm *kvm)
 {
 	if (kvm->nr_disks) {
@@ -360,4 +1218,5 @@ int disk_image__exit(struct kvm *kvm)
 {
 	return disk_image__close_all(kvm->disks, kvm->nr_disks);
 }
-dev_base_exit(disk_image__exit);
+/* Alongside the unpinning of guest RAM and the release of its pages */
+dev_base_exit_parallel(disk_image__exit);
@@ -0,0 +1,950 @@
+#include "kvm/disk-image.h"
+#include "kvm/host-numa.h"
+#include "kvm/iovec.h"
+#include "kvm/mutex.h"
+#include "kvm/kvm.h"
+#include "kvm/read-write.h"
+
+#include <linux/byteorder.h>
+#include <linux/err.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/*
+ * AES-XTS (IEEE 1619) encryption of an image, one data unit per 512-byte
+ * sector and the sector number as tweak, which is what dm-crypt calls
+ * aes-xts-plain64. The key file holds both keys of XTS, 32 bytes for
+ * AES-128 or 64 bytes for AES-256, so that "cryptsetup open --type plain
+ * --cipher aes-xts-plain64 --key-file <key> --key-size 512" opens the same
+ * image on the host.
+ *
+ * The image only ever sees ciphertext: reads are decrypted in the buffers
+ * of the guest once the image is done with them, writes are encrypted into
+ * a bounce buffer first. Large requests are split between the submitting
+ * thread and a few workers.
+ *
+ * The AES instructions of the host are used when it has them. The portable
+ * lookup tables are slow and leak through the cache, they're only there so
+ * that images can still be opened anywhere.
+ */
+
+#define XTS_BLOCK_SIZE		16
+#define XTS_BLOCKS		((int)(SECTOR_SIZE / XTS_BLOCK_SIZE))
+/* The tweaks of this many sectors are encrypted together */
+#define XTS_BATCH		8
+
+#define AES_MAX_ROUNDS		14
+
+/* Sectors handed to a worker at a time, and the requests worth splitting */
+#define DISK_CRYPT_CHUNK_SECTORS	64
+#define DISK_CRYPT_PARALLEL_MIN		(256 * 1024)
+#define DISK_CRYPT_MAX_WORKERS		4
+
+struct aes_key {
+	/* Round keys as the AES instructions load them, then as words */
+	u8	enc[AES_MAX_ROUNDS + 1][16] __attribute__((aligned(16)));
+	/* For the equivalent inverse cipher */
+	u8	dec[AES_MAX_ROUNDS + 1][16] __attribute__((aligned(16)));
+	u32	enc_w[4 * (AES_MAX_ROUNDS + 1)];
+	u32	dec_w[4 * (AES_MAX_ROUNDS + 1)];
+	int	rounds;
+};
+
+struct disk_crypt_impl {
+	const char	*name;
+	bool		(*usable)(void);
+	/* Encrypt @nr blocks in place, for the tweaks */
+	void		(*encrypt_blocks)(const struct aes_key *key, u8 *blocks,
+					  int nr);
+	/* Of one sector, with the tweak of each block in @tweaks */
+	void		(*crypt_sector)(const struct aes_key *key, u8 *buf,
+					const u8 *tweaks, bool encrypt);
+};
+
+struct disk_crypt_chunk {
+	u8			*buf;
+	u64			sector;
+	u32			nr;
+};
+
+struct disk_crypt_job {
+	struct disk_crypt_chunk	*chunks;
+	u32			nr_chunks;
+	/* The next chunk to take, atomic */
+	u32			next;
+	bool			encrypt;
+	/* Workers on the job, under the pool lock */
+	int			active;
+};
+
+struct disk_crypt {
+	struct disk_image	*backing;
+	const struct disk_crypt_impl *impl;
+	struct aes_key		data;
+	struct aes_key		tweak;
+
+	pthread_t		workers[DISK_CRYPT_MAX_WORKERS];
+	int			nr_workers;
+	struct mutex		lock;
+	pthread_cond_t		work;
+	pthread_cond_t		idle;
+	/* The job the workers may join, one at a time, under the lock */
+	struct disk_crypt_job	*job;
+	u64			gen;
+	bool			stop;
+};
+
+struct disk_crypt_wait {
+	struct mutex		lock;
+	pthread_cond_t		cond;
+	bool			done;
+	long			len;
+};
+
+static u8 aes_sbox[256], aes_inv_sbox[256];
+static u32 aes_te[4][256], aes_td[4][256];
+static pthread_once_t aes_tables_once = PTHREAD_ONCE_INIT;
+
+static u8 aes__mul(u8 a, u8 b)
+{
+	u8 r = 0;
+
+	while (b) {
+		if (b & 1)
+			r ^= a;
+		a = (a << 1) ^ (a & 0x80 ? 0x1b : 0);
+		b >>= 1;
+	}
+
+	return r;
+}
+
+static u32 aes__ror(u32 w, int n)
+{
+	return w >> n | w << (32 - n);
+}
+
+static u8 aes__rol8(u8 b, int n)
+{
+	return b << n | b >> (8 - n);
+}
+
+static void aes__init_tables(void)
+{
+	u8 p = 1, q = 1, s, is;
+	int i, j;
+
+	/* p runs through the multiplicative group, q through its inverses */
+	do {
+		p = p ^ (p << 1) ^ (p & 0x80 ? 0x1b : 0);
+		q ^= q << 1;
+		q ^= q << 2;
+		q ^= q << 4;
+		if (q & 0x80)
+			q ^= 0x09;
+		aes_sbox[p] = q ^ aes__rol8(q, 1) ^ aes__rol8(q, 2) ^
+			      aes__rol8(q, 3) ^ aes__rol8(q, 4) ^ 0x63;
+	} while (p != 1);
+	aes_sbox[0] = 0x63;
+
+	for (i = 0; i < 256; i++)
+		aes_inv_sbox[aes_sbox[i]] = i;
+
+	for (i = 0; i < 256; i++) {
+		s = aes_sbox[i];
+		is = aes_inv_sbox[i];
+		aes_te[0][i] = (u32)aes__mul(s, 2) << 24 | s << 16 | s << 8 |
+			       aes__mul(s, 3);
+		aes_td[0][i] = (u32)aes__mul(is, 14) << 24 | aes__mul(is, 9) << 16 |
+			       aes__mul(is, 13) << 8 | aes__mul(is, 11);
+		for (j = 1; j < 4; j++) {
+			aes_te[j][i] = aes__ror(aes_te[0][i], 8 * j);
+			aes_td[j][i] = aes__ror(aes_td[0][i], 8 * j);
+		}
+	}
+}
+
+static u32 aes__sub_word(u32 w)
+{
+	return (u32)aes_sbox[w >> 24] << 24 | aes_sbox[(w >> 16) & 0xff] << 16 |
+	       aes_sbox[(w >> 8) & 0xff] << 8 | aes_sbox[w & 0xff];
+}
+
+static u32 aes__inv_mix_column(u32 w)
+{
+	return aes_td[0][aes_sbox[w >> 24]] ^
+	       aes_td[1][aes_sbox[(w >> 16) & 0xff]] ^
+	       aes_td[2][aes_sbox[(w >> 8) & 0xff]] ^
+	       aes_td[3][aes_sbox[w & 0xff]];
+}
+
+static u32 aes__load_be32(const u8 *p)
+{
+	return (u32)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void aes__store_be32(u8 *p, u32 w)
+{
+	p[0] = w >> 24;
+	p[1] = w >> 16;
+	p[2] = w >> 8;
+	p[3] = w;
+}
+
+/* FIPS-197 key expansion, for 16 or 32 bytes of key */
+static void aes__expand_key(struct aes_key *key, const u8 *raw, int len)
+{
+	static const u8 rcon[] = {
+		0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36,
+	};
+	int nk = len / 4, nr = nk + 6, nw = 4 * (nr + 1);
+	u32 *w = key->enc_w, t;
+	int i, r;
+
+	pthread_once(&aes_tables_once, aes__init_tables);
+
+	key->rounds = nr;
+	for (i = 0; i < nk; i++)
+		w[i] = aes__load_be32(raw + 4 * i);
+	for (; i < nw; i++) {
+		t = w[i - 1];
+		if (i % nk == 0)
+			t = aes__sub_word(t << 8 | t >> 24) ^ (u32)rcon[i / nk - 1] << 24;
+		else if (nk > 6 && i % nk == 4)
+			t = aes__sub_word(t);
+		w[i] = w[i - nk] ^ t;
+	}
+
+	for (i = 0; i < 4; i++) {
+		key->dec_w[i] = w[4 * nr + i];
+		key->dec_w[4 * nr + i] = w[i];
+	}
+	for (r = 1; r < nr; r++) {
+		for (i = 0; i < 4; i++)
+			key->dec_w[4 * r + i] =
+				aes__inv_mix_column(w[4 * (nr - r) + i]);
+	}
+
+	for (r = 0; r <= nr; r++) {
+		for (i = 0; i < 4; i++) {
+			aes__store_be32(key->enc[r] + 4 * i, w[4 * r + i]);
+			aes__store_be32(key->dec[r] + 4 * i,
+					key->dec_w[4 * r + i]);
+		}
+	}
+}
+
+static void aes_generic__encrypt(const struct aes_key *key, u8 *block)
+{
+	const u32 *rk = key->enc_w;
+	u32 s0, s1, s2, s3, t0, t1, t2, t3;
+	int r;
+
+	s0 = aes__load_be32(block) ^ rk[0];
+	s1 = aes__load_be32(block + 4) ^ rk[1];
+	s2 = aes__load_be32(block + 8) ^ rk[2];
+	s3 = aes__load_be32(block + 12) ^ rk[3];
+
+	for (r = 1; r < key->rounds; r++) {
+		rk += 4;
+		t0 = aes_te[0][s0 >> 24] ^ aes_te[1][(s1 >> 16) & 0xff] ^
+		     aes_te[2][(s2 >> 8) & 0xff] ^ aes_te[3][s3 & 0xff] ^ rk[0];
+		t1 = aes_te[0][s1 >> 24] ^ aes_te[1][(s2 >> 16) & 0xff] ^
+		     aes_te[2][(s3 >> 8) & 0xff] ^ aes_te[3][s0 & 0xff] ^ rk[1];
+		t2 = aes_te[0][s2 >> 24] ^ aes_te[1][(s3 >> 16) & 0xff] ^
+		     aes_te[2][(s0 >> 8) & 0xff] ^ aes_te[3][s1 & 0xff] ^ rk[2];
+		t3 = aes_te[0][s3 >> 24] ^ aes_te[1][(s0 >> 16) & 0xff] ^
+		     aes_te[2][(s1 >> 8) & 0xff] ^ aes_te[3][s2 & 0xff] ^ rk[3];
+		s0 = t0;
+		s1 = t1;
+		s2 = t2;
+		s3 = t3;
+	}
+
+	rk += 4;
+	aes__store_be32(block, ((u32)aes_sbox[s0 >> 24] << 24 |
+				aes_sbox[(s1 >> 16) & 0xff] << 16 |
+				aes_sbox[(s2 >> 8) & 0xff] << 8 |
+				aes_sbox[s3 & 0xff]) ^ rk[0]);
+	aes__store_be32(block + 4, ((u32)aes_sbox[s1 >> 24] << 24 |
+				    aes_sbox[(s2 >> 16) & 0xff] << 16 |
+				    aes_sbox[(s3 >> 8) & 0xff] << 8 |
+				    aes_sbox[s0 & 0xff]) ^ rk[1]);
+	aes__store_be32(block + 8, ((u32)aes_sbox[s2 >> 24] << 24 |
+				    aes_sbox[(s3 >> 16) & 0xff] << 16 |
+				    aes_sbox[(s0 >> 8) & 0xff] << 8 |
+				    aes_sbox[s1 & 0xff]) ^ rk[2]);
+	aes__store_be32(block + 12, ((u32)aes_sbox[s3 >> 24] << 24 |
+				     aes_sbox[(s0 >> 16) & 0xff] << 16 |
+				     aes_sbox[(s1 >> 8) & 0xff] << 8 |
+				     aes_sbox[s2 & 0xff]) ^ rk[3]);
+}
+
+static void aes_generic__decrypt(const struct aes_key *key, u8 *block)
+{
+	const u32 *rk = key->dec_w;
+	u32 s0, s1, s2, s3, t0, t1, t2, t3;
+	int r;
+
+	s0 = aes__load_be32(block) ^ rk[0];
+	s1 = aes__load_be32(block + 4) ^ rk[1];
+	s2 = aes__load_be32(block + 8) ^ rk[2];
+	s3 = aes__load_be32(block + 12) ^ rk[3];
+
+	for (r = 1; r < key->rounds; r++) {
+		rk += 4;
+		t0 = aes_td[0][s0 >> 24] ^ aes_td[1][(s3 >> 16) & 0xff] ^
+		     aes_td[2][(s2 >> 8) & 0xff] ^ aes_td[3][s1 & 0xff] ^ rk[0];
+		t1 = aes_td[0][s1 >> 24] ^ aes_td[1][(s0 >> 16) & 0xff] ^
+		     aes_td[2][(s3 >> 8) & 0xff] ^ aes_td[3][s2 & 0xff] ^ rk[1];
+		t2 = aes_td[0][s2 >> 24] ^ aes_td[1][(s1 >> 16) & 0xff] ^
+		     aes_td[2][(s0 >> 8) & 0xff] ^ aes_td[3][s3 & 0xff] ^ rk[2];
+		t3 = aes_td[0][s3 >> 24] ^ aes_td[1][(s2 >> 16) & 0xff] ^
+		     aes_td[2][(s1 >> 8) & 0xff] ^ aes_td[3][s0 & 0xff] ^ rk[3];
+		s0 = t0;
+		s1 = t1;
+		s2 = t2;
+		s3 = t3;
+	}
+
+	rk += 4;
+	aes__store_be32(block, ((u32)aes_inv_sbox[s0 >> 24] << 24 |
+				aes_inv_sbox[(s3 >> 16) & 0xff] << 16 |
+				aes_inv_sbox[(s2 >> 8) & 0xff] << 8 |
+				aes_inv_sbox[s1 & 0xff]) ^ rk[0]);
+	aes__store_be32(block + 4, ((u32)aes_inv_sbox[s1 >> 24] << 24 |
+				    aes_inv_sbox[(s0 >> 16) & 0xff] << 16 |
+				    aes_inv_sbox[(s3 >> 8) & 0xff] << 8 |
+				    aes_inv_sbox[s2 & 0xff]) ^ rk[1]);
+	aes__store_be32(block + 8, ((u32)aes_inv_sbox[s2 >> 24] << 24 |
+				    aes_inv_sbox[(s1 >> 16) & 0xff] << 16 |
+				    aes_inv_sbox[(s0 >> 8) & 0xff] << 8 |
+				    aes_inv_sbox[s3 & 0xff]) ^ rk[2]);
+	aes__store_be32(block + 12, ((u32)aes_inv_sbox[s3 >> 24] << 24 |
+				     aes_inv_sbox[(s2 >> 16) & 0xff] << 16 |
+				     aes_inv_sbox[(s1 >> 8) & 0xff] << 8 |
+				     aes_inv_sbox[s0 & 0xff]) ^ rk[3]);
+}
+
+static bool aes_generic__usable(void)
+{
+	return true;
+}
+
+static void aes_generic__encrypt_blocks(const struct aes_key *key, u8 *blocks,
+					int nr)
+{
+	for (; nr; nr--, blocks += XTS_BLOCK_SIZE)
+		aes_generic__encrypt(key, blocks);
+}
+
+static void xts__xor(u8 *dst, const u8 *src)
+{
+	int i;
+
+	for (i = 0; i < XTS_BLOCK_SIZE; i++)
+		dst[i] ^= src[i];
+}
+
+static void aes_generic__crypt_sector(const struct aes_key *key, u8 *buf,
+				      const u8 *tweaks, bool encrypt)
+{
+	int i;
+
+	for (i = 0; i < XTS_BLOCKS; i++) {
+		xts__xor(buf, tweaks);
+		if (encrypt)
+			aes_generic__encrypt(key, buf);
+		else
+			aes_generic__decrypt(key, buf);
+		xts__xor(buf, tweaks);
+		buf += XTS_BLOCK_SIZE;
+		tweaks += XTS_BLOCK_SIZE;
+	}
+}
+
+#if defined(__x86_64__)
+
+static bool aes_ni__usable(void)
+{
+	return __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse4.1");
+}
+
+__attribute__((target("aes,sse4.1")))
+static void aes_ni__encrypt_blocks(const struct aes_key *key, u8 *blocks,
+				   int nr)
+{
+	__m128i x[XTS_BATCH], k;
+	int i, r, n;
+
+	for (; nr; nr -= n, blocks += n * XTS_BLOCK_SIZE) {
+		n = min(nr, XTS_BATCH);
+		k = _mm_load_si128((const __m128i *)key->enc[0]);
+		for (i = 0; i < n; i++)
+			x[i] = _mm_xor_si128(_mm_loadu_si128((__m128i *)blocks + i), k);
+		for (r = 1; r < key->rounds; r++) {
+			k = _mm_load_si128((const __m128i *)key->enc[r]);
+			for (i = 0; i < n; i++)
+				x[i] = _mm_aesenc_si128(x[i], k);
+		}
+		k = _mm_load_si128((const __m128i *)key->enc[r]);
+		for (i = 0; i < n; i++)
+			_mm_storeu_si128((__m128i *)blocks + i,
+					 _mm_aesenclast_si128(x[i], k));
+	}
+}
+
+/* Eight blocks at a time keep the AES units of the core busy */
+__attribute__((target("aes,sse4.1")))
+static void aes_ni__crypt_sector(const struct aes_key *key, u8 *buf,
+				 const u8 *tweaks, bool encrypt)
+{
+	const u8 (*rk)[16] = encrypt ? key->enc : key->dec;
+	__m128i *data = (__m128i *)buf;
+	__m128i x[8], t[8], k;
+	int i, j, r;
+
+	for (i = 0; i < XTS_BLOCKS; i += 8) {
+		k = _mm_load_si128((const __m128i *)rk[0]);
+		for (j = 0; j < 8; j++) {
+			t[j] = _mm_loadu_si128((const __m128i *)tweaks + i + j);
+			x[j] = _mm_xor_si128(_mm_loadu_si128(data + i + j), t[j]);
+			x[j] = _mm_xor_si128(x[j], k);
+		}
+		for (r = 1; r < key->rounds; r++) {
+			k = _mm_load_si128((const __m128i *)rk[r]);
+			for (j = 0; j < 8; j++)
+				x[j] = encrypt ? _mm_aesenc_si128(x[j], k) :
+						 _mm_aesdec_si128(x[j], k);
+		}
+		k = _mm_load_si128((const __m128i *)rk[r]);
+		for (j = 0; j < 8; j++) {
+			x[j] = encrypt ? _mm_aesenclast_si128(x[j], k) :
+					 _mm_aesdeclast_si128(x[j], k);
+			_mm_storeu_si128(data + i + j, _mm_xor_si128(x[j], t[j]));
+		}
+	}
+}
+
+static bool aes_vaes__usable(void)
+{
+	return aes_ni__usable() && __builtin_cpu_supports("avx2") &&
+	       __builtin_cpu_supports("vaes");
+}
+
+/* Two blocks per instruction, sixteen in flight */
+__attribute__((target("vaes,avx2,aes")))
+static void aes_vaes__crypt_sector(const struct aes_key *key, u8 *buf,
+				   const u8 *tweaks, bool encrypt)
+{
+	const u8 (*rk)[16] = encrypt ? key->enc : key->dec;
+	__m256i *data = (__m256i *)buf;
+	__m256i k[AES_MAX_ROUNDS + 1];
+	__m256i x[8], t[8];
+	int i, j, r;
+
+	for (r = 0; r <= key->rounds; r++)
+		k[r] = _mm256_broadcastsi128_si256(
+			_mm_load_si128((const __m128i *)rk[r]));
+
+	for (i = 0; i < XTS_BLOCKS / 2; i += 8) {
+		for (j = 0; j < 8; j++) {
+			t[j] = _mm256_loadu_si256((const __m256i *)tweaks + i + j);
+			x[j] = _mm256_xor_si256(_mm256_loadu_si256(data + i + j), t[j]);
+			x[j] = _mm256_xor_si256(x[j], k[0]);
+		}
+		for (r = 1; r < key->rounds; r++) {
+			for (j = 0; j < 8; j++)
+				x[j] = encrypt ? _mm256_aesenc_epi128(x[j], k[r]) :
+						 _mm256_aesdec_epi128(x[j], k[r]);
+		}
+		for (j = 0; j < 8; j++) {
+			x[j] = encrypt ? _mm256_aesenclast_epi128(x[j], k[r]) :
+					 _mm256_aesdeclast_epi128(x[j], k[r]);
+			_mm256_storeu_si256(data + i + j, _mm256_xor_si256(x[j], t[j]));
+		}
+	}
+}
+
+#elif defined(__aarch64__)
+
+static bool aes_ce__usable(void)
+{
+	return getauxval(AT_HWCAP) & HWCAP_AES;
+}
+
+/*
+ * AESE is AddRoundKey, SubBytes and ShiftRows, so the key of the last round
+ * is added on its own.
+ */
+__attribute__((target("+crypto")))
+static void aes_ce__encrypt_blocks(const struct aes_key *key, u8 *blocks,
+				   int nr)
+{
+	uint8x16_t x;
+	int r;
+
+	for (; nr; nr--, blocks += XTS_BLOCK_SIZE) {
+		x = vld1q_u8(blocks);
+		for (r = 0; r < key->rounds - 1; r++)
+			x = vaesmcq_u8(vaeseq_u8(x, vld1q_u8(key->enc[r])));
+		x = vaeseq_u8(x, vld1q_u8(key->enc[r]));
+		vst1q_u8(blocks, veorq_u8(x, vld1q_u8(key->enc[r + 1])));
+	}
+}
+
+__attribute__((target("+crypto")))
+static void aes_ce__crypt_sector(const struct aes_key *key, u8 *buf,
+				 const u8 *tweaks, bool encrypt)
+{
+	const u8 (*rk)[16] = encrypt ? key->enc : key->dec;
+	uint8x16_t x[4], t[4], k;
+	int i, j, r;
+
+	for (i = 0; i < XTS_BLOCKS; i += 4) {
+		for (j = 0; j < 4; j++) {
+			t[j] = vld1q_u8(tweaks + (i + j) * XTS_BLOCK_SIZE);
+			x[j] = veorq_u8(vld1q_u8(buf + (i + j) * XTS_BLOCK_SIZE),
+					t[j]);
+		}
+		for (r = 0; r < key->rounds - 1; r++) {
+			k = vld1q_u8(rk[r]);
+			for (j = 0; j < 4; j++)
+				x[j] = encrypt ? vaesmcq_u8(vaeseq_u8(x[j], k)) :
+						 vaesimcq_u8(vaesdq_u8(x[j], k));
+		}
+		k = vld1q_u8(rk[r]);
+		for (j = 0; j < 4; j++) {
+			x[j] = encrypt ? vaeseq_u8(x[j], k) : vaesdq_u8(x[j], k);
+			x[j] = veorq_u8(x[j], vld1q_u8(rk[r + 1]));
+			vst1q_u8(buf + (i + j) * XTS_BLOCK_SIZE,
+				 veorq_u8(x[j], t[j]));
+		}
+	}
+}
+
+#endif
+
+/* In order of preference, the last one is always usable */
+static const struct disk_crypt_impl disk_crypt_impls[] = {
+#if defined(__x86_64__)
+	{ "VAES", aes_vaes__usable, aes_ni__encrypt_blocks, aes_vaes__crypt_sector },
+	{ "AES-NI", aes_ni__usable, aes_ni__encrypt_blocks, aes_ni__crypt_sector },
+#elif defined(__aarch64__)
+	{ "ARMv8 AES", aes_ce__usable, aes_ce__encrypt_blocks, aes_ce__crypt_sector },
+#endif
+	{ "generic", aes_generic__usable, aes_generic__encrypt_blocks,
+	  aes_generic__crypt_sector },
+};
+
+/* The tweak of each block is the previous one times x in GF(2^128) */
+static void xts__tweaks(u8 tweaks[XTS_BLOCKS][XTS_BLOCK_SIZE], const u8 *first)
+{
+	u64 lo, hi, carry;
+	int i;
+
+	memcpy(&lo, first, sizeof(lo));
+	memcpy(&hi, first + 8, sizeof(hi));
+	lo = le64_to_cpu(lo);
+	hi = le64_to_cpu(hi);
+
+	for (i = 0; i < XTS_BLOCKS; i++) {
+		u64 le_lo = cpu_to_le64(lo), le_hi = cpu_to_le64(hi);
+
+		memcpy(tweaks[i], &le_lo, sizeof(le_lo));
+		memcpy(tweaks[i] + 8, &le_hi, sizeof(le_hi));
+
+		carry = hi >> 63;
+		hi = hi << 1 | lo >> 63;
+		lo = lo << 1 ^ (0x87 & -carry);
+	}
+}
+
+static void disk_crypt__sectors(struct disk_crypt *c, u8 *buf, u64 sector,
+				u64 nr, bool encrypt)
+{
+	u8 tweaks[XTS_BLOCKS][XTS_BLOCK_SIZE] __attribute__((aligned(32)));
+	u8 first[XTS_BATCH][XTS_BLOCK_SIZE];
+	u64 le;
+	int i, n;
+
+	for (; nr; nr -= n) {
+		n = min_t(u64, nr, XTS_BATCH);
+
+		memset(first, 0, sizeof(first));
+		for (i = 0; i < n; i++) {
+			le = cpu_to_le64(sector + i);
+			memcpy(first[i], &le, sizeof(le));
+		}
+		c->impl->encrypt_blocks(&c->tweak, first[0], n);
+
+		for (i = 0; i < n; i++) {
+			xts__tweaks(tweaks, first[i]);
+			c->impl->crypt_sector(&c->data, buf, tweaks[0], encrypt);
+			buf += SECTOR_SIZE;
+		}
+		sector += n;
+	}
+}
+
+static void disk_crypt__run_job(struct disk_crypt *c, struct disk_crypt_job *job)
+{
+	struct disk_crypt_chunk *chunk;
+	u32 i;
+
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+	       job->nr_chunks) {
+		chunk = &job->chunks[i];
+		disk_crypt__sectors(c, chunk->buf, chunk->sector, chunk->nr,
+				    job->encrypt);
+	}
+}
+
+static void *disk_crypt__worker(void *arg)
+{
+	struct disk_crypt *c = arg;
+	struct disk_crypt_job *job;
+	u64 seen = 0;
+
+	kvm__set_thread_name("disk-crypt");
+	host_numa__bind_thread(c->backing->numa_node);
+
+	mutex_lock(&c->lock);
+	while (!c->stop) {
+		if (!c->job || c->gen == seen) {
+			pthread_cond_wait(&c->work, &c->lock.mutex);
+			continue;
+		}
+
+		seen = c->gen;
+		job = c->job;
+		job->active++;
+		mutex_unlock(&c->lock);
+
+		disk_crypt__run_job(c, job);
+
+		mutex_lock(&c->lock);
+		if (!--job->active)
+			pthread_cond_signal(&c->idle);
+	}
+	mutex_unlock(&c->lock);
+
+	return NULL;
+}
+
+/* Encrypt or decrypt whole sectors in place, from @sector on */
+static int disk_crypt__iov(struct disk_crypt *c, const struct iovec *iov,
+			   int iovcount, u64 sector, bool encrypt)
+{
+	struct disk_crypt_job job = {
+		.encrypt	= encrypt,
+	};
+	size_t len = iov_size(iov, iovcount), off;
+	u32 nr_chunks = 0;
+	u64 nr;
+	int i;
+
+	if (!c->nr_workers || len < DISK_CRYPT_PARALLEL_MIN) {
+		for (i = 0; i < iovcount; i++) {
+			nr = iov[i].iov_len >> SECTOR_SHIFT;
+			disk_crypt__sectors(c, iov[i].iov_base, sector, nr, encrypt);
+			sector += nr;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < iovcount; i++)
+		nr_chunks += DIV_ROUND_UP(iov[i].iov_len >> SECTOR_SHIFT,
+					  DISK_CRYPT_CHUNK_SECTORS);
+	job.chunks = malloc(nr_chunks * sizeof(*job.chunks));
+	if (!job.chunks)
+		return -ENOMEM;
+
+	for (i = 0; i < iovcount; i++) {
+		for (off = 0; off < iov[i].iov_len; off += nr << SECTOR_SHIFT) {
+			nr = min_t(u64, (iov[i].iov_len - off) >> SECTOR_SHIFT,
+				   DISK_CRYPT_CHUNK_SECTORS);
+			job.chunks[job.nr_chunks++] = (struct disk_crypt_chunk) {
+				.buf	= iov[i].iov_base + off,
+				.sector	= sector,
+				.nr	= nr,
+			};
+			sector += nr;
+		}
+	}
+
+	/* The workers help with one request at a time, others go alone */
+	mutex_lock(&c->lock);
+	if (!c->job) {
+		c->job = &job;
+		c->gen++;
+		pthread_cond_broadcast(&c->work);
+	}
+	mutex_unlock(&c->lock);
+
+	disk_crypt__run_job(c, &job);
+
+	mutex_lock(&c->lock);
+	if (c->job == &job)
+		c->job = NULL;
+	while (job.active)
+		pthread_cond_wait(&c->idle, &c->lock.mutex);
+	mutex_unlock(&c->lock);
+
+	free(job.chunks);
+
+	return 0;
+}
+
+static bool disk_crypt__aligned(const struct iovec *iov, int iovcount)
+{
+	int i;
+
+	for (i = 0; i < iovcount; i++) {
+		if (iov[i].iov_len & (SECTOR_SIZE - 1))
+			return false;
+	}
+
+	return true;
+}
+
+static void disk_crypt__backing_done(void *param, long len)
+{
+	struct disk_crypt_wait *wait = param;
+
+	mutex_lock(&wait->lock);
+	wait->len = len;
+	wait->done = true;
+	pthread_cond_signal(&wait->cond);
+	mutex_unlock(&wait->lock);
+}
+
+/* Whatever the engine of the image, wait for the request to complete */
+static ssize_t disk_crypt__backing_io(struct disk_crypt *c, bool write,
+				      u64 sector, const struct iovec *iov,
+				      int iovcount)
+{
+	struct disk_crypt_wait wait = {};
+
+	mutex_init(&wait.lock);
+	pthread_cond_init(&wait.cond, NULL);
+
+	if (write)
+		disk_image__write(c->backing, sector, iov, iovcount, &wait);
+	else
+		disk_image__read(c->backing, sector, iov, iovcount, &wait);
+
+	mutex_lock(&wait.lock);
+	while (!wait.done)
+		pthread_cond_wait(&wait.cond, &wait.lock.mutex);
+	mutex_unlock(&wait.lock);
+	pthread_cond_destroy(&wait.cond);
+
+	return wait.len;
+}
+
+static ssize_t disk_crypt__read(struct disk_image *disk, u64 sector,
+				const struct iovec *iov, int iovcount,
+				void *param)
+{
+	struct disk_crypt *c = disk->priv;
+	size_t len = iov_size(iov, iovcount);
+	struct iovec bounce;
+	ssize_t r;
+
+	if (len & (SECTOR_SIZE - 1))
+		return -EINVAL;
+
+	/* Usually the sectors don't straddle buffers, and are decrypted there */
+	if (disk_crypt__aligned(iov, iovcount)) {
+		r = disk_crypt__backing_io(c, false, sector, iov, iovcount);
+		if (r == (ssize_t)len)
+			r = disk_crypt__iov(c, iov, iovcount, sector, false) ?: r;
+		return r;
+	}
+
+	bounce.iov_len = len;
+	bounce.iov_base = malloc(len);
+	if (!bounce.iov_base)
+		return -ENOMEM;
+
+	r = disk_crypt__backing_io(c, false, sector, &bounce, 1);
+	if (r == (ssize_t)len)
+		r = disk_crypt__iov(c, &bounce, 1, sector, false) ?: r;
+	if (r == (ssize_t)len)
+		memcpy_toiovecend(iov, bounce.iov_base, 0, len);
+
+	free(bounce.iov_base);
+
+	return r;
+}
+
+/* The buffers of the guest are left alone, the image gets a copy */
+static ssize_t disk_crypt__write(struct disk_image *disk, u64 sector,
+				 const struct iovec *iov, int iovcount,
+				 void *param)
+{
+	struct disk_crypt *c = disk->priv;
+	size_t len = iov_size(iov, iovcount);
+	struct iovec bounce;
+	ssize_t r;
+
+	if (len & (SECTOR_SIZE - 1))
+		return -EINVAL;
+
+	bounce.iov_len = len;
+	bounce.iov_base = malloc(len);
+	if (!bounce.iov_base)
+		return -ENOMEM;
+
+	memcpy_fromiovecend(bounce.iov_base, iov, 0, len);
+	r = disk_crypt__iov(c, &bounce, 1, sector, true);
+	if (!r)
+		r = disk_crypt__backing_io(c, true, sector, &bounce, 1);
+
+	free(bounce.iov_base);
+
+	return r;
+}
+
+static int disk_crypt__flush(struct disk_image *disk)
+{
+	struct disk_crypt *c = disk->priv;
+
+	return disk_image__flush(c->backing);
+}
+
+static void disk_crypt__destroy(struct disk_crypt *c)
+{
+	int i;
+
+	mutex_lock(&c->lock);
+	c->stop = true;
+	pthread_cond_broadcast(&c->work);
+	mutex_unlock(&c->lock);
+	for (i = 0; i < c->nr_workers; i++)
+		pthread_join(c->workers[i], NULL);
+
+	pthread_cond_destroy(&c->work);
+	pthread_cond_destroy(&c->idle);
+	explicit_bzero(&c->data, sizeof(c->data));
+	explicit_bzero(&c->tweak, sizeof(c->tweak));
+	free(c);
+}
+
+static int disk_crypt__close(struct disk_image *disk)
+{
+	struct disk_crypt *c = disk->priv;
+	int r;
+
+	r = disk_image__close(c->backing);
+	disk_crypt__destroy(c);
+	free(disk);
+
+	return r;
+}
+
+static struct disk_image_operations disk_crypt_ops = {
+	.read	= disk_crypt__read,
+	.write	= disk_crypt__write,
+	.flush	= disk_crypt__flush,
+	.close	= disk_crypt__close,
+};
+
+static int disk_crypt__read_key(struct disk_crypt *c, const char *path)
+{
+	/* One more byte than fits, to notice keys that are too long */
+	u8 raw[65];
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	len = read_in_full(fd, raw, sizeof(raw));
+	close(fd);
+
+	if (len != 32 && len != 64) {
+		explicit_bzero(raw, sizeof(raw));
+		pr_err("The key in %s must be of 32 or 64 bytes", path);
+		return -EINVAL;
+	}
+
+	aes__expand_key(&c->data, raw, len / 2);
+	aes__expand_key(&c->tweak, raw + len / 2, len / 2);
+	explicit_bzero(raw, sizeof(raw));
+
+	return 0;
+}
+
+/*
+ * Decrypt what @backing holds with the key in params->crypt_key. On
+ * failure, @backing is left to the caller.
+ */
+struct disk_image *disk_crypt__open(struct disk_image *backing,
+				    struct disk_image_params *params)
+{
+	struct disk_image *disk;
+	struct disk_crypt *c;
+	long nr_cpus;
+	int i, r;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return ERR_PTR(-ENOMEM);
+
+	c->backing = backing;
+	mutex_init(&c->lock);
+	pthread_cond_init(&c->work, NULL);
+	pthread_cond_init(&c->idle, NULL);
+
+	r = disk_crypt__read_key(c, params->crypt_key);
+	if (r < 0)
+		goto err_destroy;
+
+	for (i = 0; !c->impl; i++) {
+		if (disk_crypt_impls[i].usable())
+			c->impl = &disk_crypt_impls[i];
+	}
+	pr_debug("%s: AES-%d-XTS with %s instructions", params->filename,
+		 c->data.rounds == 10 ? 128 : 256, c->impl->name);
+
+	/* Whoever submits a request works on it too */
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (i = 0; i < min_t(long, nr_cpus - 1, DISK_CRYPT_MAX_WORKERS); i++) {
+		if (pthread_create(&c->workers[i], NULL, disk_crypt__worker, c))
+			break;
+		c->nr_workers++;
+	}
+
+	disk = disk_image__new(backing->fd, backing->size, &disk_crypt_ops,
+			       DISK_IMAGE_REGULAR);
+	if (IS_ERR(disk)) {
+		r = PTR_ERR(disk);
+		goto err_destroy;
+	}
+	disk->priv = c;
+	disk->readonly = backing->readonly;
+	disk->topology = backing->topology;
+	disk->numa_node = backing->numa_node;
+	disk_image__set_callback(backing, disk_crypt__backing_done);
+
+	return disk;
+
+err_destroy:
+	disk_crypt__destroy(c);
+	return ERR_PTR(r);
+}
@@ -0,0 +1,180 @@
+#include "kvm/disk-image.h"
+#include "kvm/host-numa.h"
+#include "kvm/iovec.h"
+#include "kvm/kvm.h"
+#include "kvm/mutex.h"
+
+#include <linux/kernel.h>
+#include <sys/stat.h>
+
+/*
+ * O_DIRECT requests go straight between the image and guest memory.
+ * Segments that don't meet the alignment the kernel requires are staged
+ * in bounce buffers instead, synchronously.
+ */
+#define DISK_BOUNCE_SIZE	(256 * 1024)
+#define DISK_BOUNCE_POOL_MAX	8
+
+struct disk_direct {
+	u32			mem_align;
+	u32			offset_align;
+
+	struct mutex		lock;
+	int			nr_free;
+	void			*free[DISK_BOUNCE_POOL_MAX];
+};
+
+static void disk_direct__get_align(struct disk_image *disk, struct stat *st,
+				   struct disk_direct *dio)
+{
+	int size;
+
+	dio->mem_align = dio->offset_align = SECTOR_SIZE;
+
+	if (S_ISBLK(st->st_mode)) {
+		if (ioctl(disk->fd, BLKSSZGET, &size) == 0 && size > 0)
+			dio->mem_align = dio->offset_align = size;
+		return;
+	}
+
+#ifdef STATX_DIOALIGN
+	{
+		struct statx stx;
+
+		if (statx(disk->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+		    (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align) {
+			dio->mem_align = stx.stx_dio_mem_align;
+			dio->offset_align = stx.stx_dio_offset_align;
+		}
+	}
+#endif
+}
+
+int disk_direct__init(struct disk_image *disk, struct stat *st)
+{
+	struct disk_direct *dio;
+
+	dio = calloc(1, sizeof(*dio));
+	if (!dio)
+		return -ENOMEM;
+
+	mutex_init(&dio->lock);
+	disk_direct__get_align(disk, st, dio);
+	disk->direct = dio;
+
+	return 0;
+}
+
+void disk_direct__exit(struct disk_image *disk)
+{
+	struct disk_direct *dio = disk->direct;
+
+	if (!dio)
+		return;
+
+	while (dio->nr_free)
+		free(dio->free[--dio->nr_free]);
+
+	free(dio);
+	disk->direct = NULL;
+}
+
+u32 disk_direct__block_size(struct disk_image *disk)
+{
+	return disk->direct ? disk->direct->offset_align : SECTOR_SIZE;
+}
+
+bool disk_direct__aligned(struct disk_image *disk, const struct iovec *iov,
+			  int iovcount)
+{
+	unsigned long mask = disk->direct->mem_align - 1;
+	int i;
+
+	for (i = 0; i < iovcount; i++) {
+		if (((unsigned long)iov[i].iov_base | iov[i].iov_len) & mask)
+			return false;
+	}
+
+	return true;
+}
+
+static void *disk_direct__get_buf(struct disk_image *disk,
+				  struct disk_direct *dio)
+{
+	void *buf = NULL;
+
+	mutex_lock(&dio->lock);
+	if (dio->nr_free)
+		buf = dio->free[--dio->nr_free];
+	mutex_unlock(&dio->lock);
+
+	if (buf)
+		return buf;
+
+	if (posix_memalign(&buf, max_t(long, dio->mem_align, PAGE_SIZE),
+			   DISK_BOUNCE_SIZE))
+		return NULL;
+	host_numa__bind_mem(buf, DISK_BOUNCE_SIZE, disk->numa_node);
+
+	return buf;
+}
+
+static void disk_direct__put_buf(struct disk_direct *dio, void *buf)
+{
+	mutex_lock(&dio->lock);
+	if (dio->nr_free < DISK_BOUNCE_POOL_MAX) {
+		dio->free[dio->nr_free++] = buf;
+		buf = NULL;
+	}
+	mutex_unlock(&dio->lock);
+
+	free(buf);
+}
+
+ssize_t disk_direct__bounce(struct disk_image *disk, bool write, u64 sector,
+			    const struct iovec *iov, int iovcount)
+{
+	struct disk_direct *dio = disk->direct;
+	u64 offset = sector << SECTOR_SHIFT;
+	size_t total = iov_size(iov, iovcount);
+	size_t done, len;
+	ssize_t r = 0;
+	void *buf;
+
+	/* The guest was told about the block size, this isn't ours to fix */
+	if ((offset | total) & (dio->offset_align - 1))
+		return -EINVAL;
+
+	buf = disk_direct__get_buf(disk, dio);
+	if (!buf)
+		return -ENOMEM;
+
+	__sync_fetch_and_add(&disk->stats.bounced, 1);
+
+	for (done = 0; done < total; done += len) {
+		len = min_t(size_t, total - done, DISK_BOUNCE_SIZE);
+
+		if (write) {
+			memcpy_fromiovecend(buf, iov, done, len);
+			r = pwrite_in_full(disk->fd, buf, len, offset + done);
+		} else {
+			r = pread_in_full(disk->fd, buf, len, offset + done);
+			if (r > 0)
+				memcpy_toiovecend(iov, buf, done, r);
+		}
+
+		if (r < 0) {
+			r = -errno;
+			break;
+		}
+
+		if ((size_t)r < len) {
+			done += r;
+			break;
+		}
+	}
+
+	disk_direct__put_buf(dio, buf);
+
+	return r < 0 ? r : (ssize_t)done;
+}
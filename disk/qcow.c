@@ -1,21 +1,28 @@
 #include "kvm/qcow.h"
 
+#include "kvm/barrier.h"
 #include "kvm/disk-image.h"
+#include "kvm/iovec.h"
 #include "kvm/read-write.h"
 #include "kvm/mutex.h"
 #include "kvm/util.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #ifdef CONFIG_HAS_ZLIB
 #include <zlib.h>
 #endif
+#ifdef CONFIG_HAS_ZSTD
+#include <zstd.h>
+#endif
 
 #include <linux/err.h>
 #include <linux/byteorder.h>
@@ -23,7 +30,6 @@
 #include <linux/types.h>
 
 static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append);
-static int qcow_write_refcount_table(struct qcow *q);
 static u64 qcow_alloc_clusters(struct qcow *q, u64 size, int update_ref);
 static void  qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size);
 
@@ -36,89 +42,181 @@ static inline int qcow_pwrite_sync(int fd,
 	return fdatasync(fd);
 }
 
-static int l2_table_insert(struct rb_root *root, struct qcow_l2_table *new)
+/*
+ * The L1 and refcount tables are mapped privately rather than read in, so
+ * opening a large sparse image costs nothing, and only the pages of the
+ * tables that lookups go through are faulted in. Changed entries are
+ * written to the file one at a time, the private copy of their page keeps
+ * the new value. Tables that the file doesn't hold in full are read.
+ */
+static u64 *qcow_load_table(struct qcow *q, u64 offset, u64 nr,
+			    size_t *map_size)
 {
-	struct rb_node **link = &(root->rb_node), *parent = NULL;
-	u64 offset = new->offset;
+	u64 page_mask = (u64)getpagesize() - 1;
+	u64 start = offset & ~page_mask;
+	u64 end = offset + nr * sizeof(u64);
+	struct stat st;
+	u64 *table;
+	void *p;
+
+	*map_size = 0;
+
+	if (fstat(q->fd, &st) == 0 && (u64)st.st_size >= end) {
+		p = mmap(NULL, end - start, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			 q->fd, start);
+		if (p != MAP_FAILED) {
+			*map_size = end - start;
+			return p + (offset - start);
+		}
+	}
 
-	/* search the tree */
-	while (*link) {
-		struct qcow_l2_table *t;
+	table = calloc(nr, sizeof(u64));
+	if (!table)
+		return NULL;
 
-		t = rb_entry(*link, struct qcow_l2_table, node);
-		if (!t)
-			goto error;
+	if (pread_in_full(q->fd, table, nr * sizeof(u64), offset) < 0) {
+		free(table);
+		return NULL;
+	}
 
-		parent = *link;
+	return table;
+}
 
-		if (t->offset > offset)
-			link = &(*link)->rb_left;
-		else if (t->offset < offset)
-			link = &(*link)->rb_right;
-		else
-			goto out;
-	}
+static void qcow_unload_table(u64 *table, size_t map_size)
+{
+	u64 page_mask = (u64)getpagesize() - 1;
 
-	/* add new node */
-	rb_link_node(&new->node, parent, link);
-	rb_insert_color(&new->node, root);
-out:
-	return 0;
-error:
-	return -1;
+	if (map_size)
+		munmap((void *)((unsigned long)table & ~page_mask), map_size);
+	else
+		free(table);
 }
 
-static struct qcow_l2_table *l2_table_lookup(struct rb_root *root, u64 offset)
+static int qcow_write_table_entry(struct qcow *q, u64 *table, u64 idx,
+				  u64 table_offset)
 {
-	struct rb_node *link = root->rb_node;
+	return qcow_pwrite_sync(q->fd, &table[idx], sizeof(u64),
+				table_offset + idx * sizeof(u64));
+}
 
-	while (link) {
-		struct qcow_l2_table *t;
+/* In bytes, extended L2 entries take twice the room */
+static inline u64 l2_table_bytes(struct qcow *q)
+{
+	return (sizeof(u64) << q->header->l2_bits) << q->extended_l2;
+}
 
-		t = rb_entry(link, struct qcow_l2_table, node);
-		if (!t)
-			goto out;
+static inline u32 l2_cache_hash(u64 idx, u32 mask)
+{
+	return (u32)((idx * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+}
 
-		if (t->offset > offset)
-			link = link->rb_left;
-		else if (t->offset < offset)
-			link = link->rb_right;
-		else
+static struct qcow_l2_cache_shard *l2_cache_shard(struct qcow *q, u64 offset,
+						  struct hlist_head **bucket)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_l2_cache_shard *shard;
+	u64 idx = offset >> q->header->cluster_bits;
+
+	/* Spread neighbouring tables over the shards */
+	shard = &l1t->shards[idx & (l1t->nr_shards - 1)];
+	*bucket = &shard->buckets[l2_cache_hash(idx / l1t->nr_shards,
+						shard->bucket_mask)];
+
+	return shard;
+}
+
+static struct qcow_l2_table *l2_table_lookup(struct hlist_head *bucket, u64 offset)
+{
+	struct qcow_l2_table *t;
+
+	hlist_for_each_entry(t, bucket, node) {
+		if (t->offset == offset)
 			return t;
 	}
-out:
+
 	return NULL;
 }
 
+static int l1_table_init_cache(struct qcow *q, u64 cache_size)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	u64 table_size = l2_table_bytes(q);
+	u64 nr_tables, per_shard;
+	u32 nr_buckets, i;
+
+	nr_tables = cache_size / table_size;
+	if (!nr_tables)
+		nr_tables = cache_size ? 1 : QCOW_L2_CACHE_DEFAULT_TABLES;
+
+	l1t->nr_shards = 1;
+	while (l1t->nr_shards < QCOW_L2_CACHE_MAX_SHARDS &&
+	       nr_tables / (l1t->nr_shards * 2) >= QCOW_L2_CACHE_MIN_SHARD_TABLES)
+		l1t->nr_shards *= 2;
+
+	l1t->shards = calloc(l1t->nr_shards, sizeof(*l1t->shards));
+	if (!l1t->shards)
+		return -ENOMEM;
+
+	per_shard = DIV_ROUND_UP(nr_tables, l1t->nr_shards);
+	for (nr_buckets = 1; nr_buckets < per_shard; nr_buckets *= 2)
+		;
+
+	for (i = 0; i < l1t->nr_shards; i++) {
+		struct qcow_l2_cache_shard *shard = &l1t->shards[i];
+
+		pthread_rwlock_init(&shard->lock, NULL);
+		shard->nr_slots = per_shard;
+		shard->bucket_mask = nr_buckets - 1;
+		shard->buckets = calloc(nr_buckets, sizeof(*shard->buckets));
+		shard->slots = calloc(per_shard, sizeof(*shard->slots));
+		if (!shard->buckets || !shard->slots)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
 static void l1_table_free_cache(struct qcow_l1_table *l1t)
 {
-	struct rb_root *r = &l1t->root;
-	struct list_head *pos, *n;
-	struct qcow_l2_table *t;
+	struct qcow_l2_cache_shard *shard;
+	u32 i, j;
 
-	list_for_each_safe(pos, n, &l1t->lru_list) {
-		/* Remove cache table from the list and RB tree */
-		list_del(pos);
-		t = list_entry(pos, struct qcow_l2_table, list);
-		rb_erase(&t->node, r);
+	if (!l1t->shards)
+		return;
 
-		/* Free the cached node */
-		free(t);
+	for (i = 0; i < l1t->nr_shards; i++) {
+		shard = &l1t->shards[i];
+
+		if (shard->slots) {
+			for (j = 0; j < shard->nr_cached; j++)
+				free(shard->slots[j]);
+		}
+
+		free(shard->slots);
+		free(shard->buckets);
+		pthread_rwlock_destroy(&shard->lock);
 	}
+
+	free(l1t->shards);
+	l1t->shards = NULL;
 }
 
+/*
+ * Metadata updates are written back lazily, on eviction and on flush. Dirty
+ * refcount blocks and guest data always reach the disk before the L2 entries
+ * that point at the clusters, so a crash can only leak clusters.
+ */
+static int qcow_writeback_refcounts(struct qcow *q);
+
 static int qcow_l2_cache_write(struct qcow *q, struct qcow_l2_table *c)
 {
-	struct qcow_header *header = q->header;
-	u64 size;
-
 	if (!c->dirty)
 		return 0;
 
-	size = 1 << header->l2_bits;
+	if (qcow_writeback_refcounts(q) < 0)
+		return -1;
 
-	if (qcow_pwrite_sync(q->fd, c->table,
-		size * sizeof(u64), c->offset) < 0)
+	if (pwrite_in_full(q->fd, c->table, l2_table_bytes(q), c->offset) < 0)
 		return -1;
 
 	c->dirty = 0;
@@ -126,73 +224,141 @@ static int qcow_l2_cache_write(struct qcow *q, struct qcow_l2_table *c)
 	return 0;
 }
 
+/* Called with q->mutex held */
 static int cache_table(struct qcow *q, struct qcow_l2_table *c)
 {
-	struct qcow_l1_table *l1t = &q->table;
-	struct rb_root *r = &l1t->root;
-	struct qcow_l2_table *lru;
+	struct qcow_l2_cache_shard *shard;
+	struct qcow_l2_table *victim;
+	struct hlist_head *bucket;
 
-	if (l1t->nr_cached == MAX_CACHE_NODES) {
-		/*
-		 * The node at the head of the list is least recently used
-		 * node. Remove it from the list and replaced with a new node.
-		 */
-		lru = list_first_entry(&l1t->lru_list, struct qcow_l2_table, list);
+	shard = l2_cache_shard(q, c->offset, &bucket);
 
-		/* Remove the node from the cache */
-		rb_erase(&lru->node, r);
-		list_del_init(&lru->list);
-		l1t->nr_cached--;
+	down_write(&shard->lock);
 
-		/* Free the LRUed node */
-		free(lru);
+	if (l2_table_lookup(bucket, c->offset)) {
+		up_write(&shard->lock);
+		return -1;
 	}
 
-	/* Add new node in RB Tree: Helps in searching faster */
-	if (l2_table_insert(r, c) < 0)
-		goto error;
+	if (shard->nr_cached < shard->nr_slots) {
+		shard->slots[shard->nr_cached++] = c;
+		goto out;
+	}
+
+	/*
+	 * CLOCK: give every table that was used since the hand last went past
+	 * it a second chance, and replace the first one that wasn't.
+	 */
+	for (;;) {
+		victim = shard->slots[shard->hand];
+		if (!victim->referenced)
+			break;
+
+		victim->referenced = 0;
+		shard->hand = (shard->hand + 1) % shard->nr_slots;
+	}
+
+	if (qcow_l2_cache_write(q, victim) < 0) {
+		up_write(&shard->lock);
+		return -1;
+	}
 
-	/* Add in LRU replacement list */
-	list_add_tail(&c->list, &l1t->lru_list);
-	l1t->nr_cached++;
+	hlist_del(&victim->node);
+	free(victim);
+
+	shard->slots[shard->hand] = c;
+	shard->hand = (shard->hand + 1) % shard->nr_slots;
+out:
+	hlist_add_head(&c->node, bucket);
+	up_write(&shard->lock);
 
 	return 0;
-error:
-	return -1;
 }
 
+/* Called with q->mutex held, so the table can't be evicted under our feet */
 static struct qcow_l2_table *l2_table_search(struct qcow *q, u64 offset)
 {
-	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_l2_cache_shard *shard;
+	struct hlist_head *bucket;
 	struct qcow_l2_table *l2t;
 
-	l2t = l2_table_lookup(&l1t->root, offset);
-	if (!l2t)
-		return NULL;
+	shard = l2_cache_shard(q, offset, &bucket);
 
-	/* Update the LRU state, by moving the searched node to list tail */
-	list_move_tail(&l2t->list, &l1t->lru_list);
+	down_read(&shard->lock);
+	l2t = l2_table_lookup(bucket, offset);
+	if (l2t && !l2t->referenced)
+		l2t->referenced = 1;
+	up_read(&shard->lock);
 
 	return l2t;
 }
 
+/* The subcluster bitmap is 0 without extended L2 entries */
+static void l2_table_get_entry(struct qcow *q, struct qcow_l2_table *l2t,
+			       u64 l2_idx, u64 *entry, u64 *bitmap)
+{
+	*entry = be64_to_cpu(l2t->table[l2_idx << q->extended_l2]);
+	*bitmap = q->extended_l2 ?
+		  be64_to_cpu(l2t->table[(l2_idx << 1) + 1]) : 0;
+}
+
+/*
+ * Lockless (with respect to q->mutex) lookup of a single L2 entry, for the
+ * read paths. Returns false if the table isn't cached.
+ */
+static bool l2_cache_get_entry(struct qcow *q, u64 l2t_offset, u64 l2_idx,
+			       u64 *entry, u64 *bitmap)
+{
+	struct qcow_l2_cache_shard *shard;
+	struct hlist_head *bucket;
+	struct qcow_l2_table *l2t;
+
+	shard = l2_cache_shard(q, l2t_offset, &bucket);
+
+	down_read(&shard->lock);
+	l2t = l2_table_lookup(bucket, l2t_offset);
+	if (l2t) {
+		/* Readers racing to set the CLOCK bit is harmless */
+		if (!l2t->referenced)
+			l2t->referenced = 1;
+		l2_table_get_entry(q, l2t, l2_idx, entry, bitmap);
+	}
+	up_read(&shard->lock);
+
+	return l2t != NULL;
+}
+
+/*
+ * Update an L2 entry, with q->mutex held, without racing with readers. The
+ * bitmap is ignored without extended L2 entries.
+ */
+static void l2_table_set_entry(struct qcow *q, struct qcow_l2_table *l2t,
+			       u64 l2_idx, u64 entry, u64 bitmap)
+{
+	struct qcow_l2_cache_shard *shard;
+	struct hlist_head *bucket;
+
+	shard = l2_cache_shard(q, l2t->offset, &bucket);
+
+	down_write(&shard->lock);
+	l2t->table[l2_idx << q->extended_l2] = cpu_to_be64(entry);
+	if (q->extended_l2)
+		l2t->table[(l2_idx << 1) + 1] = cpu_to_be64(bitmap);
+	l2t->dirty = 1;
+	up_write(&shard->lock);
+}
+
 /* Allocates a new node for caching L2 table */
 static struct qcow_l2_table *new_cache_table(struct qcow *q, u64 offset)
 {
-	struct qcow_header *header = q->header;
 	struct qcow_l2_table *c;
-	u64 l2t_sz;
-	u64 size;
 
-	l2t_sz = 1 << header->l2_bits;
-	size   = sizeof(*c) + l2t_sz * sizeof(u64);
-	c      = calloc(1, size);
+	c = calloc(1, sizeof(*c) + l2_table_bytes(q));
 	if (!c)
 		goto out;
 
 	c->offset = offset;
-	RB_CLEAR_NODE(&c->node);
-	INIT_LIST_HEAD(&c->list);
+	INIT_HLIST_NODE(&c->node);
 out:
 	return c;
 }
@@ -220,11 +386,7 @@ static inline u64 get_cluster_offset(struct qcow *q, u64 offset)
 
 static struct qcow_l2_table *qcow_read_l2_table(struct qcow *q, u64 offset)
 {
-	struct qcow_header *header = q->header;
 	struct qcow_l2_table *l2t;
-	u64 size;
-
-	size = 1 << header->l2_bits;
 
 	/* search an entry for offset in cache */
 	l2t = l2_table_search(q, offset);
@@ -237,7 +399,7 @@ static struct qcow_l2_table *qcow_read_l2_table(struct qcow *q, u64 offset)
 		goto error;
 
 	/* table not cached: read from the disk */
-	if (pread_in_full(q->fd, l2t->table, size * sizeof(u64), offset) < 0)
+	if (pread_in_full(q->fd, l2t->table, l2_table_bytes(q), offset) < 0)
 		goto error;
 
 	/* cache the table */
@@ -250,7 +412,7 @@ error:
 	return NULL;
 }
 
-static int qcow_decompress_buffer(u8 *out_buf, int out_buf_size,
+static int qcow_inflate_buffer(u8 *out_buf, int out_buf_size,
 	const u8 *buf, int buf_size)
 {
 #ifdef CONFIG_HAS_ZLIB
@@ -283,241 +445,792 @@ static int qcow_decompress_buffer(u8 *out_buf, int out_buf_size,
 #endif
 }
 
-static ssize_t qcow1_read_cluster(struct qcow *q, u64 offset,
-	void *dst, u32 dst_len)
+/*
+ * The compressed data is rounded up to whole sectors, so stop as soon as the
+ * cluster is complete rather than expecting to consume all the input.
+ */
+static int qcow_zstd_decompress_buffer(u8 *out_buf, int out_buf_size,
+	const u8 *buf, int buf_size)
+{
+#ifdef CONFIG_HAS_ZSTD
+	ZSTD_outBuffer out = { out_buf, out_buf_size, 0 };
+	ZSTD_inBuffer in = { buf, buf_size, 0 };
+	ZSTD_DCtx *dctx;
+	size_t ret = 0;
+
+	dctx = ZSTD_createDCtx();
+	if (!dctx)
+		return -1;
+
+	while (out.pos < out.size && in.pos < in.size) {
+		ret = ZSTD_decompressStream(dctx, &out, &in);
+		if (ZSTD_isError(ret))
+			break;
+	}
+
+	ZSTD_freeDCtx(dctx);
+
+	if (ZSTD_isError(ret) || out.pos != out.size)
+		return -1;
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static int qcow_decompress_buffer(struct qcow *q, u8 *out_buf, int out_buf_size,
+	const u8 *buf, int buf_size)
+{
+	switch (q->header->compression_type) {
+	case QCOW2_COMPRESSION_ZLIB:
+		return qcow_inflate_buffer(out_buf, out_buf_size, buf, buf_size);
+	case QCOW2_COMPRESSION_ZSTD:
+		return qcow_zstd_decompress_buffer(out_buf, out_buf_size,
+						   buf, buf_size);
+	default:
+		return -1;
+	}
+}
+
+/* Raw deflate with a 4KB window, which is what qcow_inflate_buffer() takes */
+static int qcow_deflate_buffer(u8 *out_buf, int out_buf_size,
+	const u8 *buf, int buf_size)
+{
+#ifdef CONFIG_HAS_ZLIB
+	z_stream strm1, *strm = &strm1;
+	int ret, out_len;
+
+	memset(strm, 0, sizeof(*strm));
+
+	ret = deflateInit2(strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -12, 9,
+			   Z_DEFAULT_STRATEGY);
+	if (ret != Z_OK)
+		return -ENOMEM;
+
+	strm->next_in	= (u8 *)buf;
+	strm->avail_in	= buf_size;
+	strm->next_out	= out_buf;
+	strm->avail_out	= out_buf_size;
+
+	/* Anything but the end of the stream means it didn't fit */
+	ret = deflate(strm, Z_FINISH);
+	out_len = strm->next_out - out_buf;
+	deflateEnd(strm);
+
+	return ret == Z_STREAM_END ? out_len : -ENOSPC;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+static int qcow_zstd_compress_buffer(u8 *out_buf, int out_buf_size,
+	const u8 *buf, int buf_size)
+{
+#ifdef CONFIG_HAS_ZSTD
+	size_t ret;
+
+	ret = ZSTD_compress(out_buf, out_buf_size, buf, buf_size,
+			    ZSTD_CLEVEL_DEFAULT);
+	if (ZSTD_isError(ret))
+		return -ENOSPC;
+
+	return ret;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+/*
+ * Compress a whole cluster into dst, which has room for a cluster, for
+ * qcow_write_compressed(). Returns the compressed length, -ENOSPC if that
+ * wouldn't be smaller than the cluster.
+ */
+int qcow_compress_cluster(struct disk_image *disk, const void *src, void *dst)
+{
+	struct qcow *q = disk->priv;
+
+	if (q->version < QCOW2_VERSION)
+		return -EOPNOTSUPP;
+
+	switch (q->header->compression_type) {
+	case QCOW2_COMPRESSION_ZLIB:
+		return qcow_deflate_buffer(dst, q->cluster_size - 1, src,
+					   q->cluster_size);
+	case QCOW2_COMPRESSION_ZSTD:
+		return qcow_zstd_compress_buffer(dst, q->cluster_size - 1, src,
+						 q->cluster_size);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+/*
+ * Look up the L2 entry at l2_idx of the table at l2t_offset. Hits in the L2
+ * cache don't take q->mutex, misses read the table in under it.
+ */
+static int qcow_get_l2_entry(struct qcow *q, u64 l2t_offset, u64 l2_idx,
+			     u64 *entry, u64 *bitmap)
+{
+	struct qcow_l2_table *l2t;
+
+	if (l2_cache_get_entry(q, l2t_offset, l2_idx, entry, bitmap))
+		return 0;
+
+	mutex_lock(&q->mutex);
+	l2t = qcow_read_l2_table(q, l2t_offset);
+	if (l2t)
+		l2_table_get_entry(q, l2t, l2_idx, entry, bitmap);
+	mutex_unlock(&q->mutex);
+
+	return l2t ? 0 : -1;
+}
+
+static inline bool qcow_cluster_compressed(struct qcow *q, u64 entry);
+
+enum {
+	QCOW_SC_UNALLOCATED,
+	QCOW_SC_ALLOCATED,
+	QCOW_SC_ZERO,
+};
+
+static inline int qcow_subcluster_state(u64 bitmap, u32 sc)
+{
+	if (bitmap & (1ULL << sc))
+		return QCOW_SC_ALLOCATED;
+	if (bitmap & (1ULL << (sc + 32)))
+		return QCOW_SC_ZERO;
+
+	return QCOW_SC_UNALLOCATED;
+}
+
+/*
+ * Turn the entry of a cluster with extended L2 entries into that of a whole
+ * cluster in the state of the subcluster at in_clust, and tell how far the
+ * subclusters in the same state go.
+ */
+static int qcow_subcluster_entry(struct qcow *q, u64 in_clust, u64 *entry,
+				 u64 bitmap, u64 *len)
+{
+	u32 sc = in_clust >> q->subcluster_bits, end;
+	int state;
+
+	/* Both allocated and zero, or allocated without a host cluster */
+	if ((bitmap & (bitmap >> 32) & QCOW_EXTL2_ALL_ALLOC) ||
+	    ((bitmap & QCOW_EXTL2_ALL_ALLOC) && !(*entry & QCOW2_OFFSET_MASK))) {
+		pr_warning("qcow: invalid subcluster bitmap 0x%llx",
+			   (unsigned long long)bitmap);
+		return -1;
+	}
+
+	state = qcow_subcluster_state(bitmap, sc);
+	for (end = sc + 1; end < QCOW_EXTL2_SUBCLUSTERS &&
+	     qcow_subcluster_state(bitmap, end) == state; end++)
+		;
+
+	*len = ((u64)end << q->subcluster_bits) - in_clust;
+	if (state == QCOW_SC_ZERO)
+		*entry = QCOW2_OFLAG_ZERO;
+	else if (state == QCOW_SC_UNALLOCATED)
+		*entry = 0;
+
+	return 0;
+}
+
+/*
+ * Fetch the L2 entry describing the cluster at guest offset, 0 if
+ * unallocated, and how many bytes from offset it covers: up to the end of
+ * the cluster, or of the run of subclusters like the one at offset.
+ */
+static int qcow_get_cluster_entry(struct qcow *q, u64 offset, u64 *entry,
+				  u64 *len)
 {
 	struct qcow_header *header = q->header;
 	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
-	u64 clust_offset;
-	u64 clust_start;
+	u64 in_clust = get_cluster_offset(q, offset);
 	u64 l2t_offset;
-	size_t length;
-	u64 l2t_size;
+	u64 bitmap;
 	u64 l1_idx;
 	u64 l2_idx;
-	int coffset;
-	int csize;
+
+	*len = q->cluster_size - in_clust;
 
 	l1_idx = get_l1_index(q, offset);
 	if (l1_idx >= l1t->table_size)
 		return -1;
 
-	clust_offset = get_cluster_offset(q, offset);
-	if (clust_offset >= q->cluster_size)
+	l2t_offset = be64_to_cpu(l1t->l1_table[l1_idx]);
+	if (q->version != QCOW1_VERSION)
+		l2t_offset &= ~QCOW2_OFLAG_COPIED;
+
+	if (!l2t_offset) {
+		*entry = 0;
+		return 0;
+	}
+
+	l2_idx = get_l2_index(q, offset);
+	if (l2_idx >= (1U << header->l2_bits))
 		return -1;
 
-	length = q->cluster_size - clust_offset;
-	if (length > dst_len)
-		length = dst_len;
+	/* read and cache level 2 table */
+	if (qcow_get_l2_entry(q, l2t_offset, l2_idx, entry, &bitmap) < 0)
+		return -1;
 
-	mutex_lock(&q->mutex);
+	/* Compressed clusters are whole */
+	if (q->extended_l2 && !qcow_cluster_compressed(q, *entry))
+		return qcow_subcluster_entry(q, in_clust, entry, bitmap, len);
 
-	l2t_offset = be64_to_cpu(l1t->l1_table[l1_idx]);
-	if (!l2t_offset)
-		goto zero_cluster;
+	return 0;
+}
 
-	l2t_size = 1 << header->l2_bits;
+static inline bool qcow_cluster_compressed(struct qcow *q, u64 entry)
+{
+	if (q->version == QCOW1_VERSION)
+		return entry & QCOW1_OFLAG_COMPRESSED;
 
-	/* read and cache level 2 table */
-	l2t = qcow_read_l2_table(q, l2t_offset);
-	if (!l2t)
-		goto out_error;
+	return entry & QCOW2_OFLAG_COMPRESSED;
+}
 
-	l2_idx = get_l2_index(q, offset);
-	if (l2_idx >= l2t_size)
-		goto out_error;
+/* Host offset of an uncompressed cluster, 0 if it isn't allocated */
+static inline u64 qcow_cluster_host_offset(struct qcow *q, u64 entry)
+{
+	if (q->version == QCOW1_VERSION)
+		return entry;
 
-	clust_start = be64_to_cpu(l2t->table[l2_idx]);
-	if (clust_start & QCOW1_OFLAG_COMPRESSED) {
-		coffset	= clust_start & q->cluster_offset_mask;
-		csize	= clust_start >> (63 - q->header->cluster_bits);
-		csize	&= (q->cluster_size - 1);
+	if (q->version >= QCOW3_VERSION && (entry & QCOW2_OFLAG_ZERO))
+		return 0;
 
-		if (pread_in_full(q->fd, q->cluster_data, csize,
-				  coffset) < 0)
-			goto out_error;
+	return entry & QCOW2_OFFSET_MASK;
+}
 
-		if (qcow_decompress_buffer(q->cluster_cache, q->cluster_size,
-					q->cluster_data, csize) < 0)
-			goto out_error;
+/* Called with q->decomp_lock held */
+static struct qcow_decomp_entry *qcow_decomp_cache_find(struct qcow *q, u64 entry)
+{
+	int i;
 
-		memcpy(dst, q->cluster_cache + clust_offset, length);
-		mutex_unlock(&q->mutex);
-	} else {
-		if (!clust_start)
-			goto zero_cluster;
+	for (i = 0; i < QCOW_DECOMP_CACHE_ENTRIES; i++) {
+		if (q->decomp_cache[i].entry == entry)
+			return &q->decomp_cache[i];
+	}
 
-		mutex_unlock(&q->mutex);
+	return NULL;
+}
 
-		if (pread_in_full(q->fd, dst, length,
-				  clust_start + clust_offset) < 0)
-			return -1;
+static bool qcow_decomp_cache_copy(struct qcow *q, u64 entry, u64 clust_offset,
+				   void *dst, size_t length)
+{
+	struct qcow_decomp_entry *e;
+
+	mutex_lock(&q->decomp_lock);
+	e = qcow_decomp_cache_find(q, entry);
+	if (e) {
+		e->referenced = true;
+		memcpy(dst, e->data + clust_offset, length);
 	}
+	mutex_unlock(&q->decomp_lock);
 
-	return length;
+	return e != NULL;
+}
+
+/* Insert a decompressed cluster, with q->decomp_lock held */
+static void qcow_decomp_cache_insert(struct qcow *q, u64 entry, void *data)
+{
+	struct qcow_decomp_entry *e;
+
+	for (;;) {
+		e = &q->decomp_cache[q->decomp_hand];
+		q->decomp_hand = (q->decomp_hand + 1) % QCOW_DECOMP_CACHE_ENTRIES;
+
+		if (!e->entry || !e->referenced)
+			break;
+
+		e->referenced = false;
+	}
+
+	free(e->data);
+	*e = (struct qcow_decomp_entry) {
+		.entry		= entry,
+		.data		= data,
+	};
+}
+
+static void qcow_decomp_cache_free(struct qcow *q)
+{
+	int i;
+
+	for (i = 0; i < QCOW_DECOMP_CACHE_ENTRIES; i++)
+		free(q->decomp_cache[i].data);
+}
+
+/*
+ * Where the compressed data of a cluster lives: read len bytes at off, the
+ * compressed stream starts skip bytes in.
+ */
+static void qcow_compressed_extent(struct qcow *q, u64 entry, u64 *off,
+				   size_t *len, size_t *skip)
+{
+	u64 coffset = entry & q->cluster_offset_mask;
+	int nb_csectors;
+
+	if (q->version == QCOW1_VERSION) {
+		*off	= coffset;
+		*len	= (entry >> (63 - q->header->cluster_bits)) &
+			  (q->cluster_size - 1);
+		*skip	= 0;
+		return;
+	}
+
+	nb_csectors = ((entry >> q->csize_shift) & q->csize_mask) + 1;
+	*off	= coffset & ~(SECTOR_SIZE - 1);
+	*len	= nb_csectors * SECTOR_SIZE;
+	*skip	= coffset & (SECTOR_SIZE - 1);
+}
+
+static ssize_t qcow_read_compressed(struct qcow *q, u64 entry,
+	u64 clust_offset, void *dst, size_t length)
+{
+	size_t len, skip;
+	u8 *cdata, *data;
+	u64 off;
+
+	if (qcow_decomp_cache_copy(q, entry, clust_offset, dst, length))
+		return length;
+
+	qcow_compressed_extent(q, entry, &off, &len, &skip);
+	if (skip >= len)
+		return -1;
+
+	cdata = malloc(len);
+	data = malloc(q->cluster_size);
+	if (!cdata || !data)
+		goto out_error;
+
+	if (pread_in_full(q->fd, cdata, len, off) < 0)
+		goto out_error;
+
+	if (qcow_decompress_buffer(q, data, q->cluster_size,
+				   cdata + skip, len - skip) < 0)
+		goto out_error;
+
+	free(cdata);
+	memcpy(dst, data + clust_offset, length);
+
+	mutex_lock(&q->decomp_lock);
+	/* Another thread may have beaten us to it */
+	if (qcow_decomp_cache_find(q, entry))
+		free(data);
+	else
+		qcow_decomp_cache_insert(q, entry, data);
+	mutex_unlock(&q->decomp_lock);
 
-zero_cluster:
-	mutex_unlock(&q->mutex);
-	memset(dst, 0, length);
 	return length;
 
 out_error:
-	mutex_unlock(&q->mutex);
-	length = -1;
+	free(cdata);
+	free(data);
 	return -1;
 }
 
-static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
+static ssize_t qcow_read_range(struct qcow *q, u64 offset, void *dst,
+			       u32 dst_len);
+
+/* Unallocated clusters read from the backing file, if there is one */
+static inline bool qcow_cluster_backed(struct qcow *q, u64 entry)
+{
+	return q->backing && !entry;
+}
+
+/* Whether the cluster reads as zeroes without being written */
+static inline bool qcow_cluster_zero(struct qcow *q, u64 entry)
+{
+	return !qcow_cluster_compressed(q, entry) &&
+	       !qcow_cluster_host_offset(q, entry) &&
+	       !qcow_cluster_backed(q, entry);
+}
+
+/* Past the end of the backing file, which may be smaller, are zeroes */
+static ssize_t qcow_backing_read(struct qcow *q, u64 offset, void *dst,
+				 size_t length)
+{
+	struct qcow_backing *b = q->backing;
+	size_t len = 0;
+
+	if (offset < b->size)
+		len = min_t(u64, length, b->size - offset);
+	memset(dst + len, 0, length - len);
+
+	if (!len)
+		return length;
+
+	if (b->q) {
+		if (qcow_read_range(b->q, offset, dst, len) < 0)
+			return -1;
+	} else if (b->map) {
+		memcpy(dst, b->map + offset, len);
+	} else if (pread_in_full(b->fd, dst, len, offset) < 0) {
+		return -1;
+	}
+
+	return length;
+}
+
+static ssize_t qcow_read_cluster(struct qcow *q, u64 offset,
 	void *dst, u32 dst_len)
 {
-	struct qcow_header *header = q->header;
-	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
 	u64 clust_offset;
 	u64 clust_start;
-	u64 l2t_offset;
+	u64 extent;
 	size_t length;
-	u64 l2t_size;
-	u64 l1_idx;
-	u64 l2_idx;
-	int coffset;
-	int sector_offset;
-	int nb_csectors;
-	int csize;
-
-	l1_idx = get_l1_index(q, offset);
-	if (l1_idx >= l1t->table_size)
-		return -1;
 
 	clust_offset = get_cluster_offset(q, offset);
 	if (clust_offset >= q->cluster_size)
 		return -1;
 
-	length = q->cluster_size - clust_offset;
-	if (length > dst_len)
-		length = dst_len;
+	if (qcow_get_cluster_entry(q, offset, &clust_start, &extent) < 0)
+		return -1;
 
-	mutex_lock(&q->mutex);
+	length = min_t(u64, extent, dst_len);
 
-	l2t_offset = be64_to_cpu(l1t->l1_table[l1_idx]);
+	if (qcow_cluster_compressed(q, clust_start))
+		return qcow_read_compressed(q, clust_start, clust_offset,
+					    dst, length);
 
-	l2t_offset &= ~QCOW2_OFLAG_COPIED;
-	if (!l2t_offset)
-		goto zero_cluster;
+	if (qcow_cluster_backed(q, clust_start))
+		return qcow_backing_read(q, offset, dst, length);
 
-	l2t_size = 1 << header->l2_bits;
+	clust_start = qcow_cluster_host_offset(q, clust_start);
+	if (!clust_start) {
+		memset(dst, 0, length);
+		return length;
+	}
 
-	/* read and cache level 2 table */
-	l2t = qcow_read_l2_table(q, l2t_offset);
-	if (!l2t)
-		goto out_error;
+	clust_start += clust_offset;
+	if (q->map && clust_start + length <= q->map_size) {
+		memcpy(dst, q->map + clust_start, length);
+		return length;
+	}
 
-	l2_idx = get_l2_index(q, offset);
-	if (l2_idx >= l2t_size)
-		goto out_error;
+	if (pread_in_full(q->fd, dst, length, clust_start) < 0)
+		return -1;
 
-	clust_start = be64_to_cpu(l2t->table[l2_idx]);
-	if (clust_start & QCOW2_OFLAG_COMPRESSED) {
-		coffset = clust_start & q->cluster_offset_mask;
-		nb_csectors = ((clust_start >> q->csize_shift)
-			& q->csize_mask) + 1;
-		sector_offset = coffset & (SECTOR_SIZE - 1);
-		csize = nb_csectors * SECTOR_SIZE - sector_offset;
-
-		if (pread_in_full(q->fd, q->cluster_data,
-				  nb_csectors * SECTOR_SIZE,
-				  coffset & ~(SECTOR_SIZE - 1)) < 0) {
-			goto out_error;
+	return length;
+}
+
+static ssize_t qcow_read_range(struct qcow *q, u64 offset, void *dst,
+			       u32 dst_len)
+{
+	struct qcow_header *header = q->header;
+	u32 nr_read;
+	ssize_t nr;
+	char *buf;
+
+	buf = dst;
+	nr_read = 0;
+
+	while (nr_read < dst_len) {
+		if (offset >= header->size)
+			return -1;
+
+		nr = qcow_read_cluster(q, offset, buf, dst_len - nr_read);
+		if (nr <= 0)
+			return -1;
+
+		nr_read	+= nr;
+		buf	+= nr;
+		offset	+= nr;
+	}
+
+	return dst_len;
+}
+
+static ssize_t qcow_read_sector_single(struct disk_image *disk, u64 sector,
+	void *dst, u32 dst_len)
+{
+	return qcow_read_range(disk->priv, sector << SECTOR_SHIFT, dst, dst_len);
+}
+
+static ssize_t qcow_read_sector(struct disk_image *disk, u64 sector,
+				const struct iovec *iov, int iovcount, void *param)
+{
+	ssize_t nr, total = 0;
+
+	while (iovcount--) {
+		nr = qcow_read_sector_single(disk, sector, iov->iov_base, iov->iov_len);
+		if (nr != (ssize_t)iov->iov_len) {
+			pr_info("qcow_read_sector error: nr=%ld iov_len=%ld\n", (long)nr, (long)iov->iov_len);
+			return -1;
 		}
 
-		if (qcow_decompress_buffer(q->cluster_cache, q->cluster_size,
-					q->cluster_data + sector_offset,
-					csize) < 0) {
-			goto out_error;
+		sector += iov->iov_len >> SECTOR_SHIFT;
+		total += nr;
+		iov++;
+	}
+
+	return total;
+}
+
+static void qcow_readahead_host(int fd, u64 offset, u64 len)
+{
+	if (len)
+		posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+}
+
+/*
+ * Ahead of a stream of reads, the clusters are looked up, which brings in
+ * the L2 tables the reads will need, and the runs of them that are
+ * contiguous in the image are read ahead in one go. Compressed and zero
+ * clusters have nothing worth it, those of the backing file are read ahead
+ * in there.
+ */
+static void qcow_readahead_range(struct qcow *q, u64 offset, u64 len)
+{
+	u64 end = min(offset + len, q->header->size);
+	u64 run_start = 0, run_len = 0;
+	u64 entry, extent, host;
+
+	while (offset < end) {
+		if (qcow_get_cluster_entry(q, offset, &entry, &extent) < 0)
+			break;
+		extent = min(extent, end - offset);
+
+		host = 0;
+		if (qcow_cluster_backed(q, entry)) {
+			if (q->backing->q)
+				qcow_readahead_range(q->backing->q, offset, extent);
+			else if (offset < q->backing->size)
+				qcow_readahead_host(q->backing->fd, offset, extent);
+		} else if (!qcow_cluster_compressed(q, entry)) {
+			host = qcow_cluster_host_offset(q, entry);
+			if (host)
+				host += get_cluster_offset(q, offset);
 		}
 
-		memcpy(dst, q->cluster_cache + clust_offset, length);
-		mutex_unlock(&q->mutex);
-	} else {
-		clust_start &= QCOW2_OFFSET_MASK;
-		if (!clust_start)
-			goto zero_cluster;
+		if (host && host == run_start + run_len) {
+			run_len += extent;
+		} else {
+			qcow_readahead_host(q->fd, run_start, run_len);
+			run_start = host;
+			run_len = host ? extent : 0;
+		}
+
+		offset += extent;
+	}
+
+	qcow_readahead_host(q->fd, run_start, run_len);
+}
+
+static int qcow_disk_readahead(struct disk_image *disk, u64 offset, u64 len)
+{
+	qcow_readahead_range(disk->priv, offset, len);
+
+	return 0;
+}
+
+/*
+ * Asynchronous reads resolve each cluster to its host offset, and hand the
+ * allocated ones to the disk engine, batching clusters that are contiguous on
+ * the host. Unallocated clusters are zero-filled in place, compressed ones are
+ * decompressed on the thread pool.
+ */
+struct qcow_read_req {
+	struct disk_split_io	split;
+	struct iovec		iov[];
+};
+
+static void qcow_read_async_submit(struct disk_image *disk,
+				   struct qcow_read_req *req, int start, int end,
+				   u64 host_offset)
+{
+	struct qcow *q = disk->priv;
+	void *param;
+	ssize_t r;
+
+	if (start == end)
+		return;
+
+	param = disk_split_io__get(&req->split,
+				   iov_size(&req->iov[start], end - start));
+	r = q->engine_ops->read(disk, host_offset >> SECTOR_SHIFT,
+				&req->iov[start], end - start, param);
+	if (r < 0)
+		disk_split_io__put(disk, &req->split, r);
+}
+
+struct qcow_decomp_work {
+	struct list_head	list;
+	struct disk_image	*disk;
+	void			*param;
+	u64			entry;
+	u64			clust_offset;
+	void			*dst;
+	size_t			length;
+};
+
+static void qcow_decomp_worker(struct kvm *kvm, void *data)
+{
+	struct qcow_decomp_work *work;
+	struct qcow *q = data;
+	ssize_t r;
+
+	for (;;) {
+		mutex_lock(&q->decomp_work_lock);
+		work = list_first_entry_or_null(&q->decomp_work,
+						struct qcow_decomp_work, list);
+		if (work)
+			list_del(&work->list);
+		mutex_unlock(&q->decomp_work_lock);
+
+		if (!work)
+			break;
+
+		r = qcow_read_compressed(q, work->entry, work->clust_offset,
+					 work->dst, work->length);
+		disk_image__complete(work->disk, work->param, r < 0 ? -EIO : r);
+		free(work);
+
+		__sync_fetch_and_sub(&q->decomp_inflight, 1);
+	}
+}
+
+static int qcow_decomp_queue(struct disk_image *disk, struct qcow_read_req *req,
+			     u64 entry, u64 clust_offset, void *dst,
+			     size_t length)
+{
+	struct qcow *q = disk->priv;
+	struct qcow_decomp_work *work;
+	u32 job;
+
+	work = malloc(sizeof(*work));
+	if (!work)
+		return -ENOMEM;
+
+	*work = (struct qcow_decomp_work) {
+		.disk		= disk,
+		.param		= disk_split_io__get(&req->split, length),
+		.entry		= entry,
+		.clust_offset	= clust_offset,
+		.dst		= dst,
+		.length		= length,
+	};
+
+	__sync_fetch_and_add(&q->decomp_inflight, 1);
+
+	mutex_lock(&q->decomp_work_lock);
+	list_add_tail(&work->list, &q->decomp_work);
+	mutex_unlock(&q->decomp_work_lock);
+
+	job = __sync_fetch_and_add(&q->decomp_next_job, 1);
+	thread_pool__do_job(&q->decomp_jobs[job % QCOW_DECOMP_WORKERS]);
+
+	return 0;
+}
+
+static void qcow_decomp_init(struct qcow *q)
+{
+	int i;
 
-		mutex_unlock(&q->mutex);
+	mutex_init(&q->decomp_lock);
+	mutex_init(&q->decomp_work_lock);
+	INIT_LIST_HEAD(&q->decomp_work);
 
-		if (pread_in_full(q->fd, dst, length,
-				  clust_start + clust_offset) < 0)
-			return -1;
+	for (i = 0; i < QCOW_DECOMP_WORKERS; i++) {
+		thread_pool__init_job(&q->decomp_jobs[i], NULL,
+				      qcow_decomp_worker, q);
+		/* Decompress in parallel rather than behind each other */
+		thread_pool__set_job_worker(&q->decomp_jobs[i], i);
 	}
+}
 
-	return length;
+static void qcow_decomp_exit(struct qcow *q)
+{
+	int i;
 
-zero_cluster:
-	mutex_unlock(&q->mutex);
-	memset(dst, 0, length);
-	return length;
+	for (i = 0; i < QCOW_DECOMP_WORKERS; i++)
+		thread_pool__cancel_job(&q->decomp_jobs[i]);
 
-out_error:
-	mutex_unlock(&q->mutex);
-	length = -1;
-	return -1;
+	qcow_decomp_cache_free(q);
 }
 
-static ssize_t qcow_read_sector_single(struct disk_image *disk, u64 sector,
-	void *dst, u32 dst_len)
+static ssize_t qcow_read_sector_async(struct disk_image *disk, u64 sector,
+				      const struct iovec *iov, int iovcount,
+				      void *param)
 {
 	struct qcow *q = disk->priv;
-	struct qcow_header *header = q->header;
-	u32 nr_read;
-	u64 offset;
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 host = 0, host_end = 0;
+	u64 entry, in_clust, chunk, extent;
+	struct qcow_read_req *req;
+	int i, nr = 0, start = 0;
+	size_t len, max_iov = 0;
+	ssize_t err = 0;
 	char *buf;
-	u32 nr;
 
-	buf = dst;
-	nr_read = 0;
+	if (!disk->async)
+		return qcow_read_sector(disk, sector, iov, iovcount, param);
 
-	while (nr_read < dst_len) {
-		offset = sector << SECTOR_SHIFT;
-		if (offset >= header->size)
-			return -1;
+	for (i = 0; i < iovcount; i++)
+		max_iov += iov[i].iov_len / q->cluster_size + 2;
 
-		if (q->version == QCOW1_VERSION)
-			nr = qcow1_read_cluster(q, offset, buf,
-				dst_len - nr_read);
-		else
-			nr = qcow2_read_cluster(q, offset, buf,
-				dst_len - nr_read);
+	req = malloc(sizeof(*req) + max_iov * sizeof(*req->iov));
+	if (!req) {
+		disk_image__complete(disk, param, -ENOMEM);
+		return 0;
+	}
 
-		if (nr <= 0)
-			return -1;
+	disk_split_io__init(&req->split, param, iov_size(iov, iovcount));
 
-		nr_read	+= nr;
-		buf	+= nr;
-		sector	+= (nr >> SECTOR_SHIFT);
-	}
+	for (i = 0; i < iovcount; i++) {
+		buf = iov[i].iov_base;
 
-	return dst_len;
-}
+		for (len = iov[i].iov_len; len; len -= chunk) {
+			if (offset >= q->header->size ||
+			    qcow_get_cluster_entry(q, offset, &entry,
+						   &extent) < 0) {
+				err = -EIO;
+				goto out;
+			}
 
-static ssize_t qcow_read_sector(struct disk_image *disk, u64 sector,
-				const struct iovec *iov, int iovcount, void *param)
-{
-	ssize_t nr, total = 0;
+			in_clust = get_cluster_offset(q, offset);
+			chunk = min_t(u64, extent, len);
+
+			if (qcow_cluster_compressed(q, entry)) {
+				err = qcow_decomp_queue(disk, req, entry,
+							in_clust, buf, chunk);
+				if (err)
+					goto out;
+			} else if (qcow_cluster_backed(q, entry)) {
+				if (qcow_backing_read(q, offset, buf, chunk) < 0) {
+					err = -EIO;
+					goto out;
+				}
+			} else if (!qcow_cluster_host_offset(q, entry)) {
+				memset(buf, 0, chunk);
+			} else {
+				entry = qcow_cluster_host_offset(q, entry) + in_clust;
+				if (entry != host_end || nr - start == IOV_MAX) {
+					qcow_read_async_submit(disk, req, start,
+							       nr, host);
+					start = nr;
+					host = entry;
+				}
+
+				req->iov[nr++] = (struct iovec) {
+					.iov_base	= buf,
+					.iov_len	= chunk,
+				};
+				host_end = entry + chunk;
+			}
 
-	while (iovcount--) {
-		nr = qcow_read_sector_single(disk, sector, iov->iov_base, iov->iov_len);
-		if (nr != (ssize_t)iov->iov_len) {
-			pr_info("qcow_read_sector error: nr=%ld iov_len=%ld\n", (long)nr, (long)iov->iov_len);
-			return -1;
+			buf	+= chunk;
+			offset	+= chunk;
 		}
-
-		sector += iov->iov_len >> SECTOR_SHIFT;
-		total += nr;
-		iov++;
 	}
 
-	return total;
+	qcow_read_async_submit(disk, req, start, nr, host);
+out:
+	disk_split_io__put(disk, &req->split, err);
+
+	return 0;
 }
 
 static void refcount_table_free_cache(struct qcow_refcount_table *rft)
@@ -572,7 +1285,7 @@ static int write_refcount_block(struct qcow *q, struct qcow_refcount_block *rfb)
 	if (!rfb->dirty)
 		return 0;
 
-	if (qcow_pwrite_sync(q->fd, rfb->entries,
+	if (pwrite_in_full(q->fd, rfb->entries,
 		rfb->size * sizeof(u16), rfb->offset) < 0)
 		return -1;
 
@@ -581,6 +1294,20 @@ static int write_refcount_block(struct qcow *q, struct qcow_refcount_block *rfb)
 	return 0;
 }
 
+/* Write back all dirty refcount blocks, and make them and guest data stable */
+static int qcow_writeback_refcounts(struct qcow *q)
+{
+	struct qcow_refcount_table *rft = &q->refcount_table;
+	struct qcow_refcount_block *rfb;
+
+	list_for_each_entry(rfb, &rft->lru_list, list) {
+		if (write_refcount_block(q, rfb) < 0)
+			return -1;
+	}
+
+	return fdatasync(q->fd);
+}
+
 static int cache_refcount_block(struct qcow *q, struct qcow_refcount_block *c)
 {
 	struct qcow_refcount_table *rft = &q->refcount_table;
@@ -590,6 +1317,9 @@ static int cache_refcount_block(struct qcow *q, struct qcow_refcount_block *c)
 	if (rft->nr_cached == MAX_CACHE_NODES) {
 		lru = list_first_entry(&rft->lru_list, struct qcow_refcount_block, list);
 
+		if (write_refcount_block(q, lru) < 0)
+			goto error;
+
 		rb_erase(&lru->node, r);
 		list_del_init(&lru->list);
 		rft->nr_cached--;
@@ -689,8 +1419,8 @@ static struct qcow_refcount_block *qcow_grow_refcount_block(struct qcow *q,
 	memset(rfb->entries, 0x00, q->cluster_size);
 	rfb->dirty = 1;
 
-	/* write refcount block */
-	if (write_refcount_block(q, rfb) < 0)
+	/* write refcount block before the refcount table points at it */
+	if (write_refcount_block(q, rfb) < 0 || fdatasync(q->fd) < 0)
 		goto free_rfb;
 
 	if (cache_refcount_block(q, rfb) < 0)
@@ -701,7 +1431,8 @@ static struct qcow_refcount_block *qcow_grow_refcount_block(struct qcow *q,
 		    header->cluster_bits, 1) < 0)
 		goto recover_rft;
 
-	if (qcow_write_refcount_table(q) < 0)
+	if (qcow_write_table_entry(q, rft->rf_table, rft_idx,
+				   header->refcount_table_offset) < 0)
 		goto recover_rft;
 
 	return rfb;
@@ -804,14 +1535,9 @@ static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append)
 
 	refcount = be16_to_cpu(rfb->entries[rfb_idx]) + append;
 	rfb->entries[rfb_idx] = cpu_to_be16(refcount);
+	/* Written back before any L2 table referencing the cluster */
 	rfb->dirty = 1;
 
-	/* write refcount block */
-	if (write_refcount_block(q, rfb) < 0) {
-		pr_warning("refcount block index out of bounds");
-		return -1;
-	}
-
 	/* update free_clust_idx since refcount becomes zero */
 	if (!refcount && clust_idx < q->free_clust_idx)
 		q->free_clust_idx = clust_idx;
@@ -865,17 +1591,28 @@ again:
 	return (clust_idx - clust_num) << header->cluster_bits;
 }
 
-static int qcow_write_l1_table(struct qcow *q)
+/* Drop the reference an L2 entry holds on its host cluster(s) */
+static void qcow_free_cluster_entry(struct qcow *q, u64 entry)
 {
-	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_header *header = q->header;
+	u64 clust_start;
+	int size;
 
-	if (qcow_pwrite_sync(q->fd, l1t->l1_table,
-		l1t->table_size * sizeof(u64),
-		header->l1_table_offset) < 0)
-		return -1;
+	if (entry & QCOW2_OFLAG_COMPRESSED) {
+		size = ((entry >> q->csize_shift) & q->csize_mask) + 1;
+		size *= 512;
+		clust_start = entry & q->cluster_offset_mask;
+		clust_start &= ~511;
 
-	return 0;
+		qcow_free_clusters(q, clust_start, size);
+		return;
+	}
+
+	clust_start = entry & QCOW2_OFFSET_MASK;
+	if (q->version >= QCOW3_VERSION)
+		clust_start &= ~QCOW2_OFLAG_ZERO;
+
+	if (clust_start)
+		qcow_free_clusters(q, clust_start, q->cluster_size);
 }
 
 /*
@@ -893,9 +1630,11 @@ static int get_cluster_table(struct qcow *q, u64 offset,
 	u64 l2t_offset;
 	u64 l2t_idx;
 	u64 l2t_size;
+	u64 l2t_bytes;
 	u64 l2t_new_offset;
 
 	l2t_size = 1 << header->l2_bits;
+	l2t_bytes = l2_table_bytes(q);
 
 	l1t_idx = get_l1_index(q, offset);
 	if (l1t_idx >= l1t->table_size)
@@ -912,10 +1651,9 @@ static int get_cluster_table(struct qcow *q, u64 offset,
 		if (!l2t)
 			goto error;
 	} else {
-		l2t_new_offset = qcow_alloc_clusters(q,
-			l2t_size*sizeof(u64), 1);
+		l2t_new_offset = qcow_alloc_clusters(q, l2t_bytes, 1);
 
-		if (l2t_new_offset != (u64)-1)
+		if (l2t_new_offset == (u64)-1)
 			goto error;
 
 		l2t = new_cache_table(q, l2t_new_offset);
@@ -923,15 +1661,15 @@ static int get_cluster_table(struct qcow *q, u64 offset,
 			goto free_cluster;
 
 		if (l2t_offset) {
-			l2t = qcow_read_l2_table(q, l2t_offset);
-			if (!l2t)
+			if (pread_in_full(q->fd, l2t->table, l2t_bytes,
+					  l2t_offset) < 0)
 				goto free_cache;
 		} else
-			memset(l2t->table, 0x00, l2t_size * sizeof(u64));
+			memset(l2t->table, 0x00, l2t_bytes);
 
-		/* write l2 table */
+		/* write l2 table, it must be on disk before L1 points at it */
 		l2t->dirty = 1;
-		if (qcow_l2_cache_write(q, l2t) < 0)
+		if (qcow_l2_cache_write(q, l2t) < 0 || fdatasync(q->fd) < 0)
 			goto free_cache;
 
 		/* cache l2 table */
@@ -941,13 +1679,15 @@ static int get_cluster_table(struct qcow *q, u64 offset,
 		/* update the l1 talble */
 		l1t->l1_table[l1t_idx] = cpu_to_be64(l2t_new_offset
 			| QCOW2_OFLAG_COPIED);
-		if (qcow_write_l1_table(q)) {
+		if (qcow_write_table_entry(q, l1t->l1_table, l1t_idx,
+					   header->l1_table_offset)) {
 			pr_warning("Update l1 table error");
-			goto free_cache;
+			goto error;
 		}
 
 		/* free old cluster */
-		qcow_free_clusters(q, l2t_offset, q->cluster_size);
+		if (l2t_offset)
+			qcow_free_clusters(q, l2t_offset, q->cluster_size);
 	}
 
 	*result_l2t = l2t;
@@ -965,6 +1705,106 @@ error:
 	return -1;
 }
 
+/* Read a whole cluster, or what of it is within length */
+static ssize_t qcow_read_cluster_full(struct qcow *q, u64 offset, void *dst,
+				      u32 length)
+{
+	u32 done = 0;
+	ssize_t nr;
+
+	while (done < length) {
+		nr = qcow_read_cluster(q, offset + done, dst + done,
+				       length - done);
+		if (nr <= 0)
+			return -1;
+		done += nr;
+	}
+
+	return length;
+}
+
+/* What an unallocated or zero subcluster reads as, with q->mutex held */
+static int qcow_fill_subcluster(struct qcow *q, u64 clust_guest, u64 bitmap,
+				u32 sc, void *dst)
+{
+	u64 size = 1ULL << q->subcluster_bits;
+
+	if (qcow_subcluster_state(bitmap, sc) == QCOW_SC_ZERO || !q->backing) {
+		memset(dst, 0, size);
+		return 0;
+	}
+
+	return qcow_backing_read(q, clust_guest + ((u64)sc << q->subcluster_bits),
+				 dst, size) < 0 ? -1 : 0;
+}
+
+/*
+ * With extended L2 entries, a write to a cluster that is ours, or not
+ * allocated yet, only allocates the subclusters it touches. Those it covers
+ * in part are filled in from what they read as so far, the others keep
+ * reading from the backing file or as zeroes. Called with q->mutex held.
+ */
+static ssize_t qcow_write_subclusters(struct qcow *q, struct qcow_l2_table *l2t,
+				      u64 l2t_idx, u64 offset, void *buf,
+				      u64 len, u64 host, u64 bitmap)
+{
+	u64 clust_off = get_cluster_offset(q, offset);
+	u64 clust_guest = offset - clust_off;
+	u32 first = clust_off >> q->subcluster_bits;
+	u32 last = (clust_off + len - 1) >> q->subcluster_bits;
+	u64 mask = ((1ULL << (last - first + 1)) - 1) << first;
+	u64 sc_size = 1ULL << q->subcluster_bits;
+	u64 start, end;
+	bool alloc = !host;
+
+	/* Once a subcluster is there it's written in place */
+	if (host && (bitmap & mask) == mask) {
+		if (pwrite_in_full(q->fd, buf, len, host + clust_off) < 0)
+			return -1;
+		return len;
+	}
+
+	if (alloc) {
+		host = qcow_alloc_clusters(q, q->cluster_size, 1);
+		if (host == (u64)-1) {
+			pr_warning("Cluster alloc error");
+			return -1;
+		}
+	}
+
+	/* Partly covered subclusters that aren't there yet are filled in */
+	start = clust_off;
+	if (qcow_subcluster_state(bitmap, first) != QCOW_SC_ALLOCATED)
+		start = (u64)first << q->subcluster_bits;
+	end = clust_off + len;
+	if (qcow_subcluster_state(bitmap, last) != QCOW_SC_ALLOCATED)
+		end = (u64)(last + 1) << q->subcluster_bits;
+
+	if (start < clust_off &&
+	    qcow_fill_subcluster(q, clust_guest, bitmap, first, q->copy_buff) < 0)
+		goto error;
+	if (end > clust_off + len && (last != first || start == clust_off) &&
+	    qcow_fill_subcluster(q, clust_guest, bitmap, last,
+				 q->copy_buff + end - sc_size - start) < 0)
+		goto error;
+
+	memcpy(q->copy_buff + clust_off - start, buf, len);
+
+	if (pwrite_in_full(q->fd, q->copy_buff, end - start, host + start) < 0)
+		goto error;
+
+	/* written back on flush or eviction, after the data */
+	l2_table_set_entry(q, l2t, l2t_idx, host | QCOW2_OFLAG_COPIED,
+			   (bitmap | mask) & ~(mask << 32));
+
+	return len;
+
+error:
+	if (alloc)
+		qcow_free_clusters(q, host, q->cluster_size);
+	return -1;
+}
+
 /*
  * If the cluster has been copied, write data directly. If not,
  * read the original data and write it to the new cluster with
@@ -979,6 +1819,9 @@ static ssize_t qcow_write_cluster(struct qcow *q, u64 offset,
 	u64 clust_flags;
 	u64 clust_off;
 	u64 l2t_idx;
+	ssize_t nr;
+	u64 bitmap;
+	bool zero;
 	u64 len;
 
 	l2t = NULL;
@@ -998,27 +1841,47 @@ static ssize_t qcow_write_cluster(struct qcow *q, u64 offset,
 		goto error;
 	}
 
-	clust_start = be64_to_cpu(l2t->table[l2t_idx]);
+	l2_table_get_entry(q, l2t, l2t_idx, &clust_start, &bitmap);
 	clust_flags = clust_start & QCOW2_OFLAGS_MASK;
 
 	clust_start &= QCOW2_OFFSET_MASK;
+
+	if (q->extended_l2 && !(clust_flags & QCOW2_OFLAG_COMPRESSED) &&
+	    (!clust_start || (clust_flags & QCOW2_OFLAG_COPIED))) {
+		nr = qcow_write_subclusters(q, l2t, l2t_idx, offset, buf, len,
+					    clust_start, bitmap);
+		mutex_unlock(&q->mutex);
+		return nr;
+	}
+
+	/* A zero cluster has to be copied, from zeroes, before it's written */
+	zero = q->version >= QCOW3_VERSION && !q->extended_l2 &&
+	       !(clust_flags & QCOW2_OFLAG_COMPRESSED) &&
+	       (clust_start & QCOW2_OFLAG_ZERO);
+	if (zero) {
+		clust_start &= ~QCOW2_OFLAG_ZERO;
+		clust_flags &= ~QCOW2_OFLAG_COPIED;
+	}
+
 	if (!(clust_flags & QCOW2_OFLAG_COPIED)) {
 		clust_new_start	= qcow_alloc_clusters(q, q->cluster_size, 1);
-		if (clust_new_start != (u64)-1) {
+		if (clust_new_start == (u64)-1) {
 			pr_warning("Cluster alloc error");
 			goto error;
 		}
 
 		offset &= ~(q->cluster_size - 1);
 
-		/* if clust_start is not zero, read the original data*/
-		if (clust_start) {
+		/* read the original data, if there is any */
+		if (!zero && (clust_start || q->backing)) {
 			mutex_unlock(&q->mutex);
-			if (qcow2_read_cluster(q, offset, q->copy_buff,
-				q->cluster_size) < 0) {
+			if (qcow_read_cluster_full(q, offset, q->copy_buff,
+						   q->cluster_size) < 0) {
 				pr_warning("Read copy cluster error");
+				mutex_lock(&q->mutex);
 				qcow_free_clusters(q, clust_new_start,
 					q->cluster_size);
+				mutex_unlock(&q->mutex);
 				return -1;
 			}
 			mutex_lock(&q->mutex);
@@ -1032,122 +1895,495 @@ static ssize_t qcow_write_cluster(struct qcow *q, u64 offset,
 			clust_new_start) < 0)
 			goto free_cluster;
 
-		/* update l2 table*/
-		l2t->table[l2t_idx] = cpu_to_be64(clust_new_start
-			| QCOW2_OFLAG_COPIED);
-		l2t->dirty = 1;
+		/* update l2 table, written back on flush or eviction */
+		l2_table_set_entry(q, l2t, l2t_idx,
+				   clust_new_start | QCOW2_OFLAG_COPIED,
+				   QCOW_EXTL2_ALL_ALLOC);
+
+		/*
+		 * free old cluster, once the L2 table on disk no longer
+		 * points at it
+		 */
+		if (clust_start) {
+			if (qcow_l2_cache_write(q, l2t) < 0 ||
+			    fdatasync(q->fd) < 0)
+				goto error;
+
+			qcow_free_cluster_entry(q, clust_start | clust_flags);
+		}
+	} else {
+		/* Write actual data */
+		if (pwrite_in_full(q->fd, buf, len,
+			clust_start + clust_off) < 0)
+			goto error;
+	}
+	mutex_unlock(&q->mutex);
+	return len;
+
+free_cluster:
+	qcow_free_clusters(q, clust_new_start, q->cluster_size);
+
+error:
+	mutex_unlock(&q->mutex);
+	return -1;
+}
+
+/*
+ * Fill iov_out with the part of iov covering [skip, skip + len). Returns
+ * the number of entries used, or 0 if it needs more than max of them.
+ */
+static int qcow_iov_slice(const struct iovec *iov, int iovcount, size_t skip,
+			  size_t len, struct iovec *iov_out, int max)
+{
+	int i, nr = 0;
+	size_t n;
+
+	for (i = 0; i < iovcount && len; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+
+		if (nr == max)
+			return 0;
+
+		n = min_t(size_t, iov[i].iov_len - skip, len);
+		iov_out[nr++] = (struct iovec) {
+			.iov_base	= iov[i].iov_base + skip,
+			.iov_len	= n,
+		};
+		len -= n;
+		skip = 0;
+	}
+
+	return nr;
+}
+
+#define QCOW_WRITE_BATCH_IOV	64
+
+/*
+ * Sequential writes to unallocated clusters: allocate all the clusters of
+ * the run that fall within one L2 table at once, and write them with a
+ * single pwritev(). Returns the number of bytes written, 0 if the write at
+ * skip doesn't start such a run.
+ */
+static ssize_t qcow_write_batch(struct qcow *q, u64 offset,
+				const struct iovec *iov, int iovcount,
+				size_t skip, size_t len)
+{
+	struct iovec slice[QCOW_WRITE_BATCH_IOV];
+	struct qcow_l2_table *l2t;
+	u64 l2t_size, l2t_idx;
+	u64 host, i, nr = 0;
+	u64 entry, bitmap;
+	int nr_iov = 0;
+
+	if (get_cluster_offset(q, offset) || len < q->cluster_size)
+		return 0;
+
+	l2t_size = 1 << q->header->l2_bits;
+
+	mutex_lock(&q->mutex);
+
+	if (get_cluster_table(q, offset, &l2t, &l2t_idx))
+		goto out;
+
+	for (nr = 0; nr < len >> q->header->cluster_bits; nr++) {
+		if (l2t_idx + nr >= l2t_size)
+			break;
+		l2_table_get_entry(q, l2t, l2t_idx + nr, &entry, &bitmap);
+		if (entry)
+			break;
+	}
+
+	while (nr) {
+		nr_iov = qcow_iov_slice(iov, iovcount, skip,
+					nr << q->header->cluster_bits,
+					slice, QCOW_WRITE_BATCH_IOV);
+		if (nr_iov)
+			break;
+		nr /= 2;
+	}
+
+	if (!nr)
+		goto out;
+
+	host = qcow_alloc_clusters(q, nr << q->header->cluster_bits, 1);
+	if (host == (u64)-1) {
+		nr = 0;
+		goto out;
+	}
+
+	if (pwritev_in_full(q->fd, slice, nr_iov, host) < 0) {
+		qcow_free_clusters(q, host, nr << q->header->cluster_bits);
+		mutex_unlock(&q->mutex);
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++)
+		l2_table_set_entry(q, l2t, l2t_idx + i,
+				   (host + (i << q->header->cluster_bits)) |
+				   QCOW2_OFLAG_COPIED, QCOW_EXTL2_ALL_ALLOC);
+out:
+	mutex_unlock(&q->mutex);
+
+	return nr << q->header->cluster_bits;
+}
+
+static ssize_t qcow_write_sector(struct disk_image *disk, u64 sector,
+				const struct iovec *iov, int iovcount, void *param)
+{
+	struct qcow *q = disk->priv;
+	u64 offset = sector << SECTOR_SHIFT;
+	size_t total = iov_size(iov, iovcount);
+	size_t done = 0, skip;
+	ssize_t nr;
+	int i;
+
+	while (done < total) {
+		if (offset >= q->header->size)
+			return -1;
+
+		nr = qcow_write_batch(q, offset, iov, iovcount, done,
+				      total - done);
+		if (!nr) {
+			/* Write up to the end of this iovec or cluster */
+			for (i = 0, skip = done; skip >= iov[i].iov_len; i++)
+				skip -= iov[i].iov_len;
+
+			nr = qcow_write_cluster(q, offset, iov[i].iov_base + skip,
+						iov[i].iov_len - skip);
+		}
+
+		if (nr <= 0) {
+			pr_info("qcow_write_sector error: nr=%ld\n", (long)nr);
+			return -1;
+		}
+
+		done	+= nr;
+		offset	+= nr;
+	}
+
+	return total;
+}
+
+/*
+ * Store the cluster at guest offset from the len bytes that
+ * qcow_compress_cluster() made of it, packed right after the previous
+ * compressed cluster when they fit in the same host cluster. Each cluster
+ * in a host cluster holds a reference to it. Only for clusters that were
+ * never written, which is what filling a new image needs.
+ */
+int qcow_write_compressed(struct disk_image *disk, u64 offset,
+			  const void *buf, u32 len)
+{
+	struct qcow *q = disk->priv;
+	struct qcow_l2_table *l2t;
+	u64 l2t_idx, entry, bitmap;
+	u64 host, nb_csectors;
+	u32 wlen;
+	int r = -EIO;
+
+	if (q->version < QCOW2_VERSION || get_cluster_offset(q, offset) ||
+	    !len || len >= q->cluster_size)
+		return -EINVAL;
+
+	mutex_lock(&q->mutex);
+
+	if (get_cluster_table(q, offset, &l2t, &l2t_idx))
+		goto out;
+
+	l2_table_get_entry(q, l2t, l2t_idx, &entry, &bitmap);
+	if (entry || bitmap) {
+		r = -EEXIST;
+		goto out;
+	}
+
+	host = q->compressed_next;
+	if (!(host & (q->cluster_size - 1)) ||
+	    (host & (q->cluster_size - 1)) + len > q->cluster_size) {
+		host = qcow_alloc_clusters(q, q->cluster_size, 1);
+		if (host == (u64)-1)
+			goto out;
+	} else if (update_cluster_refcount(q, host >> q->header->cluster_bits,
+					   1) < 0) {
+		goto out;
+	}
+
+	/*
+	 * Readers take whole sectors, so pad the last one for them to find it
+	 * in the file. The next cluster packed in overwrites the padding.
+	 */
+	wlen = ALIGN(host + len, SECTOR_SIZE) - host;
+	memcpy(q->copy_buff, buf, len);
+	memset(q->copy_buff + len, 0, wlen - len);
+	if (pwrite_in_full(q->fd, q->copy_buff, wlen, host) < 0) {
+		qcow_free_clusters(q, host, len);
+		q->compressed_next = 0;
+		goto out;
+	}
+
+	nb_csectors = ((host + len - 1) >> SECTOR_SHIFT) - (host >> SECTOR_SHIFT);
+	l2_table_set_entry(q, l2t, l2t_idx, host | QCOW2_OFLAG_COMPRESSED |
+			   nb_csectors << q->csize_shift, 0);
+	q->compressed_next = host + len;
+	r = 0;
+out:
+	mutex_unlock(&q->mutex);
+
+	return r;
+}
+
+/*
+ * The L2 entry of a cluster that reads as zeroes without using space. That's
+ * an unallocated one, unless it would read from a backing file. Version 2
+ * images have no other way, false then.
+ */
+static bool qcow_unmapped_entry(struct qcow *q, u64 *entry, u64 *bitmap)
+{
+	*bitmap = 0;
+
+	if (!q->backing) {
+		*entry = 0;
+	} else if (q->extended_l2) {
+		*entry = 0;
+		*bitmap = QCOW_EXTL2_ALL_ZERO;
+	} else if (q->version >= QCOW3_VERSION) {
+		*entry = QCOW2_OFLAG_ZERO;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Unmap nr whole clusters starting at offset, so that they read as zeroes.
+ * This serves both discard and write zeroes.
+ */
+static int qcow_unmap_clusters(struct qcow *q, u64 offset, u64 nr)
+{
+	u64 cluster_bits = q->header->cluster_bits;
+	u64 l2t_size = 1 << q->header->l2_bits;
+	struct qcow_l2_table *l2t;
+	u64 l2t_idx, i, n, unmapped, unmapped_bitmap, bitmap;
+	int ret = -1;
+	u64 *old;
+
+	if (!qcow_unmapped_entry(q, &unmapped, &unmapped_bitmap))
+		return -EOPNOTSUPP;
+
+	old = malloc(l2t_size * sizeof(u64));
+	if (!old)
+		return -ENOMEM;
 
-		if (qcow_l2_cache_write(q, l2t))
-			goto free_cluster;
+	mutex_lock(&q->mutex);
 
-		/* free old cluster*/
-		if (clust_flags & QCOW2_OFLAG_COMPRESSED) {
-			int size;
-			size = ((clust_start >> q->csize_shift) &
-				q->csize_mask) + 1;
-			size *= 512;
-			clust_start &= q->cluster_offset_mask;
-			clust_start &= ~511;
+	while (nr) {
+		if (get_cluster_table(q, offset, &l2t, &l2t_idx))
+			goto out;
 
-			qcow_free_clusters(q, clust_start, size);
-		} else if (clust_start)
-			qcow_free_clusters(q, clust_start, q->cluster_size);
+		n = min_t(u64, nr, l2t_size - l2t_idx);
+		for (i = 0; i < n; i++) {
+			l2_table_get_entry(q, l2t, l2t_idx + i, &old[i], &bitmap);
+			if (old[i] != unmapped || bitmap != unmapped_bitmap)
+				l2_table_set_entry(q, l2t, l2t_idx + i, unmapped,
+						   unmapped_bitmap);
+		}
 
-	} else {
-		/* Write actual data */
-		if (pwrite_in_full(q->fd, buf, len,
-			clust_start + clust_off) < 0)
-			goto error;
+		/* Only free the clusters once nothing on disk points at them */
+		if (qcow_l2_cache_write(q, l2t) < 0 || fdatasync(q->fd) < 0)
+			goto out;
+
+		for (i = 0; i < n; i++)
+			qcow_free_cluster_entry(q, old[i]);
+
+		offset	+= n << cluster_bits;
+		nr	-= n;
 	}
+
+	ret = 0;
+out:
 	mutex_unlock(&q->mutex);
-	return len;
+	free(old);
 
-free_cluster:
-	qcow_free_clusters(q, clust_new_start, q->cluster_size);
+	return ret;
+}
 
-error:
-	mutex_unlock(&q->mutex);
-	return -1;
+/* Partial clusters are left alone, discarding is only a hint */
+static int qcow_disk_discard(struct disk_image *disk, u64 sector, u64 nr_sectors)
+{
+	struct qcow *q = disk->priv;
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 end = offset + (nr_sectors << SECTOR_SHIFT);
+
+	offset = ALIGN(offset, q->cluster_size);
+	end &= ~((u64)q->cluster_size - 1);
+	if (end <= offset)
+		return 0;
+
+	return qcow_unmap_clusters(q, offset,
+				   (end - offset) >> q->header->cluster_bits);
 }
 
-static ssize_t qcow_write_sector_single(struct disk_image *disk, u64 sector, void *src, u32 src_len)
+static int qcow_disk_write_zeroes(struct disk_image *disk, u64 sector,
+				  u64 nr_sectors, bool unmap)
 {
 	struct qcow *q = disk->priv;
-	struct qcow_header *header = q->header;
-	u32 nr_written;
-	char *buf;
-	u64 offset;
-	ssize_t nr;
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 end = offset + (nr_sectors << SECTOR_SHIFT);
+	u64 clust_off, entry, bitmap, len, extent;
+	void *zeroes = NULL;
+	int ret = 0;
+	bool unmap_ok;
+
+	unmap_ok = qcow_unmapped_entry(q, &entry, &bitmap);
+
+	while (offset < end) {
+		clust_off = get_cluster_offset(q, offset);
+		len = min_t(u64, q->cluster_size - clust_off, end - offset);
+
+		if (unmap_ok && !clust_off && len == q->cluster_size) {
+			len = (end - offset) & ~((u64)q->cluster_size - 1);
+			ret = qcow_unmap_clusters(q, offset,
+						  len >> q->header->cluster_bits);
+			if (ret < 0)
+				break;
+			offset += len;
+			continue;
+		}
 
-	buf		= src;
-	nr_written	= 0;
-	offset		= sector << SECTOR_SHIFT;
+		ret = qcow_get_cluster_entry(q, offset, &entry, &extent);
+		if (ret < 0)
+			break;
 
-	while (nr_written < src_len) {
-		if (offset >= header->size)
-			return -1;
+		len = min_t(u64, len, extent);
 
-		nr = qcow_write_cluster(q, offset, buf, src_len - nr_written);
-		if (nr < 0)
-			return -1;
+		if (qcow_cluster_zero(q, entry)) {
+			offset += len;
+			continue;
+		}
+
+		if (!zeroes) {
+			zeroes = calloc(1, q->cluster_size);
+			if (!zeroes) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
+
+		if (qcow_write_cluster(q, offset, zeroes, len) < 0) {
+			ret = -EIO;
+			break;
+		}
 
-		nr_written	+= nr;
-		buf		+= nr;
-		offset		+= nr;
+		offset += len;
 	}
 
-	return nr_written;
+	free(zeroes);
+
+	return ret;
 }
 
-static ssize_t qcow_write_sector(struct disk_image *disk, u64 sector,
-				const struct iovec *iov, int iovcount, void *param)
+/*
+ * Map every unallocated cluster of the image, so that guest writes never
+ * have to allocate. Clusters inside the old end of file are punched out and
+ * clusters past it are covered by extending the file, so they read as zeroes.
+ */
+static int qcow_preallocate_metadata(struct qcow *q)
 {
-	ssize_t nr, total = 0;
+	u64 cluster_bits = q->header->cluster_bits;
+	u64 l2t_size = 1 << q->header->l2_bits;
+	struct qcow_l2_table *l2t;
+	u64 offset, l2t_idx, host;
+	u64 i, j, k, nr, len;
+	u64 entry, bitmap;
+	struct stat st;
+	off_t eof;
 
-	while (iovcount--) {
-		nr = qcow_write_sector_single(disk, sector, iov->iov_base, iov->iov_len);
-		if (nr != (ssize_t)iov->iov_len) {
-			pr_info("qcow_write_sector error: nr=%ld iov_len=%ld\n", (long)nr, (long)iov->iov_len);
-			return -1;
-		}
+	if (fstat(q->fd, &st) < 0)
+		return -1;
 
-		sector	+= iov->iov_len >> SECTOR_SHIFT;
-		iov++;
-		total	+= nr;
+	eof = st.st_size;
+
+	mutex_lock(&q->mutex);
+
+	for (offset = 0; offset < q->header->size;
+	     offset += l2t_size << cluster_bits) {
+		if (get_cluster_table(q, offset, &l2t, &l2t_idx))
+			goto error;
+
+		for (i = 0; i < l2t_size &&
+		     offset + (i << cluster_bits) < q->header->size; i = j) {
+			for (j = i; j < l2t_size &&
+			     offset + (j << cluster_bits) < q->header->size; j++) {
+				l2_table_get_entry(q, l2t, j, &entry, &bitmap);
+				if (entry)
+					break;
+			}
+
+			if (j == i) {
+				j++;
+				continue;
+			}
+
+			nr = j - i;
+			len = nr << cluster_bits;
+			host = qcow_alloc_clusters(q, len, 1);
+			if (host == (u64)-1)
+				goto error;
+
+			if ((off_t)host < eof &&
+			    fallocate(q->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				      host, min_t(u64, len, eof - host)) < 0)
+				goto error;
+
+			if ((off_t)(host + len) > eof) {
+				eof = host + len;
+				if (ftruncate(q->fd, eof) < 0)
+					goto error;
+			}
+
+			for (k = 0; k < nr; k++)
+				l2_table_set_entry(q, l2t, i + k,
+						   (host + (k << cluster_bits)) |
+						   QCOW2_OFLAG_COPIED,
+						   QCOW_EXTL2_ALL_ALLOC);
+		}
 	}
 
-	return total;
+	mutex_unlock(&q->mutex);
+
+	return 0;
+
+error:
+	mutex_unlock(&q->mutex);
+	return -1;
 }
 
 static int qcow_disk_flush(struct disk_image *disk)
 {
 	struct qcow *q = disk->priv;
-	struct qcow_refcount_table *rft;
-	struct list_head *pos, *n;
 	struct qcow_l1_table *l1t;
+	u32 i, j;
 
 	l1t = &q->table;
-	rft = &q->refcount_table;
 
 	mutex_lock(&q->mutex);
 
-	list_for_each_safe(pos, n, &rft->lru_list) {
-		struct qcow_refcount_block *c = list_entry(pos, struct qcow_refcount_block, list);
-
-		if (write_refcount_block(q, c) < 0)
-			goto error_unlock;
-	}
+	/* Refcounts and data first, so a crash can only leak clusters */
+	if (qcow_writeback_refcounts(q) < 0)
+		goto error_unlock;
 
-	list_for_each_safe(pos, n, &l1t->lru_list) {
-		struct qcow_l2_table *c = list_entry(pos, struct qcow_l2_table, list);
+	for (i = 0; i < l1t->nr_shards; i++) {
+		struct qcow_l2_cache_shard *shard = &l1t->shards[i];
 
-		if (qcow_l2_cache_write(q, c) < 0)
-			goto error_unlock;
+		for (j = 0; j < shard->nr_cached; j++) {
+			if (qcow_l2_cache_write(q, shard->slots[j]) < 0)
+				goto error_unlock;
+		}
 	}
 
-	if (qcow_write_l1_table < 0)
-		goto error_unlock;
-
 	mutex_unlock(&q->mutex);
 
 	return fsync(disk->fd);
@@ -1157,40 +2393,100 @@ error_unlock:
 	return -1;
 }
 
-static int qcow_disk_close(struct disk_image *disk)
-{
-	struct qcow *q;
-
-	if (!disk)
-		return 0;
-
-	q = disk->priv;
+static void qcow_backing_close(struct qcow_backing *b);
 
+/* Everything but q->fd, which belongs to the disk or to the backing file */
+static void qcow_free(struct qcow *q)
+{
+	qcow_decomp_exit(q);
+	if (q->backing)
+		qcow_backing_close(q->backing);
 	refcount_table_free_cache(&q->refcount_table);
 	l1_table_free_cache(&q->table);
 	free(q->copy_buff);
-	free(q->cluster_data);
-	free(q->cluster_cache);
-	free(q->refcount_table.rf_table);
-	free(q->table.l1_table);
+	qcow_unload_table(q->refcount_table.rf_table, q->refcount_table.map_size);
+	qcow_unload_table(q->table.l1_table, q->table.map_size);
 	free(q->header);
 	free(q);
+}
+
+static int qcow_disk_close(struct disk_image *disk)
+{
+	if (!disk)
+		return 0;
+
+	if (disk->ops->flush && qcow_disk_flush(disk) < 0)
+		pr_warning("qcow: flushing metadata on close failed");
+
+	qcow_free(disk->priv);
+
+	return 0;
+}
+
+static int qcow_disk_submit(struct disk_image *disk)
+{
+	struct qcow *q = disk->priv;
+
+	if (q->engine_ops->submit)
+		return q->engine_ops->submit(disk);
+
+	return 0;
+}
+
+static int qcow_disk_wait(struct disk_image *disk)
+{
+	struct qcow *q = disk->priv;
+
+	while (q->decomp_inflight) {
+		usleep(100);
+		barrier();
+	}
+
+	if (q->engine_ops->wait)
+		return q->engine_ops->wait(disk);
 
 	return 0;
 }
 
 static struct disk_image_operations qcow_disk_readonly_ops = {
-	.read	= qcow_read_sector,
-	.close	= qcow_disk_close,
+	.read		= qcow_read_sector,
+	.close		= qcow_disk_close,
+	.readahead	= qcow_disk_readahead,
+};
+
+/* Data reads go through the same engine as raw images */
+static struct disk_image_operations qcow_disk_readonly_async_ops = {
+	.read		= qcow_read_sector_async,
+	.submit		= qcow_disk_submit,
+	.wait		= qcow_disk_wait,
+	.close		= qcow_disk_close,
+	.readahead	= qcow_disk_readahead,
+	.async		= true,
 };
 
 static struct disk_image_operations qcow_disk_ops = {
-	.read	= qcow_read_sector,
-	.write	= qcow_write_sector,
-	.flush	= qcow_disk_flush,
-	.close	= qcow_disk_close,
+	.read		= qcow_read_sector,
+	.write		= qcow_write_sector,
+	.flush		= qcow_disk_flush,
+	.discard	= qcow_disk_discard,
+	.write_zeroes	= qcow_disk_write_zeroes,
+	.close		= qcow_disk_close,
+	.readahead	= qcow_disk_readahead,
 };
 
+static struct disk_image_operations *qcow_disk_ops_for(struct qcow *q,
+						      bool readonly)
+{
+	if (!readonly)
+		return &qcow_disk_ops;
+
+	q->engine_ops = raw_image__ops(true);
+	if (q->engine_ops->async)
+		return &qcow_disk_readonly_async_ops;
+
+	return &qcow_disk_readonly_ops;
+}
+
 static int qcow_read_refcount_table(struct qcow *q)
 {
 	struct qcow_header *header = q->header;
@@ -1199,23 +2495,13 @@ static int qcow_read_refcount_table(struct qcow *q)
 	rft->rf_size = (header->refcount_table_size * q->cluster_size)
 		/ sizeof(u64);
 
-	rft->rf_table = calloc(rft->rf_size, sizeof(u64));
-	if (!rft->rf_table)
-		return -1;
-
 	rft->root = (struct rb_root) RB_ROOT;
 	INIT_LIST_HEAD(&rft->lru_list);
 
-	return pread_in_full(q->fd, rft->rf_table, sizeof(u64) * rft->rf_size, header->refcount_table_offset);
-}
-
-static int qcow_write_refcount_table(struct qcow *q)
-{
-	struct qcow_header *header = q->header;
-	struct qcow_refcount_table *rft = &q->refcount_table;
+	rft->rf_table = qcow_load_table(q, header->refcount_table_offset,
+					rft->rf_size, &rft->map_size);
 
-	return qcow_pwrite_sync(q->fd, rft->rf_table,
-		rft->rf_size * sizeof(u64), header->refcount_table_offset);
+	return rft->rf_table ? 0 : -1;
 }
 
 static int qcow_read_l1_table(struct qcow *q)
@@ -1225,11 +2511,59 @@ static int qcow_read_l1_table(struct qcow *q)
 
 	table->table_size = header->l1_size;
 
-	table->l1_table	= calloc(table->table_size, sizeof(u64));
-	if (!table->l1_table)
+	table->l1_table = qcow_load_table(q, header->l1_table_offset,
+					  table->table_size, &table->map_size);
+
+	return table->l1_table ? 0 : -1;
+}
+
+static int qcow3_read_header(int fd, struct qcow_header *header)
+{
+	struct qcow3_header_disk f_header = { 0 };
+	u64 unsupported;
+
+	if (pread_in_full(fd, &f_header, sizeof(f_header),
+			  sizeof(struct qcow2_header_disk)) < 0)
+		return -1;
+
+	be64_to_cpus(&f_header.incompatible_features);
+	be32_to_cpus(&f_header.refcount_order);
+
+	header->incompatible_features = f_header.incompatible_features;
+	be32_to_cpus(&f_header.header_length);
+
+	unsupported = f_header.incompatible_features & ~QCOW2_INCOMPAT_SUPPORTED;
+	if (unsupported) {
+		pr_warning("Unsupported qcow2 incompatible features 0x%llx",
+			   (unsigned long long)unsupported);
+		return -1;
+	}
+
+	/* The refcount code only deals with 16-bit refcounts */
+	if (f_header.refcount_order != 4) {
+		pr_warning("Unsupported qcow2 refcount order %u",
+			   f_header.refcount_order);
+		return -1;
+	}
+
+	if (f_header.header_length > offsetof(struct qcow3_header_disk, compression_type) +
+				     sizeof(struct qcow2_header_disk))
+		header->compression_type = f_header.compression_type;
+
+	switch (header->compression_type) {
+	case QCOW2_COMPRESSION_ZLIB:
+		break;
+#ifdef CONFIG_HAS_ZSTD
+	case QCOW2_COMPRESSION_ZSTD:
+		break;
+#endif
+	default:
+		pr_warning("Unsupported qcow2 compression type %u",
+			   header->compression_type);
 		return -1;
+	}
 
-	return pread_in_full(q->fd, table->l1_table, sizeof(u64) * table->table_size, header->l1_table_offset);
+	return 0;
 }
 
 static void *qcow2_read_header(int fd)
@@ -1268,39 +2602,162 @@ static void *qcow2_read_header(int fd)
 		.l2_bits		= f_header.cluster_bits - 3,
 		.refcount_table_offset	= f_header.refcount_table_offset,
 		.refcount_table_size	= f_header.refcount_table_clusters,
+		.version		= f_header.version,
+		.backing_file_offset	= f_header.backing_file_offset,
+		.backing_file_size	= f_header.backing_file_size,
 	};
 
+	if (f_header.version >= QCOW3_VERSION &&
+	    qcow3_read_header(fd, header) < 0) {
+		free(header);
+		return NULL;
+	}
+
+	/* Entries of 16 bytes, the table is still a cluster */
+	if (header->incompatible_features & QCOW2_INCOMPAT_EXTL2) {
+		if (header->cluster_bits < QCOW_EXTL2_MIN_CLUSTER_BITS) {
+			pr_warning("qcow: extended L2 entries need clusters of %dKB or more",
+				   1 << (QCOW_EXTL2_MIN_CLUSTER_BITS - 10));
+			free(header);
+			return NULL;
+		}
+		header->l2_bits--;
+	}
+
 	return header;
 }
 
-static struct disk_image *qcow2_probe(int fd, bool readonly)
+static bool qcow2_check_image(int fd);
+static struct qcow *qcow2_open(int fd, const char *filename,
+			       u64 l2_cache_size, int depth);
+
+static void qcow_backing_close(struct qcow_backing *b)
+{
+	if (b->q)
+		qcow_free(b->q);
+	if (b->map)
+		munmap(b->map, b->map_size);
+	close(b->fd);
+	free(b);
+}
+
+/* A relative name is relative to the directory of the image */
+static int qcow_backing_path(struct qcow *q, int fd, const char *filename,
+			     char *path, size_t size)
+{
+	u32 len = q->header->backing_file_size;
+	const char *slash = strrchr(filename, '/');
+	char name[PATH_MAX];
+	int dir_len = 0;
+
+	if (!len || len >= sizeof(name))
+		return -EINVAL;
+
+	if (pread_in_full(fd, name, len, q->header->backing_file_offset) != len)
+		return -EIO;
+	name[len] = '\0';
+
+	if (name[0] != '/' && slash)
+		dir_len = slash - filename + 1;
+
+	if (snprintf(path, size, "%.*s%s", dir_len, filename, name) >= (int)size)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+static struct qcow_backing *qcow_backing_open(struct qcow *q, int fd,
+					      const char *filename, int depth)
+{
+	struct qcow_backing *b;
+	char path[PATH_MAX];
+	struct stat st;
+	int r;
+
+	if (depth == QCOW_MAX_BACKING_DEPTH) {
+		pr_warning("qcow: %s: more than %d backing files", filename,
+			   QCOW_MAX_BACKING_DEPTH);
+		return ERR_PTR(-ELOOP);
+	}
+
+	r = qcow_backing_path(q, fd, filename, path, sizeof(path));
+	if (r < 0) {
+		pr_warning("qcow: %s: invalid backing file name", filename);
+		return ERR_PTR(r);
+	}
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return ERR_PTR(-ENOMEM);
+
+	b->fd = open(path, O_RDONLY);
+	if (b->fd < 0 || fstat(b->fd, &st) < 0) {
+		r = -errno;
+		pr_warning("qcow: unable to open the backing file %s: %s",
+			   path, strerror(errno));
+		goto err_free;
+	}
+
+	/* The page cache of the file is then shared by all its users */
+	b->map_size = st.st_size;
+	b->map = mmap(NULL, b->map_size, PROT_READ, MAP_SHARED, b->fd, 0);
+	if (b->map == MAP_FAILED)
+		b->map = NULL;
+
+	if (qcow2_check_image(b->fd)) {
+		b->q = qcow2_open(b->fd, path, 0, depth + 1);
+		if (IS_ERR(b->q)) {
+			r = PTR_ERR(b->q);
+			b->q = NULL;
+			goto err_close;
+		}
+		b->q->map = b->map;
+		b->q->map_size = b->map_size;
+		b->size = b->q->header->size;
+	} else {
+		b->size = st.st_size;
+	}
+
+	return b;
+
+err_close:
+	qcow_backing_close(b);
+	return ERR_PTR(r);
+err_free:
+	if (b->fd >= 0)
+		close(b->fd);
+	free(b);
+	return ERR_PTR(r);
+}
+
+/* The metadata of a version 2 or 3 image, and of its backing files */
+static struct qcow *qcow2_open(int fd, const char *filename,
+			       u64 l2_cache_size, int depth)
 {
-	struct disk_image *disk_image;
-	struct qcow_l1_table *l1t;
 	struct qcow_header *h;
 	struct qcow *q;
+	int r = -EINVAL;
 
 	q = calloc(1, sizeof(struct qcow));
 	if (!q)
-		return NULL;
+		return ERR_PTR(-ENOMEM);
 
 	mutex_init(&q->mutex);
 	q->fd = fd;
 
-	l1t = &q->table;
-
-	l1t->root = (struct rb_root) RB_ROOT;
-	INIT_LIST_HEAD(&l1t->lru_list);
-
 	h = q->header = qcow2_read_header(fd);
 	if (!h)
 		goto free_qcow;
 
-	q->version = QCOW2_VERSION;
+	q->version = h->version;
 	q->csize_shift = (62 - (q->header->cluster_bits - 8));
 	q->csize_mask = (1 << (q->header->cluster_bits - 8)) - 1;
 	q->cluster_offset_mask = (1LL << q->csize_shift) - 1;
 	q->cluster_size = 1 << q->header->cluster_bits;
+	q->extended_l2 = h->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+	q->subcluster_bits = h->cluster_bits;
+	if (q->extended_l2)
+		q->subcluster_bits -= QCOW_EXTL2_SUBCLUSTER_SHIFT;
 
 	q->copy_buff = malloc(q->cluster_size);
 	if (!q->copy_buff) {
@@ -1308,52 +2765,36 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 		goto free_header;
 	}
 
-	q->cluster_data = malloc(q->cluster_size);
-	if (!q->cluster_data) {
-		pr_warning("cluster data malloc error");
-		goto free_copy_buff;
-	}
+	qcow_decomp_init(q);
 
-	q->cluster_cache = malloc(q->cluster_size);
-	if (!q->cluster_cache) {
-		pr_warning("cluster cache malloc error");
-		goto free_cluster_data;
+	if (l1_table_init_cache(q, l2_cache_size) < 0) {
+		pr_warning("L2 cache allocation error");
+		goto free_l2_cache;
 	}
 
 	if (qcow_read_l1_table(q) < 0)
-		goto free_cluster_cache;
+		goto free_l2_cache;
 
 	if (qcow_read_refcount_table(q) < 0)
 		goto free_l1_table;
 
-	/*
-	 * Do not use mmap use read/write instead
-	 */
-	if (readonly)
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_readonly_ops, DISK_IMAGE_REGULAR);
-	else
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_ops, DISK_IMAGE_REGULAR);
-
-	if (IS_ERR_OR_NULL(disk_image))
-		goto free_refcount_table;
-
-	disk_image->priv = q;
+	if (h->backing_file_offset) {
+		q->backing = qcow_backing_open(q, fd, filename, depth);
+		if (IS_ERR(q->backing)) {
+			r = PTR_ERR(q->backing);
+			q->backing = NULL;
+			goto free_refcount_table;
+		}
+	}
 
-	return disk_image;
+	return q;
 
 free_refcount_table:
-	if (q->refcount_table.rf_table)
-		free(q->refcount_table.rf_table);
+	qcow_unload_table(q->refcount_table.rf_table, q->refcount_table.map_size);
 free_l1_table:
-	if (q->table.l1_table)
-		free(q->table.l1_table);
-free_cluster_cache:
-	if (q->cluster_cache)
-		free(q->cluster_cache);
-free_cluster_data:
-	if (q->cluster_data)
-		free(q->cluster_data);
-free_copy_buff:
+	qcow_unload_table(q->table.l1_table, q->table.map_size);
+free_l2_cache:
+	l1_table_free_cache(&q->table);
 	if (q->copy_buff)
 		free(q->copy_buff);
 free_header:
@@ -1362,7 +2803,56 @@ free_header:
 free_qcow:
 	free(q);
 
-	return NULL;
+	return ERR_PTR(r);
+}
+
+static struct disk_image *qcow2_probe(int fd, const char *filename,
+				      bool readonly, u64 l2_cache_size,
+				      bool prealloc)
+{
+	struct disk_image *disk_image;
+	struct qcow_header *h;
+	struct qcow *q;
+
+	q = qcow2_open(fd, filename, l2_cache_size, 0);
+	if (IS_ERR(q))
+		return ERR_CAST(q);
+
+	h = q->header;
+
+	/* Refcounts of a dirty image can't be trusted for allocation */
+	if (!readonly && (h->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
+		pr_warning("qcow: image is dirty, opening it read-only");
+		readonly = true;
+	}
+
+	/*
+	 * Do not use mmap use read/write instead
+	 */
+	disk_image = disk_image__new(fd, h->size, qcow_disk_ops_for(q, readonly),
+				     DISK_IMAGE_REGULAR);
+
+	if (IS_ERR_OR_NULL(disk_image)) {
+		qcow_free(q);
+		return disk_image;
+	}
+
+	disk_image->priv = q;
+	disk_image->discard_sectors = q->cluster_size >> SECTOR_SHIFT;
+	/* Smaller writes to clusters not allocated yet copy the rest */
+	disk_image->topology.opt_io_size = q->cluster_size;
+
+	if (prealloc) {
+		if (readonly)
+			pr_warning("qcow: not preallocating a read-only image");
+		else if (q->backing)
+			pr_warning("qcow: not preallocating an image with a backing file");
+		else if (qcow_preallocate_metadata(q) < 0 ||
+			 qcow_disk_flush(disk_image) < 0)
+			pr_warning("qcow: metadata preallocation failed");
+	}
+
+	return disk_image;
 }
 
 static bool qcow2_check_image(int fd)
@@ -1378,7 +2868,8 @@ static bool qcow2_check_image(int fd)
 	if (f_header.magic != QCOW_MAGIC)
 		return false;
 
-	if (f_header.version != QCOW2_VERSION)
+	if (f_header.version != QCOW2_VERSION &&
+	    f_header.version != QCOW3_VERSION)
 		return false;
 
 	return true;
@@ -1413,15 +2904,15 @@ static void *qcow1_read_header(int fd)
 		.l1_size		= f_header.size / ((1 << f_header.l2_bits) * (1 << f_header.cluster_bits)),
 		.cluster_bits		= f_header.cluster_bits,
 		.l2_bits		= f_header.l2_bits,
+		.backing_file_offset	= f_header.backing_file_offset,
 	};
 
 	return header;
 }
 
-static struct disk_image *qcow1_probe(int fd, bool readonly)
+static struct disk_image *qcow1_probe(int fd, bool readonly, u64 l2_cache_size)
 {
 	struct disk_image *disk_image;
-	struct qcow_l1_table *l1t;
 	struct qcow_header *h;
 	struct qcow *q;
 
@@ -1432,61 +2923,53 @@ static struct disk_image *qcow1_probe(int fd, bool readonly)
 	mutex_init(&q->mutex);
 	q->fd = fd;
 
-	l1t = &q->table;
-
-	l1t->root = (struct rb_root)RB_ROOT;
-	INIT_LIST_HEAD(&l1t->lru_list);
 	INIT_LIST_HEAD(&q->refcount_table.lru_list);
 
 	h = q->header = qcow1_read_header(fd);
 	if (!h)
 		goto free_qcow;
 
+	if (h->backing_file_offset) {
+		pr_warning("qcow: backing files of version 1 images are not supported");
+		free(h);
+		free(q);
+		return ERR_PTR(-EOPNOTSUPP);
+	}
+
 	q->version = QCOW1_VERSION;
 	q->cluster_size = 1 << q->header->cluster_bits;
 	q->cluster_offset_mask = (1LL << (63 - q->header->cluster_bits)) - 1;
 	q->free_clust_idx = 0;
 
-	q->cluster_data = malloc(q->cluster_size);
-	if (!q->cluster_data) {
-		pr_warning("cluster data malloc error");
-		goto free_header;
-	}
+	qcow_decomp_init(q);
 
-	q->cluster_cache = malloc(q->cluster_size);
-	if (!q->cluster_cache) {
-		pr_warning("cluster cache malloc error");
-		goto free_cluster_data;
+	if (l1_table_init_cache(q, l2_cache_size) < 0) {
+		pr_warning("L2 cache allocation error");
+		goto free_l2_cache;
 	}
 
 	if (qcow_read_l1_table(q) < 0)
-		goto free_cluster_cache;
+		goto free_l2_cache;
 
 	/*
 	 * Do not use mmap use read/write instead
 	 */
-	if (readonly)
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_readonly_ops, DISK_IMAGE_REGULAR);
-	else
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_ops, DISK_IMAGE_REGULAR);
+	/* Without refcounts there's no way to allocate clusters */
+	disk_image = disk_image__new(fd, h->size, qcow_disk_ops_for(q, true),
+				     DISK_IMAGE_REGULAR);
 
 	if (!disk_image)
 		goto free_l1_table;
 
 	disk_image->priv = q;
+	disk_image->topology.opt_io_size = q->cluster_size;
 
 	return disk_image;
 
 free_l1_table:
-	if (q->table.l1_table)
-		free(q->table.l1_table);
-free_cluster_cache:
-	if (q->cluster_cache)
-		free(q->cluster_cache);
-free_cluster_data:
-	if (q->cluster_data)
-		free(q->cluster_data);
-free_header:
+	qcow_unload_table(q->table.l1_table, q->table.map_size);
+free_l2_cache:
+	l1_table_free_cache(&q->table);
 	if (q->header)
 		free(q->header);
 free_qcow:
@@ -1514,13 +2997,153 @@ static bool qcow1_check_image(int fd)
 	return true;
 }
 
-struct disk_image *qcow_probe(int fd, bool readonly)
+/*
+ * NULL if @fd isn't a QCOW image. @filename locates backing files with
+ * relative names.
+ */
+struct disk_image *qcow_probe(int fd, const char *filename, bool readonly,
+			      u64 l2_cache_size, bool prealloc)
 {
-	if (qcow1_check_image(fd))
-		return qcow1_probe(fd, readonly);
+	if (qcow1_check_image(fd)) {
+		if (prealloc)
+			pr_warning("qcow: preallocation needs a qcow2 image");
+		return qcow1_probe(fd, readonly, l2_cache_size);
+	}
 
 	if (qcow2_check_image(fd))
-		return qcow2_probe(fd, readonly);
+		return qcow2_probe(fd, filename, readonly, l2_cache_size,
+				   prealloc);
 
 	return NULL;
 }
+
+/* The QCOW state of a disk image, NULL if it isn't one */
+struct qcow *qcow_image(struct disk_image *disk)
+{
+	if (disk->ops->close != qcow_disk_close)
+		return NULL;
+
+	return disk->priv;
+}
+
+/*
+ * Write an empty version 3 image of size bytes to fd. The refcount table is
+ * sized for the image to be filled twice over, as it can't grow, while the
+ * refcount blocks only cover the metadata written here and are added as the
+ * image fills. An optional backing file name goes at the end of the header
+ * cluster.
+ */
+int qcow_create(int fd, u64 size, u32 cluster_bits, bool extended_l2,
+		int compression_type, const char *backing)
+{
+	struct qcow2_header_disk header;
+	struct qcow3_header_disk header3;
+	u64 cluster_size, l2_bits, l1_size, l1_clusters;
+	u64 rfb_entries, rft_entries, rft_clusters, nr_rfb;
+	u64 max_clusters, meta, i;
+	size_t backing_len = backing ? strlen(backing) : 0;
+	size_t backing_offset;
+	u16 *rfb;
+	u64 *rft;
+	void *buf;
+	int r;
+
+	if (cluster_bits < 9 || cluster_bits > 21 ||
+	    (extended_l2 && cluster_bits < QCOW_EXTL2_MIN_CLUSTER_BITS))
+		return -EINVAL;
+
+	switch (compression_type) {
+	case QCOW2_COMPRESSION_ZLIB:
+		break;
+#ifdef CONFIG_HAS_ZSTD
+	case QCOW2_COMPRESSION_ZSTD:
+		break;
+#endif
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	cluster_size = 1ULL << cluster_bits;
+	backing_offset = sizeof(header) + sizeof(header3) + sizeof(u64);
+	if (backing_offset + backing_len > cluster_size)
+		return -ENAMETOOLONG;
+
+	l2_bits = cluster_bits - 3 - extended_l2;
+	l1_size = DIV_ROUND_UP(size, cluster_size << l2_bits);
+	l1_clusters = DIV_ROUND_UP(max_t(u64, l1_size, 1) * sizeof(u64),
+				   cluster_size);
+
+	rfb_entries = cluster_size >> QCOW_REFCOUNT_BLOCK_SHIFT;
+	max_clusters = 2 * (DIV_ROUND_UP(size, cluster_size) + l1_size +
+			    l1_clusters) + 64;
+	rft_entries = DIV_ROUND_UP(max_clusters, rfb_entries);
+
+	/* The refcount blocks cover themselves and the tables */
+	for (nr_rfb = 1;; nr_rfb++) {
+		rft_clusters = DIV_ROUND_UP(max_t(u64, rft_entries, nr_rfb) *
+					    sizeof(u64), cluster_size);
+		meta = 1 + rft_clusters + nr_rfb + l1_clusters;
+		if (meta <= nr_rfb * rfb_entries)
+			break;
+	}
+
+	header = (struct qcow2_header_disk) {
+		.magic			= cpu_to_be32(QCOW_MAGIC),
+		.version		= cpu_to_be32(QCOW3_VERSION),
+		.cluster_bits		= cpu_to_be32(cluster_bits),
+		.size			= cpu_to_be64(size),
+		.l1_size		= cpu_to_be32(l1_size),
+		.l1_table_offset	= cpu_to_be64((1 + rft_clusters + nr_rfb) <<
+						      cluster_bits),
+		.refcount_table_offset	= cpu_to_be64(cluster_size),
+		.refcount_table_clusters = cpu_to_be32(rft_clusters),
+	};
+
+	if (backing_len) {
+		header.backing_file_offset = cpu_to_be64(backing_offset);
+		header.backing_file_size = cpu_to_be32(backing_len);
+	}
+
+	header3 = (struct qcow3_header_disk) {
+		.refcount_order		= cpu_to_be32(4),
+		.header_length		= cpu_to_be32(sizeof(header) +
+						      sizeof(header3)),
+		.compression_type	= compression_type,
+	};
+
+	if (extended_l2)
+		header3.incompatible_features |= QCOW2_INCOMPAT_EXTL2;
+	if (compression_type != QCOW2_COMPRESSION_ZLIB)
+		header3.incompatible_features |= QCOW2_INCOMPAT_COMPRESSION;
+	header3.incompatible_features =
+		cpu_to_be64(header3.incompatible_features);
+
+	/* Header, refcount table and blocks, the L1 table stays a hole */
+	buf = calloc(1 + rft_clusters + nr_rfb, cluster_size);
+	if (!buf)
+		return -ENOMEM;
+
+	memcpy(buf, &header, sizeof(header));
+	memcpy(buf + sizeof(header), &header3, sizeof(header3));
+	if (backing_len)
+		memcpy(buf + backing_offset, backing, backing_len);
+
+	rft = buf + cluster_size;
+	for (i = 0; i < nr_rfb; i++)
+		rft[i] = cpu_to_be64((1 + rft_clusters + i) << cluster_bits);
+
+	rfb = buf + ((1 + rft_clusters) << cluster_bits);
+	for (i = 0; i < meta; i++)
+		rfb[i] = cpu_to_be16(1);
+
+	r = 0;
+	if (ftruncate(fd, 0) < 0 || ftruncate(fd, meta << cluster_bits) < 0 ||
+	    pwrite_in_full(fd, buf, (1 + rft_clusters + nr_rfb) << cluster_bits,
+			   0) < 0 ||
+	    fdatasync(fd) < 0)
+		r = -errno;
+
+	free(buf);
+
+	return r;
+}
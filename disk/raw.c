@@ -1,6 +1,8 @@
 #include "kvm/disk-image.h"
+#include "kvm/iovec.h"
 
 #include <linux/err.h>
+#include <linux/kernel.h>
 
 ssize_t raw_image__read_sync(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param)
@@ -15,6 +17,53 @@ ssize_t raw_image__write_sync(struct disk_image *disk, u64 sector,
 	return pwritev_in_full(disk->fd, iov, iovcount, sector << SECTOR_SHIFT);
 }
 
+/* Most reads skipped after a run of misses, before trying again */
+#define RAW_NOWAIT_MAX_SKIP	64
+
+/*
+ * Read from the page cache without blocking, sparing a cached request the
+ * trip through the engine and its completion thread. Returns -EAGAIN when
+ * the request has to go to the engine: after a miss the next reads go
+ * straight there, more of them each time, so that an image that isn't
+ * cached doesn't pay for a failed preadv2() on every read.
+ */
+ssize_t raw_image__read_nowait(struct disk_image *disk, u64 sector,
+			       const struct iovec *iov, int iovcount)
+{
+	size_t len = iov_size(iov, iovcount);
+	ssize_t r;
+
+	if (!disk->nowait)
+		return -EAGAIN;
+
+	if (disk->nowait_skip) {
+		disk->nowait_skip--;
+		return -EAGAIN;
+	}
+
+	__sync_fetch_and_add(&disk->stats.nowait_reads, 1);
+	r = preadv2(disk->fd, iov, iovcount, sector << SECTOR_SHIFT,
+		    RWF_NOWAIT);
+	if (r >= 0 && (size_t)r == len) {
+		__sync_fetch_and_add(&disk->stats.nowait_hits, 1);
+		disk->nowait_backoff = 0;
+		return r;
+	}
+
+	/* The kernel or the filesystem doesn't do RWF_NOWAIT */
+	if (r < 0 && errno == EOPNOTSUPP) {
+		disk->nowait = false;
+		return -EAGAIN;
+	}
+
+	/* Short reads are partly cached, they are read again in full */
+	disk->nowait_backoff = min_t(u32, disk->nowait_backoff * 2 ?: 1,
+				     RAW_NOWAIT_MAX_SKIP);
+	disk->nowait_skip = disk->nowait_backoff;
+
+	return -EAGAIN;
+}
+
 ssize_t raw_image__read_mmap(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param)
 {
@@ -51,6 +100,53 @@ ssize_t raw_image__write_mmap(struct disk_image *disk, u64 sector, const struct
 	return total;
 }
 
+int raw_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors)
+{
+	if (fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      sector << SECTOR_SHIFT, nr_sectors << SECTOR_SHIFT) < 0)
+		return -errno;
+
+	return 0;
+}
+
+#define RAW_ZEROES_BUF_SIZE	(64 * 1024)
+
+int raw_image__write_zeroes(struct disk_image *disk, u64 sector,
+			    u64 nr_sectors, bool unmap)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 len = nr_sectors << SECTOR_SHIFT;
+	void *zeroes;
+	ssize_t n;
+	int mode;
+
+	mode = unmap ? FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE;
+	if (fallocate(disk->fd, mode | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+		return 0;
+
+	if (errno != EOPNOTSUPP)
+		return -errno;
+
+	/* The filesystem can't do it, write the zeroes ourselves */
+	zeroes = calloc(1, RAW_ZEROES_BUF_SIZE);
+	if (!zeroes)
+		return -ENOMEM;
+
+	while (len) {
+		n = pwrite_in_full(disk->fd, zeroes,
+				   min_t(u64, len, RAW_ZEROES_BUF_SIZE), offset);
+		if (n < 0)
+			break;
+
+		offset	+= n;
+		len	-= n;
+	}
+
+	free(zeroes);
+
+	return len ? -errno : 0;
+}
+
 int raw_image__close(struct disk_image *disk)
 {
 	int ret = 0;
@@ -61,30 +157,103 @@ int raw_image__close(struct disk_image *disk)
 	return ret;
 }
 
+/* Of the file, which also fills the private mapping of read-only images */
+int raw_image__readahead(struct disk_image *disk, u64 offset, u64 len)
+{
+	return -posix_fadvise(disk->fd, offset, len, POSIX_FADV_WILLNEED);
+}
+
 /*
  * multiple buffer based disk image operations
  */
 static struct disk_image_operations raw_image_regular_ops = {
-	.read	= raw_image__read,
-	.write	= raw_image__write,
-	.wait	= raw_image__wait,
-	.async	= true,
+	.read		= raw_image__read,
+	.write		= raw_image__write,
+#ifdef CONFIG_HAS_AIO
+	.flush_async	= raw_image__flush_async,
+#endif
+	.submit		= raw_image__submit,
+	.wait		= raw_image__wait,
+	.discard	= raw_image__discard,
+	.write_zeroes	= raw_image__write_zeroes,
+	.readahead	= raw_image__readahead,
+	.async		= true,
 };
 
 struct disk_image_operations ro_ops = {
-	.read	= raw_image__read_mmap,
-	.write	= raw_image__write_mmap,
-	.close	= raw_image__close,
+	.read		= raw_image__read_mmap,
+	.write		= raw_image__write_mmap,
+	.close		= raw_image__close,
+	.readahead	= raw_image__readahead,
 };
 
 struct disk_image_operations ro_ops_nowrite = {
-	.read	= raw_image__read,
-	.wait	= raw_image__wait,
-	.async	= true,
+	.read		= raw_image__read,
+	.submit		= raw_image__submit,
+	.wait		= raw_image__wait,
+	.readahead	= raw_image__readahead,
+	.async		= true,
+};
+
+static struct disk_image_operations raw_image_sync_ops = {
+	.read		= raw_image__read_sync,
+	.write		= raw_image__write_sync,
+	.discard	= raw_image__discard,
+	.write_zeroes	= raw_image__write_zeroes,
+	.readahead	= raw_image__readahead,
+};
+
+static struct disk_image_operations ro_ops_nowrite_sync = {
+	.read		= raw_image__read_sync,
+	.readahead	= raw_image__readahead,
+};
+
+#ifdef CONFIG_HAS_IO_URING
+static struct disk_image_operations raw_image_uring_ops = {
+	.read		= raw_image__read_uring,
+	.write		= raw_image__write_uring,
+	.flush_async	= raw_image__flush_uring,
+	.submit		= raw_image__submit_uring,
+	.wait		= raw_image__wait_uring,
+	.discard	= raw_image__discard,
+	.write_zeroes	= raw_image__write_zeroes,
+	.readahead	= raw_image__readahead,
+	.async		= true,
 };
 
+static struct disk_image_operations ro_ops_nowrite_uring = {
+	.read		= raw_image__read_uring,
+	.submit		= raw_image__submit_uring,
+	.wait		= raw_image__wait_uring,
+	.readahead	= raw_image__readahead,
+	.async		= true,
+};
+#endif
+
+/*
+ * Operations for file-backed raw images and block devices, according to the
+ * disk engine selected on the command line.
+ */
+struct disk_image_operations *raw_image__ops(bool readonly)
+{
+	switch (disk_engine) {
+	case DISK_ENGINE_SYNC:
+		return readonly ? &ro_ops_nowrite_sync : &raw_image_sync_ops;
+#ifdef CONFIG_HAS_IO_URING
+	case DISK_ENGINE_IO_URING:
+		return readonly ? &ro_ops_nowrite_uring : &raw_image_uring_ops;
+#endif
+	default:
+		return readonly ? &ro_ops_nowrite : &raw_image_regular_ops;
+	}
+}
+
 struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly)
 {
+	/* O_DIRECT reads go straight to guest memory, there's nothing to map */
+	if (readonly && (fcntl(fd, F_GETFL) & O_DIRECT))
+		return disk_image__new(fd, st->st_size, raw_image__ops(true), DISK_IMAGE_REGULAR);
+
 	if (readonly) {
 		/*
 		 * Use mmap's MAP_PRIVATE to implement non-persistent write
@@ -94,14 +263,20 @@ struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly)
 
 		disk = disk_image__new(fd, st->st_size, &ro_ops, DISK_IMAGE_MMAP);
 		if (IS_ERR_OR_NULL(disk)) {
-			disk = disk_image__new(fd, st->st_size, &ro_ops_nowrite, DISK_IMAGE_REGULAR);
+			disk = disk_image__new(fd, st->st_size, raw_image__ops(true), DISK_IMAGE_REGULAR);
 		}
 
 		return disk;
 	} else {
+		struct disk_image *disk;
+
 		/*
 		 * Use read/write instead of mmap
 		 */
-		return disk_image__new(fd, st->st_size, &raw_image_regular_ops, DISK_IMAGE_REGULAR);
+		disk = disk_image__new(fd, st->st_size, raw_image__ops(false), DISK_IMAGE_REGULAR);
+		if (!IS_ERR_OR_NULL(disk))
+			disk->discard_sectors = st->st_blksize >> SECTOR_SHIFT;
+
+		return disk;
 	}
 }
@@ -0,0 +1,137 @@
+#include "kvm/disk-image.h"
+#include "kvm/mutex.h"
+
+#include <linux/kernel.h>
+
+/*
+ * Readahead of the sequential streams of reads of the guest. A read that
+ * starts where another one ended continues its stream, and once a stream
+ * is sequential the backend is asked to pull the range past it into the
+ * host page cache: posix_fadvise() for raw images, the clusters ahead
+ * resolved first for QCOW ones. The window doubles each time the stream
+ * gets within half a window of its end, up to readahead= (2M by default),
+ * so that guests booting with small reads from images on slow or network
+ * filesystems don't wait on each of them.
+ *
+ * Reads that the page cache can't hold anyway, with O_DIRECT, don't get
+ * any, nor images whose backend has nothing to start reads with.
+ */
+#define DISK_RA_STREAMS		8
+/* Reads in a row before a stream counts as sequential */
+#define DISK_RA_SEQ_READS	2
+#define DISK_RA_MIN_WINDOW	(128 * 1024)
+#define DISK_RA_DEFAULT_WINDOW	(2 * 1024 * 1024)
+
+struct disk_ra_stream {
+	/* Where the next read of the stream starts, in bytes */
+	u64			next;
+	/* End of what was read ahead of the stream, 0 before the first time */
+	u64			ahead;
+	u64			window;
+	u32			reads;
+	/* For the replacement of the stream used least recently */
+	u64			used;
+};
+
+struct disk_readahead {
+	struct mutex		lock;
+	u64			max_window;
+	u64			clock;
+	struct disk_ra_stream	streams[DISK_RA_STREAMS];
+};
+
+int disk_readahead__init(struct disk_image *disk, u64 max_window)
+{
+	struct disk_readahead *ra;
+
+	if (!disk->ops->readahead || disk->direct)
+		return 0;
+
+	ra = calloc(1, sizeof(*ra));
+	if (!ra)
+		return -ENOMEM;
+
+	mutex_init(&ra->lock);
+	ra->max_window = max_window ? max_window : DISK_RA_DEFAULT_WINDOW;
+	disk->readahead = ra;
+
+	return 0;
+}
+
+void disk_readahead__exit(struct disk_image *disk)
+{
+	struct disk_readahead *ra = disk->readahead;
+
+	if (!ra)
+		return;
+
+	free(ra);
+	disk->readahead = NULL;
+}
+
+static struct disk_ra_stream *disk_readahead__stream(struct disk_readahead *ra,
+						     u64 pos)
+{
+	struct disk_ra_stream *s, *lru = &ra->streams[0];
+	int i;
+
+	for (i = 0; i < DISK_RA_STREAMS; i++) {
+		s = &ra->streams[i];
+		if (s->reads && s->next == pos)
+			return s;
+		if (s->used < lru->used)
+			lru = s;
+	}
+
+	*lru = (struct disk_ra_stream) { };
+	return lru;
+}
+
+void disk_readahead__read(struct disk_image *disk, struct disk_io *io)
+{
+	struct disk_readahead *ra = disk->readahead;
+	u64 pos = io->sector << SECTOR_SHIFT;
+	u64 end = pos + io->len;
+	struct disk_ra_stream *s;
+	u64 start = 0, len = 0;
+
+	if (end > disk->size)
+		return;
+
+	mutex_lock(&ra->lock);
+	s = disk_readahead__stream(ra, pos);
+	s->next = end;
+	s->used = ++ra->clock;
+	if (++s->reads < DISK_RA_SEQ_READS)
+		goto out;
+
+	if (s->ahead) {
+		if (end <= s->ahead)
+			__sync_fetch_and_add(&disk->stats.ra_hits, 1);
+		else
+			__sync_fetch_and_add(&disk->stats.ra_misses, 1);
+	}
+
+	/* Stay half a window ahead of the stream */
+	if (s->ahead >= end + s->window / 2)
+		goto out;
+
+	if (s->window)
+		s->window = min(s->window * 2, ra->max_window);
+	else
+		s->window = min_t(u64, DISK_RA_MIN_WINDOW, ra->max_window);
+
+	start = max(s->ahead, end);
+	if (start < disk->size)
+		len = min(s->window, disk->size - start);
+	s->ahead = start + len;
+out:
+	mutex_unlock(&ra->lock);
+
+	if (!len)
+		return;
+
+	/* Only a hint, the read itself doesn't depend on it */
+	if (disk->ops->readahead(disk, start, len) == 0)
+		__sync_fetch_and_add(&disk->stats.ra_bytes, len);
+}
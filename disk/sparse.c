@@ -0,0 +1,339 @@
+#include "kvm/disk-image.h"
+#include "kvm/rbtree-interval.h"
+#include "kvm/mutex.h"
+
+#include <linux/kernel.h>
+
+/*
+ * With the sparse option, reads of the holes of a raw image are answered
+ * with zeroes without asking the filesystem, and writes of zeroes keep the
+ * image sparse. What is known of the layout of the file is kept as extents
+ * of holes and of data, learnt with SEEK_DATA/SEEK_HOLE the first time a
+ * read starts in a range nothing is known about.
+ *
+ * Only holes must never be stale. Writes turn their range into data before
+ * they are issued, and lseek() answers that raced with a change of the tree
+ * are dropped, so a hole is only recorded where no write could have been
+ * in flight. For the same reason, a full tree sheds its holes first and
+ * then merges data extents over the unknown ranges between them.
+ */
+#define DISK_SPARSE_MAX_EXTENTS		4096
+/* Zero writes smaller or less aligned than this are written as they are */
+#define DISK_SPARSE_PUNCH_SIZE		4096
+
+struct disk_extent {
+	struct rb_int_node	node;
+	bool			hole;
+};
+
+struct disk_sparse {
+	struct mutex		lock;
+	struct rb_root		extents;
+	unsigned int		nr_extents;
+	/* Bumped on every change, for the lookups that dropped the lock */
+	u64			gen;
+	/* An extent couldn't be recorded, every request goes to the file */
+	bool			broken;
+};
+
+#define disk_extent(n)	container_of(n, struct disk_extent, node)
+
+static void disk_sparse__clear(struct disk_sparse *sp)
+{
+	struct rb_node *node;
+
+	while ((node = rb_first(&sp->extents))) {
+		rb_erase(node, &sp->extents);
+		free(disk_extent(rb_int(node)));
+	}
+
+	sp->nr_extents = 0;
+}
+
+static void disk_sparse__shrink(struct disk_sparse *sp)
+{
+	struct rb_node *node, *next;
+	struct disk_extent *ext;
+
+	for (node = rb_first(&sp->extents); node; node = next) {
+		next = rb_next(node);
+		ext = disk_extent(rb_int(node));
+		if (ext->hole) {
+			rb_erase(node, &sp->extents);
+			sp->nr_extents--;
+			free(ext);
+		}
+	}
+
+	if (sp->nr_extents <= DISK_SPARSE_MAX_EXTENTS / 2)
+		return;
+
+	/* Only data is left, make each pair of extents a single one */
+	for (node = rb_first(&sp->extents); node && (next = rb_next(node));
+	     node = rb_next(node)) {
+		ext = disk_extent(rb_int(next));
+		rb_int(node)->high = ext->node.high;
+		rb_erase(next, &sp->extents);
+		sp->nr_extents--;
+		free(ext);
+	}
+}
+
+static struct disk_extent *disk_sparse__insert(struct disk_sparse *sp,
+					       u64 start, u64 end, bool hole)
+{
+	struct disk_extent *ext;
+
+	if (sp->nr_extents == DISK_SPARSE_MAX_EXTENTS)
+		disk_sparse__shrink(sp);
+
+	ext = malloc(sizeof(*ext));
+	if (!ext) {
+		sp->broken = true;
+		return NULL;
+	}
+
+	ext->node = RB_INT_INIT(start, end);
+	ext->hole = hole;
+	if (rb_int_insert(&sp->extents, &ext->node) < 0) {
+		free(ext);
+		return NULL;
+	}
+
+	sp->nr_extents++;
+	return ext;
+}
+
+static void disk_sparse__remove(struct disk_sparse *sp, struct disk_extent *ext)
+{
+	rb_int_erase(&sp->extents, &ext->node);
+	sp->nr_extents--;
+	free(ext);
+}
+
+/* The first extent that ends after offset */
+static struct disk_extent *disk_sparse__next(struct disk_sparse *sp, u64 offset)
+{
+	struct rb_node *node = sp->extents.rb_node;
+	struct rb_int_node *cur, *next = NULL;
+
+	while (node) {
+		cur = rb_int(node);
+		if (cur->high > offset) {
+			next = cur;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	return next ? disk_extent(next) : NULL;
+}
+
+/* Forget what is known of [start, end), keeping what lies around it */
+static void disk_sparse__trim(struct disk_sparse *sp, u64 start, u64 end)
+{
+	struct disk_extent *ext;
+	u64 low, high;
+	bool hole;
+
+	sp->gen++;
+
+	while ((ext = disk_sparse__next(sp, start)) && ext->node.low < end) {
+		low = ext->node.low;
+		high = ext->node.high;
+		hole = ext->hole;
+		disk_sparse__remove(sp, ext);
+
+		if (low < start)
+			disk_sparse__insert(sp, low, start, hole);
+		if (high > end)
+			disk_sparse__insert(sp, end, high, hole);
+	}
+}
+
+/* Record [start, end) as data, merged with the data extents next to it */
+static void disk_sparse__fill(struct disk_sparse *sp, u64 start, u64 end)
+{
+	struct rb_int_node *node;
+
+	disk_sparse__trim(sp, start, end);
+
+	node = start ? rb_int_search_single(&sp->extents, start - 1) : NULL;
+	if (node && !disk_extent(node)->hole) {
+		start = node->low;
+		disk_sparse__remove(sp, disk_extent(node));
+	}
+
+	node = rb_int_search_single(&sp->extents, end);
+	if (node && !disk_extent(node)->hole) {
+		end = node->high;
+		disk_sparse__remove(sp, disk_extent(node));
+	}
+
+	disk_sparse__insert(sp, start, end, false);
+}
+
+/*
+ * The extent that offset is in, asking the filesystem if it isn't known
+ * yet. Called with the lock held, which is dropped around lseek().
+ */
+static struct disk_extent *disk_sparse__lookup(struct disk_image *disk,
+					       u64 offset)
+{
+	struct disk_sparse *sp = disk->sparse;
+	struct rb_int_node *node;
+	struct disk_extent *next;
+	bool hole = true;
+	u64 gen, end;
+	off_t pos;
+
+	if (sp->broken)
+		return NULL;
+
+	node = rb_int_search_single(&sp->extents, offset);
+	if (node)
+		return disk_extent(node);
+
+	gen = sp->gen;
+	mutex_unlock(&sp->lock);
+
+	pos = lseek(disk->fd, offset, SEEK_DATA);
+	if (pos < 0 && errno == ENXIO) {
+		end = disk->size;
+	} else if (pos < 0) {
+		end = offset;
+	} else if ((u64)pos > offset) {
+		end = pos;
+	} else {
+		hole = false;
+		pos = lseek(disk->fd, offset, SEEK_HOLE);
+		end = pos < 0 ? offset : (u64)pos;
+	}
+
+	mutex_lock(&sp->lock);
+
+	if (sp->gen != gen || end <= offset)
+		return NULL;
+
+	next = disk_sparse__next(sp, offset);
+	if (next && next->node.low < end)
+		end = next->node.low;
+
+	return disk_sparse__insert(sp, offset, end, hole);
+}
+
+static bool disk_sparse__is_hole(struct disk_image *disk, u64 offset, u64 len)
+{
+	struct disk_sparse *sp = disk->sparse;
+	struct disk_extent *ext;
+	bool hole;
+
+	mutex_lock(&sp->lock);
+	ext = disk_sparse__lookup(disk, offset);
+	hole = ext && ext->hole && ext->node.high >= offset + len;
+	mutex_unlock(&sp->lock);
+
+	return hole;
+}
+
+static bool disk_sparse__zeroes(const struct iovec *iov, int iovcount)
+{
+	const u8 *buf;
+	int i;
+
+	for (i = 0; i < iovcount; i++) {
+		buf = iov[i].iov_base;
+		if (!iov[i].iov_len)
+			continue;
+		if (buf[0] || memcmp(buf, buf + 1, iov[i].iov_len - 1))
+			return false;
+	}
+
+	return true;
+}
+
+/* Fill io with zeroes if it only covers a hole */
+bool disk_sparse__read(struct disk_image *disk, struct disk_io *io)
+{
+	int i;
+
+	if (!io->len ||
+	    !disk_sparse__is_hole(disk, io->sector << SECTOR_SHIFT, io->len))
+		return false;
+
+	for (i = 0; i < io->iovcount; i++)
+		memset(io->iov[i].iov_base, 0, io->iov[i].iov_len);
+
+	return true;
+}
+
+/*
+ * Zeroes written over a hole are dropped and zeroes written over data
+ * punch a hole instead. Other writes make their range data, they return
+ * false and are issued as usual.
+ */
+bool disk_sparse__write(struct disk_image *disk, struct disk_io *io)
+{
+	struct disk_sparse *sp = disk->sparse;
+	u64 offset = io->sector << SECTOR_SHIFT;
+
+	if (io->len && disk_sparse__zeroes(io->iov, io->iovcount)) {
+		if (disk_sparse__is_hole(disk, offset, io->len))
+			return true;
+
+		if (disk->ops->write_zeroes &&
+		    !(offset % DISK_SPARSE_PUNCH_SIZE) &&
+		    !(io->len % DISK_SPARSE_PUNCH_SIZE) &&
+		    disk->ops->write_zeroes(disk, io->sector,
+					    io->len >> SECTOR_SHIFT, true) == 0) {
+			disk_sparse__forget(disk, io->sector,
+					    io->len >> SECTOR_SHIFT);
+			return true;
+		}
+	}
+
+	mutex_lock(&sp->lock);
+	disk_sparse__fill(sp, offset, offset + io->len);
+	mutex_unlock(&sp->lock);
+
+	return false;
+}
+
+/* After a discard or write-zeroes, the range may or may not be a hole */
+void disk_sparse__forget(struct disk_image *disk, u64 sector, u64 nr_sectors)
+{
+	struct disk_sparse *sp = disk->sparse;
+
+	mutex_lock(&sp->lock);
+	disk_sparse__trim(sp, sector << SECTOR_SHIFT,
+			  (sector + nr_sectors) << SECTOR_SHIFT);
+	mutex_unlock(&sp->lock);
+}
+
+int disk_sparse__init(struct disk_image *disk)
+{
+	struct disk_sparse *sp;
+
+	sp = calloc(1, sizeof(*sp));
+	if (!sp)
+		return -ENOMEM;
+
+	mutex_init(&sp->lock);
+	sp->extents = (struct rb_root) RB_ROOT;
+	disk->sparse = sp;
+
+	return 0;
+}
+
+void disk_sparse__exit(struct disk_image *disk)
+{
+	struct disk_sparse *sp = disk->sparse;
+
+	if (!sp)
+		return;
+
+	disk_sparse__clear(sp);
+	free(sp);
+	disk->sparse = NULL;
+}
@@ -0,0 +1,252 @@
+#include "kvm/disk-image.h"
+#include "kvm/disk-stats.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/kvm.h"
+#include "kvm/metrics.h"
+
+#include <linux/kernel.h>
+#include <time.h>
+
+u64 disk_stats__now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int disk_stats__size(size_t len)
+{
+	unsigned int size = 0;
+
+	if (!len)
+		return 0;
+
+	for (len = (len - 1) >> 12; len && size < DISK_STATS_NR_SIZES - 1; len >>= 2)
+		size++;
+
+	return size;
+}
+
+static unsigned int disk_stats__bucket(u64 ns)
+{
+	unsigned int msb, bucket;
+
+	if (ns < DISK_STATS_SUB_BUCKETS)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	bucket = (msb - DISK_STATS_SUB_BITS + 1) * DISK_STATS_SUB_BUCKETS +
+		 ((ns >> (msb - DISK_STATS_SUB_BITS)) & (DISK_STATS_SUB_BUCKETS - 1));
+
+	return min_t(unsigned int, bucket, DISK_STATS_NR_BUCKETS - 1);
+}
+
+/* Lower bound of a bucket, in nanoseconds */
+u64 disk_stats__bucket_ns(unsigned int bucket)
+{
+	unsigned int msb;
+
+	if (bucket < DISK_STATS_SUB_BUCKETS)
+		return bucket;
+
+	msb = bucket / DISK_STATS_SUB_BUCKETS + DISK_STATS_SUB_BITS - 1;
+
+	return (u64)(DISK_STATS_SUB_BUCKETS + bucket % DISK_STATS_SUB_BUCKETS)
+		<< (msb - DISK_STATS_SUB_BITS);
+}
+
+/* Account a request of len bytes that was issued at start */
+void disk_stats__account(struct disk_stats *stats, int op, size_t len, u64 start)
+{
+	struct disk_stats_hist *hist;
+	u64 ns = disk_stats__now() - start;
+
+	hist = &stats->hist[op][op == DISK_STATS_FLUSH ? 0 : disk_stats__size(len)];
+
+	__sync_fetch_and_add(&hist->count, 1);
+	__sync_fetch_and_add(&stats->bytes[op], len);
+	__sync_fetch_and_add(&hist->total_ns, ns);
+	__sync_fetch_and_add(&hist->buckets[disk_stats__bucket(ns)], 1);
+}
+
+/* Upper bound of the bucket holding the pct-th percentile */
+u64 disk_stats__percentile(struct disk_stats_hist *hist, unsigned int pct)
+{
+	u64 seen = 0, target;
+	unsigned int i;
+
+	target = (hist->count * pct + 99) / 100;
+
+	for (i = 0; i < DISK_STATS_NR_BUCKETS - 1; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	return disk_stats__bucket_ns(i + 1);
+}
+
+const char *disk_stats__size_name(unsigned int size)
+{
+	static const char * const names[DISK_STATS_NR_SIZES] = {
+		"<=4K", "<=16K", "<=64K", "<=256K", ">256K",
+	};
+
+	return names[size];
+}
+
+static void disk_stats__handle_ipc(struct kvm *kvm, int fd, u32 type, u32 len,
+				   u8 *msg)
+{
+	struct disk_stats_msg *reply;
+	u32 nr = 0;
+	int i;
+
+	if (WARN_ON(type != KVM_IPC_DISK_STATS || len))
+		return;
+
+	reply = calloc(kvm->nr_disks, sizeof(*reply));
+	if (!reply)
+		return;
+
+	for (i = 0; i < kvm->nr_disks; i++) {
+		struct disk_image *disk = kvm->disks[i];
+
+		if (!disk || disk->wwpn || disk->vhost_user)
+			continue;
+
+		reply[nr].index = i;
+		reply[nr].stats = disk->stats;
+		nr++;
+	}
+
+	if (write_in_full(fd, &nr, sizeof(nr)) < 0 ||
+	    write_in_full(fd, reply, nr * sizeof(*reply)) < 0)
+		pr_warning("Failed sending disk stats");
+
+	free(reply);
+}
+
+static const char * const disk_stats_op_names[DISK_STATS_NR_OPS] = {
+	[DISK_STATS_READ]	= "read",
+	[DISK_STATS_WRITE]	= "write",
+	[DISK_STATS_FLUSH]	= "flush",
+};
+
+/* The requests of all sizes of an op */
+static void disk_stats__merge(struct disk_stats *stats, int op,
+			      struct disk_stats_hist *hist)
+{
+	unsigned int size, i;
+
+	memset(hist, 0, sizeof(*hist));
+	for (size = 0; size < DISK_STATS_NR_SIZES; size++) {
+		hist->count += stats->hist[op][size].count;
+		hist->total_ns += stats->hist[op][size].total_ns;
+		for (i = 0; i < DISK_STATS_NR_BUCKETS; i++)
+			hist->buckets[i] += stats->hist[op][size].buckets[i];
+	}
+}
+
+#define for_each_disk_op(kvm, i, op)					\
+	for (i = 0; i < (kvm)->nr_disks; i++)				\
+		if ((kvm)->disks[i] && !(kvm)->disks[i]->wwpn &&	\
+		    !(kvm)->disks[i]->vhost_user)			\
+			for (op = 0; op < DISK_STATS_NR_OPS; op++)
+
+static void disk_stats__collect_metrics(struct kvm *kvm, struct metrics *m)
+{
+	static const unsigned int pcts[] = { 50, 90, 99 };
+	struct disk_stats_hist hist;
+	unsigned int j;
+	int i, op;
+
+	metrics__family(m, "disk_requests_total", "counter",
+			"Requests completed by each disk");
+	for_each_disk_op(kvm, i, op) {
+		disk_stats__merge(&kvm->disks[i]->stats, op, &hist);
+		metrics__sample(m, hist.count, "disk=\"%d\",op=\"%s\"", i,
+				disk_stats_op_names[op]);
+	}
+
+	metrics__family(m, "disk_bytes_total", "counter",
+			"Bytes read or written by each disk");
+	for_each_disk_op(kvm, i, op) {
+		if (op != DISK_STATS_FLUSH)
+			metrics__sample(m, kvm->disks[i]->stats.bytes[op],
+					"disk=\"%d\",op=\"%s\"", i,
+					disk_stats_op_names[op]);
+	}
+
+	metrics__family(m, "disk_nowait_reads_total", "counter",
+			"Reads tried inline with RWF_NOWAIT, by outcome");
+	for (i = 0; i < kvm->nr_disks; i++) {
+		struct disk_image *disk = kvm->disks[i];
+
+		if (!disk || disk->wwpn || disk->vhost_user)
+			continue;
+		metrics__sample(m, disk->stats.nowait_hits,
+				"disk=\"%d\",result=\"hit\"", i);
+		metrics__sample(m, disk->stats.nowait_reads -
+				   disk->stats.nowait_hits,
+				"disk=\"%d\",result=\"miss\"", i);
+	}
+
+	metrics__family(m, "disk_readahead_reads_total", "counter",
+			"Reads of sequential streams, by whether they had been read ahead of");
+	for (i = 0; i < kvm->nr_disks; i++) {
+		struct disk_image *disk = kvm->disks[i];
+
+		if (!disk || disk->wwpn || disk->vhost_user)
+			continue;
+		metrics__sample(m, disk->stats.ra_hits,
+				"disk=\"%d\",result=\"hit\"", i);
+		metrics__sample(m, disk->stats.ra_misses,
+				"disk=\"%d\",result=\"miss\"", i);
+	}
+
+	metrics__family(m, "disk_readahead_bytes_total", "counter",
+			"Bytes read ahead of the sequential streams of reads");
+	for (i = 0; i < kvm->nr_disks; i++) {
+		struct disk_image *disk = kvm->disks[i];
+
+		if (!disk || disk->wwpn || disk->vhost_user)
+			continue;
+		metrics__sample(m, disk->stats.ra_bytes, "disk=\"%d\"", i);
+	}
+
+	metrics__family(m, "disk_latency_ns_total", "counter",
+			"Time taken by the requests of each disk");
+	for_each_disk_op(kvm, i, op) {
+		disk_stats__merge(&kvm->disks[i]->stats, op, &hist);
+		metrics__sample(m, hist.total_ns, "disk=\"%d\",op=\"%s\"", i,
+				disk_stats_op_names[op]);
+	}
+
+	metrics__family(m, "disk_latency_ns", "gauge",
+			"Latency percentiles of the requests of each disk");
+	for_each_disk_op(kvm, i, op) {
+		disk_stats__merge(&kvm->disks[i]->stats, op, &hist);
+		if (!hist.count)
+			continue;
+		for (j = 0; j < ARRAY_SIZE(pcts); j++)
+			metrics__sample(m, disk_stats__percentile(&hist, pcts[j]),
+					"disk=\"%d\",op=\"%s\",quantile=\"0.%u\"",
+					i, disk_stats_op_names[op], pcts[j]);
+	}
+}
+
+static struct metrics_collector disk_stats__metrics = {
+	.collect	= disk_stats__collect_metrics,
+};
+
+static int disk_stats__init(struct kvm *kvm)
+{
+	metrics__register(&disk_stats__metrics);
+
+	return kvm_ipc__register_handler(KVM_IPC_DISK_STATS,
+					 disk_stats__handle_ipc);
+}
+dev_base_init(disk_stats__init);
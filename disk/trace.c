@@ -0,0 +1,131 @@
+#include "kvm/disk-image.h"
+#include "kvm/disk-stats.h"
+#include "kvm/disk-trace.h"
+#include "kvm/mutex.h"
+#include "kvm/read-write.h"
+#include "kvm/util.h"
+
+#include <linux/kernel.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * Records of the requests to a disk, appended as they complete. They are
+ * buffered and written out a batch at a time, so that tracing costs a lock
+ * and a copy per request, plus a write() every DISK_TRACE_BATCH of them.
+ */
+#define DISK_TRACE_BATCH	256
+
+struct disk_trace {
+	struct mutex			lock;
+	int				fd;
+	u64				start;
+	/* The trace stops at the first write error */
+	bool				failed;
+	u64				dropped;
+	u32				nr;
+	struct disk_trace_record	records[DISK_TRACE_BATCH];
+};
+
+/* Called with trace->lock held */
+static void disk_trace__write(struct disk_trace *trace)
+{
+	if (!trace->nr)
+		return;
+
+	if (!trace->failed &&
+	    write_in_full(trace->fd, trace->records,
+			  trace->nr * sizeof(trace->records[0])) < 0) {
+		pr_warning("disk trace: write failed, stopping");
+		trace->failed = true;
+	}
+
+	if (trace->failed)
+		trace->dropped += trace->nr;
+	trace->nr = 0;
+}
+
+int disk_trace__open(struct disk_image *disk, const char *path)
+{
+	struct disk_trace_header header = {
+		.magic		= DISK_TRACE_MAGIC,
+		.version	= DISK_TRACE_VERSION,
+		.record_size	= sizeof(struct disk_trace_record),
+		.size		= disk->size,
+	};
+	struct disk_trace *trace;
+	int r;
+
+	trace = calloc(1, sizeof(*trace));
+	if (!trace)
+		return -ENOMEM;
+
+	trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace->fd < 0) {
+		r = -errno;
+		goto err_free;
+	}
+
+	if (write_in_full(trace->fd, &header, sizeof(header)) < 0) {
+		r = -errno;
+		goto err_close;
+	}
+
+	mutex_init(&trace->lock);
+	trace->start = disk_stats__now();
+	disk->trace = trace;
+
+	return 0;
+
+err_close:
+	close(trace->fd);
+err_free:
+	free(trace);
+	return r;
+}
+
+/* A request issued at start, by the disk_stats__now() clock, just completed */
+void disk_trace__record(struct disk_image *disk, int op, u64 sector, u32 len,
+			u64 start, u32 queue)
+{
+	struct disk_trace *trace = disk->trace;
+	u64 now = disk_stats__now();
+	struct disk_trace_record *rec;
+
+	mutex_lock(&trace->lock);
+	rec = &trace->records[trace->nr++];
+	*rec = (struct disk_trace_record) {
+		.issue		= start > trace->start ? start - trace->start : 0,
+		.complete	= now - trace->start,
+		.sector		= sector,
+		.len		= len,
+		.op		= op,
+		.queue		= queue,
+	};
+	if (trace->nr == DISK_TRACE_BATCH)
+		disk_trace__write(trace);
+	mutex_unlock(&trace->lock);
+}
+
+void disk_trace__close(struct disk_image *disk)
+{
+	struct disk_trace *trace = disk->trace;
+
+	if (!trace)
+		return;
+
+	mutex_lock(&trace->lock);
+	disk_trace__write(trace);
+	mutex_unlock(&trace->lock);
+
+	if (trace->dropped)
+		pr_warning("disk trace: %llu requests were not recorded",
+			   (unsigned long long)trace->dropped);
+	if (close(trace->fd) < 0)
+		pr_warning("disk trace: close failed");
+
+	free(trace);
+	disk->trace = NULL;
+}
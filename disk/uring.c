@@ -0,0 +1,861 @@
+#include <linux/err.h>
+#include <linux/io_uring.h>
+#include <linux/list.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "kvm/barrier.h"
+#include "kvm/disk-image.h"
+#include "kvm/host-numa.h"
+#include "kvm/iovec.h"
+#include "kvm/kvm.h"
+#include "kvm/mutex.h"
+
+#define URING_ENTRIES		1024
+/* How long the SQPOLL kernel thread spins before going to sleep */
+#define URING_SQ_IDLE_MS	50
+/* The kernel refuses registered buffers larger than 1GB */
+#define URING_MAX_BUF_SIZE	(1UL << 30)
+#define URING_MAX_BUFS		1024
+
+/*
+ * With --disk-engine=io_uring,shared, the disks backed by the same host
+ * device share one ring and its completion thread. Their requests are held
+ * per disk, and handed to the kernel in weighted fair order, no more than
+ * URING_SCHED_DEPTH at a time, so that a busy disk can't fill the queue of
+ * the device ahead of the others. Each disk is charged the bytes it moves
+ * over its weight, and the one charged least goes next.
+ */
+#define URING_SCHED_DEPTH	128
+/* What a request costs on top of its bytes, so that small ones aren't free */
+#define URING_SCHED_REQ_COST	4096
+
+struct disk_uring_member {
+	struct list_head	node;
+	struct disk_image	*disk;
+	struct list_head	pending;
+	u64			vtime;
+	/* Queued or submitted */
+	u64			inflight;
+};
+
+struct uring_req {
+	struct list_head	node;
+	struct disk_uring_member *member;
+	void			*param;
+	bool			write;
+	bool			flush;
+	u64			sector;
+	const struct iovec	*iov;
+	int			iovcount;
+	size_t			len;
+};
+
+struct uring_done {
+	struct uring_req	*req;
+	struct disk_uring_member *member;
+	long			res;
+};
+
+struct disk_uring {
+	int			fd;
+	struct disk_image	*disk;
+
+	struct mutex		sq_lock;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_flags;
+	unsigned int		*sq_array;
+	unsigned int		sq_mask;
+	unsigned int		sq_entries;
+	/* Local producer index, published to *sq_tail on submission */
+	unsigned int		sq_local_tail;
+	struct io_uring_sqe	*sqes;
+
+	struct mutex		cq_lock;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	size_t			sqes_size;
+
+	bool			sqpoll;
+	bool			fixed_file;
+	struct iovec		*bufs;
+	unsigned int		nr_bufs;
+
+	u64			inflight;
+	bool			stop;
+	pthread_t		thread;
+	/* Host node of the device the disks are on, where the thread runs */
+	int			numa_node;
+
+	/* Shared rings only, the scheduler is protected by sq_lock */
+	bool			shared;
+	dev_t			dev;
+	struct list_head	list;
+	int			refs;
+	struct list_head	members;
+	struct list_head	free_reqs;
+	u32			sched_inflight;
+	u64			vtime;
+};
+
+static LIST_HEAD(shared_rings);
+static DEFINE_MUTEX(shared_rings_lock);
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg,
+			     unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Push all prepared SQEs to the kernel. Called with sq_lock held.
+ */
+static int uring_submit_locked(struct disk_uring *ring)
+{
+	unsigned int to_submit;
+	int r;
+
+	to_submit = ring->sq_local_tail - *ring->sq_tail;
+	if (!to_submit)
+		return 0;
+
+	/* Make the SQEs visible before publishing the new tail */
+	wmb();
+	*ring->sq_tail = ring->sq_local_tail;
+
+	if (ring->sqpoll) {
+		/* Pairs with the kernel setting IORING_SQ_NEED_WAKEUP */
+		mb();
+		if (!(*ring->sq_flags & IORING_SQ_NEED_WAKEUP))
+			return 0;
+
+		r = io_uring_enter(ring->fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+		return r < 0 ? -errno : 0;
+	}
+
+	do {
+		r = io_uring_enter(ring->fd, to_submit, 0, 0);
+		if (r < 0 && errno != EAGAIN && errno != EBUSY && errno != EINTR)
+			return -errno;
+		if (r > 0)
+			to_submit -= r;
+	} while (to_submit);
+
+	return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct disk_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	while (ring->sq_local_tail - *ring->sq_head >= ring->sq_entries) {
+		/* Ring full: hand what we have over to the kernel */
+		uring_submit_locked(ring);
+		if (ring->sqpoll)
+			io_uring_enter(ring->fd, 0, 0, IORING_ENTER_SQ_WAIT);
+		/* Pairs with the kernel advancing sq_head */
+		rmb();
+	}
+
+	idx = ring->sq_local_tail & ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+	ring->sq_local_tail++;
+
+	return sqe;
+}
+
+static void uring_reap(struct disk_uring *ring)
+{
+	struct disk_image *disk = ring->disk;
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail;
+	u64 nr = 0;
+
+	mutex_lock(&ring->cq_lock);
+	head = *ring->cq_head;
+	tail = *ring->cq_tail;
+	/* Read the CQEs only after observing the tail */
+	rmb();
+
+	disk_image__batch_begin(disk);
+	for (; head != tail; head++) {
+		cqe = &ring->cqes[head & ring->cq_mask];
+		/* user_data == 0 is the wakeup NOP posted on teardown */
+		if (!cqe->user_data)
+			continue;
+		disk_image__complete(disk, (void *)(unsigned long)cqe->user_data,
+				     cqe->res);
+		nr++;
+	}
+
+	/* Release the CQEs back to the kernel once we're done with them */
+	mb();
+	*ring->cq_head = head;
+	mutex_unlock(&ring->cq_lock);
+
+	disk_image__batch_end(disk);
+
+	if (nr)
+		__sync_fetch_and_sub(&ring->inflight, nr);
+}
+
+static void uring_sched_dispatch(struct disk_uring *ring);
+
+/*
+ * Complete the requests of each disk in a batch of their own, the disks
+ * only hear about theirs, and refill the ring.
+ */
+static void uring_reap_shared(struct disk_uring *ring)
+{
+	struct uring_done done[URING_SCHED_DEPTH];
+	struct disk_uring_member *member;
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail;
+	int i, j, nr = 0;
+
+	mutex_lock(&ring->cq_lock);
+	head = *ring->cq_head;
+	tail = *ring->cq_tail;
+	/* Read the CQEs only after observing the tail */
+	rmb();
+
+	for (; head != tail && nr < (int)ARRAY_SIZE(done); head++) {
+		cqe = &ring->cqes[head & ring->cq_mask];
+		/* user_data == 0 is the wakeup NOP posted on teardown */
+		if (!cqe->user_data)
+			continue;
+		done[nr].req = (void *)(unsigned long)cqe->user_data;
+		done[nr].member = done[nr].req->member;
+		done[nr].res = cqe->res;
+		nr++;
+	}
+
+	mb();
+	*ring->cq_head = head;
+	mutex_unlock(&ring->cq_lock);
+
+	for (i = 0; i < nr; i++) {
+		member = done[i].member;
+		if (!member)
+			continue;
+
+		disk_image__batch_begin(member->disk);
+		for (j = i; j < nr; j++) {
+			if (done[j].member != member)
+				continue;
+			disk_image__complete(member->disk, done[j].req->param,
+					     done[j].res);
+			done[j].member = NULL;
+		}
+		disk_image__batch_end(member->disk);
+	}
+
+	if (!nr)
+		return;
+
+	mutex_lock(&ring->sq_lock);
+	for (i = 0; i < nr; i++) {
+		done[i].req->member->inflight--;
+		list_add(&done[i].req->node, &ring->free_reqs);
+	}
+	ring->sched_inflight -= nr;
+	uring_sched_dispatch(ring);
+	uring_submit_locked(ring);
+	mutex_unlock(&ring->sq_lock);
+}
+
+static void *disk_uring_thread(void *param)
+{
+	struct disk_uring *ring = param;
+
+	kvm__set_thread_name("disk-uring-io");
+	host_numa__bind_thread(ring->numa_node);
+
+	while (!ring->stop) {
+		if (io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR)
+			break;
+		if (ring->shared)
+			uring_reap_shared(ring);
+		else
+			uring_reap(ring);
+	}
+
+	return NULL;
+}
+
+/*
+ * Use a registered guest RAM buffer when the whole request is one contiguous
+ * chunk of it, so the kernel can skip pinning pages on every request.
+ */
+static int uring_find_buf(struct disk_uring *ring, const struct iovec *iov,
+			  int iovcount)
+{
+	unsigned int i;
+	void *base;
+
+	if (iovcount != 1)
+		return -1;
+
+	for (i = 0; i < ring->nr_bufs; i++) {
+		base = ring->bufs[i].iov_base;
+		if (iov->iov_base >= base &&
+		    iov->iov_base + iov->iov_len <= base + ring->bufs[i].iov_len)
+			return i;
+	}
+
+	return -1;
+}
+
+static void uring_prep_fd(struct disk_uring *ring, struct disk_image *disk,
+			  struct io_uring_sqe *sqe)
+{
+	if (ring->fixed_file) {
+		sqe->fd		= 0;
+		sqe->flags	= IOSQE_FIXED_FILE;
+	} else {
+		sqe->fd		= disk->fd;
+	}
+}
+
+/* Called with sq_lock held */
+static void uring_prep_rw(struct disk_uring *ring, struct disk_image *disk,
+			  bool write, u64 sector, const struct iovec *iov,
+			  int iovcount, void *param)
+{
+	struct io_uring_sqe *sqe;
+	int buf;
+
+	sqe = uring_get_sqe(ring);
+
+	buf = uring_find_buf(ring, iov, iovcount);
+	if (buf >= 0) {
+		sqe->opcode	= write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr	= (unsigned long)iov->iov_base;
+		sqe->len	= iov->iov_len;
+		sqe->buf_index	= buf;
+	} else {
+		sqe->opcode	= write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr	= (unsigned long)iov;
+		sqe->len	= iovcount;
+	}
+
+	uring_prep_fd(ring, disk, sqe);
+	sqe->off	= sector << SECTOR_SHIFT;
+	sqe->user_data	= (unsigned long)param;
+}
+
+/*
+ * Called with sq_lock held. Like fdatasync(), it covers the writes that
+ * completed before it, and isn't held back by those still in flight.
+ */
+static void uring_prep_fsync(struct disk_uring *ring, struct disk_image *disk,
+			     void *param)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ring);
+	sqe->opcode	= IORING_OP_FSYNC;
+	sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	uring_prep_fd(ring, disk, sqe);
+	sqe->user_data	= (unsigned long)param;
+}
+
+/* Called with sq_lock held */
+static void uring_sched_dispatch(struct disk_uring *ring)
+{
+	struct disk_uring_member *member, *next;
+	struct uring_req *req;
+	u32 weight;
+
+	while (ring->sched_inflight < URING_SCHED_DEPTH) {
+		next = NULL;
+		list_for_each_entry(member, &ring->members, node) {
+			if (!list_empty(&member->pending) &&
+			    (!next || member->vtime < next->vtime))
+				next = member;
+		}
+		if (!next)
+			break;
+
+		req = list_first_entry(&next->pending, struct uring_req, node);
+		list_del(&req->node);
+
+		weight = next->disk->weight ?: DISK_WEIGHT_DEFAULT;
+		ring->vtime = next->vtime;
+		next->vtime += (req->len + URING_SCHED_REQ_COST) *
+			       DISK_WEIGHT_DEFAULT / weight;
+		ring->sched_inflight++;
+
+		if (req->flush)
+			uring_prep_fsync(ring, next->disk, req);
+		else
+			uring_prep_rw(ring, next->disk, req->write, req->sector,
+				      req->iov, req->iovcount, req);
+	}
+}
+
+static ssize_t uring_sched_queue(struct disk_image *disk, bool write,
+				 bool flush, u64 sector,
+				 const struct iovec *iov, int iovcount,
+				 void *param)
+{
+	struct disk_uring_member *member = disk->uring_member;
+	struct disk_uring *ring = disk->uring;
+	struct uring_req *req;
+
+	mutex_lock(&ring->sq_lock);
+	req = list_first_entry_or_null(&ring->free_reqs, struct uring_req,
+				       node);
+	if (req) {
+		list_del(&req->node);
+	} else {
+		req = malloc(sizeof(*req));
+		if (!req) {
+			mutex_unlock(&ring->sq_lock);
+			return -ENOMEM;
+		}
+	}
+
+	*req = (struct uring_req) {
+		.member		= member,
+		.param		= param,
+		.write		= write,
+		.flush		= flush,
+		.sector		= sector,
+		.iov		= iov,
+		.iovcount	= iovcount,
+		.len		= flush ? 0 : iov_size(iov, iovcount),
+	};
+
+	/* A disk that was idle doesn't get to make up for it */
+	if (!member->inflight)
+		member->vtime = max(member->vtime, ring->vtime);
+
+	list_add_tail(&req->node, &member->pending);
+	member->inflight++;
+	mutex_unlock(&ring->sq_lock);
+
+	return 0;
+}
+
+static ssize_t uring_queue_rw(struct disk_image *disk, bool write, u64 sector,
+			      const struct iovec *iov, int iovcount,
+			      void *param)
+{
+	struct disk_uring *ring = disk->uring;
+
+	if (ring->shared)
+		return uring_sched_queue(disk, write, false, sector, iov,
+					 iovcount, param);
+
+	mutex_lock(&ring->sq_lock);
+	uring_prep_rw(ring, disk, write, sector, iov, iovcount, param);
+	__sync_fetch_and_add(&ring->inflight, 1);
+	mutex_unlock(&ring->sq_lock);
+
+	return 0;
+}
+
+ssize_t raw_image__read_uring(struct disk_image *disk, u64 sector,
+			      const struct iovec *iov, int iovcount,
+			      void *param)
+{
+	ssize_t r;
+
+	r = raw_image__read_nowait(disk, sector, iov, iovcount);
+	if (r >= 0) {
+		disk_image__complete(disk, param, r);
+		return r;
+	}
+
+	return uring_queue_rw(disk, false, sector, iov, iovcount, param);
+}
+
+ssize_t raw_image__write_uring(struct disk_image *disk, u64 sector,
+			       const struct iovec *iov, int iovcount,
+			       void *param)
+{
+	return uring_queue_rw(disk, true, sector, iov, iovcount, param);
+}
+
+int raw_image__flush_uring(struct disk_image *disk, void *param)
+{
+	struct disk_uring *ring = disk->uring;
+
+	if (ring->shared)
+		return uring_sched_queue(disk, true, true, 0, NULL, 0, param);
+
+	mutex_lock(&ring->sq_lock);
+	uring_prep_fsync(ring, disk, param);
+	__sync_fetch_and_add(&ring->inflight, 1);
+	mutex_unlock(&ring->sq_lock);
+
+	return 0;
+}
+
+/*
+ * Requests are only queued by the read, write and flush handlers. The caller
+ * (the virtio-blk queue worker) submits them all at once at the end of a kick.
+ */
+int raw_image__submit_uring(struct disk_image *disk)
+{
+	struct disk_uring *ring = disk->uring;
+	int r;
+
+	mutex_lock(&ring->sq_lock);
+	if (ring->shared)
+		uring_sched_dispatch(ring);
+	r = uring_submit_locked(ring);
+	mutex_unlock(&ring->sq_lock);
+
+	return r;
+}
+
+int raw_image__wait_uring(struct disk_image *disk)
+{
+	struct disk_uring *ring = disk->uring;
+	/* Other disks sharing the ring needn't be waited for */
+	u64 *counter = ring->shared ? &disk->uring_member->inflight :
+				      &ring->inflight;
+	u64 inflight = *counter;
+
+	raw_image__submit_uring(disk);
+
+	while (*counter) {
+		usleep(100);
+		barrier();
+	}
+
+	return inflight;
+}
+
+static int uring_add_ram_bank(struct kvm *kvm, struct kvm_mem_bank *bank,
+			      void *data)
+{
+	struct disk_uring *ring = data;
+	u64 offset, size;
+
+	for (offset = 0; offset < bank->size; offset += size) {
+		if (ring->nr_bufs == URING_MAX_BUFS)
+			return -ENOSPC;
+
+		size = min_t(u64, bank->size - offset, URING_MAX_BUF_SIZE);
+		ring->bufs[ring->nr_bufs++] = (struct iovec) {
+			.iov_base	= bank->host_addr + offset,
+			.iov_len	= size,
+		};
+	}
+
+	return 0;
+}
+
+/*
+ * Registering guest RAM pins it in host memory, so it's only done on request
+ * (--disk-engine=io_uring,fixedbufs).
+ */
+void disk_uring_register_ram(struct disk_image *disk, struct kvm *kvm)
+{
+	struct disk_uring *ring = disk->uring;
+
+	/* A shared ring only needs it once */
+	if (!ring || !(disk_engine_flags & DISK_ENGINE_F_FIXEDBUFS) ||
+	    ring->bufs)
+		return;
+
+	ring->bufs = calloc(URING_MAX_BUFS, sizeof(*ring->bufs));
+	if (!ring->bufs)
+		return;
+
+	if (kvm__for_each_mem_bank(kvm, KVM_MEM_TYPE_RAM, uring_add_ram_bank,
+				   ring) ||
+	    io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, ring->bufs,
+			      ring->nr_bufs) < 0) {
+		pr_warning("io_uring: unable to register guest RAM buffers");
+		free(ring->bufs);
+		ring->bufs = NULL;
+		ring->nr_bufs = 0;
+	}
+}
+
+static int uring_map_rings(struct disk_uring *ring, struct io_uring_params *p)
+{
+	ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(u32);
+	ring->cq_ring_size = p->cq_off.cqes +
+			     p->cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_ring_size = max(ring->sq_ring_size, ring->cq_ring_size);
+		ring->cq_ring_size = 0;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_RW,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		return -errno;
+
+	if (ring->cq_ring_size) {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_RW,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto err_unmap_sq;
+	} else {
+		ring->cq_ring = ring->sq_ring;
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_RW,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err_unmap_cq;
+
+	ring->sq_head	= ring->sq_ring + p->sq_off.head;
+	ring->sq_tail	= ring->sq_ring + p->sq_off.tail;
+	ring->sq_flags	= ring->sq_ring + p->sq_off.flags;
+	ring->sq_array	= ring->sq_ring + p->sq_off.array;
+	ring->sq_mask	= *(u32 *)(ring->sq_ring + p->sq_off.ring_mask);
+	ring->sq_entries = *(u32 *)(ring->sq_ring + p->sq_off.ring_entries);
+	ring->sq_local_tail = *ring->sq_tail;
+
+	ring->cq_head	= ring->cq_ring + p->cq_off.head;
+	ring->cq_tail	= ring->cq_ring + p->cq_off.tail;
+	ring->cq_mask	= *(u32 *)(ring->cq_ring + p->cq_off.ring_mask);
+	ring->cqes	= ring->cq_ring + p->cq_off.cqes;
+
+	return 0;
+
+err_unmap_cq:
+	if (ring->cq_ring_size)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+err_unmap_sq:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	return -ENOMEM;
+}
+
+static void uring_unmap_rings(struct disk_uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring_size)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+/* A ring of its own for disk, or one that disks will join when it's NULL */
+static struct disk_uring *uring_new(struct disk_image *disk, int numa_node)
+{
+	struct io_uring_params p = {};
+	struct disk_uring *ring;
+	int r;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return ERR_PTR(-ENOMEM);
+
+	if (disk_engine_flags & DISK_ENGINE_F_SQPOLL) {
+		p.flags = IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = URING_SQ_IDLE_MS;
+	}
+
+	ring->fd = io_uring_setup(URING_ENTRIES, &p);
+	if (ring->fd < 0 && (p.flags & IORING_SETUP_SQPOLL)) {
+		pr_warning("io_uring: SQPOLL unavailable, using regular submission");
+		p = (struct io_uring_params) {};
+		ring->fd = io_uring_setup(URING_ENTRIES, &p);
+	}
+	if (ring->fd < 0) {
+		r = -errno;
+		goto err_free;
+	}
+
+	ring->disk = disk;
+	ring->shared = !disk;
+	ring->numa_node = numa_node;
+	ring->sqpoll = p.flags & IORING_SETUP_SQPOLL;
+	mutex_init(&ring->sq_lock);
+	mutex_init(&ring->cq_lock);
+	INIT_LIST_HEAD(&ring->members);
+	INIT_LIST_HEAD(&ring->free_reqs);
+
+	r = uring_map_rings(ring, &p);
+	if (r)
+		goto err_close;
+
+	/* The files of a shared ring come and go with its disks */
+	if (disk)
+		ring->fixed_file = io_uring_register(ring->fd,
+						     IORING_REGISTER_FILES,
+						     &disk->fd, 1) == 0;
+
+	r = kvm__start_device_thread(&ring->thread, disk_uring_thread, ring);
+	if (r) {
+		r = -r;
+		goto err_unmap;
+	}
+
+	return ring;
+
+err_unmap:
+	uring_unmap_rings(ring);
+err_close:
+	close(ring->fd);
+err_free:
+	free(ring);
+	return ERR_PTR(r);
+}
+
+static void uring_free(struct disk_uring *ring)
+{
+	struct uring_req *req, *tmp;
+	struct io_uring_sqe *sqe;
+
+	/* Kick the completion thread out of io_uring_enter() */
+	mutex_lock(&ring->sq_lock);
+	ring->stop = true;
+	sqe = uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_NOP;
+	uring_submit_locked(ring);
+	mutex_unlock(&ring->sq_lock);
+
+	pthread_join(ring->thread, NULL);
+
+	list_for_each_entry_safe(req, tmp, &ring->free_reqs, node)
+		free(req);
+
+	uring_unmap_rings(ring);
+	close(ring->fd);
+	free(ring->bufs);
+	free(ring);
+}
+
+/* Files on the same filesystem share its device */
+static int uring_join_shared(struct disk_image *disk)
+{
+	struct disk_uring_member *member;
+	struct disk_uring *ring;
+	struct stat st;
+	dev_t dev;
+
+	if (fstat(disk->fd, &st) < 0)
+		return -errno;
+	dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+
+	member = calloc(1, sizeof(*member));
+	if (!member)
+		return -ENOMEM;
+
+	member->disk = disk;
+	INIT_LIST_HEAD(&member->pending);
+
+	mutex_lock(&shared_rings_lock);
+	list_for_each_entry(ring, &shared_rings, list) {
+		if (ring->dev == dev)
+			goto join;
+	}
+
+	/* A shared ring only has disks on the same device */
+	ring = uring_new(NULL, host_numa__blkdev_node(dev));
+	if (IS_ERR(ring)) {
+		mutex_unlock(&shared_rings_lock);
+		free(member);
+		return PTR_ERR(ring);
+	}
+	ring->dev = dev;
+	list_add_tail(&ring->list, &shared_rings);
+
+join:
+	mutex_lock(&ring->sq_lock);
+	list_add_tail(&member->node, &ring->members);
+	ring->refs++;
+	mutex_unlock(&ring->sq_lock);
+	mutex_unlock(&shared_rings_lock);
+
+	disk->uring = ring;
+	disk->uring_member = member;
+	disk->async = true;
+	return 0;
+}
+
+static void uring_leave_shared(struct disk_image *disk)
+{
+	struct disk_uring_member *member = disk->uring_member;
+	struct disk_uring *ring = disk->uring;
+	bool last;
+
+	/* The completion thread still has to hear about those */
+	raw_image__wait_uring(disk);
+
+	mutex_lock(&shared_rings_lock);
+	mutex_lock(&ring->sq_lock);
+	list_del(&member->node);
+	last = !--ring->refs;
+	mutex_unlock(&ring->sq_lock);
+	if (last)
+		list_del(&ring->list);
+	mutex_unlock(&shared_rings_lock);
+
+	if (last)
+		uring_free(ring);
+	free(member);
+}
+
+int disk_uring_setup(struct disk_image *disk)
+{
+	struct disk_uring *ring;
+
+	if (!disk->ops->async)
+		return 0;
+
+	if (disk_engine_flags & DISK_ENGINE_F_SHARED)
+		return uring_join_shared(disk);
+
+	ring = uring_new(disk, disk->numa_node);
+	if (IS_ERR(ring))
+		return PTR_ERR(ring);
+
+	disk->uring = ring;
+	disk->async = true;
+	return 0;
+}
+
+void disk_uring_destroy(struct disk_image *disk)
+{
+	struct disk_uring *ring = disk->uring;
+
+	if (!ring)
+		return;
+
+	if (ring->shared)
+		uring_leave_shared(disk);
+	else
+		uring_free(ring);
+
+	disk->uring = NULL;
+	disk->uring_member = NULL;
+}
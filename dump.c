@@ -0,0 +1,760 @@
+#include "kvm/dump.h"
+#include "kvm/dirty-log.h"
+#include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/mutex.h"
+#include "kvm/read-write.h"
+#include "kvm/util.h"
+
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/procfs.h>
+#include <unistd.h>
+#ifdef CONFIG_HAS_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+ * An ELF core of guest RAM, with a PT_LOAD segment for each RAM bank at its
+ * guest physical address, and an NT_PRSTATUS note for each vCPU. The zero
+ * pages are left as holes in the file, the others are written straight from
+ * guest memory with O_DIRECT, a chunk at a time by each thread.
+ *
+ * Compressed, the same file is a gzip stream, of a member for each chunk
+ * that the threads deflate in parallel and that are written in order.
+ */
+#define DUMP_ALIGN		4096
+#define DUMP_CHUNK		(4UL << 20)
+/* How far ahead of the writer the threads may compress, in chunks each */
+#define DUMP_WINDOW		2
+#define DUMP_WBUF_SIZE		(8UL << 20)
+/* Level 1: disks take it faster than the others compress */
+#define DUMP_ZLIB_LEVEL		1
+
+/*
+ * Pre-copy rounds of a live dump, until this few pages are left for the
+ * pass with the guest paused.
+ */
+#define DUMP_LIVE_MAX_ROUNDS	8
+#define DUMP_LIVE_DIRTY_PAGES	16384
+
+#if defined(__x86_64__)
+#define DUMP_ELF_MACHINE	EM_X86_64
+#elif defined(__aarch64__)
+#define DUMP_ELF_MACHINE	EM_AARCH64
+#elif defined(__riscv)
+#define DUMP_ELF_MACHINE	EM_RISCV
+#elif defined(__powerpc64__)
+#define DUMP_ELF_MACHINE	EM_PPC64
+#else
+#define DUMP_ELF_MACHINE	EM_NONE
+#endif
+
+struct dump_chunk {
+	void		*host;
+	/* In the core */
+	u64		offset;
+	u64		size;
+#ifdef CONFIG_HAS_ZLIB
+	void		*zbuf;
+	size_t		zlen;
+	bool		done;
+#endif
+};
+
+struct dump {
+	struct kvm		*kvm;
+	int			fd;
+	bool			direct;
+	long			page_size;
+	u32			threads;
+
+	struct dump_chunk	*chunks;
+	u32			nr_chunks;
+	u32			nr_banks;
+	u64			size;
+
+	/* ELF header, program headers and notes, padded to DUMP_ALIGN */
+	void			*header;
+	size_t			header_size;
+	size_t			notes_offset;
+	size_t			notes_size;
+
+	/* The pages to write again, NULL for all of those that aren't zero */
+	unsigned long		*bitmap;
+	u32			next;
+	int			err;
+	u64			zero_bytes;
+	u64			written_bytes;
+
+#ifdef CONFIG_HAS_ZLIB
+	struct mutex		lock;
+	pthread_cond_t		cond;
+	u32			written;
+	/* The member of a chunk of zeroes, deflated once */
+	void			*zero_zbuf;
+	size_t			zero_zlen;
+#endif
+};
+
+static bool dump__page_is_zero(const void *page, long size)
+{
+	const u64 *p = page;
+	long i;
+
+	for (i = 0; i < size / (long)sizeof(*p); i++)
+		if (p[i])
+			return false;
+
+	return true;
+}
+
+static size_t dump__note_size(void)
+{
+	return sizeof(Elf64_Nhdr) + ALIGN(sizeof("CORE"), 4) +
+	       ALIGN(sizeof(struct elf_prstatus), 4);
+}
+
+/* Where everything goes, leaving room for the notes of all vCPUs */
+static int dump__layout(struct dump *d)
+{
+	struct kvm *kvm = d->kvm;
+	struct kvm_mem_bank *bank;
+	u64 offset, size;
+	u32 n = 0;
+
+	d->nr_banks = d->nr_chunks = 0;
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		if (bank->type != KVM_MEM_TYPE_RAM)
+			continue;
+		d->nr_banks++;
+		d->nr_chunks += DIV_ROUND_UP(bank->size, DUMP_CHUNK);
+	}
+
+	d->notes_offset = sizeof(Elf64_Ehdr) +
+			  (1 + d->nr_banks) * sizeof(Elf64_Phdr);
+	d->header_size = ALIGN(d->notes_offset + kvm->nrcpus * dump__note_size(),
+			       DUMP_ALIGN);
+
+	d->chunks = calloc(d->nr_chunks, sizeof(*d->chunks));
+	if (posix_memalign(&d->header, DUMP_ALIGN, d->header_size))
+		d->header = NULL;
+	if (!d->chunks || !d->header)
+		return -ENOMEM;
+	memset(d->header, 0, d->header_size);
+
+	offset = d->header_size;
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		if (bank->type != KVM_MEM_TYPE_RAM)
+			continue;
+		for (size = 0; size < bank->size; size += DUMP_CHUNK) {
+			d->chunks[n++] = (struct dump_chunk) {
+				.host	= bank->host_addr + size,
+				.offset	= offset + size,
+				.size	= min_t(u64, bank->size - size, DUMP_CHUNK),
+			};
+		}
+		offset += bank->size;
+	}
+	d->size = offset;
+
+	return 0;
+}
+
+/* With the guest paused, at the point in time the core is of */
+static void dump__fill_notes(struct dump *d)
+{
+	void *p = d->header + d->notes_offset;
+	struct elf_prstatus prs;
+	Elf64_Nhdr *nhdr;
+	int i;
+
+	for (i = 0; i < d->kvm->nrcpus; i++) {
+		memset(&prs, 0, sizeof(prs));
+		prs.pr_pid = i + 1;
+		if (kvm_cpu__get_prstatus(d->kvm->cpus[i], &prs) < 0)
+			continue;
+
+		nhdr = p;
+		*nhdr = (Elf64_Nhdr) {
+			.n_namesz	= sizeof("CORE"),
+			.n_descsz	= sizeof(prs),
+			.n_type		= NT_PRSTATUS,
+		};
+		p += sizeof(*nhdr);
+		memcpy(p, "CORE", sizeof("CORE"));
+		p += ALIGN(sizeof("CORE"), 4);
+		memcpy(p, &prs, sizeof(prs));
+		p += ALIGN(sizeof(prs), 4);
+	}
+
+	d->notes_size = p - (d->header + d->notes_offset);
+}
+
+static void dump__fill_header(struct dump *d)
+{
+	Elf64_Ehdr *ehdr = d->header;
+	Elf64_Phdr *phdr = (void *)(ehdr + 1);
+	struct kvm_mem_bank *bank;
+	u64 offset = d->header_size;
+
+	*ehdr = (Elf64_Ehdr) {
+		.e_ident	= {
+			ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3,
+			ELFCLASS64,
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			ELFDATA2MSB,
+#else
+			ELFDATA2LSB,
+#endif
+			EV_CURRENT,
+		},
+		.e_type		= ET_CORE,
+		.e_machine	= DUMP_ELF_MACHINE,
+		.e_version	= EV_CURRENT,
+		.e_phoff	= sizeof(*ehdr),
+		.e_ehsize	= sizeof(*ehdr),
+		.e_phentsize	= sizeof(*phdr),
+		.e_phnum	= 1 + d->nr_banks,
+	};
+
+	*phdr++ = (Elf64_Phdr) {
+		.p_type		= PT_NOTE,
+		.p_offset	= d->notes_offset,
+		.p_filesz	= d->notes_size,
+		.p_align	= 4,
+	};
+
+	list_for_each_entry(bank, &d->kvm->mem_banks, list) {
+		if (bank->type != KVM_MEM_TYPE_RAM)
+			continue;
+		*phdr++ = (Elf64_Phdr) {
+			.p_type		= PT_LOAD,
+			.p_flags	= PF_R | PF_W | PF_X,
+			.p_offset	= offset,
+			.p_paddr	= bank->guest_phys_addr,
+			.p_filesz	= bank->size,
+			.p_memsz	= bank->size,
+			.p_align	= d->page_size,
+		};
+		offset += bank->size;
+	}
+}
+
+/* Filesystems that don't do O_DIRECT may only tell on the first write */
+static int dump__pwrite(struct dump *d, const void *buf, size_t len, u64 offset)
+{
+	if (pwrite_in_full(d->fd, buf, len, offset) >= 0)
+		return 0;
+
+	if (errno != EINVAL || !d->direct)
+		return -errno;
+
+	d->direct = false;
+	if (fcntl(d->fd, F_SETFL, fcntl(d->fd, F_GETFL) & ~O_DIRECT) < 0 ||
+	    pwrite_in_full(d->fd, buf, len, offset) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* The pages of the chunk to write, by runs of them */
+static int dump__write_chunk(struct dump *d, struct dump_chunk *c)
+{
+	u64 page = (c->host - d->kvm->ram_start) / d->page_size;
+	u64 i, first = 0, nr = 0, nr_pages = c->size / d->page_size;
+	u64 zero = 0, written = 0;
+	bool write;
+	int r = 0;
+
+	for (i = 0; i <= nr_pages && !r; i++) {
+		write = false;
+		if (i < nr_pages && d->bitmap) {
+			write = test_bit(page + i, d->bitmap);
+		} else if (i < nr_pages) {
+			write = !dump__page_is_zero(c->host + i * d->page_size,
+						    d->page_size);
+			if (!write)
+				zero += d->page_size;
+		}
+
+		if (write) {
+			if (!nr++)
+				first = i;
+			continue;
+		}
+
+		if (nr) {
+			r = dump__pwrite(d, c->host + first * d->page_size,
+					 nr * d->page_size,
+					 c->offset + first * d->page_size);
+			written += nr * d->page_size;
+			nr = 0;
+		}
+	}
+
+	__atomic_add_fetch(&d->zero_bytes, zero, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&d->written_bytes, written, __ATOMIC_RELAXED);
+
+	return r;
+}
+
+static void *dump__write_thread(void *arg)
+{
+	struct dump *d = arg;
+	u32 i;
+	int r;
+
+	kvm__set_thread_name("kvm-dump");
+
+	while (!__atomic_load_n(&d->err, __ATOMIC_RELAXED)) {
+		i = __atomic_fetch_add(&d->next, 1, __ATOMIC_RELAXED);
+		if (i >= d->nr_chunks)
+			break;
+
+		r = dump__write_chunk(d, &d->chunks[i]);
+		if (r < 0)
+			__atomic_store_n(&d->err, r, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+/* Have the threads go through all the chunks, with fn */
+static int dump__pass(struct dump *d, void *(*fn)(void *),
+		      void (*wait)(struct dump *))
+{
+	pthread_t threads[DUMP_MAX_THREADS];
+	u32 i, nr;
+	int r;
+
+	d->next = 0;
+	d->err = 0;
+
+	for (nr = 0; nr < d->threads; nr++) {
+		r = pthread_create(&threads[nr], NULL, fn, d);
+		if (r) {
+			d->err = -r;
+			break;
+		}
+	}
+
+	if (nr && wait)
+		wait(d);
+
+	for (i = 0; i < nr; i++)
+		pthread_join(threads[i], NULL);
+
+	return d->err;
+}
+
+#ifdef CONFIG_HAS_ZLIB
+/* A gzip member of its own, so that they can be concatenated */
+static int dump__deflate(const void *src, size_t len, void **out,
+			 size_t *out_len)
+{
+	z_stream zs = {};
+	void *buf;
+	int r;
+
+	if (deflateInit2(&zs, DUMP_ZLIB_LEVEL, Z_DEFLATED, 15 + 16, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK)
+		return -ENOMEM;
+
+	zs.avail_out = deflateBound(&zs, len);
+	buf = malloc(zs.avail_out);
+	if (!buf) {
+		deflateEnd(&zs);
+		return -ENOMEM;
+	}
+
+	zs.next_in = (void *)src;
+	zs.avail_in = len;
+	zs.next_out = buf;
+	r = deflate(&zs, Z_FINISH);
+	*out_len = zs.total_out;
+	deflateEnd(&zs);
+
+	if (r != Z_STREAM_END) {
+		free(buf);
+		return -EIO;
+	}
+
+	*out = buf;
+	return 0;
+}
+
+static int dump__compress_chunk(struct dump *d, struct dump_chunk *c)
+{
+	u64 i, zero = 0, nr_pages = c->size / d->page_size;
+
+	for (i = 0; i < nr_pages; i++)
+		if (dump__page_is_zero(c->host + i * d->page_size,
+				       d->page_size))
+			zero += d->page_size;
+
+	__atomic_add_fetch(&d->zero_bytes, zero, __ATOMIC_RELAXED);
+
+	/* Chunks of zeroes all share the same member */
+	if (zero == DUMP_CHUNK && d->zero_zbuf) {
+		c->zbuf = d->zero_zbuf;
+		c->zlen = d->zero_zlen;
+		return 0;
+	}
+
+	return dump__deflate(c->host, c->size, &c->zbuf, &c->zlen);
+}
+
+static void *dump__compress_thread(void *arg)
+{
+	struct dump *d = arg;
+	struct dump_chunk *c;
+	u32 i;
+	int r;
+
+	kvm__set_thread_name("kvm-dump");
+
+	for (;;) {
+		mutex_lock(&d->lock);
+		while (!d->err && d->next < d->nr_chunks &&
+		       d->next >= d->written + DUMP_WINDOW * d->threads)
+			pthread_cond_wait(&d->cond, &d->lock.mutex);
+		if (d->err || d->next >= d->nr_chunks) {
+			mutex_unlock(&d->lock);
+			break;
+		}
+		i = d->next++;
+		mutex_unlock(&d->lock);
+
+		c = &d->chunks[i];
+		r = dump__compress_chunk(d, c);
+
+		mutex_lock(&d->lock);
+		if (r < 0)
+			d->err = r;
+		c->done = true;
+		pthread_cond_broadcast(&d->cond);
+		mutex_unlock(&d->lock);
+	}
+
+	return NULL;
+}
+
+struct dump_wbuf {
+	void	*buf;
+	size_t	len;
+};
+
+/* O_DIRECT takes whole blocks only, from an aligned buffer */
+static int dump__append(struct dump *d, struct dump_wbuf *w, const void *p,
+			size_t len)
+{
+	size_t n;
+	int r;
+
+	while (len) {
+		n = min(len, DUMP_WBUF_SIZE - w->len);
+		memcpy(w->buf + w->len, p, n);
+		w->len += n;
+		p += n;
+		len -= n;
+
+		if (w->len == DUMP_WBUF_SIZE) {
+			r = dump__pwrite(d, w->buf, w->len, d->written_bytes);
+			if (r < 0)
+				return r;
+			d->written_bytes += w->len;
+			w->len = 0;
+		}
+	}
+
+	return 0;
+}
+
+/* The tail isn't a whole block */
+static int dump__flush(struct dump *d, struct dump_wbuf *w)
+{
+	int r;
+
+	if (d->direct &&
+	    fcntl(d->fd, F_SETFL, fcntl(d->fd, F_GETFL) & ~O_DIRECT) < 0)
+		return -errno;
+	d->direct = false;
+
+	r = dump__pwrite(d, w->buf, w->len, d->written_bytes);
+	if (r < 0)
+		return r;
+	d->written_bytes += w->len;
+	w->len = 0;
+
+	return 0;
+}
+
+/* Runs on the caller's thread, while the others compress */
+static void dump__write_compressed(struct dump *d)
+{
+	struct dump_wbuf w = {};
+	struct dump_chunk *c;
+	void *zbuf = NULL;
+	size_t zlen;
+	int r;
+	u32 i;
+
+	r = -ENOMEM;
+	if (posix_memalign(&w.buf, DUMP_ALIGN, DUMP_WBUF_SIZE))
+		goto out;
+
+	r = dump__deflate(d->header, d->header_size, &zbuf, &zlen);
+	if (!r)
+		r = dump__append(d, &w, zbuf, zlen);
+	free(zbuf);
+
+	for (i = 0; i < d->nr_chunks && !r; i++) {
+		c = &d->chunks[i];
+
+		mutex_lock(&d->lock);
+		while (!c->done && !d->err)
+			pthread_cond_wait(&d->cond, &d->lock.mutex);
+		r = d->err;
+		mutex_unlock(&d->lock);
+		if (r)
+			break;
+
+		r = dump__append(d, &w, c->zbuf, c->zlen);
+		if (c->zbuf != d->zero_zbuf)
+			free(c->zbuf);
+		c->zbuf = NULL;
+
+		mutex_lock(&d->lock);
+		d->written = i + 1;
+		pthread_cond_broadcast(&d->cond);
+		mutex_unlock(&d->lock);
+	}
+
+	if (!r)
+		r = dump__flush(d, &w);
+
+out:
+	mutex_lock(&d->lock);
+	if (r && !d->err)
+		d->err = r;
+	pthread_cond_broadcast(&d->cond);
+	mutex_unlock(&d->lock);
+
+	free(w.buf);
+}
+
+static int dump__compressed(struct dump *d)
+{
+	void *zero;
+	u32 i;
+	int r;
+
+	mutex_init(&d->lock);
+	pthread_cond_init(&d->cond, NULL);
+
+	/* Not worth failing over, the chunks of zeroes are deflated anew */
+	zero = calloc(1, DUMP_CHUNK);
+	if (zero && dump__deflate(zero, DUMP_CHUNK, &d->zero_zbuf,
+				  &d->zero_zlen))
+		d->zero_zbuf = NULL;
+	free(zero);
+
+	r = dump__pass(d, dump__compress_thread, dump__write_compressed);
+
+	for (i = 0; i < d->nr_chunks; i++)
+		if (d->chunks[i].zbuf != d->zero_zbuf)
+			free(d->chunks[i].zbuf);
+	free(d->zero_zbuf);
+	pthread_cond_destroy(&d->cond);
+
+	return r;
+}
+#else
+static int dump__compressed(struct dump *d)
+{
+	return -EOPNOTSUPP;
+}
+#endif
+
+/* Copy RAM while the guest runs, then again what it wrote meanwhile */
+static int dump__precopy(struct dump *d, struct dump_stats *stats)
+{
+	u64 nr_pages = d->kvm->ram_size / d->page_size;
+	unsigned long *bitmap;
+	u64 written;
+	long dirty;
+	int r;
+
+	bitmap = calloc(BITS_TO_LONGS(nr_pages), sizeof(long));
+	if (!bitmap)
+		return -ENOMEM;
+
+	r = dirty_log__start(d->kvm);
+	if (r < 0) {
+		free(bitmap);
+		return r;
+	}
+
+	/* All of RAM first, then the pages dirtied meanwhile */
+	r = dump__pass(d, dump__write_thread, NULL);
+	d->bitmap = bitmap;
+	stats->rounds = 1;
+
+	while (!r) {
+		dirty = dirty_log__sync(d->kvm, d->bitmap);
+		if (dirty < 0) {
+			r = dirty;
+			break;
+		}
+		/* What is left goes with the guest paused */
+		if (dirty <= DUMP_LIVE_DIRTY_PAGES ||
+		    stats->rounds >= DUMP_LIVE_MAX_ROUNDS)
+			break;
+
+		written = d->written_bytes;
+		r = dump__pass(d, dump__write_thread, NULL);
+		stats->rewritten_bytes += d->written_bytes - written;
+		bitmap_zero(d->bitmap, nr_pages);
+		stats->rounds++;
+	}
+
+	if (r < 0)
+		dirty_log__stop(d->kvm);
+
+	return r;
+}
+
+static int dump__write_core(struct kvm *kvm, struct dump_params *params,
+			    struct dump_stats *stats)
+{
+	bool live = params->flags & DUMP_F_LIVE;
+	bool compress = params->flags & DUMP_F_COMPRESS;
+	struct dump d = {
+		.kvm		= kvm,
+		.page_size	= getpagesize(),
+		.threads	= params->threads ?: DUMP_DEFAULT_THREADS,
+	};
+	u64 start, pause_start, written;
+	bool paused;
+	long dirty;
+	int r;
+
+	if (d.threads > DUMP_MAX_THREADS || (live && compress))
+		return -EINVAL;
+
+	start = kvm_cpu__now();
+	params->path[sizeof(params->path) - 1] = '\0';
+
+	r = dump__layout(&d);
+	if (r < 0)
+		goto out;
+
+	d.fd = open(params->path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0600);
+	d.direct = d.fd >= 0;
+	if (d.fd < 0 && errno == EINVAL)
+		d.fd = open(params->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (d.fd < 0) {
+		r = -errno;
+		goto out;
+	}
+
+	/* Where the zero pages are left out */
+	if (!compress && ftruncate(d.fd, d.size) < 0) {
+		r = -errno;
+		goto out_close;
+	}
+
+	/* A guest that "lkvm pause" stopped stays so until it resumes it */
+	paused = kvm->vm_state == KVM_VMSTATE_PAUSED;
+	live = live && !paused;
+
+	if (live) {
+		r = dump__precopy(&d, stats);
+		if (r < 0)
+			goto out_close;
+	}
+
+	pause_start = kvm_cpu__now();
+	if (!paused)
+		kvm__pause(kvm);
+
+	if (live) {
+		dirty = dirty_log__sync(kvm, d.bitmap);
+		dirty_log__sync_devices(d.bitmap);
+		written = d.written_bytes;
+		r = dirty < 0 ? dirty : dump__pass(&d, dump__write_thread, NULL);
+		stats->rewritten_bytes += d.written_bytes - written;
+	}
+
+	dump__fill_notes(&d);
+	dump__fill_header(&d);
+
+	if (compress)
+		r = dump__compressed(&d);
+	else if (!live)
+		r = dump__pass(&d, dump__write_thread, NULL);
+
+	if (!paused)
+		kvm__continue(kvm);
+	stats->pause_ns = kvm_cpu__now() - pause_start;
+
+	if (live)
+		dirty_log__stop(kvm);
+
+	if (!r && !compress) {
+		r = dump__pwrite(&d, d.header, d.header_size, 0);
+		d.written_bytes += d.header_size;
+	}
+
+out_close:
+	close(d.fd);
+	if (r < 0)
+		unlink(params->path);
+out:
+	stats->ram_bytes = kvm->ram_size;
+	stats->zero_bytes = d.zero_bytes;
+	stats->written_bytes = d.written_bytes;
+	stats->total_ns = kvm_cpu__now() - start;
+
+	free(d.bitmap);
+	free(d.header);
+	free(d.chunks);
+
+	return r;
+}
+
+static void dump__handle_ipc(struct kvm *kvm, int fd, u32 type, u32 len,
+			     u8 *msg)
+{
+	struct dump_stats stats = {};
+	struct dump_params params;
+	s32 r;
+
+	if (len != sizeof(params)) {
+		r = -EINVAL;
+	} else {
+		memcpy(&params, msg, sizeof(params));
+		r = dump__write_core(kvm, &params, &stats);
+	}
+
+	if (write_in_full(fd, &r, sizeof(r)) < 0 ||
+	    (!r && write_in_full(fd, &stats, sizeof(stats)) < 0))
+		pr_warning("Failed sending the dump status");
+}
+
+static int dump__init(struct kvm *kvm)
+{
+	return kvm_ipc__register_handler(KVM_IPC_DUMP, dump__handle_ipc);
+}
+late_init(dump__init);
@@ -58,7 +58,7 @@ int epoll__init(struct kvm *kvm, struct kvm__epoll *epoll,
 	if (r < 0)
 		goto err_close_all;
 
-	r = pthread_create(&epoll->thread, NULL, epoll__thread, epoll);
+	r = -kvm__start_device_thread(&epoll->thread, epoll__thread, epoll);
 	if (r < 0)
 		goto err_close_all;
 
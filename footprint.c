@@ -0,0 +1,212 @@
+#include "kvm/footprint.h"
+#include "kvm/kvm.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/read-write.h"
+#include "kvm/util.h"
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Host ranges of the memory banks, copied so that the lock isn't held long */
+struct footprint_bank {
+	unsigned long		start, end;
+	enum kvm_mem_type	type;
+};
+
+struct footprint_ctx {
+	struct footprint_bank	*banks;
+	u32			nr_banks;
+	/* Stack pointers of the threads */
+	unsigned long		*sps;
+	u32			nr_sps;
+	struct kvm_footprint	fp;
+};
+
+static int footprint__get_banks(struct kvm *kvm, struct footprint_ctx *ctx)
+{
+	struct kvm_mem_bank *bank;
+	u32 nr = 0;
+
+	mutex_lock(&kvm->mem_banks_lock);
+	list_for_each_entry(bank, &kvm->mem_banks, list)
+		nr++;
+
+	ctx->banks = calloc(nr, sizeof(*ctx->banks));
+	if (!ctx->banks && nr) {
+		mutex_unlock(&kvm->mem_banks_lock);
+		return -ENOMEM;
+	}
+
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		if (!bank->host_addr)
+			continue;
+		ctx->banks[ctx->nr_banks++] = (struct footprint_bank) {
+			.start	= (unsigned long)bank->host_addr,
+			.end	= (unsigned long)bank->host_addr + bank->size,
+			.type	= bank->type,
+		};
+	}
+	mutex_unlock(&kvm->mem_banks_lock);
+
+	return 0;
+}
+
+/*
+ * A thread blocked in a syscall shows its stack pointer in the task's
+ * syscall file, second to last. The running one, this, is still on its stack.
+ */
+static int footprint__get_stacks(struct footprint_ctx *ctx)
+{
+	char path[PATH_MAX], buf[256], *tok[12];
+	unsigned long *sps;
+	struct dirent *de;
+	u32 n, size = 0;
+	DIR *dir;
+	FILE *f;
+
+	dir = opendir("/proc/self/task");
+	if (!dir)
+		return -errno;
+
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		ctx->fp.nr_threads++;
+
+		/* With room for the stack of this thread */
+		if (ctx->nr_sps + 1 >= size) {
+			sps = realloc(ctx->sps, (size + 64) * sizeof(*sps));
+			if (!sps)
+				break;
+			ctx->sps = sps;
+			size += 64;
+		}
+
+		snprintf(path, sizeof(path), "/proc/self/task/%s/syscall",
+			 de->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (!fgets(buf, sizeof(buf), f))
+			buf[0] = '\0';
+		fclose(f);
+
+		for (n = 0; n < ARRAY_SIZE(tok); n++) {
+			tok[n] = strtok(n ? NULL : buf, " \n");
+			if (!tok[n])
+				break;
+		}
+		if (n >= 3)
+			ctx->sps[ctx->nr_sps++] = strtoul(tok[n - 2], NULL, 0);
+	}
+	closedir(dir);
+
+	if (ctx->nr_sps < size)
+		ctx->sps[ctx->nr_sps++] = (unsigned long)&size;
+
+	return 0;
+}
+
+static enum kvm_footprint_kind footprint__kind(struct footprint_ctx *ctx,
+					       unsigned long start,
+					       unsigned long end,
+					       const char *perms,
+					       const char *name)
+{
+	u32 i;
+
+	for (i = 0; i < ctx->nr_banks; i++) {
+		if (start < ctx->banks[i].end && ctx->banks[i].start < end)
+			return ctx->banks[i].type & KVM_MEM_TYPE_RAM ?
+			       KVM_FOOTPRINT_RAM : KVM_FOOTPRINT_DEVICE;
+	}
+
+	for (i = 0; i < ctx->nr_sps; i++) {
+		if (start <= ctx->sps[i] && ctx->sps[i] < end) {
+			ctx->fp.nr_stacks++;
+			return KVM_FOOTPRINT_STACKS;
+		}
+	}
+
+	if (!strcmp(name, "[stack]"))
+		return KVM_FOOTPRINT_STACKS;
+	if (!*name || !strcmp(name, "[heap]"))
+		return KVM_FOOTPRINT_HEAP;
+	if (*name != '/')
+		return KVM_FOOTPRINT_OTHER;
+
+	/* Shared file mappings are images, private ones are lkvm and libraries */
+	return perms[3] == 's' ? KVM_FOOTPRINT_FILES : KVM_FOOTPRINT_CODE;
+}
+
+static int footprint__collect(struct kvm *kvm, struct kvm_footprint *fp)
+{
+	struct footprint_ctx ctx = {};
+	enum kvm_footprint_kind kind = KVM_FOOTPRINT_OTHER;
+	unsigned long start, end, kb;
+	char line[PATH_MAX + 128];
+	char perms[5], *name;
+	int r, pos;
+	FILE *f;
+
+	r = footprint__get_banks(kvm, &ctx);
+	if (!r)
+		r = footprint__get_stacks(&ctx);
+	if (r)
+		goto out;
+
+	f = fopen("/proc/self/smaps", "r");
+	if (!f) {
+		r = -errno;
+		goto out;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		pos = 0;
+		if (sscanf(line, "%lx-%lx %4s %*x %*s %*u %n", &start, &end,
+			   perms, &pos) >= 3 && pos) {
+			name = line + pos;
+			name[strcspn(name, "\n")] = '\0';
+			kind = footprint__kind(&ctx, start, end, perms, name);
+			ctx.fp.size[kind] += end - start;
+		} else if (sscanf(line, "Rss: %lu kB", &kb) == 1) {
+			ctx.fp.rss[kind] += (u64)kb << 10;
+		}
+	}
+	fclose(f);
+
+	*fp = ctx.fp;
+out:
+	free(ctx.banks);
+	free(ctx.sps);
+	return r;
+}
+
+static void footprint__handle_ipc(struct kvm *kvm, int fd, u32 type, u32 len,
+				  u8 *msg)
+{
+	struct kvm_footprint fp = {};
+
+	if (WARN_ON(type != KVM_IPC_FOOTPRINT || len))
+		return;
+
+	if (footprint__collect(kvm, &fp))
+		pr_warning("Unable to account for the memory of the VM");
+
+	if (write_in_full(fd, &fp, sizeof(fp)) < 0)
+		pr_warning("Failed sending the memory footprint");
+}
+
+static int footprint__init(struct kvm *kvm)
+{
+	return kvm_ipc__register_handler(KVM_IPC_FOOTPRINT,
+					 footprint__handle_ipc);
+}
+late_init(footprint__init);
@@ -1,11 +1,14 @@
 #include "kvm/framebuffer.h"
 #include "kvm/kvm.h"
 
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <string.h>
 
 static LIST_HEAD(framebuffers);
 
@@ -27,6 +30,172 @@ int fb__attach(struct framebuffer *fb, struct fb_target_operations *ops)
 	return 0;
 }
 
+static unsigned long fb__nr_pages(struct framebuffer *fb)
+{
+	return DIV_ROUND_UP(fb->mem_size, PAGE_SIZE);
+}
+
+/*
+ * KVM hands out the whole log at once and clears it, so every target
+ * keeps its own copy of what it hasn't collected yet.
+ */
+static void fb__init_dirty_log(struct framebuffer *fb)
+{
+	/* KVM copies the log in 64-bit words */
+	size_t size = ALIGN(fb__nr_pages(fb), 64) / 8;
+	unsigned long i;
+	int err;
+
+	mutex_init(&fb->dirty_lock);
+
+	fb->log = calloc(1, size);
+	if (!fb->log)
+		goto err_free;
+
+	for (i = 0; i < fb->nr_targets; i++) {
+		fb->dirty[i] = calloc(1, size);
+		if (!fb->dirty[i])
+			goto err_free;
+	}
+
+	/* The device tells us itself what it redraws, see fb__damage() */
+	if (fb->damage) {
+		fb->dirty_log = true;
+		return;
+	}
+
+	err = kvm__set_dirty_log(fb->kvm, fb->mem_addr, true);
+	if (err) {
+		pr_warning("framebuffer: no dirty page logging (%d), redrawing whole frames",
+			   err);
+		goto err_free;
+	}
+
+	fb->dirty_log = true;
+	return;
+
+err_free:
+	for (i = 0; i < fb->nr_targets; i++) {
+		free(fb->dirty[i]);
+		fb->dirty[i] = NULL;
+	}
+	free(fb->log);
+	fb->log = NULL;
+}
+
+static int fb__full_frame(struct framebuffer *fb, struct fb_rect *rects)
+{
+	rects[0] = (struct fb_rect) {
+		.w	= fb->width,
+		.h	= fb->height,
+	};
+
+	return 1;
+}
+
+/*
+ * Fill @rects with up to @max bands of rows that the guest wrote since the
+ * last call for target @ops, and return how many there are. The first call
+ * of each target, and every call without dirty logging, returns the whole
+ * frame.
+ */
+int fb__get_dirty(struct framebuffer *fb, struct fb_target_operations *ops,
+		  struct fb_rect *rects, int max)
+{
+	unsigned long nr_pages, nr_longs, page, end;
+	u32 stride = fb->width * fb->depth / 8;
+	unsigned long *dirty;
+	unsigned long i;
+	int nr = 0;
+
+	for (i = 0; i < fb->nr_targets; i++)
+		if (fb->targets[i] == ops)
+			break;
+
+	if (i == fb->nr_targets || max <= 0)
+		return -EINVAL;
+
+	if (!fb->dirty_log || !fb->drawn[i]) {
+		fb->drawn[i] = true;
+		return fb__full_frame(fb, rects);
+	}
+
+	dirty = fb->dirty[i];
+	nr_pages = min_t(unsigned long, fb__nr_pages(fb),
+			 DIV_ROUND_UP((u64)stride * fb->height, PAGE_SIZE));
+	nr_longs = BITS_TO_LONGS(fb__nr_pages(fb));
+
+	mutex_lock(&fb->dirty_lock);
+	if (!fb->damage) {
+		if (kvm__get_dirty_log(fb->kvm, fb->mem_addr, fb->log) < 0) {
+			mutex_unlock(&fb->dirty_lock);
+			return fb__full_frame(fb, rects);
+		}
+
+		for (page = 0; page < nr_longs; page++) {
+			unsigned long j;
+
+			for (j = 0; j < fb->nr_targets; j++)
+				fb->dirty[j][page] |= fb->log[page];
+		}
+	}
+
+	for (page = 0; page < nr_pages; page = end) {
+		u32 y0, y1;
+
+		if (!test_bit(page, dirty)) {
+			end = page + 1;
+			continue;
+		}
+
+		for (end = page + 1; end < nr_pages && test_bit(end, dirty); end++)
+			;
+
+		y0 = page * PAGE_SIZE / stride;
+		y1 = min_t(u64, DIV_ROUND_UP((u64)end * PAGE_SIZE, stride),
+			   fb->height);
+
+		/* Stretch the last band rather than exceed @max */
+		if (nr && (y0 <= rects[nr - 1].y + rects[nr - 1].h || nr == max)) {
+			rects[nr - 1].h = y1 - rects[nr - 1].y;
+			continue;
+		}
+
+		rects[nr++] = (struct fb_rect) {
+			.y	= y0,
+			.w	= fb->width,
+			.h	= y1 - y0,
+		};
+	}
+
+	memset(dirty, 0, nr_longs * sizeof(long));
+	mutex_unlock(&fb->dirty_lock);
+
+	return nr;
+}
+
+/*
+ * For devices that know what they redraw: record @h rows from @y as
+ * written, for every target.
+ */
+void fb__damage(struct framebuffer *fb, u32 y, u32 h)
+{
+	u32 stride = fb->width * fb->depth / 8;
+	unsigned long first, last, i;
+
+	if (!fb->dirty_log || !h || y >= fb->height)
+		return;
+
+	h = min(h, fb->height - y);
+	first = (u64)y * stride / PAGE_SIZE;
+	last = ((u64)(y + h) * stride - 1) / PAGE_SIZE;
+
+	mutex_lock(&fb->dirty_lock);
+	for (i = 0; i < fb->nr_targets; i++)
+		bitmap_set(fb->dirty[i], first, last - first + 1);
+	mutex_unlock(&fb->dirty_lock);
+}
+
 static int start_targets(struct framebuffer *fb)
 {
 	unsigned long i;
@@ -52,6 +221,8 @@ int fb__init(struct kvm *kvm)
 	list_for_each_entry(fb, &framebuffers, node) {
 		int err;
 
+		fb__init_dirty_log(fb);
+
 		err = start_targets(fb);
 		if (err)
 			return err;
@@ -72,6 +243,13 @@ int fb__exit(struct kvm *kvm)
 			if (fb->targets[i]->stop)
 				fb->targets[i]->stop(fb);
 
+		if (fb->dirty_log && !fb->damage)
+			kvm__set_dirty_log(fb->kvm, fb->mem_addr, false);
+
+		for (i = 0; i < fb->nr_targets; i++)
+			free(fb->dirty[i]);
+		free(fb->log);
+
 		munmap(fb->mem, fb->mem_size);
 	}
 
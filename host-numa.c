@@ -0,0 +1,282 @@
+#include "kvm/host-numa.h"
+
+#include "kvm/kvm.h"
+#include "kvm/read-write.h"
+#include "kvm/util.h"
+#include "kvm/util-init.h"
+
+#include <linux/bitops.h>
+#include <linux/cpumask.h>
+#include <linux/mempolicy.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+/* How far to follow stacked devices down to a NIC, as with VLANs on bonds */
+#define HOST_NUMA_NETDEV_DEPTH	3
+
+static bool host_numa_enabled;
+
+static int host_numa__init(struct kvm *kvm)
+{
+	host_numa_enabled = !kvm->cfg.no_device_numa && !kvm->cfg.io_affinity &&
+			    access("/sys/devices/system/node/node1", F_OK) == 0;
+
+	return 0;
+}
+core_init(host_numa__init);
+
+/* From the numa_node attribute of the device at @sysfs_dir */
+int host_numa__dev_node(const char *sysfs_dir)
+{
+	char path[PATH_MAX], buf[16];
+	ssize_t len;
+	int fd, node;
+
+	snprintf(path, sizeof(path), "%s/numa_node", sysfs_dir);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	len = read_file(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+
+	node = atoi(buf);
+	return node >= 0 && node < KVM_MAX_NUMA_NODE ? node : -1;
+}
+
+/*
+ * Of a disk or of the filesystem holding an image. Partitions have their
+ * device one level up, NVMe namespaces have it on their controller.
+ */
+int host_numa__blkdev_node(dev_t dev)
+{
+	static const char * const subdirs[] = {
+		"device", "../device", "device/device", "../device/device",
+	};
+	char dir[PATH_MAX];
+	unsigned int i;
+	int node;
+
+	for (i = 0; i < ARRAY_SIZE(subdirs); i++) {
+		snprintf(dir, sizeof(dir), "/sys/dev/block/%u:%u/%s",
+			 major(dev), minor(dev), subdirs[i]);
+		node = host_numa__dev_node(dir);
+		if (node >= 0)
+			return node;
+	}
+
+	return -1;
+}
+
+static int host_numa__netdev_node_depth(const char *ifname, int depth);
+
+/* The first of the devices in @dir, minus @prefix, that has a node */
+static int host_numa__netdev_links(const char *dir, const char *prefix,
+				   const char *skip, int depth)
+{
+	struct dirent *de;
+	int node = -1;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		return -1;
+
+	while (node < 0 && (de = readdir(d)) != NULL) {
+		if (strncmp(de->d_name, prefix, strlen(prefix)) ||
+		    de->d_name[0] == '.' || !strcmp(de->d_name, skip))
+			continue;
+		node = host_numa__netdev_node_depth(de->d_name + strlen(prefix),
+						    depth);
+	}
+	closedir(d);
+
+	return node;
+}
+
+/* Its own device, or the one it is stacked on as macvtaps, VLANs and bonds */
+static int host_numa__netdev_node_depth(const char *ifname, int depth)
+{
+	char dir[PATH_MAX];
+	int node;
+
+	snprintf(dir, sizeof(dir), "/sys/class/net/%s/device", ifname);
+	node = host_numa__dev_node(dir);
+	if (node >= 0 || !depth)
+		return node;
+
+	snprintf(dir, sizeof(dir), "/sys/class/net/%s", ifname);
+	return host_numa__netdev_links(dir, "lower_", "", depth - 1);
+}
+
+/* A tap has no device, but the bridge it is a port of has a NIC as another */
+int host_numa__netdev_node(const char *ifname)
+{
+	char dir[PATH_MAX + 32], master[PATH_MAX];
+	const char *bridge;
+	ssize_t len;
+	int node;
+
+	node = host_numa__netdev_node_depth(ifname, HOST_NUMA_NETDEV_DEPTH);
+	if (node >= 0)
+		return node;
+
+	snprintf(dir, sizeof(dir), "/sys/class/net/%s/master", ifname);
+	len = readlink(dir, master, sizeof(master) - 1);
+	if (len <= 0)
+		return -1;
+	master[len] = '\0';
+	bridge = strrchr(master, '/');
+	bridge = bridge ? bridge + 1 : master;
+
+	snprintf(dir, sizeof(dir), "/sys/class/net/%s/brif", bridge);
+	return host_numa__netdev_links(dir, "", ifname,
+				       HOST_NUMA_NETDEV_DEPTH);
+}
+
+/* Of the disk behind @fd, itself a block device or a file on one */
+int host_numa__fd_node(int fd)
+{
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) < 0)
+		return -1;
+
+	return host_numa__blkdev_node(S_ISBLK(st.st_mode) ? st.st_rdev :
+					st.st_dev);
+}
+
+/* Add the CPUs of host node @node to @set */
+int host_numa__cpus(int node, cpu_set_t *set, size_t size)
+{
+	char path[64], buf[1024];
+	cpumask_t cpumask;
+	ssize_t len;
+	int i, fd;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		 node);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	len = read_file(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return -errno;
+	buf[len] = '\0';
+
+	if (cpulist_parse(buf, &cpumask))
+		return -EINVAL;
+
+	for_each_cpu(i, &cpumask)
+		CPU_SET_S(i, size, set);
+
+	return 0;
+}
+
+/* Move the calling device thread to the CPUs of @node, if it has any */
+void host_numa__bind_thread(int node)
+{
+	size_t size = CPU_ALLOC_SIZE(NR_CPUS);
+	cpu_set_t *set;
+
+	if (!host_numa_enabled || node < 0)
+		return;
+
+	set = CPU_ALLOC(NR_CPUS);
+	if (!set)
+		return;
+	CPU_ZERO_S(size, set);
+
+	/* Memory-only nodes, or CPUs outside of our cpuset */
+	if (host_numa__cpus(node, set, size) < 0 || !CPU_COUNT_S(size, set) ||
+	    sched_setaffinity(0, size, set))
+		pr_debug("Unable to move a device thread to host node %d",
+			 node);
+
+	CPU_FREE(set);
+}
+
+/* The affinity to give back to host_numa__leave(), NULL if unchanged */
+cpu_set_t *host_numa__enter(int node)
+{
+	size_t size = CPU_ALLOC_SIZE(NR_CPUS);
+	cpu_set_t *saved;
+
+	if (!host_numa_enabled || node < 0)
+		return NULL;
+
+	saved = CPU_ALLOC(NR_CPUS);
+	if (!saved)
+		return NULL;
+
+	if (sched_getaffinity(0, size, saved)) {
+		CPU_FREE(saved);
+		return NULL;
+	}
+
+	host_numa__bind_thread(node);
+
+	return saved;
+}
+
+void host_numa__leave(cpu_set_t *saved)
+{
+	if (!saved)
+		return;
+
+	if (sched_setaffinity(0, CPU_ALLOC_SIZE(NR_CPUS), saved))
+		pr_warning("Unable to restore the affinity of a thread");
+	CPU_FREE(saved);
+}
+
+/*
+ * Prefer @node for the pages of [@addr, @addr + @len), which must be page
+ * aligned. Pages already touched move there.
+ */
+void host_numa__bind_mem(void *addr, size_t len, int node)
+{
+	unsigned long mask[BITS_TO_LONGS(KVM_MAX_NUMA_NODE)] = {};
+
+	if (!host_numa_enabled || node < 0)
+		return;
+
+	mask[node / BITS_PER_LONG] |= 1UL << (node % BITS_PER_LONG);
+	/* Only a preference, the buffer works from anywhere */
+	if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask,
+		    KVM_MAX_NUMA_NODE + 1, MPOL_MF_MOVE) < 0)
+		pr_debug("Unable to place a buffer on host node %d", node);
+}
+
+/* Like calloc(), with whole pages of its own that free() releases */
+void *host_numa__zalloc(size_t size, int node)
+{
+	size_t len = ALIGN(size, PAGE_SIZE);
+	void *buf;
+
+	if (!host_numa_enabled || node < 0)
+		return calloc(1, size);
+
+	if (posix_memalign(&buf, PAGE_SIZE, len))
+		return NULL;
+
+	/* Before they are touched, so that they start out there */
+	host_numa__bind_mem(buf, len, node);
+	memset(buf, 0, len);
+
+	return buf;
+}
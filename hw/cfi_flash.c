@@ -133,6 +133,10 @@ struct cfi_flash_device {
 	void			*flash_memory;
 	u8			program_buffer[PROGRAM_BUFF_SIZE];
 	unsigned long		*lock_bm;
+	/* Erase blocks written since they last went back to the file */
+	unsigned long		*dirty_bm;
+	/* The file is read-only, writes stay in a private copy of it */
+	bool			is_private;
 	u64			block_address;
 	unsigned int		buff_written;
 	unsigned int		buffer_length;
@@ -210,6 +214,45 @@ static void lock_block(struct cfi_flash_device *sfdev, u64 faddr, bool lock)
 		clear_bit(block_nr, sfdev->lock_bm);
 }
 
+static void mark_dirty(struct cfi_flash_device *sfdev, u64 faddr, u64 len)
+{
+	u64 block_nr;
+
+	for (block_nr = faddr / FLASH_BLOCK_SIZE;
+	     block_nr * FLASH_BLOCK_SIZE < faddr + len; block_nr++)
+		set_bit(block_nr, sfdev->dirty_bm);
+}
+
+/*
+ * Write the blocks that the guest changed back to the file, each run of
+ * adjacent blocks with one msync(), once a command sequence is over.
+ * Firmware expects a variable to be stored when its write has completed.
+ */
+static void flush_flash_memory(struct cfi_flash_device *sfdev)
+{
+	int nr_blocks = nr_erase_blocks(sfdev);
+	int start, end;
+
+	for (start = 0; start < nr_blocks; start = end + 1) {
+		if (!test_bit(start, sfdev->dirty_bm)) {
+			end = start;
+			continue;
+		}
+
+		for (end = start; end < nr_blocks &&
+		     test_bit(end, sfdev->dirty_bm); end++)
+			clear_bit(end, sfdev->dirty_bm);
+
+		if (sfdev->is_private)
+			continue;
+
+		if (msync(sfdev->flash_memory + (u64)start * FLASH_BLOCK_SIZE,
+			  (u64)(end - start) * FLASH_BLOCK_SIZE, MS_SYNC) < 0)
+			pr_warning("CFI flash: unable to write back blocks %d-%d: %s",
+				   start, end - 1, strerror(errno));
+	}
+}
+
 static void word_program(struct cfi_flash_device *sfdev,
 			 u64 faddr, void *data, int len)
 {
@@ -219,6 +262,7 @@ static void word_program(struct cfi_flash_device *sfdev,
 	}
 
 	memcpy(sfdev->flash_memory + faddr, data, len);
+	mark_dirty(sfdev, faddr, len);
 }
 
 /* Reset the program buffer state to prepare for follow-up writes. */
@@ -266,6 +310,7 @@ static void buffer_confirm(struct cfi_flash_device *sfdev)
 	}
 	memcpy(sfdev->flash_memory + sfdev->block_address,
 	       sfdev->program_buffer, sfdev->buff_written);
+	mark_dirty(sfdev, sfdev->block_address, sfdev->buff_written);
 }
 
 static void block_erase_confirm(struct cfi_flash_device *sfdev, u64 faddr)
@@ -276,6 +321,7 @@ static void block_erase_confirm(struct cfi_flash_device *sfdev, u64 faddr)
 	}
 
 	memset(sfdev->flash_memory + faddr, 0xff, FLASH_BLOCK_SIZE);
+	mark_dirty(sfdev, faddr, FLASH_BLOCK_SIZE);
 }
 
 static void cfi_flash_read(struct cfi_flash_device *sfdev,
@@ -507,9 +553,10 @@ static void cfi_flash_mmio(struct kvm_cpu *vcpu,
 	cfi_flash_write(sfdev, value & 0xffff, faddr, data, len);
 
 	/* Adjust our mapping status accordingly. */
-	if (!sfdev->is_mapped && sfdev->read_mode == READ_ARRAY)
+	if (!sfdev->is_mapped && sfdev->read_mode == READ_ARRAY) {
+		flush_flash_memory(sfdev);
 		map_flash_memory(vcpu->kvm, sfdev);
-	else if (sfdev->is_mapped && sfdev->read_mode != READ_ARRAY)
+	} else if (sfdev->is_mapped && sfdev->read_mode != READ_ARRAY)
 		unmap_flash_memory(vcpu->kvm, sfdev);
 
 	mutex_unlock(&sfdev->mutex);
@@ -552,6 +599,13 @@ static struct cfi_flash_device *create_flash_device_file(struct kvm *kvm,
 	int fd;
 
 	fd = open(filename, O_RDWR);
+	/* Without write access the guest still gets a working, volatile copy */
+	if (fd < 0 && (errno == EACCES || errno == EROFS)) {
+		fd = open(filename, O_RDONLY);
+		if (fd >= 0)
+			pr_info("%s is read-only, flash writes will not be kept",
+				filename);
+	}
 	if (fd < 0)
 		return ERR_PTR(-errno);
 
@@ -560,7 +614,7 @@ static struct cfi_flash_device *create_flash_device_file(struct kvm *kvm,
 		goto out_close;
 	}
 
-	sfdev = malloc(sizeof(struct cfi_flash_device));
+	sfdev = calloc(1, sizeof(struct cfi_flash_device));
 	if (!sfdev) {
 		ret = -ENOMEM;
 		goto out_close;
@@ -576,8 +630,10 @@ static struct cfi_flash_device *create_flash_device_file(struct kvm *kvm,
 			(unsigned long long)statbuf.st_size);
 		pr_info("only using first %u bytes", sfdev->size);
 	}
+	sfdev->is_private = (fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDONLY;
 	sfdev->flash_memory = mmap(NULL, sfdev->size,
-				   PROT_READ | PROT_WRITE, MAP_SHARED,
+				   PROT_READ | PROT_WRITE,
+				   sfdev->is_private ? MAP_PRIVATE : MAP_SHARED,
 				   fd, 0);
 	if (sfdev->flash_memory == MAP_FAILED) {
 		ret = -errno;
@@ -593,6 +649,11 @@ static struct cfi_flash_device *create_flash_device_file(struct kvm *kvm,
 	value = roundup(nr_erase_blocks(sfdev), BITS_PER_LONG) / 8;
 	sfdev->lock_bm = malloc(value);
 	memset(sfdev->lock_bm, 0, value);
+	sfdev->dirty_bm = calloc(1, value);
+	if (!sfdev->dirty_bm) {
+		ret = -ENOMEM;
+		goto out_unmap;
+	}
 
 	sfdev->dev_hdr.bus_type = DEVICE_BUS_MMIO;
 	sfdev->dev_hdr.data = generate_cfi_flash_fdt_node;
@@ -612,6 +673,7 @@ static struct cfi_flash_device *create_flash_device_file(struct kvm *kvm,
 	return sfdev;
 
 out_unmap:
+	free(sfdev->dirty_bm);
 	munmap(sfdev->flash_memory, sfdev->size);
 out_free:
 	free(sfdev);
@@ -0,0 +1,222 @@
+#include "kvm/exit-bench.h"
+
+#include "kvm/ioeventfd.h"
+#include "kvm/ioport.h"
+#include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/pci.h"
+#include "kvm/util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/*
+ * Each access of a run ends in the handlers below, straight from an exit of
+ * the vCPU, from the coalesced ring once a later exit drains it, or from the
+ * ioeventfd thread, unless KVM took care of it. The time between the start
+ * and stop of a run is therefore what the dispatch of that many accesses
+ * costs the guest.
+ */
+struct exit_bench_run {
+	const char	*name;
+	u64		start;
+	u64		ns;
+	/* Made by the guest, and seen by lkvm */
+	u64		accesses;
+	u64		handled;
+};
+
+static struct exit_bench_run exit_bench_runs[EXIT_BENCH_NR_MODES] = {
+	[EXIT_BENCH_MODE_PIO_OUT]	= { .name = "pio-out" },
+	[EXIT_BENCH_MODE_PIO_IN]	= { .name = "pio-in" },
+	[EXIT_BENCH_MODE_MMIO_WRITE]	= { .name = "mmio-write" },
+	[EXIT_BENCH_MODE_MMIO_READ]	= { .name = "mmio-read" },
+	[EXIT_BENCH_MODE_COALESCED]	= { .name = "coalesced-mmio" },
+	[EXIT_BENCH_MODE_IOEVENTFD]	= { .name = "ioeventfd" },
+};
+
+static struct exit_bench_run *exit_bench_run;
+static u32 exit_bench_mmio;
+static bool exit_bench_ioeventfd;
+
+static void exit_bench__hit(void)
+{
+	struct exit_bench_run *run;
+
+	/* Kicks come from the ioeventfd thread */
+	run = __atomic_load_n(&exit_bench_run, __ATOMIC_ACQUIRE);
+	if (run)
+		__atomic_fetch_add(&run->handled, 1, __ATOMIC_RELAXED);
+}
+
+static void exit_bench__start(u32 mode)
+{
+	struct exit_bench_run *run;
+
+	if (mode >= EXIT_BENCH_NR_MODES) {
+		pr_warning("exit-bench: unknown mode %u", mode);
+		return;
+	}
+
+	run = &exit_bench_runs[mode];
+	run->handled = 0;
+	run->start = kvm_cpu__now();
+	__atomic_store_n(&exit_bench_run, run, __ATOMIC_RELEASE);
+}
+
+static void exit_bench__stop(u32 accesses)
+{
+	struct exit_bench_run *run = exit_bench_run;
+
+	if (!run)
+		return;
+
+	run->ns = kvm_cpu__now() - run->start;
+	run->accesses = accesses;
+	__atomic_store_n(&exit_bench_run, NULL, __ATOMIC_RELEASE);
+}
+
+static void exit_bench__io(struct kvm_cpu *vcpu, u64 addr, u8 *data,
+			   u32 len, u8 is_write, void *ptr)
+{
+	u32 val = is_write && len == 4 ? ioport__read32((u32 *)data) : 0;
+
+	switch (addr - EXIT_BENCH_IOPORT) {
+	case EXIT_BENCH_REG_MMIO:
+		if (!is_write && len == 4)
+			ioport__write32((u32 *)data, exit_bench_mmio);
+		break;
+	case EXIT_BENCH_REG_ITERATIONS:
+		if (!is_write && len == 4)
+			ioport__write32((u32 *)data, vcpu->kvm->cfg.exit_bench);
+		break;
+	case EXIT_BENCH_REG_START:
+		if (is_write && len == 4)
+			exit_bench__start(val);
+		break;
+	case EXIT_BENCH_REG_STOP:
+		if (is_write && len == 4)
+			exit_bench__stop(val);
+		break;
+	case EXIT_BENCH_REG_PIO:
+		exit_bench__hit();
+		if (!is_write)
+			memset(data, 0, len);
+		break;
+	}
+}
+
+static void exit_bench__mmio(struct kvm_cpu *vcpu, u64 addr, u8 *data,
+			     u32 len, u8 is_write, void *ptr)
+{
+	exit_bench__hit();
+	if (!is_write)
+		memset(data, 0, len);
+}
+
+static void exit_bench__kick(struct kvm *kvm, void *ptr)
+{
+	exit_bench__hit();
+}
+
+static int exit_bench__init_ioeventfd(struct kvm *kvm)
+{
+	struct ioevent ioevent = {
+		.io_addr	= exit_bench_mmio + EXIT_BENCH_IOEVENTFD,
+		.io_len		= sizeof(u32),
+		.fn		= exit_bench__kick,
+		.fn_kvm		= kvm,
+		.fd		= eventfd(0, 0),
+	};
+
+	return ioeventfd__add_event(&ioevent, IOEVENTFD_FLAG_NO_DATAMATCH);
+}
+
+static int exit_bench__init(struct kvm *kvm)
+{
+	int r;
+
+	if (kvm->cfg.exit_bench <= 0)
+		return 0;
+
+	exit_bench_mmio = pci_get_mmio_block(EXIT_BENCH_MMIO_SIZE);
+
+	r = kvm__register_pio(kvm, EXIT_BENCH_IOPORT, EXIT_BENCH_IOPORT_LEN,
+			      exit_bench__io, NULL);
+	if (r < 0)
+		return r;
+
+	r = kvm__register_mmio(kvm, exit_bench_mmio + EXIT_BENCH_MMIO,
+			       PAGE_SIZE, false, exit_bench__mmio, NULL);
+	if (r < 0)
+		goto err_pio;
+
+	r = kvm__register_mmio(kvm, exit_bench_mmio + EXIT_BENCH_COALESCED,
+			       PAGE_SIZE, true, exit_bench__mmio, NULL);
+	if (r < 0)
+		goto err_mmio;
+
+	/* Where the kicks exit to when KVM can't signal them */
+	r = kvm__register_mmio(kvm, exit_bench_mmio + EXIT_BENCH_IOEVENTFD,
+			       PAGE_SIZE, false, exit_bench__mmio, NULL);
+	if (r < 0)
+		goto err_coalesced;
+
+	exit_bench_ioeventfd = exit_bench__init_ioeventfd(kvm) == 0;
+	if (!exit_bench_ioeventfd)
+		pr_warning("exit-bench: no ioeventfd, kicks will exit");
+
+	return 0;
+
+err_coalesced:
+	kvm__deregister_mmio(kvm, exit_bench_mmio + EXIT_BENCH_COALESCED);
+err_mmio:
+	kvm__deregister_mmio(kvm, exit_bench_mmio + EXIT_BENCH_MMIO);
+err_pio:
+	kvm__deregister_pio(kvm, EXIT_BENCH_IOPORT);
+
+	return r;
+}
+/* Once ioeventfd__init() has run */
+dev_base_init(exit_bench__init);
+
+static void exit_bench__report(void)
+{
+	struct exit_bench_run *run;
+	unsigned int i;
+
+	printf("%-16s %10s %10s %12s %10s\n",
+	       "mode", "accesses", "handled", "exits/s", "ns/exit");
+	for (i = 0; i < EXIT_BENCH_NR_MODES; i++) {
+		run = &exit_bench_runs[i];
+		if (!run->accesses || !run->ns)
+			continue;
+
+		printf("%-16s %10llu %10llu %12.0f %10.1f\n", run->name,
+		       (unsigned long long)run->accesses,
+		       (unsigned long long)run->handled,
+		       run->accesses * 1e9 / run->ns,
+		       (double)run->ns / run->accesses);
+	}
+}
+
+/* After the terminal is restored, so that the table comes out right */
+static int exit_bench__exit(struct kvm *kvm)
+{
+	if (kvm->cfg.exit_bench <= 0)
+		return 0;
+
+	exit_bench__report();
+
+	if (exit_bench_ioeventfd)
+		ioeventfd__del_event(exit_bench_mmio + EXIT_BENCH_IOEVENTFD, 0);
+	kvm__deregister_mmio(kvm, exit_bench_mmio + EXIT_BENCH_IOEVENTFD);
+	kvm__deregister_mmio(kvm, exit_bench_mmio + EXIT_BENCH_COALESCED);
+	kvm__deregister_mmio(kvm, exit_bench_mmio + EXIT_BENCH_MMIO);
+	kvm__deregister_pio(kvm, EXIT_BENCH_IOPORT);
+
+	return 0;
+}
+dev_base_exit(exit_bench__exit);
@@ -6,6 +6,7 @@
 #include "kvm/kvm.h"
 #include "kvm/i8042.h"
 #include "kvm/kvm-cpu.h"
+#include "kvm/snapshot.h"
 
 #include <stdint.h>
 
@@ -325,6 +326,35 @@ static void kbd_io(struct kvm_cpu *vcpu, u64 addr, u8 *data, u32 len,
 		ioport__write8(data, value);
 }
 
+#define KBD_STATE_START	offsetof(struct kbd_state, kq)
+#define KBD_STATE_SIZE	(sizeof(state) - KBD_STATE_START)
+
+static int kbd__save(struct kvm *kvm, struct snapshot *snap, void *data)
+{
+	return snapshot__write(snap, (void *)&state + KBD_STATE_START,
+			       KBD_STATE_SIZE);
+}
+
+static int kbd__restore(struct kvm *kvm, struct snapshot *snap, void *data)
+{
+	int r;
+
+	r = snapshot__read(snap, (void *)&state + KBD_STATE_START,
+			   KBD_STATE_SIZE);
+	if (r < 0)
+		return r;
+
+	kbd_update_irq();
+
+	return 0;
+}
+
+static struct snapshot_handler kbd_snapshot = {
+	.name		= "i8042",
+	.save		= kbd__save,
+	.restore	= kbd__restore,
+};
+
 static int kbd__init(struct kvm *kvm)
 {
 	int r;
@@ -340,6 +370,14 @@ static int kbd__init(struct kvm *kvm)
 		return r;
 	}
 
+	/*
+	 * Drivers poll the status register for the outcome of a command, which
+	 * flushes it out of the coalesced ring.
+	 */
+	kvm__coalesce_iotrap(kvm, I8042_COMMAND_REG, 1, DEVICE_BUS_IOPORT, true);
+
+	snapshot__register(&kbd_snapshot);
+
 	return 0;
 }
 dev_init(kbd__init);
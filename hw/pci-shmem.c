@@ -0,0 +1,464 @@
+#include "kvm/pci-shmem.h"
+
+#include "kvm/virtio-pci-dev.h"
+#include "kvm/ioeventfd.h"
+#include "kvm/devices.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/snapshot.h"
+#include "kvm/ioport.h"
+#include "kvm/mutex.h"
+#include "kvm/util.h"
+#include "kvm/irq.h"
+#include "kvm/kvm.h"
+#include "kvm/pci.h"
+
+#include <linux/byteorder.h>
+#include <linux/kernel.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Memory that the guest and host processes both map, so that they exchange
+ * data without copies, and tell each other about it with the doorbells: the
+ * guest rings the host through ioeventfds, and the host raises MSI-X vectors
+ * of the guest through irqfds. Neither goes through us once set up.
+ */
+
+#define PCI_SHMEM_MSIX_BAR_SIZE		4096
+#define PCI_SHMEM_PBA_OFFSET		2048
+
+struct pci_shmem {
+	struct pci_device_header pci_hdr;
+	struct device_header	dev_hdr;
+
+	u64			size;
+	u32			nr_vectors;
+	const char		*hugetlbfs;
+	int			fd;
+	void			*mem;
+
+	u32			intr_mask;
+	u32			intr_status;
+	/* How many of the doorbell_fds are ioeventfds of BAR 0 */
+	u32			nr_ioeventfds;
+	int			doorbell_fds[PCI_SHMEM_MAX_VECTORS];
+	int			irq_fds[PCI_SHMEM_MAX_VECTORS];
+
+	/* Of the MSI-X table and the routes */
+	struct mutex		mutex;
+	struct msix_table	msix_table[PCI_SHMEM_MAX_VECTORS];
+	int			gsis[PCI_SHMEM_MAX_VECTORS];
+	bool			irqfds[PCI_SHMEM_MAX_VECTORS];
+};
+
+static struct pci_shmem shmem = {
+	.pci_hdr = {
+		.vendor_id	= cpu_to_le16(PCI_VENDOR_ID_REDHAT_QUMRANET),
+		.device_id	= cpu_to_le16(PCI_DEVICE_ID_PCI_SHMEM),
+		.header_type	= PCI_HEADER_TYPE_NORMAL,
+		.revision_id	= 1,
+		.class[0]	= PCI_CLASS_PCI_SHMEM & 0xff,
+		.class[1]	= (PCI_CLASS_PCI_SHMEM >> 8) & 0xff,
+		.class[2]	= (PCI_CLASS_PCI_SHMEM >> 16) & 0xff,
+		.subsys_vendor_id = cpu_to_le16(PCI_SUBSYSTEM_VENDOR_ID_REDHAT_QUMRANET),
+		.subsys_id	= cpu_to_le16(PCI_SUBSYSTEM_ID_PCI_SHMEM),
+		.status		= cpu_to_le16(PCI_STATUS_CAP_LIST),
+	},
+	.dev_hdr = {
+		.bus_type	= DEVICE_BUS_PCI,
+		.data		= &shmem.pci_hdr,
+	},
+	.fd		= -1,
+};
+
+/* A doorbell write that no ioeventfd took */
+static void pci_shmem__ring(u32 val)
+{
+	u32 peer = val >> 16, vector = val & 0xffff;
+	u64 one = 1;
+
+	if (peer != PCI_SHMEM_PEER_HOST || vector >= shmem.nr_vectors)
+		return;
+
+	if (write(shmem.doorbell_fds[vector], &one, sizeof(one)) < 0)
+		pr_warning("pci-shmem: unable to ring vector %u", vector);
+}
+
+static void pci_shmem__regs_mmio(struct kvm_cpu *vcpu, u64 addr, u8 *data,
+				 u32 len, u8 is_write, void *ptr)
+{
+	u64 offset = addr - pci__bar_address(&shmem.pci_hdr, 0);
+	u32 val = 0;
+
+	/* All the registers are 32-bit */
+	if (len != sizeof(u32) || offset & 3) {
+		if (!is_write)
+			memset(data, 0, len);
+		return;
+	}
+
+	if (!is_write) {
+		switch (offset) {
+		case PCI_SHMEM_INTR_MASK:
+			val = shmem.intr_mask;
+			break;
+		case PCI_SHMEM_INTR_STATUS:
+			val = shmem.intr_status;
+			break;
+		case PCI_SHMEM_IV_POSITION:
+			val = PCI_SHMEM_PEER_GUEST;
+			break;
+		}
+		ioport__write32((u32 *)data, val);
+		return;
+	}
+
+	val = ioport__read32((u32 *)data);
+	switch (offset) {
+	case PCI_SHMEM_INTR_MASK:
+		shmem.intr_mask = val;
+		break;
+	case PCI_SHMEM_INTR_STATUS:
+		shmem.intr_status = val;
+		break;
+	case PCI_SHMEM_DOORBELL:
+		pci_shmem__ring(val);
+		break;
+	}
+}
+
+/*
+ * A vector gets its route once the guest unmasks it, and the host's eventfd
+ * is its irqfd for as long as it stays unmasked. What the host signals while
+ * it is masked is left in the eventfd, and KVM injects it on the unmask.
+ */
+static void pci_shmem__update_vector(struct kvm *kvm, u32 vector)
+{
+	struct msix_table *entry = &shmem.msix_table[vector];
+	bool masked = le32_to_cpu(entry->ctrl) & PCI_MSIX_ENTRY_CTRL_MASKBIT;
+	int gsi = shmem.gsis[vector];
+
+	if (gsi < 0) {
+		if (masked)
+			return;
+
+		gsi = irq__add_msix_route(kvm, &entry->msg,
+					  pci__devfn(shmem.dev_hdr.dev_num));
+		if (gsi < 0) {
+			pr_warning("pci-shmem: unable to route vector %u", vector);
+			return;
+		}
+		shmem.gsis[vector] = gsi;
+	} else {
+		irq__update_msix_route(kvm, gsi, &entry->msg);
+	}
+
+	if (masked && shmem.irqfds[vector]) {
+		irq__del_irqfd(kvm, gsi, shmem.irq_fds[vector]);
+		shmem.irqfds[vector] = false;
+	} else if (!masked && !shmem.irqfds[vector]) {
+		if (irq__add_irqfd(kvm, gsi, shmem.irq_fds[vector], -1) < 0)
+			pr_warning("pci-shmem: unable to add irqfd for vector %u",
+				   vector);
+		else
+			shmem.irqfds[vector] = true;
+	}
+}
+
+static void pci_shmem__msix_mmio(struct kvm_cpu *vcpu, u64 addr, u8 *data,
+				 u32 len, u8 is_write, void *ptr)
+{
+	u64 offset = addr - pci__bar_address(&shmem.pci_hdr, 1);
+	u32 vector, field;
+
+	/* Nothing is ever pending here, the irqfds keep it */
+	if (offset >= PCI_SHMEM_PBA_OFFSET) {
+		if (!is_write)
+			memset(data, 0, len);
+		return;
+	}
+
+	vector = offset / sizeof(struct msix_table);
+	field = offset % sizeof(struct msix_table);
+	if (vector >= shmem.nr_vectors || field + len > sizeof(struct msix_table)) {
+		if (!is_write)
+			memset(data, 0, len);
+		return;
+	}
+
+	mutex_lock(&shmem.mutex);
+	if (!is_write) {
+		memcpy(data, (void *)&shmem.msix_table[vector] + field, len);
+	} else {
+		memcpy((void *)&shmem.msix_table[vector] + field, data, len);
+		/* Guests write the address of an entry before its data */
+		if (field + len > offsetof(struct msix_table, msg.data))
+			pci_shmem__update_vector(vcpu->kvm, vector);
+	}
+	mutex_unlock(&shmem.mutex);
+}
+
+static void pci_shmem__add_ioeventfds(struct kvm *kvm, u32 bar_addr)
+{
+	struct ioevent ioevent;
+	u32 i;
+	int r;
+
+	for (i = 0; i < shmem.nr_vectors; i++) {
+		ioevent = (struct ioevent) {
+			.io_addr	= bar_addr + PCI_SHMEM_DOORBELL,
+			.io_len		= sizeof(u32),
+			.fn_kvm		= kvm,
+			.datamatch	= PCI_SHMEM_PEER_HOST << 16 | i,
+			/* The event owns its fd, the host keeps the original */
+			.fd		= dup(shmem.doorbell_fds[i]),
+		};
+
+		r = ioeventfd__add_event(&ioevent, 0);
+		if (r) {
+			pr_warning("pci-shmem: unable to add ioeventfd (%s), doorbells will trap",
+				   strerror(-r));
+			break;
+		}
+		shmem.nr_ioeventfds = i + 1;
+	}
+}
+
+static void pci_shmem__del_ioeventfds(u32 bar_addr)
+{
+	u32 i;
+
+	for (i = 0; i < shmem.nr_ioeventfds; i++)
+		ioeventfd__del_event(bar_addr + PCI_SHMEM_DOORBELL,
+				     PCI_SHMEM_PEER_HOST << 16 | i);
+	shmem.nr_ioeventfds = 0;
+}
+
+static int pci_shmem__bar_activate(struct kvm *kvm,
+				   struct pci_device_header *pci_hdr,
+				   int bar_num, void *data)
+{
+	u32 bar_addr = pci__bar_address(pci_hdr, bar_num);
+	u32 bar_size = pci__bar_size(pci_hdr, bar_num);
+	int r;
+
+	switch (bar_num) {
+	case 0:
+		r = kvm__register_mmio(kvm, bar_addr, bar_size, false,
+				       pci_shmem__regs_mmio, NULL);
+		if (r < 0)
+			return r;
+		pci_shmem__add_ioeventfds(kvm, bar_addr);
+		return 0;
+	case 1:
+		return kvm__register_mmio(kvm, bar_addr, bar_size, false,
+					  pci_shmem__msix_mmio, NULL);
+	case 2:
+		return kvm__register_dev_mem(kvm, bar_addr, bar_size, shmem.mem);
+	}
+
+	return -EINVAL;
+}
+
+static int pci_shmem__bar_deactivate(struct kvm *kvm,
+				     struct pci_device_header *pci_hdr,
+				     int bar_num, void *data)
+{
+	u32 bar_addr = pci__bar_address(pci_hdr, bar_num);
+
+	switch (bar_num) {
+	case 0:
+		pci_shmem__del_ioeventfds(bar_addr);
+		/* Fall through */
+	case 1:
+		return kvm__deregister_mmio(kvm, bar_addr) ? 0 : -ENOENT;
+	case 2:
+		return kvm__destroy_mem(kvm, bar_addr, shmem.size, shmem.mem);
+	}
+
+	return -EINVAL;
+}
+
+static void pci_shmem__handle_ipc(struct kvm *kvm, int fd, u32 type, u32 len,
+				  u8 *msg)
+{
+	char control[CMSG_SPACE((1 + 2 * PCI_SHMEM_MAX_VECTORS) * sizeof(int))] = {};
+	struct pci_shmem_info info = {
+		.size		= shmem.size,
+		.nr_vectors	= shmem.nr_vectors,
+	};
+	struct iovec iov = {
+		.iov_base	= &info,
+		.iov_len	= sizeof(info),
+	};
+	struct msghdr msgh = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= control,
+	};
+	int fds[1 + 2 * PCI_SHMEM_MAX_VECTORS];
+	struct cmsghdr *cmsg;
+	u32 i, nr_fds = 0;
+
+	fds[nr_fds++] = shmem.fd;
+	for (i = 0; i < shmem.nr_vectors; i++)
+		fds[nr_fds++] = shmem.doorbell_fds[i];
+	for (i = 0; i < shmem.nr_vectors; i++)
+		fds[nr_fds++] = shmem.irq_fds[i];
+
+	msgh.msg_controllen = CMSG_SPACE(nr_fds * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msgh);
+	cmsg->cmsg_len = CMSG_LEN(nr_fds * sizeof(int));
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	memcpy(CMSG_DATA(cmsg), fds, nr_fds * sizeof(int));
+
+	if (sendmsg(fd, &msgh, MSG_NOSIGNAL) == sizeof(info))
+		return;
+
+	/* Version 2 replies go through a memfd, which can't carry the fds */
+	info = (struct pci_shmem_info) {
+		.status		= -errno,
+	};
+	if (write_in_full(fd, &info, sizeof(info)) < 0)
+		pr_warning("Failed sending the shared memory");
+}
+
+static int pci_shmem__alloc(void)
+{
+	char path[PATH_MAX];
+
+	if (shmem.hugetlbfs) {
+		snprintf(path, sizeof(path), "%s/kvmtool-shmemXXXXXX",
+			 shmem.hugetlbfs);
+		shmem.fd = mkostemp(path, O_CLOEXEC);
+		if (shmem.fd >= 0)
+			unlink(path);
+	} else {
+		shmem.fd = memfd_create("kvmtool-shmem", MFD_CLOEXEC);
+	}
+	if (shmem.fd < 0)
+		return -errno;
+
+	if (ftruncate(shmem.fd, shmem.size) < 0)
+		return -errno;
+
+	shmem.mem = mmap(NULL, shmem.size, PROT_RW, MAP_SHARED, shmem.fd, 0);
+	if (shmem.mem == MAP_FAILED)
+		return -errno;
+
+	return 0;
+}
+
+int pci_shmem_parser(const struct option *opt, const char *arg, int unset)
+{
+	char *buf, *cur, *param, *end;
+	u64 size;
+
+	if (shmem.size)
+		die("Only one --shmem device is supported");
+
+	buf = strdup(arg);
+	if (!buf)
+		die("out of memory");
+
+	cur = buf;
+	param = strsep(&cur, ",");
+	size = strtoull(param, &end, 10) * SZ_1M;
+	if (end == param || *end || !is_power_of_two(size) ||
+	    size > PCI_SHMEM_MAX_SIZE)
+		die("The --shmem size must be a power of two number of MB, up to %u",
+		    PCI_SHMEM_MAX_SIZE / SZ_1M);
+
+	shmem.size = size;
+	shmem.nr_vectors = 1;
+
+	while (cur) {
+		param = strsep(&cur, ",");
+
+		if (!strncmp(param, "hugetlbfs=", 10)) {
+			shmem.hugetlbfs = strdup(param + 10);
+		} else if (!strncmp(param, "vectors=", 8)) {
+			shmem.nr_vectors = strtoul(param + 8, &end, 10);
+			if (*end || !shmem.nr_vectors ||
+			    shmem.nr_vectors > PCI_SHMEM_MAX_VECTORS)
+				die("--shmem has 1 to %u vectors",
+				    PCI_SHMEM_MAX_VECTORS);
+		} else {
+			die("Unknown --shmem parameter %s", param);
+		}
+	}
+
+	free(buf);
+	return 0;
+}
+
+int pci_shmem__init(struct kvm *kvm)
+{
+	u32 bar_addr, i;
+	int r;
+
+	if (!shmem.size)
+		return 0;
+
+	r = pci_shmem__alloc();
+	if (r < 0) {
+		pr_err("pci-shmem: unable to allocate %llu MB: %s",
+		       (unsigned long long)shmem.size / SZ_1M, strerror(-r));
+		return r;
+	}
+
+	mutex_init(&shmem.mutex);
+	for (i = 0; i < shmem.nr_vectors; i++) {
+		shmem.doorbell_fds[i] = eventfd(0, EFD_CLOEXEC);
+		shmem.irq_fds[i] = eventfd(0, EFD_CLOEXEC);
+		if (shmem.doorbell_fds[i] < 0 || shmem.irq_fds[i] < 0)
+			return -errno;
+
+		shmem.gsis[i] = -1;
+		shmem.msix_table[i].ctrl = cpu_to_le32(PCI_MSIX_ENTRY_CTRL_MASKBIT);
+	}
+
+	bar_addr = pci_get_mmio_block(PCI_SHMEM_REGS_SIZE);
+	shmem.pci_hdr.bar[0] = cpu_to_le32(bar_addr | PCI_BASE_ADDRESS_SPACE_MEMORY);
+	shmem.pci_hdr.bar_size[0] = PCI_SHMEM_REGS_SIZE;
+
+	bar_addr = pci_get_mmio_block(PCI_SHMEM_MSIX_BAR_SIZE);
+	shmem.pci_hdr.bar[1] = cpu_to_le32(bar_addr | PCI_BASE_ADDRESS_SPACE_MEMORY);
+	shmem.pci_hdr.bar_size[1] = PCI_SHMEM_MSIX_BAR_SIZE;
+
+	bar_addr = pci_get_mmio_block(shmem.size);
+	shmem.pci_hdr.bar[2] = cpu_to_le32(bar_addr | PCI_BASE_ADDRESS_SPACE_MEMORY
+					   | PCI_BASE_ADDRESS_MEM_PREFETCH);
+	shmem.pci_hdr.bar_size[2] = shmem.size;
+
+	/* The table and the PBA are both in BAR 1 */
+	shmem.pci_hdr.capabilities = PCI_CAP_OFF(&shmem.pci_hdr, msix);
+	shmem.pci_hdr.msix.cap = PCI_CAP_ID_MSIX;
+	shmem.pci_hdr.msix.ctrl = cpu_to_le16(shmem.nr_vectors - 1);
+	shmem.pci_hdr.msix.table_offset = cpu_to_le32(1);
+	shmem.pci_hdr.msix.pba_offset = cpu_to_le32(1 | PCI_SHMEM_PBA_OFFSET);
+
+	r = pci__register_bar_regions(kvm, &shmem.pci_hdr,
+				      pci_shmem__bar_activate,
+				      pci_shmem__bar_deactivate, NULL);
+	if (r < 0)
+		return r;
+
+	r = device__register(&shmem.dev_hdr);
+	if (r < 0)
+		return r;
+
+	/* Snapshots only have the RAM banks */
+	snapshot__block("pci-shmem");
+	kvm_ipc__register_handler(KVM_IPC_SHMEM, pci_shmem__handle_ipc);
+
+	return 0;
+}
+dev_init(pci_shmem__init);
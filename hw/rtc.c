@@ -3,6 +3,7 @@
 #include "kvm/fdt.h"
 #include "kvm/ioport.h"
 #include "kvm/kvm.h"
+#include "kvm/snapshot.h"
 
 #include <time.h>
 
@@ -156,6 +157,23 @@ struct device_header rtc_dev_hdr = {
 	.data = generate_rtc_fdt_node,
 };
 
+/* The clock itself is the one of the host, only the registers are kept */
+static int rtc__save(struct kvm *kvm, struct snapshot *snap, void *data)
+{
+	return snapshot__write(snap, &rtc, sizeof(rtc));
+}
+
+static int rtc__restore(struct kvm *kvm, struct snapshot *snap, void *data)
+{
+	return snapshot__read(snap, &rtc, sizeof(rtc));
+}
+
+static struct snapshot_handler rtc_snapshot = {
+	.name		= "rtc",
+	.save		= rtc__save,
+	.restore	= rtc__restore,
+};
+
 int rtc__init(struct kvm *kvm)
 {
 	int r;
@@ -169,9 +187,17 @@ int rtc__init(struct kvm *kvm)
 	if (r < 0)
 		goto out_device;
 
+	/*
+	 * The index register is write-only, so selecting a register can wait
+	 * until the guest accesses the data register.
+	 */
+	kvm__coalesce_iotrap(kvm, RTC_BASE_ADDRESS, 1, RTC_BUS_TYPE, true);
+
 	/* Set the VRT bit in Register D to indicate valid RAM and time */
 	rtc.cmos_data[RTC_REG_D] = RTC_REG_D_VRT;
 
+	snapshot__register(&rtc_snapshot);
+
 	return r;
 
 out_device:
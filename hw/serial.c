@@ -1,7 +1,10 @@
 #include "kvm/8250-serial.h"
 
 #include "kvm/read-write.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/kvm-cpu.h"
 #include "kvm/ioport.h"
+#include "kvm/snapshot.h"
 #include "kvm/mutex.h"
 #include "kvm/util.h"
 #include "kvm/term.h"
@@ -12,6 +15,7 @@
 #include <linux/serial_reg.h>
 
 #include <pthread.h>
+#include <errno.h>
 
 #if defined(CONFIG_ARM) || defined(CONFIG_ARM64)
 #define serial_iobase(nr)	(ARM_UART_MMIO_BASE + (nr) * 0x1000)
@@ -44,6 +48,18 @@
 
 #define UART_IIR_TYPE_BITS	0xc0
 
+/* Of the receive FIFO, by bits 7:6 of FCR */
+static const int serial8250_rx_trigger[] = { 1, 4, 8, 14 };
+
+/*
+ * Guest output goes through a ring to a writer thread, so that a slow
+ * terminal holds the guest up only once the ring is full, by keeping THRE
+ * clear.
+ */
+#define SERIAL_TX_RING_SIZE	(64 * 1024)
+
+#define NSEC_PER_SEC		1000000000ULL
+
 struct serial8250_device {
 	struct device_header	dev_hdr;
 	struct mutex		mutex;
@@ -52,11 +68,31 @@ struct serial8250_device {
 	u32			iobase;
 	u8			irq;
 	u8			irq_state;
+	bool			can_coalesce;
+	bool			coalesced;
 	int			txcnt;
 	int			rxcnt;
 	int			rxdone;
 	char			txbuf[FIFO_LEN];
 	char			rxbuf[FIFO_LEN];
+	/* The terminal waits for the guest to make room, see serial8250_rx() */
+	bool			rxstalled;
+	/* The terminal had nothing more, see serial8250_rx_iir() */
+	bool			rxidle;
+
+	struct kvm		*kvm;
+	char			*txring;
+	u32			txhead;
+	u32			txtail;
+	bool			txstop;
+	pthread_t		txthread;
+	pthread_cond_t		txcond;
+
+	struct serial8250_stats	stats;
+	u64			rate_start;
+	u64			rate_bytes;
+
+	struct snapshot_handler	snapshot;
 
 	u8			dll;
 	u8			dlm;
@@ -91,6 +127,7 @@ static struct serial8250_device devices[] = {
 			.data		= serial8250_generate_fdt_node,
 		},
 		.mutex			= MUTEX_INITIALIZER,
+		.txcond			= PTHREAD_COND_INITIALIZER,
 
 		.id			= 0,
 		.iobase			= serial_iobase(0),
@@ -105,6 +142,7 @@ static struct serial8250_device devices[] = {
 			.data		= serial8250_generate_fdt_node,
 		},
 		.mutex			= MUTEX_INITIALIZER,
+		.txcond			= PTHREAD_COND_INITIALIZER,
 
 		.id			= 1,
 		.iobase			= serial_iobase(1),
@@ -119,6 +157,7 @@ static struct serial8250_device devices[] = {
 			.data		= serial8250_generate_fdt_node,
 		},
 		.mutex			= MUTEX_INITIALIZER,
+		.txcond			= PTHREAD_COND_INITIALIZER,
 
 		.id			= 2,
 		.iobase			= serial_iobase(2),
@@ -133,6 +172,7 @@ static struct serial8250_device devices[] = {
 			.data		= serial8250_generate_fdt_node,
 		},
 		.mutex			= MUTEX_INITIALIZER,
+		.txcond			= PTHREAD_COND_INITIALIZER,
 
 		.id			= 3,
 		.iobase			= serial_iobase(3),
@@ -142,41 +182,111 @@ static struct serial8250_device devices[] = {
 	},
 };
 
+static void *serial8250_tx_thread(void *param);
+
+/* Move the FIFO to the ring, as much of it as fits */
 static void serial8250_flush_tx(struct kvm *kvm, struct serial8250_device *dev)
 {
-	dev->lsr |= UART_LSR_TEMT | UART_LSR_THRE;
+	u32 space, off, n, done = 0;
 
-	if (dev->txcnt) {
-		term_putc(dev->txbuf, dev->txcnt, dev->id);
-		dev->txcnt = 0;
+	if (!dev->txcnt) {
+		dev->lsr |= UART_LSR_TEMT | UART_LSR_THRE;
+		return;
+	}
+
+	if (!dev->txring) {
+		dev->txring = malloc(SERIAL_TX_RING_SIZE);
+		if (!dev->txring ||
+		    kvm__start_device_thread(&dev->txthread,
+					     serial8250_tx_thread, dev)) {
+			/* Write it out ourselves then */
+			free(dev->txring);
+			dev->txring = NULL;
+			term_putc(dev->txbuf, dev->txcnt, dev->id);
+			dev->stats.tx_bytes += dev->txcnt;
+			dev->txcnt = 0;
+			dev->lsr |= UART_LSR_TEMT | UART_LSR_THRE;
+			return;
+		}
 	}
+
+	space = SERIAL_TX_RING_SIZE - (dev->txhead - dev->txtail);
+	while (done < (u32)dev->txcnt && space) {
+		off = dev->txhead & (SERIAL_TX_RING_SIZE - 1);
+		n = min(min(dev->txcnt - done, space), SERIAL_TX_RING_SIZE - off);
+		memcpy(dev->txring + off, dev->txbuf + done, n);
+		if (dev->txhead == dev->txtail)
+			pthread_cond_signal(&dev->txcond);
+		dev->txhead += n;
+		space -= n;
+		done += n;
+	}
+
+	dev->stats.tx_bytes += done;
+	dev->txcnt -= done;
+	if (!dev->txcnt) {
+		dev->lsr |= UART_LSR_TEMT | UART_LSR_THRE;
+		return;
+	}
+
+	/* The writer calls us again once there is room */
+	memmove(dev->txbuf, dev->txbuf + done, dev->txcnt);
+	dev->lsr &= ~(UART_LSR_TEMT | UART_LSR_THRE);
+	dev->stats.tx_stalls++;
 }
 
-static void serial8250_update_irq(struct kvm *kvm, struct serial8250_device *dev)
+/*
+ * With the FIFO enabled, received data only interrupts the guest once there
+ * is as much as the trigger level, or with the character timeout once the
+ * line went idle with less. UARTs wait four characters before the timeout,
+ * we know right away from the terminal having nothing more to read. A guest
+ * draining the FIFO in its handler then takes one interrupt for many
+ * characters of a paste or a stream, rather than one for each.
+ */
+static u8 serial8250_rx_iir(struct serial8250_device *dev)
 {
-	u8 iir = 0;
+	int trigger = 1;
+
+	if (dev->fcr & UART_FCR_ENABLE_FIFO)
+		trigger = serial8250_rx_trigger[dev->fcr >> 6];
+
+	if (dev->rxcnt - dev->rxdone >= trigger)
+		return UART_IIR_RDI;
+	if (dev->rxidle)
+		return UART_IIR_RX_TIMEOUT;
 
-	/* Handle clear rx */
-	if (dev->lcr & UART_FCR_CLEAR_RCVR) {
-		dev->lcr &= ~UART_FCR_CLEAR_RCVR;
+	return 0;
+}
+
+/* The FIFO resets clear themselves, the rest of FCR sticks */
+static void serial8250_write_fcr(struct serial8250_device *dev, u8 fcr)
+{
+	if (fcr & UART_FCR_CLEAR_RCVR) {
 		dev->rxcnt = dev->rxdone = 0;
-		dev->lsr &= ~UART_LSR_DR;
+		dev->lsr &= ~(UART_LSR_DR | UART_LSR_BI);
+		dev->rxstalled = false;
+		term_kick(dev->id);
 	}
 
-	/* Handle clear tx */
-	if (dev->lcr & UART_FCR_CLEAR_XMIT) {
-		dev->lcr &= ~UART_FCR_CLEAR_XMIT;
+	if (fcr & UART_FCR_CLEAR_XMIT) {
 		dev->txcnt = 0;
 		dev->lsr |= UART_LSR_TEMT | UART_LSR_THRE;
 	}
 
-	/* Data ready and rcv interrupt enabled ? */
+	dev->fcr = fcr & ~(UART_FCR_CLEAR_RCVR | UART_FCR_CLEAR_XMIT);
+}
+
+static void serial8250_update_irq(struct kvm *kvm, struct serial8250_device *dev)
+{
+	u8 iir = 0;
+
+	/* Data ready and rcv interrupt enabled ? It comes first */
 	if ((dev->ier & UART_IER_RDI) && (dev->lsr & UART_LSR_DR))
-		iir |= UART_IIR_RDI;
+		iir = serial8250_rx_iir(dev);
 
 	/* Transmitter empty and interrupt enabled ? */
-	if ((dev->ier & UART_IER_THRI) && (dev->lsr & UART_LSR_TEMT))
-		iir |= UART_IIR_THRI;
+	if (!iir && (dev->ier & UART_IER_THRI) && (dev->lsr & UART_LSR_TEMT))
+		iir = UART_IIR_THRI;
 
 	/* Now update the irq line, if necessary */
 	if (!iir) {
@@ -185,8 +295,11 @@ static void serial8250_update_irq(struct kvm *kvm, struct serial8250_device *dev
 			kvm__irq_line(kvm, dev->irq, 0);
 	} else {
 		dev->iir = iir;
-		if (!dev->irq_state)
+		if (!dev->irq_state) {
 			kvm__irq_line(kvm, dev->irq, 1);
+			if (iir != UART_IIR_THRI)
+				dev->stats.rx_irqs++;
+		}
 	}
 	dev->irq_state = iir;
 
@@ -199,6 +312,74 @@ static void serial8250_update_irq(struct kvm *kvm, struct serial8250_device *dev
 		serial8250_flush_tx(kvm, dev);
 }
 
+static void serial8250_account_tx(struct serial8250_device *dev, u32 bytes)
+{
+	u64 now = kvm_cpu__now();
+
+	dev->stats.tx_writes++;
+	dev->rate_bytes += bytes;
+
+	if (!dev->rate_start) {
+		dev->rate_start = now;
+	} else if (now - dev->rate_start >= NSEC_PER_SEC) {
+		dev->stats.tx_rate = dev->rate_bytes * NSEC_PER_SEC /
+				     (now - dev->rate_start);
+		dev->rate_start = now;
+		dev->rate_bytes = 0;
+	}
+}
+
+/* Drain the ring, a writev() of up to two pieces at a time */
+static void *serial8250_tx_thread(void *param)
+{
+	struct serial8250_device *dev = param;
+	struct iovec iov[2];
+	u32 off, len;
+	ssize_t r;
+	int cnt;
+
+	kvm__set_thread_name("serial-tx");
+
+	mutex_lock(&dev->mutex);
+	for (;;) {
+		if (dev->txhead == dev->txtail) {
+			if (dev->txstop)
+				break;
+			pthread_cond_wait(&dev->txcond, &dev->mutex.mutex);
+			continue;
+		}
+
+		off = dev->txtail & (SERIAL_TX_RING_SIZE - 1);
+		len = dev->txhead - dev->txtail;
+		iov[0].iov_base = dev->txring + off;
+		iov[0].iov_len = min(len, SERIAL_TX_RING_SIZE - off);
+		iov[1].iov_base = dev->txring;
+		iov[1].iov_len = len - iov[0].iov_len;
+		cnt = iov[1].iov_len ? 2 : 1;
+		mutex_unlock(&dev->mutex);
+
+		r = term_putc_iov(iov, cnt, dev->id);
+
+		mutex_lock(&dev->mutex);
+		if (r < 0 && errno == EINTR)
+			continue;
+		/* Like term_putc(), give up on what the terminal won't take */
+		if (r <= 0)
+			r = len;
+
+		dev->txtail += r;
+		serial8250_account_tx(dev, r);
+
+		if (dev->txcnt) {
+			serial8250_flush_tx(dev->kvm, dev);
+			serial8250_update_irq(dev->kvm, dev);
+		}
+	}
+	mutex_unlock(&dev->mutex);
+
+	return NULL;
+}
+
 #define SYSRQ_PENDING_NONE		0
 
 static int sysrq_pending;
@@ -207,6 +388,7 @@ static void serial8250__sysrq(struct kvm *kvm, struct serial8250_device *dev)
 {
 	dev->lsr |= UART_LSR_DR | UART_LSR_BI;
 	dev->rxbuf[dev->rxcnt++] = sysrq_pending;
+	dev->rxidle = true;
 	sysrq_pending	= SYSRQ_PENDING_NONE;
 }
 
@@ -218,50 +400,91 @@ static void serial8250__receive(struct kvm *kvm, struct serial8250_device *dev,
 	if (dev->mcr & UART_MCR_LOOP)
 		return;
 
-	if ((dev->lsr & UART_LSR_DR) || dev->rxcnt)
-		return;
-
+	/* The break goes with the character at the head of the FIFO */
 	if (handle_sysrq && sysrq_pending) {
-		serial8250__sysrq(kvm, dev);
+		if (!dev->rxcnt)
+			serial8250__sysrq(kvm, dev);
 		return;
 	}
 
 	if (kvm->cfg.active_console != CONSOLE_8250)
 		return;
 
-	while (term_readable(dev->id) &&
-	       dev->rxcnt < FIFO_LEN) {
+	/* Top the FIFO up behind what the guest hasn't read yet */
+	if (dev->rxdone) {
+		dev->rxcnt -= dev->rxdone;
+		memmove(dev->rxbuf, dev->rxbuf + dev->rxdone, dev->rxcnt);
+		dev->rxdone = 0;
+	}
 
+	while (dev->rxcnt < FIFO_LEN && term_readable(dev->id)) {
 		c = term_getc(kvm, dev->id);
 
 		if (c < 0)
 			break;
 		dev->rxbuf[dev->rxcnt++] = c;
 		dev->lsr |= UART_LSR_DR;
+		dev->stats.rx_bytes++;
 	}
+
+	dev->rxidle = dev->rxcnt < FIFO_LEN;
 }
 
-void serial8250__update_consoles(struct kvm *kvm)
+/* Keep the FIFO full, the guest makes room again in serial8250_rx() */
+static bool serial8250__read_term(struct kvm *kvm, int term)
 {
-	unsigned int i;
+	struct serial8250_device *dev = &devices[term];
+	bool more;
 
-	for (i = 0; i < ARRAY_SIZE(devices); i++) {
-		struct serial8250_device *dev = &devices[i];
+	mutex_lock(&dev->mutex);
 
-		mutex_lock(&dev->mutex);
+	/* Restrict sysrq injection to the first port */
+	serial8250__receive(kvm, dev, term == 0);
 
-		/* Restrict sysrq injection to the first port */
-		serial8250__receive(kvm, dev, i == 0);
+	serial8250_update_irq(kvm, dev);
 
-		serial8250_update_irq(kvm, dev);
+	more = kvm->cfg.active_console == CONSOLE_8250 &&
+	       dev->rxcnt - dev->rxdone < FIFO_LEN &&
+	       !(term == 0 && sysrq_pending);
+	dev->rxstalled = !more;
 
-		mutex_unlock(&dev->mutex);
-	}
+	mutex_unlock(&dev->mutex);
+
+	return more;
 }
 
 void serial8250__inject_sysrq(struct kvm *kvm, char sysrq)
 {
+	struct serial8250_device *dev = &devices[0];
+
 	sysrq_pending = sysrq;
+
+	mutex_lock(&dev->mutex);
+	serial8250__receive(kvm, dev, true);
+	serial8250_update_irq(kvm, dev);
+	mutex_unlock(&dev->mutex);
+}
+
+/*
+ * Without the THRE interrupt, the driver polls LSR before each write to THR
+ * and nothing else tells it about transmission. THR writes can then be posted,
+ * and console output is emulated in batches when LSR is read.
+ */
+static void serial8250_update_coalescing(struct kvm *kvm,
+					 struct serial8250_device *dev)
+{
+	bool coalesce = dev->can_coalesce && !(dev->ier & UART_IER_THRI);
+
+	if (coalesce == dev->coalesced)
+		return;
+
+	if (kvm__coalesce_iotrap(kvm, dev->iobase + UART_TX, 1,
+				 SERIAL8250_BUS_TYPE, coalesce) < 0) {
+		dev->can_coalesce = false;
+		return;
+	}
+
+	dev->coalesced = coalesce;
 }
 
 static bool serial8250_out(struct serial8250_device *dev, struct kvm_cpu *vcpu,
@@ -284,6 +507,7 @@ static bool serial8250_out(struct serial8250_device *dev, struct kvm_cpu *vcpu,
 			if (dev->rxcnt < FIFO_LEN) {
 				dev->rxbuf[dev->rxcnt++] = *addr;
 				dev->lsr |= UART_LSR_DR;
+				dev->rxidle = true;
 			}
 			break;
 		}
@@ -300,13 +524,15 @@ static bool serial8250_out(struct serial8250_device *dev, struct kvm_cpu *vcpu,
 		}
 		break;
 	case UART_IER:
-		if (!(dev->lcr & UART_LCR_DLAB))
+		if (!(dev->lcr & UART_LCR_DLAB)) {
 			dev->ier = ioport__read8(data) & 0x0f;
-		else
+			serial8250_update_coalescing(vcpu->kvm, dev);
+		} else {
 			dev->dlm = ioport__read8(data);
+		}
 		break;
 	case UART_FCR:
-		dev->fcr = ioport__read8(data);
+		serial8250_write_fcr(dev, ioport__read8(data));
 		break;
 	case UART_LCR:
 		dev->lcr = ioport__read8(data);
@@ -337,6 +563,8 @@ static bool serial8250_out(struct serial8250_device *dev, struct kvm_cpu *vcpu,
 
 static void serial8250_rx(struct serial8250_device *dev, void *data)
 {
+	int pending;
+
 	if (dev->rxdone == dev->rxcnt)
 		return;
 
@@ -348,9 +576,18 @@ static void serial8250_rx(struct serial8250_device *dev, void *data)
 	}
 
 	ioport__write8(data, dev->rxbuf[dev->rxdone++]);
-	if (dev->rxcnt == dev->rxdone) {
+	pending = dev->rxcnt - dev->rxdone;
+	if (!pending) {
 		dev->lsr &= ~UART_LSR_DR;
 		dev->rxcnt = dev->rxdone = 0;
+		if (dev->id == 0 && sysrq_pending)
+			serial8250__sysrq(dev->kvm, dev);
+	}
+
+	/* Refill before the guest runs dry, without a wakeup for each read */
+	if (dev->rxstalled && pending <= FIFO_LEN / 2) {
+		dev->rxstalled = false;
+		term_kick(dev->id);
 	}
 }
 
@@ -452,6 +689,91 @@ void serial8250_generate_fdt_node(void *fdt, struct device_header *dev_hdr,
 }
 #endif
 
+/* The registers and FIFOs of a port in a snapshot */
+struct serial8250_state {
+	u8	dll, dlm, iir, ier, fcr, lcr, mcr, lsr, msr, scr;
+	u8	irq_state;
+	u8	reserved;
+	u32	txcnt;
+	u32	rxcnt;
+	u32	rxdone;
+	char	txbuf[FIFO_LEN];
+	char	rxbuf[FIFO_LEN];
+};
+
+static int serial8250__save(struct kvm *kvm, struct snapshot *snap, void *data)
+{
+	struct serial8250_device *dev = data;
+	struct serial8250_state state;
+
+	mutex_lock(&dev->mutex);
+	state = (struct serial8250_state) {
+		.dll		= dev->dll,
+		.dlm		= dev->dlm,
+		.iir		= dev->iir,
+		.ier		= dev->ier,
+		.fcr		= dev->fcr,
+		.lcr		= dev->lcr,
+		.mcr		= dev->mcr,
+		.lsr		= dev->lsr,
+		.msr		= dev->msr,
+		.scr		= dev->scr,
+		.irq_state	= dev->irq_state,
+		.txcnt		= dev->txcnt,
+		.rxcnt		= dev->rxcnt,
+		.rxdone		= dev->rxdone,
+	};
+	memcpy(state.txbuf, dev->txbuf, FIFO_LEN);
+	memcpy(state.rxbuf, dev->rxbuf, FIFO_LEN);
+	mutex_unlock(&dev->mutex);
+
+	return snapshot__write(snap, &state, sizeof(state));
+}
+
+static int serial8250__restore(struct kvm *kvm, struct snapshot *snap,
+			       void *data)
+{
+	struct serial8250_device *dev = data;
+	struct serial8250_state state;
+	int r;
+
+	r = snapshot__read(snap, &state, sizeof(state));
+	if (r < 0)
+		return r;
+
+	if (state.txcnt > FIFO_LEN || state.rxcnt > FIFO_LEN ||
+	    state.rxdone > state.rxcnt)
+		return -EINVAL;
+
+	mutex_lock(&dev->mutex);
+	dev->dll	= state.dll;
+	dev->dlm	= state.dlm;
+	dev->iir	= state.iir;
+	dev->ier	= state.ier;
+	dev->fcr	= state.fcr;
+	dev->lcr	= state.lcr;
+	dev->mcr	= state.mcr;
+	dev->lsr	= state.lsr;
+	dev->msr	= state.msr;
+	dev->scr	= state.scr;
+	dev->irq_state	= state.irq_state;
+	dev->txcnt	= state.txcnt;
+	dev->rxcnt	= state.rxcnt;
+	dev->rxdone	= state.rxdone;
+	memcpy(dev->txbuf, state.txbuf, FIFO_LEN);
+	memcpy(dev->rxbuf, state.rxbuf, FIFO_LEN);
+	/* Whatever was received before goes to the guest without waiting */
+	dev->rxidle	= true;
+
+	serial8250_update_coalescing(kvm, dev);
+	if (dev->txcnt)
+		serial8250_flush_tx(kvm, dev);
+	serial8250_update_irq(kvm, dev);
+	mutex_unlock(&dev->mutex);
+
+	return 0;
+}
+
 static int serial8250__device_init(struct kvm *kvm,
 				   struct serial8250_device *dev)
 {
@@ -461,11 +783,55 @@ static int serial8250__device_init(struct kvm *kvm,
 	if (r < 0)
 		return r;
 
+	dev->kvm = kvm;
 	ioport__map_irq(&dev->irq);
 	r = kvm__register_iotrap(kvm, dev->iobase, 8, serial8250_mmio, dev,
 				 SERIAL8250_BUS_TYPE);
+	if (r < 0)
+		return r;
 
-	return r;
+	dev->can_coalesce = true;
+	serial8250_update_coalescing(kvm, dev);
+
+	term_set_reader(dev->id, serial8250__read_term);
+
+	dev->snapshot = (struct snapshot_handler) {
+		.save		= serial8250__save,
+		.restore	= serial8250__restore,
+		.data		= dev,
+	};
+	snprintf(dev->snapshot.name, sizeof(dev->snapshot.name), "8250-%u",
+		 dev->id);
+	snapshot__register(&dev->snapshot);
+
+	return 0;
+}
+
+static void serial8250__handle_stats(struct kvm *kvm, int fd, u32 type,
+				     u32 len, u8 *msg)
+{
+	struct serial8250_stats reply[ARRAY_SIZE(devices)];
+	u32 nr = ARRAY_SIZE(devices), i;
+	u64 now = kvm_cpu__now();
+
+	if (WARN_ON(type != KVM_IPC_SERIAL_STATS || len))
+		return;
+
+	for (i = 0; i < nr; i++) {
+		struct serial8250_device *dev = &devices[i];
+
+		mutex_lock(&dev->mutex);
+		reply[i] = dev->stats;
+		reply[i].tx_ring = dev->txhead - dev->txtail;
+		/* Nothing written for more than a window */
+		if (now - dev->rate_start >= 2 * NSEC_PER_SEC)
+			reply[i].tx_rate = 0;
+		mutex_unlock(&dev->mutex);
+	}
+
+	if (write_in_full(fd, &nr, sizeof(nr)) < 0 ||
+	    write_in_full(fd, reply, sizeof(reply)) < 0)
+		pr_warning("Failed sending serial stats");
 }
 
 int serial8250__init(struct kvm *kvm)
@@ -473,6 +839,11 @@ int serial8250__init(struct kvm *kvm)
 	unsigned int i, j;
 	int r = 0;
 
+	r = kvm_ipc__register_handler(KVM_IPC_SERIAL_STATS,
+				      serial8250__handle_stats);
+	if (r < 0)
+		return r;
+
 	for (i = 0; i < ARRAY_SIZE(devices); i++) {
 		struct serial8250_device *dev = &devices[i];
 
@@ -502,6 +873,17 @@ int serial8250__exit(struct kvm *kvm)
 	for (i = 0; i < ARRAY_SIZE(devices); i++) {
 		struct serial8250_device *dev = &devices[i];
 
+		/* Let the last words of the guest out */
+		mutex_lock(&dev->mutex);
+		dev->txstop = true;
+		pthread_cond_signal(&dev->txcond);
+		mutex_unlock(&dev->mutex);
+		if (dev->txring) {
+			pthread_join(dev->txthread, NULL);
+			free(dev->txring);
+			dev->txring = NULL;
+		}
+
 		r = kvm__deregister_iotrap(kvm, dev->iobase,
 					   SERIAL8250_BUS_TYPE);
 		if (r < 0)
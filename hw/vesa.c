@@ -72,8 +72,9 @@ struct framebuffer *vesa__init(struct kvm *kvm)
 	BUILD_BUG_ON(VESA_MEM_SIZE < VESA_BPP/8 * VESA_WIDTH * VESA_HEIGHT);
 
 	vesa_base_addr = pci_get_io_port_block(PCI_IO_SIZE);
-	r = kvm__register_pio(kvm, vesa_base_addr, PCI_IO_SIZE, vesa_pci_io,
-			      NULL);
+	/* Nothing is behind the I/O BAR, writes to it might as well be posted */
+	r = kvm__register_iotrap(kvm, vesa_base_addr, PCI_IO_SIZE, vesa_pci_io,
+				 NULL, DEVICE_BUS_IOPORT | IOTRAP_COALESCE);
 	if (r < 0)
 		goto out_error;
 
@@ -1,11 +1,23 @@
 #ifndef KVM__8250_SERIAL_H
 #define KVM__8250_SERIAL_H
 
+#include <linux/types.h>
+
 struct kvm;
 
+/* KVM_IPC_SERIAL_STATS replies with the number of ports, then these */
+struct serial8250_stats {
+	u64	tx_bytes;	/* Taken from the guest */
+	u64	tx_writes;	/* writev() calls to the terminal */
+	u64	tx_stalls;	/* Times the guest had to wait for room */
+	u64	tx_rate;	/* Bytes per second, over the last second */
+	u64	tx_ring;	/* Bytes waiting for the terminal */
+	u64	rx_bytes;	/* Given to the guest */
+	u64	rx_irqs;	/* Interrupts for received data */
+};
+
 int serial8250__init(struct kvm *kvm);
 int serial8250__exit(struct kvm *kvm);
-void serial8250__update_consoles(struct kvm *kvm);
 void serial8250__inject_sysrq(struct kvm *kvm, char sysrq);
 
 #endif /* KVM__8250_SERIAL_H */
@@ -0,0 +1,43 @@
+#ifndef KVM__BOOT_CACHE_H
+#define KVM__BOOT_CACHE_H
+
+#include <linux/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct kvm;
+
+/*
+ * --boot-cache <dir> keeps the device trees that lkvm run generates in
+ * <dir>, under a hash of what went into them, and later runs that hash the
+ * same load them into guest memory instead. boot_cache__key_init() hashes
+ * what all architectures depend on, the caller adds its own inputs.
+ */
+struct boot_cache_key {
+	u64	hash;
+	/* Without --boot-cache, nothing is hashed nor loaded */
+	bool	enabled;
+};
+
+void boot_cache__key_init(struct kvm *kvm, struct boot_cache_key *key);
+void boot_cache__key_add(struct boot_cache_key *key, const void *data,
+			 size_t len);
+void boot_cache__key_add_str(struct boot_cache_key *key, const char *str);
+
+#define boot_cache__key_add_val(key, val)				\
+	do {								\
+		typeof(val) __v = (val);				\
+		boot_cache__key_add(key, &__v, sizeof(__v));		\
+	} while (0)
+
+/* The length loaded into @buf, or a negative errno on a miss */
+ssize_t boot_cache__load(struct kvm *kvm, struct boot_cache_key *key,
+			 const char *what, void *buf, size_t size);
+/* @start is when generating @buf started, for the time later hits save */
+void boot_cache__store(struct kvm *kvm, struct boot_cache_key *key,
+		       const char *what, const void *buf, size_t len,
+		       u64 start);
+
+#endif /* KVM__BOOT_CACHE_H */
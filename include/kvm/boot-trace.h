@@ -0,0 +1,28 @@
+#ifndef KVM__BOOT_TRACE_H
+#define KVM__BOOT_TRACE_H
+
+#include <linux/types.h>
+
+#include <stdbool.h>
+
+struct kvm;
+
+/*
+ * --boot-trace records when the steps of starting the VM happen, from the
+ * start of lkvm run, and writes them out as a Chrome trace when it exits.
+ * Callers check boot_trace_enabled first, so tracing costs nothing without
+ * the option.
+ */
+extern bool boot_trace_enabled;
+/* Cleared once the first PIO and MMIO exits are both recorded */
+extern bool boot_trace_exits_pending;
+
+void boot_trace__start(struct kvm *kvm);
+/* A step that ran from @start to @end, in kvm_cpu__now() nanoseconds */
+void boot_trace__span(const char *cat, const char *name, u64 start, u64 end);
+/* Something that happened now */
+void boot_trace__mark(const char *cat, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+void boot_trace__first_exit(bool mmio, u64 addr);
+
+#endif /* KVM__BOOT_TRACE_H */
@@ -0,0 +1,9 @@
+#ifndef KVM__CPU_CMD_H
+#define KVM__CPU_CMD_H
+
+#include <kvm/util.h>
+
+int kvm_cmd_cpu(int argc, const char **argv, const char *prefix);
+void kvm_cpu_help(void) NORETURN;
+
+#endif
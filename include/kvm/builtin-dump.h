@@ -0,0 +1,9 @@
+#ifndef KVM__DUMP_CMD_H
+#define KVM__DUMP_CMD_H
+
+#include <kvm/util.h>
+
+int kvm_cmd_dump(int argc, const char **argv, const char *prefix);
+void kvm_dump_help(void) NORETURN;
+
+#endif
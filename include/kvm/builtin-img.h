@@ -0,0 +1,9 @@
+#ifndef KVM__IMG_H
+#define KVM__IMG_H
+
+#include <kvm/util.h>
+
+int kvm_cmd_img(int argc, const char **argv, const char *prefix);
+void kvm_img_help(void) NORETURN;
+
+#endif
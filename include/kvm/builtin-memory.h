@@ -0,0 +1,9 @@
+#ifndef KVM__MEMORY_CMD_H
+#define KVM__MEMORY_CMD_H
+
+#include <kvm/util.h>
+
+int kvm_cmd_memory(int argc, const char **argv, const char *prefix);
+void kvm_memory_help(void) NORETURN;
+
+#endif
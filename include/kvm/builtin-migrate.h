@@ -0,0 +1,9 @@
+#ifndef KVM__MIGRATE_CMD_H
+#define KVM__MIGRATE_CMD_H
+
+#include <kvm/util.h>
+
+int kvm_cmd_migrate(int argc, const char **argv, const char *prefix);
+void kvm_migrate_help(void) NORETURN;
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef KVM__PROFILE_CMD_H
+#define KVM__PROFILE_CMD_H
+
+#include <kvm/util.h>
+
+int kvm_cmd_profile(int argc, const char **argv, const char *prefix);
+void kvm_profile_help(void) NORETURN;
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef KVM__RATELIMIT_CMD_H
+#define KVM__RATELIMIT_CMD_H
+
+#include <kvm/util.h>
+
+int kvm_cmd_ratelimit(int argc, const char **argv, const char *prefix);
+void kvm_ratelimit_help(void) NORETURN;
+
+#endif
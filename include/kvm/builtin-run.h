@@ -7,5 +7,6 @@ int kvm_cmd_run(int argc, const char **argv, const char *prefix);
 void kvm_run_help(void) NORETURN;
 
 void kvm_run_set_wrapper_sandbox(void);
+void kvm_run_write_sandbox_cmd(const char *script, const char **argv, int argc);
 
 #endif
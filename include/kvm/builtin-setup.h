@@ -3,10 +3,14 @@
 
 #include <kvm/util.h>
 
+/* The lower directory shared by the rootfs made with setup --overlay */
+#define KVM_OVERLAY_BASE	"overlay-base"
+
 int kvm_cmd_setup(int argc, const char **argv, const char *prefix);
 void kvm_setup_help(void) NORETURN;
 int kvm_setup_create_new(const char *guestfs_name);
 void kvm_setup_resolv(const char *guestfs_name);
 int kvm_setup_guest_init(const char *guestfs_name);
+bool kvm_setup_overlay_lower(const char *guestfs_name, char *lower);
 
 #endif
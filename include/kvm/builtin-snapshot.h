@@ -0,0 +1,9 @@
+#ifndef KVM__SNAPSHOT_CMD_H
+#define KVM__SNAPSHOT_CMD_H
+
+#include <kvm/util.h>
+
+int kvm_cmd_snapshot(int argc, const char **argv, const char *prefix);
+void kvm_snapshot_help(void) NORETURN;
+
+#endif
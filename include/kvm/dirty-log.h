@@ -0,0 +1,36 @@
+#ifndef KVM__DIRTY_LOG_H
+#define KVM__DIRTY_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct kvm;
+struct kvm_cpu;
+
+/*
+ * Tracking of the guest RAM pages written between dirty_log__start() and
+ * dirty_log__stop(), in bitmaps of one bit per page from kvm->ram_start.
+ *
+ * KVM logs the writes of the vCPUs, in a ring per vCPU when the VM has them
+ * and in the bitmaps of the memory slots otherwise. The writes of devices to
+ * the buffers that the guest hands them are logged by dirty_log__mark().
+ */
+void dirty_log__enable_ring(struct kvm *kvm);
+bool dirty_log__has_ring(void);
+
+int dirty_log__start(struct kvm *kvm);
+void dirty_log__stop(struct kvm *kvm);
+long dirty_log__sync(struct kvm *kvm, unsigned long *bitmap);
+void dirty_log__sync_devices(unsigned long *bitmap);
+void dirty_log__ring_full(struct kvm_cpu *vcpu);
+
+extern unsigned long *dirty_log_devices;
+void __dirty_log__mark(const void *host, size_t len);
+
+static inline void dirty_log__mark(const void *host, size_t len)
+{
+	if (dirty_log_devices)
+		__dirty_log__mark(host, len);
+}
+
+#endif /* KVM__DIRTY_LOG_H */
@@ -2,8 +2,10 @@
 #define KVM__DISK_IMAGE_H
 
 #include "kvm/read-write.h"
+#include "kvm/disk-stats.h"
 #include "kvm/util.h"
 #include "kvm/parse-options.h"
+#include "kvm/ratelimit.h"
 
 #include <linux/types.h>
 #include <linux/fs.h>	/* for BLKGETSIZE64 */
@@ -20,6 +22,8 @@
 #include <fcntl.h>
 
 #ifdef CONFIG_HAS_AIO
+#include "kvm/mutex.h"
+
 #include <libaio.h>
 #endif
 
@@ -31,9 +35,53 @@ enum {
 	DISK_IMAGE_MMAP,
 };
 
-#define MAX_DISK_IMAGES         4
+/* Maximum number of requests collected by a plug before it is flushed */
+#define DISK_PLUG_MAX		256
+
+enum {
+	DISK_ENGINE_DEFAULT,
+	DISK_ENGINE_SYNC,
+	DISK_ENGINE_AIO,
+	DISK_ENGINE_IO_URING,
+};
+
+/* io_uring engine flags */
+#define DISK_ENGINE_F_SQPOLL	(1 << 0)
+#define DISK_ENGINE_F_FIXEDBUFS	(1 << 1)
+/* One ring for the disks on the same host device, see disk/uring.c */
+#define DISK_ENGINE_F_SHARED	(1 << 2)
+
+/* readahead=0 */
+#define DISK_READAHEAD_OFF	((u64)-1)
+
+/* Share of a disk in the ring it shares with others, weight= */
+#define DISK_WEIGHT_DEFAULT	100
+#define DISK_WEIGHT_MAX		1000
+
+/* What the guest's writes and flushes mean for the host, cachemode= */
+enum {
+	/* Writes land in the host page cache, flushes fsync the image */
+	DISK_CACHE_MODE_WRITEBACK,
+	/* Writes are O_DSYNC, the guest is told there is no write cache */
+	DISK_CACHE_MODE_WRITETHROUGH,
+	/* Flushes are ignored: fast, and lost on a host crash */
+	DISK_CACHE_MODE_UNSAFE,
+	/* O_DIRECT and O_DSYNC */
+	DISK_CACHE_MODE_DIRECTSYNC,
+};
+
+extern int disk_engine;
+extern unsigned int disk_engine_flags;
 
 struct disk_image;
+struct disk_direct;
+struct disk_flusher;
+struct disk_readahead;
+struct disk_sparse;
+struct disk_trace;
+struct disk_uring;
+struct disk_uring_member;
+struct kvm;
 
 struct disk_image_operations {
 	ssize_t (*read)(struct disk_image *disk, u64 sector, const struct iovec *iov,
@@ -41,17 +89,78 @@ struct disk_image_operations {
 	ssize_t (*write)(struct disk_image *disk, u64 sector, const struct iovec *iov,
 			int iovcount, void *param);
 	int (*flush)(struct disk_image *disk);
+	/* Complete param once the writes completed so far are stable */
+	int (*flush_async)(struct disk_image *disk, void *param);
+	int (*discard)(struct disk_image *disk, u64 sector, u64 nr_sectors);
+	int (*write_zeroes)(struct disk_image *disk, u64 sector, u64 nr_sectors,
+			    bool unmap);
 	int (*wait)(struct disk_image *disk);
+	int (*submit)(struct disk_image *disk);
 	int (*close)(struct disk_image *disk);
+	/* Start reading len bytes at offset into the host page cache */
+	int (*readahead)(struct disk_image *disk, u64 offset, u64 len);
 	bool async;
 };
 
+/*
+ * The layout of the storage under an image as far as the host knows it, in
+ * bytes with 0 when unknown, for virtio-blk to hint the guest with.
+ */
+struct disk_topology {
+	/* Writes smaller than this are read-modify-write below */
+	u32	phys_block_size;
+	/* Where the first physical block starts on the device */
+	u32	alignment_offset;
+	u32	min_io_size;
+	u32	opt_io_size;
+	/* Largest segment of a request, see the queue limits of the device */
+	u32	max_seg_size;
+};
+
+/* Larger st_blksize values are rather the optimal size of requests */
+#define DISK_MAX_PHYS_BLOCK	4096
+
 struct disk_image_params {
 	const char *filename;
 	/* wwpn == World Wide Port Number */
 	const char *wwpn;
+	/* Socket of a vhost-user-blk backend */
+	const char *vhost_user;
+	/* Show the image to the guest as virtio-scsi instead of virtio-blk */
+	bool scsi;
 	bool readonly;
 	bool direct;
+	/* Number of virtio-blk or virtio-scsi request queues, 0 picks one per vCPU */
+	int nr_queues;
+	bool pin_queues;
+	/* QCOW L2 table cache size in bytes, 0 for the default */
+	u64 l2_cache_size;
+	/* Map all QCOW clusters on open */
+	bool prealloc;
+	/* Longest busy-poll of the request queues, in microseconds */
+	u32 poll_us;
+	/* The --iothreads loop of the device, -1 to pick one */
+	int iothread;
+	/* Local file caching the blocks of the image, see disk/cache.c */
+	const char *cache;
+	bool cache_writeback;
+	/* Blocks to warm the cache up with, or where to record them */
+	const char *cache_trace;
+	/* Track the holes of raw images, see disk/sparse.c */
+	bool sparse;
+	/* Of the requests of the guest, all queues together */
+	struct ratelimit_params ratelimit;
+	/* Against the disks it shares an io_uring with, 0 for the default */
+	u32 weight;
+	/* Largest virtio-blk request queues, 0 for the default */
+	u32 queue_size;
+	int cache_mode;
+	/* Where to record the requests of the guest, see disk/trace.c */
+	const char *trace;
+	/* File with the AES-XTS key of the image, see disk/crypt.c */
+	const char *crypt_key;
+	/* Largest readahead window, 0 for the default, see disk/readahead.c */
+	u64 readahead;
 };
 
 struct disk_image {
@@ -61,24 +170,117 @@ struct disk_image {
 	void				*priv;
 	void				*disk_req_cb_param;
 	void				(*disk_req_cb)(void *param, long len);
+	void				*disk_batch_cb_param;
+	void				(*disk_batch_cb)(void *param);
 	bool				readonly;
 	bool				async;
 #ifdef CONFIG_HAS_AIO
+	/* The members below are set up by the first request */
+	bool				aio_started;
 	io_context_t			ctx;
 	int				evt;
 	pthread_t			thread;
 	u64				aio_inflight;
+	struct mutex			aio_lock;
+	int				aio_nr_pending;
+	struct iocb			*aio_pending;
+	/* IOCB_CMD_FDSYNC works on the image */
+	bool				aio_fdsync;
 #endif /* CONFIG_HAS_AIO */
+#ifdef CONFIG_HAS_IO_URING
+	struct disk_uring		*uring;
+	/* Set when the ring is shared with other disks */
+	struct disk_uring_member	*uring_member;
+#endif
 	const char			*wwpn;
+	const char			*vhost_user;
+	bool				scsi;
 	int				debug_iodelay;
+	int				nr_queues;
+	bool				pin_queues;
+	u32				poll_us;
+	int				iothread;
+	struct ratelimit_params		ratelimit;
+	u32				weight;
+	u32				queue_size;
+	int				cache_mode;
+	/* Runs the flushes that the backend can't issue asynchronously */
+	struct disk_flusher		*flusher;
+	/* Discard granularity in sectors, 0 if there is none */
+	u32				discard_sectors;
+	struct disk_topology		topology;
+	/* Host node of the device holding the image, -1 if unknown */
+	int				numa_node;
+	struct disk_stats		stats;
+	/* Alignment rules and bounce buffers when opened with O_DIRECT */
+	struct disk_direct		*direct;
+	/* What is known of the holes of a sparse raw image */
+	struct disk_sparse		*sparse;
+	/* Records of the requests of the guest, with trace= */
+	struct disk_trace		*trace;
+	/* The sequential streams of reads of the guest */
+	struct disk_readahead		*readahead;
+	/* Try reads inline with RWF_NOWAIT first, see raw_image__read_nowait() */
+	bool				nowait;
+	u32				nowait_skip;
+	u32				nowait_backoff;
+};
+
+struct disk_io {
+	bool				write;
+	u64				sector;
+	const struct iovec		*iov;
+	int				iovcount;
+	size_t				len;
+	void				*param;
+};
+
+/*
+ * While a plug is active, reads and writes issued by the plugging thread on
+ * plug->disk are only recorded. disk_image__unplug() merges requests that
+ * cover adjacent sectors and hands everything to the backend in one go.
+ */
+struct disk_plug {
+	struct disk_image		*disk;
+	int				nr;
+	struct disk_io			ios[DISK_PLUG_MAX];
+};
+
+struct disk_split_io {
+	void				*param;
+	long				len;
+	long				err;
+	/* Bytes the parts were asked for, and bytes they completed */
+	long				expected;
+	long				done;
+	int				pending;
 };
 
 int disk_img_name_parser(const struct option *opt, const char *arg, int unset);
+u64 disk_size_parser(const char *arg);
+int disk_engine_parser(const struct option *opt, const char *arg, int unset);
 int disk_image__init(struct kvm *kvm);
+int disk_image__close(struct disk_image *disk);
 int disk_image__exit(struct kvm *kvm);
 struct disk_image *disk_image__new(int fd, u64 size, struct disk_image_operations *ops, int mmap);
 int disk_image__flush(struct disk_image *disk);
+int disk_image__flush_async(struct disk_image *disk, void *param);
+bool disk_image__write_through(struct disk_image *disk);
+int disk_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors);
+int disk_image__write_zeroes(struct disk_image *disk, u64 sector,
+			     u64 nr_sectors, bool unmap);
 int disk_image__wait(struct disk_image *disk);
+int disk_image__submit(struct disk_image *disk);
+void disk_image__plug(struct disk_image *disk, struct disk_plug *plug);
+void disk_image__unplug(struct disk_plug *plug);
+void disk_image__batch_begin(struct disk_image *disk);
+void disk_image__batch_end(struct disk_image *disk);
+bool disk_image__batching(void);
+void disk_image__complete(struct disk_image *disk, void *param, long len);
+void disk_split_io__init(struct disk_split_io *split, void *param, long len);
+void *disk_split_io__get(struct disk_split_io *split, size_t len);
+void disk_split_io__put(struct disk_image *disk, struct disk_split_io *split,
+			long res);
 ssize_t disk_image__read(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
 ssize_t disk_image__write(struct disk_image *disk, u64 sector, const struct iovec *iov,
@@ -87,7 +289,13 @@ ssize_t disk_image__get_serial(struct disk_image *disk, struct iovec *iov,
 			       int iovcount, ssize_t len);
 
 struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly);
+struct disk_image_operations *raw_image__ops(bool readonly);
 struct disk_image *blkdev__probe(const char *filename, int flags, struct stat *st);
+void disk_image__file_topology(struct disk_image *disk, struct stat *st);
+struct disk_image *disk_cache__open(struct disk_image *backing,
+				    struct disk_image_params *params);
+struct disk_image *disk_crypt__open(struct disk_image *backing,
+				    struct disk_image_params *params);
 
 ssize_t raw_image__read_sync(struct disk_image *disk, u64 sector,
 			     const struct iovec *iov, int iovcount, void *param);
@@ -97,8 +305,33 @@ ssize_t raw_image__read_mmap(struct disk_image *disk, u64 sector,
 				const struct iovec *iov, int iovcount, void *param);
 ssize_t raw_image__write_mmap(struct disk_image *disk, u64 sector,
 				const struct iovec *iov, int iovcount, void *param);
+ssize_t raw_image__read_nowait(struct disk_image *disk, u64 sector,
+			       const struct iovec *iov, int iovcount);
 int raw_image__close(struct disk_image *disk);
+int raw_image__readahead(struct disk_image *disk, u64 offset, u64 len);
+int raw_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors);
+int raw_image__write_zeroes(struct disk_image *disk, u64 sector,
+			    u64 nr_sectors, bool unmap);
 void disk_image__set_callback(struct disk_image *disk, void (*disk_req_cb)(void *param, long len));
+void disk_image__set_batch_callback(struct disk_image *disk,
+				    void (*disk_batch_cb)(void *param),
+				    void *param);
+
+int disk_direct__init(struct disk_image *disk, struct stat *st);
+void disk_direct__exit(struct disk_image *disk);
+int disk_sparse__init(struct disk_image *disk);
+void disk_sparse__exit(struct disk_image *disk);
+bool disk_sparse__read(struct disk_image *disk, struct disk_io *io);
+bool disk_sparse__write(struct disk_image *disk, struct disk_io *io);
+void disk_sparse__forget(struct disk_image *disk, u64 sector, u64 nr_sectors);
+int disk_readahead__init(struct disk_image *disk, u64 max_window);
+void disk_readahead__exit(struct disk_image *disk);
+void disk_readahead__read(struct disk_image *disk, struct disk_io *io);
+u32 disk_direct__block_size(struct disk_image *disk);
+bool disk_direct__aligned(struct disk_image *disk, const struct iovec *iov,
+			  int iovcount);
+ssize_t disk_direct__bounce(struct disk_image *disk, bool write, u64 sector,
+			    const struct iovec *iov, int iovcount);
 
 #ifdef CONFIG_HAS_AIO
 int disk_aio_setup(struct disk_image *disk);
@@ -107,10 +340,13 @@ ssize_t raw_image__read_async(struct disk_image *disk, u64 sector,
 			      const struct iovec *iov, int iovcount, void *param);
 ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
 			       const struct iovec *iov, int iovcount, void *param);
+int raw_image__submit_async(struct disk_image *disk);
+int raw_image__flush_async(struct disk_image *disk, void *param);
 int raw_image__wait(struct disk_image *disk);
 
 #define raw_image__read		raw_image__read_async
 #define raw_image__write	raw_image__write_async
+#define raw_image__submit	raw_image__submit_async
 
 #else /* !CONFIG_HAS_AIO */
 static inline int disk_aio_setup(struct disk_image *disk)
@@ -126,8 +362,38 @@ static inline int raw_image__wait(struct disk_image *disk)
 {
 	return 0;
 }
+
+static inline int raw_image__submit(struct disk_image *disk)
+{
+	return 0;
+}
 #define raw_image__read		raw_image__read_sync
 #define raw_image__write	raw_image__write_sync
 #endif /* CONFIG_HAS_AIO */
 
+#ifdef CONFIG_HAS_IO_URING
+int disk_uring_setup(struct disk_image *disk);
+void disk_uring_destroy(struct disk_image *disk);
+void disk_uring_register_ram(struct disk_image *disk, struct kvm *kvm);
+ssize_t raw_image__read_uring(struct disk_image *disk, u64 sector,
+			      const struct iovec *iov, int iovcount, void *param);
+ssize_t raw_image__write_uring(struct disk_image *disk, u64 sector,
+			       const struct iovec *iov, int iovcount, void *param);
+int raw_image__submit_uring(struct disk_image *disk);
+int raw_image__flush_uring(struct disk_image *disk, void *param);
+int raw_image__wait_uring(struct disk_image *disk);
+#else /* !CONFIG_HAS_IO_URING */
+static inline int disk_uring_setup(struct disk_image *disk)
+{
+	return -ENOSYS;
+}
+static inline void disk_uring_destroy(struct disk_image *disk)
+{
+}
+static inline void disk_uring_register_ram(struct disk_image *disk,
+					   struct kvm *kvm)
+{
+}
+#endif /* CONFIG_HAS_IO_URING */
+
 #endif /* KVM__DISK_IMAGE_H */
@@ -0,0 +1,62 @@
+#ifndef KVM__DISK_STATS_H
+#define KVM__DISK_STATS_H
+
+#include <linux/types.h>
+#include <stddef.h>
+
+enum {
+	DISK_STATS_READ,
+	DISK_STATS_WRITE,
+	DISK_STATS_FLUSH,
+	DISK_STATS_NR_OPS,
+};
+
+/* Request sizes up to 4K, 16K, 64K, 256K and above */
+#define DISK_STATS_NR_SIZES	5
+
+/*
+ * Latencies are bucketed log-linearly: every power of two nanoseconds is
+ * split into DISK_STATS_SUB_BUCKETS equal steps, so a bucket is never more
+ * than 25% wide. The last bucket also counts anything above 2^48ns.
+ */
+#define DISK_STATS_SUB_BITS	2
+#define DISK_STATS_SUB_BUCKETS	(1 << DISK_STATS_SUB_BITS)
+#define DISK_STATS_NR_BUCKETS	(48 * DISK_STATS_SUB_BUCKETS)
+
+struct disk_stats_hist {
+	u64				count;
+	u64				total_ns;
+	u64				buckets[DISK_STATS_NR_BUCKETS];
+};
+
+/* Updated with atomic adds only, readers may see a slightly torn snapshot */
+struct disk_stats {
+	struct disk_stats_hist		hist[DISK_STATS_NR_OPS][DISK_STATS_NR_SIZES];
+	u64				bytes[DISK_STATS_NR_OPS];
+	/* O_DIRECT requests that had to go through a bounce buffer */
+	u64				bounced;
+	/* Reads tried inline with RWF_NOWAIT, and those the page cache served */
+	u64				nowait_reads;
+	u64				nowait_hits;
+	/*
+	 * Reads of sequential streams that had been read ahead of, those that
+	 * went past what had, and the bytes read ahead
+	 */
+	u64				ra_hits;
+	u64				ra_misses;
+	u64				ra_bytes;
+};
+
+/* KVM_IPC_DISK_STATS replies with a u32 count followed by that many of these */
+struct disk_stats_msg {
+	u32				index;
+	struct disk_stats		stats;
+};
+
+u64 disk_stats__now(void);
+void disk_stats__account(struct disk_stats *stats, int op, size_t len, u64 start);
+u64 disk_stats__bucket_ns(unsigned int bucket);
+u64 disk_stats__percentile(struct disk_stats_hist *hist, unsigned int pct);
+const char *disk_stats__size_name(unsigned int size);
+
+#endif /* KVM__DISK_STATS_H */
@@ -0,0 +1,49 @@
+#ifndef KVM__DISK_TRACE_H
+#define KVM__DISK_TRACE_H
+
+#include <linux/types.h>
+
+/*
+ * A trace is a header followed by one record per request, in the order they
+ * completed, in host byte order. lkvm bench disk --replay issues them again.
+ */
+#define DISK_TRACE_MAGIC	0x454341525442564bULL	/* "KVBTRACE" */
+#define DISK_TRACE_VERSION	1
+
+/* The first three are the DISK_STATS_* ops */
+enum {
+	DISK_TRACE_READ,
+	DISK_TRACE_WRITE,
+	DISK_TRACE_FLUSH,
+	DISK_TRACE_DISCARD,
+	DISK_TRACE_WRITE_ZEROES,
+	DISK_TRACE_NR_OPS,
+};
+
+struct disk_trace_header {
+	u64				magic;
+	u32				version;
+	u32				record_size;
+	/* Of the disk that the trace was recorded on, in bytes */
+	u64				size;
+};
+
+struct disk_trace_record {
+	/* Nanoseconds since the trace started */
+	u64				issue;
+	u64				complete;
+	u64				sector;
+	/* Bytes, 0 for flushes */
+	u32				len;
+	u16				op;
+	u16				queue;
+};
+
+struct disk_image;
+
+int disk_trace__open(struct disk_image *disk, const char *path);
+void disk_trace__record(struct disk_image *disk, int op, u64 sector, u32 len,
+			u64 start, u32 queue);
+void disk_trace__close(struct disk_image *disk);
+
+#endif /* KVM__DISK_TRACE_H */
@@ -0,0 +1,39 @@
+#ifndef KVM__DUMP_H
+#define KVM__DUMP_H
+
+#include <linux/types.h>
+
+#include <limits.h>
+
+#define DUMP_DEFAULT_THREADS		4
+#define DUMP_MAX_THREADS		16
+
+/* Copy RAM while the guest runs, pausing it only for the pages it dirtied */
+#define DUMP_F_LIVE			(1 << 0)
+/* Write the core as a gzip stream, the guest stays paused all along */
+#define DUMP_F_COMPRESS			(1 << 1)
+
+/*
+ * What "lkvm dump" sends to the instance, which writes the core itself. The
+ * reply is an s32 status, then a struct dump_stats when it is 0.
+ */
+struct dump_params {
+	char	path[PATH_MAX];
+	u32	flags;
+	u32	threads;
+};
+
+struct dump_stats {
+	u64	ram_bytes;
+	/* Left out of the file, or as holes in it */
+	u64	zero_bytes;
+	u64	written_bytes;
+	/* Of the pages dirtied while copying, with DUMP_F_LIVE */
+	u64	rewritten_bytes;
+	u32	rounds;
+	u32	reserved;
+	u64	pause_ns;
+	u64	total_ns;
+};
+
+#endif /* KVM__DUMP_H */
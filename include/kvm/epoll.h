@@ -1,3 +1,6 @@
+#ifndef KVM__EPOLL_H
+#define KVM__EPOLL_H
+
 #include <sys/epoll.h>
 #include "kvm/kvm.h"
 
@@ -15,3 +18,5 @@ struct kvm__epoll {
 int epoll__init(struct kvm *kvm, struct kvm__epoll *epoll,
 		const char *name, epoll__event_handler_t handle_event);
 int epoll__exit(struct kvm__epoll *epoll);
+
+#endif /* KVM__EPOLL_H */
@@ -0,0 +1,35 @@
+#ifndef KVM__EXIT_BENCH_H
+#define KVM__EXIT_BENCH_H
+
+/*
+ * With --exit-bench <n>, a device that the guest of tests/exit-bench drives
+ * through n accesses of each kind below, telling it when each run starts
+ * and stops. lkvm prints how long the accesses took once the guest is done,
+ * to compare changes to the way exits are dispatched. The guest includes
+ * this header as well.
+ */
+#define EXIT_BENCH_IOPORT		0x0520
+#define EXIT_BENCH_IOPORT_LEN		0x14
+
+/* 32-bit registers at EXIT_BENCH_IOPORT */
+#define EXIT_BENCH_REG_MMIO		0x00	/* in: address of the pages */
+#define EXIT_BENCH_REG_ITERATIONS	0x04	/* in: accesses per mode */
+#define EXIT_BENCH_REG_START		0x08	/* out: mode about to run */
+#define EXIT_BENCH_REG_STOP		0x0c	/* out: accesses it made */
+#define EXIT_BENCH_REG_PIO		0x10	/* the accesses of the PIO modes */
+
+/* Pages at EXIT_BENCH_REG_MMIO */
+#define EXIT_BENCH_MMIO			0x0000
+#define EXIT_BENCH_COALESCED		0x1000
+#define EXIT_BENCH_IOEVENTFD		0x2000
+#define EXIT_BENCH_MMIO_SIZE		0x4000
+
+#define EXIT_BENCH_MODE_PIO_OUT		0
+#define EXIT_BENCH_MODE_PIO_IN		1
+#define EXIT_BENCH_MODE_MMIO_WRITE	2
+#define EXIT_BENCH_MODE_MMIO_READ	3
+#define EXIT_BENCH_MODE_COALESCED	4
+#define EXIT_BENCH_MODE_IOEVENTFD	5
+#define EXIT_BENCH_NR_MODES		6
+
+#endif /* KVM__EXIT_BENCH_H */
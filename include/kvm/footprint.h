@@ -0,0 +1,26 @@
+#ifndef KVM__FOOTPRINT_H
+#define KVM__FOOTPRINT_H
+
+#include <linux/types.h>
+
+/* What the mappings of the lkvm process hold, by /proc/self/smaps */
+enum kvm_footprint_kind {
+	KVM_FOOTPRINT_RAM,		/* Guest RAM banks */
+	KVM_FOOTPRINT_DEVICE,		/* The other banks, pmem, shmem, VESA */
+	KVM_FOOTPRINT_STACKS,		/* Thread stacks */
+	KVM_FOOTPRINT_HEAP,		/* malloc() and other anonymous memory */
+	KVM_FOOTPRINT_CODE,		/* lkvm and the libraries */
+	KVM_FOOTPRINT_FILES,		/* Other shared file mappings */
+	KVM_FOOTPRINT_OTHER,		/* vdso and the like */
+	KVM_FOOTPRINT_NR,
+};
+
+/* The KVM_IPC_FOOTPRINT reply, in bytes */
+struct kvm_footprint {
+	u64	rss[KVM_FOOTPRINT_NR];
+	u64	size[KVM_FOOTPRINT_NR];
+	u32	nr_threads;
+	u32	nr_stacks;
+};
+
+#endif /* KVM__FOOTPRINT_H */
@@ -1,6 +1,8 @@
 #ifndef KVM__FRAMEBUFFER_H
 #define KVM__FRAMEBUFFER_H
 
+#include "kvm/mutex.h"
+
 #include <linux/types.h>
 #include <linux/list.h>
 
@@ -12,6 +14,14 @@ struct fb_target_operations {
 };
 
 #define FB_MAX_TARGETS			2
+#define FB_MAX_RECTS			16
+
+struct fb_rect {
+	u32				x;
+	u32				y;
+	u32				w;
+	u32				h;
+};
 
 struct framebuffer {
 	struct list_head		node;
@@ -26,10 +36,21 @@ struct framebuffer {
 
 	unsigned long			nr_targets;
 	struct fb_target_operations	*targets[FB_MAX_TARGETS];
+
+	/* Pages written by the guest, that each target hasn't redrawn yet */
+	bool				damage;
+	struct mutex			dirty_lock;
+	bool				dirty_log;
+	unsigned long			*log;
+	unsigned long			*dirty[FB_MAX_TARGETS];
+	bool				drawn[FB_MAX_TARGETS];
 };
 
 struct framebuffer *fb__register(struct framebuffer *fb);
 int fb__attach(struct framebuffer *fb, struct fb_target_operations *ops);
+int fb__get_dirty(struct framebuffer *fb, struct fb_target_operations *ops,
+		  struct fb_rect *rects, int max);
+void fb__damage(struct framebuffer *fb, u32 y, u32 h);
 int fb__init(struct kvm *kvm);
 int fb__exit(struct kvm *kvm);
 
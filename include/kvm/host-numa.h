@@ -0,0 +1,30 @@
+#ifndef KVM__HOST_NUMA_H
+#define KVM__HOST_NUMA_H
+
+#include <sched.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * The host nodes of the devices behind images, taps and assigned PCI
+ * functions, -1 when the host doesn't say. On hosts with more than one
+ * node, host_numa__bind_thread() and host_numa__zalloc() put the threads
+ * serving a device and the buffers they fill on the node of the device,
+ * unless --io-affinity already says where I/O goes or --no-device-numa.
+ */
+int host_numa__dev_node(const char *sysfs_dir);
+int host_numa__blkdev_node(dev_t dev);
+int host_numa__fd_node(int fd);
+int host_numa__netdev_node(const char *ifname);
+
+int host_numa__cpus(int node, cpu_set_t *set, size_t size);
+
+void host_numa__bind_thread(int node);
+/* Threads created in between, kernel vhost workers too, start on @node */
+cpu_set_t *host_numa__enter(int node);
+void host_numa__leave(cpu_set_t *saved);
+
+void host_numa__bind_mem(void *addr, size_t len, int node);
+void *host_numa__zalloc(size_t size, int node);
+
+#endif /* KVM__HOST_NUMA_H */
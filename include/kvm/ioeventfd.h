@@ -7,6 +7,7 @@
 #include "kvm/util.h"
 
 struct kvm;
+struct option;
 
 struct ioevent {
 	u64			io_addr;
@@ -23,9 +24,13 @@ struct ioevent {
 
 #define IOEVENTFD_FLAG_PIO		(1 << 0)
 #define IOEVENTFD_FLAG_USER_POLL	(1 << 1)
+/* Any write kicks, datamatch only tells the events apart for del_event */
+#define IOEVENTFD_FLAG_NO_DATAMATCH	(1 << 2)
 
+int ioeventfd_parser(const struct option *opt, const char *arg, int unset);
 int ioeventfd__init(struct kvm *kvm);
 int ioeventfd__exit(struct kvm *kvm);
+/* Takes ownership of ioevent->fd, which is closed on failure */
 int ioeventfd__add_event(struct ioevent *ioevent, int flags);
 int ioeventfd__del_event(u64 addr, u64 datamatch);
 
@@ -0,0 +1,25 @@
+#ifndef KVM__IOTHREAD_H
+#define KVM__IOTHREAD_H
+
+#include "kvm/kvm.h"
+
+struct iothread;
+
+/*
+ * A file descriptor watched by one of the --iothreads loops. handle() runs in
+ * that loop whenever fd is readable, so it must not block on fd.
+ */
+struct iothread_handler {
+	int		fd;
+	void		(*handle)(struct kvm *kvm, struct iothread_handler *handler);
+	struct iothread	*iothread;
+};
+
+int iothread__init(struct kvm *kvm);
+int iothread__exit(struct kvm *kvm);
+
+int iothread__pick(struct kvm *kvm, int iothread);
+int iothread__add(int iothread, struct iothread_handler *handler);
+void iothread__del(struct iothread_handler *handler);
+
+#endif /* KVM__IOTHREAD_H */
@@ -1,6 +1,11 @@
 #ifndef KVM_UTIL_IOVEC_H_
 #define KVM_UTIL_IOVEC_H_
 
+#include <linux/compiler.h>
+
+#include <string.h>
+#include <sys/uio.h>
+
 extern int memcpy_fromiovec(unsigned char *kdata, struct iovec *iov, int len);
 extern int memcpy_fromiovecend(unsigned char *kdata, const struct iovec *iov,
 				size_t offset, int len);
@@ -9,6 +14,8 @@ extern int memcpy_toiovecend(const struct iovec *v, unsigned char *kdata,
 				size_t offset, int len);
 ssize_t memcpy_fromiovec_safe(void *buf, struct iovec **iov, size_t len,
 			      size_t *iovcount);
+int iovec_window(struct iovec *dst, const struct iovec *src, int cnt,
+		 size_t skip, size_t count);
 
 static inline size_t iov_size(const struct iovec *iovec, size_t len)
 {
@@ -20,4 +27,62 @@ static inline size_t iov_size(const struct iovec *iovec, size_t len)
 	return size;
 }
 
+/*
+ * A position in an iovec array, which the copies below move forward without
+ * modifying the array, so that it can still be used afterwards. Copies that
+ * fit in the current element, as headers usually do, are inlined.
+ */
+struct iovec_cursor {
+	const struct iovec	*iov;
+	size_t			cnt;
+	/* Into iov[0], always below its length unless cnt is 0 */
+	size_t			off;
+};
+
+void __iovec_cursor__normalize(struct iovec_cursor *cur);
+size_t __iovec_cursor__to(struct iovec_cursor *cur, const void *buf,
+			  size_t len);
+size_t __iovec_cursor__from(struct iovec_cursor *cur, void *buf, size_t len);
+size_t iovec_cursor__skip(struct iovec_cursor *cur, size_t len);
+size_t iovec_cursor__copy(struct iovec_cursor *dst, struct iovec_cursor *src,
+			  size_t len);
+
+static inline void iovec_cursor__init(struct iovec_cursor *cur,
+				      const struct iovec *iov, size_t cnt)
+{
+	*cur = (struct iovec_cursor) {
+		.iov	= iov,
+		.cnt	= cnt,
+	};
+	__iovec_cursor__normalize(cur);
+}
+
+/* Copy @len bytes of @buf to the cursor, returns how many fitted */
+static inline size_t iovec_cursor__to(struct iovec_cursor *cur,
+				      const void *buf, size_t len)
+{
+	if (__builtin_expect(cur->cnt &&
+			     len < cur->iov->iov_len - cur->off, 1)) {
+		memcpy(cur->iov->iov_base + cur->off, buf, len);
+		cur->off += len;
+		return len;
+	}
+
+	return __iovec_cursor__to(cur, buf, len);
+}
+
+/* Copy @len bytes from the cursor to @buf, returns how many there were */
+static inline size_t iovec_cursor__from(struct iovec_cursor *cur, void *buf,
+					size_t len)
+{
+	if (__builtin_expect(cur->cnt &&
+			     len < cur->iov->iov_len - cur->off, 1)) {
+		memcpy(buf, cur->iov->iov_base + cur->off, len);
+		cur->off += len;
+		return len;
+	}
+
+	return __iovec_cursor__from(cur, buf, len);
+}
+
 #endif
@@ -11,27 +11,38 @@
 #include "kvm/msi.h"
 
 struct kvm;
+struct kvm_irq_routes;
 
 struct msi_routing_ops {
+	/* Optional, told about each route added or changed */
 	int (*update_route)(struct kvm *kvm, struct kvm_irq_routing_entry *);
+	/* Optional, hands the whole table to KVM after one or more changes */
+	int (*commit_routes)(struct kvm *kvm);
 	bool (*can_signal_msi)(struct kvm *kvm);
 	int (*signal_msi)(struct kvm *kvm, struct kvm_msi *msi);
 	int (*translate_gsi)(struct kvm *kvm, u32 gsi);
 };
 
 extern struct msi_routing_ops *msi_routing_ops;
-extern struct kvm_irq_routing *irq_routing;
-extern int next_gsi;
 
 int irq__alloc_line(void);
 int irq__get_nr_allocated_lines(void);
 
 int irq__init(struct kvm *kvm);
-int irq__exit(struct kvm *kvm);
 
-int irq__allocate_routing_entry(void);
+struct kvm_irq_routes *irq__new_routes(void);
+void irq__free_routes(struct kvm_irq_routes *routes);
+int irq__add_irqchip_route(struct kvm *kvm, u32 gsi, u32 irqchip, u32 pin);
+void irq__set_next_gsi(struct kvm *kvm, int gsi);
+int irq__set_routes(struct kvm *kvm);
 int irq__add_msix_route(struct kvm *kvm, struct msi_msg *msg, u32 device_id);
 void irq__update_msix_route(struct kvm *kvm, u32 gsi, struct msi_msg *msg);
+/* Left for the next irq__flush_routes(), so that a burst costs one commit */
+int irq__add_msix_route_deferred(struct kvm *kvm, struct msi_msg *msg,
+				 u32 device_id);
+void irq__update_msix_route_deferred(struct kvm *kvm, u32 gsi,
+				     struct msi_msg *msg);
+int irq__flush_routes(struct kvm *kvm);
 
 bool irq__can_signal_msi(struct kvm *kvm);
 int irq__signal_msi(struct kvm *kvm, struct kvm_msi *msi);
@@ -44,6 +55,15 @@ int irq__common_add_irqfd(struct kvm *kvm, unsigned int gsi, int trigger_fd,
 			   int resample_fd);
 void irq__common_del_irqfd(struct kvm *kvm, unsigned int gsi, int trigger_fd);
 
+/* Raise lines with an irqfd write, or return < 0 if KVM_IRQ_LINE is needed */
+int irq__irqfd_trigger(struct kvm *kvm, u32 gsi);
+int irq__irqfd_line(struct kvm *kvm, u32 gsi, int level);
+
+/* The GSI that irqfds take for a line of kvm__irq_line() */
+#ifndef irq__line_gsi
+#define irq__line_gsi(line)	(line)
+#endif
+
 #ifndef irq__add_irqfd
 #define irq__add_irqfd irq__common_add_irqfd
 #endif
@@ -0,0 +1,26 @@
+#ifndef KVM__KSM_H
+#define KVM__KSM_H
+
+#include "kvm/kvm-config.h"
+
+#include <linux/types.h>
+
+struct kvm;
+
+/* The KVM_IPC_KSM_STATS reply, from /proc/self/ksm_stat */
+struct kvm_ksm_stats {
+	u64	merging_pages;		/* Pages that KSM merged */
+	u64	zero_pages;		/* Merged with the zero page */
+	u64	rmap_items;
+	s64	profit;			/* Bytes saved less KSM metadata */
+	u32	available;		/* 0 without KSM stats in the kernel */
+	u32	merge_any;		/* PR_SET_MEMORY_MERGE is on */
+	s32	ksmd_run;		/* /sys/kernel/mm/ksm/run, or -1 */
+	u32	nr_banks;
+	u8	bank_merge[KVM_MAX_NUMA_BANKS];	/* enum kvm_mem_merge */
+};
+
+void ksm__enable_process(struct kvm *kvm);
+void ksm__setup_bank(struct kvm *kvm, void *addr, u64 size, int bank);
+
+#endif /* KVM__KSM_H */
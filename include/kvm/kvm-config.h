@@ -7,8 +7,16 @@
 
 #include <linux/sizes.h>
 
+#include <sched.h>
+
 #define DEFAULT_KVM_DEV		"/dev/kvm"
+/* lkvm-micro has no 8250 */
+#if defined(CONFIG_MICRO) && !defined(DEFAULT_CONSOLE)
+#define DEFAULT_CONSOLE		"virtio"
+#endif
+#ifndef DEFAULT_CONSOLE
 #define DEFAULT_CONSOLE		"serial"
+#endif
 #define DEFAULT_NETWORK		"user"
 #define DEFAULT_HOST_ADDR	"192.168.33.1"
 #define DEFAULT_GUEST_ADDR	"192.168.33.15"
@@ -19,24 +27,94 @@
 
 #define MIN_RAM_SIZE		SZ_64M
 
+/* RAM banks that --numa-node can place on different host nodes */
+#define KVM_MAX_NUMA_BANKS	8
+#define KVM_MAX_NUMA_NODE	1024
+
+enum kvm_mem_backend {
+	/* hugetlbfs if a path was given, else memfd if shared, else anon */
+	KVM_MEM_BACKEND_DEFAULT,
+	KVM_MEM_BACKEND_ANON,
+	KVM_MEM_BACKEND_THP,
+	KVM_MEM_BACKEND_HUGETLBFS,
+	KVM_MEM_BACKEND_MEMFD,
+};
+
+/* What KSM may do with the pages of a RAM bank, see --mem-merge */
+enum kvm_mem_merge {
+	KVM_MEM_MERGE_ON,
+	KVM_MEM_MERGE_NOHUGE,	/* Merged, and no transparent huge pages */
+	KVM_MEM_MERGE_OFF,
+};
+
+enum kvm_numa_policy {
+	KVM_NUMA_BIND,
+	KVM_NUMA_PREFERRED,
+	KVM_NUMA_INTERLEAVE,
+};
+
+/* A guest NUMA node given with --numa */
+struct kvm_numa_node {
+	u64 mem_size;
+	int first_cpu;
+	int last_cpu;
+	/* Host node its RAM and vCPUs are bound to, -1 if none */
+	int host_node;
+};
+
+/* A vCPU to host CPU pair given with --vcpu-affinity */
+struct kvm_vcpu_pin {
+	int vcpu;
+	int cpu;
+};
+
+/*
+ * Bounds of the balloon that --balloon-auto moves within, in MB, and the
+ * host memory pressure, in hundredths of a percent, that it reacts to.
+ */
+struct kvm_balloon_auto {
+	bool enabled;
+	u32 min_mb, max_mb;
+	/* Most it moves per interval */
+	u32 step_mb;
+	u32 interval_ms;
+	/* Memory the guest keeps available */
+	u32 reserve_mb;
+	u32 psi_high, psi_low;
+};
+
+/* Distances between guest nodes, as in the ACPI SLIT */
+#define KVM_NUMA_LOCAL_DISTANCE		10
+#define KVM_NUMA_REMOTE_DISTANCE	20
+
 struct kvm_config {
 	struct kvm_config_arch arch;
-	struct disk_image_params disk_image[MAX_DISK_IMAGES];
+	struct disk_image_params *disk_image;
 	struct vfio_device_params *vfio_devices;
 	u64 ram_addr;		/* Guest memory physical base address, in bytes */
 	u64 ram_size;		/* Guest memory size, in bytes */
 	u8 num_net_devices;
 	u8 num_vfio_devices;
+	/* Use iommufd and the device cdevs instead of a VFIO container */
+	bool vfio_iommufd;
+	/* Threads mapping guest RAM for DMA with iommufd, 0 for one per CPU */
+	int vfio_dma_threads;
 	u64 vsock_cid;
+	/* Forward guest vsock connections to unix sockets instead of vhost */
+	const char *vsock_uds;
 	bool virtio_rng;
 	bool nodefaults;
 	int active_console;
 	int debug_iodelay;
 	int nrcpus;
+	/* vCPUs created for "lkvm cpu add", nrcpus of them start at boot */
+	int max_cpus;
 	const char *kernel_cmdline;
 	const char *kernel_filename;
 	const char *vmlinux_filename;
 	const char *initrd_filename;
+	/* Map the kernel and initrd copy-on-write rather than reading them */
+	bool map_images;
 	const char *firmware_filename;
 	const char *flash_filename;
 	const char *console;
@@ -50,6 +128,18 @@ struct kvm_config {
 	const char *guest_name;
 	const char *sandbox;
 	const char *hugetlbfs_path;
+	/* Snapshot to start the guest from, see --restore */
+	const char *restore_dir;
+	/* Load its memory through userfaultfd rather than mapping it */
+	bool restore_uffd;
+	/* Snapshot to save once the guest has booted, see --template-save */
+	const char *template_save;
+	/* Address to receive a migrated guest on, see --incoming */
+	const char *incoming;
+	/* Address to serve the metrics on, see --metrics */
+	const char *metrics;
+	/* Refresh period of the status page, 0 to not publish one */
+	int status_interval_ms;
 	const char *custom_rootfs_name;
 	const char *real_cmdline;
 	struct virtio_net_params *net_params;
@@ -57,14 +147,71 @@ struct kvm_config {
 	bool vnc;
 	bool gtk;
 	bool sdl;
+	/* Show the UI a virtio-gpu scanout instead of the VESA framebuffer */
+	bool virtio_gpu;
+	/* Give the UI keyboard and pointer to virtio-input, not the i8042 */
+	bool virtio_input;
 	bool balloon;
+	/* Give the host the balloon pages with MADV_FREE */
+	bool balloon_lazy;
+	/* Memory that virtio-mem can plug into the guest, see --virtio-mem */
+	u64 virtio_mem_mb;
+	struct kvm_balloon_auto balloon_auto;
 	bool using_rootfs;
 	bool custom_rootfs;
+	/* Attribute cache of the 9p devices, see --9p-cache */
+	bool p9_cache;
+	bool p9_cache_loose;
+	u32 p9_cache_ttl_ms;
 	bool no_net;
 	bool no_dhcp;
 	bool ioport_debug;
 	bool mmio_debug;
+	bool startup_debug;
+	/* Chrome trace of the startup steps, see --boot-trace */
+	const char *boot_trace;
+	/* Where generated device trees are kept, see --boot-cache */
+	const char *boot_cache;
+	/* Accesses of each kind the guest of tests/exit-bench times */
+	int exit_bench;
+	bool mem_shared;
+	enum kvm_mem_backend mem_backend;
+	/* Fault in all of guest RAM before starting */
+	bool mem_prealloc;
+	/* Give RAM a guest_memfd for private pages, see --guest-memfd */
+	bool guest_memfd;
+	/* Huge page size for the memfd backend, 0 for normal pages */
+	u64 hugepage_size;
+	/* KSM of each RAM bank, the last one applies to later banks */
+	enum kvm_mem_merge mem_merge[KVM_MAX_NUMA_BANKS];
+	int nr_mem_merge;
+	/* PR_SET_MEMORY_MERGE, all of the process can be merged */
+	bool mem_merge_process;
+	/* Host node of each RAM bank, the last one applies to later banks */
+	int numa_nodes[KVM_MAX_NUMA_BANKS];
+	int nr_numa_nodes;
+	enum kvm_numa_policy numa_policy;
+	/* Topology shown to the guest, one RAM bank per node */
+	struct kvm_numa_node guest_numa[KVM_MAX_NUMA_BANKS];
+	int nr_guest_numa;
+	bool ioeventfd_strict;
+	/* Host CPUs of the vCPU threads and of all other threads, or NULL */
+	cpu_set_t *vcpu_affinity;
+	cpu_set_t *io_affinity;
+	/* Leave device threads and buffers off the node of their device */
+	bool no_device_numa;
+	/* Shared loops serving the virtqueues, 0 for a thread per queue */
+	int nr_iothreads;
+	/* vCPUs with a host CPU of their own, taking precedence */
+	struct kvm_vcpu_pin *vcpu_pins;
+	int nr_vcpu_pins;
+	/* SCHED_FIFO priority of the vCPU threads, 0 to keep SCHED_OTHER */
+	int vcpu_fifo_priority;
+	/* KVM_CAP_HALT_POLL of the VM, -1 for the host default */
+	int halt_poll_ns;
 	int virtio_transport;
+	/* Add the device of virtio-doorbell.h */
+	bool virtio_doorbell;
 };
 
 #endif
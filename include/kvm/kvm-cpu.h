@@ -3,12 +3,102 @@
 
 #include "kvm/kvm-cpu-arch.h"
 #include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* Exit reasons past the last one go in the last slot */
+#define KVM_CPU_NR_EXIT_REASONS	64
+
+/* Halts handled in the kernel, zero where KVM doesn't report them */
+struct kvm_cpu_halt_stats {
+	u64	polls;
+	u64	successful_polls;
+	u64	poll_ns;
+	u64	wakeups;
+	u64	wait_ns;
+};
+
+/*
+ * Exits of one vCPU and the time spent handling them in userspace, by exit
+ * reason. KVM_IPC_EXIT_STATS replies with a u32 count followed by that many,
+ * one per vCPU, then with a u32 count of struct kvm_iotrap_profile.
+ */
+struct kvm_cpu_exit_stats {
+	struct {
+		u64	count;
+		u64	ns;
+	} reasons[KVM_CPU_NR_EXIT_REASONS];
+	struct kvm_cpu_halt_stats halt;
+} __attribute__((aligned(64)));
 
 struct kvm_cpu_task {
 	void (*func)(struct kvm_cpu *vcpu, void *data);
 	void *data;
 };
 
+/*
+ * KVM_IPC_STEAL_STATS replies with the number of vCPUs, then the ns stolen
+ * from each, or this for those that don't account it.
+ */
+#define KVM_CPU_NO_STEAL_TIME	(~0ULL)
+
+/*
+ * KVM_IPC_VCPU_REGS replies with this, then a struct kvm_cpu_regs_record
+ * and its len bytes of registers for each vCPU. All were read during one
+ * pause of the guest, pause_ns long, or none if it was paused already.
+ */
+struct kvm_cpu_regs_head {
+	u32	nr;
+	u32	arch;
+	u64	pause_ns;
+};
+
+/*
+ * KVM_IPC_CPU_HOTPLUG starts a parked vCPU or parks a running one, cpu -1
+ * being the first parked or the last running, and replies with the status.
+ */
+#define KVM_CPU_HOTPLUG_ADD	1
+#define KVM_CPU_HOTPLUG_REMOVE	2
+
+struct kvm_cpu_hotplug_msg {
+	u32	op;
+	s32	cpu;
+};
+
+struct kvm_cpu_hotplug_reply {
+	s32	status;
+	s32	cpu;
+	u32	nr_online;
+	u32	nr_possible;
+};
+
+/* The arch of struct kvm_cpu_regs_head, 0 where registers can't be read */
+#define KVM_CPU_REGS_ARCH_X86	1
+
+#ifndef KVM_CPU_REGS_ARCH
+#define KVM_CPU_REGS_ARCH	0
+#endif
+
+/* Registers are the arch's struct kvm_cpu_arch_regs, status a -errno */
+struct kvm_cpu_regs_record {
+	u32	cpu;
+	s32	status;
+	u32	len;
+	u32	reserved;
+};
+
+#define KVM_CPU_REGS_MAX	4096
+
+/* Return addresses of the guest kernel followed for a profile sample */
+#define KVM_CPU_SAMPLE_FRAMES	32
+
+/* Where a vCPU was, pc[0], and where it was called from, innermost first */
+struct kvm_cpu_sample {
+	u64	pc[KVM_CPU_SAMPLE_FRAMES];
+	u32	nr;
+	bool	user;
+};
+
 int kvm_cpu__init(struct kvm *kvm);
 int kvm_cpu__exit(struct kvm *kvm);
 struct kvm_cpu *kvm_cpu__arch_init(struct kvm *kvm, unsigned long cpu_id);
@@ -18,6 +108,10 @@ void kvm_cpu__setup_cpuid(struct kvm_cpu *vcpu);
 void kvm_cpu__enable_singlestep(struct kvm_cpu *vcpu);
 void kvm_cpu__run(struct kvm_cpu *vcpu);
 int kvm_cpu__start(struct kvm_cpu *cpu);
+void *kvm_cpu__thread(void *arg);
+int kvm_cpu__arch_plug(struct kvm_cpu *vcpu);
+int kvm_cpu__arch_unplug(struct kvm_cpu *vcpu);
+bool kvm_cpu__arch_unplugged(struct kvm_cpu *vcpu);
 bool kvm_cpu__handle_exit(struct kvm_cpu *vcpu);
 int kvm_cpu__get_endianness(struct kvm_cpu *vcpu);
 
@@ -28,5 +122,21 @@ void kvm_cpu__show_registers(struct kvm_cpu *vcpu);
 void kvm_cpu__show_page_tables(struct kvm_cpu *vcpu);
 void kvm_cpu__arch_nmi(struct kvm_cpu *cpu);
 void kvm_cpu__run_on_all_cpus(struct kvm *kvm, struct kvm_cpu_task *task);
+void kvm_cpu__flush_coalesced_mmio(struct kvm *kvm);
+const char *kvm_cpu__exit_reason(u32 reason);
+ssize_t kvm_cpu__get_regs(struct kvm_cpu *vcpu, void *buf, size_t size);
+int kvm_cpu__get_sample(struct kvm_cpu *vcpu, struct kvm_cpu_sample *sample,
+			bool callchain);
+struct elf_prstatus;
+int kvm_cpu__get_prstatus(struct kvm_cpu *vcpu, struct elf_prstatus *prs);
+
+static inline u64 kvm_cpu__now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 #endif /* KVM__KVM_CPU_H */
@@ -13,6 +13,67 @@ enum {
 	KVM_IPC_STOP	= 6,
 	KVM_IPC_PID	= 7,
 	KVM_IPC_VMSTATE	= 8,
+	KVM_IPC_DISK_STATS	= 9,
+	KVM_IPC_NET_CAPTURE	= 10,
+	KVM_IPC_IOTRAP_STATS	= 11,
+	KVM_IPC_EXIT_STATS	= 12,
+	KVM_IPC_THREADPOOL_STATS	= 13,
+	KVM_IPC_BALLOON_HINT	= 14,
+	KVM_IPC_BALLOON_STATS	= 15,
+	KVM_IPC_SERIAL_STATS	= 16,
+	KVM_IPC_SNAPSHOT	= 17,
+	KVM_IPC_MIGRATE	= 18,
+	KVM_IPC_VIRTIO_MEM	= 19,
+	KVM_IPC_STEAL_STATS	= 20,
+	KVM_IPC_PROFILE	= 21,
+	KVM_IPC_VCPU_REGS	= 22,
+	KVM_IPC_KVM_STATS	= 23,
+	KVM_IPC_RATELIMIT	= 24,
+	KVM_IPC_DUMP	= 25,
+	KVM_IPC_NET_STATS	= 26,
+	KVM_IPC_SHMEM	= 27,
+	KVM_IPC_FOOTPRINT	= 28,
+	KVM_IPC_LOCK_STATS	= 29,
+
+	/* Handled by kvm-ipc.c itself, see struct kvm_ipc_frame */
+	KVM_IPC_HELLO	= 30,
+	KVM_IPC_CANCEL	= 31,
+
+	KVM_IPC_SNAPSHOT_LAYER	= 32,
+	KVM_IPC_CPU_HOTPLUG	= 33,
+	KVM_IPC_KSM_STATS	= 34,
+	KVM_IPC_VQ_STATS	= 35,
+};
+
+/*
+ * Version 1 is a struct kvm_ipc_head and its data per request, whose reply
+ * is whatever the handler writes back, in order.
+ *
+ * A client that sends KVM_IPC_HELLO with a struct kvm_ipc_hello gets one
+ * back with the version that the connection speaks from then on. With
+ * version 2, requests and replies are each a struct kvm_ipc_frame and its
+ * data. Requests run on worker threads and may be pipelined, their replies
+ * come back in any order with the id of the request. A request with
+ * KVM_IPC_F_REPEAT runs again every interval_ms, replying each time, until
+ * KVM_IPC_CANCEL with its id or the end of the connection.
+ */
+#define KVM_IPC_VERSION		2
+
+struct kvm_ipc_hello {
+	u32	version;
+	u32	reserved;
+};
+
+#define KVM_IPC_F_REPEAT	(1 << 0)
+
+struct kvm_ipc_frame {
+	u32	type;
+	u32	len;
+	u32	id;
+	u32	flags;
+	u32	interval_ms;
+	/* Of replies, 0 or a negative errno if no handler took the request */
+	s32	status;
 };
 
 int kvm_ipc__register_handler(u32 type, void (*cb)(struct kvm *kvm,
@@ -23,4 +84,11 @@ int kvm_ipc__exit(struct kvm *kvm);
 int kvm_ipc__send(int fd, u32 type);
 int kvm_ipc__send_msg(int fd, u32 type, u32 len, u8 *msg);
 
+int kvm_ipc__hello(int fd);
+int kvm_ipc__request(int fd, u32 type, u32 id, u32 interval_ms, u32 len,
+		     const void *msg);
+int kvm_ipc__cancel(int fd, u32 id);
+ssize_t kvm_ipc__read_reply(int fd, struct kvm_ipc_frame *frame, void **buf,
+			    size_t *size);
+
 #endif
@@ -0,0 +1,51 @@
+#ifndef KVM__KVM_STATS_H
+#define KVM__KVM_STATS_H
+
+#include <linux/types.h>
+
+struct kvm;
+
+/* One statistic, whose size values start at the index-th of the data */
+struct kvm_stat {
+	char	*name;
+	u32	flags;		/* KVM_STATS_TYPE_*, KVM_STATS_UNIT_*, ... */
+	s16	exponent;
+	u16	size;
+	u32	index;
+};
+
+/*
+ * The binary statistics that KVM keeps of the VM or of a vCPU, from
+ * KVM_GET_STATS_FD. The descriptors are parsed once, when the fd is opened,
+ * then reading all the values takes a single pread().
+ */
+struct kvm_stats {
+	int		fd;
+	u32		nr;
+	struct kvm_stat	*stats;
+	u32		data_offset;
+	u32		nr_values;
+};
+
+struct kvm_stats *kvm_stats__open(struct kvm *kvm, int fd);
+void kvm_stats__close(struct kvm_stats *stats);
+int kvm_stats__find(struct kvm_stats *stats, const char *name);
+int kvm_stats__read(struct kvm_stats *stats, u64 *values);
+
+/*
+ * KVM_IPC_KVM_STATS replies with a u32 count followed by that many, the
+ * statistics of the VM then of each vCPU. Histograms are left out.
+ */
+#define KVM_STATS_NAME_LEN	64
+#define KVM_STATS_VM		(~0U)
+
+struct kvm_stats_record {
+	char	name[KVM_STATS_NAME_LEN];
+	u32	vcpu;		/* KVM_STATS_VM for those of the VM */
+	u32	flags;
+	s32	exponent;
+	u32	reserved;
+	u64	value;
+};
+
+#endif /* KVM__KVM_STATS_H */
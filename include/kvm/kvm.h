@@ -35,6 +35,12 @@
  * a generous 4 bits for the bus mask here.
  */
 #define IOTRAP_BUS_MASK		0xf
+/*
+ * Writes to the trap are posted: KVM queues them in the coalesced ring and
+ * they are only emulated on the next exit of any vCPU, in order, before that
+ * exit is handled. Only suitable for registers whose writes have no effect
+ * the guest can observe until it reads something back from the device.
+ */
 #define IOTRAP_COALESCE		(1U << 4)
 
 #define DEFINE_KVM_EXT(ext)		\
@@ -42,6 +48,7 @@
 	.code = ext
 
 struct kvm_cpu;
+struct kvm_stats;
 typedef void (*mmio_handler_fn)(struct kvm_cpu *vcpu, u64 addr, u8 *data,
 				u32 len, u8 is_write, void *ptr);
 
@@ -74,6 +81,28 @@ struct kvm_mem_bank {
 	u64			size;
 	enum kvm_mem_type	type;
 	u32			slot;
+	/* Backing of the private pages with --guest-memfd, or -1 */
+	int			guest_memfd;
+};
+
+struct kvm_mem_range {
+	u64			guest_phys_addr;
+	u64			size;
+	void			*host_addr;
+};
+
+/*
+ * The banks sorted by guest address, for guest_flat_to_host() to look up
+ * without taking mem_banks_lock, and the ones backed by host memory sorted
+ * by host address for host_to_guest_flat(). Each change publishes a new map,
+ * and the old ones are only freed on exit.
+ */
+struct kvm_mem_map {
+	struct kvm_mem_map	*prev;
+	unsigned int		nr;
+	unsigned int		nr_host;
+	struct kvm_mem_range	**by_host;
+	struct kvm_mem_range	ranges[];
 };
 
 struct kvm {
@@ -83,15 +112,19 @@ struct kvm {
 	int			vm_fd;		/* For VM ioctls() */
 	timer_t			timerid;	/* Posix timer for interrupts */
 
-	int			nrcpus;		/* Number of cpus to run */
+	int			nrcpus;		/* Number of cpus, also those parked */
 	struct kvm_cpu		**cpus;
 
 	u32			mem_slots;	/* for KVM_SET_USER_MEMORY_REGION */
+	int			nr_ram_banks;	/* for --numa-node */
 	u64			ram_size;	/* Guest memory size, in bytes */
 	void			*ram_start;
 	u64			ram_pagesize;
+	int			ram_fd;		/* Backing file, with mem_shared */
+	void			*ram_fd_start;	/* Where ram_fd is mapped */
 	struct mutex		mem_banks_lock;
 	struct list_head	mem_banks;
+	struct kvm_mem_map	*mem_map;
 
 	bool			nmi_disabled;
 	bool			msix_needs_devid;
@@ -100,11 +133,18 @@ struct kvm {
 	struct disk_image       **disks;
 	int                     nr_disks;
 
+	/* Device state of this VM, rather than of the process */
+	struct kvm_iotraps	*iotraps;	/* See mmio.c */
+	struct kvm_irq_routes	*irq_routes;	/* See irq.c */
+	struct list_head	blk_devs;
+	struct list_head	net_devs;
+
 	int			vm_state;
+	u64			start_ns;	/* When lkvm run started */
 
-#ifdef KVM_BRLOCK_DEBUG
-	pthread_rwlock_t	brlock_sem;
-#endif
+	/* From KVM_GET_STATS_FD, NULL where KVM doesn't have them */
+	struct kvm_stats	*stats;
+	struct kvm_stats	**vcpu_stats;
 };
 
 void kvm__set_dir(const char *fmt, ...);
@@ -118,6 +158,9 @@ int kvm__get_vm_type(struct kvm *kvm);
 void kvm__init_ram(struct kvm *kvm);
 int kvm__exit(struct kvm *kvm);
 bool kvm__load_firmware(struct kvm *kvm, const char *firmware_filename);
+ssize_t kvm__load_image(struct kvm *kvm, int fd, off_t offset, void *dst,
+			size_t len);
+ssize_t kvm__read_image(struct kvm *kvm, int fd, void *dst, size_t max_size);
 bool kvm__load_kernel(struct kvm *kvm, const char *kernel_filename,
 			const char *initrd_filename, const char *kernel_cmdline);
 int kvm_timer__init(struct kvm *kvm);
@@ -129,6 +172,7 @@ bool kvm__emulate_mmio(struct kvm_cpu *vcpu, u64 phys_addr, u8 *data, u32 len, u
 int kvm__destroy_mem(struct kvm *kvm, u64 guest_phys, u64 size, void *userspace_addr);
 int kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size, void *userspace_addr,
 		      enum kvm_mem_type type);
+u64 kvm__mem_end(struct kvm *kvm, u64 align);
 static inline int kvm__register_ram(struct kvm *kvm, u64 guest_phys, u64 size,
 				    void *userspace_addr)
 {
@@ -136,6 +180,14 @@ static inline int kvm__register_ram(struct kvm *kvm, u64 guest_phys, u64 size,
 				 KVM_MEM_TYPE_RAM);
 }
 
+int kvm__register_numa_ram(struct kvm *kvm, u64 guest_phys, u64 size,
+			   void *userspace_addr);
+int kvm__set_dirty_log(struct kvm *kvm, u64 guest_phys, bool enable);
+int kvm__convert_mem(struct kvm *kvm, u64 gpa, u64 size, bool private);
+int kvm__get_dirty_log(struct kvm *kvm, u64 guest_phys, unsigned long *bitmap);
+u64 kvm__numa_node_mem(struct kvm *kvm, int node, u64 *offset);
+int kvm__numa_node_of_cpu(struct kvm *kvm, int cpu);
+
 static inline int kvm__register_dev_mem(struct kvm *kvm, u64 guest_phys,
 					u64 size, void *userspace_addr)
 {
@@ -149,6 +201,35 @@ static inline int kvm__reserve_mem(struct kvm *kvm, u64 guest_phys, u64 size)
 				 KVM_MEM_TYPE_RESERVED);
 }
 
+/*
+ * Lookups of I/O traps that the vCPU answered from its cache of recent hits,
+ * and those that needed a search of the bus. KVM_IPC_IOTRAP_STATS replies with
+ * a u32 count followed by that many, one per vCPU.
+ */
+enum {
+	KVM_IOTRAP_BUS_MMIO,
+	KVM_IOTRAP_BUS_PIO,
+	KVM_IOTRAP_NR_BUSES,
+};
+
+struct kvm_iotrap_stats {
+	struct {
+		u64	hits;
+		u64	misses;
+	} buses[KVM_IOTRAP_NR_BUSES];
+};
+
+/* Accesses to the trap starting at @addr and the time its handler took */
+struct kvm_iotrap_profile {
+	u64	addr;
+	u32	bus;
+	u32	pad;
+	u64	count;
+	u64	ns;
+};
+
+int kvm__get_iotrap_profile(struct kvm *kvm, struct kvm_iotrap_profile **profile);
+
 int __must_check kvm__register_iotrap(struct kvm *kvm, u64 phys_addr, u64 len,
 				      mmio_handler_fn mmio_fn, void *ptr,
 				      unsigned int flags);
@@ -169,7 +250,12 @@ int __must_check kvm__register_pio(struct kvm *kvm, u16 port, u16 len,
 				    DEVICE_BUS_IOPORT);
 }
 
+/* Add or remove a coalesced zone in part of a trap, for example one register */
+int kvm__coalesce_iotrap(struct kvm *kvm, u64 phys_addr, u64 len,
+			 unsigned int flags, bool coalesce);
 bool kvm__deregister_iotrap(struct kvm *kvm, u64 phys_addr, unsigned int flags);
+struct kvm_iotraps *kvm__new_iotraps(void);
+void kvm__free_iotraps(struct kvm_iotraps *traps);
 static inline bool kvm__deregister_mmio(struct kvm *kvm, u64 phys_addr)
 {
 	return kvm__deregister_iotrap(kvm, phys_addr, DEVICE_BUS_MMIO);
@@ -188,14 +274,13 @@ int kvm__enumerate_instances(int (*callback)(const char *name, int pid));
 void kvm__remove_socket(const char *name);
 
 void kvm__arch_validate_cfg(struct kvm *kvm);
-void kvm__arch_set_cmdline(char *cmdline, bool video);
+void kvm__arch_set_cmdline(struct kvm *kvm, char *cmdline, bool video);
 void kvm__arch_init(struct kvm *kvm);
 u64 kvm__arch_default_ram_address(void);
 void kvm__arch_delete_ram(struct kvm *kvm);
 int kvm__arch_setup_firmware(struct kvm *kvm);
 int kvm__arch_free_firmware(struct kvm *kvm);
 bool kvm__arch_cpu_supports_vm(void);
-void kvm__arch_read_term(struct kvm *kvm);
 
 #ifdef ARCH_HAS_CFG_RAM_ADDRESS
 static inline bool kvm__arch_has_cfg_ram_address(void)
@@ -209,6 +294,7 @@ static inline bool kvm__arch_has_cfg_ram_address(void)
 }
 #endif
 
+void *__guest_flat_to_host(struct kvm *kvm, u64 offset);
 void *guest_flat_to_host(struct kvm *kvm, u64 offset);
 u64 host_to_guest_flat(struct kvm *kvm, void *ptr);
 
@@ -252,9 +338,14 @@ static inline bool host_ptr_in_ram(struct kvm *kvm, void *p)
 bool kvm__supports_extension(struct kvm *kvm, unsigned int extension);
 bool kvm__supports_vm_extension(struct kvm *kvm, unsigned int extension);
 
-static inline void kvm__set_thread_name(const char *name)
-{
-	prctl(PR_SET_NAME, name);
-}
+void kvm__set_thread_name(const char *name);
+
+/*
+ * The stack of the threads that serve a device, which only ever run their own
+ * loop, rather than the 8MB default that the vCPUs and the thread pool keep.
+ */
+#define KVM_DEVICE_THREAD_STACK	(512 * 1024)
+
+int kvm__start_device_thread(pthread_t *thread, void *(*fn)(void *), void *arg);
 
 #endif /* KVM__KVM_H */
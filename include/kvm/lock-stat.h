@@ -0,0 +1,28 @@
+#ifndef KVM__LOCK_STAT_H
+#define KVM__LOCK_STAT_H
+
+#include <linux/types.h>
+
+#define KVM_LOCK_STAT_MAX	1024
+
+/*
+ * The KVM_IPC_LOCK_STATS reply is this header then @nr records, one per place
+ * that took a mutex. @enabled is clear unless lkvm was built with LOCK_STAT=1.
+ */
+struct kvm_lock_stat_hdr {
+	u32	enabled;
+	u32	nr;
+};
+
+struct kvm_lock_stat {
+	char	site[64];		/* file:line (function) */
+	u64	acquired;
+	u64	contended;		/* Acquisitions that had to wait */
+	u64	wait_ns;
+	u64	max_wait_ns;
+	u64	hold_ns;
+};
+
+u32 lock_stat__get(struct kvm_lock_stat *recs, u32 max);
+
+#endif /* KVM__LOCK_STAT_H */
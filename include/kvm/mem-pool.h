@@ -0,0 +1,35 @@
+#ifndef KVM__MEM_POOL_H
+#define KVM__MEM_POOL_H
+
+#include "kvm/mutex.h"
+
+#include <linux/types.h>
+#include <stddef.h>
+
+/*
+ * Objects of one size that are recycled rather than freed, for the requests
+ * of a device: up to max_free of those put back are kept for the next gets,
+ * so the pool grows to what is in flight at most and no further. The objects
+ * come back as they were left, not cleared.
+ */
+struct mem_pool {
+	struct mutex	lock;
+	void		*free;
+	size_t		size;
+	u32		nr_free;
+	u32		max_free;
+};
+
+#define MEM_POOL_INITIALIZER(_size, _max_free)				\
+	{								\
+		.lock		= MUTEX_INITIALIZER,			\
+		.size		= (_size),				\
+		.max_free	= (_max_free),				\
+	}
+
+void mem_pool__init(struct mem_pool *pool, size_t size, u32 max_free);
+void *mem_pool__get(struct mem_pool *pool);
+void mem_pool__put(struct mem_pool *pool, void *obj);
+void mem_pool__exit(struct mem_pool *pool);
+
+#endif /* KVM__MEM_POOL_H */
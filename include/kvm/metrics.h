@@ -0,0 +1,32 @@
+#ifndef KVM__METRICS_H
+#define KVM__METRICS_H
+
+#include <linux/list.h>
+#include <linux/types.h>
+
+struct kvm;
+struct metrics;
+
+/*
+ * The --metrics exporter serves the counters of the VM in the Prometheus
+ * text format. The counters stay wherever they are updated, per vCPU, per
+ * queue or per worker, with relaxed atomics or by their only writer. Each
+ * subsystem registers a collector that reads them on a scrape.
+ */
+struct metrics_collector {
+	void			(*collect)(struct kvm *kvm, struct metrics *m);
+	struct list_head	list;
+};
+
+void metrics__register(struct metrics_collector *collector);
+
+/* Starts the samples of a metric, type being "counter" or "gauge" */
+void metrics__family(struct metrics *m, const char *name, const char *type,
+		     const char *help);
+/* A sample of the last family, with labels of the form: key="value",... */
+void metrics__sample(struct metrics *m, u64 value, const char *labels, ...)
+	__attribute__((format(printf, 3, 4)));
+/* The only sample of the last family */
+void metrics__value(struct metrics *m, u64 value);
+
+#endif /* KVM__METRICS_H */
@@ -0,0 +1,27 @@
+#ifndef KVM__MIGRATE_H
+#define KVM__MIGRATE_H
+
+#include <linux/types.h>
+
+struct kvm;
+
+#define MIGRATE_DEFAULT_CHANNELS	4
+#define MIGRATE_MAX_CHANNELS		16
+#define MIGRATE_DEFAULT_DOWNTIME_MS	100
+
+/* What "lkvm migrate" sends to the source instance */
+struct migrate_params {
+	/* "tcp:<host>:<port>" or "unix:<path>" */
+	char	dest[256];
+	u32	channels;
+	/* Longest pause of the guest that pre-copy aims for */
+	u32	downtime_ms;
+	u8	zero_pages;
+	u8	compress;
+	u8	reserved[2];
+};
+
+int migrate__prepare_incoming(struct kvm *kvm);
+int migrate__incoming(struct kvm *kvm);
+
+#endif /* KVM__MIGRATE_H */
@@ -5,13 +5,40 @@
 
 #include "kvm/util.h"
 
+#include <linux/types.h>
+
 /*
  * Kernel-alike mutex API - to make it easier for kernel developers
  * to write user-space code! :-)
  */
 
+#ifdef CONFIG_LOCK_STAT
+/*
+ * With make LOCK_STAT=1, each place that takes a mutex counts its
+ * acquisitions, those that found the mutex taken, and the time spent waiting
+ * for it then holding it, which lkvm stat --locks shows.
+ */
+struct lock_stat_site {
+	const char		*file;
+	const char		*func;
+	int			line;
+	int			registered;
+	struct lock_stat_site	*next;
+	u64			acquired;
+	u64			contended;
+	u64			wait_ns;
+	u64			max_wait_ns;
+	u64			hold_ns;
+};
+#endif
+
 struct mutex {
 	pthread_mutex_t mutex;
+#ifdef CONFIG_LOCK_STAT
+	/* Of the current holder */
+	struct lock_stat_site	*site;
+	u64			acquired_at;
+#endif
 };
 #define MUTEX_INITIALIZER { .mutex = PTHREAD_MUTEX_INITIALIZER }
 
@@ -23,6 +50,22 @@ static inline void mutex_init(struct mutex *lock)
 		die("unexpected pthread_mutex_init() failure!");
 }
 
+#ifdef CONFIG_LOCK_STAT
+void lock_stat__lock(struct mutex *lock, struct lock_stat_site *site);
+void lock_stat__unlock(struct mutex *lock);
+
+#define mutex_lock(lock)						\
+	do {								\
+		static struct lock_stat_site __lock_site = {		\
+			.file	= __FILE__,				\
+			.func	= __func__,				\
+			.line	= __LINE__,				\
+		};							\
+		lock_stat__lock(lock, &__lock_site);			\
+	} while (0)
+
+#define mutex_unlock(lock)	lock_stat__unlock(lock)
+#else
 static inline void mutex_lock(struct mutex *lock)
 {
 	if (pthread_mutex_lock(&lock->mutex) != 0)
@@ -35,5 +78,6 @@ static inline void mutex_unlock(struct mutex *lock)
 	if (pthread_mutex_unlock(&lock->mutex) != 0)
 		die("unexpected pthread_mutex_unlock() failure!");
 }
+#endif /* CONFIG_LOCK_STAT */
 
 #endif /* KVM__MUTEX_H */
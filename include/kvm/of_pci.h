@@ -39,6 +39,6 @@ struct of_pci_ranges_entry {
 #define OF_PCI_SS_M32		2
 #define OF_PCI_SS_M64		3
 
-#define OF_PCI_IRQ_MAP_MAX	256	/* 5 bit device + 3 bit pin */
+#define OF_PCI_IRQ_MAP_MAX	256	/* One INTx# per device and function */
 
 #endif /* KVM__OF_PCI_H */
@@ -0,0 +1,45 @@
+#ifndef KVM__PCI_SHMEM_H
+#define KVM__PCI_SHMEM_H
+
+#include "kvm/parse-options.h"
+
+#include <linux/sizes.h>
+#include <linux/types.h>
+
+struct kvm;
+
+/*
+ * With --shmem, a PCI device laid out like QEMU's ivshmem-doorbell shares a
+ * memfd (or a hugetlbfs file) between the guest and host processes. BAR 2 is
+ * the memory, BAR 1 the MSI-X table and BAR 0 these registers, little-endian:
+ */
+#define PCI_SHMEM_INTR_MASK		0x00	/* RW, unused with MSI-X */
+#define PCI_SHMEM_INTR_STATUS		0x04	/* RW, unused with MSI-X */
+#define PCI_SHMEM_IV_POSITION		0x08	/* RO, PCI_SHMEM_PEER_GUEST */
+#define PCI_SHMEM_DOORBELL		0x0c	/* WO, peer << 16 | vector */
+#define PCI_SHMEM_REGS_SIZE		0x100
+
+/* The guest is peer 0, and it rings the host as peer 1 */
+#define PCI_SHMEM_PEER_GUEST		0
+#define PCI_SHMEM_PEER_HOST		1
+
+#define PCI_SHMEM_MAX_VECTORS		16
+/* What fits in the 32-bit PCI window of all architectures */
+#define PCI_SHMEM_MAX_SIZE		SZ_256M
+
+/*
+ * The reply to KVM_IPC_SHMEM, sent on a version 1 connection with SCM_RIGHTS
+ * for, in order: the memory, nr_vectors eventfds that the guest signals by
+ * ringing the host with vector n, and nr_vectors eventfds that raise vector n
+ * in the guest when the host writes them. Without fds if status is not 0.
+ */
+struct pci_shmem_info {
+	u64	size;
+	u32	nr_vectors;
+	s32	status;
+};
+
+int pci_shmem_parser(const struct option *opt, const char *arg, int unset);
+int pci_shmem__init(struct kvm *kvm);
+
+#endif /* KVM__PCI_SHMEM_H */
@@ -35,6 +35,35 @@
 #define PCI_IO_SIZE		0x100
 #define PCI_IOPORT_START	0x6200
 
+/*
+ * Devices fill the 32 slots of bus 0 first, then come back as functions 1-7
+ * of the same slots. Device n is at slot n % 32, function n / 32.
+ */
+#define PCI_MAX_SLOTS		32
+#define PCI_MAX_FUNCTIONS	8
+#define PCI_MAX_DEVICES		(PCI_MAX_SLOTS * PCI_MAX_FUNCTIONS)
+
+static inline u8 pci__dev_num(u8 slot, u8 fn)
+{
+	return slot + fn * PCI_MAX_SLOTS;
+}
+
+static inline u8 pci__dev_slot(u8 dev_num)
+{
+	return dev_num % PCI_MAX_SLOTS;
+}
+
+static inline u8 pci__dev_fn(u8 dev_num)
+{
+	return dev_num / PCI_MAX_SLOTS;
+}
+
+/* The devfn of the requester ID, as in MSI routes or device tree nodes */
+static inline u8 pci__devfn(u8 dev_num)
+{
+	return pci__dev_slot(dev_num) << 3 | pci__dev_fn(dev_num);
+}
+
 struct kvm;
 
 /*
@@ -149,6 +178,7 @@ struct virtio_caps {
 	struct virtio_pci_cap		isr;
 	struct virtio_pci_cap		device;
 	struct virtio_pci_cfg_cap	pci;
+	struct virtio_pci_cap64		shm;
 };
 
 struct pci_cap_hdr {
@@ -257,6 +287,8 @@ u16 pci_get_io_port_block(u32 size);
 int pci__assign_irq(struct pci_device_header *pci_hdr);
 void pci__config_wr(struct kvm *kvm, union pci_config_address addr, void *data, int size);
 void pci__config_rd(struct kvm *kvm, union pci_config_address addr, void *data, int size);
+void pci__restore_config(struct kvm *kvm, struct pci_device_header *pci_hdr,
+			 const void *config);
 
 void *pci_find_cap(struct pci_device_header *hdr, u8 cap_type);
 
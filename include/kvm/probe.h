@@ -0,0 +1,21 @@
+#ifndef KVM__PROBE_H
+#define KVM__PROBE_H
+
+/*
+ * Static tracepoints of the lkvm provider, for bpftrace and the like:
+ *
+ *	bpftrace -e 'usdt:./lkvm:lkvm:vcpu_exit { @[arg1] = count(); }'
+ *
+ * With sys/sdt.h each is a nop and an ELF note, which the tracer replaces with
+ * a breakpoint while attached. Without it they are compiled out, so that the
+ * arguments must not have side effects.
+ */
+#ifdef CONFIG_HAS_SDT
+#include <sys/sdt.h>
+
+#define kvm__probe(name, ...)	STAP_PROBEV(lkvm, name, ##__VA_ARGS__)
+#else
+#define kvm__probe(name, ...)	do { } while (0)
+#endif
+
+#endif /* KVM__PROBE_H */
@@ -0,0 +1,26 @@
+#ifndef KVM__PROFILE_H
+#define KVM__PROFILE_H
+
+#include <linux/types.h>
+
+#define PROFILE_DEFAULT_FREQ		99
+#define PROFILE_MAX_FREQ		1000
+#define PROFILE_DEFAULT_SECONDS		10
+#define PROFILE_MAX_SECONDS		3600
+
+/* Follow the frame pointers of the guest kernel */
+#define PROFILE_F_CALLCHAIN		(1 << 0)
+
+/*
+ * What "lkvm profile" sends to the instance. The reply is an s32 status,
+ * then a u32 length and that many bytes of folded stacks, a "vcpuN;outer;
+ * ...;inner count" line for each.
+ */
+struct profile_params {
+	u32	duration_ms;
+	u32	freq;
+	u32	flags;
+	u32	reserved;
+};
+
+#endif /* KVM__PROFILE_H */
@@ -2,6 +2,8 @@
 #define KVM__QCOW_H
 
 #include "kvm/mutex.h"
+#include "kvm/rwsem.h"
+#include "kvm/threadpool.h"
 
 #include <linux/types.h>
 #include <stdbool.h>
@@ -12,6 +14,7 @@
 
 #define QCOW1_VERSION		1
 #define QCOW2_VERSION		2
+#define QCOW3_VERSION		3
 
 #define QCOW1_OFLAG_COMPRESSED	(1ULL << 63)
 
@@ -22,24 +25,82 @@
 
 #define QCOW2_OFFSET_MASK	(~QCOW2_OFLAGS_MASK)
 
+/* Version 3 only: the cluster reads as zeroes */
+#define QCOW2_OFLAG_ZERO	(1ULL << 0)
+
+#define QCOW2_INCOMPAT_DIRTY		(1ULL << 0)
+#define QCOW2_INCOMPAT_CORRUPT		(1ULL << 1)
+#define QCOW2_INCOMPAT_COMPRESSION	(1ULL << 3)
+#define QCOW2_INCOMPAT_EXTL2		(1ULL << 4)
+#define QCOW2_INCOMPAT_SUPPORTED	(QCOW2_INCOMPAT_DIRTY | QCOW2_INCOMPAT_COMPRESSION | \
+					 QCOW2_INCOMPAT_EXTL2)
+
+/*
+ * With extended L2 entries, each entry is followed by a bitmap of its 32
+ * subclusters: the low half says which are allocated, the high half which
+ * read as zeroes. Those with neither read from the backing file.
+ */
+#define QCOW_EXTL2_SUBCLUSTER_SHIFT	5
+#define QCOW_EXTL2_SUBCLUSTERS		(1 << QCOW_EXTL2_SUBCLUSTER_SHIFT)
+#define QCOW_EXTL2_ALL_ALLOC		0xffffffffULL
+#define QCOW_EXTL2_ALL_ZERO		(QCOW_EXTL2_ALL_ALLOC << 32)
+/* Subclusters can't be smaller than a sector */
+#define QCOW_EXTL2_MIN_CLUSTER_BITS	14
+
+#define QCOW2_COMPRESSION_ZLIB	0
+#define QCOW2_COMPRESSION_ZSTD	1
+
 #define MAX_CACHE_NODES         32
 
+/* Number of L2 tables cached when no l2cache= size is given for the disk */
+#define QCOW_L2_CACHE_DEFAULT_TABLES	MAX_CACHE_NODES
+#define QCOW_L2_CACHE_MAX_SHARDS	16
+/* Don't split the cache in shards smaller than this many tables */
+#define QCOW_L2_CACHE_MIN_SHARD_TABLES	8
+
 struct qcow_l2_table {
 	u64				offset;
-	struct rb_node			node;
-	struct list_head		list;
+	struct hlist_node		node;
 	u8				dirty;
+	u8				referenced;
 	u64				table[];
 };
 
+/*
+ * Lookups only take the shard lock for reading. Inserting and evicting
+ * tables happens with q->mutex held as well, so code holding q->mutex can keep
+ * using a table after dropping the shard lock.
+ */
+struct qcow_l2_cache_shard {
+	pthread_rwlock_t		lock;
+	struct hlist_head		*buckets;
+	u32				bucket_mask;
+	/* CLOCK replacement ring */
+	struct qcow_l2_table		**slots;
+	u32				nr_slots;
+	u32				nr_cached;
+	u32				hand;
+};
+
 struct qcow_l1_table {
 	u32				table_size;
 	u64				*l1_table;
+	/* Of the private mapping behind l1_table, 0 if it was read */
+	size_t				map_size;
 
 	/* Level2 caching data structures */
-	struct rb_root			root;
-	struct list_head		lru_list;
-	int				nr_cached;
+	struct qcow_l2_cache_shard	*shards;
+	u32				nr_shards;
+};
+
+#define QCOW_DECOMP_CACHE_ENTRIES	16
+#define QCOW_DECOMP_WORKERS		4
+
+struct qcow_decomp_entry {
+	/* L2 entry of the compressed cluster, 0 if the slot is free */
+	u64				entry;
+	void				*data;
+	bool				referenced;
 };
 
 #define QCOW_REFCOUNT_BLOCK_SHIFT	1
@@ -56,6 +117,8 @@ struct qcow_refcount_block {
 struct qcow_refcount_table {
 	u32				rf_size;
 	u64				*rf_table;
+	/* Of the private mapping behind rf_table, 0 if it was read */
+	size_t				map_size;
 
 	/* Refcount block caching data structures */
 	struct rb_root			root;
@@ -71,6 +134,28 @@ struct qcow_header {
 	u8				l2_bits;
 	u64				refcount_table_offset;
 	u32				refcount_table_size;
+	u32				version;
+	u8				compression_type;
+	u64				incompatible_features;
+	u64				backing_file_offset;
+	u32				backing_file_size;
+};
+
+/* Backing files of backing files, and so on, up to this many */
+#define QCOW_MAX_BACKING_DEPTH		16
+
+/*
+ * The image that the unallocated clusters of a QCOW image read from, raw or
+ * QCOW itself. Backing files are only read, through a shared mapping when
+ * possible so that all the guests using one share it in the page cache.
+ */
+struct qcow_backing {
+	int				fd;
+	u64				size;
+	void				*map;
+	u64				map_size;
+	/* When the backing file is a QCOW image */
+	struct qcow			*q;
 };
 
 struct qcow {
@@ -84,10 +169,32 @@ struct qcow {
 	u32				version;
 	u64				cluster_size;
 	u64				cluster_offset_mask;
+	/* Extended L2 entries take two words instead of one */
+	bool				extended_l2;
+	u32				subcluster_bits;
 	u64				free_clust_idx;
-	void				*cluster_cache;
-	void				*cluster_data;
 	void				*copy_buff;
+	/* Where the next compressed cluster may go, packed after the last */
+	u64				compressed_next;
+
+	/* Recently decompressed clusters, replaced with CLOCK */
+	struct mutex			decomp_lock;
+	struct qcow_decomp_entry	decomp_cache[QCOW_DECOMP_CACHE_ENTRIES];
+	u32				decomp_hand;
+
+	/* Compressed reads handed to the thread pool by the async path */
+	struct mutex			decomp_work_lock;
+	struct list_head		decomp_work;
+	struct thread_pool__job		decomp_jobs[QCOW_DECOMP_WORKERS];
+	u32				decomp_next_job;
+	int				decomp_inflight;
+	/* Engine used for data reads, shared with raw images */
+	struct disk_image_operations	*engine_ops;
+
+	struct qcow_backing		*backing;
+	/* The file mapped by the image this one is the backing file of */
+	void				*map;
+	u64				map_size;
 };
 
 struct qcow1_header_disk {
@@ -128,6 +235,29 @@ struct qcow2_header_disk {
 	u64				snapshots_offset;
 };
 
-struct disk_image *qcow_probe(int fd, bool readonly);
+/* Follows struct qcow2_header_disk in version 3 images */
+struct qcow3_header_disk {
+	u64				incompatible_features;
+	u64				compatible_features;
+	u64				autoclear_features;
+
+	u32				refcount_order;
+	u32				header_length;
+
+	/* Only present if header_length covers it */
+	u8				compression_type;
+	u8				padding[7];
+};
+
+struct disk_image_operations;
+
+struct disk_image *qcow_probe(int fd, const char *filename, bool readonly,
+			      u64 l2_cache_size, bool prealloc);
+struct qcow *qcow_image(struct disk_image *disk);
+int qcow_create(int fd, u64 size, u32 cluster_bits, bool extended_l2,
+		int compression_type, const char *backing);
+int qcow_compress_cluster(struct disk_image *disk, const void *src, void *dst);
+int qcow_write_compressed(struct disk_image *disk, u64 offset,
+			  const void *buf, u32 len);
 
 #endif /* KVM__QCOW_H */
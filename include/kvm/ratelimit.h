@@ -0,0 +1,67 @@
+#ifndef KVM__RATELIMIT_H
+#define KVM__RATELIMIT_H
+
+#include "kvm/mutex.h"
+
+#include <linux/types.h>
+#include <stdbool.h>
+
+/* Rates are per second, zero for no limit */
+struct ratelimit_params {
+	u64	bytes;
+	u64	ops;
+	/* How long a device that was idle may go at full speed */
+	u32	burst_ms;
+	u32	reserved;
+};
+
+#define RATELIMIT_DEFAULT_BURST_MS	100
+#define RATELIMIT_MAX_BURST_MS		10000
+/* Higher rates are taken as this, 16GB/s or 16G operations/s */
+#define RATELIMIT_MAX_RATE		(1ULL << 34)
+
+/*
+ * A token bucket of bytes and one of operations. The tokens are kept as the
+ * time they are worth at the rate, which the clock refills up to burst_ms.
+ * Work is charged after the fact, so that it is never split, and the next
+ * is delayed until neither bucket is in debt.
+ */
+struct ratelimit_bucket {
+	u64	rate;
+	/* Nanoseconds of credit, negative once the work went past the rate */
+	s64	credit_ns;
+};
+
+struct ratelimit {
+	struct mutex		lock;
+	bool			enabled;
+	u64			burst_ns;
+	u64			last;
+	struct ratelimit_bucket	bytes;
+	struct ratelimit_bucket	ops;
+};
+
+void ratelimit__init(struct ratelimit *rl, struct ratelimit_params *params);
+void ratelimit__set(struct ratelimit *rl, struct ratelimit_params *params);
+u64 ratelimit__delay(struct ratelimit *rl);
+void ratelimit__charge(struct ratelimit *rl, u64 bytes, u64 ops);
+int ratelimit__arm(int timerfd, u64 ns);
+u64 ratelimit__parse_rate(const char *val);
+
+static inline bool ratelimit__enabled(struct ratelimit *rl)
+{
+	return __atomic_load_n(&rl->enabled, __ATOMIC_RELAXED);
+}
+
+/* KVM_IPC_RATELIMIT changes the limits of a device, and replies with an s32 */
+#define RATELIMIT_DEV_BLK		0
+#define RATELIMIT_DEV_NET		1
+
+struct ratelimit_msg {
+	u32			dev_type;
+	/* In the order of the --disk or --network options */
+	u32			dev;
+	struct ratelimit_params	params;
+};
+
+#endif /* KVM__RATELIMIT_H */
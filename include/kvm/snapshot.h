@@ -0,0 +1,58 @@
+#ifndef KVM__SNAPSHOT_H
+#define KVM__SNAPSHOT_H
+
+#include <linux/list.h>
+#include <linux/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct kvm;
+struct kvm_cpu;
+struct snapshot;
+
+/*
+ * A device with state to keep across a snapshot registers a handler. Its
+ * state is saved in a section named after the handler, which must be unique
+ * and the same for the same command line.
+ */
+struct snapshot_handler {
+	char			name[32];
+	/* Append the state with snapshot__write() */
+	int			(*save)(struct kvm *kvm, struct snapshot *snap,
+					void *data);
+	/* Read it back, in the same order, with snapshot__read() */
+	int			(*restore)(struct kvm *kvm, struct snapshot *snap,
+					   void *data);
+	/* The guest is about to run again, after saving or restoring */
+	void			(*resume)(struct kvm *kvm, void *data);
+	void			*data;
+	struct list_head	list;
+};
+
+void snapshot__register(struct snapshot_handler *handler);
+void snapshot__block(const char *reason);
+bool snapshot__blocked(void);
+
+int snapshot__write(struct snapshot *snap, const void *buf, size_t len);
+int snapshot__read(struct snapshot *snap, void *buf, size_t len);
+
+/* Offsets of the pages that a restored guest faulted first */
+#define SNAPSHOT_WORKINGSET	"workingset"
+
+int snapshot__stop(struct kvm *kvm);
+void snapshot__start(struct kvm *kvm);
+int snapshot__capture(struct kvm *kvm, void **buf, size_t *len);
+int snapshot__load(struct kvm *kvm, void *buf, size_t len);
+
+int snapshot__save(struct kvm *kvm, const char *dir, bool incremental);
+int snapshot__prepare_restore(struct kvm *kvm);
+int snapshot__restore(struct kvm *kvm);
+int snapshot__uffd_map_ram(struct kvm *kvm, const char *dir, int fd);
+
+int kvm__arch_save_state(struct kvm *kvm, struct snapshot *snap);
+int kvm__arch_restore_state(struct kvm *kvm, struct snapshot *snap);
+int kvm_cpu__arch_save_state(struct kvm_cpu *vcpu, struct snapshot *snap);
+int kvm_cpu__arch_restore_state(struct kvm_cpu *vcpu, struct snapshot *snap);
+
+#endif /* KVM__SNAPSHOT_H */
@@ -0,0 +1,14 @@
+#ifndef KVM__SOCKET_H
+#define KVM__SOCKET_H
+
+#include <stdbool.h>
+
+/*
+ * A stream socket connected to, or listening with @backlog on, the address
+ * of a command line option: "tcp:<host>:<port>" or "unix:<path>". Returns
+ * the fd or a negative errno.
+ */
+int socket__open(const char *addr, bool listening, int backlog);
+int socket__set_nodelay(int fd);
+
+#endif /* KVM__SOCKET_H */
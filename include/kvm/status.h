@@ -0,0 +1,46 @@
+#ifndef KVM__STATUS_H
+#define KVM__STATUS_H
+
+#include "kvm/disk-stats.h"
+
+#include <linux/types.h>
+
+struct kvm;
+
+#define KVM_STATUS_SUFFIX	".status"
+#define KVM_STATUS_MAGIC	0x534d564b	/* "KVMS" */
+#define KVM_STATUS_VERSION	1
+
+/*
+ * The <guest>.status file next to the IPC socket, that monitors mmap() read
+ * only. The page is refreshed every --status-interval and when the guest is
+ * paused or resumed, under a sequence count that is odd while it changes.
+ * New fields go at the end, readers check @size to find them.
+ */
+struct kvm_status_page {
+	u32	magic;
+	u32	version;
+	u32	size;
+	u32	seq;
+	u64	pid;
+	/* CLOCK_MONOTONIC of the last refresh, to spot a stuck instance */
+	u64	updated_ns;
+	u32	state;				/* KVM_VMSTATE_* */
+	u32	nr_cpus;
+	u64	ram_size;
+	/* Memory the balloon took from the guest */
+	u64	balloon_bytes;
+	/* Totals of all the disks, and of all the network queues */
+	u64	disk_ops[DISK_STATS_NR_OPS];
+	u64	disk_bytes[DISK_STATS_NR_OPS];
+	u64	net_rx_packets;
+	u64	net_rx_bytes;
+	u64	net_tx_packets;
+	u64	net_tx_bytes;
+	u64	net_drops;
+};
+
+void kvm_status__update(struct kvm *kvm);
+int kvm_status__read(const char *name, struct kvm_status_page *status);
+
+#endif /* KVM__STATUS_H */
@@ -13,6 +13,7 @@ struct kvm;
 int symbol_init(struct kvm *kvm);
 int symbol_exit(struct kvm *kvm);
 char *symbol_lookup(struct kvm *kvm, unsigned long addr, char *sym, size_t size);
+char *symbol_lookup_func(struct kvm *kvm, unsigned long addr, char *sym, size_t size);
 
 #else
 
@@ -23,6 +24,10 @@ static inline char *symbol_lookup(struct kvm *kvm, unsigned long addr, char *sym
 	sym[size - 1] = '\0';
 	return s;
 }
+static inline char *symbol_lookup_func(struct kvm *kvm, unsigned long addr, char *sym, size_t size)
+{
+	return NULL;
+}
 static inline int symbol_exit(struct kvm *kvm) { return 0; }
 
 #endif
@@ -12,12 +12,17 @@
 
 #define TERM_MAX_DEVS	4
 
+/* Reads what it can from @term, returns whether it can take more already */
+typedef bool (*term_reader_fn)(struct kvm *kvm, int term);
+
 int term_putc_iov(struct iovec *iov, int iovcnt, int term);
 int term_getc_iov(struct kvm *kvm, struct iovec *iov, int iovcnt, int term);
 int term_putc(char *addr, int cnt, int term);
 int term_getc(struct kvm *kvm, int term);
 
 bool term_readable(int term);
+void term_set_reader(int term, term_reader_fn reader);
+void term_kick(int term);
 int tty_parser(const struct option *opt, const char *arg, int unset);
 
 #endif /* KVM__TERM_H */
@@ -4,8 +4,10 @@
 #include "kvm/mutex.h"
 
 #include <linux/list.h>
+#include <linux/types.h>
 
 struct kvm;
+struct thread_pool__worker;
 
 typedef void (*kvm_thread_callback_fn_t)(struct kvm *kvm, void *data);
 
@@ -15,9 +17,25 @@ struct thread_pool__job {
 	void				*data;
 
 	int				signalcount;
-	struct mutex			mutex;
+	/* Preferred worker, or -1 for any */
+	int				worker_hint;
 
+	/* The worker whose queue holds the job, protected by its lock */
+	struct thread_pool__worker	*worker;
 	struct list_head		queue;
+	u64				queued_ns;
+};
+
+/* Counters of one worker, as sent by the KVM_IPC_THREADPOOL_STATS reply */
+struct thread_pool__stats {
+	u64	jobs;
+	/* Jobs taken from the queue of another worker */
+	u64	stolen;
+	u64	depth;
+	u64	max_depth;
+	/* Time spent in the queue, and running */
+	u64	wait_ns;
+	u64	run_ns;
 };
 
 static inline void thread_pool__init_job(struct thread_pool__job *job, struct kvm *kvm, kvm_thread_callback_fn_t callback, void *data)
@@ -26,11 +44,20 @@ static inline void thread_pool__init_job(struct thread_pool__job *job, struct kv
 		.kvm		= kvm,
 		.callback	= callback,
 		.data		= data,
-		.mutex		= MUTEX_INITIALIZER,
+		.worker_hint	= -1,
 	};
 	INIT_LIST_HEAD(&job->queue);
 }
 
+/*
+ * Queue the job on a given worker, modulo the number of workers, so that
+ * related jobs share a cache or unrelated ones don't wait behind each other.
+ */
+static inline void thread_pool__set_job_worker(struct thread_pool__job *job, int worker)
+{
+	job->worker_hint = worker;
+}
+
 int thread_pool__init(struct kvm *kvm);
 int thread_pool__exit(struct kvm *kvm);
 
@@ -3,13 +3,13 @@
 
 #include "linux/types.h"
 #include "kvm/mutex.h"
+#include "kvm/epoll.h"
 
+#include <pthread.h>
 #include <netinet/in.h>
 #include <sys/uio.h>
 
-#define UIP_BUF_STATUS_FREE	0
-#define UIP_BUF_STATUS_INUSE	1
-#define UIP_BUF_STATUS_USED	2
+#define UIP_CACHELINE_SIZE	64
 
 #define UIP_ETH_P_IP		0X0800
 #define UIP_ETH_P_ARP		0X0806
@@ -23,6 +23,11 @@
 
 #define UIP_TCP_HDR_LEN		0x50
 #define UIP_TCP_WIN_SIZE	14600
+/* MSS assumed when the guest doesn't announce one, for a 1500 bytes MTU */
+#define UIP_TCP_MSS		1460
+#define UIP_TCP_OPT_END		0
+#define UIP_TCP_OPT_NOP		1
+#define UIP_TCP_OPT_MSS		2
 #define UIP_TCP_FLAG_FIN	1
 #define UIP_TCP_FLAG_SYN	2
 #define UIP_TCP_FLAG_RST	4
@@ -184,61 +189,151 @@ struct uip_dhcp {
 	u8 option[UIP_DHCP_OPTION_LEN];
 } __attribute__((packed));
 
+struct uip_buf;
+
+/*
+ * Single producer, single consumer ring of buffers. Each index is only
+ * written by one side and gets a cache line of its own.
+ */
+struct uip_buf_ring {
+	struct uip_buf **bufs;
+	u32 mask;
+	u32 head __attribute__((aligned(UIP_CACHELINE_SIZE)));
+	u32 tail __attribute__((aligned(UIP_CACHELINE_SIZE)));
+};
+
+/* Lets a thread sleep until the other side refills the rings it polls */
+struct uip_buf_waiter {
+	struct mutex lock;
+	pthread_cond_t cond;
+	bool sleeping;
+};
+
+/*
+ * Buffers of one thread that builds frames for the guest. They go to the
+ * RX thread through the used ring, and come back through the free one.
+ */
+struct uip_buf_pool {
+	struct uip_buf_ring free;
+	struct uip_buf_ring used;
+	struct uip_buf_waiter waiter;
+	struct uip_buf *bufs;
+	u32 nr;
+};
+
+enum {
+	UIP_BUF_POOL_TX,	/* Replies from the virtio TX thread */
+	UIP_BUF_POOL_SOCKET,	/* Data from the uip worker */
+	UIP_BUF_POOL_NR,
+};
+
+/* A 4-tuple in network byte order, the key of a socket in its flow table */
+struct uip_flow {
+	struct hlist_node node;
+	u32 sip, dip;
+	u16 sport, dport;
+	u32 hash;
+};
+
+struct uip_flow_bucket {
+	struct mutex lock;
+	struct hlist_head head;
+};
+
+/* KVM_IPC_NET_STATS replies with the number of NICs, then two of these each */
+struct uip_flow_stats {
+	u64 lookups;
+	/* Lookups that found nothing */
+	u64 misses;
+	/* Flows compared by lookups, over lookups the average chain */
+	u64 probes;
+	u64 adds;
+	u64 dels;
+	u32 flows;
+	/* 0 when the NIC isn't in user mode */
+	u32 buckets;
+	u32 longest_chain;
+	u32 resizes;
+};
+
+/*
+ * Lookups hold resize_lock for reading and the lock of a single bucket, the
+ * table only stops them to double its buckets when it gets too loaded.
+ */
+struct uip_flow_table {
+	pthread_rwlock_t resize_lock;
+	struct uip_flow_bucket *buckets;
+	/* A power of two */
+	u32 nr_buckets;
+	u32 nr_flows;
+	u32 seed;
+	struct uip_flow_stats stats;
+};
+
 struct uip_info {
-	struct list_head udp_socket_head;
-	struct list_head tcp_socket_head;
-	struct mutex udp_socket_lock;
+	struct uip_flow_table udp_flows;
+	struct uip_flow_table tcp_flows;
+	/* Protects the window state of the TCP sockets */
 	struct mutex tcp_socket_lock;
 	struct uip_eth_addr guest_mac;
 	struct uip_eth_addr host_mac;
-	pthread_cond_t buf_free_cond;
-	pthread_cond_t buf_used_cond;
-	struct list_head buf_head;
-	struct mutex buf_lock;
-	pthread_t udp_thread;
+	struct uip_buf_pool buf_pools[UIP_BUF_POOL_NR];
+	/* The RX thread, waiting for a frame from any pool */
+	struct uip_buf_waiter buf_used_waiter;
+	/* Worker polling the UDP and TCP sockets on behalf of the guest */
+	struct kvm__epoll epoll;
 	u8 *udp_buf;
-	int udp_epollfd;
-	int buf_free_nr;
-	int buf_used_nr;
 	u32 guest_ip;
 	u32 guest_netmask;
 	u32 host_ip;
 	u32 dns_ip[UIP_DHCP_MAX_DNS_SERVER_NR];
 	char *domain_name;
+	/* Buffers in each pool, a power of two */
 	u32 buf_nr;
 	u32 vnet_hdr_len;
+	/*
+	 * Offloads negotiated for frames sent to the guest: it completes the
+	 * checksums itself, and takes TCP frames larger than its MSS.
+	 */
+	bool guest_csum;
+	bool guest_tso;
 };
 
 struct uip_buf {
-	struct list_head list;
 	struct uip_info *info;
+	struct uip_buf_pool *pool;
 	int vnet_len;
 	int eth_len;
-	int status;
 	unsigned char *vnet;
 	unsigned char *eth;
-	int id;
+};
+
+/* Registered with the uip worker, which calls handle() once the fd is ready */
+struct uip_epoll_entry {
+	void (*handle)(struct uip_epoll_entry *entry);
 };
 
 struct uip_udp_socket {
+	struct uip_epoll_entry epoll;
 	struct sockaddr_in addr;
-	struct list_head list;
-	struct mutex *lock;
+	struct uip_flow flow;
+	struct uip_info *info;
 	u32 dport, sport;
 	u32 dip, sip;
 	int fd;
 };
 
 struct uip_tcp_socket {
+	struct uip_epoll_entry epoll;
 	struct sockaddr_in addr;
-	struct list_head list;
+	struct uip_flow flow;
 	struct uip_info *info;
-	pthread_cond_t	cond;
 	struct mutex *lock;
-	pthread_t thread;
 	u32 dport, sport;
 	u32 guest_acked;
 	u16 window_size;
+	/* Largest segment the guest accepts */
+	u16 mss;
 	/*
 	 * Initial Sequence Number
 	 */
@@ -248,16 +343,37 @@ struct uip_tcp_socket {
 	u32 seq_server;
 	int write_done;
 	int read_done;
+	/* Not polled for data until the guest's window opens again */
+	bool paused;
 	u32 dip, sip;
 	u8 *payload;
 	u8 *buf;
 	int fd;
 };
 
+/* Most TCP sockets a batch of frames from the guest updates in one go */
+#define UIP_TX_BATCH_SOCKETS	16
+
+/* What the frames of a batch left to do on one socket, once it ends */
+struct uip_tcp_batch_entry {
+	struct uip_tcp_socket *sk;
+	u32 guest_acked;
+	u16 window_size;
+	/* Data from the guest went out and still needs an ACK */
+	bool ack;
+};
+
+struct uip_tx_batch {
+	struct uip_tcp_batch_entry tcp[UIP_TX_BATCH_SOCKETS];
+	u32 nr_tcp;
+};
+
 struct uip_tx_arg {
 	void *vnet;
 	struct uip_info *info;
 	struct uip_eth *eth;
+	/* NULL when the frame is sent on its own */
+	struct uip_tx_batch *batch;
 	int vnet_len;
 	int eth_len;
 };
@@ -334,14 +450,30 @@ static inline u16 uip_eth_hdrlen(struct uip_eth *eth)
 	return sizeof(*eth);
 }
 
+struct net_tx_io;
+
 int uip_tx(struct iovec *iov, u16 out, struct uip_info *info);
+int uip_tx_batch(struct net_tx_io *io, u16 nr, struct uip_info *info);
 int uip_rx(struct iovec *iov, u16 in, struct uip_info *info);
 void uip_static_init(struct uip_info *info);
 int uip_init(struct uip_info *info);
 void uip_exit(struct uip_info *info);
 void uip_tcp_exit(struct uip_info *info);
+void uip_tcp_batch_flush(struct uip_tx_batch *batch);
 void uip_udp_exit(struct uip_info *info);
 
+void uip_flow_table_static_init(struct uip_flow_table *table);
+int uip_flow_table_init(struct uip_flow_table *table);
+void uip_flow_table_exit(struct uip_flow_table *table);
+struct uip_flow *uip_flow_find(struct uip_flow_table *table, u32 sip, u32 dip,
+			       u16 sport, u16 dport);
+void uip_flow_add(struct uip_flow_table *table, struct uip_flow *flow,
+		  u32 sip, u32 dip, u16 sport, u16 dport);
+void uip_flow_del(struct uip_flow_table *table, struct uip_flow *flow);
+struct uip_flow *uip_flow_pop(struct uip_flow_table *table);
+void uip_flow_get_stats(struct uip_flow_table *table,
+			struct uip_flow_stats *stats);
+
 int uip_tx_do_ipv4_udp_dhcp(struct uip_tx_arg *arg);
 int uip_tx_do_ipv4_icmp(struct uip_tx_arg *arg);
 int uip_tx_do_ipv4_tcp(struct uip_tx_arg *arg);
@@ -353,12 +485,19 @@ u16 uip_csum_icmp(struct uip_icmp *icmp);
 u16 uip_csum_udp(struct uip_udp *udp);
 u16 uip_csum_tcp(struct uip_tcp *tcp);
 u16 uip_csum_ip(struct uip_ip *ip);
+u16 uip_csum_udp_pseudo(struct uip_udp *udp);
+u16 uip_csum_tcp_pseudo(struct uip_tcp *tcp);
 
+int uip_buf_init(struct uip_info *info);
+void uip_buf_exit(struct uip_info *info);
 struct uip_buf *uip_buf_set_used(struct uip_info *info, struct uip_buf *buf);
 struct uip_buf *uip_buf_set_free(struct uip_info *info, struct uip_buf *buf);
 struct uip_buf *uip_buf_get_used(struct uip_info *info);
 struct uip_buf *uip_buf_get_free(struct uip_info *info);
 struct uip_buf *uip_buf_clone(struct uip_tx_arg *arg);
+void uip_buf_set_csum_partial(struct uip_buf *buf, u16 csum_start,
+			      u16 csum_offset);
+void uip_buf_set_gso_tcp(struct uip_buf *buf, u16 hdr_len, u16 mss);
 
 int uip_udp_make_pkg(struct uip_info *info, struct uip_udp_socket *sk, struct uip_buf *buf, u8 *payload, int payload_len);
 bool uip_udp_is_dhcp(struct uip_udp *udp);
@@ -1,12 +1,16 @@
 #ifndef KVM__UTIL_INIT_H
 #define KVM__UTIL_INIT_H
 
+#include <stdbool.h>
+
 struct kvm;
 
 struct init_item {
 	struct hlist_node n;
 	const char *fn_name;
 	int (*init)(struct kvm *);
+	/* An exit that may run alongside the other parallel ones of its level */
+	bool parallel;
 };
 
 int init_list__init(struct kvm *kvm);
@@ -33,6 +37,14 @@ static void __attribute__ ((constructor)) __init__##cb(void)		\
 	exit_list_add(&t, cb, l, name);					\
 }
 
+#define __exit_list_add_parallel(cb, l)					\
+static void __attribute__ ((constructor)) __init__##cb(void)		\
+{									\
+	static char name[] = #cb;					\
+	static struct init_item t = { .parallel = true };		\
+	exit_list_add(&t, cb, l, name);					\
+}
+
 #define core_init(cb) __init_list_add(cb, 0)
 #define base_init(cb) __init_list_add(cb, 2)
 #define dev_base_init(cb)  __init_list_add(cb, 4)
@@ -44,6 +56,7 @@ static void __attribute__ ((constructor)) __init__##cb(void)		\
 #define core_exit(cb) __exit_list_add(cb, 0)
 #define base_exit(cb) __exit_list_add(cb, 2)
 #define dev_base_exit(cb) __exit_list_add(cb, 4)
+#define dev_base_exit_parallel(cb) __exit_list_add_parallel(cb, 4)
 #define dev_exit(cb) __exit_list_add(cb, 5)
 #define virtio_dev_exit(cb) __exit_list_add(cb, 6)
 #define firmware_exit(cb) __exit_list_add(cb, 7)
@@ -5,8 +5,11 @@
 #include "kvm/parse-options.h"
 #include "kvm/pci.h"
 
+#include <linux/list.h>
 #include <linux/vfio.h>
 
+struct kvm_cpu;
+
 #define vfio_dev_err(vdev, fmt, ...) \
 	pr_err("%s: " fmt, (vdev)->params->name, ##__VA_ARGS__)
 #define vfio_dev_warn(vdev, fmt, ...) \
@@ -18,6 +21,45 @@
 #define vfio_dev_die(vdev, fmt, ...) \
 	die("%s: " fmt, (vdev)->params->name, ##__VA_ARGS__)
 
+/* Since Linux 4.16, the MSI-X table of the region can be mapped */
+#ifndef VFIO_REGION_INFO_CAP_MSIX_MAPPABLE
+#define VFIO_REGION_INFO_CAP_MSIX_MAPPABLE	3
+#endif
+
+/* Since Linux 6.6, device cdevs can be bound to an iommufd */
+#ifndef VFIO_DEVICE_BIND_IOMMUFD
+struct vfio_device_bind_iommufd {
+	__u32	argsz;
+	__u32	flags;
+	__s32	iommufd;
+	__u32	out_devid;
+};
+#define VFIO_DEVICE_BIND_IOMMUFD	_IO(VFIO_TYPE, VFIO_BASE + 18)
+
+struct vfio_device_attach_iommufd_pt {
+	__u32	argsz;
+	__u32	flags;
+	__u32	pt_id;
+};
+#define VFIO_DEVICE_ATTACH_IOMMUFD_PT	_IO(VFIO_TYPE, VFIO_BASE + 19)
+#endif
+
+/* Since Linux 4.17, trapped writes can be done by the kernel on an eventfd */
+#ifndef VFIO_DEVICE_IOEVENTFD
+struct vfio_device_ioeventfd {
+	__u32	argsz;
+	__u32	flags;
+#define VFIO_DEVICE_IOEVENTFD_8		(1 << 0)
+#define VFIO_DEVICE_IOEVENTFD_16	(1 << 1)
+#define VFIO_DEVICE_IOEVENTFD_32	(1 << 2)
+#define VFIO_DEVICE_IOEVENTFD_64	(1 << 3)
+	__u64	offset;
+	__u64	data;
+	__s32	fd;
+};
+#define VFIO_DEVICE_IOEVENTFD		_IO(VFIO_TYPE, VFIO_BASE + 16)
+#endif
+
 /* Currently limited by num_vfio_devices */
 #define MAX_VFIO_DEVICES		256
 
@@ -40,17 +82,25 @@ struct vfio_pci_msi_entry {
 	u8				host_state;
 };
 
+/*
+ * The MSI-X table and PBA are emulated. They stay where the device has them,
+ * or are relocated together to a BAR the device doesn't use, so that the
+ * registers around them can be mapped into the guest.
+ */
 struct vfio_pci_msix_table {
 	size_t				size;
 	unsigned int			bar;
+	u32				bar_offset;
 	u32				guest_phys_addr;
+	bool				relocated;
+	u32				bar_size; /* of the relocated BAR */
 };
 
 struct vfio_pci_msix_pba {
 	size_t				size;
 	off_t				fd_offset; /* in VFIO device fd */
 	unsigned int			bar;
-	u32				bar_offset; /* in the shared BAR */
+	u32				bar_offset;
 	u32				guest_phys_addr;
 };
 
@@ -83,6 +133,13 @@ struct vfio_pci_device {
 	struct vfio_pci_msix_pba	msix_pba;
 };
 
+struct vfio_region_area {
+	u64				offset;
+	u64				size;
+};
+
+#define VFIO_REGION_MAX_HOLES		2
+
 struct vfio_region {
 	struct vfio_region_info		info;
 	struct vfio_device		*vdev;
@@ -90,8 +147,42 @@ struct vfio_region {
 	void				*host_addr;
 	u32				port_base;
 	int				is_ioport	:1;
+	int				trapped		:1;
+
+	/* The parts that can be mapped, if not all of it */
+	struct vfio_region_area		*areas;
+	u32				nr_areas;
+	bool				msix_mappable;
+	/* Page aligned parts that are trapped even though they could be mapped */
+	struct vfio_region_area		holes[VFIO_REGION_MAX_HOLES];
+	u32				nr_holes;
+	/* The parts registered with KVM */
+	struct vfio_region_area		*slots;
+	u32				nr_slots;
+	/* Handles the trapped parts, vfio_mmio_access() by default */
+	void				(*mmio_fn)(struct kvm_cpu *vcpu,
+						   u64 addr, u8 *data, u32 len,
+						   u8 is_write, void *ptr);
 };
 
+/*
+ * A trapped write that KVM hands to VFIO_DEVICE_IOEVENTFD, which does it
+ * from the kernel, without an exit to kvmtool
+ */
+struct vfio_ioeventfd {
+	struct list_head		list;
+	struct vfio_region		*region;
+	u64				offset;
+	u64				data;
+	u32				len;
+	int				fd;
+};
+
+/* At most this many per device, the kernel doesn't take many more */
+#define VFIO_IOEVENTFD_MAX		16
+/* Identical writes in a row that make a hot address, 2 for a doorbell= */
+#define VFIO_IOEVENTFD_HOT		32
+
 struct vfio_device {
 	struct device_header		dev_hdr;
 	struct vfio_device_params	*params;
@@ -104,12 +195,31 @@ struct vfio_device {
 	char				*sysfs_path;
 
 	struct vfio_pci_device		pci;
+
+	/* The trapped writes offloaded so far, and the last one that wasn't */
+	struct mutex			ioeventfd_lock;
+	struct list_head		ioeventfds;
+	u32				nr_ioeventfds;
+	struct vfio_ioeventfd		last_write;
+	u32				last_write_hits;
+	bool				ioeventfd_failed;
+};
+
+#define VFIO_MAX_DOORBELLS		8
+
+struct vfio_doorbell {
+	u32				bar;
+	u64				offset;
 };
 
 struct vfio_device_params {
 	char				*name;
 	const char			*bus;
 	enum vfio_device_type		type;
+	/* ioeventfd=off, and the doorbell=<bar>:<offset> registers */
+	bool				no_ioeventfd;
+	struct vfio_doorbell		doorbells[VFIO_MAX_DOORBELLS];
+	u32				nr_doorbells;
 };
 
 struct vfio_group {
@@ -120,9 +230,16 @@ struct vfio_group {
 };
 
 int vfio_device_parser(const struct option *opt, const char *arg, int unset);
+int vfio_get_region_areas(struct vfio_device *vdev, struct vfio_region *region);
 int vfio_map_region(struct kvm *kvm, struct vfio_device *vdev,
 		    struct vfio_region *region);
+void vfio_mmio_access(struct kvm_cpu *vcpu, u64 addr, u8 *data, u32 len,
+		      u8 is_write, void *ptr);
 void vfio_unmap_region(struct kvm *kvm, struct vfio_region *region);
+void vfio_ioeventfd_init(struct vfio_device *vdev);
+void vfio_ioeventfd_write(struct kvm *kvm, struct vfio_region *region,
+			  u64 offset, u32 len, u64 data);
+void vfio_ioeventfd_del_region(struct kvm *kvm, struct vfio_region *region);
 int vfio_pci_setup_device(struct kvm *kvm, struct vfio_device *device);
 void vfio_pci_teardown_device(struct kvm *kvm, struct vfio_device *vdev);
 
@@ -0,0 +1,33 @@
+#ifndef KVM__VHOST_USER_H
+#define KVM__VHOST_USER_H
+
+#include <linux/types.h>
+
+#include <stdbool.h>
+
+struct kvm;
+struct virt_queue;
+struct vhost_user;
+
+/* vhost-user protocol features kvmtool knows about */
+#define VHOST_USER_PROTOCOL_F_MQ		0
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK		3
+#define VHOST_USER_PROTOCOL_F_CONFIG		9
+
+struct vhost_user *vhost_user__new(struct kvm *kvm, const char *path);
+void vhost_user__free(struct vhost_user *vu);
+
+u64 vhost_user__get_features(struct vhost_user *vu);
+void vhost_user__set_features(struct vhost_user *vu, u64 features);
+bool vhost_user__has_protocol_feature(struct vhost_user *vu, u32 feature);
+u32 vhost_user__get_queue_num(struct vhost_user *vu);
+int vhost_user__get_config(struct vhost_user *vu, void *config, u32 size);
+
+void vhost_user__set_vring(struct kvm *kvm, struct vhost_user *vu, u32 index,
+			   struct virt_queue *queue);
+void vhost_user__set_vring_kick(struct vhost_user *vu, u32 index, int event_fd);
+int vhost_user__set_vring_enable(struct vhost_user *vu, u32 index, bool enable);
+void vhost_user__reset_vring(struct kvm *kvm, struct vhost_user *vu, u32 index,
+			     struct virt_queue *queue);
+
+#endif /* KVM__VHOST_USER_H */
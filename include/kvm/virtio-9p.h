@@ -1,20 +1,35 @@
 #ifndef KVM__VIRTIO_9P_H
 #define KVM__VIRTIO_9P_H
 #include "kvm/virtio.h"
+#include "kvm/iovec.h"
 #include "kvm/pci.h"
 #include "kvm/threadpool.h"
 #include "kvm/parse-options.h"
+#include "kvm/mutex.h"
+#include "kvm/mem-pool.h"
 
 #include <dirent.h>
+#include <sys/stat.h>
 #include <linux/list.h>
 #include <linux/rbtree.h>
 
 #define NUM_VIRT_QUEUES		1
-#define VIRTQUEUE_NUM		128
+/* Allows 4MB messages, given indirect descriptors */
+#define VIRTQUEUE_NUM		1024
+/* Leaves room for the headers in their own descriptors */
+#define VIRTIO_9P_MAX_MSIZE	((VIRTQUEUE_NUM - 3) * 4096)
+/* Bytes of directory entries read at once */
+#define VIRTIO_9P_DIRENT_BATCH	32768
 #define	VIRTIO_9P_DEFAULT_TAG	"kvm_9p"
 #define VIRTIO_9P_HDR_LEN	(sizeof(u32)+sizeof(u8)+sizeof(u16))
 #define VIRTIO_9P_VERSION_DOTL	"9P2000.L"
 #define MAX_TAG_LEN		32
+/* Jobs serving the requests of a device concurrently */
+#define VIRTIO_9P_NR_WORKERS	8
+/* Fids a single request refers to */
+#define VIRTIO_9P_PDU_MAX_FIDS	2
+/* Bytes of the strings of a request decoded without allocating */
+#define VIRTIO_9P_PDU_STRINGS	(2 * PATH_MAX)
 
 struct p9_msg {
 	u32			size;
@@ -31,6 +46,13 @@ struct p9_fid {
 	DIR			*dir;
 	int			fd;
 	struct rb_node		node;
+	/* Held by the fids tree and by each request using the fid */
+	int			refs;
+	/* Serializes the users of the directory stream */
+	struct mutex		dir_lock;
+	/* The entries of both layers of an overlay, read at open */
+	char			*dents;
+	size_t			dents_len;
 };
 
 struct p9_dev_job {
@@ -43,6 +65,7 @@ struct p9_dev {
 	struct list_head	list;
 	struct virtio_device	vdev;
 	struct rb_root		fids;
+	struct mutex		fids_lock;
 
 	size_t config_size;
 	struct virtio_9p_config	*config;
@@ -52,12 +75,46 @@ struct p9_dev {
 	struct virt_queue	vqs[NUM_VIRT_QUEUES];
 	struct p9_dev_job	jobs[NUM_VIRT_QUEUES];
 	char			root_dir[PATH_MAX];
+	struct p9_cache		*attr_cache;
+	/* The files shown below those of root_dir, if not empty */
+	char			lower_dir[PATH_MAX];
+	struct p9_overlay	*overlay;
+
+	/*
+	 * Requests popped from the queues, until one of the workers handles
+	 * them. Their completions are serialized by used_lock.
+	 */
+	struct mutex		reqs_lock;
+	struct list_head	reqs;
+	struct thread_pool__job	workers[VIRTIO_9P_NR_WORKERS];
+	struct mutex		used_lock;
+
+	/* Recycles the pdus, as many as the queues have requests */
+	struct mem_pool		pdus;
+};
+
+struct p9_pdu_str {
+	struct p9_pdu_str	*next;
+	char			str[];
 };
 
 struct p9_pdu {
+	struct list_head	list;
+	struct virt_queue	*vq;
+	struct p9_fid		*fids[VIRTIO_9P_PDU_MAX_FIDS];
+	u8			nr_fids;
 	u32			queue_head;
 	size_t			read_offset;
 	size_t			write_offset;
+	/* Where read_offset and write_offset were after the last field */
+	struct iovec_cursor	read_cur;
+	struct iovec_cursor	write_cur;
+	size_t			read_cur_offset;
+	size_t			write_cur_offset;
+	/* The decoded strings */
+	size_t			strings_len;
+	struct p9_pdu_str	*spill;
+	char			strings[VIRTIO_9P_PDU_STRINGS];
 	u16			out_iov_cnt;
 	u16			in_iov_cnt;
 	struct iovec		in_iov[VIRTQUEUE_NUM];
@@ -65,13 +122,39 @@ struct p9_pdu {
 };
 
 struct kvm;
+struct p9_cache;
+struct p9_overlay;
+
+struct p9_cache *p9_cache__new(u32 ttl_ms, bool loose);
+void p9_cache__free(struct p9_cache *cache);
+int p9_cache__lstat(struct p9_cache *cache, const char *path, struct stat *st);
+void p9_cache__invalidate(struct p9_cache *cache, const char *path,
+			  bool subtree);
+
+struct p9_overlay *p9_overlay__new(const char *upper, const char *lower);
+void p9_overlay__free(struct p9_overlay *ovl);
+bool p9_overlay__hidden(struct p9_dev *p9dev, const char *name);
+int p9_overlay__lstat(struct p9_dev *p9dev, const char *path, char *host,
+		      struct stat *st);
+int p9_overlay__copy_up(struct p9_dev *p9dev, const char *path);
+int p9_overlay__create(struct p9_dev *p9dev, const char *path);
+int p9_overlay__created(struct p9_dev *p9dev, const char *path);
+int p9_overlay__opendir(struct p9_dev *p9dev, struct p9_fid *fid);
+ssize_t p9_overlay__getdents(struct p9_fid *fid, u64 *offset, void *buf,
+			     size_t size);
+int p9_overlay__remove(struct p9_dev *p9dev, const char *path);
+int p9_overlay__rename(struct p9_dev *p9dev, const char *old, const char *new);
 
 int virtio_9p_rootdir_parser(const struct option *opt, const char *arg, int unset);
 int virtio_9p_img_name_parser(const struct option *opt, const char *arg, int unset);
+int virtio_9p_cache_parser(const struct option *opt, const char *arg, int unset);
 int virtio_9p__register(struct kvm *kvm, const char *root, const char *tag_name);
+int virtio_9p__register_overlay(struct kvm *kvm, const char *root,
+				const char *lower, const char *tag_name);
 int virtio_9p__init(struct kvm *kvm);
 int virtio_9p__exit(struct kvm *kvm);
 int virtio_p9_pdu_readf(struct p9_pdu *pdu, const char *fmt, ...);
 int virtio_p9_pdu_writef(struct p9_pdu *pdu, const char *fmt, ...);
+void virtio_p9_pdu_free(struct p9_dev *p9dev, struct p9_pdu *pdu);
 
 #endif
@@ -1,9 +1,37 @@
 #ifndef KVM__BLN_VIRTIO_H
 #define KVM__BLN_VIRTIO_H
 
+#include "kvm/parse-options.h"
+
+#include <linux/types.h>
+
 struct kvm;
 
+enum virtio_bln_auto_action {
+	VIRTIO_BLN_AUTO_HOLD,
+	VIRTIO_BLN_AUTO_INFLATE,
+	VIRTIO_BLN_AUTO_DEFLATE,
+};
+
+/* State of the --balloon-auto controller, as sent by KVM_IPC_BALLOON_STATS */
+struct virtio_bln_auto_stats {
+	u32	enabled;
+	/* Last decision, and why, with the pressure in 1/100 % */
+	u32	action;
+	u32	host_psi;
+	u64	guest_avail_mb;
+	u64	target_mb;
+	u64	actual_mb;
+	u64	inflations;
+	u64	deflations;
+	/* Rounds where the guest didn't send its stats in time */
+	u64	stat_timeouts;
+};
+
+int virtio_bln_auto_parser(const struct option *opt, const char *arg, int unset);
+
 int virtio_bln__init(struct kvm *kvm);
 int virtio_bln__exit(struct kvm *kvm);
+u64 virtio_bln__actual_bytes(void);
 
 #endif /* KVM__BLN_VIRTIO_H */
@@ -7,6 +7,10 @@ struct kvm;
 
 int virtio_blk__init(struct kvm *kvm);
 int virtio_blk__exit(struct kvm *kvm);
+int virtio_blk__set_ratelimit(struct kvm *kvm, u32 n,
+			      struct ratelimit_params *params);
 void virtio_blk_complete(void *param, long len);
+int vhost_user_blk__init(struct kvm *kvm);
+int vhost_user_blk__exit(struct kvm *kvm);
 
 #endif /* KVM__BLK_VIRTIO_H */
@@ -2,9 +2,11 @@
 #define KVM__CONSOLE_VIRTIO_H
 
 struct kvm;
+struct option;
 
+int virtio_console_port_parser(const struct option *opt, const char *arg,
+			       int unset);
 int virtio_console__init(struct kvm *kvm);
-void virtio_console__inject_interrupt(struct kvm *kvm);
 int virtio_console__exit(struct kvm *kvm);
 
 #endif /* KVM__CONSOLE_VIRTIO_H */
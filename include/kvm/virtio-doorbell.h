@@ -0,0 +1,40 @@
+#ifndef KVM__VIRTIO_DOORBELL_H
+#define KVM__VIRTIO_DOORBELL_H
+
+#include <linux/types.h>
+
+struct kvm;
+
+/*
+ * With --virtio-doorbell, a PCI device lets a guest kick the queues of all
+ * virtio devices with a single write. The guest gives it a page where u32
+ * word n holds one bit per virtqueue of device n. It sets the bits of the
+ * queues it filled, then writes VIRTIO_DOORBELL_KICK_VALUE to the KICK
+ * register, which an ioeventfd turns into one notification for all of them.
+ *
+ * The registers, little-endian, in memory BAR 0:
+ */
+#define VIRTIO_DOORBELL_MAGIC		0x00	/* RO, VIRTIO_DOORBELL_MAGIC_VALUE */
+#define VIRTIO_DOORBELL_VERSION		0x04	/* RO, 1 */
+#define VIRTIO_DOORBELL_NR_DEVICES	0x08	/* RO, words the host looks at */
+#define VIRTIO_DOORBELL_BITMAP_LO	0x10	/* RW, guest address of the page */
+#define VIRTIO_DOORBELL_BITMAP_HI	0x14
+#define VIRTIO_DOORBELL_KICK		0x18	/* WO */
+/* Which device word n is for, as two u32: a VIRTIO_DOORBELL_DEV_* and where */
+#define VIRTIO_DOORBELL_DEVICES		0x100
+
+#define VIRTIO_DOORBELL_MAGIC_VALUE	0x6c65626b	/* "kbel" */
+#define VIRTIO_DOORBELL_KICK_VALUE	1
+
+/* The PCI device number, on bus 0 */
+#define VIRTIO_DOORBELL_DEV_PCI		1
+/* The base of the virtio-mmio registers */
+#define VIRTIO_DOORBELL_DEV_MMIO	2
+
+#define VIRTIO_DOORBELL_BAR_SIZE	4096
+#define VIRTIO_DOORBELL_MAX_DEVICES	((VIRTIO_DOORBELL_BAR_SIZE - \
+					  VIRTIO_DOORBELL_DEVICES) / 8)
+
+int virtio_doorbell__init(struct kvm *kvm);
+
+#endif /* KVM__VIRTIO_DOORBELL_H */
@@ -0,0 +1,23 @@
+#ifndef KVM__VIRTIO_FS_H
+#define KVM__VIRTIO_FS_H
+
+#include "kvm/parse-options.h"
+
+#include <linux/types.h>
+
+struct kvm;
+
+/* How long the guest may keep names and attributes, see cache= */
+enum virtio_fs_cache {
+	VIRTIO_FS_CACHE_NONE,
+	VIRTIO_FS_CACHE_AUTO,
+	VIRTIO_FS_CACHE_ALWAYS,
+};
+
+int virtio_fs_parser(const struct option *opt, const char *arg, int unset);
+int virtio_fs__register(struct kvm *kvm, const char *root, const char *tag,
+			u64 dax_size, enum virtio_fs_cache cache);
+int virtio_fs__init(struct kvm *kvm);
+int virtio_fs__exit(struct kvm *kvm);
+
+#endif /* KVM__VIRTIO_FS_H */
@@ -0,0 +1,14 @@
+#ifndef KVM__VIRTIO_GPU_H
+#define KVM__VIRTIO_GPU_H
+
+#define VIRTIO_GPU_WIDTH	1024
+#define VIRTIO_GPU_HEIGHT	768
+#define VIRTIO_GPU_BPP		32
+
+struct kvm;
+struct framebuffer;
+
+struct framebuffer *virtio_gpu__init(struct kvm *kvm);
+int virtio_gpu__exit(struct kvm *kvm);
+
+#endif /* KVM__VIRTIO_GPU_H */
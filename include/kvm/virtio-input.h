@@ -0,0 +1,28 @@
+#ifndef KVM__VIRTIO_INPUT_H
+#define KVM__VIRTIO_INPUT_H
+
+#include <linux/types.h>
+#include <stdbool.h>
+
+struct kvm;
+
+/* The buttons of virtio_input__pointer(), as VNC numbers them */
+#define VIRTIO_INPUT_BTN_LEFT		(1 << 0)
+#define VIRTIO_INPUT_BTN_MIDDLE		(1 << 1)
+#define VIRTIO_INPUT_BTN_RIGHT		(1 << 2)
+#define VIRTIO_INPUT_WHEEL_UP		(1 << 3)
+#define VIRTIO_INPUT_WHEEL_DOWN		(1 << 4)
+
+/*
+ * With --input, the framebuffer UIs send their keys and pointer here rather
+ * than to the i8042. @code is a Linux KEY_* code, the pointer is absolute,
+ * at @x, @y of a @width by @height screen.
+ */
+bool virtio_input__enabled(void);
+void virtio_input__key(u16 code, bool down);
+void virtio_input__pointer(u32 x, u32 y, u32 width, u32 height, u32 buttons);
+
+int virtio_input__init(struct kvm *kvm);
+int virtio_input__exit(struct kvm *kvm);
+
+#endif /* KVM__VIRTIO_INPUT_H */
@@ -0,0 +1,17 @@
+#ifndef KVM__VIRTIO_MEM_H
+#define KVM__VIRTIO_MEM_H
+
+#include <linux/types.h>
+
+struct kvm;
+
+/* What "lkvm memory" sends with KVM_IPC_VIRTIO_MEM, replied with an s32 */
+struct virtio_mem_resize {
+	/* Memory that the guest should have plugged */
+	u64	requested_mb;
+};
+
+int virtio_mem__init(struct kvm *kvm);
+int virtio_mem__exit(struct kvm *kvm);
+
+#endif /* KVM__VIRTIO_MEM_H */
@@ -65,6 +65,9 @@ struct virtio_mmio {
 
 int virtio_mmio_signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq);
 int virtio_mmio_signal_config(struct kvm *kvm, struct virtio_device *vdev);
+u32 virtio_mmio_interrupt_status(struct virtio_device *vdev);
+int virtio_mmio_get_irq_line(struct kvm *kvm, struct virtio_device *vdev,
+			     bool *level);
 int virtio_mmio_exit(struct kvm *kvm, struct virtio_device *vdev);
 int virtio_mmio_reset(struct kvm *kvm, struct virtio_device *vdev);
 int virtio_mmio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
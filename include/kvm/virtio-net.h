@@ -2,9 +2,19 @@
 #define KVM__VIRTIO_NET_H
 
 #include "kvm/parse-options.h"
+#include "kvm/ratelimit.h"
+
+#include <linux/types.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <sys/uio.h>
 
 struct kvm;
 
+#define VIRTIO_NET_NUM_QUEUES		8
+
 struct virtio_net_params {
 	const char *guest_ip;
 	const char *host_ip;
@@ -17,17 +27,169 @@ struct virtio_net_params {
 	struct kvm *kvm;
 	int mode;
 	int vhost;
-	int fd;
+	/* Tap queues opened by the caller, with fd=, one per queue pair */
+	int fds[VIRTIO_NET_NUM_QUEUES];
+	u32 nr_fds;
 	int mq;
+	const char *dev;
+	int queue;
+	const char *socket;
+	/* Interrupt coalescing until the guest sets its own */
+	u32 rx_usecs, rx_frames;
+	u32 tx_usecs, tx_frames;
+	/* Longest busy-poll of the TX queues, in microseconds */
+	u32 poll_us;
+	/* The --iothreads loop of the device, -1 to pick one */
+	int iothread;
+	/* Frames that mode=null makes up, per RX queue and second, and bytes */
+	u32 rx_pps;
+	u32 pkt_size;
+	/* Applied to each RX and each TX queue, by the threads serving them */
+	struct ratelimit_params ratelimit;
+	/* Largest queues, 0 for the default */
+	u32 queue_size;
+};
+
+/* rx_pps=max, as fast as the guest takes the frames */
+#define VIRTIO_NET_NULL_RX_MAX		UINT_MAX
+#define VIRTIO_NET_NULL_PKT_SIZE	64
+
+struct net_uring;
+
+/* One frame of a TX batch */
+struct net_tx_io {
+	struct iovec	*iov;
+	int		iovcnt;
+	int		res;
 };
 
+#ifdef CONFIG_HAS_IO_URING
+struct net_uring *net_uring__new(unsigned int entries);
+void net_uring__free(struct net_uring *ring);
+int net_uring__writev(struct net_uring *ring, int fd, struct net_tx_io *io,
+		      unsigned int nr);
+#else /* !CONFIG_HAS_IO_URING */
+static inline struct net_uring *net_uring__new(unsigned int entries)
+{
+	return NULL;
+}
+static inline void net_uring__free(struct net_uring *ring)
+{
+}
+static inline int net_uring__writev(struct net_uring *ring, int fd,
+				    struct net_tx_io *io, unsigned int nr)
+{
+	return -ENOSYS;
+}
+#endif /* CONFIG_HAS_IO_URING */
+
+struct net_afxdp;
+
+/* Largest frame the AF_XDP backend carries, one UMEM chunk */
+#define NET_AFXDP_FRAME_SIZE	2048
+
+#ifdef CONFIG_HAS_AF_XDP
+struct net_afxdp *net_afxdp__new(const char *dev, u32 queue);
+void net_afxdp__free(struct net_afxdp *xdp);
+int net_afxdp__rx(struct net_afxdp *xdp, struct iovec *iov, u16 in,
+		  size_t hdr_len);
+int net_afxdp__tx(struct net_afxdp *xdp, struct net_tx_io *io, u16 nr,
+		  size_t hdr_len);
+#else /* !CONFIG_HAS_AF_XDP */
+static inline struct net_afxdp *net_afxdp__new(const char *dev, u32 queue)
+{
+	return NULL;
+}
+static inline void net_afxdp__free(struct net_afxdp *xdp)
+{
+}
+static inline int net_afxdp__rx(struct net_afxdp *xdp, struct iovec *iov,
+				u16 in, size_t hdr_len)
+{
+	errno = ENOSYS;
+	return -1;
+}
+static inline int net_afxdp__tx(struct net_afxdp *xdp, struct net_tx_io *io,
+				u16 nr, size_t hdr_len)
+{
+	return -ENOSYS;
+}
+#endif /* CONFIG_HAS_AF_XDP */
+
+struct net_capture;
+
+/* KVM_IPC_NET_CAPTURE, answered with an s32 status */
+struct net_capture_msg {
+	u32	dev;
+	/* Size of the capture file in MB, 0 stops capturing */
+	u32	size_mb;
+	char	path[PATH_MAX];
+};
+
+struct net_capture *net_capture__new(void);
+void net_capture__free(struct net_capture *cap);
+int net_capture__start(struct net_capture *cap, const char *path, u64 size);
+void net_capture__stop(struct net_capture *cap);
+void net_capture__frame(struct net_capture *cap, const struct iovec *iov,
+			size_t offset, size_t len, bool rx);
+
+struct net_rss;
+
+/* What the device offers for VIRTIO_NET_F_RSS and VIRTIO_NET_F_HASH_REPORT */
+#define NET_RSS_KEY_SIZE	40
+#define NET_RSS_TABLE_SIZE	128
+/* Enough of the start of a frame for net_rss__hash(), up to the ports */
+#define NET_RSS_HDR_LEN		128
+#define NET_RSS_HASH_TYPES	(VIRTIO_NET_RSS_HASH_TYPE_IPv4 |	\
+				 VIRTIO_NET_RSS_HASH_TYPE_TCPv4 |	\
+				 VIRTIO_NET_RSS_HASH_TYPE_UDPv4 |	\
+				 VIRTIO_NET_RSS_HASH_TYPE_IPv6 |	\
+				 VIRTIO_NET_RSS_HASH_TYPE_TCPv6 |	\
+				 VIRTIO_NET_RSS_HASH_TYPE_UDPv6)
+
+/* Set with VIRTIO_NET_CTRL_MQ_RSS_CONFIG or _HASH_CONFIG, in host order */
+struct net_rss_config {
+	u32	hash_types;
+	/* A power of two, the receive queue of each hash & (table_len - 1) */
+	u16	table_len;
+	u16	table[NET_RSS_TABLE_SIZE];
+	/* Where frames that aren't hashed go */
+	u16	unclassified;
+	u8	key_len;
+	u8	key[NET_RSS_KEY_SIZE];
+};
+
+struct net_rss *net_rss__new(const struct net_rss_config *config,
+			     struct net_rss *prev);
+void net_rss__free(struct net_rss *rss);
+u16 net_rss__hash(const struct net_rss *rss, const void *frame, size_t len,
+		  u32 *hash);
+int net_rss__steering_prog(const struct net_rss *rss);
+
 int virtio_net__init(struct kvm *kvm);
 int virtio_net__exit(struct kvm *kvm);
 int netdev_parser(const struct option *opt, const char *arg, int unset);
+int virtio_net__set_ratelimit(struct kvm *kvm, u32 n,
+			      struct ratelimit_params *params);
+
+/* Totals of all the queues of all the devices, for the status page */
+struct virtio_net_totals {
+	u64	rx_packets, rx_bytes;
+	u64	tx_packets, tx_bytes;
+	u64	drops;
+};
+
+void virtio_net__get_totals(struct kvm *kvm, struct virtio_net_totals *totals);
 
 enum {
 	NET_MODE_USER,
-	NET_MODE_TAP
+	NET_MODE_TAP,
+	NET_MODE_AFXDP,
+	NET_MODE_VHOST_USER,
+	/* Drops TX, makes up RX: the cost of virtio-net alone */
+	NET_MODE_NULL,
+	/* A vhost-vdpa device of the host (dev=), see virtio/vdpa.c */
+	NET_MODE_VDPA,
 };
 
 #endif /* KVM__VIRTIO_NET_H */
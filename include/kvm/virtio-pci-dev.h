@@ -17,22 +17,25 @@
 #define PCI_DEVICE_ID_VIRTIO_9P			0x1009
 #define PCI_DEVICE_ID_VIRTIO_VSOCK		0x1012
 #define PCI_DEVICE_ID_VESA			0x2000
-#define PCI_DEVICE_ID_PCI_SHMEM			0x0001
+#define PCI_DEVICE_ID_VIRTIO_DOORBELL		0x2001
+/* Those of QEMU's ivshmem, which guest drivers know */
+#define PCI_DEVICE_ID_PCI_SHMEM			0x1110
 
 /* Modern virtio device IDs start at 1040 */
 #define PCI_DEVICE_ID_VIRTIO_BASE		0x1040
 #define PCI_SUBSYS_ID_VIRTIO_BASE		0x0040
 
 #define PCI_VENDOR_ID_REDHAT_QUMRANET		0x1af4
-#define PCI_VENDOR_ID_PCI_SHMEM			0x0001
 #define PCI_SUBSYSTEM_VENDOR_ID_REDHAT_QUMRANET	0x1af4
 
 #define PCI_SUBSYSTEM_ID_VESA			0x0004
-#define PCI_SUBSYSTEM_ID_PCI_SHMEM		0x0001
+#define PCI_SUBSYSTEM_ID_VIRTIO_DOORBELL	0x0005
+#define PCI_SUBSYSTEM_ID_PCI_SHMEM		0x1100
 
 #define PCI_CLASS_BLK				0x018000
 #define PCI_CLASS_NET				0x020000
 #define PCI_CLASS_CONSOLE			0x078000
+#define PCI_CLASS_PCI_SHMEM			0x050000
 /*
  * 0xFF Device does not fit in any defined classes
  */
@@ -40,5 +43,6 @@
 #define PCI_CLASS_BLN				0xff0000
 #define PCI_CLASS_9P				0xff0000
 #define PCI_CLASS_VSOCK				0xff0000
+#define PCI_CLASS_DOORBELL			0xff0000
 
 #endif /* VIRTIO_PCI_DEV_H_ */
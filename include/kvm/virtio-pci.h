@@ -3,6 +3,7 @@
 
 #include "kvm/devices.h"
 #include "kvm/pci.h"
+#include "kvm/snapshot.h"
 #include "kvm/virtio.h"
 
 #include <stdbool.h>
@@ -27,6 +28,9 @@ struct virtio_pci_ioevent_param {
 #define VIRTIO_MSIX_BAR_SIZE	(1UL << fls_long(VIRTIO_MSIX_TABLE_SIZE + \
 						 VIRTIO_MSIX_PBA_SIZE))
 
+/* BAR 1 mirrors the I/O BAR, then has the doorbells of modern devices */
+#define VIRTIO_PCI_MMIO_SIZE	(PCI_IO_SIZE * 2)
+
 struct virtio_pci {
 	struct pci_device_header pci_hdr;
 	struct device_header	dev_hdr;
@@ -34,6 +38,8 @@ struct virtio_pci {
 	struct kvm		*kvm;
 
 	u32			doorbell_offset;
+	/* Between the doorbells of two queues, 0 when they share one */
+	u32			doorbell_multiplier;
 	bool			signal_msi;
 	u8			status;
 	u8			isr;
@@ -56,13 +62,23 @@ struct virtio_pci {
 	u64			msix_pba;
 	struct msix_table	msix_table[VIRTIO_PCI_MAX_VQ + VIRTIO_PCI_MAX_CONFIG];
 
+	/* Shared memory region, in BAR 3 */
+	void			*shm_host;
+	u64			shm_size;
+	u8			shm_id;
+
 	/* virtio queue */
 	u16			queue_selector;
 	struct virtio_pci_ioevent_param ioeventfds[VIRTIO_PCI_MAX_VQ];
+
+	struct snapshot_handler	snapshot;
 };
 
 int virtio_pci__signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq);
 int virtio_pci__signal_config(struct kvm *kvm, struct virtio_device *vdev);
+u8 virtio_pci__read_isr(struct kvm *kvm, struct virtio_device *vdev);
+int virtio_pci__get_irq_line(struct kvm *kvm, struct virtio_device *vdev,
+			     bool *level);
 int virtio_pci__exit(struct kvm *kvm, struct virtio_device *vdev);
 int virtio_pci__reset(struct kvm *kvm, struct virtio_device *vdev);
 int virtio_pci__init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
@@ -90,6 +106,7 @@ static inline u32 virtio_pci__msix_io_addr(struct virtio_pci *vpci)
 }
 
 int virtio_pci__add_msix_route(struct virtio_pci *vpci, u32 vec);
+void virtio_pci__status_written(struct virtio_pci *vpci);
 int virtio_pci__init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev,
 			       u32 vq);
 int virtio_pci_init_vq(struct kvm *kvm, struct virtio_device *vdev, int vq);
@@ -0,0 +1,15 @@
+#ifndef KVM__VIRTIO_PMEM_H
+#define KVM__VIRTIO_PMEM_H
+
+#include "kvm/parse-options.h"
+
+#include <linux/types.h>
+
+struct kvm;
+
+int virtio_pmem_parser(const struct option *opt, const char *arg, int unset);
+int virtio_pmem__register(struct kvm *kvm, const char *path, bool readonly);
+int virtio_pmem__init(struct kvm *kvm);
+int virtio_pmem__exit(struct kvm *kvm);
+
+#endif /* KVM__VIRTIO_PMEM_H */
@@ -0,0 +1,13 @@
+#ifndef KVM__VIRTIO_VDPA_H
+#define KVM__VIRTIO_VDPA_H
+
+#include "kvm/parse-options.h"
+
+struct kvm;
+
+int virtio_vdpa_parser(const struct option *opt, const char *arg, int unset);
+int virtio_vdpa__register(struct kvm *kvm, const char *path);
+int virtio_vdpa__init(struct kvm *kvm);
+int virtio_vdpa__exit(struct kvm *kvm);
+
+#endif /* KVM__VIRTIO_VDPA_H */
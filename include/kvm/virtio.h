@@ -8,11 +8,13 @@
 
 #include <linux/types.h>
 #include <linux/compiler.h>
+#include <linux/list.h>
 #include <linux/virtio_config.h>
 #include <sys/uio.h>
 
 #include "kvm/barrier.h"
 #include "kvm/kvm.h"
+#include "kvm/dirty-log.h"
 
 #define VIRTIO_IRQ_LOW		0
 #define VIRTIO_IRQ_HIGH		1
@@ -46,6 +48,10 @@
 /* Initialize the config */
 #define VIRTIO__STATUS_CONFIG		(1 << 10)
 
+/* Largest queue sizes offered, with split and with packed rings */
+#define VIRTIO_QUEUE_MAX_SIZE		1024
+#define VIRTIO_PACKED_QUEUE_MAX_SIZE	32768
+
 struct vring_addr {
 	bool			legacy;
 	union {
@@ -67,6 +73,65 @@ struct vring_addr {
 	};
 };
 
+struct virt_queue_packed_buf {
+	u16	pos;
+	u16	num;
+};
+
+/*
+ * State of a packed ring. The buffer IDs that the guest puts in descriptors
+ * take the place of split ring heads.
+ */
+struct virt_queue_packed {
+	struct vring_packed_desc	*desc;
+	struct vring_packed_desc_event	*driver;
+	struct vring_packed_desc_event	*device;
+	bool				avail_wrap;
+	u16				used_idx;
+	bool				used_wrap;
+	/*
+	 * Where the next used descriptor of a batch goes, and the flags of the
+	 * first one, written once the batch is complete.
+	 */
+	u16				next_used;
+	bool				next_used_wrap;
+	u16				first_used_flags;
+	u16				signalled_used;
+	bool				signalled_used_valid;
+	/* Avail positions and wrap counters before the last pops */
+	u16				nr_popped;
+	u16				*popped;
+	/* Where the chain of each buffer ID starts, and its length */
+	struct virt_queue_packed_buf	bufs[];
+};
+
+/* For --metrics and lkvm stat --vq, up to VIRTIO_STATS_MAX_VQ */
+#define VIRTIO_STATS_MAX_VQ	32
+
+struct virtio_vq_stats {
+	/* Counted by the transports */
+	u64	kicks;
+	u64	irqs;
+	/*
+	 * Counted by the thread that pops the queue, or uses its used ring,
+	 * see virtio__stats_add()
+	 */
+	u64	pops;
+	/* Buffers available at each pop of a split ring, the popped one too */
+	u64	avail_total;
+	u64	avail_samples;
+	u64	avail_max;
+	/* virtio_queue__should_signal() didn't want an interrupt */
+	u64	suppressed;
+};
+
+/* KVM_IPC_VQ_STATS replies with a u32 count followed by that many of these */
+struct virtio_vq_stats_msg {
+	char			device[16];
+	u32			queue;
+	struct virtio_vq_stats	stats;
+};
+
 struct virt_queue {
 	struct vring	vring;
 	struct vring_addr vring_addr;
@@ -77,12 +142,32 @@ struct virt_queue {
 	u16		endian;
 	bool		use_event_idx;
 	bool		enabled;
+	/* See virt_queue__disable_notify() */
+	bool		notify_disabled;
+	/* Set when VIRTIO_F_RING_PACKED was negotiated */
+	struct virt_queue_packed *packed;
 	struct virtio_device *vdev;
+	/*
+	 * Most descriptors the get_iov helpers return for a chain, vring.num
+	 * unless the device sized its iovecs for shorter chains.
+	 */
+	u16		max_chain;
 
 	/* vhost IRQ handling */
 	int		gsi;
 	int		irqfd;
 	int		index;
+	/*
+	 * Without an MSI, irqfd is attached to the interrupt line of the
+	 * transport, with resamplefd when the line is level-triggered. It is
+	 * -1 for edge-triggered lines, and only valid while irqfd_line is set.
+	 */
+	bool		irqfd_line;
+	int		resamplefd;
+	/* Used index of the split ring when the guest last read the ISR */
+	u16		line_used;
+	/* In the virtio_device, NULL past VIRTIO_STATS_MAX_VQ */
+	struct virtio_vq_stats *stats;
 };
 
 /*
@@ -96,34 +181,41 @@ struct virt_queue {
 
 #if VIRTIO_RING_ENDIAN != VIRTIO_ENDIAN_HOST
 
+/*
+ * @endian is that of the queue, set once by the guest, so the branch always
+ * goes the same way, and guests of the host's endianness don't swap at all.
+ */
+#define virtio_is_host_endian(endian)	\
+	__builtin_expect((endian) == VIRTIO_ENDIAN_HOST, 1)
+
 static inline u16 virtio_guest_to_host_u16(u16 endian, u16 val)
 {
-	return (endian == VIRTIO_ENDIAN_LE) ? le16toh(val) : be16toh(val);
+	return virtio_is_host_endian(endian) ? val : __builtin_bswap16(val);
 }
 
 static inline u16 virtio_host_to_guest_u16(u16 endian, u16 val)
 {
-	return (endian == VIRTIO_ENDIAN_LE) ? htole16(val) : htobe16(val);
+	return virtio_is_host_endian(endian) ? val : __builtin_bswap16(val);
 }
 
 static inline u32 virtio_guest_to_host_u32(u16 endian, u32 val)
 {
-	return (endian == VIRTIO_ENDIAN_LE) ? le32toh(val) : be32toh(val);
+	return virtio_is_host_endian(endian) ? val : __builtin_bswap32(val);
 }
 
 static inline u32 virtio_host_to_guest_u32(u16 endian, u32 val)
 {
-	return (endian == VIRTIO_ENDIAN_LE) ? htole32(val) : htobe32(val);
+	return virtio_is_host_endian(endian) ? val : __builtin_bswap32(val);
 }
 
 static inline u64 virtio_guest_to_host_u64(u16 endian, u64 val)
 {
-	return (endian == VIRTIO_ENDIAN_LE) ? le64toh(val) : be64toh(val);
+	return virtio_is_host_endian(endian) ? val : __builtin_bswap64(val);
 }
 
 static inline u64 virtio_host_to_guest_u64(u16 endian, u64 val)
 {
-	return (endian == VIRTIO_ENDIAN_LE) ? htole64(val) : htobe64(val);
+	return virtio_is_host_endian(endian) ? val : __builtin_bswap64(val);
 }
 
 #else
@@ -155,10 +247,48 @@ static inline u64 virtio_host_to_guest_u64(u16 endian, u64 value)
 
 #endif
 
+u16 virt_queue__pop_packed(struct virt_queue *queue);
+void virt_queue__unpop_packed(struct virt_queue *queue, u16 n);
+bool virt_queue__available_packed(struct virt_queue *vq);
+
+/*
+ * For the counters that have a single writer: a plain add, no atomic one,
+ * only the readers on other threads mustn't see a torn value.
+ */
+static inline void virtio__stats_add(u64 *counter, u64 val)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) +
+			 val, __ATOMIC_RELAXED);
+}
+
+static inline void virt_queue__account_pop(struct virt_queue *queue)
+{
+	struct virtio_vq_stats *stats = queue->stats;
+	u16 avail;
+
+	if (!stats)
+		return;
+
+	virtio__stats_add(&stats->pops, 1);
+	if (queue->packed)
+		return;
+
+	avail = virtio_guest_to_host_u16(queue->endian, queue->vring.avail->idx) -
+		queue->last_avail_idx;
+	virtio__stats_add(&stats->avail_total, avail);
+	virtio__stats_add(&stats->avail_samples, 1);
+	if (avail > stats->avail_max)
+		__atomic_store_n(&stats->avail_max, avail, __ATOMIC_RELAXED);
+}
+
 static inline u16 virt_queue__pop(struct virt_queue *queue)
 {
 	__u16 guest_idx;
 
+	virt_queue__account_pop(queue);
+	if (queue->packed)
+		return virt_queue__pop_packed(queue);
+
 	/*
 	 * The guest updates the avail index after writing the ring entry.
 	 * Ensure that we read the updated entry once virt_queue__available()
@@ -170,19 +300,40 @@ static inline u16 virt_queue__pop(struct virt_queue *queue)
 	return virtio_guest_to_host_u16(queue->endian, guest_idx);
 }
 
+/* Give back the last @n heads popped, they will be returned again */
+static inline void virt_queue__unpop(struct virt_queue *queue, u16 n)
+{
+	if (queue->stats)
+		virtio__stats_add(&queue->stats->pops, -(u64)n);
+	if (queue->packed)
+		virt_queue__unpop_packed(queue, n);
+	else
+		queue->last_avail_idx -= n;
+}
+
 static inline struct vring_desc *virt_queue__get_desc(struct virt_queue *queue, u16 desc_ndx)
 {
 	return &queue->vring.desc[desc_ndx];
 }
 
+/* Set while a snapshot is taken, see virtio__freeze() */
+extern bool virtio_frozen;
+
 static inline bool virt_queue__available(struct virt_queue *vq)
 {
 	u16 last_avail_idx = virtio_host_to_guest_u16(vq->endian, vq->last_avail_idx);
 
+	if (virtio_frozen)
+		return false;
+
+	if (vq->packed)
+		return virt_queue__available_packed(vq);
+
 	if (!vq->vring.avail)
 		return 0;
 
-	if (vq->use_event_idx) {
+	if (vq->use_event_idx && !vq->notify_disabled) {
+		dirty_log__mark(&vring_avail_event(&vq->vring), sizeof(u16));
 		vring_avail_event(&vq->vring) = last_avail_idx;
 		/*
 		 * After the driver writes a new avail index, it reads the event
@@ -195,11 +346,59 @@ static inline bool virt_queue__available(struct virt_queue *vq)
 	return vq->vring.avail->idx != last_avail_idx;
 }
 
+void virt_queue__disable_notify(struct virt_queue *vq);
+bool virt_queue__enable_notify(struct virt_queue *vq);
+
 void virt_queue__used_idx_advance(struct virt_queue *queue, u16 jump);
 struct vring_used_elem * virt_queue__set_used_elem_no_update(struct virt_queue *queue, u32 head, u32 len, u16 offset);
 struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32 head, u32 len);
 
 bool virtio_queue__should_signal(struct virt_queue *vq);
+
+/*
+ * Used elements added to a batch only become visible to the guest when the
+ * batch is published, with a single barrier and used index update. Whoever
+ * adds to the batch of a queue serializes with its other users of the used
+ * ring.
+ */
+struct virt_queue_batch {
+	struct virt_queue	*vq;
+	u16			nr;
+};
+
+static inline void virt_queue__batch_begin(struct virt_queue_batch *batch,
+					   struct virt_queue *vq)
+{
+	batch->vq = vq;
+	batch->nr = 0;
+}
+
+static inline void virt_queue__batch_add(struct virt_queue_batch *batch,
+					 u32 head, u32 len)
+{
+	virt_queue__set_used_elem_no_update(batch->vq, head, len, batch->nr++);
+}
+
+u16 virt_queue__batch_publish(struct virt_queue_batch *batch);
+bool virt_queue__batch_commit(struct virt_queue_batch *batch);
+/*
+ * Before going back to sleep, a device thread can keep looking at its queue
+ * for a while, with notifications still disabled. The window adapts to how
+ * long the thread ends up sleeping: it grows when the next request comes
+ * shortly after giving up, and shrinks when the queue stays idle for longer
+ * than max_ns.
+ */
+struct virtio_poll {
+	u64			max_ns;
+	u64			window_ns;
+	/* When the queue was last found empty, 0 once it is busy again */
+	u64			idle_start;
+};
+
+void virtio_poll__init(struct virtio_poll *poll, u32 max_us);
+bool virtio_poll__spin(struct virtio_poll *poll, struct virt_queue *vq);
+void virtio_poll__woken(struct virtio_poll *poll);
+
 u16 virt_queue__get_iov(struct virt_queue *vq, struct iovec iov[],
 			u16 *out, u16 *in, struct kvm *kvm);
 u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[],
@@ -208,6 +407,7 @@ u16 virt_queue__get_inout_iov(struct kvm *kvm, struct virt_queue *queue,
 			      struct iovec in_iov[], struct iovec out_iov[],
 			      u16 *in, u16 *out);
 int virtio__get_dev_specific_field(int offset, bool msix, u32 *config_off);
+u64 virtio_modern_features(struct virtio_device *vdev);
 
 enum virtio_trans {
 	VIRTIO_PCI,
@@ -219,13 +419,65 @@ enum virtio_trans {
 struct virtio_device {
 	bool			legacy;
 	bool			use_vhost;
+	/* With use_vhost, the virtqueues that are still serviced here */
+	u64			user_vqs;
+	/* With use_vhost, those with a kernel worker of their own */
+	u64			vhost_worker_vqs;
+	/*
+	 * Virtqueues whose device thread polls the ioeventfd itself, handed
+	 * over with notify_vq_eventfd(). notify_vq() is only called for the
+	 * kicks that don't go through it.
+	 */
+	u64			direct_vqs;
 	void			*virtio;
 	struct virtio_ops	*ops;
 	u16			endian;
 	u64			features;
 	u32			status;
+
+	/* In the list of all devices, by type and index within that type */
+	struct list_head	list;
+	void			*dev;
+	int			subsys_id;
+	int			index;
+	enum virtio_trans	trans;
+	/* Word of the --virtio-doorbell bitmap that kicks its queues */
+	u32			doorbell;
+	/* vhost queues whose irqfd is on the interrupt line, atomic */
+	u32			line_irqfds;
+	struct virtio_vq_stats	vq_stats[VIRTIO_STATS_MAX_VQ];
 };
 
+static inline void virtio__account_kicks(struct virtio_device *vdev, u32 vq,
+					 u64 nr)
+{
+	if (vq < VIRTIO_STATS_MAX_VQ)
+		__atomic_fetch_add(&vdev->vq_stats[vq].kicks, nr,
+				   __ATOMIC_RELAXED);
+}
+
+static inline void virtio__account_kick(struct virtio_device *vdev, u32 vq)
+{
+	virtio__account_kicks(vdev, vq, 1);
+}
+
+/* Whether the ioeventfd thread reads the kicks of @vq and calls notify_vq() */
+static inline bool virtio__relay_kicks(struct virtio_device *vdev, u32 vq)
+{
+	if (vdev->direct_vqs & (1ULL << vq))
+		return false;
+
+	/* Vhost polls the eventfd in host kernel side */
+	return !vdev->use_vhost || vdev->user_vqs & (1ULL << vq);
+}
+
+static inline void virtio__account_irq(struct virtio_device *vdev, u32 vq)
+{
+	if (vq < VIRTIO_STATS_MAX_VQ)
+		__atomic_fetch_add(&vdev->vq_stats[vq].irqs, 1,
+				   __ATOMIC_RELAXED);
+}
+
 struct virtio_ops {
 	u8 *(*get_config)(struct kvm *kvm, void *dev);
 	size_t (*get_config_size)(struct kvm *kvm, void *dev);
@@ -241,23 +493,65 @@ struct virtio_ops {
 	void (*notify_vq_eventfd)(struct kvm *kvm, void *dev, u32 vq, u32 efd);
 	int (*signal_vq)(struct kvm *kvm, struct virtio_device *vdev, u32 queueid);
 	int (*signal_config)(struct kvm *kvm, struct virtio_device *vdev);
+	/* GSI of the interrupt line of the transport, and whether it's level */
+	int (*get_irq_line)(struct kvm *kvm, struct virtio_device *vdev,
+			    bool *level);
 	void (*notify_status)(struct kvm *kvm, void *dev, u32 status);
+	/* The driver wrote @size bytes of the config at @offset */
+	void (*set_config)(struct kvm *kvm, void *dev, u32 offset, u32 size);
+	/*
+	 * Host memory of the shared memory region of the device, if any. Its
+	 * size must be a power of two, and it is mapped into the guest as is.
+	 */
+	void *(*get_shm_region)(struct kvm *kvm, void *dev, u8 *id, u64 *size);
 	int (*init)(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 		    int device_id, int subsys_id, int class);
 	int (*exit)(struct kvm *kvm, struct virtio_device *vdev);
 	int (*reset)(struct kvm *kvm, struct virtio_device *vdev);
 };
 
+/* Where a queue is, and how far the device went along it */
+struct virtio_vq_state {
+	u32			enabled;
+	u32			size;
+	struct vring_addr	addr;
+	u16			last_avail_idx;
+	u16			last_used_signalled;
+	/* Packed rings only */
+	u16			used_idx;
+	u16			signalled_used;
+	u8			avail_wrap;
+	u8			used_wrap;
+	u8			signalled_used_valid;
+	u8			reserved;
+};
+
+void virtio__freeze(struct kvm *kvm, int timeout_ms);
+void virtio__thaw(struct kvm *kvm);
+bool virtio__wait_idle(struct kvm *kvm, struct virtio_device *vdev, void *dev);
+void virtio_vq__save_state(struct virt_queue *vq, struct virtio_vq_state *state);
+void virtio_vq__restore_state(struct virt_queue *vq,
+			      struct virtio_vq_state *state);
+
 int __must_check virtio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 			     struct virtio_ops *ops, enum virtio_trans trans,
 			     int device_id, int subsys_id, int class);
 void virtio_exit(struct kvm *kvm, struct virtio_device *vdev);
 int virtio_compat_add_message(const char *device, const char *config);
 const char* virtio_trans_name(enum virtio_trans trans);
+/* The device with @doorbell, NULL when there is none */
+struct virtio_device *virtio__find_doorbell(u32 doorbell);
 void virtio_init_device_vq(struct kvm *kvm, struct virtio_device *vdev,
 			   struct virt_queue *vq, size_t nr_descs);
+void virtio_vq__attach_stats(struct kvm *kvm, struct virtio_device *vdev,
+			     u32 vq);
+int virtio_vq__check_size(u32 size);
+u32 virtio_vq__max_size(struct virtio_device *vdev, u32 size);
+u32 virtio_vq__accept_size(struct virtio_device *vdev, u32 max, int size);
 void virtio_exit_vq(struct kvm *kvm, struct virtio_device *vdev, void *dev,
 		    int num);
+void virtio_ioeventfd_failed(struct kvm *kvm, struct virtio_device *vdev,
+			     u32 vq, int err);
 bool virtio_access_config(struct kvm *kvm, struct virtio_device *vdev, void *dev,
 			  unsigned long offset, void *data, size_t size,
 			  bool is_write);
@@ -266,12 +560,21 @@ void virtio_set_guest_features(struct kvm *kvm, struct virtio_device *vdev,
 void virtio_notify_status(struct kvm *kvm, struct virtio_device *vdev,
 			  void *dev, u8 status);
 void virtio_vhost_init(struct kvm *kvm, int vhost_fd);
+int virtio_vhost_get_call_fd(struct kvm *kvm, struct virt_queue *queue);
+void virtio_vhost_put_call_fd(struct kvm *kvm, struct virt_queue *queue);
 void virtio_vhost_set_vring(struct kvm *kvm, int vhost_fd, u32 index,
 			    struct virt_queue *queue);
+void virtio_vhost_set_vring_iova(struct kvm *kvm, int vhost_fd, u32 index,
+				 struct virt_queue *queue);
 void virtio_vhost_set_vring_kick(struct kvm *kvm, int vhost_fd,
 				 u32 index, int event_fd);
+void virtio_vhost_set_vring_worker(struct virtio_device *vdev, int vhost_fd,
+				   u32 vq, u32 index);
+void virtio_vhost_set_vring_busyloop(int vhost_fd, u32 index, u32 timeout_us);
 void virtio_vhost_set_vring_irqfd(struct kvm *kvm, u32 gsi,
 				  struct virt_queue *queue);
+void virtio_vhost_line_ack(struct kvm *kvm, struct virtio_device *vdev,
+			   void *dev);
 void virtio_vhost_reset_vring(struct kvm *kvm, int vhost_fd, u32 index,
 			      struct virt_queue *queue);
 int virtio_vhost_set_features(int vhost_fd, u64 features);
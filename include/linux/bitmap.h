@@ -67,5 +67,16 @@ static inline bool bitmap_subset(const unsigned long *src1,
 	return __bitmap_subset(src1, src2, nbits);
 }
 
+unsigned int __bitmap_weight(const unsigned long *bitmap, unsigned int nbits);
+
+static inline unsigned int bitmap_weight(const unsigned long *src,
+					 unsigned int nbits)
+{
+	if (nbits <= BITS_PER_LONG)
+		return __builtin_popcountl(*src & BITMAP_LAST_WORD_MASK(nbits));
+
+	return __bitmap_weight(src, nbits);
+}
+
 
 #endif /* KVM__BITMAP_H */
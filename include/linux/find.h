@@ -27,4 +27,21 @@ unsigned long find_next_bit(const unsigned long *addr, unsigned long size,
 	return _find_next_bit(addr, NULL, size, offset, 0);
 }
 
+static inline
+unsigned long find_next_zero_bit(const unsigned long *addr, unsigned long size,
+				 unsigned long offset)
+{
+	if (size >= 0 && size <= BITS_PER_LONG) {
+		unsigned long val;
+
+		if (offset >= size)
+			return size;
+
+		val = *addr | ~GENMASK(size - 1, offset);
+		return val == ~0UL ? size : (unsigned long)__builtin_ctzl(~val);
+	}
+
+	return _find_next_bit(addr, NULL, size, offset, ~0UL);
+}
+
 #endif /* LINUX__FIND_H */
@@ -1,6 +1,9 @@
 #ifndef KVM__LINUX_PREFETCH_H
 #define KVM__LINUX_PREFETCH_H
 
-static inline void prefetch(void *a __attribute__((unused))) { }
+static inline void prefetch(const void *a)
+{
+	__builtin_prefetch(a);
+}
 
 #endif
@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <signal.h>
+#include <string.h>
 
 #include <linux/kernel.h>
 #include <linux/kvm.h>
@@ -31,11 +32,30 @@ static void ioeventfd__handle_event(struct kvm *kvm, struct epoll_event *ev)
 	ioevent->fn(ioevent->fn_kvm, ioevent->fn_ptr);
 }
 
+int ioeventfd_parser(const struct option *opt, const char *arg, int unset)
+{
+	bool *strict = opt->value;
+
+	if (!strcmp(arg, "strict")) {
+		*strict = true;
+	} else if (!strcmp(arg, "auto")) {
+		*strict = false;
+	} else {
+		pr_err("ioeventfd: unknown mode \"%s\"", arg);
+		return -1;
+	}
+
+	return 0;
+}
+
 int ioeventfd__init(struct kvm *kvm)
 {
 	ioeventfd_avail = kvm__supports_extension(kvm, KVM_CAP_IOEVENTFD);
-	if (!ioeventfd_avail)
+	if (!ioeventfd_avail) {
+		if (kvm->cfg.ioeventfd_strict)
+			die("KVM doesn't support ioeventfd");
 		return 1; /* Not fatal, but let caller determine no-go. */
+	}
 
 	return epoll__init(kvm, &epoll, "ioeventfd-worker",
 			   ioeventfd__handle_event);
@@ -59,12 +79,19 @@ int ioeventfd__add_event(struct ioevent *ioevent, int flags)
 	struct ioevent *new_ioevent;
 	int event, r;
 
-	if (!ioeventfd_avail)
-		return -ENOSYS;
+	if (ioevent->fd < 0)
+		return -EBADF;
+
+	if (!ioeventfd_avail) {
+		r = -ENOSYS;
+		goto err_close;
+	}
 
 	new_ioevent = malloc(sizeof(*new_ioevent));
-	if (new_ioevent == NULL)
-		return -ENOMEM;
+	if (new_ioevent == NULL) {
+		r = -ENOMEM;
+		goto err_close;
+	}
 
 	*new_ioevent = *ioevent;
 	event = new_ioevent->fd;
@@ -74,9 +101,11 @@ int ioeventfd__add_event(struct ioevent *ioevent, int flags)
 		.len		= ioevent->io_len,
 		.datamatch	= ioevent->datamatch,
 		.fd		= event,
-		.flags		= KVM_IOEVENTFD_FLAG_DATAMATCH,
 	};
 
+	if (!(flags & IOEVENTFD_FLAG_NO_DATAMATCH))
+		kvm_ioevent.flags |= KVM_IOEVENTFD_FLAG_DATAMATCH;
+
 	/*
 	 * For architectures that don't recognize PIO accesses, always register
 	 * on the MMIO bus. Otherwise PIO accesses will cause returns to
@@ -100,6 +129,8 @@ int ioeventfd__add_event(struct ioevent *ioevent, int flags)
 		r = epoll_ctl(epoll.fd, EPOLL_CTL_ADD, event, &epoll_event);
 		if (r) {
 			r = -errno;
+			kvm_ioevent.flags |= KVM_IOEVENTFD_FLAG_DEASSIGN;
+			ioctl(ioevent->fn_kvm->vm_fd, KVM_IOEVENTFD, &kvm_ioevent);
 			goto cleanup;
 		}
 	}
@@ -111,6 +142,8 @@ int ioeventfd__add_event(struct ioevent *ioevent, int flags)
 
 cleanup:
 	free(new_ioevent);
+err_close:
+	close(ioevent->fd);
 	return r;
 }
 
@@ -0,0 +1,135 @@
+#include <sys/epoll.h>
+#include <stdio.h>
+
+#include "kvm/epoll.h"
+#include "kvm/iothread.h"
+#include "kvm/kvm.h"
+#include "kvm/mutex.h"
+#include "kvm/util.h"
+
+/*
+ * With --iothreads=N, the virtqueues of the devices are served by N shared
+ * event loops rather than by threads of their own. Each device sticks to one
+ * loop, picked in turn unless given with its iothread= parameter.
+ */
+struct iothread {
+	struct kvm__epoll	epoll;
+	/* Held while running a handler, so that iothread__del() can wait */
+	struct mutex		lock;
+	char			name[32];
+};
+
+static struct iothread	*iothreads;
+static int		nr_iothreads;
+static int		next_iothread;
+
+static void iothread__handle_event(struct kvm *kvm, struct epoll_event *ev)
+{
+	struct iothread_handler *handler = ev->data.ptr;
+	struct iothread *iothread;
+
+	/* The handler may have been removed since epoll_wait() returned */
+	iothread = __atomic_load_n(&handler->iothread, __ATOMIC_ACQUIRE);
+	if (!iothread)
+		return;
+
+	mutex_lock(&iothread->lock);
+	if (handler->iothread == iothread)
+		handler->handle(kvm, handler);
+	mutex_unlock(&iothread->lock);
+}
+
+/* The loop a device runs on, or -1 for threads of its own */
+int iothread__pick(struct kvm *kvm, int iothread)
+{
+	if (!nr_iothreads)
+		return -1;
+
+	if (iothread < 0)
+		iothread = __atomic_fetch_add(&next_iothread, 1,
+					      __ATOMIC_RELAXED);
+
+	return iothread % nr_iothreads;
+}
+
+int iothread__add(int iothread, struct iothread_handler *handler)
+{
+	struct iothread *owner = &iothreads[iothread];
+	struct epoll_event ev = {
+		.events		= EPOLLIN,
+		.data.ptr	= handler,
+	};
+
+	__atomic_store_n(&handler->iothread, owner, __ATOMIC_RELEASE);
+	if (epoll_ctl(owner->epoll.fd, EPOLL_CTL_ADD, handler->fd, &ev) < 0) {
+		handler->iothread = NULL;
+		return -errno;
+	}
+
+	return 0;
+}
+
+/* Once this returns, the handler isn't running and won't be called again */
+void iothread__del(struct iothread_handler *handler)
+{
+	struct iothread *owner = handler->iothread;
+
+	if (!owner)
+		return;
+
+	mutex_lock(&owner->lock);
+	epoll_ctl(owner->epoll.fd, EPOLL_CTL_DEL, handler->fd, NULL);
+	__atomic_store_n(&handler->iothread, NULL, __ATOMIC_RELEASE);
+	mutex_unlock(&owner->lock);
+}
+
+int iothread__init(struct kvm *kvm)
+{
+	int i, r;
+
+	if (kvm->cfg.nr_iothreads < 0)
+		die("Invalid number of iothreads %d", kvm->cfg.nr_iothreads);
+
+	if (!kvm->cfg.nr_iothreads)
+		return 0;
+
+	iothreads = calloc(kvm->cfg.nr_iothreads, sizeof(*iothreads));
+	if (!iothreads)
+		return -ENOMEM;
+
+	for (i = 0; i < kvm->cfg.nr_iothreads; i++) {
+		mutex_init(&iothreads[i].lock);
+		snprintf(iothreads[i].name, sizeof(iothreads[i].name),
+			 "iothread-%d", i);
+		r = epoll__init(kvm, &iothreads[i].epoll, iothreads[i].name,
+				iothread__handle_event);
+		if (r < 0)
+			goto err_exit;
+		nr_iothreads++;
+	}
+
+	return 0;
+
+err_exit:
+	while (i--)
+		epoll__exit(&iothreads[i].epoll);
+	free(iothreads);
+	iothreads = NULL;
+	nr_iothreads = 0;
+	return r;
+}
+base_init(iothread__init);
+
+int iothread__exit(struct kvm *kvm)
+{
+	int i;
+
+	for (i = 0; i < nr_iothreads; i++)
+		epoll__exit(&iothreads[i].epoll);
+
+	free(iothreads);
+	iothreads = NULL;
+	nr_iothreads = 0;
+	return 0;
+}
+base_exit(iothread__exit);
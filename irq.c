@@ -1,22 +1,67 @@
 #include <stdlib.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <linux/types.h>
 #include <linux/kvm.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "kvm/kvm.h"
 #include "kvm/irq.h"
 #include "kvm/kvm-arch.h"
+#include "kvm/epoll.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/metrics.h"
+#include "kvm/mutex.h"
+#include "kvm/probe.h"
 
 static u8 next_line = KVM_IRQ_OFFSET;
-static int allocated_gsis = 0;
-
-int next_gsi;
 
 struct msi_routing_ops irq__default_routing_ops;
 struct msi_routing_ops *msi_routing_ops = &irq__default_routing_ops;
 
-struct kvm_irq_routing *irq_routing = NULL;
+/*
+ * The GSI routing of a VM. KVM rebuilds all of its routing on each
+ * KVM_SET_GSI_ROUTING, so changes made while setting a device up are
+ * committed together. The lock protects the table once vCPUs run, and
+ * everything below it.
+ */
+struct kvm_irq_routes {
+	struct kvm_irq_routing	*table;
+	int			allocated;
+	int			next_gsi;
+	struct mutex		lock;
+	/* Index + 1 in the table of the MSI route of each GSI, 0 for none */
+	u32			*gsi_entries;
+	u32			nr_gsi_entries;
+	/* Changes not handed to KVM yet */
+	bool			dirty;
+	struct {
+		u64		updates;
+		u64		commits;
+		u64		commit_ns;
+	} stats;
+};
+
+struct kvm_irq_routes *irq__new_routes(void)
+{
+	struct kvm_irq_routes *routes = calloc(1, sizeof(*routes));
+
+	if (routes)
+		mutex_init(&routes->lock);
+
+	return routes;
+}
+
+void irq__free_routes(struct kvm_irq_routes *routes)
+{
+	if (!routes)
+		return;
+
+	free(routes->table);
+	free(routes->gsi_entries);
+	free(routes);
+}
 
 int irq__alloc_line(void)
 {
@@ -28,33 +73,68 @@ int irq__get_nr_allocated_lines(void)
 	return next_line - KVM_IRQ_OFFSET;
 }
 
-int irq__allocate_routing_entry(void)
+static int irq__allocate_routing_entry(struct kvm_irq_routes *routes)
 {
 	size_t table_size = sizeof(struct kvm_irq_routing);
 	size_t old_size = table_size;
+	struct kvm_irq_routing *table;
 	int nr_entries = 0;
 
-	if (irq_routing)
-		nr_entries = irq_routing->nr;
+	if (routes->table)
+		nr_entries = routes->table->nr;
 
-	if (nr_entries < allocated_gsis)
+	if (nr_entries < routes->allocated)
 		return 0;
 
-	old_size += sizeof(struct kvm_irq_routing_entry) * allocated_gsis;
-	allocated_gsis = ALIGN(nr_entries + 1, 32);
-	table_size += sizeof(struct kvm_irq_routing_entry) * allocated_gsis;
-	irq_routing = realloc(irq_routing, table_size);
-
-	if (irq_routing == NULL)
+	old_size += sizeof(struct kvm_irq_routing_entry) * routes->allocated;
+	table_size += sizeof(struct kvm_irq_routing_entry) *
+		      ALIGN(nr_entries + 1, 32);
+	table = realloc(routes->table, table_size);
+	if (table == NULL)
 		return -ENOMEM;
-	memset((void *)irq_routing + old_size, 0, table_size - old_size);
 
-	irq_routing->nr = nr_entries;
-	irq_routing->flags = 0;
+	routes->table = table;
+	routes->allocated = ALIGN(nr_entries + 1, 32);
+	memset((void *)table + old_size, 0, table_size - old_size);
+
+	table->nr = nr_entries;
+	table->flags = 0;
+
+	return 0;
+}
+
+/* The routes of the interrupt controller, which KVM has until it's told */
+int irq__add_irqchip_route(struct kvm *kvm, u32 gsi, u32 irqchip, u32 pin)
+{
+	struct kvm_irq_routes *routes = kvm->irq_routes;
+	int r;
+
+	r = irq__allocate_routing_entry(routes);
+	if (r)
+		return r;
+
+	routes->table->entries[routes->table->nr++] =
+		(struct kvm_irq_routing_entry) {
+			.gsi = gsi,
+			.type = KVM_IRQ_ROUTING_IRQCHIP,
+			.u.irqchip.irqchip = irqchip,
+			.u.irqchip.pin = pin,
+		};
 
 	return 0;
 }
 
+/* MSI routes get GSIs from @gsi upwards */
+void irq__set_next_gsi(struct kvm *kvm, int gsi)
+{
+	kvm->irq_routes->next_gsi = gsi;
+}
+
+int irq__set_routes(struct kvm *kvm)
+{
+	return ioctl(kvm->vm_fd, KVM_SET_GSI_ROUTING, kvm->irq_routes->table);
+}
+
 static bool check_for_irq_routing(struct kvm *kvm)
 {
 	static int has_irq_routing = 0;
@@ -69,10 +149,9 @@ static bool check_for_irq_routing(struct kvm *kvm)
 	return has_irq_routing > 0;
 }
 
-static int irq__update_msix_routes(struct kvm *kvm,
-				   struct kvm_irq_routing_entry *entry)
+static int irq__commit_msix_routes(struct kvm *kvm)
 {
-	return ioctl(kvm->vm_fd, KVM_SET_GSI_ROUTING, irq_routing);
+	return irq__set_routes(kvm);
 }
 
 static bool irq__default_can_signal_msi(struct kvm *kvm)
@@ -86,7 +165,7 @@ static int irq__default_signal_msi(struct kvm *kvm, struct kvm_msi *msi)
 }
 
 struct msi_routing_ops irq__default_routing_ops = {
-	.update_route	= irq__update_msix_routes,
+	.commit_routes	= irq__commit_msix_routes,
 	.signal_msi	= irq__default_signal_msi,
 	.can_signal_msi	= irq__default_can_signal_msi,
 };
@@ -98,24 +177,111 @@ bool irq__can_signal_msi(struct kvm *kvm)
 
 int irq__signal_msi(struct kvm *kvm, struct kvm_msi *msi)
 {
+	kvm__probe(irq_msi, msi->address_lo, msi->data);
 	return msi_routing_ops->signal_msi(kvm, msi);
 }
 
-int irq__add_msix_route(struct kvm *kvm, struct msi_msg *msg, u32 device_id)
+/* With the routes lock held */
+static int irq__flush_routes_locked(struct kvm *kvm)
+{
+	struct kvm_irq_routes *routes = kvm->irq_routes;
+	u64 start;
+	int r;
+
+	if (!routes->dirty)
+		return 0;
+
+	start = kvm_cpu__now();
+	r = msi_routing_ops->commit_routes(kvm);
+	if (r)
+		return r;
+
+	routes->dirty = false;
+	routes->stats.commits++;
+	routes->stats.commit_ns += kvm_cpu__now() - start;
+
+	return 0;
+}
+
+/* Hand the deferred route changes to KVM, before their GSIs may fire */
+int irq__flush_routes(struct kvm *kvm)
 {
+	struct kvm_irq_routes *routes = kvm->irq_routes;
 	int r;
+
+	if (!__atomic_load_n(&routes->dirty, __ATOMIC_ACQUIRE))
+		return 0;
+
+	mutex_lock(&routes->lock);
+	r = irq__flush_routes_locked(kvm);
+	mutex_unlock(&routes->lock);
+
+	return r;
+}
+
+/* With the routes lock held */
+static int irq__route_changed(struct kvm *kvm,
+			      struct kvm_irq_routing_entry *entry, bool defer)
+{
+	int r;
+
+	kvm->irq_routes->stats.updates++;
+
+	if (msi_routing_ops->update_route) {
+		r = msi_routing_ops->update_route(kvm, entry);
+		if (r)
+			return r;
+	}
+
+	if (!msi_routing_ops->commit_routes)
+		return 0;
+
+	__atomic_store_n(&kvm->irq_routes->dirty, true, __ATOMIC_RELEASE);
+	return defer ? 0 : irq__flush_routes_locked(kvm);
+}
+
+static int irq__map_gsi(struct kvm_irq_routes *routes, u32 gsi, u32 index)
+{
+	u32 nr = routes->nr_gsi_entries;
+	u32 *map;
+
+	if (gsi >= nr) {
+		nr = ALIGN(gsi + 1, 64);
+		map = realloc(routes->gsi_entries, nr * sizeof(*map));
+		if (!map)
+			return -ENOMEM;
+
+		memset(map + routes->nr_gsi_entries, 0,
+		       (nr - routes->nr_gsi_entries) * sizeof(*map));
+		routes->gsi_entries = map;
+		routes->nr_gsi_entries = nr;
+	}
+
+	routes->gsi_entries[gsi] = index + 1;
+	return 0;
+}
+
+static int __irq__add_msix_route(struct kvm *kvm, struct msi_msg *msg,
+				 u32 device_id, bool defer)
+{
+	struct kvm_irq_routes *routes = kvm->irq_routes;
 	struct kvm_irq_routing_entry *entry;
+	int r;
 
 	if (!check_for_irq_routing(kvm))
 		return -ENXIO;
 
-	r = irq__allocate_routing_entry();
+	r = irq__allocate_routing_entry(routes);
 	if (r)
 		return r;
 
-	entry = &irq_routing->entries[irq_routing->nr];
+	r = irq__map_gsi(routes, routes->next_gsi, routes->table->nr);
+	if (r)
+		return r;
+
+	entry = &routes->table->entries[routes->table->nr];
 	*entry = (struct kvm_irq_routing_entry) {
-		.gsi = next_gsi,
+		.gsi = routes->next_gsi,
 		.type = KVM_IRQ_ROUTING_MSI,
 		.u.msi.address_hi = msg->address_hi,
 		.u.msi.address_lo = msg->address_lo,
@@ -127,13 +293,40 @@ int irq__add_msix_route(struct kvm *kvm, struct msi_msg *msg, u32 device_id)
 		entry->u.msi.devid = device_id;
 	}
 
-	irq_routing->nr++;
+	routes->table->nr++;
 
-	r = msi_routing_ops->update_route(kvm, entry);
+	r = irq__route_changed(kvm, entry, defer);
 	if (r)
 		return r;
 
-	return next_gsi++;
+	return routes->next_gsi++;
+}
+
+int irq__add_msix_route(struct kvm *kvm, struct msi_msg *msg, u32 device_id)
+{
+	int r;
+
+	mutex_lock(&kvm->irq_routes->lock);
+	r = __irq__add_msix_route(kvm, msg, device_id, false);
+	mutex_unlock(&kvm->irq_routes->lock);
+
+	return r;
+}
+
+/*
+ * The route only exists in KVM after irq__flush_routes(): an irqfd can
+ * already be attached to the GSI, but it doesn't fire until then.
+ */
+int irq__add_msix_route_deferred(struct kvm *kvm, struct msi_msg *msg,
+				 u32 device_id)
+{
+	int r;
+
+	mutex_lock(&kvm->irq_routes->lock);
+	r = __irq__add_msix_route(kvm, msg, device_id, true);
+	mutex_unlock(&kvm->irq_routes->lock);
+
+	return r;
 }
 
 static bool update_data(u32 *ptr, u32 newdata)
@@ -145,29 +338,43 @@ static bool update_data(u32 *ptr, u32 newdata)
 	return true;
 }
 
-void irq__update_msix_route(struct kvm *kvm, u32 gsi, struct msi_msg *msg)
+static void __irq__update_msix_route(struct kvm *kvm, u32 gsi,
+				     struct msi_msg *msg, bool defer)
 {
+	struct kvm_irq_routes *routes = kvm->irq_routes;
 	struct kvm_irq_routing_msi *entry;
-	unsigned int i;
+	u32 i;
 	bool changed;
 
-	for (i = 0; i < irq_routing->nr; i++)
-		if (gsi == irq_routing->entries[i].gsi)
-			break;
-	if (i == irq_routing->nr)
-		return;
+	mutex_lock(&routes->lock);
+	if (gsi >= routes->nr_gsi_entries || !routes->gsi_entries[gsi])
+		goto out_unlock;
 
-	entry = &irq_routing->entries[i].u.msi;
+	i = routes->gsi_entries[gsi] - 1;
+	entry = &routes->table->entries[i].u.msi;
 
 	changed  = update_data(&entry->address_hi, msg->address_hi);
 	changed |= update_data(&entry->address_lo, msg->address_lo);
 	changed |= update_data(&entry->data, msg->data);
 
-	if (!changed)
-		return;
-
-	if (msi_routing_ops->update_route(kvm, &irq_routing->entries[i]))
+	if (changed &&
+	    irq__route_changed(kvm, &routes->table->entries[i], defer))
 		die_perror("KVM_SET_GSI_ROUTING");
+
+out_unlock:
+	mutex_unlock(&routes->lock);
+}
+
+void irq__update_msix_route(struct kvm *kvm, u32 gsi, struct msi_msg *msg)
+{
+	__irq__update_msix_route(kvm, gsi, msg, false);
+}
+
+/* Like irq__add_msix_route_deferred(), the GSI keeps its old route for now */
+void irq__update_msix_route_deferred(struct kvm *kvm, u32 gsi,
+				     struct msi_msg *msg)
+{
+	__irq__update_msix_route(kvm, gsi, msg, true);
 }
 
 int irq__common_add_irqfd(struct kvm *kvm, unsigned int gsi, int trigger_fd,
@@ -201,9 +408,266 @@ void irq__common_del_irqfd(struct kvm *kvm, unsigned int gsi, int trigger_fd)
 	ioctl(kvm->vm_fd, KVM_IRQFD, &irqfd);
 }
 
-int __attribute__((weak)) irq__exit(struct kvm *kvm)
+/*
+ * Lines of the emulated devices, raised with a write to an irqfd rather than
+ * with KVM_IRQ_LINE on the VM fd. Level lines also have a resample fd: KVM
+ * lowers them once the guest acks the interrupt, and they are raised again
+ * if the device still holds them high.
+ */
+#define IRQFD_LINES_MAX		1024
+#define IRQFD_NONE		-1
+#define IRQFD_FAILED		-2
+
+struct irqfd_line {
+	u32	gsi;
+	int	edge_fd;
+	int	trigger_fd;
+	int	resample_fd;
+	/* What the device drives the line to */
+	int	level;
+	/* Raised, and not acked by the guest yet */
+	int	asserted;
+};
+
+static struct irqfd_line *irqfd_lines[IRQFD_LINES_MAX];
+static DEFINE_MUTEX(irqfd_lock);
+static struct kvm__epoll irqfd_epoll;
+static bool irqfd_epoll_running;
+
+static int irqfd__signal(int fd)
+{
+	u64 one = 1;
+
+	return write(fd, &one, sizeof(one)) == sizeof(one) ? 0 : -errno;
+}
+
+static void irqfd__raise(struct irqfd_line *line)
+{
+	if (!__atomic_exchange_n(&line->asserted, 1, __ATOMIC_SEQ_CST))
+		irqfd__signal(line->trigger_fd);
+}
+
+static void irqfd__resample(struct kvm *kvm, struct epoll_event *ev)
+{
+	struct irqfd_line *line = ev->data.ptr;
+	u64 count;
+
+	if (read(line->resample_fd, &count, sizeof(count)) < 0)
+		return;
+
+	__atomic_store_n(&line->asserted, 0, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&line->level, __ATOMIC_SEQ_CST))
+		irqfd__raise(line);
+}
+
+static struct irqfd_line *irqfd__get_line(u32 gsi)
+{
+	struct irqfd_line *line;
+
+	if (gsi >= IRQFD_LINES_MAX)
+		return NULL;
+
+	line = __atomic_load_n(&irqfd_lines[gsi], __ATOMIC_ACQUIRE);
+	if (line)
+		return line;
+
+	mutex_lock(&irqfd_lock);
+	line = irqfd_lines[gsi];
+	if (!line) {
+		line = calloc(1, sizeof(*line));
+		if (line) {
+			line->gsi = gsi;
+			line->edge_fd = IRQFD_NONE;
+			line->trigger_fd = IRQFD_NONE;
+			line->resample_fd = IRQFD_NONE;
+			__atomic_store_n(&irqfd_lines[gsi], line, __ATOMIC_RELEASE);
+		}
+	}
+	mutex_unlock(&irqfd_lock);
+
+	return line;
+}
+
+/* With irqfd_lock held */
+static int irqfd__add_edge(struct kvm *kvm, struct irqfd_line *line)
+{
+	int fd, r;
+
+	fd = eventfd(0, 0);
+	if (fd < 0)
+		return -errno;
+
+	r = irq__add_irqfd(kvm, line->gsi, fd, -1);
+	if (r < 0) {
+		r = -errno;
+		close(fd);
+		return r;
+	}
+
+	__atomic_store_n(&line->edge_fd, fd, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* With irqfd_lock held */
+static int irqfd__add_level(struct kvm *kvm, struct irqfd_line *line)
+{
+	struct epoll_event ev = {
+		.events		= EPOLLIN,
+		.data.ptr	= line,
+	};
+	int trigger_fd, resample_fd, r;
+
+	if (!kvm__supports_extension(kvm, KVM_CAP_IRQFD_RESAMPLE))
+		return -ENOTSUP;
+
+	if (!irqfd_epoll_running) {
+		r = epoll__init(kvm, &irqfd_epoll, "irqfd-resample",
+				irqfd__resample);
+		if (r < 0)
+			return r;
+		irqfd_epoll_running = true;
+	}
+
+	trigger_fd = eventfd(0, 0);
+	if (trigger_fd < 0)
+		return -errno;
+
+	resample_fd = eventfd(0, EFD_NONBLOCK);
+	if (resample_fd < 0) {
+		r = -errno;
+		goto err_close_trigger;
+	}
+
+	r = irq__add_irqfd(kvm, line->gsi, trigger_fd, resample_fd);
+	if (r < 0) {
+		r = -errno;
+		goto err_close_resample;
+	}
+
+	line->resample_fd = resample_fd;
+	if (epoll_ctl(irqfd_epoll.fd, EPOLL_CTL_ADD, resample_fd, &ev) < 0) {
+		r = -errno;
+		irq__del_irqfd(kvm, line->gsi, trigger_fd);
+		goto err_close_resample;
+	}
+
+	__atomic_store_n(&line->trigger_fd, trigger_fd, __ATOMIC_RELEASE);
+	return 0;
+
+err_close_resample:
+	close(resample_fd);
+err_close_trigger:
+	close(trigger_fd);
+	line->trigger_fd = IRQFD_NONE;
+	line->resample_fd = IRQFD_NONE;
+	return r;
+}
+
+/*
+ * Set up the fd of a line on first use. If KVM can't take one, the line is
+ * left to KVM_IRQ_LINE from then on.
+ */
+static int irqfd__get_fd(struct kvm *kvm, struct irqfd_line *line, int *fd,
+			 int (*add)(struct kvm *kvm, struct irqfd_line *line))
+{
+	int r = __atomic_load_n(fd, __ATOMIC_ACQUIRE);
+
+	if (r >= 0)
+		return r;
+	if (r == IRQFD_FAILED)
+		return -ENODEV;
+
+	mutex_lock(&irqfd_lock);
+	if (*fd == IRQFD_NONE) {
+		r = add(kvm, line);
+		if (r < 0) {
+			pr_debug("No irqfd for GSI %u: %s", line->gsi,
+				 strerror(-r));
+			__atomic_store_n(fd, IRQFD_FAILED, __ATOMIC_RELEASE);
+		}
+	}
+	r = *fd;
+	mutex_unlock(&irqfd_lock);
+
+	return r >= 0 ? r : -ENODEV;
+}
+
+/* Pulse @gsi through an irqfd. Returns 0, or < 0 to fall back to KVM_IRQ_LINE */
+int irq__irqfd_trigger(struct kvm *kvm, u32 gsi)
+{
+	struct irqfd_line *line = irqfd__get_line(gsi);
+	int fd;
+
+	if (!line)
+		return -ENODEV;
+
+	fd = irqfd__get_fd(kvm, line, &line->edge_fd, irqfd__add_edge);
+	if (fd < 0)
+		return fd;
+
+	return irqfd__signal(fd);
+}
+
+/* Drive @gsi to @level through an irqfd, or return < 0 to fall back */
+int irq__irqfd_line(struct kvm *kvm, u32 gsi, int level)
+{
+	struct irqfd_line *line = irqfd__get_line(gsi);
+	int fd;
+
+	if (!line)
+		return -ENODEV;
+
+	fd = irqfd__get_fd(kvm, line, &line->trigger_fd, irqfd__add_level);
+	if (fd < 0)
+		return fd;
+
+	/*
+	 * The irqfd can't lower the line, KVM does when the guest acks it. A
+	 * device that lowers it earlier only keeps it from being raised again.
+	 */
+	__atomic_store_n(&line->level, !!level, __ATOMIC_SEQ_CST);
+	if (level)
+		irqfd__raise(line);
+
+	return 0;
+}
+
+static void irq__collect_metrics(struct kvm *kvm, struct metrics *m)
+{
+	struct kvm_irq_routes *routes = kvm->irq_routes;
+	u64 updates, commits, commit_ns, entries;
+
+	mutex_lock(&routes->lock);
+	updates = routes->stats.updates;
+	commits = routes->stats.commits;
+	commit_ns = routes->stats.commit_ns;
+	entries = routes->table ? routes->table->nr : 0;
+	mutex_unlock(&routes->lock);
+
+	metrics__family(m, "irq_routing_updates_total", "counter",
+			"MSI routes added or changed");
+	metrics__value(m, updates);
+
+	metrics__family(m, "irq_routing_commits_total", "counter",
+			"Routing tables handed to KVM for MSI route changes");
+	metrics__value(m, commits);
+
+	metrics__family(m, "irq_routing_commit_ns_total", "counter",
+			"Time spent handing routing tables to KVM");
+	metrics__value(m, commit_ns);
+
+	metrics__family(m, "irq_routing_entries", "gauge",
+			"Entries of the routing table");
+	metrics__value(m, entries);
+}
+
+static struct metrics_collector irq__metrics = {
+	.collect	= irq__collect_metrics,
+};
+
+static int irq__metrics_init(struct kvm *kvm)
 {
-	free(irq_routing);
+	metrics__register(&irq__metrics);
 	return 0;
 }
-dev_base_exit(irq__exit);
+late_init(irq__metrics_init);
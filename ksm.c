@@ -0,0 +1,129 @@
+#include "kvm/ksm.h"
+#include "kvm/kvm.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/read-write.h"
+#include "kvm/util.h"
+
+#include <linux/kernel.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#ifndef PR_SET_MEMORY_MERGE
+#define PR_SET_MEMORY_MERGE	67
+#define PR_GET_MEMORY_MERGE	68
+#endif
+
+static enum kvm_mem_merge ksm__bank_merge(struct kvm *kvm, int bank)
+{
+	if (!kvm->cfg.nr_mem_merge)
+		return KVM_MEM_MERGE_ON;
+
+	return kvm->cfg.mem_merge[min(bank, kvm->cfg.nr_mem_merge - 1)];
+}
+
+/*
+ * With --mem-merge-process, KSM may merge any private memory of lkvm, the
+ * heap and stacks too, and those of the mappings made later.
+ */
+void ksm__enable_process(struct kvm *kvm)
+{
+	if (!kvm->cfg.mem_merge_process)
+		return;
+
+	if (prctl(PR_SET_MEMORY_MERGE, 1, 0, 0, 0) < 0)
+		pr_warning("Unable to make all of the process mergeable: %s",
+			   strerror(errno));
+}
+
+/*
+ * RAM banks are mergeable unless --mem-merge says otherwise. Where merging
+ * matters more than the reach of the TLB, transparent huge pages go, since
+ * KSM only merges small pages and would have to split them first. A kernel
+ * without KSM is only worth a warning when --mem-merge was asked for.
+ */
+void ksm__setup_bank(struct kvm *kvm, void *addr, u64 size, int bank)
+{
+	enum kvm_mem_merge merge = ksm__bank_merge(kvm, bank);
+	int advice = merge == KVM_MEM_MERGE_OFF ? MADV_UNMERGEABLE :
+						  MADV_MERGEABLE;
+
+	if (merge == KVM_MEM_MERGE_NOHUGE &&
+	    madvise(addr, size, MADV_NOHUGEPAGE) < 0)
+		pr_warning("Unable to keep huge pages out of RAM bank %d: %s",
+			   bank, strerror(errno));
+
+	if (madvise(addr, size, advice) < 0 && kvm->cfg.nr_mem_merge)
+		pr_warning("Unable to set KSM merging of RAM bank %d: %s",
+			   bank, strerror(errno));
+}
+
+static void ksm__read_stats(struct kvm_ksm_stats *st)
+{
+	char key[64];
+	long long val;
+	FILE *f;
+
+	f = fopen("/proc/self/ksm_stat", "r");
+	if (f) {
+		while (fscanf(f, "%63s %lld", key, &val) == 2) {
+			if (!strcmp(key, "ksm_merging_pages"))
+				st->merging_pages = val;
+			else if (!strcmp(key, "ksm_zero_pages"))
+				st->zero_pages = val;
+			else if (!strcmp(key, "ksm_rmap_items"))
+				st->rmap_items = val;
+			else if (!strcmp(key, "ksm_process_profit"))
+				st->profit = val;
+		}
+		fclose(f);
+		st->available = 1;
+	}
+
+	/* Kernels before ksm_stat had its own file for the merged pages */
+	if (!st->merging_pages) {
+		f = fopen("/proc/self/ksm_merging_pages", "r");
+		if (f) {
+			if (fscanf(f, "%lld", &val) == 1)
+				st->merging_pages = val;
+			fclose(f);
+			st->available = 1;
+		}
+	}
+
+	st->ksmd_run = -1;
+	f = fopen("/sys/kernel/mm/ksm/run", "r");
+	if (f) {
+		if (fscanf(f, "%d", &st->ksmd_run) != 1)
+			st->ksmd_run = -1;
+		fclose(f);
+	}
+}
+
+static void ksm__handle_ipc(struct kvm *kvm, int fd, u32 type, u32 len,
+			    u8 *msg)
+{
+	struct kvm_ksm_stats st = {};
+	u32 i;
+
+	if (WARN_ON(type != KVM_IPC_KSM_STATS || len))
+		return;
+
+	ksm__read_stats(&st);
+	st.merge_any = prctl(PR_GET_MEMORY_MERGE, 0, 0, 0, 0) > 0;
+	st.nr_banks = min_t(u32, kvm->nr_ram_banks, KVM_MAX_NUMA_BANKS);
+	for (i = 0; i < st.nr_banks; i++)
+		st.bank_merge[i] = ksm__bank_merge(kvm, i);
+
+	if (write_in_full(fd, &st, sizeof(st)) < 0)
+		pr_warning("Failed sending the KSM stats");
+}
+
+static int ksm__init(struct kvm *kvm)
+{
+	return kvm_ipc__register_handler(KVM_IPC_KSM_STATS, ksm__handle_ipc);
+}
+late_init(ksm__init);
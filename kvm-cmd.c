@@ -4,15 +4,24 @@
 
 /* user defined header files */
 #include "kvm/builtin-debug.h"
+#include "kvm/builtin-dump.h"
 #include "kvm/builtin-pause.h"
 #include "kvm/builtin-resume.h"
 #include "kvm/builtin-balloon.h"
 #include "kvm/builtin-list.h"
 #include "kvm/builtin-version.h"
 #include "kvm/builtin-setup.h"
+#include "kvm/builtin-snapshot.h"
+#include "kvm/builtin-memory.h"
+#include "kvm/builtin-cpu.h"
+#include "kvm/builtin-migrate.h"
+#include "kvm/builtin-profile.h"
+#include "kvm/builtin-ratelimit.h"
 #include "kvm/builtin-stop.h"
 #include "kvm/builtin-stat.h"
+#include "kvm/builtin-bench.h"
 #include "kvm/builtin-help.h"
+#include "kvm/builtin-img.h"
 #include "kvm/builtin-sandbox.h"
 #include "kvm/kvm-cmd.h"
 #include "kvm/builtin-run.h"
@@ -28,8 +37,17 @@ struct cmd_struct kvm_commands[] = {
 	{ "--version",	kvm_cmd_version,	NULL,			0 },
 	{ "stop",	kvm_cmd_stop,		kvm_stop_help,		0 },
 	{ "stat",	kvm_cmd_stat,		kvm_stat_help,		0 },
+	{ "bench",	kvm_cmd_bench,		kvm_bench_help,		0 },
+	{ "img",	kvm_cmd_img,		kvm_img_help,		0 },
 	{ "help",	kvm_cmd_help,		NULL,			0 },
 	{ "setup",	kvm_cmd_setup,		kvm_setup_help,		0 },
+	{ "snapshot",	kvm_cmd_snapshot,	kvm_snapshot_help,	0 },
+	{ "migrate",	kvm_cmd_migrate,	kvm_migrate_help,	0 },
+	{ "profile",	kvm_cmd_profile,	kvm_profile_help,	0 },
+	{ "dump",	kvm_cmd_dump,		kvm_dump_help,		0 },
+	{ "ratelimit",	kvm_cmd_ratelimit,	kvm_ratelimit_help,	0 },
+	{ "memory",	kvm_cmd_memory,		kvm_memory_help,	0 },
+	{ "cpu",		kvm_cmd_cpu,		kvm_cpu_help,		0 },
 	{ "run",	kvm_cmd_run,		kvm_run_help,		0 },
 	{ "sandbox",	kvm_cmd_sandbox,	kvm_run_help,		0 },
 	{ NULL,		NULL,			NULL,			0 },
@@ -1,11 +1,22 @@
 #include "kvm/kvm-cpu.h"
 
+#include "kvm/boot-trace.h"
+#include "kvm/host-numa.h"
+
 #include "kvm/symbol.h"
 #include "kvm/util.h"
 #include "kvm/kvm.h"
 #include "kvm/virtio.h"
 #include "kvm/mutex.h"
 #include "kvm/barrier.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/kvm-stats.h"
+#include "kvm/read-write.h"
+#include "kvm/dirty-log.h"
+#include "kvm/metrics.h"
+#include "kvm/probe.h"
+
+#include <linux/cpumask.h>
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -14,7 +25,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
 #include <stdio.h>
+#include <unistd.h>
 
 extern __thread struct kvm_cpu *current_kvm_cpu;
 
@@ -23,6 +38,52 @@ int __attribute__((weak)) kvm_cpu__get_endianness(struct kvm_cpu *vcpu)
 	return VIRTIO_ENDIAN_HOST;
 }
 
+/* Called with the vCPU out of KVM_RUN, from any thread */
+ssize_t __attribute__((weak)) kvm_cpu__get_regs(struct kvm_cpu *vcpu,
+						void *buf, size_t size)
+{
+	return -ENOSYS;
+}
+
+/* The registers of a paused vCPU, as the NT_PRSTATUS note of a core dump */
+int __attribute__((weak)) kvm_cpu__get_prstatus(struct kvm_cpu *vcpu,
+						struct elf_prstatus *prs)
+{
+	return -ENOSYS;
+}
+
+/* Called on the vCPU thread, with the vCPU out of KVM_RUN */
+int __attribute__((weak)) kvm_cpu__arch_plug(struct kvm_cpu *vcpu)
+{
+	return 0;
+}
+
+int __attribute__((weak)) kvm_cpu__arch_unplug(struct kvm_cpu *vcpu)
+{
+	return 0;
+}
+
+/* A vCPU that the guest turned off, through PSCI or SBI HSM, is stopped */
+bool __attribute__((weak)) kvm_cpu__arch_unplugged(struct kvm_cpu *vcpu)
+{
+	struct kvm_mp_state mp_state;
+	int r;
+
+	/* The vCPU is locked for as long as it is in KVM_RUN */
+	kvm__pause(vcpu->kvm);
+	r = ioctl(vcpu->vcpu_fd, KVM_GET_MP_STATE, &mp_state);
+	kvm__continue(vcpu->kvm);
+
+	return !r && mp_state.mp_state == KVM_MP_STATE_STOPPED;
+}
+
+int __attribute__((weak)) kvm_cpu__get_sample(struct kvm_cpu *vcpu,
+					      struct kvm_cpu_sample *sample,
+					      bool callchain)
+{
+	return -ENOSYS;
+}
+
 void kvm_cpu__enable_singlestep(struct kvm_cpu *vcpu)
 {
 	struct kvm_guest_debug debug = {
@@ -41,8 +102,15 @@ void kvm_cpu__run(struct kvm_cpu *vcpu)
 		return;
 
 	err = ioctl(vcpu->vcpu_fd, KVM_RUN, 0);
+	/* KVM_EXIT_MEMORY_FAULT comes with -EFAULT */
+	if (err < 0 && errno == EFAULT &&
+	    vcpu->kvm_run->exit_reason == KVM_EXIT_MEMORY_FAULT)
+		return;
 	if (err < 0 && (errno != EINTR && errno != EAGAIN))
 		die_perror("KVM_RUN failed");
+	/* Left before entering the guest, the last exit is still there */
+	if (err < 0 && errno == EINTR)
+		vcpu->kvm_run->exit_reason = KVM_EXIT_INTR;
 }
 
 static void kvm_cpu_signal_handler(int signum)
@@ -50,44 +118,322 @@ static void kvm_cpu_signal_handler(int signum)
 	if (signum == SIGKVMEXIT) {
 		if (current_kvm_cpu && current_kvm_cpu->is_running)
 			current_kvm_cpu->is_running = false;
-	} else if (signum == SIGKVMPAUSE) {
-		if (current_kvm_cpu->paused)
-			die("Pause signaled for already paused CPU\n");
-
-		/* pause_lock is held by kvm__pause() */
-		current_kvm_cpu->paused = 1;
-
-		/*
-		 * This is a blocking function and uses locks. It is safe
-		 * to call it for this signal as a second pause event should
-		 * not be send to this thread until it acquires and releases
-		 * the pause_lock.
-		 */
-		kvm__notify_paused();
 	}
 
-	/* For SIGKVMTASK cpu->task is already set */
+	/*
+	 * For SIGKVMTASK cpu->task and for SIGKVMPAUSE immediate_exit are
+	 * already set. The signal only takes the vCPU out of KVM_RUN.
+	 */
 }
 
+/* All vCPUs map the same ring, whose entries must be emulated in order */
+static DEFINE_MUTEX(coalesced_lock);
+
 static void kvm_cpu__handle_coalesced_mmio(struct kvm_cpu *cpu)
 {
-	if (cpu->ring) {
-		while (cpu->ring->first != cpu->ring->last) {
-			struct kvm_coalesced_mmio *m;
-			m = &cpu->ring->coalesced_mmio[cpu->ring->first];
-			kvm_cpu__emulate_mmio(cpu,
-					      m->phys_addr,
-					      m->data,
-					      m->len,
-					      1);
-			cpu->ring->first = (cpu->ring->first + 1) % KVM_COALESCED_MMIO_MAX;
-		}
+	if (!cpu->ring || cpu->ring->first == cpu->ring->last)
+		return;
+
+	mutex_lock(&coalesced_lock);
+	while (cpu->ring->first != cpu->ring->last) {
+		struct kvm_coalesced_mmio *m;
+
+		/* Read the entry after seeing KVM's update of last */
+		rmb();
+		m = &cpu->ring->coalesced_mmio[cpu->ring->first];
+		if (m->pio)
+			kvm_cpu__emulate_io(cpu, m->phys_addr, m->data,
+					    KVM_EXIT_IO_OUT, m->len, 1);
+		else
+			kvm_cpu__emulate_mmio(cpu, m->phys_addr, m->data,
+					      m->len, 1);
+		/* Done with the entry before KVM may reuse it */
+		mb();
+		cpu->ring->first = (cpu->ring->first + 1) % KVM_COALESCED_MMIO_MAX;
 	}
+	mutex_unlock(&coalesced_lock);
+}
+
+/* Emulate the writes still in the ring, while the vCPUs are paused */
+void kvm_cpu__flush_coalesced_mmio(struct kvm *kvm)
+{
+	if (kvm->cpus && kvm->cpus[0])
+		kvm_cpu__handle_coalesced_mmio(kvm->cpus[0]);
 }
 
 static DEFINE_MUTEX(task_lock);
 static int task_eventfd;
 
+/* vCPUs that ran, a restarted one carries on from where the guest left it */
+static bool *vcpu_ran;
+
+/* Written by each vCPU only, readers may see a slightly stale snapshot */
+static struct kvm_cpu_exit_stats *exit_stats;
+
+static void kvm_cpu__account_exit(struct kvm_cpu *cpu, u32 reason, u64 start)
+{
+	struct kvm_cpu_exit_stats *stats = &exit_stats[cpu->cpu_id];
+
+	reason = min_t(u32, reason, KVM_CPU_NR_EXIT_REASONS - 1);
+	stats->reasons[reason].count++;
+	stats->reasons[reason].ns += kvm_cpu__now() - start;
+}
+
+static const char * const exit_reasons[KVM_CPU_NR_EXIT_REASONS] = {
+	[KVM_EXIT_UNKNOWN]		= "unknown",
+	[KVM_EXIT_EXCEPTION]		= "exception",
+	[KVM_EXIT_IO]			= "io",
+	[KVM_EXIT_HYPERCALL]		= "hypercall",
+	[KVM_EXIT_DEBUG]		= "debug",
+	[KVM_EXIT_HLT]			= "hlt",
+	[KVM_EXIT_MMIO]			= "mmio",
+	[KVM_EXIT_IRQ_WINDOW_OPEN]	= "irq_window",
+	[KVM_EXIT_SHUTDOWN]		= "shutdown",
+	[KVM_EXIT_FAIL_ENTRY]		= "fail_entry",
+	[KVM_EXIT_INTR]			= "intr",
+	[KVM_EXIT_NMI]			= "nmi",
+	[KVM_EXIT_INTERNAL_ERROR]	= "internal_error",
+	[KVM_EXIT_PAPR_HCALL]		= "papr_hcall",
+	[KVM_EXIT_SYSTEM_EVENT]		= "system_event",
+	[KVM_EXIT_IOAPIC_EOI]		= "ioapic_eoi",
+	[KVM_EXIT_ARM_NISV]		= "arm_nisv",
+	[KVM_EXIT_RISCV_SBI]		= "riscv_sbi",
+	[KVM_EXIT_RISCV_CSR]		= "riscv_csr",
+	[KVM_EXIT_DIRTY_RING_FULL]	= "dirty_ring_full",
+	[KVM_EXIT_MEMORY_FAULT]		= "memory_fault",
+};
+
+/* The name of a KVM_EXIT_* reason, NULL for those without one */
+const char *kvm_cpu__exit_reason(u32 reason)
+{
+	return reason < KVM_CPU_NR_EXIT_REASONS ? exit_reasons[reason] : NULL;
+}
+
+/* KVM statistics of each vCPU, in the order of halt_stat_names */
+enum {
+	HALT_STAT_POLLS,
+	HALT_STAT_SUCCESSFUL_POLLS,
+	HALT_STAT_POLL_SUCCESS_NS,
+	HALT_STAT_POLL_FAIL_NS,
+	HALT_STAT_WAKEUPS,
+	HALT_STAT_WAIT_NS,
+	HALT_STAT_NR,
+};
+
+static const char * const halt_stat_names[HALT_STAT_NR] = {
+	[HALT_STAT_POLLS]		= "halt_attempted_poll",
+	[HALT_STAT_SUCCESSFUL_POLLS]	= "halt_successful_poll",
+	[HALT_STAT_POLL_SUCCESS_NS]	= "halt_poll_success_ns",
+	[HALT_STAT_POLL_FAIL_NS]	= "halt_poll_fail_ns",
+	[HALT_STAT_WAKEUPS]		= "halt_wakeup",
+	[HALT_STAT_WAIT_NS]		= "halt_wait_ns",
+};
+
+/* Where each statistic is in the values of a vCPU, -1 if KVM lacks it */
+static int halt_stat_index[HALT_STAT_NR];
+
+static u64 halt_stat(u64 *val, int stat)
+{
+	return halt_stat_index[stat] < 0 ? 0 : val[halt_stat_index[stat]];
+}
+
+static void kvm_cpu__open_stats(struct kvm *kvm)
+{
+	int i;
+
+	for (i = 0; i < kvm->nrcpus; i++)
+		kvm->vcpu_stats[i] = kvm_stats__open(kvm, kvm->cpus[i]->vcpu_fd);
+
+	for (i = 0; i < HALT_STAT_NR; i++)
+		halt_stat_index[i] = kvm_stats__find(kvm->vcpu_stats[0],
+						     halt_stat_names[i]);
+}
+
+static void kvm_cpu__read_halt_stats(struct kvm *kvm)
+{
+	struct kvm_stats *stats;
+	u64 *val;
+	int i;
+
+	for (i = 0; i < kvm->nrcpus; i++) {
+		stats = kvm->vcpu_stats[i];
+		val = stats ? malloc(stats->nr_values * sizeof(*val)) : NULL;
+		if (!val)
+			continue;
+
+		if (kvm_stats__read(stats, val)) {
+			free(val);
+			continue;
+		}
+
+		exit_stats[i].halt.polls = halt_stat(val, HALT_STAT_POLLS);
+		exit_stats[i].halt.successful_polls =
+			halt_stat(val, HALT_STAT_SUCCESSFUL_POLLS);
+		exit_stats[i].halt.poll_ns =
+			halt_stat(val, HALT_STAT_POLL_SUCCESS_NS) +
+			halt_stat(val, HALT_STAT_POLL_FAIL_NS);
+		exit_stats[i].halt.wakeups = halt_stat(val, HALT_STAT_WAKEUPS);
+		exit_stats[i].halt.wait_ns = halt_stat(val, HALT_STAT_WAIT_NS);
+		free(val);
+	}
+}
+
+static void kvm_cpu__handle_exit_stats(struct kvm *kvm, int fd, u32 type,
+				       u32 len, u8 *msg)
+{
+	struct kvm_iotrap_profile *profile;
+	u32 nr = kvm->nrcpus;
+	int nr_traps;
+
+	if (WARN_ON(type != KVM_IPC_EXIT_STATS || len))
+		return;
+
+	kvm_cpu__read_halt_stats(kvm);
+
+	nr_traps = kvm__get_iotrap_profile(kvm, &profile);
+	if (nr_traps < 0)
+		return;
+
+	if (write_in_full(fd, &nr, sizeof(nr)) < 0 ||
+	    write_in_full(fd, exit_stats, nr * sizeof(*exit_stats)) < 0 ||
+	    write_in_full(fd, &nr_traps, sizeof(nr_traps)) < 0 ||
+	    write_in_full(fd, profile, nr_traps * sizeof(*profile)) < 0)
+		pr_warning("Failed sending exit stats");
+
+	free(profile);
+}
+
+/*
+ * kvm__pause() kicks all vCPUs at once, and with immediate_exit they don't
+ * go back to the guest, so they stop together about as fast as the slowest
+ * exit. Their registers are then read from here, without waiting for each
+ * vCPU thread in turn as the debug dump does.
+ */
+static void kvm_cpu__handle_regs(struct kvm *kvm, int fd, u32 type, u32 len,
+				 u8 *msg)
+{
+	struct kvm_cpu_regs_head head = {
+		.nr	= kvm->nrcpus,
+		.arch	= KVM_CPU_REGS_ARCH,
+	};
+	struct kvm_cpu_regs_record *rec;
+	size_t rec_size = sizeof(*rec) + KVM_CPU_REGS_MAX;
+	bool paused;
+	ssize_t r;
+	u64 start;
+	u8 *buf;
+	int i;
+
+	if (WARN_ON(type != KVM_IPC_VCPU_REGS || len))
+		return;
+
+	buf = malloc(head.nr * rec_size);
+	if (!buf) {
+		pr_warning("Failed allocating the vCPU registers");
+		return;
+	}
+
+	/* A guest that "lkvm pause" stopped stays so until it resumes it */
+	paused = kvm->vm_state == KVM_VMSTATE_PAUSED;
+
+	start = kvm_cpu__now();
+	if (!paused)
+		kvm__pause(kvm);
+
+	for (i = 0; i < kvm->nrcpus; i++) {
+		rec = (void *)(buf + i * rec_size);
+		*rec = (struct kvm_cpu_regs_record) { .cpu = i };
+
+		if (!kvm->cpus[i]->is_running)
+			r = -ESRCH;
+		else
+			r = kvm_cpu__get_regs(kvm->cpus[i], rec + 1,
+					      KVM_CPU_REGS_MAX);
+		if (r < 0)
+			rec->status = r;
+		else
+			rec->len = r;
+	}
+
+	if (!paused) {
+		kvm__continue(kvm);
+		head.pause_ns = kvm_cpu__now() - start;
+	}
+
+	if (write_in_full(fd, &head, sizeof(head)) < 0)
+		goto out;
+
+	for (i = 0; i < kvm->nrcpus; i++) {
+		rec = (void *)(buf + i * rec_size);
+		if (write_in_full(fd, rec, sizeof(*rec) + rec->len) < 0)
+			goto out;
+	}
+
+	free(buf);
+	return;
+out:
+	pr_warning("Failed sending the vCPU registers");
+	free(buf);
+}
+
+static void kvm_cpu__collect_metrics(struct kvm *kvm, struct metrics *m)
+{
+	struct kvm_cpu_exit_stats *stats;
+	const char *name;
+	u32 reason;
+	int i;
+
+	kvm_cpu__read_halt_stats(kvm);
+
+	metrics__family(m, "vcpu_exits_total", "counter",
+			"Exits of each vCPU to userspace, by reason");
+	for (i = 0; i < kvm->nrcpus; i++) {
+		stats = &exit_stats[i];
+		for (reason = 0; reason < KVM_CPU_NR_EXIT_REASONS; reason++) {
+			if (!stats->reasons[reason].count)
+				continue;
+			name = kvm_cpu__exit_reason(reason);
+			if (name)
+				metrics__sample(m, stats->reasons[reason].count,
+						"vcpu=\"%d\",reason=\"%s\"", i, name);
+			else
+				metrics__sample(m, stats->reasons[reason].count,
+						"vcpu=\"%d\",reason=\"%u\"", i, reason);
+		}
+	}
+
+	metrics__family(m, "vcpu_exit_ns_total", "counter",
+			"Time spent handling the exits of each vCPU");
+	for (i = 0; i < kvm->nrcpus; i++) {
+		stats = &exit_stats[i];
+		for (reason = 0; reason < KVM_CPU_NR_EXIT_REASONS; reason++) {
+			if (!stats->reasons[reason].count)
+				continue;
+			name = kvm_cpu__exit_reason(reason);
+			if (name)
+				metrics__sample(m, stats->reasons[reason].ns,
+						"vcpu=\"%d\",reason=\"%s\"", i, name);
+			else
+				metrics__sample(m, stats->reasons[reason].ns,
+						"vcpu=\"%d\",reason=\"%u\"", i, reason);
+		}
+	}
+
+	metrics__family(m, "vcpu_halt_wakeups_total", "counter",
+			"Wakeups of each vCPU from a halt in KVM");
+	for (i = 0; i < kvm->nrcpus; i++)
+		metrics__sample(m, exit_stats[i].halt.wakeups, "vcpu=\"%d\"", i);
+
+	metrics__family(m, "vcpu_halt_wait_ns_total", "counter",
+			"Time each vCPU was halted in KVM");
+	for (i = 0; i < kvm->nrcpus; i++)
+		metrics__sample(m, exit_stats[i].halt.wait_ns, "vcpu=\"%d\"", i);
+}
+
+static struct metrics_collector kvm_cpu__metrics = {
+	.collect	= kvm_cpu__collect_metrics,
+};
+
 static void kvm_cpu__run_task(struct kvm_cpu *cpu)
 {
 	u64 inc = 1;
@@ -106,32 +452,63 @@ static void kvm_cpu__run_task(struct kvm_cpu *cpu)
 		die("Failed notifying of completed task.");
 }
 
+/*
+ * Only a signal takes a vCPU out of the guest, so only those in KVM_RUN, or
+ * about to enter it, get one. The others run the task before their next
+ * KVM_RUN. immediate_exit makes one that is kicked before entering KVM_RUN
+ * leave it right away, rather than wait there for its next exit.
+ */
+static void kvm_cpu__kick_task(struct kvm_cpu *cpu)
+{
+	if (!__atomic_load_n(&cpu->in_run, __ATOMIC_SEQ_CST))
+		return;
+
+	cpu->kvm_run->immediate_exit = 1;
+	pthread_kill(cpu->thread, SIGKVMTASK);
+}
+
 void kvm_cpu__run_on_all_cpus(struct kvm *kvm, struct kvm_cpu_task *task)
 {
+	struct pollfd pfd = { .fd = task_eventfd, .events = POLLIN };
 	int i, done = 0;
 
 	pr_debug("Running task %p on all cpus", task);
 
 	mutex_lock(&task_lock);
 
+	/*
+	 * Post the task to all of them, then kick, then wait. The parked
+	 * ones have no thread, it runs here for them.
+	 */
 	for (i = 0; i < kvm->nrcpus; i++) {
 		if (kvm->cpus[i]->task) {
 			/* Should never happen */
 			die("CPU %d already has a task pending!", i);
 		}
 
-		kvm->cpus[i]->task = task;
-		wmb();
+		__atomic_store_n(&kvm->cpus[i]->task, task, __ATOMIC_SEQ_CST);
+	}
 
-		if (kvm->cpus[i] == current_kvm_cpu)
-			kvm_cpu__run_task(current_kvm_cpu);
+	for (i = 0; i < kvm->nrcpus; i++) {
+		if (kvm->cpus[i] == current_kvm_cpu || !kvm->cpus[i]->thread)
+			kvm_cpu__run_task(kvm->cpus[i]);
 		else
-			pthread_kill(kvm->cpus[i]->thread, SIGKVMTASK);
+			kvm_cpu__kick_task(kvm->cpus[i]);
 	}
 
 	while (done < kvm->nrcpus) {
 		u64 count;
 
+		/* Without KVM_CAP_IMMEDIATE_EXIT a kick can be lost, kick again */
+		if (poll(&pfd, 1, 1) == 0) {
+			for (i = 0; i < kvm->nrcpus; i++) {
+				if (__atomic_load_n(&kvm->cpus[i]->task,
+						    __ATOMIC_ACQUIRE))
+					kvm_cpu__kick_task(kvm->cpus[i]);
+			}
+			continue;
+		}
+
 		if (read(task_eventfd, &count, sizeof(count)) < 0)
 			die("Failed reading task eventfd");
 
@@ -141,9 +518,76 @@ void kvm_cpu__run_on_all_cpus(struct kvm *kvm, struct kvm_cpu_task *task)
 	mutex_unlock(&task_lock);
 }
 
+/* Add the CPUs of the host node backing the guest NUMA node of @cpu */
+static void kvm_cpu__numa_affinity(struct kvm_cpu *cpu, cpu_set_t *affinity,
+				   size_t size)
+{
+	struct kvm *kvm = cpu->kvm;
+	int node, r;
+
+	node = kvm__numa_node_of_cpu(kvm, cpu->cpu_id);
+	if (node < 0 || kvm->cfg.guest_numa[node].host_node < 0)
+		return;
+
+	r = host_numa__cpus(kvm->cfg.guest_numa[node].host_node, affinity,
+			    size);
+	if (r < 0)
+		die("Unable to read the CPUs of host node %d: %s",
+		    kvm->cfg.guest_numa[node].host_node, strerror(-r));
+
+	/* Memory-only nodes have no CPUs to run on */
+	if (!CPU_COUNT_S(size, affinity))
+		pr_warning("Host node %d has no CPUs, vCPU %lu is not pinned",
+			   kvm->cfg.guest_numa[node].host_node, cpu->cpu_id);
+}
+
+/*
+ * Move a vCPU thread to its own --vcpu-affinity CPUs if it has any, else to
+ * the host node of its guest NUMA node, else to the CPUs of all vCPUs.
+ */
+static void kvm_cpu__set_affinity(struct kvm_cpu *cpu)
+{
+	struct kvm *kvm = cpu->kvm;
+	size_t size = CPU_ALLOC_SIZE(NR_CPUS);
+	struct sched_param param;
+	cpu_set_t *affinity;
+	int i, r;
+
+	affinity = CPU_ALLOC(NR_CPUS);
+	if (!affinity)
+		die_perror("CPU_ALLOC");
+	CPU_ZERO_S(size, affinity);
+
+	for (i = 0; i < kvm->cfg.nr_vcpu_pins; i++) {
+		if (kvm->cfg.vcpu_pins[i].vcpu == (int)cpu->cpu_id)
+			CPU_SET_S(kvm->cfg.vcpu_pins[i].cpu, size, affinity);
+	}
+
+	if (!CPU_COUNT_S(size, affinity))
+		kvm_cpu__numa_affinity(cpu, affinity, size);
+
+	if (!CPU_COUNT_S(size, affinity) && kvm->cfg.vcpu_affinity)
+		CPU_OR_S(size, affinity, affinity, kvm->cfg.vcpu_affinity);
+
+	if (CPU_COUNT_S(size, affinity) && sched_setaffinity(0, size, affinity))
+		die_perror("sched_setaffinity");
+
+	CPU_FREE(affinity);
+
+	if (!kvm->cfg.vcpu_fifo_priority)
+		return;
+
+	param.sched_priority = kvm->cfg.vcpu_fifo_priority;
+	r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (r)
+		die("Unable to run vCPU %lu as SCHED_FIFO: %s", cpu->cpu_id,
+		    strerror(r));
+}
+
 int kvm_cpu__start(struct kvm_cpu *cpu)
 {
 	sigset_t sigset;
+	u64 start;
 
 	sigemptyset(&sigset);
 	sigaddset(&sigset, SIGALRM);
@@ -154,21 +598,51 @@ int kvm_cpu__start(struct kvm_cpu *cpu)
 	signal(SIGKVMPAUSE, kvm_cpu_signal_handler);
 	signal(SIGKVMTASK, kvm_cpu_signal_handler);
 
-	kvm_cpu__reset_vcpu(cpu);
+	kvm_cpu__set_affinity(cpu);
+
+	/* A restored vCPU already has the state of the snapshot */
+	if (!cpu->kvm->cfg.restore_dir && !cpu->kvm->cfg.incoming &&
+	    !vcpu_ran[cpu->cpu_id])
+		kvm_cpu__reset_vcpu(cpu);
+	vcpu_ran[cpu->cpu_id] = true;
 
 	if (cpu->kvm->cfg.single_step)
 		kvm_cpu__enable_singlestep(cpu);
 
+	if (cpu->kvm->cfg.startup_debug && cpu->cpu_id == 0)
+		pr_info("startup: %.3f ms to the first guest entry",
+			(kvm_cpu__now() - cpu->kvm->start_ns) / 1e6);
+
+	if (boot_trace_enabled)
+		boot_trace__mark("vcpu", "vcpu%lu first guest entry",
+				 cpu->cpu_id);
+
 	while (cpu->is_running) {
 		if (cpu->needs_nmi) {
 			kvm_cpu__arch_nmi(cpu);
 			cpu->needs_nmi = 0;
 		}
 
-		if (cpu->task)
+		/* Set by kvm__pause(), which waits for us to stop here */
+		if (cpu->kvm_run->immediate_exit)
+			kvm__notify_paused();
+
+		/*
+		 * A task posted before in_run is set is run here, one posted
+		 * after comes with a kick, see kvm_cpu__kick_task().
+		 */
+		__atomic_store_n(&cpu->in_run, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&cpu->task, __ATOMIC_SEQ_CST)) {
+			__atomic_store_n(&cpu->in_run, 0, __ATOMIC_RELAXED);
 			kvm_cpu__run_task(cpu);
+			continue;
+		}
 
+		kvm__probe(vcpu_entry, cpu->cpu_id);
 		kvm_cpu__run(cpu);
+		__atomic_store_n(&cpu->in_run, 0, __ATOMIC_RELAXED);
+		start = kvm_cpu__now();
+		kvm__probe(vcpu_exit, cpu->cpu_id, cpu->kvm_run->exit_reason);
 
 		switch (cpu->kvm_run->exit_reason) {
 		case KVM_EXIT_UNKNOWN:
@@ -180,6 +654,13 @@ int kvm_cpu__start(struct kvm_cpu *cpu)
 		case KVM_EXIT_IO: {
 			bool ret;
 
+			/* As below, posted writes come before this access */
+			kvm_cpu__handle_coalesced_mmio(cpu);
+
+			if (unlikely(boot_trace_exits_pending))
+				boot_trace__first_exit(false,
+						       cpu->kvm_run->io.port);
+
 			ret = kvm_cpu__emulate_io(cpu,
 						  cpu->kvm_run->io.port,
 						  (u8 *)cpu->kvm_run +
@@ -201,6 +682,10 @@ int kvm_cpu__start(struct kvm_cpu *cpu)
 			 */
 			kvm_cpu__handle_coalesced_mmio(cpu);
 
+			if (unlikely(boot_trace_exits_pending))
+				boot_trace__first_exit(true,
+						       cpu->kvm_run->mmio.phys_addr);
+
 			ret = kvm_cpu__emulate_mmio(cpu,
 						    cpu->kvm_run->mmio.phys_addr,
 						    cpu->kvm_run->mmio.data,
@@ -211,11 +696,26 @@ int kvm_cpu__start(struct kvm_cpu *cpu)
 				goto panic_kvm;
 			break;
 		}
+		case KVM_EXIT_DIRTY_RING_FULL:
+			dirty_log__ring_full(cpu);
+			break;
+		case KVM_EXIT_MEMORY_FAULT: {
+			struct kvm_run *run = cpu->kvm_run;
+
+			if (kvm__convert_mem(cpu->kvm, run->memory_fault.gpa,
+					     run->memory_fault.size,
+					     run->memory_fault.flags &
+					     KVM_MEMORY_EXIT_FLAG_PRIVATE) < 0)
+				goto panic_kvm;
+			break;
+		}
 		case KVM_EXIT_INTR:
 			if (cpu->is_running)
 				break;
 			goto exit_kvm;
 		case KVM_EXIT_SHUTDOWN:
+			/* A triple fault, reboot=t, may be on any vCPU */
+			kvm__reboot(cpu->kvm);
 			goto exit_kvm;
 		case KVM_EXIT_SYSTEM_EVENT:
 			/*
@@ -248,6 +748,7 @@ int kvm_cpu__start(struct kvm_cpu *cpu)
 		}
 		}
 		kvm_cpu__handle_coalesced_mmio(cpu);
+		kvm_cpu__account_exit(cpu, cpu->kvm_run->exit_reason, start);
 	}
 
 exit_kvm:
@@ -257,22 +758,225 @@ panic_kvm:
 	return 1;
 }
 
+void *kvm_cpu__thread(void *arg)
+{
+	char name[16];
+
+	current_kvm_cpu = arg;
+
+	sprintf(name, "kvm-vcpu-%lu", current_kvm_cpu->cpu_id);
+	kvm__set_thread_name(name);
+
+	if (kvm_cpu__start(current_kvm_cpu))
+		goto panic_kvm;
+
+	return (void *) (intptr_t) 0;
+
+panic_kvm:
+	pr_err("KVM exit reason: %u (\"%s\")",
+		current_kvm_cpu->kvm_run->exit_reason,
+		kvm_exit_reasons[current_kvm_cpu->kvm_run->exit_reason]);
+
+	if (current_kvm_cpu->kvm_run->exit_reason == KVM_EXIT_UNKNOWN) {
+		pr_err("KVM exit code: %llu",
+			(unsigned long long)current_kvm_cpu->kvm_run->hw.hardware_exit_reason);
+	}
+
+	kvm_cpu__set_debug_fd(STDOUT_FILENO);
+	kvm_cpu__show_registers(current_kvm_cpu);
+	kvm_cpu__show_code(current_kvm_cpu);
+	kvm_cpu__show_page_tables(current_kvm_cpu);
+
+	return (void *) (intptr_t) 1;
+}
+
+/*
+ * Not task_lock: a vCPU waiting for it in kvm_cpu__run_on_all_cpus() would
+ * never see the kvm__pause() of a hotplug.
+ */
+static DEFINE_MUTEX(hotplug_lock);
+
+/* How long "lkvm cpu remove" waits for the guest to give a vCPU up */
+#define KVM_CPU_UNPLUG_TIMEOUT_MS	5000
+#define KVM_CPU_UNPLUG_POLL_MS		100
+
+/* Starts the thread of a parked vCPU, then tells the guest about it */
+static int kvm_cpu__plug(struct kvm *kvm, struct kvm_cpu *cpu)
+{
+	int r;
+
+	if (cpu->thread)
+		return -EEXIST;
+
+	/* So that a kvm__pause() doesn't find it half started */
+	kvm__pause(kvm);
+	cpu->is_running = true;
+	/* Not before kvm__continue(), like the others */
+	cpu->kvm_run->immediate_exit = 1;
+	r = -pthread_create(&cpu->thread, NULL, kvm_cpu__thread, cpu);
+	if (r) {
+		cpu->is_running = false;
+		cpu->kvm_run->immediate_exit = 0;
+		cpu->thread = 0;
+	}
+	kvm__continue(kvm);
+
+	return r ?: kvm_cpu__arch_plug(cpu);
+}
+
+/*
+ * Asks the guest to give a vCPU up, then parks it once it has. The thread
+ * only leaves while all vCPUs are paused, so a kvm__pause() kicking it
+ * doesn't race with its end.
+ */
+static int kvm_cpu__unplug(struct kvm *kvm, struct kvm_cpu *cpu)
+{
+	int ms, r;
+
+	/* The guest stops with vCPU 0 */
+	if (!cpu->cpu_id)
+		return -EBUSY;
+	if (!cpu->thread)
+		return -ENOENT;
+
+	r = kvm_cpu__arch_unplug(cpu);
+	if (r)
+		return r;
+
+	for (ms = 0; !kvm_cpu__arch_unplugged(cpu); ms += KVM_CPU_UNPLUG_POLL_MS) {
+		if (ms >= KVM_CPU_UNPLUG_TIMEOUT_MS)
+			return -EBUSY;
+		usleep(KVM_CPU_UNPLUG_POLL_MS * 1000);
+	}
+
+	kvm__pause(kvm);
+	cpu->is_running = false;
+	kvm__continue(kvm);
+
+	if (pthread_join(cpu->thread, NULL))
+		return -errno;
+	cpu->thread = 0;
+
+	return 0;
+}
+
+static u32 kvm_cpu__nr_online(struct kvm *kvm)
+{
+	u32 nr = 0;
+	int i;
+
+	for (i = 0; i < kvm->nrcpus; i++)
+		nr += !!kvm->cpus[i]->thread;
+
+	return nr;
+}
+
+/* The first parked vCPU to add, the last running one to remove */
+static int kvm_cpu__hotplug_pick(struct kvm *kvm, bool add)
+{
+	int i;
+
+	for (i = add ? 1 : kvm->nrcpus - 1; i > 0 && i < kvm->nrcpus;
+	     i += add ? 1 : -1) {
+		if (!kvm->cpus[i]->thread == add)
+			return i;
+	}
+
+	return -ENOSPC;
+}
+
+static void kvm_cpu__handle_hotplug(struct kvm *kvm, int fd, u32 type, u32 len,
+				    u8 *msg)
+{
+	struct kvm_cpu_hotplug_msg *req = (void *)msg;
+	struct kvm_cpu_hotplug_reply reply = {};
+	bool add;
+	int cpu;
+
+	if (WARN_ON(type != KVM_IPC_CPU_HOTPLUG || len != sizeof(*req)))
+		return;
+
+	add = req->op == KVM_CPU_HOTPLUG_ADD;
+	cpu = req->cpu;
+
+	mutex_lock(&hotplug_lock);
+	if (cpu < 0)
+		cpu = kvm_cpu__hotplug_pick(kvm, add);
+
+	if (req->op != KVM_CPU_HOTPLUG_ADD && req->op != KVM_CPU_HOTPLUG_REMOVE)
+		reply.status = -EINVAL;
+	else if (cpu < 0)
+		reply.status = cpu;
+	else if (cpu >= kvm->nrcpus)
+		reply.status = -ERANGE;
+
+	if (!reply.status && add)
+		reply.status = kvm_cpu__plug(kvm, kvm->cpus[cpu]);
+	else if (!reply.status)
+		reply.status = kvm_cpu__unplug(kvm, kvm->cpus[cpu]);
+
+	reply.cpu = cpu;
+	reply.nr_online = kvm_cpu__nr_online(kvm);
+	reply.nr_possible = kvm->nrcpus;
+	mutex_unlock(&hotplug_lock);
+
+	if (!reply.status)
+		pr_info("vCPU %d %s, %u of %u online", cpu,
+			add ? "added" : "removed", reply.nr_online,
+			reply.nr_possible);
+
+	if (write_in_full(fd, &reply, sizeof(reply)) < 0)
+		pr_warning("Failed sending the vCPU hotplug status");
+}
+
+/*
+ * Creating a vCPU mostly waits on the kernel, so startup spreads it over a
+ * few threads, each taking every nr_creators-th vCPU.
+ */
+#define KVM_CPU_CREATORS	8
+
+struct kvm_cpu_creator {
+	pthread_t	thread;
+	bool		started;
+	struct kvm	*kvm;
+	int		first;
+	int		step;
+};
+
+static void *kvm_cpu__create(void *arg)
+{
+	struct kvm_cpu_creator *creator = arg;
+	struct kvm *kvm = creator->kvm;
+	int i;
+
+	for (i = creator->first; i < kvm->nrcpus; i += creator->step)
+		kvm->cpus[i] = kvm_cpu__arch_init(kvm, i);
+
+	return NULL;
+}
+
 int kvm_cpu__init(struct kvm *kvm)
 {
-	int max_cpus, recommended_cpus, i;
+	struct kvm_cpu_creator creators[KVM_CPU_CREATORS];
+	int max_cpus, recommended_cpus, nr_creators, i, r;
 
 	max_cpus = kvm__max_cpus(kvm);
 	recommended_cpus = kvm__recommended_cpus(kvm);
 
-	if (kvm->cfg.nrcpus > max_cpus) {
+	if (kvm->cfg.max_cpus < kvm->cfg.nrcpus)
+		kvm->cfg.max_cpus = kvm->cfg.nrcpus;
+
+	if (kvm->cfg.max_cpus > max_cpus) {
 		pr_warning("Limiting the number of CPUs to %d", max_cpus);
-		kvm->cfg.nrcpus = max_cpus;
-	} else if (kvm->cfg.nrcpus > recommended_cpus) {
+		kvm->cfg.max_cpus = max_cpus;
+		kvm->cfg.nrcpus = min(kvm->cfg.nrcpus, max_cpus);
+	} else if (kvm->cfg.max_cpus > recommended_cpus) {
 		pr_warning("The maximum recommended amount of VCPUs is %d",
 			   recommended_cpus);
 	}
 
-	kvm->nrcpus = kvm->cfg.nrcpus;
+	/* All are created now, those past --cpus stay parked */
+	kvm->nrcpus = kvm->cfg.max_cpus;
 
 	task_eventfd = eventfd(0, 0);
 	if (task_eventfd < 0) {
@@ -280,6 +984,34 @@ int kvm_cpu__init(struct kvm *kvm)
 		return task_eventfd;
 	}
 
+	exit_stats = calloc(kvm->nrcpus, sizeof(*exit_stats));
+	if (!exit_stats) {
+		pr_err("Couldn't allocate exit statistics for %d CPUs",
+		       kvm->nrcpus);
+		return -ENOMEM;
+	}
+
+	kvm->vcpu_stats = calloc(kvm->nrcpus, sizeof(*kvm->vcpu_stats));
+	vcpu_ran = calloc(kvm->nrcpus, sizeof(*vcpu_ran));
+	if (!kvm->vcpu_stats || !vcpu_ran)
+		return -ENOMEM;
+
+	r = kvm_ipc__register_handler(KVM_IPC_EXIT_STATS,
+				      kvm_cpu__handle_exit_stats);
+	if (r < 0)
+		return r;
+
+	r = kvm_ipc__register_handler(KVM_IPC_VCPU_REGS, kvm_cpu__handle_regs);
+	if (r < 0)
+		return r;
+
+	r = kvm_ipc__register_handler(KVM_IPC_CPU_HOTPLUG,
+				      kvm_cpu__handle_hotplug);
+	if (r < 0)
+		return r;
+
+	metrics__register(&kvm_cpu__metrics);
+
 	/* Alloc one pointer too many, so array ends up 0-terminated */
 	kvm->cpus = calloc(kvm->nrcpus + 1, sizeof(void *));
 	if (!kvm->cpus) {
@@ -287,14 +1019,40 @@ int kvm_cpu__init(struct kvm *kvm)
 		return -ENOMEM;
 	}
 
+	nr_creators = min(kvm->nrcpus, KVM_CPU_CREATORS);
+	for (i = 0; i < nr_creators; i++) {
+		creators[i] = (struct kvm_cpu_creator) {
+			.kvm	= kvm,
+			.first	= i,
+			.step	= nr_creators,
+		};
+		/* The first share is ours, or any that lacks a thread */
+		creators[i].started = i > 0 &&
+			!pthread_create(&creators[i].thread, NULL,
+					kvm_cpu__create, &creators[i]);
+	}
+
+	for (i = 0; i < nr_creators; i++) {
+		if (!creators[i].started)
+			kvm_cpu__create(&creators[i]);
+	}
+
+	for (i = 0; i < nr_creators; i++) {
+		if (creators[i].started)
+			pthread_join(creators[i].thread, NULL);
+	}
+
 	for (i = 0; i < kvm->nrcpus; i++) {
-		kvm->cpus[i] = kvm_cpu__arch_init(kvm, i);
 		if (!kvm->cpus[i]) {
 			pr_err("unable to initialize KVM VCPU");
 			goto fail_alloc;
 		}
+		if (i >= kvm->cfg.nrcpus)
+			kvm->cpus[i]->is_running = false;
 	}
 
+	kvm_cpu__open_stats(kvm);
+
 	return 0;
 
 fail_alloc:
@@ -319,12 +1077,22 @@ int kvm_cpu__exit(struct kvm *kvm)
 			if (pthread_join(kvm->cpus[i]->thread, &ret) != 0)
 				die("pthread_join");
 			kvm_cpu__delete(kvm->cpus[i]);
+		} else if (!kvm->cpus[i]->thread) {
+			/* Parked */
+			kvm_cpu__delete(kvm->cpus[i]);
 		}
 		if (ret == NULL)
 			r = 0;
 	}
 	kvm__continue(kvm);
 
+	for (i = 0; kvm->vcpu_stats && i < kvm->nrcpus; i++)
+		kvm_stats__close(kvm->vcpu_stats[i]);
+	free(kvm->vcpu_stats);
+	kvm->vcpu_stats = NULL;
+	free(vcpu_ran);
+	vcpu_ran = NULL;
+
 	free(kvm->cpus);
 
 	kvm->nrcpus = 0;
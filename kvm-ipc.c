@@ -2,7 +2,9 @@
 #include <sys/un.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <dirent.h>
+#include <fcntl.h>
 
 #include "kvm/epoll.h"
 #include "kvm/kvm-ipc.h"
@@ -14,13 +16,50 @@
 #include "kvm/strbuf.h"
 #include "kvm/kvm-cpu.h"
 #include "kvm/8250-serial.h"
+#include "kvm/mutex.h"
+#include "kvm/lock-stat.h"
+#include "kvm/status.h"
+
+#include <linux/list.h>
 
 struct kvm_ipc_head {
 	u32 type;
 	u32 len;
 };
 
-#define KVM_IPC_MAX_MSGS 16
+#define KVM_IPC_MAX_MSGS 64
+
+#define KVM_IPC_WORKERS		4
+/* Requests up to this size reuse the buffers of previous ones */
+#define KVM_IPC_BUF_SIZE	4096
+#define KVM_IPC_MAX_BUFS	32
+/* Beyond which a request is taken for garbage and its connection dropped */
+#define KVM_IPC_MAX_LEN		(1 << 20)
+
+struct kvm_ipc_buf {
+	struct list_head	list;
+	u32			size;
+	u8			data[];
+};
+
+/* A client, in the data of its epoll event. The listening socket has NULL */
+struct kvm_ipc_conn {
+	int			fd;
+	u32			version;
+	int			refcount;
+	bool			closed;
+	/* Replies of concurrent version 2 requests don't interleave */
+	struct mutex		write_lock;
+};
+
+struct kvm_ipc_work {
+	struct list_head	list;
+	struct kvm_ipc_conn	*conn;
+	struct kvm_ipc_frame	frame;
+	struct kvm_ipc_buf	*buf;
+	u64			due_ns;
+	bool			cancelled;
+};
 
 #define KVM_SOCK_SUFFIX		".sock"
 #define KVM_SOCK_SUFFIX_LEN	((ssize_t)sizeof(KVM_SOCK_SUFFIX) - 1)
@@ -28,9 +67,21 @@ struct kvm_ipc_head {
 extern __thread struct kvm_cpu *current_kvm_cpu;
 static void (*msgs[KVM_IPC_MAX_MSGS])(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg);
 static DECLARE_RWSEM(msgs_rwlock);
+static struct mutex msgs_locks[KVM_IPC_MAX_MSGS];
 static int server_fd;
 static struct kvm__epoll epoll;
 
+static LIST_HEAD(bufs);
+static int nr_bufs;
+static DEFINE_MUTEX(bufs_lock);
+
+/* Requests by when they are due, and those that workers are running */
+static LIST_HEAD(work_queue);
+static LIST_HEAD(work_running);
+static DEFINE_MUTEX(work_lock);
+static pthread_cond_t work_cond;
+static bool work_stop;
+
 static int kvm__create_socket(struct kvm *kvm)
 {
 	char full_name[PATH_MAX];
@@ -236,6 +287,72 @@ int kvm_ipc__send_msg(int fd, u32 type, u32 len, u8 *msg)
 	return 0;
 }
 
+/* Returns the version of the protocol that @fd speaks from now on */
+int kvm_ipc__hello(int fd)
+{
+	struct kvm_ipc_hello hello = { .version = KVM_IPC_VERSION };
+
+	if (kvm_ipc__send_msg(fd, KVM_IPC_HELLO, sizeof(hello), (u8 *)&hello) < 0)
+		return -1;
+
+	if (read_in_full(fd, &hello, sizeof(hello)) != sizeof(hello))
+		return -1;
+
+	return hello.version;
+}
+
+/* With interval_ms, the request is answered again until kvm_ipc__cancel() */
+int kvm_ipc__request(int fd, u32 type, u32 id, u32 interval_ms, u32 len,
+		     const void *msg)
+{
+	struct kvm_ipc_frame frame = {
+		.type		= type,
+		.len		= len,
+		.id		= id,
+		.flags		= interval_ms ? KVM_IPC_F_REPEAT : 0,
+		.interval_ms	= interval_ms,
+	};
+
+	if (write_in_full(fd, &frame, sizeof(frame)) < 0)
+		return -1;
+
+	if (len && write_in_full(fd, msg, len) < 0)
+		return -1;
+
+	return 0;
+}
+
+int kvm_ipc__cancel(int fd, u32 id)
+{
+	return kvm_ipc__request(fd, KVM_IPC_CANCEL, id, 0, 0, NULL);
+}
+
+/*
+ * Read the next reply into @frame and *@buf, of *@size bytes, which grows as
+ * needed. Returns the length of the reply.
+ */
+ssize_t kvm_ipc__read_reply(int fd, struct kvm_ipc_frame *frame, void **buf,
+			    size_t *size)
+{
+	void *p;
+
+	if (read_in_full(fd, frame, sizeof(*frame)) != sizeof(*frame))
+		return -1;
+
+	if (frame->len > *size) {
+		p = realloc(*buf, frame->len);
+		if (!p)
+			return -1;
+		*buf = p;
+		*size = frame->len;
+	}
+
+	if (read_in_full(fd, *buf, frame->len) != (ssize_t)frame->len)
+		return -1;
+
+	return frame->len;
+}
+
 static int kvm_ipc__handle(struct kvm *kvm, int fd, u32 type, u32 len, u8 *data)
 {
 	void (*cb)(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg);
@@ -252,83 +369,464 @@ static int kvm_ipc__handle(struct kvm *kvm, int fd, u32 type, u32 len, u8 *data)
 		return -ENODEV;
 	}
 
+	/* Handlers may be called from several workers, but not reentered */
+	mutex_lock(&msgs_locks[type]);
 	cb(kvm, fd, type, len, data);
+	mutex_unlock(&msgs_locks[type]);
+
+	return 0;
+}
+
+static struct kvm_ipc_buf *kvm_ipc__get_buf(u32 len)
+{
+	struct kvm_ipc_buf *buf = NULL;
+	u32 size = max_t(u32, len, KVM_IPC_BUF_SIZE);
+
+	if (size == KVM_IPC_BUF_SIZE) {
+		mutex_lock(&bufs_lock);
+		if (!list_empty(&bufs)) {
+			buf = list_first_entry(&bufs, struct kvm_ipc_buf, list);
+			list_del(&buf->list);
+			nr_bufs--;
+		}
+		mutex_unlock(&bufs_lock);
+		if (buf)
+			return buf;
+	}
+
+	buf = malloc(sizeof(*buf) + size);
+	if (buf)
+		buf->size = size;
+
+	return buf;
+}
+
+static void kvm_ipc__put_buf(struct kvm_ipc_buf *buf)
+{
+	if (buf->size == KVM_IPC_BUF_SIZE) {
+		mutex_lock(&bufs_lock);
+		if (nr_bufs < KVM_IPC_MAX_BUFS) {
+			list_add(&buf->list, &bufs);
+			nr_bufs++;
+			buf = NULL;
+		}
+		mutex_unlock(&bufs_lock);
+	}
+
+	free(buf);
+}
+
+static void kvm_ipc__get_conn(struct kvm_ipc_conn *conn)
+{
+	__atomic_add_fetch(&conn->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/* The fd goes with the last reference, so that no reply ends up elsewhere */
+static void kvm_ipc__put_conn(struct kvm_ipc_conn *conn)
+{
+	if (__atomic_sub_fetch(&conn->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	close(conn->fd);
+	free(conn);
+}
+
+static void kvm_ipc__arm_conn(struct kvm_ipc_conn *conn)
+{
+	struct epoll_event ev = {
+		.events		= EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+		.data.ptr	= conn,
+	};
+
+	if (__atomic_load_n(&conn->closed, __ATOMIC_ACQUIRE))
+		return;
+
+	if (epoll_ctl(epoll.fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
+		pr_warning("Failed re-arming IPC connection: %s", strerror(errno));
+}
+
+/* Those that change the state of the guest run in order, on the first worker */
+static bool kvm_ipc__is_ordered(u32 type)
+{
+	switch (type) {
+	case KVM_IPC_BALLOON:
+	case KVM_IPC_DEBUG:
+	case KVM_IPC_PAUSE:
+	case KVM_IPC_RESUME:
+	case KVM_IPC_STOP:
+	case KVM_IPC_NET_CAPTURE:
+	case KVM_IPC_BALLOON_HINT:
+	case KVM_IPC_SNAPSHOT:
+	case KVM_IPC_MIGRATE:
+	case KVM_IPC_VIRTIO_MEM:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* With work_lock held */
+static void kvm_ipc__queue_work(struct kvm_ipc_work *work)
+{
+	struct kvm_ipc_work *pos;
+
+	list_for_each_entry(pos, &work_queue, list) {
+		if (pos->due_ns > work->due_ns)
+			break;
+	}
+	list_add_tail(&work->list, &pos->list);
+	pthread_cond_broadcast(&work_cond);
+}
+
+/* Drop the repeated request @id of @conn, or all of its requests */
+static void kvm_ipc__cancel_work(struct kvm_ipc_conn *conn, u32 id, bool all)
+{
+	struct kvm_ipc_work *work, *tmp;
+	LIST_HEAD(cancelled);
+
+	mutex_lock(&work_lock);
+	list_for_each_entry(work, &work_running, list) {
+		if (work->conn == conn && (all || work->frame.id == id))
+			work->cancelled = true;
+	}
+	list_for_each_entry_safe(work, tmp, &work_queue, list) {
+		if (work->conn == conn && (all || work->frame.id == id))
+			list_move(&work->list, &cancelled);
+	}
+	mutex_unlock(&work_lock);
+
+	list_for_each_entry_safe(work, tmp, &cancelled, list) {
+		list_del(&work->list);
+		kvm_ipc__put_buf(work->buf);
+		kvm_ipc__put_conn(work->conn);
+		free(work);
+	}
+}
+
+static struct kvm_ipc_work *kvm_ipc__next_work(long worker)
+{
+	struct kvm_ipc_work *work, *next;
+	struct timespec ts;
+	u64 now;
+
+	mutex_lock(&work_lock);
+	for (;;) {
+		next = NULL;
+		list_for_each_entry(work, &work_queue, list) {
+			if (worker == 0 || !kvm_ipc__is_ordered(work->frame.type)) {
+				next = work;
+				break;
+			}
+		}
+
+		if (work_stop) {
+			next = NULL;
+			break;
+		}
+
+		if (!next) {
+			pthread_cond_wait(&work_cond, &work_lock.mutex);
+			continue;
+		}
+
+		now = kvm_cpu__now();
+		if (next->due_ns <= now)
+			break;
+
+		ts.tv_sec = next->due_ns / 1000000000ULL;
+		ts.tv_nsec = next->due_ns % 1000000000ULL;
+		pthread_cond_timedwait(&work_cond, &work_lock.mutex, &ts);
+	}
+
+	if (next)
+		list_move(&next->list, &work_running);
+	mutex_unlock(&work_lock);
+
+	return next;
+}
+
+static int kvm_ipc__send_full(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
 
 	return 0;
 }
 
+/* Run a version 2 request with its reply going to @memfd, then send it */
+static void kvm_ipc__run_framed(struct kvm *kvm, struct kvm_ipc_work *work,
+				int memfd, struct kvm_ipc_buf *out)
+{
+	struct kvm_ipc_conn *conn = work->conn;
+	struct kvm_ipc_frame reply = work->frame;
+	off_t size, off;
+	ssize_t n;
+
+	if (ftruncate(memfd, 0) < 0 || lseek(memfd, 0, SEEK_SET) < 0) {
+		reply.status = -errno;
+		size = 0;
+	} else {
+		reply.status = kvm_ipc__handle(kvm, memfd, work->frame.type,
+					       work->frame.len, work->buf->data);
+		size = lseek(memfd, 0, SEEK_END);
+		if (size < 0) {
+			reply.status = -errno;
+			size = 0;
+		}
+	}
+
+	reply.len = size;
+
+	mutex_lock(&conn->write_lock);
+	if (kvm_ipc__send_full(conn->fd, &reply, sizeof(reply)) < 0)
+		goto out;
+
+	for (off = 0; off < size; off += n) {
+		n = pread(memfd, out->data, min_t(off_t, size - off, out->size), off);
+		if (n <= 0 || kvm_ipc__send_full(conn->fd, out->data, n) < 0)
+			break;
+	}
+out:
+	mutex_unlock(&conn->write_lock);
+}
+
+static void kvm_ipc__done_work(struct kvm_ipc_work *work)
+{
+	struct kvm_ipc_conn *conn = work->conn;
+	u64 now;
+
+	mutex_lock(&work_lock);
+	list_del(&work->list);
+	if ((work->frame.flags & KVM_IPC_F_REPEAT) && !work->cancelled &&
+	    !__atomic_load_n(&conn->closed, __ATOMIC_ACQUIRE) && !work_stop) {
+		/* Keep the pace, unless the handler took longer than it */
+		now = kvm_cpu__now();
+		work->due_ns += (u64)work->frame.interval_ms * 1000000ULL;
+		if (work->due_ns < now)
+			work->due_ns = now;
+		kvm_ipc__queue_work(work);
+		mutex_unlock(&work_lock);
+		return;
+	}
+	mutex_unlock(&work_lock);
+
+	/* The next version 1 request is read once this one is answered */
+	if (conn->version < 2)
+		kvm_ipc__arm_conn(conn);
+
+	kvm_ipc__put_buf(work->buf);
+	kvm_ipc__put_conn(conn);
+	free(work);
+}
+
+static void *kvm_ipc__worker(void *arg)
+{
+	long worker = (long)arg;
+	struct kvm_ipc_work *work;
+	struct kvm_ipc_buf *out;
+	int memfd;
+
+	kvm__set_thread_name("kvm-ipc-work");
+
+	memfd = memfd_create("kvm-ipc-reply", MFD_CLOEXEC);
+	out = kvm_ipc__get_buf(KVM_IPC_BUF_SIZE);
+	if (memfd < 0 || !out)
+		die("Failed setting up an IPC worker");
+
+	while ((work = kvm_ipc__next_work(worker))) {
+		if (work->conn->version < 2)
+			kvm_ipc__handle(epoll.kvm, work->conn->fd,
+					work->frame.type, work->frame.len,
+					work->buf->data);
+		else
+			kvm_ipc__run_framed(epoll.kvm, work, memfd, out);
+
+		kvm_ipc__done_work(work);
+	}
+
+	kvm_ipc__put_buf(out);
+	close(memfd);
+
+	return NULL;
+}
+
 static int kvm_ipc__new_conn(int fd)
 {
-	int client;
-	struct epoll_event ev;
+	struct epoll_event ev = {
+		.events	= EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+	};
+	struct kvm_ipc_conn *conn;
+	int client, r;
 
-	client = accept(fd, NULL, NULL);
+	client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
 	if (client < 0)
-		return -1;
+		return -errno;
 
-	ev.events = EPOLLIN | EPOLLRDHUP;
-	ev.data.fd = client;
-	if (epoll_ctl(epoll.fd, EPOLL_CTL_ADD, client, &ev) < 0) {
+	conn = calloc(1, sizeof(*conn));
+	if (!conn) {
 		close(client);
-		return -1;
+		return -ENOMEM;
+	}
+
+	*conn = (struct kvm_ipc_conn) {
+		.fd		= client,
+		.version	= 1,
+		.refcount	= 1,
+	};
+	mutex_init(&conn->write_lock);
+
+	ev.data.ptr = conn;
+	if (epoll_ctl(epoll.fd, EPOLL_CTL_ADD, client, &ev) < 0) {
+		r = -errno;
+		kvm_ipc__put_conn(conn);
+		return r;
 	}
 
-	return client;
+	return 0;
 }
 
-static void kvm_ipc__close_conn(int fd)
+static void kvm_ipc__close_conn(struct kvm_ipc_conn *conn)
 {
-	epoll_ctl(epoll.fd, EPOLL_CTL_DEL, fd, NULL);
-	close(fd);
+	__atomic_store_n(&conn->closed, true, __ATOMIC_RELEASE);
+	epoll_ctl(epoll.fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	kvm_ipc__cancel_work(conn, 0, true);
+	kvm_ipc__put_conn(conn);
 }
 
-static int kvm_ipc__receive(struct kvm *kvm, int fd)
+static int kvm_ipc__hello_conn(struct kvm_ipc_conn *conn,
+			       struct kvm_ipc_frame *frame,
+			       struct kvm_ipc_buf *buf)
 {
+	struct kvm_ipc_hello hello = {};
+	struct kvm_ipc_frame reply = *frame;
+
+	/* Once framed, the version can't change anymore */
+	if (conn->version >= 2) {
+		reply.len = 0;
+		reply.status = -EALREADY;
+		mutex_lock(&conn->write_lock);
+		kvm_ipc__send_full(conn->fd, &reply, sizeof(reply));
+		mutex_unlock(&conn->write_lock);
+		return 0;
+	}
+
+	if (frame->len < sizeof(hello))
+		return -EINVAL;
+
+	memcpy(&hello, buf->data, sizeof(hello));
+	if (hello.version > KVM_IPC_VERSION)
+		hello.version = KVM_IPC_VERSION;
+	else if (hello.version < 1)
+		hello.version = 1;
+	hello.reserved = 0;
+	if (kvm_ipc__send_full(conn->fd, &hello, sizeof(hello)) < 0)
+		return -EIO;
+
+	conn->version = hello.version;
+
+	return 0;
+}
+
+/*
+ * Read one request of @conn and queue it for the workers. Returns 1 if the
+ * connection is to be armed again once the request ran, 0 if it can be now.
+ */
+static int kvm_ipc__receive(struct kvm_ipc_conn *conn)
+{
+	struct kvm_ipc_frame frame = {};
 	struct kvm_ipc_head head;
-	u8 *msg = NULL;
-	u32 n;
+	struct kvm_ipc_work *work;
+	struct kvm_ipc_buf *buf;
+	int r;
+
+	if (conn->version < 2) {
+		if (read_in_full(conn->fd, &head, sizeof(head)) != sizeof(head))
+			return -EIO;
+		frame.type = head.type;
+		frame.len = head.len;
+	} else {
+		if (read_in_full(conn->fd, &frame, sizeof(frame)) != sizeof(frame))
+			return -EIO;
+		if (!frame.interval_ms)
+			frame.flags &= ~KVM_IPC_F_REPEAT;
+	}
 
-	n = read(fd, &head, sizeof(head));
-	if (n != sizeof(head))
-		goto done;
+	if (frame.len > KVM_IPC_MAX_LEN)
+		return -EMSGSIZE;
 
-	msg = malloc(head.len);
-	if (msg == NULL)
-		goto done;
+	buf = kvm_ipc__get_buf(frame.len);
+	if (!buf)
+		return -ENOMEM;
 
-	n = read_in_full(fd, msg, head.len);
-	if (n != head.len)
-		goto done;
+	if (read_in_full(conn->fd, buf->data, frame.len) != (ssize_t)frame.len) {
+		r = -EIO;
+		goto out_put;
+	}
 
-	kvm_ipc__handle(kvm, fd, head.type, head.len, msg);
+	switch (frame.type) {
+	case KVM_IPC_HELLO:
+		r = kvm_ipc__hello_conn(conn, &frame, buf);
+		goto out_put;
+	case KVM_IPC_CANCEL:
+		kvm_ipc__cancel_work(conn, frame.id, false);
+		r = 0;
+		goto out_put;
+	}
 
-	return 0;
+	work = calloc(1, sizeof(*work));
+	if (!work) {
+		r = -ENOMEM;
+		goto out_put;
+	}
+
+	kvm_ipc__get_conn(conn);
+	*work = (struct kvm_ipc_work) {
+		.conn	= conn,
+		.frame	= frame,
+		.buf	= buf,
+		.due_ns	= kvm_cpu__now(),
+	};
 
-done:
-	free(msg);
-	return -1;
+	mutex_lock(&work_lock);
+	kvm_ipc__queue_work(work);
+	mutex_unlock(&work_lock);
+
+	return conn->version < 2 ? 1 : 0;
+
+out_put:
+	kvm_ipc__put_buf(buf);
+	return r;
 }
 
 static void kvm_ipc__handle_event(struct kvm *kvm, struct epoll_event *ev)
 {
-	int fd = ev->data.fd;
+	struct kvm_ipc_conn *conn = ev->data.ptr;
+	int r = -EIO;
 
-	if (fd == server_fd) {
-		int client, r;
+	if (conn == NULL) {
+		/* Edge triggered, take all the connections that are waiting */
+		while (kvm_ipc__new_conn(server_fd) == 0)
+			;
+		return;
+	}
 
-		client = kvm_ipc__new_conn(fd);
-		/*
-		 * Handle multiple IPC cmd at a time
-		 */
-		do {
-			r = kvm_ipc__receive(kvm, client);
-		} while	(r == 0);
+	/* What came before the hangup is still answered */
+	if (ev->events & EPOLLIN)
+		r = kvm_ipc__receive(conn);
 
-	} else if (ev->events & (EPOLLERR | EPOLLRDHUP | EPOLLHUP)) {
-		kvm_ipc__close_conn(fd);
-	} else {
-		kvm_ipc__receive(kvm, fd);
-	}
+	if (r < 0)
+		kvm_ipc__close_conn(conn);
+	else if (r == 0)
+		kvm_ipc__arm_conn(conn);
 }
 
 static void kvm__pid(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg)
@@ -351,6 +849,29 @@ static void handle_stop(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg)
 	kvm__reboot(kvm);
 }
 
+static void handle_lock_stats(struct kvm *kvm, int fd, u32 type, u32 len,
+			      u8 *msg)
+{
+	struct kvm_lock_stat_hdr hdr = {};
+	struct kvm_lock_stat *recs;
+
+	if (WARN_ON(type != KVM_IPC_LOCK_STATS || len))
+		return;
+
+#ifdef CONFIG_LOCK_STAT
+	hdr.enabled = 1;
+#endif
+	recs = calloc(KVM_LOCK_STAT_MAX, sizeof(*recs));
+	if (recs)
+		hdr.nr = lock_stat__get(recs, KVM_LOCK_STAT_MAX);
+
+	if (write_in_full(fd, &hdr, sizeof(hdr)) < 0 ||
+	    write_in_full(fd, recs, hdr.nr * sizeof(*recs)) < 0)
+		pr_warning("Failed sending lock statistics");
+
+	free(recs);
+}
+
 /* Pause/resume the guest using SIGUSR2 */
 static int is_paused;
 
@@ -371,6 +892,7 @@ static void handle_pause(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg)
 	}
 
 	is_paused = !is_paused;
+	kvm_status__update(kvm);
 }
 
 static void handle_vmstate(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg)
@@ -424,7 +946,7 @@ static void handle_debug(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg)
 		serial8250__inject_sysrq(kvm, params->sysrq);
 
 	if (dbg_type & KVM_DEBUG_CMD_TYPE_NMI) {
-		if ((int)vcpu >= kvm->nrcpus)
+		if ((int)vcpu >= kvm->nrcpus || !kvm->cpus[vcpu]->thread)
 			return;
 
 		kvm->cpus[vcpu]->needs_nmi = 1;
@@ -437,7 +959,7 @@ static void handle_debug(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg)
 	for (i = 0; i < kvm->nrcpus; i++) {
 		struct kvm_cpu *cpu = kvm->cpus[i];
 
-		if (!cpu)
+		if (!cpu || !cpu->thread)
 			continue;
 
 		printout_done = 0;
@@ -453,18 +975,69 @@ static void handle_debug(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg)
 			sleep(0);
 	}
 
-	close(fd);
+	/* The end of the dump, the connection may have more requests */
+	shutdown(fd, SHUT_WR);
 
 	serial8250__inject_sysrq(kvm, 'p');
 }
 
+static int kvm_ipc__start_workers(void)
+{
+	pthread_condattr_t attr;
+	pthread_attr_t tattr;
+	pthread_t thread;
+	long i;
+	int r;
+
+	/* Due times are from kvm_cpu__now() */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	r = pthread_cond_init(&work_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (r)
+		return -r;
+
+	for (i = 0; i < KVM_IPC_MAX_MSGS; i++)
+		mutex_init(&msgs_locks[i]);
+
+	pthread_attr_init(&tattr);
+	pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < KVM_IPC_WORKERS; i++) {
+		r = pthread_create(&thread, &tattr, kvm_ipc__worker, (void *)i);
+		if (r)
+			break;
+	}
+	pthread_attr_destroy(&tattr);
+
+	return -r;
+}
+
+/* They finish what they run, and leave what is queued */
+static void kvm_ipc__stop_workers(void)
+{
+	mutex_lock(&work_lock);
+	work_stop = true;
+	pthread_cond_broadcast(&work_cond);
+	mutex_unlock(&work_lock);
+}
+
 int kvm_ipc__init(struct kvm *kvm)
 {
 	int ret;
 	int sock = kvm__create_socket(kvm);
 	struct epoll_event ev = {0};
 
+	if (sock < 0)
+		return sock;
+
 	server_fd = sock;
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	ret = kvm_ipc__start_workers();
+	if (ret) {
+		pr_err("Failed starting IPC workers");
+		goto err;
+	}
 
 	ret = epoll__init(kvm, &epoll, "kvm-ipc",
 			  kvm_ipc__handle_event);
@@ -474,7 +1047,7 @@ int kvm_ipc__init(struct kvm *kvm)
 	}
 
 	ev.events = EPOLLIN | EPOLLET;
-	ev.data.fd = sock;
+	ev.data.ptr = NULL;
 	if (epoll_ctl(epoll.fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
 		pr_err("Failed adding socket to epoll");
 		ret = -EFAULT;
@@ -487,14 +1060,16 @@ int kvm_ipc__init(struct kvm *kvm)
 	kvm_ipc__register_handler(KVM_IPC_RESUME, handle_pause);
 	kvm_ipc__register_handler(KVM_IPC_STOP, handle_stop);
 	kvm_ipc__register_handler(KVM_IPC_VMSTATE, handle_vmstate);
+	kvm_ipc__register_handler(KVM_IPC_LOCK_STATS, handle_lock_stats);
 	signal(SIGUSR1, handle_sigusr1);
 
 	return 0;
 
 err_epoll:
 	epoll__exit(&epoll);
-	close(server_fd);
 err:
+	kvm_ipc__stop_workers();
+	close(server_fd);
 	return ret;
 }
 base_init(kvm_ipc__init);
@@ -502,6 +1077,7 @@ base_init(kvm_ipc__init);
 int kvm_ipc__exit(struct kvm *kvm)
 {
 	epoll__exit(&epoll);
+	kvm_ipc__stop_workers();
 	close(server_fd);
 
 	kvm__remove_socket(kvm->cfg.guest_name);
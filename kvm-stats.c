@@ -0,0 +1,295 @@
+#include "kvm/kvm-stats.h"
+#include "kvm/kvm.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/metrics.h"
+#include "kvm/read-write.h"
+#include "kvm/util.h"
+
+#include <linux/kernel.h>
+#include <linux/kvm.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+struct kvm_stats *kvm_stats__open(struct kvm *kvm, int fd)
+{
+	struct kvm_stats_header header;
+	struct kvm_stats_desc *desc;
+	struct kvm_stats *stats;
+	struct kvm_stat *stat;
+	size_t desc_size;
+	u32 i, end;
+
+	if (!kvm__supports_extension(kvm, KVM_CAP_BINARY_STATS_FD))
+		return NULL;
+
+	stats = calloc(1, sizeof(*stats));
+	if (!stats)
+		return NULL;
+
+	stats->fd = ioctl(fd, KVM_GET_STATS_FD, NULL);
+	if (stats->fd < 0)
+		goto err_free;
+
+	if (pread(stats->fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    !header.name_size)
+		goto err_close;
+
+	desc_size = sizeof(*desc) + header.name_size;
+	desc = malloc(header.num_desc * desc_size);
+	stats->stats = calloc(header.num_desc, sizeof(*stats->stats));
+	if (!desc || !stats->stats)
+		goto err_desc;
+
+	/* The descriptors are contiguous, read them all at once */
+	if (pread(stats->fd, desc, header.num_desc * desc_size,
+		  header.desc_offset) != (ssize_t)(header.num_desc * desc_size))
+		goto err_desc;
+
+	for (i = 0; i < header.num_desc; i++) {
+		struct kvm_stats_desc *d = (void *)desc + i * desc_size;
+
+		/* The data is u64 only, offsets that aren't are unknown */
+		if (d->offset % sizeof(u64) || !d->size)
+			continue;
+
+		d->name[header.name_size - 1] = '\0';
+		stat = &stats->stats[stats->nr];
+		stat->name = strdup(d->name);
+		if (!stat->name)
+			goto err_desc;
+		stat->flags = d->flags;
+		stat->exponent = d->exponent;
+		stat->size = d->size;
+		stat->index = d->offset / sizeof(u64);
+		stats->nr++;
+
+		end = stat->index + stat->size;
+		stats->nr_values = max(stats->nr_values, end);
+	}
+
+	stats->data_offset = header.data_offset;
+	free(desc);
+
+	return stats;
+
+err_desc:
+	free(desc);
+	for (i = 0; i < stats->nr; i++)
+		free(stats->stats[i].name);
+	free(stats->stats);
+err_close:
+	close(stats->fd);
+err_free:
+	free(stats);
+	return NULL;
+}
+
+void kvm_stats__close(struct kvm_stats *stats)
+{
+	u32 i;
+
+	if (!stats)
+		return;
+
+	for (i = 0; i < stats->nr; i++)
+		free(stats->stats[i].name);
+	free(stats->stats);
+	close(stats->fd);
+	free(stats);
+}
+
+/* The index of the first value of a statistic, -ENOENT if KVM lacks it */
+int kvm_stats__find(struct kvm_stats *stats, const char *name)
+{
+	u32 i;
+
+	for (i = 0; stats && i < stats->nr; i++) {
+		if (!strcmp(stats->stats[i].name, name))
+			return stats->stats[i].index;
+	}
+
+	return -ENOENT;
+}
+
+/* Fill values, nr_values of them, with what KVM counted so far */
+int kvm_stats__read(struct kvm_stats *stats, u64 *values)
+{
+	size_t size = stats->nr_values * sizeof(u64);
+
+	if (pread(stats->fd, values, size, stats->data_offset) != (ssize_t)size)
+		return -EIO;
+
+	return 0;
+}
+
+static u64 *kvm_stats__alloc_values(struct kvm *kvm)
+{
+	u32 nr = kvm->stats ? kvm->stats->nr_values : 0;
+	int i;
+
+	for (i = 0; kvm->vcpu_stats && i < kvm->nrcpus; i++) {
+		if (kvm->vcpu_stats[i])
+			nr = max(nr, kvm->vcpu_stats[i]->nr_values);
+	}
+
+	return nr ? malloc(nr * sizeof(u64)) : NULL;
+}
+
+static int kvm_stats__add_records(struct kvm_stats *stats, u32 vcpu,
+				  u64 *values, struct kvm_stats_record **records,
+				  u32 *nr)
+{
+	struct kvm_stats_record *rec;
+	struct kvm_stat *stat;
+	u32 i, n = 0;
+
+	if (!stats || kvm_stats__read(stats, values))
+		return 0;
+
+	rec = realloc(*records, (*nr + stats->nr) * sizeof(*rec));
+	if (!rec)
+		return -ENOMEM;
+	*records = rec;
+	rec += *nr;
+
+	for (i = 0; i < stats->nr; i++) {
+		stat = &stats->stats[i];
+		if (stat->size != 1)
+			continue;
+
+		memset(&rec[n], 0, sizeof(rec[n]));
+		snprintf(rec[n].name, sizeof(rec[n].name), "%s", stat->name);
+		rec[n].vcpu = vcpu;
+		rec[n].flags = stat->flags;
+		rec[n].exponent = stat->exponent;
+		rec[n].value = values[stat->index];
+		n++;
+	}
+
+	*nr += n;
+	return 0;
+}
+
+static void kvm_stats__handle_ipc(struct kvm *kvm, int fd, u32 type, u32 len,
+				  u8 *msg)
+{
+	struct kvm_stats_record *records = NULL;
+	u64 *values;
+	u32 nr = 0;
+	int i, r;
+
+	if (WARN_ON(type != KVM_IPC_KVM_STATS || len))
+		return;
+
+	values = kvm_stats__alloc_values(kvm);
+	if (values) {
+		r = kvm_stats__add_records(kvm->stats, KVM_STATS_VM, values,
+					   &records, &nr);
+		for (i = 0; !r && i < kvm->nrcpus; i++)
+			r = kvm_stats__add_records(kvm->vcpu_stats[i], i,
+						   values, &records, &nr);
+		if (r)
+			nr = 0;
+	}
+
+	if (write_in_full(fd, &nr, sizeof(nr)) < 0 ||
+	    write_in_full(fd, records, nr * sizeof(*records)) < 0)
+		pr_warning("Failed sending KVM stats");
+
+	free(records);
+	free(values);
+}
+
+static void kvm_stats__family(struct metrics *m, const char *prefix,
+			      struct kvm_stat *stat, const char *of)
+{
+	bool counter = (stat->flags & KVM_STATS_TYPE_MASK) ==
+		       KVM_STATS_TYPE_CUMULATIVE;
+	char name[128], help[128];
+
+	snprintf(name, sizeof(name), "%s_%s", prefix, stat->name);
+	snprintf(help, sizeof(help), "The %s statistic of KVM for %s",
+		 stat->name, of);
+	metrics__family(m, name, counter ? "counter" : "gauge", help);
+}
+
+/* vCPUs all have the same statistics, in the same order */
+static void kvm_stats__collect(struct kvm *kvm, struct metrics *m)
+{
+	struct kvm_stats *vcpu0 = kvm->vcpu_stats ? kvm->vcpu_stats[0] : NULL;
+	u64 *values, **vcpu_values;
+	struct kvm_stat *stat;
+	int i;
+	u32 j;
+
+	values = kvm_stats__alloc_values(kvm);
+	if (!values)
+		return;
+
+	if (kvm->stats && !kvm_stats__read(kvm->stats, values)) {
+		for (j = 0; j < kvm->stats->nr; j++) {
+			stat = &kvm->stats->stats[j];
+			if (stat->size != 1)
+				continue;
+			kvm_stats__family(m, "kvm_vm", stat, "the VM");
+			metrics__value(m, values[stat->index]);
+		}
+	}
+
+	vcpu_values = vcpu0 ? calloc(kvm->nrcpus, sizeof(*vcpu_values)) : NULL;
+	if (!vcpu_values)
+		goto out;
+
+	for (i = 0; i < kvm->nrcpus; i++) {
+		if (!kvm->vcpu_stats[i] ||
+		    kvm->vcpu_stats[i]->nr_values != vcpu0->nr_values)
+			continue;
+		vcpu_values[i] = malloc(vcpu0->nr_values * sizeof(u64));
+		if (vcpu_values[i] &&
+		    kvm_stats__read(kvm->vcpu_stats[i], vcpu_values[i])) {
+			free(vcpu_values[i]);
+			vcpu_values[i] = NULL;
+		}
+	}
+
+	for (j = 0; j < vcpu0->nr; j++) {
+		stat = &vcpu0->stats[j];
+		if (stat->size != 1)
+			continue;
+		kvm_stats__family(m, "kvm_vcpu", stat, "each vCPU");
+		for (i = 0; i < kvm->nrcpus; i++) {
+			if (vcpu_values[i])
+				metrics__sample(m, vcpu_values[i][stat->index],
+						"vcpu=\"%d\"", i);
+		}
+	}
+
+	for (i = 0; i < kvm->nrcpus; i++)
+		free(vcpu_values[i]);
+	free(vcpu_values);
+out:
+	free(values);
+}
+
+static struct metrics_collector kvm_stats__metrics = {
+	.collect	= kvm_stats__collect,
+};
+
+static int kvm_stats__init(struct kvm *kvm)
+{
+	int r;
+
+	r = kvm_ipc__register_handler(KVM_IPC_KVM_STATS, kvm_stats__handle_ipc);
+	if (r < 0)
+		return r;
+
+	metrics__register(&kvm_stats__metrics);
+
+	return 0;
+}
+late_init(kvm_stats__init);
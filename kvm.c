@@ -1,15 +1,24 @@
 #include "kvm/kvm.h"
+#include "kvm/boot-trace.h"
 #include "kvm/read-write.h"
 #include "kvm/util.h"
 #include "kvm/strbuf.h"
 #include "kvm/mutex.h"
 #include "kvm/kvm-cpu.h"
 #include "kvm/kvm-ipc.h"
+#include "kvm/kvm-stats.h"
+#include "kvm/ksm.h"
+#include "kvm/irq.h"
+#include "kvm/dirty-log.h"
+#include "kvm/snapshot.h"
 
 #include <linux/kernel.h>
 #include <linux/kvm.h>
 #include <linux/list.h>
+#include <linux/bitops.h>
 #include <linux/err.h>
+#include <linux/mempolicy.h>
+#include <linux/sizes.h>
 
 #include <sys/un.h>
 #include <sys/stat.h>
@@ -17,6 +26,7 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <stdbool.h>
 #include <limits.h>
 #include <signal.h>
@@ -27,7 +37,6 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <time.h>
-#include <sys/eventfd.h>
 #include <asm/unistd.h>
 #include <dirent.h>
 
@@ -57,8 +66,15 @@ const char *kvm_exit_reasons[] = {
 #endif
 };
 
-static int pause_event;
+#define KVM_PAUSE_KICK_NS	1000000
+
+/* Held from kvm__pause() to kvm__continue() */
 static DEFINE_MUTEX(pause_lock);
+/* Protects the paused flags of the vCPUs, and pause_requested */
+static DEFINE_MUTEX(pause_state_lock);
+static pthread_cond_t paused_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t resume_cond = PTHREAD_COND_INITIALIZER;
+static bool pause_requested;
 extern struct kvm_ext kvm_req_ext[];
 
 static char kvm_dir[PATH_MAX];
@@ -157,20 +173,117 @@ struct kvm *kvm__new(void)
 	if (!kvm)
 		return ERR_PTR(-ENOMEM);
 
+	kvm->iotraps = kvm__new_iotraps();
+	kvm->irq_routes = irq__new_routes();
+	if (!kvm->iotraps || !kvm->irq_routes) {
+		kvm__free_iotraps(kvm->iotraps);
+		irq__free_routes(kvm->irq_routes);
+		free(kvm);
+		return ERR_PTR(-ENOMEM);
+	}
+
 	mutex_init(&kvm->mem_banks_lock);
+	INIT_LIST_HEAD(&kvm->blk_devs);
+	INIT_LIST_HEAD(&kvm->net_devs);
 	kvm->sys_fd = -1;
 	kvm->vm_fd = -1;
-
-#ifdef KVM_BRLOCK_DEBUG
-	kvm->brlock_sem = (pthread_rwlock_t) PTHREAD_RWLOCK_INITIALIZER;
-#endif
+	kvm->ram_fd = -1;
 
 	return kvm;
 }
 
+/* Zapped from up to one thread per host CPU, a chunk at a time */
+#define KVM_RELEASE_CHUNK	SZ_1G
+#define KVM_RELEASE_THREADS	16
+
+struct kvm_release_ctx {
+	struct kvm	*kvm;
+	u64		chunk;
+	u64		next;
+	u64		total_chunks;
+};
+
+static void *kvm__release_ram_thread(void *arg)
+{
+	struct kvm_release_ctx *ctx = arg;
+	struct kvm_mem_bank *bank;
+	u64 offset, base, len;
+
+	kvm__set_thread_name("kvm-release");
+
+	for (;;) {
+		offset = __atomic_fetch_add(&ctx->next, ctx->chunk,
+					    __ATOMIC_RELAXED);
+		if (offset >= ctx->total_chunks)
+			break;
+
+		base = 0;
+		list_for_each_entry(bank, &ctx->kvm->mem_banks, list) {
+			if (bank->type != KVM_MEM_TYPE_RAM)
+				continue;
+			if (offset < base + ALIGN(bank->size, ctx->chunk))
+				break;
+			base += ALIGN(bank->size, ctx->chunk);
+		}
+
+		offset -= base;
+		len = min(ctx->chunk, bank->size - offset);
+		/* Locked or huge pages are left to the munmap() */
+		madvise(bank->host_addr + offset, len, MADV_DONTNEED);
+	}
+
+	return NULL;
+}
+
+/*
+ * Freeing the pages of guest RAM is most of what makes a large guest slow
+ * to exit, and munmap() does it from a single thread. Once the devices that
+ * use the RAM are gone, drop its pages from several threads while VFIO and
+ * the disks are torn down, which leaves little for kvm__exit() to unmap.
+ * Shared memory merely loses its mappings, its pages go with its file.
+ */
+static int kvm__release_ram(struct kvm *kvm)
+{
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t threads[KVM_RELEASE_THREADS];
+	struct kvm_release_ctx ctx = {
+		.kvm	= kvm,
+		.chunk	= max_t(u64, KVM_RELEASE_CHUNK, kvm->ram_pagesize),
+	};
+	struct kvm_mem_bank *bank;
+	int i, nr_threads;
+
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		if (bank->type == KVM_MEM_TYPE_RAM)
+			ctx.total_chunks += ALIGN(bank->size, ctx.chunk);
+	}
+
+	/* Not worth more threads than just this one */
+	nr_threads = min_t(u64, max(nr_cpus, 1L), ctx.total_chunks / ctx.chunk);
+	nr_threads = min(nr_threads, KVM_RELEASE_THREADS);
+	if (nr_threads <= 1)
+		return 0;
+
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, kvm__release_ram_thread,
+				   &ctx))
+			break;
+	}
+	nr_threads = i;
+	if (!nr_threads)
+		kvm__release_ram_thread(&ctx);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	return 0;
+}
+dev_base_exit_parallel(kvm__release_ram);
+
 int kvm__exit(struct kvm *kvm)
 {
 	struct kvm_mem_bank *bank, *tmp;
+	struct kvm_mem_map *map;
 
 	kvm__arch_delete_ram(kvm);
 
@@ -179,15 +292,183 @@ int kvm__exit(struct kvm *kvm)
 		free(bank);
 	}
 
+	while ((map = kvm->mem_map)) {
+		kvm->mem_map = map->prev;
+		free(map);
+	}
+
+	kvm_stats__close(kvm->stats);
+	kvm__free_iotraps(kvm->iotraps);
+	irq__free_routes(kvm->irq_routes);
 	free(kvm);
 	return 0;
 }
 core_exit(kvm__exit);
 
+static int kvm__cmp_mem_range(const void *a, const void *b)
+{
+	const struct kvm_mem_range *ra = a, *rb = b;
+
+	if (ra->guest_phys_addr == rb->guest_phys_addr)
+		return 0;
+
+	return ra->guest_phys_addr < rb->guest_phys_addr ? -1 : 1;
+}
+
+static int kvm__cmp_mem_range_host(const void *a, const void *b)
+{
+	const struct kvm_mem_range *ra = *(void **)a, *rb = *(void **)b;
+
+	if (ra->host_addr == rb->host_addr)
+		return 0;
+
+	return ra->host_addr < rb->host_addr ? -1 : 1;
+}
+
+/* Publish the current banks to the lookups, with mem_banks_lock held */
+static int kvm__update_mem_map(struct kvm *kvm)
+{
+	struct kvm_mem_bank *bank;
+	struct kvm_mem_map *map;
+	unsigned int i, nr = 0;
+
+	list_for_each_entry(bank, &kvm->mem_banks, list)
+		nr++;
+
+	map = malloc(sizeof(*map) + nr * sizeof(map->ranges[0]) +
+		     nr * sizeof(map->by_host[0]));
+	if (!map)
+		return -ENOMEM;
+	map->by_host = (void *)&map->ranges[nr];
+
+	map->nr = 0;
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		map->ranges[map->nr++] = (struct kvm_mem_range) {
+			.guest_phys_addr	= bank->guest_phys_addr,
+			.size			= bank->size,
+			.host_addr		= bank->host_addr,
+		};
+	}
+	qsort(map->ranges, nr, sizeof(map->ranges[0]), kvm__cmp_mem_range);
+
+	map->nr_host = 0;
+	for (i = 0; i < nr; i++)
+		if (map->ranges[i].host_addr)
+			map->by_host[map->nr_host++] = &map->ranges[i];
+	qsort(map->by_host, map->nr_host, sizeof(map->by_host[0]),
+	      kvm__cmp_mem_range_host);
+
+	map->prev = kvm->mem_map;
+	__atomic_store_n(&kvm->mem_map, map, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+ * The memory slot of @bank, with @size 0 to delete it. Banks with a
+ * guest_memfd need KVM_SET_USER_MEMORY_REGION2, the others use the classic
+ * ioctl that older kernels have.
+ */
+static int kvm__set_mem_region(struct kvm *kvm, struct kvm_mem_bank *bank,
+			       u32 flags, u64 size)
+{
+	struct kvm_userspace_memory_region2 mem = {
+		.slot			= bank->slot,
+		.flags			= flags,
+		.guest_phys_addr	= bank->guest_phys_addr,
+		.memory_size		= size,
+		.userspace_addr		= (unsigned long)bank->host_addr,
+	};
+	struct kvm_userspace_memory_region mem1 = {
+		.slot			= bank->slot,
+		.flags			= flags,
+		.guest_phys_addr	= bank->guest_phys_addr,
+		.memory_size		= size,
+		.userspace_addr		= (unsigned long)bank->host_addr,
+	};
+	int r;
+
+	if (bank->guest_memfd >= 0) {
+		mem.flags |= KVM_MEM_GUEST_MEMFD;
+		mem.guest_memfd = bank->guest_memfd;
+		r = ioctl(kvm->vm_fd, KVM_SET_USER_MEMORY_REGION2, &mem);
+	} else {
+		r = ioctl(kvm->vm_fd, KVM_SET_USER_MEMORY_REGION, &mem1);
+	}
+
+	return r < 0 ? -errno : 0;
+}
+
+/*
+ * With --guest-memfd, each RAM bank has a guest_memfd of its size, which
+ * backs the pages that the guest has private. Shared pages, which are all of
+ * them until the guest converts some, stay in the host mapping that the rest
+ * of kvmtool uses.
+ */
+static int kvm__create_guest_memfd(struct kvm *kvm, u64 size)
+{
+	struct kvm_create_guest_memfd gmem = {
+		.size	= size,
+	};
+	int fd;
+
+	fd = ioctl(kvm->vm_fd, KVM_CREATE_GUEST_MEMFD, &gmem);
+	if (fd < 0)
+		return -errno;
+
+	return fd;
+}
+
+/*
+ * KVM_EXIT_MEMORY_FAULT: the guest accessed [@gpa, @gpa + @size) as private
+ * or shared, but KVM has it the other way. Convert the range, and drop the
+ * pages of the side that it leaves.
+ */
+int kvm__convert_mem(struct kvm *kvm, u64 gpa, u64 size, bool private)
+{
+	struct kvm_memory_attributes attr = {
+		.address	= gpa,
+		.size		= size,
+		.attributes	= private ? KVM_MEMORY_ATTRIBUTE_PRIVATE : 0,
+	};
+	struct kvm_mem_bank *bank;
+	u64 offset;
+	int r = 0;
+
+	mutex_lock(&kvm->mem_banks_lock);
+	bank = NULL;
+	list_for_each_entry(bank, &kvm->mem_banks, list)
+		if (gpa >= bank->guest_phys_addr &&
+		    gpa + size <= bank->guest_phys_addr + bank->size)
+			break;
+
+	if (&bank->list == &kvm->mem_banks || bank->guest_memfd < 0) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	if (ioctl(kvm->vm_fd, KVM_SET_MEMORY_ATTRIBUTES, &attr) < 0) {
+		r = -errno;
+		goto out;
+	}
+
+	offset = gpa - bank->guest_phys_addr;
+	if (private)
+		madvise(bank->host_addr + offset, size, MADV_DONTNEED);
+	else if (fallocate(bank->guest_memfd,
+			   FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			   offset, size) < 0)
+		pr_warning("Unable to discard private guest memory: %s",
+			   strerror(errno));
+
+out:
+	mutex_unlock(&kvm->mem_banks_lock);
+	return r;
+}
+
 int kvm__destroy_mem(struct kvm *kvm, u64 guest_phys, u64 size,
 		     void *userspace_addr)
 {
-	struct kvm_userspace_memory_region mem;
 	struct kvm_mem_bank *bank;
 	int ret;
 
@@ -211,33 +492,78 @@ int kvm__destroy_mem(struct kvm *kvm, u64 guest_phys, u64 size,
 		goto out;
 	}
 
-	mem = (struct kvm_userspace_memory_region) {
-		.slot			= bank->slot,
-		.guest_phys_addr	= guest_phys,
-		.memory_size		= 0,
-		.userspace_addr		= (unsigned long)userspace_addr,
-	};
-
-	ret = ioctl(kvm->vm_fd, KVM_SET_USER_MEMORY_REGION, &mem);
-	if (ret < 0) {
-		ret = -errno;
+	ret = kvm__set_mem_region(kvm, bank, 0, 0);
+	if (ret < 0)
 		goto out;
-	}
 
 	list_del(&bank->list);
+	if (bank->guest_memfd >= 0)
+		close(bank->guest_memfd);
 	free(bank);
 	kvm->mem_slots--;
-	ret = 0;
+	ret = kvm__update_mem_map(kvm);
 
 out:
 	mutex_unlock(&kvm->mem_banks_lock);
 	return ret;
 }
 
+/*
+ * Place RAM bank number @bank on the host nodes given with --numa-node. This
+ * only sets the policy for pages that the guest hasn't touched yet, so it
+ * must run before anything is loaded into guest memory.
+ */
+static void kvm__numa_bind(struct kvm *kvm, void *addr, u64 size, int bank)
+{
+	unsigned long mask[BITS_TO_LONGS(KVM_MAX_NUMA_NODE)] = {};
+	int i, node, mode;
+
+	if (!kvm->cfg.nr_numa_nodes)
+		return;
+
+	switch (kvm->cfg.numa_policy) {
+	case KVM_NUMA_INTERLEAVE:
+		mode = MPOL_INTERLEAVE;
+		for (i = 0; i < kvm->cfg.nr_numa_nodes; i++) {
+			node = kvm->cfg.numa_nodes[i];
+			mask[node / BITS_PER_LONG] |= 1UL << (node % BITS_PER_LONG);
+		}
+		break;
+	case KVM_NUMA_PREFERRED:
+	case KVM_NUMA_BIND:
+	default:
+		mode = kvm->cfg.numa_policy == KVM_NUMA_PREFERRED ?
+		       MPOL_PREFERRED : MPOL_BIND;
+		node = kvm->cfg.numa_nodes[min(bank, kvm->cfg.nr_numa_nodes - 1)];
+		mask[node / BITS_PER_LONG] |= 1UL << (node % BITS_PER_LONG);
+		break;
+	}
+
+	if (syscall(SYS_mbind, addr, size, mode, mask, KVM_MAX_NUMA_NODE + 1,
+		    MPOL_MF_MOVE) < 0)
+		die_perror("mbind");
+}
+
+/*
+ * Past all the guest physical memory registered so far, and above the 32-bit
+ * devices, where regions that devices add can go.
+ */
+u64 kvm__mem_end(struct kvm *kvm, u64 align)
+{
+	struct kvm_mem_bank *bank;
+	u64 end = SZ_4G;
+
+	mutex_lock(&kvm->mem_banks_lock);
+	list_for_each_entry(bank, &kvm->mem_banks, list)
+		end = max(end, bank->guest_phys_addr + bank->size);
+	mutex_unlock(&kvm->mem_banks_lock);
+
+	return ALIGN(end, align);
+}
+
 int kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size,
 		      void *userspace_addr, enum kvm_mem_type type)
 {
-	struct kvm_userspace_memory_region mem;
 	struct kvm_mem_bank *merged = NULL;
 	struct kvm_mem_bank *bank;
 	struct list_head *prev_entry;
@@ -297,7 +623,7 @@ int kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size,
 	}
 
 	if (merged) {
-		ret = 0;
+		ret = kvm__update_mem_map(kvm);
 		goto out;
 	}
 
@@ -313,62 +639,278 @@ int kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size,
 	bank->size			= size;
 	bank->type			= type;
 	bank->slot			= slot;
+	bank->guest_memfd		= -1;
 
 	if (type & KVM_MEM_TYPE_READONLY)
 		flags |= KVM_MEM_READONLY;
 
-	if (type != KVM_MEM_TYPE_RESERVED) {
-		mem = (struct kvm_userspace_memory_region) {
-			.slot			= slot,
-			.flags			= flags,
-			.guest_phys_addr	= guest_phys,
-			.memory_size		= size,
-			.userspace_addr		= (unsigned long)userspace_addr,
-		};
+	if (type == KVM_MEM_TYPE_RAM) {
+		kvm__numa_bind(kvm, userspace_addr, size, kvm->nr_ram_banks);
+		ksm__setup_bank(kvm, userspace_addr, size, kvm->nr_ram_banks++);
+	}
 
-		ret = ioctl(kvm->vm_fd, KVM_SET_USER_MEMORY_REGION, &mem);
+	if (type == KVM_MEM_TYPE_RAM && kvm->cfg.guest_memfd) {
+		ret = kvm__create_guest_memfd(kvm, size);
 		if (ret < 0) {
-			ret = -errno;
+			free(bank);
+			goto out;
+		}
+		bank->guest_memfd = ret;
+	}
+
+	if (type != KVM_MEM_TYPE_RESERVED) {
+		ret = kvm__set_mem_region(kvm, bank, flags, size);
+		if (ret < 0) {
+			if (bank->guest_memfd >= 0)
+				close(bank->guest_memfd);
+			free(bank);
 			goto out;
 		}
 	}
 
 	list_add(&bank->list, prev_entry);
 	kvm->mem_slots++;
-	ret = 0;
+	ret = kvm__update_mem_map(kvm);
 
 out:
 	mutex_unlock(&kvm->mem_banks_lock);
 	return ret;
 }
 
-void *guest_flat_to_host(struct kvm *kvm, u64 offset)
+static struct kvm_mem_bank *kvm__find_bank(struct kvm *kvm, u64 guest_phys)
 {
 	struct kvm_mem_bank *bank;
 
-	list_for_each_entry(bank, &kvm->mem_banks, list) {
-		u64 bank_start = bank->guest_phys_addr;
-		u64 bank_end = bank_start + bank->size;
+	list_for_each_entry(bank, &kvm->mem_banks, list)
+		if (bank->guest_phys_addr == guest_phys)
+			return bank;
+
+	return NULL;
+}
 
-		if (offset >= bank_start && offset < bank_end)
-			return bank->host_addr + (offset - bank_start);
+/*
+ * Start or stop KVM logging the writes to the bank at @guest_phys, for
+ * kvm__get_dirty_log() to collect.
+ */
+int kvm__set_dirty_log(struct kvm *kvm, u64 guest_phys, bool enable)
+{
+	struct kvm_mem_bank *bank;
+	u32 flags = enable ? KVM_MEM_LOG_DIRTY_PAGES : 0;
+	int ret = 0;
+
+	mutex_lock(&kvm->mem_banks_lock);
+	bank = kvm__find_bank(kvm, guest_phys);
+	if (!bank || bank->type == KVM_MEM_TYPE_RESERVED) {
+		ret = -EINVAL;
+		goto out;
 	}
 
-	pr_warning("unable to translate guest address 0x%llx to host",
-			(unsigned long long)offset);
-	return NULL;
+	/* KVM doesn't log the writes to guest_memfd slots */
+	if (bank->guest_memfd >= 0) {
+		ret = enable ? -EOPNOTSUPP : 0;
+		goto out;
+	}
+
+	if (bank->type & KVM_MEM_TYPE_READONLY)
+		flags |= KVM_MEM_READONLY;
+
+	ret = kvm__set_mem_region(kvm, bank, flags, bank->size);
+
+out:
+	mutex_unlock(&kvm->mem_banks_lock);
+	return ret;
 }
 
-u64 host_to_guest_flat(struct kvm *kvm, void *ptr)
+/*
+ * Fetch and clear the pages of the bank at @guest_phys written since the
+ * last call, one bit per page. @bitmap is rounded up to 64 bits.
+ */
+int kvm__get_dirty_log(struct kvm *kvm, u64 guest_phys, unsigned long *bitmap)
 {
+	struct kvm_dirty_log log = { .dirty_bitmap = bitmap };
 	struct kvm_mem_bank *bank;
 
+	mutex_lock(&kvm->mem_banks_lock);
+	bank = kvm__find_bank(kvm, guest_phys);
+	if (bank)
+		log.slot = bank->slot;
+	mutex_unlock(&kvm->mem_banks_lock);
+
+	if (!bank)
+		return -EINVAL;
+
+	if (ioctl(kvm->vm_fd, KVM_GET_DIRTY_LOG, &log) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Size of the RAM of guest NUMA node @node and its @offset from the start of
+ * RAM. Nodes follow each other in order, and those past the end of the RAM
+ * that the architecture could give the guest are left empty.
+ */
+u64 kvm__numa_node_mem(struct kvm *kvm, int node, u64 *offset)
+{
+	u64 start = 0;
+	int i;
+
+	for (i = 0; i < node; i++)
+		start += kvm->cfg.guest_numa[i].mem_size;
+
+	*offset = start;
+	if (start >= kvm->ram_size)
+		return 0;
+
+	return min(kvm->cfg.guest_numa[node].mem_size, kvm->ram_size - start);
+}
+
+int kvm__numa_node_of_cpu(struct kvm *kvm, int cpu)
+{
+	struct kvm_numa_node *node;
+	int i;
+
+	for (i = 0; i < kvm->cfg.nr_guest_numa; i++) {
+		node = &kvm->cfg.guest_numa[i];
+		if (cpu >= node->first_cpu && cpu <= node->last_cpu)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Register contiguous RAM as one bank per guest NUMA node, so that each bank
+ * can be bound to the host node backing it.
+ */
+int kvm__register_numa_ram(struct kvm *kvm, u64 guest_phys, u64 size,
+			   void *userspace_addr)
+{
+	u64 offset, len;
+	int i, r;
+
+	if (!kvm->cfg.nr_guest_numa)
+		return kvm__register_ram(kvm, guest_phys, size, userspace_addr);
+
+	for (i = 0; i < kvm->cfg.nr_guest_numa; i++) {
+		len = kvm__numa_node_mem(kvm, i, &offset);
+		if (!len || offset >= size)
+			break;
+
+		len = min(len, size - offset);
+		r = kvm__register_ram(kvm, guest_phys + offset, len,
+				      userspace_addr + offset);
+		if (r)
+			return r;
+	}
+
+	return 0;
+}
+
+/*
+ * How much of each RAM bank KVM can map with the huge pages that back it, or
+ * with the transparent huge pages that may. The host and guest addresses of
+ * a bank have to be congruent modulo the page size, and only the whole pages
+ * within the bank count.
+ */
+static void kvm__report_ram_pages(struct kvm *kvm)
+{
+	u64 base = getpagesize(), page, start, end, mapped;
+	struct kvm_mem_bank *bank;
+	int i = 0;
+
+	page = kvm->ram_pagesize > base ? kvm->ram_pagesize : host_thp_size();
+
 	list_for_each_entry(bank, &kvm->mem_banks, list) {
-		void *bank_start = bank->host_addr;
-		void *bank_end = bank_start + bank->size;
+		if (bank->type != KVM_MEM_TYPE_RAM)
+			continue;
+
+		start = ALIGN(bank->guest_phys_addr, page);
+		end = (bank->guest_phys_addr + bank->size) & ~(page - 1);
+		mapped = end > start ? end - start : 0;
+		if ((bank->guest_phys_addr ^ (unsigned long)bank->host_addr) &
+		    (page - 1)) {
+			pr_warning("RAM bank %d at 0x%llx isn't aligned like its host mapping, KVM can't map it with %lluKB pages",
+				   i, bank->guest_phys_addr, page >> 10);
+			mapped = 0;
+		}
+
+		pr_debug("RAM bank %d at 0x%llx: %lluMB of %lluMB can be mapped with %lluKB pages",
+			 i++, bank->guest_phys_addr, mapped >> 20,
+			 bank->size >> 20, page >> 10);
+	}
+}
+
+/* The range of the last translation of each thread, most often hit again */
+static __thread struct {
+	struct kvm_mem_map	*map;
+	struct kvm_mem_range	range;
+} last_translation;
+
+/* Without a warning for the addresses that aren't RAM, that the guest gave */
+void *__guest_flat_to_host(struct kvm *kvm, u64 offset)
+{
+	struct kvm_mem_map *map = __atomic_load_n(&kvm->mem_map, __ATOMIC_ACQUIRE);
+	struct kvm_mem_range *range = &last_translation.range;
+	unsigned int lo = 0, hi, mid;
+
+	if (last_translation.map == map &&
+	    offset - range->guest_phys_addr < range->size)
+		return range->host_addr + (offset - range->guest_phys_addr);
+
+	hi = map ? map->nr : 0;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		range = &map->ranges[mid];
+
+		if (offset < range->guest_phys_addr) {
+			hi = mid;
+		} else if (offset - range->guest_phys_addr >= range->size) {
+			lo = mid + 1;
+		} else {
+			last_translation.map = map;
+			last_translation.range = *range;
+			return range->host_addr + (offset - range->guest_phys_addr);
+		}
+	}
+
+	return NULL;
+}
+
+void *guest_flat_to_host(struct kvm *kvm, u64 offset)
+{
+	void *host = __guest_flat_to_host(kvm, offset);
+
+	if (!host)
+		pr_warning("unable to translate guest address 0x%llx to host",
+			   (unsigned long long)offset);
+	return host;
+}
 
-		if (ptr >= bank_start && ptr < bank_end)
-			return bank->guest_phys_addr + (ptr - bank_start);
+u64 host_to_guest_flat(struct kvm *kvm, void *ptr)
+{
+	struct kvm_mem_map *map = __atomic_load_n(&kvm->mem_map, __ATOMIC_ACQUIRE);
+	struct kvm_mem_range *range = &last_translation.range;
+	unsigned int lo = 0, hi, mid;
+
+	if (last_translation.map == map && range->host_addr &&
+	    (u64)(ptr - range->host_addr) < range->size)
+		return range->guest_phys_addr + (ptr - range->host_addr);
+
+	hi = map ? map->nr_host : 0;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		range = map->by_host[mid];
+
+		if (ptr < range->host_addr) {
+			hi = mid;
+		} else if ((u64)(ptr - range->host_addr) >= range->size) {
+			lo = mid + 1;
+		} else {
+			last_translation.map = map;
+			last_translation.range = *range;
+			return range->guest_phys_addr + (ptr - range->host_addr);
+		}
 	}
 
 	pr_warning("unable to translate host address %p to guest", ptr);
@@ -433,10 +975,224 @@ int __attribute__((weak)) kvm__get_vm_type(struct kvm *kvm)
 	return KVM_VM_TYPE;
 }
 
+/* Per VM, instead of the halt_poll_ns module parameter of the host */
+static void kvm__set_halt_poll(struct kvm *kvm)
+{
+	struct kvm_enable_cap cap = {
+		.cap	= KVM_CAP_HALT_POLL,
+		.args	= { kvm->cfg.halt_poll_ns },
+	};
+
+	if (!kvm__supports_vm_extension(kvm, KVM_CAP_HALT_POLL))
+		die("--halt-poll-ns needs KVM_CAP_HALT_POLL");
+
+	if (ioctl(kvm->vm_fd, KVM_ENABLE_CAP, &cap) < 0)
+		die_perror("KVM_ENABLE_CAP(KVM_CAP_HALT_POLL)");
+}
+
+static cpu_set_t *kvm__io_affinity;
+
+/*
+ * Every thread that kvmtool starts names itself first, which is also where
+ * it moves to the --io-affinity CPUs. vCPU threads set their own affinity
+ * once named.
+ */
+void kvm__set_thread_name(const char *name)
+{
+	prctl(PR_SET_NAME, name);
+
+	if (kvm__io_affinity &&
+	    sched_setaffinity(0, CPU_ALLOC_SIZE(NR_CPUS), kvm__io_affinity))
+		pr_warning("Unable to move thread %s to the I/O CPUs", name);
+}
+
+/*
+ * Like pthread_create(). Each default stack is 8MB of address space and of
+ * commit charge, the device threads of 500 VMs would account for tens of GB.
+ */
+int kvm__start_device_thread(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+	pthread_attr_t attr;
+	int r;
+
+	r = pthread_attr_init(&attr);
+	if (r)
+		return r;
+
+	r = pthread_attr_setstacksize(&attr, KVM_DEVICE_THREAD_STACK);
+	if (!r)
+		r = pthread_create(thread, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+
+	return r;
+}
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23
+#endif
+
+/* RAM is pre-faulted in chunks, handed out to the threads in turn */
+#define KVM_PREALLOC_CHUNK	SZ_256M
+#define KVM_PREALLOC_THREADS	16
+
+struct kvm_prealloc {
+	struct kvm	*kvm;
+	u64		chunk;
+	/* RAM size, and the same with each bank rounded up to chunks */
+	u64		total;
+	u64		total_chunks;
+	/* Offset of the next chunk over all RAM banks, and bytes done */
+	u64		next;
+	u64		done;
+	int		err;
+};
+
+static bool kvm__prealloc_no_populate;
+
+static int kvm__prealloc_range(void *addr, u64 size, u64 pagesize)
+{
+	volatile u8 *page;
+	u64 off;
+
+	if (!__atomic_load_n(&kvm__prealloc_no_populate, __ATOMIC_RELAXED)) {
+		if (!madvise(addr, size, MADV_POPULATE_WRITE))
+			return 0;
+		/* Kernels older than 5.14 */
+		if (errno != EINVAL)
+			return -errno;
+		__atomic_store_n(&kvm__prealloc_no_populate, true,
+				 __ATOMIC_RELAXED);
+	}
+
+	/* Nothing was loaded yet, but keep the contents anyway */
+	for (off = 0; off < size; off += pagesize) {
+		page = addr + off;
+		*page = *page;
+	}
+
+	return 0;
+}
+
+static void *kvm__prealloc_thread(void *arg)
+{
+	struct kvm_prealloc *pa = arg;
+	struct kvm *kvm = pa->kvm;
+	struct kvm_mem_bank *bank;
+	u64 offset, base, len;
+	int r;
+
+	/* Not kvm__set_thread_name(), this may use all host CPUs */
+	prctl(PR_SET_NAME, "kvm-prealloc");
+
+	for (;;) {
+		offset = __atomic_fetch_add(&pa->next, pa->chunk,
+					    __ATOMIC_RELAXED);
+		if (offset >= pa->total_chunks)
+			break;
+
+		/* Chunks don't span banks */
+		base = 0;
+		list_for_each_entry(bank, &kvm->mem_banks, list) {
+			if (bank->type != KVM_MEM_TYPE_RAM)
+				continue;
+			if (offset < base + ALIGN(bank->size, pa->chunk))
+				break;
+			base += ALIGN(bank->size, pa->chunk);
+		}
+
+		len = min(pa->chunk, bank->size - (offset - base));
+		r = kvm__prealloc_range(bank->host_addr + offset - base, len,
+					kvm->ram_pagesize);
+		if (r < 0) {
+			pa->err = r;
+			break;
+		}
+
+		__atomic_add_fetch(&pa->done, len, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+/*
+ * Fault in all of guest RAM with --mem-prealloc, from several threads. This
+ * runs after the banks got their NUMA policy, so pages land on the right
+ * nodes, and reports progress when it takes a while.
+ */
+static void kvm__prealloc_ram(struct kvm *kvm)
+{
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t threads[KVM_PREALLOC_THREADS];
+	struct kvm_prealloc pa = {
+		.kvm	= kvm,
+		.chunk	= max_t(u64, KVM_PREALLOC_CHUNK, kvm->ram_pagesize),
+	};
+	struct kvm_mem_bank *bank;
+	u64 start = kvm_cpu__now();
+	unsigned int seconds = 0;
+	int i, nr_threads;
+
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		if (bank->type != KVM_MEM_TYPE_RAM)
+			continue;
+		pa.total += bank->size;
+		pa.total_chunks += ALIGN(bank->size, pa.chunk);
+	}
+
+	nr_threads = min_t(long, max(nr_cpus, 1L), KVM_PREALLOC_THREADS);
+	nr_threads = min_t(u64, nr_threads, pa.total_chunks / pa.chunk);
+
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, kvm__prealloc_thread, &pa))
+			break;
+	}
+	nr_threads = i;
+	/* Do it all here if no thread could start */
+	if (!nr_threads)
+		kvm__prealloc_thread(&pa);
+
+	while (__atomic_load_n(&pa.done, __ATOMIC_RELAXED) < pa.total &&
+	       !__atomic_load_n(&pa.err, __ATOMIC_RELAXED)) {
+		usleep(100000);
+		if ((kvm_cpu__now() - start) / 1000000000ULL <= seconds)
+			continue;
+
+		seconds++;
+		pr_info("Preallocating guest RAM: %llu/%llu MB",
+			(unsigned long long)__atomic_load_n(&pa.done,
+					__ATOMIC_RELAXED) / SZ_1M,
+			(unsigned long long)pa.total / SZ_1M);
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (pa.err) {
+		errno = -pa.err;
+		die_perror("Preallocating guest RAM");
+	}
+
+	/* KSM would merge the zeroed pages again */
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		if (bank->type == KVM_MEM_TYPE_RAM)
+			madvise(bank->host_addr, bank->size, MADV_UNMERGEABLE);
+	}
+
+	pr_debug("Preallocated %llu MB of guest RAM in %llu ms",
+		 (unsigned long long)pa.total / SZ_1M,
+		 (unsigned long long)(kvm_cpu__now() - start) / 1000000);
+}
+
 int kvm__init(struct kvm *kvm)
 {
 	int ret;
 
+	/* Threads that don't name themselves inherit it from us */
+	kvm__io_affinity = kvm->cfg.io_affinity;
+	if (kvm__io_affinity &&
+	    sched_setaffinity(0, CPU_ALLOC_SIZE(NR_CPUS), kvm__io_affinity))
+		die_perror("sched_setaffinity");
+
 	if (!kvm__arch_cpu_supports_vm()) {
 		pr_err("Your CPU does not support hardware virtualization");
 		ret = -ENOSYS;
@@ -479,10 +1235,41 @@ int kvm__init(struct kvm *kvm)
 		goto err_vm_fd;
 	}
 
+	kvm->stats = kvm_stats__open(kvm, kvm->vm_fd);
+
+	if (kvm->cfg.halt_poll_ns >= 0)
+		kvm__set_halt_poll(kvm);
+
+	if (kvm->cfg.guest_memfd) {
+		if (!kvm__supports_vm_extension(kvm, KVM_CAP_USER_MEMORY2) ||
+		    !kvm__supports_vm_extension(kvm, KVM_CAP_GUEST_MEMFD))
+			die("--guest-memfd needs KVM_CAP_GUEST_MEMFD");
+
+		/* Private pages can't be read back */
+		snapshot__block("guest_memfd RAM");
+	}
+
+	/* Rings are set up per vCPU, so before any is created */
+	dirty_log__enable_ring(kvm);
+
+	/* Before RAM is mapped, so that banks can still opt out */
+	ksm__enable_process(kvm);
+
 	kvm__arch_init(kvm);
 
 	INIT_LIST_HEAD(&kvm->mem_banks);
 	kvm__init_ram(kvm);
+	kvm__report_ram_pages(kvm);
+
+	if (kvm->cfg.mem_prealloc)
+		kvm__prealloc_ram(kvm);
+
+	/*
+	 * Guest RAM, firmware included, is mapped from the snapshot or
+	 * received from the source later.
+	 */
+	if (kvm->cfg.restore_dir || kvm->cfg.incoming)
+		return 0;
 
 	if (!kvm->cfg.firmware_filename) {
 		if (!kvm__load_kernel(kvm, kvm->cfg.kernel_filename,
@@ -512,11 +1299,89 @@ err:
 }
 core_init(kvm__init);
 
+/*
+ * With --map-images, whole pages of kernels and initrds are mapped from their
+ * file, private and copy-on-write, rather than copied. Guests booting the same
+ * image then share its page cache. Guest RAM with huge pages, or that other
+ * processes or NUMA policies apply to, keeps the copies.
+ */
+static bool kvm__can_map_image(struct kvm *kvm, int fd, off_t offset,
+			       void *dst, size_t len)
+{
+	long pagesize = getpagesize();
+	struct stat st;
+
+	if (!kvm->cfg.map_images || kvm->cfg.mem_shared ||
+	    kvm->cfg.mem_prealloc || kvm->cfg.nr_numa_nodes ||
+	    kvm->ram_pagesize != (u64)pagesize)
+		return false;
+
+	if (offset % pagesize || (unsigned long)dst % pagesize ||
+	    (size_t)pagesize > len)
+		return false;
+
+	if (dst < kvm->ram_start || dst + len > kvm->ram_start + kvm->ram_size)
+		return false;
+
+	return !fstat(fd, &st) && S_ISREG(st.st_mode) &&
+	       offset + (off_t)len <= st.st_size;
+}
+
+/* Load @len bytes of @fd at @offset to @dst, in guest RAM */
+ssize_t kvm__load_image(struct kvm *kvm, int fd, off_t offset, void *dst,
+			size_t len)
+{
+	size_t mapped = 0;
+	ssize_t r;
+
+	if (kvm__can_map_image(kvm, fd, offset, dst, len)) {
+		mapped = len & ~((size_t)getpagesize() - 1);
+		if (mmap(dst, mapped, PROT_RW, MAP_PRIVATE | MAP_FIXED, fd,
+			 offset) == MAP_FAILED) {
+			pr_warning("Unable to map the image: %s, reading it",
+				   strerror(errno));
+			/* MAP_FIXED may have unmapped the range already */
+			if (mmap(dst, mapped, PROT_RW, MAP_ANON_NORESERVE |
+				 MAP_FIXED, -1, 0) == MAP_FAILED)
+				die_perror("mmap");
+			mapped = 0;
+		}
+	}
+
+	if (mapped == len)
+		return len;
+
+	r = pread_in_full(fd, dst + mapped, len - mapped, offset + mapped);
+	if (r < 0)
+		return r;
+
+	return mapped + r;
+}
+
+/* Like read_file(), from the current offset of @fd to its end */
+ssize_t kvm__read_image(struct kvm *kvm, int fd, void *dst, size_t max_size)
+{
+	struct stat st;
+	off_t offset;
+
+	offset = lseek(fd, 0, SEEK_CUR);
+	if (offset < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return read_file(fd, dst, max_size);
+
+	if (st.st_size - offset > (off_t)max_size) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return kvm__load_image(kvm, fd, offset, dst, st.st_size - offset);
+}
+
 bool kvm__load_kernel(struct kvm *kvm, const char *kernel_filename,
 		const char *initrd_filename, const char *kernel_cmdline)
 {
 	bool ret;
 	int fd_kernel = -1, fd_initrd = -1;
+	u64 start = kvm_cpu__now();
 
 	fd_kernel = open(kernel_filename, O_RDONLY);
 	if (fd_kernel < 0)
@@ -537,6 +1402,9 @@ bool kvm__load_kernel(struct kvm *kvm, const char *kernel_filename,
 
 	if (!ret)
 		die("%s is not a valid kernel image", kernel_filename);
+
+	if (boot_trace_enabled)
+		boot_trace__span("init", "load kernel", start, kvm_cpu__now());
 	return ret;
 }
 
@@ -573,12 +1441,46 @@ void kvm__reboot(struct kvm *kvm)
 
 void kvm__continue(struct kvm *kvm)
 {
+	mutex_lock(&pause_state_lock);
+	pause_requested = false;
+	pthread_cond_broadcast(&resume_cond);
+	mutex_unlock(&pause_state_lock);
+
 	mutex_unlock(&pause_lock);
 }
 
+/* Kick the vCPUs that aren't paused yet, returns how many there are */
+static int kvm__kick_running(struct kvm *kvm, bool kick)
+{
+	int i, nr = 0;
+
+	for (i = 0; i < kvm->nrcpus; i++) {
+		struct kvm_cpu *vcpu = kvm->cpus[i];
+
+		if (!vcpu->is_running || vcpu->paused)
+			continue;
+
+		nr++;
+		if (!kick)
+			continue;
+
+		vcpu->kvm_run->immediate_exit = 1;
+		/* Only needed when it is in the guest already */
+		pthread_kill(vcpu->thread, SIGKVMPAUSE);
+	}
+
+	return nr;
+}
+
+/*
+ * Stop all vCPUs between two exits, until kvm__continue(). Each one has
+ * immediate_exit set, so that it leaves KVM_RUN or doesn't enter it again,
+ * and all are kicked before waiting for any of them.
+ */
 void kvm__pause(struct kvm *kvm)
 {
-	int i, paused_vcpus = 0;
+	struct timespec ts;
+	bool kick = true;
 
 	mutex_lock(&pause_lock);
 
@@ -586,34 +1488,42 @@ void kvm__pause(struct kvm *kvm)
 	if (!kvm->cpus || !kvm->cpus[0] || kvm->cpus[0]->thread == 0)
 		return;
 
-	pause_event = eventfd(0, 0);
-	if (pause_event < 0)
-		die("Failed creating pause notification event");
-	for (i = 0; i < kvm->nrcpus; i++) {
-		if (kvm->cpus[i]->is_running && kvm->cpus[i]->paused == 0)
-			pthread_kill(kvm->cpus[i]->thread, SIGKVMPAUSE);
-		else
-			paused_vcpus++;
-	}
-
-	while (paused_vcpus < kvm->nrcpus) {
-		u64 cur_read;
-
-		if (read(pause_event, &cur_read, sizeof(cur_read)) < 0)
-			die("Failed reading pause event");
-		paused_vcpus += cur_read;
+	mutex_lock(&pause_state_lock);
+	pause_requested = true;
+
+	/*
+	 * Without KVM_CAP_IMMEDIATE_EXIT, a signal that comes right before
+	 * KVM_RUN is lost, kick again the vCPUs that take long.
+	 */
+	while (kvm__kick_running(kvm, kick)) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += KVM_PAUSE_KICK_NS;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		kick = pthread_cond_timedwait(&paused_cond,
+					      &pause_state_lock.mutex,
+					      &ts) == ETIMEDOUT;
 	}
-	close(pause_event);
+	mutex_unlock(&pause_state_lock);
 }
 
+/* Called by a vCPU that has immediate_exit set, before its next KVM_RUN */
 void kvm__notify_paused(void)
 {
-	u64 p = 1;
+	struct kvm_cpu *vcpu = current_kvm_cpu;
 
-	if (write(pause_event, &p, sizeof(p)) < 0)
-		die("Failed notifying of paused VCPU.");
+	mutex_lock(&pause_state_lock);
+	if (pause_requested) {
+		vcpu->paused = 1;
+		pthread_cond_signal(&paused_cond);
 
-	mutex_lock(&pause_lock);
-	current_kvm_cpu->paused = 0;
-	mutex_unlock(&pause_lock);
+		while (pause_requested)
+			pthread_cond_wait(&resume_cond, &pause_state_lock.mutex);
+		vcpu->paused = 0;
+	}
+	/* A new kvm__pause() sets it again, with this lock held */
+	vcpu->kvm_run->immediate_exit = 0;
+	mutex_unlock(&pause_state_lock);
 }
@@ -0,0 +1,226 @@
+#include "kvm/metrics.h"
+
+#include "kvm/epoll.h"
+#include "kvm/kvm.h"
+#include "kvm/mutex.h"
+#include "kvm/socket.h"
+#include "kvm/util.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* How long a client has to send its request, before it gets plain text */
+#define METRICS_REQUEST_MS	100
+
+struct metrics {
+	char			*buf;
+	size_t			len;
+	size_t			size;
+	bool			failed;
+	const char		*family;
+	const char		*guest;
+};
+
+static LIST_HEAD(collectors);
+static DEFINE_MUTEX(collectors_lock);
+
+static int metrics_fd = -1;
+static struct kvm__epoll metrics_epoll;
+
+void metrics__register(struct metrics_collector *collector)
+{
+	mutex_lock(&collectors_lock);
+	list_add_tail(&collector->list, &collectors);
+	mutex_unlock(&collectors_lock);
+}
+
+static void metrics__vprintf(struct metrics *m, const char *fmt, va_list ap)
+{
+	va_list copy;
+	size_t size;
+	char *p;
+	int n;
+
+	if (m->failed)
+		return;
+
+	for (;;) {
+		va_copy(copy, ap);
+		n = vsnprintf(m->buf + m->len, m->size - m->len, fmt, copy);
+		va_end(copy);
+		if (n < 0) {
+			m->failed = true;
+			return;
+		}
+		if ((size_t)n < m->size - m->len)
+			break;
+
+		size = max_t(size_t, m->size * 2, m->len + n + 1);
+		p = realloc(m->buf, size);
+		if (!p) {
+			m->failed = true;
+			return;
+		}
+		m->buf = p;
+		m->size = size;
+	}
+
+	m->len += n;
+}
+
+static void metrics__printf(struct metrics *m, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	metrics__vprintf(m, fmt, ap);
+	va_end(ap);
+}
+
+void metrics__family(struct metrics *m, const char *name, const char *type,
+		     const char *help)
+{
+	m->family = name;
+	metrics__printf(m, "# HELP kvmtool_%s %s\n# TYPE kvmtool_%s %s\n",
+			name, help, name, type);
+}
+
+void metrics__sample(struct metrics *m, u64 value, const char *labels, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	va_start(ap, labels);
+	vsnprintf(buf, sizeof(buf), labels, ap);
+	va_end(ap);
+
+	metrics__printf(m, "kvmtool_%s{guest=\"%s\"%s%s} %llu\n", m->family,
+			m->guest, buf[0] ? "," : "", buf,
+			(unsigned long long)value);
+}
+
+void metrics__value(struct metrics *m, u64 value)
+{
+	metrics__printf(m, "kvmtool_%s{guest=\"%s\"} %llu\n", m->family,
+			m->guest, (unsigned long long)value);
+}
+
+static int metrics__send(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Each connection gets all metrics once. Scrapers send an HTTP GET, to which
+ * this is the reply. Anything else, such as a plain reader of the socket
+ * that sends nothing, gets the text only.
+ */
+static void metrics__handle_event(struct kvm *kvm, struct epoll_event *ev)
+{
+	struct timeval tv = { .tv_usec = METRICS_REQUEST_MS * 1000 };
+	struct metrics m = { .guest = kvm->cfg.guest_name };
+	struct metrics_collector *collector;
+	char req[1024], head[128];
+	bool http;
+	ssize_t n;
+	int fd;
+
+	fd = accept4(metrics_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	n = recv(fd, req, sizeof(req), 0);
+	http = n >= 4 && !memcmp(req, "GET ", 4);
+
+	mutex_lock(&collectors_lock);
+	list_for_each_entry(collector, &collectors, list)
+		collector->collect(kvm, &m);
+	mutex_unlock(&collectors_lock);
+
+	if (m.failed) {
+		pr_warning("Unable to collect the metrics");
+		goto out;
+	}
+
+	if (http) {
+		n = snprintf(head, sizeof(head),
+			     "HTTP/1.0 200 OK\r\n"
+			     "Content-Type: text/plain; version=0.0.4\r\n"
+			     "Content-Length: %zu\r\n\r\n", m.len);
+		if (metrics__send(fd, head, n) < 0)
+			goto out;
+	}
+
+	metrics__send(fd, m.buf, m.len);
+out:
+	free(m.buf);
+	close(fd);
+}
+
+static int metrics__init(struct kvm *kvm)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	int r;
+
+	if (!kvm->cfg.metrics)
+		return 0;
+
+	metrics_fd = socket__open(kvm->cfg.metrics, true, 16);
+	if (metrics_fd < 0) {
+		pr_err("Unable to listen for metrics on %s: %s",
+		       kvm->cfg.metrics, strerror(-metrics_fd));
+		return metrics_fd;
+	}
+
+	r = epoll__init(kvm, &metrics_epoll, "kvm-metrics",
+			metrics__handle_event);
+	if (r < 0)
+		goto err_close;
+
+	if (epoll_ctl(metrics_epoll.fd, EPOLL_CTL_ADD, metrics_fd, &ev) < 0) {
+		r = -errno;
+		epoll__exit(&metrics_epoll);
+		goto err_close;
+	}
+
+	return 0;
+
+err_close:
+	close(metrics_fd);
+	metrics_fd = -1;
+	return r;
+}
+late_init(metrics__init);
+
+static int metrics__exit(struct kvm *kvm)
+{
+	if (metrics_fd < 0)
+		return 0;
+
+	epoll__exit(&metrics_epoll);
+	close(metrics_fd);
+	if (!strncmp(kvm->cfg.metrics, "unix:", 5))
+		unlink(kvm->cfg.metrics + 5);
+
+	return 0;
+}
+late_exit(metrics__exit);
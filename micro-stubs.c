@@ -0,0 +1,157 @@
+#include "kvm/8250-serial.h"
+#include "kvm/disk-image.h"
+#include "kvm/kvm.h"
+#include "kvm/parse-options.h"
+#include "kvm/pci-shmem.h"
+#include "kvm/term.h"
+#include "kvm/uip.h"
+#include "kvm/util.h"
+#include "kvm/vfio.h"
+#include "kvm/virtio-9p.h"
+#include "kvm/virtio-balloon.h"
+#include "kvm/virtio-fs.h"
+#include "kvm/virtio-pmem.h"
+#include "kvm/virtio-vdpa.h"
+
+#include <errno.h>
+
+/*
+ * lkvm-micro is built without the devices that config/micro.mak leaves
+ * out. Their options stay, so that the command line is the same as that
+ * of lkvm, and give up here.
+ */
+#define MICRO_NOT_BUILT(what)						\
+	die(what " isn't built into " KVM_BINARY_NAME "-micro")
+
+int virtio_9p_rootdir_parser(const struct option *opt, const char *arg,
+			     int unset)
+{
+	MICRO_NOT_BUILT("virtio-9p");
+}
+
+int virtio_9p_img_name_parser(const struct option *opt, const char *arg,
+			      int unset)
+{
+	MICRO_NOT_BUILT("virtio-9p");
+}
+
+int virtio_9p_cache_parser(const struct option *opt, const char *arg,
+			   int unset)
+{
+	MICRO_NOT_BUILT("virtio-9p");
+}
+
+int virtio_9p__register(struct kvm *kvm, const char *root,
+			const char *tag_name)
+{
+	return -ENODEV;
+}
+
+int virtio_fs_parser(const struct option *opt, const char *arg, int unset)
+{
+	MICRO_NOT_BUILT("virtio-fs");
+}
+
+int virtio_pmem_parser(const struct option *opt, const char *arg, int unset)
+{
+	MICRO_NOT_BUILT("virtio-pmem");
+}
+
+int virtio_vdpa_parser(const struct option *opt, const char *arg, int unset)
+{
+	MICRO_NOT_BUILT("vhost-vdpa");
+}
+
+int virtio_vdpa__register(struct kvm *kvm, const char *path)
+{
+	MICRO_NOT_BUILT("vhost-vdpa");
+}
+
+int virtio_bln_auto_parser(const struct option *opt, const char *arg,
+			   int unset)
+{
+	MICRO_NOT_BUILT("virtio-balloon");
+}
+
+u64 virtio_bln__actual_bytes(void)
+{
+	return 0;
+}
+
+int vfio_device_parser(const struct option *opt, const char *arg, int unset)
+{
+	MICRO_NOT_BUILT("VFIO");
+}
+
+int pci_shmem_parser(const struct option *opt, const char *arg, int unset)
+{
+	MICRO_NOT_BUILT("ivshmem");
+}
+
+void serial8250__inject_sysrq(struct kvm *kvm, char sysrq)
+{
+}
+
+/* virtio-net only gets here for mode=user */
+void uip_static_init(struct uip_info *info)
+{
+	MICRO_NOT_BUILT("User mode networking");
+}
+
+int uip_init(struct uip_info *info)
+{
+	return -ENODEV;
+}
+
+void uip_exit(struct uip_info *info)
+{
+}
+
+int uip_tx(struct iovec *iov, u16 out, struct uip_info *info)
+{
+	return -ENODEV;
+}
+
+int uip_tx_batch(struct net_tx_io *io, u16 nr, struct uip_info *info)
+{
+	return -ENODEV;
+}
+
+int uip_rx(struct iovec *iov, u16 in, struct uip_info *info)
+{
+	return -ENODEV;
+}
+
+void uip_flow_get_stats(struct uip_flow_table *table,
+			struct uip_flow_stats *stats)
+{
+}
+
+/* The options of the devices left out that only set a flag */
+static int micro__init(struct kvm *kvm)
+{
+	int i;
+
+	if (kvm->cfg.active_console == CONSOLE_8250)
+		MICRO_NOT_BUILT("The 8250 console");
+	if (kvm->cfg.balloon)
+		MICRO_NOT_BUILT("virtio-balloon");
+	if (kvm->cfg.virtio_mem_mb)
+		MICRO_NOT_BUILT("virtio-mem");
+	if (kvm->cfg.virtio_gpu || kvm->cfg.virtio_input)
+		MICRO_NOT_BUILT("The display");
+	if (kvm->cfg.virtio_doorbell)
+		MICRO_NOT_BUILT("virtio-doorbell");
+
+	for (i = 0; i < kvm->nr_disks; i++) {
+		if (kvm->cfg.disk_image[i].scsi)
+			MICRO_NOT_BUILT("virtio-scsi");
+	}
+
+	/* No default user mode network, only those given */
+	if (!kvm->cfg.num_net_devices)
+		kvm->cfg.no_net = true;
+
+	return 0;
+}
+base_init(micro__init);
@@ -0,0 +1,842 @@
+#include "kvm/migrate.h"
+
+#include "kvm/dirty-log.h"
+#include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/read-write.h"
+#include "kvm/snapshot.h"
+#include "kvm/socket.h"
+#include "kvm/util.h"
+
+#include <linux/bitmap.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef CONFIG_HAS_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+ * Pre-copy live migration. The source opens a number of connections to the
+ * destination, each starting with a struct migrate_header, and splits guest
+ * RAM between them by runs of 64 pages: the one of the N-th word of the dirty
+ * bitmap goes to channel N % nr_channels.
+ *
+ * The first round sends all of RAM, while the guest runs. Each of the next
+ * ones sends the pages that were written during the previous round, until
+ * these are few enough to be sent within the downtime target. The guest is
+ * then stopped, sending the last pages and the state of snapshot__capture(),
+ * and it runs on the destination once that has restored it.
+ *
+ * Each connection carries a sequence of struct migrate_record, ended by
+ * MIGRATE_END. Offsets and sizes are those of RAM from kvm->ram_start, and
+ * only channel 0 carries the state.
+ */
+#define MIGRATE_MAGIC		"LKVMMIGR"
+#define MIGRATE_VERSION		1
+
+#define MIGRATE_F_COMPRESS	(1 << 0)
+
+#define MIGRATE_MAX_ROUNDS	30
+
+/*
+ * Guests that write faster than the link sends are slowed down, by taking
+ * a growing share of each period from their vCPUs.
+ */
+#define MIGRATE_THROTTLE_PERIOD_US	10000
+#define MIGRATE_THROTTLE_START		20
+#define MIGRATE_THROTTLE_STEP		10
+#define MIGRATE_THROTTLE_MAX		99
+
+enum {
+	MIGRATE_PAGES,
+	/* zlib, of the size in the record */
+	MIGRATE_PAGES_Z,
+	MIGRATE_ZERO,
+	MIGRATE_STATE,
+	MIGRATE_END,
+};
+
+struct migrate_header {
+	char	magic[8];
+	u32	version;
+	u32	nrcpus;
+	u64	ram_size;
+	u32	page_size;
+	u32	flags;
+	u16	nr_channels;
+	u16	channel;
+	u32	reserved;
+};
+
+struct migrate_record {
+	u32	type;
+	/* Of the data that follows */
+	u32	len;
+	u64	offset;
+	u64	size;
+};
+
+struct migrate_channel {
+	struct kvm			*kvm;
+	int				fd;
+	u16				index;
+	u16				nr;
+	bool				zero_pages;
+	bool				compress;
+	/* Pages to send in this round, the channel clears its own words */
+	unsigned long			*bitmap;
+	u64				nr_pages;
+	void				*zbuf;
+	size_t				zbuf_size;
+	u64				bytes;
+	/* Received by channel 0 */
+	void				*state;
+	size_t				state_len;
+	int				err;
+	pthread_t			thread;
+};
+
+struct migrate_throttle {
+	struct kvm		*kvm;
+	pthread_t		thread;
+	u32			pct;
+	bool			stop;
+};
+
+static long migrate_page_size;
+
+/* Of an incoming migration, from migrate__prepare_incoming() */
+static int migrate_listen_fd = -1;
+static int migrate_incoming_fd = -1;
+static struct migrate_header migrate_incoming_header;
+
+static bool migrate__page_is_zero(const void *page)
+{
+	const u64 *p = page;
+	long i;
+
+	for (i = 0; i < migrate_page_size / (long)sizeof(*p); i++)
+		if (p[i])
+			return false;
+
+	return true;
+}
+
+/* Set the bits of the pages that are guest RAM, not of the holes in it */
+static void migrate__set_ram(struct kvm *kvm, unsigned long *bitmap)
+{
+	struct kvm_mem_bank *bank;
+
+	list_for_each_entry(bank, &kvm->mem_banks, list)
+		if (bank->type == KVM_MEM_TYPE_RAM)
+			bitmap_set(bitmap,
+				   (bank->host_addr - kvm->ram_start) /
+				   migrate_page_size,
+				   bank->size / migrate_page_size);
+}
+
+static int migrate__send_record(struct migrate_channel *ch, u32 type,
+				u64 offset, u64 size, const void *data,
+				u32 len)
+{
+	struct migrate_record rec = {
+		.type	= type,
+		.len	= len,
+		.offset	= offset,
+		.size	= size,
+	};
+
+	if (write_in_full(ch->fd, &rec, sizeof(rec)) < 0 ||
+	    (len && write_in_full(ch->fd, data, len) < 0))
+		return -errno;
+
+	ch->bytes += sizeof(rec) + len;
+
+	return 0;
+}
+
+static int migrate__send_pages(struct migrate_channel *ch, u64 page, u64 nr,
+			       bool zero)
+{
+	u64 offset = page * migrate_page_size;
+	u64 size = nr * migrate_page_size;
+	void *p = ch->kvm->ram_start + offset;
+
+	if (zero)
+		return migrate__send_record(ch, MIGRATE_ZERO, offset, size,
+					    NULL, 0);
+
+#ifdef CONFIG_HAS_ZLIB
+	if (ch->compress) {
+		uLongf len = ch->zbuf_size;
+
+		/* Level 1: faster than most links, and still halves text */
+		if (compress2(ch->zbuf, &len, p, size, 1) == Z_OK &&
+		    len < size)
+			return migrate__send_record(ch, MIGRATE_PAGES_Z, offset,
+						    size, ch->zbuf, len);
+	}
+#endif
+
+	return migrate__send_record(ch, MIGRATE_PAGES, offset, size, p, size);
+}
+
+/* Send the pages of this channel in the bitmap, by runs of the same kind */
+static void *migrate__send_thread(void *arg)
+{
+	struct migrate_channel *ch = arg;
+	u64 i, j, words = BITS_TO_LONGS(ch->nr_pages);
+
+	for (i = ch->index; i < words && !ch->err; i += ch->nr) {
+		unsigned long w = ch->bitmap[i];
+		u64 first = 0, nr = 0;
+		bool zero = false;
+
+		if (!w)
+			continue;
+		ch->bitmap[i] = 0;
+
+		for (j = 0; j <= BITS_PER_LONG; j++) {
+			u64 page = i * BITS_PER_LONG + j;
+			bool dirty, z;
+
+			dirty = j < BITS_PER_LONG && (w & (1UL << j)) &&
+				page < ch->nr_pages;
+			z = dirty && ch->zero_pages &&
+			    migrate__page_is_zero(ch->kvm->ram_start +
+						  page * migrate_page_size);
+
+			if (nr && (!dirty || z != zero)) {
+				ch->err = migrate__send_pages(ch, first, nr,
+							      zero);
+				if (ch->err)
+					break;
+				nr = 0;
+			}
+
+			if (!dirty)
+				continue;
+			if (!nr) {
+				first = page;
+				zero = z;
+			}
+			nr++;
+		}
+	}
+
+	return NULL;
+}
+
+static int migrate__send_round(struct migrate_channel *chs, u32 nr)
+{
+	u32 i;
+	int r;
+
+	for (i = 0; i < nr; i++) {
+		r = pthread_create(&chs[i].thread, NULL, migrate__send_thread,
+				   &chs[i]);
+		if (r)
+			chs[i].err = -r;
+	}
+
+	for (i = 0; i < nr; i++)
+		if (!chs[i].err)
+			pthread_join(chs[i].thread, NULL);
+
+	for (i = 0; i < nr; i++)
+		if (chs[i].err)
+			return chs[i].err;
+
+	return 0;
+}
+
+static u64 migrate__bytes(struct migrate_channel *chs, u32 nr)
+{
+	u64 bytes = 0;
+	u32 i;
+
+	for (i = 0; i < nr; i++)
+		bytes += chs[i].bytes;
+
+	return bytes;
+}
+
+static void migrate__throttle_vcpu(struct kvm_cpu *vcpu, void *data)
+{
+	struct migrate_throttle *t = data;
+
+	usleep(MIGRATE_THROTTLE_PERIOD_US *
+	       __atomic_load_n(&t->pct, __ATOMIC_RELAXED) / 100);
+}
+
+static void *migrate__throttle_thread(void *arg)
+{
+	struct migrate_throttle *t = arg;
+	struct kvm_cpu_task task = {
+		.func	= migrate__throttle_vcpu,
+		.data	= t,
+	};
+
+	kvm__set_thread_name("kvm-throttle");
+
+	while (!__atomic_load_n(&t->stop, __ATOMIC_RELAXED)) {
+		u32 pct = __atomic_load_n(&t->pct, __ATOMIC_RELAXED);
+
+		kvm_cpu__run_on_all_cpus(t->kvm, &task);
+		usleep(MIGRATE_THROTTLE_PERIOD_US * (100 - pct) / 100);
+	}
+
+	return NULL;
+}
+
+static void migrate__throttle(struct migrate_throttle *t)
+{
+	if (t->pct) {
+		__atomic_store_n(&t->pct,
+				 min_t(u32, t->pct + MIGRATE_THROTTLE_STEP,
+				       MIGRATE_THROTTLE_MAX), __ATOMIC_RELAXED);
+	} else {
+		t->pct = MIGRATE_THROTTLE_START;
+		if (pthread_create(&t->thread, NULL, migrate__throttle_thread,
+				   t)) {
+			t->pct = 0;
+			return;
+		}
+	}
+
+	pr_info("migrate: throttling the guest by %u%%", t->pct);
+}
+
+static void migrate__unthrottle(struct migrate_throttle *t)
+{
+	if (!t->pct)
+		return;
+
+	__atomic_store_n(&t->stop, true, __ATOMIC_RELAXED);
+	pthread_join(t->thread, NULL);
+	t->pct = 0;
+}
+
+static int migrate__connect(struct kvm *kvm, const struct migrate_params *params,
+			    struct migrate_channel *chs)
+{
+	struct migrate_header header = {
+		.magic		= MIGRATE_MAGIC,
+		.version	= MIGRATE_VERSION,
+		.nrcpus		= kvm->nrcpus,
+		.ram_size	= kvm->cfg.ram_size,
+		.page_size	= migrate_page_size,
+		.flags		= params->compress ? MIGRATE_F_COMPRESS : 0,
+		.nr_channels	= params->channels,
+	};
+	u32 i;
+
+	for (i = 0; i < params->channels; i++) {
+		struct migrate_channel *ch = &chs[i];
+
+		ch->fd = socket__open(params->dest, false, 0);
+		if (ch->fd < 0) {
+			pr_err("migrate: unable to connect to %s: %s",
+			       params->dest, strerror(-ch->fd));
+			return ch->fd;
+		}
+
+		header.channel = i;
+		if (write_in_full(ch->fd, &header, sizeof(header)) < 0)
+			return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Send the guest to @params->dest. On success, it is left stopped for
+ * migrate__finish(), and it runs again otherwise.
+ */
+static int migrate__outgoing(struct kvm *kvm, const struct migrate_params *params)
+{
+	struct migrate_channel chs[MIGRATE_MAX_CHANNELS] = {};
+	struct migrate_throttle throttle = { .kvm = kvm };
+	u32 nr = params->channels, downtime_ms = params->downtime_ms;
+	u64 nr_pages, start, round_start, bytes, bw, expected_ms;
+	unsigned long *bitmap;
+	size_t state_len = 0;
+	void *state = NULL;
+	u32 i, round;
+	long dirty = 0;
+	s32 status;
+	int r;
+
+	if (!nr || nr > MIGRATE_MAX_CHANNELS)
+		return -EINVAL;
+	if (!downtime_ms)
+		downtime_ms = MIGRATE_DEFAULT_DOWNTIME_MS;
+
+#ifndef CONFIG_HAS_ZLIB
+	if (params->compress) {
+		pr_err("migrate: built without zlib, can't compress");
+		return -EOPNOTSUPP;
+	}
+#endif
+
+	/* Rather than after sending all of RAM */
+	if (snapshot__blocked())
+		return -EOPNOTSUPP;
+
+	migrate_page_size = getpagesize();
+	nr_pages = kvm->ram_size / migrate_page_size;
+	bitmap = calloc(BITS_TO_LONGS(nr_pages), sizeof(long));
+	if (!bitmap)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		chs[i] = (struct migrate_channel) {
+			.kvm		= kvm,
+			.fd		= -1,
+			.index		= i,
+			.nr		= nr,
+			.zero_pages	= params->zero_pages,
+			.compress	= params->compress,
+			.bitmap		= bitmap,
+			.nr_pages	= nr_pages,
+		};
+#ifdef CONFIG_HAS_ZLIB
+		if (params->compress) {
+			chs[i].zbuf_size = compressBound(BITS_PER_LONG *
+							 migrate_page_size);
+			chs[i].zbuf = malloc(chs[i].zbuf_size);
+			if (!chs[i].zbuf) {
+				r = -ENOMEM;
+				goto out;
+			}
+		}
+#endif
+	}
+
+	r = migrate__connect(kvm, params, chs);
+	if (r < 0)
+		goto out;
+
+	r = dirty_log__start(kvm);
+	if (r < 0)
+		goto out;
+
+	pr_info("migrate: sending %llu MB to %s on %u channels, %s dirty ring",
+		(unsigned long long)kvm->cfg.ram_size / SZ_1M, params->dest,
+		nr, dirty_log__has_ring() ? "with the" : "without a");
+
+	start = kvm_cpu__now();
+	migrate__set_ram(kvm, bitmap);
+
+	for (round = 0; ; round++) {
+		round_start = kvm_cpu__now();
+		bytes = migrate__bytes(chs, nr);
+
+		r = migrate__send_round(chs, nr);
+		if (r < 0)
+			goto out_log;
+
+		bytes = migrate__bytes(chs, nr) - bytes;
+		bw = bytes * 1000000000ULL /
+		     max_t(u64, kvm_cpu__now() - round_start, 1);
+
+		dirty = dirty_log__sync(kvm, bitmap);
+		if (dirty < 0) {
+			r = dirty;
+			goto out_log;
+		}
+
+		expected_ms = bw ? dirty * migrate_page_size * 1000 / bw : 0;
+		pr_debug("migrate: round %u sent %llu MB at %llu MB/s, %ld pages dirty",
+			 round, (unsigned long long)bytes / SZ_1M,
+			 (unsigned long long)bw / SZ_1M, dirty);
+
+		if (expected_ms <= downtime_ms || round + 1 >= MIGRATE_MAX_ROUNDS)
+			break;
+
+		/* The guest writes as fast as we can send, slow it down */
+		if ((u64)dirty * migrate_page_size > bytes / 2)
+			migrate__throttle(&throttle);
+	}
+
+	migrate__unthrottle(&throttle);
+
+	round_start = kvm_cpu__now();
+	r = snapshot__stop(kvm);
+	if (r < 0)
+		goto out_log;
+
+	dirty = dirty_log__sync(kvm, bitmap);
+	dirty_log__sync_devices(bitmap);
+	if (dirty >= 0)
+		r = migrate__send_round(chs, nr);
+	else
+		r = dirty;
+	if (!r)
+		r = snapshot__capture(kvm, &state, &state_len);
+
+	for (i = 1; i < nr && !r; i++)
+		r = migrate__send_record(&chs[i], MIGRATE_END, 0, 0, NULL, 0);
+	if (!r)
+		r = migrate__send_record(&chs[0], MIGRATE_STATE, 0, 0, state,
+					 state_len);
+	if (!r)
+		r = migrate__send_record(&chs[0], MIGRATE_END, 0, 0, NULL, 0);
+	if (!r) {
+		if (read_in_full(chs[0].fd, &status, sizeof(status)) !=
+		    sizeof(status))
+			r = -EIO;
+		else
+			r = status;
+	}
+
+	if (r < 0) {
+		pr_err("migrate: the destination didn't take the guest: %s",
+		       strerror(-r));
+		dirty_log__stop(kvm);
+		snapshot__start(kvm);
+		goto out;
+	}
+
+	pr_info("migrate: sent in %.3f s, the guest was stopped for %.3f ms",
+		(kvm_cpu__now() - start) / 1e9,
+		(kvm_cpu__now() - round_start) / 1e6);
+	goto out;
+
+out_log:
+	migrate__unthrottle(&throttle);
+	dirty_log__stop(kvm);
+out:
+	for (i = 0; i < nr; i++) {
+		if (chs[i].fd >= 0)
+			close(chs[i].fd);
+		free(chs[i].zbuf);
+	}
+	free(state);
+	free(bitmap);
+
+	return r;
+}
+
+/* The guest runs on the destination now, the vCPUs exit here */
+static void migrate__finish(struct kvm *kvm)
+{
+	int i;
+
+	dirty_log__stop(kvm);
+
+	for (i = 0; i < kvm->nrcpus; i++)
+		kvm->cpus[i]->is_running = false;
+
+	kvm__continue(kvm);
+}
+
+static int migrate__accept(struct migrate_header *header)
+{
+	int fd;
+
+	fd = accept4(migrate_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	socket__set_nodelay(fd);
+
+	if (read_in_full(fd, header, sizeof(*header)) != sizeof(*header) ||
+	    memcmp(header->magic, MIGRATE_MAGIC, sizeof(header->magic)) ||
+	    header->version != MIGRATE_VERSION ||
+	    header->page_size != (u32)getpagesize() ||
+	    !header->nr_channels ||
+	    header->nr_channels > MIGRATE_MAX_CHANNELS ||
+	    header->channel >= header->nr_channels) {
+		pr_err("migrate: the source doesn't speak this version");
+		close(fd);
+		return -EINVAL;
+	}
+
+	return fd;
+}
+
+/* Wait for the source of --incoming, before the guest is set up */
+int migrate__prepare_incoming(struct kvm *kvm)
+{
+	struct migrate_header *header = &migrate_incoming_header;
+
+	if (kvm->cfg.restore_dir) {
+		pr_err("migrate: --incoming and --restore don't go together");
+		return -EINVAL;
+	}
+
+	migrate_listen_fd = socket__open(kvm->cfg.incoming, true,
+					 MIGRATE_MAX_CHANNELS);
+	if (migrate_listen_fd < 0) {
+		pr_err("migrate: unable to listen on %s: %s",
+		       kvm->cfg.incoming, strerror(-migrate_listen_fd));
+		return migrate_listen_fd;
+	}
+
+	pr_info("migrate: waiting for the guest on %s", kvm->cfg.incoming);
+
+	/* The source connects its channels in order */
+	migrate_incoming_fd = migrate__accept(header);
+	if (migrate_incoming_fd < 0)
+		return migrate_incoming_fd;
+	if (header->channel) {
+		pr_err("migrate: the source didn't connect channel 0 first");
+		return -EINVAL;
+	}
+
+#ifndef CONFIG_HAS_ZLIB
+	if (header->flags & MIGRATE_F_COMPRESS) {
+		pr_err("migrate: built without zlib, can't uncompress");
+		return -EOPNOTSUPP;
+	}
+#endif
+
+	if ((kvm->cfg.nrcpus && kvm->cfg.nrcpus != (int)header->nrcpus) ||
+	    (kvm->cfg.ram_size && kvm->cfg.ram_size != header->ram_size)) {
+		pr_err("migrate: the guest has %u vCPUs and %llu MB of RAM",
+		       header->nrcpus,
+		       (unsigned long long)header->ram_size / SZ_1M);
+		return -EINVAL;
+	}
+
+	kvm->cfg.nrcpus = header->nrcpus;
+	kvm->cfg.ram_size = header->ram_size;
+
+	return 0;
+}
+
+static bool migrate__is_ram(struct kvm *kvm, u64 offset, u64 size)
+{
+	struct kvm_mem_bank *bank;
+
+	if (offset % migrate_page_size || size % migrate_page_size)
+		return false;
+
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		u64 start = bank->host_addr - kvm->ram_start;
+
+		if (bank->type != KVM_MEM_TYPE_RAM)
+			continue;
+		if (offset >= start && size <= bank->size &&
+		    offset - start <= bank->size - size)
+			return true;
+	}
+
+	return false;
+}
+
+static void migrate__zero(struct kvm *kvm, void *p, u64 size)
+{
+	/* Dropping private anonymous pages is cheaper than writing them */
+	if (kvm->cfg.mem_shared || kvm->cfg.hugetlbfs_path ||
+	    kvm->cfg.mem_prealloc ||
+	    kvm->cfg.mem_backend == KVM_MEM_BACKEND_HUGETLBFS ||
+	    kvm->cfg.mem_backend == KVM_MEM_BACKEND_MEMFD ||
+	    madvise(p, size, MADV_DONTNEED) < 0)
+		memset(p, 0, size);
+}
+
+static int migrate__receive(struct migrate_channel *ch)
+{
+	struct migrate_record rec;
+	void *p;
+
+	for (;;) {
+		if (read_in_full(ch->fd, &rec, sizeof(rec)) != sizeof(rec))
+			return -EIO;
+
+		switch (rec.type) {
+		case MIGRATE_END:
+			return 0;
+		case MIGRATE_STATE:
+			if (ch->index || ch->state || !rec.len)
+				return -EINVAL;
+
+			ch->state = malloc(rec.len);
+			if (!ch->state)
+				return -ENOMEM;
+			ch->state_len = rec.len;
+			if (read_in_full(ch->fd, ch->state, rec.len) != rec.len)
+				return -EIO;
+			continue;
+		case MIGRATE_PAGES:
+		case MIGRATE_PAGES_Z:
+		case MIGRATE_ZERO:
+			break;
+		default:
+			return -EINVAL;
+		}
+
+		if (!migrate__is_ram(ch->kvm, rec.offset, rec.size))
+			return -EINVAL;
+		p = ch->kvm->ram_start + rec.offset;
+
+		if (rec.type == MIGRATE_ZERO) {
+			if (rec.len)
+				return -EINVAL;
+			migrate__zero(ch->kvm, p, rec.size);
+		} else if (rec.type == MIGRATE_PAGES) {
+			if (rec.len != rec.size)
+				return -EINVAL;
+			if (read_in_full(ch->fd, p, rec.len) != rec.len)
+				return -EIO;
+		} else {
+#ifdef CONFIG_HAS_ZLIB
+			uLongf len = rec.size;
+
+			if (rec.len > ch->zbuf_size)
+				return -EINVAL;
+			if (read_in_full(ch->fd, ch->zbuf, rec.len) != rec.len)
+				return -EIO;
+			if (uncompress(p, &len, ch->zbuf, rec.len) != Z_OK ||
+			    len != rec.size)
+				return -EINVAL;
+#else
+			return -EOPNOTSUPP;
+#endif
+		}
+	}
+}
+
+static void *migrate__receive_thread(void *arg)
+{
+	struct migrate_channel *ch = arg;
+
+	kvm__set_thread_name("kvm-migrate");
+	ch->err = migrate__receive(ch);
+
+	return NULL;
+}
+
+/* Once all devices are set up, and before the vCPUs run */
+int migrate__incoming(struct kvm *kvm)
+{
+	struct migrate_header *first = &migrate_incoming_header, header;
+	struct migrate_channel chs[MIGRATE_MAX_CHANNELS] = {};
+	u32 i, nr = first->nr_channels;
+	u64 start = kvm_cpu__now();
+	int r = 0;
+
+	migrate_page_size = getpagesize();
+
+	for (i = 0; i < nr; i++) {
+		chs[i] = (struct migrate_channel) {
+			.kvm	= kvm,
+			.fd	= -1,
+			.index	= i,
+			.nr	= nr,
+		};
+#ifdef CONFIG_HAS_ZLIB
+		chs[i].zbuf_size = compressBound(BITS_PER_LONG *
+						 migrate_page_size);
+		chs[i].zbuf = malloc(chs[i].zbuf_size);
+		if (!chs[i].zbuf) {
+			r = -ENOMEM;
+			goto out;
+		}
+#endif
+	}
+	chs[0].fd = migrate_incoming_fd;
+	migrate_incoming_fd = -1;
+
+	for (i = 1; i < nr; i++) {
+		int fd = migrate__accept(&header);
+
+		if (fd < 0) {
+			r = fd;
+			goto out;
+		}
+
+		if (header.nr_channels != nr || header.nrcpus != first->nrcpus ||
+		    header.ram_size != first->ram_size ||
+		    chs[header.channel].fd >= 0) {
+			close(fd);
+			r = -EINVAL;
+			goto out;
+		}
+		chs[header.channel].fd = fd;
+	}
+
+	close(migrate_listen_fd);
+	migrate_listen_fd = -1;
+
+	for (i = 1; i < nr; i++) {
+		r = pthread_create(&chs[i].thread, NULL,
+				   migrate__receive_thread, &chs[i]);
+		if (r)
+			chs[i].err = -r;
+	}
+
+	r = migrate__receive(&chs[0]);
+
+	for (i = 1; i < nr; i++) {
+		if (!chs[i].err)
+			pthread_join(chs[i].thread, NULL);
+		if (chs[i].err && !r)
+			r = chs[i].err;
+	}
+
+	if (!r && !chs[0].state)
+		r = -EINVAL;
+	if (!r) {
+		r = snapshot__load(kvm, chs[0].state, chs[0].state_len);
+		chs[0].state = NULL;
+	}
+	if (!r)
+		r = snapshot__restore(kvm);
+
+	/* The source stops the guest, or resumes it */
+	if (write_in_full(chs[0].fd, &r, sizeof(r)) < 0 && !r)
+		r = -errno;
+
+	if (!r)
+		pr_info("migrate: received the guest in %.3f ms after setup",
+			(kvm_cpu__now() - start) / 1e6);
+
+out:
+	for (i = 0; i < nr; i++) {
+		if (chs[i].fd >= 0)
+			close(chs[i].fd);
+		free(chs[i].zbuf);
+		free(chs[i].state);
+	}
+
+	return r;
+}
+
+static void migrate__handle_ipc(struct kvm *kvm, int fd, u32 type, u32 len,
+				u8 *msg)
+{
+	struct migrate_params params;
+	s32 r;
+
+	if (len != sizeof(params)) {
+		r = -EINVAL;
+	} else {
+		memcpy(&params, msg, sizeof(params));
+		params.dest[sizeof(params.dest) - 1] = '\0';
+		r = migrate__outgoing(kvm, &params);
+	}
+
+	if (write_in_full(fd, &r, sizeof(r)) < 0)
+		pr_warning("Failed sending migration status");
+
+	if (!r)
+		migrate__finish(kvm);
+}
+
+static int migrate__init(struct kvm *kvm)
+{
+	return kvm_ipc__register_handler(KVM_IPC_MIGRATE, migrate__handle_ipc);
+}
+late_init(migrate__init);
@@ -22,6 +22,7 @@ struct kvm_cpu {
 	u8		is_running;
 	u8		paused;
 	u8		needs_nmi;
+	u8		in_run;	/* In or entering KVM_RUN */
 
 	struct kvm_coalesced_mmio_ring *ring;
 };
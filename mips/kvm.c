@@ -1,7 +1,7 @@
 #include "kvm/8250-serial.h"
 #include "kvm/kvm.h"
 #include "kvm/ioport.h"
-#include "kvm/virtio-console.h"
+#include "kvm/probe.h"
 
 #include <linux/kvm.h>
 
@@ -22,11 +22,6 @@ void kvm__arch_validate_cfg(struct kvm *kvm)
 {
 }
 
-void kvm__arch_read_term(struct kvm *kvm)
-{
-	virtio_console__inject_interrupt(kvm);
-}
-
 void kvm__init_ram(struct kvm *kvm)
 {
 	u64	phys_start, phys_size;
@@ -61,7 +56,7 @@ void kvm__arch_delete_ram(struct kvm *kvm)
 	munmap(kvm->ram_start, kvm->ram_size);
 }
 
-void kvm__arch_set_cmdline(char *cmdline, bool video)
+void kvm__arch_set_cmdline(struct kvm *kvm, char *cmdline, bool video)
 {
 
 }
@@ -78,8 +73,6 @@ void kvm__arch_init(struct kvm *kvm)
 	if (kvm->ram_start == MAP_FAILED)
 		die("out of memory");
 
-	madvise(kvm->ram_start, kvm->ram_size, MADV_MERGEABLE);
-
 	ret = ioctl(kvm->vm_fd, KVM_CREATE_IRQCHIP);
 	if (ret < 0)
 		die_perror("KVM_CREATE_IRQCHIP ioctl");
@@ -90,6 +83,8 @@ void kvm__irq_line(struct kvm *kvm, int irq, int level)
 	struct kvm_irq_level irq_level;
 	int ret;
 
+	kvm__probe(irq_line, irq, level);
+
 	irq_level.irq = irq;
 	irq_level.level = level ? 1 : 0;
 
@@ -103,6 +98,8 @@ void kvm__irq_trigger(struct kvm *kvm, int irq)
 	struct kvm_irq_level irq_level;
 	int ret;
 
+	kvm__probe(irq_trigger, irq);
+
 	irq_level.irq = irq;
 	irq_level.level = 1;
 
@@ -1,7 +1,11 @@
 #include "kvm/kvm.h"
 #include "kvm/kvm-cpu.h"
+#include "kvm/kvm-ipc.h"
 #include "kvm/rbtree-interval.h"
 #include "kvm/mutex.h"
+#include "kvm/probe.h"
+#include "kvm/read-write.h"
+#include "kvm/util.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,36 +15,119 @@
 #include <linux/types.h>
 #include <linux/rbtree.h>
 #include <linux/err.h>
+#include <linux/list.h>
 #include <errno.h>
 
 #define mmio_node(n) rb_entry(n, struct mmio_mapping, node)
 
-static DEFINE_MUTEX(mmio_lock);
-
+#define MMIO_CACHELINE_SIZE	64
+/* Last hits that each vCPU remembers, on each bus */
+#define MMIO_CACHE_SIZE		4
+/* Traps that each vCPU profiles, the others are accounted together */
+#define MMIO_PROFILE_BITS	6
+#define MMIO_PROFILE_SIZE	(1 << MMIO_PROFILE_BITS)
+
+/*
+ * vCPUs look up their trap in a sorted array of the mappings on the bus,
+ * without taking any lock. Writers serialise on the lock of the VM's traps,
+ * update the tree
+ * and publish a new array. The old array, and the mappings removed from the
+ * bus, are freed once every vCPU that might still use them has left
+ * kvm__emulate_mmio() or kvm__emulate_io().
+ *
+ * A vCPU's sequence count is odd while it is looking up or running a handler.
+ * Retired objects record the counts of the vCPUs at the time they were
+ * unpublished, and are reclaimed by a later writer once all the odd ones have
+ * moved on. Writers never wait for the vCPUs: handlers may themselves remove
+ * traps, for example when the guest moves a PCI BAR.
+ *
+ * Devices register hundreds of traps while the VM is set up, before any vCPU
+ * runs. Until then traps only go into the tree, and mmio__publish_all()
+ * builds each array once.
+ */
 struct mmio_mapping {
 	struct rb_int_node	node;
 	mmio_handler_fn		mmio_fn;
 	void			*ptr;
-	u32			refcount;
-	bool			remove;
 };
 
-static struct rb_root mmio_tree = RB_ROOT;
-static struct rb_root pio_tree = RB_ROOT;
+struct mmio_entry {
+	u64			start;
+	u64			end;
+	struct mmio_mapping	*mmio;
+};
+
+/*
+ * The start addresses are searched apart from the entries, so that a lookup
+ * goes through eight of them per cache line.
+ */
+struct mmio_table {
+	u64			gen;
+	unsigned int		nr;
+	struct mmio_entry	*entries;
+	u64			starts[];
+};
+
+struct mmio_bus {
+	unsigned int		id;
+	struct rb_root		tree;
+	struct mmio_table	*table;
+	u64			gen;
+};
+
+/*
+ * The entries of a cache are only valid for the table of the same generation,
+ * which holds a reference to their mappings.
+ */
+struct mmio_cache {
+	u64			gen;
+	unsigned int		nr;
+	unsigned int		next;
+	struct mmio_entry	entries[MMIO_CACHE_SIZE];
+};
+
+struct mmio_reader {
+	u64			seq;
+	struct mmio_cache	caches[KVM_IOTRAP_NR_BUSES];
+	/* Only updated by the vCPU, readers may see a slightly stale snapshot */
+	struct kvm_iotrap_stats	stats;
+	struct kvm_iotrap_profile profile[MMIO_PROFILE_SIZE + 1];
+} __attribute__((aligned(MMIO_CACHELINE_SIZE)));
+
+struct mmio_retired {
+	struct list_head	list;
+	struct mmio_table	*table;
+	struct mmio_mapping	*mmio;
+	u64			seqs[];
+};
+
+/* The traps of a VM, on both of its buses */
+struct kvm_iotraps {
+	struct mutex		lock;
+	bool			batching;
+	struct mmio_bus		mmio;
+	struct mmio_bus		pio;
+	struct mmio_reader	*readers;
+	int			nr_readers;
+	struct list_head	retired;
+};
 
-static struct mmio_mapping *mmio_search(struct rb_root *root, u64 addr, u64 len)
+struct kvm_iotraps *kvm__new_iotraps(void)
 {
-	struct rb_int_node *node;
+	struct kvm_iotraps *traps = calloc(1, sizeof(*traps));
 
-	/* If len is zero or if there's an overflow, the MMIO op is invalid. */
-	if (addr + len <= addr)
+	if (!traps)
 		return NULL;
 
-	node = rb_int_search_range(root, addr, addr + len);
-	if (node == NULL)
-		return NULL;
+	mutex_init(&traps->lock);
+	traps->batching = true;
+	traps->mmio.id = KVM_IOTRAP_BUS_MMIO;
+	traps->mmio.tree = (struct rb_root)RB_ROOT;
+	traps->pio.id = KVM_IOTRAP_BUS_PIO;
+	traps->pio.tree = (struct rb_root)RB_ROOT;
+	INIT_LIST_HEAD(&traps->retired);
 
-	return mmio_node(node);
+	return traps;
 }
 
 /* Find lowest match, Check for overlap */
@@ -73,39 +160,253 @@ static const char *to_direction(u8 is_write)
 	return "read";
 }
 
-static struct mmio_mapping *mmio_get(struct rb_root *root, u64 phys_addr, u32 len)
+static struct mmio_mapping *mmio_table_search(struct mmio_table *table,
+					      u64 addr, u64 len)
 {
+	unsigned int low = 0, high;
+	struct mmio_entry *entry;
+
+	/* If len is zero or if there's an overflow, the MMIO op is invalid. */
+	if (addr + len <= addr)
+		return NULL;
+
+	/* Find the last mapping that starts at or below addr */
+	high = table->nr;
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+
+		if (table->starts[mid] <= addr)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (!low)
+		return NULL;
+
+	entry = &table->entries[low - 1];
+	if (entry->end < addr + len)
+		return NULL;
+
+	return entry->mmio;
+}
+
+static struct mmio_mapping *mmio_cache_search(struct mmio_cache *cache,
+					      struct mmio_table *table,
+					      u64 addr, u64 len)
+{
+	unsigned int i;
+
+	if (cache->gen != table->gen) {
+		cache->gen = table->gen;
+		cache->nr = 0;
+		return NULL;
+	}
+
+	for (i = 0; i < cache->nr; i++) {
+		struct mmio_entry *entry = &cache->entries[i];
+
+		if (entry->start <= addr && addr + len <= entry->end &&
+		    addr < addr + len)
+			return entry->mmio;
+	}
+
+	return NULL;
+}
+
+static void mmio_cache_insert(struct mmio_cache *cache, struct mmio_mapping *mmio)
+{
+	cache->entries[cache->next] = (struct mmio_entry) {
+		.start	= mmio->node.low,
+		.end	= mmio->node.high,
+		.mmio	= mmio,
+	};
+
+	cache->next = (cache->next + 1) % MMIO_CACHE_SIZE;
+	if (cache->nr < MMIO_CACHE_SIZE)
+		cache->nr++;
+}
+
+static struct mmio_mapping *mmio_get(struct kvm_cpu *vcpu, struct mmio_bus *bus,
+				     u64 phys_addr, u32 len)
+{
+	struct kvm_iotraps *traps = vcpu->kvm->iotraps;
+	struct mmio_reader *readers, *reader;
 	struct mmio_mapping *mmio;
+	struct mmio_cache *cache;
+	struct mmio_table *table;
 
-	mutex_lock(&mmio_lock);
-	mmio = mmio_search(root, phys_addr, len);
+	/* Nothing is published before the readers are allocated */
+	readers = __atomic_load_n(&traps->readers, __ATOMIC_ACQUIRE);
+	if (!readers)
+		return NULL;
+
+	reader = &readers[vcpu->cpu_id];
+	__atomic_store_n(&reader->seq, reader->seq + 1, __ATOMIC_RELAXED);
+	/* Pairs with the fence in mmio_publish() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	table = __atomic_load_n(&bus->table, __ATOMIC_ACQUIRE);
+	if (!table)
+		return NULL;
+
+	cache = &reader->caches[bus->id];
+	mmio = mmio_cache_search(cache, table, phys_addr, len);
+	if (mmio) {
+		reader->stats.buses[bus->id].hits++;
+		return mmio;
+	}
+
+	reader->stats.buses[bus->id].misses++;
+	mmio = mmio_table_search(table, phys_addr, len);
 	if (mmio)
-		mmio->refcount++;
-	mutex_unlock(&mmio_lock);
+		mmio_cache_insert(cache, mmio);
 
 	return mmio;
 }
 
-/* Called with mmio_lock held. */
-static void mmio_deregister(struct kvm *kvm, struct rb_root *root, struct mmio_mapping *mmio)
+/* Charge @ns to the trap at @addr, in an open-addressed table of the vCPU */
+static void mmio_profile(struct kvm_cpu *vcpu, struct mmio_bus *bus,
+			 struct mmio_mapping *mmio, u64 ns)
 {
-	struct kvm_coalesced_mmio_zone zone = (struct kvm_coalesced_mmio_zone) {
-		.addr	= rb_int_start(&mmio->node),
-		.size	= 1,
-	};
-	ioctl(kvm->vm_fd, KVM_UNREGISTER_COALESCED_MMIO, &zone);
+	struct kvm_iotraps *traps = vcpu->kvm->iotraps;
+	struct kvm_iotrap_profile *profile = traps->readers[vcpu->cpu_id].profile;
+	u64 addr = mmio->node.low;
+	unsigned int i, slot;
+
+	slot = ((addr >> 2) * 0x9e3779b97f4a7c15ULL) >> (64 - MMIO_PROFILE_BITS);
+	for (i = 0; i < MMIO_PROFILE_SIZE; i++) {
+		struct kvm_iotrap_profile *entry;
+
+		entry = &profile[(slot + i) % MMIO_PROFILE_SIZE];
+		if (!entry->count) {
+			entry->addr = addr;
+			entry->bus = bus->id;
+		} else if (entry->addr != addr || entry->bus != bus->id) {
+			continue;
+		}
 
-	mmio_remove(root, mmio);
-	free(mmio);
+		entry->count++;
+		entry->ns += ns;
+		return;
+	}
+
+	profile[MMIO_PROFILE_SIZE].bus = KVM_IOTRAP_NR_BUSES;
+	profile[MMIO_PROFILE_SIZE].count++;
+	profile[MMIO_PROFILE_SIZE].ns += ns;
+}
+
+static void mmio_put(struct kvm_cpu *vcpu)
+{
+	struct mmio_reader *readers = vcpu->kvm->iotraps->readers;
+
+	/* mmio_get() may have found no readers, and then not counted itself */
+	if (!readers || !(readers[vcpu->cpu_id].seq & 1))
+		return;
+
+	__atomic_store_n(&readers[vcpu->cpu_id].seq,
+			 readers[vcpu->cpu_id].seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Called with the lock of @traps held. */
+static void mmio_reclaim(struct kvm_iotraps *traps)
+{
+	struct mmio_retired *retired, *next;
+	int i;
+
+	list_for_each_entry_safe(retired, next, &traps->retired, list) {
+		for (i = 0; i < traps->nr_readers; i++) {
+			u64 seq = __atomic_load_n(&traps->readers[i].seq,
+						  __ATOMIC_ACQUIRE);
+
+			if ((retired->seqs[i] & 1) && seq == retired->seqs[i])
+				break;
+		}
+
+		if (i < traps->nr_readers)
+			continue;
+
+		list_del(&retired->list);
+		free(retired->table);
+		free(retired->mmio);
+		free(retired);
+	}
+}
+
+/*
+ * Called with the lock of @traps held. Publish the mappings currently in the
+ * tree, and retire the previous table along with @removed.
+ */
+static int mmio_publish(struct kvm_iotraps *traps, struct mmio_bus *bus,
+			struct mmio_mapping *removed)
+{
+	struct mmio_retired *retired;
+	struct mmio_table *table;
+	struct rb_node *node;
+	unsigned int nr = 0;
+	int i;
+
+	for (node = rb_first(&bus->tree); node; node = rb_next(node))
+		nr++;
+
+	table = malloc(sizeof(*table) +
+		       nr * (sizeof(u64) + sizeof(struct mmio_entry)));
+	retired = malloc(sizeof(*retired) + traps->nr_readers * sizeof(u64));
+	if (!table || !retired) {
+		free(table);
+		free(retired);
+		return -ENOMEM;
+	}
+
+	table->gen = ++bus->gen;
+	table->nr = 0;
+	table->entries = (void *)&table->starts[nr];
+	for (node = rb_first(&bus->tree); node; node = rb_next(node)) {
+		struct mmio_mapping *mmio = mmio_node(rb_int(node));
+
+		table->starts[table->nr] = mmio->node.low;
+		table->entries[table->nr++] = (struct mmio_entry) {
+			.start	= mmio->node.low,
+			.end	= mmio->node.high,
+			.mmio	= mmio,
+		};
+	}
+
+	retired->table = bus->table;
+	retired->mmio = removed;
+	__atomic_store_n(&bus->table, table, __ATOMIC_RELEASE);
+
+	/* Pairs with the fence in mmio_get() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (i = 0; i < traps->nr_readers; i++)
+		retired->seqs[i] = __atomic_load_n(&traps->readers[i].seq,
+						   __ATOMIC_ACQUIRE);
+	list_add_tail(&retired->list, &traps->retired);
+
+	mmio_reclaim(traps);
+
+	return 0;
 }
 
-static void mmio_put(struct kvm *kvm, struct rb_root *root, struct mmio_mapping *mmio)
+/* Called with the lock of the traps held. */
+static int mmio_init_readers(struct kvm *kvm)
 {
-	mutex_lock(&mmio_lock);
-	mmio->refcount--;
-	if (mmio->remove && mmio->refcount == 0)
-		mmio_deregister(kvm, root, mmio);
-	mutex_unlock(&mmio_lock);
+	struct kvm_iotraps *traps = kvm->iotraps;
+	struct mmio_reader *readers;
+
+	if (traps->readers)
+		return 0;
+
+	/* The final number of vCPUs, parked ones too, can only be lower */
+	readers = calloc(kvm->cfg.max_cpus, sizeof(*readers));
+	if (!readers)
+		return -ENOMEM;
+
+	traps->nr_readers = kvm->cfg.max_cpus;
+	__atomic_store_n(&traps->readers, readers, __ATOMIC_RELEASE);
+
+	return 0;
 }
 
 static bool trap_is_mmio(unsigned int flags)
@@ -113,12 +414,42 @@ static bool trap_is_mmio(unsigned int flags)
 	return (flags & IOTRAP_BUS_MASK) == DEVICE_BUS_MMIO;
 }
 
+int kvm__coalesce_iotrap(struct kvm *kvm, u64 phys_addr, u64 len,
+			 unsigned int flags, bool coalesce)
+{
+	struct kvm_coalesced_mmio_zone zone = {
+		.addr	= phys_addr,
+		.size	= len,
+		.pio	= !trap_is_mmio(flags),
+	};
+	int r;
+
+	if (zone.pio && !kvm__supports_extension(kvm, KVM_CAP_COALESCED_PIO))
+		return -EOPNOTSUPP;
+
+	r = ioctl(kvm->vm_fd, coalesce ? KVM_REGISTER_COALESCED_MMIO :
+					 KVM_UNREGISTER_COALESCED_MMIO, &zone);
+	if (r < 0)
+		return -errno;
+
+	return 0;
+}
+
+static struct mmio_bus *trap_bus(struct kvm_iotraps *traps, unsigned int flags)
+{
+	if (trap_is_mmio(flags))
+		return &traps->mmio;
+
+	return &traps->pio;
+}
+
 int kvm__register_iotrap(struct kvm *kvm, u64 phys_addr, u64 phys_addr_len,
 			 mmio_handler_fn mmio_fn, void *ptr,
 			 unsigned int flags)
 {
+	struct kvm_iotraps *traps = kvm->iotraps;
+	struct mmio_bus *bus = trap_bus(traps, flags);
 	struct mmio_mapping *mmio;
-	struct kvm_coalesced_mmio_zone zone;
 	int ret;
 
 	mmio = malloc(sizeof(*mmio));
@@ -129,68 +460,73 @@ int kvm__register_iotrap(struct kvm *kvm, u64 phys_addr, u64 phys_addr_len,
 		.node		= RB_INT_INIT(phys_addr, phys_addr + phys_addr_len),
 		.mmio_fn	= mmio_fn,
 		.ptr		= ptr,
-		/*
-		 * Start from 0 because kvm__deregister_mmio() doesn't decrement
-		 * the reference count.
-		 */
-		.refcount	= 0,
-		.remove		= false,
 	};
 
-	if (trap_is_mmio(flags) && (flags & IOTRAP_COALESCE)) {
-		zone = (struct kvm_coalesced_mmio_zone) {
-			.addr	= phys_addr,
-			.size	= phys_addr_len,
-		};
-		ret = ioctl(kvm->vm_fd, KVM_REGISTER_COALESCED_MMIO, &zone);
-		if (ret < 0) {
+	/* Coalescing is only an optimisation for port I/O, which may lack it */
+	if (flags & IOTRAP_COALESCE) {
+		ret = kvm__coalesce_iotrap(kvm, phys_addr, phys_addr_len, flags,
+					   true);
+		if (ret < 0 && (trap_is_mmio(flags) || ret != -EOPNOTSUPP)) {
 			free(mmio);
-			return -errno;
+			return ret;
 		}
 	}
 
-	mutex_lock(&mmio_lock);
-	if (trap_is_mmio(flags))
-		ret = mmio_insert(&mmio_tree, mmio);
-	else
-		ret = mmio_insert(&pio_tree, mmio);
-	mutex_unlock(&mmio_lock);
+	mutex_lock(&traps->lock);
+	ret = mmio_init_readers(kvm);
+	if (ret)
+		goto err_free;
+
+	ret = mmio_insert(&bus->tree, mmio);
+	if (ret)
+		goto err_free;
 
+	ret = traps->batching ? 0 : mmio_publish(traps, bus, NULL);
+	if (ret) {
+		mmio_remove(&bus->tree, mmio);
+		goto err_free;
+	}
+	mutex_unlock(&traps->lock);
+
+	return 0;
+
+err_free:
+	mutex_unlock(&traps->lock);
+	free(mmio);
 	return ret;
 }
 
 bool kvm__deregister_iotrap(struct kvm *kvm, u64 phys_addr, unsigned int flags)
 {
+	struct kvm_iotraps *traps = kvm->iotraps;
+	struct mmio_bus *bus = trap_bus(traps, flags);
 	struct mmio_mapping *mmio;
-	struct rb_root *tree;
 
-	if (trap_is_mmio(flags))
-		tree = &mmio_tree;
-	else
-		tree = &pio_tree;
-
-	mutex_lock(&mmio_lock);
-	mmio = mmio_search_single(tree, phys_addr);
+	mutex_lock(&traps->lock);
+	mmio = mmio_search_single(&bus->tree, phys_addr);
 	if (mmio == NULL) {
-		mutex_unlock(&mmio_lock);
+		mutex_unlock(&traps->lock);
 		return false;
 	}
+
+	/* Drops any zone that covers the start of the trap */
+	kvm__coalesce_iotrap(kvm, rb_int_start(&mmio->node), 1, flags, false);
+
 	/*
 	 * The PCI emulation code calls this function when memory access is
 	 * disabled for a device, or when a BAR has a new address assigned. PCI
-	 * emulation doesn't use any locks and as a result we can end up in a
-	 * situation where we have called mmio_get() to do emulation on one VCPU
-	 * thread (let's call it VCPU0), and several other VCPU threads have
-	 * called kvm__deregister_mmio(). In this case, if we decrement refcount
-	 * kvm__deregister_mmio() (either directly, or by calling mmio_put()),
-	 * refcount will reach 0 and we will free the mmio node before VCPU0 has
-	 * called mmio_put(). This will trigger use-after-free errors on VCPU0.
+	 * emulation doesn't use any locks and as a result, other VCPU threads
+	 * may still be running the handler of the mapping, or even this one if
+	 * the handler is what removes it. The mapping is only freed once they
+	 * are all done.
 	 */
-	if (mmio->refcount == 0)
-		mmio_deregister(kvm, tree, mmio);
-	else
-		mmio->remove = true;
-	mutex_unlock(&mmio_lock);
+	mmio_remove(&bus->tree, mmio);
+	if (traps->batching)
+		free(mmio);
+	else if (mmio_publish(traps, bus, mmio) < 0)
+		die("Unable to remove I/O trap at 0x%llx",
+		    (unsigned long long)phys_addr);
+	mutex_unlock(&traps->lock);
 
 	return true;
 }
@@ -198,9 +534,11 @@ bool kvm__deregister_iotrap(struct kvm *kvm, u64 phys_addr, unsigned int flags)
 bool kvm__emulate_mmio(struct kvm_cpu *vcpu, u64 phys_addr, u8 *data,
 		       u32 len, u8 is_write)
 {
+	struct kvm_iotraps *traps = vcpu->kvm->iotraps;
 	struct mmio_mapping *mmio;
+	u64 start, ns;
 
-	mmio = mmio_get(&mmio_tree, phys_addr, len);
+	mmio = mmio_get(vcpu, &traps->mmio, phys_addr, len);
 	if (!mmio) {
 		if (vcpu->kvm->cfg.mmio_debug)
 			fprintf(stderr,	"MMIO warning: Ignoring MMIO %s at %016llx (length %u)\n",
@@ -209,21 +547,29 @@ bool kvm__emulate_mmio(struct kvm_cpu *vcpu, u64 phys_addr, u8 *data,
 		goto out;
 	}
 
+	start = kvm_cpu__now();
 	mmio->mmio_fn(vcpu, phys_addr, data, len, is_write, mmio->ptr);
-	mmio_put(vcpu->kvm, &mmio_tree, mmio);
+	ns = kvm_cpu__now() - start;
+	mmio_profile(vcpu, &traps->mmio, mmio, ns);
+	kvm__probe(mmio, vcpu->cpu_id, phys_addr, len, is_write, ns);
 
 out:
+	mmio_put(vcpu);
 	return true;
 }
 
 bool kvm__emulate_io(struct kvm_cpu *vcpu, u16 port, void *data,
 		     int direction, int size, u32 count)
 {
+	struct kvm_iotraps *traps = vcpu->kvm->iotraps;
 	struct mmio_mapping *mmio;
 	bool is_write = direction == KVM_EXIT_IO_OUT;
+	u64 start, ns;
+	u32 i;
 
-	mmio = mmio_get(&pio_tree, port, size);
+	mmio = mmio_get(vcpu, &traps->pio, port, size);
 	if (!mmio) {
+		mmio_put(vcpu);
 		if (vcpu->kvm->cfg.ioport_debug) {
 			fprintf(stderr, "IO error: %s port=%x, size=%d, count=%u\n",
 				to_direction(direction), port, size, count);
@@ -233,13 +579,146 @@ bool kvm__emulate_io(struct kvm_cpu *vcpu, u16 port, void *data,
 		return true;
 	}
 
-	while (count--) {
+	start = kvm_cpu__now();
+	for (i = 0; i < count; i++) {
 		mmio->mmio_fn(vcpu, port, data, size, is_write, mmio->ptr);
 
 		data += size;
 	}
 
-	mmio_put(vcpu->kvm, &pio_tree, mmio);
+	ns = kvm_cpu__now() - start;
+	mmio_profile(vcpu, &traps->pio, mmio, ns);
+	kvm__probe(pio, vcpu->cpu_id, port, size, is_write, count, ns);
+	mmio_put(vcpu);
 
 	return true;
 }
+
+/* Sum up the profiles of all vCPUs, returning the number of traps */
+int kvm__get_iotrap_profile(struct kvm *kvm, struct kvm_iotrap_profile **profile)
+{
+	struct kvm_iotraps *traps = kvm->iotraps;
+	int i, j, k, nr = 0, nr_readers;
+	struct kvm_iotrap_profile *sum;
+
+	mutex_lock(&traps->lock);
+	nr_readers = min(kvm->nrcpus, traps->nr_readers);
+	sum = calloc(nr_readers * (MMIO_PROFILE_SIZE + 1) + 1, sizeof(*sum));
+	if (!sum) {
+		mutex_unlock(&traps->lock);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr_readers; i++) {
+		for (j = 0; j <= MMIO_PROFILE_SIZE; j++) {
+			struct kvm_iotrap_profile entry = traps->readers[i].profile[j];
+
+			if (!entry.count)
+				continue;
+
+			for (k = 0; k < nr; k++)
+				if (sum[k].addr == entry.addr &&
+				    sum[k].bus == entry.bus)
+					break;
+
+			if (k == nr)
+				sum[nr++] = (struct kvm_iotrap_profile) {
+					.addr	= entry.addr,
+					.bus	= entry.bus,
+				};
+
+			sum[k].count += entry.count;
+			sum[k].ns += entry.ns;
+		}
+	}
+	mutex_unlock(&traps->lock);
+
+	*profile = sum;
+	return nr;
+}
+
+static void mmio__handle_stats(struct kvm *kvm, int fd, u32 type, u32 len,
+			       u8 *msg)
+{
+	struct kvm_iotraps *traps = kvm->iotraps;
+	struct kvm_iotrap_stats *reply;
+	u32 nr;
+	int i;
+
+	if (WARN_ON(type != KVM_IPC_IOTRAP_STATS || len))
+		return;
+
+	nr = kvm->nrcpus;
+	reply = calloc(nr, sizeof(*reply));
+	if (!reply)
+		return;
+
+	mutex_lock(&traps->lock);
+	for (i = 0; i < min((int)nr, traps->nr_readers); i++)
+		reply[i] = traps->readers[i].stats;
+	mutex_unlock(&traps->lock);
+
+	if (write_in_full(fd, &nr, sizeof(nr)) < 0 ||
+	    write_in_full(fd, reply, nr * sizeof(*reply)) < 0)
+		pr_warning("Failed sending I/O trap stats");
+
+	free(reply);
+}
+
+static int mmio__init(struct kvm *kvm)
+{
+	return kvm_ipc__register_handler(KVM_IPC_IOTRAP_STATS,
+					 mmio__handle_stats);
+}
+dev_base_init(mmio__init);
+
+/* Before the vCPUs start, after the devices registered their traps */
+static int mmio__publish_all(struct kvm *kvm)
+{
+	struct kvm_iotraps *traps = kvm->iotraps;
+	int r;
+
+	mutex_lock(&traps->lock);
+	traps->batching = false;
+	r = mmio_init_readers(kvm);
+	if (!r)
+		r = mmio_publish(traps, &traps->mmio, NULL);
+	if (!r)
+		r = mmio_publish(traps, &traps->pio, NULL);
+	mutex_unlock(&traps->lock);
+
+	return r;
+}
+late_init(mmio__publish_all);
+
+static void mmio_free_bus(struct mmio_bus *bus)
+{
+	struct rb_node *node;
+
+	while ((node = rb_first(&bus->tree))) {
+		struct mmio_mapping *mmio = mmio_node(rb_int(node));
+
+		mmio_remove(&bus->tree, mmio);
+		free(mmio);
+	}
+	free(bus->table);
+}
+
+/* Once no vCPU runs, so that everything retired can go */
+void kvm__free_iotraps(struct kvm_iotraps *traps)
+{
+	struct mmio_retired *retired, *next;
+
+	if (!traps)
+		return;
+
+	list_for_each_entry_safe(retired, next, &traps->retired, list) {
+		free(retired->table);
+		free(retired->mmio);
+		free(retired);
+	}
+	mmio_free_bus(&traps->mmio);
+	mmio_free_bus(&traps->pio);
+	free(traps->readers);
+	free(traps);
+}
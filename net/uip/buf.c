@@ -1,88 +1,231 @@
 #include "kvm/uip.h"
 
+#include <linux/virtio_net.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
 
-struct uip_buf *uip_buf_get_used(struct uip_info *info)
+/*
+ * Frames for the guest are built by the virtio TX thread and by the uip
+ * worker, and only consumed by the RX thread. Each builder has its own
+ * pool, so every ring has a single producer and a single consumer and
+ * buffers change hands without taking a lock. The waiter locks are only
+ * used to sleep on an empty ring.
+ */
+
+static void uip_buf_ring_push(struct uip_buf_ring *ring, struct uip_buf *buf)
+{
+	u32 head = ring->head;
+
+	/* A ring holds all buffers of its pool, so it never overflows */
+	ring->bufs[head & ring->mask] = buf;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static struct uip_buf *uip_buf_ring_pop(struct uip_buf_ring *ring)
 {
+	u32 tail = ring->tail;
 	struct uip_buf *buf;
-	bool found = false;
-
-	mutex_lock(&info->buf_lock);
-
-	while (!(info->buf_used_nr > 0))
-		pthread_cond_wait(&info->buf_used_cond, &info->buf_lock.mutex);
-
-	list_for_each_entry(buf, &info->buf_head, list) {
-		if (buf->status == UIP_BUF_STATUS_USED) {
-			/*
-			 * Set status to INUSE immediately to prevent
-			 * someone from using this buf until we free it
-			 */
-			buf->status = UIP_BUF_STATUS_INUSE;
-			info->buf_used_nr--;
-			found = true;
-			break;
-		}
-	}
 
-	mutex_unlock(&info->buf_lock);
+	if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+		return NULL;
 
-	return found ? buf : NULL;
+	buf = ring->bufs[tail & ring->mask];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return buf;
 }
 
-struct uip_buf *uip_buf_get_free(struct uip_info *info)
+static struct uip_buf *uip_buf_rings_pop(struct uip_buf_ring **rings, int nr)
 {
 	struct uip_buf *buf;
-	bool found = false;
-
-	mutex_lock(&info->buf_lock);
-
-	while (!(info->buf_free_nr > 0))
-		pthread_cond_wait(&info->buf_free_cond, &info->buf_lock.mutex);
-
-	list_for_each_entry(buf, &info->buf_head, list) {
-		if (buf->status == UIP_BUF_STATUS_FREE) {
-			/*
-			 * Set status to INUSE immediately to prevent
-			 * someone from using this buf until we free it
-			 */
-			buf->status = UIP_BUF_STATUS_INUSE;
-			info->buf_free_nr--;
-			found = true;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		buf = uip_buf_ring_pop(rings[i]);
+		if (buf)
+			return buf;
+	}
+
+	return NULL;
+}
+
+static struct uip_buf *uip_buf_wait(struct uip_buf_waiter *waiter,
+				    struct uip_buf_ring **rings, int nr)
+{
+	struct uip_buf *buf;
+
+	buf = uip_buf_rings_pop(rings, nr);
+	if (buf)
+		return buf;
+
+	mutex_lock(&waiter->lock);
+	for (;;) {
+		/* Pairs with the barrier in uip_buf_wake() */
+		__atomic_store_n(&waiter->sleeping, true, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		buf = uip_buf_rings_pop(rings, nr);
+		if (buf)
 			break;
-		}
+
+		pthread_cond_wait(&waiter->cond, &waiter->lock.mutex);
 	}
+	__atomic_store_n(&waiter->sleeping, false, __ATOMIC_RELAXED);
+	mutex_unlock(&waiter->lock);
+
+	return buf;
+}
 
-	mutex_unlock(&info->buf_lock);
+static void uip_buf_wake(struct uip_buf_waiter *waiter)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&waiter->sleeping, __ATOMIC_RELAXED))
+		return;
 
-	return found ? buf : NULL;
+	mutex_lock(&waiter->lock);
+	pthread_cond_signal(&waiter->cond);
+	mutex_unlock(&waiter->lock);
 }
 
-struct uip_buf *uip_buf_set_used(struct uip_info *info, struct uip_buf *buf)
+/* The pool of the calling thread */
+static struct uip_buf_pool *uip_buf_pool_self(struct uip_info *info)
+{
+	if (pthread_equal(pthread_self(), info->epoll.thread))
+		return &info->buf_pools[UIP_BUF_POOL_SOCKET];
+
+	return &info->buf_pools[UIP_BUF_POOL_TX];
+}
+
+struct uip_buf *uip_buf_get_used(struct uip_info *info)
 {
-	mutex_lock(&info->buf_lock);
+	struct uip_buf_ring *rings[UIP_BUF_POOL_NR];
+	int i;
 
-	buf->status = UIP_BUF_STATUS_USED;
-	info->buf_used_nr++;
-	pthread_cond_signal(&info->buf_used_cond);
+	for (i = 0; i < UIP_BUF_POOL_NR; i++)
+		rings[i] = &info->buf_pools[i].used;
 
-	mutex_unlock(&info->buf_lock);
+	return uip_buf_wait(&info->buf_used_waiter, rings, UIP_BUF_POOL_NR);
+}
+
+struct uip_buf *uip_buf_get_free(struct uip_info *info)
+{
+	struct uip_buf_pool *pool = uip_buf_pool_self(info);
+	struct uip_buf_ring *ring = &pool->free;
+
+	return uip_buf_wait(&pool->waiter, &ring, 1);
+}
+
+struct uip_buf *uip_buf_set_used(struct uip_info *info, struct uip_buf *buf)
+{
+	uip_buf_ring_push(&buf->pool->used, buf);
+	uip_buf_wake(&info->buf_used_waiter);
 
 	return buf;
 }
 
 struct uip_buf *uip_buf_set_free(struct uip_info *info, struct uip_buf *buf)
 {
-	mutex_lock(&info->buf_lock);
+	uip_buf_ring_push(&buf->pool->free, buf);
+	uip_buf_wake(&buf->pool->waiter);
+
+	return buf;
+}
+
+static void uip_buf_waiter_init(struct uip_buf_waiter *waiter)
+{
+	mutex_init(&waiter->lock);
+	pthread_cond_init(&waiter->cond, NULL);
+	waiter->sleeping = false;
+}
 
-	buf->status = UIP_BUF_STATUS_FREE;
-	info->buf_free_nr++;
-	pthread_cond_signal(&info->buf_free_cond);
+static int uip_buf_ring_init(struct uip_buf_ring *ring, u32 nr)
+{
+	ring->bufs = calloc(nr, sizeof(*ring->bufs));
+	if (!ring->bufs)
+		return -ENOMEM;
 
-	mutex_unlock(&info->buf_lock);
+	ring->mask = nr - 1;
+	ring->head = ring->tail = 0;
 
-	return buf;
+	return 0;
+}
+
+static int uip_buf_pool_init(struct uip_info *info, struct uip_buf_pool *pool)
+{
+	struct uip_buf *buf;
+	u32 i;
+
+	pool->nr = info->buf_nr;
+	pool->bufs = calloc(pool->nr, sizeof(*pool->bufs));
+	if (!pool->bufs)
+		return -ENOMEM;
+
+	if (uip_buf_ring_init(&pool->free, pool->nr) ||
+	    uip_buf_ring_init(&pool->used, pool->nr))
+		return -ENOMEM;
+
+	uip_buf_waiter_init(&pool->waiter);
+
+	for (i = 0; i < pool->nr; i++) {
+		buf = &pool->bufs[i];
+
+		buf->info	= info;
+		buf->pool	= pool;
+		buf->vnet_len	= info->vnet_hdr_len;
+		buf->vnet	= calloc(1, buf->vnet_len);
+		buf->eth_len	= 1024*64 + sizeof(struct uip_pseudo_hdr);
+		/* Only touched as far as frames go */
+		buf->eth	= malloc(buf->eth_len);
+		if (!buf->vnet || !buf->eth)
+			return -ENOMEM;
+
+		uip_buf_ring_push(&pool->free, buf);
+	}
+
+	return 0;
+}
+
+static void uip_buf_pool_exit(struct uip_buf_pool *pool)
+{
+	u32 i;
+
+	for (i = 0; pool->bufs && i < pool->nr; i++) {
+		free(pool->bufs[i].vnet);
+		free(pool->bufs[i].eth);
+	}
+
+	free(pool->bufs);
+	free(pool->free.bufs);
+	free(pool->used.bufs);
+	memset(pool, 0, sizeof(*pool));
+}
+
+int uip_buf_init(struct uip_info *info)
+{
+	int i, r;
+
+	if (!is_power_of_two(info->buf_nr))
+		return -EINVAL;
+
+	uip_buf_waiter_init(&info->buf_used_waiter);
+
+	for (i = 0; i < UIP_BUF_POOL_NR; i++) {
+		r = uip_buf_pool_init(info, &info->buf_pools[i]);
+		if (r < 0) {
+			uip_buf_exit(info);
+			return r;
+		}
+	}
+
+	return 0;
+}
+
+void uip_buf_exit(struct uip_info *info)
+{
+	int i;
+
+	for (i = 0; i < UIP_BUF_POOL_NR; i++)
+		uip_buf_pool_exit(&info->buf_pools[i]);
 }
 
 struct uip_buf *uip_buf_clone(struct uip_tx_arg *arg)
@@ -112,3 +255,28 @@ struct uip_buf *uip_buf_clone(struct uip_tx_arg *arg)
 
 	return buf;
 }
+
+/*
+ * Let the guest complete the transport checksum of @buf, which starts at
+ * @csum_start in the frame and lives @csum_offset bytes into the transport
+ * header. The checksum field must hold the pseudo header sum.
+ */
+void uip_buf_set_csum_partial(struct uip_buf *buf, u16 csum_start,
+			      u16 csum_offset)
+{
+	struct virtio_net_hdr *vnet = (struct virtio_net_hdr *)buf->vnet;
+
+	vnet->flags		= VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	vnet->csum_start	= csum_start;
+	vnet->csum_offset	= csum_offset;
+}
+
+/* Hand the guest a TCP frame larger than its MSS, as if GRO had merged it */
+void uip_buf_set_gso_tcp(struct uip_buf *buf, u16 hdr_len, u16 mss)
+{
+	struct virtio_net_hdr *vnet = (struct virtio_net_hdr *)buf->vnet;
+
+	vnet->gso_type		= VIRTIO_NET_HDR_GSO_TCPV4;
+	vnet->gso_size		= mss;
+	vnet->hdr_len		= hdr_len;
+}
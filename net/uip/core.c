@@ -1,12 +1,14 @@
 #include "kvm/mutex.h"
 #include "kvm/uip.h"
+#include "kvm/virtio-net.h"
 
 #include <linux/virtio_net.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <kvm/iovec.h>
 
-int uip_tx(struct iovec *iov, u16 out, struct uip_info *info)
+static int __uip_tx(struct iovec *iov, u16 out, struct uip_info *info,
+		    struct uip_tx_batch *batch)
 {
 	void *vnet;
 	ssize_t len;
@@ -16,6 +18,7 @@ int uip_tx(struct iovec *iov, u16 out, struct uip_info *info)
 	void *vnet_buf = NULL;
 	void *eth_buf = NULL;
 	size_t iovcount = out;
+	struct iovec_cursor cur;
 
 	u16 proto;
 
@@ -47,18 +50,16 @@ int uip_tx(struct iovec *iov, u16 out, struct uip_info *info)
 		if (!vnet)
 			return -ENOMEM;
 
-		len = memcpy_fromiovec_safe(vnet_buf, &iov, len, &iovcount);
-		if (len)
+		iovec_cursor__init(&cur, iov, iovcount);
+		if (iovec_cursor__from(&cur, vnet_buf, vnet_len) != vnet_len)
 			goto out_free_buf;
 
-		len = eth_len = iov_size(iov, iovcount);
+		len = eth_len = iov_size(iov, iovcount) - vnet_len;
 		eth = eth_buf = malloc(len);
 		if (!eth)
 			goto out_free_buf;
 
-		len = memcpy_fromiovec_safe(eth_buf, &iov, len, &iovcount);
-		if (len)
-			goto out_free_buf;
+		iovec_cursor__from(&cur, eth_buf, len);
 	}
 
 	memset(&arg, 0, sizeof(arg));
@@ -68,6 +69,7 @@ int uip_tx(struct iovec *iov, u16 out, struct uip_info *info)
 	arg.info = info;
 	arg.vnet = vnet;
 	arg.eth = eth;
+	arg.batch = batch;
 
 	/*
 	 * Check package type
@@ -94,6 +96,29 @@ out_free_buf:
 	return -EINVAL;
 }
 
+int uip_tx(struct iovec *iov, u16 out, struct uip_info *info)
+{
+	return __uip_tx(iov, out, info, NULL);
+}
+
+/*
+ * The frames of a batch update the TCP sockets they belong to only once it
+ * ends, so that a window of ACKs from the guest, or a stream of its data, take
+ * the socket lock and get acknowledged once instead of for every frame.
+ */
+int uip_tx_batch(struct net_tx_io *io, u16 nr, struct uip_info *info)
+{
+	struct uip_tx_batch batch = {};
+	u16 i;
+
+	for (i = 0; i < nr; i++)
+		io[i].res = __uip_tx(io[i].iov, io[i].iovcnt, info, &batch);
+
+	uip_tcp_batch_flush(&batch);
+
+	return 0;
+}
+
 int uip_rx(struct iovec *iov, u16 in, struct uip_info *info)
 {
 	struct uip_buf *buf;
@@ -115,78 +140,60 @@ int uip_rx(struct iovec *iov, u16 in, struct uip_info *info)
 
 void uip_static_init(struct uip_info *info)
 {
-	struct list_head *udp_socket_head;
-	struct list_head *tcp_socket_head;
-	struct list_head *buf_head;
-
-	udp_socket_head	= &info->udp_socket_head;
-	tcp_socket_head	= &info->tcp_socket_head;
-	buf_head	= &info->buf_head;
-
-	INIT_LIST_HEAD(udp_socket_head);
-	INIT_LIST_HEAD(tcp_socket_head);
-	INIT_LIST_HEAD(buf_head);
+	uip_flow_table_static_init(&info->udp_flows);
+	uip_flow_table_static_init(&info->tcp_flows);
 
-	mutex_init(&info->udp_socket_lock);
 	mutex_init(&info->tcp_socket_lock);
-	mutex_init(&info->buf_lock);
+}
 
-	pthread_cond_init(&info->buf_used_cond, NULL);
-	pthread_cond_init(&info->buf_free_cond, NULL);
+static void uip_epoll_handle_event(struct kvm *kvm, struct epoll_event *ev)
+{
+	struct uip_epoll_entry *entry = ev->data.ptr;
 
-	info->buf_used_nr = 0;
+	entry->handle(entry);
 }
 
 int uip_init(struct uip_info *info)
 {
-	struct list_head *buf_head;
-	struct uip_buf *buf;
-	int buf_nr;
-	int i;
-
-	buf_head	= &info->buf_head;
-	buf_nr		= info->buf_nr;
-
-	for (i = 0; i < buf_nr; i++) {
-		buf = malloc(sizeof(*buf));
-		memset(buf, 0, sizeof(*buf));
-
-		buf->status	= UIP_BUF_STATUS_FREE;
-		buf->info	= info;
-		buf->id		= i;
-		list_add_tail(&buf->list, buf_head);
-	}
+	int ret;
 
-	list_for_each_entry(buf, buf_head, list) {
-		buf->vnet_len   = info->vnet_hdr_len;
-		buf->vnet	= malloc(buf->vnet_len);
-		buf->eth_len    = 1024*64 + sizeof(struct uip_pseudo_hdr);
-		buf->eth	= malloc(buf->eth_len);
+	ret = uip_buf_init(info);
+	if (ret < 0)
+		return ret;
 
-		memset(buf->vnet, 0, buf->vnet_len);
-		memset(buf->eth, 0, buf->eth_len);
-	}
+	uip_dhcp_get_dns(info);
 
-	info->buf_free_nr = buf_nr;
+	info->udp_buf = malloc(UIP_MAX_UDP_PAYLOAD);
+	if (!info->udp_buf)
+		return -ENOMEM;
 
-	uip_dhcp_get_dns(info);
+	if (uip_flow_table_init(&info->udp_flows) < 0 ||
+	    uip_flow_table_init(&info->tcp_flows) < 0)
+		return -ENOMEM;
 
-	return 0;
+	/* A single thread serves all sockets, rather than one per connection */
+	return epoll__init(NULL, &info->epoll, "uip", uip_epoll_handle_event);
 }
 
 void uip_exit(struct uip_info *info)
 {
-	struct uip_buf *buf, *next;
+	/*
+	 * The worker may be waiting for the guest to free a buffer, which
+	 * won't happen anymore, so cancel it rather than asking it to stop.
+	 */
+	pthread_cancel(info->epoll.thread);
+	pthread_join(info->epoll.thread, NULL);
+	close(info->epoll.stop_fd);
+	close(info->epoll.fd);
+	free(info->udp_buf);
+	info->udp_buf = NULL;
 
 	uip_udp_exit(info);
 	uip_tcp_exit(info);
 	uip_dhcp_exit(info);
+	uip_flow_table_exit(&info->udp_flows);
+	uip_flow_table_exit(&info->tcp_flows);
 
-	list_for_each_entry_safe(buf, next, &info->buf_head, list) {
-		free(buf->vnet);
-		free(buf->eth);
-		list_del(&buf->list);
-		free(buf);
-	}
+	uip_buf_exit(info);
 	uip_static_init(info);
 }
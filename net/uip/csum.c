@@ -1,24 +1,84 @@
 #include "kvm/uip.h"
 
+#include <string.h>
+
+/*
+ * One's complement sum, 64 bits at a time. The end-around carry makes the
+ * sum independent of the word size, so folding the 64-bit accumulator down
+ * gives the same result as adding 16-bit words, in either byte order.
+ */
 static u16 uip_csum(u16 csum, u8 *addr, u16 count)
 {
-	long sum = csum;
+	u64 sum = csum;
+	u64 w64;
+	u32 w32;
+	u16 w16;
+
+	for (; count >= 32; addr += 32, count -= 32) {
+		u64 w[4];
+
+		memcpy(w, addr, sizeof(w));
+		sum += w[0];
+		sum += (sum < w[0]);
+		sum += w[1];
+		sum += (sum < w[1]);
+		sum += w[2];
+		sum += (sum < w[2]);
+		sum += w[3];
+		sum += (sum < w[3]);
+	}
+
+	for (; count >= 8; addr += 8, count -= 8) {
+		memcpy(&w64, addr, sizeof(w64));
+		sum += w64;
+		sum += (sum < w64);
+	}
 
-	while (count > 1) {
-		sum	+= *(u16 *)addr;
-		addr	+= 2;
-		count	-= 2;
+	if (count >= 4) {
+		memcpy(&w32, addr, sizeof(w32));
+		sum += w32;
+		sum += (sum < w32);
+		addr += 4;
+		count -= 4;
 	}
 
-	if (count > 0)
-		sum += *(unsigned char *)addr;
+	if (count >= 2) {
+		memcpy(&w16, addr, sizeof(w16));
+		sum += w16;
+		sum += (sum < w16);
+		addr += 2;
+		count -= 2;
+	}
+
+	if (count > 0) {
+		/* Pad the last byte with zero, as the first byte of a word */
+		w16 = 0;
+		memcpy(&w16, addr, 1);
+		sum += w16;
+		sum += (sum < w16);
+	}
 
-	while (sum>>16)
-		sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
 
 	return ~sum;
 }
 
+/* Sum of the pseudo header, which the guest then completes */
+static u16 uip_csum_pseudo(struct uip_ip *ip, u16 len)
+{
+	struct uip_pseudo_hdr hdr = {
+		.sip	= ip->sip,
+		.dip	= ip->dip,
+		.proto	= ip->proto,
+		.len	= htons(len),
+	};
+
+	return ~uip_csum(0, (u8 *)&hdr, sizeof(hdr));
+}
+
 u16 uip_csum_ip(struct uip_ip *ip)
 {
 	return uip_csum(0, &ip->vhl, uip_ip_hdrlen(ip));
@@ -88,3 +148,13 @@ u16 uip_csum_tcp(struct uip_tcp *tcp)
 		return uip_csum(0, tcp_hdr, tcp_len + sizeof(hdr));
 	}
 }
+
+u16 uip_csum_udp_pseudo(struct uip_udp *udp)
+{
+	return uip_csum_pseudo(&udp->ip, uip_udp_len(udp));
+}
+
+u16 uip_csum_tcp_pseudo(struct uip_tcp *tcp)
+{
+	return uip_csum_pseudo(&tcp->ip, uip_tcp_len(tcp));
+}
@@ -0,0 +1,250 @@
+#include "kvm/uip.h"
+#include "kvm/rwsem.h"
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <sys/random.h>
+#include <time.h>
+
+#define UIP_FLOW_MIN_BUCKETS	64
+#define UIP_FLOW_MAX_BUCKETS	(1U << 20)
+/* Flows per bucket, on average, before the table doubles */
+#define UIP_FLOW_MAX_LOAD	2
+
+static u32 uip_flow_mix(u32 h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+/* Seeded, so that the guest can't pick ports that all land in one bucket */
+static u32 uip_flow_hash(struct uip_flow_table *table, u32 sip, u32 dip,
+			 u16 sport, u16 dport)
+{
+	u32 h = table->seed;
+
+	h = uip_flow_mix(h ^ sip);
+	h = uip_flow_mix(h ^ dip);
+	h = uip_flow_mix(h ^ ((u32)sport << 16 | dport));
+
+	return h;
+}
+
+static struct uip_flow_bucket *uip_flow_bucket(struct uip_flow_table *table,
+					       u32 hash)
+{
+	return &table->buckets[hash & (table->nr_buckets - 1)];
+}
+
+static struct uip_flow_bucket *uip_flow_alloc_buckets(u32 nr)
+{
+	struct uip_flow_bucket *buckets;
+	u32 i;
+
+	buckets = calloc(nr, sizeof(*buckets));
+	if (!buckets)
+		return NULL;
+
+	for (i = 0; i < nr; i++) {
+		mutex_init(&buckets[i].lock);
+		INIT_HLIST_HEAD(&buckets[i].head);
+	}
+
+	return buckets;
+}
+
+void uip_flow_table_static_init(struct uip_flow_table *table)
+{
+	*table = (struct uip_flow_table) {};
+	pthread_rwlock_init(&table->resize_lock, NULL);
+}
+
+int uip_flow_table_init(struct uip_flow_table *table)
+{
+	table->buckets = uip_flow_alloc_buckets(UIP_FLOW_MIN_BUCKETS);
+	if (!table->buckets)
+		return -ENOMEM;
+
+	table->nr_buckets = UIP_FLOW_MIN_BUCKETS;
+	if (getrandom(&table->seed, sizeof(table->seed), GRND_NONBLOCK) !=
+	    sizeof(table->seed))
+		table->seed = time(NULL) ^ (u32)(unsigned long)table;
+
+	return 0;
+}
+
+/* The flows must have been taken out already */
+void uip_flow_table_exit(struct uip_flow_table *table)
+{
+	free(table->buckets);
+	table->buckets = NULL;
+	table->nr_buckets = 0;
+}
+
+struct uip_flow *uip_flow_find(struct uip_flow_table *table, u32 sip, u32 dip,
+			       u16 sport, u16 dport)
+{
+	u32 hash = uip_flow_hash(table, sip, dip, sport, dport);
+	struct uip_flow_bucket *bucket;
+	struct uip_flow *flow;
+	u64 probes = 0;
+
+	down_read(&table->resize_lock);
+	bucket = uip_flow_bucket(table, hash);
+	mutex_lock(&bucket->lock);
+	hlist_for_each_entry(flow, &bucket->head, node) {
+		probes++;
+		if (flow->hash == hash && flow->sip == sip && flow->dip == dip &&
+		    flow->sport == sport && flow->dport == dport)
+			break;
+	}
+	mutex_unlock(&bucket->lock);
+	up_read(&table->resize_lock);
+
+	__atomic_fetch_add(&table->stats.lookups, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&table->stats.probes, probes, __ATOMIC_RELAXED);
+	if (!flow)
+		__atomic_fetch_add(&table->stats.misses, 1, __ATOMIC_RELAXED);
+
+	return flow;
+}
+
+static void uip_flow_table_grow(struct uip_flow_table *table)
+{
+	struct uip_flow_bucket *buckets, *old;
+	struct hlist_node *next;
+	struct uip_flow *flow;
+	u32 nr, i;
+
+	down_write(&table->resize_lock);
+
+	/* Someone else grew it while we waited */
+	nr = table->nr_buckets * 2;
+	if (table->nr_flows <= table->nr_buckets * UIP_FLOW_MAX_LOAD ||
+	    nr > UIP_FLOW_MAX_BUCKETS)
+		goto out;
+
+	/* Stay as we are, only slower */
+	buckets = uip_flow_alloc_buckets(nr);
+	if (!buckets)
+		goto out;
+
+	old = table->buckets;
+	for (i = 0; i < table->nr_buckets; i++) {
+		hlist_for_each_entry_safe(flow, next, &old[i].head, node) {
+			hlist_del(&flow->node);
+			hlist_add_head(&flow->node,
+				       &buckets[flow->hash & (nr - 1)].head);
+		}
+	}
+
+	table->buckets = buckets;
+	table->nr_buckets = nr;
+	table->stats.resizes++;
+	free(old);
+out:
+	up_write(&table->resize_lock);
+}
+
+void uip_flow_add(struct uip_flow_table *table, struct uip_flow *flow,
+		  u32 sip, u32 dip, u16 sport, u16 dport)
+{
+	struct uip_flow_bucket *bucket;
+	bool grow;
+
+	flow->sip	= sip;
+	flow->dip	= dip;
+	flow->sport	= sport;
+	flow->dport	= dport;
+	flow->hash	= uip_flow_hash(table, sip, dip, sport, dport);
+
+	down_read(&table->resize_lock);
+	bucket = uip_flow_bucket(table, flow->hash);
+	mutex_lock(&bucket->lock);
+	hlist_add_head(&flow->node, &bucket->head);
+	mutex_unlock(&bucket->lock);
+	grow = __atomic_add_fetch(&table->nr_flows, 1, __ATOMIC_RELAXED) >
+	       table->nr_buckets * UIP_FLOW_MAX_LOAD;
+	up_read(&table->resize_lock);
+
+	__atomic_fetch_add(&table->stats.adds, 1, __ATOMIC_RELAXED);
+	if (grow)
+		uip_flow_table_grow(table);
+}
+
+void uip_flow_del(struct uip_flow_table *table, struct uip_flow *flow)
+{
+	struct uip_flow_bucket *bucket;
+
+	down_read(&table->resize_lock);
+	bucket = uip_flow_bucket(table, flow->hash);
+	mutex_lock(&bucket->lock);
+	hlist_del(&flow->node);
+	mutex_unlock(&bucket->lock);
+	__atomic_fetch_sub(&table->nr_flows, 1, __ATOMIC_RELAXED);
+	up_read(&table->resize_lock);
+
+	__atomic_fetch_add(&table->stats.dels, 1, __ATOMIC_RELAXED);
+}
+
+/* Take any flow out of the table, once nothing else uses it, NULL when empty */
+struct uip_flow *uip_flow_pop(struct uip_flow_table *table)
+{
+	struct uip_flow *flow = NULL;
+	u32 i;
+
+	for (i = 0; i < table->nr_buckets && !flow; i++) {
+		if (!hlist_empty(&table->buckets[i].head))
+			flow = hlist_entry(table->buckets[i].head.first,
+					   struct uip_flow, node);
+	}
+
+	if (flow)
+		uip_flow_del(table, flow);
+
+	return flow;
+}
+
+void uip_flow_get_stats(struct uip_flow_table *table,
+			struct uip_flow_stats *stats)
+{
+	struct uip_flow_bucket *bucket;
+	struct uip_flow *flow;
+	u32 i, chain;
+
+	down_read(&table->resize_lock);
+	*stats = (struct uip_flow_stats) {
+		.lookups	= __atomic_load_n(&table->stats.lookups,
+						  __ATOMIC_RELAXED),
+		.misses		= __atomic_load_n(&table->stats.misses,
+						  __ATOMIC_RELAXED),
+		.probes		= __atomic_load_n(&table->stats.probes,
+						  __ATOMIC_RELAXED),
+		.adds		= __atomic_load_n(&table->stats.adds,
+						  __ATOMIC_RELAXED),
+		.dels		= __atomic_load_n(&table->stats.dels,
+						  __ATOMIC_RELAXED),
+		.flows		= __atomic_load_n(&table->nr_flows,
+						  __ATOMIC_RELAXED),
+		.buckets	= table->nr_buckets,
+		.resizes	= table->stats.resizes,
+	};
+
+	for (i = 0; i < table->nr_buckets; i++) {
+		bucket = &table->buckets[i];
+		chain = 0;
+
+		mutex_lock(&bucket->lock);
+		hlist_for_each_entry(flow, &bucket->head, node)
+			chain++;
+		mutex_unlock(&bucket->lock);
+
+		stats->longest_chain = max(stats->longest_chain, chain);
+	}
+	up_read(&table->resize_lock);
+}
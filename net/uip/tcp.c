@@ -5,6 +5,9 @@
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+
+static void uip_tcp_socket_event(struct uip_epoll_entry *entry);
 
 static int uip_tcp_socket_close(struct uip_tcp_socket *sk, int how)
 {
@@ -14,9 +17,7 @@ static int uip_tcp_socket_close(struct uip_tcp_socket *sk, int how)
 		shutdown(sk->fd, SHUT_RDWR);
 		close(sk->fd);
 
-		mutex_lock(sk->lock);
-		list_del(&sk->list);
-		mutex_unlock(sk->lock);
+		uip_flow_del(&sk->info->tcp_flows, &sk->flow);
 
 		free(sk->buf);
 		free(sk);
@@ -27,28 +28,17 @@ static int uip_tcp_socket_close(struct uip_tcp_socket *sk, int how)
 
 static struct uip_tcp_socket *uip_tcp_socket_find(struct uip_tx_arg *arg, u32 sip, u32 dip, u16 sport, u16 dport)
 {
-	struct list_head *sk_head;
-	struct mutex *sk_lock;
-	struct uip_tcp_socket *sk;
-
-	sk_head = &arg->info->tcp_socket_head;
-	sk_lock = &arg->info->tcp_socket_lock;
+	struct uip_flow *flow;
 
-	mutex_lock(sk_lock);
-	list_for_each_entry(sk, sk_head, list) {
-		if (sk->sip == sip && sk->dip == dip && sk->sport == sport && sk->dport == dport) {
-			mutex_unlock(sk_lock);
-			return sk;
-		}
-	}
-	mutex_unlock(sk_lock);
+	flow = uip_flow_find(&arg->info->tcp_flows, sip, dip, sport, dport);
+	if (!flow)
+		return NULL;
 
-	return NULL;
+	return container_of(flow, struct uip_tcp_socket, flow);
 }
 
 static struct uip_tcp_socket *uip_tcp_socket_alloc(struct uip_tx_arg *arg, u32 sip, u32 dip, u16 sport, u16 dport)
 {
-	struct list_head *sk_head;
 	struct uip_tcp_socket *sk;
 	struct mutex *sk_lock;
 	struct uip_tcp *tcp;
@@ -58,7 +48,6 @@ static struct uip_tcp_socket *uip_tcp_socket_alloc(struct uip_tx_arg *arg, u32 s
 	tcp = (struct uip_tcp *)arg->eth;
 	ip = (struct uip_ip *)arg->eth;
 
-	sk_head = &arg->info->tcp_socket_head;
 	sk_lock = &arg->info->tcp_socket_lock;
 
 	sk = malloc(sizeof(*sk));
@@ -66,14 +55,13 @@ static struct uip_tcp_socket *uip_tcp_socket_alloc(struct uip_tx_arg *arg, u32 s
 
 	sk->lock			= sk_lock;
 	sk->info			= arg->info;
+	sk->epoll.handle		= uip_tcp_socket_event;
 
 	sk->fd				= socket(AF_INET, SOCK_STREAM, 0);
 	sk->addr.sin_family		= AF_INET;
 	sk->addr.sin_port		= dport;
 	sk->addr.sin_addr.s_addr	= dip;
 
-	pthread_cond_init(&sk->cond, NULL);
-
 	if (ntohl(dip) == arg->info->host_ip)
 		sk->addr.sin_addr.s_addr = inet_addr("127.0.0.1");
 
@@ -88,29 +76,23 @@ static struct uip_tcp_socket *uip_tcp_socket_alloc(struct uip_tx_arg *arg, u32 s
 	sk->sport	= tcp->sport;
 	sk->dport	= tcp->dport;
 
-	mutex_lock(sk_lock);
-	list_add_tail(&sk->list, sk_head);
-	mutex_unlock(sk_lock);
+	uip_flow_add(&arg->info->tcp_flows, &sk->flow, sk->sip, sk->dip,
+		     sk->sport, sk->dport);
 
 	return sk;
 }
 
-/* Caller holds the sk lock */
+/* Already taken out of the flow table */
 static void uip_tcp_socket_free(struct uip_tcp_socket *sk)
 {
 	/*
-	 * Here we assume that the virtqueues are already inactive so we don't
-	 * race with uip_tx_do_ipv4_tcp. We are racing with
-	 * uip_tcp_socket_thread though, but holding the sk lock ensures that it
-	 * cannot free data concurrently.
+	 * Here we assume that the virtqueues are already inactive and the uip
+	 * worker stopped, so nothing else uses the socket.
 	 */
-	if (sk->thread) {
-		pthread_cancel(sk->thread);
-		pthread_join(sk->thread, NULL);
-	}
-
-	sk->write_done = sk->read_done = 1;
-	uip_tcp_socket_close(sk, SHUT_RDWR);
+	shutdown(sk->fd, SHUT_RDWR);
+	close(sk->fd);
+	free(sk->buf);
+	free(sk);
 }
 
 static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_len)
@@ -167,7 +149,6 @@ static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_
 
 	ip2->len	= htons(uip_tcp_hdrlen(tcp2) + payload_len + uip_ip_hdrlen(ip2));
 	ip2->csum	= uip_csum_ip(ip2);
-	tcp2->csum	= uip_csum_tcp(tcp2);
 
 	/*
 	 * virtio_net_hdr
@@ -175,6 +156,20 @@ static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_
 	buf->vnet_len	= info->vnet_hdr_len;
 	memset(buf->vnet, 0, buf->vnet_len);
 
+	if (info->guest_csum) {
+		tcp2->csum = uip_csum_tcp_pseudo(tcp2);
+		uip_buf_set_csum_partial(buf, uip_eth_hdrlen(eth2) + uip_ip_hdrlen(ip2),
+					 offsetof(struct uip_tcp, csum) -
+					 offsetof(struct uip_tcp, sport));
+
+		if (info->guest_tso && payload_len > sk->mss)
+			uip_buf_set_gso_tcp(buf, uip_eth_hdrlen(eth2) +
+					    uip_ip_hdrlen(ip2) + uip_tcp_hdrlen(tcp2),
+					    sk->mss);
+	} else {
+		tcp2->csum = uip_csum_tcp(tcp2);
+	}
+
 	buf->eth_len	= ntohs(ip2->len) + uip_eth_hdrlen(&ip2->eth);
 
 	/*
@@ -190,76 +185,91 @@ static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_
 	return 0;
 }
 
-static void *uip_tcp_socket_thread(void *p)
+/* Without TSO, the guest only takes segments that fit its MTU */
+static int uip_tcp_max_payload(struct uip_tcp_socket *sk)
 {
-	struct uip_tcp_socket *sk;
-	int len, left, ret;
-	u8 *pos;
+	return sk->info->guest_tso ? UIP_MAX_TCP_PAYLOAD : sk->mss;
+}
 
-	kvm__set_thread_name("uip-tcp");
+/* How much more data the guest currently accepts */
+static int uip_tcp_window(struct uip_tcp_socket *sk)
+{
+	return sk->guest_acked + sk->window_size - sk->seq_server;
+}
 
-	sk = p;
+static int uip_tcp_socket_poll(struct uip_tcp_socket *sk, int op, u32 events)
+{
+	struct epoll_event ev = {
+		.events		= events,
+		.data.ptr	= &sk->epoll,
+	};
 
-	while (1) {
-		pos = sk->buf;
+	return epoll_ctl(sk->info->epoll.fd, op, sk->fd, &ev);
+}
 
-		ret = read(sk->fd, sk->buf, UIP_MAX_TCP_PAYLOAD);
+static void uip_tcp_socket_event(struct uip_epoll_entry *entry)
+{
+	struct uip_tcp_socket *sk;
+	int len, ret;
 
-		if (ret <= 0 || ret > UIP_MAX_TCP_PAYLOAD)
-			goto out;
+	sk = container_of(entry, struct uip_tcp_socket, epoll);
 
-		left = ret;
+	/*
+	 * Only read as much as the guest can take. The rest stays queued on
+	 * the socket, which pushes back on the remote end, until an ACK from
+	 * the guest opens the window again.
+	 */
+	mutex_lock(sk->lock);
+	len = uip_tcp_window(sk);
+	if (len <= 0) {
+		sk->paused = true;
+		uip_tcp_socket_poll(sk, EPOLL_CTL_MOD, 0);
+	}
+	mutex_unlock(sk->lock);
 
-		while (left > 0) {
-			mutex_lock(sk->lock);
-			while ((len = sk->guest_acked + sk->window_size - sk->seq_server) <= 0)
-				pthread_cond_wait(&sk->cond, &sk->lock->mutex);
-			mutex_unlock(sk->lock);
+	if (len <= 0)
+		return;
 
-			sk->payload = pos;
-			if (len > left)
-				len = left;
-			if (len > UIP_MAX_TCP_PAYLOAD)
-				len = UIP_MAX_TCP_PAYLOAD;
-			left -= len;
-			pos += len;
+	len = min(len, uip_tcp_max_payload(sk));
+	ret = recv(sk->fd, sk->buf, len, MSG_DONTWAIT);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
 
-			uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, len);
-		}
+	if (ret > 0) {
+		sk->payload = sk->buf;
+		uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, ret);
+		return;
 	}
 
-out:
 	/*
 	 * Close server to guest TCP connection
 	 */
-	uip_tcp_socket_close(sk, SHUT_RD);
+	uip_tcp_socket_poll(sk, EPOLL_CTL_DEL, 0);
 
 	uip_tcp_payload_send(sk, UIP_TCP_FLAG_FIN | UIP_TCP_FLAG_ACK, 0);
 	sk->seq_server += 1;
 
 	sk->read_done = 1;
 
-	pthread_exit(NULL);
-
-	return NULL;
+	uip_tcp_socket_close(sk, SHUT_RD);
 }
 
 static int uip_tcp_socket_receive(struct uip_tcp_socket *sk)
 {
 	int ret;
 
-	if (sk->thread == 0) {
-		sk->buf = malloc(UIP_MAX_TCP_PAYLOAD);
-		if (!sk->buf)
-			return -ENOMEM;
-		ret = pthread_create(&sk->thread, NULL, uip_tcp_socket_thread,
-				     (void *)sk);
-		if (ret)
-			free(sk->buf);
-		return ret;
+	sk->buf = malloc(UIP_MAX_TCP_PAYLOAD);
+	if (!sk->buf)
+		return -ENOMEM;
+
+	ret = uip_tcp_socket_poll(sk, EPOLL_CTL_ADD, EPOLLIN);
+	if (ret < 0) {
+		ret = -errno;
+		free(sk->buf);
+		sk->buf = NULL;
 	}
 
-	return 0;
+	return ret;
 }
 
 static int uip_tcp_socket_send(struct uip_tcp_socket *sk, struct uip_tcp *tcp)
@@ -281,8 +291,97 @@ static int uip_tcp_socket_send(struct uip_tcp_socket *sk, struct uip_tcp *tcp)
 	return ret;
 }
 
+/* An ACK from the guest moves its window, which may let the worker read again */
+static void uip_tcp_update_window(struct uip_tcp_socket *sk, u32 guest_acked,
+				  u16 window_size)
+{
+	mutex_lock(sk->lock);
+	sk->window_size = window_size;
+	sk->guest_acked = guest_acked;
+	if (sk->paused && uip_tcp_window(sk) > 0) {
+		sk->paused = false;
+		uip_tcp_socket_poll(sk, EPOLL_CTL_MOD, EPOLLIN);
+	}
+	mutex_unlock(sk->lock);
+}
+
+/* Where the frames of the batch for @sk go, NULL once it has too many sockets */
+static struct uip_tcp_batch_entry *uip_tcp_batch_entry(struct uip_tx_batch *batch,
+							struct uip_tcp_socket *sk)
+{
+	struct uip_tcp_batch_entry *entry;
+	u32 i;
+
+	for (i = 0; i < batch->nr_tcp; i++) {
+		if (batch->tcp[i].sk == sk)
+			return &batch->tcp[i];
+	}
+
+	if (batch->nr_tcp == UIP_TX_BATCH_SOCKETS)
+		return NULL;
+
+	entry = &batch->tcp[batch->nr_tcp++];
+	entry->sk = sk;
+	entry->ack = false;
+
+	return entry;
+}
+
+static void uip_tcp_batch_apply(struct uip_tcp_batch_entry *entry)
+{
+	/* Only the last ACK of the guest counts, they don't go backwards */
+	uip_tcp_update_window(entry->sk, entry->guest_acked, entry->window_size);
+	if (entry->ack)
+		uip_tcp_payload_send(entry->sk, UIP_TCP_FLAG_ACK, 0);
+}
+
+static void uip_tcp_batch_del(struct uip_tx_batch *batch,
+			      struct uip_tcp_batch_entry *entry)
+{
+	uip_tcp_batch_apply(entry);
+	*entry = batch->tcp[--batch->nr_tcp];
+}
+
+void uip_tcp_batch_flush(struct uip_tx_batch *batch)
+{
+	u32 i;
+
+	for (i = 0; i < batch->nr_tcp; i++)
+		uip_tcp_batch_apply(&batch->tcp[i]);
+	batch->nr_tcp = 0;
+}
+
+/* MSS option of a SYN, UIP_TCP_MSS if the guest didn't send one */
+static u16 uip_tcp_mss(struct uip_tcp *tcp)
+{
+	u8 *opt = (u8 *)(tcp + 1);
+	u8 *end = uip_tcp_payload(tcp);
+	u16 mss;
+
+	while (opt < end && *opt != UIP_TCP_OPT_END) {
+		if (*opt == UIP_TCP_OPT_NOP) {
+			opt++;
+			continue;
+		}
+
+		if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end)
+			break;
+
+		if (*opt == UIP_TCP_OPT_MSS && opt[1] == 4) {
+			memcpy(&mss, opt + 2, sizeof(mss));
+			mss = ntohs(mss);
+			return mss ? mss : UIP_TCP_MSS;
+		}
+
+		opt += opt[1];
+	}
+
+	return UIP_TCP_MSS;
+}
+
 int uip_tx_do_ipv4_tcp(struct uip_tx_arg *arg)
 {
+	struct uip_tcp_batch_entry *entry;
 	struct uip_tcp_socket *sk;
 	struct uip_tcp *tcp;
 	struct uip_ip *ip;
@@ -300,6 +399,7 @@ int uip_tx_do_ipv4_tcp(struct uip_tx_arg *arg)
 			return -1;
 
 		sk->window_size = ntohs(tcp->win);
+		sk->mss = uip_tcp_mss(tcp);
 
 		/*
 		 * Setup ISN number
@@ -313,7 +413,7 @@ int uip_tx_do_ipv4_tcp(struct uip_tx_arg *arg)
 		sk->seq_server += 1;
 
 		/*
-		 * Start receive thread for data from remote to guest
+		 * Have the uip worker forward data from remote to guest
 		 */
 		uip_tcp_socket_receive(sk);
 
@@ -327,13 +427,19 @@ int uip_tx_do_ipv4_tcp(struct uip_tx_arg *arg)
 	if (!sk)
 		return -1;
 
-	mutex_lock(sk->lock);
-	sk->window_size = ntohs(tcp->win);
-	sk->guest_acked = ntohl(tcp->ack);
-	pthread_cond_signal(&sk->cond);
-	mutex_unlock(sk->lock);
+	entry = arg->batch ? uip_tcp_batch_entry(arg->batch, sk) : NULL;
+	if (entry) {
+		entry->guest_acked = ntohl(tcp->ack);
+		entry->window_size = ntohs(tcp->win);
+	} else {
+		uip_tcp_update_window(sk, ntohl(tcp->ack), ntohs(tcp->win));
+	}
 
 	if (uip_tcp_is_fin(tcp)) {
+		/* The socket may go away with the FIN, it's done with first */
+		if (entry)
+			uip_tcp_batch_del(arg->batch, entry);
+
 		if (sk->write_done)
 			goto out;
 
@@ -362,10 +468,13 @@ int uip_tx_do_ipv4_tcp(struct uip_tx_arg *arg)
 	if (ret < 0)
 		return -1;
 	/*
-	 * Send ACK to guest imediately
+	 * ACK to guest imediately, or once the batch ends
 	 */
 	sk->ack_server += ret;
-	uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, 0);
+	if (entry)
+		entry->ack = true;
+	else
+		uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, 0);
 
 out:
 	return 0;
@@ -373,10 +482,9 @@ out:
 
 void uip_tcp_exit(struct uip_info *info)
 {
-	struct uip_tcp_socket *sk, *next;
+	struct uip_flow *flow;
 
-	mutex_lock(&info->tcp_socket_lock);
-	list_for_each_entry_safe(sk, next, &info->tcp_socket_head, list)
-		uip_tcp_socket_free(sk);
-	mutex_unlock(&info->tcp_socket_lock);
+	while ((flow = uip_flow_pop(&info->tcp_flows)))
+		uip_tcp_socket_free(container_of(flow, struct uip_tcp_socket,
+						 flow));
 }
@@ -8,31 +8,22 @@
 #include <sys/epoll.h>
 #include <fcntl.h>
 
-#define UIP_UDP_MAX_EVENTS 1000
+static void uip_udp_socket_event(struct uip_epoll_entry *entry);
 
 static struct uip_udp_socket *uip_udp_socket_find(struct uip_tx_arg *arg, u32 sip, u32 dip, u16 sport, u16 dport)
 {
-	struct list_head *sk_head;
 	struct uip_udp_socket *sk;
-	struct mutex *sk_lock;
+	struct uip_flow *flow;
 	struct epoll_event ev;
 	int flags;
 	int ret;
 
-	sk_head = &arg->info->udp_socket_head;
-	sk_lock = &arg->info->udp_socket_lock;
-
 	/*
 	 * Find existing sk
 	 */
-	mutex_lock(sk_lock);
-	list_for_each_entry(sk, sk_head, list) {
-		if (sk->sip == sip && sk->dip == dip && sk->sport == sport && sk->dport == dport) {
-			mutex_unlock(sk_lock);
-			return sk;
-		}
-	}
-	mutex_unlock(sk_lock);
+	flow = uip_flow_find(&arg->info->udp_flows, sip, dip, sport, dport);
+	if (flow)
+		return container_of(flow, struct uip_udp_socket, flow);
 
 	/*
 	 * Allocate new one
@@ -40,7 +31,8 @@ static struct uip_udp_socket *uip_udp_socket_find(struct uip_tx_arg *arg, u32 si
 	sk = malloc(sizeof(*sk));
 	memset(sk, 0, sizeof(*sk));
 
-	sk->lock = sk_lock;
+	sk->info = arg->info;
+	sk->epoll.handle = uip_udp_socket_event;
 
 	sk->fd = socket(AF_INET, SOCK_DGRAM, 0);
 	if (sk->fd < 0)
@@ -54,14 +46,11 @@ static struct uip_udp_socket *uip_udp_socket_find(struct uip_tx_arg *arg, u32 si
 	fcntl(sk->fd, F_SETFL, flags);
 
 	/*
-	 * Add sk->fd to epoll_wait
+	 * Let the uip worker poll sk->fd
 	 */
 	ev.events	= EPOLLIN;
-	ev.data.fd	= sk->fd;
-	ev.data.ptr	= sk;
-	if (arg->info->udp_epollfd <= 0)
-		arg->info->udp_epollfd = epoll_create(UIP_UDP_MAX_EVENTS);
-	ret = epoll_ctl(arg->info->udp_epollfd, EPOLL_CTL_ADD, sk->fd, &ev);
+	ev.data.ptr	= &sk->epoll;
+	ret = epoll_ctl(arg->info->epoll.fd, EPOLL_CTL_ADD, sk->fd, &ev);
 	if (ret == -1)
 		pr_warning("epoll_ctl error");
 
@@ -74,9 +63,7 @@ static struct uip_udp_socket *uip_udp_socket_find(struct uip_tx_arg *arg, u32 si
 	sk->sport		 = sport;
 	sk->dport		 = dport;
 
-	mutex_lock(sk_lock);
-	list_add_tail(&sk->list, sk_head);
-	mutex_unlock(sk_lock);
+	uip_flow_add(&arg->info->udp_flows, &sk->flow, sip, dip, sport, dport);
 
 	return sk;
 
@@ -137,7 +124,6 @@ int uip_udp_make_pkg(struct uip_info *info, struct uip_udp_socket *sk, struct ui
 
 	ip2->len	= udp2->len + htons(uip_ip_hdrlen(ip2));
 	ip2->csum	= uip_csum_ip(ip2);
-	udp2->csum	= uip_csum_udp(udp2);
 
 	/*
 	 * virtio_net_hdr
@@ -145,74 +131,56 @@ int uip_udp_make_pkg(struct uip_info *info, struct uip_udp_socket *sk, struct ui
 	buf->vnet_len	= info->vnet_hdr_len;
 	memset(buf->vnet, 0, buf->vnet_len);
 
+	if (info->guest_csum) {
+		udp2->csum = uip_csum_udp_pseudo(udp2);
+		uip_buf_set_csum_partial(buf, uip_eth_hdrlen(eth2) + uip_ip_hdrlen(ip2),
+					 offsetof(struct uip_udp, csum) -
+					 offsetof(struct uip_udp, sport));
+	} else {
+		udp2->csum = uip_csum_udp(udp2);
+	}
+
 	buf->eth_len	= ntohs(ip2->len) + uip_eth_hdrlen(&ip2->eth);
 
 	return 0;
 }
 
-static void *uip_udp_socket_thread(void *p)
+static void uip_udp_socket_event(struct uip_epoll_entry *entry)
 {
-	struct epoll_event events[UIP_UDP_MAX_EVENTS];
 	struct uip_udp_socket *sk;
 	struct uip_info *info;
 	struct uip_buf *buf;
 	int payload_len;
-	u8 *payload;
-	int nfds;
-	int i;
-
-	kvm__set_thread_name("uip-udp");
-
-	info = p;
-	payload = info->udp_buf;
 
-	while (1) {
-		nfds = epoll_wait(info->udp_epollfd, events, UIP_UDP_MAX_EVENTS, -1);
+	sk = container_of(entry, struct uip_udp_socket, epoll);
+	info = sk->info;
 
-		if (nfds == -1)
-			continue;
+	payload_len = recvfrom(sk->fd, info->udp_buf, UIP_MAX_UDP_PAYLOAD, 0, NULL, NULL);
+	if (payload_len < 0)
+		return;
 
-		for (i = 0; i < nfds; i++) {
-
-			sk = events[i].data.ptr;
-			payload_len = recvfrom(sk->fd, payload, UIP_MAX_UDP_PAYLOAD, 0, NULL, NULL);
-			if (payload_len < 0)
-				continue;
-
-			/*
-			 * Get free buffer to send data to guest
-			 */
-			buf = uip_buf_get_free(info);
-
-			uip_udp_make_pkg(info, sk, buf, payload, payload_len);
-
-			/*
-			 * Send data received from socket to guest
-			 */
-			uip_buf_set_used(info, buf);
-		}
-	}
+	/*
+	 * Get free buffer to send data to guest
+	 */
+	buf = uip_buf_get_free(info);
 
-	mutex_lock(&info->udp_socket_lock);
-	free(info->udp_buf);
-	info->udp_buf = NULL;
-	mutex_unlock(&info->udp_socket_lock);
+	uip_udp_make_pkg(info, sk, buf, info->udp_buf, payload_len);
 
-	pthread_exit(NULL);
-	return NULL;
+	/*
+	 * Send data received from socket to guest
+	 */
+	uip_buf_set_used(info, buf);
 }
 
 int uip_tx_do_ipv4_udp(struct uip_tx_arg *arg)
 {
 	struct uip_udp_socket *sk;
-	struct uip_info *info;
 	struct uip_udp *udp;
 	struct uip_ip *ip;
 	int ret;
 
 	udp	= (struct uip_udp *)(arg->eth);
 	ip	= (struct uip_ip *)(arg->eth);
-	info	= arg->info;
 
 	if (uip_udp_is_dhcp(udp)) {
 		uip_tx_do_ipv4_udp_dhcp(arg);
@@ -233,36 +201,17 @@ int uip_tx_do_ipv4_udp(struct uip_tx_arg *arg)
 	if (ret)
 		return -1;
 
-	if (!info->udp_thread) {
-		info->udp_buf = malloc(UIP_MAX_UDP_PAYLOAD);
-		if (!info->udp_buf)
-			return -1;
-
-		pthread_create(&info->udp_thread, NULL, uip_udp_socket_thread, (void *)info);
-	}
-
 	return 0;
 }
 
 void uip_udp_exit(struct uip_info *info)
 {
-	struct uip_udp_socket *sk, *next;
-
-	mutex_lock(&info->udp_socket_lock);
-	if (info->udp_thread) {
-		pthread_cancel(info->udp_thread);
-		pthread_join(info->udp_thread, NULL);
-		info->udp_thread = 0;
-		free(info->udp_buf);
-	}
-	if (info->udp_epollfd > 0) {
-		close(info->udp_epollfd);
-		info->udp_epollfd = 0;
-	}
+	struct uip_udp_socket *sk;
+	struct uip_flow *flow;
 
-	list_for_each_entry_safe(sk, next, &info->udp_socket_head, list) {
+	while ((flow = uip_flow_pop(&info->udp_flows))) {
+		sk = container_of(flow, struct uip_udp_socket, flow);
 		close(sk->fd);
 		free(sk);
 	}
-	mutex_unlock(&info->udp_socket_lock);
 }
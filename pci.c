@@ -97,19 +97,31 @@ static void pci_config_address_mmio(struct kvm_cpu *vcpu, u64 addr, u8 *data,
 	else
 		memcpy(data, p, len);
 }
-static bool pci_device_exists(u8 bus_number, u8 device_number, u8 function_number)
+
+/* All devices are on bus 0, their number spread over slots and functions */
+static struct pci_device_header *
+pci_config_find_dev(union pci_config_address addr)
 {
-	union pci_config_address pci_config_address;
+	if (addr.bus_number != 0)
+		return NULL;
 
-	pci_config_address.w = ioport__read32(&pci_config_address_bits);
+	return pci__find_dev(pci__dev_num(addr.device_number,
+					  addr.function_number));
+}
 
-	if (pci_config_address.bus_number != bus_number)
-		return false;
+/* Function 0 of a slot is multi-function when other devices share its slot */
+static bool pci_config_is_multifunction(union pci_config_address addr)
+{
+	u8 fn;
 
-	if (pci_config_address.function_number != function_number)
+	if (addr.function_number != 0)
 		return false;
 
-	return !IS_ERR_OR_NULL(device__find_dev(DEVICE_BUS_PCI, device_number));
+	for (fn = 1; fn < PCI_MAX_FUNCTIONS; fn++)
+		if (pci__find_dev(pci__dev_num(addr.device_number, fn)))
+			return true;
+
+	return false;
 }
 
 static void pci_config_data_mmio(struct kvm_cpu *vcpu, u64 addr, u8 *data,
@@ -374,14 +386,14 @@ void pci__config_wr(struct kvm *kvm, union pci_config_address addr, void *data,
 	u8 bar;
 	u16 offset;
 	struct pci_device_header *pci_hdr;
-	u8 dev_num = addr.device_number;
 	u32 value = 0, mask = 0;
 
-	if (!pci_device_exists(addr.bus_number, dev_num, 0))
+	pci_hdr = pci_config_find_dev(addr);
+	if (!pci_hdr)
 		return;
 
 	offset = addr.w & PCI_DEV_CFG_MASK;
-	base = pci_hdr = device__find_dev(DEVICE_BUS_PCI, dev_num)->data;
+	base = pci_hdr;
 
 	/* We don't sanity-check capabilities for the moment */
 	if (offset < PCI_STD_HEADER_SIZEOF) {
@@ -413,16 +425,19 @@ void pci__config_rd(struct kvm *kvm, union pci_config_address addr, void *data,
 {
 	u16 offset;
 	struct pci_device_header *pci_hdr;
-	u8 dev_num = addr.device_number;
 
-	if (pci_device_exists(addr.bus_number, dev_num, 0)) {
-		pci_hdr = device__find_dev(DEVICE_BUS_PCI, dev_num)->data;
+	pci_hdr = pci_config_find_dev(addr);
+	if (pci_hdr) {
 		offset = addr.w & PCI_DEV_CFG_MASK;
 
 		if (pci_hdr->cfg_ops.read)
 			pci_hdr->cfg_ops.read(kvm, pci_hdr, offset, data, size);
 
 		memcpy(data, (void *)pci_hdr + offset, size);
+
+		if (offset <= PCI_HEADER_TYPE && offset + size > PCI_HEADER_TYPE &&
+		    pci_config_is_multifunction(addr))
+			((u8 *)data)[PCI_HEADER_TYPE - offset] |= 0x80;
 	} else {
 		memset(data, 0xff, size);
 	}
@@ -454,6 +469,23 @@ static void pci_config_mmio_access(struct kvm_cpu *vcpu, u64 addr, u8 *data,
 		pci__config_rd(kvm, cfg_addr, data, len);
 }
 
+/*
+ * Bring back the config space of a device from a snapshot. The BARs are
+ * emulated where the guest had put them.
+ */
+void pci__restore_config(struct kvm *kvm, struct pci_device_header *pci_hdr,
+			 const void *config)
+{
+	u16 command;
+
+	memcpy(&command, config + PCI_COMMAND, sizeof(command));
+
+	pci_config_command_wr(kvm, pci_hdr, 0);
+	memcpy(pci_hdr->__pad, config, PCI_DEV_CFG_SIZE);
+	pci_hdr->command = 0;
+	pci_config_command_wr(kvm, pci_hdr, command);
+}
+
 struct pci_device_header *pci__find_dev(u8 dev_num)
 {
 	struct device_header *hdr = device__find_dev(DEVICE_BUS_PCI, dev_num);
@@ -508,8 +540,13 @@ int pci__init(struct kvm *kvm)
 				 pci_config_data_mmio, NULL);
 	if (r < 0)
 		return r;
-	r = kvm__register_pio(kvm, PCI_CONFIG_ADDRESS, 4,
-				 pci_config_address_mmio, NULL);
+	/*
+	 * The address latch needn't exit: the data access that uses it
+	 * emulates the posted writes first. That halves the exits of CAM.
+	 */
+	r = kvm__register_iotrap(kvm, PCI_CONFIG_ADDRESS, 4,
+				 pci_config_address_mmio, NULL,
+				 DEVICE_BUS_IOPORT | IOTRAP_COALESCE);
 	if (r < 0)
 		goto err_unregister_data;
 
@@ -1,7 +1,23 @@
 #ifndef KVM__KVM_CONFIG_ARCH_H
 #define KVM__KVM_CONFIG_ARCH_H
 
+#include "kvm/parse-options.h"
+
+/*
+ * The hypervisor console moves 16 bytes an hcall, and the guest polls it
+ * with more hcalls while idle: virtio-console goes through a ring instead.
+ */
+#define DEFAULT_CONSOLE		"virtio"
+
 struct kvm_config_arch {
+	bool		userspace_xics;
 };
 
+#define OPT_ARCH_RUN(pfx, cfg)						\
+	pfx,								\
+	OPT_GROUP("Interrupt options:"),				\
+	OPT_BOOLEAN('\0', "userspace-xics", &(cfg)->userspace_xics,	\
+		    "Emulate the XICS in kvmtool even if KVM can"	\
+		    " emulate it"),
+
 #endif /* KVM__KVM_CONFIG_ARCH_H */
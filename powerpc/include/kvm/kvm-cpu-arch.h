@@ -59,6 +59,7 @@ struct kvm_cpu {
 	u8			is_running;
 	u8			paused;
 	u8			needs_nmi;
+	u8			in_run;		/* In or entering KVM_RUN */
 	/*
 	 * Although PPC KVM doesn't yet support coalesced MMIO, generic code
 	 * needs this in our kvm_cpu:
@@ -11,8 +11,10 @@
  * by the Free Software Foundation.
  */
 
+#include "kvm/boot-cache.h"
 #include "kvm/fdt.h"
 #include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
 #include "kvm/util.h"
 #include "cpu_info.h"
 
@@ -91,7 +93,7 @@ void kvm__init_ram(struct kvm *kvm)
 	kvm__register_ram(kvm, phys_start, phys_size, host_mem);
 }
 
-void kvm__arch_set_cmdline(char *cmdline, bool video)
+void kvm__arch_set_cmdline(struct kvm *kvm, char *cmdline, bool video)
 {
 	/* We don't need anything unusual in here. */
 }
@@ -119,7 +121,6 @@ void kvm__arch_init(struct kvm *kvm)
 	kvm->arch.fdt_gra = kvm->ram_size - FDT_MAX_SIZE;
 	/* FIXME: Not all PPC systems have RTAS */
 	kvm->arch.rtas_gra = kvm->arch.fdt_gra - RTAS_MAX_SIZE;
-	madvise(kvm->ram_start, kvm->ram_size, MADV_MERGEABLE);
 
 	/* FIXME:  SPAPR-PR specific; allocate a guest HPT. */
 	if (posix_memalign((void **)&hpt, (1<<HPT_ORDER), (1<<HPT_ORDER)))
@@ -138,6 +139,7 @@ void kvm__arch_init(struct kvm *kvm)
 	/* Do these before FDT setup, IRQ setup, etc. */
 	/* FIXME: SPAPR-specific */
 	hypercall_init();
+	hypercall_enable_kernel(kvm);
 	register_core_rtas();
 	/* Now that hypercalls are initialised, register a couple for the console: */
 	spapr_hvcons_init();
@@ -159,12 +161,6 @@ void kvm__irq_trigger(struct kvm *kvm, int irq)
 	kvm__irq_line(kvm, irq, 0);
 }
 
-void kvm__arch_read_term(struct kvm *kvm)
-{
-	/* FIXME: Should register callbacks to platform-specific polls */
-	spapr_hvcons_poll(kvm);
-}
-
 bool kvm__arch_load_kernel_image(struct kvm *kvm, int fd_kernel, int fd_initrd,
 				 const char *kernel_cmdline)
 {
@@ -174,7 +170,7 @@ bool kvm__arch_load_kernel_image(struct kvm *kvm, int fd_kernel, int fd_initrd,
 
 	p = k_start = guest_flat_to_host(kvm, KERNEL_LOAD_ADDR);
 
-	filesize = read_file(fd_kernel, p, INITRD_LOAD_ADDR - KERNEL_LOAD_ADDR);
+	filesize = kvm__read_image(kvm, fd_kernel, p, INITRD_LOAD_ADDR - KERNEL_LOAD_ADDR);
 	if (filesize < 0) {
 		if (errno == ENOMEM)
 			die("Kernel overlaps initrd!");
@@ -190,7 +186,7 @@ bool kvm__arch_load_kernel_image(struct kvm *kvm, int fd_kernel, int fd_initrd,
 		/* Round up kernel size to 8byte alignment, and load initrd right after. */
 		p = guest_flat_to_host(kvm, INITRD_LOAD_ADDR);
 
-		filesize = read_file(fd_initrd, p,
+		filesize = kvm__read_image(kvm, fd_initrd, p,
 			       (kvm->ram_start + kvm->ram_size) - p);
 		if (filesize < 0) {
 			if (errno == ENOMEM)
@@ -286,6 +282,26 @@ static void generate_segment_page_sizes(struct kvm_ppc_smmu_info *info, struct f
  * and whilst most PPC targets will require CPU/memory nodes, others like RTAS
  * should eventually be added separately.
  */
+/* What the tree depends on besides what boot_cache__key_init() hashes */
+static void boot_cache_key_arch(struct kvm *kvm, struct boot_cache_key *key,
+				struct cpu_info *cpu_info)
+{
+	boot_cache__key_add_str(key, kern_cmdline);
+	boot_cache__key_add_val(key, kvm->arch.pvr);
+	boot_cache__key_add_val(key, kvm->arch.initrd_gra);
+	boot_cache__key_add_val(key, kvm->arch.initrd_size);
+	boot_cache__key_add_val(key, kvm->arch.fdt_gra);
+	boot_cache__key_add_val(key, kvm->arch.rtas_gra);
+	boot_cache__key_add_val(key, kvm->arch.rtas_size);
+	boot_cache__key_add_str(key, cpu_info->name);
+	boot_cache__key_add_val(key, cpu_info->tb_freq);
+	boot_cache__key_add_val(key, cpu_info->d_bsize);
+	boot_cache__key_add_val(key, cpu_info->i_bsize);
+	boot_cache__key_add_val(key, cpu_info->flags);
+	boot_cache__key_add(key, &cpu_info->mmu_info,
+			    sizeof(cpu_info->mmu_info));
+}
+
 static int setup_fdt(struct kvm *kvm)
 {
 	uint64_t 	mem_reg_property[] = { 0, cpu_to_be64(kvm->ram_size) };
@@ -304,6 +320,13 @@ static int setup_fdt(struct kvm *kvm)
 	/* Generate an appropriate DT at kvm->arch.fdt_gra */
 	void *fdt_dest = guest_flat_to_host(kvm, kvm->arch.fdt_gra);
 	void *fdt = staging_fdt;
+	struct boot_cache_key key;
+	u64 start = kvm_cpu__now();
+
+	boot_cache__key_init(kvm, &key);
+	boot_cache_key_arch(kvm, &key, cpu_info);
+	if (boot_cache__load(kvm, &key, "dtb", fdt_dest, FDT_MAX_SIZE) >= 0)
+		return 0;
 
 	_FDT(fdt_create(fdt, FDT_MAX_SIZE));
 	_FDT(fdt_finish_reservemap(fdt));
@@ -345,11 +368,12 @@ static int setup_fdt(struct kvm *kvm)
 	}
 
 	/*
-	 * stdout-path: This is assuming we're using the HV console.  Also, the
-	 * address is hardwired until we do a VIO bus.
+	 * stdout-path: The HV console, whose address is hardwired until we do
+	 * a VIO bus. Without it, virtio-console is hvc0.
 	 */
-	_FDT(fdt_property_string(fdt, "linux,stdout-path",
-				 "/vdevice/vty@30000000"));
+	if (kvm->cfg.active_console == CONSOLE_HV)
+		_FDT(fdt_property_string(fdt, "linux,stdout-path",
+					 "/vdevice/vty@30000000"));
 	_FDT(fdt_end_node(fdt));
 
 	/*
@@ -468,12 +492,14 @@ static int setup_fdt(struct kvm *kvm)
 	_FDT(fdt_property_cell(fdt, "#size-cells", 0x0));
 	_FDT(fdt_property_string(fdt, "device_type", "vdevice"));
 	_FDT(fdt_property_string(fdt, "compatible", "IBM,vdevice"));
-	_FDT(fdt_begin_node(fdt, "vty@30000000"));
-	_FDT(fdt_property_string(fdt, "name", "vty"));
-	_FDT(fdt_property_string(fdt, "device_type", "serial"));
-	_FDT(fdt_property_string(fdt, "compatible", "hvterm1"));
-	_FDT(fdt_property_cell(fdt, "reg", 0x30000000));
-	_FDT(fdt_end_node(fdt));
+	if (kvm->cfg.active_console == CONSOLE_HV) {
+		_FDT(fdt_begin_node(fdt, "vty@30000000"));
+		_FDT(fdt_property_string(fdt, "name", "vty"));
+		_FDT(fdt_property_string(fdt, "device_type", "serial"));
+		_FDT(fdt_property_string(fdt, "compatible", "hvterm1"));
+		_FDT(fdt_property_cell(fdt, "reg", 0x30000000));
+		_FDT(fdt_end_node(fdt));
+	}
 	_FDT(fdt_end_node(fdt));
 
 	/* Finalise: */
@@ -488,6 +514,8 @@ static int setup_fdt(struct kvm *kvm)
 
 	_FDT(fdt_add_mem_rsv(fdt_dest, kvm->arch.rtas_gra, kvm->arch.rtas_size));
 	_FDT(fdt_pack(fdt_dest));
+	boot_cache__store(kvm, &key, "dtb", fdt_dest, fdt_totalsize(fdt_dest),
+			  start);
 
 	free(segment_page_sizes.value);
 
@@ -82,6 +82,7 @@ typedef target_ulong (*spapr_hcall_fn)(struct kvm_cpu *vcpu,
                                        target_ulong *args);
 
 void hypercall_init(void);
+void hypercall_enable_kernel(struct kvm *kvm);
 void register_core_rtas(void);
 
 void spapr_register_hypercall(target_ulong opcode, spapr_hcall_fn fn);
@@ -104,6 +105,7 @@ typedef void (*spapr_rtas_fn)(struct kvm_cpu *vcpu, uint32_t token,
                               uint32_t nargs, target_ulong args,
                               uint32_t nret, target_ulong rets);
 void spapr_rtas_register(const char *name, spapr_rtas_fn fn);
+uint32_t spapr_rtas_token(const char *name);
 target_ulong spapr_rtas_call(struct kvm_cpu *vcpu,
                              uint32_t token, uint32_t nargs, target_ulong args,
                              uint32_t nret, target_ulong rets);
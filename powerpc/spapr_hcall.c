@@ -182,6 +182,34 @@ target_ulong spapr_hypercall(struct kvm_cpu *vcpu, target_ulong opcode,
 	return H_FUNCTION;
 }
 
+/*
+ * KVM implements these too, but leaves them to userspace unless it's asked to
+ * handle them. What it can't do itself still comes back here.
+ */
+static const target_ulong kernel_hcalls[] = {
+	H_LOGICAL_CI_LOAD,
+	H_LOGICAL_CI_STORE,
+	H_SET_MODE,
+};
+
+void hypercall_enable_kernel(struct kvm *kvm)
+{
+	struct kvm_enable_cap cap = {
+		.cap	= KVM_CAP_PPC_ENABLE_HCALL,
+	};
+	unsigned int i;
+
+	if (!kvm__supports_extension(kvm, KVM_CAP_PPC_ENABLE_HCALL))
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(kernel_hcalls); i++) {
+		cap.args[0] = kernel_hcalls[i];
+		cap.args[1] = 1;
+		if (ioctl(kvm->vm_fd, KVM_ENABLE_CAP, &cap) < 0)
+			pr_debug("KVM doesn't handle hcall 0x%lx", kernel_hcalls[i]);
+	}
+}
+
 void hypercall_init(void)
 {
 	/* hcall-dabr */
@@ -88,16 +88,6 @@ static unsigned long h_get_term_char(struct kvm_cpu *vcpu, unsigned long opcode,
 	return H_SUCCESS;
 }
 
-void spapr_hvcons_poll(struct kvm *kvm)
-{
-	if (term_readable(0)) {
-		/*
-		 * We can inject an IRQ to guest here if we want.  The guest
-		 * will happily poll, though, so not required.
-		 */
-	}
-}
-
 void spapr_hvcons_init(void)
 {
 	spapr_register_hypercall(H_PUT_TERM_CHAR, h_put_term_char);
@@ -14,6 +14,5 @@
 #include "kvm/kvm.h"
 
 void spapr_hvcons_init(void);
-void spapr_hvcons_poll(struct kvm *kvm);
 
 #endif
@@ -53,7 +53,9 @@ static void rtas_ibm_read_pci_config(struct kvm_cpu *vcpu,
 	uint32_t val = 0;
 	uint64_t buid = ((uint64_t)rtas_ld(vcpu->kvm, args, 1) << 32) | rtas_ld(vcpu->kvm, args, 2);
 	union pci_config_address addr = { .w = rtas_ld(vcpu->kvm, args, 0) };
-	struct pci_device_header *dev = pci__find_dev(addr.device_number);
+	struct pci_device_header *dev =
+		pci__find_dev(pci__dev_num(addr.device_number,
+					   addr.function_number));
 	uint32_t size = rtas_ld(vcpu->kvm, args, 3);
 
 	if (buid != phb.buid || !dev || (size > 4)) {
@@ -91,7 +93,9 @@ static void rtas_read_pci_config(struct kvm_cpu *vcpu,
 {
 	uint32_t val;
 	union pci_config_address addr = { .w = rtas_ld(vcpu->kvm, args, 0) };
-	struct pci_device_header *dev = pci__find_dev(addr.device_number);
+	struct pci_device_header *dev =
+		pci__find_dev(pci__dev_num(addr.device_number,
+					   addr.function_number));
 	uint32_t size = rtas_ld(vcpu->kvm, args, 1);
 
 	if (!dev || (size > 4)) {
@@ -122,7 +126,9 @@ static void rtas_ibm_write_pci_config(struct kvm_cpu *vcpu,
 {
 	uint64_t buid = ((uint64_t)rtas_ld(vcpu->kvm, args, 1) << 32) | rtas_ld(vcpu->kvm, args, 2);
 	union pci_config_address addr = { .w = rtas_ld(vcpu->kvm, args, 0) };
-	struct pci_device_header *dev = pci__find_dev(addr.device_number);
+	struct pci_device_header *dev =
+		pci__find_dev(pci__dev_num(addr.device_number,
+					   addr.function_number));
 	uint32_t size = rtas_ld(vcpu->kvm, args, 3);
 	uint32_t val = rtas_ld(vcpu->kvm, args, 4);
 
@@ -157,7 +163,9 @@ static void rtas_write_pci_config(struct kvm_cpu *vcpu,
 				  uint32_t nret, target_ulong rets)
 {
 	union pci_config_address addr = { .w = rtas_ld(vcpu->kvm, args, 0) };
-	struct pci_device_header *dev = pci__find_dev(addr.device_number);
+	struct pci_device_header *dev =
+		pci__find_dev(pci__dev_num(addr.device_number,
+					   addr.function_number));
 	uint32_t size = rtas_ld(vcpu->kvm, args, 1);
 	uint32_t val = rtas_ld(vcpu->kvm, args, 2);
 
@@ -296,13 +304,13 @@ int spapr_populate_pci_devices(struct kvm *kvm,
 		if (!hdr)
 			continue;
 
-		devid = dev_hdr->dev_num;
-		fn = 0; /* kvmtool doesn't yet do multifunction devices */
+		devid = pci__dev_slot(dev_hdr->dev_num);
+		fn = pci__dev_fn(dev_hdr->dev_num);
 
 		sprintf(nodename, "pci@%u,%u", devid, fn);
 
 		/* Allocate interrupt from the map */
-		if (devid > SPAPR_PCI_NUM_LSI)	{
+		if (devices >= SPAPR_PCI_NUM_LSI)	{
 			die("Unexpected behaviour in spapr_populate_pci_devices,"
 			    "wrong devid %u\n", devid);
 		}
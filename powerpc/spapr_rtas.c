@@ -20,6 +20,7 @@
 
 #include <libfdt.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 #define TOKEN_BASE      0x2000
@@ -200,6 +201,18 @@ void spapr_rtas_register(const char *name, spapr_rtas_fn fn)
 	rtas_next++;
 }
 
+/* The token that the guest finds for @name in /rtas, 0 if not registered */
+uint32_t spapr_rtas_token(const char *name)
+{
+	struct rtas_call *call;
+
+	for (call = rtas_table; call < rtas_next; call++)
+		if (!strcmp(call->name, name))
+			return TOKEN_BASE + (call - rtas_table);
+
+	return 0;
+}
+
 /*
  * This is called from the context of an open /rtas node, in order to add
  * properties for the rtas call tokens.
@@ -15,9 +15,14 @@
 #include "xics.h"
 #include "kvm/util.h"
 #include "kvm/kvm.h"
+#include "kvm/irq.h"
+#include "kvm/probe.h"
 
+#include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #include <malloc.h>
+#include <sys/ioctl.h>
 
 #define XICS_NUM_IRQS	1024
 
@@ -419,6 +424,92 @@ static void rtas_int_on(struct kvm_cpu *vcpu, uint32_t token,
 	rtas_st(vcpu->kvm, rets, 0, 0); /* Success */
 }
 
+/*
+ * KVM's XICS, emulated on XIVE hardware by the host if need be, handles the
+ * ICP hypercalls and the xive RTAS calls itself, so that neither IPIs nor
+ * EOIs exit to kvmtool.
+ */
+static int xics_fd = -1;
+
+static const char * const xics_rtas_calls[] = {
+	"ibm,set-xive", "ibm,get-xive", "ibm,int-off", "ibm,int-on",
+};
+
+static int xics_create_in_kernel(struct kvm *kvm)
+{
+	struct kvm_create_device dev = {
+		.type	= KVM_DEV_TYPE_XICS,
+	};
+	struct kvm_rtas_token_args rtas;
+	unsigned int i;
+	int j;
+
+	if (kvm->cfg.arch.userspace_xics ||
+	    !kvm__supports_extension(kvm, KVM_CAP_IRQ_XICS) ||
+	    !kvm__supports_extension(kvm, KVM_CAP_PPC_RTAS))
+		return -ENODEV;
+
+	if (ioctl(kvm->vm_fd, KVM_CREATE_DEVICE, &dev) < 0)
+		return -errno;
+
+	for (i = 0; i < ARRAY_SIZE(xics_rtas_calls); i++) {
+		memset(&rtas, 0, sizeof(rtas));
+		strcpy(rtas.name, xics_rtas_calls[i]);
+		rtas.token = spapr_rtas_token(xics_rtas_calls[i]);
+		if (ioctl(kvm->vm_fd, KVM_PPC_RTAS_DEFINE_TOKEN, &rtas) < 0)
+			die_perror("KVM_PPC_RTAS_DEFINE_TOKEN");
+	}
+
+	for (j = 0; j < kvm->nrcpus; j++) {
+		struct kvm_cpu *vcpu = kvm->cpus[j];
+		struct kvm_enable_cap cap = {
+			.cap	= KVM_CAP_IRQ_XICS,
+			.args	= { dev.fd, vcpu->cpu_id },
+		};
+
+		if (ioctl(vcpu->vcpu_fd, KVM_ENABLE_CAP, &cap) < 0)
+			die_perror("KVM_ENABLE_CAP(KVM_CAP_IRQ_XICS)");
+	}
+
+	xics_fd = dev.fd;
+	return 0;
+}
+
+/*
+ * Once the devices have their interrupts: have KVM know their sources,
+ * masked until the guest sets them up, and route them 1:1 for irqfds.
+ */
+static int xics_setup_in_kernel(struct kvm *kvm)
+{
+	u64 val = KVM_XICS_MASKED |
+		  ((u64)0xff << KVM_XICS_PRIORITY_SHIFT);
+	struct kvm_device_attr attr = {
+		.group	= KVM_DEV_XICS_GRP_SOURCES,
+		.addr	= (u64)(unsigned long)&val,
+	};
+	int nr = irq__get_nr_allocated_lines();
+	int i, r;
+
+	if (xics_fd < 0)
+		return 0;
+
+	for (i = XICS_IRQ_OFFSET; i < XICS_IRQ_OFFSET + nr; i++) {
+		attr.attr = i;
+		if (ioctl(xics_fd, KVM_SET_DEVICE_ATTR, &attr) < 0)
+			return -errno;
+
+		r = irq__add_irqchip_route(kvm, i, 0, i);
+		if (r)
+			return r;
+	}
+
+	if (irq__set_routes(kvm) < 0)
+		pr_warning("No irqfds for the XICS: %s", strerror(errno));
+
+	return 0;
+}
+late_init(xics_setup_in_kernel);
+
 static int xics_init(struct kvm *kvm)
 {
 	unsigned int i;
@@ -479,6 +570,9 @@ static int xics_init(struct kvm *kvm)
 
 	kvm->arch.icp = icp;
 
+	if (!xics_create_in_kernel(kvm))
+		pr_debug("Using the in-kernel XICS");
+
 	return 0;
 }
 dev_base_init(xics_init);
@@ -486,6 +580,23 @@ dev_base_init(xics_init);
 
 void kvm__irq_line(struct kvm *kvm, int irq, int level)
 {
+	struct kvm_irq_level irq_level = {
+		.irq	= irq,
+		.level	= level,
+	};
+
+	kvm__probe(irq_line, irq, level);
+
+	/* The sources are edge triggered, KVM ignores them going low */
+	if (xics_fd >= 0) {
+		if (!level || !irq__irqfd_trigger(kvm, irq))
+			return;
+		if (ioctl(kvm->vm_fd, KVM_IRQ_LINE, &irq_level) < 0)
+			pr_warning("KVM_IRQ_LINE for irq %d: %s", irq,
+				   strerror(errno));
+		return;
+	}
+
 	/*
 	 * Route event to ICS, which routes to ICP, which eventually does a
 	 * kvm_cpu__irq(vcpu, POWER7_EXT_IRQ, 1)
@@ -0,0 +1,316 @@
+#include "kvm/profile.h"
+#include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/read-write.h"
+#include "kvm/symbol.h"
+#include "kvm/util.h"
+
+#include <linux/err.h>
+#include <linux/list.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Samples of where the vCPUs are, taken by having all of them run a task
+ * at the profiling frequency. Identical stacks are counted together while
+ * recording, and symbolized once it is over, with the functions of the
+ * vmlinux of the guest.
+ */
+#define PROFILE_BUCKETS		4096
+#define PROFILE_MAX_STACKS	65536
+#define PROFILE_SYM_LEN		128
+
+struct profile_stack {
+	struct hlist_node	node;
+	u32			hash;
+	u32			cpu;
+	u64			count;
+	struct kvm_cpu_sample	sample;
+};
+
+struct profile {
+	struct kvm_cpu_sample	*samples;
+	int			*errs;
+	bool			callchain;
+	struct hlist_head	buckets[PROFILE_BUCKETS];
+	struct profile_stack	**stacks;
+	u32			nr_stacks;
+	u64			dropped;
+};
+
+struct profile_line {
+	char	*line;
+	u64	count;
+};
+
+static void profile__sample(struct kvm_cpu *vcpu, void *data)
+{
+	struct profile *prof = data;
+	struct kvm_cpu_sample *sample = &prof->samples[vcpu->cpu_id];
+
+	prof->errs[vcpu->cpu_id] = kvm_cpu__get_sample(vcpu, sample,
+						       prof->callchain);
+}
+
+static u32 profile__hash(u32 cpu, struct kvm_cpu_sample *sample)
+{
+	u64 hash = cpu * 0x9e3779b97f4a7c15ULL ^ sample->user;
+	u32 i;
+
+	for (i = 0; i < sample->nr; i++)
+		hash = (hash ^ sample->pc[i]) * 0x100000001b3ULL;
+
+	return hash ^ hash >> 32;
+}
+
+static bool profile__same(struct profile_stack *stack, u32 cpu,
+			  struct kvm_cpu_sample *sample)
+{
+	return stack->cpu == cpu && stack->sample.user == sample->user &&
+	       stack->sample.nr == sample->nr &&
+	       !memcmp(stack->sample.pc, sample->pc,
+		       sample->nr * sizeof(sample->pc[0]));
+}
+
+static void profile__add(struct profile *prof, u32 cpu,
+			 struct kvm_cpu_sample *sample)
+{
+	u32 hash = profile__hash(cpu, sample);
+	struct hlist_head *bucket = &prof->buckets[hash % PROFILE_BUCKETS];
+	struct profile_stack *stack;
+
+	/* Where the vCPU was in userspace isn't worth telling apart */
+	if (sample->user)
+		sample->nr = 0;
+
+	hlist_for_each_entry(stack, bucket, node) {
+		if (stack->hash == hash && profile__same(stack, cpu, sample)) {
+			stack->count++;
+			return;
+		}
+	}
+
+	if (prof->nr_stacks == PROFILE_MAX_STACKS ||
+	    !(stack = malloc(sizeof(*stack)))) {
+		prof->dropped++;
+		return;
+	}
+
+	stack->hash = hash;
+	stack->cpu = cpu;
+	stack->count = 1;
+	stack->sample = *sample;
+	hlist_add_head(&stack->node, bucket);
+	prof->stacks[prof->nr_stacks++] = stack;
+}
+
+static int profile__line_cmp(const void *a, const void *b)
+{
+	const struct profile_line *la = a, *lb = b;
+
+	return strcmp(la->line, lb->line);
+}
+
+/* The folded stack of a sample, outermost frame first */
+static char *profile__fold(struct kvm *kvm, struct profile_stack *stack)
+{
+	char sym[PROFILE_SYM_LEN], *line = NULL;
+	size_t size;
+	FILE *f;
+	int i;
+
+	f = open_memstream(&line, &size);
+	if (!f)
+		return NULL;
+
+	fprintf(f, "vcpu%u", stack->cpu);
+	if (stack->sample.user)
+		fprintf(f, ";[user]");
+
+	for (i = stack->sample.nr - 1; i >= 0; i--) {
+		if (IS_ERR_OR_NULL(symbol_lookup_func(kvm, stack->sample.pc[i],
+						      sym, sizeof(sym))))
+			snprintf(sym, sizeof(sym), "0x%llx",
+				 (unsigned long long)stack->sample.pc[i]);
+		fprintf(f, ";%s", sym);
+	}
+
+	if (fclose(f)) {
+		free(line);
+		return NULL;
+	}
+
+	return line;
+}
+
+/* Stacks that differ only by addresses within a function are merged */
+static int profile__write(struct kvm *kvm, struct profile *prof, char **out,
+			  size_t *len)
+{
+	struct profile_line *lines;
+	u32 i, nr = 0;
+	int r = 0;
+	FILE *f;
+
+	f = open_memstream(out, len);
+	lines = calloc(prof->nr_stacks, sizeof(*lines));
+	if (!f || !lines) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < prof->nr_stacks; i++) {
+		lines[nr].line = profile__fold(kvm, prof->stacks[i]);
+		lines[nr].count = prof->stacks[i]->count;
+		if (!lines[nr].line) {
+			r = -ENOMEM;
+			goto out;
+		}
+		nr++;
+	}
+
+	qsort(lines, nr, sizeof(*lines), profile__line_cmp);
+
+	for (i = 0; i < nr; i++) {
+		if (i + 1 < nr && !strcmp(lines[i].line, lines[i + 1].line)) {
+			lines[i + 1].count += lines[i].count;
+			continue;
+		}
+		fprintf(f, "%s %llu\n", lines[i].line,
+			(unsigned long long)lines[i].count);
+	}
+
+	if (prof->dropped)
+		fprintf(f, "[dropped] %llu\n", (unsigned long long)prof->dropped);
+
+out:
+	for (i = 0; i < nr; i++)
+		free(lines[i].line);
+	free(lines);
+
+	if (f && fclose(f) && !r)
+		r = -ENOMEM;
+	if (r) {
+		free(*out);
+		*out = NULL;
+	}
+
+	return r;
+}
+
+static void timespec_add_ns(struct timespec *ts, u64 ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static int profile__record(struct kvm *kvm, struct profile_params *params,
+			   char **out, size_t *len)
+{
+	struct profile prof = {
+		.callchain	= params->flags & PROFILE_F_CALLCHAIN,
+	};
+	struct kvm_cpu_task task = {
+		.func	= profile__sample,
+		.data	= &prof,
+	};
+	u64 period_ns, end, now;
+	struct timespec next;
+	int i, r = 0, err = 0;
+	u64 nr_samples = 0;
+
+	if (!params->freq || params->freq > PROFILE_MAX_FREQ ||
+	    !params->duration_ms ||
+	    params->duration_ms > PROFILE_MAX_SECONDS * 1000)
+		return -EINVAL;
+
+	/* The vCPUs wouldn't run the task until resumed */
+	if (kvm->vm_state == KVM_VMSTATE_PAUSED)
+		return -EBUSY;
+
+	prof.samples = calloc(kvm->nrcpus, sizeof(*prof.samples));
+	prof.errs = calloc(kvm->nrcpus, sizeof(*prof.errs));
+	prof.stacks = calloc(PROFILE_MAX_STACKS, sizeof(*prof.stacks));
+	if (!prof.samples || !prof.errs || !prof.stacks) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	period_ns = 1000000000ULL / params->freq;
+	end = kvm_cpu__now() + params->duration_ms * 1000000ULL;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while ((now = kvm_cpu__now()) < end) {
+		kvm_cpu__run_on_all_cpus(kvm, &task);
+
+		for (i = 0; i < kvm->nrcpus; i++) {
+			/* Parked, the sample is of a vCPU that isn't running */
+			if (!kvm->cpus[i]->thread)
+				continue;
+			if (prof.errs[i]) {
+				err = prof.errs[i];
+				continue;
+			}
+			profile__add(&prof, i, &prof.samples[i]);
+			nr_samples++;
+		}
+
+		/* Don't catch up on the samples that took too long */
+		timespec_add_ns(&next, period_ns);
+		if ((u64)next.tv_sec * 1000000000ULL + next.tv_nsec < now)
+			clock_gettime(CLOCK_MONOTONIC, &next);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	if (!nr_samples && err) {
+		r = err;
+		goto out;
+	}
+
+	r = profile__write(kvm, &prof, out, len);
+out:
+	for (i = 0; prof.stacks && i < (int)prof.nr_stacks; i++)
+		free(prof.stacks[i]);
+	free(prof.stacks);
+	free(prof.errs);
+	free(prof.samples);
+
+	return r;
+}
+
+static void profile__handle_ipc(struct kvm *kvm, int fd, u32 type, u32 len,
+				u8 *msg)
+{
+	struct profile_params params;
+	size_t out_len = 0;
+	char *out = NULL;
+	u32 size;
+	s32 r;
+
+	if (len != sizeof(params)) {
+		r = -EINVAL;
+	} else {
+		memcpy(&params, msg, sizeof(params));
+		r = profile__record(kvm, &params, &out, &out_len);
+	}
+
+	size = out_len;
+	if (write_in_full(fd, &r, sizeof(r)) < 0 ||
+	    (!r && (write_in_full(fd, &size, sizeof(size)) < 0 ||
+		    write_in_full(fd, out, size) < 0)))
+		pr_warning("Failed sending the profile");
+
+	free(out);
+}
+
+static int profile__init(struct kvm *kvm)
+{
+	return kvm_ipc__register_handler(KVM_IPC_PROFILE, profile__handle_ipc);
+}
+late_init(profile__init);
@@ -0,0 +1,181 @@
+#include "kvm/ratelimit.h"
+#include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/read-write.h"
+#include "kvm/util.h"
+#include "kvm/virtio-blk.h"
+#include "kvm/virtio-net.h"
+
+#include <linux/kernel.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+
+#define NSEC_PER_SEC	1000000000ULL
+
+static void ratelimit__bucket_set(struct ratelimit_bucket *bucket, u64 rate,
+				  u64 burst_ns)
+{
+	bucket->rate = min_t(u64, rate, RATELIMIT_MAX_RATE);
+	bucket->credit_ns = burst_ns;
+}
+
+/* Called with the lock held, or before the limiter is in use */
+static void ratelimit__update(struct ratelimit *rl,
+			      struct ratelimit_params *params)
+{
+	u32 burst_ms = params->burst_ms ?: RATELIMIT_DEFAULT_BURST_MS;
+
+	burst_ms = min_t(u32, burst_ms, RATELIMIT_MAX_BURST_MS);
+	rl->burst_ns = burst_ms * 1000000ULL;
+	rl->last = kvm_cpu__now();
+	ratelimit__bucket_set(&rl->bytes, params->bytes, rl->burst_ns);
+	ratelimit__bucket_set(&rl->ops, params->ops, rl->burst_ns);
+	__atomic_store_n(&rl->enabled, params->bytes || params->ops,
+			 __ATOMIC_RELAXED);
+}
+
+void ratelimit__init(struct ratelimit *rl, struct ratelimit_params *params)
+{
+	struct ratelimit_params none = {};
+
+	mutex_init(&rl->lock);
+	ratelimit__update(rl, params ?: &none);
+}
+
+/* New limits start with a full bucket */
+void ratelimit__set(struct ratelimit *rl, struct ratelimit_params *params)
+{
+	mutex_lock(&rl->lock);
+	ratelimit__update(rl, params);
+	mutex_unlock(&rl->lock);
+}
+
+static void ratelimit__refill(struct ratelimit *rl)
+{
+	u64 now = kvm_cpu__now();
+	s64 elapsed = now - rl->last;
+
+	rl->last = now;
+	rl->bytes.credit_ns = min_t(s64, rl->bytes.credit_ns + elapsed,
+				    rl->burst_ns);
+	rl->ops.credit_ns = min_t(s64, rl->ops.credit_ns + elapsed,
+				  rl->burst_ns);
+}
+
+static u64 ratelimit__bucket_delay(struct ratelimit_bucket *bucket)
+{
+	return bucket->rate && bucket->credit_ns < 0 ? -bucket->credit_ns : 0;
+}
+
+/* Nanoseconds until the next work may start, 0 if it can right away */
+u64 ratelimit__delay(struct ratelimit *rl)
+{
+	u64 delay;
+
+	if (!ratelimit__enabled(rl))
+		return 0;
+
+	mutex_lock(&rl->lock);
+	ratelimit__refill(rl);
+	delay = max(ratelimit__bucket_delay(&rl->bytes),
+		    ratelimit__bucket_delay(&rl->ops));
+	mutex_unlock(&rl->lock);
+
+	return delay;
+}
+
+static void ratelimit__bucket_charge(struct ratelimit_bucket *bucket, u64 n)
+{
+	u64 rate = bucket->rate;
+
+	if (!rate)
+		return;
+
+	/* Work worth more than a few seconds at once is charged for that */
+	n = min_t(u64, n, rate * 16);
+	bucket->credit_ns -= n / rate * NSEC_PER_SEC +
+			     n % rate * NSEC_PER_SEC / rate;
+}
+
+void ratelimit__charge(struct ratelimit *rl, u64 bytes, u64 ops)
+{
+	if (!ratelimit__enabled(rl))
+		return;
+
+	mutex_lock(&rl->lock);
+	ratelimit__bucket_charge(&rl->bytes, bytes);
+	ratelimit__bucket_charge(&rl->ops, ops);
+	mutex_unlock(&rl->lock);
+}
+
+/* Have timerfd expire in ns, at least a microsecond from now */
+int ratelimit__arm(int timerfd, u64 ns)
+{
+	struct itimerspec its = {};
+
+	ns = max_t(u64, ns, 1000);
+	its.it_value.tv_sec = ns / NSEC_PER_SEC;
+	its.it_value.tv_nsec = ns % NSEC_PER_SEC;
+
+	return timerfd_settime(timerfd, 0, &its, NULL) < 0 ? -errno : 0;
+}
+
+/* A rate with an optional K, M or G suffix, in powers of 1024 */
+u64 ratelimit__parse_rate(const char *val)
+{
+	char *end;
+	u64 rate;
+
+	rate = strtoull(val, &end, 10);
+	switch (*end) {
+	case 'K': case 'k': rate <<= 10; break;
+	case 'M': case 'm': rate <<= 20; break;
+	case 'G': case 'g': rate <<= 30; break;
+	}
+
+	return rate;
+}
+
+static void ratelimit__handle_ipc(struct kvm *kvm, int fd, u32 type, u32 len,
+				  u8 *msg)
+{
+	struct ratelimit_msg rmsg;
+	s32 r;
+
+	if (len != sizeof(rmsg)) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	memcpy(&rmsg, msg, sizeof(rmsg));
+	if (rmsg.params.burst_ms > RATELIMIT_MAX_BURST_MS) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	switch (rmsg.dev_type) {
+	case RATELIMIT_DEV_BLK:
+		r = virtio_blk__set_ratelimit(kvm, rmsg.dev, &rmsg.params);
+		break;
+	case RATELIMIT_DEV_NET:
+		r = virtio_net__set_ratelimit(kvm, rmsg.dev, &rmsg.params);
+		break;
+	default:
+		r = -EINVAL;
+	}
+
+out:
+	if (write_in_full(fd, &r, sizeof(r)) < 0)
+		pr_warning("Failed sending the rate limit status");
+}
+
+static int ratelimit__init_ipc(struct kvm *kvm)
+{
+	return kvm_ipc__register_handler(KVM_IPC_RATELIMIT,
+					 ratelimit__handle_ipc);
+}
+late_init(ratelimit__init_ipc);
@@ -100,7 +100,7 @@ static void aia__generate_fdt_node(void *fdt, struct kvm *kvm)
 
 static int aia__irq_routing_init(struct kvm *kvm)
 {
-	int r;
+	int gsi, r;
 	int irqlines = aia_nr_sources + 1;
 
 	/* Skip this if we have no interrupt sources */
@@ -113,19 +113,12 @@ static int aia__irq_routing_init(struct kvm *kvm)
 	 * don't need to commit these setting right now. The first actual
 	 * user (MSI routing) will engage these mappings then.
 	 */
-	for (next_gsi = 0; next_gsi < irqlines; next_gsi++) {
-		r = irq__allocate_routing_entry();
+	for (gsi = 0; gsi < irqlines; gsi++) {
+		r = irq__add_irqchip_route(kvm, gsi, IRQCHIP_AIA_NR, gsi);
 		if (r)
 			return r;
-
-		irq_routing->entries[irq_routing->nr++] =
-			(struct kvm_irq_routing_entry) {
-				.gsi = next_gsi,
-				.type = KVM_IRQ_ROUTING_IRQCHIP,
-				.u.irqchip.irqchip = IRQCHIP_AIA_NR,
-				.u.irqchip.pin = next_gsi,
-		};
 	}
+	irq__set_next_gsi(kvm, gsi);
 
 	return 0;
 }
@@ -194,10 +187,10 @@ static int aia__init(struct kvm *kvm)
 	if (ret)
 		return ret;
 
-	/* Mark IRQFD as ready */
+	/* Mark IRQFD as ready, and register those postponed until now */
 	riscv_irqchip_irqfd_ready = true;
 
-	return 0;
+	return riscv__setup_irqfd_lines(kvm);
 }
 late_init(aia__init);
 
@@ -213,8 +206,11 @@ void aia__create(struct kvm *kvm)
 		return;
 
 	err = ioctl(kvm->vm_fd, KVM_CREATE_DEVICE, &aia_device);
-	if (err)
+	if (err) {
+		pr_debug("No in-kernel AIA (%s), emulating a PLIC",
+			 strerror(errno));
 		return;
+	}
 	aia_fd = aia_device.fd;
 
 	riscv_irqchip = IRQCHIP_AIA;
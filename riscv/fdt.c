@@ -1,3 +1,4 @@
+#include "kvm/boot-cache.h"
 #include "kvm/devices.h"
 #include "kvm/fdt.h"
 #include "kvm/kvm.h"
@@ -81,10 +82,70 @@ static void dump_fdt(const char *dtb_file, void *fdt)
 	close(fd);
 }
 
+static void generate_memory_nodes(void *fdt, struct kvm *kvm)
+{
+	u64 mem_reg_prop[2], offset, size;
+	char name[32];
+	int i;
+
+	if (!kvm->cfg.nr_guest_numa) {
+		mem_reg_prop[0] = cpu_to_fdt64(kvm->arch.memory_guest_start);
+		mem_reg_prop[1] = cpu_to_fdt64(kvm->ram_size);
+
+		_FDT(fdt_begin_node(fdt, "memory"));
+		_FDT(fdt_property_string(fdt, "device_type", "memory"));
+		_FDT(fdt_property(fdt, "reg", mem_reg_prop, sizeof(mem_reg_prop)));
+		_FDT(fdt_end_node(fdt));
+		return;
+	}
+
+	/* One node per guest NUMA node, matching its RAM bank */
+	for (i = 0; i < kvm->cfg.nr_guest_numa; i++) {
+		size = kvm__numa_node_mem(kvm, i, &offset);
+		if (!size)
+			continue;
+
+		offset += kvm->arch.memory_guest_start;
+		mem_reg_prop[0] = cpu_to_fdt64(offset);
+		mem_reg_prop[1] = cpu_to_fdt64(size);
+
+		snprintf(name, sizeof(name), "memory@%llx", offset);
+		_FDT(fdt_begin_node(fdt, name));
+		_FDT(fdt_property_string(fdt, "device_type", "memory"));
+		_FDT(fdt_property(fdt, "reg", mem_reg_prop, sizeof(mem_reg_prop)));
+		_FDT(fdt_property_cell(fdt, "numa-node-id", i));
+		_FDT(fdt_end_node(fdt));
+	}
+}
+
+static void generate_distance_map(void *fdt, struct kvm *kvm)
+{
+	u32 matrix[KVM_MAX_NUMA_BANKS * KVM_MAX_NUMA_BANKS * 3];
+	int i, j, n = 0;
+
+	if (!kvm->cfg.nr_guest_numa)
+		return;
+
+	for (i = 0; i < kvm->cfg.nr_guest_numa; i++) {
+		for (j = 0; j < kvm->cfg.nr_guest_numa; j++) {
+			matrix[n++] = cpu_to_fdt32(i);
+			matrix[n++] = cpu_to_fdt32(j);
+			matrix[n++] = cpu_to_fdt32(i == j ?
+						   KVM_NUMA_LOCAL_DISTANCE :
+						   KVM_NUMA_REMOTE_DISTANCE);
+		}
+	}
+
+	_FDT(fdt_begin_node(fdt, "distance-map"));
+	_FDT(fdt_property_string(fdt, "compatible", "numa-distance-map-v1"));
+	_FDT(fdt_property(fdt, "distance-matrix", matrix, n * sizeof(u32)));
+	_FDT(fdt_end_node(fdt));
+}
+
 #define CPU_NAME_MAX_LEN 15
 static void generate_cpu_nodes(void *fdt, struct kvm *kvm)
 {
-	int cpu, pos, i, index, valid_isa_len;
+	int cpu, pos, i, index, valid_isa_len, numa_node;
 	const char *valid_isa_order = "IEMAFDQCLBJTPVNSUHKORWXYZG";
 	int arr_sz = ARRAY_SIZE(isa_info_arr);
 	unsigned long cbom_blksz = 0, cboz_blksz = 0, satp_mode = 0;
@@ -202,6 +263,10 @@ static void generate_cpu_nodes(void *fdt, struct kvm *kvm)
 		_FDT(fdt_property_cell(fdt, "reg", cpu));
 		_FDT(fdt_property_string(fdt, "status", "okay"));
 
+		numa_node = kvm__numa_node_of_cpu(kvm, cpu);
+		if (numa_node >= 0)
+			_FDT(fdt_property_cell(fdt, "numa-node-id", numa_node));
+
 		_FDT(fdt_begin_node(fdt, "interrupt-controller"));
 		_FDT(fdt_property_string(fdt, "compatible", "riscv,cpu-intc"));
 		_FDT(fdt_property_cell(fdt, "#interrupt-cells", 1));
@@ -216,14 +281,36 @@ static void generate_cpu_nodes(void *fdt, struct kvm *kvm)
 	_FDT(fdt_end_node(fdt));
 }
 
+/* What the tree depends on besides what boot_cache__key_init() hashes */
+static void boot_cache_key_arch(struct kvm *kvm, struct boot_cache_key *key)
+{
+	struct kvm_config_arch *cfg = &kvm->cfg.arch;
+	int cpu;
+
+	boot_cache__key_add_val(key, kvm->arch.initrd_guest_start);
+	boot_cache__key_add_val(key, kvm->arch.initrd_size);
+	boot_cache__key_add_val(key, kvm->arch.dtb_guest_start);
+	boot_cache__key_add_val(key, cfg->custom_mvendorid);
+	boot_cache__key_add_val(key, cfg->custom_marchid);
+	boot_cache__key_add_val(key, cfg->custom_mimpid);
+	boot_cache__key_add(key, cfg->ext_disabled, sizeof(cfg->ext_disabled));
+	boot_cache__key_add(key, cfg->sbi_ext_disabled,
+			    sizeof(cfg->sbi_ext_disabled));
+	boot_cache__key_add_val(key, riscv_irqchip);
+	boot_cache__key_add_val(key, riscv_irqchip_phandle);
+	boot_cache__key_add_val(key, riscv_irqchip_msi_phandle);
+	boot_cache__key_add_str(key, fdt_stdout_path);
+
+	for (cpu = 0; cpu < kvm->nrcpus; cpu++)
+		boot_cache__key_add_val(key, kvm->cpus[cpu]->riscv_isa);
+}
+
 static int setup_fdt(struct kvm *kvm)
 {
 	struct device_header *dev_hdr;
+	struct boot_cache_key key;
+	u64 start = kvm_cpu__now();
 	u8 staging_fdt[FDT_MAX_SIZE];
-	u64 mem_reg_prop[]	= {
-		cpu_to_fdt64(kvm->arch.memory_guest_start),
-		cpu_to_fdt64(kvm->ram_size),
-	};
 	char *str;
 	void *fdt		= staging_fdt;
 	void *fdt_dest		= guest_flat_to_host(kvm,
@@ -231,6 +318,14 @@ static int setup_fdt(struct kvm *kvm)
 	void (*generate_mmio_fdt_nodes)(void *, struct device_header *,
 					void (*)(void *, u8, enum irq_type));
 
+	boot_cache__key_init(kvm, &key);
+	boot_cache_key_arch(kvm, &key);
+	if (boot_cache__load(kvm, &key, "dtb", fdt_dest, FDT_MAX_SIZE) >= 0) {
+		free(fdt_stdout_path);
+		fdt_stdout_path = NULL;
+		goto out;
+	}
+
 	/* Create new tree without a reserve map */
 	_FDT(fdt_create(fdt, FDT_MAX_SIZE));
 	_FDT(fdt_finish_reservemap(fdt));
@@ -270,10 +365,8 @@ static int setup_fdt(struct kvm *kvm)
 	_FDT(fdt_end_node(fdt));
 
 	/* Memory */
-	_FDT(fdt_begin_node(fdt, "memory"));
-	_FDT(fdt_property_string(fdt, "device_type", "memory"));
-	_FDT(fdt_property(fdt, "reg", mem_reg_prop, sizeof(mem_reg_prop)));
-	_FDT(fdt_end_node(fdt));
+	generate_memory_nodes(fdt, kvm);
+	generate_distance_map(fdt, kvm);
 
 	/* CPUs */
 	generate_cpu_nodes(fdt, kvm);
@@ -333,7 +426,10 @@ static int setup_fdt(struct kvm *kvm)
 
 	_FDT(fdt_open_into(fdt, fdt_dest, FDT_MAX_SIZE));
 	_FDT(fdt_pack(fdt_dest));
+	boot_cache__store(kvm, &key, "dtb", fdt_dest, fdt_totalsize(fdt_dest),
+			  start);
 
+out:
 	if (kvm->cfg.arch.dump_dtb_filename)
 		dump_fdt(kvm->cfg.arch.dump_dtb_filename, fdt_dest);
 	return 0;
@@ -56,6 +56,10 @@
 
 #define ARCH_HAS_PCI_EXP	1
 
+/* NUMA topology is described in the device tree */
+#define ARCH_HAS_GUEST_NUMA	1
+#define ARCH_HAS_CPU_HOTPLUG	1
+
 struct kvm;
 
 struct kvm_arch {
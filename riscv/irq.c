@@ -2,6 +2,7 @@
 #include "kvm/kvm-cpu.h"
 #include "kvm/irq.h"
 #include "kvm/fdt.h"
+#include "kvm/probe.h"
 #include "kvm/virtio.h"
 
 enum irqchip_type riscv_irqchip = IRQCHIP_UNKNOWN;
@@ -18,7 +19,13 @@ void kvm__irq_line(struct kvm *kvm, int irq, int level)
 {
 	struct kvm_irq_level irq_level;
 
+	kvm__probe(irq_line, irq, level);
+
 	if (riscv_irqchip_inkernel) {
+		if (riscv_irqchip_irqfd_ready &&
+		    !irq__irqfd_line(kvm, irq, level))
+			return;
+
 		irq_level.irq = irq;
 		irq_level.level = !!level;
 		if (ioctl(kvm->vm_fd, KVM_IRQ_LINE, &irq_level) < 0)
@@ -35,7 +42,12 @@ void kvm__irq_line(struct kvm *kvm, int irq, int level)
 
 void kvm__irq_trigger(struct kvm *kvm, int irq)
 {
+	kvm__probe(irq_trigger, irq);
+
 	if (riscv_irqchip_inkernel) {
+		if (riscv_irqchip_irqfd_ready && !irq__irqfd_trigger(kvm, irq))
+			return;
+
 		kvm__irq_line(kvm, irq, VIRTIO_IRQ_HIGH);
 		kvm__irq_line(kvm, irq, VIRTIO_IRQ_LOW);
 	} else {
@@ -19,6 +19,12 @@ int kvm_cpu__get_debug_fd(void)
 	return debug_fd;
 }
 
+/* The SBI extensions that are enabled even if KVM leaves them off */
+static const int sbi_ext_enabled[] = {
+	KVM_RISCV_SBI_EXT_DBCN,
+	KVM_RISCV_SBI_EXT_STA,
+};
+
 struct kvm_cpu *kvm_cpu__arch_init(struct kvm *kvm, unsigned long cpu_id)
 {
 	struct kvm_cpu *vcpu;
@@ -106,17 +112,32 @@ struct kvm_cpu *kvm_cpu__arch_init(struct kvm *kvm, unsigned long cpu_id)
 			die("KVM_SET_ONE_REG failed (sbi_ext %d)", i);
 	}
 
-	/* Force enable SBI debug console if not disabled from command line */
-	if (!kvm->cfg.arch.sbi_ext_disabled[KVM_RISCV_SBI_EXT_DBCN]) {
+	/*
+	 * Force enable the SBI debug console and steal-time accounting if not
+	 * disabled from command line. With STA, each vCPU of the guest gives
+	 * KVM a shared memory region of its own, that KVM updates in the
+	 * kernel with the time the vCPU was runnable but not running.
+	 */
+	for (i = 0; i < (int)ARRAY_SIZE(sbi_ext_enabled); i++) {
+		if (kvm->cfg.arch.sbi_ext_disabled[sbi_ext_enabled[i]])
+			continue;
 		id = 1;
 		reg.id = RISCV_SBI_EXT_REG(KVM_REG_RISCV_SBI_SINGLE,
-					   KVM_RISCV_SBI_EXT_DBCN);
+					   sbi_ext_enabled[i]);
 		reg.addr = (unsigned long)&id;
-		if (ioctl(vcpu->vcpu_fd, KVM_SET_ONE_REG, &reg) < 0)
+		if (ioctl(vcpu->vcpu_fd, KVM_SET_ONE_REG, &reg) < 0 && !cpu_id)
 			pr_warning("KVM_SET_ONE_REG failed (sbi_ext %d)",
-				   KVM_RISCV_SBI_EXT_DBCN);
+				   sbi_ext_enabled[i]);
 	}
 
+	/* Without Sstc, every timer the guest programs is an SBI call */
+	id = 0;
+	reg.id = RISCV_ISA_EXT_REG(KVM_RISCV_ISA_EXT_SSTC);
+	reg.addr = (unsigned long)&id;
+	if (!cpu_id && !kvm->cfg.arch.ext_disabled[KVM_RISCV_ISA_EXT_SSTC] &&
+	    (ioctl(vcpu->vcpu_fd, KVM_GET_ONE_REG, &reg) < 0 || !id))
+		pr_info("The host has no Sstc, guest timers trap to SBI");
+
 	/* Populate the vcpu structure. */
 	vcpu->kvm		= kvm;
 	vcpu->cpu_id		= cpu_id;
@@ -1,7 +1,5 @@
 #include "kvm/kvm.h"
 #include "kvm/util.h"
-#include "kvm/8250-serial.h"
-#include "kvm/virtio-console.h"
 #include "kvm/fdt.h"
 
 #include <linux/kernel.h>
@@ -38,7 +36,7 @@ void kvm__init_ram(struct kvm *kvm)
 	phys_size	= kvm->ram_size;
 	host_mem	= kvm->ram_start;
 
-	err = kvm__register_ram(kvm, phys_start, phys_size, host_mem);
+	err = kvm__register_numa_ram(kvm, phys_start, phys_size, host_mem);
 	if (err)
 		die("Failed to register %lld bytes of memory at physical "
 		    "address 0x%llx [err %d]", phys_size, phys_start, err);
@@ -51,35 +49,21 @@ void kvm__arch_delete_ram(struct kvm *kvm)
 	munmap(kvm->arch.ram_alloc_start, kvm->arch.ram_alloc_size);
 }
 
-void kvm__arch_read_term(struct kvm *kvm)
+void kvm__arch_set_cmdline(struct kvm *kvm, char *cmdline, bool video)
 {
-	serial8250__update_consoles(kvm);
-	virtio_console__inject_interrupt(kvm);
 }
 
-void kvm__arch_set_cmdline(char *cmdline, bool video)
-{
-}
-
-#if __riscv_xlen == 64
-#define HUGEPAGE_SIZE	SZ_2M
-#else
-#define HUGEPAGE_SIZE	SZ_4M
-#endif
-
 void kvm__arch_init(struct kvm *kvm)
 {
 	/*
-	 * Allocate guest memory. We must align our buffer to 64K to
-	 * correlate with the maximum guest page size for virtio-mmio.
-	 * If using THP, then our minimal alignment becomes hugepage
-	 * size. The hugepage size is always greater than 64K, so
-	 * let's go with that.
+	 * Allocate guest memory. The mapping is aligned to the largest host
+	 * page that can back it, which is always greater than the 64K that
+	 * the maximum guest page size for virtio-mmio needs. RAM starts at a
+	 * guest physical address aligned as much, so the G-stage can use
+	 * huge pages.
 	 */
 	kvm->ram_size = min(kvm->cfg.ram_size, (u64)RISCV_MAX_MEMORY(kvm));
 	kvm->arch.ram_alloc_size = kvm->ram_size;
-	if (!kvm->cfg.hugetlbfs_path)
-		kvm->arch.ram_alloc_size += HUGEPAGE_SIZE;
 	kvm->arch.ram_alloc_start = mmap_anon_or_hugetlbfs(kvm,
 						kvm->cfg.hugetlbfs_path,
 						kvm->arch.ram_alloc_size);
@@ -88,11 +72,7 @@ void kvm__arch_init(struct kvm *kvm)
 		die("Failed to map %lld bytes for guest memory (%d)",
 		    kvm->arch.ram_alloc_size, errno);
 
-	kvm->ram_start = (void *)ALIGN((unsigned long)kvm->arch.ram_alloc_start,
-					SZ_2M);
-
-	madvise(kvm->arch.ram_alloc_start, kvm->arch.ram_alloc_size,
-		MADV_MERGEABLE);
+	kvm->ram_start = kvm->arch.ram_alloc_start;
 
 	madvise(kvm->arch.ram_alloc_start, kvm->arch.ram_alloc_size,
 		MADV_HUGEPAGE);
@@ -125,7 +105,7 @@ bool kvm__arch_load_kernel_image(struct kvm *kvm, int fd_kernel, int fd_initrd,
 
 	pos = kvm->ram_start + kernel_offset;
 	kvm->arch.kern_guest_start = host_to_guest_flat(kvm, pos);
-	file_size = read_file(fd_kernel, pos, limit - pos);
+	file_size = kvm__read_image(kvm, fd_kernel, pos, limit - pos);
 	if (file_size < 0) {
 		if (errno == ENOMEM)
 			die("kernel image too big to fit in guest memory.");
@@ -152,18 +132,21 @@ bool kvm__arch_load_kernel_image(struct kvm *kvm, int fd_kernel, int fd_initrd,
 	if (fd_initrd != -1) {
 		struct stat sb;
 		unsigned long initrd_start;
+		/* Whole pages of it can be mapped with --map-images */
+		unsigned long align = kvm->cfg.map_images ? getpagesize() :
+							    INITRD_ALIGN;
 
 		if (fstat(fd_initrd, &sb))
 			die_perror("fstat");
 
-		pos = limit - (sb.st_size + INITRD_ALIGN);
-		guest_addr = ALIGN(host_to_guest_flat(kvm, pos), INITRD_ALIGN);
+		pos = limit - (sb.st_size + align);
+		guest_addr = ALIGN(host_to_guest_flat(kvm, pos), align);
 		pos = guest_flat_to_host(kvm, guest_addr);
 		if (pos < kernel_end)
 			die("initrd overlaps with kernel image.");
 
 		initrd_start = guest_addr;
-		file_size = read_file(fd_initrd, pos, limit - pos);
+		file_size = kvm__read_image(kvm, fd_initrd, pos, limit - pos);
 		if (file_size == -1) {
 			if (errno == ENOMEM)
 				die("initrd too big to fit in guest memory.");
@@ -80,7 +80,8 @@ void pci__generate_fdt_nodes(void *fdt)
 		*entry = (struct of_interrupt_map_entry) {
 			.pci_irq_mask = {
 				.pci_addr = {
-					.hi	= cpu_to_fdt32(of_pci_b_ddddd(dev_num)),
+					.hi	= cpu_to_fdt32(of_pci_b_ddddd(pci__dev_slot(dev_num)) |
+							    of_pci_b_fff(pci__dev_fn(dev_num))),
 					.mid	= 0,
 					.lo	= 0,
 				},
@@ -103,7 +104,8 @@ void pci__generate_fdt_nodes(void *fdt)
 	if (nentries) {
 		struct of_pci_irq_mask irq_mask = {
 			.pci_addr = {
-				.hi	= cpu_to_fdt32(of_pci_b_ddddd(-1)),
+				.hi	= cpu_to_fdt32(of_pci_b_ddddd(-1) |
+						    of_pci_b_fff(-1)),
 				.mid	= 0,
 				.lo	= 0,
 			},
@@ -115,6 +115,8 @@ struct plic_context {
 	u8 irq_pending_priority[MAX_DEVICES];
 	u32 irq_claimed[MAX_DEVICES/32];
 	u32 irq_autoclear[MAX_DEVICES/32];
+	/* What the vCPU was last told with KVM_INTERRUPT */
+	bool irq_asserted;
 };
 
 struct plic_state {
@@ -143,18 +145,18 @@ static u32 __plic_context_best_pending_irq(struct plic_state *s,
 					   struct plic_context *c)
 {
 	u8 best_irq_prio = 0;
-	u32 i, j, irq, best_irq = 0;
+	u32 i, irq, best_irq = 0;
+	u32 active;
 
+	/* Only look at the sources that are pending and not claimed */
 	for (i = 0; i < s->num_irq_word; i++) {
-		if (!c->irq_pending[i])
-			continue;
+		active = c->irq_pending[i] & ~c->irq_claimed[i];
 
-		for (j = 0; j < 32; j++) {
-			irq = i * 32 + j;
-			if ((s->num_irq <= irq) ||
-			    !(c->irq_pending[i] & (1 << j)) ||
-			    (c->irq_claimed[i] & (1 << j)))
-				continue;
+		while (active) {
+			irq = i * 32 + __builtin_ctz(active);
+			active &= active - 1;
+			if (s->num_irq <= irq)
+				break;
 
 			if (!best_irq ||
 			    (best_irq_prio < c->irq_pending_priority[irq])) {
@@ -171,25 +173,27 @@ static u32 __plic_context_best_pending_irq(struct plic_state *s,
 static void __plic_context_irq_update(struct plic_state *s,
 				      struct plic_context *c)
 {
-	u32 best_irq = __plic_context_best_pending_irq(s, c);
-	u32 virq = (best_irq) ? KVM_INTERRUPT_SET : KVM_INTERRUPT_UNSET;
+	bool pending = __plic_context_best_pending_irq(s, c) != 0;
+	u32 virq = pending ? KVM_INTERRUPT_SET : KVM_INTERRUPT_UNSET;
+
+	/* Most updates leave the external interrupt of the vCPU as it was */
+	if (pending == c->irq_asserted)
+		return;
 
 	if (ioctl(c->vcpu->vcpu_fd, KVM_INTERRUPT, &virq) < 0)
 		pr_warning("KVM_INTERRUPT failed");
+	else
+		c->irq_asserted = pending;
 }
 
 /* Note: Must be called with c->irq_lock held */
 static u32 __plic_context_irq_claim(struct plic_state *s,
 				    struct plic_context *c)
 {
-	u32 virq = KVM_INTERRUPT_UNSET;
 	u32 best_irq = __plic_context_best_pending_irq(s, c);
 	u32 best_irq_word = best_irq / 32;
 	u32 best_irq_mask = (1 << (best_irq % 32));
 
-	if (ioctl(c->vcpu->vcpu_fd, KVM_INTERRUPT, &virq) < 0)
-		pr_warning("KVM_INTERRUPT failed");
-
 	if (best_irq) {
 		if (c->irq_autoclear[best_irq_word] & best_irq_mask) {
 			c->irq_pending[best_irq_word] &= ~best_irq_mask;
@@ -504,7 +508,7 @@ static void plic__generate_fdt_node(void *fdt, struct kvm *kvm)
 
 static int plic__irq_routing_init(struct kvm *kvm)
 {
-	int r;
+	int gsi, r;
 
 	/*
 	 * This describes the default routing that the kernel uses without
@@ -512,19 +516,12 @@ static int plic__irq_routing_init(struct kvm *kvm)
 	 * don't need to commit these setting right now. The first actual
 	 * user (MSI routing) will engage these mappings then.
 	 */
-	for (next_gsi = 0; next_gsi < MAX_DEVICES; next_gsi++) {
-		r = irq__allocate_routing_entry();
+	for (gsi = 0; gsi < MAX_DEVICES; gsi++) {
+		r = irq__add_irqchip_route(kvm, gsi, IRQCHIP_PLIC_NR, gsi);
 		if (r)
 			return r;
-
-		irq_routing->entries[irq_routing->nr++] =
-			(struct kvm_irq_routing_entry) {
-				.gsi = next_gsi,
-				.type = KVM_IRQ_ROUTING_IRQCHIP,
-				.u.irqchip.irqchip = IRQCHIP_PLIC_NR,
-				.u.irqchip.pin = next_gsi,
-		};
 	}
+	irq__set_next_gsi(kvm, gsi);
 
 	return 0;
 }
@@ -0,0 +1,522 @@
+#include "kvm/snapshot.h"
+
+#include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/read-write.h"
+#include "kvm/util.h"
+
+#include <linux/bitmap.h>
+#include <linux/userfaultfd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * With --restore-mode=uffd, guest RAM stays anonymous memory registered with
+ * userfaultfd, and a thread copies the pages in from the memory file:
+ *
+ * - The pages in the working set file of the snapshot are loaded before the
+ *   vCPUs start, sorted and merged into a few large reads.
+ * - A fault loads a window of pages from the faulting one. The window grows
+ *   while faults follow each other, and falls back to its minimum otherwise.
+ * - Once no fault came for UFFD_IDLE_MS, the rest of the file is loaded in
+ *   the background, between faults, and the thread exits when it is done.
+ *
+ * Without a working set file, the pages that faulted until then are written
+ * to one, for the next restore.
+ */
+#define UFFD_MIN_WINDOW		16		/* In pages */
+#define UFFD_MAX_WINDOW		512
+#define UFFD_MERGE_GAP		16
+#define UFFD_BACKGROUND_CHUNK	SZ_1M
+#define UFFD_IDLE_MS		10
+
+struct uffd_loader {
+	struct kvm	*kvm;
+	int		uffd;
+	int		fd;
+	long		page_size;
+	u64		nr_pages;
+	/* Pages that are in guest RAM, or that aren't RAM */
+	unsigned long	*loaded;
+	/* Pages that aren't holes of the memory file */
+	unsigned long	*data;
+	void		*buf;
+	u64		buf_pages;
+
+	/* The page after the last fault window, and the size of the next */
+	u64		next;
+	u64		window;
+
+	bool		background;
+	u64		cursor;
+
+	bool		recording;
+	u64		*faults;
+	size_t		nr_faults;
+	size_t		max_faults;
+	char		workingset[PATH_MAX];
+
+	u64		start;
+	u64		nr_fault_msgs;
+};
+
+/* Fill @nr pages from @page, which aren't loaded yet, from the file or with zeroes */
+static int uffd__fill(struct uffd_loader *l, u64 page, u64 nr, bool data)
+{
+	long ps = l->page_size;
+	size_t off = 0;
+	s64 done;
+	int r;
+
+	if (data && pread_in_full(l->fd, l->buf, nr * ps, page * ps) !=
+		    (ssize_t)(nr * ps))
+		return -EIO;
+
+	while (nr) {
+		unsigned long addr = (unsigned long)l->kvm->ram_start + page * ps;
+
+		if (data) {
+			struct uffdio_copy copy = {
+				.dst	= addr,
+				.src	= (unsigned long)l->buf + off,
+				.len	= nr * ps,
+			};
+
+			r = ioctl(l->uffd, UFFDIO_COPY, &copy);
+			done = copy.copy;
+		} else {
+			struct uffdio_zeropage zero = {
+				.range	= { .start = addr, .len = nr * ps },
+			};
+
+			r = ioctl(l->uffd, UFFDIO_ZEROPAGE, &zero);
+			done = zero.zeropage;
+		}
+
+		if (r == 0)
+			done = nr * ps;
+		else if (errno == EEXIST)
+			/* Something else mapped the first page already */
+			done = ps;
+		else if (errno != EAGAIN)
+			return -errno;
+		else if (done < 0)
+			done = 0;
+
+		bitmap_set(l->loaded, page, done / ps);
+		page += done / ps;
+		nr -= done / ps;
+		off += done;
+	}
+
+	return 0;
+}
+
+/* Load the pages in [@first, @first + @nr) that aren't there yet */
+static int uffd__load(struct uffd_loader *l, u64 first, u64 nr)
+{
+	u64 end = min(first + nr, l->nr_pages);
+	u64 page = first, start;
+	bool data;
+	int r;
+
+	while (page < end) {
+		if (test_bit(page, l->loaded)) {
+			page++;
+			continue;
+		}
+
+		start = page;
+		data = test_bit(page, l->data);
+		while (page < end && page - start < l->buf_pages &&
+		       !test_bit(page, l->loaded) &&
+		       !!test_bit(page, l->data) == data)
+			page++;
+
+		r = uffd__fill(l, start, page - start, data);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static void uffd__record(struct uffd_loader *l, u64 page)
+{
+	u64 *faults;
+
+	if (l->nr_faults == l->max_faults) {
+		size_t max = max_t(size_t, l->max_faults * 2, 1024);
+
+		faults = realloc(l->faults, max * sizeof(*faults));
+		if (!faults) {
+			l->recording = false;
+			return;
+		}
+		l->faults = faults;
+		l->max_faults = max;
+	}
+
+	l->faults[l->nr_faults++] = page * l->page_size;
+}
+
+static void uffd__handle_fault(struct uffd_loader *l, u64 addr)
+{
+	u64 page = (addr - (unsigned long)l->kvm->ram_start) / l->page_size;
+	int r;
+
+	if (page >= l->nr_pages)
+		return;
+
+	if (test_bit(page, l->loaded)) {
+		/*
+		 * The guest dropped the page since, with the balloon for
+		 * example, and gets zeroes as it would without userfaultfd.
+		 * Otherwise the fault was already served.
+		 */
+		struct uffdio_zeropage zero = {
+			.range = {
+				.start	= addr & ~(l->page_size - 1),
+				.len	= l->page_size,
+			},
+		};
+		struct uffdio_range wake = zero.range;
+
+		if (ioctl(l->uffd, UFFDIO_ZEROPAGE, &zero) < 0 &&
+		    errno == EEXIST)
+			ioctl(l->uffd, UFFDIO_WAKE, &wake);
+		return;
+	}
+
+	if (page >= l->next && page < l->next + l->window)
+		l->window = min_t(u64, l->window * 2, UFFD_MAX_WINDOW);
+	else
+		l->window = UFFD_MIN_WINDOW;
+
+	r = uffd__load(l, page, l->window);
+	if (r < 0)
+		die("snapshot: unable to load guest page 0x%llx (%d)",
+		    (unsigned long long)page * l->page_size, r);
+
+	l->next = page + l->window;
+	l->nr_fault_msgs++;
+
+	if (l->recording)
+		uffd__record(l, page);
+}
+
+static void uffd__handle_faults(struct uffd_loader *l)
+{
+	struct uffd_msg msg;
+	ssize_t n;
+
+	for (;;) {
+		n = read(l->uffd, &msg, sizeof(msg));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return;
+			die_perror("snapshot: userfaultfd read");
+		}
+
+		if (n == sizeof(msg) && msg.event == UFFD_EVENT_PAGEFAULT)
+			uffd__handle_fault(l, msg.arg.pagefault.address);
+	}
+}
+
+static void uffd__save_workingset(struct uffd_loader *l)
+{
+	char tmp[PATH_MAX + 4];
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", l->workingset);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		goto err;
+
+	if (write_in_full(fd, l->faults, l->nr_faults * sizeof(*l->faults)) < 0) {
+		close(fd);
+		unlink(tmp);
+		goto err;
+	}
+	close(fd);
+
+	if (rename(tmp, l->workingset) == 0)
+		return;
+	unlink(tmp);
+
+err:
+	pr_warning("snapshot: unable to record the working set to %s",
+		   l->workingset);
+}
+
+static void uffd__finish(struct uffd_loader *l)
+{
+	struct kvm_mem_bank *bank;
+
+	/* Pages that the guest drops now are zeroes without help */
+	mutex_lock(&l->kvm->mem_banks_lock);
+	list_for_each_entry(bank, &l->kvm->mem_banks, list) {
+		struct uffdio_range range = {
+			.start	= (unsigned long)bank->host_addr,
+			.len	= bank->size,
+		};
+
+		if (bank->type == KVM_MEM_TYPE_RAM)
+			ioctl(l->uffd, UFFDIO_UNREGISTER, &range);
+	}
+	mutex_unlock(&l->kvm->mem_banks_lock);
+
+	pr_info("snapshot: guest RAM loaded in %.3f ms, after %llu faults",
+		(kvm_cpu__now() - l->start) / 1e6,
+		(unsigned long long)l->nr_fault_msgs);
+
+	if (l->recording)
+		uffd__save_workingset(l);
+
+	close(l->uffd);
+	close(l->fd);
+	free(l->faults);
+	free(l->buf);
+	free(l->data);
+	free(l->loaded);
+	free(l);
+}
+
+static void *uffd__thread(void *arg)
+{
+	struct uffd_loader *l = arg;
+	struct pollfd pfd = {
+		.fd	= l->uffd,
+		.events	= POLLIN,
+	};
+	int r;
+
+	kvm__set_thread_name("kvm-uffd");
+
+	while (l->cursor < l->nr_pages) {
+		r = poll(&pfd, 1, l->background ? 0 : UFFD_IDLE_MS);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			die_perror("snapshot: userfaultfd poll");
+		}
+
+		if (r > 0) {
+			uffd__handle_faults(l);
+			continue;
+		}
+
+		/* The guest is quiet, load the next chunk of what's left */
+		l->background = true;
+		r = uffd__load(l, l->cursor,
+			       UFFD_BACKGROUND_CHUNK / l->page_size);
+		if (r < 0)
+			die("snapshot: unable to load guest RAM (%d)", r);
+		l->cursor += UFFD_BACKGROUND_CHUNK / l->page_size;
+	}
+
+	uffd__finish(l);
+
+	return NULL;
+}
+
+static int uffd__cmp_offset(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Load the working set, merging pages close to each other into one read */
+static int uffd__load_workingset(struct uffd_loader *l)
+{
+	u64 *offsets, start = 0, end = 0, page;
+	size_t i, n;
+	struct stat st;
+	int fd, r = 0;
+
+	fd = open(l->workingset, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		l->recording = errno == ENOENT;
+		return 0;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	n = st.st_size / sizeof(*offsets);
+	offsets = malloc(n * sizeof(*offsets) ?: 1);
+	if (!offsets) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	if (read_in_full(fd, offsets, n * sizeof(*offsets)) !=
+	    (ssize_t)(n * sizeof(*offsets))) {
+		r = -EIO;
+		goto out;
+	}
+
+	qsort(offsets, n, sizeof(*offsets), uffd__cmp_offset);
+
+	for (i = 0; i < n; i++) {
+		page = offsets[i] / l->page_size;
+		if (page >= l->nr_pages)
+			break;
+
+		if (end && page < end + UFFD_MERGE_GAP) {
+			end = max(end, page + 1);
+			continue;
+		}
+
+		if (end) {
+			r = uffd__load(l, start, end - start);
+			if (r < 0)
+				goto out;
+		}
+		start = page;
+		end = page + 1;
+	}
+
+	if (end)
+		r = uffd__load(l, start, end - start);
+
+out:
+	free(offsets);
+	close(fd);
+	return r;
+}
+
+/* Find the pages of the memory file that aren't holes */
+static void uffd__scan_data(struct uffd_loader *l)
+{
+	off_t size = l->nr_pages * l->page_size;
+	off_t data = 0, hole;
+
+	for (;;) {
+		data = lseek(l->fd, data, SEEK_DATA);
+		if (data < 0 || data >= size)
+			break;
+
+		hole = lseek(l->fd, data, SEEK_HOLE);
+		if (hole < 0 || hole > size)
+			hole = size;
+
+		data -= data % l->page_size;
+		bitmap_set(l->data, data / l->page_size,
+			   DIV_ROUND_UP(hole - data, l->page_size));
+		data = hole;
+	}
+}
+
+int snapshot__uffd_map_ram(struct kvm *kvm, const char *dir, int fd)
+{
+	struct uffdio_api api = { .api = UFFD_API };
+	struct kvm_mem_bank *bank;
+	struct uffd_loader *l;
+	pthread_t thread;
+	size_t bitmap_size;
+	int r;
+
+	l = calloc(1, sizeof(*l));
+	if (!l)
+		return -ENOMEM;
+
+	l->kvm = kvm;
+	l->start = kvm_cpu__now();
+	l->page_size = getpagesize();
+	l->nr_pages = kvm->ram_size / l->page_size;
+	l->window = UFFD_MIN_WINDOW;
+	l->buf_pages = max_t(u64, UFFD_MAX_WINDOW,
+			     UFFD_BACKGROUND_CHUNK / l->page_size);
+	snprintf(l->workingset, sizeof(l->workingset), "%s/%s", dir,
+		 SNAPSHOT_WORKINGSET);
+
+	bitmap_size = BITS_TO_LONGS(l->nr_pages) * sizeof(long);
+	l->loaded = malloc(bitmap_size);
+	l->data = calloc(1, bitmap_size);
+	l->buf = malloc(l->buf_pages * l->page_size);
+	l->fd = dup(fd);
+	l->uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (!l->loaded || !l->data || !l->buf || l->fd < 0 || l->uffd < 0) {
+		r = -errno;
+		if (l->uffd < 0)
+			pr_err("snapshot: userfaultfd isn't available, see vm.unprivileged_userfaultfd");
+		goto err;
+	}
+
+	if (ioctl(l->uffd, UFFDIO_API, &api) < 0) {
+		r = -errno;
+		goto err;
+	}
+
+	memset(l->loaded, 0xff, bitmap_size);
+	uffd__scan_data(l);
+
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		struct uffdio_register reg = {
+			.range	= {
+				.start	= (unsigned long)bank->host_addr,
+				.len	= bank->size,
+			},
+			.mode	= UFFDIO_REGISTER_MODE_MISSING,
+		};
+		u64 page = (bank->host_addr - kvm->ram_start) / l->page_size;
+		u64 i;
+
+		if (bank->type != KVM_MEM_TYPE_RAM)
+			continue;
+
+		/* Drop what setting up the guest wrote, the snapshot has it */
+		if (madvise(bank->host_addr, bank->size, MADV_DONTNEED) < 0 ||
+		    ioctl(l->uffd, UFFDIO_REGISTER, &reg) < 0) {
+			r = -errno;
+			goto err;
+		}
+
+		for (i = 0; i < bank->size / l->page_size; i++)
+			clear_bit(page + i, l->loaded);
+	}
+
+	r = uffd__load_workingset(l);
+	if (r < 0)
+		goto err;
+
+	pr_debug("snapshot: working set loaded in %.3f ms",
+		 (kvm_cpu__now() - l->start) / 1e6);
+
+	if (pthread_create(&thread, NULL, uffd__thread, l) != 0) {
+		r = -EAGAIN;
+		goto err;
+	}
+	pthread_detach(thread);
+
+	return 0;
+
+err:
+	if (l->uffd >= 0)
+		close(l->uffd);
+	if (l->fd >= 0)
+		close(l->fd);
+	free(l->buf);
+	free(l->data);
+	free(l->loaded);
+	free(l);
+	return r;
+}
@@ -0,0 +1,1153 @@
+#include "kvm/snapshot.h"
+
+#include "kvm/dirty-log.h"
+#include "kvm/disk-image.h"
+#include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/read-write.h"
+#include "kvm/util.h"
+#include "kvm/virtio.h"
+
+#include <linux/bitmap.h>
+#include <linux/find.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * A snapshot is a directory with two files:
+ *
+ * - "memory" holds guest RAM at the same offsets as in the host mapping
+ *   that starts at kvm->ram_start. Pages that were all zeroes are left as
+ *   holes. Restoring maps it MAP_PRIVATE over the RAM banks, so that the
+ *   guest only reads the pages it touches, and copies the ones it writes.
+ *
+ * - "state" starts with a struct snapshot_header, followed by sections that
+ *   each start with a struct snapshot_section: "vm", then the "cpu<N>" of
+ *   each vCPU, then the sections of the registered handlers.
+ *
+ * An incremental snapshot is a layer over the previous snapshot of the guest.
+ * Its "memory" only has the pages written since then, the others are holes,
+ * "dirty" is a struct snapshot_dirty_header and the bitmap of the pages that
+ * the layer holds, and "parent" the directory of the snapshot underneath.
+ * Restoring maps the layers over each other, from the bottom one up.
+ */
+#define SNAPSHOT_MAGIC		"LKVMSNAP"
+#define SNAPSHOT_VERSION	2
+/* The state is the same, older versions just wouldn't restore the layers */
+#define SNAPSHOT_LAYER_VERSION	3
+#define SNAPSHOT_STATE		"state"
+#define SNAPSHOT_MEMORY		"memory"
+#define SNAPSHOT_DIRTY		"dirty"
+#define SNAPSHOT_PARENT		"parent"
+
+#define SNAPSHOT_DIRTY_MAGIC	"LKVMDIRT"
+
+/* Deepest chain of layers, and most runs of pages mapped from them */
+#define SNAPSHOT_MAX_LAYERS	64
+#define SNAPSHOT_MAX_LAYER_MAPS	16384
+
+/* Longest wait for the requests that devices are still processing */
+#define SNAPSHOT_IDLE_TIMEOUT_MS	1000
+
+#define SNAPSHOT_MAX_BLOCKERS	8
+
+/* A booted template has its vCPUs busy under 2% of 4 periods of 500ms */
+#define SNAPSHOT_TEMPLATE_PERIOD_MS	500
+#define SNAPSHOT_TEMPLATE_IDLE_PERIODS	4
+#define SNAPSHOT_TEMPLATE_BUSY_PCT	2
+
+struct snapshot_header {
+	char	magic[8];
+	u32	version;
+	u32	nrcpus;
+	u64	ram_size;
+	u32	nr_sections;
+	u32	reserved;
+};
+
+struct snapshot_section {
+	char	name[32];
+	u64	size;
+};
+
+struct snapshot_dirty_header {
+	char	magic[8];
+	u32	page_size;
+	u32	reserved;
+	u64	nr_pages;
+};
+
+struct snapshot {
+	void	*buf;
+	size_t	size;
+	size_t	len;
+	/* While saving, where the header of the current section is */
+	size_t	section;
+	/* While restoring, the position in the current section and its end */
+	size_t	pos;
+	size_t	end;
+	u32	nr_sections;
+};
+
+static LIST_HEAD(snapshot_handlers);
+static const char *snapshot_blockers[SNAPSHOT_MAX_BLOCKERS];
+static int nr_snapshot_blockers;
+static struct snapshot restore_snap;
+
+/*
+ * While the pages that the guest writes are tracked for an incremental
+ * snapshot, the directory of the last one, else an empty string.
+ */
+static char snapshot_base[PATH_MAX];
+
+int __attribute__((weak)) kvm__arch_save_state(struct kvm *kvm,
+					       struct snapshot *snap)
+{
+	return -EOPNOTSUPP;
+}
+
+int __attribute__((weak)) kvm__arch_restore_state(struct kvm *kvm,
+						  struct snapshot *snap)
+{
+	return -EOPNOTSUPP;
+}
+
+int __attribute__((weak)) kvm_cpu__arch_save_state(struct kvm_cpu *vcpu,
+						   struct snapshot *snap)
+{
+	return -EOPNOTSUPP;
+}
+
+int __attribute__((weak)) kvm_cpu__arch_restore_state(struct kvm_cpu *vcpu,
+						      struct snapshot *snap)
+{
+	return -EOPNOTSUPP;
+}
+
+void snapshot__register(struct snapshot_handler *handler)
+{
+	list_add_tail(&handler->list, &snapshot_handlers);
+}
+
+/* Something the guest uses that snapshots can't capture */
+void snapshot__block(const char *reason)
+{
+	int i;
+
+	for (i = 0; i < nr_snapshot_blockers; i++)
+		if (!strcmp(snapshot_blockers[i], reason))
+			return;
+
+	if (nr_snapshot_blockers < SNAPSHOT_MAX_BLOCKERS)
+		snapshot_blockers[nr_snapshot_blockers++] = reason;
+}
+
+bool snapshot__blocked(void)
+{
+	int i;
+
+	for (i = 0; i < nr_snapshot_blockers; i++)
+		pr_warning("snapshot: %s can't be saved", snapshot_blockers[i]);
+
+	return nr_snapshot_blockers > 0;
+}
+
+int snapshot__write(struct snapshot *snap, const void *buf, size_t len)
+{
+	if (snap->len + len > snap->size) {
+		size_t size = max_t(size_t, snap->size * 2, snap->len + len);
+		void *p = realloc(snap->buf, size);
+
+		if (!p)
+			return -ENOMEM;
+		snap->buf = p;
+		snap->size = size;
+	}
+
+	memcpy(snap->buf + snap->len, buf, len);
+	snap->len += len;
+
+	return 0;
+}
+
+int snapshot__read(struct snapshot *snap, void *buf, size_t len)
+{
+	if (snap->pos + len > snap->end)
+		return -EINVAL;
+
+	memcpy(buf, snap->buf + snap->pos, len);
+	snap->pos += len;
+
+	return 0;
+}
+
+static int snapshot__begin(struct snapshot *snap, const char *name)
+{
+	struct snapshot_section section = {};
+
+	snprintf(section.name, sizeof(section.name), "%s", name);
+	snap->section = snap->len;
+	snap->nr_sections++;
+
+	return snapshot__write(snap, &section, sizeof(section));
+}
+
+static void snapshot__end(struct snapshot *snap)
+{
+	struct snapshot_section *section = snap->buf + snap->section;
+
+	section->size = snap->len - snap->section - sizeof(*section);
+}
+
+/* Position the snapshot at the contents of section @name */
+static int snapshot__find(struct snapshot *snap, const char *name)
+{
+	struct snapshot_section section;
+	size_t pos = sizeof(struct snapshot_header);
+
+	while (pos + sizeof(section) <= snap->len) {
+		memcpy(&section, snap->buf + pos, sizeof(section));
+		pos += sizeof(section);
+		if (section.size > snap->len - pos)
+			break;
+
+		if (!strncmp(section.name, name, sizeof(section.name))) {
+			snap->pos = pos;
+			snap->end = pos + section.size;
+			snap->nr_sections++;
+			return 0;
+		}
+		pos += section.size;
+	}
+
+	pr_err("snapshot: no state for %s, was it taken with the same options?",
+	       name);
+	return -ENOENT;
+}
+
+static int snapshot__restore_section(struct kvm *kvm, const char *name,
+				     int (*restore)(struct kvm *kvm,
+						    struct snapshot *snap,
+						    void *data),
+				     void *data)
+{
+	int r;
+
+	r = snapshot__find(&restore_snap, name);
+	if (r < 0)
+		return r;
+
+	r = restore(kvm, &restore_snap, data);
+	if (r < 0) {
+		pr_err("snapshot: failed to restore %s (%d)", name, r);
+		return r;
+	}
+
+	if (restore_snap.pos != restore_snap.end) {
+		pr_err("snapshot: the state of %s doesn't match this device",
+		       name);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static bool snapshot__page_is_zero(const void *page, size_t size)
+{
+	const u64 *p = page;
+	size_t i;
+
+	for (i = 0; i < size / sizeof(*p); i++)
+		if (p[i])
+			return false;
+
+	return true;
+}
+
+/* A page that goes to the memory file, with @dirty those of a layer only */
+static bool snapshot__page_wanted(struct kvm *kvm, void *page, long page_size,
+				  const unsigned long *dirty)
+{
+	if (dirty && !test_bit((page - kvm->ram_start) / page_size, dirty))
+		return false;
+
+	return !snapshot__page_is_zero(page, page_size);
+}
+
+static int snapshot__save_ram(struct kvm *kvm, int fd,
+			      const unsigned long *dirty)
+{
+	struct kvm_mem_bank *bank;
+	long page_size = getpagesize();
+	int r = 0;
+
+	if (ftruncate(fd, kvm->ram_size) < 0)
+		return -errno;
+
+	mutex_lock(&kvm->mem_banks_lock);
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		off_t base = bank->host_addr - kvm->ram_start;
+		u64 start, off = 0;
+
+		if (bank->type != KVM_MEM_TYPE_RAM)
+			continue;
+
+		/* Write the runs of pages that aren't zero, up to 1MB at once */
+		while (off < bank->size) {
+			while (off < bank->size &&
+			       !snapshot__page_wanted(kvm, bank->host_addr + off,
+						      page_size, dirty))
+				off += page_size;
+
+			start = off;
+			while (off < bank->size && off - start < SZ_1M &&
+			       snapshot__page_wanted(kvm, bank->host_addr + off,
+						     page_size, dirty))
+				off += page_size;
+
+			if (off > start &&
+			    pwrite_in_full(fd, bank->host_addr + start,
+					   off - start, base + start) < 0) {
+				r = -errno;
+				goto out;
+			}
+		}
+	}
+
+out:
+	mutex_unlock(&kvm->mem_banks_lock);
+	return r;
+}
+
+static int snapshot__open_memory(struct kvm *kvm, const char *dir)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, SNAPSHOT_MEMORY);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		pr_err("snapshot: unable to open %s", path);
+		return -errno;
+	}
+
+	if (fstat(fd, &st) < 0 || (u64)st.st_size != kvm->ram_size) {
+		pr_err("snapshot: %s doesn't match the guest RAM", path);
+		close(fd);
+		return -EINVAL;
+	}
+
+	return fd;
+}
+
+/* The whole of file @name in @dir, in a buffer that the caller frees */
+static int snapshot__read_file(const char *dir, const char *name, void **buf,
+			       size_t *len)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int fd, r = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		r = -errno;
+		goto out;
+	}
+
+	*len = st.st_size;
+	*buf = malloc(*len + 1);
+	if (!*buf) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	if (read_in_full(fd, *buf, *len) != (ssize_t)*len) {
+		free(*buf);
+		r = -EIO;
+	}
+
+out:
+	close(fd);
+	return r;
+}
+
+/* Returns 1 with the directory of the layer under @dir, 0 for a full one */
+static int snapshot__get_parent(const char *dir, char *parent)
+{
+	size_t len;
+	char *buf;
+	int r;
+
+	r = snapshot__read_file(dir, SNAPSHOT_PARENT, (void **)&buf, &len);
+	if (r == -ENOENT)
+		return 0;
+	if (r < 0)
+		return r;
+
+	if (!len || len >= PATH_MAX) {
+		free(buf);
+		return -EINVAL;
+	}
+
+	memcpy(parent, buf, len);
+	parent[len] = '\0';
+	free(buf);
+
+	return 1;
+}
+
+/*
+ * Map the pages of the layer in @dir over those underneath, still lazily.
+ * Beyond SNAPSHOT_MAX_LAYER_MAPS runs, which would each take a mapping of
+ * their own, the pages are copied instead.
+ */
+static int snapshot__map_layer(struct kvm *kvm, const char *dir, u32 *nr_maps)
+{
+	struct snapshot_dirty_header header;
+	long page_size = getpagesize();
+	u64 nr_pages = kvm->ram_size / page_size;
+	struct kvm_mem_bank *bank;
+	unsigned long *dirty;
+	size_t len;
+	void *buf;
+	int fd, r;
+
+	r = snapshot__read_file(dir, SNAPSHOT_DIRTY, &buf, &len);
+	if (r < 0) {
+		pr_err("snapshot: the layer in %s has no dirty pages", dir);
+		return r;
+	}
+
+	memcpy(&header, buf, min_t(size_t, len, sizeof(header)));
+	if (len != sizeof(header) + BITS_TO_LONGS(nr_pages) * sizeof(long) ||
+	    memcmp(header.magic, SNAPSHOT_DIRTY_MAGIC, sizeof(header.magic)) ||
+	    header.page_size != page_size || header.nr_pages != nr_pages) {
+		pr_err("snapshot: the dirty pages of %s don't match the guest RAM",
+		       dir);
+		free(buf);
+		return -EINVAL;
+	}
+	dirty = buf + sizeof(header);
+
+	fd = snapshot__open_memory(kvm, dir);
+	if (fd < 0) {
+		free(buf);
+		return fd;
+	}
+
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		u64 first = (bank->host_addr - kvm->ram_start) / page_size;
+		u64 last = first + bank->size / page_size;
+		u64 start = first, end;
+		off_t off;
+		void *p;
+
+		if (bank->type != KVM_MEM_TYPE_RAM)
+			continue;
+
+		for (;;) {
+			start = find_next_bit(dirty, last, start);
+			if (start >= last)
+				break;
+			end = find_next_zero_bit(dirty, last, start);
+			off = start * page_size;
+			len = (end - start) * page_size;
+
+			if (*nr_maps < SNAPSHOT_MAX_LAYER_MAPS) {
+				p = mmap(kvm->ram_start + off, len,
+					 PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_FIXED, fd, off);
+				if (p == MAP_FAILED) {
+					r = -errno;
+					goto out;
+				}
+				(*nr_maps)++;
+			} else if (pread_in_full(fd, kvm->ram_start + off, len,
+						 off) < 0) {
+				r = -errno;
+				goto out;
+			}
+			start = end;
+		}
+	}
+
+out:
+	close(fd);
+	free(buf);
+	return r;
+}
+
+static int snapshot__map_ram(struct kvm *kvm, const char *dir)
+{
+	struct kvm_mem_bank *bank;
+	char (*chain)[PATH_MAX];
+	u32 i, nr = 1, nr_maps = 0;
+	int fd, r = 0;
+
+	chain = malloc(SNAPSHOT_MAX_LAYERS * sizeof(*chain));
+	if (!chain)
+		return -ENOMEM;
+
+	snprintf(chain[0], sizeof(chain[0]), "%s", dir);
+	while ((r = snapshot__get_parent(chain[nr - 1], chain[nr])) > 0) {
+		if (++nr == SNAPSHOT_MAX_LAYERS) {
+			pr_err("snapshot: %s has more than %u layers", dir,
+			       SNAPSHOT_MAX_LAYERS - 1);
+			r = -ELOOP;
+			goto out_free;
+		}
+	}
+	if (r < 0) {
+		pr_err("snapshot: unable to find the parent of %s",
+		       chain[nr - 1]);
+		goto out_free;
+	}
+
+	fd = snapshot__open_memory(kvm, chain[nr - 1]);
+	if (fd < 0) {
+		r = fd;
+		goto out_free;
+	}
+
+	if (kvm->cfg.restore_uffd) {
+		if (nr > 1) {
+			pr_err("snapshot: --restore-mode=uffd needs a full snapshot, %s is a layer",
+			       dir);
+			r = -EINVAL;
+		} else {
+			r = snapshot__uffd_map_ram(kvm, dir, fd);
+		}
+		goto out;
+	}
+
+	/*
+	 * KVM follows the change of mapping under its memory slots, the host
+	 * addresses of guest RAM stay the same.
+	 */
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		void *p;
+
+		if (bank->type != KVM_MEM_TYPE_RAM)
+			continue;
+
+		p = mmap(bank->host_addr, bank->size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_FIXED, fd,
+			 bank->host_addr - kvm->ram_start);
+		if (p == MAP_FAILED) {
+			r = -errno;
+			goto out;
+		}
+	}
+
+	for (i = nr - 1; i-- > 0 && !r;)
+		r = snapshot__map_layer(kvm, chain[i], &nr_maps);
+
+	if (!r && nr > 1)
+		pr_info("snapshot: %u layers over %s, %u runs of pages mapped%s",
+			nr - 1, chain[nr - 1], nr_maps,
+			nr_maps == SNAPSHOT_MAX_LAYER_MAPS ? ", others copied" : "");
+
+out:
+	close(fd);
+out_free:
+	free(chain);
+	return r;
+}
+
+/*
+ * Write @snap to @name in @dir, through a temporary file. Without @snap, the
+ * memory file, of the pages in @dirty only if there is one.
+ */
+static int snapshot__write_file(struct kvm *kvm, const char *dir,
+				const char *name, struct snapshot *snap,
+				const unsigned long *dirty)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int fd, r;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= PATH_MAX ||
+	    snprintf(tmp, sizeof(tmp), "%s/%s.tmp", dir, name) >= PATH_MAX)
+		return -ENAMETOOLONG;
+
+	/*
+	 * A guest restored from this directory still maps the old memory
+	 * file, which must not change under it.
+	 */
+	unlink(tmp);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+
+	if (snap)
+		r = write_in_full(fd, snap->buf, snap->len) < 0 ? -errno : 0;
+	else
+		r = snapshot__save_ram(kvm, fd, dirty);
+
+	if (!r && fdatasync(fd) < 0)
+		r = -errno;
+	close(fd);
+
+	if (!r && rename(tmp, path) < 0)
+		r = -errno;
+	if (r)
+		unlink(tmp);
+
+	return r;
+}
+
+static int snapshot__save_state(struct kvm *kvm, struct snapshot *snap)
+{
+	struct snapshot_handler *handler;
+	struct snapshot_header header = {
+		.version	= SNAPSHOT_VERSION,
+		.nrcpus		= kvm->nrcpus,
+		.ram_size	= kvm->cfg.ram_size,
+	};
+	char name[32];
+	int i, r;
+
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	r = snapshot__write(snap, &header, sizeof(header));
+	if (r < 0)
+		return r;
+
+	r = snapshot__begin(snap, "vm");
+	if (r < 0)
+		return r;
+	r = kvm__arch_save_state(kvm, snap);
+	if (r < 0) {
+		pr_warning("snapshot: unable to save the VM state (%d)", r);
+		return r;
+	}
+	snapshot__end(snap);
+
+	for (i = 0; i < kvm->nrcpus; i++) {
+		snprintf(name, sizeof(name), "cpu%d", i);
+		r = snapshot__begin(snap, name);
+		if (r < 0)
+			return r;
+		r = kvm_cpu__arch_save_state(kvm->cpus[i], snap);
+		if (r < 0) {
+			pr_warning("snapshot: unable to save vCPU %d (%d)", i, r);
+			return r;
+		}
+		snapshot__end(snap);
+	}
+
+	list_for_each_entry(handler, &snapshot_handlers, list) {
+		r = snapshot__begin(snap, handler->name);
+		if (r < 0)
+			return r;
+		r = handler->save(kvm, snap, handler->data);
+		if (r < 0) {
+			pr_warning("snapshot: unable to save %s (%d)",
+				   handler->name, r);
+			return r;
+		}
+		snapshot__end(snap);
+	}
+
+	((struct snapshot_header *)snap->buf)->nr_sections = snap->nr_sections;
+
+	return 0;
+}
+
+static void snapshot__resume(struct kvm *kvm)
+{
+	struct snapshot_handler *handler;
+
+	list_for_each_entry(handler, &snapshot_handlers, list)
+		if (handler->resume)
+			handler->resume(kvm, handler->data);
+}
+
+/*
+ * Stop the guest in a state that snapshot__capture() can save, until
+ * snapshot__start().
+ */
+int snapshot__stop(struct kvm *kvm)
+{
+	int i;
+
+	if (snapshot__blocked())
+		return -EOPNOTSUPP;
+
+	/*
+	 * vCPUs pause between two exits, the state of the one they were
+	 * emulating isn't left half in kvmtool.
+	 */
+	kvm__pause(kvm);
+
+	/*
+	 * With the vCPUs stopped, keep devices from taking new requests and
+	 * give them some time to finish the ones they have. Whatever they
+	 * still write to guest memory afterwards may not be in the snapshot.
+	 */
+	virtio__freeze(kvm, SNAPSHOT_IDLE_TIMEOUT_MS);
+	kvm_cpu__flush_coalesced_mmio(kvm);
+
+	for (i = 0; i < kvm->nr_disks; i++)
+		disk_image__flush(kvm->disks[i]);
+
+	return 0;
+}
+
+void snapshot__start(struct kvm *kvm)
+{
+	virtio__thaw(kvm);
+	snapshot__resume(kvm);
+
+	kvm__continue(kvm);
+}
+
+/* The state of a stopped guest, in a buffer that the caller frees */
+int snapshot__capture(struct kvm *kvm, void **buf, size_t *len)
+{
+	struct snapshot snap = {};
+	int r;
+
+	r = snapshot__save_state(kvm, &snap);
+	if (r < 0) {
+		free(snap.buf);
+		return r;
+	}
+
+	*buf = snap.buf;
+	*len = snap.len;
+
+	return 0;
+}
+
+/*
+ * Whether a layer in @dir can go over the snapshot in @base: not one of the
+ * chain under it, which would then loop, nor one too many.
+ */
+static bool snapshot__can_layer(const char *base, const char *dir)
+{
+	char cur[PATH_MAX], parent[PATH_MAX];
+	u32 depth;
+
+	snprintf(cur, sizeof(cur), "%s", base);
+	for (depth = 1; depth < SNAPSHOT_MAX_LAYERS - 1; depth++) {
+		if (!strcmp(cur, dir))
+			return false;
+		if (snapshot__get_parent(cur, parent) <= 0)
+			return true;
+		memcpy(cur, parent, sizeof(cur));
+	}
+
+	return false;
+}
+
+static int snapshot__write_layer(struct kvm *kvm, const char *dir,
+				 const unsigned long *dirty)
+{
+	struct snapshot_dirty_header header = {
+		.page_size	= getpagesize(),
+		.nr_pages	= kvm->ram_size / getpagesize(),
+	};
+	struct snapshot snap = {};
+	int r;
+
+	memcpy(header.magic, SNAPSHOT_DIRTY_MAGIC, sizeof(header.magic));
+	r = snapshot__write(&snap, &header, sizeof(header));
+	if (!r)
+		r = snapshot__write(&snap, dirty,
+				    BITS_TO_LONGS(header.nr_pages) * sizeof(long));
+	if (!r)
+		r = snapshot__write_file(kvm, dir, SNAPSHOT_DIRTY, &snap, NULL);
+	free(snap.buf);
+	if (r)
+		return r;
+
+	snap = (struct snapshot) {};
+	r = snapshot__write(&snap, snapshot_base, strlen(snapshot_base));
+	if (!r)
+		r = snapshot__write_file(kvm, dir, SNAPSHOT_PARENT, &snap, NULL);
+	free(snap.buf);
+
+	return r;
+}
+
+/*
+ * Track the pages that the stopped guest writes from now on, for a layer
+ * over @dir, or stop tracking them with a NULL @dir.
+ */
+static void snapshot__track(struct kvm *kvm, const char *dir)
+{
+	int r;
+
+	if (snapshot_base[0]) {
+		dirty_log__stop(kvm);
+		snapshot_base[0] = '\0';
+	}
+
+	if (!dir)
+		return;
+
+	r = dirty_log__start(kvm);
+	if (r < 0) {
+		pr_warning("snapshot: unable to track the pages written after %s, the next snapshot will be full: %s",
+			   dir, strerror(-r));
+		return;
+	}
+	snprintf(snapshot_base, sizeof(snapshot_base), "%s", dir);
+}
+
+/*
+ * With @incremental, only write the pages that changed since the previous
+ * snapshot, if it was incremental too, as a layer over it. Paths must be
+ * absolute for the layers to find each other.
+ */
+int snapshot__save(struct kvm *kvm, const char *dir, bool incremental)
+{
+	struct snapshot snap = {};
+	u64 start = kvm_cpu__now();
+	unsigned long *dirty = NULL;
+	u64 nr_pages = kvm->ram_size / getpagesize();
+	char parent[PATH_MAX];
+	long nr_dirty = 0;
+	bool layer;
+	int r;
+
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+		return -errno;
+
+	r = snapshot__stop(kvm);
+	if (r < 0)
+		return r;
+
+	layer = incremental && snapshot_base[0] &&
+		snapshot__can_layer(snapshot_base, dir);
+	if (layer) {
+		snprintf(parent, sizeof(parent), "%s", snapshot_base);
+		dirty = calloc(BITS_TO_LONGS(nr_pages), sizeof(long));
+		if (!dirty) {
+			r = -ENOMEM;
+			goto out;
+		}
+
+		nr_dirty = dirty_log__sync(kvm, dirty);
+		if (nr_dirty < 0) {
+			r = nr_dirty;
+			goto out;
+		}
+		dirty_log__sync_devices(dirty);
+		nr_dirty = bitmap_weight(dirty, nr_pages);
+	}
+
+	r = snapshot__save_state(kvm, &snap);
+	if (!r && layer)
+		((struct snapshot_header *)snap.buf)->version =
+			SNAPSHOT_LAYER_VERSION;
+	if (!r)
+		r = snapshot__write_file(kvm, dir, SNAPSHOT_MEMORY, NULL, dirty);
+	if (!r) {
+		/* It was about the previous memory file */
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s/%s", dir, SNAPSHOT_WORKINGSET);
+		unlink(path);
+
+		if (layer) {
+			r = snapshot__write_layer(kvm, dir, dirty);
+		} else {
+			snprintf(path, sizeof(path), "%s/%s", dir, SNAPSHOT_DIRTY);
+			unlink(path);
+			snprintf(path, sizeof(path), "%s/%s", dir, SNAPSHOT_PARENT);
+			unlink(path);
+		}
+	}
+	if (!r)
+		r = snapshot__write_file(kvm, dir, SNAPSHOT_STATE, &snap, NULL);
+
+out:
+	/* The pages that a failed layer would have had are lost for the next */
+	snapshot__track(kvm, incremental && !r ? dir : NULL);
+	snapshot__start(kvm);
+
+	free(snap.buf);
+	free(dirty);
+
+	if (!r && layer)
+		pr_info("snapshot: saved %ld dirty pages to %s, over %s, in %.3f ms",
+			nr_dirty, dir, parent, (kvm_cpu__now() - start) / 1e6);
+	else if (!r)
+		pr_info("snapshot: saved to %s in %.3f ms", dir,
+			(kvm_cpu__now() - start) / 1e6);
+
+	return r;
+}
+
+/*
+ * Take the state in @buf, which snapshot__capture() made, for
+ * snapshot__restore(). The number of vCPUs and the RAM size come from it,
+ * the rest of the command line must be the same as the one of the saved
+ * guest. @buf is freed in any case.
+ */
+int snapshot__load(struct kvm *kvm, void *buf, size_t len)
+{
+	struct snapshot_header header;
+
+	if (len < sizeof(header)) {
+		free(buf);
+		return -EINVAL;
+	}
+
+	memcpy(&header, buf, sizeof(header));
+	if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) ||
+	    (header.version != SNAPSHOT_VERSION &&
+	     header.version != SNAPSHOT_LAYER_VERSION)) {
+		pr_err("snapshot: the state isn't of this version");
+		free(buf);
+		return -EINVAL;
+	}
+
+	if ((kvm->cfg.nrcpus && kvm->cfg.nrcpus != (int)header.nrcpus) ||
+	    (kvm->cfg.ram_size && kvm->cfg.ram_size != header.ram_size)) {
+		pr_err("snapshot: the guest had %u vCPUs and %llu MB of RAM",
+		       header.nrcpus,
+		       (unsigned long long)header.ram_size / SZ_1M);
+		free(buf);
+		return -EINVAL;
+	}
+
+	kvm->cfg.nrcpus = header.nrcpus;
+	kvm->cfg.ram_size = header.ram_size;
+
+	free(restore_snap.buf);
+	restore_snap = (struct snapshot) {
+		.buf	= buf,
+		.len	= len,
+		.size	= len,
+	};
+
+	return 0;
+}
+
+/* Load the state of --restore, before the guest is set up */
+int snapshot__prepare_restore(struct kvm *kvm)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	void *buf;
+	int fd, r;
+
+	if (kvm->cfg.hugetlbfs_path || kvm->cfg.mem_shared ||
+	    kvm->cfg.mem_prealloc) {
+		pr_err("snapshot: restored RAM comes from the memory file, it can't be shared, preallocated or on hugetlbfs");
+		return -EINVAL;
+	} else if (kvm->cfg.restore_uffd &&
+		   (kvm->cfg.mem_backend == KVM_MEM_BACKEND_HUGETLBFS ||
+		    kvm->cfg.mem_backend == KVM_MEM_BACKEND_MEMFD)) {
+		pr_err("snapshot: --restore-mode=uffd needs anonymous guest RAM");
+		return -EINVAL;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", kvm->cfg.restore_dir,
+		 SNAPSHOT_STATE);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		pr_err("snapshot: unable to open %s", path);
+		r = -errno;
+		if (fd >= 0)
+			close(fd);
+		return r;
+	}
+
+	buf = malloc(st.st_size ?: 1);
+	if (!buf) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	if (read_in_full(fd, buf, st.st_size) != st.st_size) {
+		close(fd);
+		free(buf);
+		return -EIO;
+	}
+	close(fd);
+
+	return snapshot__load(kvm, buf, st.st_size);
+}
+
+static int snapshot__restore_vm(struct kvm *kvm, struct snapshot *snap,
+				void *data)
+{
+	return kvm__arch_restore_state(kvm, snap);
+}
+
+static int snapshot__restore_cpu(struct kvm *kvm, struct snapshot *snap,
+				 void *data)
+{
+	return kvm_cpu__arch_restore_state(data, snap);
+}
+
+/* Once all devices are set up, and before the vCPUs run */
+int snapshot__restore(struct kvm *kvm)
+{
+	struct snapshot_header *header = restore_snap.buf;
+	struct snapshot_handler *handler;
+	u64 start = kvm_cpu__now();
+	char name[32];
+	int i, r;
+
+	if (snapshot__blocked())
+		return -EOPNOTSUPP;
+
+	/* An incoming migration has received RAM already */
+	if (kvm->cfg.restore_dir) {
+		r = snapshot__map_ram(kvm, kvm->cfg.restore_dir);
+		if (r < 0)
+			return r;
+	}
+
+	r = snapshot__restore_section(kvm, "vm", snapshot__restore_vm, NULL);
+	if (r < 0)
+		return r;
+
+	list_for_each_entry(handler, &snapshot_handlers, list) {
+		r = snapshot__restore_section(kvm, handler->name,
+					      handler->restore, handler->data);
+		if (r < 0)
+			return r;
+	}
+
+	for (i = 0; i < kvm->nrcpus; i++) {
+		snprintf(name, sizeof(name), "cpu%d", i);
+		r = snapshot__restore_section(kvm, name, snapshot__restore_cpu,
+					      kvm->cpus[i]);
+		if (r < 0)
+			return r;
+	}
+
+	if (restore_snap.nr_sections != header->nr_sections) {
+		pr_err("snapshot: it has devices that this guest doesn't have");
+		return -EINVAL;
+	}
+
+	snapshot__resume(kvm);
+
+	free(restore_snap.buf);
+	restore_snap = (struct snapshot) {};
+
+	if (kvm->cfg.restore_dir)
+		pr_info("snapshot: restored from %s in %.3f ms",
+			kvm->cfg.restore_dir, (kvm_cpu__now() - start) / 1e6);
+
+	return 0;
+}
+
+static void snapshot__handle_ipc(struct kvm *kvm, int fd, u32 type, u32 len,
+				 u8 *msg)
+{
+	char dir[PATH_MAX];
+	int r;
+
+	if (!len || len >= sizeof(dir)) {
+		r = -EINVAL;
+	} else {
+		memcpy(dir, msg, len);
+		dir[len] = '\0';
+		r = snapshot__save(kvm, dir, type == KVM_IPC_SNAPSHOT_LAYER);
+	}
+
+	if (write_in_full(fd, &r, sizeof(r)) < 0)
+		pr_warning("Failed sending snapshot status");
+}
+
+/* CPU time of all vCPU threads, or -1 while they aren't all running */
+static s64 snapshot__vcpu_time(struct kvm *kvm)
+{
+	struct timespec ts;
+	clockid_t clock;
+	pthread_t thread;
+	s64 total = 0;
+	int i;
+
+	for (i = 0; i < kvm->nrcpus; i++) {
+		thread = __atomic_load_n(&kvm->cpus[i]->thread, __ATOMIC_RELAXED);
+		/* Parked for "lkvm cpu add" */
+		if (!thread && i >= kvm->cfg.nrcpus)
+			continue;
+		if (!thread || pthread_getcpuclockid(thread, &clock) ||
+		    clock_gettime(clock, &ts))
+			return -1;
+		total += ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	}
+
+	return total;
+}
+
+/*
+ * With --template-save, the guest is saved once it has booted, which is when
+ * its vCPUs have been idle for a while, and the instance exits. Guests that
+ * --restore the template map its memory file MAP_PRIVATE, so they all share
+ * the page cache of the pages they haven't written.
+ */
+static void *snapshot__template_thread(void *arg)
+{
+	struct kvm *kvm = arg;
+	s64 now, last = -1;
+	int idle = 0, r;
+
+	kvm__set_thread_name("kvm-template");
+
+	while (idle < SNAPSHOT_TEMPLATE_IDLE_PERIODS) {
+		usleep(SNAPSHOT_TEMPLATE_PERIOD_MS * 1000);
+
+		now = snapshot__vcpu_time(kvm);
+		if (now >= 0 && last >= 0 &&
+		    now - last < kvm->nrcpus * SNAPSHOT_TEMPLATE_PERIOD_MS *
+				 1000000LL * SNAPSHOT_TEMPLATE_BUSY_PCT / 100)
+			idle++;
+		else
+			idle = 0;
+		last = now;
+	}
+
+	r = snapshot__save(kvm, kvm->cfg.template_save, false);
+	if (r < 0)
+		pr_err("snapshot: unable to save the template to %s: %s",
+		       kvm->cfg.template_save, strerror(-r));
+
+	kvm__reboot(kvm);
+
+	return NULL;
+}
+
+static int snapshot__init(struct kvm *kvm)
+{
+	pthread_t thread;
+	int r;
+
+	r = kvm_ipc__register_handler(KVM_IPC_SNAPSHOT, snapshot__handle_ipc);
+	if (!r)
+		r = kvm_ipc__register_handler(KVM_IPC_SNAPSHOT_LAYER,
+					      snapshot__handle_ipc);
+	if (r < 0 || !kvm->cfg.template_save)
+		return r;
+
+	if (pthread_create(&thread, NULL, snapshot__template_thread, kvm))
+		return -errno;
+	pthread_detach(thread);
+
+	return 0;
+}
+late_init(snapshot__init);
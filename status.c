@@ -0,0 +1,258 @@
+#include "kvm/status.h"
+#include "kvm/disk-image.h"
+#include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/mutex.h"
+#include "kvm/util.h"
+#include "kvm/virtio-balloon.h"
+#include "kvm/virtio-net.h"
+
+#include <linux/kernel.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* A torn copy is retried, an instance stuck mid-update gives up after this */
+#define KVM_STATUS_READ_TRIES	1000
+
+static struct kvm_status_page *status_page;
+static DEFINE_MUTEX(status_lock);
+static pthread_t status_thread;
+static int status_stopfd = -1;
+
+static void kvm_status__path(char *path, size_t len, const char *name)
+{
+	snprintf(path, len, "%s/%s%s", kvm__get_dir(), name, KVM_STATUS_SUFFIX);
+}
+
+static void kvm_status__disks(struct kvm *kvm, struct kvm_status_page *page)
+{
+	struct disk_stats *stats;
+	int i, op, size;
+
+	for (i = 0; i < kvm->nr_disks; i++) {
+		stats = &kvm->disks[i]->stats;
+		for (op = 0; op < DISK_STATS_NR_OPS; op++) {
+			for (size = 0; size < DISK_STATS_NR_SIZES; size++)
+				page->disk_ops[op] += __atomic_load_n(
+					&stats->hist[op][size].count,
+					__ATOMIC_RELAXED);
+			page->disk_bytes[op] += __atomic_load_n(&stats->bytes[op],
+								__ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* The writer side of the seqlock: the sequence count is odd meanwhile */
+void kvm_status__update(struct kvm *kvm)
+{
+	struct kvm_status_page *page;
+	struct virtio_net_totals net;
+	u32 seq;
+
+	mutex_lock(&status_lock);
+	page = status_page;
+	if (!page) {
+		mutex_unlock(&status_lock);
+		return;
+	}
+
+	seq = page->seq;
+	__atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	page->updated_ns	= kvm_cpu__now();
+	page->state		= kvm->vm_state;
+	page->nr_cpus		= kvm->nrcpus;
+	page->ram_size		= kvm->ram_size;
+	page->balloon_bytes	= virtio_bln__actual_bytes();
+
+	memset(page->disk_ops, 0, sizeof(page->disk_ops));
+	memset(page->disk_bytes, 0, sizeof(page->disk_bytes));
+	kvm_status__disks(kvm, page);
+
+	virtio_net__get_totals(kvm, &net);
+	page->net_rx_packets	= net.rx_packets;
+	page->net_rx_bytes	= net.rx_bytes;
+	page->net_tx_packets	= net.tx_packets;
+	page->net_tx_bytes	= net.tx_bytes;
+	page->net_drops		= net.drops;
+
+	__atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+	mutex_unlock(&status_lock);
+}
+
+/* Copies the status page of instance @name, without a word to the instance */
+int kvm_status__read(const char *name, struct kvm_status_page *status)
+{
+	struct kvm_status_page *page;
+	char path[PATH_MAX];
+	u32 seq, size, tries;
+	int fd, r = -EAGAIN;
+	struct stat st;
+
+	kvm_status__path(path, sizeof(path), name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	/* Not sized yet, the page would fault */
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*page)) {
+		close(fd);
+		return -EAGAIN;
+	}
+
+	page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED)
+		return -errno;
+
+	if (page->magic != KVM_STATUS_MAGIC ||
+	    page->version != KVM_STATUS_VERSION) {
+		r = -EPROTO;
+		goto out;
+	}
+
+	memset(status, 0, sizeof(*status));
+	size = min_t(u32, page->size, sizeof(*status));
+	for (tries = 0; tries < KVM_STATUS_READ_TRIES; tries++) {
+		seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		memcpy(status, page, size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq) {
+			r = 0;
+			break;
+		}
+	}
+
+out:
+	munmap(page, sizeof(*page));
+	return r;
+}
+
+static void *kvm_status__thread(void *param)
+{
+	struct kvm *kvm = param;
+	struct pollfd pfd = {
+		.fd	= status_stopfd,
+		.events	= POLLIN,
+	};
+
+	kvm__set_thread_name("kvm-status");
+
+	while (poll(&pfd, 1, kvm->cfg.status_interval_ms) == 0)
+		kvm_status__update(kvm);
+
+	return NULL;
+}
+
+static int kvm_status__init(struct kvm *kvm)
+{
+	struct kvm_status_page *page;
+	char path[PATH_MAX];
+	long size = sysconf(_SC_PAGESIZE);
+	int fd, r;
+
+	if (kvm->cfg.status_interval_ms <= 0)
+		return 0;
+
+	BUILD_BUG_ON(sizeof(*page) > 4096);
+
+	kvm_status__path(path, sizeof(path), kvm->cfg.guest_name);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		pr_warning("Unable to create the status page %s: %s", path,
+			   strerror(errno));
+		return 0;
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		r = -errno;
+		goto err_unlink;
+	}
+
+	page = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED) {
+		r = -errno;
+		goto err_unlink;
+	}
+	close(fd);
+
+	page->version	= KVM_STATUS_VERSION;
+	page->size	= sizeof(*page);
+	page->pid	= getpid();
+	/* Readers only trust the page once it's complete */
+	__atomic_store_n(&page->magic, KVM_STATUS_MAGIC, __ATOMIC_RELEASE);
+	mutex_lock(&status_lock);
+	status_page = page;
+	mutex_unlock(&status_lock);
+	kvm_status__update(kvm);
+
+	status_stopfd = eventfd(0, EFD_CLOEXEC);
+	if (status_stopfd < 0) {
+		r = -errno;
+		goto err_unmap;
+	}
+
+	r = -kvm__start_device_thread(&status_thread, kvm_status__thread, kvm);
+	if (r) {
+		close(status_stopfd);
+		status_stopfd = -1;
+		goto err_unmap;
+	}
+
+	return 0;
+
+err_unmap:
+	mutex_lock(&status_lock);
+	status_page = NULL;
+	mutex_unlock(&status_lock);
+	munmap(page, size);
+	fd = -1;
+err_unlink:
+	if (fd >= 0)
+		close(fd);
+	unlink(path);
+	pr_warning("Unable to publish the status page: %s", strerror(-r));
+	return 0;
+}
+late_init(kvm_status__init);
+
+static int kvm_status__exit(struct kvm *kvm)
+{
+	char path[PATH_MAX];
+	u64 stop = 1;
+
+	if (!status_page)
+		return 0;
+
+	if (write(status_stopfd, &stop, sizeof(stop)) < 0)
+		pr_warning("Unable to stop the status thread");
+	else
+		pthread_join(status_thread, NULL);
+	close(status_stopfd);
+	status_stopfd = -1;
+
+	kvm_status__path(path, sizeof(path), kvm->cfg.guest_name);
+	unlink(path);
+
+	mutex_lock(&status_lock);
+	munmap(status_page, sysconf(_SC_PAGESIZE));
+	status_page = NULL;
+	mutex_unlock(&status_lock);
+
+	return 0;
+}
+late_exit(kvm_status__exit);
@@ -1,14 +1,36 @@
 #include "kvm/symbol.h"
 
 #include "kvm/kvm.h"
+#include "kvm/mutex.h"
 
 #include <linux/err.h>
+#include <linux/kernel.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <bfd.h>
 
 static bfd *abfd;
+/* libbfd isn't thread-safe, debug dumps of several vCPUs may race */
+static DEFINE_MUTEX(bfd_lock);
+
+/*
+ * The functions of the kernel by address, loaded once at the first lookup:
+ * where each one starts, how far it goes, and where its name is in a pool
+ * of names, so that the symbol table of libbfd can go once they're copied.
+ */
+struct symbol_func {
+	u64		start;
+	u32		size;
+	u32		name;
+};
+
+static pthread_once_t funcs_once = PTHREAD_ONCE_INIT;
+static struct symbol_func *funcs;
+static char *funcs_names;
+static long nr_funcs;
 
 int symbol_init(struct kvm *kvm)
 {
@@ -40,88 +62,193 @@ int symbol_init(struct kvm *kvm)
 }
 late_init(symbol_init);
 
-static asymbol *lookup(asymbol **symbols, int nr_symbols, const char *symbol_name)
+static int symbol_func_cmp(const void *a, const void *b)
 {
-	int i, ret;
+	const struct symbol_func *fa = a, *fb = b;
 
-	ret = -ENOENT;
+	if (fa->start != fb->start)
+		return fa->start < fb->start ? -1 : 1;
+	return 0;
+}
 
-	for (i = 0; i < nr_symbols; i++) {
-		asymbol *symbol = symbols[i];
+static bool symbol_is_func(asymbol *sym)
+{
+	return (sym->flags & BSF_FUNCTION) && sym->section &&
+	       bfd_asymbol_value(sym) < sym->section->vma + sym->section->size;
+}
 
-		if (!strcmp(bfd_asymbol_name(symbol), symbol_name))
-			return symbol;
-	}
+/*
+ * A function ends where the next one starts, or with its section: kernels
+ * have functions in assembly with no size, and aliases of others.
+ */
+static void symbol_size_funcs(u64 *ends)
+{
+	long i, nr = 0;
+	u64 end;
 
-	return ERR_PTR(ret);
+	qsort(funcs, nr_funcs, sizeof(*funcs), symbol_func_cmp);
+
+	for (i = 0; i < nr_funcs; i++) {
+		if (nr && funcs[i].start == funcs[nr - 1].start)
+			continue;
+		funcs[nr++] = funcs[i];
+	}
+	nr_funcs = nr;
+
+	for (i = 0; i < nr_funcs; i++) {
+		/* Stashed by symbol_load_funcs() in size, the index in ends */
+		end = ends[funcs[i].size];
+		if (i + 1 < nr_funcs && funcs[i + 1].start < end)
+			end = funcs[i + 1].start;
+		funcs[i].size = min_t(u64, end - funcs[i].start, UINT32_MAX);
+	}
 }
 
-char *symbol_lookup(struct kvm *kvm, unsigned long addr, char *sym, size_t size)
+static void symbol_load_funcs(void)
 {
-	const char *filename;
-	bfd_vma sym_offset;
-	bfd_vma sym_start;
-	asection *section;
-	unsigned int line;
-	const char *func;
-	long symtab_size;
-	asymbol *symbol;
+	long symtab_size, nr_syms, i, n = 0;
+	size_t names_len = 0, len;
 	asymbol **syms;
-	int nr_syms, ret;
-
-	ret = -ENOENT;
-	if (!abfd)
-		goto not_found;
+	u64 *ends;
 
-	if (!bfd_check_format(abfd, bfd_object))
-		goto not_found;
+	mutex_lock(&bfd_lock);
+	if (!abfd || !bfd_check_format(abfd, bfd_object))
+		goto out;
 
 	symtab_size = bfd_get_symtab_upper_bound(abfd);
-	if (!symtab_size)
-		goto not_found;
+	if (symtab_size <= 0)
+		goto out;
 
-	ret = -ENOMEM;
 	syms = malloc(symtab_size);
 	if (!syms)
-		goto not_found;
+		goto out;
 
 	nr_syms = bfd_canonicalize_symtab(abfd, syms);
+	for (i = 0; i < nr_syms; i++) {
+		if (symbol_is_func(syms[i])) {
+			names_len += strlen(bfd_asymbol_name(syms[i])) + 1;
+			n++;
+		}
+	}
 
-	ret = -ENOENT;
-	section = bfd_get_section_by_name(abfd, ".debug_aranges");
-	if (!section)
-		goto not_found;
+	if (names_len > UINT32_MAX)
+		goto out_free_syms;
+
+	funcs = calloc(n, sizeof(*funcs));
+	funcs_names = malloc(names_len);
+	ends = calloc(n, sizeof(*ends));
+	if (!funcs || !funcs_names || !ends) {
+		free(funcs);
+		free(funcs_names);
+		funcs = NULL;
+		funcs_names = NULL;
+		goto out_free_ends;
+	}
 
-	if (!bfd_find_nearest_line(abfd, section, NULL, addr, &filename, &func, &line))
-		goto not_found;
+	names_len = 0;
+	for (i = 0; i < nr_syms; i++) {
+		asymbol *sym = syms[i];
+
+		if (!symbol_is_func(sym))
+			continue;
+
+		len = strlen(bfd_asymbol_name(sym)) + 1;
+		memcpy(funcs_names + names_len, bfd_asymbol_name(sym), len);
+		ends[nr_funcs] = sym->section->vma + sym->section->size;
+		funcs[nr_funcs] = (struct symbol_func) {
+			.start	= bfd_asymbol_value(sym),
+			.size	= nr_funcs,
+			.name	= names_len,
+		};
+		names_len += len;
+		nr_funcs++;
+	}
 
-	if (!func)
-		goto not_found;
+	symbol_size_funcs(ends);
 
-	symbol = lookup(syms, nr_syms, func);
-	if (IS_ERR(symbol))
-		goto not_found;
+out_free_ends:
+	free(ends);
+out_free_syms:
+	free(syms);
+out:
+	mutex_unlock(&bfd_lock);
+}
 
-	sym_start = bfd_asymbol_value(symbol);
+/* The function holding addr */
+static struct symbol_func *symbol_find_func(unsigned long addr)
+{
+	long lo = 0, hi, mid;
+
+	pthread_once(&funcs_once, symbol_load_funcs);
+
+	/* The last function starting at or below addr */
+	hi = nr_funcs;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (funcs[mid].start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	sym_offset = addr - sym_start;
+	if (!lo || addr - funcs[lo - 1].start >= funcs[lo - 1].size)
+		return NULL;
 
-	snprintf(sym, size, "%s+%llx (%s:%i)", func, (long long) sym_offset, filename, line);
+	return &funcs[lo - 1];
+}
 
-	sym[size - 1] = '\0';
+/*
+ * The function and offset of addr from the table, and its file and line
+ * from the debug info if libbfd finds them, which takes much longer.
+ */
+char *symbol_lookup(struct kvm *kvm, unsigned long addr, char *sym, size_t size)
+{
+	struct symbol_func *func = symbol_find_func(addr);
+	const char *filename, *name;
+	asection *section;
+	unsigned int line;
+	bool found;
 
-	free(syms);
+	if (!func)
+		return ERR_PTR(-ENOENT);
+
+	mutex_lock(&bfd_lock);
+	section = bfd_get_section_by_name(abfd, ".debug_aranges");
+	found = section && bfd_find_nearest_line(abfd, section, NULL, addr,
+						&filename, &name, &line) &&
+		filename;
+	if (found)
+		snprintf(sym, size, "%s+%llx (%s:%i)", funcs_names + func->name,
+			 (unsigned long long)(addr - func->start), filename, line);
+	mutex_unlock(&bfd_lock);
+
+	if (!found)
+		snprintf(sym, size, "%s+%llx", funcs_names + func->name,
+			 (unsigned long long)(addr - func->start));
 
 	return sym;
+}
 
-not_found:
-	return ERR_PTR(ret);
+/* Only the name of the function holding addr, for the profiler */
+char *symbol_lookup_func(struct kvm *kvm, unsigned long addr, char *sym, size_t size)
+{
+	struct symbol_func *func = symbol_find_func(addr);
+
+	if (!func)
+		return ERR_PTR(-ENOENT);
+
+	snprintf(sym, size, "%s", funcs_names + func->name);
+
+	return sym;
 }
 
 int symbol_exit(struct kvm *kvm)
 {
 	bfd_boolean ret = TRUE;
 
+	free(funcs);
+	free(funcs_names);
+
 	if (abfd)
 		ret = bfd_close(abfd);
 
@@ -3,12 +3,17 @@
 #include <termios.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #include <signal.h>
 #include <pty.h>
 #include <utmp.h>
 
 #include "kvm/read-write.h"
+#include "kvm/epoll.h"
+#include "kvm/iovec.h"
 #include "kvm/term.h"
 #include "kvm/util.h"
 #include "kvm/kvm.h"
@@ -21,7 +26,25 @@ static struct termios	orig_term;
 
 static int term_fds[TERM_MAX_DEVS][2];
 
-static pthread_t term_poll_thread;
+/*
+ * Each input fd is on the epoll set once, in one-shot mode, and is only
+ * armed again when one of the devices reading from it can take more. A
+ * device that doesn't drain its terminal then doesn't wake us up over and
+ * over, or the other devices with it.
+ */
+struct term_backend {
+	term_reader_fn		reader;
+	int			listen_fd;
+	bool			socket;
+	bool			polled;
+};
+
+static struct term_backend term_backends[TERM_MAX_DEVS] = {
+	[0 ... TERM_MAX_DEVS - 1]	= { .listen_fd = -1 },
+};
+
+static struct kvm__epoll term_epoll;
+static bool term_polling;
 
 /* ctrl-a is used for escape */
 #define term_escape_char	0x01
@@ -50,13 +73,36 @@ int term_getc(struct kvm *kvm, int term)
 	return c;
 }
 
+static ssize_t term_write(int term, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg = {
+		.msg_iov	= iov,
+		.msg_iovlen	= iovcnt,
+	};
+	int fd = term_fds[term][TERM_FD_OUT];
+
+	/* A socket without a client, output goes nowhere */
+	if (fd < 0)
+		return iov_size(iov, iovcnt);
+
+	if (term_backends[term].socket)
+		return sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+	return writev(fd, iov, iovcnt);
+}
+
 int term_putc(char *addr, int cnt, int term)
 {
 	int ret;
 	int num_remaining = cnt;
 
 	while (num_remaining) {
-		ret = write(term_fds[term][TERM_FD_OUT], addr, num_remaining);
+		struct iovec iov = {
+			.iov_base	= addr,
+			.iov_len	= num_remaining,
+		};
+
+		ret = term_write(term, &iov, 1);
 		if (ret < 0)
 			return cnt - num_remaining;
 		num_remaining -= ret;
@@ -82,7 +128,7 @@ int term_getc_iov(struct kvm *kvm, struct iovec *iov, int iovcnt, int term)
 
 int term_putc_iov(struct iovec *iov, int iovcnt, int term)
 {
-	return writev(term_fds[term][TERM_FD_OUT], iov, iovcnt);
+	return term_write(term, iov, iovcnt);
 }
 
 bool term_readable(int term)
@@ -98,29 +144,114 @@ bool term_readable(int term)
 	return (err > 0 && (pollfd.revents & POLLIN));
 }
 
-static void *term_poll_thread_loop(void *param)
+/* The first terminal reading from the same fd as @term */
+static int term_owner(int term)
 {
-	struct pollfd fds[TERM_MAX_DEVS];
-	struct kvm *kvm = (struct kvm *) param;
 	int i;
 
-	kvm__set_thread_name("term-poll");
+	for (i = 0; i < term; i++)
+		if (term_fds[i][TERM_FD_IN] == term_fds[term][TERM_FD_IN])
+			return i;
 
-	for (i = 0; i < TERM_MAX_DEVS; i++) {
-		fds[i].fd = term_fds[i][TERM_FD_IN];
-		fds[i].events = POLLIN;
-		fds[i].revents = 0;
+	return term;
+}
+
+static int term_epoll_ctl(int term, int op)
+{
+	struct epoll_event ev = {
+		.events		= EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+		.data.ptr	= &term_backends[term],
+	};
+
+	return epoll_ctl(term_epoll.fd, op, term_fds[term][TERM_FD_IN], &ev);
+}
+
+static void term_poll_add(int term)
+{
+	if (term_owner(term) != term || term_fds[term][TERM_FD_IN] < 0)
+		return;
+
+	term_backends[term].polled = !term_epoll_ctl(term, EPOLL_CTL_ADD);
+}
+
+static void term_poll_del(int term)
+{
+	if (!term_backends[term].polled)
+		return;
+
+	epoll_ctl(term_epoll.fd, EPOLL_CTL_DEL, term_fds[term][TERM_FD_IN], NULL);
+	term_backends[term].polled = false;
+}
+
+void term_kick(int term)
+{
+	int owner = term_owner(term);
+
+	if (term_backends[owner].polled)
+		term_epoll_ctl(owner, EPOLL_CTL_MOD);
+}
+
+void term_set_reader(int term, term_reader_fn reader)
+{
+	term_backends[term].reader = reader;
+	term_kick(term);
+}
+
+static void term_socket_accept(int term)
+{
+	int fd;
+
+	fd = accept4(term_backends[term].listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	/* One client at a time */
+	if (term_fds[term][TERM_FD_IN] >= 0) {
+		close(fd);
+		return;
 	}
 
-	while (1) {
-		/* Poll with infinite timeout */
-		if(poll(fds, TERM_MAX_DEVS, -1) < 1)
-			break;
-		kvm__arch_read_term(kvm);
+	term_fds[term][TERM_FD_IN] = term_fds[term][TERM_FD_OUT] = fd;
+	term_poll_add(term);
+}
+
+static void term_hangup(int term)
+{
+	int fd = term_fds[term][TERM_FD_IN];
+
+	term_poll_del(term);
+	if (!term_backends[term].socket)
+		return;
+
+	term_fds[term][TERM_FD_IN] = term_fds[term][TERM_FD_OUT] = -1;
+	close(fd);
+}
+
+static void term_handle_event(struct kvm *kvm, struct epoll_event *ev)
+{
+	int term = ((char *)ev->data.ptr - (char *)term_backends) /
+		   sizeof(struct term_backend);
+	int i, fd = term_fds[term][TERM_FD_IN];
+	bool more = false;
+
+	if (ev->data.ptr == &term_backends[term].listen_fd) {
+		term_socket_accept(term);
+		return;
 	}
 
-	die("term_poll_thread_loop: error polling device fds %d\n", errno);
-	return NULL;
+	if (ev->events & EPOLLIN)
+		for (i = term; i < TERM_MAX_DEVS; i++)
+			if (term_fds[i][TERM_FD_IN] == fd && term_backends[i].reader)
+				more |= term_backends[i].reader(kvm, i);
+
+	if (ev->events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
+		/* Whatever was left to read is gone with the peer */
+		term_hangup(term);
+		return;
+	}
+
+	if (more)
+		term_kick(term);
 }
 
 static void term_cleanup(void)
@@ -152,18 +283,106 @@ static void term_set_tty(int term)
 	if (openpty(&master, &slave, new_pty, &orig_term, NULL) < 0)
 		return;
 
-	close(slave);
-
+	/*
+	 * Keep the slave open, or the master hangs up until something opens
+	 * it. Output is held up the same way, when nothing reads it.
+	 */
 	pr_info("Assigned terminal %d to pty %s\n", term, new_pty);
 
 	term_fds[term][TERM_FD_IN] = term_fds[term][TERM_FD_OUT] = master;
 }
 
+static void term_set_socket(int term, const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		die("Terminal socket path too long: %s", path);
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		die_perror("socket");
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 1) < 0)
+		die_perror(path);
+
+	pr_info("Assigned terminal %d to socket %s\n", term, path);
+
+	term_backends[term].listen_fd	= fd;
+	term_backends[term].socket	= true;
+	term_fds[term][TERM_FD_IN] = term_fds[term][TERM_FD_OUT] = -1;
+}
+
+static void term_set_file(int term, const char *path)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		die_perror(path);
+
+	/* Output only */
+	term_fds[term][TERM_FD_IN]	= -1;
+	term_fds[term][TERM_FD_OUT]	= fd;
+}
+
+/* <id>[,pty|socket=<path>|file=<path>] */
 int tty_parser(const struct option *opt, const char *arg, int unset)
 {
-	int tty = atoi(arg);
+	const char *backend;
+	char *end;
+	long tty;
+
+	tty = strtol(arg, &end, 10);
+	if (end == arg || (*end && *end != ',') || tty < 0 || tty >= TERM_MAX_DEVS)
+		die("Invalid terminal '%s', it must be 0 to %d", arg,
+		    TERM_MAX_DEVS - 1);
+
+	backend = *end ? end + 1 : "pty";
+
+	if (!strcmp(backend, "pty"))
+		term_set_tty(tty);
+	else if (!strncmp(backend, "socket=", 7) && backend[7])
+		term_set_socket(tty, backend + 7);
+	else if (!strncmp(backend, "file=", 5) && backend[5])
+		term_set_file(tty, backend + 5);
+	else
+		die("Unknown terminal backend '%s'", backend);
 
-	term_set_tty(tty);
+	return 0;
+}
+
+static int term_poll_init(struct kvm *kvm, bool stdio)
+{
+	int i, r;
+
+	r = epoll__init(kvm, &term_epoll, "term-poll", term_handle_event);
+	if (r < 0)
+		return r;
+	term_polling = true;
+
+	for (i = 0; i < TERM_MAX_DEVS; i++) {
+		struct term_backend *backend = &term_backends[i];
+
+		if (backend->listen_fd >= 0) {
+			struct epoll_event ev = {
+				.events		= EPOLLIN,
+				.data.ptr	= &backend->listen_fd,
+			};
+
+			if (epoll_ctl(term_epoll.fd, EPOLL_CTL_ADD,
+				      backend->listen_fd, &ev) < 0)
+				return -errno;
+			continue;
+		}
+
+		if (stdio || term_fds[i][TERM_FD_IN] != STDIN_FILENO)
+			term_poll_add(i);
+	}
 
 	return 0;
 }
@@ -171,6 +390,7 @@ int tty_parser(const struct option *opt, const char *arg, int unset)
 static int term_init(struct kvm *kvm)
 {
 	struct termios term;
+	bool stdio;
 	int i, r;
 
 	for (i = 0; i < TERM_MAX_DEVS; i++)
@@ -179,8 +399,10 @@ static int term_init(struct kvm *kvm)
 			term_fds[i][TERM_FD_OUT] = STDOUT_FILENO;
 		}
 
-	if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO))
-		return 0;
+	/* Guest input only comes from standard input when it is a terminal */
+	stdio = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+	if (!stdio)
+		return term_poll_init(kvm, false);
 
 	r = tcgetattr(STDIN_FILENO, &orig_term);
 	if (r < 0) {
@@ -196,7 +418,7 @@ static int term_init(struct kvm *kvm)
 
 
 	/* Use our own blocking thread to read stdin, don't require a tick */
-	if(pthread_create(&term_poll_thread, NULL, term_poll_thread_loop,kvm))
+	if (term_poll_init(kvm, true) < 0)
 		die("Unable to create console input poll thread\n");
 
 	signal(SIGTERM, term_sig_cleanup);
@@ -208,6 +430,15 @@ dev_init(term_init);
 
 static int term_exit(struct kvm *kvm)
 {
+	int i;
+
+	if (term_polling)
+		epoll__exit(&term_epoll);
+
+	for (i = 0; i < TERM_MAX_DEVS; i++)
+		if (term_backends[i].listen_fd >= 0)
+			close(term_backends[i].listen_fd);
+
 	return 0;
 }
 dev_exit(term_exit);
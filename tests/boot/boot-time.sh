@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# Boots boot_test.iso, whose init reboots straight away, a number of times
+# with lkvm run --boot-trace, and prints the distribution of the time to
+# each mark of the traces: the first guest entry, the first DRIVER_OK of
+# each virtio device, and the end of the run.
+
+usage() {
+	echo "usage: $0 [-l lkvm] [-n runs] [-- extra lkvm run options] <kernel>" >&2
+	exit 1
+}
+
+LKVM=../../lkvm
+RUNS=10
+
+while getopts "l:n:" opt; do
+	case $opt in
+	l) LKVM=$OPTARG ;;
+	n) RUNS=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+[ $# -ge 1 ] || usage
+eval KERNEL=\${$#}
+EXTRA=
+while [ $# -gt 1 ]; do
+	EXTRA="$EXTRA $1"
+	shift
+done
+
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+i=0
+while [ $i -lt "$RUNS" ]; do
+	"$LKVM" run -k "$KERNEL" -d boot_test.iso -p "init=init" \
+		--boot-trace "$DIR/trace.$i.json" $EXTRA >/dev/null 2>&1 ||
+		echo "run $i failed" >&2
+	i=$((i + 1))
+done
+
+# The traces have one event per line, the end of the marks and spans is
+# their ts plus their dur, in microseconds
+cat "$DIR"/trace.*.json 2>/dev/null | awk '
+/"name":/ {
+	name = $0; sub(/.*"name":"/, "", name); sub(/",.*/, "", name)
+	ts = $0; sub(/.*"ts":/, "", ts); sub(/,.*/, "", ts)
+	dur = 0
+	if ($0 ~ /"dur":/) { dur = $0; sub(/.*"dur":/, "", dur); sub(/,.*/, "", dur) }
+	if (name != "run" && name !~ /DRIVER_OK|first guest entry/)
+		next
+	if (!(name in n))
+		names[nr_names++] = name
+	t[name, n[name]++] = (ts + dur) / 1000
+}
+
+function sort(name, count,	i, j, v) {
+	for (i = 1; i < count; i++) {
+		v = t[name, i]
+		for (j = i - 1; j >= 0 && t[name, j] > v; j--)
+			t[name, j + 1] = t[name, j]
+		t[name, j + 1] = v
+	}
+}
+
+function pct(name, count, p) {
+	return t[name, int((count - 1) * p / 100 + 0.5)]
+}
+
+END {
+	if (!nr_names) {
+		print "No traces were written" > "/dev/stderr"
+		exit 1
+	}
+	printf "%-32s %5s %9s %9s %9s %9s\n", "ms to", "runs", "min", "median", "p90", "max"
+	for (i = 0; i < nr_names; i++) {
+		name = names[i]
+		sort(name, n[name])
+		printf "%-32s %5d %9.2f %9.2f %9.2f %9.2f\n", name, n[name],
+		       t[name, 0], pct(name, n[name], 50), pct(name, n[name], 90),
+		       t[name, n[name] - 1]
+	}
+}'
@@ -0,0 +1,426 @@
+/*
+ * Microbenchmarks of the virtqueue code, on a ring that a synthetic guest
+ * filled in memory. The rest of kvmtool is stubbed out below, so virtio/core.c
+ * runs as it does for devices, without a VM.
+ */
+#include "kvm/virtio.h"
+#include "kvm/virtio-mmio.h"
+#include "kvm/virtio-pci.h"
+#include "kvm/guest_compat.h"
+#include "kvm/metrics.h"
+#include "kvm/boot-trace.h"
+#include "kvm/iovec.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/util.h"
+
+#include <linux/kernel.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_PAGE		4096
+/* Descriptors of each chain, and bytes of each of their buffers */
+#define BENCH_CHAIN_LEN		4
+#define BENCH_BUF_SIZE		2048
+#define BENCH_MAX_RING		4096
+
+#define BENCH_RING_GPA		0
+#define BENCH_INDIRECT_GPA	(1 << 20)
+#define BENCH_DATA_GPA		(4 << 20)
+#define BENCH_MEM_SIZE		(BENCH_DATA_GPA + \
+				 BENCH_MAX_RING * BENCH_BUF_SIZE)
+
+#define BENCH_ITERATIONS	2000000
+
+static const unsigned int ring_sizes[] = { 64, 256, 1024, BENCH_MAX_RING };
+static const unsigned int copy_sizes[] = { 64, 1500, BENCH_CHAIN_LEN * BENCH_BUF_SIZE };
+
+static struct kvm kvm;
+static void *guest_mem;
+
+/* What the rest of kvmtool provides to virtio/core.c */
+
+unsigned long *dirty_log_devices;
+bool boot_trace_enabled;
+
+void boot_trace__mark(const char *cat, const char *fmt, ...)
+{
+}
+
+void __dirty_log__mark(const void *host, size_t len)
+{
+}
+
+void *guest_flat_to_host(struct kvm *kvm, u64 offset)
+{
+	return guest_mem + offset;
+}
+
+int compat__add_message(const char *title, const char *description)
+{
+	return 0;
+}
+
+void metrics__register(struct metrics_collector *collector)
+{
+}
+
+void metrics__family(struct metrics *m, const char *name, const char *type,
+		     const char *help)
+{
+}
+
+void metrics__sample(struct metrics *m, u64 value, const char *labels, ...)
+{
+}
+
+int kvm_ipc__register_handler(u32 type, void (*cb)(struct kvm *kvm,
+				int fd, u32 type, u32 len, u8 *msg))
+{
+	return 0;
+}
+
+void die(const char *err, ...)
+{
+	va_list params;
+
+	va_start(params, err);
+	vfprintf(stderr, err, params);
+	va_end(params);
+	fputc('\n', stderr);
+	exit(1);
+}
+
+void pr_err(const char *err, ...)
+{
+}
+
+void pr_warning(const char *err, ...)
+{
+}
+
+int virtio_mmio_signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
+{
+	return 0;
+}
+
+int virtio_mmio_signal_config(struct kvm *kvm, struct virtio_device *vdev)
+{
+	return 0;
+}
+
+int virtio_mmio_exit(struct kvm *kvm, struct virtio_device *vdev)
+{
+	return 0;
+}
+
+int virtio_mmio_reset(struct kvm *kvm, struct virtio_device *vdev)
+{
+	return 0;
+}
+
+int virtio_mmio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
+		     int device_id, int subsys_id, int class)
+{
+	return 0;
+}
+
+int virtio_mmio_get_irq_line(struct kvm *kvm, struct virtio_device *vdev,
+			     bool *level)
+{
+	return -ENODEV;
+}
+
+int virtio_pci__signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
+{
+	return 0;
+}
+
+int virtio_pci__signal_config(struct kvm *kvm, struct virtio_device *vdev)
+{
+	return 0;
+}
+
+int virtio_pci__exit(struct kvm *kvm, struct virtio_device *vdev)
+{
+	return 0;
+}
+
+int virtio_pci__reset(struct kvm *kvm, struct virtio_device *vdev)
+{
+	return 0;
+}
+
+int virtio_pci__init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
+		     int device_id, int subsys_id, int class)
+{
+	return 0;
+}
+
+int virtio_pci__get_irq_line(struct kvm *kvm, struct virtio_device *vdev,
+			     bool *level)
+{
+	return -ENODEV;
+}
+
+/* The synthetic guest */
+
+static u64 bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_report(const char *name, unsigned int size, u64 start,
+			 unsigned long iterations)
+{
+	double ns = (double)(bench_now_ns() - start) / iterations;
+
+	printf("%-28s %8u %10.1f\n", name, size, ns);
+}
+
+static void bench_fill_desc(struct vring_desc *desc, unsigned int buf,
+			    u16 flags, u16 next)
+{
+	desc->addr = BENCH_DATA_GPA + (u64)buf * BENCH_BUF_SIZE;
+	desc->len = BENCH_BUF_SIZE;
+	desc->flags = flags;
+	desc->next = next;
+}
+
+/*
+ * Chains of BENCH_CHAIN_LEN buffers, the first half read by the device and
+ * the rest written, either in the ring or in one indirect table each.
+ */
+static void bench_setup_ring(struct virt_queue *vq, unsigned int num,
+			     bool indirect)
+{
+	unsigned int i, j, nr_chains, head;
+	struct vring_desc *table;
+	u16 flags;
+
+	memset(guest_mem, 0, BENCH_DATA_GPA);
+	memset(vq, 0, sizeof(*vq));
+	vq->endian = VIRTIO_ENDIAN_HOST;
+	vq->use_event_idx = true;
+	vq->enabled = true;
+	vring_init(&vq->vring, num, guest_mem + BENCH_RING_GPA, BENCH_PAGE);
+	vq->max_chain = num;
+
+	nr_chains = indirect ? num : num / BENCH_CHAIN_LEN;
+	for (i = 0; i < nr_chains; i++) {
+		head = indirect ? i : i * BENCH_CHAIN_LEN;
+		if (indirect) {
+			table = guest_mem + BENCH_INDIRECT_GPA +
+				i * BENCH_CHAIN_LEN * sizeof(*table);
+			vq->vring.desc[head] = (struct vring_desc) {
+				.addr	= (void *)table - guest_mem,
+				.len	= BENCH_CHAIN_LEN * sizeof(*table),
+				.flags	= VRING_DESC_F_INDIRECT,
+			};
+		} else {
+			table = &vq->vring.desc[head];
+		}
+
+		for (j = 0; j < BENCH_CHAIN_LEN; j++) {
+			flags = j < BENCH_CHAIN_LEN / 2 ? 0 : VRING_DESC_F_WRITE;
+			if (j + 1 < BENCH_CHAIN_LEN)
+				flags |= VRING_DESC_F_NEXT;
+			bench_fill_desc(&table[j],
+					(i * BENCH_CHAIN_LEN + j) % BENCH_MAX_RING,
+					flags, indirect ? j + 1 : head + j + 1);
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		head = i % nr_chains;
+		vq->vring.avail->ring[i] = indirect ? head : head * BENCH_CHAIN_LEN;
+	}
+}
+
+static void bench_get_head_iov(unsigned int num, bool indirect)
+{
+	struct iovec iov[BENCH_MAX_RING];
+	struct virt_queue vq;
+	unsigned long i;
+	u16 out, in;
+	u64 start;
+
+	bench_setup_ring(&vq, num, indirect);
+
+	start = bench_now_ns();
+	for (i = 0; i < BENCH_ITERATIONS; i++)
+		virt_queue__get_head_iov(&vq, iov, &out, &in,
+					 vq.vring.avail->ring[i % num], &kvm);
+	bench_report(indirect ? "get_head_iov (indirect)" :
+				"get_head_iov (direct)", num, start,
+		     BENCH_ITERATIONS);
+
+	if (out != BENCH_CHAIN_LEN / 2 || in != BENCH_CHAIN_LEN - out)
+		die("Chain of %u+%u descriptors, expected %u", out, in,
+		    BENCH_CHAIN_LEN);
+}
+
+static void bench_set_used_elem(unsigned int num)
+{
+	struct virt_queue vq;
+	unsigned long i;
+	u64 start;
+
+	bench_setup_ring(&vq, num, false);
+
+	start = bench_now_ns();
+	for (i = 0; i < BENCH_ITERATIONS; i++)
+		virt_queue__set_used_elem(&vq, i % num, BENCH_BUF_SIZE);
+	bench_report("set_used_elem", num, start, BENCH_ITERATIONS);
+}
+
+/* With the event index of a guest that only wants every 16th buffer */
+static void bench_should_signal(unsigned int num)
+{
+	unsigned long i, signals = 0;
+	struct virt_queue vq;
+	u64 start;
+
+	bench_setup_ring(&vq, num, false);
+
+	start = bench_now_ns();
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		vq.vring.used->idx++;
+		if (!(i % 16))
+			vring_used_event(&vq.vring) = vq.vring.used->idx;
+		signals += virtio_queue__should_signal(&vq);
+	}
+	bench_report("should_signal", num, start, BENCH_ITERATIONS);
+
+	if (!signals)
+		die("The guest was never signalled");
+}
+
+/* Includes copying the iovecs back, as memcpy_toiovec() consumes them */
+static void bench_memcpy_toiovec(unsigned int len)
+{
+	struct iovec chain[BENCH_CHAIN_LEN], iov[BENCH_CHAIN_LEN];
+	unsigned char *data;
+	unsigned long i;
+	u64 start;
+
+	data = malloc(len);
+	if (!data)
+		die("Couldn't allocate %u bytes", len);
+	memset(data, 0x5a, len);
+
+	for (i = 0; i < BENCH_CHAIN_LEN; i++)
+		chain[i] = (struct iovec) {
+			.iov_base	= guest_mem + BENCH_DATA_GPA +
+					  i * BENCH_BUF_SIZE,
+			.iov_len	= BENCH_BUF_SIZE,
+		};
+
+	start = bench_now_ns();
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		memcpy(iov, chain, sizeof(iov));
+		memcpy_toiovec(iov, data, len);
+	}
+	bench_report("memcpy_toiovec", len, start, BENCH_ITERATIONS);
+
+	free(data);
+}
+
+/* The same copy with a cursor, which leaves the iovecs alone */
+static void bench_iovec_cursor_to(unsigned int len)
+{
+	struct iovec chain[BENCH_CHAIN_LEN];
+	struct iovec_cursor cur;
+	unsigned char *data;
+	unsigned long i;
+	u64 start;
+
+	data = malloc(len);
+	if (!data)
+		die("Couldn't allocate %u bytes", len);
+	memset(data, 0x5a, len);
+
+	for (i = 0; i < BENCH_CHAIN_LEN; i++)
+		chain[i] = (struct iovec) {
+			.iov_base	= guest_mem + BENCH_DATA_GPA +
+					  i * BENCH_BUF_SIZE,
+			.iov_len	= BENCH_BUF_SIZE,
+		};
+
+	start = bench_now_ns();
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		iovec_cursor__init(&cur, chain, BENCH_CHAIN_LEN);
+		iovec_cursor__to(&cur, data, len);
+	}
+	bench_report("iovec_cursor__to", len, start, BENCH_ITERATIONS);
+
+	free(data);
+}
+
+/* Between two chains whose buffers are split at different offsets */
+static void bench_iovec_cursor_copy(unsigned int len)
+{
+	struct iovec src[BENCH_CHAIN_LEN], dst[BENCH_CHAIN_LEN + 1];
+	struct iovec_cursor src_cur, dst_cur;
+	unsigned long i;
+	u64 start;
+
+	for (i = 0; i < BENCH_CHAIN_LEN; i++)
+		src[i] = (struct iovec) {
+			.iov_base	= guest_mem + BENCH_DATA_GPA +
+					  i * BENCH_BUF_SIZE,
+			.iov_len	= BENCH_BUF_SIZE,
+		};
+	dst[0] = (struct iovec) {
+		.iov_base	= guest_mem + BENCH_INDIRECT_GPA,
+		.iov_len	= BENCH_BUF_SIZE / 2,
+	};
+	for (i = 1; i <= BENCH_CHAIN_LEN; i++)
+		dst[i] = (struct iovec) {
+			.iov_base	= guest_mem + BENCH_INDIRECT_GPA +
+					  i * BENCH_BUF_SIZE,
+			.iov_len	= BENCH_BUF_SIZE,
+		};
+
+	start = bench_now_ns();
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		iovec_cursor__init(&src_cur, src, BENCH_CHAIN_LEN);
+		iovec_cursor__init(&dst_cur, dst, BENCH_CHAIN_LEN + 1);
+		iovec_cursor__copy(&dst_cur, &src_cur, len);
+	}
+	bench_report("iovec_cursor__copy", len, start, BENCH_ITERATIONS);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+
+	guest_mem = calloc(1, BENCH_MEM_SIZE);
+	if (!guest_mem)
+		die("Couldn't allocate the guest memory");
+
+	printf("%-28s %8s %10s\n", "operation", "size", "ns/op");
+
+	for (i = 0; i < ARRAY_SIZE(ring_sizes); i++) {
+		bench_get_head_iov(ring_sizes[i], false);
+		bench_get_head_iov(ring_sizes[i], true);
+		bench_set_used_elem(ring_sizes[i]);
+		bench_should_signal(ring_sizes[i]);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(copy_sizes); i++) {
+		bench_memcpy_toiovec(copy_sizes[i]);
+		bench_iovec_cursor_to(copy_sizes[i]);
+		bench_iovec_cursor_copy(copy_sizes[i]);
+	}
+
+	free(guest_mem);
+
+	return 0;
+}
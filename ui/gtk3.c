@@ -3,6 +3,8 @@
 #include "kvm/framebuffer.h"
 #include "kvm/kvm-cpu.h"
 #include "kvm/i8042.h"
+#include "kvm/virtio-gpu.h"
+#include "kvm/virtio-input.h"
 #include "kvm/vesa.h"
 #include "kvm/kvm.h"
 
@@ -138,9 +140,18 @@ static const struct set2_scancode keymap[256] = {
 	[119]	= DEFINE_ESC(0x71),	/* <delete> */
 };
 
+/*
+ * The guest framebuffer, and a copy of it on the side of the display, which
+ * only takes the bands that the guest wrote. On X11 that's a pixmap that the
+ * server scales and converts into the window, with the GPU when it can.
+ */
 static cairo_surface_t	*surface;
+static cairo_surface_t	*screen;
+static struct framebuffer *gtk_fb;
 static bool		done;
 
+static struct fb_target_operations kvm_gtk_ops;
+
 static const struct set2_scancode *to_code(u8 scancode)
 {
         return &keymap[scancode];
@@ -150,27 +161,54 @@ static gboolean
 kvm_gtk_configure_event(GtkWidget * widget, GdkEventConfigure * event, gpointer data)
 {
 	struct framebuffer *fb = data;
+	cairo_t *cr;
 	int stride;
 
-	if (surface)
-		cairo_surface_destroy(surface);
+	if (!surface) {
+		stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24,
+						       fb->width);
+		surface = cairo_image_surface_create_for_data((void *) fb->mem,
+							      CAIRO_FORMAT_RGB24,
+							      fb->width,
+							      fb->height,
+							      stride);
+	}
 
-	stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, fb->width);
+	/* Resizing keeps the copy, it's the guest size whatever the window */
+	if (screen)
+		return TRUE;
 
-	surface =
-	    cairo_image_surface_create_for_data((void *) fb->mem,
-						CAIRO_FORMAT_RGB24,
-						fb->width,
-						fb->height,
-						stride);
+	screen = gdk_window_create_similar_surface(gtk_widget_get_window(widget),
+						   CAIRO_CONTENT_COLOR,
+						   fb->width, fb->height);
+	cr = cairo_create(screen);
+	cairo_set_source_surface(cr, surface, 0, 0);
+	cairo_paint(cr);
+	cairo_destroy(cr);
 
 	return TRUE;
 }
 
-static gboolean kvm_gtk_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
+static void kvm_gtk_scale(GtkWidget *widget, double *sx, double *sy)
 {
-	cairo_set_source_surface(cr, surface, 0, 0);
+	*sx = (double)gtk_widget_get_allocated_width(widget) / gtk_fb->width;
+	*sy = (double)gtk_widget_get_allocated_height(widget) / gtk_fb->height;
+}
 
+static gboolean kvm_gtk_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
+{
+	double sx, sy;
+
+	if (!screen)
+		return FALSE;
+
+	/* Stretched to the window, without touching guest memory */
+	kvm_gtk_scale(widget, &sx, &sy);
+	cairo_scale(cr, sx, sy);
+	cairo_set_source_surface(cr, screen, 0, 0);
+	if (sx != 1.0 || sy != 1.0)
+		cairo_pattern_set_filter(cairo_get_source(cr),
+					 CAIRO_FILTER_GOOD);
 	cairo_paint(cr);
 
 	return FALSE;
@@ -178,15 +216,43 @@ static gboolean kvm_gtk_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
 
 static void kvm_gtk_destroy(void)
 {
+	if (screen)
+		cairo_surface_destroy(screen);
 	if (surface)
 		cairo_surface_destroy(surface);
 
 	gtk_main_quit();
 }
 
-static gboolean kvm_gtk_redraw(GtkWidget * window)
+static gboolean kvm_gtk_redraw(GtkWidget *da)
 {
-	gtk_widget_queue_draw(window);
+	struct fb_rect rects[FB_MAX_RECTS];
+	double sx, sy;
+	cairo_t *cr;
+	int i, nr;
+
+	if (!screen)
+		return TRUE;
+
+	nr = fb__get_dirty(gtk_fb, &kvm_gtk_ops, rects, FB_MAX_RECTS);
+	if (nr <= 0)
+		return TRUE;
+
+	/* Only the dirty bands go to the display */
+	cr = cairo_create(screen);
+	cairo_set_source_surface(cr, surface, 0, 0);
+	for (i = 0; i < nr; i++)
+		cairo_rectangle(cr, rects[i].x, rects[i].y, rects[i].w,
+				rects[i].h);
+	cairo_fill(cr);
+	cairo_destroy(cr);
+
+	kvm_gtk_scale(da, &sx, &sy);
+	for (i = 0; i < nr; i++)
+		gtk_widget_queue_draw_area(da, rects[i].x * sx,
+					   rects[i].y * sy,
+					   rects[i].w * sx + 1,
+					   rects[i].h * sy + 1);
 
 	return TRUE;
 }
@@ -196,6 +262,12 @@ kvm_gtk_key_press(GtkWidget *widget, GdkEventKey *event, gpointer user_data)
 {
 	const struct set2_scancode *sc = to_code(event->hardware_keycode);
 
+	/* The X keycodes of GDK are evdev codes plus 8 */
+	if (virtio_input__enabled()) {
+		virtio_input__key(event->hardware_keycode - 8, true);
+		return TRUE;
+	}
+
         switch (sc->type) {
         case SCANCODE_ESCAPED:
                 kbd_queue(0xe0);
@@ -223,6 +295,82 @@ kvm_gtk_key_press(GtkWidget *widget, GdkEventKey *event, gpointer user_data)
 	return TRUE;
 }
 
+static gboolean
+kvm_gtk_key_release(GtkWidget *widget, GdkEventKey *event, gpointer user_data)
+{
+	virtio_input__key(event->hardware_keycode - 8, false);
+
+	return TRUE;
+}
+
+/* GDK numbers the buttons from 1 as VNC numbers its bits from 0 */
+static u32 kvm_gtk_buttons(guint state)
+{
+	return (state & GDK_BUTTON1_MASK ? VIRTIO_INPUT_BTN_LEFT : 0)
+		| (state & GDK_BUTTON2_MASK ? VIRTIO_INPUT_BTN_MIDDLE : 0)
+		| (state & GDK_BUTTON3_MASK ? VIRTIO_INPUT_BTN_RIGHT : 0);
+}
+
+/* The window is the whole screen of the guest, however it's stretched */
+static void kvm_gtk_pointer(GtkWidget *widget, double x, double y, u32 buttons)
+{
+	virtio_input__pointer(max(x, 0.0), max(y, 0.0),
+			      gtk_widget_get_allocated_width(widget),
+			      gtk_widget_get_allocated_height(widget), buttons);
+}
+
+static gboolean
+kvm_gtk_motion(GtkWidget *widget, GdkEventMotion *event, gpointer user_data)
+{
+	kvm_gtk_pointer(widget, event->x, event->y,
+			kvm_gtk_buttons(event->state));
+	/* With the motion hints, ask for the next movement */
+	gdk_event_request_motions(event);
+
+	return TRUE;
+}
+
+static gboolean
+kvm_gtk_button(GtkWidget *widget, GdkEventButton *event, gpointer user_data)
+{
+	u32 buttons = kvm_gtk_buttons(event->state);
+	u32 mask = 0;
+
+	/* The state is of before the event */
+	if (event->button >= 1 && event->button <= 3)
+		mask = 1U << (event->button - 1);
+	if (event->type == GDK_BUTTON_PRESS)
+		buttons |= mask;
+	else if (event->type == GDK_BUTTON_RELEASE)
+		buttons &= ~mask;
+	else
+		return TRUE;
+
+	kvm_gtk_pointer(widget, event->x, event->y, buttons);
+
+	return TRUE;
+}
+
+static gboolean
+kvm_gtk_scroll(GtkWidget *widget, GdkEventScroll *event, gpointer user_data)
+{
+	u32 buttons = kvm_gtk_buttons(event->state);
+
+	if (event->direction == GDK_SCROLL_UP)
+		buttons |= VIRTIO_INPUT_WHEEL_UP;
+	else if (event->direction == GDK_SCROLL_DOWN)
+		buttons |= VIRTIO_INPUT_WHEEL_DOWN;
+	else
+		return TRUE;
+
+	kvm_gtk_pointer(widget, event->x, event->y, buttons);
+	/* The wheel doesn't stay down, the next report releases it */
+	kvm_gtk_pointer(widget, event->x, event->y,
+			kvm_gtk_buttons(event->state));
+
+	return TRUE;
+}
+
 static void *kvm_gtk_thread(void *p)
 {
 	struct framebuffer *fb = p;
@@ -230,6 +378,8 @@ static void *kvm_gtk_thread(void *p)
 	GtkWidget *frame;
 	GtkWidget *da;
 
+	gtk_fb = fb;
+
 	gtk_init(NULL, NULL);
 
 	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
@@ -248,6 +398,7 @@ static void *kvm_gtk_thread(void *p)
 	da = gtk_drawing_area_new();
 
 	gtk_widget_set_size_request(da, 100, 100);
+	gtk_window_set_default_size(GTK_WINDOW(window), fb->width, fb->height);
 
 	gtk_container_add(GTK_CONTAINER(frame), da);
 
@@ -256,15 +407,29 @@ static void *kvm_gtk_thread(void *p)
 			 G_CALLBACK(kvm_gtk_configure_event), fb);
 	g_signal_connect(G_OBJECT (window), "key_press_event", G_CALLBACK(kvm_gtk_key_press), NULL);
 
+	if (virtio_input__enabled()) {
+		g_signal_connect(G_OBJECT(window), "key_release_event",
+				 G_CALLBACK(kvm_gtk_key_release), NULL);
+		g_signal_connect(da, "motion-notify-event",
+				 G_CALLBACK(kvm_gtk_motion), NULL);
+		g_signal_connect(da, "button-press-event",
+				 G_CALLBACK(kvm_gtk_button), NULL);
+		g_signal_connect(da, "button-release-event",
+				 G_CALLBACK(kvm_gtk_button), NULL);
+		g_signal_connect(da, "scroll-event",
+				 G_CALLBACK(kvm_gtk_scroll), NULL);
+	}
 
 	gtk_widget_set_events(da, gtk_widget_get_events(da)
 			      | GDK_BUTTON_PRESS_MASK
+			      | GDK_BUTTON_RELEASE_MASK
+			      | GDK_SCROLL_MASK
 			      | GDK_POINTER_MOTION_MASK
 			      | GDK_POINTER_MOTION_HINT_MASK);
 
 	gtk_widget_show_all(window);
 
-	g_timeout_add(1000 / FRAME_RATE, (GSourceFunc) kvm_gtk_redraw, window);
+	g_timeout_add(1000 / FRAME_RATE, (GSourceFunc) kvm_gtk_redraw, da);
 
 	gtk_main();
 
@@ -305,9 +470,13 @@ int kvm_gtk_init(struct kvm *kvm)
 	if (!kvm->cfg.gtk)
 		return 0;
 
-	fb = vesa__init(kvm);
+	if (kvm->cfg.virtio_gpu)
+		fb = virtio_gpu__init(kvm);
+	else
+		fb = vesa__init(kvm);
 	if (IS_ERR(fb)) {
-		pr_err("vesa__init() failed with error %ld\n", PTR_ERR(fb));
+		pr_err("Framebuffer initialisation failed with error %ld\n",
+		       PTR_ERR(fb));
 		return PTR_ERR(fb);
 	}
 
@@ -5,6 +5,8 @@
 #include "kvm/util.h"
 #include "kvm/kvm.h"
 #include "kvm/kvm-cpu.h"
+#include "kvm/virtio-gpu.h"
+#include "kvm/virtio-input.h"
 #include "kvm/vesa.h"
 
 #include <SDL/SDL.h>
@@ -197,14 +199,30 @@ static void key_release(const struct set2_scancode *sc)
 	}
 }
 
+static struct fb_target_operations sdl_ops;
+
+/* SDL numbers the buttons from 1 as VNC numbers its bits from 0 */
+static u32 sdl_buttons(u32 buttons, Uint8 button, bool down)
+{
+	u32 mask = 1U << (button - 1);
+
+	if (button < SDL_BUTTON_LEFT || button > SDL_BUTTON_WHEELDOWN)
+		return buttons;
+
+	return down ? buttons | mask : buttons & ~mask;
+}
+
 static void *sdl__thread(void *p)
 {
+	struct fb_rect rects[FB_MAX_RECTS];
+	SDL_Rect update[FB_MAX_RECTS];
 	Uint32 rmask, gmask, bmask, amask;
 	struct framebuffer *fb = p;
 	SDL_Surface *guest_screen;
 	SDL_Surface *screen;
 	SDL_Event ev;
 	Uint32 flags;
+	u32 buttons = 0;
 
 	kvm__set_thread_name("kvm-sdl-worker");
 
@@ -220,7 +238,8 @@ static void *sdl__thread(void *p)
 	if (!guest_screen)
 		die("Unable to create SDL RBG surface");
 
-	flags = SDL_HWSURFACE | SDL_ASYNCBLIT | SDL_HWACCEL | SDL_DOUBLEBUF;
+	/* Single buffered, so that only the rectangles that changed are redrawn */
+	flags = SDL_HWSURFACE | SDL_ASYNCBLIT | SDL_HWACCEL;
 
 	SDL_WM_SetCaption("KVM tool", "KVM tool");
 
@@ -231,13 +250,30 @@ static void *sdl__thread(void *p)
 	SDL_EnableKeyRepeat(200, 50);
 
 	while (running) {
-		SDL_BlitSurface(guest_screen, NULL, screen, NULL);
-		SDL_Flip(screen);
+		int i, nr;
+
+		nr = fb__get_dirty(fb, &sdl_ops, rects, FB_MAX_RECTS);
+		for (i = 0; i < nr; i++) {
+			update[i] = (SDL_Rect) {
+				.x	= rects[i].x,
+				.y	= rects[i].y,
+				.w	= rects[i].w,
+				.h	= rects[i].h,
+			};
+			SDL_BlitSurface(guest_screen, &update[i], screen, &update[i]);
+		}
+		if (nr > 0)
+			SDL_UpdateRects(screen, nr, update);
 
 		while (SDL_PollEvent(&ev)) {
 			switch (ev.type) {
 			case SDL_KEYDOWN: {
 				const struct set2_scancode *sc = to_code(ev.key.keysym.scancode);
+				/* The X keycodes of SDL are evdev codes plus 8 */
+				if (virtio_input__enabled()) {
+					virtio_input__key(ev.key.keysym.scancode - 8, true);
+					break;
+				}
 				if (sc->type == SCANCODE_UNKNOWN) {
 					pr_warning("key '%d' not found in keymap", ev.key.keysym.scancode);
 					break;
@@ -247,11 +283,28 @@ static void *sdl__thread(void *p)
 			}
 			case SDL_KEYUP: {
 				const struct set2_scancode *sc = to_code(ev.key.keysym.scancode);
+				if (virtio_input__enabled()) {
+					virtio_input__key(ev.key.keysym.scancode - 8, false);
+					break;
+				}
 				if (sc->type == SCANCODE_UNKNOWN)
 					break;
 				key_release(sc);
 				break;
 			}
+			case SDL_MOUSEMOTION:
+				virtio_input__pointer(ev.motion.x, ev.motion.y,
+						      fb->width, fb->height, buttons);
+				break;
+			case SDL_MOUSEBUTTONDOWN:
+			case SDL_MOUSEBUTTONUP:
+				buttons = sdl_buttons(buttons, ev.button.button,
+						      ev.type == SDL_MOUSEBUTTONDOWN);
+				virtio_input__pointer(ev.button.x, ev.button.y,
+						      fb->width, fb->height, buttons);
+				/* Wheel steps are a press each, they don't stay down */
+				buttons &= ~(VIRTIO_INPUT_WHEEL_UP | VIRTIO_INPUT_WHEEL_DOWN);
+				break;
 			case SDL_QUIT:
 				goto exit;
 			}
@@ -304,9 +357,13 @@ int sdl__init(struct kvm *kvm)
 	if (!kvm->cfg.sdl)
 		return 0;
 
-	fb = vesa__init(kvm);
+	if (kvm->cfg.virtio_gpu)
+		fb = virtio_gpu__init(kvm);
+	else
+		fb = vesa__init(kvm);
 	if (IS_ERR(fb)) {
-		pr_err("vesa__init() failed with error %ld\n", PTR_ERR(fb));
+		pr_err("Framebuffer initialisation failed with error %ld\n",
+		       PTR_ERR(fb));
 		return PTR_ERR(fb);
 	}
 
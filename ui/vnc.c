@@ -2,12 +2,21 @@
 
 #include "kvm/framebuffer.h"
 #include "kvm/i8042.h"
+#include "kvm/mutex.h"
+#include "kvm/virtio-gpu.h"
+#include "kvm/virtio-input.h"
 #include "kvm/vesa.h"
 
+#include <linux/input.h>
+#include <linux/kernel.h>
 #include <linux/types.h>
 #include <rfb/keysym.h>
 #include <rfb/rfb.h>
 #include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <linux/err.h>
 
 #define VESA_QUEUE_SIZE		128
@@ -37,6 +46,90 @@ static char num[10] = {
 	0x45, 0x16, 0x1e, 0x26, 0x2e, 0x23, 0x36, 0x3d, 0x3e, 0x46,
 };
 
+/*
+ * VNC sends keysyms, the characters of the keys, so the shifted characters
+ * map back to the key that the client holds shift with.
+ */
+static const struct {
+	rfbKeySym	key;
+	u16		code;
+} vnc_keys[] = {
+	{ XK_Escape, KEY_ESC },		{ XK_BackSpace, KEY_BACKSPACE },
+	{ XK_Tab, KEY_TAB },		{ XK_ISO_Left_Tab, KEY_TAB },
+	{ XK_Return, KEY_ENTER },	{ XK_space, KEY_SPACE },
+	{ XK_Insert, KEY_INSERT },	{ XK_Delete, KEY_DELETE },
+	{ XK_Home, KEY_HOME },		{ XK_End, KEY_END },
+	{ XK_Page_Up, KEY_PAGEUP },	{ XK_Page_Down, KEY_PAGEDOWN },
+	{ XK_Up, KEY_UP },		{ XK_Down, KEY_DOWN },
+	{ XK_Left, KEY_LEFT },		{ XK_Right, KEY_RIGHT },
+	{ XK_Shift_L, KEY_LEFTSHIFT },	{ XK_Shift_R, KEY_RIGHTSHIFT },
+	{ XK_Control_L, KEY_LEFTCTRL },	{ XK_Control_R, KEY_RIGHTCTRL },
+	{ XK_Alt_L, KEY_LEFTALT },	{ XK_Alt_R, KEY_RIGHTALT },
+	{ XK_Meta_L, KEY_LEFTMETA },	{ XK_Meta_R, KEY_RIGHTMETA },
+	{ XK_Super_L, KEY_LEFTMETA },	{ XK_Super_R, KEY_RIGHTMETA },
+	{ XK_Caps_Lock, KEY_CAPSLOCK },	{ XK_Num_Lock, KEY_NUMLOCK },
+	{ XK_Scroll_Lock, KEY_SCROLLLOCK }, { XK_Print, KEY_SYSRQ },
+	{ XK_Pause, KEY_PAUSE },	{ XK_Menu, KEY_COMPOSE },
+	{ XK_quoteleft, KEY_GRAVE },	{ XK_asciitilde, KEY_GRAVE },
+	{ XK_minus, KEY_MINUS },	{ XK_underscore, KEY_MINUS },
+	{ XK_equal, KEY_EQUAL },	{ XK_plus, KEY_EQUAL },
+	{ XK_bracketleft, KEY_LEFTBRACE }, { XK_braceleft, KEY_LEFTBRACE },
+	{ XK_bracketright, KEY_RIGHTBRACE }, { XK_braceright, KEY_RIGHTBRACE },
+	{ XK_backslash, KEY_BACKSLASH }, { XK_bar, KEY_BACKSLASH },
+	{ XK_semicolon, KEY_SEMICOLON }, { XK_colon, KEY_SEMICOLON },
+	{ XK_quoteright, KEY_APOSTROPHE }, { XK_quotedbl, KEY_APOSTROPHE },
+	{ XK_comma, KEY_COMMA },	{ XK_less, KEY_COMMA },
+	{ XK_period, KEY_DOT },		{ XK_greater, KEY_DOT },
+	{ XK_slash, KEY_SLASH },	{ XK_question, KEY_SLASH },
+	{ XK_exclam, KEY_1 },		{ XK_at, KEY_2 },
+	{ XK_numbersign, KEY_3 },	{ XK_dollar, KEY_4 },
+	{ XK_percent, KEY_5 },		{ XK_asciicircum, KEY_6 },
+	{ XK_ampersand, KEY_7 },	{ XK_asterisk, KEY_8 },
+	{ XK_parenleft, KEY_9 },	{ XK_parenright, KEY_0 },
+	{ XK_KP_Enter, KEY_KPENTER },	{ XK_KP_Add, KEY_KPPLUS },
+	{ XK_KP_Subtract, KEY_KPMINUS }, { XK_KP_Multiply, KEY_KPASTERISK },
+	{ XK_KP_Divide, KEY_KPSLASH },	{ XK_KP_Decimal, KEY_KPDOT },
+};
+
+static u16 vnc_key_code(rfbKeySym key)
+{
+	/* The KEY_* codes follow the rows of the keyboard, not the alphabet */
+	static const u16 key_letters[26] = {
+		KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I,
+		KEY_J, KEY_K, KEY_L, KEY_M, KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R,
+		KEY_S, KEY_T, KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z,
+	};
+	static const u16 keypad[10] = {
+		KEY_KP0, KEY_KP1, KEY_KP2, KEY_KP3, KEY_KP4, KEY_KP5, KEY_KP6,
+		KEY_KP7, KEY_KP8, KEY_KP9,
+	};
+	unsigned int i;
+
+	if (key >= XK_A && key <= XK_Z)
+		return key_letters[key - XK_A];
+	if (key >= XK_a && key <= XK_z)
+		return key_letters[key - XK_a];
+	if (key == XK_0)
+		return KEY_0;
+	if (key >= XK_1 && key <= XK_9)
+		return KEY_1 + key - XK_1;
+	if (key >= XK_KP_0 && key <= XK_KP_9)
+		return keypad[key - XK_KP_0];
+	if (key >= XK_F1 && key <= XK_F10)
+		return KEY_F1 + key - XK_F1;
+	if (key == XK_F11)
+		return KEY_F11;
+	if (key == XK_F12)
+		return KEY_F12;
+
+	for (i = 0; i < ARRAY_SIZE(vnc_keys); i++) {
+		if (vnc_keys[i].key == key)
+			return vnc_keys[i].code;
+	}
+
+	return 0;
+}
+
 /*
  * This is called when the VNC server receives a key event
  * The reason this function is such a beast is that we have
@@ -50,6 +143,11 @@ static void kbd_handle_key(rfbBool down, rfbKeySym key, rfbClientPtr cl)
 {
 	char tosend = 0;
 
+	if (virtio_input__enabled()) {
+		virtio_input__key(vnc_key_code(key), down);
+		return;
+	}
+
 	if (key >= 0x41 && key <= 0x5a)
 		key += 0x20; /* convert to lowercase */
 
@@ -145,6 +243,14 @@ static void kbd_handle_ptr(int buttonMask, int x, int y, rfbClientPtr cl)
 	int dx, dy;
 	char b1 = 0x8;
 
+	/* The tablet takes the absolute position, and the wheel */
+	if (virtio_input__enabled()) {
+		virtio_input__pointer(max(x, 0), max(y, 0), server->width,
+				      server->height, buttonMask);
+		rfbDefaultPtrAddEvent(buttonMask, x, y, cl);
+		return;
+	}
+
 	/* The VNC mask and the PS/2 button encoding are the same */
 	b1 |= buttonMask;
 
@@ -175,9 +281,161 @@ static void kbd_handle_ptr(int buttonMask, int x, int y, rfbClientPtr cl)
 	rfbDefaultPtrAddEvent(buttonMask, x, y, cl);
 }
 
+static struct fb_target_operations vnc_ops;
+
+/*
+ * libvncserver encodes for each client in a thread of its own, from a shadow
+ * of the framebuffer, and only once the client asked for an update. This
+ * thread syncs the dirty log while some client waits, no faster than
+ * VNC_FRAME_US, and marks only the rows that really changed, after moving
+ * scrolled bands with a CopyRect.
+ */
+#define VNC_FRAME_US		(5 * VESA_UPDATE_TIME)
+
+/* Bands shorter than this aren't worth looking for a scroll in */
+#define VNC_SCROLL_MIN_ROWS	16
+#define VNC_SCROLL_CANDIDATES	8
+
+static struct vnc_state {
+	struct mutex		lock;
+	pthread_cond_t		cond;
+	/* A client asked for an update that it didn't get yet */
+	bool			pending;
+	bool			stop;
+	int			nr_clients;
+	char			*shadow;
+	u64			*hashes;
+} vnc = {
+	.lock	= MUTEX_INITIALIZER,
+	.cond	= PTHREAD_COND_INITIALIZER,
+};
+
+static void vnc__wake(bool pending)
+{
+	mutex_lock(&vnc.lock);
+	vnc.pending |= pending;
+	pthread_cond_signal(&vnc.cond);
+	mutex_unlock(&vnc.lock);
+}
+
+static void vnc__update_request(rfbClientPtr cl,
+				rfbFramebufferUpdateRequestMsg *msg)
+{
+	vnc__wake(true);
+}
+
+static void vnc__client_gone(rfbClientPtr cl)
+{
+	mutex_lock(&vnc.lock);
+	if (!--vnc.nr_clients)
+		vnc.pending = false;
+	mutex_unlock(&vnc.lock);
+}
+
+static enum rfbNewClientAction vnc__new_client(rfbClientPtr cl)
+{
+	cl->clientFramebufferUpdateRequestHook = vnc__update_request;
+	cl->clientGoneHook = vnc__client_gone;
+
+	mutex_lock(&vnc.lock);
+	vnc.nr_clients++;
+	mutex_unlock(&vnc.lock);
+
+	return RFB_CLIENT_ACCEPT;
+}
+
+static u64 vnc__hash_row(const char *row, u32 len)
+{
+	const u64 *p = (const u64 *)row;
+	u64 hash = 0xcbf29ce484222325ULL;
+	u32 i;
+
+	for (i = 0; i < len / 8; i++)
+		hash = (hash ^ p[i]) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+/*
+ * Find by how many rows the band @y0 to @y1 of the guest framebuffer moved
+ * from the shadow, hashing rows into @old and @new. A terminal or a browser
+ * scroll moves most of the band and writes the rest.
+ */
+static int vnc__find_scroll(struct framebuffer *fb, u32 y0, u32 y1, u64 *old,
+			    u64 *new)
+{
+	u32 stride = fb->width * fb->depth / 8, h = y1 - y0;
+	u32 probe = h / 2, y, src, matches, best = 0;
+	int dy, best_dy = 0, candidates = 0;
+
+	for (y = 0; y < h; y++) {
+		old[y] = vnc__hash_row(vnc.shadow + (u64)(y0 + y) * stride, stride);
+		new[y] = vnc__hash_row(fb->mem + (u64)(y0 + y) * stride, stride);
+	}
+
+	if (new[probe] == old[probe])
+		return 0;
+
+	for (y = 0; y < h && candidates < VNC_SCROLL_CANDIDATES; y++) {
+		if (old[y] != new[probe])
+			continue;
+		candidates++;
+
+		dy = (int)probe - (int)y;
+		matches = 0;
+		for (src = max(0, -dy); src < h && (int)src + dy < (int)h; src++)
+			matches += old[src] == new[src + dy];
+
+		if (matches > best) {
+			best = matches;
+			best_dy = dy;
+		}
+	}
+
+	return best >= h / 2 ? best_dy : 0;
+}
+
+/* Bring the shadow up to date over @r, and tell the clients what changed */
+static void vnc__update_band(struct framebuffer *fb, struct fb_rect *r)
+{
+	u32 stride = fb->width * fb->depth / 8;
+	u32 y0 = r->y, y1 = r->y + r->h, y, run = y1;
+	char *row, *copy;
+	int dy = 0;
+
+	if (vnc.hashes && r->h >= VNC_SCROLL_MIN_ROWS && r->w == fb->width)
+		dy = vnc__find_scroll(fb, y0, y1, vnc.hashes,
+				      vnc.hashes + fb->height);
+
+	/* Moves the shadow rows too, the rows left behind are diffed below */
+	if (dy < 0)
+		rfbDoCopyRect(server, 0, y0, fb->width, y1 + dy, 0, dy);
+	else if (dy > 0)
+		rfbDoCopyRect(server, 0, y0 + dy, fb->width, y1, 0, dy);
+
+	for (y = y0; y <= y1; y++) {
+		row = fb->mem + (u64)y * stride;
+		copy = vnc.shadow + (u64)y * stride;
+
+		if (y < y1 && memcmp(copy, row, stride)) {
+			memcpy(copy, row, stride);
+			if (run == y1)
+				run = y;
+			continue;
+		}
+
+		if (run < y) {
+			rfbMarkRectAsModified(server, 0, run, fb->width, y);
+			run = y1;
+		}
+	}
+}
+
 static void *vnc__thread(void *p)
 {
+	struct fb_rect rects[FB_MAX_RECTS];
 	struct framebuffer *fb = p;
+	struct timespec now, next = {};
 	/*
 	 * Make a fake argc and argv because the getscreen function
 	 * seems to want it.
@@ -187,17 +445,63 @@ static void *vnc__thread(void *p)
 
 	kvm__set_thread_name("kvm-vnc-worker");
 
+	vnc.shadow = malloc((u64)fb->width * fb->height * fb->depth / 8);
+	if (!vnc.shadow) {
+		pr_err("Unable to allocate the VNC framebuffer");
+		return NULL;
+	}
+	memcpy(vnc.shadow, fb->mem, (u64)fb->width * fb->height * fb->depth / 8);
+	/* Without it, bands are only diffed, scrolls redrawn */
+	vnc.hashes = calloc(2 * fb->height, sizeof(*vnc.hashes));
+
 	server = rfbGetScreen(&argc, (char **) argv, fb->width, fb->height, 8, 3, 4);
-	server->frameBuffer		= fb->mem;
+	server->frameBuffer		= vnc.shadow;
 	server->alwaysShared		= TRUE;
 	server->kbdAddEvent		= kbd_handle_key;
 	server->ptrAddEvent		= kbd_handle_ptr;
+	server->newClientHook		= vnc__new_client;
 	rfbInitServer(server);
-
-	while (rfbIsActive(server)) {
-		rfbMarkRectAsModified(server, 0, 0, fb->width, fb->height);
-		rfbProcessEvents(server, server->deferUpdateTime * VESA_UPDATE_TIME);
+	/* A thread accepting clients, and two more for each client */
+	rfbRunEventLoop(server, -1, TRUE);
+
+	for (;;) {
+		int i, nr;
+
+		mutex_lock(&vnc.lock);
+		while (!vnc.pending && !vnc.stop)
+			pthread_cond_wait(&vnc.cond, &vnc.lock.mutex);
+		if (vnc.stop) {
+			mutex_unlock(&vnc.lock);
+			break;
+		}
+		mutex_unlock(&vnc.lock);
+
+		/* At the pace that the clients ask, up to a frame per interval */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec < next.tv_sec ||
+		    (now.tv_sec == next.tv_sec && now.tv_nsec < next.tv_nsec)) {
+			usleep(((next.tv_sec - now.tv_sec) * 1000000000L +
+				next.tv_nsec - now.tv_nsec) / 1000);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		}
+		next = now;
+		next.tv_nsec += VNC_FRAME_US * 1000L;
+		next.tv_sec += next.tv_nsec / 1000000000L;
+		next.tv_nsec %= 1000000000L;
+
+		nr = fb__get_dirty(fb, &vnc_ops, rects, FB_MAX_RECTS);
+		if (nr <= 0)
+			continue;
+
+		/* The clients want more once they have these */
+		mutex_lock(&vnc.lock);
+		vnc.pending = false;
+		mutex_unlock(&vnc.lock);
+
+		for (i = 0; i < nr; i++)
+			vnc__update_band(fb, &rects[i]);
 	}
+
 	return NULL;
 }
 
@@ -213,7 +517,13 @@ static int vnc__start(struct framebuffer *fb)
 
 static int vnc__stop(struct framebuffer *fb)
 {
-	rfbShutdownServer(server, TRUE);
+	mutex_lock(&vnc.lock);
+	vnc.stop = true;
+	pthread_cond_signal(&vnc.cond);
+	mutex_unlock(&vnc.lock);
+
+	if (server)
+		rfbShutdownServer(server, TRUE);
 
 	return 0;
 }
@@ -230,9 +540,13 @@ int vnc__init(struct kvm *kvm)
 	if (!kvm->cfg.vnc)
 		return 0;
 
-	fb = vesa__init(kvm);
+	if (kvm->cfg.virtio_gpu)
+		fb = virtio_gpu__init(kvm);
+	else
+		fb = vesa__init(kvm);
 	if (IS_ERR(fb)) {
-		pr_err("vesa__init() failed with error %ld\n", PTR_ERR(fb));
+		pr_err("Framebuffer initialisation failed with error %ld\n",
+		       PTR_ERR(fb));
 		return PTR_ERR(fb);
 	}
 
@@ -254,3 +254,17 @@ bool __bitmap_subset(const unsigned long *bitmap1, const unsigned long *bitmap2,
 
 	return true;
 }
+
+unsigned int __bitmap_weight(const unsigned long *bitmap, unsigned int nbits)
+{
+	unsigned int k, lim = nbits / BITS_PER_LONG, w = 0;
+
+	for (k = 0; k < lim; k++)
+		w += __builtin_popcountl(bitmap[k]);
+
+	if (nbits % BITS_PER_LONG)
+		w += __builtin_popcountl(bitmap[k] &
+					 BITMAP_LAST_WORD_MASK(nbits));
+
+	return w;
+}
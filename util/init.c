@@ -1,11 +1,26 @@
 #include <linux/list.h>
 #include <linux/kernel.h>
 
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "kvm/boot-trace.h"
 #include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
 #include "kvm/util-init.h"
 
 #define PRIORITY_LISTS 10
 
+static const char * const init_level_names[PRIORITY_LISTS] = {
+	[0] = "core",
+	[2] = "base",
+	[4] = "dev_base",
+	[5] = "dev",
+	[6] = "virtio_dev",
+	[7] = "firmware",
+	[9] = "late",
+};
+
 static struct hlist_head init_lists[PRIORITY_LISTS];
 static struct hlist_head exit_lists[PRIORITY_LISTS];
 
@@ -34,34 +49,173 @@ int init_list__init(struct kvm *kvm)
 	unsigned int i;
 	int r = 0;
 	struct init_item *t;
+	u64 start, level_start;
+
+	if (kvm->cfg.boot_trace)
+		boot_trace__start(kvm);
 
-	for (i = 0; i < ARRAY_SIZE(init_lists); i++)
+	if (kvm->cfg.startup_debug)
+		pr_info("startup: %.3f ms before initialisation",
+			(kvm_cpu__now() - kvm->start_ns) / 1e6);
+
+	for (i = 0; i < ARRAY_SIZE(init_lists); i++) {
+		level_start = kvm_cpu__now();
 		hlist_for_each_entry(t, &init_lists[i], n) {
+			start = kvm_cpu__now();
 			r = t->init(kvm);
 			if (r < 0) {
 				pr_warning("Failed init: %s\n", t->fn_name);
 				goto fail;
 			}
+
+			if (kvm->cfg.startup_debug)
+				pr_info("startup: %-28s level %u %8.3f ms",
+					t->fn_name, i,
+					(kvm_cpu__now() - start) / 1e6);
+			if (boot_trace_enabled)
+				boot_trace__span("init", t->fn_name, start,
+						 kvm_cpu__now());
 		}
 
+		if (boot_trace_enabled && !hlist_empty(&init_lists[i]))
+			boot_trace__span("level", init_level_names[i] ?: "init",
+					 level_start, kvm_cpu__now());
+	}
+
+	if (kvm->cfg.startup_debug)
+		pr_info("startup: %.3f ms to initialise",
+			(kvm_cpu__now() - kvm->start_ns) / 1e6);
+
 fail:
 	return r;
 }
 
+struct exit_job {
+	pthread_t		thread;
+	struct init_item	*t;
+	struct kvm		*kvm;
+	u64			ns;
+	int			r;
+	bool			started;
+};
+
+static int exit_item__run(struct init_item *t, struct kvm *kvm, u64 *ns)
+{
+	u64 start = kvm_cpu__now();
+	int r;
+
+	r = t->init(kvm);
+	*ns = kvm_cpu__now() - start;
+	if (r < 0)
+		pr_warning("%s failed.\n", t->fn_name);
+
+	return r;
+}
+
+static void *exit_job__thread(void *arg)
+{
+	struct exit_job *job = arg;
+
+	kvm__set_thread_name("kvm-exit");
+	job->r = exit_item__run(job->t, job->kvm, &job->ns);
+
+	return NULL;
+}
+
+/*
+ * The serial exits of a level run first and in order, then the parallel
+ * ones, which only have to be independent of each other, all at once.
+ */
+static int init_list__exit_level(struct kvm *kvm, unsigned int level,
+				 bool debug)
+{
+	struct exit_job *jobs = NULL;
+	unsigned int i, nr_jobs = 0;
+	struct init_item *t;
+	int r = 0;
+	u64 ns;
+
+	hlist_for_each_entry(t, &exit_lists[level], n) {
+		if (t->parallel) {
+			nr_jobs++;
+			continue;
+		}
+
+		r = exit_item__run(t, kvm, &ns);
+		if (r < 0)
+			return r;
+		if (debug)
+			pr_info("teardown: %-27s level %u %8.3f ms",
+				t->fn_name, level, ns / 1e6);
+	}
+
+	if (nr_jobs)
+		jobs = calloc(nr_jobs, sizeof(*jobs));
+
+	i = 0;
+	hlist_for_each_entry(t, &exit_lists[level], n) {
+		if (!t->parallel)
+			continue;
+
+		if (jobs) {
+			jobs[i] = (struct exit_job) { .t = t, .kvm = kvm };
+			jobs[i].started = !pthread_create(&jobs[i].thread, NULL,
+							  exit_job__thread,
+							  &jobs[i]);
+			if (jobs[i++].started)
+				continue;
+		}
+
+		/* No thread, no harm: it runs on its own here */
+		r = exit_item__run(t, kvm, &ns);
+		if (debug && r >= 0)
+			pr_info("teardown: %-27s level %u %8.3f ms",
+				t->fn_name, level, ns / 1e6);
+		if (r < 0)
+			break;
+	}
+
+	for (i = 0; jobs && i < nr_jobs; i++) {
+		if (!jobs[i].started)
+			continue;
+
+		pthread_join(jobs[i].thread, NULL);
+		if (debug && jobs[i].r >= 0)
+			pr_info("teardown: %-27s level %u %8.3f ms (parallel)",
+				jobs[i].t->fn_name, level, jobs[i].ns / 1e6);
+		if (jobs[i].r < 0 && !r)
+			r = jobs[i].r;
+	}
+	free(jobs);
+
+	return r;
+}
+
 int init_list__exit(struct kvm *kvm)
 {
+	/* kvm__exit() frees the configuration along with the rest */
+	bool debug = kvm->cfg.startup_debug;
+	u64 start = kvm_cpu__now(), level_start;
 	int i;
 	int r = 0;
-	struct init_item *t;
 
-	for (i = ARRAY_SIZE(exit_lists) - 1; i >= 0; i--)
-		hlist_for_each_entry(t, &exit_lists[i], n) {
-			r = t->init(kvm);
-			if (r < 0) {
-				pr_warning("%s failed.\n", t->fn_name);
-				goto fail;
-			}
-		}
-fail:
+	for (i = ARRAY_SIZE(exit_lists) - 1; i >= 0; i--) {
+		if (hlist_empty(&exit_lists[i]))
+			continue;
+
+		level_start = kvm_cpu__now();
+		r = init_list__exit_level(kvm, i, debug);
+		if (r < 0)
+			break;
+		if (debug)
+			pr_info("teardown: level %-21s %8.3f ms",
+				init_level_names[i] ?: "exit",
+				(kvm_cpu__now() - level_start) / 1e6);
+	}
+
+	if (debug && r >= 0)
+		pr_info("teardown: %.3f ms to tear down",
+			(kvm_cpu__now() - start) / 1e6);
+
 	return r;
 }
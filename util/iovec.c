@@ -19,6 +19,7 @@
 #include <linux/errno.h>
 #include <linux/kernel.h>
 #include <linux/compiler.h>
+#include <linux/prefetch.h>
 #include <sys/uio.h>
 #include <kvm/iovec.h>
 #include <string.h>
@@ -150,3 +151,131 @@ int memcpy_fromiovecend(unsigned char *kdata, const struct iovec *iov,
 
 	return 0;
 }
+
+/*
+ *	Point dst at count bytes of src, starting skip bytes in, so that the
+ *	payload after a header can be read or written in place. Returns the
+ *	number of entries used in dst, which must have room for cnt of them.
+ */
+int iovec_window(struct iovec *dst, const struct iovec *src, int cnt,
+		 size_t skip, size_t count)
+{
+	size_t len;
+	int i, n = 0;
+
+	for (i = 0; i < cnt && count; i++) {
+		if (skip >= src[i].iov_len) {
+			skip -= src[i].iov_len;
+			continue;
+		}
+
+		len = min(src[i].iov_len - skip, count);
+		dst[n].iov_base	= src[i].iov_base + skip;
+		dst[n].iov_len	= len;
+		n++;
+		count -= len;
+		skip = 0;
+	}
+
+	return n;
+}
+
+/* Past the current element when the cursor reached its end, or empty ones */
+void __iovec_cursor__normalize(struct iovec_cursor *cur)
+{
+	while (cur->cnt && cur->off >= cur->iov->iov_len) {
+		cur->off -= cur->iov->iov_len;
+		cur->iov++;
+		cur->cnt--;
+	}
+}
+
+/*
+ * The next element of a large copy is most likely cold, being some other
+ * guest page, so start fetching it while the current one is copied.
+ */
+#define IOVEC_PREFETCH_MIN	1024
+
+static inline void iovec_cursor__prefetch(const struct iovec_cursor *cur,
+					  size_t copy)
+{
+	if (copy >= IOVEC_PREFETCH_MIN && cur->cnt > 1)
+		prefetch(cur->iov[1].iov_base);
+}
+
+size_t iovec_cursor__skip(struct iovec_cursor *cur, size_t len)
+{
+	size_t done = 0, copy;
+
+	while (len && cur->cnt) {
+		copy = min(len, cur->iov->iov_len - cur->off);
+		cur->off += copy;
+		done += copy;
+		len -= copy;
+		__iovec_cursor__normalize(cur);
+	}
+
+	return done;
+}
+
+size_t __iovec_cursor__to(struct iovec_cursor *cur, const void *buf,
+			  size_t len)
+{
+	size_t done = 0, copy;
+
+	while (len && cur->cnt) {
+		copy = min(len, cur->iov->iov_len - cur->off);
+		iovec_cursor__prefetch(cur, copy);
+		memcpy(cur->iov->iov_base + cur->off, buf + done, copy);
+		cur->off += copy;
+		done += copy;
+		len -= copy;
+		__iovec_cursor__normalize(cur);
+	}
+
+	return done;
+}
+
+size_t __iovec_cursor__from(struct iovec_cursor *cur, void *buf, size_t len)
+{
+	size_t done = 0, copy;
+
+	while (len && cur->cnt) {
+		copy = min(len, cur->iov->iov_len - cur->off);
+		iovec_cursor__prefetch(cur, copy);
+		memcpy(buf + done, cur->iov->iov_base + cur->off, copy);
+		cur->off += copy;
+		done += copy;
+		len -= copy;
+		__iovec_cursor__normalize(cur);
+	}
+
+	return done;
+}
+
+/*
+ * Copy @len bytes from one scatter/gather list to another, without bouncing
+ * them through a buffer. Returns how many were copied, less than @len when
+ * either list ran out.
+ */
+size_t iovec_cursor__copy(struct iovec_cursor *dst, struct iovec_cursor *src,
+			  size_t len)
+{
+	size_t done = 0, copy;
+
+	while (len && dst->cnt && src->cnt) {
+		copy = min(len, min(dst->iov->iov_len - dst->off,
+				    src->iov->iov_len - src->off));
+		iovec_cursor__prefetch(src, copy);
+		memcpy(dst->iov->iov_base + dst->off,
+		       src->iov->iov_base + src->off, copy);
+		dst->off += copy;
+		src->off += copy;
+		done += copy;
+		len -= copy;
+		__iovec_cursor__normalize(dst);
+		__iovec_cursor__normalize(src);
+	}
+
+	return done;
+}
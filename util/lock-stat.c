@@ -0,0 +1,116 @@
+#include "kvm/lock-stat.h"
+#include "kvm/mutex.h"
+
+#ifdef CONFIG_LOCK_STAT
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Every site that has taken a mutex, pushed on first use and never removed */
+static struct lock_stat_site *lock_stat_sites;
+
+static u64 lock_stat__now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void lock_stat__register(struct lock_stat_site *site)
+{
+	int unregistered = 0;
+
+	if (__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE))
+		return;
+	if (!__atomic_compare_exchange_n(&site->registered, &unregistered, 1,
+					 false, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE))
+		return;
+
+	site->next = __atomic_load_n(&lock_stat_sites, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&lock_stat_sites, &site->next, site,
+					    false, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+void lock_stat__lock(struct mutex *lock, struct lock_stat_site *site)
+{
+	u64 start, wait, max;
+	int r;
+
+	lock_stat__register(site);
+
+	r = pthread_mutex_trylock(&lock->mutex);
+	if (r == EBUSY) {
+		start = lock_stat__now();
+		r = pthread_mutex_lock(&lock->mutex);
+		wait = lock_stat__now() - start;
+
+		__atomic_add_fetch(&site->contended, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&site->wait_ns, wait, __ATOMIC_RELAXED);
+		max = __atomic_load_n(&site->max_wait_ns, __ATOMIC_RELAXED);
+		while (wait > max &&
+		       !__atomic_compare_exchange_n(&site->max_wait_ns, &max,
+						    wait, false,
+						    __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED))
+			;
+	}
+	if (r != 0)
+		die("unexpected pthread_mutex_lock() failure!");
+
+	__atomic_add_fetch(&site->acquired, 1, __ATOMIC_RELAXED);
+	lock->site = site;
+	lock->acquired_at = lock_stat__now();
+}
+
+void lock_stat__unlock(struct mutex *lock)
+{
+	struct lock_stat_site *site = lock->site;
+
+	/*
+	 * Unset when another thread took the mutex during a pthread_cond_wait()
+	 * of this one, otherwise the hold time counts that wait too.
+	 */
+	if (site) {
+		__atomic_add_fetch(&site->hold_ns,
+				   lock_stat__now() - lock->acquired_at,
+				   __ATOMIC_RELAXED);
+		lock->site = NULL;
+	}
+
+	if (pthread_mutex_unlock(&lock->mutex) != 0)
+		die("unexpected pthread_mutex_unlock() failure!");
+}
+
+u32 lock_stat__get(struct kvm_lock_stat *recs, u32 max)
+{
+	struct lock_stat_site *site;
+	u32 nr = 0;
+
+	site = __atomic_load_n(&lock_stat_sites, __ATOMIC_ACQUIRE);
+	for (; site && nr < max; site = site->next, nr++) {
+		snprintf(recs[nr].site, sizeof(recs[nr].site), "%s:%d (%s)",
+			 site->file, site->line, site->func);
+		recs[nr].acquired = __atomic_load_n(&site->acquired,
+						    __ATOMIC_RELAXED);
+		recs[nr].contended = __atomic_load_n(&site->contended,
+						     __ATOMIC_RELAXED);
+		recs[nr].wait_ns = __atomic_load_n(&site->wait_ns,
+						   __ATOMIC_RELAXED);
+		recs[nr].max_wait_ns = __atomic_load_n(&site->max_wait_ns,
+						       __ATOMIC_RELAXED);
+		recs[nr].hold_ns = __atomic_load_n(&site->hold_ns,
+						   __ATOMIC_RELAXED);
+	}
+
+	return nr;
+}
+#else
+u32 lock_stat__get(struct kvm_lock_stat *recs, u32 max)
+{
+	return 0;
+}
+#endif /* CONFIG_LOCK_STAT */
@@ -0,0 +1,67 @@
+#include "kvm/mem-pool.h"
+#include "kvm/util.h"
+
+#include <linux/kernel.h>
+
+#include <stdlib.h>
+
+/* The free objects are chained through their first word */
+struct mem_pool_obj {
+	struct mem_pool_obj	*next;
+};
+
+void mem_pool__init(struct mem_pool *pool, size_t size, u32 max_free)
+{
+	*pool = (struct mem_pool) {
+		.size		= max_t(size_t, size, sizeof(struct mem_pool_obj)),
+		.max_free	= max_free,
+	};
+	mutex_init(&pool->lock);
+}
+
+void *mem_pool__get(struct mem_pool *pool)
+{
+	struct mem_pool_obj *obj;
+
+	mutex_lock(&pool->lock);
+	obj = pool->free;
+	if (obj) {
+		pool->free = obj->next;
+		pool->nr_free--;
+	}
+	mutex_unlock(&pool->lock);
+
+	return obj ? obj : malloc(pool->size);
+}
+
+void mem_pool__put(struct mem_pool *pool, void *p)
+{
+	struct mem_pool_obj *obj = p;
+
+	if (!obj)
+		return;
+
+	mutex_lock(&pool->lock);
+	if (pool->nr_free < pool->max_free) {
+		obj->next = pool->free;
+		pool->free = obj;
+		pool->nr_free++;
+		obj = NULL;
+	}
+	mutex_unlock(&pool->lock);
+
+	free(obj);
+}
+
+void mem_pool__exit(struct mem_pool *pool)
+{
+	struct mem_pool_obj *obj;
+
+	mutex_lock(&pool->lock);
+	while ((obj = pool->free)) {
+		pool->free = obj->next;
+		free(obj);
+	}
+	pool->nr_free = 0;
+	mutex_unlock(&pool->lock);
+}
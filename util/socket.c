@@ -0,0 +1,121 @@
+#include "kvm/socket.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int socket__set_nodelay(int fd)
+{
+	int one = 1;
+
+	/* The last records shouldn't wait for more to fill a packet */
+	return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static int socket__unix(const char *path, bool listening, int backlog)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd, r;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (listening) {
+		unlink(path);
+		r = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+		if (!r)
+			r = listen(fd, backlog);
+	} else {
+		r = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+	}
+
+	if (r < 0) {
+		r = -errno;
+		close(fd);
+		return r;
+	}
+
+	return fd;
+}
+
+static int socket__tcp(const char *dest, bool listening, int backlog)
+{
+	struct addrinfo hints = {
+		.ai_family	= AF_UNSPEC,
+		.ai_socktype	= SOCK_STREAM,
+		.ai_flags	= listening ? AI_PASSIVE : 0,
+	};
+	struct addrinfo *res, *ai;
+	const char *port, *end;
+	char host[256];
+	int fd = -EINVAL, one = 1;
+
+	/* host:port, [v6 address]:port, or :port to listen on all of them */
+	if (dest[0] == '[') {
+		end = strchr(dest, ']');
+		if (!end || end[1] != ':')
+			return -EINVAL;
+		dest++;
+		port = end + 2;
+	} else {
+		end = strrchr(dest, ':');
+		if (!end)
+			return -EINVAL;
+		port = end + 1;
+	}
+
+	if ((size_t)(end - dest) >= sizeof(host))
+		return -ENAMETOOLONG;
+	memcpy(host, dest, end - dest);
+	host[end - dest] = '\0';
+
+	if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res))
+		return -EHOSTUNREACH;
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+			    ai->ai_protocol);
+		if (fd < 0) {
+			fd = -errno;
+			continue;
+		}
+
+		if (listening) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one,
+				   sizeof(one));
+			if (!bind(fd, ai->ai_addr, ai->ai_addrlen) &&
+			    !listen(fd, backlog))
+				break;
+		} else if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+			socket__set_nodelay(fd);
+			break;
+		}
+
+		close(fd);
+		fd = -errno;
+	}
+
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+int socket__open(const char *dest, bool listening, int backlog)
+{
+	if (!strncmp(dest, "tcp:", 4))
+		return socket__tcp(dest + 4, listening, backlog);
+	if (!strncmp(dest, "unix:", 5))
+		return socket__unix(dest + 5, listening, backlog);
+
+	return -EINVAL;
+}
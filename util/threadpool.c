@@ -1,157 +1,344 @@
 #include "kvm/threadpool.h"
 #include "kvm/mutex.h"
 #include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/read-write.h"
+#include "kvm/metrics.h"
 
+#include <linux/futex.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <sys/syscall.h>
+
+/*
+ * Each worker owns a queue of jobs. Jobs are queued on the worker they were
+ * last signalled from, the worker they prefer, or the next one in turn, and
+ * a worker whose queue is empty steals the most recently queued job of the
+ * others. A job's signalcount tells whether it is queued or running, so
+ * signalling it again is a single atomic increment.
+ *
+ * Idle workers sleep on a futex, which is only woken when some worker is
+ * idle.
+ */
+struct thread_pool__worker {
+	struct mutex			lock;
+	struct list_head		queue;
+	pthread_t			thread;
+	struct thread_pool__stats	stats;
+};
+
+/* Holds the jobs signalled before the workers exist */
+static struct thread_pool__worker early_worker = {
+	.lock	= MUTEX_INITIALIZER,
+	.queue	= LIST_HEAD_INIT(early_worker.queue),
+};
+
+static struct thread_pool__worker	*workers;
+static unsigned int			nr_workers;
+static unsigned int			next_worker;
+static bool				running;
+
+static int				wake_seq;
+static int				nr_idle;
+
+static __thread struct thread_pool__worker *current_worker;
+
+static void thread_pool__job_push(struct thread_pool__worker *worker,
+				  struct thread_pool__job *job)
+{
+	mutex_lock(&worker->lock);
+	job->queued_ns = kvm_cpu__now();
+	job->worker = worker;
+	list_add_tail(&job->queue, &worker->queue);
+	worker->stats.depth++;
+	worker->stats.max_depth = max(worker->stats.max_depth,
+				      worker->stats.depth);
+	mutex_unlock(&worker->lock);
+}
+
+/* Take the oldest job of our own queue, or the newest of another one */
+static struct thread_pool__job *
+thread_pool__job_pop(struct thread_pool__worker *worker, bool steal)
+{
+	struct thread_pool__job *job = NULL;
 
-static DEFINE_MUTEX(job_mutex);
-static DEFINE_MUTEX(thread_mutex);
-static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+	if (list_empty(&worker->queue))
+		return NULL;
 
-static LIST_HEAD(head);
+	mutex_lock(&worker->lock);
+	if (!list_empty(&worker->queue)) {
+		if (steal)
+			job = list_last_entry(&worker->queue,
+					      struct thread_pool__job, queue);
+		else
+			job = list_first_entry(&worker->queue,
+					       struct thread_pool__job, queue);
+		list_del_init(&job->queue);
+		job->worker = NULL;
+		worker->stats.depth--;
+	}
+	mutex_unlock(&worker->lock);
 
-static pthread_t	*threads;
-static long		threadcount;
-static bool		running;
+	return job;
+}
 
-static struct thread_pool__job *thread_pool__job_pop_locked(void)
+static struct thread_pool__job *
+thread_pool__find_job(struct thread_pool__worker *self)
 {
+	struct thread_pool__worker *pool;
 	struct thread_pool__job *job;
+	unsigned int i, idx;
 
-	if (list_empty(&head))
+	job = thread_pool__job_pop(self, false);
+	if (job)
+		return job;
+
+	/* The others are only known once all of them have started */
+	pool = __atomic_load_n(&workers, __ATOMIC_ACQUIRE);
+	if (!pool)
 		return NULL;
 
-	job = list_first_entry(&head, struct thread_pool__job, queue);
-	list_del_init(&job->queue);
+	idx = self - pool;
+	for (i = 1; i < nr_workers; i++) {
+		job = thread_pool__job_pop(&pool[(idx + i) % nr_workers], true);
+		if (job) {
+			self->stats.stolen++;
+			return job;
+		}
+	}
 
-	return job;
+	return NULL;
 }
 
-static void thread_pool__job_push_locked(struct thread_pool__job *job)
+static void thread_pool__wake(void)
 {
-	list_add_tail(&job->queue, &head);
+	/* Pairs with the barrier between going idle and looking for jobs */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&nr_idle, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_add_fetch(&wake_seq, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &wake_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
 }
 
-static struct thread_pool__job *thread_pool__job_pop(void)
+static struct thread_pool__worker *
+thread_pool__pick_worker(struct thread_pool__job *job)
 {
-	struct thread_pool__job *job;
+	if (job->worker_hint >= 0)
+		return &workers[job->worker_hint % nr_workers];
 
-	mutex_lock(&job_mutex);
-	job = thread_pool__job_pop_locked();
-	mutex_unlock(&job_mutex);
-	return job;
+	if (current_worker)
+		return current_worker;
+
+	return &workers[__atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED) %
+			nr_workers];
 }
 
-static void thread_pool__job_push(struct thread_pool__job *job)
+static void thread_pool__queue_job(struct thread_pool__job *job)
 {
-	mutex_lock(&job_mutex);
-	thread_pool__job_push_locked(job);
-	mutex_unlock(&job_mutex);
+	struct thread_pool__worker *worker;
+
+	if (!__atomic_load_n(&workers, __ATOMIC_ACQUIRE)) {
+		/* Recheck under the lock that thread_pool__init() drains with */
+		mutex_lock(&early_worker.lock);
+		if (!workers) {
+			job->worker = &early_worker;
+			list_add_tail(&job->queue, &early_worker.queue);
+			mutex_unlock(&early_worker.lock);
+			return;
+		}
+		mutex_unlock(&early_worker.lock);
+	}
+
+	worker = thread_pool__pick_worker(job);
+	thread_pool__job_push(worker, job);
+	thread_pool__wake();
 }
 
-static void thread_pool__handle_job(struct thread_pool__job *job)
+static void thread_pool__handle_job(struct thread_pool__worker *self,
+				    struct thread_pool__job *job)
 {
-	while (job) {
-		job->callback(job->kvm, job->data);
+	u64 start = kvm_cpu__now(), end;
 
-		mutex_lock(&job->mutex);
+	self->stats.wait_ns += start - job->queued_ns;
 
-		if (--job->signalcount > 0)
-			/* If the job was signaled again while we were working */
-			thread_pool__job_push(job);
+	job->callback(job->kvm, job->data);
 
-		mutex_unlock(&job->mutex);
+	end = kvm_cpu__now();
+	self->stats.run_ns += end - start;
+	self->stats.jobs++;
 
-		job = thread_pool__job_pop();
-	}
-}
-
-static void thread_pool__threadfunc_cleanup(void *param)
-{
-	mutex_unlock(&job_mutex);
+	/* If the job was signaled again while we were working */
+	if (__atomic_sub_fetch(&job->signalcount, 1, __ATOMIC_SEQ_CST) > 0)
+		thread_pool__queue_job(job);
 }
 
 static void *thread_pool__threadfunc(void *param)
 {
-	pthread_cleanup_push(thread_pool__threadfunc_cleanup, NULL);
+	struct thread_pool__worker *self = param;
+	struct thread_pool__job *job;
+	int seq;
 
+	current_worker = self;
 	kvm__set_thread_name("threadpool-worker");
 
-	while (running) {
-		struct thread_pool__job *curjob = NULL;
+	while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		job = thread_pool__find_job(self);
+		if (job) {
+			thread_pool__handle_job(self, job);
+			continue;
+		}
 
-		mutex_lock(&job_mutex);
-		while (running && (curjob = thread_pool__job_pop_locked()) == NULL)
-			pthread_cond_wait(&job_cond, &job_mutex.mutex);
-		mutex_unlock(&job_mutex);
+		__atomic_add_fetch(&nr_idle, 1, __ATOMIC_SEQ_CST);
+		seq = __atomic_load_n(&wake_seq, __ATOMIC_SEQ_CST);
 
-		if (running)
-			thread_pool__handle_job(curjob);
-	}
+		/* Look again, now that queueing a job would wake us up */
+		job = thread_pool__find_job(self);
+		if (!job && __atomic_load_n(&running, __ATOMIC_ACQUIRE))
+			syscall(SYS_futex, &wake_seq, FUTEX_WAIT_PRIVATE, seq,
+				NULL, NULL, 0);
+
+		__atomic_sub_fetch(&nr_idle, 1, __ATOMIC_SEQ_CST);
 
-	pthread_cleanup_pop(0);
+		if (job)
+			thread_pool__handle_job(self, job);
+	}
 
 	return NULL;
 }
 
-static int thread_pool__addthread(void)
+static void thread_pool__handle_stats(struct kvm *kvm, int fd, u32 type,
+				      u32 len, u8 *msg)
 {
-	int res;
-	void *newthreads;
-
-	mutex_lock(&thread_mutex);
-	newthreads = realloc(threads, (threadcount + 1) * sizeof(pthread_t));
-	if (newthreads == NULL) {
-		mutex_unlock(&thread_mutex);
-		return -1;
+	struct thread_pool__stats *reply;
+	u32 nr = nr_workers;
+	unsigned int i;
+
+	if (WARN_ON(type != KVM_IPC_THREADPOOL_STATS || len))
+		return;
+
+	reply = calloc(nr, sizeof(*reply));
+	if (!reply && nr)
+		return;
+
+	for (i = 0; i < nr; i++) {
+		mutex_lock(&workers[i].lock);
+		reply[i] = workers[i].stats;
+		mutex_unlock(&workers[i].lock);
 	}
 
-	threads = newthreads;
+	if (write_in_full(fd, &nr, sizeof(nr)) < 0 ||
+	    write_in_full(fd, reply, nr * sizeof(*reply)) < 0)
+		pr_warning("Failed sending thread pool stats");
 
-	res = pthread_create(threads + threadcount, NULL,
-			     thread_pool__threadfunc, NULL);
+	free(reply);
+}
 
-	if (res == 0)
-		threadcount++;
-	mutex_unlock(&thread_mutex);
+static void thread_pool__collect_metrics(struct kvm *kvm, struct metrics *m)
+{
+	struct thread_pool__stats *stats;
+	unsigned int i;
 
-	return res;
+	stats = calloc(nr_workers, sizeof(*stats));
+	if (!stats && nr_workers)
+		return;
+
+	for (i = 0; i < nr_workers; i++) {
+		mutex_lock(&workers[i].lock);
+		stats[i] = workers[i].stats;
+		mutex_unlock(&workers[i].lock);
+	}
+
+	metrics__family(m, "threadpool_jobs_total", "counter",
+			"Jobs run by each worker of the thread pool");
+	for (i = 0; i < nr_workers; i++)
+		metrics__sample(m, stats[i].jobs, "worker=\"%u\"", i);
+
+	metrics__family(m, "threadpool_depth", "gauge",
+			"Jobs waiting in the queue of each worker");
+	for (i = 0; i < nr_workers; i++)
+		metrics__sample(m, stats[i].depth, "worker=\"%u\"", i);
+
+	metrics__family(m, "threadpool_wait_ns_total", "counter",
+			"Time the jobs of each worker spent in its queue");
+	for (i = 0; i < nr_workers; i++)
+		metrics__sample(m, stats[i].wait_ns, "worker=\"%u\"", i);
+
+	free(stats);
 }
 
+static struct metrics_collector thread_pool__metrics = {
+	.collect	= thread_pool__collect_metrics,
+};
+
 int thread_pool__init(struct kvm *kvm)
 {
-	unsigned long i;
-	unsigned int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	struct thread_pool__worker *pool;
+	struct thread_pool__job *job, *tmp;
+	unsigned int i;
+	int r;
+
+	if (thread_count < 1)
+		thread_count = 1;
+
+	pool = calloc(thread_count, sizeof(*pool));
+	if (!pool)
+		return -ENOMEM;
+
+	for (i = 0; i < thread_count; i++) {
+		mutex_init(&pool[i].lock);
+		INIT_LIST_HEAD(&pool[i].queue);
+	}
 
 	running = true;
 
-	for (i = 0; i < thread_count; i++)
-		if (thread_pool__addthread() < 0)
-			return i;
+	for (i = 0; i < thread_count; i++) {
+		r = pthread_create(&pool[i].thread, NULL,
+				   thread_pool__threadfunc, &pool[i]);
+		if (r) {
+			pr_warning("Couldn't start thread pool worker %u", i);
+			break;
+		}
+	}
+
+	if (!i) {
+		free(pool);
+		return -r;
+	}
+
+	nr_workers = i;
+	mutex_lock(&early_worker.lock);
+	__atomic_store_n(&workers, pool, __ATOMIC_RELEASE);
+	list_for_each_entry_safe(job, tmp, &early_worker.queue, queue) {
+		list_del_init(&job->queue);
+		job->worker = NULL;
+		thread_pool__queue_job(job);
+	}
+	mutex_unlock(&early_worker.lock);
+
+	metrics__register(&thread_pool__metrics);
 
-	return i;
+	return kvm_ipc__register_handler(KVM_IPC_THREADPOOL_STATS,
+					 thread_pool__handle_stats);
 }
 late_init(thread_pool__init);
 
 int thread_pool__exit(struct kvm *kvm)
 {
-	int i;
-	void *NUL = NULL;
+	unsigned int i;
 
-	running = false;
+	__atomic_store_n(&running, false, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&wake_seq, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &wake_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL,
+		0);
 
-	for (i = 0; i < threadcount; i++) {
-		mutex_lock(&job_mutex);
-		pthread_cond_signal(&job_cond);
-		mutex_unlock(&job_mutex);
-	}
-
-	for (i = 0; i < threadcount; i++) {
-		pthread_join(threads[i], NUL);
-	}
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(workers[i].thread, NULL);
 
 	return 0;
 }
@@ -159,23 +346,17 @@ late_exit(thread_pool__exit);
 
 void thread_pool__do_job(struct thread_pool__job *job)
 {
-	struct thread_pool__job *jobinfo = job;
-
-	if (jobinfo == NULL || jobinfo->callback == NULL)
+	if (job == NULL || job->callback == NULL)
 		return;
 
-	mutex_lock(&jobinfo->mutex);
-	if (jobinfo->signalcount++ == 0)
-		thread_pool__job_push(job);
-	mutex_unlock(&jobinfo->mutex);
-
-	mutex_lock(&job_mutex);
-	pthread_cond_signal(&job_cond);
-	mutex_unlock(&job_mutex);
+	/* Otherwise it is already queued, or will run again once finished */
+	if (__atomic_fetch_add(&job->signalcount, 1, __ATOMIC_SEQ_CST) == 0)
+		thread_pool__queue_job(job);
 }
 
 void thread_pool__cancel_job(struct thread_pool__job *job)
 {
+	struct thread_pool__worker *worker;
 	bool running;
 
 	/*
@@ -185,14 +366,23 @@ void thread_pool__cancel_job(struct thread_pool__job *job)
 	 * thread_pool__do_job() isn't called - while this function is running.
 	 */
 	do {
-		mutex_lock(&job_mutex);
-		if (list_empty(&job->queue)) {
-			running = job->signalcount > 0;
-		} else {
+		worker = __atomic_load_n(&job->worker, __ATOMIC_ACQUIRE);
+		if (!worker) {
+			running = __atomic_load_n(&job->signalcount,
+						  __ATOMIC_ACQUIRE) > 0;
+			continue;
+		}
+
+		mutex_lock(&worker->lock);
+		running = true;
+		if (job->worker == worker) {
 			list_del_init(&job->queue);
-			job->signalcount = 0;
+			job->worker = NULL;
+			if (worker != &early_worker)
+				worker->stats.depth--;
+			__atomic_store_n(&job->signalcount, 0, __ATOMIC_RELEASE);
 			running = false;
 		}
-		mutex_unlock(&job_mutex);
+		mutex_unlock(&worker->lock);
 	} while (running);
 }
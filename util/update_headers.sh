@@ -12,7 +12,7 @@ set -ue
 VIRTIO_LIST="virtio_9p.h virtio_balloon.h virtio_blk.h virtio_config.h \
 	     virtio_console.h virtio_ids.h virtio_mmio.h virtio_net.h \
 	     virtio_pci.h virtio_ring.h virtio_rng.h virtio_scsi.h \
-	     virtio_vsock.h"
+	     virtio_vsock.h virtio_fs.h"
 
 if [ "$#" -ge 1 ]
 then
@@ -29,6 +29,9 @@ then
 fi
 
 cp -- "$LINUX_ROOT/include/uapi/linux/kvm.h" include/linux
+cp -- "$LINUX_ROOT/include/uapi/linux/io_uring.h" include/linux
+cp -- "$LINUX_ROOT/include/uapi/linux/fuse.h" include/linux
+cp -- "$LINUX_ROOT/include/uapi/linux/iommufd.h" include/linux
 
 for header in $VIRTIO_LIST
 do
@@ -6,6 +6,8 @@
 
 #include <kvm/kvm.h>
 #include <linux/magic.h>	/* For HUGETLBFS_MAGIC */
+#include <linux/memfd.h>	/* For MFD_HUGE_* */
+#include <linux/sizes.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
@@ -104,6 +106,60 @@ void die_perror(const char *s)
 	exit(1);
 }
 
+/* The size of the transparent huge pages that the host kernel makes */
+u64 host_thp_size(void)
+{
+	static u64 size;
+	unsigned long long val;
+	FILE *f;
+
+	if (size)
+		return size;
+
+	size = SZ_2M;
+	f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+	if (f) {
+		if (fscanf(f, "%llu", &val) == 1 && val && !(val & (val - 1)))
+			size = val;
+		fclose(f);
+	}
+
+	return size;
+}
+
+/*
+ * Guest RAM is mapped with the host address aligned to the largest page that
+ * can back it. Guest physical addresses of banks are aligned the same way, so
+ * KVM can map huge pages into the guest for all of them. The alignment comes
+ * from reserving more address space than needed, and mapping the RAM over its
+ * aligned part.
+ */
+static void *mmap_aligned(struct kvm *kvm, u64 size, int flags, int fd)
+{
+	u64 align = max_t(u64, kvm->ram_pagesize, host_thp_size());
+	unsigned long start, aligned;
+	void *addr;
+
+	addr = mmap(NULL, size + align, PROT_NONE, MAP_ANON_NORESERVE, -1, 0);
+	if (addr == MAP_FAILED)
+		return addr;
+
+	start = (unsigned long)addr;
+	aligned = ALIGN(start, align);
+	addr = mmap((void *)aligned, size, PROT_RW, flags | MAP_FIXED, fd, 0);
+	if (addr == MAP_FAILED) {
+		munmap((void *)start, size + align);
+		return addr;
+	}
+
+	if (aligned > start)
+		munmap((void *)start, aligned - start);
+	if (start + align > aligned)
+		munmap((void *)(aligned + size), start + align - aligned);
+
+	return addr;
+}
+
 void *mmap_hugetlbfs(struct kvm *kvm, const char *htlbfs_path, u64 size)
 {
 	char mpath[PATH_MAX];
@@ -134,23 +190,103 @@ void *mmap_hugetlbfs(struct kvm *kvm, const char *htlbfs_path, u64 size)
 	if (ftruncate(fd, size) < 0)
 		die("Can't ftruncate for mem mapping size %lld\n",
 			(unsigned long long)size);
-	addr = mmap(NULL, size, PROT_RW, MAP_PRIVATE, fd, 0);
-	close(fd);
+	addr = mmap_aligned(kvm, size,
+			    kvm->cfg.mem_shared ? MAP_SHARED : MAP_PRIVATE, fd);
+	if (addr != MAP_FAILED && kvm->cfg.mem_shared) {
+		kvm->ram_fd = fd;
+		kvm->ram_fd_start = addr;
+	} else {
+		close(fd);
+	}
+
+	return addr;
+}
+
+/*
+ * Guest RAM that an external process (a vhost-user backend) maps too has to be
+ * backed by a file descriptor that we can hand over. The memfd can also be
+ * backed by huge pages, without needing a hugetlbfs mount.
+ */
+static void *mmap_memfd(struct kvm *kvm, u64 size)
+{
+	unsigned int flags = MFD_CLOEXEC;
+	void *addr;
+	int fd;
+
+	if (kvm->cfg.hugepage_size) {
+		flags |= MFD_HUGETLB;
+		flags |= kvm->cfg.hugepage_size == SZ_1G ? MFD_HUGE_1GB :
+							   MFD_HUGE_2MB;
+		size = ALIGN(size, kvm->cfg.hugepage_size);
+		kvm->ram_pagesize = kvm->cfg.hugepage_size;
+	}
+
+	fd = memfd_create("kvmtool-ram", flags);
+	if (fd < 0)
+		die_perror("memfd_create");
+	if (ftruncate(fd, size) < 0)
+		die("Can't ftruncate for mem mapping size %lld\n",
+			(unsigned long long)size);
+
+	addr = mmap_aligned(kvm, size,
+			    (kvm->cfg.mem_shared ? MAP_SHARED : MAP_PRIVATE) |
+			    MAP_NORESERVE, fd);
+	if (addr == MAP_FAILED) {
+		close(fd);
+		return addr;
+	}
+
+	if (kvm->cfg.mem_shared) {
+		kvm->ram_fd = fd;
+		kvm->ram_fd_start = addr;
+	} else {
+		close(fd);
+	}
 
 	return addr;
 }
 
-/* This function wraps the decision between hugetlbfs map (if requested) or normal mmap */
+/* This function wraps the decision between the guest RAM backends */
 void *mmap_anon_or_hugetlbfs(struct kvm *kvm, const char *hugetlbfs_path, u64 size)
 {
-	if (hugetlbfs_path)
-		/*
-		 * We don't /need/ to map guest RAM from hugetlbfs, but we do so
-		 * if the user specifies a hugetlbfs path.
-		 */
+	enum kvm_mem_backend backend = kvm->cfg.mem_backend;
+	void *addr;
+
+	if (backend == KVM_MEM_BACKEND_DEFAULT) {
+		if (hugetlbfs_path)
+			backend = KVM_MEM_BACKEND_HUGETLBFS;
+		else if (kvm->cfg.mem_shared || kvm->cfg.hugepage_size)
+			backend = KVM_MEM_BACKEND_MEMFD;
+		else
+			backend = KVM_MEM_BACKEND_ANON;
+	}
+
+	if (kvm->cfg.hugepage_size && backend != KVM_MEM_BACKEND_MEMFD)
+		die("--hugepage-size only applies to the memfd backend");
+
+	kvm->ram_pagesize = getpagesize();
+
+	switch (backend) {
+	case KVM_MEM_BACKEND_HUGETLBFS:
+		if (!hugetlbfs_path)
+			die("The hugetlbfs backend needs a --hugetlbfs path");
 		return mmap_hugetlbfs(kvm, hugetlbfs_path, size);
-	else {
-		kvm->ram_pagesize = getpagesize();
-		return mmap(NULL, size, PROT_RW, MAP_ANON_NORESERVE, -1, 0);
+	case KVM_MEM_BACKEND_MEMFD:
+		return mmap_memfd(kvm, size);
+	case KVM_MEM_BACKEND_THP:
+		/* Shared memory is shmem, which has THP too if enabled for it */
+		if (kvm->cfg.mem_shared)
+			addr = mmap_memfd(kvm, size);
+		else
+			addr = mmap_aligned(kvm, size, MAP_ANON_NORESERVE, -1);
+		if (addr != MAP_FAILED && madvise(addr, size, MADV_HUGEPAGE) < 0)
+			pr_warning("Transparent huge pages unavailable: %s",
+				   strerror(errno));
+		return addr;
+	case KVM_MEM_BACKEND_ANON:
+	default:
+		if (kvm->cfg.mem_shared)
+			die("Shared guest RAM needs the memfd, thp or hugetlbfs backend");
+		return mmap_aligned(kvm, size, MAP_ANON_NORESERVE, -1);
 	}
 }
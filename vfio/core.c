@@ -1,14 +1,40 @@
 #include "kvm/kvm.h"
 #include "kvm/vfio.h"
 #include "kvm/ioport.h"
+#include "kvm/snapshot.h"
+#include "kvm/host-numa.h"
 
+#include <linux/iommufd.h>
 #include <linux/list.h>
+#include <linux/sizes.h>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/prctl.h>
 
 #define VFIO_DEV_DIR		"/dev/vfio"
 #define VFIO_DEV_NODE		VFIO_DEV_DIR "/vfio"
+#define VFIO_CDEV_DIR		VFIO_DEV_DIR "/devices"
+#define IOMMUFD_DEV_NODE	"/dev/iommu"
 #define IOMMU_GROUP_DIR		"/sys/kernel/iommu_groups"
 
-static int vfio_container;
+/* Guest RAM is mapped for DMA in chunks, from several threads with iommufd */
+#define VFIO_DMA_CHUNK		SZ_1G
+#define VFIO_DMA_THREADS	16
+
+struct vfio_dma_map_ctx {
+	struct kvm	*kvm;
+	u64		chunk;
+	u64		next;
+	u64		total_chunks;
+	int		err;
+	/* Tear the chunks down instead */
+	bool		unmap;
+};
+
+static int vfio_container = -1;
+static int vfio_iommufd = -1;
+static u32 vfio_ioas_id;
 static LIST_HEAD(vfio_groups);
 static struct vfio_device *vfio_devices;
 
@@ -38,6 +64,46 @@ static int vfio_device_pci_parser(const struct option *opt, char *arg,
 	return 0;
 }
 
+/* ioeventfd=on|off and doorbell=<bar>:<offset>, after the device */
+static int vfio_device_option_parser(char *arg, struct vfio_device_params *dev)
+{
+	struct vfio_doorbell *doorbell;
+	const char *option = arg;
+	char *end;
+
+	if (!strcmp(arg, "ioeventfd=off")) {
+		dev->no_ioeventfd = true;
+		return 0;
+	}
+	if (!strcmp(arg, "ioeventfd=on")) {
+		dev->no_ioeventfd = false;
+		return 0;
+	}
+
+	if (strncmp(arg, "doorbell=", 9))
+		goto err;
+	if (dev->nr_doorbells == VFIO_MAX_DOORBELLS) {
+		pr_err("Too many doorbells, %d at most", VFIO_MAX_DOORBELLS);
+		return -EINVAL;
+	}
+
+	doorbell = &dev->doorbells[dev->nr_doorbells];
+	doorbell->bar = strtoul(arg + 9, &end, 0);
+	if (end == arg + 9 || *end != ':' || doorbell->bar > VFIO_PCI_BAR5_REGION_INDEX)
+		goto err;
+	arg = end + 1;
+	doorbell->offset = strtoull(arg, &end, 0);
+	if (end == arg || *end)
+		goto err;
+	dev->nr_doorbells++;
+
+	return 0;
+
+err:
+	pr_err("Invalid VFIO device option %s", option);
+	return -EINVAL;
+}
+
 int vfio_device_parser(const struct option *opt, const char *arg, int unset)
 {
 	int ret = -EINVAL;
@@ -62,6 +128,7 @@ int vfio_device_parser(const struct option *opt, const char *arg, int unset)
 
 	kvm->cfg.vfio_devices = devs;
 	dev = &devs[idx];
+	memset(dev, 0, sizeof(*dev));
 
 	cur = strtok(buf, ",");
 	if (!cur)
@@ -72,6 +139,9 @@ int vfio_device_parser(const struct option *opt, const char *arg, int unset)
 	else
 		ret = -EINVAL;
 
+	while (!ret && (cur = strtok(NULL, ",")))
+		ret = vfio_device_option_parser(cur, dev);
+
 	if (!ret)
 		kvm->cfg.num_vfio_devices = ++idx;
 
@@ -115,8 +185,8 @@ static bool vfio_ioport_in(struct vfio_region *region, u32 offset,
 	return true;
 }
 
-static bool vfio_ioport_out(struct vfio_region *region, u32 offset,
-			     void *data, int len)
+static bool vfio_ioport_out(struct kvm *kvm, struct vfio_region *region,
+			    u32 offset, void *data, int len)
 {
 	struct vfio_device *vdev = region->vdev;
 	ssize_t nr;
@@ -144,6 +214,8 @@ static bool vfio_ioport_out(struct vfio_region *region, u32 offset,
 	if (nr != len)
 		vfio_dev_err(vdev, "could not write %d bytes to I/O port 0x%x",
 			     len, offset + region->port_base);
+	else
+		vfio_ioeventfd_write(kvm, region, offset, len, val);
 
 	return nr == len;
 }
@@ -155,13 +227,13 @@ static void vfio_ioport_mmio(struct kvm_cpu *vcpu, u64 addr, u8 *data, u32 len,
 	u32 offset = addr - region->port_base;
 
 	if (is_write)
-		vfio_ioport_out(region, offset, data, len);
+		vfio_ioport_out(vcpu->kvm, region, offset, data, len);
 	else
 		vfio_ioport_in(region, offset, data, len);
 }
 
-static void vfio_mmio_access(struct kvm_cpu *vcpu, u64 addr, u8 *data, u32 len,
-			     u8 is_write, void *ptr)
+void vfio_mmio_access(struct kvm_cpu *vcpu, u64 addr, u8 *data, u32 len,
+		      u8 is_write, void *ptr)
 {
 	u64 val;
 	ssize_t nr;
@@ -182,6 +254,8 @@ static void vfio_mmio_access(struct kvm_cpu *vcpu, u64 addr, u8 *data, u32 len,
 		nr = pwrite(vdev->fd, &val, len, region->info.offset + offset);
 		if ((u32)nr != len)
 			goto err_report;
+
+		vfio_ioeventfd_write(vcpu->kvm, region, offset, len, val);
 	} else {
 		if (!(region->info.flags & VFIO_REGION_INFO_FLAG_READ))
 			goto err_report;
@@ -215,8 +289,175 @@ static int vfio_setup_trap_region(struct kvm *kvm, struct vfio_device *vdev,
 	}
 
 	return kvm__register_mmio(kvm, region->guest_phys_addr,
-				  region->info.size, false, vfio_mmio_access,
-				  region);
+				  region->info.size, false,
+				  region->mmio_fn ?: vfio_mmio_access, region);
+}
+
+/*
+ * Find out which parts of a region can be mapped. With a sparse mmap
+ * capability, only the areas it lists can, unless the MSI-X table isn't
+ * excluded from them anymore.
+ */
+int vfio_get_region_areas(struct vfio_device *vdev, struct vfio_region *region)
+{
+	struct vfio_region_info_cap_sparse_mmap *sparse = NULL;
+	struct vfio_region_sparse_mmap_area *area;
+	struct vfio_info_cap_header *hdr;
+	struct vfio_region_info *info;
+	u32 i, off, argsz = region->info.argsz;
+	int ret = 0;
+
+	free(region->areas);
+	region->areas = NULL;
+	region->nr_areas = 0;
+	region->msix_mappable = false;
+
+	if (!(region->info.flags & VFIO_REGION_INFO_FLAG_CAPS) ||
+	    argsz <= sizeof(*info))
+		return 0;
+
+	info = calloc(1, argsz);
+	if (!info)
+		return -ENOMEM;
+
+	info->argsz = argsz;
+	info->index = region->info.index;
+	if (ioctl(vdev->fd, VFIO_DEVICE_GET_REGION_INFO, info)) {
+		ret = -errno;
+		vfio_dev_err(vdev, "cannot get capabilities of region %u",
+			     info->index);
+		goto out;
+	}
+
+	for (off = info->cap_offset; off && off + sizeof(*hdr) <= argsz;
+	     off = hdr->next) {
+		hdr = (void *)info + off;
+		if (hdr->id == VFIO_REGION_INFO_CAP_MSIX_MAPPABLE)
+			region->msix_mappable = true;
+		else if (hdr->id == VFIO_REGION_INFO_CAP_SPARSE_MMAP &&
+			 off + sizeof(*sparse) <= argsz)
+			sparse = (void *)hdr;
+	}
+
+	if (!sparse || region->msix_mappable)
+		goto out;
+
+	region->areas = calloc(sparse->nr_areas ?: 1, sizeof(*region->areas));
+	if (!region->areas) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < sparse->nr_areas; i++) {
+		area = &sparse->areas[i];
+		if ((void *)(area + 1) > (void *)info + argsz)
+			break;
+		if (!area->size || (area->offset | area->size) & (PAGE_SIZE - 1) ||
+		    area->offset + area->size > ALIGN(region->info.size, PAGE_SIZE))
+			continue;
+
+		region->areas[region->nr_areas++] = (struct vfio_region_area) {
+			.offset	= area->offset,
+			.size	= area->size,
+		};
+	}
+
+	/* Nothing can be mapped after all */
+	if (!region->nr_areas)
+		region->info.flags &= ~VFIO_REGION_INFO_FLAG_MMAP;
+
+out:
+	free(info);
+	return ret;
+}
+
+static int vfio_add_slot(struct kvm *kvm, struct vfio_region *region,
+			 u64 offset, u64 size)
+{
+	struct vfio_region_area *slots;
+	int ret;
+
+	slots = realloc(region->slots, (region->nr_slots + 1) * sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+	region->slots = slots;
+
+	ret = kvm__register_dev_mem(kvm, region->guest_phys_addr + offset, size,
+				    region->host_addr + offset);
+	if (ret)
+		return ret;
+
+	slots[region->nr_slots++] = (struct vfio_region_area) {
+		.offset	= offset,
+		.size	= size,
+	};
+
+	return 0;
+}
+
+/* Hand [start, end) of the region to the guest, except for the holes */
+static int vfio_map_area(struct kvm *kvm, struct vfio_region *region,
+			 u64 start, u64 end)
+{
+	struct vfio_region_area *hole;
+	u64 next;
+	u32 i;
+	int ret;
+
+	while (start < end) {
+		next = end;
+		for (i = 0; i < region->nr_holes; i++) {
+			hole = &region->holes[i];
+			if (start >= hole->offset &&
+			    start < hole->offset + hole->size)
+				break;
+			if (hole->offset > start)
+				next = min(next, hole->offset);
+		}
+
+		if (i < region->nr_holes) {
+			start = hole->offset + hole->size;
+			continue;
+		}
+
+		ret = vfio_add_slot(kvm, region, start, next - start);
+		if (ret)
+			return ret;
+		start = next;
+	}
+
+	return 0;
+}
+
+static void *vfio_mmap_region(struct vfio_device *vdev,
+			      struct vfio_region *region, int prot)
+{
+	u64 map_size = ALIGN(region->info.size, PAGE_SIZE);
+	struct vfio_region_area *area;
+	void *base, *p;
+	u32 i;
+
+	if (!region->nr_areas)
+		return mmap(NULL, region->info.size, prot, MAP_SHARED, vdev->fd,
+			    region->info.offset);
+
+	/* Reserve the whole region, and map the areas into it */
+	base = mmap(NULL, map_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return base;
+
+	for (i = 0; i < region->nr_areas; i++) {
+		area = &region->areas[i];
+		p = mmap(base + area->offset, area->size, prot,
+			 MAP_SHARED | MAP_FIXED, vdev->fd,
+			 region->info.offset + area->offset);
+		if (p == MAP_FAILED) {
+			munmap(base, map_size);
+			return p;
+		}
+	}
+
+	return base;
 }
 
 int vfio_map_region(struct kvm *kvm, struct vfio_device *vdev,
@@ -224,6 +465,7 @@ int vfio_map_region(struct kvm *kvm, struct vfio_device *vdev,
 {
 	void *base;
 	int ret, prot = 0;
+	u32 i;
 	/* KVM needs page-aligned regions */
 	u64 map_size = ALIGN(region->info.size, PAGE_SIZE);
 
@@ -235,50 +477,79 @@ int vfio_map_region(struct kvm *kvm, struct vfio_device *vdev,
 	 * address isn't page aligned, let's emulate the region ourselves.
 	 */
 	if (region->guest_phys_addr & (PAGE_SIZE - 1))
-		return kvm__register_mmio(kvm, region->guest_phys_addr,
-					  region->info.size, false,
-					  vfio_mmio_access, region);
+		return vfio_setup_trap_region(kvm, vdev, region);
 
 	if (region->info.flags & VFIO_REGION_INFO_FLAG_READ)
 		prot |= PROT_READ;
 	if (region->info.flags & VFIO_REGION_INFO_FLAG_WRITE)
 		prot |= PROT_WRITE;
 
-	base = mmap(NULL, region->info.size, prot, MAP_SHARED, vdev->fd,
-		    region->info.offset);
+	base = vfio_mmap_region(vdev, region, prot);
 	if (base == MAP_FAILED) {
-		/* TODO: support sparse mmap */
 		vfio_dev_warn(vdev, "failed to mmap region %u (0x%llx bytes), falling back to trapping",
 			 region->info.index, region->info.size);
 		return vfio_setup_trap_region(kvm, vdev, region);
 	}
 	region->host_addr = base;
 
-	ret = kvm__register_dev_mem(kvm, region->guest_phys_addr, map_size,
-				    region->host_addr);
+	/*
+	 * Whatever isn't mapped is trapped. The memory slots take precedence
+	 * over the trap where they overlap it.
+	 */
+	if (region->nr_areas || region->nr_holes) {
+		ret = vfio_setup_trap_region(kvm, vdev, region);
+		if (ret)
+			goto err_unmap;
+		region->trapped = 1;
+	}
+
+	if (!region->nr_areas) {
+		ret = vfio_map_area(kvm, region, 0, map_size);
+	} else {
+		for (i = 0, ret = 0; i < region->nr_areas && !ret; i++)
+			ret = vfio_map_area(kvm, region, region->areas[i].offset,
+					    region->areas[i].offset +
+					    region->areas[i].size);
+	}
 	if (ret) {
 		vfio_dev_err(vdev, "failed to register region with KVM");
-		return ret;
+		goto err_unmap;
 	}
 
 	return 0;
+
+err_unmap:
+	vfio_unmap_region(kvm, region);
+	return ret;
 }
 
 void vfio_unmap_region(struct kvm *kvm, struct vfio_region *region)
 {
-	u64 map_size;
+	struct vfio_region_area *slot;
+	u32 i;
 
 	if (region->host_addr) {
-		map_size = ALIGN(region->info.size, PAGE_SIZE);
-		kvm__destroy_mem(kvm, region->guest_phys_addr, map_size,
-				 region->host_addr);
-		munmap(region->host_addr, region->info.size);
+		for (i = 0; i < region->nr_slots; i++) {
+			slot = &region->slots[i];
+			kvm__destroy_mem(kvm, region->guest_phys_addr + slot->offset,
+					 slot->size, region->host_addr + slot->offset);
+		}
+		free(region->slots);
+		region->slots = NULL;
+		region->nr_slots = 0;
+
+		munmap(region->host_addr, ALIGN(region->info.size, PAGE_SIZE));
 		region->host_addr = NULL;
-	} else if (region->is_ioport) {
+		if (!region->trapped)
+			return;
+		region->trapped = 0;
+	}
+
+	vfio_ioeventfd_del_region(kvm, region);
+	if (region->is_ioport)
 		kvm__deregister_pio(kvm, region->port_base);
-	} else {
+	else
 		kvm__deregister_mmio(kvm, region->guest_phys_addr);
-	}
 }
 
 static int vfio_configure_device(struct kvm *kvm, struct vfio_device *vdev)
@@ -286,8 +557,10 @@ static int vfio_configure_device(struct kvm *kvm, struct vfio_device *vdev)
 	int ret;
 	struct vfio_group *group = vdev->group;
 
-	vdev->fd = ioctl(group->fd, VFIO_GROUP_GET_DEVICE_FD,
-			 vdev->params->name);
+	/* With iommufd, the cdev was opened and bound by vfio_device_init() */
+	if (group)
+		vdev->fd = ioctl(group->fd, VFIO_GROUP_GET_DEVICE_FD,
+				 vdev->params->name);
 	if (vdev->fd < 0) {
 		vfio_dev_warn(vdev, "failed to get fd");
 
@@ -326,8 +599,12 @@ static int vfio_configure_device(struct kvm *kvm, struct vfio_device *vdev)
 	if (ret)
 		goto err_free_regions;
 
-	vfio_dev_info(vdev, "assigned to device number 0x%x in group %lu",
-		      vdev->dev_hdr.dev_num, group->id);
+	if (group)
+		vfio_dev_info(vdev, "assigned to device number 0x%x in group %lu",
+			      vdev->dev_hdr.dev_num, group->id);
+	else
+		vfio_dev_info(vdev, "assigned to device number 0x%x",
+			      vdev->dev_hdr.dev_num);
 
 	return 0;
 
@@ -363,52 +640,268 @@ static int vfio_get_iommu_type(void)
 	return -ENODEV;
 }
 
-static int vfio_map_mem_bank(struct kvm *kvm, struct kvm_mem_bank *bank, void *data)
+static int vfio_dma_map(u64 iova, void *vaddr, u64 size)
 {
 	int ret = 0;
-	struct vfio_iommu_type1_dma_map dma_map = {
-		.argsz	= sizeof(dma_map),
-		.flags	= VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
-		.vaddr	= (unsigned long)bank->host_addr,
-		.iova	= (u64)bank->guest_phys_addr,
-		.size	= bank->size,
-	};
 
-	/* Map the guest memory for DMA (i.e. provide isolation) */
-	if (ioctl(vfio_container, VFIO_IOMMU_MAP_DMA, &dma_map)) {
-		ret = -errno;
-		pr_err("Failed to map 0x%llx -> 0x%llx (%llu) for DMA",
-		       dma_map.iova, dma_map.vaddr, dma_map.size);
+	if (vfio_iommufd >= 0) {
+		struct iommu_ioas_map map = {
+			.size		= sizeof(map),
+			.flags		= IOMMU_IOAS_MAP_FIXED_IOVA |
+					  IOMMU_IOAS_MAP_READABLE |
+					  IOMMU_IOAS_MAP_WRITEABLE,
+			.ioas_id	= vfio_ioas_id,
+			.user_va	= (unsigned long)vaddr,
+			.length		= size,
+			.iova		= iova,
+		};
+
+		if (ioctl(vfio_iommufd, IOMMU_IOAS_MAP, &map))
+			ret = -errno;
+	} else {
+		struct vfio_iommu_type1_dma_map dma_map = {
+			.argsz	= sizeof(dma_map),
+			.flags	= VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+			.vaddr	= (unsigned long)vaddr,
+			.iova	= iova,
+			.size	= size,
+		};
+
+		/* Map the guest memory for DMA (i.e. provide isolation) */
+		if (ioctl(vfio_container, VFIO_IOMMU_MAP_DMA, &dma_map))
+			ret = -errno;
 	}
 
+	if (ret)
+		pr_err("Failed to map 0x%llx -> %p (%llu) for DMA",
+		       iova, vaddr, size);
+
 	return ret;
 }
 
+static int vfio_map_mem_bank(struct kvm *kvm, struct kvm_mem_bank *bank, void *data)
+{
+	return vfio_dma_map(bank->guest_phys_addr, bank->host_addr, bank->size);
+}
+
 static int vfio_unmap_mem_bank(struct kvm *kvm, struct kvm_mem_bank *bank, void *data)
 {
-	struct vfio_iommu_type1_dma_unmap dma_unmap = {
-		.argsz = sizeof(dma_unmap),
-		.size = bank->size,
-		.iova = bank->guest_phys_addr,
+	if (vfio_iommufd >= 0) {
+		/* This also unmaps all the chunks the bank was mapped in */
+		struct iommu_ioas_unmap unmap = {
+			.size		= sizeof(unmap),
+			.ioas_id	= vfio_ioas_id,
+			.iova		= bank->guest_phys_addr,
+			.length		= bank->size,
+		};
+
+		ioctl(vfio_iommufd, IOMMU_IOAS_UNMAP, &unmap);
+	} else {
+		struct vfio_iommu_type1_dma_unmap dma_unmap = {
+			.argsz = sizeof(dma_unmap),
+			.size = bank->size,
+			.iova = bank->guest_phys_addr,
+		};
+
+		ioctl(vfio_container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
+	}
+
+	return 0;
+}
+
+static int vfio_dma_unmap_chunk(u64 iova, u64 size)
+{
+	struct iommu_ioas_unmap unmap = {
+		.size		= sizeof(unmap),
+		.ioas_id	= vfio_ioas_id,
+		.iova		= iova,
+		.length		= size,
+	};
+
+	if (ioctl(vfio_iommufd, IOMMU_IOAS_UNMAP, &unmap))
+		return -errno;
+
+	return 0;
+}
+
+static void *vfio_dma_map_thread(void *arg)
+{
+	struct vfio_dma_map_ctx *ctx = arg;
+	struct kvm *kvm = ctx->kvm;
+	struct kvm_mem_bank *bank;
+	u64 offset, base, len;
+	int r;
+
+	prctl(PR_SET_NAME, ctx->unmap ? "vfio-dma-unmap" : "vfio-dma-map");
+
+	for (;;) {
+		offset = __atomic_fetch_add(&ctx->next, ctx->chunk,
+					    __ATOMIC_RELAXED);
+		if (offset >= ctx->total_chunks ||
+		    __atomic_load_n(&ctx->err, __ATOMIC_RELAXED))
+			break;
+
+		/* Chunks don't span banks */
+		base = 0;
+		list_for_each_entry(bank, &kvm->mem_banks, list) {
+			if (bank->type != KVM_MEM_TYPE_RAM)
+				continue;
+			if (offset < base + ALIGN(bank->size, ctx->chunk))
+				break;
+			base += ALIGN(bank->size, ctx->chunk);
+		}
+
+		offset -= base;
+		len = min(ctx->chunk, bank->size - offset);
+		if (ctx->unmap)
+			r = vfio_dma_unmap_chunk(bank->guest_phys_addr + offset,
+						 len);
+		else
+			r = vfio_dma_map(bank->guest_phys_addr + offset,
+					 bank->host_addr + offset, len);
+		if (r < 0) {
+			ctx->err = r;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * The host node all assigned devices sit on, or -1. Unless --numa-node or
+ * --numa already placed guest RAM, pinning it from there faults the pages
+ * not yet touched in next to the devices that DMA into them.
+ */
+static int vfio_dma_numa_node(struct kvm *kvm)
+{
+	int i, node = -1;
+
+	if (kvm->cfg.nr_numa_nodes)
+		return -1;
+	for (i = 0; i < kvm->cfg.nr_guest_numa; i++) {
+		if (kvm->cfg.guest_numa[i].host_node >= 0)
+			return -1;
+	}
+
+	for (i = 0; i < kvm->cfg.num_vfio_devices; i++) {
+		int dev_node = host_numa__dev_node(vfio_devices[i].sysfs_path);
+
+		if (dev_node < 0 || (i && dev_node != node))
+			return -1;
+		node = dev_node;
+	}
+
+	return node;
+}
+
+/* Map or unmap the chunks of guest RAM from up to --vfio-dma-threads */
+static void vfio_dma_run(struct kvm *kvm, struct vfio_dma_map_ctx *ctx)
+{
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t threads[VFIO_DMA_THREADS];
+	struct kvm_mem_bank *bank;
+	int i, nr_threads;
+
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		if (bank->type == KVM_MEM_TYPE_RAM)
+			ctx->total_chunks += ALIGN(bank->size, ctx->chunk);
+	}
+
+	nr_threads = kvm->cfg.vfio_dma_threads;
+	if (nr_threads <= 0)
+		nr_threads = max(nr_cpus, 1L);
+	nr_threads = min(nr_threads, VFIO_DMA_THREADS);
+	nr_threads = min_t(u64, nr_threads, ctx->total_chunks / ctx->chunk);
+
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, vfio_dma_map_thread, ctx))
+			break;
+	}
+	nr_threads = i;
+	/* Do it all here if no thread could start */
+	if (!nr_threads)
+		vfio_dma_map_thread(ctx);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/*
+ * Pinning guest RAM is what makes assigning a device slow to start, and
+ * iommufd pins separate mappings concurrently. Split the banks into chunks
+ * whose IOVAs are aligned to the chunk size, so that no huge page straddles
+ * two of them, and map them from several threads. The type1 container
+ * serialises its mappings, so it gets each bank in one go.
+ */
+static int vfio_map_guest_ram(struct kvm *kvm)
+{
+	struct vfio_dma_map_ctx ctx = {
+		.kvm	= kvm,
+		.chunk	= max_t(u64, VFIO_DMA_CHUNK, kvm->ram_pagesize),
 	};
+	struct kvm_mem_bank *bank;
+	u64 start = kvm_cpu__now();
+	cpu_set_t *saved;
+	int r;
+
+	/* The map threads inherit it */
+	saved = host_numa__enter(vfio_dma_numa_node(kvm));
+	if (vfio_iommufd < 0) {
+		r = kvm__for_each_mem_bank(kvm, KVM_MEM_TYPE_RAM,
+					   vfio_map_mem_bank, NULL);
+		host_numa__leave(saved);
+		return r;
+	}
+
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		if (bank->type != KVM_MEM_TYPE_RAM)
+			continue;
+		if (((unsigned long)bank->host_addr ^ bank->guest_phys_addr) &
+		    (SZ_2M - 1))
+			pr_warning("Guest RAM at 0x%llx isn't huge page aligned, DMA mappings will use small pages",
+				   bank->guest_phys_addr);
+	}
+
+	vfio_dma_run(kvm, &ctx);
+	host_numa__leave(saved);
+
+	if (ctx.err)
+		return ctx.err;
 
-	ioctl(vfio_container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
+	pr_debug("Mapped guest RAM for DMA in %llu ms",
+		 (unsigned long long)(kvm_cpu__now() - start) / 1000000);
 
 	return 0;
 }
 
+/*
+ * Unpinning takes as long as pinning did, so with iommufd undo the chunks
+ * from as many threads. Whatever they leave is unmapped bank by bank.
+ */
+static void vfio_unmap_guest_ram(struct kvm *kvm)
+{
+	struct vfio_dma_map_ctx ctx = {
+		.kvm	= kvm,
+		.chunk	= max_t(u64, VFIO_DMA_CHUNK, kvm->ram_pagesize),
+		.unmap	= true,
+	};
+
+	if (vfio_iommufd >= 0)
+		vfio_dma_run(kvm, &ctx);
+	if (vfio_iommufd < 0 || ctx.err)
+		kvm__for_each_mem_bank(kvm, KVM_MEM_TYPE_RAM,
+				       vfio_unmap_mem_bank, NULL);
+}
+
 static int vfio_configure_reserved_regions(struct kvm *kvm,
-					   struct vfio_group *group)
+					   const char *filename)
 {
 	FILE *file;
 	int ret = 0;
 	char type[9];
-	char filename[PATH_MAX];
 	unsigned long long start, end;
 
-	snprintf(filename, PATH_MAX, IOMMU_GROUP_DIR "/%lu/reserved_regions",
-		 group->id);
-
 	/* reserved_regions might not be present on older systems */
 	if (access(filename, F_OK))
 		return 0;
@@ -430,11 +923,26 @@ static int vfio_configure_reserved_regions(struct kvm *kvm,
 
 static int vfio_configure_groups(struct kvm *kvm)
 {
-	int ret;
+	int i, ret;
 	struct vfio_group *group;
+	char filename[PATH_MAX];
 
 	list_for_each_entry(group, &vfio_groups, list) {
-		ret = vfio_configure_reserved_regions(kvm, group);
+		snprintf(filename, PATH_MAX, IOMMU_GROUP_DIR "/%lu/reserved_regions",
+			 group->id);
+		ret = vfio_configure_reserved_regions(kvm, filename);
+		if (ret)
+			return ret;
+	}
+
+	/* Without groups, find the regions through the devices */
+	if (vfio_iommufd < 0)
+		return 0;
+
+	for (i = 0; i < kvm->cfg.num_vfio_devices; ++i) {
+		snprintf(filename, PATH_MAX, "%s/iommu_group/reserved_regions",
+			 vfio_devices[i].sysfs_path);
+		ret = vfio_configure_reserved_regions(kvm, filename);
 		if (ret)
 			return ret;
 	}
@@ -554,6 +1062,72 @@ out_close:
 	return group;
 }
 
+/* Open the cdev of the device, and attach it to our IOAS */
+static int vfio_device_open_cdev(struct kvm *kvm, struct vfio_device *vdev)
+{
+	struct vfio_device_bind_iommufd bind = {
+		.argsz		= sizeof(bind),
+		.iommufd	= vfio_iommufd,
+	};
+	struct vfio_device_attach_iommufd_pt attach = {
+		.argsz		= sizeof(attach),
+		.pt_id		= vfio_ioas_id,
+	};
+	char path[PATH_MAX];
+	struct dirent *dirent;
+	DIR *dir;
+	int ret;
+
+	snprintf(path, PATH_MAX, "%s/vfio-dev", vdev->sysfs_path);
+	dir = opendir(path);
+	if (!dir) {
+		ret = -errno;
+		vfio_dev_err(vdev, "no VFIO cdev, is the device bound to vfio-pci?");
+		return ret;
+	}
+
+	path[0] = '\0';
+	while ((dirent = readdir(dir))) {
+		if (!strncmp(dirent->d_name, "vfio", 4)) {
+			snprintf(path, PATH_MAX, VFIO_CDEV_DIR "/%s",
+				 dirent->d_name);
+			break;
+		}
+	}
+	closedir(dir);
+
+	if (!path[0]) {
+		vfio_dev_err(vdev, "no VFIO cdev");
+		return -ENODEV;
+	}
+
+	vdev->fd = open(path, O_RDWR);
+	if (vdev->fd < 0) {
+		ret = -errno;
+		vfio_dev_err(vdev, "failed to open %s", path);
+		return ret;
+	}
+
+	if (ioctl(vdev->fd, VFIO_DEVICE_BIND_IOMMUFD, &bind)) {
+		ret = -errno;
+		vfio_dev_err(vdev, "failed to bind to iommufd");
+		goto err_close;
+	}
+
+	if (ioctl(vdev->fd, VFIO_DEVICE_ATTACH_IOMMUFD_PT, &attach)) {
+		ret = -errno;
+		vfio_dev_err(vdev, "failed to attach to IOAS %u", vfio_ioas_id);
+		goto err_close;
+	}
+
+	return 0;
+
+err_close:
+	close(vdev->fd);
+	vdev->fd = -1;
+	return ret;
+}
+
 static int vfio_device_init(struct kvm *kvm, struct vfio_device *vdev)
 {
 	int ret;
@@ -569,6 +1143,15 @@ static int vfio_device_init(struct kvm *kvm, struct vfio_device *vdev)
 	if (!vdev->sysfs_path)
 		return -errno;
 
+	vfio_ioeventfd_init(vdev);
+
+	if (vfio_iommufd >= 0) {
+		ret = vfio_device_open_cdev(kvm, vdev);
+		if (ret)
+			free(vdev->sysfs_path);
+		return ret;
+	}
+
 	group = vfio_group_get_for_dev(kvm, vdev);
 	if (!group) {
 		free(vdev->sysfs_path);
@@ -582,7 +1165,10 @@ static int vfio_device_init(struct kvm *kvm, struct vfio_device *vdev)
 
 static void vfio_device_exit(struct kvm *kvm, struct vfio_device *vdev)
 {
-	vfio_group_exit(kvm, vdev->group);
+	u32 i;
+
+	if (vdev->group)
+		vfio_group_exit(kvm, vdev->group);
 
 	switch (vdev->params->type) {
 	case VFIO_DEVICE_PCI:
@@ -594,10 +1180,47 @@ static void vfio_device_exit(struct kvm *kvm, struct vfio_device *vdev)
 
 	close(vdev->fd);
 
+	for (i = 0; i < vdev->info.num_regions; i++)
+		free(vdev->regions[i].areas);
 	free(vdev->regions);
 	free(vdev->sysfs_path);
 }
 
+static int vfio_iommufd_init(struct kvm *kvm)
+{
+	struct iommu_ioas_alloc alloc = {
+		.size	= sizeof(alloc),
+	};
+	int i, ret;
+
+	vfio_iommufd = open(IOMMUFD_DEV_NODE, O_RDWR);
+	if (vfio_iommufd < 0) {
+		ret = -errno;
+		pr_err("Failed to open %s", IOMMUFD_DEV_NODE);
+		return ret;
+	}
+
+	/* One address space for all devices, that mirrors the guest's */
+	if (ioctl(vfio_iommufd, IOMMU_IOAS_ALLOC, &alloc)) {
+		ret = -errno;
+		pr_err("Failed to allocate an IOAS");
+		return ret;
+	}
+	vfio_ioas_id = alloc.out_ioas_id;
+
+	for (i = 0; i < kvm->cfg.num_vfio_devices; ++i) {
+		vfio_devices[i].params = &kvm->cfg.vfio_devices[i];
+
+		ret = vfio_device_init(kvm, &vfio_devices[i]);
+		if (ret)
+			return ret;
+	}
+
+	pr_info("Using iommufd for VFIO devices");
+
+	return vfio_map_guest_ram(kvm);
+}
+
 static int vfio_container_init(struct kvm *kvm)
 {
 	int api, i, ret, iommu_type;;
@@ -641,8 +1264,7 @@ static int vfio_container_init(struct kvm *kvm)
 		pr_info("Using IOMMU type %d for VFIO container", iommu_type);
 	}
 
-	return kvm__for_each_mem_bank(kvm, KVM_MEM_TYPE_RAM, vfio_map_mem_bank,
-				      NULL);
+	return vfio_map_guest_ram(kvm);
 }
 
 static int vfio__init(struct kvm *kvm)
@@ -652,11 +1274,17 @@ static int vfio__init(struct kvm *kvm)
 	if (!kvm->cfg.num_vfio_devices)
 		return 0;
 
+	/* Device state lives in the hardware */
+	snapshot__block("VFIO devices");
+
 	vfio_devices = calloc(kvm->cfg.num_vfio_devices, sizeof(*vfio_devices));
 	if (!vfio_devices)
 		return -ENOMEM;
 
-	ret = vfio_container_init(kvm);
+	if (kvm->cfg.vfio_iommufd)
+		ret = vfio_iommufd_init(kvm);
+	else
+		ret = vfio_container_init(kvm);
 	if (ret)
 		return ret;
 
@@ -684,11 +1312,14 @@ static int vfio__exit(struct kvm *kvm)
 
 	free(vfio_devices);
 
-	kvm__for_each_mem_bank(kvm, KVM_MEM_TYPE_RAM, vfio_unmap_mem_bank, NULL);
-	close(vfio_container);
+	vfio_unmap_guest_ram(kvm);
+	if (vfio_iommufd >= 0)
+		close(vfio_iommufd);
+	else
+		close(vfio_container);
 
 	free(kvm->cfg.vfio_devices);
 
 	return 0;
 }
-dev_base_exit(vfio__exit);
+dev_base_exit_parallel(vfio__exit);
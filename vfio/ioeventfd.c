@@ -0,0 +1,202 @@
+#include "kvm/ioeventfd.h"
+#include "kvm/kvm.h"
+#include "kvm/vfio.h"
+
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+/*
+ * A write that keeps hitting the same trapped register with the same value,
+ * like a doorbell, is offloaded: KVM signals an eventfd on it, and VFIO does
+ * the write to the device. Writes of other values still exit to kvmtool. The
+ * kernel does the offloaded writes asynchronously, much as a posted write.
+ */
+
+void vfio_ioeventfd_init(struct vfio_device *vdev)
+{
+	mutex_init(&vdev->ioeventfd_lock);
+	INIT_LIST_HEAD(&vdev->ioeventfds);
+}
+
+static u32 vfio_ioeventfd_size_flag(u32 len)
+{
+	switch (len) {
+	case 1:
+		return VFIO_DEVICE_IOEVENTFD_8;
+	case 2:
+		return VFIO_DEVICE_IOEVENTFD_16;
+	case 4:
+		return VFIO_DEVICE_IOEVENTFD_32;
+	case 8:
+		return VFIO_DEVICE_IOEVENTFD_64;
+	}
+
+	return 0;
+}
+
+static u64 vfio_ioeventfd_addr(struct vfio_region *region, u64 offset)
+{
+	if (region->is_ioport)
+		return region->port_base + offset;
+
+	return region->guest_phys_addr + offset;
+}
+
+static int vfio_ioeventfd_set(struct vfio_device *vdev,
+			      struct vfio_ioeventfd *ioeventfd, int fd)
+{
+	struct vfio_device_ioeventfd vfio_ioeventfd = {
+		.argsz	= sizeof(vfio_ioeventfd),
+		.flags	= vfio_ioeventfd_size_flag(ioeventfd->len),
+		.offset	= ioeventfd->region->info.offset + ioeventfd->offset,
+		.data	= ioeventfd->data,
+		.fd	= fd,
+	};
+
+	if (ioctl(vdev->fd, VFIO_DEVICE_IOEVENTFD, &vfio_ioeventfd))
+		return -errno;
+
+	return 0;
+}
+
+static int vfio_ioeventfd_add(struct kvm *kvm, struct vfio_device *vdev,
+			      struct vfio_ioeventfd *write)
+{
+	struct vfio_region *region = write->region;
+	struct vfio_ioeventfd *ioeventfd;
+	struct ioevent ioevent;
+	int ret;
+
+	ioeventfd = malloc(sizeof(*ioeventfd));
+	if (!ioeventfd)
+		return -ENOMEM;
+
+	*ioeventfd = *write;
+	ioeventfd->fd = eventfd(0, EFD_CLOEXEC);
+	if (ioeventfd->fd < 0) {
+		ret = -errno;
+		goto err_free;
+	}
+
+	ret = vfio_ioeventfd_set(vdev, ioeventfd, ioeventfd->fd);
+	if (ret)
+		goto err_close;
+
+	/* KVM only signals it for that value, and owns it from now on */
+	ioevent = (struct ioevent) {
+		.io_addr	= vfio_ioeventfd_addr(region, write->offset),
+		.io_len		= write->len,
+		.fn_kvm		= kvm,
+		.fd		= ioeventfd->fd,
+		.datamatch	= write->data,
+	};
+	ret = ioeventfd__add_event(&ioevent, region->is_ioport ?
+				   IOEVENTFD_FLAG_PIO : 0);
+	if (ret) {
+		vfio_ioeventfd_set(vdev, ioeventfd, -1);
+		goto err_free;
+	}
+
+	list_add_tail(&ioeventfd->list, &vdev->ioeventfds);
+	vdev->nr_ioeventfds++;
+	vfio_dev_dbg(vdev, "offloaded writes of 0x%llx to region %u at 0x%llx",
+		     write->data, region->info.index, write->offset);
+
+	return 0;
+
+err_close:
+	close(ioeventfd->fd);
+err_free:
+	free(ioeventfd);
+	return ret;
+}
+
+static bool vfio_ioeventfd_is_doorbell(struct vfio_device *vdev,
+				       struct vfio_region *region, u64 offset)
+{
+	struct vfio_device_params *params = vdev->params;
+	u32 i;
+
+	for (i = 0; i < params->nr_doorbells; i++) {
+		if (params->doorbells[i].bar == region->info.index &&
+		    params->doorbells[i].offset == offset)
+			return true;
+	}
+
+	return false;
+}
+
+/* Called for each trapped write, after it was done */
+void vfio_ioeventfd_write(struct kvm *kvm, struct vfio_region *region,
+			  u64 offset, u32 len, u64 data)
+{
+	struct vfio_device *vdev = region->vdev;
+	struct vfio_ioeventfd *last = &vdev->last_write;
+	u32 hot = VFIO_IOEVENTFD_HOT;
+
+	if (vdev->params->no_ioeventfd || vdev->ioeventfd_failed ||
+	    !vfio_ioeventfd_size_flag(len))
+		return;
+
+	mutex_lock(&vdev->ioeventfd_lock);
+	if (vdev->nr_ioeventfds >= VFIO_IOEVENTFD_MAX)
+		goto out;
+
+	if (last->region != region || last->offset != offset ||
+	    last->len != len || last->data != data) {
+		*last = (struct vfio_ioeventfd) {
+			.region	= region,
+			.offset	= offset,
+			.len	= len,
+			.data	= data,
+		};
+		vdev->last_write_hits = 0;
+	}
+
+	if (vfio_ioeventfd_is_doorbell(vdev, region, offset))
+		hot = 2;
+
+	if (++vdev->last_write_hits < hot)
+		goto out;
+
+	vdev->last_write_hits = 0;
+	if (vfio_ioeventfd_add(kvm, vdev, last)) {
+		/* Most likely the kernel or the region doesn't support it */
+		vfio_dev_info(vdev, "trapped writes can't be offloaded");
+		vdev->ioeventfd_failed = true;
+	}
+	last->region = NULL;
+
+out:
+	mutex_unlock(&vdev->ioeventfd_lock);
+}
+
+/* The guest moved or disabled the BAR, the writes are learnt again */
+void vfio_ioeventfd_del_region(struct kvm *kvm, struct vfio_region *region)
+{
+	struct vfio_device *vdev = region->vdev;
+	struct vfio_ioeventfd *ioeventfd, *next;
+
+	if (!vdev)
+		return;
+
+	mutex_lock(&vdev->ioeventfd_lock);
+	list_for_each_entry_safe(ioeventfd, next, &vdev->ioeventfds, list) {
+		if (ioeventfd->region != region)
+			continue;
+
+		/* Closes the eventfd */
+		ioeventfd__del_event(vfio_ioeventfd_addr(region,
+							 ioeventfd->offset),
+				     ioeventfd->data);
+		vfio_ioeventfd_set(vdev, ioeventfd, -1);
+		list_del(&ioeventfd->list);
+		vdev->nr_ioeventfds--;
+		free(ioeventfd);
+	}
+
+	if (vdev->last_write.region == region)
+		vdev->last_write.region = NULL;
+	mutex_unlock(&vdev->ioeventfd_lock);
+}
@@ -67,24 +67,55 @@ static void set_vfio_irq_eventd_payload(union vfio_irq_eventfd *evfd, int fd)
 static void vfio_pci_disable_intx(struct kvm *kvm, struct vfio_device *vdev);
 static int vfio_pci_enable_intx(struct kvm *kvm, struct vfio_device *vdev);
 
-static int vfio_pci_enable_msis(struct kvm *kvm, struct vfio_device *vdev,
-				bool msix)
+/*
+ * Give the eventfd of a single vector to VFIO, if it changed. The other
+ * vectors keep theirs, and so do their irqfds and posted interrupts.
+ */
+static int vfio_pci_set_msi_vector(struct vfio_device *vdev,
+				   struct vfio_pci_msi_common *msis, size_t i)
 {
-	size_t i;
-	int ret = 0;
-	int *eventfds;
-	struct vfio_pci_device *pdev = &vdev->pci;
-	struct vfio_pci_msi_common *msis = msix ? &pdev->msix : &pdev->msi;
+	int ret, *eventfds = (void *)msis->irq_set + sizeof(struct vfio_irq_set);
+	struct vfio_pci_msi_entry *entry = &msis->entries[i];
+	int fd = entry->gsi >= 0 ? entry->eventfd : -1;
 	union vfio_irq_eventfd single = {
 		.irq = {
 			.argsz	= sizeof(single),
 			.flags	= VFIO_IRQ_SET_DATA_EVENTFD |
 				  VFIO_IRQ_SET_ACTION_TRIGGER,
 			.index	= msis->info.index,
+			.start	= i,
 			.count	= 1,
 		},
 	};
 
+	if (fd == eventfds[i])
+		return 0;
+
+	set_vfio_irq_eventd_payload(&single, fd);
+
+	ret = ioctl(vdev->fd, VFIO_DEVICE_SET_IRQS, &single);
+	if (ret < 0) {
+		perror("VFIO_DEVICE_SET_IRQS(single)");
+		return ret;
+	}
+
+	eventfds[i] = fd;
+
+	if (msi_is_empty(msis->host_state) && fd >= 0)
+		msi_set_empty(msis->host_state, false);
+
+	return 0;
+}
+
+static int vfio_pci_enable_msis(struct kvm *kvm, struct vfio_device *vdev,
+				bool msix)
+{
+	size_t i;
+	int ret = 0;
+	int *eventfds;
+	struct vfio_pci_device *pdev = &vdev->pci;
+	struct vfio_pci_msi_common *msis = msix ? &pdev->msix : &pdev->msi;
+
 	if (!msi_is_enabled(msis->guest_state))
 		return 0;
 
@@ -144,25 +175,9 @@ static int vfio_pci_enable_msis(struct kvm *kvm, struct vfio_device *vdev,
 
 	/* Update individual vectors to avoid breaking those in use */
 	for (i = 0; i < msis->nr_entries; i++) {
-		struct vfio_pci_msi_entry *entry = &msis->entries[i];
-		int fd = entry->gsi >= 0 ? entry->eventfd : -1;
-
-		if (fd == eventfds[i])
-			continue;
-
-		single.irq.start = i;
-		set_vfio_irq_eventd_payload(&single, fd);
-
-		ret = ioctl(vdev->fd, VFIO_DEVICE_SET_IRQS, &single);
-		if (ret < 0) {
-			perror("VFIO_DEVICE_SET_IRQS(single)");
+		ret = vfio_pci_set_msi_vector(vdev, msis, i);
+		if (ret < 0)
 			break;
-		}
-
-		eventfds[i] = fd;
-
-		if (msi_is_empty(msis->host_state) && fd >= 0)
-			msi_set_empty(msis->host_state, false);
 	}
 
 	return ret;
@@ -220,17 +235,30 @@ static int vfio_pci_update_msi_entry(struct kvm *kvm, struct vfio_device *vdev,
 		}
 	}
 
-	/* Allocate IRQ if necessary */
+	/*
+	 * Allocate IRQ if necessary. Guests fill the vectors while they are
+	 * masked, and their routes are only committed together once one of
+	 * them gets an irqfd.
+	 */
 	if (entry->gsi < 0) {
-		int ret = irq__add_msix_route(kvm, &entry->config.msg,
-					      vdev->dev_hdr.dev_num << 3);
+		int ret = irq__add_msix_route_deferred(kvm, &entry->config.msg,
+					pci__devfn(vdev->dev_hdr.dev_num));
 		if (ret < 0) {
 			vfio_dev_err(vdev, "cannot create MSI-X route");
 			return ret;
 		}
 		entry->gsi = ret;
 	} else {
-		irq__update_msix_route(kvm, entry->gsi, &entry->config.msg);
+		irq__update_msix_route_deferred(kvm, entry->gsi,
+						&entry->config.msg);
+	}
+
+	if (!msi_is_masked(entry->guest_state)) {
+		ret = irq__flush_routes(kvm);
+		if (ret < 0) {
+			vfio_dev_err(vdev, "cannot commit MSI-X routes");
+			return ret;
+		}
 	}
 
 	/*
@@ -325,11 +353,18 @@ static void vfio_pci_msix_table_access(struct kvm_cpu *vcpu, u64 addr, u8 *data,
 	memcpy((void *)&entry->config + field, data, len);
 
 	/*
-	 * Check if access touched the vector control register, which is at the
-	 * end of the MSI-X entry.
+	 * Guests may move an unmasked vector to another CPU by rewriting its
+	 * message, address first and data last. Once the data is written,
+	 * retarget the route. The irqfd stays, so KVM only updates the posted
+	 * interrupt and nothing is torn down.
 	 */
-	if (field + len <= PCI_MSIX_ENTRY_VECTOR_CTRL)
+	if (field + len <= PCI_MSIX_ENTRY_VECTOR_CTRL) {
+		if (field + len > PCI_MSIX_ENTRY_DATA && entry->gsi >= 0 &&
+		    !msi_is_masked(entry->host_state))
+			irq__update_msix_route(kvm, entry->gsi,
+					       &entry->config.msg);
 		goto out_unlock;
+	}
 
 	msi_set_masked(entry->guest_state, entry->config.ctrl &
 		       PCI_MSIX_ENTRY_CTRL_MASKBIT);
@@ -338,14 +373,47 @@ static void vfio_pci_msix_table_access(struct kvm_cpu *vcpu, u64 addr, u8 *data,
 		/* Not much we can do here. */
 		vfio_dev_err(vdev, "failed to configure MSIX vector %zu", vector);
 
-	/* Update the physical capability if necessary */
-	if (vfio_pci_enable_msis(kvm, vdev, true))
+	/*
+	 * Once the physical capability is set up with some vectors, only this
+	 * one needs updating. Otherwise setting it up might be due.
+	 */
+	if (msi_is_enabled(pdev->msix.guest_state) &&
+	    !msi_is_masked(pdev->msix.guest_state) &&
+	    msi_is_enabled(pdev->msix.host_state) &&
+	    !msi_is_empty(pdev->msix.host_state)) {
+		if (vfio_pci_set_msi_vector(vdev, &pdev->msix, vector))
+			vfio_dev_err(vdev, "cannot update MSIX vector %zu", vector);
+	} else if (vfio_pci_enable_msis(kvm, vdev, true)) {
 		vfio_dev_err(vdev, "cannot enable MSIX");
+	}
 
 out_unlock:
 	mutex_unlock(&pdev->msix.mutex);
 }
 
+/*
+ * Accesses to the trapped parts of a BAR that holds the MSI-X table or PBA
+ * in place. What isn't one of them goes to the device.
+ */
+static void vfio_pci_msix_bar_access(struct kvm_cpu *vcpu, u64 addr, u8 *data,
+				     u32 len, u8 is_write, void *ptr)
+{
+	struct vfio_region *region = ptr;
+	struct vfio_pci_device *pdev = &region->vdev->pci;
+	struct vfio_pci_msix_table *table = &pdev->msix_table;
+	struct vfio_pci_msix_pba *pba = &pdev->msix_pba;
+	u32 bar = region->info.index;
+
+	if (bar == table->bar && addr >= table->guest_phys_addr &&
+	    addr < table->guest_phys_addr + table->size)
+		vfio_pci_msix_table_access(vcpu, addr, data, len, is_write, pdev);
+	else if (bar == pba->bar && addr >= pba->guest_phys_addr &&
+		 addr < pba->guest_phys_addr + pba->size)
+		vfio_pci_msix_pba_access(vcpu, addr, data, len, is_write, pdev);
+	else
+		vfio_mmio_access(vcpu, addr, data, len, is_write, region);
+}
+
 static void vfio_pci_msix_cap_write(struct kvm *kvm,
 				    struct vfio_device *vdev, u16 off,
 				    void *data, int sz)
@@ -516,32 +584,32 @@ static int vfio_pci_bar_activate(struct kvm *kvm,
 	else
 		region->guest_phys_addr = bar_addr;
 
-	if (has_msix && (u32)bar_num == table->bar) {
-		table->guest_phys_addr = region->guest_phys_addr;
+	if (has_msix && table->relocated && (u32)bar_num == table->bar) {
+		/* The virtual BAR only holds the emulated table and PBA */
+		table->guest_phys_addr = region->guest_phys_addr + table->bar_offset;
+		pba->guest_phys_addr = region->guest_phys_addr + pba->bar_offset;
 		ret = kvm__register_mmio(kvm, table->guest_phys_addr,
 					 table->size, false,
 					 vfio_pci_msix_table_access, pdev);
-		/*
-		 * The MSIX table and the PBA structure can share the same BAR,
-		 * but for convenience we register different regions for mmio
-		 * emulation. We want to we update both if they share the same
-		 * BAR.
-		 */
-		if (ret < 0 || table->bar != pba->bar)
+		if (ret < 0)
 			goto out;
-	}
-
-	if (has_msix && (u32)bar_num == pba->bar) {
-		if (pba->bar == table->bar)
-			pba->guest_phys_addr = table->guest_phys_addr + pba->bar_offset;
-		else
-			pba->guest_phys_addr = region->guest_phys_addr;
 		ret = kvm__register_mmio(kvm, pba->guest_phys_addr,
 					 pba->size, false,
 					 vfio_pci_msix_pba_access, pdev);
+		if (ret < 0)
+			kvm__deregister_mmio(kvm, table->guest_phys_addr);
 		goto out;
 	}
 
+	if (has_msix && !table->relocated) {
+		if ((u32)bar_num == table->bar)
+			table->guest_phys_addr = region->guest_phys_addr +
+						 table->bar_offset;
+		if ((u32)bar_num == pba->bar)
+			pba->guest_phys_addr = region->guest_phys_addr +
+					       pba->bar_offset;
+	}
+
 	ret = vfio_map_region(kvm, vdev, region);
 out:
 	return ret;
@@ -564,18 +632,11 @@ static int vfio_pci_bar_deactivate(struct kvm *kvm,
 	region = &vdev->regions[bar_num];
 	has_msix = pdev->irq_modes & VFIO_PCI_IRQ_MODE_MSIX;
 
-	if (has_msix && (u32)bar_num == table->bar) {
-		success = kvm__deregister_mmio(kvm, table->guest_phys_addr);
+	if (has_msix && table->relocated && (u32)bar_num == table->bar) {
+		success = kvm__deregister_mmio(kvm, table->guest_phys_addr) &
+			  kvm__deregister_mmio(kvm, pba->guest_phys_addr);
 		/* kvm__deregister_mmio fails when the region is not found. */
 		ret = (success ? 0 : -ENOENT);
-		/* See vfio_pci_bar_activate(). */
-		if (ret < 0 || table->bar!= pba->bar)
-			goto out;
-	}
-
-	if (has_msix && (u32)bar_num == pba->bar) {
-		success = kvm__deregister_mmio(kvm, pba->guest_phys_addr);
-		ret = (success ? 0 : -ENOENT);
 		goto out;
 	}
 
@@ -844,23 +905,11 @@ static int vfio_pci_fixup_cfg_space(struct vfio_device *vdev)
 	/* Plumb in our fake MSI-X capability, if we have it. */
 	msix = pci_find_cap(&pdev->hdr, PCI_CAP_ID_MSIX);
 	if (msix) {
-		/* Add a shortcut to the PBA region for the MMIO handler */
-		int pba_index = VFIO_PCI_BAR0_REGION_INDEX + pdev->msix_pba.bar;
-		u32 pba_bar_offset = msix->pba_offset & PCI_MSIX_PBA_OFFSET;
-
-		pdev->msix_pba.fd_offset = vdev->regions[pba_index].info.offset +
-					   pba_bar_offset;
-
-		/* Tidy up the capability */
-		msix->table_offset &= PCI_MSIX_TABLE_BIR;
-		if (pdev->msix_table.bar == pdev->msix_pba.bar) {
-			/* Keep the same offset as the MSIX cap. */
-			pdev->msix_pba.bar_offset = pba_bar_offset;
-		} else {
-			/* PBA is at the start of the BAR. */
-			msix->pba_offset &= PCI_MSIX_PBA_BIR;
-			pdev->msix_pba.bar_offset = 0;
-		}
+		/* Point the capability at the emulated table and PBA */
+		msix->table_offset = pdev->msix_table.bar_offset |
+				     pdev->msix_table.bar;
+		msix->pba_offset = pdev->msix_pba.bar_offset |
+				   pdev->msix_pba.bar;
 	}
 
 	/* Install our fake Configuration Space */
@@ -913,21 +962,55 @@ static int vfio_pci_get_region_info(struct vfio_device *vdev, u32 index,
 	return 0;
 }
 
+/* Find a BAR that the device doesn't implement, to put the MSI-X table in */
+static int vfio_pci_find_free_bar(struct vfio_device *vdev)
+{
+	struct vfio_region_info info;
+	bool is_64bit = false;
+	u32 i, bar;
+
+	for (i = VFIO_PCI_BAR0_REGION_INDEX; i <= VFIO_PCI_BAR5_REGION_INDEX; ++i) {
+		if (i >= vdev->info.num_regions)
+			break;
+
+		/* The top half of a 64-bit BAR isn't free */
+		if (is_64bit) {
+			is_64bit = false;
+			continue;
+		}
+
+		bar = vdev->pci.hdr.bar[i];
+		is_64bit = (bar & PCI_BASE_ADDRESS_SPACE) ==
+			   PCI_BASE_ADDRESS_SPACE_MEMORY &&
+			   bar & PCI_BASE_ADDRESS_MEM_TYPE_64;
+
+		if (vfio_pci_get_region_info(vdev, i, &info))
+			continue;
+		if (!info.size)
+			return i;
+	}
+
+	return -ENOSPC;
+}
+
 static int vfio_pci_create_msix_table(struct kvm *kvm, struct vfio_device *vdev)
 {
 	int ret;
+	int free_bar;
 	size_t i;
-	size_t map_size;
 	size_t nr_entries;
 	struct vfio_pci_msi_entry *entries;
 	struct vfio_pci_device *pdev = &vdev->pci;
 	struct vfio_pci_msix_pba *pba = &pdev->msix_pba;
 	struct vfio_pci_msix_table *table = &pdev->msix_table;
 	struct msix_cap *msix = PCI_CAP(&pdev->hdr, pdev->msix.pos);
+	struct vfio_region table_region = {};
 	struct vfio_region_info info;
 
 	table->bar = msix->table_offset & PCI_MSIX_TABLE_BIR;
-	pba->bar = msix->pba_offset & PCI_MSIX_TABLE_BIR;
+	table->bar_offset = msix->table_offset & PCI_MSIX_TABLE_OFFSET;
+	pba->bar = msix->pba_offset & PCI_MSIX_PBA_BIR;
+	pba->bar_offset = msix->pba_offset & PCI_MSIX_PBA_OFFSET;
 
 	nr_entries = (msix->ctrl & PCI_MSIX_FLAGS_QSIZE) + 1;
 
@@ -942,51 +1025,72 @@ static int vfio_pci_create_msix_table(struct kvm *kvm, struct vfio_device *vdev)
 	for (i = 0; i < nr_entries; i++)
 		entries[i].config.ctrl = PCI_MSIX_ENTRY_CTRL_MASKBIT;
 
-	ret = vfio_pci_get_region_info(vdev, table->bar, &info);
+	ret = vfio_pci_get_region_info(vdev, table->bar, &table_region.info);
 	if (ret)
-		return ret;
-	if (!info.size)
-		return -EINVAL;
+		goto out_free;
+	if (table->bar_offset + table->size > table_region.info.size) {
+		vfio_dev_err(vdev, "MSI-X table exceeds the size of the region");
+		ret = -EINVAL;
+		goto out_free;
+	}
 
-	map_size = ALIGN(info.size, MAX_PAGE_SIZE);
-	table->guest_phys_addr = pci_get_mmio_block(map_size);
-	if (!table->guest_phys_addr) {
-		pr_err("cannot allocate MMIO space");
-		ret = -ENOMEM;
+	/*
+	 * Reads of the PBA are forwarded to the physical one, wherever the
+	 * guest sees it.
+	 */
+	ret = vfio_pci_get_region_info(vdev, pba->bar, &info);
+	if (ret)
+		goto out_free;
+	if (pba->bar_offset + pba->size > info.size) {
+		vfio_dev_err(vdev, "PBA exceeds the size of the region");
+		ret = -EINVAL;
+		goto out_free;
+	}
+	pba->fd_offset = info.offset + pba->bar_offset;
+
+	if (table->bar == pba->bar &&
+	    table->bar_offset < pba->bar_offset + pba->size &&
+	    pba->bar_offset < table->bar_offset + table->size) {
+		vfio_dev_err(vdev, "MSI-X table overlaps with PBA");
+		ret = -EINVAL;
 		goto out_free;
 	}
 
 	/*
-	 * We could map the physical PBA directly into the guest, but it's
-	 * likely smaller than a page, and we can only hand full pages to the
-	 * guest. Even though the PCI spec disallows sharing a page used for
-	 * MSI-X with any other resource, it allows to share the same page
-	 * between MSI-X table and PBA. For the sake of isolation, create a
-	 * virtual PBA.
+	 * The table is emulated, and by default the pages holding it are
+	 * trapped while the rest of its BAR is mapped into the guest. Some
+	 * devices have registers the driver uses all the time next to the
+	 * table though, and trapping these is costly. If the host lets us map
+	 * the table page (it relies on interrupt remapping to isolate the
+	 * device), move the emulated table and PBA to a BAR of their own, so
+	 * that the physical BAR can be mapped as a whole. Otherwise, there is
+	 * nothing to gain since the host won't let us map the page anyway.
 	 */
-	if (table->bar == pba->bar) {
-		u32 pba_bar_offset = msix->pba_offset & PCI_MSIX_PBA_OFFSET;
-
-		/* Sanity checks. */
-		if (table->size > pba_bar_offset)
-			die("MSIX table overlaps with PBA");
-		if (pba_bar_offset + pba->size > info.size)
-			die("PBA exceeds the size of the region");
-		pba->guest_phys_addr = table->guest_phys_addr + pba_bar_offset;
-	} else {
-		ret = vfio_pci_get_region_info(vdev, pba->bar, &info);
-		if (ret)
-			return ret;
-		if (!info.size)
-			return -EINVAL;
+	table_region.vdev = vdev;
+	ret = vfio_get_region_areas(vdev, &table_region);
+	free(table_region.areas);
+	if (ret)
+		goto out_free;
 
-		map_size = ALIGN(info.size, MAX_PAGE_SIZE);
-		pba->guest_phys_addr = pci_get_mmio_block(map_size);
-		if (!pba->guest_phys_addr) {
+	free_bar = vfio_pci_find_free_bar(vdev);
+	if (table_region.msix_mappable && free_bar >= 0) {
+		table->relocated = true;
+		table->bar = free_bar;
+		table->bar_offset = 0;
+		table->bar_size = roundup_pow_of_two(max_t(u32, PAGE_SIZE,
+					table->size + pba->size));
+		pba->bar = free_bar;
+		pba->bar_offset = table->size;
+
+		table->guest_phys_addr = pci_get_mmio_block(table->bar_size);
+		if (!table->guest_phys_addr) {
 			pr_err("cannot allocate MMIO space");
 			ret = -ENOMEM;
 			goto out_free;
 		}
+		pba->guest_phys_addr = table->guest_phys_addr + pba->bar_offset;
+
+		vfio_dev_info(vdev, "MSI-X table moved to BAR %d", free_bar);
 	}
 
 	pdev->msix.entries = entries;
@@ -1013,6 +1117,18 @@ static int vfio_pci_create_msi_cap(struct kvm *kvm, struct vfio_pci_device *pdev
 	return 0;
 }
 
+static void vfio_pci_add_hole(struct vfio_region *region, u32 offset,
+			      u32 size)
+{
+	u64 start = offset & ~(u64)(PAGE_SIZE - 1);
+
+	assert(region->nr_holes < VFIO_REGION_MAX_HOLES);
+	region->holes[region->nr_holes++] = (struct vfio_region_area) {
+		.offset	= start,
+		.size	= ALIGN(offset + size, PAGE_SIZE) - start,
+	};
+}
+
 static int vfio_pci_configure_bar(struct kvm *kvm, struct vfio_device *vdev,
 				  size_t nr)
 {
@@ -1020,6 +1136,8 @@ static int vfio_pci_configure_bar(struct kvm *kvm, struct vfio_device *vdev,
 	u32 bar;
 	size_t map_size;
 	struct vfio_pci_device *pdev = &vdev->pci;
+	struct vfio_pci_msix_table *table = &pdev->msix_table;
+	bool msix = pdev->irq_modes & VFIO_PCI_IRQ_MODE_MSIX;
 	struct vfio_region *region;
 
 	if (nr >= vdev->info.num_regions)
@@ -1031,6 +1149,17 @@ static int vfio_pci_configure_bar(struct kvm *kvm, struct vfio_device *vdev,
 	region->vdev = vdev;
 	region->is_ioport = !!(bar & PCI_BASE_ADDRESS_SPACE_IO);
 
+	if (msix && table->relocated && nr == table->bar) {
+		/* The virtual BAR holding the emulated MSI-X table and PBA */
+		region->info = (struct vfio_region_info) {
+			.argsz	= sizeof(region->info),
+			.index	= nr,
+			.size	= table->bar_size,
+		};
+		region->guest_phys_addr = table->guest_phys_addr;
+		return 0;
+	}
+
 	ret = vfio_pci_get_region_info(vdev, nr, &region->info);
 	if (ret)
 		return ret;
@@ -1039,15 +1168,24 @@ static int vfio_pci_configure_bar(struct kvm *kvm, struct vfio_device *vdev,
 	if (!region->info.size)
 		return 0;
 
-	if (pdev->irq_modes & VFIO_PCI_IRQ_MODE_MSIX) {
-		/* Trap and emulate MSI-X table */
-		if (nr == pdev->msix_table.bar) {
-			region->guest_phys_addr = pdev->msix_table.guest_phys_addr;
-			return 0;
-		} else if (nr == pdev->msix_pba.bar) {
-			region->guest_phys_addr = pdev->msix_pba.guest_phys_addr;
-			return 0;
-		}
+	if (!region->is_ioport) {
+		ret = vfio_get_region_areas(vdev, region);
+		if (ret)
+			return ret;
+	}
+
+	/*
+	 * Trap and emulate the MSI-X table and PBA in place. Only the pages
+	 * holding them are trapped, the rest of the BAR is mapped.
+	 */
+	if (msix && !table->relocated &&
+	    (nr == table->bar || nr == pdev->msix_pba.bar)) {
+		if (nr == table->bar)
+			vfio_pci_add_hole(region, table->bar_offset, table->size);
+		if (nr == pdev->msix_pba.bar)
+			vfio_pci_add_hole(region, pdev->msix_pba.bar_offset,
+					  pdev->msix_pba.size);
+		region->mmio_fn = vfio_pci_msix_bar_access;
 	}
 
 	if (region->is_ioport) {
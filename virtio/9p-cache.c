@@ -0,0 +1,466 @@
+#include "kvm/util.h"
+#include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/virtio-9p.h"
+
+#include <linux/list.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+/*
+ * The lstat() results of the paths the guest looks up, failed lookups
+ * included, since builds spend a lot of time probing include paths for
+ * files that don't exist.
+ *
+ * The requests of the guest invalidate the paths they change. Changes made
+ * on the host are caught by inotify watches on the directories of the cached
+ * paths. Entries whose directory couldn't be watched expire after the TTL. In
+ * loose mode, which matches a guest mounting with cache=loose, the guest is
+ * assumed to be the only one changing the directory, and entries only go
+ * away when invalidated or evicted.
+ */
+#define P9_CACHE_ENTRIES	4096
+#define P9_CACHE_BUCKETS	4096
+#define P9_CACHE_WATCHES	1024
+#define P9_CACHE_WATCH_BUCKETS	256
+
+#define P9_CACHE_EVENTS		(IN_ATTRIB | IN_MODIFY | IN_CREATE |	\
+				 IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+				 IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct p9_cache_entry {
+	struct hlist_node	node;
+	u32			hash;
+	/* NULL while the slot is free */
+	char			*path;
+	/* 0, or the errno of a failed lookup */
+	int			err;
+	struct stat		st;
+	/* 0 if the entry lasts until invalidated */
+	u64			expires_ns;
+	u8			referenced;
+};
+
+struct p9_cache_watch {
+	struct hlist_node	node;
+	u32			hash;
+	int			wd;
+	char			*path;
+};
+
+struct p9_cache {
+	pthread_rwlock_t	lock;
+	struct hlist_head	buckets[P9_CACHE_BUCKETS];
+	/* CLOCK replacement ring */
+	struct p9_cache_entry	slots[P9_CACHE_ENTRIES];
+	u32			hand;
+	/* Bumped by invalidations, so that racing lookups don't insert */
+	u64			gen;
+	u64			ttl_ns;
+	bool			loose;
+
+	int			inotify_fd;
+	int			stop_fd;
+	pthread_t		thread;
+	struct hlist_head	watch_buckets[P9_CACHE_WATCH_BUCKETS];
+	struct p9_cache_watch	watches[P9_CACHE_WATCHES];
+	u32			nr_watches;
+};
+
+static u32 p9_cache_hash(const char *s, size_t len)
+{
+	u32 hash = 2166136261u;
+
+	while (len--) {
+		hash ^= (u8)*s++;
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+static struct p9_cache_entry *p9_cache_find(struct p9_cache *cache,
+					    const char *path, size_t len,
+					    u32 hash)
+{
+	struct hlist_head *bucket = &cache->buckets[hash % P9_CACHE_BUCKETS];
+	struct p9_cache_entry *e;
+
+	hlist_for_each_entry(e, bucket, node) {
+		if (e->hash == hash && !strncmp(e->path, path, len) &&
+		    !e->path[len])
+			return e;
+	}
+
+	return NULL;
+}
+
+static void p9_cache_drop(struct p9_cache_entry *e)
+{
+	hlist_del(&e->node);
+	free(e->path);
+	e->path = NULL;
+}
+
+/* Called with the lock held for writing */
+static void p9_cache_invalidate_locked(struct p9_cache *cache,
+				       const char *path, size_t len,
+				       bool subtree)
+{
+	struct p9_cache_entry *e;
+	u32 i;
+
+	cache->gen++;
+
+	e = p9_cache_find(cache, path, len, p9_cache_hash(path, len));
+	if (e)
+		p9_cache_drop(e);
+
+	if (!subtree)
+		return;
+
+	for (i = 0; i < P9_CACHE_ENTRIES; i++) {
+		e = &cache->slots[i];
+		if (e->path && !strncmp(e->path, path, len) &&
+		    e->path[len] == '/')
+			p9_cache_drop(e);
+	}
+}
+
+static void p9_cache_flush_locked(struct p9_cache *cache)
+{
+	u32 i;
+
+	cache->gen++;
+	for (i = 0; i < P9_CACHE_ENTRIES; i++) {
+		if (cache->slots[i].path)
+			p9_cache_drop(&cache->slots[i]);
+	}
+}
+
+static size_t p9_cache_dirname_len(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+
+	if (!slash)
+		return 0;
+
+	return slash == path ? 1 : slash - path;
+}
+
+/*
+ * Make sure that the directory holding the entry is watched. Called with the
+ * lock held for writing.
+ */
+static bool p9_cache_watch_dir(struct p9_cache *cache, const char *path)
+{
+	size_t len = p9_cache_dirname_len(path);
+	u32 hash = p9_cache_hash(path, len);
+	struct hlist_head *bucket;
+	struct p9_cache_watch *w;
+	char *dir;
+	u32 i;
+	int wd;
+
+	if (cache->inotify_fd < 0 || !len)
+		return false;
+
+	bucket = &cache->watch_buckets[hash % P9_CACHE_WATCH_BUCKETS];
+	hlist_for_each_entry(w, bucket, node) {
+		if (w->hash == hash && !strncmp(w->path, path, len) &&
+		    !w->path[len])
+			return true;
+	}
+
+	/* Reuse the slot of a watch that went away */
+	for (i = 0; i < cache->nr_watches && cache->watches[i].path; i++)
+		;
+	if (i == P9_CACHE_WATCHES)
+		return false;
+
+	dir = strndup(path, len);
+	if (!dir)
+		return false;
+
+	wd = inotify_add_watch(cache->inotify_fd, dir, P9_CACHE_EVENTS);
+	if (wd < 0) {
+		free(dir);
+		return false;
+	}
+
+	w = &cache->watches[i];
+	if (i == cache->nr_watches)
+		cache->nr_watches++;
+	*w = (struct p9_cache_watch) {
+		.hash	= hash,
+		.wd	= wd,
+		.path	= dir,
+	};
+	hlist_add_head(&w->node, bucket);
+
+	return true;
+}
+
+static struct p9_cache_entry *p9_cache_alloc(struct p9_cache *cache)
+{
+	struct p9_cache_entry *e;
+
+	for (;;) {
+		e = &cache->slots[cache->hand];
+		cache->hand = (cache->hand + 1) % P9_CACHE_ENTRIES;
+
+		if (!e->path)
+			return e;
+
+		if (__atomic_exchange_n(&e->referenced, 0, __ATOMIC_RELAXED))
+			continue;
+
+		p9_cache_drop(e);
+		return e;
+	}
+}
+
+static void p9_cache_insert(struct p9_cache *cache, const char *path,
+			    u32 hash, struct stat *st, int err, u64 gen)
+{
+	size_t len = strlen(path);
+	struct p9_cache_entry *e;
+	u64 expires_ns = 0;
+	char *copy;
+
+	pthread_rwlock_wrlock(&cache->lock);
+
+	/* Invalidated since the lookup, or cached by someone else */
+	if (cache->gen != gen || p9_cache_find(cache, path, len, hash))
+		goto out;
+
+	if (!cache->loose && !p9_cache_watch_dir(cache, path)) {
+		if (!cache->ttl_ns)
+			goto out;
+		expires_ns = kvm_cpu__now() + cache->ttl_ns;
+	}
+
+	copy = strdup(path);
+	if (!copy)
+		goto out;
+
+	e = p9_cache_alloc(cache);
+	e->hash		= hash;
+	e->path		= copy;
+	e->err		= err;
+	e->st		= *st;
+	e->expires_ns	= expires_ns;
+	e->referenced	= 0;
+	hlist_add_head(&e->node, &cache->buckets[hash % P9_CACHE_BUCKETS]);
+out:
+	pthread_rwlock_unlock(&cache->lock);
+}
+
+int p9_cache__lstat(struct p9_cache *cache, const char *path, struct stat *st)
+{
+	struct p9_cache_entry *e;
+	size_t len;
+	u32 hash;
+	int r, err;
+	u64 gen;
+
+	if (!cache)
+		return lstat(path, st);
+
+	len = strlen(path);
+	hash = p9_cache_hash(path, len);
+
+	pthread_rwlock_rdlock(&cache->lock);
+	e = p9_cache_find(cache, path, len, hash);
+	if (e && (!e->expires_ns || e->expires_ns > kvm_cpu__now())) {
+		err = e->err;
+		*st = e->st;
+		__atomic_store_n(&e->referenced, 1, __ATOMIC_RELAXED);
+		pthread_rwlock_unlock(&cache->lock);
+
+		if (!err)
+			return 0;
+
+		errno = err;
+		return -1;
+	}
+	gen = cache->gen;
+	pthread_rwlock_unlock(&cache->lock);
+
+	r = lstat(path, st);
+	err = r ? errno : 0;
+
+	if (!r || err == ENOENT || err == ENOTDIR) {
+		if (r)
+			memset(st, 0, sizeof(*st));
+		p9_cache_insert(cache, path, hash, st, err, gen);
+	}
+
+	errno = err;
+	return r;
+}
+
+void p9_cache__invalidate(struct p9_cache *cache, const char *path,
+			  bool subtree)
+{
+	size_t len;
+
+	if (!cache)
+		return;
+
+	len = strlen(path);
+
+	pthread_rwlock_wrlock(&cache->lock);
+	p9_cache_invalidate_locked(cache, path, len, subtree);
+	/* Adding or removing an entry changes the times of the directory */
+	p9_cache_invalidate_locked(cache, path, p9_cache_dirname_len(path),
+				   false);
+	pthread_rwlock_unlock(&cache->lock);
+}
+
+static void p9_cache_handle_event(struct p9_cache *cache,
+				  struct inotify_event *ev)
+{
+	struct p9_cache_watch *w = NULL;
+	char path[PATH_MAX];
+	size_t len;
+	u32 i;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		p9_cache_flush_locked(cache);
+		return;
+	}
+
+	for (i = 0; i < cache->nr_watches; i++) {
+		if (cache->watches[i].path && cache->watches[i].wd == ev->wd) {
+			w = &cache->watches[i];
+			break;
+		}
+	}
+	if (!w)
+		return;
+
+	if (ev->mask & IN_IGNORED) {
+		/* Nothing below can be trusted without the watch */
+		p9_cache_invalidate_locked(cache, w->path, strlen(w->path),
+					   true);
+		hlist_del(&w->node);
+		free(w->path);
+		w->path = NULL;
+		return;
+	}
+
+	if (!ev->len) {
+		p9_cache_invalidate_locked(cache, w->path, strlen(w->path),
+					   false);
+		return;
+	}
+
+	len = snprintf(path, sizeof(path), "%s/%s", w->path, ev->name);
+	if (len >= sizeof(path))
+		return;
+
+	p9_cache_invalidate_locked(cache, path, len, ev->mask & IN_ISDIR);
+	if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+		p9_cache_invalidate_locked(cache, w->path, strlen(w->path),
+					   false);
+}
+
+static void *p9_cache_thread(void *param)
+{
+	struct p9_cache *cache = param;
+	struct pollfd pfd[] = {
+		{ .fd = cache->inotify_fd,	.events = POLLIN },
+		{ .fd = cache->stop_fd,		.events = POLLIN },
+	};
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+
+	kvm__set_thread_name("virtio-9p-cache");
+
+	while (poll(pfd, ARRAY_SIZE(pfd), -1) >= 0 || errno == EINTR) {
+		if (pfd[1].revents)
+			break;
+		if (!pfd[0].revents)
+			continue;
+
+		len = read(cache->inotify_fd, buf, sizeof(buf));
+		if (len <= 0)
+			continue;
+
+		pthread_rwlock_wrlock(&cache->lock);
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			p9_cache_handle_event(cache, ev);
+		}
+		pthread_rwlock_unlock(&cache->lock);
+	}
+
+	return NULL;
+}
+
+struct p9_cache *p9_cache__new(u32 ttl_ms, bool loose)
+{
+	struct p9_cache *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	pthread_rwlock_init(&cache->lock, NULL);
+	cache->ttl_ns		= (u64)ttl_ms * 1000000;
+	cache->loose		= loose;
+	cache->inotify_fd	= -1;
+	cache->stop_fd		= -1;
+
+	if (loose)
+		return cache;
+
+	cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	cache->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (cache->inotify_fd < 0 || cache->stop_fd < 0 ||
+	    pthread_create(&cache->thread, NULL, p9_cache_thread, cache)) {
+		pr_warning("9p attribute cache: no inotify, entries expire after %u ms",
+			   ttl_ms);
+		if (cache->inotify_fd >= 0)
+			close(cache->inotify_fd);
+		if (cache->stop_fd >= 0)
+			close(cache->stop_fd);
+		cache->inotify_fd = cache->stop_fd = -1;
+	}
+
+	return cache;
+}
+
+void p9_cache__free(struct p9_cache *cache)
+{
+	u64 stop = 1;
+	u32 i;
+
+	if (!cache)
+		return;
+
+	if (cache->inotify_fd >= 0) {
+		if (write(cache->stop_fd, &stop, sizeof(stop)) < 0)
+			pr_warning("Failed stopping the 9p cache thread");
+		pthread_join(cache->thread, NULL);
+		close(cache->inotify_fd);
+		close(cache->stop_fd);
+	}
+
+	p9_cache_flush_locked(cache);
+	for (i = 0; i < cache->nr_watches; i++)
+		free(cache->watches[i].path);
+
+	pthread_rwlock_destroy(&cache->lock);
+	free(cache);
+}
@@ -0,0 +1,742 @@
+#include "kvm/util.h"
+#include "kvm/virtio-9p.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+/*
+ * An overlay shares a read-only lower directory between guests, with the
+ * changes of each of them kept in its own upper directory, the root of the
+ * device. A file of the lower directory is copied up before it is first
+ * written to, and a removed one is hidden by a whiteout, an empty file named
+ * .wh.<name> next to where it was. A directory replacing a removed one, or
+ * moved in, gets an opaque marker hiding what the lower directory had there.
+ * Unlike the whiteouts of overlayfs these are regular files, which don't
+ * need any privileges to create.
+ *
+ * The paths handled here are those of the upper directory, as the fids have
+ * them. Without an overlay, the helpers do what the device did before.
+ */
+#define P9_OVERLAY_WH		".wh."
+#define P9_OVERLAY_WH_LEN	(sizeof(P9_OVERLAY_WH) - 1)
+#define P9_OVERLAY_OPAQUE	P9_OVERLAY_WH ".wh..opq"
+#define P9_OVERLAY_TMP		P9_OVERLAY_WH ".wh..tmp.XXXXXX"
+/* Keeps the qids of the lower and upper files apart */
+#define P9_OVERLAY_LOWER_INO	(1ULL << 63)
+
+struct p9_overlay {
+	char			lower[PATH_MAX];
+	size_t			root_len;
+	/* Serializes the changes to the upper directory */
+	struct mutex		lock;
+};
+
+struct p9_overlay_dents {
+	char			*buf;
+	size_t			len;
+	size_t			size;
+};
+
+bool p9_overlay__hidden(struct p9_dev *p9dev, const char *name)
+{
+	return p9dev->overlay &&
+	       !strncmp(name, P9_OVERLAY_WH, P9_OVERLAY_WH_LEN);
+}
+
+static const char *p9_overlay_name(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+
+	return slash ? slash + 1 : path;
+}
+
+/* The entry named prefix + name in the directory of path, in buf */
+static int p9_overlay_sibling(char *buf, const char *path, const char *prefix,
+			      const char *name)
+{
+	int dir_len = p9_overlay_name(path) - path;
+	int ret;
+
+	ret = snprintf(buf, PATH_MAX, "%.*s%s%s", dir_len, path, prefix, name);
+	if (ret >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int p9_overlay_lower(struct p9_dev *p9dev, const char *path, char *buf)
+{
+	struct p9_overlay *ovl = p9dev->overlay;
+	int ret;
+
+	ret = snprintf(buf, PATH_MAX, "%s%s", ovl->lower, path + ovl->root_len);
+	if (ret >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+static bool p9_overlay_exists(struct p9_dev *p9dev, const char *path)
+{
+	struct stat st;
+
+	return !p9_cache__lstat(p9dev->attr_cache, path, &st);
+}
+
+/*
+ * Whether the lower directory shows through at path: no whiteout nor
+ * opaque directory hides it, and no file of the upper directory is in the
+ * way.
+ */
+static bool p9_overlay_visible(struct p9_dev *p9dev, const char *path)
+{
+	struct p9_overlay *ovl = p9dev->overlay;
+	char dir[PATH_MAX], tmp[PATH_MAX];
+	size_t pos = ovl->root_len, end;
+	struct stat st;
+	int ret;
+
+	for (;;) {
+		while (path[pos] == '/')
+			pos++;
+		if (!path[pos])
+			return true;
+
+		end = pos + strcspn(path + pos, "/");
+		ret = snprintf(tmp, sizeof(tmp), "%.*s" P9_OVERLAY_WH "%.*s",
+			       (int)pos, path, (int)(end - pos), path + pos);
+		if (ret >= (int)sizeof(tmp) || p9_overlay_exists(p9dev, tmp))
+			return false;
+
+		ret = snprintf(tmp, sizeof(tmp), "%.*s" P9_OVERLAY_OPAQUE,
+			       (int)pos, path);
+		if (ret >= (int)sizeof(tmp) || p9_overlay_exists(p9dev, tmp))
+			return false;
+
+		if (!path[end])
+			return true;
+
+		snprintf(dir, sizeof(dir), "%.*s", (int)end, path);
+		if (p9_cache__lstat(p9dev->attr_cache, dir, &st) < 0)
+			return errno == ENOENT;
+		if (!S_ISDIR(st.st_mode))
+			return false;
+
+		pos = end;
+	}
+}
+
+/* The file at path in the lower directory, if it shows through */
+static int p9_overlay_lookup_lower(struct p9_dev *p9dev, const char *path,
+				   char *lower, struct stat *st)
+{
+	if (!p9_overlay_visible(p9dev, path)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (p9_overlay_lower(p9dev, path, lower) < 0 ||
+	    p9_cache__lstat(p9dev->attr_cache, lower, st) < 0)
+		return -1;
+
+	st->st_ino |= P9_OVERLAY_LOWER_INO;
+	return 0;
+}
+
+/*
+ * lstat() of what the guest sees at path, and where that is on the host if
+ * host isn't NULL.
+ */
+int p9_overlay__lstat(struct p9_dev *p9dev, const char *path, char *host,
+		      struct stat *st)
+{
+	char lower[PATH_MAX];
+
+	if (!p9_cache__lstat(p9dev->attr_cache, path, st)) {
+		if (host && host != path)
+			strcpy(host, path);
+		return 0;
+	}
+
+	if (!p9dev->overlay || errno != ENOENT ||
+	    p9_overlay_lookup_lower(p9dev, path, lower, st) < 0)
+		return -1;
+
+	if (host)
+		strcpy(host, lower);
+	return 0;
+}
+
+static void p9_overlay_invalidate(struct p9_dev *p9dev, const char *path)
+{
+	p9_cache__invalidate(p9dev->attr_cache, path, true);
+}
+
+static int p9_overlay_copy_file(const char *from, const char *to,
+				struct stat *st)
+{
+	char tmp[PATH_MAX];
+	int in, out, err;
+	off_t offset = 0;
+	ssize_t ret;
+
+	if (p9_overlay_sibling(tmp, to, P9_OVERLAY_TMP, "") < 0)
+		return -1;
+
+	in = open(from, O_RDONLY | O_NOFOLLOW);
+	if (in < 0)
+		return -1;
+
+	out = mkstemp(tmp);
+	if (out < 0) {
+		err = errno;
+		close(in);
+		errno = err;
+		return -1;
+	}
+
+	ret = 0;
+	while (offset < st->st_size) {
+		ret = sendfile(out, in, &offset, st->st_size - offset);
+		if (ret <= 0)
+			break;
+	}
+	/* The file shrank under us */
+	if (!ret)
+		errno = EIO;
+
+	/* Owner first, it drops the setuid bits */
+	if (offset == st->st_size &&
+	    fchown(out, st->st_uid, st->st_gid) < 0)
+		pr_debug("9p overlay: can't keep the owner of %s", from);
+
+	if (offset < st->st_size || fchmod(out, st->st_mode & 07777) < 0 ||
+	    futimens(out, (struct timespec []){ st->st_atim, st->st_mtim }) < 0 ||
+	    rename(tmp, to) < 0) {
+		err = errno;
+		unlink(tmp);
+		close(out);
+		close(in);
+		errno = err;
+		return -1;
+	}
+
+	close(out);
+	close(in);
+	return 0;
+}
+
+static int p9_overlay_copy_up_parent(struct p9_dev *p9dev, const char *path);
+
+/* Called with the lock held */
+static int p9_overlay_copy_up(struct p9_dev *p9dev, const char *path)
+{
+	char lower[PATH_MAX], target[PATH_MAX];
+	struct stat st;
+	ssize_t len;
+	int ret;
+
+	if (p9_overlay_exists(p9dev, path))
+		return 0;
+	if (errno != ENOENT)
+		return -1;
+
+	if (p9_overlay_lookup_lower(p9dev, path, lower, &st) < 0)
+		return -1;
+
+	if (p9_overlay_copy_up_parent(p9dev, path) < 0)
+		return -1;
+
+	switch (st.st_mode & S_IFMT) {
+	case S_IFDIR:
+		ret = mkdir(path, 0700);
+		if (!ret && lchown(path, st.st_uid, st.st_gid) < 0)
+			pr_debug("9p overlay: can't keep the owner of %s", lower);
+		if (!ret)
+			ret = chmod(path, st.st_mode & 07777);
+		break;
+	case S_IFREG:
+		ret = p9_overlay_copy_file(lower, path, &st);
+		break;
+	case S_IFLNK:
+		len = readlink(lower, target, sizeof(target) - 1);
+		if (len < 0)
+			return -1;
+		target[len] = '\0';
+		ret = symlink(target, path);
+		if (!ret && lchown(path, st.st_uid, st.st_gid) < 0)
+			pr_debug("9p overlay: can't keep the owner of %s", lower);
+		break;
+	default:
+		ret = mknod(path, st.st_mode, st.st_rdev);
+		break;
+	}
+
+	p9_overlay_invalidate(p9dev, path);
+	return ret;
+}
+
+/* Make path a file of the upper directory before it is changed */
+int p9_overlay__copy_up(struct p9_dev *p9dev, const char *path)
+{
+	struct p9_overlay *ovl = p9dev->overlay;
+	int ret;
+
+	if (!ovl)
+		return 0;
+
+	mutex_lock(&ovl->lock);
+	ret = p9_overlay_copy_up(p9dev, path);
+	mutex_unlock(&ovl->lock);
+
+	return ret;
+}
+
+static int p9_overlay_copy_up_parent(struct p9_dev *p9dev, const char *path)
+{
+	char parent[PATH_MAX];
+	const char *name = p9_overlay_name(path);
+
+	/* The root of the upper directory always exists */
+	if ((size_t)(name - path) <= p9dev->overlay->root_len + 1)
+		return 0;
+
+	snprintf(parent, sizeof(parent), "%.*s", (int)(name - path - 1), path);
+	return p9_overlay_copy_up(p9dev, parent);
+}
+
+static int p9_overlay_whiteout(struct p9_dev *p9dev, const char *path)
+{
+	char wh[PATH_MAX];
+	int fd;
+
+	if (p9_overlay_sibling(wh, path, P9_OVERLAY_WH,
+			       p9_overlay_name(path)) < 0)
+		return -1;
+
+	fd = open(wh, O_CREAT | O_WRONLY | O_NOFOLLOW, 0);
+	if (fd < 0)
+		return -1;
+
+	close(fd);
+	p9_overlay_invalidate(p9dev, wh);
+	return 0;
+}
+
+/* Drop the whiteout of path, returning whether there was one */
+static bool p9_overlay_drop_whiteout(struct p9_dev *p9dev, const char *path)
+{
+	char wh[PATH_MAX];
+
+	if (p9_overlay_sibling(wh, path, P9_OVERLAY_WH,
+			       p9_overlay_name(path)) < 0 || unlink(wh) < 0)
+		return false;
+
+	p9_overlay_invalidate(p9dev, wh);
+	return true;
+}
+
+static int p9_overlay_make_opaque(struct p9_dev *p9dev, const char *path)
+{
+	char opaque[PATH_MAX];
+	int fd, ret;
+
+	ret = snprintf(opaque, sizeof(opaque), "%s/" P9_OVERLAY_OPAQUE, path);
+	if (ret >= (int)sizeof(opaque)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = open(opaque, O_CREAT | O_WRONLY | O_NOFOLLOW, 0);
+	if (fd < 0)
+		return -1;
+
+	close(fd);
+	p9_overlay_invalidate(p9dev, opaque);
+	return 0;
+}
+
+/* Before path is created in the upper directory */
+int p9_overlay__create(struct p9_dev *p9dev, const char *path)
+{
+	struct p9_overlay *ovl = p9dev->overlay;
+	int ret;
+
+	if (!ovl)
+		return 0;
+
+	if (p9_overlay__hidden(p9dev, p9_overlay_name(path))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	mutex_lock(&ovl->lock);
+	ret = p9_overlay_copy_up_parent(p9dev, path);
+	mutex_unlock(&ovl->lock);
+
+	return ret;
+}
+
+/* Once path was created, it hides what the lower directory has there */
+int p9_overlay__created(struct p9_dev *p9dev, const char *path)
+{
+	struct p9_overlay *ovl = p9dev->overlay;
+	char lower[PATH_MAX];
+	struct stat st;
+	bool covers;
+	int ret = 0;
+
+	if (!ovl)
+		return 0;
+
+	mutex_lock(&ovl->lock);
+	covers = p9_overlay_drop_whiteout(p9dev, path) ||
+		 !p9_overlay_lookup_lower(p9dev, path, lower, &st);
+	if (covers && !lstat(path, &st) && S_ISDIR(st.st_mode))
+		ret = p9_overlay_make_opaque(p9dev, path);
+	mutex_unlock(&ovl->lock);
+
+	return ret;
+}
+
+static int p9_overlay_dents_add(struct p9_overlay_dents *dents, u64 ino,
+				u8 type, const char *name)
+{
+	size_t reclen = ALIGN(offsetof(struct dirent64, d_name) +
+			      strlen(name) + 1, 8);
+	struct dirent64 *dent;
+	char *buf;
+
+	if (dents->len + reclen > dents->size) {
+		size_t size = max_t(size_t, dents->size * 2, 4096) + reclen;
+
+		buf = realloc(dents->buf, size);
+		if (!buf)
+			return -ENOMEM;
+		dents->buf = buf;
+		dents->size = size;
+	}
+
+	dent = (struct dirent64 *)(dents->buf + dents->len);
+	memset(dent, 0, reclen);
+	dents->len += reclen;
+	dent->d_ino	= ino;
+	dent->d_off	= dents->len;
+	dent->d_reclen	= reclen;
+	dent->d_type	= type;
+	strcpy(dent->d_name, name);
+
+	return 0;
+}
+
+static bool p9_overlay_dot(const char *name)
+{
+	return !strcmp(name, ".") || !strcmp(name, "..");
+}
+
+/*
+ * The entries of the upper directory then those of the lower one that it
+ * doesn't cover, or -1 with errno set.
+ */
+static int p9_overlay_list(struct p9_dev *p9dev, const char *path,
+			   struct p9_overlay_dents *dents)
+{
+	char lower[PATH_MAX], opaque[PATH_MAX];
+	DIR *upper_dir = NULL, *lower_dir = NULL;
+	bool upper_dots = false;
+	struct dirent *dent;
+	struct stat st;
+	int ret = 0;
+
+	*dents = (struct p9_overlay_dents) {};
+
+	if (!lstat(path, &st) && S_ISDIR(st.st_mode)) {
+		upper_dir = opendir(path);
+		if (!upper_dir)
+			return -1;
+	}
+
+	snprintf(opaque, sizeof(opaque), "%s/" P9_OVERLAY_OPAQUE, path);
+	if (!(upper_dir && !lstat(opaque, &st)) &&
+	    !p9_overlay_lookup_lower(p9dev, path, lower, &st) &&
+	    S_ISDIR(st.st_mode)) {
+		lower_dir = opendir(lower);
+		if (!lower_dir)
+			ret = -1;
+	}
+
+	if (!upper_dir && !lower_dir) {
+		if (!ret)
+			errno = ENOENT;
+		return -1;
+	}
+
+	while (!ret && upper_dir && (dent = readdir(upper_dir))) {
+		if (p9_overlay__hidden(p9dev, dent->d_name))
+			continue;
+		upper_dots |= p9_overlay_dot(dent->d_name);
+		ret = p9_overlay_dents_add(dents, dent->d_ino, dent->d_type,
+					   dent->d_name);
+	}
+
+	while (!ret && lower_dir && (dent = readdir(lower_dir))) {
+		char wh[NAME_MAX + P9_OVERLAY_WH_LEN + 1];
+
+		if (p9_overlay_dot(dent->d_name) && upper_dots)
+			continue;
+
+		if (upper_dir) {
+			snprintf(wh, sizeof(wh), P9_OVERLAY_WH "%s", dent->d_name);
+			if (!fstatat(dirfd(upper_dir), dent->d_name, &st,
+				     AT_SYMLINK_NOFOLLOW) ||
+			    !fstatat(dirfd(upper_dir), wh, &st,
+				     AT_SYMLINK_NOFOLLOW))
+				continue;
+		}
+
+		ret = p9_overlay_dents_add(dents,
+					   dent->d_ino | P9_OVERLAY_LOWER_INO,
+					   dent->d_type, dent->d_name);
+	}
+
+	if (upper_dir)
+		closedir(upper_dir);
+	if (lower_dir)
+		closedir(lower_dir);
+
+	if (ret < 0) {
+		free(dents->buf);
+		errno = -ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Read the merged entries of a directory when the fid is opened */
+int p9_overlay__opendir(struct p9_dev *p9dev, struct p9_fid *fid)
+{
+	struct p9_overlay_dents dents;
+
+	if (!p9dev->overlay)
+		return 0;
+
+	if (p9_overlay_list(p9dev, fid->abs_path, &dents) < 0)
+		return -1;
+
+	free(fid->dents);
+	fid->dents = dents.buf;
+	fid->dents_len = dents.len;
+	return 0;
+}
+
+/* The getdents64() of the entries read at open, from *offset */
+ssize_t p9_overlay__getdents(struct p9_fid *fid, u64 *offset, void *buf,
+			     size_t size)
+{
+	size_t pos = *offset, len = 0, name;
+	struct dirent64 *dent;
+
+	/* Offsets come from the guest, each record is checked */
+	while (pos < fid->dents_len) {
+		dent = (struct dirent64 *)(fid->dents + pos);
+		name = offsetof(struct dirent64, d_name);
+		if (pos % 8 || pos + name > fid->dents_len ||
+		    dent->d_reclen <= name ||
+		    dent->d_reclen > fid->dents_len - pos ||
+		    !memchr(dent->d_name, 0, dent->d_reclen - name)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (len + dent->d_reclen > size)
+			break;
+
+		memcpy((char *)buf + len, dent, dent->d_reclen);
+		len += dent->d_reclen;
+		pos += dent->d_reclen;
+	}
+
+	*offset = pos;
+	return len;
+}
+
+/* Remove the upper directory at path, already found to look empty */
+static int p9_overlay_rmdir(const char *path)
+{
+	char entry[PATH_MAX];
+	struct dirent *dent;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	while ((dent = readdir(dir))) {
+		if (strncmp(dent->d_name, P9_OVERLAY_WH, P9_OVERLAY_WH_LEN))
+			continue;
+		snprintf(entry, sizeof(entry), "%s/%s", path, dent->d_name);
+		unlink(entry);
+	}
+
+	closedir(dir);
+	return rmdir(path);
+}
+
+static int p9_overlay_remove(struct p9_dev *p9dev, const char *path)
+{
+	struct p9_overlay_dents dents;
+	char lower[PATH_MAX];
+	struct stat upper_st, lower_st;
+	bool upper, in_lower;
+	size_t pos;
+
+	upper = !lstat(path, &upper_st);
+	in_lower = !p9_overlay_lookup_lower(p9dev, path, lower, &lower_st);
+	if (!upper && !in_lower) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (S_ISDIR(upper ? upper_st.st_mode : lower_st.st_mode)) {
+		if (p9_overlay_list(p9dev, path, &dents) < 0)
+			return -1;
+
+		for (pos = 0; pos < dents.len; pos = ((struct dirent64 *)
+		     (dents.buf + pos))->d_off) {
+			if (!p9_overlay_dot(((struct dirent64 *)
+					     (dents.buf + pos))->d_name))
+				break;
+		}
+		free(dents.buf);
+
+		if (pos < dents.len) {
+			errno = ENOTEMPTY;
+			return -1;
+		}
+
+		if (upper && p9_overlay_rmdir(path) < 0)
+			return -1;
+	} else if (upper && unlink(path) < 0) {
+		return -1;
+	}
+
+	p9_overlay_invalidate(p9dev, path);
+
+	if (!in_lower)
+		return 0;
+
+	if (p9_overlay_copy_up_parent(p9dev, path) < 0)
+		return -1;
+
+	return p9_overlay_whiteout(p9dev, path);
+}
+
+/* remove() of what the guest sees at path */
+int p9_overlay__remove(struct p9_dev *p9dev, const char *path)
+{
+	struct p9_overlay *ovl = p9dev->overlay;
+	int ret;
+
+	if (!ovl)
+		return remove(path);
+
+	mutex_lock(&ovl->lock);
+	ret = p9_overlay_remove(p9dev, path);
+	mutex_unlock(&ovl->lock);
+
+	return ret;
+}
+
+/*
+ * Directories are only moved within the upper directory, as overlayfs does
+ * without redirects: those that the lower directory has, or that would
+ * replace one it has, make the rename fail with EXDEV and the guest copies
+ * them instead.
+ */
+static int p9_overlay_rename(struct p9_dev *p9dev, const char *old,
+			     const char *new)
+{
+	char lower[PATH_MAX];
+	struct stat st, lower_st;
+	bool old_lower, new_lower;
+
+	if (p9_overlay__lstat(p9dev, old, NULL, &st) < 0)
+		return -1;
+
+	old_lower = !p9_overlay_lookup_lower(p9dev, old, lower, &lower_st);
+	new_lower = !p9_overlay_lookup_lower(p9dev, new, lower, &lower_st);
+	if (S_ISDIR(st.st_mode) &&
+	    (old_lower || (new_lower && S_ISDIR(lower_st.st_mode)))) {
+		errno = EXDEV;
+		return -1;
+	}
+
+	if (p9_overlay_copy_up(p9dev, old) < 0 ||
+	    p9_overlay_copy_up_parent(p9dev, new) < 0 ||
+	    rename(old, new) < 0)
+		return -1;
+
+	p9_overlay_invalidate(p9dev, old);
+	p9_overlay_invalidate(p9dev, new);
+	p9_overlay_drop_whiteout(p9dev, new);
+
+	return old_lower ? p9_overlay_whiteout(p9dev, old) : 0;
+}
+
+/* rename() of what the guest sees at old */
+int p9_overlay__rename(struct p9_dev *p9dev, const char *old, const char *new)
+{
+	struct p9_overlay *ovl = p9dev->overlay;
+	int ret;
+
+	if (!ovl)
+		return rename(old, new);
+
+	if (p9_overlay__hidden(p9dev, p9_overlay_name(new))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	mutex_lock(&ovl->lock);
+	ret = p9_overlay_rename(p9dev, old, new);
+	mutex_unlock(&ovl->lock);
+
+	return ret;
+}
+
+struct p9_overlay *p9_overlay__new(const char *upper, const char *lower)
+{
+	struct p9_overlay *ovl;
+
+	if (strlen(lower) >= sizeof(ovl->lower))
+		return NULL;
+
+	ovl = calloc(1, sizeof(*ovl));
+	if (!ovl)
+		return NULL;
+
+	strcpy(ovl->lower, lower);
+	ovl->root_len = strlen(upper);
+	mutex_init(&ovl->lock);
+
+	return ovl;
+}
+
+void p9_overlay__free(struct p9_overlay *ovl)
+{
+	free(ovl);
+}
@@ -1,4 +1,5 @@
 #include "kvm/util.h"
+#include "kvm/iovec.h"
 #include "kvm/virtio-9p.h"
 
 #include <endian.h>
@@ -7,61 +8,94 @@
 #include <linux/compiler.h>
 #include <linux/9p.h>
 
-static void virtio_p9_pdu_read(struct p9_pdu *pdu, void *data, size_t size)
+/*
+ * Fields are read and written one after the other, so the cursors carry
+ * on from where the previous field ended. They only walk the iovecs again
+ * when a handler moved read_offset or write_offset itself.
+ */
+static struct iovec_cursor *virtio_p9_pdu_cursor(struct iovec_cursor *cur,
+						 size_t *cur_offset,
+						 const struct iovec *iov,
+						 size_t cnt, size_t offset)
 {
-	size_t len;
-	int i, copied = 0;
-	u16 iov_cnt = pdu->out_iov_cnt;
-	size_t offset = pdu->read_offset;
-	struct iovec *iov = pdu->out_iov;
-
-	for (i = 0; i < iov_cnt && size; i++) {
-		if (offset >= iov[i].iov_len) {
-			offset -= iov[i].iov_len;
-			continue;
-		} else {
-			len = MIN(iov[i].iov_len - offset, size);
-			memcpy(data, iov[i].iov_base + offset, len);
-			size -= len;
-			data += len;
-			offset = 0;
-			copied += len;
-		}
+	if (*cur_offset != offset) {
+		iovec_cursor__init(cur, iov, cnt);
+		iovec_cursor__skip(cur, offset);
+		*cur_offset = offset;
 	}
-	pdu->read_offset += copied;
+
+	return cur;
+}
+
+static void virtio_p9_pdu_read(struct p9_pdu *pdu, void *data, size_t size)
+{
+	struct iovec_cursor *cur;
+
+	cur = virtio_p9_pdu_cursor(&pdu->read_cur, &pdu->read_cur_offset,
+				   pdu->out_iov, pdu->out_iov_cnt,
+				   pdu->read_offset);
+	pdu->read_offset += iovec_cursor__from(cur, data, size);
+	pdu->read_cur_offset = pdu->read_offset;
+}
+
+static void virtio_p9_pdu_skip(struct p9_pdu *pdu, size_t size)
+{
+	struct iovec_cursor *cur;
+
+	cur = virtio_p9_pdu_cursor(&pdu->read_cur, &pdu->read_cur_offset,
+				   pdu->out_iov, pdu->out_iov_cnt,
+				   pdu->read_offset);
+	pdu->read_offset += iovec_cursor__skip(cur, size);
+	pdu->read_cur_offset = pdu->read_offset;
 }
 
 static void virtio_p9_pdu_write(struct p9_pdu *pdu,
 				const void *data, size_t size)
 {
-	size_t len;
-	int i, copied = 0;
-	u16 iov_cnt = pdu->in_iov_cnt;
-	size_t offset = pdu->write_offset;
-	struct iovec *iov = pdu->in_iov;
-
-	for (i = 0; i < iov_cnt && size; i++) {
-		if (offset >= iov[i].iov_len) {
-			offset -= iov[i].iov_len;
-			continue;
-		} else {
-			len = MIN(iov[i].iov_len - offset, size);
-			memcpy(iov[i].iov_base + offset, data, len);
-			size -= len;
-			data += len;
-			offset = 0;
-			copied += len;
-		}
+	struct iovec_cursor *cur;
+
+	cur = virtio_p9_pdu_cursor(&pdu->write_cur, &pdu->write_cur_offset,
+				   pdu->in_iov, pdu->in_iov_cnt,
+				   pdu->write_offset);
+	pdu->write_offset += iovec_cursor__to(cur, data, size);
+	pdu->write_cur_offset = pdu->write_offset;
+}
+
+/*
+ * Strings are decoded into the pdu, and live as long as it does. The few
+ * that don't fit are allocated and freed with the pdu.
+ */
+static char *virtio_p9_pdu_str(struct p9_pdu *pdu, size_t len)
+{
+	struct p9_pdu_str *spill;
+	char *str;
+
+	if (len < sizeof(pdu->strings) - pdu->strings_len) {
+		str = pdu->strings + pdu->strings_len;
+		pdu->strings_len += len + 1;
+		return str;
 	}
-	pdu->write_offset += copied;
+
+	spill = malloc(sizeof(*spill) + len + 1);
+	if (!spill)
+		return NULL;
+
+	spill->next = pdu->spill;
+	pdu->spill = spill;
+
+	return spill->str;
 }
 
-static void virtio_p9_wstat_free(struct p9_wstat *stbuf)
+void virtio_p9_pdu_free(struct p9_dev *p9dev, struct p9_pdu *pdu)
 {
-	free(stbuf->name);
-	free(stbuf->uid);
-	free(stbuf->gid);
-	free(stbuf->muid);
+	struct p9_pdu_str *spill;
+
+	while ((spill = pdu->spill)) {
+		pdu->spill = spill->next;
+		free(spill);
+	}
+
+	mem_pool__put(&p9dev->pdus, pdu);
 }
 
 static int virtio_p9_decode(struct p9_pdu *pdu, const char *fmt, va_list ap)
@@ -103,12 +137,14 @@ static int virtio_p9_decode(struct p9_pdu *pdu, const char *fmt, va_list ap)
 		break;
 		case 's':
 		{
-			int16_t len;
+			uint16_t len;
 			char **str = va_arg(ap, char **);
 
-			virtio_p9_pdu_readf(pdu, "w", &len);
-			*str = malloc(len + 1);
+			virtio_p9_pdu_read(pdu, &len, sizeof(len));
+			len = le16toh(len);
+			*str = virtio_p9_pdu_str(pdu, len);
 			if (*str == NULL) {
+				virtio_p9_pdu_skip(pdu, len);
 				retval = ENOMEM;
 				break;
 			}
@@ -119,9 +155,14 @@ static int virtio_p9_decode(struct p9_pdu *pdu, const char *fmt, va_list ap)
 		case 'Q':
 		{
 			struct p9_qid *qid = va_arg(ap, struct p9_qid *);
-			retval = virtio_p9_pdu_readf(pdu, "bdq",
-						     &qid->type, &qid->version,
-						     &qid->path);
+			uint32_t version;
+			uint64_t path;
+
+			virtio_p9_pdu_read(pdu, &qid->type, sizeof(qid->type));
+			virtio_p9_pdu_read(pdu, &version, sizeof(version));
+			virtio_p9_pdu_read(pdu, &path, sizeof(path));
+			qid->version = le32toh(version);
+			qid->path = le64toh(path);
 		}
 		break;
 		case 'S':
@@ -138,8 +179,6 @@ static int virtio_p9_decode(struct p9_pdu *pdu, const char *fmt, va_list ap)
 						&stbuf->mtime, &stbuf->length,
 						&stbuf->name, &stbuf->uid,
 						&stbuf->gid, &stbuf->muid);
-			if (retval)
-				virtio_p9_wstat_free(stbuf);
 		}
 		break;
 		case 'I':
@@ -204,16 +243,20 @@ static int virtio_p9_pdu_encode(struct p9_pdu *pdu, const char *fmt, va_list ap)
 			const char *s = va_arg(ap, char *);
 			if (s)
 				len = MIN(strlen(s), USHRT_MAX);
-			virtio_p9_pdu_writef(pdu, "w", len);
-			virtio_p9_pdu_write(pdu, s, len);
+			len = htole16(len);
+			virtio_p9_pdu_write(pdu, &len, sizeof(len));
+			virtio_p9_pdu_write(pdu, s, le16toh(len));
 		}
 		break;
 		case 'Q':
 		{
 			struct p9_qid *qid = va_arg(ap, struct p9_qid *);
-			retval = virtio_p9_pdu_writef(pdu, "bdq",
-						      qid->type, qid->version,
-						      qid->path);
+			uint32_t version = htole32(qid->version);
+			uint64_t path = htole64(qid->path);
+
+			virtio_p9_pdu_write(pdu, &qid->type, sizeof(qid->type));
+			virtio_p9_pdu_write(pdu, &version, sizeof(version));
+			virtio_p9_pdu_write(pdu, &path, sizeof(path));
 		}
 		break;
 		case 'S':
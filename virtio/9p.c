@@ -4,8 +4,11 @@
 #include "kvm/threadpool.h"
 #include "kvm/irq.h"
 #include "kvm/virtio-9p.h"
+#include "kvm/iovec.h"
 #include "kvm/guest_compat.h"
 #include "kvm/builtin-setup.h"
+#include "kvm/snapshot.h"
+#include "kvm/probe.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,11 +28,10 @@ static LIST_HEAD(devs);
 static int compat_id = -1;
 
 static int insert_new_fid(struct p9_dev *dev, struct p9_fid *fid);
-static struct p9_fid *find_or_create_fid(struct p9_dev *dev, u32 fid)
+
+static struct p9_fid *find_fid(struct p9_dev *dev, u32 fid)
 {
 	struct rb_node *node = dev->fids.rb_node;
-	struct p9_fid *pfid = NULL;
-	size_t len;
 
 	while (node) {
 		struct p9_fid *cur = rb_entry(node, struct p9_fid, node);
@@ -43,17 +45,40 @@ static struct p9_fid *find_or_create_fid(struct p9_dev *dev, u32 fid)
 		}
 	}
 
-	pfid = calloc(sizeof(*pfid), 1);
-	if (!pfid)
-		return NULL;
+	return NULL;
+}
+
+/* Each walk makes a fid, with room for a path, that the next clunk drops */
+static struct mem_pool fid_pool = MEM_POOL_INITIALIZER(sizeof(struct p9_fid),
+						       VIRTQUEUE_NUM);
+
+/* Called with fids_lock held */
+static struct p9_fid *find_or_create_fid(struct p9_dev *dev, u32 fid)
+{
+	struct p9_fid *pfid;
+	size_t len;
+
+	pfid = find_fid(dev, fid);
+	if (pfid)
+		return pfid;
 
 	len = strlen(dev->root_dir);
-	if (len >= sizeof(pfid->abs_path)) {
-		free(pfid);
+	if (len >= sizeof(pfid->abs_path))
+		return NULL;
+
+	pfid = mem_pool__get(&fid_pool);
+	if (!pfid)
 		return NULL;
-	}
 
-	pfid->fid = fid;
+	/* Not the path, which is about to be written over */
+	pfid->fid	= fid;
+	pfid->uid	= 0;
+	pfid->dir	= NULL;
+	pfid->fd	= 0;
+	pfid->refs	= 1;
+	pfid->dents	= NULL;
+	pfid->dents_len	= 0;
+	mutex_init(&pfid->dir_lock);
 	strcpy(pfid->abs_path, dev->root_dir);
 	pfid->path = pfid->abs_path + strlen(pfid->abs_path);
 
@@ -83,15 +108,47 @@ static int insert_new_fid(struct p9_dev *dev, struct p9_fid *fid)
 	return 0;
 }
 
-static struct p9_fid *get_fid(struct p9_dev *p9dev, int fid)
+/*
+ * Requests run concurrently, so a fid clunked by one of them may still be in
+ * use by others. Each request holds a reference to the fids it looks up,
+ * dropped once it completes.
+ */
+static struct p9_fid *get_fid(struct p9_dev *p9dev, struct p9_pdu *pdu, int fid)
 {
 	struct p9_fid *new;
+	u8 i;
 
+	for (i = 0; i < pdu->nr_fids; i++) {
+		if (pdu->fids[i]->fid == (u32)fid)
+			return pdu->fids[i];
+	}
+
+	mutex_lock(&p9dev->fids_lock);
 	new = find_or_create_fid(p9dev, fid);
+	if (new && !WARN_ON(pdu->nr_fids == VIRTIO_9P_PDU_MAX_FIDS)) {
+		__atomic_add_fetch(&new->refs, 1, __ATOMIC_RELAXED);
+		pdu->fids[pdu->nr_fids++] = new;
+	}
+	mutex_unlock(&p9dev->fids_lock);
 
 	return new;
 }
 
+static void put_fid(struct p9_fid *pfid)
+{
+	if (__atomic_sub_fetch(&pfid->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	if (pfid->fd > 0)
+		close(pfid->fd);
+
+	if (pfid->dir)
+		closedir(pfid->dir);
+
+	free(pfid->dents);
+	mem_pool__put(&fid_pool, pfid);
+}
+
 static void stat2qid(struct stat *st, struct p9_qid *qid)
 {
 	*qid = (struct p9_qid) {
@@ -103,18 +160,22 @@ static void stat2qid(struct stat *st, struct p9_qid *qid)
 		qid->type	|= P9_QTDIR;
 }
 
-static void close_fid(struct p9_dev *p9dev, u32 fid)
+/* Called with fids_lock held */
+static void __close_fid(struct p9_dev *p9dev, struct p9_fid *pfid)
 {
-	struct p9_fid *pfid = get_fid(p9dev, fid);
-
-	if (pfid->fd > 0)
-		close(pfid->fd);
+	rb_erase(&pfid->node, &p9dev->fids);
+	put_fid(pfid);
+}
 
-	if (pfid->dir)
-		closedir(pfid->dir);
+static void close_fid(struct p9_dev *p9dev, u32 fid)
+{
+	struct p9_fid *pfid;
 
-	rb_erase(&pfid->node, &p9dev->fids);
-	free(pfid);
+	mutex_lock(&p9dev->fids_lock);
+	pfid = find_fid(p9dev, fid);
+	if (pfid)
+		__close_fid(p9dev, pfid);
+	mutex_unlock(&p9dev->fids_lock);
 }
 
 static void virtio_p9_set_reply_header(struct p9_pdu *pdu, u32 size)
@@ -129,22 +190,6 @@ static void virtio_p9_set_reply_header(struct p9_pdu *pdu, u32 size)
 	virtio_p9_pdu_writef(pdu, "dbw", size, cmd + 1, tag);
 }
 
-static u16 virtio_p9_update_iov_cnt(struct iovec iov[], u32 count, int iov_cnt)
-{
-	int i;
-	u32 total = 0;
-	for (i = 0; (i < iov_cnt) && (total < count); i++) {
-		if (total + iov[i].iov_len > count) {
-			/* we don't need this iov fully */
-			iov[i].iov_len -= ((total + iov[i].iov_len) - count);
-			i++;
-			break;
-		}
-		total += iov[i].iov_len;
-	}
-	return i;
-}
-
 static void virtio_p9_error_reply(struct p9_dev *p9dev,
 				  struct p9_pdu *pdu, int err, u32 *outlen)
 {
@@ -174,9 +219,11 @@ static void virtio_p9_version(struct p9_dev *p9dev,
 	char *version;
 	virtio_p9_pdu_readf(pdu, "ds", &msize, &version);
 	/*
-	 * reply with the same msize the client sent us
+	 * reply with the msize the client sent us, unless a message that size
+	 * wouldn't fit in a chain of pages as long as the queue
 	 * Error out if the request is not for 9P2000.L
 	 */
+	msize = min_t(u32, msize, VIRTIO_9P_MAX_MSIZE);
 	if (!strcmp(version, VIRTIO_9P_VERSION_DOTL))
 		virtio_p9_pdu_writef(pdu, "ds", msize, version);
 	else
@@ -184,7 +231,6 @@ static void virtio_p9_version(struct p9_dev *p9dev,
 
 	*outlen = pdu->write_offset;
 	virtio_p9_set_reply_header(pdu, *outlen);
-	free(version);
 	return;
 }
 
@@ -212,20 +258,20 @@ static int virtio_p9_openflags(int flags)
 	return flags;
 }
 
-static bool is_dir(struct p9_fid *fid)
+static bool is_dir(const char *path)
 {
 	struct stat st;
 
-	stat(fid->abs_path, &st);
+	stat(path, &st);
 
 	return S_ISDIR(st.st_mode);
 }
 
-static bool is_reg(struct p9_fid *fid)
+static bool is_reg(const char *path)
 {
 	struct stat st;
 
-	stat(fid->abs_path, &st);
+	stat(path, &st);
 
 	return S_ISREG(st.st_mode);
 }
@@ -277,7 +323,7 @@ static int stat_rel(struct p9_dev *p9dev, const char *path, struct stat *st)
 	if (get_full_path_helper(full_path, sizeof(full_path), p9dev->root_dir, path) != 0)
 		return -1;
 
-	if (lstat(full_path, st) != 0)
+	if (p9_overlay__lstat(p9dev, full_path, NULL, st) != 0)
 		return -1;
 
 	return 0;
@@ -290,23 +336,30 @@ static void virtio_p9_open(struct p9_dev *p9dev,
 	struct stat st;
 	struct p9_qid qid;
 	struct p9_fid *new_fid;
+	char path[PATH_MAX];
 
 
 	virtio_p9_pdu_readf(pdu, "dd", &fid, &flags);
-	new_fid = get_fid(p9dev, fid);
+	new_fid = get_fid(p9dev, pdu, fid);
 
-	if (lstat(new_fid->abs_path, &st) < 0)
+	/* Files of the lower directory of an overlay are only read there */
+	if (((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC)) &&
+	    p9_overlay__copy_up(p9dev, new_fid->abs_path) < 0)
+		goto err_out;
+
+	if (p9_overlay__lstat(p9dev, new_fid->abs_path, path, &st) < 0)
 		goto err_out;
 
 	stat2qid(&st, &qid);
 
-	if (is_dir(new_fid)) {
-		new_fid->dir = opendir(new_fid->abs_path);
+	if (is_dir(path)) {
+		new_fid->dir = opendir(path);
 		if (!new_fid->dir)
 			goto err_out;
-	} else if (is_reg(new_fid)) {
-		new_fid->fd  = open(new_fid->abs_path,
-				    virtio_p9_openflags(flags));
+		if (p9_overlay__opendir(p9dev, new_fid) < 0)
+			goto err_out;
+	} else if (is_reg(path)) {
+		new_fid->fd  = open(path, virtio_p9_openflags(flags));
 		if (new_fid->fd < 0)
 			goto err_out;
 	} else {
@@ -338,11 +391,14 @@ static void virtio_p9_create(struct p9_dev *p9dev,
 
 	virtio_p9_pdu_readf(pdu, "dsddd", &dfid_val,
 			    &name, &flags, &mode, &gid);
-	dfid = get_fid(p9dev, dfid_val);
+	dfid = get_fid(p9dev, pdu, dfid_val);
 
 	if (get_full_path(full_path, sizeof(full_path), dfid, name) != 0)
 		goto err_out;
 
+	if (p9_overlay__create(p9dev, full_path) < 0)
+		goto err_out;
+
 	size = sizeof(dfid->abs_path) - (dfid->path - dfid->abs_path);
 
 	tmp_path = strdup(dfid->path);
@@ -365,6 +421,9 @@ static void virtio_p9_create(struct p9_dev *p9dev,
 		goto err_out;
 	dfid->fd = fd;
 
+	if (p9_overlay__created(p9dev, full_path) < 0)
+		goto err_out;
+
 	if (lstat(full_path, &st) < 0)
 		goto err_out;
 
@@ -376,10 +435,8 @@ static void virtio_p9_create(struct p9_dev *p9dev,
 	virtio_p9_pdu_writef(pdu, "Qd", &qid, 0);
 	*outlen = pdu->write_offset;
 	virtio_p9_set_reply_header(pdu, *outlen);
-	free(name);
 	return;
 err_out:
-	free(name);
 	virtio_p9_error_reply(p9dev, pdu, errno, outlen);
 	return;
 }
@@ -397,15 +454,21 @@ static void virtio_p9_mkdir(struct p9_dev *p9dev,
 
 	virtio_p9_pdu_readf(pdu, "dsdd", &dfid_val,
 			    &name, &mode, &gid);
-	dfid = get_fid(p9dev, dfid_val);
+	dfid = get_fid(p9dev, pdu, dfid_val);
 
 	if (get_full_path(full_path, sizeof(full_path), dfid, name) != 0)
 		goto err_out;
 
+	if (p9_overlay__create(p9dev, full_path) < 0)
+		goto err_out;
+
 	ret = mkdir(full_path, mode);
 	if (ret < 0)
 		goto err_out;
 
+	if (p9_overlay__created(p9dev, full_path) < 0)
+		goto err_out;
+
 	if (lstat(full_path, &st) < 0)
 		goto err_out;
 
@@ -417,10 +480,8 @@ static void virtio_p9_mkdir(struct p9_dev *p9dev,
 	virtio_p9_pdu_writef(pdu, "Qd", &qid, 0);
 	*outlen = pdu->write_offset;
 	virtio_p9_set_reply_header(pdu, *outlen);
-	free(name);
 	return;
 err_out:
-	free(name);
 	virtio_p9_error_reply(p9dev, pdu, errno, outlen);
 	return;
 }
@@ -450,11 +511,11 @@ static void virtio_p9_walk(struct p9_dev *p9dev,
 
 
 	virtio_p9_pdu_readf(pdu, "ddw", &fid_val, &newfid_val, &nwname);
-	new_fid	= get_fid(p9dev, newfid_val);
+	new_fid	= get_fid(p9dev, pdu, newfid_val);
 
 	nwqid = 0;
 	if (nwname) {
-		struct p9_fid *fid = get_fid(p9dev, fid_val);
+		struct p9_fid *fid = get_fid(p9dev, pdu, fid_val);
 
 		if (join_path(new_fid, fid->path) != 0) {
 			errno = ENAMETOOLONG;
@@ -470,6 +531,10 @@ static void virtio_p9_walk(struct p9_dev *p9dev,
 			int ret;
 
 			virtio_p9_pdu_readf(pdu, "s", &str);
+			if (p9_overlay__hidden(p9dev, str)) {
+				errno = ENOENT;
+				goto err_out;
+			}
 
 			/* Format the new path we're 'walk'ing into */
 			ret = snprintf(tmp, sizeof(tmp), "%s/%s", new_fid->path, str);
@@ -478,7 +543,6 @@ static void virtio_p9_walk(struct p9_dev *p9dev,
 				goto err_out;
 			}
 
-			free(str);
 
 			if (stat_rel(p9dev, tmp, &st) != 0)
 				goto err_out;
@@ -497,7 +561,7 @@ static void virtio_p9_walk(struct p9_dev *p9dev,
 		 * update write_offset so our outlen get correct value
 		 */
 		pdu->write_offset += sizeof(u16);
-		old_fid = get_fid(p9dev, fid_val);
+		old_fid = get_fid(p9dev, pdu, fid_val);
 		if (join_path(new_fid, old_fid->path) != 0) {
 			errno = ENAMETOOLONG;
 			goto err_out;
@@ -527,15 +591,13 @@ static void virtio_p9_attach(struct p9_dev *p9dev,
 	virtio_p9_pdu_readf(pdu, "ddssd", &fid_val, &afid,
 			    &uname, &aname, &uid);
 
-	free(uname);
-	free(aname);
 
-	if (lstat(p9dev->root_dir, &st) < 0)
+	if (p9_cache__lstat(p9dev->attr_cache, p9dev->root_dir, &st) < 0)
 		goto err_out;
 
 	stat2qid(&st, &qid);
 
-	fid = get_fid(p9dev, fid_val);
+	fid = get_fid(p9dev, pdu, fid_val);
 	fid->uid = uid;
 	if (join_path(fid, "/") != 0) {
 		errno = ENAMETOOLONG;
@@ -579,106 +641,116 @@ static void virtio_p9_read(struct p9_dev *p9dev,
 {
 	u64 offset;
 	u32 fid_val;
-	u16 iov_cnt;
-	void *iov_base;
-	size_t iov_len;
-	u32 count, rcount;
+	u32 count;
+	ssize_t rcount;
 	struct p9_fid *fid;
+	struct iovec iov[VIRTQUEUE_NUM];
+	int iov_cnt;
 
-
-	rcount = 0;
 	virtio_p9_pdu_readf(pdu, "dqd", &fid_val, &offset, &count);
-	fid = get_fid(p9dev, fid_val);
-
-	iov_base = pdu->in_iov[0].iov_base;
-	iov_len  = pdu->in_iov[0].iov_len;
-	iov_cnt  = pdu->in_iov_cnt;
-	pdu->in_iov[0].iov_base += VIRTIO_9P_HDR_LEN + sizeof(u32);
-	pdu->in_iov[0].iov_len -= VIRTIO_9P_HDR_LEN + sizeof(u32);
-	pdu->in_iov_cnt = virtio_p9_update_iov_cnt(pdu->in_iov,
-						   count,
-						   pdu->in_iov_cnt);
-	rcount = preadv(fid->fd, pdu->in_iov,
-			pdu->in_iov_cnt, offset);
-	if (rcount > count)
-		rcount = count;
-	/*
-	 * Update the iov_base back, so that rest of
-	 * pdu_writef works correctly.
-	 */
-	pdu->in_iov[0].iov_base = iov_base;
-	pdu->in_iov[0].iov_len  = iov_len;
-	pdu->in_iov_cnt         = iov_cnt;
+	fid = get_fid(p9dev, pdu, fid_val);
+
+	iov_cnt = iovec_window(iov, pdu->in_iov, pdu->in_iov_cnt,
+				       VIRTIO_9P_HDR_LEN + sizeof(u32), count);
+	rcount = preadv(fid->fd, iov, iov_cnt, offset);
+	if (rcount < 0)
+		goto err_out;
 
 	pdu->write_offset = VIRTIO_9P_HDR_LEN;
 	virtio_p9_pdu_writef(pdu, "d", rcount);
 	*outlen = pdu->write_offset + rcount;
 	virtio_p9_set_reply_header(pdu, *outlen);
 	return;
+err_out:
+	virtio_p9_error_reply(p9dev, pdu, errno, outlen);
 }
 
-static int virtio_p9_dentry_size(struct dirent *dent)
+static int virtio_p9_dentry_size(const char *name)
 {
 	/*
 	 * Size of each dirent:
 	 * qid(13) + offset(8) + type(1) + name_len(2) + name
 	 */
-	return 24 + strlen(dent->d_name);
+	return 24 + strlen(name);
 }
 
+/*
+ * Entries are read with getdents64() in batches, and the qids come from the
+ * inode numbers and types it returns rather than from a stat() of each of
+ * them. The guest passes back the offset of the last entry it got.
+ */
 static void virtio_p9_readdir(struct p9_dev *p9dev,
 			      struct p9_pdu *pdu, u32 *outlen)
 {
+	char buf[VIRTIO_9P_DIRENT_BATCH] __attribute__((aligned(8)));
 	u32 fid_val;
 	u32 count, rcount;
-	struct stat st;
 	struct p9_fid *fid;
-	struct dirent *dent;
-	u64 offset, old_offset;
+	struct dirent64 *dent;
+	ssize_t len, pos;
+	u64 offset;
+	bool full = false;
+	int fd;
 
 	rcount = 0;
 	virtio_p9_pdu_readf(pdu, "dqd", &fid_val, &offset, &count);
-	fid = get_fid(p9dev, fid_val);
+	fid = get_fid(p9dev, pdu, fid_val);
 
-	if (!is_dir(fid)) {
+	if (!fid->dir) {
 		errno = EINVAL;
 		goto err_out;
 	}
 
-	/* Move the offset specified */
-	seekdir(fid->dir, offset);
+	fd = dirfd(fid->dir);
+	mutex_lock(&fid->dir_lock);
 
-	old_offset = offset;
-	/* If reading a dir, fill the buffer with p9_stat entries */
-	dent = readdir(fid->dir);
+	/* Move the offset specified */
+	if (!fid->dents && lseek(fd, offset, SEEK_SET) < 0)
+		goto err_unlock;
 
 	/* Skip the space for writing count */
 	pdu->write_offset += sizeof(u32);
-	while (dent) {
-		u32 read;
-		struct p9_qid qid;
-
-		if ((rcount + virtio_p9_dentry_size(dent)) > count) {
-			/* seek to the previous offset and return */
-			seekdir(fid->dir, old_offset);
+	while (!full) {
+		if (fid->dents)
+			len = p9_overlay__getdents(fid, &offset, buf, sizeof(buf));
+		else
+			len = getdents64(fd, buf, sizeof(buf));
+		if (len < 0)
+			goto err_unlock;
+		if (!len)
 			break;
+
+		for (pos = 0; pos < len; pos += dent->d_reclen) {
+			struct p9_qid qid = {};
+			u32 read;
+
+			dent = (struct dirent64 *)(buf + pos);
+			if ((rcount + virtio_p9_dentry_size(dent->d_name)) > count) {
+				/* The guest asks for the rest at d_off */
+				full = true;
+				break;
+			}
+
+			qid.path = dent->d_ino;
+			if (dent->d_type == DT_DIR)
+				qid.type = P9_QTDIR;
+
+			read = pdu->write_offset;
+			virtio_p9_pdu_writef(pdu, "Qqbs", &qid, dent->d_off,
+					     dent->d_type, dent->d_name);
+			rcount += pdu->write_offset - read;
 		}
-		old_offset = dent->d_off;
-		if (stat_rel(p9dev, dent->d_name, &st) != 0)
-			memset(&st, -1, sizeof(st));
-		stat2qid(&st, &qid);
-		read = pdu->write_offset;
-		virtio_p9_pdu_writef(pdu, "Qqbs", &qid, dent->d_off,
-				     dent->d_type, dent->d_name);
-		rcount += pdu->write_offset - read;
-		dent = readdir(fid->dir);
 	}
 
+	mutex_unlock(&fid->dir_lock);
+
 	pdu->write_offset = VIRTIO_9P_HDR_LEN;
 	virtio_p9_pdu_writef(pdu, "d", rcount);
 	*outlen = pdu->write_offset + rcount;
 	virtio_p9_set_reply_header(pdu, *outlen);
 	return;
+err_unlock:
+	mutex_unlock(&fid->dir_lock);
 err_out:
 	virtio_p9_error_reply(p9dev, pdu, errno, outlen);
 	return;
@@ -695,8 +767,8 @@ static void virtio_p9_getattr(struct p9_dev *p9dev,
 	struct p9_stat_dotl statl;
 
 	virtio_p9_pdu_readf(pdu, "dq", &fid_val, &request_mask);
-	fid = get_fid(p9dev, fid_val);
-	if (lstat(fid->abs_path, &st) < 0)
+	fid = get_fid(p9dev, pdu, fid_val);
+	if (p9_overlay__lstat(p9dev, fid->abs_path, NULL, &st) < 0)
 		goto err_out;
 
 	virtio_p9_fill_stat(p9dev, &st, &statl);
@@ -743,7 +815,10 @@ static void virtio_p9_setattr(struct p9_dev *p9dev,
 	struct p9_iattr_dotl p9attr;
 
 	virtio_p9_pdu_readf(pdu, "dI", &fid_val, &p9attr);
-	fid = get_fid(p9dev, fid_val);
+	fid = get_fid(p9dev, pdu, fid_val);
+
+	if (p9_overlay__copy_up(p9dev, fid->abs_path) < 0)
+		goto err_out;
 
 	if (p9attr.valid & ATTR_MODE) {
 		ret = chmod(fid->abs_path, p9attr.mode);
@@ -815,34 +890,17 @@ static void virtio_p9_write(struct p9_dev *p9dev,
 	u32 fid_val;
 	u32 count;
 	ssize_t res;
-	u16 iov_cnt;
-	void *iov_base;
-	size_t iov_len;
 	struct p9_fid *fid;
-	/* u32 fid + u64 offset + u32 count */
-	int twrite_size = sizeof(u32) + sizeof(u64) + sizeof(u32);
+	struct iovec iov[VIRTQUEUE_NUM];
+	int iov_cnt;
 
 	virtio_p9_pdu_readf(pdu, "dqd", &fid_val, &offset, &count);
-	fid = get_fid(p9dev, fid_val);
-
-	iov_base = pdu->out_iov[0].iov_base;
-	iov_len  = pdu->out_iov[0].iov_len;
-	iov_cnt  = pdu->out_iov_cnt;
-
-	/* Adjust the iovec to skip the header and meta data */
-	pdu->out_iov[0].iov_base += (sizeof(struct p9_msg) + twrite_size);
-	pdu->out_iov[0].iov_len -=  (sizeof(struct p9_msg) + twrite_size);
-	pdu->out_iov_cnt = virtio_p9_update_iov_cnt(pdu->out_iov, count,
-						    pdu->out_iov_cnt);
-	res = pwritev(fid->fd, pdu->out_iov, pdu->out_iov_cnt, offset);
-	/*
-	 * Update the iov_base back, so that rest of
-	 * pdu_readf works correctly.
-	 */
-	pdu->out_iov[0].iov_base = iov_base;
-	pdu->out_iov[0].iov_len  = iov_len;
-	pdu->out_iov_cnt         = iov_cnt;
+	fid = get_fid(p9dev, pdu, fid_val);
 
+	/* The data follows the header and the fid, offset and count */
+	iov_cnt = iovec_window(iov, pdu->out_iov, pdu->out_iov_cnt,
+				       pdu->read_offset, count);
+	res = pwritev(fid->fd, iov, iov_cnt, offset);
 	if (res < 0)
 		goto err_out;
 	virtio_p9_pdu_writef(pdu, "d", res);
@@ -862,9 +920,9 @@ static void virtio_p9_remove(struct p9_dev *p9dev,
 	struct p9_fid *fid;
 
 	virtio_p9_pdu_readf(pdu, "d", &fid_val);
-	fid = get_fid(p9dev, fid_val);
+	fid = get_fid(p9dev, pdu, fid_val);
 
-	ret = remove(fid->abs_path);
+	ret = p9_overlay__remove(p9dev, fid->abs_path);
 	if (ret < 0)
 		goto err_out;
 	*outlen = pdu->write_offset;
@@ -885,13 +943,13 @@ static void virtio_p9_rename(struct p9_dev *p9dev,
 	char full_path[PATH_MAX], *new_name;
 
 	virtio_p9_pdu_readf(pdu, "dds", &fid_val, &new_fid_val, &new_name);
-	fid = get_fid(p9dev, fid_val);
-	new_fid = get_fid(p9dev, new_fid_val);
+	fid = get_fid(p9dev, pdu, fid_val);
+	new_fid = get_fid(p9dev, pdu, new_fid_val);
 
 	if (get_full_path(full_path, sizeof(full_path), new_fid, new_name) != 0)
 		goto err_out;
 
-	ret = rename(fid->abs_path, full_path);
+	ret = p9_overlay__rename(p9dev, fid->abs_path, full_path);
 	if (ret < 0)
 		goto err_out;
 	*outlen = pdu->write_offset;
@@ -908,14 +966,19 @@ static void virtio_p9_readlink(struct p9_dev *p9dev,
 {
 	int ret;
 	u32 fid_val;
+	struct stat st;
 	struct p9_fid *fid;
+	char path[PATH_MAX];
 	char target_path[PATH_MAX];
 
 	virtio_p9_pdu_readf(pdu, "d", &fid_val);
-	fid = get_fid(p9dev, fid_val);
+	fid = get_fid(p9dev, pdu, fid_val);
+
+	if (p9_overlay__lstat(p9dev, fid->abs_path, path, &st) < 0)
+		goto err_out;
 
 	memset(target_path, 0, PATH_MAX);
-	ret = readlink(fid->abs_path, target_path, PATH_MAX - 1);
+	ret = readlink(path, target_path, PATH_MAX - 1);
 	if (ret < 0)
 		goto err_out;
 
@@ -938,9 +1001,11 @@ static void virtio_p9_statfs(struct p9_dev *p9dev,
 	struct statfs stat_buf;
 
 	virtio_p9_pdu_readf(pdu, "d", &fid_val);
-	fid = get_fid(p9dev, fid_val);
+	fid = get_fid(p9dev, pdu, fid_val);
 
-	ret = statfs(fid->abs_path, &stat_buf);
+	/* The files of an overlay are written to the upper directory */
+	ret = statfs(p9dev->overlay ? p9dev->root_dir : fid->abs_path,
+		     &stat_buf);
 	if (ret < 0)
 		goto err_out;
 	/* FIXME!! f_blocks needs update based on client msize */
@@ -973,15 +1038,21 @@ static void virtio_p9_mknod(struct p9_dev *p9dev,
 	virtio_p9_pdu_readf(pdu, "dsdddd", &fid_val, &name, &mode,
 			    &major, &minor, &gid);
 
-	dfid = get_fid(p9dev, fid_val);
+	dfid = get_fid(p9dev, pdu, fid_val);
 
 	if (get_full_path(full_path, sizeof(full_path), dfid, name) != 0)
 		goto err_out;
 
+	if (p9_overlay__create(p9dev, full_path) < 0)
+		goto err_out;
+
 	ret = mknod(full_path, mode, makedev(major, minor));
 	if (ret < 0)
 		goto err_out;
 
+	if (p9_overlay__created(p9dev, full_path) < 0)
+		goto err_out;
+
 	if (lstat(full_path, &st) < 0)
 		goto err_out;
 
@@ -991,12 +1062,10 @@ static void virtio_p9_mknod(struct p9_dev *p9dev,
 
 	stat2qid(&st, &qid);
 	virtio_p9_pdu_writef(pdu, "Q", &qid);
-	free(name);
 	*outlen = pdu->write_offset;
 	virtio_p9_set_reply_header(pdu, *outlen);
 	return;
 err_out:
-	free(name);
 	virtio_p9_error_reply(p9dev, pdu, errno, outlen);
 	return;
 }
@@ -1009,7 +1078,7 @@ static void virtio_p9_fsync(struct p9_dev *p9dev,
 	u32 fid_val, datasync;
 
 	virtio_p9_pdu_readf(pdu, "dd", &fid_val, &datasync);
-	fid = get_fid(p9dev, fid_val);
+	fid = get_fid(p9dev, pdu, fid_val);
 
 	if (fid->dir)
 		fd = dirfd(fid->dir);
@@ -1043,28 +1112,30 @@ static void virtio_p9_symlink(struct p9_dev *p9dev,
 
 	virtio_p9_pdu_readf(pdu, "dssd", &fid_val, &name, &old_path, &gid);
 
-	dfid = get_fid(p9dev, fid_val);
+	dfid = get_fid(p9dev, pdu, fid_val);
 
 	if (get_full_path(new_name, sizeof(new_name), dfid, name) != 0)
 		goto err_out;
 
+	if (p9_overlay__create(p9dev, new_name) < 0)
+		goto err_out;
+
 	ret = symlink(old_path, new_name);
 	if (ret < 0)
 		goto err_out;
 
+	if (p9_overlay__created(p9dev, new_name) < 0)
+		goto err_out;
+
 	if (lstat(new_name, &st) < 0)
 		goto err_out;
 
 	stat2qid(&st, &qid);
 	virtio_p9_pdu_writef(pdu, "Q", &qid);
-	free(name);
-	free(old_path);
 	*outlen = pdu->write_offset;
 	virtio_p9_set_reply_header(pdu, *outlen);
 	return;
 err_out:
-	free(name);
-	free(old_path);
 	virtio_p9_error_reply(p9dev, pdu, errno, outlen);
 	return;
 }
@@ -1080,21 +1151,26 @@ static void virtio_p9_link(struct p9_dev *p9dev,
 
 	virtio_p9_pdu_readf(pdu, "dds", &dfid_val, &fid_val, &name);
 
-	dfid = get_fid(p9dev, dfid_val);
-	fid =  get_fid(p9dev, fid_val);
+	dfid = get_fid(p9dev, pdu, dfid_val);
+	fid =  get_fid(p9dev, pdu, fid_val);
 
 	if (get_full_path(full_path, sizeof(full_path), dfid, name) != 0)
 		goto err_out;
 
+	if (p9_overlay__copy_up(p9dev, fid->abs_path) < 0 ||
+	    p9_overlay__create(p9dev, full_path) < 0)
+		goto err_out;
+
 	ret = link(fid->abs_path, full_path);
 	if (ret < 0)
 		goto err_out;
-	free(name);
+
+	if (p9_overlay__created(p9dev, full_path) < 0)
+		goto err_out;
 	*outlen = pdu->write_offset;
 	virtio_p9_set_reply_header(pdu, *outlen);
 	return;
 err_out:
-	free(name);
 	virtio_p9_error_reply(p9dev, pdu, errno, outlen);
 	return;
 
@@ -1116,7 +1192,6 @@ static void virtio_p9_lock(struct p9_dev *p9dev,
 	virtio_p9_pdu_writef(pdu, "d", ret);
 	*outlen = pdu->write_offset;
 	virtio_p9_set_reply_header(pdu, *outlen);
-	free(flock.client_id);
 	return;
 }
 
@@ -1136,7 +1211,6 @@ static void virtio_p9_getlock(struct p9_dev *p9dev,
 			     glock.client_id);
 	*outlen = pdu->write_offset;
 	virtio_p9_set_reply_header(pdu, *outlen);
-	free(glock.client_id);
 	return;
 }
 
@@ -1202,8 +1276,8 @@ static void virtio_p9_renameat(struct p9_dev *p9dev,
 	virtio_p9_pdu_readf(pdu, "dsds", &old_dfid_val, &old_name,
 			    &new_dfid_val, &new_name);
 
-	old_dfid = get_fid(p9dev, old_dfid_val);
-	new_dfid = get_fid(p9dev, new_dfid_val);
+	old_dfid = get_fid(p9dev, pdu, old_dfid_val);
+	new_dfid = get_fid(p9dev, pdu, new_dfid_val);
 
 	if (get_full_path(old_full_path, sizeof(old_full_path), old_dfid, old_name) != 0)
 		goto err_out;
@@ -1211,7 +1285,7 @@ static void virtio_p9_renameat(struct p9_dev *p9dev,
 	if (get_full_path(new_full_path, sizeof(new_full_path), new_dfid, new_name) != 0)
 		goto err_out;
 
-	ret = rename(old_full_path, new_full_path);
+	ret = p9_overlay__rename(p9dev, old_full_path, new_full_path);
 	if (ret < 0)
 		goto err_out;
 	/*
@@ -1219,14 +1293,10 @@ static void virtio_p9_renameat(struct p9_dev *p9dev,
 	 * that.
 	 */
 	rename_fids(p9dev, old_name, new_name);
-	free(old_name);
-	free(new_name);
 	*outlen = pdu->write_offset;
 	virtio_p9_set_reply_header(pdu, *outlen);
 	return;
 err_out:
-	free(old_name);
-	free(new_name);
 	virtio_p9_error_reply(p9dev, pdu, errno, outlen);
 	return;
 }
@@ -1241,20 +1311,18 @@ static void virtio_p9_unlinkat(struct p9_dev *p9dev,
 	char full_path[PATH_MAX];
 
 	virtio_p9_pdu_readf(pdu, "dsd", &fid_val, &name, &flags);
-	fid = get_fid(p9dev, fid_val);
+	fid = get_fid(p9dev, pdu, fid_val);
 
 	if (get_full_path(full_path, sizeof(full_path), fid, name) != 0)
 		goto err_out;
 
-	ret = remove(full_path);
+	ret = p9_overlay__remove(p9dev, full_path);
 	if (ret < 0)
 		goto err_out;
-	free(name);
 	*outlen = pdu->write_offset;
 	virtio_p9_set_reply_header(pdu, *outlen);
 	return;
 err_out:
-	free(name);
 	virtio_p9_error_reply(p9dev, pdu, errno, outlen);
 	return;
 }
@@ -1315,15 +1383,23 @@ static p9_handler *virtio_9p_dotl_handler [] = {
 	[P9_TRENAME]      = virtio_p9_rename,
 };
 
-static struct p9_pdu *virtio_p9_pdu_init(struct kvm *kvm, struct virt_queue *vq)
+static struct p9_pdu *virtio_p9_pdu_init(struct kvm *kvm, struct p9_dev *p9dev,
+					 struct virt_queue *vq)
 {
-	struct p9_pdu *pdu = calloc(1, sizeof(*pdu));
+	/* Don't bother clearing the iovecs, they are large */
+	struct p9_pdu *pdu = mem_pool__get(&p9dev->pdus);
 	if (!pdu)
 		return NULL;
 
 	/* skip the pdu header p9_msg */
+	pdu->vq			= vq;
+	pdu->nr_fids		= 0;
 	pdu->read_offset	= VIRTIO_9P_HDR_LEN;
 	pdu->write_offset	= VIRTIO_9P_HDR_LEN;
+	pdu->read_cur_offset	= SIZE_MAX;
+	pdu->write_cur_offset	= SIZE_MAX;
+	pdu->strings_len	= 0;
+	pdu->spill		= NULL;
 	pdu->queue_head		= virt_queue__get_inout_iov(kvm, vq, pdu->in_iov,
 					pdu->out_iov, &pdu->in_iov_cnt, &pdu->out_iov_cnt);
 	return pdu;
@@ -1340,20 +1416,44 @@ static u8 virtio_p9_get_cmd(struct p9_pdu *pdu)
 	return msg->cmd;
 }
 
-static bool virtio_p9_do_io_request(struct kvm *kvm, struct p9_dev_job *job)
+/*
+ * Drop the cached attributes that a request may have changed. The fids of
+ * requests that add, remove or rename entries are directories, or entries
+ * that moved, so everything below them goes as well.
+ */
+static void virtio_p9_invalidate(struct p9_dev *p9dev, u8 cmd,
+				 struct p9_fid *fid)
+{
+	switch (cmd) {
+	case P9_TWRITE:
+	case P9_TSETATTR:
+	case P9_TLOPEN:
+		p9_cache__invalidate(p9dev->attr_cache, fid->abs_path, false);
+		break;
+	case P9_TLCREATE:
+	case P9_TMKDIR:
+	case P9_TSYMLINK:
+	case P9_TMKNOD:
+	case P9_TLINK:
+	case P9_TRENAME:
+	case P9_TRENAMEAT:
+	case P9_TUNLINKAT:
+	case P9_TREMOVE:
+		p9_cache__invalidate(p9dev->attr_cache, fid->abs_path, true);
+		break;
+	}
+}
+
+static void virtio_p9_do_io_request(struct kvm *kvm, struct p9_dev *p9dev,
+				    struct p9_pdu *p9pdu)
 {
 	u8 cmd;
 	u32 len = 0;
 	p9_handler *handler;
-	struct p9_dev *p9dev;
-	struct virt_queue *vq;
-	struct p9_pdu *p9pdu;
-
-	vq = job->vq;
-	p9dev = job->p9dev;
+	u8 i;
 
-	p9pdu = virtio_p9_pdu_init(kvm, vq);
 	cmd = virtio_p9_get_cmd(p9pdu);
+	kvm__probe(p9_request, p9dev, cmd, p9pdu->queue_head);
 
 	if ((cmd >= ARRAY_SIZE(virtio_9p_dotl_handler)) ||
 	    !virtio_9p_dotl_handler[cmd])
@@ -1362,21 +1462,100 @@ static bool virtio_p9_do_io_request(struct kvm *kvm, struct p9_dev_job *job)
 		handler = virtio_9p_dotl_handler[cmd];
 
 	handler(p9dev, p9pdu, &len);
-	virt_queue__set_used_elem(vq, p9pdu->queue_head, len);
-	free(p9pdu);
-	return true;
+
+	for (i = 0; i < p9pdu->nr_fids; i++) {
+		virtio_p9_invalidate(p9dev, cmd, p9pdu->fids[i]);
+		put_fid(p9pdu->fids[i]);
+	}
+
+	/* Completions are out of order, the guest matches them by head */
+	mutex_lock(&p9dev->used_lock);
+	virt_queue__set_used_elem(p9pdu->vq, p9pdu->queue_head, len);
+	mutex_unlock(&p9dev->used_lock);
+	kvm__probe(p9_done, p9dev, cmd, p9pdu->queue_head, len);
 }
 
+static struct p9_pdu *virtio_p9_next_request(struct p9_dev *p9dev)
+{
+	struct p9_pdu *pdu = NULL;
+
+	mutex_lock(&p9dev->reqs_lock);
+	if (!list_empty(&p9dev->reqs)) {
+		pdu = list_first_entry(&p9dev->reqs, struct p9_pdu, list);
+		list_del(&pdu->list);
+	}
+	mutex_unlock(&p9dev->reqs_lock);
+
+	return pdu;
+}
+
+static void virtio_p9_signal(struct kvm *kvm, struct p9_dev *p9dev,
+			     struct virt_queue *vq)
+{
+	bool signal;
+
+	mutex_lock(&p9dev->used_lock);
+	signal = virtio_queue__should_signal(vq);
+	mutex_unlock(&p9dev->used_lock);
+
+	if (signal)
+		p9dev->vdev.ops->signal_vq(kvm, &p9dev->vdev, vq - p9dev->vqs);
+}
+
+/* A worker handles queued requests until there are none left */
+static void virtio_p9_do_requests(struct kvm *kvm, void *param)
+{
+	struct p9_dev *p9dev = param;
+	struct virt_queue *vq = NULL;
+	struct p9_pdu *pdu;
+
+	while ((pdu = virtio_p9_next_request(p9dev))) {
+		if (vq && vq != pdu->vq)
+			virtio_p9_signal(kvm, p9dev, vq);
+		vq = pdu->vq;
+
+		virtio_p9_do_io_request(kvm, p9dev, pdu);
+		virtio_p9_pdu_free(p9dev, pdu);
+	}
+
+	if (vq)
+		virtio_p9_signal(kvm, p9dev, vq);
+}
+
+/*
+ * Requests such as a walk and a read of another file don't depend on each
+ * other, so the job of the queue only pops them and lets the workers of the
+ * device handle them in parallel.
+ */
 static void virtio_p9_do_io(struct kvm *kvm, void *param)
 {
 	struct p9_dev_job *job = (struct p9_dev_job *)param;
 	struct p9_dev *p9dev   = job->p9dev;
 	struct virt_queue *vq  = job->vq;
+	struct p9_pdu *pdu;
+	LIST_HEAD(reqs);
+	unsigned int nr = 0, i;
+
+	do {
+		virt_queue__disable_notify(vq);
+		while (virt_queue__available(vq)) {
+			pdu = virtio_p9_pdu_init(kvm, p9dev, vq);
+			if (!pdu)
+				break;
+			list_add_tail(&pdu->list, &reqs);
+			nr++;
+		}
+	} while (virt_queue__enable_notify(vq));
 
-	while (virt_queue__available(vq)) {
-		virtio_p9_do_io_request(kvm, job);
-		p9dev->vdev.ops->signal_vq(kvm, &p9dev->vdev, vq - p9dev->vqs);
-	}
+	if (!nr)
+		return;
+
+	mutex_lock(&p9dev->reqs_lock);
+	list_splice_tail(&reqs, &p9dev->reqs);
+	mutex_unlock(&p9dev->reqs_lock);
+
+	for (i = 0; i < min_t(unsigned int, nr, VIRTIO_9P_NR_WORKERS); i++)
+		thread_pool__do_job(&p9dev->workers[i]);
 }
 
 static u8 *get_config(struct kvm *kvm, void *dev)
@@ -1395,7 +1574,8 @@ static size_t get_config_size(struct kvm *kvm, void *dev)
 
 static u64 get_host_features(struct kvm *kvm, void *dev)
 {
-	return 1 << VIRTIO_9P_MOUNT_TAG;
+	return 1UL << VIRTIO_9P_MOUNT_TAG
+		| 1UL << VIRTIO_RING_F_INDIRECT_DESC;
 }
 
 static void notify_status(struct kvm *kvm, void *dev, u32 status)
@@ -1410,8 +1590,11 @@ static void notify_status(struct kvm *kvm, void *dev, u32 status)
 	if (!(status & VIRTIO__STATUS_STOP))
 		return;
 
+	mutex_lock(&p9dev->fids_lock);
 	rbtree_postorder_for_each_entry_safe(pfid, next, &p9dev->fids, node)
-		close_fid(p9dev, pfid->fid);
+		put_fid(pfid);
+	p9dev->fids = (struct rb_root)RB_ROOT;
+	mutex_unlock(&p9dev->fids_lock);
 }
 
 static int init_vq(struct kvm *kvm, void *dev, u32 vq)
@@ -1439,8 +1622,22 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct p9_dev *p9dev = dev;
+	struct p9_pdu *pdu, *tmp;
+	unsigned int i;
 
 	thread_pool__cancel_job(&p9dev->jobs[vq].job_id);
+	for (i = 0; i < VIRTIO_9P_NR_WORKERS; i++)
+		thread_pool__cancel_job(&p9dev->workers[i]);
+
+	/* Drop what the workers didn't get to */
+	mutex_lock(&p9dev->reqs_lock);
+	list_for_each_entry_safe(pdu, tmp, &p9dev->reqs, list) {
+		if (pdu->vq != &p9dev->vqs[vq])
+			continue;
+		list_del(&pdu->list);
+		virtio_p9_pdu_free(p9dev, pdu);
+	}
+	mutex_unlock(&p9dev->reqs_lock);
 }
 
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
@@ -1491,22 +1688,37 @@ struct virtio_ops p9_dev_virtio_ops = {
 
 int virtio_9p_rootdir_parser(const struct option *opt, const char *arg, int unset)
 {
-	char *tag_name;
-	char tmp[PATH_MAX];
+	char *tag_name, *lower = NULL, *next;
+	char tmp[PATH_MAX], lower_path[PATH_MAX];
 	struct kvm *kvm = opt->ptr;
 
 	/*
 	 * 9p dir can be of the form dirname,tag_name or
 	 * just dirname. In the later case we use the
-	 * default tag name
+	 * default tag name. A lower=dir option makes dirname
+	 * the upper directory of an overlay.
 	 */
 	tag_name = strstr(arg, ",");
 	if (tag_name) {
 		*tag_name = '\0';
 		tag_name++;
+		next = strstr(tag_name, ",");
+		if (next)
+			*next++ = '\0';
+		if (!strncmp(tag_name, "lower=", 6)) {
+			lower = tag_name + 6;
+			tag_name = next;
+		} else if (next && !strncmp(next, "lower=", 6)) {
+			lower = next + 6;
+		} else if (next) {
+			die("Invalid 9p option %s", next);
+		}
 	}
+	if (lower && !realpath(lower, lower_path))
+		die("Failed resolving 9p lower path");
 	if (realpath(arg, tmp)) {
-		if (virtio_9p__register(kvm, tmp, tag_name) < 0)
+		if (virtio_9p__register_overlay(kvm, tmp, lower ? lower_path : NULL,
+						tag_name) < 0)
 			die("Unable to initialize virtio 9p");
 	} else
 		die("Failed resolving 9p path");
@@ -1537,13 +1749,15 @@ int virtio_9p_img_name_parser(const struct option *opt, const char *arg, int uns
 
 	if (stat(path, &st) == 0 &&
 	    S_ISDIR(st.st_mode)) {
-		char tmp[PATH_MAX];
+		char tmp[PATH_MAX], lower[PATH_MAX];
+		bool overlay = kvm_setup_overlay_lower(arg, lower);
 
 		if (kvm->cfg.using_rootfs)
 			die("Please use only one rootfs directory atmost");
 
 		if (realpath(path, tmp) == 0 ||
-		    virtio_9p__register(kvm, tmp, "/dev/root") < 0)
+		    virtio_9p__register_overlay(kvm, tmp, overlay ? lower : NULL,
+						"/dev/root") < 0)
 			die("Unable to initialize virtio 9p");
 		if (virtio_9p__register(kvm, "/", "hostfs") < 0)
 			die("Unable to initialize virtio 9p");
@@ -1556,12 +1770,46 @@ int virtio_9p_img_name_parser(const struct option *opt, const char *arg, int uns
 	return -1;
 }
 
+int virtio_9p_cache_parser(const struct option *opt, const char *arg, int unset)
+{
+	struct kvm *kvm = opt->ptr;
+	char *end;
+
+	kvm->cfg.p9_cache = true;
+	if (!strcmp(arg, "loose")) {
+		kvm->cfg.p9_cache_loose = true;
+		return 0;
+	}
+
+	kvm->cfg.p9_cache_ttl_ms = strtoul(arg, &end, 10);
+	if (*end)
+		die("Invalid 9p cache TTL %s", arg);
+
+	return 0;
+}
+
 int virtio_9p__init(struct kvm *kvm)
 {
 	struct p9_dev *p9dev;
 	int r;
 
 	list_for_each_entry(p9dev, &devs, list) {
+		if (kvm->cfg.p9_cache) {
+			p9dev->attr_cache = p9_cache__new(kvm->cfg.p9_cache_ttl_ms,
+							  kvm->cfg.p9_cache_loose);
+			if (!p9dev->attr_cache)
+				return -ENOMEM;
+		}
+
+		if (p9dev->lower_dir[0]) {
+			p9dev->overlay = p9_overlay__new(p9dev->root_dir,
+							 p9dev->lower_dir);
+			if (!p9dev->overlay)
+				return -ENOMEM;
+		}
+
+		/* The fids of the guest are host files that snapshots don't keep */
+		snapshot__block("virtio-9p");
 		r = virtio_init(kvm, p9dev, &p9dev->vdev, &p9_dev_virtio_ops,
 				kvm->cfg.virtio_transport, PCI_DEVICE_ID_VIRTIO_9P,
 				VIRTIO_ID_9P, PCI_CLASS_9P);
@@ -1580,18 +1828,29 @@ int virtio_9p__exit(struct kvm *kvm)
 	list_for_each_entry_safe(p9dev, tmp, &devs, list) {
 		list_del(&p9dev->list);
 		virtio_exit(kvm, &p9dev->vdev);
+		p9_cache__free(p9dev->attr_cache);
+		p9_overlay__free(p9dev->overlay);
+		mem_pool__exit(&p9dev->pdus);
 		free(p9dev);
 	}
+	mem_pool__exit(&fid_pool);
 
 	return 0;
 }
 virtio_dev_exit(virtio_9p__exit);
 
 int virtio_9p__register(struct kvm *kvm, const char *root, const char *tag_name)
+{
+	return virtio_9p__register_overlay(kvm, root, NULL, tag_name);
+}
+
+int virtio_9p__register_overlay(struct kvm *kvm, const char *root,
+				const char *lower, const char *tag_name)
 {
 	struct p9_dev *p9dev;
 	size_t tag_length;
 	size_t config_size;
+	unsigned int i;
 	int err;
 
 	p9dev = calloc(1, sizeof(*p9dev));
@@ -1612,8 +1871,25 @@ int virtio_9p__register(struct kvm *kvm, const char *root, const char *tag_name)
 	}
 	p9dev->config_size = config_size;
 
+	mutex_init(&p9dev->fids_lock);
+	mutex_init(&p9dev->reqs_lock);
+	mutex_init(&p9dev->used_lock);
+	INIT_LIST_HEAD(&p9dev->reqs);
+	mem_pool__init(&p9dev->pdus, sizeof(struct p9_pdu),
+		       NUM_VIRT_QUEUES * VIRTQUEUE_NUM);
+	for (i = 0; i < VIRTIO_9P_NR_WORKERS; i++) {
+		thread_pool__init_job(&p9dev->workers[i], kvm,
+				      virtio_p9_do_requests, p9dev);
+		/* Spread them, rather than queueing all on the dispatcher's */
+		thread_pool__set_job_worker(&p9dev->workers[i], i);
+	}
+
 	strncpy(p9dev->root_dir, root, sizeof(p9dev->root_dir));
 	p9dev->root_dir[sizeof(p9dev->root_dir)-1] = '\x00';
+	if (lower) {
+		strncpy(p9dev->lower_dir, lower, sizeof(p9dev->lower_dir));
+		p9dev->lower_dir[sizeof(p9dev->lower_dir)-1] = '\x00';
+	}
 
 	p9dev->tag_len = tag_length;
 	if (p9dev->tag_len > MAX_TAG_LEN) {
@@ -9,6 +9,8 @@
 #include "kvm/threadpool.h"
 #include "kvm/guest_compat.h"
 #include "kvm/kvm-ipc.h"
+#include "kvm/mutex.h"
+#include "kvm/metrics.h"
 
 #include <linux/virtio_ring.h>
 #include <linux/virtio_balloon.h>
@@ -21,13 +23,26 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <pthread.h>
+#include <poll.h>
+#include <stdio.h>
 #include <sys/eventfd.h>
 
-#define NUM_VIRT_QUEUES		3
+#define NUM_VIRT_QUEUES		5
 #define VIRTIO_BLN_QUEUE_SIZE	128
 #define VIRTIO_BLN_INFLATE	0
 #define VIRTIO_BLN_DEFLATE	1
 #define VIRTIO_BLN_STATS	2
+#define VIRTIO_BLN_FREE_PAGE	3
+#define VIRTIO_BLN_REPORTING	4
+
+#define VIRTIO_BLN_MB_PAGES	(SZ_1M >> VIRTIO_BALLOON_PFN_SHIFT)
+#define VIRTIO_BLN_PAGE_SIZE	(1UL << VIRTIO_BALLOON_PFN_SHIFT)
+/* PFNs sorted at once, as many as Linux puts in a request */
+#define VIRTIO_BLN_MAX_PFNS	256
+/* How long to wait for the guest to update its stats */
+#define VIRTIO_BLN_STAT_TIMEOUT_MS	1000
+
+#define VIRTIO_BLN_PSI_PATH	"/proc/pressure/memory"
 
 struct bln_dev {
 	struct list_head	list;
@@ -42,6 +57,29 @@ struct bln_dev {
 	u32			cur_stat_head;
 	u16			stat_count;
 	int			stat_waitfd;
+	/* Serializes the stat requests, the guest holds cur_stat if pending */
+	struct mutex		stat_lock;
+	bool			stat_pending;
+
+	/* The --balloon-auto controller */
+	pthread_t		auto_thread;
+	int			auto_stopfd;
+	struct mutex		auto_lock;
+	struct virtio_bln_auto_stats auto_stats;
+
+	/* Free page hinting run, protected by hint_lock */
+	struct mutex		hint_lock;
+	u32			hint_cmd_id;
+	bool			hint_active;
+
+	/*
+	 * With RAM backed by pages larger than those of the balloon, the number
+	 * of balloon pages in each of these granules of RAM. A granule is only
+	 * dropped once all of it is in the balloon.
+	 */
+	u32			*granules;
+	u64			nr_granules;
+	unsigned int		granule_shift;
 
 	struct virtio_balloon_config config;
 };
@@ -49,30 +87,226 @@ struct bln_dev {
 static struct bln_dev bdev;
 static int compat_id = -1;
 
+static bool virtio_bln_has_vq(struct bln_dev *bdev, int vq)
+{
+	u64 features = bdev->vdev.features;
+
+	switch (vq) {
+	case VIRTIO_BLN_STATS:
+		return features & (1UL << VIRTIO_BALLOON_F_STATS_VQ);
+	case VIRTIO_BLN_FREE_PAGE:
+		return features & (1UL << VIRTIO_BALLOON_F_FREE_PAGE_HINT);
+	case VIRTIO_BLN_REPORTING:
+		return features & (1UL << VIRTIO_BALLOON_F_REPORTING);
+	default:
+		return true;
+	}
+}
+
+/*
+ * The driver only numbers the queues of the features it negotiated, so
+ * the queue numbers differ from the VIRTIO_BLN_* indices of bdev->vqs. The
+ * queues of the other features come last.
+ */
+static u32 virtio_bln_vq_of(struct bln_dev *bdev, u32 num)
+{
+	u32 vq, n = 0;
+
+	for (vq = 0; vq < NUM_VIRT_QUEUES; vq++) {
+		if (virtio_bln_has_vq(bdev, vq) && n++ == num)
+			return vq;
+	}
+	for (vq = 0; vq < NUM_VIRT_QUEUES; vq++) {
+		if (!virtio_bln_has_vq(bdev, vq) && n++ == num)
+			return vq;
+	}
+
+	return 0;
+}
+
+static u32 virtio_bln_num_of(struct bln_dev *bdev, u32 vq)
+{
+	u32 i, num = 0;
+
+	for (i = 0; i < vq; i++)
+		num += virtio_bln_has_vq(bdev, i);
+
+	return num;
+}
+
+/* Pages the guest writes a pattern into when freeing can't be dropped */
+static bool virtio_bln_can_discard(struct bln_dev *bdev)
+{
+	return !(bdev->vdev.features & (1UL << VIRTIO_BALLOON_F_PAGE_POISON)) ||
+	       !le32_to_cpu(bdev->config.poison_val);
+}
+
+/*
+ * Shared RAM has to be punched out of its file. MADV_FREE, with
+ * --balloon-lazy, leaves the pages until the host runs short of memory, and
+ * doesn't apply to huge pages.
+ */
+static void virtio_bln_madvise(struct kvm *kvm, void *start, size_t len)
+{
+	if (kvm->cfg.mem_shared) {
+		madvise(start, len, MADV_REMOVE);
+		return;
+	}
+
+	if (kvm->cfg.balloon_lazy && !madvise(start, len, MADV_FREE))
+		return;
+
+	madvise(start, len, MADV_DONTNEED);
+}
+
+/*
+ * Drop the host pages behind the guest pages of @iov, merging contiguous
+ * ones into a single madvise().
+ */
+static void virtio_bln_discard(struct kvm *kvm, struct iovec *iov, u16 nr)
+{
+	void *start = NULL;
+	size_t len = 0;
+	u16 i;
+
+	for (i = 0; i <= nr; i++) {
+		if (i < nr && start + len == iov[i].iov_base) {
+			len += iov[i].iov_len;
+			continue;
+		}
+
+		if (len && host_ptr_in_ram(kvm, start) &&
+		    host_ptr_in_ram(kvm, start + len - 1))
+			virtio_bln_madvise(kvm, start, len);
+
+		if (i < nr) {
+			start = iov[i].iov_base;
+			len = iov[i].iov_len;
+		}
+	}
+}
+
+/*
+ * Account @len bytes of guest RAM at host @ptr entering (@inflate) or leaving
+ * the balloon. Without granules, inflated memory is dropped right away.
+ * Otherwise only the granules the balloon now covers entirely are, by runs.
+ */
+static void virtio_bln_account(struct kvm *kvm, struct bln_dev *bdev,
+			       void *ptr, u64 len, bool inflate)
+{
+	u64 off = ptr - kvm->ram_start, end = off + len;
+	u64 g, g_start, g_end, run_start = 0, run_len = 0;
+	unsigned int shift = bdev->granule_shift;
+	u32 n, count, full = 1U << (shift - VIRTIO_BALLOON_PFN_SHIFT);
+
+	if (!bdev->granules) {
+		if (inflate)
+			virtio_bln_madvise(kvm, ptr, len);
+		return;
+	}
+
+	for (g = off >> shift; g < bdev->nr_granules && g << shift < end; g++) {
+		g_start = max_t(u64, off, g << shift);
+		g_end = min_t(u64, end, (g + 1) << shift);
+		n = (g_end - g_start) >> VIRTIO_BALLOON_PFN_SHIFT;
+
+		if (!inflate) {
+			count = __atomic_load_n(&bdev->granules[g], __ATOMIC_RELAXED);
+			while (!__atomic_compare_exchange_n(&bdev->granules[g],
+							    &count, count - min(count, n),
+							    false, __ATOMIC_RELAXED,
+							    __ATOMIC_RELAXED))
+				;
+			continue;
+		}
+
+		if (__atomic_add_fetch(&bdev->granules[g], n, __ATOMIC_RELAXED) < full)
+			continue;
+
+		if (run_len && run_start + run_len == g << shift) {
+			run_len += 1ULL << shift;
+			continue;
+		}
+		if (run_len)
+			virtio_bln_madvise(kvm, kvm->ram_start + run_start, run_len);
+		run_start = g << shift;
+		run_len = 1ULL << shift;
+	}
+
+	if (run_len)
+		virtio_bln_madvise(kvm, kvm->ram_start + run_start, run_len);
+}
+
+static int virtio_bln_cmp_pfn(const void *a, const void *b)
+{
+	u32 pa = *(const u32 *)a, pb = *(const u32 *)b;
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+/*
+ * Sort the PFNs of a request, so that the pages contiguous in guest memory
+ * and in the host mapping of RAM are accounted, and dropped, as one range.
+ */
+static void virtio_bln_do_pfns(struct kvm *kvm, struct bln_dev *bdev,
+			       u32 *pfns, u32 nr, bool inflate)
+{
+	u64 gpa, len;
+	void *host, *last;
+	u32 i, j, k;
+
+	qsort(pfns, nr, sizeof(*pfns), virtio_bln_cmp_pfn);
+
+	for (i = 0; i < nr; i = j) {
+		for (j = i + 1; j < nr && pfns[j] - pfns[j - 1] <= 1; j++)
+			;
+
+		gpa = (u64)pfns[i] << VIRTIO_BALLOON_PFN_SHIFT;
+		len = ((u64)pfns[j - 1] - pfns[i] + 1) << VIRTIO_BALLOON_PFN_SHIFT;
+		host = __guest_flat_to_host(kvm, gpa);
+		last = __guest_flat_to_host(kvm, gpa + len - VIRTIO_BLN_PAGE_SIZE);
+
+		if (host && last == host + len - VIRTIO_BLN_PAGE_SIZE &&
+		    host_ptr_in_ram(kvm, host) && host_ptr_in_ram(kvm, last)) {
+			virtio_bln_account(kvm, bdev, host, len, inflate);
+			continue;
+		}
+
+		/* Across a hole of guest memory, or not RAM at all */
+		for (k = i; k < j; k++) {
+			if (k > i && pfns[k] == pfns[k - 1])
+				continue;
+			host = guest_flat_to_host(kvm, (u64)pfns[k] <<
+						       VIRTIO_BALLOON_PFN_SHIFT);
+			if (host && host_ptr_in_ram(kvm, host))
+				virtio_bln_account(kvm, bdev, host,
+						   VIRTIO_BLN_PAGE_SIZE, inflate);
+		}
+	}
+}
+
 static bool virtio_bln_do_io_request(struct kvm *kvm, struct bln_dev *bdev, struct virt_queue *queue)
 {
 	struct iovec iov[VIRTIO_BLN_QUEUE_SIZE];
+	u32 pfns[VIRTIO_BLN_MAX_PFNS];
+	bool inflate = queue == &bdev->vqs[VIRTIO_BLN_INFLATE];
 	unsigned int len = 0;
 	u16 out, in, head;
-	u32 *ptrs, i;
+	u32 *ptrs, i, nr;
 	u32 actual;
 
 	head	= virt_queue__get_iov(queue, iov, &out, &in, kvm);
 	ptrs	= iov[0].iov_base;
 	len	= iov[0].iov_len / sizeof(u32);
 
-	actual = le32_to_cpu(bdev->config.actual);
-	for (i = 0 ; i < len ; i++) {
-		void *guest_ptr;
-
-		guest_ptr = guest_flat_to_host(kvm, (u64)ptrs[i] << VIRTIO_BALLOON_PFN_SHIFT);
-		if (queue == &bdev->vqs[VIRTIO_BLN_INFLATE]) {
-			madvise(guest_ptr, 1 << VIRTIO_BALLOON_PFN_SHIFT, MADV_DONTNEED);
-			actual++;
-		} else if (queue == &bdev->vqs[VIRTIO_BLN_DEFLATE]) {
-			actual--;
-		}
+	for (i = 0; i < len; i += nr) {
+		nr = min_t(u32, len - i, VIRTIO_BLN_MAX_PFNS);
+		memcpy(pfns, ptrs + i, nr * sizeof(*pfns));
+		virtio_bln_do_pfns(kvm, bdev, pfns, nr, inflate);
 	}
+
+	actual = le32_to_cpu(bdev->config.actual);
+	actual = inflate ? actual + len : actual - min(actual, len);
 	bdev->config.actual = cpu_to_le32(actual);
 
 	virt_queue__set_used_elem(queue, head, len);
@@ -98,11 +332,12 @@ static bool virtio_bln_do_stat_request(struct kvm *kvm, struct bln_dev *bdev, st
 		return true;
 	}
 
-	memcpy(bdev->stats, stat, iov[0].iov_len);
+	memcpy(bdev->stats, stat, min(iov[0].iov_len, sizeof(bdev->stats)));
 
 	bdev->stat_count = iov[0].iov_len / sizeof(struct virtio_balloon_stat);
 	bdev->cur_stat = stat;
 	bdev->cur_stat_head = head;
+	__atomic_store_n(&bdev->stat_pending, false, __ATOMIC_RELEASE);
 
 	if (write(bdev->stat_waitfd, &wait_val, sizeof(wait_val)) <= 0)
 		return -EFAULT;
@@ -110,39 +345,126 @@ static bool virtio_bln_do_stat_request(struct kvm *kvm, struct bln_dev *bdev, st
 	return 1;
 }
 
+/* Free page reporting: the guest hands over free pages until we return them */
+static void virtio_bln_do_report_request(struct kvm *kvm, struct bln_dev *bdev,
+					 struct virt_queue *queue)
+{
+	struct iovec iov[VIRTIO_BLN_QUEUE_SIZE];
+	u16 out, in, head;
+
+	head = virt_queue__get_iov(queue, iov, &out, &in, kvm);
+	if (virtio_bln_can_discard(bdev))
+		virtio_bln_discard(kvm, iov + out, in);
+
+	virt_queue__set_used_elem(queue, head, 0);
+}
+
+/*
+ * Free page hinting: the guest tells which command it answers, sends the free
+ * pages, and stops. It keeps the pages allocated until the command is DONE.
+ */
+static void virtio_bln_do_hint_request(struct kvm *kvm, struct bln_dev *bdev,
+				       struct virt_queue *queue)
+{
+	struct iovec iov[VIRTIO_BLN_QUEUE_SIZE];
+	u16 out, in, head;
+	bool done = false;
+	__le32 cmd_id;
+	u32 id;
+
+	head = virt_queue__get_iov(queue, iov, &out, &in, kvm);
+
+	mutex_lock(&bdev->hint_lock);
+	if (out && iov[0].iov_len >= sizeof(cmd_id)) {
+		memcpy(&cmd_id, iov[0].iov_base, sizeof(cmd_id));
+		id = virtio_guest_to_host_u32(queue->endian, cmd_id);
+		if (id == VIRTIO_BALLOON_CMD_ID_STOP) {
+			done = bdev->hint_active;
+			bdev->hint_active = false;
+		} else {
+			bdev->hint_active = id == bdev->hint_cmd_id;
+		}
+	} else if (in && bdev->hint_active && virtio_bln_can_discard(bdev)) {
+		virtio_bln_discard(kvm, iov + out, in);
+	}
+
+	if (done)
+		bdev->config.free_page_hint_cmd_id =
+			cpu_to_le32(VIRTIO_BALLOON_CMD_ID_DONE);
+	mutex_unlock(&bdev->hint_lock);
+
+	virt_queue__set_used_elem(queue, head, 0);
+
+	/* The guest may now reuse the pages */
+	if (done)
+		bdev->vdev.ops->signal_config(kvm, &bdev->vdev);
+}
+
 static void virtio_bln_do_io(struct kvm *kvm, void *param)
 {
 	struct virt_queue *vq = param;
+	u32 num = virtio_bln_num_of(&bdev, vq - bdev.vqs);
 
 	if (vq == &bdev.vqs[VIRTIO_BLN_STATS]) {
 		virtio_bln_do_stat_request(kvm, &bdev, vq);
-		bdev.vdev.ops->signal_vq(kvm, &bdev.vdev, VIRTIO_BLN_STATS);
+		bdev.vdev.ops->signal_vq(kvm, &bdev.vdev, num);
 		return;
 	}
 
 	while (virt_queue__available(vq)) {
-		virtio_bln_do_io_request(kvm, &bdev, vq);
-		bdev.vdev.ops->signal_vq(kvm, &bdev.vdev, vq - bdev.vqs);
+		if (vq == &bdev.vqs[VIRTIO_BLN_REPORTING])
+			virtio_bln_do_report_request(kvm, &bdev, vq);
+		else if (vq == &bdev.vqs[VIRTIO_BLN_FREE_PAGE])
+			virtio_bln_do_hint_request(kvm, &bdev, vq);
+		else
+			virtio_bln_do_io_request(kvm, &bdev, vq);
+		bdev.vdev.ops->signal_vq(kvm, &bdev.vdev, num);
 	}
 }
 
+/*
+ * Have the guest refresh bdev.stats. A buffer the guest didn't return in time
+ * stays with it, and the next caller waits for it instead of asking again.
+ */
 static int virtio_bln__collect_stats(struct kvm *kvm)
 {
 	struct virt_queue *vq = &bdev.vqs[VIRTIO_BLN_STATS];
+	struct pollfd pfd = {
+		.fd	= bdev.stat_waitfd,
+		.events	= POLLIN,
+	};
+	int r = 0;
 	u64 tmp;
 
+	mutex_lock(&bdev.stat_lock);
+
 	/* Exit if the queue is not set up. */
-	if (!vq->enabled)
-		return -ENODEV;
+	if (!vq->enabled || !bdev.cur_stat) {
+		r = -ENODEV;
+		goto out;
+	}
 
-	virt_queue__set_used_elem(vq, bdev.cur_stat_head,
-				  sizeof(struct virtio_balloon_stat));
-	bdev.vdev.ops->signal_vq(kvm, &bdev.vdev, VIRTIO_BLN_STATS);
+	if (!__atomic_load_n(&bdev.stat_pending, __ATOMIC_ACQUIRE)) {
+		/* Forget about answers that came too late */
+		while (read(bdev.stat_waitfd, &tmp, sizeof(tmp)) > 0)
+			;
+		bdev.stat_pending = true;
+		virt_queue__set_used_elem(vq, bdev.cur_stat_head,
+					  sizeof(struct virtio_balloon_stat));
+		bdev.vdev.ops->signal_vq(kvm, &bdev.vdev,
+					 virtio_bln_num_of(&bdev, VIRTIO_BLN_STATS));
+	}
 
-	if (read(bdev.stat_waitfd, &tmp, sizeof(tmp)) <= 0)
-		return -EFAULT;
+	r = poll(&pfd, 1, VIRTIO_BLN_STAT_TIMEOUT_MS);
+	if (r <= 0) {
+		r = r ? -errno : -ETIMEDOUT;
+		goto out;
+	}
 
-	return 0;
+	r = read(bdev.stat_waitfd, &tmp, sizeof(tmp)) < 0 ? -errno : 0;
+out:
+	mutex_unlock(&bdev.stat_lock);
+	return r;
 }
 
 static void virtio_bln__print_stats(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg)
@@ -160,6 +482,14 @@ static void virtio_bln__print_stats(struct kvm *kvm, int fd, u32 type, u32 len,
 		pr_warning("Failed sending memory stats");
 }
 
+static void virtio_bln__set_num_pages(struct kvm *kvm, u32 num_pages)
+{
+	bdev.config.num_pages = cpu_to_le32(num_pages);
+
+	/* Notify that the configuration space has changed */
+	bdev.vdev.ops->signal_config(kvm, &bdev.vdev);
+}
+
 static void handle_mem(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg)
 {
 	int mem;
@@ -172,20 +502,255 @@ static void handle_mem(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg)
 	num_pages = le32_to_cpu(bdev.config.num_pages);
 
 	if (mem > 0) {
-		num_pages += 256 * mem;
+		num_pages += VIRTIO_BLN_MB_PAGES * mem;
 	} else if (mem < 0) {
-		if (num_pages < (u32)(256 * (-mem)))
+		if (num_pages < (u32)(VIRTIO_BLN_MB_PAGES * (-mem)))
 			return;
 
-		num_pages += 256 * mem;
+		num_pages += VIRTIO_BLN_MB_PAGES * mem;
 	}
 
-	bdev.config.num_pages = cpu_to_le32(num_pages);
+	virtio_bln__set_num_pages(kvm, num_pages);
+}
+
+/* The "some avg10" memory pressure of the host, in 1/100 % */
+static int virtio_bln_auto_read_psi(u32 *psi)
+{
+	char line[128];
+	double avg10;
+	FILE *f;
+	int r = -EINVAL;
+
+	f = fopen(VIRTIO_BLN_PSI_PATH, "r");
+	if (!f)
+		return -errno;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "some avg10=%lf", &avg10) == 1) {
+			*psi = avg10 * 100;
+			r = 0;
+			break;
+		}
+	}
+
+	fclose(f);
+	return r;
+}
+
+static u64 virtio_bln_auto_guest_avail(void)
+{
+	u64 avail = 0, memfree = 0;
+	u16 i;
+
+	for (i = 0; i < min_t(u16, bdev.stat_count, VIRTIO_BALLOON_S_NR); i++) {
+		if (bdev.stats[i].tag == VIRTIO_BALLOON_S_AVAIL)
+			avail = bdev.stats[i].val;
+		else if (bdev.stats[i].tag == VIRTIO_BALLOON_S_MEMFREE)
+			memfree = bdev.stats[i].val;
+	}
+
+	/* Older guests don't estimate the memory they could reclaim */
+	return (avail ? avail : memfree) / SZ_1M;
+}
+
+/*
+ * Inflate by a step while the host is under pressure and the guest has memory
+ * to spare, and deflate by a step when the host is at ease or the guest runs
+ * short. The balloon stays within the configured bounds either way.
+ */
+static void virtio_bln_auto_tick(struct kvm *kvm)
+{
+	struct kvm_balloon_auto *cfg = &kvm->cfg.balloon_auto;
+	struct virtio_bln_auto_stats *st = &bdev.auto_stats;
+	u64 target, avail;
+	u32 psi = 0;
+	int r;
+
+	if (virtio_bln_auto_read_psi(&psi) < 0)
+		psi = 0;
+
+	r = virtio_bln__collect_stats(kvm);
+	if (r == -ENODEV)
+		return;
+
+	mutex_lock(&bdev.auto_lock);
+	if (r < 0) {
+		st->stat_timeouts++;
+		mutex_unlock(&bdev.auto_lock);
+		return;
+	}
+
+	avail = virtio_bln_auto_guest_avail();
+	target = le32_to_cpu(bdev.config.num_pages) / VIRTIO_BLN_MB_PAGES;
+
+	st->action = VIRTIO_BLN_AUTO_HOLD;
+	if (target < cfg->min_mb) {
+		target = min_t(u64, target + cfg->step_mb, cfg->min_mb);
+		st->action = VIRTIO_BLN_AUTO_INFLATE;
+	} else if (target > cfg->max_mb) {
+		target = max_t(u64, target - min_t(u64, target, cfg->step_mb),
+			       cfg->max_mb);
+		st->action = VIRTIO_BLN_AUTO_DEFLATE;
+	} else if (psi >= cfg->psi_high && target < cfg->max_mb &&
+		   avail > cfg->reserve_mb + cfg->step_mb) {
+		target = min_t(u64, target + cfg->step_mb, cfg->max_mb);
+		st->action = VIRTIO_BLN_AUTO_INFLATE;
+	} else if ((psi < cfg->psi_low || avail < cfg->reserve_mb) &&
+		   target > cfg->min_mb) {
+		target = max_t(u64, target - min_t(u64, target, cfg->step_mb),
+			       cfg->min_mb);
+		st->action = VIRTIO_BLN_AUTO_DEFLATE;
+	}
+
+	st->host_psi = psi;
+	st->guest_avail_mb = avail;
+	st->target_mb = target;
+	st->actual_mb = le32_to_cpu(bdev.config.actual) / VIRTIO_BLN_MB_PAGES;
+	if (st->action == VIRTIO_BLN_AUTO_INFLATE)
+		st->inflations++;
+	else if (st->action == VIRTIO_BLN_AUTO_DEFLATE)
+		st->deflations++;
+	mutex_unlock(&bdev.auto_lock);
+
+	if (st->action != VIRTIO_BLN_AUTO_HOLD)
+		virtio_bln__set_num_pages(kvm, target * VIRTIO_BLN_MB_PAGES);
+}
+
+static void *virtio_bln_auto_thread(void *param)
+{
+	struct kvm *kvm = param;
+	struct pollfd pfd = {
+		.fd	= bdev.auto_stopfd,
+		.events	= POLLIN,
+	};
+
+	kvm__set_thread_name("virtio-bln-auto");
+
+	while (poll(&pfd, 1, kvm->cfg.balloon_auto.interval_ms) == 0)
+		virtio_bln_auto_tick(kvm);
+
+	return NULL;
+}
+
+static void handle_auto_stats(struct kvm *kvm, int fd, u32 type, u32 len,
+			      u8 *msg)
+{
+	struct virtio_bln_auto_stats reply;
+
+	if (WARN_ON(type != KVM_IPC_BALLOON_STATS || len))
+		return;
+
+	mutex_lock(&bdev.auto_lock);
+	reply = bdev.auto_stats;
+	mutex_unlock(&bdev.auto_lock);
+
+	if (write_in_full(fd, &reply, sizeof(reply)) < 0)
+		pr_warning("Failed sending balloon controller stats");
+}
+
+static int set_auto_param(struct kvm_balloon_auto *cfg, const char *param,
+			  const char *val)
+{
+	if (strcmp(param, "min") == 0)
+		cfg->min_mb = atoi(val);
+	else if (strcmp(param, "max") == 0)
+		cfg->max_mb = atoi(val);
+	else if (strcmp(param, "step") == 0)
+		cfg->step_mb = atoi(val);
+	else if (strcmp(param, "interval") == 0)
+		cfg->interval_ms = atoi(val);
+	else if (strcmp(param, "reserve") == 0)
+		cfg->reserve_mb = atoi(val);
+	else if (strcmp(param, "psi_high") == 0)
+		cfg->psi_high = atof(val) * 100;
+	else if (strcmp(param, "psi_low") == 0)
+		cfg->psi_low = atof(val) * 100;
+	else
+		die("Unknown balloon controller parameter %s", param);
+
+	return 0;
+}
+
+int virtio_bln_auto_parser(const struct option *opt, const char *arg, int unset)
+{
+	struct kvm *kvm = opt->ptr;
+	struct kvm_balloon_auto *cfg = &kvm->cfg.balloon_auto;
+	char *buf, *param, *val;
+
+	*cfg = (struct kvm_balloon_auto) {
+		.enabled	= true,
+		.step_mb	= 64,
+		.interval_ms	= 1000,
+		.reserve_mb	= 256,
+		.psi_high	= 1000,
+		.psi_low	= 100,
+	};
+	kvm->cfg.balloon = true;
+
+	if (!arg)
+		return 0;
+
+	buf = strdup(arg);
+	if (!buf)
+		die("Out of memory");
+
+	for (param = strtok(buf, ","); param; param = strtok(NULL, ",")) {
+		val = strchr(param, '=');
+		if (!val)
+			die("Balloon controller parameter %s needs a value", param);
+		*val++ = 0;
+		set_auto_param(cfg, param, val);
+	}
+
+	free(buf);
+
+	return 0;
+}
+
+/* Ask the guest for a new round of free page hints */
+static void handle_hint(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg)
+{
+	if (WARN_ON(type != KVM_IPC_BALLOON_HINT || len))
+		return;
+
+	if (!virtio_bln_has_vq(&bdev, VIRTIO_BLN_FREE_PAGE)) {
+		pr_warning("The guest doesn't hint free pages");
+		return;
+	}
+
+	mutex_lock(&bdev.hint_lock);
+	/* Command IDs up to VIRTIO_BALLOON_CMD_ID_DONE are reserved */
+	if (++bdev.hint_cmd_id <= VIRTIO_BALLOON_CMD_ID_DONE)
+		bdev.hint_cmd_id = VIRTIO_BALLOON_CMD_ID_DONE + 1;
+	bdev.hint_active = false;
+	bdev.config.free_page_hint_cmd_id = cpu_to_le32(bdev.hint_cmd_id);
+	mutex_unlock(&bdev.hint_lock);
 
-	/* Notify that the configuration space has changed */
 	bdev.vdev.ops->signal_config(kvm, &bdev.vdev);
 }
 
+static void virtio_bln__collect_metrics(struct kvm *kvm, struct metrics *m)
+{
+	metrics__family(m, "balloon_target_bytes", "gauge",
+			"Memory the balloon asks the guest to give back");
+	metrics__value(m, (u64)le32_to_cpu(bdev.config.num_pages) <<
+			  VIRTIO_BALLOON_PFN_SHIFT);
+
+	metrics__family(m, "balloon_actual_bytes", "gauge",
+			"Memory the guest has given back to the balloon");
+	metrics__value(m, (u64)le32_to_cpu(bdev.config.actual) <<
+			  VIRTIO_BALLOON_PFN_SHIFT);
+}
+
+static struct metrics_collector virtio_bln__metrics = {
+	.collect	= virtio_bln__collect_metrics,
+};
+
+u64 virtio_bln__actual_bytes(void)
+{
+	return (u64)le32_to_cpu(bdev.config.actual) << VIRTIO_BALLOON_PFN_SHIFT;
+}
+
 static u8 *get_config(struct kvm *kvm, void *dev)
 {
 	struct bln_dev *bdev = dev;
@@ -202,7 +767,10 @@ static size_t get_config_size(struct kvm *kvm, void *dev)
 
 static u64 get_host_features(struct kvm *kvm, void *dev)
 {
-	return 1 << VIRTIO_BALLOON_F_STATS_VQ;
+	return 1 << VIRTIO_BALLOON_F_STATS_VQ
+		| 1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT
+		| 1 << VIRTIO_BALLOON_F_PAGE_POISON
+		| 1 << VIRTIO_BALLOON_F_REPORTING;
 }
 
 static int init_vq(struct kvm *kvm, void *dev, u32 vq)
@@ -212,6 +780,7 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 
 	compat__remove_message(compat_id);
 
+	vq		= virtio_bln_vq_of(bdev, vq);
 	queue		= &bdev->vqs[vq];
 
 	virtio_init_device_vq(kvm, &bdev->vdev, queue, VIRTIO_BLN_QUEUE_SIZE);
@@ -225,14 +794,20 @@ static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct bln_dev *bdev = dev;
 
+	vq = virtio_bln_vq_of(bdev, vq);
 	thread_pool__cancel_job(&bdev->jobs[vq]);
+
+	/* A reset returns the balloon to the guest */
+	if (vq == VIRTIO_BLN_INFLATE && bdev->granules)
+		memset(bdev->granules, 0,
+		       bdev->nr_granules * sizeof(*bdev->granules));
 }
 
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct bln_dev *bdev = dev;
 
-	thread_pool__do_job(&bdev->jobs[vq]);
+	thread_pool__do_job(&bdev->jobs[virtio_bln_vq_of(bdev, vq)]);
 
 	return 0;
 }
@@ -241,7 +816,7 @@ static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct bln_dev *bdev = dev;
 
-	return &bdev->vqs[vq];
+	return &bdev->vqs[virtio_bln_vq_of(bdev, vq)];
 }
 
 static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
@@ -273,8 +848,27 @@ struct virtio_ops bln_dev_virtio_ops = {
 	.get_vq_count		= get_vq_count,
 };
 
+/* The pages that back guest RAM, when the balloon's don't make them up */
+static void virtio_bln_init_granules(struct kvm *kvm, struct bln_dev *bdev)
+{
+	u64 size = kvm->ram_pagesize;
+
+	if (kvm->cfg.mem_backend == KVM_MEM_BACKEND_THP)
+		size = max_t(u64, size, SZ_2M);
+	if (size <= VIRTIO_BLN_PAGE_SIZE)
+		return;
+
+	bdev->granule_shift = __builtin_ctzll(size);
+	bdev->nr_granules = DIV_ROUND_UP(kvm->ram_size, size);
+	bdev->granules = calloc(bdev->nr_granules, sizeof(*bdev->granules));
+	if (!bdev->granules)
+		pr_warning("No memory to track the balloon by %lluKB pages",
+			   (unsigned long long)size >> 10);
+}
+
 int virtio_bln__init(struct kvm *kvm)
 {
+	struct kvm_balloon_auto *auto_cfg = &kvm->cfg.balloon_auto;
 	int r;
 
 	if (!kvm->cfg.balloon)
@@ -282,9 +876,15 @@ int virtio_bln__init(struct kvm *kvm)
 
 	kvm_ipc__register_handler(KVM_IPC_BALLOON, handle_mem);
 	kvm_ipc__register_handler(KVM_IPC_STAT, virtio_bln__print_stats);
+	kvm_ipc__register_handler(KVM_IPC_BALLOON_HINT, handle_hint);
+	kvm_ipc__register_handler(KVM_IPC_BALLOON_STATS, handle_auto_stats);
 
-	bdev.stat_waitfd	= eventfd(0, 0);
+	bdev.stat_waitfd	= eventfd(0, EFD_NONBLOCK);
+	mutex_init(&bdev.stat_lock);
+	mutex_init(&bdev.hint_lock);
+	mutex_init(&bdev.auto_lock);
 	memset(&bdev.config, 0, sizeof(struct virtio_balloon_config));
+	virtio_bln_init_granules(kvm, &bdev);
 
 	r = virtio_init(kvm, &bdev, &bdev.vdev, &bln_dev_virtio_ops,
 			kvm->cfg.virtio_transport, PCI_DEVICE_ID_VIRTIO_BLN,
@@ -292,16 +892,53 @@ int virtio_bln__init(struct kvm *kvm)
 	if (r < 0)
 		return r;
 
+	metrics__register(&virtio_bln__metrics);
+
 	if (compat_id == -1)
 		compat_id = virtio_compat_add_message("virtio-balloon", "CONFIG_VIRTIO_BALLOON");
 
-	return 0;
+	if (!auto_cfg->enabled)
+		return 0;
+
+	/* By default, take back at most half of the guest memory */
+	if (!auto_cfg->max_mb)
+		auto_cfg->max_mb = kvm->cfg.ram_size / SZ_1M / 2;
+	if (auto_cfg->min_mb > auto_cfg->max_mb || !auto_cfg->step_mb ||
+	    !auto_cfg->interval_ms || auto_cfg->psi_low > auto_cfg->psi_high)
+		die("Invalid --balloon-auto parameters");
+
+	if (access(VIRTIO_BLN_PSI_PATH, R_OK) < 0)
+		pr_warning("No %s, the balloon controller only follows the guest",
+			   VIRTIO_BLN_PSI_PATH);
+
+	bdev.auto_stats.enabled = true;
+	bdev.auto_stopfd = eventfd(0, 0);
+	if (bdev.auto_stopfd < 0)
+		return -errno;
+
+	r = -pthread_create(&bdev.auto_thread, NULL, virtio_bln_auto_thread, kvm);
+	if (r) {
+		close(bdev.auto_stopfd);
+		bdev.auto_stats.enabled = false;
+	}
+
+	return r;
 }
 virtio_dev_init(virtio_bln__init);
 
 int virtio_bln__exit(struct kvm *kvm)
 {
+	u64 stop = 1;
+
+	if (bdev.auto_stats.enabled) {
+		if (write(bdev.auto_stopfd, &stop, sizeof(stop)) < 0)
+			pr_warning("Failed stopping the balloon controller");
+		pthread_join(bdev.auto_thread, NULL);
+		close(bdev.auto_stopfd);
+	}
+
 	virtio_exit(kvm, &bdev.vdev);
+	free(bdev.granules);
 
 	return 0;
 }
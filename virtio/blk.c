@@ -2,6 +2,8 @@
 
 #include "kvm/virtio-pci-dev.h"
 #include "kvm/disk-image.h"
+#include "kvm/disk-trace.h"
+#include "kvm/host-numa.h"
 #include "kvm/iovec.h"
 #include "kvm/mutex.h"
 #include "kvm/util.h"
@@ -9,74 +11,215 @@
 #include "kvm/pci.h"
 #include "kvm/threadpool.h"
 #include "kvm/ioeventfd.h"
+#include "kvm/iothread.h"
+#include "kvm/ratelimit.h"
 #include "kvm/guest_compat.h"
 #include "kvm/virtio-pci.h"
 #include "kvm/virtio.h"
 
 #include <linux/virtio_ring.h>
 #include <linux/virtio_blk.h>
+#include <linux/byteorder.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
+#include <linux/sizes.h>
 #include <linux/types.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/timerfd.h>
 
-#define VIRTIO_BLK_MAX_DEV		4
-
+#define VIRTIO_BLK_QUEUE_SIZE		256
 /*
- * the header and status consume too entries
+ * the header and status consume too entries. Deeper queues get more requests,
+ * not longer ones.
  */
 #define DISK_SEG_MAX			(VIRTIO_BLK_QUEUE_SIZE - 2)
-#define VIRTIO_BLK_QUEUE_SIZE		256
-#define NUM_VIRT_QUEUES			1
+#define VIRTIO_BLK_MAX_QUEUES		16
+
+/* Keep a single discard or write zeroes segment from stalling the queue */
+#define VIRTIO_BLK_MAX_DISCARD_SECTORS	(SZ_1G >> SECTOR_SHIFT)
+
+struct blk_dev_queue;
 
 struct blk_dev_req {
-	struct virt_queue		*vq;
+	struct blk_dev_queue		*queue;
 	struct blk_dev			*bdev;
-	struct iovec			iov[VIRTIO_BLK_QUEUE_SIZE];
+	/* seg_max + 2 entries, in the arena of the queue */
+	struct iovec			*iov;
 	u16				out, in, head;
 	u8				*status;
 	struct kvm			*kvm;
+
+	/* For the latency histograms, stats_op is DISK_STATS_NR_OPS if unused */
+	u64				start;
+	size_t				stats_len;
+	int				stats_op;
+	/* And for the trace= of the disk */
+	u64				sector;
 };
 
-struct blk_dev {
+/*
+ * Each virtqueue has its own I/O thread, eventfd and used ring lock, so that
+ * requests submitted on different queues never serialise on each other.
+ */
+struct blk_dev_queue {
+	u32				id;
+	struct blk_dev			*bdev;
 	struct mutex			mutex;
+	struct virt_queue		vq;
+	/* Completions not yet shown to the guest, protected by mutex */
+	struct virt_queue_batch		batch;
+	/* One per descriptor of the ring, followed by all their iovecs */
+	struct blk_dev_req		*reqs;
+	/* What the driver asked for, 0 until it does */
+	u32				size;
 
+	pthread_t			io_thread;
+	int				io_efd;
+	int				cpu;
+	struct virtio_poll		poll;
+	/* Watches io_efd when the device runs on an iothread */
+	struct iothread_handler		io_handler;
+	/*
+	 * The ioeventfd of the queue, read here rather than relayed to io_efd
+	 * by the ioeventfd thread, or -1
+	 */
+	int				kick_fd;
+	struct iothread_handler		kick_handler;
+
+	/* Over the rate limit, the queue waits for throttle_fd to expire */
+	bool				throttled;
+	int				throttle_fd;
+	struct iothread_handler		throttle_handler;
+};
+
+struct blk_dev {
 	struct list_head		list;
 
 	struct virtio_device		vdev;
 	struct virtio_blk_config	blk_config;
 	u64				capacity;
 	struct disk_image		*disk;
+	/* Largest queue offered, and segments per request */
+	u32				queue_size;
+	u32				seg_max;
 
-	struct virt_queue		vqs[NUM_VIRT_QUEUES];
-	struct blk_dev_req		reqs[VIRTIO_BLK_QUEUE_SIZE];
-
-	pthread_t			io_thread;
-	int				io_efd;
+	u32				nr_queues;
+	struct blk_dev_queue		queues[VIRTIO_BLK_MAX_QUEUES];
+	/* The --iothreads loop serving the queues, or -1 */
+	int				iothread;
+	struct ratelimit		ratelimit;
 
 	struct kvm			*kvm;
 };
 
-static LIST_HEAD(bdevs);
 static int compat_id = -1;
 
 void virtio_blk_complete(void *param, long len)
 {
 	struct blk_dev_req *req = param;
+	struct blk_dev_queue *queue = req->queue;
 	struct blk_dev *bdev = req->bdev;
-	int queueid = req->vq - bdev->vqs;
+	bool signal;
 	u8 *status;
 
-	/* status */
+	if (req->stats_op != DISK_STATS_NR_OPS) {
+		disk_stats__account(&bdev->disk->stats, req->stats_op,
+				    req->stats_len, req->start);
+		if (bdev->disk->trace)
+			disk_trace__record(bdev->disk, req->stats_op,
+					   req->sector, req->stats_len,
+					   req->start, queue->id);
+	}
+
+	/* status, -EOPNOTSUPP for requests the device doesn't take */
 	status = req->status;
-	*status	= (len < 0) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+	if (len == -EOPNOTSUPP)
+		*status = VIRTIO_BLK_S_UNSUPP;
+	else
+		*status = (len < 0) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+
+	mutex_lock(&queue->mutex);
+	virt_queue__batch_add(&queue->batch, req->head, len);
+	/* Within a batch, virtio_blk_complete_batch() publishes it */
+	signal = !disk_image__batching() &&
+		 virt_queue__batch_commit(&queue->batch);
+	mutex_unlock(&queue->mutex);
+
+	if (signal)
+		bdev->vdev.ops->signal_vq(req->kvm, &bdev->vdev, queue->id);
+}
+
+static void virtio_blk_complete_batch(void *param)
+{
+	struct blk_dev *bdev = param;
+	struct blk_dev_queue *queue;
+	bool signal;
+	u32 i;
+
+	for (i = 0; i < bdev->nr_queues; i++) {
+		queue = &bdev->queues[i];
+		/* Others that added to the batch publish it themselves */
+		if (!__atomic_load_n(&queue->batch.nr, __ATOMIC_RELAXED))
+			continue;
 
-	mutex_lock(&bdev->mutex);
-	virt_queue__set_used_elem(req->vq, req->head, len);
-	mutex_unlock(&bdev->mutex);
+		mutex_lock(&queue->mutex);
+		signal = virt_queue__batch_commit(&queue->batch);
+		mutex_unlock(&queue->mutex);
 
-	if (virtio_queue__should_signal(&bdev->vqs[queueid]))
-		bdev->vdev.ops->signal_vq(req->kvm, &bdev->vdev, queueid);
+		if (signal)
+			bdev->vdev.ops->signal_vq(bdev->kvm, &bdev->vdev,
+						  queue->id);
+	}
+}
+
+static long virtio_blk_discard(struct blk_dev_req *req, u32 type,
+			       struct iovec *iov, size_t iovcount)
+{
+	struct virtio_blk_discard_write_zeroes seg;
+	struct blk_dev *bdev = req->bdev;
+	struct iovec_cursor cur;
+	u64 sector, nr_sectors;
+	u64 start;
+	u32 flags;
+	int r;
+
+	iovec_cursor__init(&cur, iov, iovcount);
+	while (iovec_cursor__from(&cur, &seg, sizeof(seg)) == sizeof(seg)) {
+		sector		= le64_to_cpu(seg.sector);
+		nr_sectors	= le32_to_cpu(seg.num_sectors);
+		flags		= le32_to_cpu(seg.flags);
+
+		if (sector > bdev->capacity || nr_sectors > bdev->capacity - sector)
+			return -EIO;
+
+		start = disk_stats__now();
+		if (type == VIRTIO_BLK_T_DISCARD) {
+			/* Which the spec has devices answer with UNSUPP */
+			if (flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP)
+				return -EOPNOTSUPP;
+			r = disk_image__discard(bdev->disk, sector, nr_sectors);
+		} else {
+			r = disk_image__write_zeroes(bdev->disk, sector, nr_sectors,
+					flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP);
+		}
+
+		if (r < 0)
+			return r;
+
+		/* One record per segment, as they aren't contiguous */
+		if (bdev->disk->trace)
+			disk_trace__record(bdev->disk,
+					   type == VIRTIO_BLK_T_DISCARD ?
+					   DISK_TRACE_DISCARD :
+					   DISK_TRACE_WRITE_ZEROES,
+					   sector, nr_sectors << SECTOR_SHIFT,
+					   start, req->queue->id);
+	}
+
+	return 0;
 }
 
 static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, struct blk_dev_req *req)
@@ -117,15 +260,35 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 	if (!iov[last_iov].iov_len)
 		iovcount--;
 
+	req->stats_op = DISK_STATS_NR_OPS;
+	req->start = disk_stats__now();
+	req->sector = sector;
+
+	if (ratelimit__enabled(&bdev->ratelimit))
+		ratelimit__charge(&bdev->ratelimit,
+				  type == VIRTIO_BLK_T_IN ||
+				  type == VIRTIO_BLK_T_OUT ?
+				  iov_size(iov, iovcount) : 0, 1);
+
 	switch (type) {
 	case VIRTIO_BLK_T_IN:
+		req->stats_op = DISK_STATS_READ;
+		req->stats_len = iov_size(iov, iovcount);
 		disk_image__read(bdev->disk, sector, iov, iovcount, req);
 		break;
 	case VIRTIO_BLK_T_OUT:
+		req->stats_op = DISK_STATS_WRITE;
+		req->stats_len = iov_size(iov, iovcount);
 		disk_image__write(bdev->disk, sector, iov, iovcount, req);
 		break;
 	case VIRTIO_BLK_T_FLUSH:
-		len = disk_image__flush(bdev->disk);
+		req->stats_op = DISK_STATS_FLUSH;
+		/* Reads and writes behind it needn't wait for the fsync */
+		disk_image__flush_async(bdev->disk, req);
+		break;
+	case VIRTIO_BLK_T_DISCARD:
+	case VIRTIO_BLK_T_WRITE_ZEROES:
+		len = virtio_blk_discard(req, type, iov, iovcount);
 		virtio_blk_complete(req, len);
 		break;
 	case VIRTIO_BLK_T_GET_ID:
@@ -139,20 +302,60 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 	}
 }
 
-static void virtio_blk_do_io(struct kvm *kvm, struct virt_queue *vq, struct blk_dev *bdev)
+/*
+ * Leave the requests in the ring until the limiter allows more. Guest
+ * notifications stay disabled meanwhile, the timer resumes the queue.
+ */
+static bool virtio_blk_throttle(struct blk_dev_queue *queue)
 {
+	u64 delay = ratelimit__delay(&queue->bdev->ratelimit);
+
+	if (!delay)
+		return false;
+
+	if (ratelimit__arm(queue->throttle_fd, delay) < 0) {
+		pr_warning("virtio-blk: unable to delay queue %u", queue->id);
+		return false;
+	}
+
+	queue->throttled = true;
+	return true;
+}
+
+static void virtio_blk_do_io(struct kvm *kvm, struct blk_dev_queue *queue)
+{
+	struct virt_queue *vq = &queue->vq;
+	struct disk_plug plug;
 	struct blk_dev_req *req;
 	u16 head;
 
-	while (virt_queue__available(vq)) {
-		head		= virt_queue__pop(vq);
-		req		= &bdev->reqs[head];
-		req->head	= virt_queue__get_head_iov(vq, req->iov, &req->out,
-					&req->in, head, kvm);
-		req->vq		= vq;
+	if (queue->throttled)
+		return;
 
-		virtio_blk_do_io_request(kvm, vq, req);
-	}
+	virtio_poll__woken(&queue->poll);
+
+	/*
+	 * The guest needn't notify us while we are emptying the queue, or
+	 * polling it. Plugged requests are submitted before polling.
+	 */
+	do {
+		virt_queue__disable_notify(vq);
+		disk_image__plug(queue->bdev->disk, &plug);
+		while (virt_queue__available(vq)) {
+			if (virtio_blk_throttle(queue))
+				break;
+			head		= virt_queue__pop(vq);
+			req		= &queue->reqs[head];
+			req->head	= virt_queue__get_head_iov(vq, req->iov,
+						&req->out, &req->in, head, kvm);
+
+			virtio_blk_do_io_request(kvm, vq, req);
+		}
+		disk_image__unplug(&plug);
+		if (queue->throttled)
+			return;
+	} while (virtio_poll__spin(&queue->poll, vq) ||
+		 virt_queue__enable_notify(vq));
 }
 
 static u8 *get_config(struct kvm *kvm, void *dev)
@@ -169,16 +372,69 @@ static size_t get_config_size(struct kvm *kvm, void *dev)
 	return sizeof(bdev->blk_config);
 }
 
+/* Whether the host storage has larger blocks than the guest's logical ones */
+static bool virtio_blk__has_topology(struct blk_dev *bdev)
+{
+	struct disk_topology *t = &bdev->disk->topology;
+	u32 blk_size = disk_direct__block_size(bdev->disk);
+
+	return t->phys_block_size > blk_size || t->min_io_size > blk_size ||
+	       t->opt_io_size > blk_size;
+}
+
+/* Guests don't take segments smaller than a page */
+static bool virtio_blk__has_size_max(struct blk_dev *bdev)
+{
+	return bdev->disk->topology.max_seg_size >= DISK_MAX_PHYS_BLOCK;
+}
+
 static u64 get_host_features(struct kvm *kvm, void *dev)
 {
 	struct blk_dev *bdev = dev;
 
 	return	1UL << VIRTIO_BLK_F_SEG_MAX
-		| 1UL << VIRTIO_BLK_F_FLUSH
+		/* Without it the guest treats the disk as write-through */
+		| (!disk_image__write_through(bdev->disk) ?
+		   1UL << VIRTIO_BLK_F_FLUSH : 0)
 		| 1UL << VIRTIO_RING_F_EVENT_IDX
 		| 1UL << VIRTIO_RING_F_INDIRECT_DESC
 		| 1UL << VIRTIO_F_ANY_LAYOUT
-		| (bdev->disk->readonly ? 1UL << VIRTIO_BLK_F_RO : 0);
+		| (bdev->nr_queues > 1 ? 1UL << VIRTIO_BLK_F_MQ : 0)
+		| 1UL << VIRTIO_BLK_F_BLK_SIZE
+		| (virtio_blk__has_topology(bdev) ?
+		   1UL << VIRTIO_BLK_F_TOPOLOGY : 0)
+		| (virtio_blk__has_size_max(bdev) ?
+		   1UL << VIRTIO_BLK_F_SIZE_MAX : 0)
+		| (bdev->disk->readonly ? 1UL << VIRTIO_BLK_F_RO : 0)
+		| (!bdev->disk->readonly && bdev->disk->ops->discard ?
+		   1UL << VIRTIO_BLK_F_DISCARD : 0)
+		| (!bdev->disk->readonly && bdev->disk->ops->write_zeroes ?
+		   1UL << VIRTIO_BLK_F_WRITE_ZEROES : 0);
+}
+
+/* In logical blocks, as the guest counts them */
+static void virtio_blk__config_topology(struct blk_dev *bdev)
+{
+	struct virtio_blk_config *conf = &bdev->blk_config;
+	struct disk_topology *t = &bdev->disk->topology;
+	u32 blk_size = disk_direct__block_size(bdev->disk);
+	u16 endian = bdev->vdev.endian;
+
+	if (virtio_blk__has_size_max(bdev))
+		conf->size_max = virtio_host_to_guest_u32(endian,
+							  t->max_seg_size);
+
+	if (!virtio_blk__has_topology(bdev))
+		return;
+
+	conf->physical_block_exp =
+		fls_long(max(t->phys_block_size, blk_size) / blk_size) - 1;
+	conf->alignment_offset = min_t(u32, t->alignment_offset / blk_size,
+				       UINT8_MAX);
+	conf->min_io_size = virtio_host_to_guest_u16(endian,
+				min_t(u32, t->min_io_size / blk_size, UINT16_MAX));
+	conf->opt_io_size = virtio_host_to_guest_u32(endian,
+						     t->opt_io_size / blk_size);
 }
 
 static void notify_status(struct kvm *kvm, void *dev, u32 status)
@@ -190,71 +446,292 @@ static void notify_status(struct kvm *kvm, void *dev, u32 status)
 		return;
 
 	conf->capacity = virtio_host_to_guest_u64(bdev->vdev.endian, bdev->capacity);
-	conf->seg_max = virtio_host_to_guest_u32(bdev->vdev.endian, DISK_SEG_MAX);
+	conf->seg_max = virtio_host_to_guest_u32(bdev->vdev.endian, bdev->seg_max);
+	conf->num_queues = virtio_host_to_guest_u16(bdev->vdev.endian,
+						    bdev->nr_queues);
+
+	conf->blk_size = virtio_host_to_guest_u32(bdev->vdev.endian,
+				disk_direct__block_size(bdev->disk));
+	virtio_blk__config_topology(bdev);
+
+	conf->max_discard_sectors = virtio_host_to_guest_u32(bdev->vdev.endian,
+					VIRTIO_BLK_MAX_DISCARD_SECTORS);
+	conf->max_discard_seg = virtio_host_to_guest_u32(bdev->vdev.endian,
+							 bdev->seg_max);
+	conf->discard_sector_alignment = virtio_host_to_guest_u32(bdev->vdev.endian,
+					max(bdev->disk->discard_sectors, 1U));
+	conf->max_write_zeroes_sectors = virtio_host_to_guest_u32(bdev->vdev.endian,
+					VIRTIO_BLK_MAX_DISCARD_SECTORS);
+	conf->max_write_zeroes_seg = virtio_host_to_guest_u32(bdev->vdev.endian,
+							      bdev->seg_max);
+	conf->write_zeroes_may_unmap = 1;
 }
 
-static void *virtio_blk_thread(void *dev)
+/* Spread pinned queues over the --io-affinity CPUs */
+static int virtio_blk__io_cpu(struct kvm *kvm, u32 queue)
+{
+	size_t size = CPU_ALLOC_SIZE(NR_CPUS);
+	int cpu, n;
+
+	n = queue % CPU_COUNT_S(size, kvm->cfg.io_affinity);
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		if (CPU_ISSET_S(cpu, size, kvm->cfg.io_affinity) && !n--)
+			return cpu;
+	}
+
+	return -1;
+}
+
+static void virtio_blk_set_affinity(struct blk_dev_queue *queue)
+{
+	cpu_set_t cpuset;
+
+	if (queue->cpu < 0) {
+		host_numa__bind_thread(queue->bdev->disk->numa_node);
+		return;
+	}
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(queue->cpu, &cpuset);
+	if (sched_setaffinity(0, sizeof(cpuset), &cpuset))
+		pr_warning("virtio-blk: unable to pin queue %u to CPU %d",
+			   queue->id, queue->cpu);
+}
+
+static void virtio_blk_resume(struct kvm *kvm, struct blk_dev_queue *queue)
+{
+	u64 expired;
+
+	if (read(queue->throttle_fd, &expired, sizeof(expired)) < 0)
+		return;
+
+	queue->throttled = false;
+	virtio_blk_do_io(kvm, queue);
+}
+
+/* Whether the guest kicked the queue through its ioeventfd */
+static bool virtio_blk_read_kicks(struct blk_dev_queue *queue)
 {
-	struct blk_dev *bdev = dev;
 	u64 data;
-	int r;
+
+	if (read(queue->kick_fd, &data, sizeof(u64)) <= 0)
+		return false;
+
+	virtio__account_kicks(&queue->bdev->vdev, queue->id, data);
+	return true;
+}
+
+static void *virtio_blk_thread(void *p)
+{
+	struct blk_dev_queue *queue = p;
+	/* poll() skips a negative kick_fd */
+	struct pollfd fds[3] = {
+		{ .fd = queue->io_efd,		.events = POLLIN },
+		{ .fd = queue->throttle_fd,	.events = POLLIN },
+		{ .fd = queue->kick_fd,		.events = POLLIN },
+	};
+	u64 data;
 
 	kvm__set_thread_name("virtio-blk-io");
+	virtio_blk_set_affinity(queue);
 
 	while (1) {
-		r = read(bdev->io_efd, &data, sizeof(u64));
-		if (r < 0)
+		if (poll(fds, ARRAY_SIZE(fds), -1) < 0)
 			continue;
-		virtio_blk_do_io(bdev->kvm, &bdev->vqs[0], bdev);
+		if (fds[1].revents & POLLIN)
+			virtio_blk_resume(queue->bdev->kvm, queue);
+		if ((fds[0].revents & POLLIN) &&
+		    read(queue->io_efd, &data, sizeof(u64)) > 0)
+			virtio_blk_do_io(queue->bdev->kvm, queue);
+		if ((fds[2].revents & POLLIN) && virtio_blk_read_kicks(queue))
+			virtio_blk_do_io(queue->bdev->kvm, queue);
 	}
 
 	pthread_exit(NULL);
 	return NULL;
 }
 
-static int init_vq(struct kvm *kvm, void *dev, u32 vq)
+static void virtio_blk_handle_io(struct kvm *kvm,
+				 struct iothread_handler *handler)
 {
-	unsigned int i;
-	struct blk_dev *bdev = dev;
+	struct blk_dev_queue *queue = container_of(handler,
+						   struct blk_dev_queue,
+						   io_handler);
+	u64 data;
 
-	compat__remove_message(compat_id);
+	if (read(queue->io_efd, &data, sizeof(u64)) < 0)
+		return;
 
-	virtio_init_device_vq(kvm, &bdev->vdev, &bdev->vqs[vq],
-			      VIRTIO_BLK_QUEUE_SIZE);
+	virtio_blk_do_io(kvm, queue);
+}
 
-	if (vq != 0)
-		return 0;
+static void virtio_blk_handle_kick(struct kvm *kvm,
+				   struct iothread_handler *handler)
+{
+	struct blk_dev_queue *queue = container_of(handler,
+						   struct blk_dev_queue,
+						   kick_handler);
+
+	if (virtio_blk_read_kicks(queue))
+		virtio_blk_do_io(kvm, queue);
+}
+
+static void virtio_blk_handle_throttle(struct kvm *kvm,
+				       struct iothread_handler *handler)
+{
+	struct blk_dev_queue *queue = container_of(handler,
+						   struct blk_dev_queue,
+						   throttle_handler);
+
+	virtio_blk_resume(kvm, queue);
+}
+
+/*
+ * The iovecs of a deep queue add up to a lot, but they come after the
+ * requests and only the pages where the guest's requests land get touched.
+ */
+static int virtio_blk_alloc_reqs(struct kvm *kvm, struct blk_dev_queue *queue)
+{
+	struct blk_dev *bdev = queue->bdev;
+	u32 i, num = queue->vq.vring.num;
+	u32 nr_iov = queue->vq.max_chain;
+	struct iovec *iov;
 
-	for (i = 0; i < ARRAY_SIZE(bdev->reqs); i++) {
-		bdev->reqs[i] = (struct blk_dev_req) {
+	queue->reqs = host_numa__zalloc(num * (sizeof(*queue->reqs) +
+						nr_iov * sizeof(*iov)),
+					bdev->disk->numa_node);
+	if (!queue->reqs)
+		return -ENOMEM;
+
+	iov = (struct iovec *)&queue->reqs[num];
+	for (i = 0; i < num; i++) {
+		queue->reqs[i] = (struct blk_dev_req) {
+			.queue = queue,
 			.bdev = bdev,
+			.iov = iov + i * nr_iov,
 			.kvm = kvm,
 		};
 	}
 
-	mutex_init(&bdev->mutex);
-	bdev->io_efd = eventfd(0, 0);
-	if (bdev->io_efd < 0)
-		return -errno;
+	return 0;
+}
+
+static void virtio_blk_put_kick_fd(struct blk_dev_queue *queue)
+{
+	if (queue->kick_fd >= 0)
+		close(queue->kick_fd);
+	queue->kick_fd = -1;
+}
+
+static int init_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct blk_dev *bdev = dev;
+	struct blk_dev_queue *queue = &bdev->queues[vq];
+	u32 size;
+	int r;
+
+	compat__remove_message(compat_id);
+
+	size = queue->size ?: virtio_vq__max_size(&bdev->vdev,
+						  bdev->queue_size);
+	virtio_init_device_vq(kvm, &bdev->vdev, &queue->vq, size);
+	queue->vq.max_chain = min(size, bdev->seg_max + 2);
+	virt_queue__batch_begin(&queue->batch, &queue->vq);
+
+	queue->bdev = bdev;
+	r = virtio_blk_alloc_reqs(kvm, queue);
+	if (r)
+		return r;
+
+	queue->id = vq;
+	mutex_init(&queue->mutex);
+	virtio_poll__init(&queue->poll, bdev->disk->poll_us);
+	queue->io_efd = eventfd(0, bdev->iothread >= 0 ? EFD_NONBLOCK : 0);
+	if (queue->io_efd < 0) {
+		r = -errno;
+		goto err_free_reqs;
+	}
+
+	queue->throttled = false;
+	queue->throttle_fd = timerfd_create(CLOCK_MONOTONIC,
+					    TFD_NONBLOCK | TFD_CLOEXEC);
+	if (queue->throttle_fd < 0) {
+		r = -errno;
+		goto err_close_efd;
+	}
 
-	if (pthread_create(&bdev->io_thread, NULL, virtio_blk_thread, bdev))
-		return -errno;
+	if (bdev->iothread >= 0) {
+		queue->io_handler = (struct iothread_handler) {
+			.fd	= queue->io_efd,
+			.handle	= virtio_blk_handle_io,
+		};
+		queue->throttle_handler = (struct iothread_handler) {
+			.fd	= queue->throttle_fd,
+			.handle	= virtio_blk_handle_throttle,
+		};
+		queue->kick_handler = (struct iothread_handler) {
+			.fd	= queue->kick_fd,
+			.handle	= virtio_blk_handle_kick,
+		};
+		r = iothread__add(bdev->iothread, &queue->io_handler);
+		if (!r) {
+			r = iothread__add(bdev->iothread,
+					  &queue->throttle_handler);
+			if (r)
+				iothread__del(&queue->io_handler);
+		}
+		if (!r && queue->kick_fd >= 0) {
+			r = iothread__add(bdev->iothread, &queue->kick_handler);
+			if (r) {
+				iothread__del(&queue->throttle_handler);
+				iothread__del(&queue->io_handler);
+			}
+		}
+	} else {
+		r = -kvm__start_device_thread(&queue->io_thread,
+					      virtio_blk_thread, queue);
+	}
+	if (r)
+		goto err_close_timer;
 
 	return 0;
+
+err_close_timer:
+	close(queue->throttle_fd);
+err_close_efd:
+	close(queue->io_efd);
+err_free_reqs:
+	virtio_blk_put_kick_fd(queue);
+	free(queue->reqs);
+	queue->reqs = NULL;
+	return r;
 }
 
 static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct blk_dev *bdev = dev;
+	struct blk_dev_queue *queue = &bdev->queues[vq];
+
+	if (bdev->iothread >= 0) {
+		iothread__del(&queue->io_handler);
+		iothread__del(&queue->throttle_handler);
+		if (queue->kick_fd >= 0)
+			iothread__del(&queue->kick_handler);
+		close(queue->io_efd);
+	} else {
+		close(queue->io_efd);
+		pthread_cancel(queue->io_thread);
+		pthread_join(queue->io_thread, NULL);
+	}
+	close(queue->throttle_fd);
+	virtio_blk_put_kick_fd(queue);
 
-	if (vq != 0)
-		return;
-
-	close(bdev->io_efd);
-	pthread_cancel(bdev->io_thread);
-	pthread_join(bdev->io_thread, NULL);
-
+	/* In-flight requests still point into queue->reqs */
 	disk_image__wait(bdev->disk);
+
+	free(queue->reqs);
+	queue->reqs = NULL;
+	queue->size = 0;
 }
 
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
@@ -263,35 +740,58 @@ static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
 	u64 data = 1;
 	int r;
 
-	r = write(bdev->io_efd, &data, sizeof(data));
+	r = write(bdev->queues[vq].io_efd, &data, sizeof(data));
 	if (r < 0)
 		return r;
 
 	return 0;
 }
 
+/*
+ * Called before init_vq() for the queues in direct_vqs. The transport closes
+ * its descriptor before calling exit_vq(), so the queue keeps its own.
+ */
+static void notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd)
+{
+	struct blk_dev *bdev = dev;
+	struct blk_dev_queue *queue = &bdev->queues[vq];
+
+	virtio_blk_put_kick_fd(queue);
+	queue->kick_fd = fcntl(efd, F_DUPFD_CLOEXEC, 0);
+	if (queue->kick_fd < 0)
+		die_perror("virtio-blk: dup(ioeventfd)");
+}
+
 static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct blk_dev *bdev = dev;
 
-	return &bdev->vqs[vq];
+	return &bdev->queues[vq].vq;
 }
 
 static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
 {
-	/* FIXME: dynamic */
-	return VIRTIO_BLK_QUEUE_SIZE;
+	struct blk_dev *bdev = dev;
+
+	return virtio_vq__max_size(&bdev->vdev, bdev->queue_size);
 }
 
 static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
 {
-	/* FIXME: dynamic */
-	return size;
+	struct blk_dev *bdev = dev;
+	struct blk_dev_queue *queue = &bdev->queues[vq];
+
+	queue->size = virtio_vq__accept_size(&bdev->vdev,
+					     get_size_vq(kvm, dev, vq), size);
+
+	return queue->size;
 }
 
 static unsigned int get_vq_count(struct kvm *kvm, void *dev)
 {
-	return NUM_VIRT_QUEUES;
+	struct blk_dev *bdev = dev;
+
+	return bdev->nr_queues;
 }
 
 static struct virtio_ops blk_dev_virtio_ops = {
@@ -303,14 +803,31 @@ static struct virtio_ops blk_dev_virtio_ops = {
 	.exit_vq		= exit_vq,
 	.notify_status		= notify_status,
 	.notify_vq		= notify_vq,
+	.notify_vq_eventfd	= notify_vq_eventfd,
 	.get_vq			= get_vq,
 	.get_size_vq		= get_size_vq,
 	.set_size_vq		= set_size_vq,
 };
 
+/*
+ * By default, give each vCPU its own request queue so that the guest's
+ * blk-mq layer can submit without cross-CPU contention.
+ */
+static u32 virtio_blk__nr_queues(struct kvm *kvm, struct disk_image *disk)
+{
+	int nr = disk->nr_queues;
+
+	if (nr <= 0)
+		nr = kvm->cfg.nrcpus;
+
+	return max(1, min(VIRTIO_BLK_MAX_QUEUES, nr));
+}
+
 static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 {
+	long nr_online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
 	struct blk_dev *bdev;
+	unsigned int i;
 	int r;
 
 	if (!disk)
@@ -323,10 +840,25 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 	*bdev = (struct blk_dev) {
 		.disk			= disk,
 		.capacity		= disk->size / SECTOR_SIZE,
+		.queue_size		= disk->queue_size ?: VIRTIO_BLK_QUEUE_SIZE,
+		.nr_queues		= virtio_blk__nr_queues(kvm, disk),
+		.iothread		= iothread__pick(kvm, disk->iothread),
 		.kvm			= kvm,
 	};
+	/* A chain can't be longer than the queue */
+	bdev->seg_max = min_t(u32, bdev->queue_size - 2, DISK_SEG_MAX);
+	ratelimit__init(&bdev->ratelimit, &disk->ratelimit);
+
+	for (i = 0; i < bdev->nr_queues; i++) {
+		bdev->queues[i].kick_fd = -1;
+		bdev->queues[i].cpu = -1;
+		if (disk->pin_queues && kvm->cfg.io_affinity)
+			bdev->queues[i].cpu = virtio_blk__io_cpu(kvm, i);
+		else if (disk->pin_queues && nr_online_cpus > 0)
+			bdev->queues[i].cpu = i % nr_online_cpus;
+	}
 
-	list_add_tail(&bdev->list, &bdevs);
+	list_add_tail(&bdev->list, &kvm->blk_devs);
 
 	r = virtio_init(kvm, bdev, &bdev->vdev, &blk_dev_virtio_ops,
 			kvm->cfg.virtio_transport, PCI_DEVICE_ID_VIRTIO_BLK,
@@ -334,7 +866,12 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 	if (r < 0)
 		return r;
 
+	/* The queue threads wait on the ioeventfds themselves */
+	bdev->vdev.direct_vqs = (1ULL << bdev->nr_queues) - 1;
+
 	disk_image__set_callback(bdev->disk, virtio_blk_complete);
+	disk_image__set_batch_callback(bdev->disk, virtio_blk_complete_batch,
+				       bdev);
 
 	if (compat_id == -1)
 		compat_id = virtio_compat_add_message("virtio-blk", "CONFIG_VIRTIO_BLK");
@@ -351,12 +888,41 @@ static int virtio_blk__exit_one(struct kvm *kvm, struct blk_dev *bdev)
 	return 0;
 }
 
+/* Change the limits of the n-th --disk, throttled queues resume right away */
+int virtio_blk__set_ratelimit(struct kvm *kvm, u32 n,
+			      struct ratelimit_params *params)
+{
+	struct blk_dev *bdev;
+	u32 i;
+
+	if ((int)n >= kvm->nr_disks)
+		return -ENODEV;
+
+	list_for_each_entry(bdev, &kvm->blk_devs, list) {
+		if (bdev->disk != kvm->disks[n])
+			continue;
+
+		ratelimit__set(&bdev->ratelimit, params);
+		for (i = 0; i < bdev->nr_queues; i++) {
+			if (bdev->queues[i].reqs &&
+			    __atomic_load_n(&bdev->queues[i].throttled,
+					    __ATOMIC_RELAXED))
+				ratelimit__arm(bdev->queues[i].throttle_fd, 0);
+		}
+		return 0;
+	}
+
+	/* Not a virtio-blk device */
+	return -EOPNOTSUPP;
+}
+
 int virtio_blk__init(struct kvm *kvm)
 {
 	int i, r = 0;
 
 	for (i = 0; i < kvm->nr_disks; i++) {
-		if (kvm->disks[i]->wwpn)
+		if (kvm->disks[i]->wwpn || kvm->disks[i]->vhost_user ||
+		    kvm->disks[i]->scsi)
 			continue;
 		r = virtio_blk__init_one(kvm, kvm->disks[i]);
 		if (r < 0)
@@ -372,10 +938,10 @@ virtio_dev_init(virtio_blk__init);
 
 int virtio_blk__exit(struct kvm *kvm)
 {
-	while (!list_empty(&bdevs)) {
+	while (!list_empty(&kvm->blk_devs)) {
 		struct blk_dev *bdev;
 
-		bdev = list_first_entry(&bdevs, struct blk_dev, list);
+		bdev = list_first_entry(&kvm->blk_devs, struct blk_dev, list);
 		virtio_blk__exit_one(kvm, bdev);
 	}
 
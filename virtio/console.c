@@ -11,12 +11,21 @@
 #include "kvm/threadpool.h"
 #include "kvm/irq.h"
 #include "kvm/guest_compat.h"
+#include "kvm/iovec.h"
+#include "kvm/strbuf.h"
+#include "kvm/parse-options.h"
 
 #include <linux/virtio_console.h>
 #include <linux/virtio_ring.h>
 #include <linux/virtio_blk.h>
+#include <linux/list.h>
+#include <linux/sizes.h>
 
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <termios.h>
@@ -24,28 +33,255 @@
 #include <fcntl.h>
 
 #define VIRTIO_CONSOLE_QUEUE_SIZE	128
-#define VIRTIO_CONSOLE_NUM_QUEUES	2
+/* Port 0, then the control queues, then the other ports */
+#define VIRTIO_CONSOLE_MAX_PORTS	8
+#define VIRTIO_CONSOLE_NUM_QUEUES	(2 + 2 * VIRTIO_CONSOLE_MAX_PORTS)
 #define VIRTIO_CONSOLE_RX_QUEUE		0
 #define VIRTIO_CONSOLE_TX_QUEUE		1
+#define VIRTIO_CONSOLE_CTRL_RX_QUEUE	2
+#define VIRTIO_CONSOLE_CTRL_TX_QUEUE	3
+
+/* Guest output waiting for a port's backend, a power of two */
+#define VIRTIO_CONSOLE_RING_SIZE	SZ_1M
+#define VIRTIO_CONSOLE_MAX_EVENTS	16
+
+enum con_backend {
+	CON_BACKEND_TERM,
+	CON_BACKEND_SOCKET,
+	CON_BACKEND_FILE,
+};
+
+/*
+ * A port hands guest output to a writer thread through a ring, so the TX
+ * queue is emptied at guest speed and a slow terminal or socket only holds
+ * up the guest once the ring is full.
+ */
+struct con_port {
+	u32				id;
+	const char			*name;
+	enum con_backend		backend;
+	const char			*path;
+	bool				used;
+
+	/* Protects everything below, and the fd against the writer */
+	struct mutex			lock;
+	pthread_cond_t			cond;
+	/* The socket client or the file, -1 if nobody is connected */
+	int				fd;
+	int				listen_fd;
+	bool				hangup;
+	bool				rx_wait;
+	bool				guest_ready;
+	u8				*ring;
+	u32				head;
+	u32				tail;
+	pthread_t			writer;
+
+	struct thread_pool__job		rx_job;
+	struct thread_pool__job		tx_job;
+};
+
+struct con_ctrl_msg {
+	struct list_head		list;
+	u32				id;
+	u16				event;
+	u16				value;
+	const char			*name;
+};
 
 struct con_dev {
 	struct mutex			mutex;
+	struct kvm			*kvm;
 
 	struct virtio_device		vdev;
 	struct virt_queue		vqs[VIRTIO_CONSOLE_NUM_QUEUES];
 	struct virtio_console_config	config;
 	int				vq_ready;
 
-	struct thread_pool__job		jobs[VIRTIO_CONSOLE_NUM_QUEUES];
+	struct con_port			ports[VIRTIO_CONSOLE_MAX_PORTS];
+	u32				nr_ports;
+
+	/* Control messages for the guest, protected by mutex */
+	struct list_head		ctrl_msgs;
+	struct thread_pool__job		ctrl_job;
+
+	/* Connections and input of the socket ports */
+	int				epoll_fd;
+	pthread_t			epoll_thread;
 };
 
 static struct con_dev cdev = {
 	.mutex				= MUTEX_INITIALIZER,
 	.vq_ready			= 0,
+	.nr_ports			= 1,
+	.ctrl_msgs			= LIST_HEAD_INIT(cdev.ctrl_msgs),
+	.epoll_fd			= -1,
 };
 
 static int compat_id = -1;
 
+static bool virtio_console__multiport(void)
+{
+	return cdev.nr_ports > 1;
+}
+
+static u32 con_port_vq(struct con_port *port, bool tx)
+{
+	return (port->id ? 2 + 2 * port->id : 0) + tx;
+}
+
+static struct con_port *con_vq_port(u32 vq)
+{
+	if (vq < VIRTIO_CONSOLE_CTRL_RX_QUEUE)
+		return &cdev.ports[0];
+	if (vq <= VIRTIO_CONSOLE_CTRL_TX_QUEUE)
+		return NULL;
+	return &cdev.ports[vq / 2 - 1];
+}
+
+static void con_flush_ctrl(struct kvm *kvm)
+{
+	struct virt_queue *vq = &cdev.vqs[VIRTIO_CONSOLE_CTRL_RX_QUEUE];
+	struct iovec iov[VIRTIO_CONSOLE_QUEUE_SIZE];
+	struct virtio_console_control ctrl;
+	struct con_ctrl_msg *msg;
+	u16 endian = cdev.vdev.endian;
+	bool used = false;
+	u16 out, in, head;
+	size_t len;
+
+	mutex_lock(&cdev.mutex);
+	while (vq->enabled && !list_empty(&cdev.ctrl_msgs) &&
+	       virt_queue__available(vq)) {
+		msg = list_first_entry(&cdev.ctrl_msgs, struct con_ctrl_msg, list);
+		list_del(&msg->list);
+
+		ctrl = (struct virtio_console_control) {
+			.id	= virtio_host_to_guest_u32(endian, msg->id),
+			.event	= virtio_host_to_guest_u16(endian, msg->event),
+			.value	= virtio_host_to_guest_u16(endian, msg->value),
+		};
+
+		head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+		len = min(sizeof(ctrl), iov_size(iov + out, in));
+		memcpy_toiovecend(iov + out, (void *)&ctrl, 0, len);
+		if (msg->name && len == sizeof(ctrl)) {
+			len += min(strlen(msg->name), iov_size(iov + out, in) - len);
+			memcpy_toiovecend(iov + out, (void *)msg->name,
+					  sizeof(ctrl), len - sizeof(ctrl));
+		}
+		virt_queue__set_used_elem(vq, head, len);
+		used = true;
+		free(msg);
+	}
+	mutex_unlock(&cdev.mutex);
+
+	if (used && virtio_queue__should_signal(vq))
+		cdev.vdev.ops->signal_vq(kvm, &cdev.vdev,
+					 VIRTIO_CONSOLE_CTRL_RX_QUEUE);
+}
+
+static void con_send_ctrl(struct kvm *kvm, u32 id, u16 event, u16 value,
+			  const char *name)
+{
+	struct con_ctrl_msg *msg;
+
+	if (!virtio_console__multiport())
+		return;
+
+	msg = malloc(sizeof(*msg));
+	if (!msg) {
+		pr_warning("virtio-console: dropping a control message");
+		return;
+	}
+
+	*msg = (struct con_ctrl_msg) {
+		.id	= id,
+		.event	= event,
+		.value	= value,
+		.name	= name,
+	};
+
+	mutex_lock(&cdev.mutex);
+	list_add_tail(&msg->list, &cdev.ctrl_msgs);
+	mutex_unlock(&cdev.mutex);
+
+	con_flush_ctrl(kvm);
+}
+
+static bool con_port_connected(struct con_port *port)
+{
+	return port->backend != CON_BACKEND_SOCKET || port->fd >= 0;
+}
+
+/* Tell the guest about a port it is ready to use */
+static void con_port_announce(struct kvm *kvm, struct con_port *port)
+{
+	bool connected;
+
+	mutex_lock(&port->lock);
+	port->guest_ready = true;
+	connected = con_port_connected(port) && !port->hangup;
+	mutex_unlock(&port->lock);
+
+	if (port->backend == CON_BACKEND_TERM)
+		con_send_ctrl(kvm, port->id, VIRTIO_CONSOLE_CONSOLE_PORT, 1, NULL);
+	else
+		con_send_ctrl(kvm, port->id, VIRTIO_CONSOLE_PORT_NAME, 1,
+			      port->name);
+
+	if (connected)
+		con_send_ctrl(kvm, port->id, VIRTIO_CONSOLE_PORT_OPEN, 1, NULL);
+}
+
+static void virtio_console_ctrl_callback(struct kvm *kvm, void *param)
+{
+	struct virt_queue *vq = param;
+	struct iovec iov[VIRTIO_CONSOLE_QUEUE_SIZE];
+	struct virtio_console_control ctrl;
+	u16 endian = cdev.vdev.endian;
+	struct con_port *port;
+	u16 out, in, head;
+	u32 id, i;
+
+	while (virt_queue__available(vq)) {
+		head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+		if (memcpy_fromiovecend((void *)&ctrl, iov, 0, sizeof(ctrl)) ||
+		    iov_size(iov, out) < sizeof(ctrl)) {
+			virt_queue__set_used_elem(vq, head, 0);
+			continue;
+		}
+		virt_queue__set_used_elem(vq, head, 0);
+
+		id = virtio_guest_to_host_u32(endian, ctrl.id);
+		port = id < cdev.nr_ports ? &cdev.ports[id] : NULL;
+
+		switch (virtio_guest_to_host_u16(endian, ctrl.event)) {
+		case VIRTIO_CONSOLE_DEVICE_READY:
+			if (!ctrl.value)
+				break;
+			for (i = 0; i < cdev.nr_ports; i++) {
+				if (cdev.ports[i].used)
+					con_send_ctrl(kvm, i, VIRTIO_CONSOLE_PORT_ADD,
+						      0, NULL);
+			}
+			break;
+		case VIRTIO_CONSOLE_PORT_READY:
+			if (port && port->used && ctrl.value)
+				con_port_announce(kvm, port);
+			break;
+		case VIRTIO_CONSOLE_PORT_OPEN:
+			/* Output is always accepted, open or not */
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (virtio_queue__should_signal(vq))
+		cdev.vdev.ops->signal_vq(kvm, &cdev.vdev, vq - cdev.vqs);
+}
+
 /*
  * Interrupts are injected for hvc0 only.
  */
@@ -53,6 +289,7 @@ static void virtio_console__inject_interrupt_callback(struct kvm *kvm, void *par
 {
 	struct iovec iov[VIRTIO_CONSOLE_QUEUE_SIZE];
 	struct virt_queue *vq;
+	bool signal = false;
 	u16 out, in;
 	u16 head;
 	int len;
@@ -61,49 +298,300 @@ static void virtio_console__inject_interrupt_callback(struct kvm *kvm, void *par
 
 	vq = param;
 
-	if (term_readable(0) && virt_queue__available(vq)) {
+	while (term_readable(0) && virt_queue__available(vq)) {
 		head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
 		len = term_getc_iov(kvm, iov, in, 0);
 		virt_queue__set_used_elem(vq, head, len);
-		cdev.vdev.ops->signal_vq(kvm, &cdev.vdev, vq - cdev.vqs);
+		signal = true;
 	}
 
+	if (signal)
+		cdev.vdev.ops->signal_vq(kvm, &cdev.vdev, vq - cdev.vqs);
+
+	/*
+	 * With buffers left, the terminal is drained and can be watched again.
+	 * Otherwise the next notification of the RX queue brings us back here.
+	 */
+	if (virt_queue__available(vq))
+		term_kick(0);
+
 	mutex_unlock(&cdev.mutex);
 }
 
-void virtio_console__inject_interrupt(struct kvm *kvm)
+static bool virtio_console__read_term(struct kvm *kvm, int term)
 {
 	if (kvm->cfg.active_console != CONSOLE_VIRTIO)
-		return;
+		return false;
 
 	mutex_lock(&cdev.mutex);
 	if (cdev.vq_ready)
-		thread_pool__do_job(&cdev.jobs[VIRTIO_CONSOLE_RX_QUEUE]);
+		thread_pool__do_job(&cdev.ports[0].rx_job);
 	mutex_unlock(&cdev.mutex);
+
+	return false;
+}
+
+static void con_port_rearm(struct con_port *port)
+{
+	struct epoll_event ev = {
+		.events		= EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+		.data.u64	= port->id,
+	};
+
+	if (epoll_ctl(cdev.epoll_fd, EPOLL_CTL_MOD, port->fd, &ev) < 0)
+		pr_warning("virtio-console: epoll_ctl failed with %d", errno);
+}
+
+/* Move socket input into the guest, as long as it has buffers for it */
+static void virtio_console_socket_rx_callback(struct kvm *kvm, void *param)
+{
+	struct con_port *port = param;
+	struct virt_queue *vq = &cdev.vqs[con_port_vq(port, false)];
+	struct iovec iov[VIRTIO_CONSOLE_QUEUE_SIZE];
+	bool used = false;
+	u16 out, in, head;
+	ssize_t r;
+	int avail;
+
+	mutex_lock(&port->lock);
+	port->rx_wait = false;
+	while (port->fd >= 0 && !port->hangup) {
+		/* Only take a buffer when there is something to put in it */
+		if (ioctl(port->fd, FIONREAD, &avail) < 0 || avail <= 0) {
+			con_port_rearm(port);
+			break;
+		}
+
+		if (!vq->enabled || !virt_queue__available(vq)) {
+			port->rx_wait = true;
+			break;
+		}
+
+		head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+		r = readv(port->fd, iov + out, in);
+		virt_queue__set_used_elem(vq, head, max_t(ssize_t, r, 0));
+		used = true;
+	}
+	mutex_unlock(&port->lock);
+
+	if (used)
+		cdev.vdev.ops->signal_vq(kvm, &cdev.vdev, vq - cdev.vqs);
+}
+
+/* Returns the bytes of guest output the ring took */
+static size_t con_port_queue(struct con_port *port, struct iovec *iov,
+			     int iovcnt, size_t len)
+{
+	size_t done = 0, n, off;
+
+	/* Port 0 when it isn't the console */
+	if (!port->used)
+		return len;
+
+	mutex_lock(&port->lock);
+	while (done < len && con_port_connected(port) && !port->hangup) {
+		n = VIRTIO_CONSOLE_RING_SIZE - (port->head - port->tail);
+		if (!n) {
+			pthread_cond_wait(&port->cond, &port->lock.mutex);
+			continue;
+		}
+
+		/* Up to the end of the ring, then around */
+		off = port->head & (VIRTIO_CONSOLE_RING_SIZE - 1);
+		n = min(n, min(len - done, VIRTIO_CONSOLE_RING_SIZE - off));
+		memcpy_fromiovecend(port->ring + off, iov, done, n);
+		port->head += n;
+		done += n;
+		pthread_cond_broadcast(&port->cond);
+	}
+	mutex_unlock(&port->lock);
+
+	return done;
 }
 
 static void virtio_console_handle_callback(struct kvm *kvm, void *param)
 {
 	struct iovec iov[VIRTIO_CONSOLE_QUEUE_SIZE];
-	struct virt_queue *vq;
+	struct con_port *port = param;
+	struct virt_queue *vq = &cdev.vqs[con_port_vq(port, true)];
+	bool used = false;
 	u16 out, in;
 	u16 head;
 	u32 len;
 
-	vq = param;
-
 	/*
 	 * The current Linux implementation polls for the buffer
 	 * to be used, rather than waiting for an interrupt.
-	 * So there is no need to inject an interrupt for the tx path.
+	 * Only non-blocking writes to the other ports need one.
 	 */
 
 	while (virt_queue__available(vq)) {
 		head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-		len = term_putc_iov(iov, out, 0);
+		len = con_port_queue(port, iov, out, iov_size(iov, out));
 		virt_queue__set_used_elem(vq, head, len);
+		used = true;
+	}
+
+	if (port->id && used && virtio_queue__should_signal(vq))
+		cdev.vdev.ops->signal_vq(kvm, &cdev.vdev, vq - cdev.vqs);
+}
+
+static ssize_t con_port_write(struct con_port *port, int fd,
+			      struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg = {
+		.msg_iov	= iov,
+		.msg_iovlen	= iovcnt,
+	};
+
+	switch (port->backend) {
+	case CON_BACKEND_TERM:
+		return term_putc_iov(iov, iovcnt, 0);
+	case CON_BACKEND_SOCKET:
+		return sendmsg(fd, &msg, MSG_NOSIGNAL);
+	default:
+		return writev(fd, iov, iovcnt);
+	}
+}
+
+/* Drain the ring, a writev() of up to two pieces at a time */
+static void *con_port_writer(void *param)
+{
+	struct con_port *port = param;
+	struct iovec iov[2];
+	u32 off, len;
+	ssize_t r;
+	int cnt, fd;
+
+	kvm__set_thread_name("virtio-con-out");
+
+	mutex_lock(&port->lock);
+	for (;;) {
+		if (port->hangup) {
+			/* The socket client went away, and its output with it */
+			close(port->fd);
+			port->fd = -1;
+			port->tail = port->head;
+			port->hangup = false;
+			pthread_cond_broadcast(&port->cond);
+			if (port->guest_ready) {
+				mutex_unlock(&port->lock);
+				con_send_ctrl(cdev.kvm, port->id,
+					      VIRTIO_CONSOLE_PORT_OPEN, 0, NULL);
+				mutex_lock(&port->lock);
+			}
+			continue;
+		}
+
+		if (port->head == port->tail) {
+			pthread_cond_wait(&port->cond, &port->lock.mutex);
+			continue;
+		}
+
+		off = port->tail & (VIRTIO_CONSOLE_RING_SIZE - 1);
+		len = port->head - port->tail;
+		iov[0].iov_base = port->ring + off;
+		iov[0].iov_len = min(len, VIRTIO_CONSOLE_RING_SIZE - off);
+		iov[1].iov_base = port->ring;
+		iov[1].iov_len = len - iov[0].iov_len;
+		cnt = iov[1].iov_len ? 2 : 1;
+		fd = port->fd;
+		mutex_unlock(&port->lock);
+
+		r = con_port_write(port, fd, iov, cnt);
+
+		mutex_lock(&port->lock);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			if (port->backend == CON_BACKEND_SOCKET && port->fd == fd) {
+				port->hangup = true;
+				continue;
+			}
+			pr_warning("virtio-console: port %u output lost", port->id);
+			r = len;
+		}
+		port->tail += r;
+		pthread_cond_broadcast(&port->cond);
+	}
+
+	return NULL;
+}
+
+static void con_port_accept(struct kvm *kvm, struct con_port *port)
+{
+	struct epoll_event ev = {
+		.events		= EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+		.data.u64	= port->id,
+	};
+	bool announce;
+	int fd;
+
+	fd = accept4(port->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	mutex_lock(&port->lock);
+	if (port->fd >= 0 || port->hangup) {
+		/* One client at a time */
+		mutex_unlock(&port->lock);
+		close(fd);
+		return;
+	}
+	port->fd = fd;
+	announce = port->guest_ready;
+	mutex_unlock(&port->lock);
+
+	if (epoll_ctl(cdev.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		pr_warning("virtio-console: epoll_ctl failed with %d", errno);
+
+	if (announce)
+		con_send_ctrl(kvm, port->id, VIRTIO_CONSOLE_PORT_OPEN, 1, NULL);
+}
+
+static void con_port_event(struct kvm *kvm, struct con_port *port, u32 events)
+{
+	if (!(events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP))) {
+		thread_pool__do_job(&port->rx_job);
+		return;
+	}
+
+	/* The writer closes the socket once it is done with it */
+	mutex_lock(&port->lock);
+	if (port->fd >= 0 && !port->hangup) {
+		epoll_ctl(cdev.epoll_fd, EPOLL_CTL_DEL, port->fd, NULL);
+		shutdown(port->fd, SHUT_RDWR);
+		port->hangup = true;
+		pthread_cond_broadcast(&port->cond);
+	}
+	mutex_unlock(&port->lock);
+}
+
+/* Listening sockets have the top bit set in their event data */
+#define CON_EPOLL_LISTEN	(1ULL << 63)
+
+static void *con_epoll_thread(void *param)
+{
+	struct epoll_event events[VIRTIO_CONSOLE_MAX_EVENTS];
+	struct kvm *kvm = param;
+	struct con_port *port;
+	int nfds, i;
+
+	kvm__set_thread_name("virtio-con-poll");
+
+	for (;;) {
+		nfds = epoll_wait(cdev.epoll_fd, events,
+				  VIRTIO_CONSOLE_MAX_EVENTS, -1);
+		for (i = 0; i < nfds; i++) {
+			port = &cdev.ports[events[i].data.u64 & ~CON_EPOLL_LISTEN];
+			if (events[i].data.u64 & CON_EPOLL_LISTEN)
+				con_port_accept(kvm, port);
+			else
+				con_port_event(kvm, port, events[i].events);
+		}
 	}
 
+	return NULL;
 }
 
 static u8 *get_config(struct kvm *kvm, void *dev)
@@ -122,25 +610,46 @@ static size_t get_config_size(struct kvm *kvm, void *dev)
 
 static u64 get_host_features(struct kvm *kvm, void *dev)
 {
-	return 1 << VIRTIO_F_ANY_LAYOUT;
+	return 1 << VIRTIO_F_ANY_LAYOUT |
+	       (virtio_console__multiport() ? 1 << VIRTIO_CONSOLE_F_MULTIPORT : 0);
 }
 
 static void notify_status(struct kvm *kvm, void *dev, u32 status)
 {
 	struct con_dev *cdev = dev;
 	struct virtio_console_config *conf = &cdev->config;
+	struct con_ctrl_msg *msg, *next;
+	u32 i;
+
+	if (status & VIRTIO__STATUS_STOP) {
+		/* The guest announces its ports again after a reset */
+		for (i = 0; i < cdev->nr_ports; i++) {
+			mutex_lock(&cdev->ports[i].lock);
+			cdev->ports[i].guest_ready = false;
+			mutex_unlock(&cdev->ports[i].lock);
+		}
+
+		mutex_lock(&cdev->mutex);
+		list_for_each_entry_safe(msg, next, &cdev->ctrl_msgs, list) {
+			list_del(&msg->list);
+			free(msg);
+		}
+		mutex_unlock(&cdev->mutex);
+	}
 
 	if (!(status & VIRTIO__STATUS_CONFIG))
 		return;
 
 	conf->cols = virtio_host_to_guest_u16(cdev->vdev.endian, 80);
 	conf->rows = virtio_host_to_guest_u16(cdev->vdev.endian, 24);
-	conf->max_nr_ports = virtio_host_to_guest_u32(cdev->vdev.endian, 1);
+	conf->max_nr_ports = virtio_host_to_guest_u32(cdev->vdev.endian,
+						      cdev->nr_ports);
 }
 
 static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct virt_queue *queue;
+	struct con_port *port;
 
 	BUG_ON(vq >= VIRTIO_CONSOLE_NUM_QUEUES);
 
@@ -150,10 +659,21 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 
 	virtio_init_device_vq(kvm, &cdev.vdev, queue, VIRTIO_CONSOLE_QUEUE_SIZE);
 
-	if (vq == VIRTIO_CONSOLE_TX_QUEUE) {
-		thread_pool__init_job(&cdev.jobs[vq], kvm, virtio_console_handle_callback, queue);
-	} else if (vq == VIRTIO_CONSOLE_RX_QUEUE) {
-		thread_pool__init_job(&cdev.jobs[vq], kvm, virtio_console__inject_interrupt_callback, queue);
+	port = con_vq_port(vq);
+	if (!port) {
+		if (vq == VIRTIO_CONSOLE_CTRL_TX_QUEUE)
+			thread_pool__init_job(&cdev.ctrl_job, kvm,
+					      virtio_console_ctrl_callback, queue);
+		return 0;
+	}
+
+	if (vq & 1) {
+		thread_pool__init_job(&port->tx_job, kvm, virtio_console_handle_callback, port);
+	} else if (port->id) {
+		thread_pool__init_job(&port->rx_job, kvm,
+				      virtio_console_socket_rx_callback, port);
+	} else {
+		thread_pool__init_job(&port->rx_job, kvm, virtio_console__inject_interrupt_callback, queue);
 		/* Tell the waiting poll thread that we're ready to go */
 		mutex_lock(&cdev.mutex);
 		cdev.vq_ready = 1;
@@ -165,21 +685,52 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 
 static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
 {
-	if (vq == VIRTIO_CONSOLE_RX_QUEUE) {
+	struct con_port *port = con_vq_port(vq);
+
+	if (!port) {
+		if (vq == VIRTIO_CONSOLE_CTRL_TX_QUEUE)
+			thread_pool__cancel_job(&cdev.ctrl_job);
+	} else if (vq == VIRTIO_CONSOLE_RX_QUEUE) {
 		mutex_lock(&cdev.mutex);
 		cdev.vq_ready = 0;
 		mutex_unlock(&cdev.mutex);
-		thread_pool__cancel_job(&cdev.jobs[vq]);
-	} else if (vq == VIRTIO_CONSOLE_TX_QUEUE) {
-		thread_pool__cancel_job(&cdev.jobs[vq]);
+		thread_pool__cancel_job(&port->rx_job);
+	} else if (vq & 1) {
+		thread_pool__cancel_job(&port->tx_job);
+	} else {
+		thread_pool__cancel_job(&port->rx_job);
 	}
 }
 
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
 {
-	struct con_dev *cdev = dev;
+	struct con_port *port = con_vq_port(vq);
+	bool rx_wait;
+
+	if (!port) {
+		if (vq == VIRTIO_CONSOLE_CTRL_RX_QUEUE)
+			con_flush_ctrl(kvm);
+		else
+			thread_pool__do_job(&cdev.ctrl_job);
+		return 0;
+	}
 
-	thread_pool__do_job(&cdev->jobs[vq]);
+	if (vq & 1) {
+		thread_pool__do_job(&port->tx_job);
+		return 0;
+	}
+
+	/* New buffers for input that was held back */
+	if (port->id) {
+		mutex_lock(&port->lock);
+		rx_wait = port->rx_wait;
+		mutex_unlock(&port->lock);
+		if (rx_wait)
+			thread_pool__do_job(&port->rx_job);
+		return 0;
+	}
+
+	thread_pool__do_job(&port->rx_job);
 
 	return 0;
 }
@@ -204,7 +755,7 @@ static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
 
 static unsigned int get_vq_count(struct kvm *kvm, void *dev)
 {
-	return VIRTIO_CONSOLE_NUM_QUEUES;
+	return virtio_console__multiport() ? 2 + 2 * cdev.nr_ports : 2;
 }
 
 static struct virtio_ops con_dev_virtio_ops = {
@@ -221,13 +772,152 @@ static struct virtio_ops con_dev_virtio_ops = {
 	.set_size_vq		= set_size_vq,
 };
 
+/* --console-port <name>,socket=<path> or <name>,file=<path> */
+int virtio_console_port_parser(const struct option *opt, const char *arg,
+			       int unset)
+{
+	struct con_port *port;
+	char *buf, *cur, *name, *param;
+
+	if (cdev.nr_ports >= VIRTIO_CONSOLE_MAX_PORTS)
+		die("At most %d virtio-console ports are supported",
+		    VIRTIO_CONSOLE_MAX_PORTS - 1);
+
+	buf = strdup(arg);
+	if (!buf)
+		die("out of memory");
+
+	cur = buf;
+	name = strsep(&cur, ",");
+	param = strsep(&cur, ",");
+	if (!name || !*name || !param || cur)
+		die("virtio-console ports need a name and a backend: <name>,socket=<path>|file=<path>");
+
+	port = &cdev.ports[cdev.nr_ports];
+	port->name = name;
+	if (!strncmp(param, "socket=", 7)) {
+		port->backend = CON_BACKEND_SOCKET;
+		port->path = param + 7;
+	} else if (!strncmp(param, "file=", 5)) {
+		port->backend = CON_BACKEND_FILE;
+		port->path = param + 5;
+	} else {
+		die("Unknown virtio-console port backend %s", param);
+	}
+
+	if (!*port->path)
+		die("virtio-console port %s needs a path", name);
+
+	port->used = true;
+	cdev.nr_ports++;
+
+	return 0;
+}
+
+static int con_port_listen(struct con_port *port)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct epoll_event ev = {
+		.events		= EPOLLIN,
+		.data.u64	= port->id | CON_EPOLL_LISTEN,
+	};
+	int fd, r;
+
+	if (strlcpy(addr.sun_path, port->path, sizeof(addr.sun_path)) >=
+	    sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	unlink(port->path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 1) < 0 ||
+	    epoll_ctl(cdev.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		r = -errno;
+		close(fd);
+		return r;
+	}
+
+	port->listen_fd = fd;
+	return 0;
+}
+
+static int con_port_init(struct kvm *kvm, struct con_port *port, u32 id)
+{
+	int r;
+
+	port->id = id;
+	port->fd = -1;
+	port->listen_fd = -1;
+	mutex_init(&port->lock);
+	pthread_cond_init(&port->cond, NULL);
+
+	if (!port->used)
+		return 0;
+
+	port->ring = malloc(VIRTIO_CONSOLE_RING_SIZE);
+	if (!port->ring)
+		return -ENOMEM;
+
+	switch (port->backend) {
+	case CON_BACKEND_SOCKET:
+		r = con_port_listen(port);
+		if (r < 0) {
+			pr_err("virtio-console: cannot listen on %s", port->path);
+			return r;
+		}
+		break;
+	case CON_BACKEND_FILE:
+		port->fd = open(port->path, O_WRONLY | O_CREAT | O_APPEND |
+				O_CLOEXEC, 0644);
+		if (port->fd < 0) {
+			pr_err("virtio-console: cannot open %s", port->path);
+			return -errno;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return -kvm__start_device_thread(&port->writer, con_port_writer, port);
+}
+
 int virtio_console__init(struct kvm *kvm)
 {
+	u32 i;
 	int r;
 
-	if (kvm->cfg.active_console != CONSOLE_VIRTIO)
+	if (kvm->cfg.active_console != CONSOLE_VIRTIO &&
+	    !virtio_console__multiport())
 		return 0;
 
+	cdev.kvm = kvm;
+
+	/* Without virtio as the console, port 0 is left out */
+	cdev.ports[0].backend = CON_BACKEND_TERM;
+	cdev.ports[0].used = kvm->cfg.active_console == CONSOLE_VIRTIO;
+
+	if (virtio_console__multiport()) {
+		cdev.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (cdev.epoll_fd < 0)
+			return -errno;
+	}
+
+	for (i = 0; i < cdev.nr_ports; i++) {
+		r = con_port_init(kvm, &cdev.ports[i], i);
+		if (r < 0)
+			return r;
+	}
+
+	if (cdev.epoll_fd >= 0) {
+		r = -kvm__start_device_thread(&cdev.epoll_thread,
+					      con_epoll_thread, kvm);
+		if (r < 0)
+			return r;
+	}
+
 	r = virtio_init(kvm, &cdev, &cdev.vdev, &con_dev_virtio_ops,
 			kvm->cfg.virtio_transport, PCI_DEVICE_ID_VIRTIO_CONSOLE,
 			VIRTIO_ID_CONSOLE, PCI_CLASS_CONSOLE);
@@ -237,14 +927,30 @@ int virtio_console__init(struct kvm *kvm)
 	if (compat_id == -1)
 		compat_id = virtio_compat_add_message("virtio-console", "CONFIG_VIRTIO_CONSOLE");
 
+	if (cdev.ports[0].used)
+		term_set_reader(0, virtio_console__read_term);
+
 	return 0;
 }
 virtio_dev_init(virtio_console__init);
 
 int virtio_console__exit(struct kvm *kvm)
 {
+	struct con_port *port;
+	u32 i;
+
+	if (kvm->cfg.active_console != CONSOLE_VIRTIO &&
+	    !virtio_console__multiport())
+		return 0;
+
 	virtio_exit(kvm, &cdev.vdev);
 
+	for (i = 0; i < cdev.nr_ports; i++) {
+		port = &cdev.ports[i];
+		if (port->backend == CON_BACKEND_SOCKET && port->listen_fd >= 0)
+			unlink(port->path);
+	}
+
 	return 0;
 }
 virtio_dev_exit(virtio_console__exit);
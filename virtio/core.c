@@ -1,15 +1,29 @@
+#include <linux/virtio_ids.h>
 #include <linux/virtio_ring.h>
+#include <linux/prefetch.h>
 #include <linux/types.h>
 #include <sys/uio.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "kvm/guest_compat.h"
+#include "kvm/boot-trace.h"
 #include "kvm/barrier.h"
 #include "kvm/virtio.h"
+#include "kvm/virtio-doorbell.h"
 #include "kvm/virtio-pci.h"
 #include "kvm/virtio-mmio.h"
 #include "kvm/util.h"
 #include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/read-write.h"
+#include "kvm/dirty-log.h"
+#include "kvm/metrics.h"
+#include "kvm/mutex.h"
+#include "kvm/probe.h"
 
 
 const char* virtio_trans_name(enum virtio_trans trans)
@@ -51,10 +65,293 @@ int virtio_transport_parser(const struct option *opt, const char *arg, int unset
 	return 0;
 }
 
+#define VIRTIO_CACHELINE_SIZE	64
+
+/* Indirect tables are read front to back right after they are found */
+static void virt_queue__prefetch_table(void *table, size_t len)
+{
+	size_t i;
+
+	if (!table)
+		return;
+
+	for (i = 0; i < len; i += VIRTIO_CACHELINE_SIZE)
+		prefetch(table + i);
+}
+
+static inline u16 packed_desc__flags(struct virt_queue *vq,
+				     struct vring_packed_desc *desc)
+{
+	return virtio_guest_to_host_u16(vq->endian, desc->flags);
+}
+
+static void packed_ring__advance(struct virt_queue *vq, u16 *idx, bool *wrap,
+				 u16 n)
+{
+	*idx += n;
+	if (*idx >= vq->vring.num) {
+		*idx -= vq->vring.num;
+		*wrap = !*wrap;
+	}
+}
+
+bool virt_queue__available_packed(struct virt_queue *vq)
+{
+	struct virt_queue_packed *pk = vq->packed;
+	u16 flags;
+
+	if (vq->use_event_idx && !vq->notify_disabled) {
+		pk->device->off_wrap = virtio_host_to_guest_u16(vq->endian,
+				vq->last_avail_idx |
+				pk->avail_wrap << VRING_PACKED_EVENT_F_WRAP_CTR);
+		/* Like avail_event, see virt_queue__available() */
+		mb();
+	}
+
+	flags = packed_desc__flags(vq, &pk->desc[vq->last_avail_idx]);
+
+	return !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL)) == pk->avail_wrap &&
+	       !!(flags & (1 << VRING_PACKED_DESC_F_USED)) != pk->avail_wrap;
+}
+
+u16 virt_queue__pop_packed(struct virt_queue *queue)
+{
+	struct virt_queue_packed *pk = queue->packed;
+	u16 pos = queue->last_avail_idx, idx = pos, num = 1, id;
+
+	/* Read the descriptors after their flags, see virt_queue__pop() */
+	rmb();
+
+	/* The buffer ID is in the last descriptor of the chain */
+	while ((packed_desc__flags(queue, &pk->desc[idx]) & VRING_DESC_F_NEXT) &&
+	       num < queue->vring.num) {
+		idx = (idx + 1) % queue->vring.num;
+		num++;
+	}
+
+	id = virtio_guest_to_host_u16(queue->endian, pk->desc[idx].id);
+	id %= queue->vring.num;
+
+	pk->popped[pk->nr_popped] = pos | pk->avail_wrap << 15;
+	pk->nr_popped = (pk->nr_popped + 1) % queue->vring.num;
+	pk->bufs[id] = (struct virt_queue_packed_buf) {
+		.pos	= pos,
+		.num	= num,
+	};
+
+	packed_ring__advance(queue, &queue->last_avail_idx, &pk->avail_wrap,
+			     num);
+
+	return id;
+}
+
+void virt_queue__unpop_packed(struct virt_queue *queue, u16 n)
+{
+	struct virt_queue_packed *pk = queue->packed;
+	u16 num = queue->vring.num;
+	u16 pos;
+
+	if (!n)
+		return;
+
+	pk->nr_popped = (pk->nr_popped + num - n % num) % num;
+	pos = pk->popped[pk->nr_popped];
+
+	queue->last_avail_idx = pos & ~(1 << 15);
+	pk->avail_wrap = pos >> 15;
+}
+
+/*
+ * Ask the guest not to notify us about new buffers, while we are processing
+ * the queue anyway. With VIRTIO_RING_F_EVENT_IDX, the avail event simply
+ * stays behind, so the guest may still notify once.
+ */
+void virt_queue__disable_notify(struct virt_queue *vq)
+{
+	u16 flags;
+
+	vq->notify_disabled = true;
+
+	if (vq->packed) {
+		dirty_log__mark(vq->packed->device, sizeof(*vq->packed->device));
+		vq->packed->device->flags = virtio_host_to_guest_u16(vq->endian,
+				VRING_PACKED_EVENT_FLAG_DISABLE);
+	} else if (!vq->use_event_idx) {
+		dirty_log__mark(vq->vring.used, sizeof(*vq->vring.used));
+		flags = virtio_guest_to_host_u16(vq->endian, vq->vring.used->flags);
+		vq->vring.used->flags = virtio_host_to_guest_u16(vq->endian,
+				flags | VRING_USED_F_NO_NOTIFY);
+	}
+}
+
+/*
+ * Let the guest notify us again before we wait for it. Returns true if
+ * buffers were added in the meantime, which the guest won't notify about.
+ */
+bool virt_queue__enable_notify(struct virt_queue *vq)
+{
+	u16 flags;
+
+	vq->notify_disabled = false;
+
+	if (vq->packed) {
+		dirty_log__mark(vq->packed->device, sizeof(*vq->packed->device));
+		vq->packed->device->flags = virtio_host_to_guest_u16(vq->endian,
+				vq->use_event_idx ? VRING_PACKED_EVENT_FLAG_DESC :
+						    VRING_PACKED_EVENT_FLAG_ENABLE);
+	} else if (!vq->use_event_idx) {
+		dirty_log__mark(vq->vring.used, sizeof(*vq->vring.used));
+		flags = virtio_guest_to_host_u16(vq->endian, vq->vring.used->flags);
+		vq->vring.used->flags = virtio_host_to_guest_u16(vq->endian,
+				flags & ~VRING_USED_F_NO_NOTIFY);
+	}
+
+	/*
+	 * Order the flags store before reading the ring. The avail event is
+	 * written, with the same barrier, by virt_queue__available().
+	 */
+	mb();
+
+	return virt_queue__available(vq);
+}
+
+/* The window a poll starts with, and under which it stops polling */
+#define VIRTIO_POLL_BASE_NS	10000
+
+void virtio_poll__init(struct virtio_poll *poll, u32 max_us)
+{
+	*poll = (struct virtio_poll) {
+		.max_ns	= (u64)max_us * 1000,
+	};
+}
+
+/* Return true if the queue got new buffers within the poll window */
+bool virtio_poll__spin(struct virtio_poll *poll, struct virt_queue *vq)
+{
+	u64 start, now;
+
+	if (!poll->max_ns)
+		return false;
+
+	start = now = kvm_cpu__now();
+	while (now - start < poll->window_ns) {
+		if (virt_queue__available(vq)) {
+			poll->idle_start = 0;
+			return true;
+		}
+		now = kvm_cpu__now();
+	}
+
+	poll->idle_start = start;
+	return false;
+}
+
+/* Called once the thread is notified again, after virtio_poll__spin() failed */
+void virtio_poll__woken(struct virtio_poll *poll)
+{
+	u64 base = min_t(u64, VIRTIO_POLL_BASE_NS, poll->max_ns);
+	u64 idle;
+
+	if (!poll->idle_start)
+		return;
+
+	idle = kvm_cpu__now() - poll->idle_start;
+	poll->idle_start = 0;
+
+	if (idle <= poll->max_ns) {
+		/* Polling a little longer would have avoided the wakeup */
+		poll->window_ns = min(max(poll->window_ns * 2, base),
+				      poll->max_ns);
+	} else if (poll->window_ns) {
+		poll->window_ns /= 2;
+		if (poll->window_ns < base)
+			poll->window_ns = 0;
+	}
+}
+
+/*
+ * Used descriptors of a batch are written as they come, except for the flags
+ * of the first one, which makes the whole batch visible to the guest.
+ */
+static void virt_queue__set_used_packed(struct virt_queue *queue, u32 head,
+					u32 len, u16 offset)
+{
+	struct virt_queue_packed *pk = queue->packed;
+	struct vring_packed_desc *desc;
+	u16 flags = 0;
+
+	if (!offset) {
+		pk->next_used = pk->used_idx;
+		pk->next_used_wrap = pk->used_wrap;
+	}
+
+	desc = &pk->desc[pk->next_used];
+	dirty_log__mark(desc, sizeof(*desc));
+	desc->id = virtio_host_to_guest_u16(queue->endian, head);
+	desc->len = virtio_host_to_guest_u32(queue->endian, len);
+
+	if (pk->next_used_wrap)
+		flags = 1 << VRING_PACKED_DESC_F_AVAIL |
+			1 << VRING_PACKED_DESC_F_USED;
+	flags = virtio_host_to_guest_u16(queue->endian, flags);
+
+	if (offset) {
+		wmb();
+		desc->flags = flags;
+	} else {
+		pk->first_used_flags = flags;
+	}
+
+	packed_ring__advance(queue, &pk->next_used, &pk->next_used_wrap,
+			     pk->bufs[head % queue->vring.num].num);
+}
+
+static void virt_queue__used_advance_packed(struct virt_queue *queue)
+{
+	struct virt_queue_packed *pk = queue->packed;
+
+	/* Publish the id and len of the batch along with its first element */
+	wmb();
+	pk->desc[pk->used_idx].flags = pk->first_used_flags;
+
+	pk->used_idx = pk->next_used;
+	pk->used_wrap = pk->next_used_wrap;
+}
+
+static bool virtio_queue__should_signal_packed(struct virt_queue *vq)
+{
+	struct virt_queue_packed *pk = vq->packed;
+	u16 old = pk->signalled_used, new = pk->used_idx;
+	bool valid = pk->signalled_used_valid;
+	u16 flags, off_wrap, event_idx;
+
+	pk->signalled_used = new;
+	pk->signalled_used_valid = true;
+
+	flags = virtio_guest_to_host_u16(vq->endian, pk->driver->flags);
+	if (flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+		return false;
+	if (flags != VRING_PACKED_EVENT_FLAG_DESC || !vq->use_event_idx)
+		return true;
+
+	off_wrap = virtio_guest_to_host_u16(vq->endian, pk->driver->off_wrap);
+	event_idx = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	if ((off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) != pk->used_wrap)
+		event_idx -= vq->vring.num;
+
+	return !valid || vring_need_event(event_idx, new, old);
+}
+
 void virt_queue__used_idx_advance(struct virt_queue *queue, u16 jump)
 {
-	u16 idx = virtio_guest_to_host_u16(queue->endian,
-					   queue->vring.used->idx);
+	u16 idx;
+
+	if (queue->packed) {
+		virt_queue__used_advance_packed(queue);
+		return;
+	}
+
+	idx = virtio_guest_to_host_u16(queue->endian, queue->vring.used->idx);
 
 	/*
 	 * Use wmb to assure that used elem was updated with head and len.
@@ -63,6 +360,7 @@ void virt_queue__used_idx_advance(struct virt_queue *queue, u16 jump)
 	 */
 	wmb();
 	idx += jump;
+	dirty_log__mark(queue->vring.used, sizeof(*queue->vring.used));
 	queue->vring.used->idx = virtio_host_to_guest_u16(queue->endian, idx);
 }
 
@@ -71,10 +369,19 @@ virt_queue__set_used_elem_no_update(struct virt_queue *queue, u32 head,
 				    u32 len, u16 offset)
 {
 	struct vring_used_elem *used_elem;
-	u16 idx = virtio_guest_to_host_u16(queue->endian, queue->vring.used->idx);
+	u16 idx;
+
+	kvm__probe(vq_push, queue, head, len);
 
+	if (queue->packed) {
+		virt_queue__set_used_packed(queue, head, len, offset);
+		return NULL;
+	}
+
+	idx = virtio_guest_to_host_u16(queue->endian, queue->vring.used->idx);
 	idx += offset;
 	used_elem	= &queue->vring.used->ring[idx % queue->vring.num];
+	dirty_log__mark(used_elem, sizeof(*used_elem));
 	used_elem->id	= virtio_host_to_guest_u32(queue->endian, head);
 	used_elem->len	= virtio_host_to_guest_u32(queue->endian, len);
 
@@ -117,12 +424,101 @@ static unsigned next_desc(struct virt_queue *vq, struct vring_desc *desc,
 	return min(next, max);
 }
 
+/* The descriptors of a packed ring buffer, in the ring or an indirect table */
+struct packed_chain {
+	struct vring_packed_desc	*desc;
+	u32				idx;
+	u32				left;
+	u32				wrap;
+};
+
+static void packed_chain__init(struct virt_queue *vq, struct packed_chain *chain,
+			       u16 head, struct kvm *kvm)
+{
+	struct virt_queue_packed_buf *buf = &vq->packed->bufs[head % vq->vring.num];
+	struct vring_packed_desc *desc = &vq->packed->desc[buf->pos];
+
+	if (packed_desc__flags(vq, desc) & VRING_DESC_F_INDIRECT) {
+		*chain = (struct packed_chain) {
+			.desc	= guest_flat_to_host(kvm,
+					virtio_guest_to_host_u64(vq->endian, desc->addr)),
+			.left	= virtio_guest_to_host_u32(vq->endian, desc->len) /
+				  sizeof(*desc),
+		};
+		chain->wrap = chain->left;
+		virt_queue__prefetch_table(chain->desc,
+					   chain->left * sizeof(*desc));
+	} else {
+		*chain = (struct packed_chain) {
+			.desc	= vq->packed->desc,
+			.idx	= buf->pos,
+			.left	= buf->num,
+			.wrap	= vq->vring.num,
+		};
+	}
+}
+
+static struct vring_packed_desc *packed_chain__next(struct packed_chain *chain)
+{
+	struct vring_packed_desc *desc;
+
+	if (!chain->left || !chain->desc)
+		return NULL;
+
+	desc = &chain->desc[chain->idx];
+	chain->idx = (chain->idx + 1) % chain->wrap;
+	chain->left--;
+
+	return desc;
+}
+
+static u16 virt_queue__get_packed_iov(struct virt_queue *vq,
+				      struct iovec in_iov[],
+				      struct iovec out_iov[], u16 *out, u16 *in,
+				      u16 head, struct kvm *kvm)
+{
+	struct vring_packed_desc *desc;
+	struct packed_chain chain;
+	struct iovec *iov;
+
+	*out = *in = 0;
+	packed_chain__init(vq, &chain, head, kvm);
+
+	while (*out + *in < vq->max_chain &&
+	       (desc = packed_chain__next(&chain))) {
+		/* Without a separate in_iov, everything goes to out_iov */
+		bool write = packed_desc__flags(vq, desc) & VRING_DESC_F_WRITE;
+
+		if (write) {
+			iov = in_iov ? &in_iov[*in] : &out_iov[*out + *in];
+			(*in)++;
+		} else {
+			iov = &out_iov[in_iov ? *out : *out + *in];
+			(*out)++;
+		}
+
+		iov->iov_len = virtio_guest_to_host_u32(vq->endian, desc->len);
+		iov->iov_base = guest_flat_to_host(kvm,
+				virtio_guest_to_host_u64(vq->endian, desc->addr));
+		if (write)
+			dirty_log__mark(iov->iov_base, iov->iov_len);
+	}
+
+	return head;
+}
+
 u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, u16 head, struct kvm *kvm)
 {
 	struct vring_desc *desc;
 	u16 idx;
 	u16 max;
 
+	kvm__probe(vq_pop, vq, head);
+
+	if (vq->packed)
+		return virt_queue__get_packed_iov(vq, NULL, iov, out, in, head,
+						  kvm);
+
 	idx = head;
 	*out = *in = 0;
 	max = vq->vring.num;
@@ -131,6 +527,7 @@ u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out
 	if (virt_desc__test_flag(vq, &desc[idx], VRING_DESC_F_INDIRECT)) {
 		max = virtio_guest_to_host_u32(vq->endian, desc[idx].len) / sizeof(struct vring_desc);
 		desc = guest_flat_to_host(kvm, virtio_guest_to_host_u64(vq->endian, desc[idx].addr));
+		virt_queue__prefetch_table(desc, max * sizeof(*desc));
 		idx = 0;
 	}
 
@@ -140,11 +537,15 @@ u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out
 		iov[*out + *in].iov_base = guest_flat_to_host(kvm,
 							      virtio_guest_to_host_u64(vq->endian, desc[idx].addr));
 		/* If this is an input descriptor, increment that count. */
-		if (virt_desc__test_flag(vq, &desc[idx], VRING_DESC_F_WRITE))
+		if (virt_desc__test_flag(vq, &desc[idx], VRING_DESC_F_WRITE)) {
+			dirty_log__mark(iov[*out + *in].iov_base,
+					iov[*out + *in].iov_len);
 			(*in)++;
-		else
+		} else {
 			(*out)++;
-	} while ((idx = next_desc(vq, desc, idx, max)) != max);
+		}
+	} while ((idx = next_desc(vq, desc, idx, max)) != max &&
+		 *out + *in < vq->max_chain);
 
 	return head;
 }
@@ -158,38 +559,68 @@ u16 virt_queue__get_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16
 	return virt_queue__get_head_iov(vq, iov, out, in, head, kvm);
 }
 
-/* in and out are relative to guest */
+/*
+ * in and out are relative to guest. The chain, including the descriptors of
+ * an indirect table, can't be longer than the queue, so the iovecs only need
+ * room for max_chain entries, vring.num at most.
+ */
 u16 virt_queue__get_inout_iov(struct kvm *kvm, struct virt_queue *queue,
 			      struct iovec in_iov[], struct iovec out_iov[],
 			      u16 *in, u16 *out)
 {
 	struct vring_desc *desc;
-	u16 head, idx;
+	unsigned int idx, max;
+	u16 head;
+	u64 addr;
+
+	head = virt_queue__pop(queue);
+	kvm__probe(vq_pop, queue, head);
+	if (queue->packed)
+		return virt_queue__get_packed_iov(queue, in_iov, out_iov, out,
+						  in, head, kvm);
 
-	idx = head = virt_queue__pop(queue);
 	*out = *in = 0;
+	idx = head;
+	max = queue->vring.num;
+	desc = queue->vring.desc;
+
+	if (virt_desc__test_flag(queue, &desc[idx], VRING_DESC_F_INDIRECT)) {
+		max = virtio_guest_to_host_u32(queue->endian, desc[idx].len) /
+		      sizeof(struct vring_desc);
+		desc = guest_flat_to_host(kvm,
+				virtio_guest_to_host_u64(queue->endian, desc[idx].addr));
+		virt_queue__prefetch_table(desc, max * sizeof(*desc));
+		idx = 0;
+	}
+
 	do {
-		u64 addr;
-		desc = virt_queue__get_desc(queue, idx);
-		addr = virtio_guest_to_host_u64(queue->endian, desc->addr);
-		if (virt_desc__test_flag(queue, desc, VRING_DESC_F_WRITE)) {
+		addr = virtio_guest_to_host_u64(queue->endian, desc[idx].addr);
+		if (virt_desc__test_flag(queue, &desc[idx], VRING_DESC_F_WRITE)) {
 			in_iov[*in].iov_base = guest_flat_to_host(kvm, addr);
-			in_iov[*in].iov_len = virtio_guest_to_host_u32(queue->endian, desc->len);
+			in_iov[*in].iov_len = virtio_guest_to_host_u32(queue->endian, desc[idx].len);
+			dirty_log__mark(in_iov[*in].iov_base, in_iov[*in].iov_len);
 			(*in)++;
 		} else {
 			out_iov[*out].iov_base = guest_flat_to_host(kvm, addr);
-			out_iov[*out].iov_len = virtio_guest_to_host_u32(queue->endian, desc->len);
+			out_iov[*out].iov_len = virtio_guest_to_host_u32(queue->endian, desc[idx].len);
 			(*out)++;
 		}
-		if (virt_desc__test_flag(queue, desc, VRING_DESC_F_NEXT))
-			idx = virtio_guest_to_host_u16(queue->endian, desc->next);
-		else
-			break;
-	} while (1);
+	} while ((idx = next_desc(queue, desc, idx, max)) != max &&
+		 *in + *out < queue->max_chain);
 
 	return head;
 }
 
+void virtio_vq__attach_stats(struct kvm *kvm, struct virtio_device *vdev,
+			     u32 vq)
+{
+	struct virt_queue *queue = vdev->ops->get_vq(kvm, vdev->dev, vq);
+
+	if (queue)
+		queue->stats = vq < VIRTIO_STATS_MAX_VQ ?
+			       &vdev->vq_stats[vq] : NULL;
+}
+
 void virtio_init_device_vq(struct kvm *kvm, struct virtio_device *vdev,
 			   struct virt_queue *vq, size_t nr_descs)
 {
@@ -199,8 +630,39 @@ void virtio_init_device_vq(struct kvm *kvm, struct virtio_device *vdev,
 	vq->use_event_idx	= (vdev->features & (1UL << VIRTIO_RING_F_EVENT_IDX));
 	vq->enabled		= true;
 	vq->vdev		= vdev;
+	vq->max_chain		= nr_descs;
+
+	free(vq->packed);
+	vq->packed = NULL;
 
-	if (addr->legacy) {
+	if (vdev->features & (1ULL << VIRTIO_F_RING_PACKED)) {
+		u64 desc = (u64)addr->desc_hi << 32 | addr->desc_lo;
+		u64 driver = (u64)addr->avail_hi << 32 | addr->avail_lo;
+		u64 device = (u64)addr->used_hi << 32 | addr->used_lo;
+		struct virt_queue_packed *pk;
+
+		pk = calloc(1, sizeof(*pk) + nr_descs *
+			    (sizeof(pk->bufs[0]) + sizeof(pk->popped[0])));
+		if (!pk)
+			die("Couldn't allocate packed virtqueue state");
+
+		pk->desc	= guest_flat_to_host(kvm, desc);
+		pk->driver	= guest_flat_to_host(kvm, driver);
+		pk->device	= guest_flat_to_host(kvm, device);
+		pk->popped	= (u16 *)&pk->bufs[nr_descs];
+		pk->avail_wrap	= true;
+		pk->used_wrap	= true;
+
+		pk->device->flags = virtio_host_to_guest_u16(vq->endian,
+				vq->use_event_idx ? VRING_PACKED_EVENT_FLAG_DESC :
+						    VRING_PACKED_EVENT_FLAG_ENABLE);
+
+		vq->last_avail_idx = 0;
+		vq->vring = (struct vring) {
+			.num	= nr_descs,
+		};
+		vq->packed = pk;
+	} else if (addr->legacy) {
 		unsigned long base = (u64)addr->pfn * addr->pgsize;
 		void *p = guest_flat_to_host(kvm, base);
 
@@ -219,6 +681,49 @@ void virtio_init_device_vq(struct kvm *kvm, struct virtio_device *vdev,
 	}
 }
 
+/* Of a qsize= option, 0 standing for the default of the device */
+int virtio_vq__check_size(u32 size)
+{
+	if (!size)
+		return 0;
+	if (size < 4 || size > VIRTIO_PACKED_QUEUE_MAX_SIZE ||
+	    (size & (size - 1)))
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * The queue size offered to the driver, out of the @size the device was
+ * configured with. Drivers read it once the features are negotiated, and only
+ * packed rings may go beyond VIRTIO_QUEUE_MAX_SIZE.
+ */
+u32 virtio_vq__max_size(struct virtio_device *vdev, u32 size)
+{
+	if (vdev->features & (1ULL << VIRTIO_F_RING_PACKED))
+		return size;
+
+	return min_t(u32, size, VIRTIO_QUEUE_MAX_SIZE);
+}
+
+/*
+ * What a device keeps of the queue size the driver wrote. Split rings must be
+ * a power of two, and the ring then has @max entries as if it never asked.
+ */
+u32 virtio_vq__accept_size(struct virtio_device *vdev, u32 max, int size)
+{
+	bool packed = vdev->features & (1ULL << VIRTIO_F_RING_PACKED);
+
+	if (size <= 0 || (u32)size > max ||
+	    (!packed && (size & (size - 1)))) {
+		pr_warning("Ignoring the queue size %d of the driver, using %u",
+			   size, max);
+		return max;
+	}
+
+	return size;
+}
+
 void virtio_exit_vq(struct kvm *kvm, struct virtio_device *vdev,
 			   void *dev, int num)
 {
@@ -226,9 +731,38 @@ void virtio_exit_vq(struct kvm *kvm, struct virtio_device *vdev,
 
 	if (vq->enabled && vdev->ops->exit_vq)
 		vdev->ops->exit_vq(kvm, dev, num);
+	free(vq->packed);
 	memset(vq, 0, sizeof(*vq));
 }
 
+/*
+ * Queue notifications that have no ioeventfd trap to userspace, and the
+ * transport calls notify_vq() itself. That only works for queues handled in
+ * userspace, and --ioeventfd=strict forbids it altogether.
+ */
+void virtio_ioeventfd_failed(struct kvm *kvm, struct virtio_device *vdev,
+			     u32 vq, int err)
+{
+	bool kernel_poll = vdev->use_vhost && !(vdev->user_vqs & (1ULL << vq));
+
+	if (kvm->cfg.ioeventfd_strict || kernel_poll)
+		die("Unable to add ioeventfd for vq %u: %s", vq, strerror(-err));
+
+	pr_warning("Unable to add ioeventfd for vq %u (%s), notifications will trap",
+		   vq, strerror(-err));
+}
+
+u64 virtio_modern_features(struct virtio_device *vdev)
+{
+	u64 features = 1ULL << VIRTIO_F_VERSION_1;
+
+	/* vhost only handles split rings */
+	if (!vdev->use_vhost)
+		features |= 1ULL << VIRTIO_F_RING_PACKED;
+
+	return features;
+}
+
 int virtio__get_dev_specific_field(int offset, bool msix, u32 *config_off)
 {
 	if (msix) {
@@ -243,7 +777,7 @@ int virtio__get_dev_specific_field(int offset, bool msix, u32 *config_off)
 	return VIRTIO_PCI_O_CONFIG;
 }
 
-bool virtio_queue__should_signal(struct virt_queue *vq)
+static bool virtio_queue__needs_signal(struct virt_queue *vq)
 {
 	u16 old_idx, new_idx, event_idx;
 
@@ -255,6 +789,9 @@ bool virtio_queue__should_signal(struct virt_queue *vq)
 	 */
 	mb();
 
+	if (vq->packed)
+		return virtio_queue__should_signal_packed(vq);
+
 	if (!vq->use_event_idx) {
 		/*
 		 * When VIRTIO_RING_F_EVENT_IDX isn't negotiated, interrupt the
@@ -276,6 +813,37 @@ bool virtio_queue__should_signal(struct virt_queue *vq)
 	return false;
 }
 
+bool virtio_queue__should_signal(struct virt_queue *vq)
+{
+	bool signal = virtio_queue__needs_signal(vq);
+
+	if (!signal && vq->stats)
+		virtio__stats_add(&vq->stats->suppressed, 1);
+
+	return signal;
+}
+
+/* Returns the number of used elements that the guest can now see */
+u16 virt_queue__batch_publish(struct virt_queue_batch *batch)
+{
+	u16 nr = batch->nr;
+
+	if (nr)
+		virt_queue__used_idx_advance(batch->vq, nr);
+	batch->nr = 0;
+
+	return nr;
+}
+
+/* Publish the batch, and tell whether the guest wants an interrupt for it */
+bool virt_queue__batch_commit(struct virt_queue_batch *batch)
+{
+	if (!virt_queue__batch_publish(batch))
+		return false;
+
+	return virtio_queue__should_signal(batch->vq);
+}
+
 void virtio_set_guest_features(struct kvm *kvm, struct virtio_device *vdev,
 			       void *dev, u64 features)
 {
@@ -284,6 +852,8 @@ void virtio_set_guest_features(struct kvm *kvm, struct virtio_device *vdev,
 	vdev->features |= features;
 }
 
+static const char *virtio__name(int subsys_id);
+
 void virtio_notify_status(struct kvm *kvm, struct virtio_device *vdev,
 			  void *dev, u8 status)
 {
@@ -298,6 +868,11 @@ void virtio_notify_status(struct kvm *kvm, struct virtio_device *vdev,
 		vdev->status |= VIRTIO__STATUS_START;
 		ext_status |= VIRTIO__STATUS_START;
 
+		if (boot_trace_enabled)
+			boot_trace__mark("virtio", "virtio-%s%d DRIVER_OK",
+					 virtio__name(vdev->subsys_id),
+					 vdev->index);
+
 	} else if (!status && (vdev->status & VIRTIO__STATUS_START)) {
 		vdev->status &= ~VIRTIO__STATUS_START;
 		ext_status |= VIRTIO__STATUS_STOP;
@@ -350,9 +925,297 @@ bool virtio_access_config(struct kvm *kvm, struct virtio_device *vdev,
 		return false;
 	}
 
+	if (is_write && vdev->ops->set_config)
+		vdev->ops->set_config(kvm, dev, offset, size);
+
 	return true;
 }
 
+bool virtio_frozen;
+static u64 virtio_freeze_deadline;
+
+/*
+ * Keep devices from taking requests off their queues, for a snapshot:
+ * virt_queue__available() reports them empty until virtio__thaw(). The
+ * requests they already took have until @timeout_ms from now to complete.
+ */
+void virtio__freeze(struct kvm *kvm, int timeout_ms)
+{
+	virtio_frozen = true;
+	mb();
+	virtio_freeze_deadline = kvm_cpu__now() + timeout_ms * 1000000ULL;
+}
+
+void virtio__thaw(struct kvm *kvm)
+{
+	virtio_frozen = false;
+	wmb();
+}
+
+static bool virtio_vq__idle(struct virt_queue *vq)
+{
+	struct virt_queue_packed *pk = vq->packed;
+	u16 used_idx;
+
+	if (!vq->enabled)
+		return true;
+
+	if (pk)
+		return pk->used_idx == vq->last_avail_idx &&
+		       pk->used_wrap == pk->avail_wrap;
+
+	used_idx = virtio_guest_to_host_u16(vq->endian, vq->vring.used->idx);
+
+	return used_idx == vq->last_avail_idx;
+}
+
+/* Wait for a frozen device to complete the requests it took */
+bool virtio__wait_idle(struct kvm *kvm, struct virtio_device *vdev, void *dev)
+{
+	unsigned int i, nr = vdev->ops->get_vq_count(kvm, dev);
+
+	for (;;) {
+		for (i = 0; i < nr; i++)
+			if (!virtio_vq__idle(vdev->ops->get_vq(kvm, dev, i)))
+				break;
+
+		if (i == nr)
+			return true;
+
+		if (kvm_cpu__now() >= virtio_freeze_deadline)
+			return false;
+
+		usleep(1000);
+	}
+}
+
+void virtio_vq__save_state(struct virt_queue *vq, struct virtio_vq_state *state)
+{
+	struct virt_queue_packed *pk = vq->packed;
+
+	*state = (struct virtio_vq_state) {
+		.enabled		= vq->enabled,
+		.size			= vq->vring.num,
+		.addr			= vq->vring_addr,
+		.last_avail_idx		= vq->last_avail_idx,
+		.last_used_signalled	= vq->last_used_signalled,
+	};
+
+	if (pk) {
+		state->used_idx			= pk->used_idx;
+		state->signalled_used		= pk->signalled_used;
+		state->avail_wrap		= pk->avail_wrap;
+		state->used_wrap		= pk->used_wrap;
+		state->signalled_used_valid	= pk->signalled_used_valid;
+	}
+}
+
+/* Once the queue is set up again, pick up where the device left off */
+void virtio_vq__restore_state(struct virt_queue *vq,
+			      struct virtio_vq_state *state)
+{
+	struct virt_queue_packed *pk = vq->packed;
+
+	vq->last_avail_idx	= state->last_avail_idx;
+	vq->last_used_signalled	= state->last_used_signalled;
+
+	if (pk) {
+		pk->used_idx = pk->next_used	= state->used_idx;
+		pk->used_wrap = pk->next_used_wrap = state->used_wrap;
+		pk->avail_wrap			= state->avail_wrap;
+		pk->signalled_used		= state->signalled_used;
+		pk->signalled_used_valid	= state->signalled_used_valid;
+	}
+}
+
+static LIST_HEAD(virtio_devices);
+static DEFINE_MUTEX(virtio_devices_lock);
+
+static const char *virtio__name(int subsys_id)
+{
+	switch (subsys_id) {
+	case VIRTIO_ID_NET:		return "net";
+	case VIRTIO_ID_BLOCK:		return "blk";
+	case VIRTIO_ID_CONSOLE:		return "console";
+	case VIRTIO_ID_RNG:		return "rng";
+	case VIRTIO_ID_BALLOON:		return "balloon";
+	case VIRTIO_ID_9P:		return "9p";
+	case VIRTIO_ID_SCSI:		return "scsi";
+	case VIRTIO_ID_GPU:		return "gpu";
+	case VIRTIO_ID_VSOCK:		return "vsock";
+	case VIRTIO_ID_FS:		return "fs";
+	default:			return "unknown";
+	}
+}
+
+static void virtio__sample_vqs(struct kvm *kvm, struct metrics *m,
+			       size_t offset)
+{
+	struct virtio_device *vdev;
+	unsigned int vq, nr;
+
+	list_for_each_entry(vdev, &virtio_devices, list) {
+		nr = min_t(unsigned int, VIRTIO_STATS_MAX_VQ,
+			   vdev->ops->get_vq_count(kvm, vdev->dev));
+		for (vq = 0; vq < nr; vq++)
+			metrics__sample(m, *(u64 *)((void *)&vdev->vq_stats[vq] +
+						    offset),
+					"device=\"%s%d\",queue=\"%u\"",
+					virtio__name(vdev->subsys_id),
+					vdev->index, vq);
+	}
+}
+
+static void virtio__collect_metrics(struct kvm *kvm, struct metrics *m)
+{
+	mutex_lock(&virtio_devices_lock);
+	metrics__family(m, "virtqueue_kicks_total", "counter",
+			"Notifications from the guest, per virtqueue");
+	virtio__sample_vqs(kvm, m, offsetof(struct virtio_vq_stats, kicks));
+
+	metrics__family(m, "virtqueue_irqs_total", "counter",
+			"Interrupts sent to the guest, per virtqueue");
+	virtio__sample_vqs(kvm, m, offsetof(struct virtio_vq_stats, irqs));
+
+	metrics__family(m, "virtqueue_requests_total", "counter",
+			"Buffers popped from each virtqueue");
+	virtio__sample_vqs(kvm, m, offsetof(struct virtio_vq_stats, pops));
+
+	metrics__family(m, "virtqueue_suppressed_irqs_total", "counter",
+			"Interrupts the guest didn't want, per virtqueue");
+	virtio__sample_vqs(kvm, m, offsetof(struct virtio_vq_stats, suppressed));
+
+	metrics__family(m, "virtqueue_avail_depth_sum", "counter",
+			"Buffers available at each pop of a split ring");
+	virtio__sample_vqs(kvm, m, offsetof(struct virtio_vq_stats,
+					    avail_total));
+
+	metrics__family(m, "virtqueue_avail_depth_count", "counter",
+			"Pops of a split ring that sampled its depth");
+	virtio__sample_vqs(kvm, m, offsetof(struct virtio_vq_stats,
+					    avail_samples));
+
+	metrics__family(m, "virtqueue_avail_depth_max", "gauge",
+			"Most buffers available at a pop of a split ring");
+	virtio__sample_vqs(kvm, m, offsetof(struct virtio_vq_stats, avail_max));
+	mutex_unlock(&virtio_devices_lock);
+}
+
+/* Of all the queues of all devices, up to VIRTIO_STATS_MAX_VQ each */
+static void virtio__handle_vq_stats(struct kvm *kvm, int fd, u32 type,
+				    u32 len, u8 *msg)
+{
+	struct virtio_vq_stats_msg *reply = NULL, *tmp;
+	struct virtio_device *vdev;
+	unsigned int vq, nr_vqs;
+	u32 nr = 0;
+
+	if (WARN_ON(type != KVM_IPC_VQ_STATS || len))
+		return;
+
+	mutex_lock(&virtio_devices_lock);
+	list_for_each_entry(vdev, &virtio_devices, list) {
+		nr_vqs = min_t(unsigned int, VIRTIO_STATS_MAX_VQ,
+			       vdev->ops->get_vq_count(kvm, vdev->dev));
+		tmp = realloc(reply, (nr + nr_vqs) * sizeof(*reply));
+		if (!tmp) {
+			nr = 0;
+			break;
+		}
+
+		reply = tmp;
+		for (vq = 0; vq < nr_vqs; vq++, nr++) {
+			memset(&reply[nr], 0, sizeof(reply[nr]));
+			snprintf(reply[nr].device, sizeof(reply[nr].device),
+				 "%s%d", virtio__name(vdev->subsys_id),
+				 vdev->index);
+			reply[nr].queue = vq;
+			reply[nr].stats = vdev->vq_stats[vq];
+		}
+	}
+	mutex_unlock(&virtio_devices_lock);
+
+	if (write_in_full(fd, &nr, sizeof(nr)) < 0 ||
+	    write_in_full(fd, reply, nr * sizeof(*reply)) < 0)
+		pr_warning("Failed sending virtqueue stats");
+
+	free(reply);
+}
+
+static struct metrics_collector virtio__metrics = {
+	.collect	= virtio__collect_metrics,
+};
+
+/* For the doorbell device, which looks devices up by their word */
+static struct virtio_device *virtio_doorbells[VIRTIO_DOORBELL_MAX_DEVICES];
+static u32 virtio_nr_doorbells;
+
+struct virtio_device *virtio__find_doorbell(u32 doorbell)
+{
+	if (doorbell >= VIRTIO_DOORBELL_MAX_DEVICES)
+		return NULL;
+
+	return __atomic_load_n(&virtio_doorbells[doorbell], __ATOMIC_ACQUIRE);
+}
+
+static void virtio__add_device(void *dev, struct virtio_device *vdev,
+			       int subsys_id)
+{
+	static bool registered;
+	struct virtio_device *pos;
+
+	vdev->dev = dev;
+	vdev->subsys_id = subsys_id;
+	vdev->index = 0;
+	vdev->doorbell = virtio_nr_doorbells++;
+	if (vdev->doorbell < VIRTIO_DOORBELL_MAX_DEVICES)
+		__atomic_store_n(&virtio_doorbells[vdev->doorbell], vdev,
+				 __ATOMIC_RELEASE);
+
+	/* Devices are created by the init thread only */
+	if (!registered) {
+		metrics__register(&virtio__metrics);
+		kvm_ipc__register_handler(KVM_IPC_VQ_STATS,
+					  virtio__handle_vq_stats);
+		registered = true;
+	}
+
+	mutex_lock(&virtio_devices_lock);
+	list_for_each_entry(pos, &virtio_devices, list) {
+		if (pos->subsys_id == subsys_id)
+			vdev->index++;
+	}
+	list_add_tail(&vdev->list, &virtio_devices);
+	mutex_unlock(&virtio_devices_lock);
+}
+
+/* Multi-queue devices, that a single interrupt serializes */
+#define VIRTIO_MMIO_SHARED_IRQ_VQS	4
+
+/*
+ * virtio-mmio has one wired interrupt per device, and its handler reads the
+ * interrupt status, an MMIO exit. There's no MSI for it in the guest drivers,
+ * virtio-pci has a vector per queue through the ITS, GICv2m or IMSIC.
+ */
+static void virtio_mmio__warn_shared_irq(struct kvm *kvm, void *dev,
+					 struct virtio_device *vdev)
+{
+	static bool warned;
+	unsigned int nr_vqs;
+
+	if (warned || !vdev->ops->get_vq_count)
+		return;
+
+	nr_vqs = vdev->ops->get_vq_count(kvm, dev);
+	if (nr_vqs < VIRTIO_MMIO_SHARED_IRQ_VQS)
+		return;
+
+	pr_warning("virtio-mmio: the %u queues of a device share an interrupt, "
+		   "--virtio-transport pci gives each its own MSI-X vector",
+		   nr_vqs);
+	warned = true;
+}
+
 int virtio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 		struct virtio_ops *ops, enum virtio_trans trans,
 		int device_id, int subsys_id, int class)
@@ -360,6 +1223,8 @@ int virtio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 	void *virtio;
 	int r;
 
+	vdev->trans = trans;
+
 	switch (trans) {
 	case VIRTIO_PCI_LEGACY:
 		vdev->legacy			= true;
@@ -372,6 +1237,7 @@ int virtio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 		vdev->ops			= ops;
 		vdev->ops->signal_vq		= virtio_pci__signal_vq;
 		vdev->ops->signal_config	= virtio_pci__signal_config;
+		vdev->ops->get_irq_line		= virtio_pci__get_irq_line;
 		vdev->ops->init			= virtio_pci__init;
 		vdev->ops->exit			= virtio_pci__exit;
 		vdev->ops->reset		= virtio_pci__reset;
@@ -388,20 +1254,36 @@ int virtio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 		vdev->ops			= ops;
 		vdev->ops->signal_vq		= virtio_mmio_signal_vq;
 		vdev->ops->signal_config	= virtio_mmio_signal_config;
+		vdev->ops->get_irq_line		= virtio_mmio_get_irq_line;
 		vdev->ops->init			= virtio_mmio_init;
 		vdev->ops->exit			= virtio_mmio_exit;
 		vdev->ops->reset		= virtio_mmio_reset;
 		r = vdev->ops->init(kvm, dev, vdev, device_id, subsys_id, class);
+		if (!r)
+			virtio_mmio__warn_shared_irq(kvm, dev, vdev);
 		break;
 	default:
 		r = -1;
 	};
 
+	if (!r)
+		virtio__add_device(dev, vdev, subsys_id);
+
 	return r;
 }
 
 void virtio_exit(struct kvm *kvm, struct virtio_device *vdev)
 {
+	if (vdev->list.next) {
+		mutex_lock(&virtio_devices_lock);
+		list_del_init(&vdev->list);
+		mutex_unlock(&virtio_devices_lock);
+
+		if (vdev->doorbell < VIRTIO_DOORBELL_MAX_DEVICES)
+			__atomic_store_n(&virtio_doorbells[vdev->doorbell],
+					 NULL, __ATOMIC_RELEASE);
+	}
+
 	if (vdev->ops && vdev->ops->exit)
 		vdev->ops->exit(kvm, vdev);
 }
@@ -0,0 +1,294 @@
+#include "kvm/virtio-doorbell.h"
+
+#include "kvm/virtio-pci-dev.h"
+#include "kvm/virtio-mmio.h"
+#include "kvm/virtio-pci.h"
+#include "kvm/ioeventfd.h"
+#include "kvm/devices.h"
+#include "kvm/virtio.h"
+#include "kvm/ioport.h"
+#include "kvm/util.h"
+#include "kvm/kvm.h"
+#include "kvm/pci.h"
+
+#include <linux/byteorder.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/*
+ * A guest that has filled queues of several devices would otherwise exit
+ * once per queue. Here it exits once, and the queues are kicked from the
+ * ioeventfd thread in the order of the bitmap.
+ */
+
+#define VIRTIO_DOORBELL_PAGE_SIZE	4096
+
+struct virtio_doorbell {
+	struct pci_device_header pci_hdr;
+	struct device_header	dev_hdr;
+	struct kvm		*kvm;
+	u64			bitmap_gpa;
+	/* Where bitmap_gpa is, NULL until the guest gave a page of RAM */
+	u32			*bitmap;
+	bool			ioeventfd;
+};
+
+static struct virtio_doorbell doorbell = {
+	.pci_hdr = {
+		.vendor_id	= cpu_to_le16(PCI_VENDOR_ID_REDHAT_QUMRANET),
+		.device_id	= cpu_to_le16(PCI_DEVICE_ID_VIRTIO_DOORBELL),
+		.header_type	= PCI_HEADER_TYPE_NORMAL,
+		.revision_id	= 0,
+		.class[0]	= PCI_CLASS_DOORBELL & 0xff,
+		.class[1]	= (PCI_CLASS_DOORBELL >> 8) & 0xff,
+		.class[2]	= (PCI_CLASS_DOORBELL >> 16) & 0xff,
+		.subsys_vendor_id = cpu_to_le16(PCI_SUBSYSTEM_VENDOR_ID_REDHAT_QUMRANET),
+		.subsys_id	= cpu_to_le16(PCI_SUBSYSTEM_ID_VIRTIO_DOORBELL),
+	},
+	.dev_hdr = {
+		.bus_type	= DEVICE_BUS_PCI,
+		.data		= &doorbell.pci_hdr,
+	},
+};
+
+static u32 virtio_doorbell__nr_devices(void)
+{
+	u32 nr = 0, i;
+
+	for (i = 0; i < VIRTIO_DOORBELL_MAX_DEVICES; i++) {
+		if (virtio__find_doorbell(i))
+			nr = i + 1;
+	}
+
+	return nr;
+}
+
+static void virtio_doorbell__kick(struct kvm *kvm, struct virtio_device *vdev,
+				  u32 bits)
+{
+	unsigned int nr_vqs = vdev->ops->get_vq_count(kvm, vdev->dev);
+	struct virt_queue *vq;
+	u32 vq_idx;
+
+	while (bits) {
+		vq_idx = __builtin_ctz(bits);
+		bits &= bits - 1;
+
+		if (vq_idx >= nr_vqs)
+			break;
+		/* vhost polls the queue's own eventfd, it would miss this kick */
+		if (vdev->use_vhost && !(vdev->user_vqs & (1ULL << vq_idx)))
+			continue;
+		vq = vdev->ops->get_vq(kvm, vdev->dev, vq_idx);
+		if (!vq || !vq->enabled)
+			continue;
+
+		virtio__account_kick(vdev, vq_idx);
+		vdev->ops->notify_vq(kvm, vdev->dev, vq_idx);
+	}
+}
+
+static void virtio_doorbell__drain(struct kvm *kvm, void *param)
+{
+	struct virtio_doorbell *db = param;
+	struct virtio_device *vdev;
+	u32 *bitmap, bits, i;
+
+	bitmap = __atomic_load_n(&db->bitmap, __ATOMIC_ACQUIRE);
+	if (!bitmap)
+		return;
+
+	for (i = 0; i < VIRTIO_DOORBELL_MAX_DEVICES; i++) {
+		if (!__atomic_load_n(&bitmap[i], __ATOMIC_RELAXED))
+			continue;
+
+		bits = le32_to_cpu(__atomic_exchange_n(&bitmap[i], 0,
+						       __ATOMIC_ACQUIRE));
+		vdev = virtio__find_doorbell(i);
+		if (vdev && bits)
+			virtio_doorbell__kick(kvm, vdev, bits);
+	}
+}
+
+static void virtio_doorbell__set_bitmap(struct virtio_doorbell *db)
+{
+	u64 gpa = db->bitmap_gpa;
+	u32 *bitmap = NULL;
+	void *start, *end;
+
+	if (gpa && !(gpa & (VIRTIO_DOORBELL_PAGE_SIZE - 1))) {
+		start = guest_flat_to_host(db->kvm, gpa);
+		end = guest_flat_to_host(db->kvm,
+					 gpa + VIRTIO_DOORBELL_PAGE_SIZE - 1);
+		/* The drain walks the page from the host pointer */
+		if (start && end == start + VIRTIO_DOORBELL_PAGE_SIZE - 1)
+			bitmap = start;
+		else
+			pr_warning("virtio-doorbell: 0x%llx is not a page of RAM",
+				   (unsigned long long)gpa);
+	}
+
+	__atomic_store_n(&db->bitmap, bitmap, __ATOMIC_RELEASE);
+}
+
+static u32 virtio_doorbell__device(u32 index, bool location)
+{
+	struct virtio_device *vdev = virtio__find_doorbell(index);
+	struct virtio_mmio *vmmio;
+	struct virtio_pci *vpci;
+
+	if (!vdev)
+		return 0;
+
+	switch (vdev->trans) {
+	case VIRTIO_PCI:
+	case VIRTIO_PCI_LEGACY:
+		vpci = vdev->virtio;
+		return location ? (u32)vpci->dev_hdr.dev_num :
+				  VIRTIO_DOORBELL_DEV_PCI;
+	case VIRTIO_MMIO:
+	case VIRTIO_MMIO_LEGACY:
+		vmmio = vdev->virtio;
+		return location ? vmmio->addr : VIRTIO_DOORBELL_DEV_MMIO;
+	default:
+		return 0;
+	}
+}
+
+static u32 virtio_doorbell__read(u64 offset)
+{
+	switch (offset) {
+	case VIRTIO_DOORBELL_MAGIC:
+		return VIRTIO_DOORBELL_MAGIC_VALUE;
+	case VIRTIO_DOORBELL_VERSION:
+		return 1;
+	case VIRTIO_DOORBELL_NR_DEVICES:
+		return virtio_doorbell__nr_devices();
+	case VIRTIO_DOORBELL_BITMAP_LO:
+		return (u32)doorbell.bitmap_gpa;
+	case VIRTIO_DOORBELL_BITMAP_HI:
+		return doorbell.bitmap_gpa >> 32;
+	}
+
+	if (offset >= VIRTIO_DOORBELL_DEVICES)
+		return virtio_doorbell__device((offset - VIRTIO_DOORBELL_DEVICES) / 8,
+					       offset & 4);
+
+	return 0;
+}
+
+static void virtio_doorbell__write(struct kvm *kvm, u64 offset, u32 val)
+{
+	switch (offset) {
+	case VIRTIO_DOORBELL_BITMAP_LO:
+		doorbell.bitmap_gpa = (doorbell.bitmap_gpa & ~0xffffffffULL) | val;
+		virtio_doorbell__set_bitmap(&doorbell);
+		break;
+	case VIRTIO_DOORBELL_BITMAP_HI:
+		doorbell.bitmap_gpa = (doorbell.bitmap_gpa & 0xffffffffULL) |
+				      (u64)val << 32;
+		virtio_doorbell__set_bitmap(&doorbell);
+		break;
+	case VIRTIO_DOORBELL_KICK:
+		/* Without the ioeventfd, or with another value */
+		virtio_doorbell__drain(kvm, &doorbell);
+		break;
+	}
+}
+
+static void virtio_doorbell__mmio(struct kvm_cpu *vcpu, u64 addr, u8 *data,
+				  u32 len, u8 is_write, void *ptr)
+{
+	u64 offset = addr - pci__bar_address(&doorbell.pci_hdr, 0);
+
+	/* All the registers are 32-bit */
+	if (len != sizeof(u32) || offset & 3) {
+		if (!is_write)
+			memset(data, 0, len);
+		return;
+	}
+
+	if (is_write)
+		virtio_doorbell__write(vcpu->kvm, offset, ioport__read32((u32 *)data));
+	else
+		ioport__write32((u32 *)data, virtio_doorbell__read(offset));
+}
+
+static int virtio_doorbell__add_ioeventfd(struct kvm *kvm, u32 bar_addr)
+{
+	struct ioevent ioevent = {
+		.io_addr	= bar_addr + VIRTIO_DOORBELL_KICK,
+		.io_len		= sizeof(u32),
+		.fn		= virtio_doorbell__drain,
+		.fn_ptr		= &doorbell,
+		.fn_kvm		= kvm,
+		.datamatch	= VIRTIO_DOORBELL_KICK_VALUE,
+		.fd		= eventfd(0, 0),
+	};
+	int r;
+
+	r = ioeventfd__add_event(&ioevent, IOEVENTFD_FLAG_USER_POLL);
+	if (r) {
+		pr_warning("virtio-doorbell: unable to add ioeventfd (%s), kicks will trap",
+			   strerror(-r));
+		return r;
+	}
+
+	doorbell.ioeventfd = true;
+	return 0;
+}
+
+static int virtio_doorbell__bar_activate(struct kvm *kvm,
+					 struct pci_device_header *pci_hdr,
+					 int bar_num, void *data)
+{
+	u32 bar_addr = pci__bar_address(pci_hdr, bar_num);
+	int r;
+
+	r = kvm__register_mmio(kvm, bar_addr, pci__bar_size(pci_hdr, bar_num),
+			       false, virtio_doorbell__mmio, NULL);
+	if (r < 0)
+		return r;
+
+	virtio_doorbell__add_ioeventfd(kvm, bar_addr);
+	return 0;
+}
+
+static int virtio_doorbell__bar_deactivate(struct kvm *kvm,
+					   struct pci_device_header *pci_hdr,
+					   int bar_num, void *data)
+{
+	u32 bar_addr = pci__bar_address(pci_hdr, bar_num);
+
+	if (doorbell.ioeventfd) {
+		ioeventfd__del_event(bar_addr + VIRTIO_DOORBELL_KICK,
+				     VIRTIO_DOORBELL_KICK_VALUE);
+		doorbell.ioeventfd = false;
+	}
+
+	return kvm__deregister_mmio(kvm, bar_addr) ? 0 : -ENOENT;
+}
+
+int virtio_doorbell__init(struct kvm *kvm)
+{
+	u32 bar_addr;
+	int r;
+
+	if (!kvm->cfg.virtio_doorbell)
+		return 0;
+
+	doorbell.kvm = kvm;
+
+	bar_addr = pci_get_mmio_block(VIRTIO_DOORBELL_BAR_SIZE);
+	doorbell.pci_hdr.bar[0] = cpu_to_le32(bar_addr | PCI_BASE_ADDRESS_SPACE_MEMORY);
+	doorbell.pci_hdr.bar_size[0] = VIRTIO_DOORBELL_BAR_SIZE;
+
+	r = pci__register_bar_regions(kvm, &doorbell.pci_hdr,
+				      virtio_doorbell__bar_activate,
+				      virtio_doorbell__bar_deactivate, NULL);
+	if (r < 0)
+		return r;
+
+	return device__register(&doorbell.dev_hdr);
+}
+virtio_dev_init(virtio_doorbell__init);
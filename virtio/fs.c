@@ -0,0 +1,1633 @@
+#include "kvm/virtio-fs.h"
+
+#include "kvm/virtio-pci-dev.h"
+
+#include "kvm/virtio.h"
+#include "kvm/util.h"
+#include "kvm/kvm.h"
+#include "kvm/iovec.h"
+#include "kvm/mutex.h"
+#include "kvm/threadpool.h"
+#include "kvm/guest_compat.h"
+#include "kvm/snapshot.h"
+
+#include <linux/virtio_ring.h>
+#include <linux/virtio_fs.h>
+#include <linux/fuse.h>
+
+#include <linux/list.h>
+#include <linux/rbtree.h>
+#include <linux/kernel.h>
+#include <linux/sizes.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* A high priority queue, for FORGET and INTERRUPT, and one request queue */
+#define VIRTIO_FS_NR_QUEUES		2
+#define VIRTIO_FS_NR_REQUEST_QUEUES	1
+#define VIRTIO_FS_QUEUE_SIZE		1024
+#define VIRTIO_FS_MAX_PAGES		256
+#define VIRTIO_FS_MAX_WRITE		SZ_1M
+/* Room for the largest arguments: symlink names, REMOVEMAPPING lists */
+#define VIRTIO_FS_ARG_MAX		8192
+#define VIRTIO_FS_REPLY_MAX		(PATH_MAX + 256)
+#define VIRTIO_FS_DIRENT_BATCH		(32 * 1024)
+#define VIRTIO_FS_TIMEOUT_AUTO		1
+#define VIRTIO_FS_TIMEOUT_ALWAYS	86400
+/* The first protocol with DAX mappings, older guests don't have virtio-fs */
+#define VIRTIO_FS_MIN_MINOR		31
+
+#define PCI_DEVICE_ID_VIRTIO_FS		(PCI_DEVICE_ID_VIRTIO_BASE + VIRTIO_ID_FS)
+#define PCI_CLASS_FS			0xff0000
+
+/*
+ * A host file the guest knows about. The guest names it by nodeid, and
+ * holds nlookup references to it until it forgets them. Requests using it
+ * hold the other refs.
+ */
+struct fs_inode {
+	struct rb_node		node;
+	struct rb_node		ino_node;
+	u64			nodeid;
+	dev_t			dev;
+	ino_t			ino;
+	int			fd;
+	u64			nlookup;
+	int			refs;
+};
+
+struct fs_dev;
+
+struct fs_dev_job {
+	struct virt_queue	*vq;
+	struct fs_dev		*fs;
+	struct thread_pool__job	job_id;
+
+	/* Buffers of the request being handled */
+	struct iovec		req_iov[VIRTIO_FS_QUEUE_SIZE];
+	struct iovec		rep_iov[VIRTIO_FS_QUEUE_SIZE];
+	struct iovec		win[VIRTIO_FS_QUEUE_SIZE];
+	u8			arg[VIRTIO_FS_ARG_MAX];
+	u8			reply[VIRTIO_FS_REPLY_MAX];
+};
+
+struct fs_dev {
+	struct list_head	list;
+	struct virtio_device	vdev;
+	struct virt_queue	vqs[VIRTIO_FS_NR_QUEUES];
+	struct fs_dev_job	jobs[VIRTIO_FS_NR_QUEUES];
+	struct virtio_fs_config	config;
+
+	char			root_dir[PATH_MAX];
+	char			tag[sizeof(((struct virtio_fs_config *)0)->tag) + 1];
+	enum virtio_fs_cache	cache;
+	u64			timeout;
+
+	/* Inodes by nodeid and by host inode, and the open files */
+	struct mutex		lock;
+	struct rb_root		nodes;
+	struct rb_root		inos;
+	struct fs_inode		*root;
+	u64			next_nodeid;
+	int			*fds;
+	u32			nr_fds;
+
+	/* DAX window, into which the guest has files mapped */
+	void			*dax;
+	u64			dax_size;
+	u64			dax_align;
+};
+
+struct fs_req {
+	struct fuse_in_header	hdr;
+	struct fs_inode		*inode;
+	void			*arg;
+	size_t			arg_len;
+
+	struct iovec		*req_iov;
+	u16			req_cnt;
+	size_t			req_size;
+	struct iovec		*rep_iov;
+	u16			rep_cnt;
+	size_t			rep_size;
+	struct iovec		*win;
+
+	/* Reply after the header, and what the handler put there itself */
+	void			*reply;
+	size_t			reply_len;
+	size_t			direct_len;
+};
+
+struct fs_op {
+	int		(*handler)(struct fs_dev *fs, struct fs_req *req);
+	size_t		arg_size;
+	bool		node;
+	bool		no_reply;
+};
+
+static LIST_HEAD(fs_devs);
+static int compat_id = -1;
+
+/* Copy len bytes between buf and the iovecs, skip bytes in */
+static size_t fs_iov_copy(const struct iovec *iov, int cnt, size_t skip,
+			  void *buf, size_t len, bool to_iov)
+{
+	size_t copied = 0, copy;
+	int i;
+
+	for (i = 0; i < cnt && copied < len; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+
+		copy = min(iov[i].iov_len - skip, len - copied);
+		if (to_iov)
+			memcpy(iov[i].iov_base + skip, buf + copied, copy);
+		else
+			memcpy(buf + copied, iov[i].iov_base + skip, copy);
+		copied += copy;
+		skip = 0;
+	}
+
+	return copied;
+}
+
+static void fs_proc_path(char *path, size_t size, int fd)
+{
+	snprintf(path, size, "/proc/self/fd/%d", fd);
+}
+
+static struct fs_inode *fs_find_node(struct fs_dev *fs, u64 nodeid)
+{
+	struct rb_node *node = fs->nodes.rb_node;
+
+	while (node) {
+		struct fs_inode *cur = rb_entry(node, struct fs_inode, node);
+
+		if (nodeid < cur->nodeid)
+			node = node->rb_left;
+		else if (nodeid > cur->nodeid)
+			node = node->rb_right;
+		else
+			return cur;
+	}
+
+	return NULL;
+}
+
+static struct fs_inode *fs_find_ino(struct fs_dev *fs, dev_t dev, ino_t ino)
+{
+	struct rb_node *node = fs->inos.rb_node;
+
+	while (node) {
+		struct fs_inode *cur = rb_entry(node, struct fs_inode, ino_node);
+
+		if (dev < cur->dev || (dev == cur->dev && ino < cur->ino))
+			node = node->rb_left;
+		else if (dev > cur->dev || ino > cur->ino)
+			node = node->rb_right;
+		else
+			return cur;
+	}
+
+	return NULL;
+}
+
+/* Called with lock held */
+static void fs_insert_inode(struct fs_dev *fs, struct fs_inode *inode)
+{
+	struct rb_node **node = &fs->nodes.rb_node, *parent = NULL;
+	struct fs_inode *cur;
+
+	while (*node) {
+		cur = rb_entry(*node, struct fs_inode, node);
+		parent = *node;
+		if (inode->nodeid < cur->nodeid)
+			node = &(*node)->rb_left;
+		else
+			node = &(*node)->rb_right;
+	}
+	rb_link_node(&inode->node, parent, node);
+	rb_insert_color(&inode->node, &fs->nodes);
+
+	node = &fs->inos.rb_node;
+	parent = NULL;
+	while (*node) {
+		cur = rb_entry(*node, struct fs_inode, ino_node);
+		parent = *node;
+		if (inode->dev < cur->dev ||
+		    (inode->dev == cur->dev && inode->ino < cur->ino))
+			node = &(*node)->rb_left;
+		else
+			node = &(*node)->rb_right;
+	}
+	rb_link_node(&inode->ino_node, parent, node);
+	rb_insert_color(&inode->ino_node, &fs->inos);
+}
+
+static struct fs_inode *fs_get_inode(struct fs_dev *fs, u64 nodeid)
+{
+	struct fs_inode *inode;
+
+	mutex_lock(&fs->lock);
+	inode = fs_find_node(fs, nodeid);
+	if (inode)
+		inode->refs++;
+	mutex_unlock(&fs->lock);
+
+	return inode;
+}
+
+/* Called with lock held */
+static bool __fs_put_inode(struct fs_inode *inode)
+{
+	if (--inode->refs)
+		return false;
+
+	close(inode->fd);
+	free(inode);
+	return true;
+}
+
+static void fs_put_inode(struct fs_dev *fs, struct fs_inode *inode)
+{
+	mutex_lock(&fs->lock);
+	__fs_put_inode(inode);
+	mutex_unlock(&fs->lock);
+}
+
+static void fs_forget(struct fs_dev *fs, u64 nodeid, u64 nlookup)
+{
+	struct fs_inode *inode;
+
+	mutex_lock(&fs->lock);
+	inode = fs_find_node(fs, nodeid);
+	if (!inode || inode == fs->root)
+		goto out;
+
+	inode->nlookup -= min(nlookup, inode->nlookup);
+	if (inode->nlookup)
+		goto out;
+
+	rb_erase(&inode->node, &fs->nodes);
+	rb_erase(&inode->ino_node, &fs->inos);
+	__fs_put_inode(inode);
+out:
+	mutex_unlock(&fs->lock);
+}
+
+static int fs_new_fh(struct fs_dev *fs, int fd, u64 *fh)
+{
+	u32 i, nr;
+	int *fds;
+
+	mutex_lock(&fs->lock);
+	for (i = 0; i < fs->nr_fds; i++) {
+		if (fs->fds[i] < 0)
+			goto found;
+	}
+
+	nr = max(fs->nr_fds * 2, 64U);
+	fds = realloc(fs->fds, nr * sizeof(*fds));
+	if (!fds) {
+		mutex_unlock(&fs->lock);
+		return -ENOMEM;
+	}
+	for (i = fs->nr_fds; i < nr; i++)
+		fds[i] = -1;
+	i = fs->nr_fds;
+	fs->fds = fds;
+	fs->nr_fds = nr;
+found:
+	fs->fds[i] = fd;
+	mutex_unlock(&fs->lock);
+
+	*fh = i;
+	return 0;
+}
+
+/*
+ * Files are only opened, used and released by the request queue, one
+ * request at a time, so the fd stays valid while it is used.
+ */
+static int fs_get_fd(struct fs_dev *fs, u64 fh)
+{
+	int fd = -EBADF;
+
+	mutex_lock(&fs->lock);
+	if (fh < fs->nr_fds && fs->fds[fh] >= 0)
+		fd = fs->fds[fh];
+	mutex_unlock(&fs->lock);
+
+	return fd;
+}
+
+static int fs_release_fh(struct fs_dev *fs, u64 fh)
+{
+	int fd = -EBADF;
+
+	mutex_lock(&fs->lock);
+	if (fh < fs->nr_fds && fs->fds[fh] >= 0) {
+		fd = fs->fds[fh];
+		fs->fds[fh] = -1;
+	}
+	mutex_unlock(&fs->lock);
+
+	if (fd < 0)
+		return fd;
+
+	close(fd);
+	return 0;
+}
+
+static bool fs_dax_range_ok(struct fs_dev *fs, u64 moffset, u64 len)
+{
+	return len && !((moffset | len) & (fs->dax_align - 1)) &&
+	       moffset < fs->dax_size && len <= fs->dax_size - moffset;
+}
+
+/* Put back the inaccessible memory that the window starts with */
+static int fs_dax_unmap(struct fs_dev *fs, u64 moffset, u64 len)
+{
+	void *p;
+
+	p = mmap(fs->dax + moffset, len, PROT_NONE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+	return p == MAP_FAILED ? -errno : 0;
+}
+
+/* Forget everything the guest knew, as when it unmounts or resets */
+static void fs_reset(struct fs_dev *fs)
+{
+	struct fs_inode *inode, *next;
+	u32 i;
+
+	mutex_lock(&fs->lock);
+	rbtree_postorder_for_each_entry_safe(inode, next, &fs->nodes, node) {
+		if (inode != fs->root)
+			__fs_put_inode(inode);
+	}
+	fs->nodes = (struct rb_root)RB_ROOT;
+	fs->inos = (struct rb_root)RB_ROOT;
+	fs_insert_inode(fs, fs->root);
+
+	for (i = 0; i < fs->nr_fds; i++) {
+		if (fs->fds[i] >= 0)
+			close(fs->fds[i]);
+		fs->fds[i] = -1;
+	}
+	mutex_unlock(&fs->lock);
+
+	if (fs->dax && fs_dax_unmap(fs, 0, fs->dax_size) < 0)
+		pr_warning("virtio-fs: failed to clear the DAX window of %s",
+			   fs->tag);
+}
+
+/* The NUL terminated string at *off in the arguments */
+static const char *fs_arg_str(struct fs_req *req, size_t *off)
+{
+	char *str = req->arg + *off;
+	size_t len;
+
+	if (*off >= req->arg_len)
+		return NULL;
+
+	len = strnlen(str, req->arg_len - *off);
+	if (*off + len == req->arg_len)
+		return NULL;
+
+	*off += len + 1;
+	return str;
+}
+
+/*
+ * Everything is resolved one name at a time from the directories the guest
+ * looked up, starting at the shared one, so that a name without slashes
+ * that isn't "." or ".." can't lead outside of it.
+ */
+static const char *fs_arg_name(struct fs_req *req, size_t *off)
+{
+	const char *name = fs_arg_str(req, off);
+
+	if (!name || !*name || strchr(name, '/') ||
+	    !strcmp(name, ".") || !strcmp(name, ".."))
+		return NULL;
+
+	return name;
+}
+
+static void fs_fill_attr(struct fuse_attr *attr, const struct stat *st)
+{
+	*attr = (struct fuse_attr) {
+		.ino		= st->st_ino,
+		.size		= st->st_size,
+		.blocks		= st->st_blocks,
+		.atime		= st->st_atim.tv_sec,
+		.mtime		= st->st_mtim.tv_sec,
+		.ctime		= st->st_ctim.tv_sec,
+		.atimensec	= st->st_atim.tv_nsec,
+		.mtimensec	= st->st_mtim.tv_nsec,
+		.ctimensec	= st->st_ctim.tv_nsec,
+		.mode		= st->st_mode,
+		.nlink		= st->st_nlink,
+		.uid		= st->st_uid,
+		.gid		= st->st_gid,
+		.rdev		= st->st_rdev,
+		.blksize	= st->st_blksize,
+	};
+}
+
+static int fs_lookup(struct fs_dev *fs, struct fs_inode *parent,
+		     const char *name, struct fuse_entry_out *out)
+{
+	struct fs_inode *inode, *new;
+	struct stat st;
+	u64 nodeid;
+	int fd, r;
+
+	fd = openat(parent->fd, name, O_PATH | O_NOFOLLOW);
+	if (fd < 0)
+		return -errno;
+
+	if (fstatat(fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0) {
+		r = -errno;
+		close(fd);
+		return r;
+	}
+
+	new = calloc(1, sizeof(*new));
+
+	mutex_lock(&fs->lock);
+	inode = fs_find_ino(fs, st.st_dev, st.st_ino);
+	if (!inode && new) {
+		inode = new;
+		new = NULL;
+		inode->nodeid = fs->next_nodeid++;
+		inode->dev = st.st_dev;
+		inode->ino = st.st_ino;
+		inode->fd = fd;
+		inode->refs = 1;
+		fd = -1;
+		fs_insert_inode(fs, inode);
+	}
+	if (inode) {
+		inode->nlookup++;
+		nodeid = inode->nodeid;
+	}
+	mutex_unlock(&fs->lock);
+
+	free(new);
+	if (fd >= 0)
+		close(fd);
+	if (!inode)
+		return -ENOMEM;
+
+	*out = (struct fuse_entry_out) {
+		.nodeid		= nodeid,
+		.entry_valid	= fs->timeout,
+		.attr_valid	= fs->timeout,
+	};
+	fs_fill_attr(&out->attr, &st);
+
+	return 0;
+}
+
+static int fs_reply_entry(struct fs_dev *fs, struct fs_req *req,
+			  const char *name)
+{
+	int r;
+
+	r = fs_lookup(fs, req->inode, name, req->reply);
+	if (r < 0)
+		return r;
+
+	req->reply_len = sizeof(struct fuse_entry_out);
+	return 0;
+}
+
+static int fs_reply_attr(struct fs_dev *fs, struct fs_req *req,
+			 const struct stat *st)
+{
+	struct fuse_attr_out *out = req->reply;
+
+	*out = (struct fuse_attr_out) {
+		.attr_valid	= fs->timeout,
+	};
+	fs_fill_attr(&out->attr, st);
+	req->reply_len = sizeof(*out);
+
+	return 0;
+}
+
+static int fs_reply_open(struct fs_dev *fs, struct fs_req *req, int fd,
+			 bool dir)
+{
+	struct fuse_open_out *out = req->reply + req->reply_len;
+	u64 fh;
+	int r;
+
+	r = fs_new_fh(fs, fd, &fh);
+	if (r < 0) {
+		close(fd);
+		return r;
+	}
+
+	*out = (struct fuse_open_out) {
+		.fh		= fh,
+	};
+	if (fs->cache == VIRTIO_FS_CACHE_NONE && !dir)
+		out->open_flags = FOPEN_DIRECT_IO;
+	else if (fs->cache == VIRTIO_FS_CACHE_ALWAYS)
+		out->open_flags = dir ? FOPEN_CACHE_DIR : FOPEN_KEEP_CACHE;
+	req->reply_len += sizeof(*out);
+
+	return 0;
+}
+
+static int fs_op_init(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_init_out *out = req->reply;
+	struct fuse_init_in in = {};
+	u32 flags;
+
+	memcpy(&in, req->arg, min(req->arg_len, sizeof(in)));
+	if (in.major != FUSE_KERNEL_VERSION || in.minor < VIRTIO_FS_MIN_MINOR) {
+		pr_warning("virtio-fs: unsupported FUSE protocol %u.%u",
+			   in.major, in.minor);
+		return -EPROTO;
+	}
+
+	flags = FUSE_ASYNC_READ | FUSE_ATOMIC_O_TRUNC | FUSE_BIG_WRITES |
+		FUSE_PARALLEL_DIROPS | FUSE_MAX_PAGES;
+	if (fs->cache == VIRTIO_FS_CACHE_AUTO)
+		flags |= FUSE_AUTO_INVAL_DATA;
+	if (fs->dax)
+		flags |= FUSE_MAP_ALIGNMENT;
+
+	*out = (struct fuse_init_out) {
+		.major		= FUSE_KERNEL_VERSION,
+		.minor		= min_t(u32, in.minor, FUSE_KERNEL_MINOR_VERSION),
+		.max_readahead	= in.max_readahead,
+		.flags		= flags & in.flags,
+		.max_write	= VIRTIO_FS_MAX_WRITE,
+		.time_gran	= 1,
+		.max_pages	= VIRTIO_FS_MAX_PAGES,
+	};
+	if (fs->dax)
+		out->map_alignment = __builtin_ctzll(fs->dax_align);
+	req->reply_len = sizeof(*out);
+
+	return 0;
+}
+
+static int fs_op_destroy(struct fs_dev *fs, struct fs_req *req)
+{
+	fs_reset(fs);
+	return 0;
+}
+
+static int fs_op_lookup(struct fs_dev *fs, struct fs_req *req)
+{
+	size_t off = 0;
+	const char *name = fs_arg_name(req, &off);
+
+	if (!name)
+		return -EINVAL;
+
+	return fs_reply_entry(fs, req, name);
+}
+
+static int fs_op_forget(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_forget_in *in = req->arg;
+
+	fs_forget(fs, req->hdr.nodeid, in->nlookup);
+	return 0;
+}
+
+static int fs_op_batch_forget(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_batch_forget_in *in = req->arg;
+	struct fuse_forget_one *one = (void *)(in + 1);
+	u32 i, count;
+
+	count = min_t(size_t, in->count,
+		      (req->arg_len - sizeof(*in)) / sizeof(*one));
+	for (i = 0; i < count; i++)
+		fs_forget(fs, one[i].nodeid, one[i].nlookup);
+
+	return 0;
+}
+
+static int fs_op_interrupt(struct fs_dev *fs, struct fs_req *req)
+{
+	/* Requests aren't waiting on anything that could be interrupted */
+	return 0;
+}
+
+static int fs_op_getattr(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_getattr_in *in = req->arg;
+	struct stat st;
+	int fd, r;
+
+	if (in->getattr_flags & FUSE_GETATTR_FH) {
+		fd = fs_get_fd(fs, in->fh);
+		if (fd < 0)
+			return fd;
+		r = fstat(fd, &st);
+	} else {
+		r = fstatat(req->inode->fd, "", &st,
+			    AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+	}
+	if (r < 0)
+		return -errno;
+
+	return fs_reply_attr(fs, req, &st);
+}
+
+static void fs_set_time(struct timespec *ts, u32 valid, u32 set, u32 now,
+			u64 sec, u32 nsec)
+{
+	if (valid & now)
+		ts->tv_nsec = UTIME_NOW;
+	else if (valid & set)
+		*ts = (struct timespec) { .tv_sec = sec, .tv_nsec = nsec };
+	else
+		ts->tv_nsec = UTIME_OMIT;
+}
+
+/*
+ * Inodes are only held by O_PATH fds, so changes that need an open file
+ * go through /proc/self/fd, unless the guest gives one of its own.
+ */
+static int fs_op_setattr(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_setattr_in *in = req->arg;
+	u32 valid = in->valid;
+	struct timespec ts[2];
+	char path[32];
+	struct stat st;
+	int fd = -1, r = 0;
+
+	if (valid & FATTR_FH) {
+		fd = fs_get_fd(fs, in->fh);
+		if (fd < 0)
+			return fd;
+	}
+	fs_proc_path(path, sizeof(path), req->inode->fd);
+
+	if (valid & FATTR_MODE)
+		r = fd >= 0 ? fchmod(fd, in->mode) : chmod(path, in->mode);
+
+	if (!r && valid & (FATTR_UID | FATTR_GID))
+		r = fchownat(req->inode->fd, "",
+			     valid & FATTR_UID ? in->uid : (uid_t)-1,
+			     valid & FATTR_GID ? in->gid : (gid_t)-1,
+			     AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+
+	if (!r && valid & FATTR_SIZE)
+		r = fd >= 0 ? ftruncate(fd, in->size) : truncate(path, in->size);
+
+	if (!r && valid & (FATTR_ATIME | FATTR_ATIME_NOW |
+			   FATTR_MTIME | FATTR_MTIME_NOW)) {
+		fs_set_time(&ts[0], valid, FATTR_ATIME, FATTR_ATIME_NOW,
+			    in->atime, in->atimensec);
+		fs_set_time(&ts[1], valid, FATTR_MTIME, FATTR_MTIME_NOW,
+			    in->mtime, in->mtimensec);
+		r = fd >= 0 ? futimens(fd, ts) : utimensat(AT_FDCWD, path, ts, 0);
+	}
+
+	if (r < 0)
+		return -errno;
+
+	if (fstatat(req->inode->fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0)
+		return -errno;
+
+	return fs_reply_attr(fs, req, &st);
+}
+
+static int fs_op_readlink(struct fs_dev *fs, struct fs_req *req)
+{
+	ssize_t len;
+
+	len = readlinkat(req->inode->fd, "", req->reply, VIRTIO_FS_REPLY_MAX);
+	if (len < 0)
+		return -errno;
+
+	req->reply_len = len;
+	return 0;
+}
+
+static int fs_op_symlink(struct fs_dev *fs, struct fs_req *req)
+{
+	size_t off = 0;
+	const char *name = fs_arg_name(req, &off);
+	const char *target = fs_arg_str(req, &off);
+
+	if (!name || !target)
+		return -EINVAL;
+
+	if (symlinkat(target, req->inode->fd, name) < 0)
+		return -errno;
+
+	return fs_reply_entry(fs, req, name);
+}
+
+static int fs_op_mknod(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_mknod_in *in = req->arg;
+	size_t off = sizeof(*in);
+	const char *name = fs_arg_name(req, &off);
+
+	if (!name)
+		return -EINVAL;
+
+	if (mknodat(req->inode->fd, name, in->mode, in->rdev) < 0)
+		return -errno;
+
+	return fs_reply_entry(fs, req, name);
+}
+
+static int fs_op_mkdir(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_mkdir_in *in = req->arg;
+	size_t off = sizeof(*in);
+	const char *name = fs_arg_name(req, &off);
+
+	if (!name)
+		return -EINVAL;
+
+	if (mkdirat(req->inode->fd, name, in->mode) < 0)
+		return -errno;
+
+	return fs_reply_entry(fs, req, name);
+}
+
+static int fs_op_unlink(struct fs_dev *fs, struct fs_req *req)
+{
+	size_t off = 0;
+	const char *name = fs_arg_name(req, &off);
+	int flags = req->hdr.opcode == FUSE_RMDIR ? AT_REMOVEDIR : 0;
+
+	if (!name)
+		return -EINVAL;
+
+	if (unlinkat(req->inode->fd, name, flags) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int fs_op_rename(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_rename2_in *in2 = req->arg;
+	struct fuse_rename_in *in = req->arg;
+	const char *oldname, *newname;
+	struct fs_inode *newdir;
+	unsigned int flags = 0;
+	size_t off;
+	int r = 0;
+
+	if (req->hdr.opcode == FUSE_RENAME2) {
+		off = sizeof(*in2);
+		flags = in2->flags;
+	} else {
+		off = sizeof(*in);
+	}
+
+	oldname = fs_arg_name(req, &off);
+	newname = fs_arg_name(req, &off);
+	if (!oldname || !newname)
+		return -EINVAL;
+
+	newdir = fs_get_inode(fs, in->newdir);
+	if (!newdir)
+		return -ESTALE;
+
+	if (renameat2(req->inode->fd, oldname, newdir->fd, newname, flags) < 0)
+		r = -errno;
+
+	fs_put_inode(fs, newdir);
+	return r;
+}
+
+static int fs_op_link(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_link_in *in = req->arg;
+	size_t off = sizeof(*in);
+	const char *name = fs_arg_name(req, &off);
+	struct fs_inode *old;
+	char path[32];
+	int r = 0;
+
+	if (!name)
+		return -EINVAL;
+
+	old = fs_get_inode(fs, in->oldnodeid);
+	if (!old)
+		return -ESTALE;
+
+	fs_proc_path(path, sizeof(path), old->fd);
+	if (linkat(AT_FDCWD, path, req->inode->fd, name, AT_SYMLINK_FOLLOW) < 0)
+		r = -errno;
+
+	fs_put_inode(fs, old);
+	return r ?: fs_reply_entry(fs, req, name);
+}
+
+/*
+ * What the guest may ask of open() and create(). Everything else, O_PATH,
+ * O_DIRECTORY, O_TMPFILE and O_NOFOLLOW included, is lkvm's to decide.
+ */
+#define FS_OPEN_FLAGS	(O_ACCMODE | O_APPEND | O_TRUNC | O_EXCL |	\
+			 O_NONBLOCK | O_DSYNC | O_SYNC | O_DIRECT |	\
+			 O_NOATIME | O_LARGEFILE)
+
+static int fs_op_open(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_open_in *in = req->arg;
+	bool dir = req->hdr.opcode == FUSE_OPENDIR;
+	char path[32];
+	int fd, flags;
+
+	if (dir)
+		flags = O_RDONLY | O_DIRECTORY;
+	else
+		flags = in->flags & FS_OPEN_FLAGS & ~O_EXCL;
+
+	fs_proc_path(path, sizeof(path), req->inode->fd);
+	fd = open(path, flags);
+	if (fd < 0)
+		return -errno;
+
+	return fs_reply_open(fs, req, fd, dir);
+}
+
+static int fs_op_create(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_create_in *in = req->arg;
+	struct fuse_entry_out *entry = req->reply;
+	size_t off = sizeof(*in);
+	const char *name = fs_arg_name(req, &off);
+	int fd, r;
+
+	if (!name)
+		return -EINVAL;
+
+	/*
+	 * Never through a symlink, which the guest may point anywhere on the
+	 * host. ELOOP means that name is one, so it can't be created.
+	 */
+	fd = openat(req->inode->fd, name,
+		    (in->flags & FS_OPEN_FLAGS) | O_CREAT | O_NOFOLLOW,
+		    in->mode);
+	if (fd < 0)
+		return errno == ELOOP ? -EEXIST : -errno;
+
+	r = fs_reply_entry(fs, req, name);
+	if (r < 0) {
+		close(fd);
+		return r;
+	}
+
+	r = fs_reply_open(fs, req, fd, false);
+	if (r < 0)
+		fs_forget(fs, entry->nodeid, 1);
+
+	return r;
+}
+
+static int fs_op_read(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_read_in *in = req->arg;
+	size_t size;
+	ssize_t len;
+	int fd, cnt;
+
+	fd = fs_get_fd(fs, in->fh);
+	if (fd < 0)
+		return fd;
+
+	size = min_t(size_t, in->size,
+		     req->rep_size - sizeof(struct fuse_out_header));
+	cnt = iovec_window(req->win, req->rep_iov, req->rep_cnt,
+			   sizeof(struct fuse_out_header), size);
+	len = preadv(fd, req->win, cnt, in->offset);
+	if (len < 0)
+		return -errno;
+
+	req->direct_len = len;
+	return 0;
+}
+
+static int fs_op_write(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_write_in *in = req->arg;
+	struct fuse_write_out *out = req->reply;
+	size_t skip = sizeof(struct fuse_in_header) + sizeof(*in);
+	size_t size;
+	ssize_t len;
+	int fd, cnt;
+
+	fd = fs_get_fd(fs, in->fh);
+	if (fd < 0)
+		return fd;
+
+	size = min_t(size_t, in->size, req->req_size - skip);
+	cnt = iovec_window(req->win, req->req_iov, req->req_cnt, skip, size);
+	len = pwritev(fd, req->win, cnt, in->offset);
+	if (len < 0)
+		return -errno;
+
+	*out = (struct fuse_write_out) {
+		.size		= len,
+	};
+	req->reply_len = sizeof(*out);
+
+	return 0;
+}
+
+static int fs_op_statfs(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_statfs_out *out = req->reply;
+	struct statvfs sv;
+
+	if (fstatvfs(req->inode->fd, &sv) < 0)
+		return -errno;
+
+	*out = (struct fuse_statfs_out) {
+		.st = {
+			.blocks		= sv.f_blocks,
+			.bfree		= sv.f_bfree,
+			.bavail		= sv.f_bavail,
+			.files		= sv.f_files,
+			.ffree		= sv.f_ffree,
+			.bsize		= sv.f_bsize,
+			.namelen	= sv.f_namemax,
+			.frsize		= sv.f_frsize,
+		},
+	};
+	req->reply_len = sizeof(*out);
+
+	return 0;
+}
+
+static int fs_op_release(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_release_in *in = req->arg;
+
+	return fs_release_fh(fs, in->fh);
+}
+
+static int fs_op_flush(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_flush_in *in = req->arg;
+	int fd;
+
+	fd = fs_get_fd(fs, in->fh);
+	if (fd < 0)
+		return fd;
+
+	/* Do what closing one of the guest's fds would do */
+	fd = dup(fd);
+	if (fd < 0 || close(fd) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int fs_op_fsync(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_fsync_in *in = req->arg;
+	int fd, r;
+
+	fd = fs_get_fd(fs, in->fh);
+	if (fd < 0)
+		return fd;
+
+	if (in->fsync_flags & FUSE_FSYNC_FDATASYNC)
+		r = fdatasync(fd);
+	else
+		r = fsync(fd);
+
+	return r < 0 ? -errno : 0;
+}
+
+static int fs_op_fallocate(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_fallocate_in *in = req->arg;
+	int fd;
+
+	fd = fs_get_fd(fs, in->fh);
+	if (fd < 0)
+		return fd;
+
+	if (fallocate(fd, in->mode, in->offset, in->length) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int fs_op_lseek(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_lseek_in *in = req->arg;
+	struct fuse_lseek_out *out = req->reply;
+	off_t off;
+	int fd;
+
+	fd = fs_get_fd(fs, in->fh);
+	if (fd < 0)
+		return fd;
+
+	off = lseek(fd, in->offset, in->whence);
+	if (off < 0)
+		return -errno;
+
+	out->offset = off;
+	req->reply_len = sizeof(*out);
+
+	return 0;
+}
+
+/*
+ * Entries are read with getdents64() in batches, from the offset of the
+ * last one the guest got. Those that don't fit are read again next time.
+ */
+static int fs_op_readdir(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_read_in *in = req->arg;
+	struct fuse_dirent *fde;
+	struct dirent64 *dent;
+	size_t size, len = 0, namelen, reclen;
+	ssize_t nread, pos;
+	char *buf, *out;
+	int fd, r = 0;
+
+	fd = fs_get_fd(fs, in->fh);
+	if (fd < 0)
+		return fd;
+
+	size = min_t(size_t, in->size,
+		     req->rep_size - sizeof(struct fuse_out_header));
+	buf = malloc(VIRTIO_FS_DIRENT_BATCH);
+	out = malloc(size ?: 1);
+	if (!buf || !out) {
+		r = -ENOMEM;
+		goto err;
+	}
+
+	if (lseek(fd, in->offset, SEEK_SET) < 0) {
+		r = -errno;
+		goto err;
+	}
+
+	while (len < size) {
+		nread = getdents64(fd, buf, VIRTIO_FS_DIRENT_BATCH);
+		if (nread < 0)
+			r = -errno;
+		if (nread <= 0)
+			break;
+
+		for (pos = 0; pos < nread; pos += dent->d_reclen) {
+			dent = (struct dirent64 *)(buf + pos);
+			namelen = strlen(dent->d_name);
+			reclen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+			if (len + reclen > size)
+				goto full;
+
+			fde = (struct fuse_dirent *)(out + len);
+			*fde = (struct fuse_dirent) {
+				.ino		= dent->d_ino,
+				.off		= dent->d_off,
+				.namelen	= namelen,
+				.type		= dent->d_type,
+			};
+			memcpy(fde->name, dent->d_name, namelen);
+			memset(fde->name + namelen, 0,
+			       reclen - FUSE_NAME_OFFSET - namelen);
+			len += reclen;
+		}
+	}
+full:
+	/* Report errors only if there is nothing else to tell */
+	if (r < 0 && len)
+		r = 0;
+	if (r < 0)
+		goto err;
+
+	free(buf);
+	req->reply = out;
+	req->reply_len = len;
+	return 0;
+
+err:
+	free(buf);
+	free(out);
+	return r;
+}
+
+static int fs_op_setupmapping(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_setupmapping_in *in = req->arg;
+	int fd, prot = 0;
+	void *p;
+
+	if (!fs->dax)
+		return -EOPNOTSUPP;
+
+	fd = fs_get_fd(fs, in->fh);
+	if (fd < 0)
+		return fd;
+
+	if (!fs_dax_range_ok(fs, in->moffset, in->len) ||
+	    in->foffset & (fs->dax_align - 1))
+		return -EINVAL;
+
+	if (in->flags & FUSE_SETUPMAPPING_FLAG_READ)
+		prot |= PROT_READ;
+	if (in->flags & FUSE_SETUPMAPPING_FLAG_WRITE)
+		prot |= PROT_WRITE;
+
+	/* The guest memory slot of the window follows the new mapping */
+	p = mmap(fs->dax + in->moffset, in->len, prot, MAP_SHARED | MAP_FIXED,
+		 fd, in->foffset);
+	if (p == MAP_FAILED)
+		return -errno;
+
+	return 0;
+}
+
+static int fs_op_removemapping(struct fs_dev *fs, struct fs_req *req)
+{
+	struct fuse_removemapping_in *in = req->arg;
+	struct fuse_removemapping_one *one = (void *)(in + 1);
+	u32 i;
+	int r;
+
+	if (!fs->dax)
+		return -EOPNOTSUPP;
+
+	if (in->count > (req->arg_len - sizeof(*in)) / sizeof(*one))
+		return -EINVAL;
+
+	for (i = 0; i < in->count; i++) {
+		if (!fs_dax_range_ok(fs, one[i].moffset, one[i].len))
+			return -EINVAL;
+
+		r = fs_dax_unmap(fs, one[i].moffset, one[i].len);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static const struct fs_op fs_ops[] = {
+	[FUSE_INIT]		= { fs_op_init, offsetof(struct fuse_init_in, flags2) },
+	[FUSE_DESTROY]		= { fs_op_destroy },
+	[FUSE_LOOKUP]		= { fs_op_lookup, 0, true },
+	[FUSE_FORGET]		= { fs_op_forget, sizeof(struct fuse_forget_in), false, true },
+	[FUSE_BATCH_FORGET]	= { fs_op_batch_forget, sizeof(struct fuse_batch_forget_in), false, true },
+	[FUSE_INTERRUPT]	= { fs_op_interrupt, sizeof(struct fuse_interrupt_in), false, true },
+	[FUSE_GETATTR]		= { fs_op_getattr, sizeof(struct fuse_getattr_in), true },
+	[FUSE_SETATTR]		= { fs_op_setattr, sizeof(struct fuse_setattr_in), true },
+	[FUSE_READLINK]		= { fs_op_readlink, 0, true },
+	[FUSE_SYMLINK]		= { fs_op_symlink, 0, true },
+	[FUSE_MKNOD]		= { fs_op_mknod, sizeof(struct fuse_mknod_in), true },
+	[FUSE_MKDIR]		= { fs_op_mkdir, sizeof(struct fuse_mkdir_in), true },
+	[FUSE_UNLINK]		= { fs_op_unlink, 0, true },
+	[FUSE_RMDIR]		= { fs_op_unlink, 0, true },
+	[FUSE_RENAME]		= { fs_op_rename, sizeof(struct fuse_rename_in), true },
+	[FUSE_RENAME2]		= { fs_op_rename, sizeof(struct fuse_rename2_in), true },
+	[FUSE_LINK]		= { fs_op_link, sizeof(struct fuse_link_in), true },
+	[FUSE_OPEN]		= { fs_op_open, sizeof(struct fuse_open_in), true },
+	[FUSE_CREATE]		= { fs_op_create, sizeof(struct fuse_create_in), true },
+	[FUSE_READ]		= { fs_op_read, sizeof(struct fuse_read_in) },
+	[FUSE_WRITE]		= { fs_op_write, sizeof(struct fuse_write_in) },
+	[FUSE_STATFS]		= { fs_op_statfs, 0, true },
+	[FUSE_RELEASE]		= { fs_op_release, sizeof(struct fuse_release_in) },
+	[FUSE_FLUSH]		= { fs_op_flush, sizeof(struct fuse_flush_in) },
+	[FUSE_FSYNC]		= { fs_op_fsync, sizeof(struct fuse_fsync_in) },
+	[FUSE_OPENDIR]		= { fs_op_open, sizeof(struct fuse_open_in), true },
+	[FUSE_READDIR]		= { fs_op_readdir, sizeof(struct fuse_read_in) },
+	[FUSE_RELEASEDIR]	= { fs_op_release, sizeof(struct fuse_release_in) },
+	[FUSE_FSYNCDIR]		= { fs_op_fsync, sizeof(struct fuse_fsync_in) },
+	[FUSE_FALLOCATE]	= { fs_op_fallocate, sizeof(struct fuse_fallocate_in) },
+	[FUSE_LSEEK]		= { fs_op_lseek, sizeof(struct fuse_lseek_in) },
+	[FUSE_SETUPMAPPING]	= { fs_op_setupmapping, sizeof(struct fuse_setupmapping_in) },
+	[FUSE_REMOVEMAPPING]	= { fs_op_removemapping, sizeof(struct fuse_removemapping_in) },
+};
+
+static int fs_handle_request(struct fs_dev *fs, struct fs_req *req,
+			     const struct fs_op *op)
+{
+	size_t len = req->req_size - sizeof(req->hdr);
+
+	if (!op || !op->handler)
+		return -ENOSYS;
+
+	/* Only the data of writes stays in the guest buffers */
+	if (req->arg_len < op->arg_size ||
+	    (len > req->arg_len && req->hdr.opcode != FUSE_WRITE))
+		return -EINVAL;
+
+	if (op->node) {
+		req->inode = fs_get_inode(fs, req->hdr.nodeid);
+		if (!req->inode)
+			return -ESTALE;
+	}
+
+	return op->handler(fs, req);
+}
+
+static void virtio_fs_do_request(struct kvm *kvm, struct fs_dev *fs,
+				 struct fs_dev_job *job)
+{
+	const struct fs_op *op = NULL;
+	struct fuse_out_header out;
+	struct fs_req req = {
+		.arg		= job->arg,
+		.req_iov	= job->req_iov,
+		.rep_iov	= job->rep_iov,
+		.win		= job->win,
+		.reply		= job->reply,
+	};
+	u32 len = 0;
+	u16 head;
+	int r;
+
+	head = virt_queue__get_inout_iov(kvm, job->vq, job->rep_iov,
+					 job->req_iov, &req.rep_cnt,
+					 &req.req_cnt);
+	req.req_size = iov_size(job->req_iov, req.req_cnt);
+	req.rep_size = iov_size(job->rep_iov, req.rep_cnt);
+
+	if (req.req_size < sizeof(req.hdr))
+		goto out;
+
+	fs_iov_copy(job->req_iov, req.req_cnt, 0, &req.hdr, sizeof(req.hdr),
+		    false);
+	req.arg_len = fs_iov_copy(job->req_iov, req.req_cnt, sizeof(req.hdr),
+				  job->arg, VIRTIO_FS_ARG_MAX, false);
+
+	if (req.hdr.opcode < ARRAY_SIZE(fs_ops))
+		op = &fs_ops[req.hdr.opcode];
+
+	r = fs_handle_request(fs, &req, op);
+	if (req.inode)
+		fs_put_inode(fs, req.inode);
+
+	if ((op && op->no_reply) || req.rep_size < sizeof(out))
+		goto out;
+
+	if (r < 0 || req.reply_len + req.direct_len >
+		     req.rep_size - sizeof(out)) {
+		r = r < 0 ? r : -ERANGE;
+		req.reply_len = req.direct_len = 0;
+	}
+
+	out = (struct fuse_out_header) {
+		.len		= sizeof(out) + req.reply_len + req.direct_len,
+		.error		= r < 0 ? r : 0,
+		.unique		= req.hdr.unique,
+	};
+	fs_iov_copy(job->rep_iov, req.rep_cnt, 0, &out, sizeof(out), true);
+	fs_iov_copy(job->rep_iov, req.rep_cnt, sizeof(out), req.reply,
+		    req.reply_len, true);
+	len = out.len;
+out:
+	if (req.reply != job->reply)
+		free(req.reply);
+	virt_queue__set_used_elem(job->vq, head, len);
+}
+
+static void virtio_fs_do_io(struct kvm *kvm, void *param)
+{
+	struct fs_dev_job *job	= param;
+	struct virt_queue *vq	= job->vq;
+	struct fs_dev *fs	= job->fs;
+
+	while (virt_queue__available(vq)) {
+		virtio_fs_do_request(kvm, fs, job);
+		if (virtio_queue__should_signal(vq))
+			fs->vdev.ops->signal_vq(kvm, &fs->vdev, vq - fs->vqs);
+	}
+}
+
+static u8 *get_config(struct kvm *kvm, void *dev)
+{
+	struct fs_dev *fs = dev;
+
+	return (u8 *)&fs->config;
+}
+
+static size_t get_config_size(struct kvm *kvm, void *dev)
+{
+	struct fs_dev *fs = dev;
+
+	return sizeof(fs->config);
+}
+
+static u64 get_host_features(struct kvm *kvm, void *dev)
+{
+	return 1UL << VIRTIO_RING_F_INDIRECT_DESC
+		| 1UL << VIRTIO_RING_F_EVENT_IDX;
+}
+
+static void notify_status(struct kvm *kvm, void *dev, u32 status)
+{
+	struct fs_dev *fs = dev;
+
+	if (status & VIRTIO__STATUS_CONFIG)
+		fs->config.num_request_queues =
+			virtio_host_to_guest_u32(fs->vdev.endian,
+						 VIRTIO_FS_NR_REQUEST_QUEUES);
+
+	if (status & VIRTIO__STATUS_STOP)
+		fs_reset(fs);
+}
+
+static int init_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct fs_dev *fs = dev;
+	struct fs_dev_job *job;
+	struct virt_queue *queue;
+
+	compat__remove_message(compat_id);
+
+	queue		= &fs->vqs[vq];
+	job		= &fs->jobs[vq];
+
+	virtio_init_device_vq(kvm, &fs->vdev, queue, VIRTIO_FS_QUEUE_SIZE);
+
+	job->vq		= queue;
+	job->fs		= fs;
+	thread_pool__init_job(&job->job_id, kvm, virtio_fs_do_io, job);
+
+	return 0;
+}
+
+static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct fs_dev *fs = dev;
+
+	thread_pool__cancel_job(&fs->jobs[vq].job_id);
+}
+
+static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct fs_dev *fs = dev;
+
+	thread_pool__do_job(&fs->jobs[vq].job_id);
+
+	return 0;
+}
+
+static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct fs_dev *fs = dev;
+
+	return &fs->vqs[vq];
+}
+
+static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	return VIRTIO_FS_QUEUE_SIZE;
+}
+
+static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
+{
+	/* FIXME: dynamic */
+	return size;
+}
+
+static unsigned int get_vq_count(struct kvm *kvm, void *dev)
+{
+	return VIRTIO_FS_NR_QUEUES;
+}
+
+static void *get_shm_region(struct kvm *kvm, void *dev, u8 *id, u64 *size)
+{
+	struct fs_dev *fs = dev;
+
+	*id	= VIRTIO_FS_SHMCAP_ID_CACHE;
+	*size	= fs->dax_size;
+
+	return fs->dax;
+}
+
+static struct virtio_ops fs_dev_virtio_ops = {
+	.get_config		= get_config,
+	.get_config_size	= get_config_size,
+	.get_host_features	= get_host_features,
+	.get_vq_count		= get_vq_count,
+	.init_vq		= init_vq,
+	.exit_vq		= exit_vq,
+	.notify_status		= notify_status,
+	.notify_vq		= notify_vq,
+	.get_vq			= get_vq,
+	.get_size_vq		= get_size_vq,
+	.set_size_vq		= set_size_vq,
+	.get_shm_region		= get_shm_region,
+};
+
+static void fs_free(struct fs_dev *fs)
+{
+	if (fs->root) {
+		fs_reset(fs);
+		fs_put_inode(fs, fs->root);
+	}
+	if (fs->dax)
+		munmap(fs->dax, fs->dax_size);
+	free(fs->fds);
+	free(fs);
+}
+
+int virtio_fs__register(struct kvm *kvm, const char *root, const char *tag,
+			u64 dax_size, enum virtio_fs_cache cache)
+{
+	struct fs_inode *inode;
+	struct fs_dev *fs;
+	struct stat st;
+	int fd, r;
+
+	if (!tag || !*tag || strlen(tag) > sizeof(fs->config.tag))
+		return -EINVAL;
+
+	if (dax_size && (!is_power_of_two(dax_size) ||
+			 dax_size < (u64)getpagesize()))
+		return -EINVAL;
+
+	fs = calloc(1, sizeof(*fs));
+	if (!fs)
+		return -ENOMEM;
+
+	mutex_init(&fs->lock);
+	fs->nodes	= (struct rb_root)RB_ROOT;
+	fs->inos	= (struct rb_root)RB_ROOT;
+	fs->next_nodeid	= FUSE_ROOT_ID + 1;
+	fs->cache	= cache;
+	if (cache == VIRTIO_FS_CACHE_AUTO)
+		fs->timeout = VIRTIO_FS_TIMEOUT_AUTO;
+	else if (cache == VIRTIO_FS_CACHE_ALWAYS)
+		fs->timeout = VIRTIO_FS_TIMEOUT_ALWAYS;
+
+	strncpy(fs->root_dir, root, sizeof(fs->root_dir) - 1);
+	strcpy(fs->tag, tag);
+	memcpy(fs->config.tag, tag, strlen(tag));
+
+	fd = open(root, O_PATH | O_DIRECTORY);
+	if (fd < 0) {
+		r = -errno;
+		goto err;
+	}
+
+	inode = calloc(1, sizeof(*inode));
+	if (!inode || fstat(fd, &st) < 0) {
+		r = inode ? -errno : -ENOMEM;
+		free(inode);
+		close(fd);
+		goto err;
+	}
+
+	*inode = (struct fs_inode) {
+		.nodeid		= FUSE_ROOT_ID,
+		.dev		= st.st_dev,
+		.ino		= st.st_ino,
+		.fd		= fd,
+		.nlookup	= 1,
+		.refs		= 1,
+	};
+	fs->root = inode;
+	fs_insert_inode(fs, inode);
+
+	if (dax_size) {
+		/* Guest accesses outside of the mappings fault */
+		fs->dax = mmap(NULL, dax_size, PROT_NONE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			       -1, 0);
+		if (fs->dax == MAP_FAILED) {
+			fs->dax = NULL;
+			r = -errno;
+			goto err;
+		}
+		fs->dax_size	= dax_size;
+		fs->dax_align	= getpagesize();
+	}
+
+	list_add_tail(&fs->list, &fs_devs);
+
+	if (compat_id == -1)
+		compat_id = virtio_compat_add_message("virtio-fs", "CONFIG_VIRTIO_FS");
+
+	return 0;
+
+err:
+	fs_free(fs);
+	return r;
+}
+
+int virtio_fs_parser(const struct option *opt, const char *arg, int unset)
+{
+	enum virtio_fs_cache cache = VIRTIO_FS_CACHE_AUTO;
+	struct kvm *kvm = opt->ptr;
+	char *buf, *cur, *dir, *tag;
+	char path[PATH_MAX];
+	u64 dax_size = 0;
+	int r;
+
+	buf = strdup(arg);
+	if (!buf)
+		die("out of memory");
+
+	cur = buf;
+	dir = strsep(&cur, ",");
+	tag = strsep(&cur, ",");
+	if (!dir || !*dir || !tag || !*tag)
+		die("virtio-fs needs a directory and a tag: <dir>,<tag>");
+
+	while (cur) {
+		char *param = strsep(&cur, ",");
+
+		if (!strncmp(param, "dax=", 4)) {
+			dax_size = strtoull(param + 4, NULL, 10) * SZ_1M;
+		} else if (!strcmp(param, "cache=none")) {
+			cache = VIRTIO_FS_CACHE_NONE;
+		} else if (!strcmp(param, "cache=auto")) {
+			cache = VIRTIO_FS_CACHE_AUTO;
+		} else if (!strcmp(param, "cache=always")) {
+			cache = VIRTIO_FS_CACHE_ALWAYS;
+		} else {
+			die("Unknown virtio-fs parameter %s", param);
+		}
+	}
+
+	if (!realpath(dir, path))
+		die("Failed resolving virtio-fs path %s", dir);
+
+	r = virtio_fs__register(kvm, path, tag, dax_size, cache);
+	if (r < 0)
+		die("Unable to share %s with virtio-fs: %s", path, strerror(-r));
+
+	free(buf);
+	return 0;
+}
+
+int virtio_fs__init(struct kvm *kvm)
+{
+	enum virtio_trans trans = kvm->cfg.virtio_transport;
+	struct fs_dev *fs;
+	int r;
+
+	/* There is no legacy virtio-fs */
+	if (trans == VIRTIO_PCI_LEGACY)
+		trans = VIRTIO_PCI;
+	else if (trans == VIRTIO_MMIO_LEGACY)
+		trans = VIRTIO_MMIO;
+
+	list_for_each_entry(fs, &fs_devs, list) {
+		if (fs->dax && trans != VIRTIO_PCI) {
+			pr_warning("virtio-fs: DAX needs the PCI transport, disabled for %s",
+				   fs->tag);
+			munmap(fs->dax, fs->dax_size);
+			fs->dax = NULL;
+			fs->dax_size = 0;
+		}
+
+		/* The nodes of the guest are host files that snapshots don't keep */
+		snapshot__block("virtio-fs");
+		r = virtio_init(kvm, fs, &fs->vdev, &fs_dev_virtio_ops, trans,
+				PCI_DEVICE_ID_VIRTIO_FS, VIRTIO_ID_FS,
+				PCI_CLASS_FS);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+virtio_dev_init(virtio_fs__init);
+
+int virtio_fs__exit(struct kvm *kvm)
+{
+	struct fs_dev *fs, *tmp;
+
+	list_for_each_entry_safe(fs, tmp, &fs_devs, list) {
+		list_del(&fs->list);
+		virtio_exit(kvm, &fs->vdev);
+		fs_free(fs);
+	}
+
+	return 0;
+}
+virtio_dev_exit(virtio_fs__exit);
@@ -0,0 +1,817 @@
+#include "kvm/virtio-gpu.h"
+
+#include "kvm/virtio-pci-dev.h"
+
+#include "kvm/framebuffer.h"
+#include "kvm/guest_compat.h"
+#include "kvm/threadpool.h"
+#include "kvm/virtio.h"
+#include "kvm/mutex.h"
+#include "kvm/iovec.h"
+#include "kvm/util.h"
+#include "kvm/kvm.h"
+#include "kvm/snapshot.h"
+
+#include <linux/virtio_ring.h>
+#include <linux/virtio_gpu.h>
+
+#include <linux/byteorder.h>
+#include <linux/kernel.h>
+#include <linux/sizes.h>
+#include <linux/list.h>
+#include <linux/err.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#define PCI_DEVICE_ID_VIRTIO_GPU	(PCI_DEVICE_ID_VIRTIO_BASE + VIRTIO_ID_GPU)
+#define PCI_CLASS_GPU			0x038000
+
+#define VIRTIO_GPU_QUEUE_SIZE		256
+#define VIRTIO_GPU_CTRL_QUEUE		0
+#define VIRTIO_GPU_CURSOR_QUEUE		1
+#define VIRTIO_GPU_NR_QUEUES		2
+
+/* All the formats we take are 32 bits per pixel, copied as they are */
+#define VIRTIO_GPU_PIXEL_SIZE		4
+#define VIRTIO_GPU_MAX_RESOURCE_SIZE	SZ_256M
+#define VIRTIO_GPU_MAX_BACKING		16384
+
+struct gpu_resource {
+	struct list_head	list;
+	u32			id;
+	u32			format;
+	u32			width;
+	u32			height;
+
+	/* The framebuffer itself while the resource is scanned out whole */
+	u8			*data;
+	bool			on_fb;
+
+	struct iovec		*iov;
+	u32			nr_iov;
+	size_t			backing_size;
+};
+
+struct gpu_dev_job {
+	struct virt_queue	*vq;
+	struct gpu_dev		*gdev;
+	struct thread_pool__job	job_id;
+};
+
+struct gpu_dev {
+	struct virtio_device	vdev;
+	struct virtio_gpu_config config;
+	struct kvm		*kvm;
+
+	struct virt_queue	vqs[VIRTIO_GPU_NR_QUEUES];
+	struct gpu_dev_job	jobs[VIRTIO_GPU_NR_QUEUES];
+
+	struct framebuffer	fb;
+
+	struct mutex		mutex;
+	struct list_head	resources;
+	struct gpu_resource	*scanout;
+	struct virtio_gpu_rect	scanout_rect;
+};
+
+union gpu_request {
+	struct virtio_gpu_ctrl_hdr			hdr;
+	struct virtio_gpu_resource_create_2d		create_2d;
+	struct virtio_gpu_resource_unref		unref;
+	struct virtio_gpu_set_scanout			set_scanout;
+	struct virtio_gpu_resource_flush		flush;
+	struct virtio_gpu_transfer_to_host_2d		transfer;
+	struct virtio_gpu_resource_attach_backing	attach;
+	struct virtio_gpu_resource_detach_backing	detach;
+};
+
+static struct gpu_dev *gpu_dev;
+static int compat_id = -1;
+
+static struct gpu_resource *gpu_find_resource(struct gpu_dev *gdev, u32 id)
+{
+	struct gpu_resource *res;
+
+	list_for_each_entry(res, &gdev->resources, list)
+		if (res->id == id)
+			return res;
+
+	return NULL;
+}
+
+static bool gpu_rect_in(struct virtio_gpu_rect *r, u32 width, u32 height)
+{
+	return r->width && r->height &&
+	       r->x <= width && r->width <= width - r->x &&
+	       r->y <= height && r->height <= height - r->y;
+}
+
+static void gpu_rect_from_le(struct virtio_gpu_rect *r)
+{
+	r->x		= le32_to_cpu(r->x);
+	r->y		= le32_to_cpu(r->y);
+	r->width	= le32_to_cpu(r->width);
+	r->height	= le32_to_cpu(r->height);
+}
+
+/*
+ * Copy the part @r of the scanout resource, in resource coordinates, to
+ * the framebuffer. The scanout rectangle goes to its top left corner.
+ */
+static void gpu_blit(struct gpu_dev *gdev, struct virtio_gpu_rect *r)
+{
+	struct virtio_gpu_rect *sr = &gdev->scanout_rect;
+	struct gpu_resource *res = gdev->scanout;
+	struct framebuffer *fb = &gdev->fb;
+	u32 x0, y0, x1, y1, y, src_stride;
+
+	x0 = max(r->x, sr->x);
+	y0 = max(r->y, sr->y);
+	x1 = min(min(r->x + r->width, sr->x + sr->width), sr->x + fb->width);
+	y1 = min(min(r->y + r->height, sr->y + sr->height), sr->y + fb->height);
+	if (x0 >= x1 || y0 >= y1)
+		return;
+
+	if (!res->on_fb) {
+		src_stride = res->width * VIRTIO_GPU_PIXEL_SIZE;
+		for (y = y0; y < y1; y++)
+			memcpy(fb->mem + (y - sr->y) * fb->width * VIRTIO_GPU_PIXEL_SIZE +
+			       (x0 - sr->x) * VIRTIO_GPU_PIXEL_SIZE,
+			       res->data + y * src_stride + x0 * VIRTIO_GPU_PIXEL_SIZE,
+			       (x1 - x0) * VIRTIO_GPU_PIXEL_SIZE);
+	}
+
+	fb__damage(fb, y0 - sr->y, y1 - y0);
+}
+
+static bool gpu_resource_fits_fb(struct gpu_dev *gdev, struct gpu_resource *res,
+				 struct virtio_gpu_rect *r)
+{
+	return res->width == gdev->fb.width && res->height == gdev->fb.height &&
+	       !r->x && !r->y && r->width == res->width && r->height == res->height;
+}
+
+/* Give the scanout resource its own copy of the pixels back */
+static int gpu_unpin(struct gpu_dev *gdev, struct gpu_resource *res)
+{
+	size_t size = (size_t)res->width * res->height * VIRTIO_GPU_PIXEL_SIZE;
+	u8 *data;
+
+	if (!res->on_fb)
+		return 0;
+
+	data = malloc(size);
+	if (!data)
+		return -ENOMEM;
+
+	memcpy(data, gdev->fb.mem, size);
+	res->data	= data;
+	res->on_fb	= false;
+
+	return 0;
+}
+
+static void gpu_clear_fb(struct gpu_dev *gdev)
+{
+	struct framebuffer *fb = &gdev->fb;
+
+	memset(fb->mem, 0, fb->width * fb->height * VIRTIO_GPU_PIXEL_SIZE);
+	fb__damage(fb, 0, fb->height);
+}
+
+/* Without its own copy of the pixels, the resource can't be used anymore */
+static void gpu_drop_scanout(struct gpu_dev *gdev, bool keep_pixels)
+{
+	struct gpu_resource *res = gdev->scanout;
+
+	if (!res)
+		return;
+
+	if (res->on_fb && (!keep_pixels || gpu_unpin(gdev, res) < 0)) {
+		res->data	= NULL;
+		res->on_fb	= false;
+	}
+
+	gdev->scanout = NULL;
+	gpu_clear_fb(gdev);
+}
+
+static void gpu_free_resource(struct gpu_dev *gdev, struct gpu_resource *res)
+{
+	if (gdev->scanout == res)
+		gpu_drop_scanout(gdev, false);
+
+	list_del(&res->list);
+	if (!res->on_fb)
+		free(res->data);
+	free(res->iov);
+	free(res);
+}
+
+static u32 gpu_create_2d(struct gpu_dev *gdev,
+			 struct virtio_gpu_resource_create_2d *req)
+{
+	u32 id = le32_to_cpu(req->resource_id);
+	struct gpu_resource *res;
+	u64 size;
+
+	if (!id || gpu_find_resource(gdev, id))
+		return VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+
+	switch (le32_to_cpu(req->format)) {
+	case VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM:
+	case VIRTIO_GPU_FORMAT_B8G8R8X8_UNORM:
+	case VIRTIO_GPU_FORMAT_A8R8G8B8_UNORM:
+	case VIRTIO_GPU_FORMAT_X8R8G8B8_UNORM:
+	case VIRTIO_GPU_FORMAT_R8G8B8A8_UNORM:
+	case VIRTIO_GPU_FORMAT_X8B8G8R8_UNORM:
+	case VIRTIO_GPU_FORMAT_A8B8G8R8_UNORM:
+	case VIRTIO_GPU_FORMAT_R8G8B8X8_UNORM:
+		break;
+	default:
+		return VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+	}
+
+	size = (u64)le32_to_cpu(req->width) * le32_to_cpu(req->height) *
+	       VIRTIO_GPU_PIXEL_SIZE;
+	if (!size)
+		return VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+	if (size > VIRTIO_GPU_MAX_RESOURCE_SIZE)
+		return VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+
+	res = calloc(1, sizeof(*res));
+	if (!res)
+		return VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+
+	res->data = calloc(1, size);
+	if (!res->data) {
+		free(res);
+		return VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+	}
+
+	res->id		= id;
+	res->format	= le32_to_cpu(req->format);
+	res->width	= le32_to_cpu(req->width);
+	res->height	= le32_to_cpu(req->height);
+	list_add_tail(&res->list, &gdev->resources);
+
+	return VIRTIO_GPU_RESP_OK_NODATA;
+}
+
+static u32 gpu_unref(struct gpu_dev *gdev, struct virtio_gpu_resource_unref *req)
+{
+	struct gpu_resource *res;
+
+	res = gpu_find_resource(gdev, le32_to_cpu(req->resource_id));
+	if (!res)
+		return VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+
+	gpu_free_resource(gdev, res);
+
+	return VIRTIO_GPU_RESP_OK_NODATA;
+}
+
+/*
+ * A resource the size of the display, scanned out whole, is moved into
+ * the framebuffer: the transfers then write straight to what the UI shows
+ * and flushes only have to report the damage.
+ */
+static u32 gpu_set_scanout(struct gpu_dev *gdev, struct virtio_gpu_set_scanout *req)
+{
+	struct virtio_gpu_rect r = req->r;
+	struct gpu_resource *res;
+	size_t size;
+	u32 id;
+
+	if (le32_to_cpu(req->scanout_id) != 0)
+		return VIRTIO_GPU_RESP_ERR_INVALID_SCANOUT_ID;
+
+	id = le32_to_cpu(req->resource_id);
+	if (!id) {
+		gpu_drop_scanout(gdev, true);
+		return VIRTIO_GPU_RESP_OK_NODATA;
+	}
+
+	res = gpu_find_resource(gdev, id);
+	if (!res || !res->data)
+		return VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+
+	gpu_rect_from_le(&r);
+	if (!gpu_rect_in(&r, res->width, res->height))
+		return VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+
+	if (gdev->scanout && gdev->scanout != res &&
+	    gpu_unpin(gdev, gdev->scanout) < 0)
+		return VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+
+	gdev->scanout		= res;
+	gdev->scanout_rect	= r;
+
+	if (res->on_fb && gpu_resource_fits_fb(gdev, res, &r)) {
+		fb__damage(&gdev->fb, 0, gdev->fb.height);
+		return VIRTIO_GPU_RESP_OK_NODATA;
+	}
+
+	if (gpu_unpin(gdev, res) < 0) {
+		gdev->scanout = NULL;
+		return VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+	}
+
+	if (gpu_resource_fits_fb(gdev, res, &r)) {
+		size = (size_t)res->width * res->height * VIRTIO_GPU_PIXEL_SIZE;
+		memcpy(gdev->fb.mem, res->data, size);
+		free(res->data);
+		res->data	= (u8 *)gdev->fb.mem;
+		res->on_fb	= true;
+		fb__damage(&gdev->fb, 0, gdev->fb.height);
+		return VIRTIO_GPU_RESP_OK_NODATA;
+	}
+
+	gpu_clear_fb(gdev);
+	gpu_blit(gdev, &r);
+
+	return VIRTIO_GPU_RESP_OK_NODATA;
+}
+
+static u32 gpu_flush(struct gpu_dev *gdev, struct virtio_gpu_resource_flush *req)
+{
+	struct virtio_gpu_rect r = req->r;
+	struct gpu_resource *res;
+
+	res = gpu_find_resource(gdev, le32_to_cpu(req->resource_id));
+	if (!res)
+		return VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+
+	gpu_rect_from_le(&r);
+	if (!gpu_rect_in(&r, res->width, res->height))
+		return VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+
+	if (res == gdev->scanout)
+		gpu_blit(gdev, &r);
+
+	return VIRTIO_GPU_RESP_OK_NODATA;
+}
+
+static u32 gpu_transfer_to_host_2d(struct gpu_dev *gdev,
+				   struct virtio_gpu_transfer_to_host_2d *req)
+{
+	struct virtio_gpu_rect r = req->r;
+	u64 offset = le64_to_cpu(req->offset);
+	struct gpu_resource *res;
+	u32 stride, len, y;
+
+	res = gpu_find_resource(gdev, le32_to_cpu(req->resource_id));
+	if (!res || !res->data)
+		return VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+
+	if (!res->iov)
+		return VIRTIO_GPU_RESP_ERR_UNSPEC;
+
+	gpu_rect_from_le(&r);
+	if (!gpu_rect_in(&r, res->width, res->height))
+		return VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+
+	stride	= res->width * VIRTIO_GPU_PIXEL_SIZE;
+	len	= r.width * VIRTIO_GPU_PIXEL_SIZE;
+	if (offset > res->backing_size ||
+	    (u64)stride * (r.height - 1) + len > res->backing_size - offset)
+		return VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+
+	/* Whole rows are contiguous on both sides */
+	if (r.width == res->width)
+		return memcpy_fromiovecend(res->data + r.y * stride, res->iov,
+					   offset, stride * r.height) ?
+		       VIRTIO_GPU_RESP_ERR_UNSPEC : VIRTIO_GPU_RESP_OK_NODATA;
+
+	for (y = 0; y < r.height; y++)
+		if (memcpy_fromiovecend(res->data + (r.y + y) * stride +
+					r.x * VIRTIO_GPU_PIXEL_SIZE,
+					res->iov, offset + (u64)stride * y, len))
+			return VIRTIO_GPU_RESP_ERR_UNSPEC;
+
+	return VIRTIO_GPU_RESP_OK_NODATA;
+}
+
+static u32 gpu_attach_backing(struct gpu_dev *gdev,
+			      struct virtio_gpu_resource_attach_backing *req,
+			      struct iovec *out, size_t out_len)
+{
+	u32 nr = le32_to_cpu(req->nr_entries);
+	struct virtio_gpu_mem_entry *entries;
+	struct gpu_resource *res;
+	u32 i, ret;
+
+	res = gpu_find_resource(gdev, le32_to_cpu(req->resource_id));
+	if (!res)
+		return VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+
+	if (res->iov || !nr || nr > VIRTIO_GPU_MAX_BACKING ||
+	    out_len < sizeof(*req) + nr * sizeof(*entries))
+		return VIRTIO_GPU_RESP_ERR_UNSPEC;
+
+	entries = malloc(nr * sizeof(*entries));
+	res->iov = calloc(nr, sizeof(*res->iov));
+	if (!entries || !res->iov) {
+		ret = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+		goto out_free;
+	}
+
+	memcpy_fromiovecend((void *)entries, out, sizeof(*req),
+			    nr * sizeof(*entries));
+
+	res->backing_size = 0;
+	for (i = 0; i < nr; i++) {
+		u64 addr = le64_to_cpu(entries[i].addr);
+		u32 len = le32_to_cpu(entries[i].length);
+		u8 *start, *end;
+
+		start = guest_flat_to_host(gdev->kvm, addr);
+		end = len ? guest_flat_to_host(gdev->kvm, addr + len - 1) : start;
+		if (!start || end != start + (len ? len - 1 : 0)) {
+			ret = VIRTIO_GPU_RESP_ERR_UNSPEC;
+			goto out_free;
+		}
+
+		res->iov[i] = (struct iovec) {
+			.iov_base	= start,
+			.iov_len	= len,
+		};
+		res->backing_size += len;
+	}
+
+	res->nr_iov = nr;
+	free(entries);
+
+	return VIRTIO_GPU_RESP_OK_NODATA;
+
+out_free:
+	free(res->iov);
+	res->iov = NULL;
+	res->backing_size = 0;
+	free(entries);
+
+	return ret;
+}
+
+static u32 gpu_detach_backing(struct gpu_dev *gdev,
+			      struct virtio_gpu_resource_detach_backing *req)
+{
+	struct gpu_resource *res;
+
+	res = gpu_find_resource(gdev, le32_to_cpu(req->resource_id));
+	if (!res)
+		return VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+
+	if (!res->iov)
+		return VIRTIO_GPU_RESP_ERR_UNSPEC;
+
+	free(res->iov);
+	res->iov		= NULL;
+	res->nr_iov		= 0;
+	res->backing_size	= 0;
+
+	return VIRTIO_GPU_RESP_OK_NODATA;
+}
+
+static size_t gpu_display_info(struct gpu_dev *gdev,
+			       struct virtio_gpu_resp_display_info *resp)
+{
+	resp->pmodes[0].r.width		= cpu_to_le32(gdev->fb.width);
+	resp->pmodes[0].r.height	= cpu_to_le32(gdev->fb.height);
+	resp->pmodes[0].enabled		= cpu_to_le32(1);
+
+	return sizeof(*resp);
+}
+
+static size_t gpu_request_size(u32 type)
+{
+	switch (type) {
+	case VIRTIO_GPU_CMD_GET_DISPLAY_INFO:
+		return sizeof(struct virtio_gpu_ctrl_hdr);
+	case VIRTIO_GPU_CMD_RESOURCE_CREATE_2D:
+		return sizeof(struct virtio_gpu_resource_create_2d);
+	case VIRTIO_GPU_CMD_RESOURCE_UNREF:
+		return sizeof(struct virtio_gpu_resource_unref);
+	case VIRTIO_GPU_CMD_SET_SCANOUT:
+		return sizeof(struct virtio_gpu_set_scanout);
+	case VIRTIO_GPU_CMD_RESOURCE_FLUSH:
+		return sizeof(struct virtio_gpu_resource_flush);
+	case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D:
+		return sizeof(struct virtio_gpu_transfer_to_host_2d);
+	case VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING:
+		return sizeof(struct virtio_gpu_resource_attach_backing);
+	case VIRTIO_GPU_CMD_RESOURCE_DETACH_BACKING:
+		return sizeof(struct virtio_gpu_resource_detach_backing);
+	default:
+		return sizeof(struct virtio_gpu_ctrl_hdr);
+	}
+}
+
+static u32 gpu_handle_cmd(struct gpu_dev *gdev, union gpu_request *req,
+			  struct iovec *out, size_t out_len,
+			  struct virtio_gpu_resp_display_info *resp,
+			  size_t *resp_len)
+{
+	u32 type = le32_to_cpu(req->hdr.type);
+
+	if (out_len < gpu_request_size(type))
+		return VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+
+	switch (type) {
+	case VIRTIO_GPU_CMD_GET_DISPLAY_INFO:
+		*resp_len = gpu_display_info(gdev, resp);
+		return VIRTIO_GPU_RESP_OK_DISPLAY_INFO;
+	case VIRTIO_GPU_CMD_RESOURCE_CREATE_2D:
+		return gpu_create_2d(gdev, &req->create_2d);
+	case VIRTIO_GPU_CMD_RESOURCE_UNREF:
+		return gpu_unref(gdev, &req->unref);
+	case VIRTIO_GPU_CMD_SET_SCANOUT:
+		return gpu_set_scanout(gdev, &req->set_scanout);
+	case VIRTIO_GPU_CMD_RESOURCE_FLUSH:
+		return gpu_flush(gdev, &req->flush);
+	case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D:
+		return gpu_transfer_to_host_2d(gdev, &req->transfer);
+	case VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING:
+		return gpu_attach_backing(gdev, &req->attach, out, out_len);
+	case VIRTIO_GPU_CMD_RESOURCE_DETACH_BACKING:
+		return gpu_detach_backing(gdev, &req->detach);
+	default:
+		return VIRTIO_GPU_RESP_ERR_UNSPEC;
+	}
+}
+
+/*
+ * Commands complete before we answer them, so fences are signalled right
+ * away by echoing them in the response.
+ */
+static u32 virtio_gpu_do_ctrl_request(struct gpu_dev *gdev, struct virt_queue *vq,
+				      u16 *head)
+{
+	struct iovec iov[VIRTIO_GPU_QUEUE_SIZE];
+	struct virtio_gpu_resp_display_info resp;
+	union gpu_request req;
+	size_t out_len, in_len, resp_len;
+	u16 out, in;
+
+	*head = virt_queue__get_iov(vq, iov, &out, &in, gdev->kvm);
+
+	out_len	= iov_size(iov, out);
+	in_len	= iov_size(iov + out, in);
+
+	memset(&req, 0, sizeof(req));
+	memset(&resp, 0, sizeof(resp));
+	memcpy_fromiovecend((void *)&req, iov, 0, min(out_len, sizeof(req)));
+
+	resp_len = sizeof(resp.hdr);
+	if (out_len < sizeof(req.hdr)) {
+		resp.hdr.type = VIRTIO_GPU_RESP_ERR_UNSPEC;
+	} else {
+		mutex_lock(&gdev->mutex);
+		resp.hdr.type = gpu_handle_cmd(gdev, &req, iov, out_len,
+					       &resp, &resp_len);
+		mutex_unlock(&gdev->mutex);
+	}
+
+	resp.hdr.type = cpu_to_le32(resp.hdr.type);
+	if (req.hdr.flags & cpu_to_le32(VIRTIO_GPU_FLAG_FENCE)) {
+		resp.hdr.flags		= cpu_to_le32(VIRTIO_GPU_FLAG_FENCE);
+		resp.hdr.fence_id	= req.hdr.fence_id;
+		resp.hdr.ctx_id		= req.hdr.ctx_id;
+	}
+
+	resp_len = min(resp_len, in_len);
+	memcpy_toiovecend(iov + out, (void *)&resp, 0, resp_len);
+
+	return resp_len;
+}
+
+static void virtio_gpu_do_io(struct kvm *kvm, void *param)
+{
+	struct gpu_dev_job *job	= param;
+	struct virt_queue *vq	= job->vq;
+	struct gpu_dev *gdev	= job->gdev;
+	struct iovec iov[VIRTIO_GPU_QUEUE_SIZE];
+	u16 out, in, head;
+	u32 len;
+
+	while (virt_queue__available(vq)) {
+		/* There is no cursor on our displays, only take the updates */
+		if (vq == &gdev->vqs[VIRTIO_GPU_CURSOR_QUEUE]) {
+			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+			len = 0;
+		} else {
+			len = virtio_gpu_do_ctrl_request(gdev, vq, &head);
+		}
+
+		virt_queue__set_used_elem(vq, head, len);
+	}
+
+	gdev->vdev.ops->signal_vq(kvm, &gdev->vdev, vq - gdev->vqs);
+}
+
+static void gpu_reset(struct gpu_dev *gdev)
+{
+	struct gpu_resource *res, *tmp;
+
+	mutex_lock(&gdev->mutex);
+	list_for_each_entry_safe(res, tmp, &gdev->resources, list)
+		gpu_free_resource(gdev, res);
+	mutex_unlock(&gdev->mutex);
+}
+
+static u8 *get_config(struct kvm *kvm, void *dev)
+{
+	struct gpu_dev *gdev = dev;
+
+	return (u8 *)&gdev->config;
+}
+
+static size_t get_config_size(struct kvm *kvm, void *dev)
+{
+	struct gpu_dev *gdev = dev;
+
+	return sizeof(gdev->config);
+}
+
+static u64 get_host_features(struct kvm *kvm, void *dev)
+{
+	return 1UL << VIRTIO_RING_F_INDIRECT_DESC
+		| 1UL << VIRTIO_RING_F_EVENT_IDX;
+}
+
+static void notify_status(struct kvm *kvm, void *dev, u32 status)
+{
+	struct gpu_dev *gdev = dev;
+
+	if (status & VIRTIO__STATUS_CONFIG)
+		gdev->config.num_scanouts =
+			virtio_host_to_guest_u32(gdev->vdev.endian, 1);
+
+	if (status & VIRTIO__STATUS_STOP)
+		gpu_reset(gdev);
+}
+
+static int init_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct gpu_dev *gdev = dev;
+	struct gpu_dev_job *job;
+	struct virt_queue *queue;
+
+	compat__remove_message(compat_id);
+
+	queue	= &gdev->vqs[vq];
+	job	= &gdev->jobs[vq];
+
+	virtio_init_device_vq(kvm, &gdev->vdev, queue, VIRTIO_GPU_QUEUE_SIZE);
+
+	job->vq		= queue;
+	job->gdev	= gdev;
+	thread_pool__init_job(&job->job_id, kvm, virtio_gpu_do_io, job);
+
+	return 0;
+}
+
+static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct gpu_dev *gdev = dev;
+
+	thread_pool__cancel_job(&gdev->jobs[vq].job_id);
+}
+
+static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct gpu_dev *gdev = dev;
+
+	thread_pool__do_job(&gdev->jobs[vq].job_id);
+
+	return 0;
+}
+
+static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct gpu_dev *gdev = dev;
+
+	return &gdev->vqs[vq];
+}
+
+static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	return VIRTIO_GPU_QUEUE_SIZE;
+}
+
+static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
+{
+	/* FIXME: dynamic */
+	return size;
+}
+
+static unsigned int get_vq_count(struct kvm *kvm, void *dev)
+{
+	return VIRTIO_GPU_NR_QUEUES;
+}
+
+static struct virtio_ops gpu_dev_virtio_ops = {
+	.get_config		= get_config,
+	.get_config_size	= get_config_size,
+	.get_host_features	= get_host_features,
+	.get_vq_count		= get_vq_count,
+	.init_vq		= init_vq,
+	.exit_vq		= exit_vq,
+	.notify_status		= notify_status,
+	.notify_vq		= notify_vq,
+	.get_vq			= get_vq,
+	.get_size_vq		= get_size_vq,
+	.set_size_vq		= set_size_vq,
+};
+
+/*
+ * Unlike VESA, the framebuffer isn't guest memory: the guest copies its
+ * pixels in with TRANSFER_TO_HOST_2D and tells us what changed with
+ * RESOURCE_FLUSH.
+ */
+struct framebuffer *virtio_gpu__init(struct kvm *kvm)
+{
+	enum virtio_trans trans = kvm->cfg.virtio_transport;
+	struct gpu_dev *gdev;
+	u64 size;
+	int r;
+
+	/* There is no legacy virtio-gpu */
+	if (trans == VIRTIO_PCI_LEGACY)
+		trans = VIRTIO_PCI;
+	else if (trans == VIRTIO_MMIO_LEGACY)
+		trans = VIRTIO_MMIO;
+
+	gdev = calloc(1, sizeof(*gdev));
+	if (!gdev)
+		return ERR_PTR(-ENOMEM);
+
+	size = VIRTIO_GPU_WIDTH * VIRTIO_GPU_HEIGHT * VIRTIO_GPU_BPP / 8;
+
+	gdev->kvm = kvm;
+	gdev->fb = (struct framebuffer) {
+		.width		= VIRTIO_GPU_WIDTH,
+		.height		= VIRTIO_GPU_HEIGHT,
+		.depth		= VIRTIO_GPU_BPP,
+		.mem_size	= ALIGN(size, PAGE_SIZE),
+		.kvm		= kvm,
+		.damage		= true,
+	};
+	mutex_init(&gdev->mutex);
+	INIT_LIST_HEAD(&gdev->resources);
+
+	gdev->fb.mem = mmap(NULL, gdev->fb.mem_size, PROT_RW, MAP_ANON_NORESERVE,
+			    -1, 0);
+	if (gdev->fb.mem == MAP_FAILED) {
+		r = -errno;
+		goto err_free;
+	}
+
+	/* Snapshots don't keep the resources of the guest */
+	snapshot__block("virtio-gpu");
+	r = virtio_init(kvm, gdev, &gdev->vdev, &gpu_dev_virtio_ops, trans,
+			PCI_DEVICE_ID_VIRTIO_GPU, VIRTIO_ID_GPU, PCI_CLASS_GPU);
+	if (r < 0)
+		goto err_unmap;
+
+	gpu_dev = gdev;
+
+	if (compat_id == -1)
+		compat_id = virtio_compat_add_message("virtio-gpu", "CONFIG_DRM_VIRTIO_GPU");
+
+	return fb__register(&gdev->fb);
+
+err_unmap:
+	munmap(gdev->fb.mem, gdev->fb.mem_size);
+err_free:
+	free(gdev);
+
+	return ERR_PTR(r);
+}
+
+int virtio_gpu__exit(struct kvm *kvm)
+{
+	struct gpu_dev *gdev = gpu_dev;
+	struct gpu_resource *res, *tmp;
+
+	if (!gdev)
+		return 0;
+
+	/* fb__exit() has unmapped the framebuffer already */
+	list_for_each_entry_safe(res, tmp, &gdev->resources, list) {
+		list_del(&res->list);
+		if (!res->on_fb)
+			free(res->data);
+		free(res->iov);
+		free(res);
+	}
+
+	virtio_exit(kvm, &gdev->vdev);
+	free(gdev);
+	gpu_dev = NULL;
+
+	return 0;
+}
+virtio_dev_exit(virtio_gpu__exit);
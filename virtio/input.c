@@ -0,0 +1,455 @@
+#include "kvm/virtio-input.h"
+
+#include "kvm/virtio-pci-dev.h"
+
+#include "kvm/guest_compat.h"
+#include "kvm/kvm.h"
+#include "kvm/mutex.h"
+#include "kvm/threadpool.h"
+#include "kvm/util.h"
+#include "kvm/virtio.h"
+#include "kvm/iovec.h"
+
+#include <linux/byteorder.h>
+#include <linux/input.h>
+#include <linux/kernel.h>
+#include <linux/virtio_input.h>
+#include <linux/virtio_ring.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PCI_DEVICE_ID_VIRTIO_INPUT	(PCI_DEVICE_ID_VIRTIO_BASE + VIRTIO_ID_INPUT)
+#define PCI_CLASS_INPUT			0x098000
+
+#define NUM_VIRT_QUEUES			2
+#define VIRTIO_INPUT_EVENTQ		0
+#define VIRTIO_INPUT_STATUSQ		1
+#define VIRTIO_INPUT_QUEUE_SIZE		128
+
+/* Events waiting for buffers of the guest, a power of two */
+#define VIRTIO_INPUT_PENDING		256
+/* The range of the tablet axes, whatever the size of the screen */
+#define VIRTIO_INPUT_ABS_MAX		0x7fff
+#define VIRTIO_INPUT_BITMAP_SIZE	sizeof(((struct virtio_input_config *)0)->u.bitmap)
+
+enum {
+	VIRTIO_INPUT_KEYBOARD,
+	VIRTIO_INPUT_TABLET,
+	VIRTIO_INPUT_NR_DEVS,
+};
+
+/*
+ * The UIs queue whole reports, which the eventq job copies into as many
+ * buffers as the guest gave, before a single interrupt for all of them.
+ * A burst of pointer motion costs one exit-free copy per event rather than
+ * a dozen port accesses and interrupts per movement with the i8042.
+ */
+struct input_dev {
+	struct virtio_device		vdev;
+	struct virtio_input_config	config;
+
+	const char			*name;
+	u16				product;
+	/* The codes that the device sends, per EV_* type */
+	u8				ev_bits[EV_CNT][VIRTIO_INPUT_BITMAP_SIZE];
+
+	/* Of the pending events, and of ready */
+	struct mutex			mutex;
+	/* Set while the guest has the eventq, the events are dropped before */
+	bool				ready;
+	u32				head, tail;
+	struct virtio_input_event	pending[VIRTIO_INPUT_PENDING];
+	/* Of the last pointer report, only the UI thread touches it */
+	u32				buttons;
+
+	struct virt_queue		vqs[NUM_VIRT_QUEUES];
+	struct thread_pool__job		jobs[NUM_VIRT_QUEUES];
+};
+
+static struct input_dev *input_devs[VIRTIO_INPUT_NR_DEVS];
+static int compat_id = -1;
+
+static void input_dev__set_bit(struct input_dev *idev, u16 type, u16 code)
+{
+	idev->ev_bits[type][code / 8] |= 1 << (code % 8);
+}
+
+/* The bytes of the bitmap up to its last set bit */
+static u8 input_dev__bitmap_size(const u8 *bitmap)
+{
+	u8 size = VIRTIO_INPUT_BITMAP_SIZE;
+
+	while (size && !bitmap[size - 1])
+		size--;
+
+	return size;
+}
+
+/* The driver picked what the union of the config describes */
+static void input_dev__select(struct input_dev *idev)
+{
+	struct virtio_input_config *cfg = &idev->config;
+	u8 size = 0;
+
+	memset(&cfg->u, 0, sizeof(cfg->u));
+
+	switch (cfg->select) {
+	case VIRTIO_INPUT_CFG_ID_NAME:
+		size = strlen(idev->name);
+		memcpy(cfg->u.string, idev->name, size);
+		break;
+	case VIRTIO_INPUT_CFG_ID_DEVIDS:
+		cfg->u.ids = (struct virtio_input_devids) {
+			.bustype	= cpu_to_le16(BUS_VIRTUAL),
+			.vendor		= cpu_to_le16(PCI_VENDOR_ID_REDHAT_QUMRANET),
+			.product	= cpu_to_le16(idev->product),
+			.version	= cpu_to_le16(1),
+		};
+		size = sizeof(cfg->u.ids);
+		break;
+	case VIRTIO_INPUT_CFG_EV_BITS:
+		if (cfg->subsel >= EV_CNT)
+			break;
+		size = input_dev__bitmap_size(idev->ev_bits[cfg->subsel]);
+		memcpy(cfg->u.bitmap, idev->ev_bits[cfg->subsel], size);
+		break;
+	case VIRTIO_INPUT_CFG_ABS_INFO:
+		if (!input_dev__bitmap_size(idev->ev_bits[EV_ABS]) ||
+		    (cfg->subsel != ABS_X && cfg->subsel != ABS_Y))
+			break;
+		cfg->u.abs.max = cpu_to_le32(VIRTIO_INPUT_ABS_MAX);
+		size = sizeof(cfg->u.abs);
+		break;
+	}
+
+	cfg->size = size;
+}
+
+static void input_ev(struct virtio_input_event *ev, u16 type, u16 code,
+		     s32 value)
+{
+	*ev = (struct virtio_input_event) {
+		.type	= cpu_to_le16(type),
+		.code	= cpu_to_le16(code),
+		.value	= cpu_to_le32(value),
+	};
+}
+
+/* Reports go whole or not at all, the guest would misread half of one */
+static void input_dev__queue(struct input_dev *idev,
+			     const struct virtio_input_event *ev, u32 nr)
+{
+	bool kick = false;
+	u32 i;
+
+	mutex_lock(&idev->mutex);
+	if (idev->ready && idev->tail - idev->head + nr <= VIRTIO_INPUT_PENDING) {
+		for (i = 0; i < nr; i++)
+			idev->pending[idev->tail++ % VIRTIO_INPUT_PENDING] = ev[i];
+		kick = true;
+	}
+	mutex_unlock(&idev->mutex);
+
+	if (kick)
+		thread_pool__do_job(&idev->jobs[VIRTIO_INPUT_EVENTQ]);
+}
+
+static void virtio_input_do_events(struct kvm *kvm, void *param)
+{
+	struct input_dev *idev = param;
+	struct virt_queue *vq = &idev->vqs[VIRTIO_INPUT_EVENTQ];
+	struct iovec iov[VIRTIO_INPUT_QUEUE_SIZE];
+	struct virtio_input_event *ev;
+	u16 out, in, head;
+	u32 nr = 0;
+
+	mutex_lock(&idev->mutex);
+	while (idev->head != idev->tail && virt_queue__available(vq)) {
+		head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+		if (iov_size(iov + out, in) < sizeof(*ev)) {
+			pr_warning("virtio-input: event buffer too small");
+			virt_queue__set_used_elem(vq, head, 0);
+			continue;
+		}
+
+		ev = &idev->pending[idev->head++ % VIRTIO_INPUT_PENDING];
+		memcpy_toiovecend(iov + out, (void *)ev, 0, sizeof(*ev));
+		virt_queue__set_used_elem(vq, head, sizeof(*ev));
+		nr++;
+	}
+	mutex_unlock(&idev->mutex);
+
+	if (nr)
+		idev->vdev.ops->signal_vq(kvm, &idev->vdev, VIRTIO_INPUT_EVENTQ);
+}
+
+/* LEDs and sounds, which there is nothing to do with */
+static void virtio_input_do_status(struct kvm *kvm, void *param)
+{
+	struct input_dev *idev = param;
+	struct virt_queue *vq = &idev->vqs[VIRTIO_INPUT_STATUSQ];
+
+	while (virt_queue__available(vq))
+		virt_queue__set_used_elem(vq, virt_queue__pop(vq), 0);
+
+	idev->vdev.ops->signal_vq(kvm, &idev->vdev, VIRTIO_INPUT_STATUSQ);
+}
+
+bool virtio_input__enabled(void)
+{
+	return input_devs[VIRTIO_INPUT_KEYBOARD] != NULL;
+}
+
+void virtio_input__key(u16 code, bool down)
+{
+	struct input_dev *idev = input_devs[VIRTIO_INPUT_KEYBOARD];
+	struct virtio_input_event ev[2];
+
+	if (!idev || !code || code >= KEY_CNT)
+		return;
+
+	input_ev(&ev[0], EV_KEY, code, down);
+	input_ev(&ev[1], EV_SYN, SYN_REPORT, 0);
+	input_dev__queue(idev, ev, ARRAY_SIZE(ev));
+}
+
+void virtio_input__pointer(u32 x, u32 y, u32 width, u32 height, u32 buttons)
+{
+	static const struct {
+		u32	mask;
+		u16	code;
+	} btns[] = {
+		{ VIRTIO_INPUT_BTN_LEFT,	BTN_LEFT },
+		{ VIRTIO_INPUT_BTN_MIDDLE,	BTN_MIDDLE },
+		{ VIRTIO_INPUT_BTN_RIGHT,	BTN_RIGHT },
+	};
+	struct input_dev *idev = input_devs[VIRTIO_INPUT_TABLET];
+	struct virtio_input_event ev[ARRAY_SIZE(btns) + 4];
+	u32 changed, i, nr = 0;
+
+	if (!idev || !width || !height)
+		return;
+
+	x = min(x, width - 1);
+	y = min(y, height - 1);
+	input_ev(&ev[nr++], EV_ABS, ABS_X,
+		 (u64)x * VIRTIO_INPUT_ABS_MAX / max(width - 1, 1U));
+	input_ev(&ev[nr++], EV_ABS, ABS_Y,
+		 (u64)y * VIRTIO_INPUT_ABS_MAX / max(height - 1, 1U));
+
+	changed = buttons ^ idev->buttons;
+	for (i = 0; i < ARRAY_SIZE(btns); i++) {
+		if (changed & btns[i].mask)
+			input_ev(&ev[nr++], EV_KEY, btns[i].code,
+				 !!(buttons & btns[i].mask));
+	}
+
+	/* A wheel step is a press of its button */
+	if (changed & buttons & VIRTIO_INPUT_WHEEL_UP)
+		input_ev(&ev[nr++], EV_REL, REL_WHEEL, 1);
+	else if (changed & buttons & VIRTIO_INPUT_WHEEL_DOWN)
+		input_ev(&ev[nr++], EV_REL, REL_WHEEL, -1);
+
+	input_ev(&ev[nr++], EV_SYN, SYN_REPORT, 0);
+	idev->buttons = buttons;
+
+	input_dev__queue(idev, ev, nr);
+}
+
+static u8 *get_config(struct kvm *kvm, void *dev)
+{
+	struct input_dev *idev = dev;
+
+	return (u8 *)&idev->config;
+}
+
+static size_t get_config_size(struct kvm *kvm, void *dev)
+{
+	struct input_dev *idev = dev;
+
+	return sizeof(idev->config);
+}
+
+static void set_config(struct kvm *kvm, void *dev, u32 offset, u32 size)
+{
+	struct input_dev *idev = dev;
+
+	if (offset < offsetof(struct virtio_input_config, size))
+		input_dev__select(idev);
+}
+
+static u64 get_host_features(struct kvm *kvm, void *dev)
+{
+	return 1UL << VIRTIO_RING_F_EVENT_IDX
+		| 1UL << VIRTIO_RING_F_INDIRECT_DESC;
+}
+
+static int init_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct input_dev *idev = dev;
+
+	compat__remove_message(compat_id);
+
+	virtio_init_device_vq(kvm, &idev->vdev, &idev->vqs[vq],
+			      VIRTIO_INPUT_QUEUE_SIZE);
+
+	if (vq == VIRTIO_INPUT_STATUSQ) {
+		thread_pool__init_job(&idev->jobs[vq], kvm,
+				      virtio_input_do_status, idev);
+		return 0;
+	}
+
+	thread_pool__init_job(&idev->jobs[vq], kvm, virtio_input_do_events,
+			      idev);
+	mutex_lock(&idev->mutex);
+	idev->ready = true;
+	mutex_unlock(&idev->mutex);
+
+	return 0;
+}
+
+static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct input_dev *idev = dev;
+
+	if (vq == VIRTIO_INPUT_EVENTQ) {
+		mutex_lock(&idev->mutex);
+		idev->ready = false;
+		idev->head = idev->tail = 0;
+		mutex_unlock(&idev->mutex);
+	}
+
+	thread_pool__cancel_job(&idev->jobs[vq]);
+}
+
+static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct input_dev *idev = dev;
+
+	/* New eventq buffers take the events that waited for them */
+	thread_pool__do_job(&idev->jobs[vq]);
+
+	return 0;
+}
+
+static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct input_dev *idev = dev;
+
+	return &idev->vqs[vq];
+}
+
+static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	return VIRTIO_INPUT_QUEUE_SIZE;
+}
+
+static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
+{
+	return size;
+}
+
+static unsigned int get_vq_count(struct kvm *kvm, void *dev)
+{
+	return NUM_VIRT_QUEUES;
+}
+
+static struct virtio_ops input_dev_virtio_ops = {
+	.get_config		= get_config,
+	.get_config_size	= get_config_size,
+	.set_config		= set_config,
+	.get_host_features	= get_host_features,
+	.init_vq		= init_vq,
+	.exit_vq		= exit_vq,
+	.notify_vq		= notify_vq,
+	.get_vq			= get_vq,
+	.get_size_vq		= get_size_vq,
+	.set_size_vq		= set_size_vq,
+	.get_vq_count		= get_vq_count,
+};
+
+static void input_dev__setup(struct input_dev *idev, int type)
+{
+	u16 code;
+
+	mutex_init(&idev->mutex);
+
+	switch (type) {
+	case VIRTIO_INPUT_KEYBOARD:
+		idev->name	= "kvmtool virtio keyboard";
+		idev->product	= 1;
+		for (code = KEY_ESC; code <= KEY_MICMUTE; code++)
+			input_dev__set_bit(idev, EV_KEY, code);
+		/* Any bit, so that the guest repeats held keys itself */
+		input_dev__set_bit(idev, EV_REP, 0);
+		break;
+	case VIRTIO_INPUT_TABLET:
+		idev->name	= "kvmtool virtio tablet";
+		idev->product	= 2;
+		input_dev__set_bit(idev, EV_KEY, BTN_LEFT);
+		input_dev__set_bit(idev, EV_KEY, BTN_RIGHT);
+		input_dev__set_bit(idev, EV_KEY, BTN_MIDDLE);
+		input_dev__set_bit(idev, EV_REL, REL_WHEEL);
+		input_dev__set_bit(idev, EV_ABS, ABS_X);
+		input_dev__set_bit(idev, EV_ABS, ABS_Y);
+		break;
+	}
+}
+
+int virtio_input__init(struct kvm *kvm)
+{
+	enum virtio_trans trans = kvm->cfg.virtio_transport;
+	struct input_dev *idev;
+	int i, r;
+
+	if (!kvm->cfg.virtio_input)
+		return 0;
+
+	/* There is no legacy virtio-input */
+	if (trans == VIRTIO_PCI_LEGACY)
+		trans = VIRTIO_PCI;
+	else if (trans == VIRTIO_MMIO_LEGACY)
+		trans = VIRTIO_MMIO;
+
+	for (i = 0; i < VIRTIO_INPUT_NR_DEVS; i++) {
+		idev = calloc(1, sizeof(*idev));
+		if (!idev)
+			return -ENOMEM;
+
+		input_dev__setup(idev, i);
+		r = virtio_init(kvm, idev, &idev->vdev, &input_dev_virtio_ops,
+				trans, PCI_DEVICE_ID_VIRTIO_INPUT,
+				VIRTIO_ID_INPUT, PCI_CLASS_INPUT);
+		if (r < 0) {
+			free(idev);
+			return r;
+		}
+
+		input_devs[i] = idev;
+	}
+
+	if (compat_id == -1)
+		compat_id = virtio_compat_add_message("virtio-input", "CONFIG_VIRTIO_INPUT");
+
+	return 0;
+}
+virtio_dev_init(virtio_input__init);
+
+int virtio_input__exit(struct kvm *kvm)
+{
+	int i;
+
+	for (i = 0; i < VIRTIO_INPUT_NR_DEVS; i++) {
+		if (!input_devs[i])
+			continue;
+
+		virtio_exit(kvm, &input_devs[i]->vdev);
+		free(input_devs[i]);
+		input_devs[i] = NULL;
+	}
+
+	return 0;
+}
+virtio_dev_exit(virtio_input__exit);
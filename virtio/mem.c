@@ -0,0 +1,485 @@
+#include "kvm/virtio-mem.h"
+
+#include "kvm/virtio-pci-dev.h"
+
+#include "kvm/guest_compat.h"
+#include "kvm/kvm.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/metrics.h"
+#include "kvm/mutex.h"
+#include "kvm/snapshot.h"
+#include "kvm/threadpool.h"
+#include "kvm/util.h"
+#include "kvm/virtio.h"
+#include "kvm/iovec.h"
+
+#include <linux/bitmap.h>
+#include <linux/byteorder.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/sizes.h>
+#include <linux/virtio_mem.h>
+#include <linux/virtio_ring.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define PCI_DEVICE_ID_VIRTIO_MEM	(PCI_DEVICE_ID_VIRTIO_BASE + VIRTIO_ID_MEM)
+#define PCI_CLASS_MEM			0xff0000
+
+#define NUM_VIRT_QUEUES			1
+#define VIRTIO_MEM_QUEUE_SIZE		128
+
+/*
+ * Blocks are the size of a huge page, the smallest that Linux plugs on x86.
+ * The region is aligned and sized for the 128MB memory blocks of the guest.
+ */
+#define VIRTIO_MEM_BLOCK_SIZE		SZ_2M
+#define VIRTIO_MEM_REGION_ALIGN		SZ_1G
+#define VIRTIO_MEM_SIZE_ALIGN		SZ_128M
+
+/*
+ * A region of guest physical memory past RAM, that the guest plugs and
+ * unplugs by blocks up to the size that the host requests. It is registered
+ * whole, but only the plugged blocks get host memory as the guest touches
+ * them, and unplugged ones give it back.
+ */
+struct mem_dev {
+	struct virtio_device	vdev;
+	struct virtio_mem_config config;
+
+	void			*host;
+	u64			addr;
+	u64			size;
+	u64			nr_blocks;
+	unsigned long		*plugged;
+	/* Of the config, the bitmap and the mapping */
+	struct mutex		mutex;
+
+	struct virt_queue	vqs[NUM_VIRT_QUEUES];
+	struct thread_pool__job	job;
+};
+
+static struct mem_dev *mem_dev;
+static int compat_id = -1;
+
+/* The blocks of the request at @addr, if they lie in the usable region */
+static bool mem_dev__blocks(struct mem_dev *mdev, u64 addr, u16 nb_blocks,
+			    u64 *first)
+{
+	u64 usable = le64_to_cpu(mdev->config.usable_region_size);
+
+	if (!nb_blocks || addr < mdev->addr ||
+	    (addr - mdev->addr) % VIRTIO_MEM_BLOCK_SIZE)
+		return false;
+
+	*first = (addr - mdev->addr) / VIRTIO_MEM_BLOCK_SIZE;
+
+	return *first + nb_blocks <= usable / VIRTIO_MEM_BLOCK_SIZE;
+}
+
+/* How many of the @nr blocks from @first are plugged */
+static u64 mem_dev__nr_plugged(struct mem_dev *mdev, u64 first, u64 nr)
+{
+	u64 i, plugged = 0;
+
+	for (i = first; i < first + nr; i++)
+		plugged += test_bit(i, mdev->plugged);
+
+	return plugged;
+}
+
+static void mem_dev__set_plugged(struct mem_dev *mdev, u64 first, u64 nr,
+				 bool plugged)
+{
+	u64 i, size = le64_to_cpu(mdev->config.plugged_size);
+
+	for (i = first; i < first + nr; i++) {
+		if (plugged)
+			set_bit(i, mdev->plugged);
+		else
+			clear_bit(i, mdev->plugged);
+	}
+
+	if (plugged)
+		size += nr * VIRTIO_MEM_BLOCK_SIZE;
+	else
+		size -= nr * VIRTIO_MEM_BLOCK_SIZE;
+	mdev->config.plugged_size = cpu_to_le64(size);
+}
+
+static u16 mem_dev__plug(struct kvm *kvm, struct mem_dev *mdev, u64 addr,
+			 u16 nb_blocks)
+{
+	u64 first, len = (u64)nb_blocks * VIRTIO_MEM_BLOCK_SIZE;
+	void *p;
+
+	if (!mem_dev__blocks(mdev, addr, nb_blocks, &first) ||
+	    mem_dev__nr_plugged(mdev, first, nb_blocks))
+		return VIRTIO_MEM_RESP_ERROR;
+
+	if (le64_to_cpu(mdev->config.plugged_size) + len >
+	    le64_to_cpu(mdev->config.requested_size))
+		return VIRTIO_MEM_RESP_NACK;
+
+	/* With --mem-prealloc, the blocks get their memory now */
+	p = mdev->host + first * VIRTIO_MEM_BLOCK_SIZE;
+	if (kvm->cfg.mem_prealloc && madvise(p, len, MADV_POPULATE_WRITE) < 0) {
+		pr_warning("virtio-mem: unable to allocate %llu MB: %s",
+			   (unsigned long long)len / SZ_1M, strerror(errno));
+		madvise(p, len, MADV_DONTNEED);
+		return VIRTIO_MEM_RESP_NACK;
+	}
+
+	mem_dev__set_plugged(mdev, first, nb_blocks, true);
+
+	return VIRTIO_MEM_RESP_ACK;
+}
+
+static u16 mem_dev__unplug(struct mem_dev *mdev, u64 addr, u16 nb_blocks)
+{
+	u64 first;
+
+	if (!mem_dev__blocks(mdev, addr, nb_blocks, &first) ||
+	    mem_dev__nr_plugged(mdev, first, nb_blocks) != nb_blocks)
+		return VIRTIO_MEM_RESP_ERROR;
+
+	if (madvise(mdev->host + first * VIRTIO_MEM_BLOCK_SIZE,
+		    (u64)nb_blocks * VIRTIO_MEM_BLOCK_SIZE, MADV_DONTNEED) < 0)
+		return VIRTIO_MEM_RESP_BUSY;
+
+	mem_dev__set_plugged(mdev, first, nb_blocks, false);
+
+	return VIRTIO_MEM_RESP_ACK;
+}
+
+static u16 mem_dev__unplug_all(struct mem_dev *mdev)
+{
+	if (madvise(mdev->host, mdev->size, MADV_DONTNEED) < 0)
+		return VIRTIO_MEM_RESP_BUSY;
+
+	bitmap_zero(mdev->plugged, mdev->nr_blocks);
+	mdev->config.plugged_size = 0;
+	/* The guest reads it again after unplugging all */
+	mdev->config.usable_region_size = cpu_to_le64(mdev->size);
+
+	return VIRTIO_MEM_RESP_ACK;
+}
+
+static u16 mem_dev__state(struct mem_dev *mdev, u64 addr, u16 nb_blocks,
+			  u16 *state)
+{
+	u64 first, plugged;
+
+	if (!mem_dev__blocks(mdev, addr, nb_blocks, &first))
+		return VIRTIO_MEM_RESP_ERROR;
+
+	plugged = mem_dev__nr_plugged(mdev, first, nb_blocks);
+	if (plugged == nb_blocks)
+		*state = VIRTIO_MEM_STATE_PLUGGED;
+	else if (!plugged)
+		*state = VIRTIO_MEM_STATE_UNPLUGGED;
+	else
+		*state = VIRTIO_MEM_STATE_MIXED;
+
+	return VIRTIO_MEM_RESP_ACK;
+}
+
+static void virtio_mem_do_io_request(struct kvm *kvm, struct mem_dev *mdev,
+				     struct virt_queue *vq)
+{
+	struct iovec iov[VIRTIO_MEM_QUEUE_SIZE];
+	struct virtio_mem_resp resp = {};
+	struct virtio_mem_req req;
+	u16 out, in, head, type;
+	u16 state = 0;
+
+	head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+
+	if (memcpy_fromiovecend((void *)&req, iov, 0, sizeof(req)) ||
+	    iov_size(iov + out, in) < sizeof(resp)) {
+		pr_warning("virtio-mem: malformed request");
+		virt_queue__set_used_elem(vq, head, 0);
+		return;
+	}
+
+	mutex_lock(&mdev->mutex);
+	switch (virtio_guest_to_host_u16(vq->endian, req.type)) {
+	case VIRTIO_MEM_REQ_PLUG:
+		type = mem_dev__plug(kvm, mdev,
+				     virtio_guest_to_host_u64(vq->endian, req.u.plug.addr),
+				     virtio_guest_to_host_u16(vq->endian, req.u.plug.nb_blocks));
+		break;
+	case VIRTIO_MEM_REQ_UNPLUG:
+		type = mem_dev__unplug(mdev,
+				       virtio_guest_to_host_u64(vq->endian, req.u.unplug.addr),
+				       virtio_guest_to_host_u16(vq->endian, req.u.unplug.nb_blocks));
+		break;
+	case VIRTIO_MEM_REQ_UNPLUG_ALL:
+		type = mem_dev__unplug_all(mdev);
+		break;
+	case VIRTIO_MEM_REQ_STATE:
+		type = mem_dev__state(mdev,
+				      virtio_guest_to_host_u64(vq->endian, req.u.state.addr),
+				      virtio_guest_to_host_u16(vq->endian, req.u.state.nb_blocks),
+				      &state);
+		break;
+	default:
+		type = VIRTIO_MEM_RESP_ERROR;
+		break;
+	}
+	mutex_unlock(&mdev->mutex);
+
+	resp.type = virtio_host_to_guest_u16(vq->endian, type);
+	resp.u.state.state = virtio_host_to_guest_u16(vq->endian, state);
+	memcpy_toiovecend(iov + out, (void *)&resp, 0, sizeof(resp));
+
+	virt_queue__set_used_elem(vq, head, sizeof(resp));
+}
+
+static void virtio_mem_do_io(struct kvm *kvm, void *param)
+{
+	struct mem_dev *mdev = param;
+	struct virt_queue *vq = &mdev->vqs[0];
+
+	while (virt_queue__available(vq))
+		virtio_mem_do_io_request(kvm, mdev, vq);
+
+	mdev->vdev.ops->signal_vq(kvm, &mdev->vdev, 0);
+}
+
+static void handle_resize(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg)
+{
+	struct mem_dev *mdev = mem_dev;
+	struct virtio_mem_resize *resize = (void *)msg;
+	s32 r = 0;
+	u64 size;
+
+	if (WARN_ON(type != KVM_IPC_VIRTIO_MEM || len != sizeof(*resize)))
+		return;
+
+	size = resize->requested_mb * SZ_1M;
+	if (!mdev)
+		r = -ENODEV;
+	else if (size > mdev->size || size % VIRTIO_MEM_BLOCK_SIZE)
+		r = -EINVAL;
+
+	if (!r) {
+		mutex_lock(&mdev->mutex);
+		mdev->config.requested_size = cpu_to_le64(size);
+		mutex_unlock(&mdev->mutex);
+
+		/* The guest plugs or unplugs blocks to get there */
+		mdev->vdev.ops->signal_config(kvm, &mdev->vdev);
+	}
+
+	if (write_in_full(fd, &r, sizeof(r)) < 0)
+		pr_warning("Failed sending virtio-mem status");
+}
+
+static void virtio_mem__collect_metrics(struct kvm *kvm, struct metrics *m)
+{
+	struct mem_dev *mdev = mem_dev;
+	u64 plugged, requested;
+
+	mutex_lock(&mdev->mutex);
+	plugged = le64_to_cpu(mdev->config.plugged_size);
+	requested = le64_to_cpu(mdev->config.requested_size);
+	mutex_unlock(&mdev->mutex);
+
+	metrics__family(m, "virtio_mem_region_bytes", "gauge",
+			"Memory that virtio-mem can plug into the guest");
+	metrics__value(m, mdev->size);
+
+	metrics__family(m, "virtio_mem_requested_bytes", "gauge",
+			"Memory that the guest is asked to have plugged");
+	metrics__value(m, requested);
+
+	metrics__family(m, "virtio_mem_plugged_bytes", "gauge",
+			"Memory that the guest has plugged");
+	metrics__value(m, plugged);
+}
+
+static struct metrics_collector virtio_mem__metrics = {
+	.collect	= virtio_mem__collect_metrics,
+};
+
+static u8 *get_config(struct kvm *kvm, void *dev)
+{
+	struct mem_dev *mdev = dev;
+
+	return (u8 *)&mdev->config;
+}
+
+static size_t get_config_size(struct kvm *kvm, void *dev)
+{
+	struct mem_dev *mdev = dev;
+
+	return sizeof(mdev->config);
+}
+
+static u64 get_host_features(struct kvm *kvm, void *dev)
+{
+	return 1UL << VIRTIO_RING_F_EVENT_IDX
+		| 1UL << VIRTIO_RING_F_INDIRECT_DESC;
+}
+
+static int init_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct mem_dev *mdev = dev;
+
+	compat__remove_message(compat_id);
+
+	virtio_init_device_vq(kvm, &mdev->vdev, &mdev->vqs[vq],
+			      VIRTIO_MEM_QUEUE_SIZE);
+	thread_pool__init_job(&mdev->job, kvm, virtio_mem_do_io, mdev);
+
+	return 0;
+}
+
+static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct mem_dev *mdev = dev;
+
+	thread_pool__cancel_job(&mdev->job);
+}
+
+static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct mem_dev *mdev = dev;
+
+	thread_pool__do_job(&mdev->job);
+
+	return 0;
+}
+
+static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct mem_dev *mdev = dev;
+
+	return &mdev->vqs[vq];
+}
+
+static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	return VIRTIO_MEM_QUEUE_SIZE;
+}
+
+static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
+{
+	return size;
+}
+
+static unsigned int get_vq_count(struct kvm *kvm, void *dev)
+{
+	return NUM_VIRT_QUEUES;
+}
+
+static struct virtio_ops mem_dev_virtio_ops = {
+	.get_config		= get_config,
+	.get_config_size	= get_config_size,
+	.get_host_features	= get_host_features,
+	.init_vq		= init_vq,
+	.exit_vq		= exit_vq,
+	.notify_vq		= notify_vq,
+	.get_vq			= get_vq,
+	.get_size_vq		= get_size_vq,
+	.set_size_vq		= set_size_vq,
+	.get_vq_count		= get_vq_count,
+};
+
+int virtio_mem__init(struct kvm *kvm)
+{
+	enum virtio_trans trans = kvm->cfg.virtio_transport;
+	struct mem_dev *mdev;
+	int r;
+
+	if (!kvm->cfg.virtio_mem_mb)
+		return 0;
+
+	/* Other processes only know the RAM banks */
+	if (kvm->cfg.mem_shared) {
+		pr_err("virtio-mem doesn't support shared guest RAM");
+		return -EINVAL;
+	}
+
+	/* There is no legacy virtio-mem */
+	if (trans == VIRTIO_PCI_LEGACY)
+		trans = VIRTIO_PCI;
+	else if (trans == VIRTIO_MMIO_LEGACY)
+		trans = VIRTIO_MMIO;
+
+	mdev = calloc(1, sizeof(*mdev));
+	if (!mdev)
+		return -ENOMEM;
+
+	mutex_init(&mdev->mutex);
+	mdev->size = ALIGN(kvm->cfg.virtio_mem_mb * SZ_1M, VIRTIO_MEM_SIZE_ALIGN);
+	mdev->addr = kvm__mem_end(kvm, VIRTIO_MEM_REGION_ALIGN);
+	mdev->nr_blocks = mdev->size / VIRTIO_MEM_BLOCK_SIZE;
+	mdev->config = (struct virtio_mem_config) {
+		.block_size		= cpu_to_le64(VIRTIO_MEM_BLOCK_SIZE),
+		.addr			= cpu_to_le64(mdev->addr),
+		.region_size		= cpu_to_le64(mdev->size),
+		.usable_region_size	= cpu_to_le64(mdev->size),
+	};
+
+	mdev->plugged = calloc(BITS_TO_LONGS(mdev->nr_blocks), sizeof(long));
+	if (!mdev->plugged) {
+		r = -ENOMEM;
+		goto err_free;
+	}
+
+	mdev->host = mmap(NULL, mdev->size, PROT_RW, MAP_ANON_NORESERVE, -1, 0);
+	if (mdev->host == MAP_FAILED) {
+		r = -errno;
+		goto err_free;
+	}
+
+	/* Not RAM, which the memory map, snapshots and DMA mappings cover */
+	r = kvm__register_dev_mem(kvm, mdev->addr, mdev->size, mdev->host);
+	if (r < 0)
+		goto err_unmap;
+
+	/* Snapshots only have the RAM banks */
+	snapshot__block("virtio-mem");
+	r = virtio_init(kvm, mdev, &mdev->vdev, &mem_dev_virtio_ops, trans,
+			PCI_DEVICE_ID_VIRTIO_MEM, VIRTIO_ID_MEM, PCI_CLASS_MEM);
+	if (r < 0)
+		goto err_unregister;
+
+	mem_dev = mdev;
+	kvm_ipc__register_handler(KVM_IPC_VIRTIO_MEM, handle_resize);
+	metrics__register(&virtio_mem__metrics);
+
+	if (compat_id == -1)
+		compat_id = virtio_compat_add_message("virtio-mem", "CONFIG_VIRTIO_MEM");
+
+	return 0;
+
+err_unregister:
+	kvm__destroy_mem(kvm, mdev->addr, mdev->size, mdev->host);
+err_unmap:
+	munmap(mdev->host, mdev->size);
+err_free:
+	free(mdev->plugged);
+	free(mdev);
+
+	return r;
+}
+virtio_dev_init(virtio_mem__init);
+
+int virtio_mem__exit(struct kvm *kvm)
+{
+	struct mem_dev *mdev = mem_dev;
+
+	if (!mdev)
+		return 0;
+
+	virtio_exit(kvm, &mdev->vdev);
+
+	return 0;
+}
+virtio_dev_exit(virtio_mem__exit);
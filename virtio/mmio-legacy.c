@@ -21,9 +21,11 @@ static void virtio_mmio_config_in(struct kvm_cpu *vcpu,
 	case VIRTIO_MMIO_DEVICE_ID:
 	case VIRTIO_MMIO_VENDOR_ID:
 	case VIRTIO_MMIO_STATUS:
-	case VIRTIO_MMIO_INTERRUPT_STATUS:
 		ioport__write32(data, *(u32 *)(((void *)&vmmio->hdr) + addr));
 		break;
+	case VIRTIO_MMIO_INTERRUPT_STATUS:
+		ioport__write32(data, virtio_mmio_interrupt_status(vdev));
+		break;
 	case VIRTIO_MMIO_DEVICE_FEATURES:
 		if (vmmio->hdr.host_features_sel == 0)
 			val = vdev->ops->get_host_features(vmmio->kvm,
@@ -118,6 +120,7 @@ static void virtio_mmio_config_out(struct kvm_cpu *vcpu,
 				val, vq_count);
 			break;
 		}
+		virtio__account_kick(vdev, val);
 		vdev->ops->notify_vq(vmmio->kvm, vmmio->dev, val);
 		break;
 	case VIRTIO_MMIO_INTERRUPT_ACK:
@@ -11,7 +11,7 @@ static void virtio_mmio_config_in(struct kvm_cpu *vcpu,
 				  struct virtio_device *vdev)
 {
 	struct virtio_mmio *vmmio = vdev->virtio;
-	u64 features = 1ULL << VIRTIO_F_VERSION_1;
+	u64 features = virtio_modern_features(vdev);
 	u32 val = 0;
 
 	switch (addr) {
@@ -20,9 +20,11 @@ static void virtio_mmio_config_in(struct kvm_cpu *vcpu,
 	case VIRTIO_MMIO_DEVICE_ID:
 	case VIRTIO_MMIO_VENDOR_ID:
 	case VIRTIO_MMIO_STATUS:
-	case VIRTIO_MMIO_INTERRUPT_STATUS:
 		val = *(u32 *)(((void *)&vmmio->hdr) + addr);
 		break;
+	case VIRTIO_MMIO_INTERRUPT_STATUS:
+		val = virtio_mmio_interrupt_status(vdev);
+		break;
 	case VIRTIO_MMIO_DEVICE_FEATURES:
 		if (vmmio->hdr.host_features_sel > 1)
 			break;
@@ -108,6 +110,7 @@ static void virtio_mmio_config_out(struct kvm_cpu *vcpu,
 			virtio_mmio_exit_vq(kvm, vdev, vmmio->hdr.queue_sel);
 		break;
 	case VIRTIO_MMIO_QUEUE_NOTIFY:
+		virtio__account_kick(vdev, val);
 		vdev->ops->notify_vq(vmmio->kvm, vmmio->dev, val);
 		break;
 	case VIRTIO_MMIO_INTERRUPT_ACK:
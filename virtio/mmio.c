@@ -5,6 +5,7 @@
 #include "kvm/kvm.h"
 #include "kvm/irq.h"
 #include "kvm/fdt.h"
+#include "kvm/snapshot.h"
 
 #include <linux/virtio_mmio.h>
 #include <string.h>
@@ -24,6 +25,7 @@ static void virtio_mmio_ioevent_callback(struct kvm *kvm, void *param)
 	struct virtio_mmio_ioevent_param *ioeventfd = param;
 	struct virtio_mmio *vmmio = ioeventfd->vdev->virtio;
 
+	virtio__account_kick(ioeventfd->vdev, ioeventfd->vq);
 	ioeventfd->vdev->ops->notify_vq(kvm, vmmio->dev, ioeventfd->vq);
 }
 
@@ -49,10 +51,10 @@ int virtio_mmio_init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev,
 		.fd		= eventfd(0, 0),
 	};
 
-	if (vdev->use_vhost)
+	if (!virtio__relay_kicks(vdev, vq))
 		/*
-		 * Vhost will poll the eventfd in host kernel side,
-		 * no need to poll in userspace.
+		 * Vhost or the device will poll the eventfd itself, no
+		 * need to poll it here.
 		 */
 		err = ioeventfd__add_event(&ioevent, 0);
 	else
@@ -71,6 +73,7 @@ int virtio_mmio_signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
 {
 	struct virtio_mmio *vmmio = vdev->virtio;
 
+	virtio__account_irq(vdev, vq);
 	vmmio->hdr.interrupt_state |= VIRTIO_MMIO_INT_VRING;
 	kvm__irq_trigger(vmmio->kvm, vmmio->irq);
 
@@ -83,11 +86,14 @@ int virtio_mmio_init_vq(struct kvm *kvm, struct virtio_device *vdev, int vq)
 	struct virtio_mmio *vmmio = vdev->virtio;
 
 	ret = virtio_mmio_init_ioeventfd(vmmio->kvm, vdev, vq);
-	if (ret) {
-		pr_err("couldn't add ioeventfd for vq %d: %d", vq, ret);
-		return ret;
-	}
-	return vdev->ops->init_vq(vmmio->kvm, vmmio->dev, vq);
+	if (ret)
+		virtio_ioeventfd_failed(vmmio->kvm, vdev, vq, ret);
+
+	ret = vdev->ops->init_vq(vmmio->kvm, vmmio->dev, vq);
+	if (!ret)
+		virtio_vq__attach_stats(vmmio->kvm, vdev, vq);
+
+	return ret;
 }
 
 void virtio_mmio_exit_vq(struct kvm *kvm, struct virtio_device *vdev, int vq)
@@ -108,6 +114,27 @@ int virtio_mmio_signal_config(struct kvm *kvm, struct virtio_device *vdev)
 	return 0;
 }
 
+/* Along with the interrupts that vhost raised through an irqfd */
+u32 virtio_mmio_interrupt_status(struct virtio_device *vdev)
+{
+	struct virtio_mmio *vmmio = vdev->virtio;
+
+	if (!__atomic_load_n(&vdev->line_irqfds, __ATOMIC_RELAXED))
+		return vmmio->hdr.interrupt_state;
+
+	return vmmio->hdr.interrupt_state | VIRTIO_MMIO_INT_VRING;
+}
+
+/* Each interrupt is an edge, as the device tree says */
+int virtio_mmio_get_irq_line(struct kvm *kvm, struct virtio_device *vdev,
+			     bool *level)
+{
+	struct virtio_mmio *vmmio = vdev->virtio;
+
+	*level = false;
+	return irq__line_gsi(vmmio->irq);
+}
+
 #ifdef CONFIG_HAS_LIBFDT
 #define DEVICE_NAME_MAX_LEN 32
 static
@@ -157,6 +184,9 @@ int virtio_mmio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 	vmmio->kvm	= kvm;
 	vmmio->dev	= dev;
 
+	/* Only the PCI transport saves its state */
+	snapshot__block("virtio-mmio devices");
+
 	if (!legacy)
 		vdev->endian = VIRTIO_ENDIAN_LE;
 
@@ -0,0 +1,477 @@
+#include "kvm/virtio-net.h"
+#include "kvm/barrier.h"
+#include "kvm/iovec.h"
+#include "kvm/util.h"
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/kernel.h>
+#include <linux/virtio_net.h>
+
+#include <errno.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef AF_XDP
+#define AF_XDP			44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP			283
+#endif
+
+/*
+ * The UMEM is a dedicated pool split in two: the first half is lent to the
+ * kernel through the fill ring for RX, the second half holds TX frames.
+ */
+#define AFXDP_NUM_FRAMES	4096
+#define AFXDP_RING_SIZE		(AFXDP_NUM_FRAMES / 2)
+#define AFXDP_UMEM_SIZE		(AFXDP_NUM_FRAMES * NET_AFXDP_FRAME_SIZE)
+/* How long TX waits for the kernel to complete frames before dropping */
+#define AFXDP_TX_WAIT_MS	1
+
+struct afxdp_ring {
+	u32		*producer;
+	u32		*consumer;
+	u32		*flags;
+	void		*descs;
+	u32		mask;
+	u32		size;
+	/* Local copies, published on submission */
+	u32		cached_prod;
+	u32		cached_cons;
+	void		*map;
+	size_t		map_size;
+};
+
+struct net_afxdp {
+	int			fd;
+	int			map_fd;
+	int			prog_fd;
+	int			link_fd;
+	u32			queue;
+	bool			need_wakeup;
+
+	void			*umem;
+	bool			umem_huge;
+
+	/* Owned by the RX thread */
+	struct afxdp_ring	rx;
+	struct afxdp_ring	fill;
+
+	/* Owned by the TX thread */
+	struct afxdp_ring	tx;
+	struct afxdp_ring	comp;
+	u64			tx_free[AFXDP_RING_SIZE];
+	u32			nr_tx_free;
+};
+
+static int bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int afxdp_map_ring(struct net_afxdp *xdp, struct afxdp_ring *ring,
+			  struct xdp_ring_offset *off, size_t desc_size,
+			  off_t pgoff)
+{
+	ring->map_size = off->desc + AFXDP_RING_SIZE * desc_size;
+	ring->map = mmap(NULL, ring->map_size, PROT_RW,
+			 MAP_SHARED | MAP_POPULATE, xdp->fd, pgoff);
+	if (ring->map == MAP_FAILED) {
+		ring->map = NULL;
+		return -errno;
+	}
+
+	ring->producer	= ring->map + off->producer;
+	ring->consumer	= ring->map + off->consumer;
+	ring->flags	= ring->map + off->flags;
+	ring->descs	= ring->map + off->desc;
+	ring->size	= AFXDP_RING_SIZE;
+	ring->mask	= AFXDP_RING_SIZE - 1;
+	ring->cached_prod = *ring->producer;
+	ring->cached_cons = *ring->consumer;
+
+	return 0;
+}
+
+static void afxdp_unmap_ring(struct afxdp_ring *ring)
+{
+	if (ring->map)
+		munmap(ring->map, ring->map_size);
+}
+
+/* Entries the kernel produced that we haven't consumed yet */
+static u32 afxdp_ring_avail(struct afxdp_ring *ring)
+{
+	u32 nr = *ring->producer - ring->cached_cons;
+
+	/* Read the descriptors only after observing the producer */
+	rmb();
+	return nr;
+}
+
+/* Entries we may still produce before the kernel consumes some */
+static u32 afxdp_ring_space(struct afxdp_ring *ring)
+{
+	return ring->size - (ring->cached_prod - *ring->consumer);
+}
+
+static void afxdp_ring_submit(struct afxdp_ring *ring)
+{
+	/* Make the descriptors visible before publishing the producer */
+	wmb();
+	*ring->producer = ring->cached_prod;
+}
+
+static void afxdp_ring_release(struct afxdp_ring *ring)
+{
+	/* Done reading the descriptors before handing them back */
+	mb();
+	*ring->consumer = ring->cached_cons;
+}
+
+static int afxdp_setup_socket(struct net_afxdp *xdp)
+{
+	struct xdp_umem_reg mr = {
+		.addr		= (unsigned long)xdp->umem,
+		.len		= AFXDP_UMEM_SIZE,
+		.chunk_size	= NET_AFXDP_FRAME_SIZE,
+	};
+	struct xdp_mmap_offsets off;
+	socklen_t optlen = sizeof(off);
+	int size = AFXDP_RING_SIZE;
+	u32 i;
+
+	xdp->fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (xdp->fd < 0)
+		return -errno;
+
+	if (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) ||
+	    setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) ||
+	    setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) ||
+	    setsockopt(xdp->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) ||
+	    setsockopt(xdp->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) ||
+	    getsockopt(xdp->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen))
+		return -errno;
+
+	if (afxdp_map_ring(xdp, &xdp->rx, &off.rx, sizeof(struct xdp_desc),
+			   XDP_PGOFF_RX_RING) ||
+	    afxdp_map_ring(xdp, &xdp->tx, &off.tx, sizeof(struct xdp_desc),
+			   XDP_PGOFF_TX_RING) ||
+	    afxdp_map_ring(xdp, &xdp->fill, &off.fr, sizeof(u64),
+			   XDP_UMEM_PGOFF_FILL_RING) ||
+	    afxdp_map_ring(xdp, &xdp->comp, &off.cr, sizeof(u64),
+			   XDP_UMEM_PGOFF_COMPLETION_RING))
+		return -ENOMEM;
+
+	/* Lend the RX half of the UMEM to the kernel */
+	for (i = 0; i < AFXDP_RING_SIZE; i++)
+		((u64 *)xdp->fill.descs)[i] = (u64)i * NET_AFXDP_FRAME_SIZE;
+	xdp->fill.cached_prod += AFXDP_RING_SIZE;
+	afxdp_ring_submit(&xdp->fill);
+
+	for (i = 0; i < AFXDP_RING_SIZE; i++)
+		xdp->tx_free[i] = (u64)(AFXDP_RING_SIZE + i) * NET_AFXDP_FRAME_SIZE;
+	xdp->nr_tx_free = AFXDP_RING_SIZE;
+
+	return 0;
+}
+
+static int afxdp_bind(struct net_afxdp *xdp, unsigned int ifindex)
+{
+	struct sockaddr_xdp sxdp = {
+		.sxdp_family	= AF_XDP,
+		.sxdp_ifindex	= ifindex,
+		.sxdp_queue_id	= xdp->queue,
+		.sxdp_flags	= XDP_USE_NEED_WAKEUP,
+	};
+
+	xdp->need_wakeup = true;
+	if (!bind(xdp->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)))
+		return 0;
+
+	/* Kernels before 5.4 don't know about XDP_USE_NEED_WAKEUP */
+	xdp->need_wakeup = false;
+	sxdp.sxdp_flags = 0;
+	if (!bind(xdp->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)))
+		return 0;
+
+	return -errno;
+}
+
+/*
+ * Steer the frames received on our queue to the socket. The program looks up
+ * the queue index in an XSKMAP and lets everything else, including frames on
+ * other queues, through to the host stack.
+ */
+static int afxdp_attach_prog(struct net_afxdp *xdp, unsigned int ifindex)
+{
+	char license[] = "GPL";
+	union bpf_attr attr;
+	u32 key = xdp->queue;
+	struct bpf_insn insns[] = {
+		/* r2 = ctx->rx_queue_index */
+		{ .code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2,
+		  .src_reg = BPF_REG_1,
+		  .off = offsetof(struct xdp_md, rx_queue_index) },
+		/* r1 = xskmap */
+		{ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1,
+		  .src_reg = BPF_PSEUDO_MAP_FD },
+		{ 0 },
+		/* r3 = XDP_PASS, the action when there's no socket */
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3,
+		  .imm = XDP_PASS },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type		= BPF_MAP_TYPE_XSKMAP;
+	attr.key_size		= sizeof(u32);
+	attr.value_size		= sizeof(int);
+	attr.max_entries	= xdp->queue + 1;
+	xdp->map_fd = bpf(BPF_MAP_CREATE, &attr);
+	if (xdp->map_fd < 0)
+		return -errno;
+
+	insns[1].imm = xdp->map_fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type	= BPF_PROG_TYPE_XDP;
+	attr.insns	= (unsigned long)insns;
+	attr.insn_cnt	= ARRAY_SIZE(insns);
+	attr.license	= (unsigned long)license;
+	xdp->prog_fd = bpf(BPF_PROG_LOAD, &attr);
+	if (xdp->prog_fd < 0)
+		return -errno;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd	= xdp->map_fd;
+	attr.key	= (unsigned long)&key;
+	attr.value	= (unsigned long)&xdp->fd;
+	if (bpf(BPF_MAP_UPDATE_ELEM, &attr))
+		return -errno;
+
+	/* The link, and with it the program, goes away when kvmtool exits */
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd	= xdp->prog_fd;
+	attr.link_create.target_ifindex	= ifindex;
+	attr.link_create.attach_type	= BPF_XDP;
+	xdp->link_fd = bpf(BPF_LINK_CREATE, &attr);
+	if (xdp->link_fd < 0)
+		return -errno;
+
+	return 0;
+}
+
+struct net_afxdp *net_afxdp__new(const char *dev, u32 queue)
+{
+	struct net_afxdp *xdp;
+	unsigned int ifindex;
+	int r;
+
+	ifindex = if_nametoindex(dev);
+	if (!ifindex) {
+		pr_warning("AF_XDP: unknown interface %s", dev);
+		return NULL;
+	}
+
+	xdp = calloc(1, sizeof(*xdp));
+	if (!xdp)
+		return NULL;
+
+	xdp->fd = xdp->map_fd = xdp->prog_fd = xdp->link_fd = -1;
+	xdp->queue = queue;
+
+	xdp->umem = mmap(NULL, AFXDP_UMEM_SIZE, PROT_RW,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	xdp->umem_huge = xdp->umem != MAP_FAILED;
+	if (!xdp->umem_huge)
+		xdp->umem = mmap(NULL, AFXDP_UMEM_SIZE, PROT_RW,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (xdp->umem == MAP_FAILED) {
+		xdp->umem = NULL;
+		r = -ENOMEM;
+		goto err;
+	}
+
+	r = afxdp_setup_socket(xdp);
+	if (r) {
+		pr_warning("AF_XDP: unable to set up the socket: %s", strerror(-r));
+		goto err;
+	}
+
+	r = afxdp_bind(xdp, ifindex);
+	if (r) {
+		pr_warning("AF_XDP: unable to bind to %s queue %u: %s", dev,
+			   queue, strerror(-r));
+		goto err;
+	}
+
+	r = afxdp_attach_prog(xdp, ifindex);
+	if (r) {
+		pr_warning("AF_XDP: unable to attach the XDP program to %s: %s",
+			   dev, strerror(-r));
+		goto err;
+	}
+
+	return xdp;
+
+err:
+	net_afxdp__free(xdp);
+	return NULL;
+}
+
+void net_afxdp__free(struct net_afxdp *xdp)
+{
+	if (!xdp)
+		return;
+
+	if (xdp->link_fd >= 0)
+		close(xdp->link_fd);
+	if (xdp->prog_fd >= 0)
+		close(xdp->prog_fd);
+	if (xdp->map_fd >= 0)
+		close(xdp->map_fd);
+
+	afxdp_unmap_ring(&xdp->rx);
+	afxdp_unmap_ring(&xdp->tx);
+	afxdp_unmap_ring(&xdp->fill);
+	afxdp_unmap_ring(&xdp->comp);
+
+	if (xdp->fd >= 0)
+		close(xdp->fd);
+	if (xdp->umem)
+		munmap(xdp->umem, AFXDP_UMEM_SIZE);
+	free(xdp);
+}
+
+/*
+ * Copy one received frame into @iov, behind a blank virtio-net header of
+ * @hdr_len bytes. Blocks until a frame arrives.
+ */
+int net_afxdp__rx(struct net_afxdp *xdp, struct iovec *iov, u16 in,
+		  size_t hdr_len)
+{
+	struct pollfd pfd = { .fd = xdp->fd, .events = POLLIN };
+	struct virtio_net_hdr_mrg_rxbuf hdr = {};
+	size_t size = iov_size(iov, in);
+	struct xdp_desc *desc;
+	u64 *fill;
+	u32 len;
+
+	if (size < hdr_len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (!afxdp_ring_avail(&xdp->rx)) {
+		if (xdp->need_wakeup && (*xdp->fill.flags & XDP_RING_NEED_WAKEUP))
+			recvfrom(xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return -1;
+	}
+
+	desc = &((struct xdp_desc *)xdp->rx.descs)[xdp->rx.cached_cons & xdp->rx.mask];
+	len = min_t(size_t, desc->len, size - hdr_len);
+
+	memcpy_toiovecend(iov, (void *)&hdr, 0, hdr_len);
+	memcpy_toiovecend(iov, xdp->umem + desc->addr, hdr_len, len);
+
+	/* Give the frame straight back to the kernel */
+	fill = &((u64 *)xdp->fill.descs)[xdp->fill.cached_prod++ & xdp->fill.mask];
+	*fill = desc->addr & ~((u64)NET_AFXDP_FRAME_SIZE - 1);
+
+	xdp->rx.cached_cons++;
+	afxdp_ring_release(&xdp->rx);
+	afxdp_ring_submit(&xdp->fill);
+
+	return hdr_len + len;
+}
+
+static void afxdp_tx_kick(struct net_afxdp *xdp)
+{
+	if (xdp->need_wakeup && !(*xdp->tx.flags & XDP_RING_NEED_WAKEUP))
+		return;
+
+	/* EAGAIN, EBUSY and ENOBUFS only mean the kernel is still busy */
+	sendto(xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+}
+
+static void afxdp_tx_reclaim(struct net_afxdp *xdp)
+{
+	u32 nr = afxdp_ring_avail(&xdp->comp);
+	u64 addr;
+
+	while (nr--) {
+		addr = ((u64 *)xdp->comp.descs)[xdp->comp.cached_cons++ & xdp->comp.mask];
+		xdp->tx_free[xdp->nr_tx_free++] = addr;
+	}
+	afxdp_ring_release(&xdp->comp);
+}
+
+static bool afxdp_tx_get_frame(struct net_afxdp *xdp, u64 *addr)
+{
+	struct pollfd pfd = { .fd = xdp->fd, .events = POLLOUT };
+
+	afxdp_tx_reclaim(xdp);
+	if (!xdp->nr_tx_free || !afxdp_ring_space(&xdp->tx)) {
+		/* Push out what's queued and give the kernel a moment */
+		afxdp_ring_submit(&xdp->tx);
+		afxdp_tx_kick(xdp);
+		poll(&pfd, 1, AFXDP_TX_WAIT_MS);
+		afxdp_tx_reclaim(xdp);
+	}
+
+	if (!xdp->nr_tx_free || !afxdp_ring_space(&xdp->tx))
+		return false;
+
+	*addr = xdp->tx_free[--xdp->nr_tx_free];
+	return true;
+}
+
+/*
+ * Queue a batch of guest frames, stripping their virtio-net header, and kick
+ * the kernel once. Frames that don't fit a UMEM chunk, or that can't be queued
+ * because the kernel is lagging behind, are dropped like a NIC would.
+ */
+int net_afxdp__tx(struct net_afxdp *xdp, struct net_tx_io *io, u16 nr,
+		  size_t hdr_len)
+{
+	struct xdp_desc *desc;
+	size_t size;
+	u64 addr;
+	u16 i;
+
+	for (i = 0; i < nr; i++) {
+		size = iov_size(io[i].iov, io[i].iovcnt);
+		io[i].res = size;
+
+		if (size <= hdr_len || size - hdr_len > NET_AFXDP_FRAME_SIZE)
+			continue;
+
+		if (!afxdp_tx_get_frame(xdp, &addr))
+			continue;
+
+		memcpy_fromiovecend(xdp->umem + addr, io[i].iov, hdr_len,
+				    size - hdr_len);
+
+		desc = &((struct xdp_desc *)xdp->tx.descs)[xdp->tx.cached_prod++ & xdp->tx.mask];
+		desc->addr = addr;
+		desc->len = size - hdr_len;
+		desc->options = 0;
+	}
+
+	afxdp_ring_submit(&xdp->tx);
+	afxdp_tx_kick(xdp);
+
+	return 0;
+}
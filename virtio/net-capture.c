@@ -0,0 +1,256 @@
+#include "kvm/virtio-net.h"
+#include "kvm/mutex.h"
+#include "kvm/iovec.h"
+#include "kvm/util.h"
+
+#include <linux/kernel.h>
+
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/*
+ * Frames crossing a virtio-net device, written to a size-capped pcapng file
+ * shared with the page cache. Once the file is full, writing wraps around to
+ * the first packet block, so it holds the most recent traffic with the
+ * oldest frames following the write position.
+ *
+ * Whatever made it into the file is always a valid sequence of blocks: the
+ * parts of overwritten blocks that remain are covered by padding blocks,
+ * which use a block type reserved for local use that readers skip.
+ */
+
+#define PCAPNG_SHB			0x0a0d0d0a
+#define PCAPNG_IDB			0x00000001
+#define PCAPNG_EPB			0x00000006
+#define PCAPNG_PAD			0x80000000
+#define PCAPNG_BYTE_ORDER_MAGIC		0x1a2b3c4d
+#define PCAPNG_LINKTYPE_ETHERNET	1
+#define PCAPNG_OPT_EPB_FLAGS		2
+#define PCAPNG_EPB_FLAG_INBOUND		1
+#define PCAPNG_EPB_FLAG_OUTBOUND	2
+
+/* Type, length and trailing length */
+#define PCAPNG_MIN_BLOCK		12
+/* EPB header and trailer, with an epb_flags option and opt_endofopt */
+#define PCAPNG_EPB_LEN(caplen)		(28 + ALIGN(caplen, 4) + 8 + 4 + 4)
+#define NET_CAPTURE_SNAPLEN		65535
+
+struct net_capture {
+	struct mutex	mutex;
+	bool		active;
+	int		fd;
+	u8		*map;
+	u64		size;
+	/* Offset of the first packet block, after the headers */
+	u64		start;
+	/* Where the next packet block goes */
+	u64		pos;
+};
+
+static void net_capture__put(struct net_capture *cap, u64 pos, u32 val)
+{
+	memcpy(cap->map + pos, &val, sizeof(val));
+}
+
+static void net_capture__put16(struct net_capture *cap, u64 pos, u16 val)
+{
+	memcpy(cap->map + pos, &val, sizeof(val));
+}
+
+static u32 net_capture__get(struct net_capture *cap, u64 pos)
+{
+	u32 val;
+
+	memcpy(&val, cap->map + pos, sizeof(val));
+	return val;
+}
+
+static void net_capture__pad(struct net_capture *cap, u64 pos, u64 end)
+{
+	net_capture__put(cap, pos, PCAPNG_PAD);
+	net_capture__put(cap, pos + 4, end - pos);
+	net_capture__put(cap, end - 4, end - pos);
+}
+
+/*
+ * Make room for @len bytes at @pos, padding the remains of the blocks it
+ * overwrites. Returns false if the blocks before the end of the file cannot
+ * be split that way, or the file doesn't contain what we wrote.
+ */
+static bool net_capture__reserve(struct net_capture *cap, u64 pos, u32 len)
+{
+	u64 end = pos + len, next = pos;
+	u32 blk;
+
+	while (next < end || (next > end && next - end < PCAPNG_MIN_BLOCK)) {
+		if (next == cap->size)
+			return false;
+
+		blk = net_capture__get(cap, next + 4);
+		if (blk < PCAPNG_MIN_BLOCK || blk % 4 || blk > cap->size - next)
+			return false;
+
+		next += blk;
+	}
+
+	if (next > end)
+		net_capture__pad(cap, end, next);
+
+	return true;
+}
+
+void net_capture__frame(struct net_capture *cap, const struct iovec *iov,
+			size_t offset, size_t len, bool rx)
+{
+	u32 caplen = min_t(size_t, len, NET_CAPTURE_SNAPLEN);
+	u32 blk = PCAPNG_EPB_LEN(caplen);
+	struct timespec ts;
+	u64 usecs, pos;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	usecs = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+
+	mutex_lock(&cap->mutex);
+	if (!cap->active)
+		goto out;
+
+	pos = cap->pos;
+	if (!net_capture__reserve(cap, pos, blk)) {
+		pos = cap->start;
+		if (!net_capture__reserve(cap, pos, blk))
+			goto out;
+	}
+
+	net_capture__put(cap, pos, PCAPNG_EPB);
+	net_capture__put(cap, pos + 4, blk);
+	net_capture__put(cap, pos + 8, 0);
+	net_capture__put(cap, pos + 12, usecs >> 32);
+	net_capture__put(cap, pos + 16, usecs);
+	net_capture__put(cap, pos + 20, caplen);
+	net_capture__put(cap, pos + 24, len);
+
+	memset(cap->map + pos + 28 + round_down(caplen, 4), 0, 4);
+	memcpy_fromiovecend(cap->map + pos + 28, iov, offset, caplen);
+
+	pos += 28 + ALIGN(caplen, 4);
+	net_capture__put16(cap, pos, PCAPNG_OPT_EPB_FLAGS);
+	net_capture__put16(cap, pos + 2, 4);
+	net_capture__put(cap, pos + 4, rx ? PCAPNG_EPB_FLAG_INBOUND :
+					    PCAPNG_EPB_FLAG_OUTBOUND);
+	net_capture__put(cap, pos + 8, 0);
+	net_capture__put(cap, pos + 12, blk);
+
+	cap->pos = pos + 16;
+out:
+	mutex_unlock(&cap->mutex);
+}
+
+static void net_capture__write_headers(struct net_capture *cap)
+{
+	u64 pos = 0;
+
+	/* Section header, of unknown length */
+	net_capture__put(cap, pos, PCAPNG_SHB);
+	net_capture__put(cap, pos + 4, 28);
+	net_capture__put(cap, pos + 8, PCAPNG_BYTE_ORDER_MAGIC);
+	net_capture__put16(cap, pos + 12, 1);
+	net_capture__put16(cap, pos + 14, 0);
+	net_capture__put(cap, pos + 16, 0xffffffff);
+	net_capture__put(cap, pos + 20, 0xffffffff);
+	net_capture__put(cap, pos + 24, 28);
+	pos += 28;
+
+	/* The device, with microsecond timestamps and no snapshot length */
+	net_capture__put(cap, pos, PCAPNG_IDB);
+	net_capture__put(cap, pos + 4, 20);
+	net_capture__put16(cap, pos + 8, PCAPNG_LINKTYPE_ETHERNET);
+	net_capture__put16(cap, pos + 10, 0);
+	net_capture__put(cap, pos + 12, 0);
+	net_capture__put(cap, pos + 16, 20);
+	pos += 20;
+
+	cap->start = cap->pos = pos;
+	net_capture__pad(cap, pos, cap->size);
+}
+
+static void net_capture__close(struct net_capture *cap)
+{
+	if (!cap->active)
+		return;
+
+	munmap(cap->map, cap->size);
+	close(cap->fd);
+	cap->active = false;
+}
+
+int net_capture__start(struct net_capture *cap, const char *path, u64 size)
+{
+	int r;
+
+	size = round_down(size, 4);
+	if (size < PCAPNG_EPB_LEN(NET_CAPTURE_SNAPLEN) * 2)
+		return -EINVAL;
+
+	mutex_lock(&cap->mutex);
+	net_capture__close(cap);
+
+	cap->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (cap->fd < 0) {
+		r = -errno;
+		goto out;
+	}
+
+	if (ftruncate(cap->fd, size) < 0) {
+		r = -errno;
+		goto err_close;
+	}
+
+	cap->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			cap->fd, 0);
+	if (cap->map == MAP_FAILED) {
+		r = -errno;
+		goto err_close;
+	}
+
+	cap->size = size;
+	net_capture__write_headers(cap);
+	cap->active = true;
+	r = 0;
+	goto out;
+
+err_close:
+	close(cap->fd);
+out:
+	mutex_unlock(&cap->mutex);
+	return r;
+}
+
+void net_capture__stop(struct net_capture *cap)
+{
+	mutex_lock(&cap->mutex);
+	net_capture__close(cap);
+	mutex_unlock(&cap->mutex);
+}
+
+struct net_capture *net_capture__new(void)
+{
+	struct net_capture *cap;
+
+	cap = calloc(1, sizeof(*cap));
+	if (!cap)
+		return NULL;
+
+	mutex_init(&cap->mutex);
+
+	return cap;
+}
+
+void net_capture__free(struct net_capture *cap)
+{
+	if (!cap)
+		return;
+
+	net_capture__stop(cap);
+	free(cap);
+}
@@ -0,0 +1,534 @@
+#include "kvm/virtio-net.h"
+#include "kvm/util.h"
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/kernel.h>
+#include <linux/virtio_net.h>
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Receive side scaling as the driver sets it up with
+ * VIRTIO_NET_CTRL_MQ_RSS_CONFIG: a Toeplitz hash of the addresses, and of
+ * the ports for TCP and UDP, picks an entry of the indirection table, which
+ * names the receive queue.
+ *
+ * The hash reported to the guest is computed here, with one lookup table per
+ * byte of the input. Steering has to happen before the frame reaches a tap
+ * queue, so for tap the same hash is also turned into an eBPF program, with
+ * the key unrolled into its instructions, that tun runs to pick the queue.
+ * Both look at the same fields: an Ethernet header with at most one 802.1Q
+ * tag, then IPv4 or IPv6 without extension headers. The _EX hash types
+ * aren't supported.
+ */
+
+/* More fragments, or a fragment offset */
+#define IP_FRAG_MASK		0x3fff
+
+/* Two IPv6 addresses and two ports */
+#define NET_RSS_INPUT_MAX	36
+
+#define NET_RSS_IPv4_TYPES	(VIRTIO_NET_RSS_HASH_TYPE_IPv4 |	\
+				 VIRTIO_NET_RSS_HASH_TYPE_TCPv4 |	\
+				 VIRTIO_NET_RSS_HASH_TYPE_UDPv4)
+#define NET_RSS_IPv6_TYPES	(VIRTIO_NET_RSS_HASH_TYPE_IPv6 |	\
+				 VIRTIO_NET_RSS_HASH_TYPE_TCPv6 |	\
+				 VIRTIO_NET_RSS_HASH_TYPE_UDPv6)
+
+struct net_rss {
+	struct net_rss_config	config;
+	/* The hash of each value of each byte of the input */
+	u32			lut[NET_RSS_INPUT_MAX][256];
+	struct net_rss		*prev;
+};
+
+/* The 32 bits of the key starting at bit @bit, the part that input bit uses */
+static u32 net_rss_key_window(const u8 *key, u32 bit)
+{
+	const u8 *p = key + bit / 8;
+	u64 v;
+
+	v = (u64)p[0] << 32 | (u64)p[1] << 24 | (u64)p[2] << 16 |
+	    (u64)p[3] << 8 | p[4];
+
+	return v >> (8 - bit % 8);
+}
+
+struct net_rss *net_rss__new(const struct net_rss_config *config,
+			     struct net_rss *prev)
+{
+	/* Zeroes past the key, for the windows of the last input bits */
+	u8 key[NET_RSS_KEY_SIZE + 1] = {};
+	struct net_rss *rss;
+	u32 window[8];
+	u32 i, v, b;
+
+	rss = malloc(sizeof(*rss));
+	if (!rss)
+		return NULL;
+
+	rss->config = *config;
+	rss->prev = prev;
+	memcpy(key, config->key, min_t(u32, config->key_len, NET_RSS_KEY_SIZE));
+
+	for (i = 0; i < NET_RSS_INPUT_MAX; i++) {
+		for (b = 0; b < 8; b++)
+			window[b] = net_rss_key_window(key, i * 8 + b);
+
+		for (v = 0; v < 256; v++) {
+			u32 hash = 0;
+
+			for (b = 0; b < 8; b++)
+				if (v & (0x80 >> b))
+					hash ^= window[b];
+			rss->lut[i][v] = hash;
+		}
+	}
+
+	return rss;
+}
+
+/* Along with all those it superseded */
+void net_rss__free(struct net_rss *rss)
+{
+	struct net_rss *prev;
+
+	while (rss) {
+		prev = rss->prev;
+		free(rss);
+		rss = prev;
+	}
+}
+
+static u16 net_rss_load16(const u8 *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+/*
+ * Gather the fields that are hashed into @input, and return the hash type
+ * they make, VIRTIO_NET_HASH_REPORT_NONE when the frame isn't classified.
+ * The steering program in net_rss__steering_prog() follows the same steps.
+ */
+static u16 net_rss_parse(const struct net_rss *rss, const u8 *frame,
+			 size_t len, u8 *input, size_t *input_len)
+{
+	u32 types = rss->config.hash_types;
+	size_t l3 = ETH_HLEN, l4;
+	bool ports = false;
+	u16 proto;
+
+	if (len < ETH_HLEN)
+		return VIRTIO_NET_HASH_REPORT_NONE;
+
+	proto = net_rss_load16(frame + 12);
+	if (proto == ETH_P_8021Q) {
+		if (len < ETH_HLEN + 4)
+			return VIRTIO_NET_HASH_REPORT_NONE;
+		proto = net_rss_load16(frame + 16);
+		l3 += 4;
+	}
+
+	if (proto == ETH_P_IP && (types & NET_RSS_IPv4_TYPES)) {
+		if (len < l3 + 20)
+			return VIRTIO_NET_HASH_REPORT_NONE;
+
+		if (!(net_rss_load16(frame + l3 + 6) & IP_FRAG_MASK)) {
+			proto = frame[l3 + 9];
+			ports = (proto == IPPROTO_TCP &&
+				 (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) ||
+				(proto == IPPROTO_UDP &&
+				 (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4));
+		}
+		if (!ports && !(types & VIRTIO_NET_RSS_HASH_TYPE_IPv4))
+			return VIRTIO_NET_HASH_REPORT_NONE;
+
+		memcpy(input, frame + l3 + 12, 8);
+		*input_len = 8;
+		if (!ports)
+			return VIRTIO_NET_HASH_REPORT_IPv4;
+
+		l4 = l3 + (frame[l3] & 0xf) * 4;
+		if (len < l4 + 4)
+			return VIRTIO_NET_HASH_REPORT_NONE;
+
+		memcpy(input + 8, frame + l4, 4);
+		*input_len += 4;
+		return proto == IPPROTO_TCP ? VIRTIO_NET_HASH_REPORT_TCPv4 :
+					      VIRTIO_NET_HASH_REPORT_UDPv4;
+	}
+
+	if (proto == ETH_P_IPV6 && (types & NET_RSS_IPv6_TYPES)) {
+		if (len < l3 + 40)
+			return VIRTIO_NET_HASH_REPORT_NONE;
+
+		proto = frame[l3 + 6];
+		ports = (proto == IPPROTO_TCP &&
+			 (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv6)) ||
+			(proto == IPPROTO_UDP &&
+			 (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6));
+		if (!ports && !(types & VIRTIO_NET_RSS_HASH_TYPE_IPv6))
+			return VIRTIO_NET_HASH_REPORT_NONE;
+
+		memcpy(input, frame + l3 + 8, 32);
+		*input_len = 32;
+		if (!ports)
+			return VIRTIO_NET_HASH_REPORT_IPv6;
+
+		if (len < l3 + 44)
+			return VIRTIO_NET_HASH_REPORT_NONE;
+
+		memcpy(input + 32, frame + l3 + 40, 4);
+		*input_len += 4;
+		return proto == IPPROTO_TCP ? VIRTIO_NET_HASH_REPORT_TCPv6 :
+					      VIRTIO_NET_HASH_REPORT_UDPv6;
+	}
+
+	return VIRTIO_NET_HASH_REPORT_NONE;
+}
+
+u16 net_rss__hash(const struct net_rss *rss, const void *frame, size_t len,
+		  u32 *hash)
+{
+	u8 input[NET_RSS_INPUT_MAX];
+	size_t input_len, i;
+	u16 report;
+
+	*hash = 0;
+	report = net_rss_parse(rss, frame, len, input, &input_len);
+	if (report == VIRTIO_NET_HASH_REPORT_NONE)
+		return report;
+
+	for (i = 0; i < input_len; i++)
+		*hash ^= rss->lut[i][input[i]];
+
+	return report;
+}
+
+/*
+ * The steering program. r6 holds the skb, as BPF_LD_ABS and BPF_LD_IND want,
+ * r7 the hash, r8 the offset of the ports or 0 when they aren't hashed, and
+ * r9 the offset of the IP header. The loads clobber r0 to r5, r1 is scratch
+ * between them.
+ */
+struct net_rss_prog {
+	struct bpf_insn	*insns;
+	u32		nr;
+};
+
+/* Queue indices are 4 bits, 16 of them per 64-bit immediate */
+#define NET_RSS_PROG_QUEUE_SHIFT	2
+#define NET_RSS_PROG_QUEUE_BITS		(1 << NET_RSS_PROG_QUEUE_SHIFT)
+#define NET_RSS_PROG_CHUNK_SHIFT	(6 - NET_RSS_PROG_QUEUE_SHIFT)
+#define NET_RSS_PROG_MAX_INSNS	BPF_MAXINSNS
+
+#define RSS_INSN(c, d, s, o, i)						\
+	((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s),	\
+			     .off = (o), .imm = (i) })
+
+static u32 net_rss_emit(struct net_rss_prog *prog, struct bpf_insn insn)
+{
+	/* Sized for the longest program, see net_rss__steering_prog() */
+	BUG_ON(prog->nr >= NET_RSS_PROG_MAX_INSNS);
+	prog->insns[prog->nr] = insn;
+
+	return prog->nr++;
+}
+
+/* A jump whose target is set by net_rss_land() */
+static u32 net_rss_jump(struct net_rss_prog *prog, u8 op, u8 reg, s32 imm)
+{
+	return net_rss_emit(prog, RSS_INSN(BPF_JMP | op | BPF_K, reg, 0, 0, imm));
+}
+
+static void net_rss_land(struct net_rss_prog *prog, u32 jump)
+{
+	prog->insns[jump].off = prog->nr - jump - 1;
+}
+
+static void net_rss_mov(struct net_rss_prog *prog, u8 reg, s32 imm)
+{
+	net_rss_emit(prog, RSS_INSN(BPF_ALU64 | BPF_MOV | BPF_K, reg, 0, 0, imm));
+}
+
+/* r0 = the big-endian value at @off, or at @reg + @off */
+static void net_rss_load(struct net_rss_prog *prog, u8 size, u8 reg, s32 off)
+{
+	net_rss_emit(prog, RSS_INSN(BPF_LD | size | (reg ? BPF_IND : BPF_ABS),
+				    0, reg, 0, off));
+}
+
+/*
+ * Hash the 32 bits in r0, which are the input bits from @bit on. Without
+ * branches, which would have the verifier follow every combination of bits:
+ * each bit, 0 or 1 in r1, is multiplied by its window.
+ */
+static void net_rss_emit_word(struct net_rss_prog *prog, const u8 *key,
+			      u32 bit)
+{
+	u32 b, window;
+
+	for (b = 0; b < 32; b++) {
+		window = net_rss_key_window(key, bit + b);
+		if (!window)
+			continue;
+
+		net_rss_emit(prog, RSS_INSN(BPF_ALU | BPF_MOV | BPF_X, BPF_REG_1,
+					    BPF_REG_0, 0, 0));
+		if (b < 31)
+			net_rss_emit(prog, RSS_INSN(BPF_ALU | BPF_RSH | BPF_K,
+						    BPF_REG_1, 0, 0, 31 - b));
+		net_rss_emit(prog, RSS_INSN(BPF_ALU | BPF_AND | BPF_K, BPF_REG_1,
+					    0, 0, 1));
+		net_rss_emit(prog, RSS_INSN(BPF_ALU | BPF_MUL | BPF_K, BPF_REG_1,
+					    0, 0, (s32)window));
+		net_rss_emit(prog, RSS_INSN(BPF_ALU | BPF_XOR | BPF_X, BPF_REG_7,
+					    BPF_REG_1, 0, 0));
+	}
+}
+
+/* The addresses at @addr, @words long, then the ports if r8 says so */
+static void net_rss_emit_ip(struct net_rss_prog *prog, const u8 *key,
+			    u32 addr, u32 words, bool ports, u32 *to_select)
+{
+	u32 i, skip;
+
+	for (i = 0; i < words; i++) {
+		net_rss_load(prog, BPF_W, BPF_REG_9, addr + i * 4);
+		net_rss_emit_word(prog, key, i * 32);
+	}
+
+	if (ports) {
+		skip = net_rss_jump(prog, BPF_JEQ, BPF_REG_8, 0);
+		net_rss_load(prog, BPF_W, BPF_REG_8, 0);
+		net_rss_emit_word(prog, key, words * 32);
+		net_rss_land(prog, skip);
+	}
+
+	*to_select = net_rss_emit(prog, RSS_INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0));
+}
+
+static void net_rss_emit_ipv4(struct net_rss_prog *prog, const u8 *key,
+			      u32 types, u32 *to_select, u32 *to_unclassified)
+{
+	bool tcp = types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4;
+	bool udp = types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4;
+	u32 frag, is_tcp = 0, is_udp = 0, other;
+
+	net_rss_mov(prog, BPF_REG_8, 0);
+	if (tcp || udp) {
+		net_rss_load(prog, BPF_H, BPF_REG_9, 6);
+		frag = net_rss_jump(prog, BPF_JSET, BPF_REG_0, IP_FRAG_MASK);
+		net_rss_load(prog, BPF_B, BPF_REG_9, 9);
+		if (tcp)
+			is_tcp = net_rss_jump(prog, BPF_JEQ, BPF_REG_0, IPPROTO_TCP);
+		if (udp)
+			is_udp = net_rss_jump(prog, BPF_JEQ, BPF_REG_0, IPPROTO_UDP);
+		other = net_rss_emit(prog, RSS_INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0));
+
+		/* r8 = r9 + ihl * 4 */
+		if (tcp)
+			net_rss_land(prog, is_tcp);
+		if (udp)
+			net_rss_land(prog, is_udp);
+		net_rss_load(prog, BPF_B, BPF_REG_9, 0);
+		net_rss_emit(prog, RSS_INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_0,
+					    0, 0, 0xf));
+		net_rss_emit(prog, RSS_INSN(BPF_ALU64 | BPF_LSH | BPF_K, BPF_REG_0,
+					    0, 0, 2));
+		net_rss_emit(prog, RSS_INSN(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_0,
+					    BPF_REG_9, 0, 0));
+		net_rss_emit(prog, RSS_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_8,
+					    BPF_REG_0, 0, 0));
+
+		net_rss_land(prog, frag);
+		net_rss_land(prog, other);
+	}
+
+	if (!(types & VIRTIO_NET_RSS_HASH_TYPE_IPv4))
+		*to_unclassified = net_rss_jump(prog, BPF_JEQ, BPF_REG_8, 0);
+
+	net_rss_emit_ip(prog, key, 12, 2, tcp || udp, to_select);
+}
+
+static void net_rss_emit_ipv6(struct net_rss_prog *prog, const u8 *key,
+			      u32 types, u32 *to_select, u32 *to_unclassified)
+{
+	bool tcp = types & VIRTIO_NET_RSS_HASH_TYPE_TCPv6;
+	bool udp = types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6;
+	u32 is_tcp = 0, is_udp = 0, other;
+
+	net_rss_mov(prog, BPF_REG_8, 0);
+	if (tcp || udp) {
+		net_rss_load(prog, BPF_B, BPF_REG_9, 6);
+		if (tcp)
+			is_tcp = net_rss_jump(prog, BPF_JEQ, BPF_REG_0, IPPROTO_TCP);
+		if (udp)
+			is_udp = net_rss_jump(prog, BPF_JEQ, BPF_REG_0, IPPROTO_UDP);
+		other = net_rss_emit(prog, RSS_INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0));
+
+		/* r8 = r9 + 40, right after the fixed header */
+		if (tcp)
+			net_rss_land(prog, is_tcp);
+		if (udp)
+			net_rss_land(prog, is_udp);
+		net_rss_emit(prog, RSS_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_8,
+					    BPF_REG_9, 0, 0));
+		net_rss_emit(prog, RSS_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_8,
+					    0, 0, 40));
+
+		net_rss_land(prog, other);
+	}
+
+	if (!(types & VIRTIO_NET_RSS_HASH_TYPE_IPv6))
+		*to_unclassified = net_rss_jump(prog, BPF_JEQ, BPF_REG_8, 0);
+
+	net_rss_emit_ip(prog, key, 8, 8, tcp || udp, to_select);
+}
+
+/* r0 = table[r7 & mask], with the table packed into immediates */
+static void net_rss_emit_select(struct net_rss_prog *prog,
+				const struct net_rss_config *config)
+{
+	u32 per_chunk = 1 << NET_RSS_PROG_CHUNK_SHIFT;
+	u32 nr_chunks = DIV_ROUND_UP(config->table_len, per_chunk);
+	u32 found[NET_RSS_TABLE_SIZE >> NET_RSS_PROG_CHUNK_SHIFT];
+	u32 i, j, next;
+	u64 chunk;
+
+	net_rss_emit(prog, RSS_INSN(BPF_ALU | BPF_MOV | BPF_X, BPF_REG_0,
+				    BPF_REG_7, 0, 0));
+	net_rss_emit(prog, RSS_INSN(BPF_ALU | BPF_AND | BPF_K, BPF_REG_0, 0, 0,
+				    config->table_len - 1));
+	/* r1 = the chunk, r2 = the shift within it */
+	net_rss_emit(prog, RSS_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1,
+				    BPF_REG_0, 0, 0));
+	net_rss_emit(prog, RSS_INSN(BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_1,
+				    0, 0, NET_RSS_PROG_CHUNK_SHIFT));
+	net_rss_emit(prog, RSS_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2,
+				    BPF_REG_0, 0, 0));
+	net_rss_emit(prog, RSS_INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_2,
+				    0, 0, per_chunk - 1));
+	net_rss_emit(prog, RSS_INSN(BPF_ALU64 | BPF_LSH | BPF_K, BPF_REG_2,
+				    0, 0, NET_RSS_PROG_QUEUE_SHIFT));
+	net_rss_mov(prog, BPF_REG_3, 0);
+
+	for (i = 0; i < nr_chunks; i++) {
+		chunk = 0;
+		for (j = 0; j < per_chunk && i * per_chunk + j < config->table_len; j++)
+			chunk |= (u64)config->table[i * per_chunk + j] <<
+				 (j * NET_RSS_PROG_QUEUE_BITS);
+
+		next = net_rss_jump(prog, BPF_JNE, BPF_REG_1, i);
+		net_rss_emit(prog, RSS_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_3,
+					    0, 0, (u32)chunk));
+		net_rss_emit(prog, RSS_INSN(0, 0, 0, 0, chunk >> 32));
+		found[i] = net_rss_emit(prog, RSS_INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0));
+		net_rss_land(prog, next);
+	}
+
+	for (i = 0; i < nr_chunks; i++)
+		net_rss_land(prog, found[i]);
+
+	net_rss_emit(prog, RSS_INSN(BPF_ALU64 | BPF_RSH | BPF_X, BPF_REG_3,
+				    BPF_REG_2, 0, 0));
+	net_rss_emit(prog, RSS_INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_3, 0, 0,
+				    (1 << NET_RSS_PROG_QUEUE_BITS) - 1));
+	net_rss_emit(prog, RSS_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_0,
+				    BPF_REG_3, 0, 0));
+	net_rss_emit(prog, RSS_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+}
+
+/*
+ * Build and load the program that tun runs to pick the queue of a frame,
+ * for TUNSETSTEERINGEBPF. tun takes the result modulo the number of attached
+ * queues, which are the active queue pairs in order. Frames too short for
+ * the loads end up on queue 0.
+ *
+ * Returns the program fd, or a negative errno.
+ */
+int net_rss__steering_prog(const struct net_rss *rss)
+{
+	const struct net_rss_config *config = &rss->config;
+	u32 to_select[2] = {}, to_unclassified[2] = {};
+	u32 types = config->hash_types;
+	u8 key[NET_RSS_KEY_SIZE + 1] = {};
+	struct net_rss_prog prog = {};
+	u32 vlan, is_ipv4 = 0, is_ipv6 = 0, other, i;
+	char license[] = "GPL";
+	union bpf_attr attr;
+	int fd;
+
+	if (config->table_len > NET_RSS_TABLE_SIZE ||
+	    !is_power_of_two(config->table_len))
+		return -EINVAL;
+
+	for (i = 0; i < config->table_len; i++)
+		if (config->table[i] >= 1 << NET_RSS_PROG_QUEUE_BITS)
+			return -EINVAL;
+
+	prog.insns = calloc(NET_RSS_PROG_MAX_INSNS, sizeof(*prog.insns));
+	if (!prog.insns)
+		return -ENOMEM;
+
+	memcpy(key, config->key, min_t(u32, config->key_len, NET_RSS_KEY_SIZE));
+
+	net_rss_emit(&prog, RSS_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6,
+				     BPF_REG_1, 0, 0));
+	net_rss_mov(&prog, BPF_REG_7, 0);
+	net_rss_mov(&prog, BPF_REG_9, ETH_HLEN);
+	net_rss_load(&prog, BPF_H, 0, 12);
+	vlan = net_rss_jump(&prog, BPF_JNE, BPF_REG_0, ETH_P_8021Q);
+	net_rss_load(&prog, BPF_H, 0, ETH_HLEN + 2);
+	net_rss_mov(&prog, BPF_REG_9, ETH_HLEN + 4);
+	net_rss_land(&prog, vlan);
+
+	if (types & NET_RSS_IPv4_TYPES)
+		is_ipv4 = net_rss_jump(&prog, BPF_JEQ, BPF_REG_0, ETH_P_IP);
+	if (types & NET_RSS_IPv6_TYPES)
+		is_ipv6 = net_rss_jump(&prog, BPF_JEQ, BPF_REG_0, ETH_P_IPV6);
+	other = net_rss_emit(&prog, RSS_INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0));
+
+	if (types & NET_RSS_IPv4_TYPES) {
+		net_rss_land(&prog, is_ipv4);
+		net_rss_emit_ipv4(&prog, key, types, &to_select[0],
+				  &to_unclassified[0]);
+	}
+	if (types & NET_RSS_IPv6_TYPES) {
+		net_rss_land(&prog, is_ipv6);
+		net_rss_emit_ipv6(&prog, key, types, &to_select[1],
+				  &to_unclassified[1]);
+	}
+
+	net_rss_land(&prog, other);
+	for (i = 0; i < 2; i++)
+		if (to_unclassified[i])
+			net_rss_land(&prog, to_unclassified[i]);
+	net_rss_mov(&prog, BPF_REG_0, config->unclassified);
+	net_rss_emit(&prog, RSS_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+	if (types & NET_RSS_IPv4_TYPES)
+		net_rss_land(&prog, to_select[0]);
+	if (types & NET_RSS_IPv6_TYPES)
+		net_rss_land(&prog, to_select[1]);
+	net_rss_emit_select(&prog, config);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type	= BPF_PROG_TYPE_SOCKET_FILTER;
+	attr.insns	= (unsigned long)prog.insns;
+	attr.insn_cnt	= prog.nr;
+	attr.license	= (unsigned long)license;
+	fd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+	if (fd < 0)
+		fd = -errno;
+
+	free(prog.insns);
+
+	return fd;
+}
@@ -0,0 +1,234 @@
+#include "kvm/virtio-net.h"
+#include "kvm/barrier.h"
+#include "kvm/util.h"
+
+#include <linux/io_uring.h>
+#include <linux/kernel.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * A small synchronous io_uring used by the virtio-net TX queues to hand a
+ * whole batch of frames to the tap in one system call. The tap is a character
+ * device, so there is no sendmmsg() to batch writes with.
+ */
+struct net_uring {
+	int			fd;
+
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_array;
+	unsigned int		sq_mask;
+	unsigned int		sq_entries;
+	struct io_uring_sqe	*sqes;
+
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	size_t			sqes_size;
+};
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static int net_uring_map(struct net_uring *ring, struct io_uring_params *p)
+{
+	ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(u32);
+	ring->cq_ring_size = p->cq_off.cqes +
+			     p->cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_ring_size = max(ring->sq_ring_size, ring->cq_ring_size);
+		ring->cq_ring_size = 0;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_RW,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		return -errno;
+
+	if (ring->cq_ring_size) {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_RW,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto err_unmap_sq;
+	} else {
+		ring->cq_ring = ring->sq_ring;
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_RW,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err_unmap_cq;
+
+	ring->sq_head	= ring->sq_ring + p->sq_off.head;
+	ring->sq_tail	= ring->sq_ring + p->sq_off.tail;
+	ring->sq_array	= ring->sq_ring + p->sq_off.array;
+	ring->sq_mask	= *(u32 *)(ring->sq_ring + p->sq_off.ring_mask);
+	ring->sq_entries = *(u32 *)(ring->sq_ring + p->sq_off.ring_entries);
+
+	ring->cq_head	= ring->cq_ring + p->cq_off.head;
+	ring->cq_tail	= ring->cq_ring + p->cq_off.tail;
+	ring->cq_mask	= *(u32 *)(ring->cq_ring + p->cq_off.ring_mask);
+	ring->cqes	= ring->cq_ring + p->cq_off.cqes;
+
+	return 0;
+
+err_unmap_cq:
+	if (ring->cq_ring_size)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+err_unmap_sq:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	return -ENOMEM;
+}
+
+struct net_uring *net_uring__new(unsigned int entries)
+{
+	struct io_uring_params p = {};
+	struct net_uring *ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	ring->fd = io_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		goto err_free;
+
+	if (net_uring_map(ring, &p))
+		goto err_close;
+
+	return ring;
+
+err_close:
+	close(ring->fd);
+err_free:
+	free(ring);
+	return NULL;
+}
+
+void net_uring__free(struct net_uring *ring)
+{
+	if (!ring)
+		return;
+
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring_size)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	free(ring);
+}
+
+static unsigned int net_uring_reap(struct net_uring *ring,
+				   struct net_tx_io *io)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail, nr = 0;
+
+	head = *ring->cq_head;
+	tail = *ring->cq_tail;
+	/* Read the CQEs only after observing the tail */
+	rmb();
+
+	for (; head != tail; head++, nr++) {
+		cqe = &ring->cqes[head & ring->cq_mask];
+		io[cqe->user_data].res = cqe->res;
+	}
+
+	/* Release the CQEs back to the kernel once we're done with them */
+	mb();
+	*ring->cq_head = head;
+
+	return nr;
+}
+
+/*
+ * Write @nr frames to @fd and wait for all of them. The writes are hard-linked
+ * so that the tap sees them in order, and a failed write doesn't cancel the
+ * ones queued after it. The result of each write ends up in io->res.
+ *
+ * Returns 0 once all writes completed, or a negative errno if the batch could
+ * not be submitted at all, in which case none of the frames were written.
+ */
+int net_uring__writev(struct net_uring *ring, int fd, struct net_tx_io *io,
+		      unsigned int nr)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int i, idx, submitted = 0, done = 0;
+	struct io_uring_sqe *sqe;
+	int r;
+
+	if (!nr || nr > ring->sq_entries)
+		return -EINVAL;
+
+	for (i = 0; i < nr; i++) {
+		idx = (tail + i) & ring->sq_mask;
+		sqe = &ring->sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode	= IORING_OP_WRITEV;
+		sqe->fd		= fd;
+		sqe->off	= -1;
+		sqe->addr	= (unsigned long)io[i].iov;
+		sqe->len	= io[i].iovcnt;
+		sqe->user_data	= i;
+		if (i + 1 < nr)
+			sqe->flags = IOSQE_IO_HARDLINK;
+		ring->sq_array[idx] = idx;
+	}
+
+	/* Make the SQEs visible before publishing the new tail */
+	wmb();
+	*ring->sq_tail = tail + nr;
+
+	while (done < nr) {
+		r = io_uring_enter(ring->fd, nr - submitted, nr - done,
+				   IORING_ENTER_GETEVENTS);
+		if (r < 0 && errno != EAGAIN && errno != EBUSY &&
+		    errno != EINTR) {
+			r = -errno;
+			if (submitted == nr)
+				return r;
+
+			/* Take back the SQEs the kernel didn't consume */
+			*ring->sq_tail = tail + submitted;
+			if (!submitted)
+				return r;
+
+			for (i = submitted; i < nr; i++)
+				io[i].res = r;
+			done += nr - submitted;
+			submitted = nr;
+			continue;
+		}
+		if (r > 0)
+			submitted += r;
+
+		done += net_uring_reap(ring, io);
+	}
+
+	return 0;
+}
@@ -1,14 +1,26 @@
 #include "kvm/virtio-pci-dev.h"
 #include "kvm/virtio-net.h"
+#include "kvm/vhost-user.h"
+#include "kvm/virtio-vdpa.h"
 #include "kvm/virtio.h"
 #include "kvm/mutex.h"
 #include "kvm/util.h"
 #include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
 #include "kvm/uip.h"
 #include "kvm/guest_compat.h"
 #include "kvm/iovec.h"
 #include "kvm/strbuf.h"
-
+#include "kvm/kvm-ipc.h"
+#include "kvm/epoll.h"
+#include "kvm/iothread.h"
+#include "kvm/read-write.h"
+#include "kvm/metrics.h"
+#include "kvm/ratelimit.h"
+#include "kvm/probe.h"
+#include "kvm/host-numa.h"
+
+#include <linux/byteorder.h>
 #include <linux/list.h>
 #include <linux/vhost.h>
 #include <linux/virtio_net.h>
@@ -25,24 +37,95 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 #define VIRTIO_NET_QUEUE_SIZE		256
-#define VIRTIO_NET_NUM_QUEUES		8
+/* Longest chain taken from a queue, however deep it is */
+#define VIRTIO_NET_MAX_CHAIN		256
+/* Chains handed to the backend at once, the guest is signalled per batch */
+#define VIRTIO_NET_TX_BATCH		32
 
 struct net_dev;
 
+struct net_dev_queue;
+
 struct net_dev_operations {
-	int (*rx)(struct iovec *iov, u16 in, struct net_dev *ndev);
-	int (*tx)(struct iovec *iov, u16 in, struct net_dev *ndev);
+	int (*rx)(struct iovec *iov, u16 in, struct net_dev_queue *queue);
+	int (*tx)(struct iovec *iov, u16 in, struct net_dev_queue *queue);
+	/* Optional, returns 0 when the whole batch was handled */
+	int (*tx_batch)(struct net_tx_io *io, u16 nr,
+			struct net_dev_queue *queue);
 };
 
 struct net_dev_queue {
 	int				id;
 	struct net_dev			*ndev;
 	struct virt_queue		vq;
+	/*
+	 * Serves the queue from its first kick once it is active, until
+	 * exit_vq(), and runs if has_thread
+	 */
+	void				*(*thread_fn)(void *);
+	bool				has_thread;
 	pthread_t			thread;
 	struct mutex			lock;
 	pthread_cond_t			cond;
+	bool				started;
+	/* Batches TX writes to the tap */
+	struct net_uring		*uring;
+
+	/*
+	 * Sized from the ring: room for two chains, the chains of one RX
+	 * packet plus one more at most, or a TX batch. And for RX, the heads
+	 * and sizes of the chains of a packet.
+	 */
+	struct iovec			*iov;
+	u32				nr_iov;
+	u16				*heads;
+	u32				*sizes;
+	/* What the driver asked for, 0 until it does */
+	u32				size;
+
+	/* Used buffers the guest wasn't told about, until coal_timer fires */
+	struct mutex			coal_lock;
+	u32				coal_pending;
+	int				coal_timer;
+
+	/* Busy-polls the TX queue before waiting */
+	struct virtio_poll		poll;
+	/* Kicks a TX queue served by an iothread, -1 otherwise */
+	int				io_efd;
+	bool				io_failed;
+	struct iothread_handler		io_handler;
+
+	/* Written by the thread serving the queue only */
+	u64				packets;
+	u64				bytes;
+	u64				drops;
+	/* Spent moving frames, not waiting for them or for buffers */
+	u64				busy_ns;
+
+	/* When mode=null makes up the next RX frame */
+	u64				null_next;
+
+	/*
+	 * Waiting out the rate limit: the thread of the queue sleeps on cond,
+	 * an iothread has throttle_fd armed. Both with the lock held.
+	 */
+	struct ratelimit		ratelimit;
+	bool				throttled;
+	int				throttle_fd;
+	struct iothread_handler		throttle_handler;
+};
+
+/* Set with VIRTIO_NET_CTRL_NOTF_COAL, indexed by the parity of the vq */
+#define VIRTIO_NET_COAL_RX		0
+#define VIRTIO_NET_COAL_TX		1
+
+struct virtio_net_coal {
+	u32				usecs;
+	u32				max_packets;
 };
 
 struct net_dev {
@@ -53,33 +136,80 @@ struct net_dev {
 	struct net_dev_queue		queues[VIRTIO_NET_NUM_QUEUES * 2 + 1];
 	struct virtio_net_config	config;
 	u32				queue_pairs;
-
-	int				vhost_fd;
-	int				tap_fd;
+	/* Largest queue offered */
+	u32				queue_size;
+	/* Pairs the driver enabled with VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET */
+	u32				active_pairs;
+
+	/* One vhost-net instance and one tap queue per queue pair */
+	int				vhost_fds[VIRTIO_NET_NUM_QUEUES];
+	int				tap_fds[VIRTIO_NET_NUM_QUEUES];
 	char				tap_name[IFNAMSIZ];
 	bool				tap_ufo;
+	/* Host node of the NIC the tap or AF_XDP socket is backed by, or -1 */
+	int				numa_node;
 
 	int				mode;
 
 	struct uip_info			info;
+	struct net_afxdp		*afxdp;
+	struct vhost_user		*vhost_user;
+	/* What mode=null receives, after room for the largest vnet header */
+	u8				*null_frame;
 	struct net_dev_operations	*ops;
 	struct kvm			*kvm;
 
+	struct virtio_net_coal		coal[2];
+	/* Flushes the coalesced notifications */
+	struct kvm__epoll		coal_epoll;
+	bool				coal_started;
+
+	/* Frames are copied to the capture file while set */
+	bool				capturing;
+	struct net_capture		*capture;
+
+	/* What the driver set for VIRTIO_NET_F_RSS or _HASH_REPORT, or NULL */
+	struct net_rss			*rss;
+	/* Every one since, as the RX threads may still hash with them */
+	struct net_rss			*rss_configs;
+	/* tun takes our steering programs, VIRTIO_NET_F_RSS is offered */
+	bool				rss_steering;
+
 	struct virtio_net_params	*params;
+	/* The --iothreads loop serving the TX queues, or -1 */
+	int				iothread;
 };
 
-static LIST_HEAD(ndevs);
 static int compat_id = -1;
 
 #define MAX_PACKET_SIZE 65550
 
 static bool has_virtio_feature(struct net_dev *ndev, u32 feature)
 {
-	return ndev->vdev.features & (1 << feature);
+	return ndev->vdev.features & (1ULL << feature);
+}
+
+/* Index of the tap queue and vhost-net instance serving a virtqueue */
+static inline u32 vq_pair(u32 vq)
+{
+	return vq / 2;
+}
+
+static bool is_ctrl_vq(struct net_dev *ndev, u32 vq)
+{
+	return vq == (u32)(ndev->queue_pairs * 2);
+}
+
+static bool virtio_net_queue_active(struct net_dev_queue *queue)
+{
+	return vq_pair(queue->id) < queue->ndev->active_pairs;
 }
 
 static int virtio_net_hdr_len(struct net_dev *ndev)
 {
+	if (has_virtio_feature(ndev, VIRTIO_NET_F_HASH_REPORT))
+		return sizeof(struct virtio_net_hdr_v1_hash);
+
 	if (has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF) ||
 	    !ndev->vdev.legacy)
 		return sizeof(struct virtio_net_hdr_mrg_rxbuf);
@@ -87,10 +217,313 @@ static int virtio_net_hdr_len(struct net_dev *ndev)
 	return sizeof(struct virtio_net_hdr);
 }
 
+/* Copy a frame, which starts with its virtio_net_hdr, to the capture file */
+static void virtio_net_capture(struct net_dev *ndev, const struct iovec *iov,
+			       size_t len, bool rx)
+{
+	size_t hdr_len = virtio_net_hdr_len(ndev);
+
+	if (len > hdr_len)
+		net_capture__frame(ndev->capture, iov, hdr_len, len - hdr_len, rx);
+}
+
+static void virtio_net_signal_now(struct net_dev_queue *queue)
+{
+	struct net_dev *ndev = queue->ndev;
+
+	if (virtio_queue__should_signal(&queue->vq))
+		ndev->vdev.ops->signal_vq(ndev->kvm, &ndev->vdev, queue->id);
+}
+
+/*
+ * Tell the guest about @nr more used buffers. Unless it asked for coalescing,
+ * that happens right away, since latency suffers otherwise. Coalesced
+ * notifications wait for max_packets buffers, or for the timer.
+ */
+static void virtio_net_signal(struct net_dev_queue *queue, u32 nr)
+{
+	struct virtio_net_coal *coal = &queue->ndev->coal[queue->id & 1];
+	u32 usecs = coal->usecs, max_packets = coal->max_packets;
+	struct itimerspec its = {};
+
+	if (!usecs && !queue->coal_pending) {
+		virtio_net_signal_now(queue);
+		return;
+	}
+
+	mutex_lock(&queue->coal_lock);
+	queue->coal_pending += nr;
+	if (!usecs || (max_packets && queue->coal_pending >= max_packets)) {
+		queue->coal_pending = 0;
+		virtio_net_signal_now(queue);
+	} else if (queue->coal_pending == nr) {
+		/* The first buffer held back starts the clock */
+		its.it_value.tv_sec = usecs / 1000000;
+		its.it_value.tv_nsec = (usecs % 1000000) * 1000;
+		if (timerfd_settime(queue->coal_timer, 0, &its, NULL) < 0) {
+			queue->coal_pending = 0;
+			virtio_net_signal_now(queue);
+		}
+	}
+	mutex_unlock(&queue->coal_lock);
+}
+
+static void virtio_net_coal_expired(struct kvm *kvm, struct epoll_event *ev)
+{
+	struct net_dev_queue *queue = ev->data.ptr;
+	u64 expired;
+
+	mutex_lock(&queue->coal_lock);
+	if (read(queue->coal_timer, &expired, sizeof(expired)) > 0 &&
+	    queue->coal_pending) {
+		queue->coal_pending = 0;
+		virtio_net_signal_now(queue);
+	}
+	mutex_unlock(&queue->coal_lock);
+}
+
+static int virtio_net_coal_init(struct net_dev_queue *queue)
+{
+	struct net_dev *ndev = queue->ndev;
+	struct epoll_event ev = {
+		.events		= EPOLLIN,
+		.data.ptr	= queue,
+	};
+	int r;
+
+	if (!ndev->coal_started) {
+		r = epoll__init(ndev->kvm, &ndev->coal_epoll, "virtio-net-coal",
+				virtio_net_coal_expired);
+		if (r < 0)
+			return r;
+		ndev->coal_started = true;
+	}
+
+	mutex_init(&queue->coal_lock);
+	queue->coal_pending = 0;
+	queue->coal_timer = timerfd_create(CLOCK_MONOTONIC,
+					   TFD_NONBLOCK | TFD_CLOEXEC);
+	if (queue->coal_timer < 0)
+		return -errno;
+
+	if (epoll_ctl(ndev->coal_epoll.fd, EPOLL_CTL_ADD, queue->coal_timer,
+		      &ev) < 0) {
+		r = -errno;
+		close(queue->coal_timer);
+		return r;
+	}
+
+	return 0;
+}
+
+static void virtio_net_coal_exit(struct net_dev_queue *queue)
+{
+	mutex_lock(&queue->coal_lock);
+	epoll_ctl(queue->ndev->coal_epoll.fd, EPOLL_CTL_DEL, queue->coal_timer,
+		  NULL);
+	close(queue->coal_timer);
+	queue->coal_timer = -1;
+	queue->coal_pending = 0;
+	mutex_unlock(&queue->coal_lock);
+}
+
+static void virtio_net_rx_wait(struct net_dev_queue *queue)
+{
+	mutex_lock(&queue->lock);
+	while (!virt_queue__available(&queue->vq) ||
+	       !virtio_net_queue_active(queue))
+		pthread_cond_wait(&queue->cond, &queue->lock.mutex);
+	mutex_unlock(&queue->lock);
+}
+
+/*
+ * Wait until the next frame is due. A guest that ran out of buffers doesn't
+ * get the missed frames in a burst afterwards.
+ */
+static void virtio_net_null_pace(struct net_dev_queue *queue)
+{
+	u32 pps = queue->ndev->params->rx_pps;
+	struct timespec ts;
+	u64 now;
+
+	if (pps == VIRTIO_NET_NULL_RX_MAX)
+		return;
+
+	/* Without rx_pps=, the guest receives nothing */
+	while (!pps)
+		pause();
+
+	now = kvm_cpu__now();
+	if (queue->null_next > now) {
+		ts.tv_sec = queue->null_next / 1000000000ULL;
+		ts.tv_nsec = queue->null_next % 1000000000ULL;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				       NULL) == EINTR)
+			;
+	} else {
+		queue->null_next = now;
+	}
+	queue->null_next += 1000000000ULL / pps;
+}
+
+static void virtio_net_rx_set_num_buffers(struct net_dev *ndev,
+					  struct virt_queue *vq,
+					  struct iovec *iov, u16 num_buffers)
+{
+	/*
+	 * The device MUST set num_buffers, except in the case
+	 * where the legacy driver did not negotiate
+	 * VIRTIO_NET_F_MRG_RXBUF and the field does not exist.
+	 */
+	if (!has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF) &&
+	    ndev->vdev.legacy)
+		return;
+
+	num_buffers = virtio_host_to_guest_u16(vq->endian, num_buffers);
+	memcpy_toiovecend(iov, (void *)&num_buffers,
+			  offsetof(struct virtio_net_hdr_mrg_rxbuf, num_buffers),
+			  sizeof(num_buffers));
+}
+
+/* With VIRTIO_NET_F_HASH_REPORT, the hash of the frame following the header */
+static void virtio_net_rx_report_hash(struct net_dev *ndev,
+				      const struct iovec *iov, size_t len)
+{
+	struct net_rss *rss = __atomic_load_n(&ndev->rss, __ATOMIC_ACQUIRE);
+	size_t hdr_len = virtio_net_hdr_len(ndev);
+	u16 report = VIRTIO_NET_HASH_REPORT_NONE;
+	u8 frame[NET_RSS_HDR_LEN];
+	struct {
+		__le32	value;
+		__le16	report;
+		__le16	padding;
+	} hash = {};
+	u32 value = 0;
+	size_t n;
+
+	if (!has_virtio_feature(ndev, VIRTIO_NET_F_HASH_REPORT))
+		return;
+
+	if (rss && len > hdr_len) {
+		n = min_t(size_t, len - hdr_len, sizeof(frame));
+		memcpy_fromiovecend(frame, iov, hdr_len, n);
+		report = net_rss__hash(rss, frame, n, &value);
+	}
+
+	hash.value = cpu_to_le32(value);
+	hash.report = cpu_to_le16(report);
+	memcpy_toiovecend(iov, (void *)&hash,
+			  offsetof(struct virtio_net_hdr_v1_hash, hash_value),
+			  sizeof(hash));
+}
+
+/*
+ * Read a packet from the backend straight into the guest buffers. This is only
+ * possible when the chains already made available by the driver can hold the
+ * largest packet the backend may return, which with mergeable buffers usually
+ * means gathering several of them. The chains that end up unused are handed
+ * back to the ring.
+ *
+ * Returns the packet length, 0 when the copying path must be used instead,
+ * or -1 with errno set.
+ */
+static int virtio_net_rx_zerocopy(struct net_dev_queue *queue,
+				  struct iovec *iov)
+{
+	struct net_dev *ndev = queue->ndev;
+	struct virt_queue *vq = &queue->vq;
+	bool mrg = has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF);
+	size_t need = virtio_net_hdr_len(ndev);
+	u16 *heads = queue->heads;
+	u32 *sizes = queue->sizes;
+	u16 nr_heads = 0, num_buffers, out, in;
+	size_t niov = 0, total = 0;
+	ssize_t len, copied;
+
+	if (ndev->mode == NET_MODE_AFXDP)
+		need += NET_AFXDP_FRAME_SIZE;
+	else if (ndev->mode == NET_MODE_NULL)
+		need += ndev->params->pkt_size;
+	else
+		need += MAX_PACKET_SIZE;
+
+	while (total < need && virt_queue__available(vq) &&
+	       (mrg || !nr_heads) && nr_heads < vq->max_chain &&
+	       niov + vq->max_chain <= queue->nr_iov) {
+		heads[nr_heads] = virt_queue__get_iov(vq, iov + niov, &out, &in,
+						      ndev->kvm);
+		sizes[nr_heads] = iov_size(iov + niov, in);
+		total += sizes[nr_heads++];
+		niov += in;
+	}
+
+	if (total < need) {
+		virt_queue__unpop(vq, nr_heads);
+		return 0;
+	}
+
+	len = ndev->ops->rx(iov, niov, queue);
+	kvm__probe(net_rx, queue->id, len);
+	if (len < 0) {
+		virt_queue__unpop(vq, nr_heads);
+		return -1;
+	}
+
+	/* tun reports the full length of a packet it had to truncate */
+	if (len > (ssize_t)total)
+		queue->drops++;
+	len = min_t(ssize_t, len, total);
+
+	virtio_net_rx_report_hash(ndev, iov, len);
+	if (ndev->capturing)
+		virtio_net_capture(ndev, iov, len, true);
+
+	copied = num_buffers = 0;
+	do {
+		u32 used = min_t(ssize_t, len - copied, sizes[num_buffers]);
+
+		virt_queue__set_used_elem_no_update(vq, heads[num_buffers],
+						    used, num_buffers);
+		copied += used;
+		num_buffers++;
+	} while (copied < len);
+
+	virt_queue__unpop(vq, nr_heads - num_buffers);
+	virtio_net_rx_set_num_buffers(ndev, vq, iov, num_buffers);
+	virt_queue__used_idx_advance(vq, num_buffers);
+
+	return len;
+}
+
+static void timespec_add_ns(struct timespec *ts, u64 ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+/* Sleep until the rate limit lets the queue go on, or its limits change */
+static void virtio_net_throttle_wait(struct net_dev_queue *queue, u64 ns)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	timespec_add_ns(&ts, ns);
+
+	mutex_lock(&queue->lock);
+	queue->throttled = true;
+	while (queue->throttled)
+		if (pthread_cond_timedwait(&queue->cond, &queue->lock.mutex,
+					   &ts) == ETIMEDOUT)
+			break;
+	queue->throttled = false;
+	mutex_unlock(&queue->lock);
+}
+
 static void *virtio_net_rx_thread(void *p)
 {
-	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
 	struct net_dev_queue *queue = p;
+	struct iovec *iov = queue->iov;
 	struct virt_queue *vq = &queue->vq;
 	struct net_dev *ndev = queue->ndev;
 	struct kvm *kvm;
@@ -99,60 +532,84 @@ static void *virtio_net_rx_thread(void *p)
 	int len, copied;
 
 	kvm__set_thread_name("virtio-net-rx");
+	host_numa__bind_thread(ndev->numa_node);
 
 	kvm = ndev->kvm;
 	while (1) {
-		mutex_lock(&queue->lock);
-		if (!virt_queue__available(vq))
-			pthread_cond_wait(&queue->cond, &queue->lock.mutex);
-		mutex_unlock(&queue->lock);
+		virtio_net_rx_wait(queue);
 
 		while (virt_queue__available(vq)) {
-			unsigned char buffer[MAX_PACKET_SIZE + sizeof(struct virtio_net_hdr_mrg_rxbuf)];
+			unsigned char buffer[MAX_PACKET_SIZE + sizeof(struct virtio_net_hdr_v1_hash)];
 			struct iovec dummy_iov = {
 				.iov_base = buffer,
 				.iov_len  = sizeof(buffer),
 			};
-			struct virtio_net_hdr_mrg_rxbuf *hdr;
+			struct iovec *chain = iov;
+			struct iovec_cursor cur;
 			u16 num_buffers;
-
-			len = ndev->ops->rx(&dummy_iov, 1, ndev);
+			size_t iovsize;
+			u64 start, delay;
+
+			/* The frame is charged once its length is known */
+			delay = ratelimit__delay(&queue->ratelimit);
+			if (delay)
+				virtio_net_throttle_wait(queue, delay);
+
+			if (ndev->mode == NET_MODE_NULL)
+				virtio_net_null_pace(queue);
+			start = kvm_cpu__now();
+
+			len = 0;
+			if (ndev->mode != NET_MODE_USER)
+				len = virtio_net_rx_zerocopy(queue, iov);
+			if (len > 0)
+				goto signal;
+
+			if (len == 0) {
+				len = ndev->ops->rx(&dummy_iov, 1, queue);
+				kvm__probe(net_rx, queue->id, len);
+			}
+			/* The tap queue was detached by VQ_PAIRS_SET */
+			if (len < 0 && errno == EBADFD)
+				break;
 			if (len < 0) {
 				pr_warning("%s: rx on vq %u failed (%d), exiting thread\n",
 						__func__, queue->id, len);
 				goto out_err;
 			}
 
+			virtio_net_rx_report_hash(ndev, &dummy_iov, len);
+			if (ndev->capturing)
+				virtio_net_capture(ndev, &dummy_iov, len, true);
+
+			/*
+			 * The header is written into the first chain, which stays
+			 * at the start of iov while the others are being filled.
+			 */
 			copied = num_buffers = 0;
-			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-			hdr = iov[0].iov_base;
+			head = virt_queue__get_iov(vq, chain, &out, &in, kvm);
 			while (copied < len) {
-				size_t iovsize = min_t(size_t, len - copied, iov_size(iov, in));
-
-				memcpy_toiovec(iov, buffer + copied, iovsize);
+				iovec_cursor__init(&cur, chain, in);
+				iovsize = iovec_cursor__to(&cur, buffer + copied,
+							   len - copied);
 				copied += iovsize;
 				virt_queue__set_used_elem_no_update(vq, head, iovsize, num_buffers++);
 				if (copied == len)
 					break;
-				while (!virt_queue__available(vq))
-					sleep(0);
-				head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+				virtio_net_rx_wait(queue);
+				chain = iov + vq->max_chain;
+				head = virt_queue__get_iov(vq, chain, &out, &in, kvm);
 			}
 
-			/*
-			 * The device MUST set num_buffers, except in the case
-			 * where the legacy driver did not negotiate
-			 * VIRTIO_NET_F_MRG_RXBUF and the field does not exist.
-			 */
-			if (has_virtio_feature(ndev, VIRTIO_NET_F_MRG_RXBUF) ||
-			    !ndev->vdev.legacy)
-				hdr->num_buffers = virtio_host_to_guest_u16(vq->endian, num_buffers);
-
+			virtio_net_rx_set_num_buffers(ndev, vq, iov, num_buffers);
 			virt_queue__used_idx_advance(vq, num_buffers);
 
-			/* We should interrupt guest right now, otherwise latency is huge. */
-			if (virtio_queue__should_signal(vq))
-				ndev->vdev.ops->signal_vq(kvm, &ndev->vdev, queue->id);
+signal:
+			queue->packets++;
+			queue->bytes += len;
+			ratelimit__charge(&queue->ratelimit, len, 1);
+			virtio_net_signal(queue, 1);
+			queue->busy_ns += kvm_cpu__now() - start;
 		}
 	}
 
@@ -162,20 +619,117 @@ out_err:
 
 }
 
-static void *virtio_net_tx_thread(void *p)
+/*
+ * Hand a batch of frames to the backend, preferably all at once. The length
+ * written, or a negative errno, ends up in io->res.
+ */
+static void virtio_net_tx_batch(struct net_dev_queue *queue,
+				struct net_tx_io *io, u16 nr)
 {
-	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
-	struct net_dev_queue *queue = p;
+	struct net_dev *ndev = queue->ndev;
+	u16 i;
+
+	kvm__probe(net_tx, queue->id, nr);
+
+	if (ndev->ops->tx_batch && !ndev->ops->tx_batch(io, nr, queue))
+		return;
+
+	for (i = 0; i < nr; i++) {
+		io[i].res = ndev->ops->tx(io[i].iov, io[i].iovcnt, queue);
+		if (io[i].res < 0)
+			io[i].res = -errno;
+	}
+}
+
+/*
+ * Send all the frames the guest made available, with but one notification.
+ * Returns the nanoseconds to wait for when the rate limit stopped it, with
+ * the notifications still disabled, or a negative errno.
+ */
+static s64 virtio_net_tx_do_io(struct net_dev_queue *queue)
+{
+	struct net_tx_io io[VIRTIO_NET_TX_BATCH];
+	struct iovec *iov = queue->iov;
+	u16 heads[VIRTIO_NET_TX_BATCH];
 	struct virt_queue *vq = &queue->vq;
 	struct net_dev *ndev = queue->ndev;
-	struct kvm *kvm;
+	struct kvm *kvm = ndev->kvm;
+	struct virt_queue_batch batch;
 	u16 out, in;
-	u16 head;
+	u16 i, nr;
+	size_t niov;
+	u64 start, delay, bytes;
 	int len;
 
-	kvm__set_thread_name("virtio-net-tx");
+	/* Until we wait again, the guest needn't notify us */
+	virt_queue__disable_notify(vq);
+	while (virt_queue__available(vq) ||
+	       virtio_poll__spin(&queue->poll, vq)) {
+		delay = ratelimit__delay(&queue->ratelimit);
+		if (delay)
+			return delay;
+
+		start = kvm_cpu__now();
+		nr = niov = 0;
+		while (nr < VIRTIO_NET_TX_BATCH &&
+		       niov + vq->max_chain <= queue->nr_iov &&
+		       virt_queue__available(vq)) {
+			heads[nr] = virt_queue__get_iov(vq, iov + niov,
+							&out, &in, kvm);
+			io[nr++] = (struct net_tx_io) {
+				.iov	= iov + niov,
+				.iovcnt	= out,
+			};
+			/* Before the backend gets to consume the iovecs */
+			if (ndev->capturing)
+				virtio_net_capture(ndev, iov + niov,
+						   iov_size(iov + niov, out),
+						   false);
+			niov += out + in;
+		}
 
-	kvm = ndev->kvm;
+		virtio_net_tx_batch(queue, io, nr);
+
+		bytes = 0;
+		virt_queue__batch_begin(&batch, vq);
+		for (i = 0; i < nr; i++) {
+			len = io[i].res;
+			/* Drop frames sent on a detached tap queue */
+			if (len == -EBADFD) {
+				queue->drops++;
+				len = 0;
+			}
+			if (len < 0) {
+				pr_warning("%s: tx on vq %u failed (%d)\n",
+						__func__, queue->id, -len);
+				return len;
+			}
+			if (len) {
+				queue->packets++;
+				queue->bytes += len;
+				bytes += len;
+			}
+
+			virt_queue__batch_add(&batch, heads[i], len);
+		}
+		ratelimit__charge(&queue->ratelimit, bytes, nr);
+
+		virtio_net_signal(queue, virt_queue__batch_publish(&batch));
+		queue->busy_ns += kvm_cpu__now() - start;
+	}
+	virt_queue__enable_notify(vq);
+
+	return 0;
+}
+
+static void *virtio_net_tx_thread(void *p)
+{
+	struct net_dev_queue *queue = p;
+	struct virt_queue *vq = &queue->vq;
+	s64 r;
+
+	kvm__set_thread_name("virtio-net-tx");
+	host_numa__bind_thread(queue->ndev->numa_node);
 
 	while (1) {
 		mutex_lock(&queue->lock);
@@ -183,44 +737,357 @@ static void *virtio_net_tx_thread(void *p)
 			pthread_cond_wait(&queue->cond, &queue->lock.mutex);
 		mutex_unlock(&queue->lock);
 
-		while (virt_queue__available(vq)) {
-			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-			len = ndev->ops->tx(iov, out, ndev);
-			if (len < 0) {
-				pr_warning("%s: tx on vq %u failed (%d)\n",
-						__func__, queue->id, errno);
-				goto out_err;
+		virtio_poll__woken(&queue->poll);
+
+		r = virtio_net_tx_do_io(queue);
+		if (r < 0)
+			break;
+		if (r)
+			virtio_net_throttle_wait(queue, r);
+	}
+
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void virtio_net_tx_iothread_do_io(struct net_dev_queue *queue)
+{
+	s64 r;
+
+	/* The guest isn't notifying us, the timer will */
+	if (queue->throttled)
+		return;
+
+	/* Like the TX thread, give up on the queue once the backend fails */
+	r = virtio_net_tx_do_io(queue);
+	if (r < 0) {
+		queue->io_failed = true;
+	} else if (r) {
+		mutex_lock(&queue->lock);
+		queue->throttled = true;
+		if (ratelimit__arm(queue->throttle_fd, r) < 0)
+			queue->throttled = false;
+		mutex_unlock(&queue->lock);
+	}
+}
+
+static void virtio_net_tx_handle_io(struct kvm *kvm,
+				    struct iothread_handler *handler)
+{
+	struct net_dev_queue *queue = container_of(handler,
+						   struct net_dev_queue,
+						   io_handler);
+	u64 data;
+
+	if (read(queue->io_efd, &data, sizeof(data)) < 0)
+		return;
+
+	virtio_poll__woken(&queue->poll);
+	virtio_net_tx_iothread_do_io(queue);
+}
+
+static void virtio_net_tx_handle_throttle(struct kvm *kvm,
+					  struct iothread_handler *handler)
+{
+	struct net_dev_queue *queue = container_of(handler,
+						   struct net_dev_queue,
+						   throttle_handler);
+	u64 data;
+
+	if (read(queue->throttle_fd, &data, sizeof(data)) < 0)
+		return;
+
+	mutex_lock(&queue->lock);
+	queue->throttled = false;
+	mutex_unlock(&queue->lock);
+
+	virtio_net_tx_iothread_do_io(queue);
+}
+
+/* Called with the lock of the queue held */
+static void virtio_net_queue_spawn(struct net_dev_queue *queue)
+{
+	/* Queues of the pairs that the driver didn't enable may never be used */
+	if (!queue->thread_fn || queue->has_thread ||
+	    (!is_ctrl_vq(queue->ndev, queue->id) &&
+	     !virtio_net_queue_active(queue)))
+		return;
+
+	if (kvm__start_device_thread(&queue->thread, queue->thread_fn, queue))
+		die_perror("Unable to start a virtio-net queue thread");
+	queue->has_thread = true;
+}
+
+/* Wake up the thread or iothread serving a queue */
+static void virtio_net_queue_kick(struct net_dev_queue *queue)
+{
+	u64 data = 1;
+
+	if (queue->io_efd >= 0) {
+		if (!queue->io_failed &&
+		    write(queue->io_efd, &data, sizeof(data)) < 0)
+			pr_warning("%s: kicking vq %u failed", __func__,
+				   queue->id);
+		return;
+	}
+
+	mutex_lock(&queue->lock);
+	virtio_net_queue_spawn(queue);
+	pthread_cond_signal(&queue->cond);
+	mutex_unlock(&queue->lock);
+}
+
+static int virtio_net_set_backend(struct net_dev *ndev, u32 vq, int fd)
+{
+	struct vhost_vring_file file = {
+		.index	= vq & 1,
+		.fd	= fd,
+	};
+
+	if (ioctl(ndev->vhost_fds[vq_pair(vq)], VHOST_NET_SET_BACKEND, &file) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int virtio_net_set_queue_pairs(struct net_dev *ndev, u32 pairs)
+{
+	struct ifreq ifr = {};
+	u32 i, vq;
+	int r;
+
+	if (pairs == ndev->active_pairs)
+		return 0;
+
+	for (i = 0; i < ndev->queue_pairs; i++) {
+		bool enable = i < pairs;
+
+		if (enable == (i < ndev->active_pairs))
+			continue;
+
+		if (ndev->mode == NET_MODE_TAP && ndev->queue_pairs > 1) {
+			ifr.ifr_flags = enable ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+			r = ioctl(ndev->tap_fds[i], TUNSETQUEUE, &ifr);
+			if (r < 0) {
+				pr_warning("TUNSETQUEUE on tap queue %u failed", i);
+				return -errno;
 			}
+		}
+
+		if (!ndev->vdev.use_vhost)
+			continue;
+
+		for (vq = i * 2; vq < i * 2 + 2; vq++) {
+			if (!ndev->queues[vq].started)
+				continue;
+
+			if (ndev->mode == NET_MODE_VHOST_USER)
+				r = vhost_user__set_vring_enable(ndev->vhost_user,
+								 vq, enable);
+			else
+				r = virtio_net_set_backend(ndev, vq, enable ?
+							   ndev->tap_fds[i] : -1);
+			if (r < 0) {
+				pr_warning("Unable to %s vq %u",
+					   enable ? "enable" : "disable", vq);
+				return r;
+			}
+		}
+	}
+
+	ndev->active_pairs = pairs;
+
+	/* Wake up the userspace queues that were waiting to be enabled */
+	for (vq = 0; vq < ndev->queue_pairs * 2; vq++) {
+		struct net_dev_queue *queue = &ndev->queues[vq];
+
+		if (!queue->started || ndev->vdev.use_vhost)
+			continue;
+
+		virtio_net_queue_kick(queue);
+	}
+
+	return 0;
+}
+
+/* Have tun pick the queue of each frame with @rss, or as it likes when NULL */
+static int virtio_net_set_steering(struct net_dev *ndev, struct net_rss *rss)
+{
+	int fd = -1, r = 0;
+
+	if (rss) {
+		fd = net_rss__steering_prog(rss);
+		if (fd < 0)
+			return fd;
+	}
+
+	/* The program is per device, and the first queue is always attached */
+	if (ioctl(ndev->tap_fds[0], TUNSETSTEERINGEBPF, &fd) < 0)
+		r = -errno;
+
+	/* tun holds on to the program */
+	if (fd >= 0)
+		close(fd);
+
+	return r;
+}
+
+/*
+ * VIRTIO_NET_CTRL_MQ_RSS_CONFIG sets the hash, the indirection table and the
+ * queue pairs in use, VIRTIO_NET_CTRL_MQ_HASH_CONFIG only the hash that is
+ * reported. The RX threads may still be hashing with the previous config,
+ * which is only freed with the device.
+ */
+static virtio_net_ctrl_ack virtio_net_handle_rss(struct net_dev *ndev,
+						 struct virtio_net_ctrl_hdr *ctrl,
+						 struct iovec_cursor *cur)
+{
+	bool steer = ctrl->cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG;
+	struct net_rss_config config = { .table_len = 1 };
+	__le16 table[NET_RSS_TABLE_SIZE], val[2];
+	u32 i, pairs = 1, max_tx_vq;
+	struct net_rss *rss;
+	__le32 hash_types;
+	u16 mask;
+
+	if (!has_virtio_feature(ndev, steer ? VIRTIO_NET_F_RSS :
+						 VIRTIO_NET_F_HASH_REPORT))
+		return VIRTIO_NET_ERR;
+
+	if (iovec_cursor__from(cur, &hash_types, sizeof(hash_types)) !=
+	    sizeof(hash_types))
+		return VIRTIO_NET_ERR;
+	config.hash_types = le32_to_cpu(hash_types) & NET_RSS_HASH_TYPES;
+
+	/*
+	 * indirection_table_mask, unclassified_queue and the table. Reserved
+	 * fields in their place without RSS, as long as a table of one entry.
+	 */
+	if (iovec_cursor__from(cur, val, sizeof(val)) != sizeof(val))
+		return VIRTIO_NET_ERR;
+
+	if (steer) {
+		mask = le16_to_cpu(val[0]);
+		config.unclassified = le16_to_cpu(val[1]);
+		config.table_len = mask + 1;
+		if (config.table_len > NET_RSS_TABLE_SIZE ||
+		    !is_power_of_two(config.table_len) ||
+		    config.unclassified >= ndev->queue_pairs)
+			return VIRTIO_NET_ERR;
+	}
+
+	if (iovec_cursor__from(cur, table, config.table_len * 2) !=
+	    config.table_len * 2u)
+		return VIRTIO_NET_ERR;
+
+	if (steer) {
+		pairs = config.unclassified + 1;
+		for (i = 0; i < config.table_len; i++) {
+			config.table[i] = le16_to_cpu(table[i]);
+			if (config.table[i] >= ndev->queue_pairs)
+				return VIRTIO_NET_ERR;
+			pairs = max_t(u32, pairs, config.table[i] + 1);
+		}
+	}
+
+	/* max_tx_vq, or reserved */
+	if (iovec_cursor__from(cur, val, sizeof(val[0])) != sizeof(val[0]))
+		return VIRTIO_NET_ERR;
+	max_tx_vq = le16_to_cpu(val[0]);
+	if (steer && (max_tx_vq < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+		      max_tx_vq > ndev->queue_pairs))
+		return VIRTIO_NET_ERR;
+
+	if (iovec_cursor__from(cur, &config.key_len, 1) != 1 ||
+	    config.key_len > NET_RSS_KEY_SIZE ||
+	    iovec_cursor__from(cur, config.key, config.key_len) != config.key_len)
+		return VIRTIO_NET_ERR;
+
+	rss = net_rss__new(&config, ndev->rss_configs);
+	if (!rss)
+		return VIRTIO_NET_ERR;
+	ndev->rss_configs = rss;
+
+	/* There's no VQ_PAIRS_SET with RSS, max_tx_vq stands for it */
+	if (steer && (virtio_net_set_queue_pairs(ndev, max_t(u32, pairs, max_tx_vq)) ||
+		      virtio_net_set_steering(ndev, rss)))
+		return VIRTIO_NET_ERR;
+
+	__atomic_store_n(&ndev->rss, rss, __ATOMIC_RELEASE);
+
+	return VIRTIO_NET_OK;
+}
+
+static virtio_net_ctrl_ack virtio_net_handle_mq(struct kvm* kvm, struct net_dev *ndev,
+						struct virtio_net_ctrl_hdr *ctrl,
+						struct iovec_cursor *cur)
+{
+	struct virtio_net_ctrl_mq mq;
+	u16 pairs;
+
+	if (ctrl->cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG ||
+	    ctrl->cmd == VIRTIO_NET_CTRL_MQ_HASH_CONFIG)
+		return virtio_net_handle_rss(ndev, ctrl, cur);
+
+	if (ctrl->cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET)
+		return VIRTIO_NET_ERR;
 
-			virt_queue__set_used_elem(vq, head, len);
-		}
+	if (iovec_cursor__from(cur, &mq, sizeof(mq)) != sizeof(mq))
+		return VIRTIO_NET_ERR;
 
-		if (virtio_queue__should_signal(vq))
-			ndev->vdev.ops->signal_vq(kvm, &ndev->vdev, queue->id);
-	}
+	pairs = virtio_guest_to_host_u16(ndev->vdev.endian, mq.virtqueue_pairs);
+	if (pairs < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN || pairs > ndev->queue_pairs)
+		return VIRTIO_NET_ERR;
 
-out_err:
-	pthread_exit(NULL);
-	return NULL;
+	if (virtio_net_set_queue_pairs(ndev, pairs))
+		return VIRTIO_NET_ERR;
+
+	return VIRTIO_NET_OK;
 }
 
-static virtio_net_ctrl_ack virtio_net_handle_mq(struct kvm* kvm, struct net_dev *ndev, struct virtio_net_ctrl_hdr *ctrl)
+static virtio_net_ctrl_ack virtio_net_handle_coal(struct net_dev *ndev,
+						  struct virtio_net_ctrl_hdr *ctrl,
+						  struct iovec_cursor *cur)
 {
-	/* Not much to do here */
+	struct virtio_net_ctrl_coal coal;
+	struct virtio_net_coal *dst;
+
+	if (!has_virtio_feature(ndev, VIRTIO_NET_F_NOTF_COAL))
+		return VIRTIO_NET_ERR;
+
+	/* The RX and TX commands share their layout */
+	switch (ctrl->cmd) {
+	case VIRTIO_NET_CTRL_NOTF_COAL_RX_SET:
+		dst = &ndev->coal[VIRTIO_NET_COAL_RX];
+		break;
+	case VIRTIO_NET_CTRL_NOTF_COAL_TX_SET:
+		dst = &ndev->coal[VIRTIO_NET_COAL_TX];
+		break;
+	default:
+		return VIRTIO_NET_ERR;
+	}
+
+	if (iovec_cursor__from(cur, &coal, sizeof(coal)) != sizeof(coal))
+		return VIRTIO_NET_ERR;
+
+	dst->max_packets = virtio_guest_to_host_u32(ndev->vdev.endian,
+						    coal.max_packets);
+	dst->usecs = virtio_guest_to_host_u32(ndev->vdev.endian, coal.max_usecs);
+
 	return VIRTIO_NET_OK;
 }
 
 static void *virtio_net_ctrl_thread(void *p)
 {
-	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
 	struct net_dev_queue *queue = p;
+	struct iovec *iov = queue->iov;
 	struct virt_queue *vq = &queue->vq;
 	struct net_dev *ndev = queue->ndev;
 	u16 out, in, head;
 	struct kvm *kvm = ndev->kvm;
 	struct virtio_net_ctrl_hdr ctrl;
 	virtio_net_ctrl_ack ack;
-	size_t len;
+	struct iovec_cursor cur;
 
 	kvm__set_thread_name("virtio-net-ctrl");
 
@@ -232,18 +1099,24 @@ static void *virtio_net_ctrl_thread(void *p)
 
 		while (virt_queue__available(vq)) {
 			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-			len = min(iov_size(iov, in), sizeof(ctrl));
-			memcpy_fromiovec((void *)&ctrl, iov, len);
+			iovec_cursor__init(&cur, iov, out);
+
+			if (iovec_cursor__from(&cur, &ctrl, sizeof(ctrl)) != sizeof(ctrl))
+				ctrl.class = (u8)-1;
 
 			switch (ctrl.class) {
 			case VIRTIO_NET_CTRL_MQ:
-				ack = virtio_net_handle_mq(kvm, ndev, &ctrl);
+				ack = virtio_net_handle_mq(kvm, ndev, &ctrl, &cur);
+				break;
+			case VIRTIO_NET_CTRL_NOTF_COAL:
+				ack = virtio_net_handle_coal(ndev, &ctrl, &cur);
 				break;
 			default:
 				ack = VIRTIO_NET_ERR;
 				break;
 			}
-			memcpy_toiovec(iov + in, &ack, sizeof(ack));
+			/* The ack lives in the device-writable part of the chain */
+			memcpy_toiovecend(iov + out, &ack, 0, sizeof(ack));
 			virt_queue__set_used_elem(vq, head, sizeof(ack));
 		}
 
@@ -265,28 +1138,50 @@ static void virtio_net_handle_callback(struct kvm *kvm, struct net_dev *ndev, in
 		return;
 	}
 
-	mutex_lock(&net_queue->lock);
-	pthread_cond_signal(&net_queue->cond);
-	mutex_unlock(&net_queue->lock);
+	virtio_net_queue_kick(net_queue);
 }
 
 static int virtio_net_request_tap(struct net_dev *ndev, struct ifreq *ifr,
-				  const char *tapname)
+				  const char *tapname, u32 pair)
 {
 	int ret;
 
 	memset(ifr, 0, sizeof(*ifr));
 	ifr->ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+	if (ndev->queue_pairs > 1)
+		ifr->ifr_flags |= IFF_MULTI_QUEUE;
 	if (tapname)
 		strlcpy(ifr->ifr_name, tapname, sizeof(ifr->ifr_name));
 
-	ret = ioctl(ndev->tap_fd, TUNSETIFF, ifr);
+	ret = ioctl(ndev->tap_fds[pair], TUNSETIFF, ifr);
 
 	if (ret >= 0)
 		strlcpy(ndev->tap_name, ifr->ifr_name, sizeof(ndev->tap_name));
 	return ret;
 }
 
+/*
+ * A tap queue handed over with fd= may already be attached to its device,
+ * which then can't take TUNSETIFF again.
+ */
+static int virtio_net_adopt_tap(struct net_dev *ndev, struct ifreq *ifr,
+				const char *tapname, u32 pair)
+{
+	memset(ifr, 0, sizeof(*ifr));
+	if (ioctl(ndev->tap_fds[pair], TUNGETIFF, ifr) < 0)
+		return virtio_net_request_tap(ndev, ifr, tapname, pair);
+
+	if (!(ifr->ifr_flags & IFF_VNET_HDR) ||
+	    (ndev->queue_pairs > 1 && !(ifr->ifr_flags & IFF_MULTI_QUEUE))) {
+		pr_warning("%s: tap queue %u needs IFF_VNET_HDR%s", ifr->ifr_name,
+			   pair, ndev->queue_pairs > 1 ? " and IFF_MULTI_QUEUE" : "");
+		return -1;
+	}
+
+	strlcpy(ndev->tap_name, ifr->ifr_name, sizeof(ndev->tap_name));
+	return 0;
+}
+
 static int virtio_net_exec_script(const char* script, const char *tap_name)
 {
 	pid_t pid;
@@ -306,6 +1201,17 @@ static int virtio_net_exec_script(const char* script, const char *tap_name)
 	return 0;
 }
 
+static void virtio_net__tap_close(struct net_dev *ndev)
+{
+	u32 i;
+
+	for (i = 0; i < VIRTIO_NET_NUM_QUEUES; i++) {
+		if (ndev->tap_fds[i] >= 0)
+			close(ndev->tap_fds[i]);
+		ndev->tap_fds[i] = -1;
+	}
+}
+
 static bool virtio_net__tap_init(struct net_dev *ndev)
 {
 	int sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -314,10 +1220,14 @@ static bool virtio_net__tap_init(struct net_dev *ndev)
 	struct ifreq ifr;
 	const struct virtio_net_params *params = ndev->params;
 	bool skipconf = !!params->tapif;
+	u32 i;
 
+	/* macvtap keeps the header size per queue, tun per device */
 	hdr_len = virtio_net_hdr_len(ndev);
-	if (ioctl(ndev->tap_fd, TUNSETVNETHDRSZ, &hdr_len) < 0)
-		pr_warning("Config tap device TUNSETVNETHDRSZ error");
+	for (i = 0; i < ndev->queue_pairs; i++) {
+		if (ioctl(ndev->tap_fds[i], TUNSETVNETHDRSZ, &hdr_len) < 0)
+			pr_warning("Config tap device TUNSETVNETHDRSZ error");
+	}
 
 	if (strcmp(params->script, "none")) {
 		if (virtio_net_exec_script(params->script, ndev->tap_name) < 0)
@@ -350,8 +1260,7 @@ static bool virtio_net__tap_init(struct net_dev *ndev)
 fail:
 	if (sock >= 0)
 		close(sock);
-	if (ndev->tap_fd >= 0)
-		close(ndev->tap_fd);
+	virtio_net__tap_close(ndev);
 
 	return 0;
 }
@@ -373,36 +1282,94 @@ static void virtio_net__tap_exit(struct net_dev *ndev)
 	close(sock);
 }
 
+/*
+ * Open one tap queue per queue pair after the first one has been set up.
+ * Running short of queues isn't fatal, the device is simply created with
+ * fewer pairs.
+ */
+static void virtio_net__tap_create_queues(struct net_dev *ndev,
+					  const char *tap_file, bool macvtap)
+{
+	struct ifreq ifr;
+	u32 i;
+
+	for (i = 1; i < ndev->queue_pairs; i++) {
+		ndev->tap_fds[i] = open(tap_file, O_RDWR);
+		if (ndev->tap_fds[i] < 0)
+			break;
+
+		if (!macvtap &&
+		    virtio_net_request_tap(ndev, &ifr, ndev->tap_name, i) < 0) {
+			close(ndev->tap_fds[i]);
+			ndev->tap_fds[i] = -1;
+			break;
+		}
+	}
+
+	if (i < ndev->queue_pairs) {
+		pr_warning("%s: only %u of %u tap queues available",
+			   ndev->tap_name, i, ndev->queue_pairs);
+		ndev->queue_pairs = i;
+	}
+}
+
 static bool virtio_net__tap_create(struct net_dev *ndev)
 {
 	int offload;
+	u32 i;
 	struct ifreq ifr;
 	const struct virtio_net_params *params = ndev->params;
 	bool macvtap = (!!params->tapif) && (params->tapif[0] == '/');
+	const char *tap_file = "/dev/net/tun";
 
-	/* Did the user already gave us the FD? */
-	if (params->fd)
-		ndev->tap_fd = params->fd;
-	else {
-		const char *tap_file = "/dev/net/tun";
+	/* Did the user ask us to use macvtap? */
+	if (macvtap)
+		tap_file = params->tapif;
+
+	/* Did the user already gave us the FDs, one per queue pair? */
+	if (params->nr_fds) {
+		if (params->mq && params->mq != (int)params->nr_fds)
+			pr_warning("%u tap queues given, ignoring mq=%d",
+				   params->nr_fds, params->mq);
+		ndev->queue_pairs = params->nr_fds;
+		for (i = 0; i < params->nr_fds; i++)
+			ndev->tap_fds[i] = params->fds[i];
 
-		/* Did the user ask us to use macvtap? */
 		if (macvtap)
-			tap_file = params->tapif;
+			goto created;
 
-		ndev->tap_fd = open(tap_file, O_RDWR);
-		if (ndev->tap_fd < 0) {
-			pr_warning("Unable to open %s", tap_file);
-			return 0;
+		for (i = 0; i < params->nr_fds; i++) {
+			if (virtio_net_adopt_tap(ndev, &ifr, i ? ndev->tap_name :
+						 params->tapif, i) < 0) {
+				pr_warning("Config tap queue %u error", i);
+				goto fail;
+			}
 		}
+		goto created;
+	}
+
+	ndev->tap_fds[0] = open(tap_file, O_RDWR);
+	if (ndev->tap_fds[0] < 0) {
+		pr_warning("Unable to open %s", tap_file);
+		return 0;
 	}
 
 	if (!macvtap &&
-	    virtio_net_request_tap(ndev, &ifr, params->tapif) < 0) {
+	    virtio_net_request_tap(ndev, &ifr, params->tapif, 0) < 0) {
+		/* An existing single-queue tap doesn't accept IFF_MULTI_QUEUE */
+		if (ndev->queue_pairs > 1) {
+			ndev->queue_pairs = 1;
+			if (virtio_net_request_tap(ndev, &ifr, params->tapif, 0) >= 0)
+				goto created;
+		}
 		pr_warning("Config tap device error. Are you root?");
 		goto fail;
 	}
 
+	virtio_net__tap_create_queues(ndev, tap_file, macvtap);
+
+created:
+
 	/*
 	 * The UFO support had been removed from kernel in commit:
 	 * ID: fb652fdfe83710da0ca13448a41b7ed027d0a984
@@ -413,58 +1380,200 @@ static bool virtio_net__tap_create(struct net_dev *ndev)
 	 */
 	ndev->tap_ufo = true;
 	offload = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_UFO;
-	if (ioctl(ndev->tap_fd, TUNSETOFFLOAD, offload) < 0) {
+	for (i = 0; i < ndev->queue_pairs; i++) {
+		if (ioctl(ndev->tap_fds[i], TUNSETOFFLOAD, offload) >= 0)
+			continue;
+
 		/*
 		 * Is this failure caused by kernel remove the UFO support?
 		 * Try TUNSETOFFLOAD without TUN_F_UFO.
 		 */
-		offload &= ~TUN_F_UFO;
-		if (ioctl(ndev->tap_fd, TUNSETOFFLOAD, offload) < 0) {
-			pr_warning("Config tap device TUNSETOFFLOAD error");
-			goto fail;
+		if (i == 0 && (offload & TUN_F_UFO)) {
+			offload &= ~TUN_F_UFO;
+			ndev->tap_ufo = false;
+			if (ioctl(ndev->tap_fds[i], TUNSETOFFLOAD, offload) >= 0)
+				continue;
 		}
-		ndev->tap_ufo = false;
+
+		pr_warning("Config tap device TUNSETOFFLOAD error");
+		goto fail;
+	}
+
+	/* Only the first pair is enabled until the driver asks for more */
+	for (i = 1; i < ndev->queue_pairs; i++) {
+		ifr.ifr_flags = IFF_DETACH_QUEUE;
+		if (ioctl(ndev->tap_fds[i], TUNSETQUEUE, &ifr) < 0)
+			pr_warning("Unable to detach tap queue %u", i);
 	}
 
 	return 1;
 
 fail:
-	if ((ndev->tap_fd >= 0) || (!params->fd) )
-		close(ndev->tap_fd);
+	virtio_net__tap_close(ndev);
 
 	return 0;
 }
 
-static inline int tap_ops_tx(struct iovec *iov, u16 out, struct net_dev *ndev)
+/*
+ * Steering needs a kernel that knows TUNSETSTEERINGEBPF (4.16), the
+ * privileges to load the program, and a tap rather than a macvtap.
+ */
+static void virtio_net__tap_probe_rss(struct net_dev *ndev)
+{
+	struct net_rss_config config = {
+		.hash_types	= NET_RSS_HASH_TYPES,
+		.table_len	= 1,
+	};
+	struct net_rss *rss;
+
+	if (ndev->queue_pairs < 2)
+		return;
+
+	rss = net_rss__new(&config, NULL);
+	if (!rss)
+		return;
+
+	ndev->rss_steering = !virtio_net_set_steering(ndev, rss) &&
+			     !virtio_net_set_steering(ndev, NULL);
+	if (!ndev->rss_steering)
+		pr_debug("%s: no RSS, tun doesn't take the steering program",
+			 ndev->tap_name);
+
+	net_rss__free(rss);
+}
+
+static inline int tap_ops_tx(struct iovec *iov, u16 out, struct net_dev_queue *queue)
+{
+	return writev(queue->ndev->tap_fds[vq_pair(queue->id)], iov, out);
+}
+
+static inline int tap_ops_rx(struct iovec *iov, u16 in, struct net_dev_queue *queue)
+{
+	return readv(queue->ndev->tap_fds[vq_pair(queue->id)], iov, in);
+}
+
+static int tap_ops_tx_batch(struct net_tx_io *io, u16 nr,
+			    struct net_dev_queue *queue)
+{
+	if (!queue->uring)
+		return -ENOSYS;
+
+	return net_uring__writev(queue->uring,
+				 queue->ndev->tap_fds[vq_pair(queue->id)],
+				 io, nr);
+}
+
+static int afxdp_ops_rx(struct iovec *iov, u16 in, struct net_dev_queue *queue)
+{
+	struct net_dev *ndev = queue->ndev;
+
+	return net_afxdp__rx(ndev->afxdp, iov, in, virtio_net_hdr_len(ndev));
+}
+
+static int afxdp_ops_tx_batch(struct net_tx_io *io, u16 nr,
+			      struct net_dev_queue *queue)
+{
+	struct net_dev *ndev = queue->ndev;
+
+	return net_afxdp__tx(ndev->afxdp, io, nr, virtio_net_hdr_len(ndev));
+}
+
+static int afxdp_ops_tx(struct iovec *iov, u16 out, struct net_dev_queue *queue)
 {
-	return writev(ndev->tap_fd, iov, out);
+	struct net_tx_io io = {
+		.iov	= iov,
+		.iovcnt	= out,
+	};
+
+	afxdp_ops_tx_batch(&io, 1, queue);
+	return io.res;
+}
+
+static inline int uip_ops_tx(struct iovec *iov, u16 out, struct net_dev_queue *queue)
+{
+	return uip_tx(iov, out, &queue->ndev->info);
+}
+
+static int uip_ops_tx_batch(struct net_tx_io *io, u16 nr,
+			    struct net_dev_queue *queue)
+{
+	return uip_tx_batch(io, nr, &queue->ndev->info);
 }
 
-static inline int tap_ops_rx(struct iovec *iov, u16 in, struct net_dev *ndev)
+static inline int uip_ops_rx(struct iovec *iov, u16 in, struct net_dev_queue *queue)
 {
-	return readv(ndev->tap_fd, iov, in);
+	return uip_rx(iov, in, &queue->ndev->info);
 }
 
-static inline int uip_ops_tx(struct iovec *iov, u16 out, struct net_dev *ndev)
+static int null_ops_tx(struct iovec *iov, u16 out, struct net_dev_queue *queue)
 {
-	return uip_tx(iov, out, &ndev->info);
+	return iov_size(iov, out);
 }
 
-static inline int uip_ops_rx(struct iovec *iov, u16 in, struct net_dev *ndev)
+/* A zeroed vnet header, then the frame, like tap does with zerocopy */
+static int null_ops_rx(struct iovec *iov, u16 in, struct net_dev_queue *queue)
 {
-	return uip_rx(iov, in, &ndev->info);
+	struct net_dev *ndev = queue->ndev;
+	size_t hdr_len = virtio_net_hdr_len(ndev);
+	size_t len = hdr_len + ndev->params->pkt_size;
+	u8 *frame = ndev->null_frame + sizeof(struct virtio_net_hdr_mrg_rxbuf) -
+		    hdr_len;
+
+	memcpy_toiovecend(iov, frame, 0, min_t(size_t, len, iov_size(iov, in)));
+
+	return len;
 }
 
 static struct net_dev_operations tap_ops = {
-	.rx	= tap_ops_rx,
-	.tx	= tap_ops_tx,
+	.rx		= tap_ops_rx,
+	.tx		= tap_ops_tx,
+	.tx_batch	= tap_ops_tx_batch,
+};
+
+static struct net_dev_operations afxdp_ops = {
+	.rx		= afxdp_ops_rx,
+	.tx		= afxdp_ops_tx,
+	.tx_batch	= afxdp_ops_tx_batch,
 };
 
 static struct net_dev_operations uip_ops = {
-	.rx	= uip_ops_rx,
-	.tx	= uip_ops_tx,
+	.rx		= uip_ops_rx,
+	.tx		= uip_ops_tx,
+	.tx_batch	= uip_ops_tx_batch,
+};
+
+static struct net_dev_operations null_ops = {
+	.rx	= null_ops_rx,
+	.tx	= null_ops_tx,
 };
 
+static void virtio_net__null_init(struct net_dev *ndev)
+{
+	struct virtio_net_params *params = ndev->params;
+	size_t hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+	u8 *eth;
+
+	if (!params->pkt_size)
+		params->pkt_size = VIRTIO_NET_NULL_PKT_SIZE;
+	if (params->pkt_size < ETH_ZLEN ||
+	    params->pkt_size > ETH_MAX_MTU + ETH_HLEN)
+		die("mode=null frames are %u to %u bytes", ETH_ZLEN,
+		    ETH_MAX_MTU + ETH_HLEN);
+
+	ndev->null_frame = calloc(1, hdr_len + params->pkt_size);
+	if (!ndev->null_frame)
+		die("Unable to allocate the mode=null frame");
+
+	/* To the guest, from the host, of a local experimental ethertype */
+	eth = ndev->null_frame + hdr_len;
+	memcpy(eth, params->guest_mac, ETH_ALEN);
+	memcpy(eth + ETH_ALEN, params->host_mac, ETH_ALEN);
+	eth[2 * ETH_ALEN] = ETH_P_802_EX1 >> 8;
+	eth[2 * ETH_ALEN + 1] = ETH_P_802_EX1 & 0xff;
+
+	ndev->ops = &null_ops;
+}
+
 static u8 *get_config(struct kvm *kvm, void *dev)
 {
 	struct net_dev *ndev = dev;
@@ -479,6 +1588,14 @@ static size_t get_config_size(struct kvm *kvm, void *dev)
 	return sizeof(ndev->config);
 }
 
+/*
+ * Implemented by kvmtool even when vhost moves the packets: the config space
+ * and the control virtqueue that selects the queue pairs.
+ */
+#define VIRTIO_NET_USER_FEATURES	(1ULL << VIRTIO_NET_F_MAC |	\
+					 1ULL << VIRTIO_NET_F_CTRL_VQ |	\
+					 1ULL << VIRTIO_NET_F_MQ)
+
 static u64 get_host_features(struct kvm *kvm, void *dev)
 {
 	u64 features;
@@ -486,6 +1603,7 @@ static u64 get_host_features(struct kvm *kvm, void *dev)
 
 	features = 1UL << VIRTIO_NET_F_MAC
 		| 1UL << VIRTIO_NET_F_CSUM
+		| 1UL << VIRTIO_NET_F_GUEST_CSUM
 		| 1UL << VIRTIO_NET_F_HOST_TSO4
 		| 1UL << VIRTIO_NET_F_HOST_TSO6
 		| 1UL << VIRTIO_NET_F_GUEST_TSO4
@@ -505,33 +1623,113 @@ static u64 get_host_features(struct kvm *kvm, void *dev)
 		features |= (1UL << VIRTIO_NET_F_HOST_UFO
 				| 1UL << VIRTIO_NET_F_GUEST_UFO);
 
-	if (ndev->vhost_fd) {
+	/* AF_XDP moves plain frames, checksums and segments must be complete */
+	if (ndev->mode == NET_MODE_AFXDP)
+		features &= ~(1UL << VIRTIO_NET_F_CSUM
+				| 1UL << VIRTIO_NET_F_GUEST_CSUM
+				| 1UL << VIRTIO_NET_F_HOST_TSO4
+				| 1UL << VIRTIO_NET_F_HOST_TSO6
+				| 1UL << VIRTIO_NET_F_GUEST_TSO4
+				| 1UL << VIRTIO_NET_F_GUEST_TSO6);
+
+	if (ndev->mode == NET_MODE_VHOST_USER) {
+		features &= vhost_user__get_features(ndev->vhost_user) |
+			    VIRTIO_NET_USER_FEATURES;
+	} else if (ndev->vdev.use_vhost) {
 		u64 vhost_features;
 
-		if (ioctl(ndev->vhost_fd, VHOST_GET_FEATURES, &vhost_features) != 0)
+		if (ioctl(ndev->vhost_fds[0], VHOST_GET_FEATURES, &vhost_features) != 0)
 			die_perror("VHOST_GET_FEATURES failed");
 
-		features &= vhost_features;
+		features &= vhost_features | VIRTIO_NET_USER_FEATURES;
 	}
 
+	/* The vhost backends signal the guest themselves */
+	if (!ndev->vdev.use_vhost)
+		features |= 1ULL << VIRTIO_NET_F_NOTF_COAL;
+
+	/* And don't hash the frames for us */
+	if (!ndev->vdev.use_vhost &&
+	    (ndev->mode == NET_MODE_TAP || ndev->mode == NET_MODE_USER))
+		features |= 1ULL << VIRTIO_NET_F_HASH_REPORT;
+	if (ndev->rss_steering)
+		features |= 1ULL << VIRTIO_NET_F_RSS;
+
 	return features;
 }
 
+static void virtio_net__vhost_user_start(struct net_dev *ndev)
+{
+	struct net_dev_queue *queue;
+	u32 vq;
+
+	vhost_user__set_features(ndev->vhost_user, ndev->vdev.features);
+
+	/* A reset device starts over with a single queue pair */
+	ndev->active_pairs = 1;
+	for (vq = 0; vq < ndev->queue_pairs * 2; vq++) {
+		queue = &ndev->queues[vq];
+		if (!queue->started)
+			continue;
+
+		vhost_user__set_vring(ndev->kvm, ndev->vhost_user, vq, &queue->vq);
+		if (vhost_user__set_vring_enable(ndev->vhost_user, vq,
+						 virtio_net_queue_active(queue)))
+			die("Unable to enable vhost-user vring %u", vq);
+	}
+}
+
 static void virtio_net_start(struct net_dev *ndev)
 {
 	/* VHOST_NET_F_VIRTIO_NET_HDR clashes with VIRTIO_F_ANY_LAYOUT! */
 	u64 features = ndev->vdev.features & ~(1UL << VHOST_NET_F_VIRTIO_NET_HDR);
+	struct virtio_net_params *params = ndev->params;
+	u32 i;
+
+	/* A reset device forgets what the driver asked for */
+	ndev->coal[VIRTIO_NET_COAL_RX] = (struct virtio_net_coal) {
+		.usecs		= params->rx_usecs,
+		.max_packets	= params->rx_frames,
+	};
+	ndev->coal[VIRTIO_NET_COAL_TX] = (struct virtio_net_coal) {
+		.usecs		= params->tx_usecs,
+		.max_packets	= params->tx_frames,
+	};
+	ndev->rss = NULL;
+	if (ndev->rss_steering && virtio_net_set_steering(ndev, NULL))
+		pr_warning("Unable to reset the RSS steering");
 
 	if (ndev->mode == NET_MODE_TAP) {
 		if (!virtio_net__tap_init(ndev))
 			die_perror("TAP device initialized failed because");
 
-		if (ndev->vhost_fd && virtio_vhost_set_features(ndev->vhost_fd,
-								features))
-			die_perror("VHOST_SET_FEATURES failed");
-	} else {
+		for (i = 0; ndev->vdev.use_vhost && i < ndev->queue_pairs; i++) {
+			if (virtio_vhost_set_features(ndev->vhost_fds[i], features))
+				die_perror("VHOST_SET_FEATURES failed");
+		}
+
+		/* A reset device starts over with a single queue pair */
+		if (virtio_net_set_queue_pairs(ndev, 1))
+			pr_warning("Unable to reset the number of queue pairs");
+	} else if (ndev->mode == NET_MODE_USER) {
 		ndev->info.vnet_hdr_len = virtio_net_hdr_len(ndev);
-		uip_init(&ndev->info);
+		/* uip fills the vnet header in host byte order */
+		ndev->info.guest_csum = ndev->vdev.endian == VIRTIO_ENDIAN_HOST &&
+			has_virtio_feature(ndev, VIRTIO_NET_F_GUEST_CSUM);
+		ndev->info.guest_tso = ndev->info.guest_csum &&
+			has_virtio_feature(ndev, VIRTIO_NET_F_GUEST_TSO4);
+		if (uip_init(&ndev->info))
+			die("Unable to start user networking");
+	} else if (ndev->mode == NET_MODE_VHOST_USER) {
+		virtio_net__vhost_user_start(ndev);
+	}
+
+	/* Restored queues may hold buffers already, without a kick to come */
+	for (i = 0; i < ndev->queue_pairs * 2 + 1; i++) {
+		struct net_dev_queue *queue = &ndev->queues[i];
+
+		if (queue->thread_fn && virt_queue__available(&queue->vq))
+			virtio_net_queue_kick(queue);
 	}
 }
 
@@ -540,7 +1738,7 @@ static void virtio_net_stop(struct net_dev *ndev)
 	/* Undo whatever start() did */
 	if (ndev->mode == NET_MODE_TAP)
 		virtio_net__tap_exit(ndev);
-	else
+	else if (ndev->mode == NET_MODE_USER)
 		uip_exit(&ndev->info);
 }
 
@@ -558,6 +1756,7 @@ static void virtio_net_update_endian(struct net_dev *ndev)
 	    ndev->vdev.endian != VIRTIO_ENDIAN_HOST) {
 		int enable_val = 1, disable_val = 0;
 		int enable_req, disable_req;
+		u32 i;
 
 		if (ndev->vdev.endian == VIRTIO_ENDIAN_LE) {
 			enable_req = TUNSETVNETLE;
@@ -567,9 +1766,11 @@ static void virtio_net_update_endian(struct net_dev *ndev)
 			disable_req = TUNSETVNETLE;
 		}
 
-		ioctl(ndev->tap_fd, disable_req, &disable_val);
-		if (ioctl(ndev->tap_fd, enable_req, &enable_val) < 0)
-			pr_err("Config tap device TUNSETVNETLE/BE error");
+		for (i = 0; i < ndev->queue_pairs; i++) {
+			ioctl(ndev->tap_fds[i], disable_req, &disable_val);
+			if (ioctl(ndev->tap_fds[i], enable_req, &enable_val) < 0)
+				pr_err("Config tap device TUNSETVNETLE/BE error");
+		}
 	}
 }
 
@@ -586,52 +1787,169 @@ static void notify_status(struct kvm *kvm, void *dev, u32 status)
 		virtio_net_stop(dev);
 }
 
-static bool is_ctrl_vq(struct net_dev *ndev, u32 vq)
+static int virtio_net_tx_iothread_init(struct net_dev_queue *queue)
 {
-	return vq == (u32)(ndev->queue_pairs * 2);
+	int r;
+
+	queue->io_efd = eventfd(0, EFD_NONBLOCK);
+	if (queue->io_efd < 0)
+		return -errno;
+
+	queue->throttle_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (queue->throttle_fd < 0) {
+		r = -errno;
+		goto err_close_efd;
+	}
+
+	queue->io_failed = false;
+	queue->throttled = false;
+	queue->io_handler = (struct iothread_handler) {
+		.fd	= queue->io_efd,
+		.handle	= virtio_net_tx_handle_io,
+	};
+	queue->throttle_handler = (struct iothread_handler) {
+		.fd	= queue->throttle_fd,
+		.handle	= virtio_net_tx_handle_throttle,
+	};
+
+	r = iothread__add(queue->ndev->iothread, &queue->io_handler);
+	if (r < 0)
+		goto err_close_timer;
+
+	r = iothread__add(queue->ndev->iothread, &queue->throttle_handler);
+	if (r < 0) {
+		iothread__del(&queue->io_handler);
+		goto err_close_timer;
+	}
+
+	return 0;
+
+err_close_timer:
+	close(queue->throttle_fd);
+	queue->throttle_fd = -1;
+err_close_efd:
+	close(queue->io_efd);
+	queue->io_efd = -1;
+	return r;
+}
+
+static void virtio_net_tx_iothread_exit(struct net_dev_queue *queue)
+{
+	iothread__del(&queue->throttle_handler);
+	iothread__del(&queue->io_handler);
+	close(queue->throttle_fd);
+	queue->throttle_fd = -1;
+	close(queue->io_efd);
+	queue->io_efd = -1;
+}
+
+/* For the queues served by kvmtool, the vhost backends have their own */
+static int virtio_net_alloc_iov(struct net_dev_queue *queue)
+{
+	u32 max_chain = queue->vq.max_chain;
+	void *p;
+
+	queue->nr_iov = max_chain * 2;
+	p = calloc(1, queue->nr_iov * sizeof(*queue->iov) +
+		   max_chain * (sizeof(*queue->sizes) + sizeof(*queue->heads)));
+	if (!p)
+		return -ENOMEM;
+
+	queue->iov = p;
+	queue->sizes = (u32 *)&queue->iov[queue->nr_iov];
+	queue->heads = (u16 *)&queue->sizes[max_chain];
+
+	return 0;
+}
+
+static void virtio_net_free_iov(struct net_dev_queue *queue)
+{
+	free(queue->iov);
+	queue->iov = NULL;
+	queue->sizes = NULL;
+	queue->heads = NULL;
 }
 
 static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 {
-	struct vhost_vring_file file = { .index = vq };
 	struct net_dev_queue *net_queue;
 	struct net_dev *ndev = dev;
 	struct virt_queue *queue;
-	int r;
+	u32 size;
+	int fd;
 
 	compat__remove_message(compat_id);
 
 	net_queue	= &ndev->queues[vq];
 	net_queue->id	= vq;
 	net_queue->ndev	= ndev;
+	net_queue->io_efd = -1;
+	net_queue->throttle_fd = -1;
+	net_queue->throttled = false;
 	queue		= &net_queue->vq;
-	virtio_init_device_vq(kvm, &ndev->vdev, queue, VIRTIO_NET_QUEUE_SIZE);
+	size		= net_queue->size ?:
+			  virtio_vq__max_size(&ndev->vdev, ndev->queue_size);
+	virtio_init_device_vq(kvm, &ndev->vdev, queue, size);
+	queue->max_chain = min_t(u32, size, VIRTIO_NET_MAX_CHAIN);
+
+	if (is_ctrl_vq(ndev, vq) ||
+	    (ndev->mode != NET_MODE_VHOST_USER && !ndev->vdev.use_vhost)) {
+		virtio_net_free_iov(net_queue);
+		if (virtio_net_alloc_iov(net_queue) < 0)
+			return -ENOMEM;
+	}
 
 	mutex_init(&net_queue->lock);
 	pthread_cond_init(&net_queue->cond, NULL);
+	net_queue->thread_fn = NULL;
+	net_queue->has_thread = false;
 	if (is_ctrl_vq(ndev, vq)) {
-		pthread_create(&net_queue->thread, NULL, virtio_net_ctrl_thread,
-			       net_queue);
+		net_queue->thread_fn = virtio_net_ctrl_thread;
 
 		return 0;
-	} else if (ndev->vhost_fd == 0 ) {
-		if (vq & 1)
-			pthread_create(&net_queue->thread, NULL,
-				       virtio_net_tx_thread, net_queue);
-		else
-			pthread_create(&net_queue->thread, NULL,
-				       virtio_net_rx_thread, net_queue);
+	} else if (ndev->mode == NET_MODE_VHOST_USER) {
+		/* The backend gets the vrings once the driver is ready */
+		net_queue->started = true;
+		return 0;
+	} else if (!ndev->vdev.use_vhost) {
+		if ((vq & 1) && ndev->mode == NET_MODE_TAP && !net_queue->uring)
+			net_queue->uring = net_uring__new(VIRTIO_NET_TX_BATCH);
+
+		if (virtio_net_coal_init(net_queue) < 0)
+			die_perror("Unable to set up interrupt coalescing");
+
+		ratelimit__init(&net_queue->ratelimit, &ndev->params->ratelimit);
+
+		if ((vq & 1) && ndev->iothread >= 0) {
+			virtio_poll__init(&net_queue->poll, ndev->params->poll_us);
+			if (virtio_net_tx_iothread_init(net_queue) < 0)
+				die_perror("Unable to serve TX from an iothread");
+		} else if (vq & 1) {
+			virtio_poll__init(&net_queue->poll, ndev->params->poll_us);
+			net_queue->thread_fn = virtio_net_tx_thread;
+		} else {
+			net_queue->thread_fn = virtio_net_rx_thread;
+		}
 
+		net_queue->started = true;
 		return 0;
 	}
 
-	virtio_vhost_set_vring(kvm, ndev->vhost_fd, vq, queue);
-
-	file.fd = ndev->tap_fd;
-	r = ioctl(ndev->vhost_fd, VHOST_NET_SET_BACKEND, &file);
-	if (r < 0)
+	/*
+	 * Each vhost-net instance only knows about its own rx/tx pair, and
+	 * already has a kernel worker of its own.
+	 */
+	virtio_vhost_set_vring(kvm, ndev->vhost_fds[vq_pair(vq)], vq & 1, queue);
+	queue->index = vq;
+	if (ndev->params->poll_us)
+		virtio_vhost_set_vring_busyloop(ndev->vhost_fds[vq_pair(vq)],
+						vq & 1, ndev->params->poll_us);
+
+	fd = virtio_net_queue_active(net_queue) ? ndev->tap_fds[vq_pair(vq)] : -1;
+	if (virtio_net_set_backend(ndev, vq, fd) < 0)
 		die_perror("VHOST_NET_SET_BACKEND failed");
 
+	net_queue->started = true;
 	return 0;
 }
 
@@ -640,24 +1958,43 @@ static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
 	struct net_dev *ndev = dev;
 	struct net_dev_queue *queue = &ndev->queues[vq];
 
-	virtio_vhost_reset_vring(kvm, ndev->vhost_fd, vq, &queue->vq);
+	queue->started = false;
+	queue->size = 0;
+
+	if (ndev->mode == NET_MODE_VHOST_USER && !is_ctrl_vq(ndev, vq)) {
+		vhost_user__reset_vring(kvm, ndev->vhost_user, vq, &queue->vq);
+		return;
+	}
 
 	/*
 	 * TODO: vhost reset owner. It's the only way to cleanly stop vhost, but
 	 * we can't restart it at the moment.
 	 */
-	if (ndev->vhost_fd && !is_ctrl_vq(ndev, vq)) {
+	if (ndev->vdev.use_vhost && !is_ctrl_vq(ndev, vq)) {
+		int vhost_fd = ndev->vhost_fds[vq_pair(vq)];
+
+		virtio_vhost_reset_vring(kvm, vhost_fd, vq & 1, &queue->vq);
 		pr_warning("Cannot reset VHOST queue");
-		ioctl(ndev->vhost_fd, VHOST_RESET_OWNER);
+		ioctl(vhost_fd, VHOST_RESET_OWNER);
 		return;
 	}
 
-	/*
-	 * Threads are waiting on cancellation points (readv or
-	 * pthread_cond_wait) and should stop gracefully.
-	 */
-	pthread_cancel(queue->thread);
-	pthread_join(queue->thread, NULL);
+	if (queue->io_efd >= 0) {
+		virtio_net_tx_iothread_exit(queue);
+	} else if (queue->has_thread) {
+		/*
+		 * Threads are waiting on cancellation points (readv or
+		 * pthread_cond_wait) and should stop gracefully.
+		 */
+		pthread_cancel(queue->thread);
+		pthread_join(queue->thread, NULL);
+	}
+	queue->thread_fn = NULL;
+	queue->has_thread = false;
+
+	if (!is_ctrl_vq(ndev, vq))
+		virtio_net_coal_exit(queue);
+	virtio_net_free_iov(queue);
 }
 
 static void notify_vq_gsi(struct kvm *kvm, void *dev, u32 vq, u32 gsi)
@@ -665,7 +2002,7 @@ static void notify_vq_gsi(struct kvm *kvm, void *dev, u32 vq, u32 gsi)
 	struct net_dev *ndev = dev;
 	struct net_dev_queue *queue = &ndev->queues[vq];
 
-	if (ndev->vhost_fd == 0 || is_ctrl_vq(ndev, vq))
+	if (!ndev->vdev.use_vhost || is_ctrl_vq(ndev, vq))
 		return;
 
 	virtio_vhost_set_vring_irqfd(kvm, gsi, &queue->vq);
@@ -675,10 +2012,15 @@ static void notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd)
 {
 	struct net_dev *ndev = dev;
 
-	if (ndev->vhost_fd == 0 || is_ctrl_vq(ndev, vq))
+	if (!ndev->vdev.use_vhost || is_ctrl_vq(ndev, vq))
 		return;
 
-	virtio_vhost_set_vring_kick(kvm, ndev->vhost_fd, vq, efd);
+	if (ndev->mode == NET_MODE_VHOST_USER) {
+		vhost_user__set_vring_kick(ndev->vhost_user, vq, efd);
+		return;
+	}
+
+	virtio_vhost_set_vring_kick(kvm, ndev->vhost_fds[vq_pair(vq)], vq & 1, efd);
 }
 
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
@@ -699,14 +2041,20 @@ static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
 
 static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
 {
-	/* FIXME: dynamic */
-	return VIRTIO_NET_QUEUE_SIZE;
+	struct net_dev *ndev = dev;
+
+	return virtio_vq__max_size(&ndev->vdev, ndev->queue_size);
 }
 
 static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
 {
-	/* FIXME: dynamic */
-	return size;
+	struct net_dev *ndev = dev;
+	struct net_dev_queue *queue = &ndev->queues[vq];
+
+	queue->size = virtio_vq__accept_size(&ndev->vdev,
+					     get_size_vq(kvm, dev, vq), size);
+
+	return queue->size;
 }
 
 static unsigned int get_vq_count(struct kvm *kvm, void *dev)
@@ -734,18 +2082,38 @@ static struct virtio_ops net_dev_virtio_ops = {
 
 static void virtio_net__vhost_init(struct kvm *kvm, struct net_dev *ndev)
 {
-	if (ndev->queue_pairs > 1) {
-		pr_warning("multiqueue is not supported with vhost yet");
-		return;
+	cpu_set_t *saved;
+	u32 i;
+
+	/* VHOST_SET_OWNER forks the worker with our affinity */
+	saved = host_numa__enter(ndev->numa_node);
+	for (i = 0; i < ndev->queue_pairs; i++) {
+		ndev->vhost_fds[i] = open("/dev/vhost-net", O_RDWR);
+		if (ndev->vhost_fds[i] < 0)
+			die_perror("Failed openning vhost-net device");
+
+		virtio_vhost_init(kvm, ndev->vhost_fds[i]);
 	}
+	host_numa__leave(saved);
+
+	ndev->vdev.use_vhost = true;
+	ndev->vdev.user_vqs = 1ULL << (ndev->queue_pairs * 2);
+}
+
+static void virtio_net__vhost_user_init(struct kvm *kvm, struct net_dev *ndev)
+{
+	u32 pairs;
 
-	ndev->vhost_fd = open("/dev/vhost-net", O_RDWR);
-	if (ndev->vhost_fd < 0)
-		die_perror("Failed openning vhost-net device");
+	ndev->vhost_user = vhost_user__new(kvm, ndev->params->socket);
 
-	virtio_vhost_init(kvm, ndev->vhost_fd);
+	pairs = max(1U, vhost_user__get_queue_num(ndev->vhost_user) / 2);
+	if (ndev->queue_pairs > pairs) {
+		pr_warning("vhost-user backend only has %u queue pairs", pairs);
+		ndev->queue_pairs = pairs;
+	}
 
 	ndev->vdev.use_vhost = true;
+	ndev->vdev.user_vqs = 1ULL << (ndev->queue_pairs * 2);
 }
 
 static inline void str_to_mac(const char *str, char *mac)
@@ -768,11 +2136,21 @@ static int set_net_param(struct kvm *kvm, struct virtio_net_params *p,
 			p->mode = NET_MODE_USER;
 		} else if (!strncmp(val, "tap", 3)) {
 			p->mode = NET_MODE_TAP;
+		} else if (!strncmp(val, "afxdp", 5)) {
+			p->mode = NET_MODE_AFXDP;
+		} else if (!strncmp(val, "vhost-user", 10)) {
+			p->mode = NET_MODE_VHOST_USER;
+			/* The backend maps guest memory */
+			kvm->cfg.mem_shared = true;
+		} else if (!strncmp(val, "null", 4)) {
+			p->mode = NET_MODE_NULL;
+		} else if (!strncmp(val, "vdpa", 4)) {
+			p->mode = NET_MODE_VDPA;
 		} else if (!strncmp(val, "none", 4)) {
 			kvm->cfg.no_net = 1;
 			return -1;
 		} else
-			die("Unknown network mode %s, please use user, tap or none", kvm->cfg.network);
+			die("Unknown network mode %s, please use user, tap, afxdp, vhost-user, null, vdpa or none", kvm->cfg.network);
 	} else if (strcmp(param, "script") == 0) {
 		p->script = strdup(val);
 	} else if (strcmp(param, "downscript") == 0) {
@@ -788,9 +2166,55 @@ static int set_net_param(struct kvm *kvm, struct virtio_net_params *p,
 	} else if (strcmp(param, "vhost") == 0) {
 		p->vhost = atoi(val);
 	} else if (strcmp(param, "fd") == 0) {
-		p->fd = atoi(val);
+		char *end;
+
+		/* fd=<tap queue>[:<tap queue>...] */
+		for (p->nr_fds = 0; *val; val = end + (*end == ':')) {
+			if (p->nr_fds == VIRTIO_NET_NUM_QUEUES)
+				die("At most %d tap queues in fd=",
+				    VIRTIO_NET_NUM_QUEUES);
+			p->fds[p->nr_fds++] = strtol(val, &end, 10);
+			if (end == val || (*end && *end != ':'))
+				die("Invalid fd=, expected <fd>[:<fd>...]");
+		}
 	} else if (strcmp(param, "mq") == 0) {
 		p->mq = atoi(val);
+	} else if (strcmp(param, "dev") == 0) {
+		p->dev = strdup(val);
+	} else if (strcmp(param, "queue") == 0) {
+		p->queue = atoi(val);
+	} else if (strcmp(param, "socket") == 0) {
+		p->socket = strdup(val);
+	} else if (strcmp(param, "rx_usecs") == 0) {
+		p->rx_usecs = atoi(val);
+	} else if (strcmp(param, "rx_frames") == 0) {
+		p->rx_frames = atoi(val);
+	} else if (strcmp(param, "tx_usecs") == 0) {
+		p->tx_usecs = atoi(val);
+	} else if (strcmp(param, "tx_frames") == 0) {
+		p->tx_frames = atoi(val);
+	} else if (strcmp(param, "poll") == 0) {
+		p->poll_us = atoi(val);
+	} else if (strcmp(param, "iothread") == 0) {
+		p->iothread = atoi(val);
+	} else if (strcmp(param, "rx_pps") == 0) {
+		if (!strcmp(val, "max"))
+			p->rx_pps = VIRTIO_NET_NULL_RX_MAX;
+		else
+			p->rx_pps = strtoul(val, NULL, 0);
+	} else if (strcmp(param, "pkt_size") == 0) {
+		p->pkt_size = atoi(val);
+	} else if (strcmp(param, "bps") == 0) {
+		p->ratelimit.bytes = ratelimit__parse_rate(val);
+	} else if (strcmp(param, "pps") == 0) {
+		p->ratelimit.ops = ratelimit__parse_rate(val);
+	} else if (strcmp(param, "burst") == 0) {
+		p->ratelimit.burst_ms = atoi(val);
+	} else if (strcmp(param, "qsize") == 0) {
+		p->queue_size = atoi(val);
+		if (virtio_vq__check_size(p->queue_size))
+			die("Network queue size must be a power of two between 4 and %d",
+			    VIRTIO_PACKED_QUEUE_MAX_SIZE);
 	} else
 		die("Unknown network parameter %s", param);
 
@@ -817,6 +2241,7 @@ int netdev_parser(const struct option *opt, const char *arg, int unset)
 		.script		= DEFAULT_SCRIPT,
 		.downscript	= DEFAULT_SCRIPT,
 		.mode		= NET_MODE_TAP,
+		.iothread	= -1,
 	};
 
 	str_to_mac(DEFAULT_GUEST_MAC, p.guest_mac);
@@ -834,6 +2259,16 @@ int netdev_parser(const struct option *opt, const char *arg, int unset)
 		cur = strtok(NULL, ",=");
 	};
 
+	/* The NIC is the vDPA device, that isn't virtio-net's to drive */
+	if (p.mode == NET_MODE_VDPA) {
+		if (!p.dev)
+			die("vDPA networking needs a vhost-vdpa device (dev=)");
+		if (virtio_vdpa__register(kvm, p.dev) < 0)
+			die("Failed adding vDPA device %s", p.dev);
+		kvm->cfg.no_net = 1;
+		goto done;
+	}
+
 	kvm->cfg.num_net_devices++;
 
 	kvm->cfg.net_params = realloc(kvm->cfg.net_params, kvm->cfg.num_net_devices * sizeof(*kvm->cfg.net_params));
@@ -858,17 +2293,36 @@ static int virtio_net__init_one(struct virtio_net_params *params)
 	if (ndev == NULL)
 		return -ENOMEM;
 
-	list_add_tail(&ndev->list, &ndevs);
+	list_add_tail(&ndev->list, &params->kvm->net_devs);
+	ndev->numa_node = -1;
 
 	ops = malloc(sizeof(*ops));
 	if (ops == NULL)
 		return -ENOMEM;
 
+	ndev->capture = net_capture__new();
+	if (!ndev->capture)
+		return -ENOMEM;
+
 	ndev->kvm = params->kvm;
 	ndev->params = params;
+	ndev->iothread = iothread__pick(params->kvm, params->iothread);
 
 	mutex_init(&ndev->mutex);
-	ndev->queue_pairs = max(1, min(VIRTIO_NET_NUM_QUEUES, params->mq));
+
+	/* Without an explicit mq=, give tap devices one queue pair per vCPU */
+	if (params->mq)
+		ndev->queue_pairs = params->mq;
+	else if (params->mode == NET_MODE_TAP)
+		ndev->queue_pairs = params->kvm->cfg.nrcpus;
+	else
+		ndev->queue_pairs = 1;
+	ndev->queue_pairs = max(1, min(VIRTIO_NET_NUM_QUEUES, (int)ndev->queue_pairs));
+	ndev->active_pairs = 1;
+	ndev->queue_size = params->queue_size ?: VIRTIO_NET_QUEUE_SIZE;
+
+	for (i = 0; i < VIRTIO_NET_NUM_QUEUES; i++)
+		ndev->tap_fds[i] = -1;
 
 	for (i = 0 ; i < 6 ; i++) {
 		ndev->config.mac[i]		= params->guest_mac[i];
@@ -881,11 +2335,35 @@ static int virtio_net__init_one(struct virtio_net_params *params)
 		ndev->ops = &tap_ops;
 		if (!virtio_net__tap_create(ndev))
 			die_perror("You have requested a TAP device, but creation of one has failed because");
+		ndev->numa_node = host_numa__netdev_node(ndev->tap_name);
+	} else if (ndev->mode == NET_MODE_AFXDP) {
+		if (!params->dev)
+			die("AF_XDP networking needs a network interface (dev=)");
+		if (ndev->queue_pairs > 1)
+			pr_warning("AF_XDP networking uses a single queue pair");
+		ndev->queue_pairs = 1;
+
+		ndev->ops = &afxdp_ops;
+		ndev->afxdp = net_afxdp__new(params->dev, params->queue);
+		if (!ndev->afxdp)
+			die("Unable to set up AF_XDP on %s queue %d", params->dev,
+			    params->queue);
+		ndev->numa_node = host_numa__netdev_node(params->dev);
+	} else if (ndev->mode == NET_MODE_VHOST_USER) {
+		if (!params->socket)
+			die("vhost-user networking needs a backend socket (socket=)");
+	} else if (ndev->mode == NET_MODE_NULL) {
+		virtio_net__null_init(ndev);
 	} else {
 		ndev->info.host_ip		= ntohl(inet_addr(params->host_ip));
 		ndev->info.guest_ip		= ntohl(inet_addr(params->guest_ip));
 		ndev->info.guest_netmask	= ntohl(inet_addr("255.255.255.0"));
-		ndev->info.buf_nr		= 20,
+		/* Enough frames in flight to fill the RX queue */
+		ndev->info.buf_nr		= VIRTIO_NET_QUEUE_SIZE;
+		/* uip has a single RX thread consuming its frames */
+		if (ndev->queue_pairs > 1)
+			pr_warning("User networking uses a single queue pair");
+		ndev->queue_pairs = 1;
 		ndev->ops = &uip_ops;
 		uip_static_init(&ndev->info);
 	}
@@ -910,15 +2388,220 @@ static int virtio_net__init_one(struct virtio_net_params *params)
 		return r;
 	}
 
-	if (params->vhost)
+	if (ndev->mode == NET_MODE_VHOST_USER)
+		virtio_net__vhost_user_init(params->kvm, ndev);
+	else if (params->vhost && ndev->mode == NET_MODE_AFXDP)
+		pr_warning("vhost is not available with AF_XDP networking");
+	else if (params->vhost && ndev->mode == NET_MODE_NULL)
+		pr_warning("vhost is not available with null networking");
+	else if (params->vhost)
 		virtio_net__vhost_init(params->kvm, ndev);
 
+	if (ndev->mode == NET_MODE_TAP && !ndev->vdev.use_vhost)
+		virtio_net__tap_probe_rss(ndev);
+
+	ndev->config.rss_max_key_size = NET_RSS_KEY_SIZE;
+	ndev->config.rss_max_indirection_table_length =
+		cpu_to_le16(NET_RSS_TABLE_SIZE);
+	ndev->config.supported_hash_types = cpu_to_le32(NET_RSS_HASH_TYPES);
+
 	if (compat_id == -1)
 		compat_id = virtio_compat_add_message("virtio-net", "CONFIG_VIRTIO_NET");
 
 	return 0;
 }
 
+static void virtio_net__handle_capture(struct kvm *kvm, int fd, u32 type,
+				       u32 len, u8 *msg)
+{
+	struct net_capture_msg *cmd = (struct net_capture_msg *)msg;
+	struct net_dev *ndev;
+	u32 i = 0;
+	s32 r = -ENODEV;
+
+	if (WARN_ON(type != KVM_IPC_NET_CAPTURE || len != sizeof(*cmd)))
+		return;
+
+	list_for_each_entry(ndev, &kvm->net_devs, list) {
+		if (i++ != cmd->dev)
+			continue;
+
+		/* vhost moves the frames without us seeing them */
+		if (ndev->vdev.use_vhost) {
+			r = -EOPNOTSUPP;
+		} else if (cmd->size_mb) {
+			cmd->path[PATH_MAX - 1] = '\0';
+			r = net_capture__start(ndev->capture, cmd->path,
+					       (u64)cmd->size_mb << 20);
+			ndev->capturing = !r;
+		} else {
+			ndev->capturing = false;
+			net_capture__stop(ndev->capture);
+			r = 0;
+		}
+		break;
+	}
+
+	if (write_in_full(fd, &r, sizeof(r)) < 0)
+		pr_warning("Failed sending the network capture status");
+}
+
+static void virtio_net__handle_stats(struct kvm *kvm, int fd, u32 type,
+				     u32 len, u8 *msg)
+{
+	struct uip_flow_stats *reply = NULL;
+	struct net_dev *ndev;
+	u32 nr = 0, i = 0;
+
+	if (WARN_ON(type != KVM_IPC_NET_STATS || len))
+		return;
+
+	list_for_each_entry(ndev, &kvm->net_devs, list)
+		nr++;
+
+	/* A TCP then a UDP table per NIC, left zeroed unless in user mode */
+	if (nr) {
+		reply = calloc(nr * 2, sizeof(*reply));
+		if (!reply)
+			nr = 0;
+	}
+
+	list_for_each_entry(ndev, &kvm->net_devs, list) {
+		if (!reply)
+			break;
+		if (ndev->mode == NET_MODE_USER) {
+			uip_flow_get_stats(&ndev->info.tcp_flows, &reply[i]);
+			uip_flow_get_stats(&ndev->info.udp_flows, &reply[i + 1]);
+		}
+		i += 2;
+	}
+
+	if (write_in_full(fd, &nr, sizeof(nr)) < 0 ||
+	    write_in_full(fd, reply, nr * 2 * sizeof(*reply)) < 0)
+		pr_warning("Failed sending network stats");
+
+	free(reply);
+}
+
+/* Change the limits of the n-th --network, throttled queues resume right away */
+int virtio_net__set_ratelimit(struct kvm *kvm, u32 n,
+			      struct ratelimit_params *params)
+{
+	struct net_dev_queue *queue;
+	struct net_dev *ndev;
+	u32 i, dev = 0;
+
+	list_for_each_entry(ndev, &kvm->net_devs, list) {
+		if (dev++ != n)
+			continue;
+
+		/* The frames don't go through our threads */
+		if (ndev->vdev.use_vhost || ndev->mode == NET_MODE_VHOST_USER)
+			return -EOPNOTSUPP;
+
+		/* Kept for the queues set up again after a reset */
+		ndev->params->ratelimit = *params;
+		for (i = 0; i < ndev->queue_pairs * 2; i++) {
+			queue = &ndev->queues[i];
+			if (!queue->started)
+				continue;
+
+			ratelimit__set(&queue->ratelimit, params);
+			mutex_lock(&queue->lock);
+			if (queue->throttled && queue->throttle_fd >= 0) {
+				ratelimit__arm(queue->throttle_fd, 0);
+			} else if (queue->throttled) {
+				queue->throttled = false;
+				pthread_cond_signal(&queue->cond);
+			}
+			mutex_unlock(&queue->lock);
+		}
+		return 0;
+	}
+
+	return -ENODEV;
+}
+
+static void virtio_net__collect_queues(struct kvm *kvm, struct metrics *m,
+				       size_t offset)
+{
+	struct net_dev_queue *queue;
+	struct net_dev *ndev;
+	u32 i, dev = 0;
+
+	list_for_each_entry(ndev, &kvm->net_devs, list) {
+		for (i = 0; i < ndev->queue_pairs * 2; i++) {
+			queue = &ndev->queues[i];
+			metrics__sample(m, *(u64 *)((void *)queue + offset),
+					"device=\"%u\",queue=\"%u\",dir=\"%s\"",
+					dev, i, i % 2 ? "tx" : "rx");
+		}
+		dev++;
+	}
+}
+
+static void virtio_net__collect_metrics(struct kvm *kvm, struct metrics *m)
+{
+	struct net_dev *ndev;
+	u32 dev = 0;
+
+	metrics__family(m, "net_packets_total", "counter",
+			"Frames moved between the guest and the backend");
+	virtio_net__collect_queues(kvm, m, offsetof(struct net_dev_queue, packets));
+
+	metrics__family(m, "net_bytes_total", "counter",
+			"Bytes moved between the guest and the backend");
+	virtio_net__collect_queues(kvm, m, offsetof(struct net_dev_queue, bytes));
+
+	metrics__family(m, "net_drops_total", "counter",
+			"Frames dropped or truncated on their way");
+	virtio_net__collect_queues(kvm, m, offsetof(struct net_dev_queue, drops));
+
+	metrics__family(m, "net_busy_ns_total", "counter",
+			"Time spent moving frames, over net_packets_total the cost of each");
+	virtio_net__collect_queues(kvm, m, offsetof(struct net_dev_queue, busy_ns));
+
+	metrics__family(m, "uip_sockets", "gauge",
+			"Host sockets of the user mode network, by protocol");
+	list_for_each_entry(ndev, &kvm->net_devs, list) {
+		if (ndev->mode == NET_MODE_USER) {
+			metrics__sample(m, ndev->info.tcp_flows.nr_flows,
+					"device=\"%u\",proto=\"tcp\"", dev);
+			metrics__sample(m, ndev->info.udp_flows.nr_flows,
+					"device=\"%u\",proto=\"udp\"", dev);
+		}
+		dev++;
+	}
+}
+
+static struct metrics_collector virtio_net__metrics = {
+	.collect	= virtio_net__collect_metrics,
+};
+
+/* Even queues are RX, odd ones TX */
+void virtio_net__get_totals(struct kvm *kvm, struct virtio_net_totals *totals)
+{
+	struct net_dev_queue *queue;
+	struct net_dev *ndev;
+	u32 i;
+
+	*totals = (struct virtio_net_totals) {};
+
+	list_for_each_entry(ndev, &kvm->net_devs, list) {
+		for (i = 0; i < ndev->queue_pairs * 2; i++) {
+			queue = &ndev->queues[i];
+			if (i % 2) {
+				totals->tx_packets += queue->packets;
+				totals->tx_bytes += queue->bytes;
+			} else {
+				totals->rx_packets += queue->packets;
+				totals->rx_bytes += queue->bytes;
+			}
+			totals->drops += queue->drops;
+		}
+	}
+}
+
 int virtio_net__init(struct kvm *kvm)
 {
 	int i, r;
@@ -939,6 +2622,7 @@ int virtio_net__init(struct kvm *kvm)
 			.kvm		= kvm,
 			.script		= kvm->cfg.script,
 			.mode		= NET_MODE_USER,
+			.iothread	= -1,
 		};
 		str_to_mac(kvm->cfg.guest_mac, net_params.guest_mac);
 		str_to_mac(kvm->cfg.host_mac, net_params.host_mac);
@@ -948,7 +2632,15 @@ int virtio_net__init(struct kvm *kvm)
 			goto cleanup;
 	}
 
-	return 0;
+	metrics__register(&virtio_net__metrics);
+
+	r = kvm_ipc__register_handler(KVM_IPC_NET_STATS,
+				      virtio_net__handle_stats);
+	if (r < 0)
+		goto cleanup;
+
+	return kvm_ipc__register_handler(KVM_IPC_NET_CAPTURE,
+					 virtio_net__handle_capture);
 
 cleanup:
 	virtio_net__exit(kvm);
@@ -961,8 +2653,9 @@ int virtio_net__exit(struct kvm *kvm)
 	struct virtio_net_params *params;
 	struct net_dev *ndev;
 	struct list_head *ptr, *n;
+	size_t i;
 
-	list_for_each_safe(ptr, n, &ndevs) {
+	list_for_each_safe(ptr, n, &kvm->net_devs) {
 		ndev = list_entry(ptr, struct net_dev, list);
 		params = ndev->params;
 		/* Cleanup any tap device which attached to bridge */
@@ -973,6 +2666,14 @@ int virtio_net__exit(struct kvm *kvm)
 
 		list_del(&ndev->list);
 		virtio_exit(kvm, &ndev->vdev);
+		for (i = 0; i < ARRAY_SIZE(ndev->queues); i++)
+			net_uring__free(ndev->queues[i].uring);
+		net_afxdp__free(ndev->afxdp);
+		vhost_user__free(ndev->vhost_user);
+		net_capture__free(ndev->capture);
+		net_rss__free(ndev->rss_configs);
+		if (ndev->coal_started)
+			epoll__exit(&ndev->coal_epoll);
 		free(ndev);
 	}
 
@@ -59,7 +59,7 @@ static bool virtio_pci__data_in(struct kvm_cpu *vcpu, struct virtio_device *vdev
 		ioport__write8(data, vpci->status);
 		break;
 	case VIRTIO_PCI_ISR:
-		ioport__write8(data, vpci->isr);
+		ioport__write8(data, virtio_pci__read_isr(kvm, vdev));
 		kvm__irq_line(kvm, vpci->legacy_irq_line, VIRTIO_IRQ_LOW);
 		vpci->isr = 0;
 		break;
@@ -166,12 +166,14 @@ static bool virtio_pci__data_out(struct kvm_cpu *vcpu, struct virtio_device *vde
 				val, vq_count);
 			return false;
 		}
+		virtio__account_kick(vdev, val);
 		vdev->ops->notify_vq(kvm, vpci->dev, val);
 		break;
 	case VIRTIO_PCI_STATUS:
 		vpci->status = ioport__read8(data);
 		if (!vpci->status) /* Sample endianness on reset */
 			vdev->endian = kvm_cpu__get_endianness(vcpu);
+		virtio_pci__status_written(vpci);
 		virtio_notify_status(kvm, vdev, vpci->dev, vpci->status);
 		break;
 	default:
@@ -10,15 +10,14 @@
 #define VPCI_CFG_COMMON_START	0
 #define VPCI_CFG_COMMON_END	(VPCI_CFG_COMMON_SIZE - 1)
 /*
- * Use a naturally aligned 4-byte doorbell, in case we ever want to
- * implement VIRTIO_F_NOTIFICATION_DATA
+ * Where the doorbell shared by all queues used to be. Keep the hole so that
+ * the layout of a device doesn't change under a snapshot.
  */
-#define VPCI_CFG_NOTIFY_SIZE	4
-#define VPCI_CFG_NOTIFY_START	(VPCI_CFG_COMMON_END + 1)
-#define VPCI_CFG_NOTIFY_END	(VPCI_CFG_COMMON_END + VPCI_CFG_NOTIFY_SIZE)
+#define VPCI_CFG_UNUSED_SIZE	4
+#define VPCI_CFG_UNUSED_END	(VPCI_CFG_COMMON_END + VPCI_CFG_UNUSED_SIZE)
 #define VPCI_CFG_ISR_SIZE	4
-#define VPCI_CFG_ISR_START	(VPCI_CFG_NOTIFY_END + 1)
-#define VPCI_CFG_ISR_END	(VPCI_CFG_NOTIFY_END + VPCI_CFG_ISR_SIZE)
+#define VPCI_CFG_ISR_START	(VPCI_CFG_UNUSED_END + 1)
+#define VPCI_CFG_ISR_END	(VPCI_CFG_UNUSED_END + VPCI_CFG_ISR_SIZE)
 /*
  * We're at 64 bytes. Use the remaining 192 bytes in PCI_IO_SIZE for the
  * device-specific config space. It's sufficient for the devices we
@@ -28,6 +27,16 @@
 #define VPCI_CFG_DEV_START	(VPCI_CFG_ISR_END + 1)
 #define VPCI_CFG_DEV_END	((PCI_IO_SIZE) - 1)
 #define VPCI_CFG_DEV_SIZE	(VPCI_CFG_DEV_END - VPCI_CFG_DEV_START + 1)
+/*
+ * Past the mirror of the I/O BAR, give each queue its own naturally aligned
+ * 4-byte doorbell (in case we ever want to implement
+ * VIRTIO_F_NOTIFICATION_DATA), so that KVM doesn't have to compare the value
+ * written against the ioeventfds of all queues.
+ */
+#define VPCI_CFG_NOTIFY_MULT	4
+#define VPCI_CFG_NOTIFY_SIZE	(VIRTIO_PCI_MAX_VQ * VPCI_CFG_NOTIFY_MULT)
+#define VPCI_CFG_NOTIFY_START	PCI_IO_SIZE
+#define VPCI_CFG_NOTIFY_END	(VPCI_CFG_NOTIFY_START + VPCI_CFG_NOTIFY_SIZE - 1)
 
 #define vpci_selected_vq(vpci) \
 	vdev->ops->get_vq((vpci)->kvm, (vpci)->dev, (vpci)->queue_selector)
@@ -66,6 +75,7 @@ static bool virtio_pci__common_write(struct virtio_device *vdev,
 		break;
 	case VIRTIO_PCI_COMMON_STATUS:
 		vpci->status = ioport__read8(data);
+		virtio_pci__status_written(vpci);
 		virtio_notify_status(vpci->kvm, vdev, vpci->dev, vpci->status);
 		break;
 	case VIRTIO_PCI_COMMON_Q_SELECT:
@@ -125,9 +135,13 @@ static bool virtio_pci__common_write(struct virtio_device *vdev,
 static bool virtio_pci__notify_write(struct virtio_device *vdev,
 				     unsigned long offset, void *data, int size)
 {
-	u16 vq = ioport__read16(data);
+	u32 vq = (offset - VPCI_CFG_NOTIFY_START) / VPCI_CFG_NOTIFY_MULT;
 	struct virtio_pci *vpci = vdev->virtio;
 
+	if (vq >= (u32)vdev->ops->get_vq_count(vpci->kvm, vpci->dev))
+		return false;
+
+	virtio__account_kick(vdev, vq);
 	vdev->ops->notify_vq(vpci->kvm, vpci->dev, vq);
 
 	return true;
@@ -148,7 +162,7 @@ static bool virtio_pci__common_read(struct virtio_device *vdev,
 {
 	u32 val;
 	struct virtio_pci *vpci = vdev->virtio;
-	u64 features = 1ULL << VIRTIO_F_VERSION_1;
+	u64 features = virtio_modern_features(vdev);
 
 	switch (offset - VPCI_CFG_COMMON_START) {
 	case VIRTIO_PCI_COMMON_DFSELECT:
@@ -244,7 +258,7 @@ static bool virtio_pci__isr_read(struct virtio_device *vdev,
 	if (WARN_ON(offset - VPCI_CFG_ISR_START != 0))
 		return false;
 
-	ioport__write8(data, vpci->isr);
+	ioport__write8(data, virtio_pci__read_isr(vpci->kvm, vdev));
 	kvm__irq_line(vpci->kvm, vpci->legacy_irq_line, VIRTIO_IRQ_LOW);
 	vpci->isr = 0;
 
@@ -319,6 +333,7 @@ int virtio_pci_modern_init(struct virtio_device *vdev)
 	hdr->subsys_id = cpu_to_le16(PCI_SUBSYS_ID_VIRTIO_BASE + subsys_id);
 
 	vpci->doorbell_offset = VPCI_CFG_NOTIFY_START;
+	vpci->doorbell_multiplier = VPCI_CFG_NOTIFY_MULT;
 	vdev->endian = VIRTIO_ENDIAN_LE;
 
 	hdr->msix.next = PCI_CAP_OFF(hdr, virtio);
@@ -342,12 +357,11 @@ int virtio_pci_modern_init(struct virtio_device *vdev)
 		.cap.bar		= 1,
 		.cap.offset		= cpu_to_le32(VPCI_CFG_NOTIFY_START),
 		.cap.length		= cpu_to_le32(VPCI_CFG_NOTIFY_SIZE),
-		/*
-		 * Notify multiplier is 0, meaning that notifications are all on
-		 * the same register
-		 */
+		/* Queue n rings at offset + n * multiplier, see Q_NOFF */
+		.notify_off_multiplier	= cpu_to_le32(VPCI_CFG_NOTIFY_MULT),
 	};
 	BUILD_BUG_ON(VPCI_CFG_NOTIFY_START & 0x3);
+	BUILD_BUG_ON(VPCI_CFG_NOTIFY_END >= VIRTIO_PCI_MMIO_SIZE);
 
 	hdr->virtio.isr = (struct virtio_pci_cap) {
 		.cap_vndr		= PCI_CAP_ID_VNDR,
@@ -383,5 +397,20 @@ int virtio_pci_modern_init(struct virtio_device *vdev)
 		.cap.cfg_type		= VIRTIO_PCI_CAP_PCI_CFG,
 	};
 
+	if (!vpci->shm_host)
+		return 0;
+
+	hdr->virtio.pci.cap.cap_next = PCI_CAP_OFF(hdr, virtio.shm);
+	hdr->virtio.shm = (struct virtio_pci_cap64) {
+		.cap.cap_vndr		= PCI_CAP_ID_VNDR,
+		.cap.cap_next		= 0,
+		.cap.cap_len		= sizeof(hdr->virtio.shm),
+		.cap.cfg_type		= VIRTIO_PCI_CAP_SHARED_MEMORY_CFG,
+		.cap.bar		= 3,
+		.cap.id			= vpci->shm_id,
+		.cap.length		= cpu_to_le32(vpci->shm_size),
+		.length_hi		= cpu_to_le32(vpci->shm_size >> 32),
+	};
+
 	return 0;
 }
@@ -17,16 +17,29 @@
 /* The bit of the ISR which indicates a queue change. */
 #define VIRTIO_PCI_ISR_QUEUE	0x1
 
+/*
+ * The device doesn't notify the driver before DRIVER_OK, so until then the
+ * routes of all of its vectors are committed together, when it is set.
+ */
+static bool virtio_pci__defer_routes(struct virtio_pci *vpci)
+{
+	return !(vpci->status & VIRTIO_CONFIG_S_DRIVER_OK);
+}
+
 int virtio_pci__add_msix_route(struct virtio_pci *vpci, u32 vec)
 {
 	int gsi;
 	struct msi_msg *msg;
+	u32 devid = pci__devfn(vpci->dev_hdr.dev_num);
 
 	if (vec == VIRTIO_MSI_NO_VECTOR)
 		return -EINVAL;
 
 	msg = &vpci->msix_table[vec].msg;
-	gsi = irq__add_msix_route(vpci->kvm, msg, vpci->dev_hdr.dev_num << 3);
+	if (virtio_pci__defer_routes(vpci))
+		gsi = irq__add_msix_route_deferred(vpci->kvm, msg, devid);
+	else
+		gsi = irq__add_msix_route(vpci->kvm, msg, devid);
 	/*
 	 * We don't need IRQ routing if we can use
 	 * MSI injection via the KVM_SIGNAL_MSI ioctl.
@@ -40,11 +53,19 @@ int virtio_pci__add_msix_route(struct virtio_pci *vpci, u32 vec)
 	return gsi;
 }
 
+/* Nothing should come through the route anymore, KVM can learn it later */
 static void virtio_pci__del_msix_route(struct virtio_pci *vpci, u32 gsi)
 {
 	struct msi_msg msg = { 0 };
 
-	irq__update_msix_route(vpci->kvm, gsi, &msg);
+	irq__update_msix_route_deferred(vpci->kvm, gsi, &msg);
+}
+
+/* Called by the transports when the driver writes the device status */
+void virtio_pci__status_written(struct virtio_pci *vpci)
+{
+	if (!virtio_pci__defer_routes(vpci))
+		irq__flush_routes(vpci->kvm);
 }
 
 static void virtio_pci__ioevent_callback(struct kvm *kvm, void *param)
@@ -52,9 +73,15 @@ static void virtio_pci__ioevent_callback(struct kvm *kvm, void *param)
 	struct virtio_pci_ioevent_param *ioeventfd = param;
 	struct virtio_pci *vpci = ioeventfd->vdev->virtio;
 
+	virtio__account_kick(ioeventfd->vdev, ioeventfd->vq);
 	ioeventfd->vdev->ops->notify_vq(kvm, vpci->dev, ioeventfd->vq);
 }
 
+static off_t virtio_pci__doorbell(struct virtio_pci *vpci, u32 vq)
+{
+	return vpci->doorbell_offset + vq * vpci->doorbell_multiplier;
+}
+
 int virtio_pci__init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev,
 			       u32 vq)
 {
@@ -62,9 +89,9 @@ int virtio_pci__init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev,
 	struct virtio_pci *vpci = vdev->virtio;
 	u32 mmio_addr = virtio_pci__mmio_addr(vpci);
 	u16 port_addr = virtio_pci__port_addr(vpci);
-	off_t offset = vpci->doorbell_offset;
-	int r, flags = 0;
-	int pio_fd, mmio_fd;
+	off_t offset = virtio_pci__doorbell(vpci, vq);
+	int r, pio_flags = 0, mmio_flags = 0;
+	int pio_fd = -1, mmio_fd;
 
 	vpci->ioeventfds[vq] = (struct virtio_pci_ioevent_param) {
 		.vdev		= vdev,
@@ -79,25 +106,39 @@ int virtio_pci__init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev,
 	};
 
 	/*
-	 * Vhost will poll the eventfd in host kernel side, otherwise we
-	 * need to poll in userspace.
+	 * Unless vhost or the device itself polls the eventfd that the driver
+	 * kicks, we need to poll in userspace. The MMIO mirror of a legacy
+	 * device is hardly ever used, and is always relayed.
 	 */
-	if (!vdev->use_vhost)
-		flags |= IOEVENTFD_FLAG_USER_POLL;
+	if (virtio__relay_kicks(vdev, vq))
+		pio_flags = mmio_flags = IOEVENTFD_FLAG_USER_POLL;
+	else if (!vdev->use_vhost && vdev->legacy)
+		mmio_flags = IOEVENTFD_FLAG_USER_POLL;
+
+	/*
+	 * A modern device has a doorbell per queue in the memory BAR, that
+	 * KVM finds by address alone. Legacy queues share a register of the
+	 * I/O BAR and are told apart by the value written.
+	 */
+	if (vpci->doorbell_multiplier)
+		mmio_flags |= IOEVENTFD_FLAG_NO_DATAMATCH;
 
 	/* ioport */
-	ioevent.io_addr	= port_addr + offset;
-	ioevent.io_len	= sizeof(u16);
-	ioevent.fd	= pio_fd = eventfd(0, 0);
-	r = ioeventfd__add_event(&ioevent, flags | IOEVENTFD_FLAG_PIO);
-	if (r)
-		return r;
+	if (vdev->legacy) {
+		ioevent.io_addr	= port_addr + offset;
+		ioevent.io_len	= sizeof(u16);
+		ioevent.fd	= pio_fd = eventfd(0, 0);
+		r = ioeventfd__add_event(&ioevent,
+					 pio_flags | IOEVENTFD_FLAG_PIO);
+		if (r)
+			return r;
+	}
 
 	/* mmio */
 	ioevent.io_addr	= mmio_addr + offset;
 	ioevent.io_len	= sizeof(u16);
 	ioevent.fd	= mmio_fd = eventfd(0, 0);
-	r = ioeventfd__add_event(&ioevent, flags);
+	r = ioeventfd__add_event(&ioevent, mmio_flags);
 	if (r)
 		goto free_ioport_evt;
 
@@ -107,7 +148,8 @@ int virtio_pci__init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev,
 	return 0;
 
 free_ioport_evt:
-	ioeventfd__del_event(port_addr + offset, vq);
+	if (vdev->legacy)
+		ioeventfd__del_event(port_addr + offset, vq);
 	return r;
 }
 
@@ -117,11 +159,14 @@ int virtio_pci_init_vq(struct kvm *kvm, struct virtio_device *vdev, int vq)
 	struct virtio_pci *vpci = vdev->virtio;
 
 	ret = virtio_pci__init_ioeventfd(kvm, vdev, vq);
-	if (ret) {
-		pr_err("couldn't add ioeventfd for vq %d: %d", vq, ret);
-		return ret;
-	}
-	return vdev->ops->init_vq(kvm, vpci->dev, vq);
+	if (ret)
+		virtio_ioeventfd_failed(kvm, vdev, vq, ret);
+
+	ret = vdev->ops->init_vq(kvm, vpci->dev, vq);
+	if (!ret)
+		virtio_vq__attach_stats(kvm, vdev, vq);
+
+	return ret;
 }
 
 void virtio_pci_exit_vq(struct kvm *kvm, struct virtio_device *vdev, int vq)
@@ -129,38 +174,140 @@ void virtio_pci_exit_vq(struct kvm *kvm, struct virtio_device *vdev, int vq)
 	struct virtio_pci *vpci = vdev->virtio;
 	u32 mmio_addr = virtio_pci__mmio_addr(vpci);
 	u16 port_addr = virtio_pci__port_addr(vpci);
-	off_t offset = vpci->doorbell_offset;
+	off_t offset = virtio_pci__doorbell(vpci, vq);
 
 	virtio_pci__del_msix_route(vpci, vpci->gsis[vq]);
 	vpci->gsis[vq] = 0;
 	vpci->vq_vector[vq] = VIRTIO_MSI_NO_VECTOR;
 	ioeventfd__del_event(mmio_addr + offset, vq);
-	ioeventfd__del_event(port_addr + offset, vq);
+	if (vdev->legacy)
+		ioeventfd__del_event(port_addr + offset, vq);
 	virtio_exit_vq(kvm, vdev, vpci->dev, vq);
 }
 
+static void virtio_pci__update_route(struct virtio_pci *vpci, u32 gsi,
+				     struct msi_msg *msg, bool defer)
+{
+	if (defer)
+		irq__update_msix_route_deferred(vpci->kvm, gsi, msg);
+	else
+		irq__update_msix_route(vpci->kvm, gsi, msg);
+}
+
+/*
+ * Several queues can share a vector, each through its own GSI. The routes are
+ * cached per GSI by the IRQ code, which only tells KVM about the ones whose
+ * message really changed.
+ */
 static void update_msix_map(struct virtio_pci *vpci,
-			    struct msix_table *msix_entry, u32 vecnum)
+			    struct msix_table *msix_entry, u32 vecnum,
+			    bool defer)
 {
-	u32 gsi, i;
+	struct msi_msg *msg = &msix_entry[vecnum].msg;
+	u32 i;
 
-	/* Find the GSI number used for that vector */
-	if (vecnum == vpci->config_vector) {
-		gsi = vpci->config_gsi;
-	} else {
-		for (i = 0; i < VIRTIO_PCI_MAX_VQ; i++)
-			if (vpci->vq_vector[i] == vecnum)
-				break;
-		if (i == VIRTIO_PCI_MAX_VQ)
-			return;
-		gsi = vpci->gsis[i];
+	defer |= virtio_pci__defer_routes(vpci);
+
+	if (vecnum == vpci->config_vector && vpci->config_gsi)
+		virtio_pci__update_route(vpci, vpci->config_gsi, msg, defer);
+
+	for (i = 0; i < VIRTIO_PCI_MAX_VQ; i++) {
+		if (vpci->vq_vector[i] == vecnum && vpci->gsis[i])
+			virtio_pci__update_route(vpci, vpci->gsis[i], msg, defer);
 	}
+}
+
+static bool virtio_pci__vector_masked(struct virtio_pci *vpci, u32 vec)
+{
+	u16 ctrl = __atomic_load_n(&vpci->pci_hdr.msix.ctrl, __ATOMIC_RELAXED);
+	u32 entry = __atomic_load_n(&vpci->msix_table[vec].ctrl, __ATOMIC_RELAXED);
+
+	return ctrl & cpu_to_le16(PCI_MSIX_FLAGS_MASKALL) ||
+	       entry & cpu_to_le32(PCI_MSIX_ENTRY_CTRL_MASKBIT);
+}
 
-	if (gsi == 0)
+static void virtio_pci__signal_msi(struct kvm *kvm, struct virtio_pci *vpci,
+				   int vec)
+{
+	struct kvm_msi msi = {
+		.address_lo = vpci->msix_table[vec].msg.address_lo,
+		.address_hi = vpci->msix_table[vec].msg.address_hi,
+		.data = vpci->msix_table[vec].msg.data,
+	};
+
+	if (kvm->msix_needs_devid) {
+		msi.flags = KVM_MSI_VALID_DEVID;
+		msi.devid = pci__devfn(vpci->dev_hdr.dev_num);
+	}
+
+	irq__signal_msi(kvm, &msi);
+}
+
+static void virtio_pci__deliver_msix(struct kvm *kvm, struct virtio_pci *vpci,
+				     u32 vec, u32 gsi)
+{
+	if (vpci->signal_msi) {
+		virtio_pci__signal_msi(kvm, vpci, vec);
+	} else if (gsi) {
+		irq__flush_routes(kvm);
+		kvm__irq_trigger(kvm, gsi);
+	}
+}
+
+/*
+ * A masked vector only sets its pending bit, and whoever clears the bit
+ * delivers the interrupt: either the vCPU that unmasks the vector, or this
+ * signaller when it races with the unmasking. Returns true if the interrupt
+ * was left pending.
+ */
+static bool virtio_pci__msix_hold(struct virtio_pci *vpci, u32 vec)
+{
+	u64 bit = 1ULL << vec;
+
+	if (!virtio_pci__vector_masked(vpci, vec))
+		return false;
+
+	__atomic_fetch_or(&vpci->msix_pba, bit, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (virtio_pci__vector_masked(vpci, vec))
+		return true;
+
+	return !(__atomic_fetch_and(&vpci->msix_pba, ~bit, __ATOMIC_SEQ_CST) & bit);
+}
+
+/* After an unmask, send what was left pending while the vector was masked */
+static void virtio_pci__msix_release(struct kvm *kvm, struct virtio_pci *vpci,
+				     u64 vecs)
+{
+	u32 vec, i, gsi;
+	u64 bit;
+
+	if (!virtio_pci__msix_enabled(vpci))
 		return;
 
-	msix_entry = &msix_entry[vecnum];
-	irq__update_msix_route(vpci->kvm, gsi, &msix_entry->msg);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	vecs &= __atomic_load_n(&vpci->msix_pba, __ATOMIC_SEQ_CST);
+
+	while (vecs) {
+		vec = __builtin_ctzll(vecs);
+		bit = 1ULL << vec;
+		vecs &= ~bit;
+
+		if (virtio_pci__vector_masked(vpci, vec))
+			continue;
+		if (!(__atomic_fetch_and(&vpci->msix_pba, ~bit, __ATOMIC_SEQ_CST) & bit))
+			continue;
+
+		gsi = 0;
+		if (vec == vpci->config_vector) {
+			gsi = vpci->config_gsi;
+		} else {
+			for (i = 0; i < VIRTIO_PCI_MAX_VQ && !gsi; i++)
+				if (vpci->vq_vector[i] == vec)
+					gsi = vpci->gsis[i];
+		}
+		virtio_pci__deliver_msix(kvm, vpci, vec, gsi);
+	}
 }
 
 static void virtio_pci__msix_mmio_callback(struct kvm_cpu *vcpu,
@@ -202,26 +349,53 @@ static void virtio_pci__msix_mmio_callback(struct kvm_cpu *vcpu,
 
 	memcpy((void *)&table[vecnum] + offset, data, len);
 
-	/* Did we just update the address or payload? */
+	/*
+	 * Did we just update the address or payload? Guests write the address
+	 * of an entry before its data, which commits the new route. Until then
+	 * or until the entry is unmasked, the vector keeps its old route.
+	 */
 	if (offset < offsetof(struct msix_table, ctrl))
-		update_msix_map(vpci, table, vecnum);
+		update_msix_map(vpci, table, vecnum,
+				offset + len <= offsetof(struct msix_table, msg.data));
+
+	/*
+	 * Masking and unmasking never reroute the vector: a masked vector just
+	 * leaves its interrupts pending. Unmasking commits the route changes
+	 * that were held back and delivers what is pending.
+	 */
+	if (offset + len <= offsetof(struct msix_table, ctrl) ||
+	    virtio_pci__vector_masked(vpci, vecnum))
+		return;
+
+	if (!virtio_pci__defer_routes(vpci))
+		irq__flush_routes(vpci->kvm);
+	virtio_pci__msix_release(vpci->kvm, vpci, 1ULL << vecnum);
 }
 
-static void virtio_pci__signal_msi(struct kvm *kvm, struct virtio_pci *vpci,
-				   int vec)
+/* Clearing the function mask releases all the vectors left pending */
+static void virtio_pci__cfg_write(struct kvm *kvm,
+				  struct pci_device_header *pci_hdr,
+				  u16 offset, void *data, int sz)
 {
-	struct kvm_msi msi = {
-		.address_lo = vpci->msix_table[vec].msg.address_lo,
-		.address_hi = vpci->msix_table[vec].msg.address_hi,
-		.data = vpci->msix_table[vec].msg.data,
-	};
+	struct virtio_pci *vpci = container_of(pci_hdr, struct virtio_pci,
+					       pci_hdr);
+	u16 ctrl_offset = PCI_CAP_OFF(pci_hdr, msix) +
+			  offsetof(struct msix_cap, ctrl);
+	u16 ctrl;
 
-	if (kvm->msix_needs_devid) {
-		msi.flags = KVM_MSI_VALID_DEVID;
-		msi.devid = vpci->dev_hdr.dev_num << 3;
-	}
+	if (offset > ctrl_offset || offset + sz < ctrl_offset + (int)sizeof(ctrl))
+		return;
 
-	irq__signal_msi(kvm, &msi);
+	memcpy(&ctrl, data + ctrl_offset - offset, sizeof(ctrl));
+	__atomic_store_n(&pci_hdr->msix.ctrl, ctrl, __ATOMIC_SEQ_CST);
+
+	if (!(ctrl & cpu_to_le16(PCI_MSIX_FLAGS_ENABLE)) ||
+	    ctrl & cpu_to_le16(PCI_MSIX_FLAGS_MASKALL))
+		return;
+
+	if (!virtio_pci__defer_routes(vpci))
+		irq__flush_routes(kvm);
+	virtio_pci__msix_release(kvm, vpci, ~0ULL);
 }
 
 int virtio_pci__signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
@@ -229,18 +403,11 @@ int virtio_pci__signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
 	struct virtio_pci *vpci = vdev->virtio;
 	int tbl = vpci->vq_vector[vq];
 
-	if (virtio_pci__msix_enabled(vpci) && tbl != VIRTIO_MSI_NO_VECTOR) {
-		if (vpci->pci_hdr.msix.ctrl & cpu_to_le16(PCI_MSIX_FLAGS_MASKALL) ||
-		    vpci->msix_table[tbl].ctrl & cpu_to_le16(PCI_MSIX_ENTRY_CTRL_MASKBIT)) {
-
-			vpci->msix_pba |= 1 << tbl;
-			return 0;
-		}
+	virtio__account_irq(vdev, vq);
 
-		if (vpci->signal_msi)
-			virtio_pci__signal_msi(kvm, vpci, vpci->vq_vector[vq]);
-		else
-			kvm__irq_trigger(kvm, vpci->gsis[vq]);
+	if (virtio_pci__msix_enabled(vpci) && tbl != VIRTIO_MSI_NO_VECTOR) {
+		if (!virtio_pci__msix_hold(vpci, tbl))
+			virtio_pci__deliver_msix(kvm, vpci, tbl, vpci->gsis[vq]);
 	} else {
 		vpci->isr |= VIRTIO_PCI_ISR_QUEUE;
 		kvm__irq_line(kvm, vpci->legacy_irq_line, VIRTIO_IRQ_HIGH);
@@ -254,17 +421,8 @@ int virtio_pci__signal_config(struct kvm *kvm, struct virtio_device *vdev)
 	int tbl = vpci->config_vector;
 
 	if (virtio_pci__msix_enabled(vpci) && tbl != VIRTIO_MSI_NO_VECTOR) {
-		if (vpci->pci_hdr.msix.ctrl & cpu_to_le16(PCI_MSIX_FLAGS_MASKALL) ||
-		    vpci->msix_table[tbl].ctrl & cpu_to_le16(PCI_MSIX_ENTRY_CTRL_MASKBIT)) {
-
-			vpci->msix_pba |= 1 << tbl;
-			return 0;
-		}
-
-		if (vpci->signal_msi)
-			virtio_pci__signal_msi(kvm, vpci, tbl);
-		else
-			kvm__irq_trigger(kvm, vpci->config_gsi);
+		if (!virtio_pci__msix_hold(vpci, tbl))
+			virtio_pci__deliver_msix(kvm, vpci, tbl, vpci->config_gsi);
 	} else {
 		vpci->isr |= VIRTIO_PCI_ISR_CONFIG;
 		kvm__irq_line(kvm, vpci->legacy_irq_line, VIRTIO_IRQ_HIGH);
@@ -273,11 +431,33 @@ int virtio_pci__signal_config(struct kvm *kvm, struct virtio_device *vdev)
 	return 0;
 }
 
+/* Along with the interrupts that vhost raised through an irqfd */
+u8 virtio_pci__read_isr(struct kvm *kvm, struct virtio_device *vdev)
+{
+	struct virtio_pci *vpci = vdev->virtio;
+
+	if (!__atomic_load_n(&vdev->line_irqfds, __ATOMIC_RELAXED))
+		return vpci->isr;
+
+	virtio_vhost_line_ack(kvm, vdev, vpci->dev);
+	return vpci->isr | VIRTIO_PCI_ISR_QUEUE;
+}
+
+int virtio_pci__get_irq_line(struct kvm *kvm, struct virtio_device *vdev,
+			     bool *level)
+{
+	struct virtio_pci *vpci = vdev->virtio;
+
+	*level = true;
+	return irq__line_gsi(vpci->legacy_irq_line);
+}
+
 static int virtio_pci__bar_activate(struct kvm *kvm,
 				    struct pci_device_header *pci_hdr,
 				    int bar_num, void *data)
 {
 	struct virtio_device *vdev = data;
+	struct virtio_pci *vpci = vdev->virtio;
 	mmio_handler_fn mmio_fn;
 	u32 bar_addr, bar_size;
 	int r = -EINVAL;
@@ -287,7 +467,7 @@ static int virtio_pci__bar_activate(struct kvm *kvm,
 	else
 		mmio_fn = &virtio_pci_modern__io_mmio_callback;
 
-	assert(bar_num <= 2);
+	assert(bar_num <= 3);
 
 	bar_addr = pci__bar_address(pci_hdr, bar_num);
 	bar_size = pci__bar_size(pci_hdr, bar_num);
@@ -304,6 +484,10 @@ static int virtio_pci__bar_activate(struct kvm *kvm,
 		r =  kvm__register_mmio(kvm, bar_addr, bar_size, false,
 					virtio_pci__msix_mmio_callback, vdev);
 		break;
+	case 3:
+		r = kvm__register_dev_mem(kvm, bar_addr, bar_size,
+					  vpci->shm_host);
+		break;
 	}
 
 	return r;
@@ -313,11 +497,13 @@ static int virtio_pci__bar_deactivate(struct kvm *kvm,
 				      struct pci_device_header *pci_hdr,
 				      int bar_num, void *data)
 {
+	struct virtio_device *vdev = data;
+	struct virtio_pci *vpci = vdev->virtio;
 	u32 bar_addr;
 	bool success;
 	int r = -EINVAL;
 
-	assert(bar_num <= 2);
+	assert(bar_num <= 3);
 
 	bar_addr = pci__bar_address(pci_hdr, bar_num);
 
@@ -331,11 +517,195 @@ static int virtio_pci__bar_deactivate(struct kvm *kvm,
 		/* kvm__deregister_mmio fails when the region is not found. */
 		r = (success ? 0 : -ENOENT);
 		break;
+	case 3:
+		r = kvm__destroy_mem(kvm, bar_addr, pci__bar_size(pci_hdr, 3),
+				     vpci->shm_host);
+		break;
+	}
+
+	return r;
+}
+
+/*
+ * The transport state of a device in a snapshot. It is followed by a struct
+ * virtio_vq_state for each queue and by the device config space.
+ */
+struct virtio_pci_state {
+	u8			config[PCI_DEV_CFG_SIZE];
+	u64			features;
+	u32			nr_vqs;
+	u32			config_size;
+	u32			device_features_sel;
+	u32			driver_features_sel;
+	u16			config_vector;
+	u16			queue_selector;
+	u16			vq_vector[VIRTIO_PCI_MAX_VQ];
+	u8			status;
+	u8			isr;
+	u64			msix_pba;
+	struct msix_table	msix_table[VIRTIO_NR_MSIX];
+};
+
+static int virtio_pci__save(struct kvm *kvm, struct snapshot *snap, void *data)
+{
+	struct virtio_device *vdev = data;
+	struct virtio_pci *vpci = vdev->virtio;
+	struct virtio_pci_state *state;
+	struct virtio_vq_state vq_state;
+	void *dev = vpci->dev;
+	u32 i;
+	int r;
+
+	if (vdev->use_vhost) {
+		pr_warning("%s: the queues served by vhost can't be saved",
+			   vpci->snapshot.name);
+		return -EOPNOTSUPP;
 	}
 
+	if (!virtio__wait_idle(kvm, vdev, dev))
+		pr_warning("%s: requests in flight won't complete after restoring",
+			   vpci->snapshot.name);
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return -ENOMEM;
+
+	memcpy(state->config, vpci->pci_hdr.__pad, sizeof(state->config));
+	state->features		= vdev->features;
+	state->nr_vqs		= vdev->ops->get_vq_count(kvm, dev);
+	state->config_size	= vdev->ops->get_config_size(kvm, dev);
+	state->device_features_sel = vpci->device_features_sel;
+	state->driver_features_sel = vpci->driver_features_sel;
+	state->config_vector	= vpci->config_vector;
+	state->queue_selector	= vpci->queue_selector;
+	state->status		= vpci->status;
+	state->isr		= vpci->isr;
+	state->msix_pba		= vpci->msix_pba;
+	memcpy(state->vq_vector, vpci->vq_vector, sizeof(state->vq_vector));
+	memcpy(state->msix_table, vpci->msix_table, sizeof(state->msix_table));
+
+	r = snapshot__write(snap, state, sizeof(*state));
+	for (i = 0; !r && i < state->nr_vqs; i++) {
+		virtio_vq__save_state(vdev->ops->get_vq(kvm, dev, i), &vq_state);
+		r = snapshot__write(snap, &vq_state, sizeof(vq_state));
+	}
+	if (!r)
+		r = snapshot__write(snap, vdev->ops->get_config(kvm, dev),
+				    state->config_size);
+
+	free(state);
+
 	return r;
 }
 
+/* Go through the steps of the driver that set the device up */
+static int virtio_pci__restore(struct kvm *kvm, struct snapshot *snap,
+			       void *data)
+{
+	struct virtio_vq_state vq_states[VIRTIO_PCI_MAX_VQ];
+	struct virtio_device *vdev = data;
+	struct virtio_pci *vpci = vdev->virtio;
+	struct virtio_pci_state *state;
+	void *dev = vpci->dev;
+	struct virt_queue *vq;
+	int r, gsi;
+	u32 i;
+
+	if (vdev->use_vhost)
+		return -EOPNOTSUPP;
+
+	state = malloc(sizeof(*state));
+	if (!state)
+		return -ENOMEM;
+
+	r = snapshot__read(snap, state, sizeof(*state));
+	if (r < 0)
+		goto out;
+
+	r = -EINVAL;
+	if (state->nr_vqs != vdev->ops->get_vq_count(kvm, dev) ||
+	    state->nr_vqs > VIRTIO_PCI_MAX_VQ ||
+	    state->config_size != vdev->ops->get_config_size(kvm, dev))
+		goto out;
+
+	r = snapshot__read(snap, vq_states, state->nr_vqs * sizeof(vq_states[0]));
+	if (!r)
+		r = snapshot__read(snap, vdev->ops->get_config(kvm, dev),
+				   state->config_size);
+	if (r < 0)
+		goto out;
+
+	pci__restore_config(kvm, &vpci->pci_hdr, state->config);
+	memcpy(vpci->msix_table, state->msix_table, sizeof(vpci->msix_table));
+	vpci->msix_pba = state->msix_pba;
+	vpci->device_features_sel = state->device_features_sel;
+	vpci->driver_features_sel = state->driver_features_sel;
+
+	if (state->status) {
+		virtio_set_guest_features(kvm, vdev, dev, state->features);
+		virtio_notify_status(kvm, vdev, dev,
+				     state->status & ~VIRTIO_CONFIG_S_DRIVER_OK);
+	}
+
+	vpci->config_vector = state->config_vector;
+	gsi = virtio_pci__add_msix_route(vpci, vpci->config_vector);
+	if (gsi >= 0)
+		vpci->config_gsi = gsi;
+
+	for (i = 0; i < state->nr_vqs; i++) {
+		vpci->vq_vector[i] = state->vq_vector[i];
+		if (!vq_states[i].enabled)
+			continue;
+
+		gsi = virtio_pci__add_msix_route(vpci, vpci->vq_vector[i]);
+		if (gsi >= 0) {
+			vpci->gsis[i] = gsi;
+			if (vdev->ops->notify_vq_gsi)
+				vdev->ops->notify_vq_gsi(kvm, dev, i, gsi);
+		}
+
+		vdev->ops->set_size_vq(kvm, dev, i, vq_states[i].size);
+		vq = vdev->ops->get_vq(kvm, dev, i);
+		vq->vring_addr = vq_states[i].addr;
+
+		r = virtio_pci_init_vq(kvm, vdev, i);
+		if (r < 0)
+			goto out;
+		virtio_vq__restore_state(vq, &vq_states[i]);
+	}
+
+	vpci->queue_selector = state->queue_selector;
+	vpci->status = state->status;
+	/* The routes above were added as if the driver was still probing */
+	irq__flush_routes(kvm);
+	if (state->status & VIRTIO_CONFIG_S_DRIVER_OK)
+		virtio_notify_status(kvm, vdev, dev, state->status);
+
+	vpci->isr = state->isr;
+	if (vpci->isr)
+		kvm__irq_line(kvm, vpci->legacy_irq_line, VIRTIO_IRQ_HIGH);
+
+	r = 0;
+out:
+	free(state);
+	return r;
+}
+
+/* Pick up the requests that came while the device was frozen */
+static void virtio_pci__resume(struct kvm *kvm, void *data)
+{
+	struct virtio_device *vdev = data;
+	struct virtio_pci *vpci = vdev->virtio;
+	u32 i;
+
+	if (vdev->use_vhost)
+		return;
+
+	for (i = 0; i < vdev->ops->get_vq_count(kvm, vpci->dev); i++)
+		if (vdev->ops->get_vq(kvm, vpci->dev, i)->enabled)
+			vdev->ops->notify_vq(kvm, vpci->dev, i);
+}
+
 int virtio_pci__init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 		     int device_id, int subsys_id, int class)
 {
@@ -348,9 +718,10 @@ int virtio_pci__init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 	vpci->dev = dev;
 
 	BUILD_BUG_ON(!is_power_of_two(PCI_IO_SIZE));
+	BUILD_BUG_ON(!is_power_of_two(VIRTIO_PCI_MMIO_SIZE));
 
 	port_addr = pci_get_io_port_block(PCI_IO_SIZE);
-	mmio_addr = pci_get_mmio_block(PCI_IO_SIZE);
+	mmio_addr = pci_get_mmio_block(VIRTIO_PCI_MMIO_SIZE);
 	msix_io_block = pci_get_mmio_block(VIRTIO_MSIX_BAR_SIZE);
 
 	vpci->pci_hdr = (struct pci_device_header) {
@@ -373,10 +744,29 @@ int virtio_pci__init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 		.status			= cpu_to_le16(PCI_STATUS_CAP_LIST),
 		.capabilities		= PCI_CAP_OFF(&vpci->pci_hdr, msix),
 		.bar_size[0]		= cpu_to_le32(PCI_IO_SIZE),
-		.bar_size[1]		= cpu_to_le32(PCI_IO_SIZE),
+		.bar_size[1]		= cpu_to_le32(VIRTIO_PCI_MMIO_SIZE),
 		.bar_size[2]		= cpu_to_le32(VIRTIO_MSIX_BAR_SIZE),
+		.cfg_ops		= {
+			.write		= virtio_pci__cfg_write,
+		},
 	};
 
+	/* Modern devices can have their shared memory mapped in BAR 3 */
+	if (!vdev->legacy && vdev->ops->get_shm_region) {
+		vpci->shm_host = vdev->ops->get_shm_region(kvm, dev,
+							   &vpci->shm_id,
+							   &vpci->shm_size);
+		if (vpci->shm_host) {
+			if (!is_power_of_two(vpci->shm_size) ||
+			    vpci->shm_size > SZ_256M)
+				return -EINVAL;
+			vpci->pci_hdr.bar[3] = cpu_to_le32(pci_get_mmio_block(vpci->shm_size)
+							   | PCI_BASE_ADDRESS_SPACE_MEMORY
+							   | PCI_BASE_ADDRESS_MEM_PREFETCH);
+			vpci->pci_hdr.bar_size[3] = vpci->shm_size;
+		}
+	}
+
 	r = pci__register_bar_regions(kvm, &vpci->pci_hdr,
 				      virtio_pci__bar_activate,
 				      virtio_pci__bar_deactivate, vdev);
@@ -420,6 +810,16 @@ int virtio_pci__init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 	if (r < 0)
 		return r;
 
+	vpci->snapshot = (struct snapshot_handler) {
+		.save		= virtio_pci__save,
+		.restore	= virtio_pci__restore,
+		.resume		= virtio_pci__resume,
+		.data		= vdev,
+	};
+	snprintf(vpci->snapshot.name, sizeof(vpci->snapshot.name),
+		 "virtio-pci-%02x", vpci->dev_hdr.dev_num);
+	snapshot__register(&vpci->snapshot);
+
 	if (vdev->legacy)
 		vpci->doorbell_offset = VIRTIO_PCI_QUEUE_NOTIFY;
 	else
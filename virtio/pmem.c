@@ -0,0 +1,379 @@
+#include "kvm/virtio-pmem.h"
+
+#include "kvm/virtio-pci-dev.h"
+
+#include "kvm/guest_compat.h"
+#include "kvm/kvm.h"
+#include "kvm/snapshot.h"
+#include "kvm/threadpool.h"
+#include "kvm/util.h"
+#include "kvm/virtio.h"
+#include "kvm/iovec.h"
+
+#include <linux/byteorder.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/sizes.h>
+#include <linux/virtio_pmem.h>
+#include <linux/virtio_ring.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define PCI_DEVICE_ID_VIRTIO_PMEM	(PCI_DEVICE_ID_VIRTIO_BASE + VIRTIO_ID_PMEM)
+#define PCI_CLASS_PMEM			0xff0000
+
+#define NUM_VIRT_QUEUES			1
+#define VIRTIO_PMEM_QUEUE_SIZE		64
+/* A request and its response, Linux sends nothing longer */
+#define VIRTIO_PMEM_MAX_CHAIN		4
+
+/*
+ * The guest maps the region as ZONE_DEVICE memory, which Linux hotplugs by
+ * 2MB subsections. Regions start on their own 1GB, past all other memory.
+ */
+#define VIRTIO_PMEM_SIZE_ALIGN		SZ_2M
+#define VIRTIO_PMEM_REGION_ALIGN	SZ_1G
+
+struct pmem_req {
+	u16			head;
+	u16			out, in;
+	/* Anything else gets an error */
+	bool			flush;
+	struct iovec		iov[VIRTIO_PMEM_MAX_CHAIN];
+};
+
+/*
+ * A host file mapped shared into guest physical memory. The guest reads and
+ * writes it in place (with DAX, without a page cache of its own) and asks for
+ * its writes to be made durable through the request queue.
+ */
+struct pmem_dev {
+	struct list_head	list;
+	struct virtio_device	vdev;
+	struct virtio_pmem_config config;
+
+	char			path[PATH_MAX];
+	int			fd;
+	bool			readonly;
+	void			*host;
+	u64			addr;
+	u64			size;
+
+	struct virt_queue	vqs[NUM_VIRT_QUEUES];
+	struct thread_pool__job	job;
+	struct pmem_req		reqs[VIRTIO_PMEM_QUEUE_SIZE];
+};
+
+static LIST_HEAD(pmem_devs);
+static int compat_id = -1;
+
+/* Pops a request, false if it is malformed and already completed */
+static bool virtio_pmem_get_req(struct kvm *kvm, struct virt_queue *vq,
+				struct pmem_req *req)
+{
+	struct virtio_pmem_req hdr;
+
+	req->head = virt_queue__get_iov(vq, req->iov, &req->out, &req->in, kvm);
+
+	if (memcpy_fromiovecend((void *)&hdr, req->iov, 0, sizeof(hdr)) ||
+	    iov_size(req->iov + req->out, req->in) <
+	    sizeof(struct virtio_pmem_resp)) {
+		pr_warning("virtio-pmem: malformed request");
+		virt_queue__set_used_elem(vq, req->head, 0);
+		return false;
+	}
+
+	req->flush = virtio_guest_to_host_u32(vq->endian, hdr.type) ==
+		     VIRTIO_PMEM_REQ_TYPE_FLUSH;
+	if (!req->flush)
+		pr_warning("virtio-pmem: unknown request %u",
+			   virtio_guest_to_host_u32(vq->endian, hdr.type));
+
+	return true;
+}
+
+static void virtio_pmem_do_io(struct kvm *kvm, void *param)
+{
+	struct pmem_dev *pdev = param;
+	struct virt_queue *vq = &pdev->vqs[0];
+	struct virtio_pmem_resp resp;
+	u32 ret;
+	int i, nr;
+
+	while (virt_queue__available(vq)) {
+		nr = 0;
+		while (nr < VIRTIO_PMEM_QUEUE_SIZE && virt_queue__available(vq))
+			nr += virtio_pmem_get_req(kvm, vq, &pdev->reqs[nr]);
+
+		/*
+		 * One fsync() covers all the flushes queued before it starts:
+		 * their writes went to the shared mapping, so they are in the
+		 * page cache of the file already.
+		 */
+		ret = 0;
+		if (nr && !pdev->readonly && fsync(pdev->fd) < 0) {
+			pr_warning("virtio-pmem: fsync of %s failed: %s",
+				   pdev->path, strerror(errno));
+			ret = 1;
+		}
+
+		for (i = 0; i < nr; i++) {
+			struct pmem_req *req = &pdev->reqs[i];
+
+			resp.ret = virtio_host_to_guest_u32(vq->endian,
+							    req->flush ? ret : 1);
+			memcpy_toiovecend(req->iov + req->out, (void *)&resp, 0,
+					  sizeof(resp));
+			virt_queue__set_used_elem(vq, req->head, sizeof(resp));
+		}
+	}
+
+	pdev->vdev.ops->signal_vq(kvm, &pdev->vdev, 0);
+}
+
+static u8 *get_config(struct kvm *kvm, void *dev)
+{
+	struct pmem_dev *pdev = dev;
+
+	return (u8 *)&pdev->config;
+}
+
+static size_t get_config_size(struct kvm *kvm, void *dev)
+{
+	struct pmem_dev *pdev = dev;
+
+	return sizeof(pdev->config);
+}
+
+static u64 get_host_features(struct kvm *kvm, void *dev)
+{
+	return 1UL << VIRTIO_RING_F_EVENT_IDX
+		| 1UL << VIRTIO_RING_F_INDIRECT_DESC;
+}
+
+static int init_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct pmem_dev *pdev = dev;
+
+	compat__remove_message(compat_id);
+
+	virtio_init_device_vq(kvm, &pdev->vdev, &pdev->vqs[vq],
+			      VIRTIO_PMEM_QUEUE_SIZE);
+	pdev->vqs[vq].max_chain = VIRTIO_PMEM_MAX_CHAIN;
+	thread_pool__init_job(&pdev->job, kvm, virtio_pmem_do_io, pdev);
+
+	return 0;
+}
+
+static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct pmem_dev *pdev = dev;
+
+	thread_pool__cancel_job(&pdev->job);
+}
+
+static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct pmem_dev *pdev = dev;
+
+	thread_pool__do_job(&pdev->job);
+
+	return 0;
+}
+
+static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct pmem_dev *pdev = dev;
+
+	return &pdev->vqs[vq];
+}
+
+static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	return VIRTIO_PMEM_QUEUE_SIZE;
+}
+
+static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
+{
+	return size;
+}
+
+static unsigned int get_vq_count(struct kvm *kvm, void *dev)
+{
+	return NUM_VIRT_QUEUES;
+}
+
+static struct virtio_ops pmem_dev_virtio_ops = {
+	.get_config		= get_config,
+	.get_config_size	= get_config_size,
+	.get_host_features	= get_host_features,
+	.init_vq		= init_vq,
+	.exit_vq		= exit_vq,
+	.notify_vq		= notify_vq,
+	.get_vq			= get_vq,
+	.get_size_vq		= get_size_vq,
+	.set_size_vq		= set_size_vq,
+	.get_vq_count		= get_vq_count,
+};
+
+static void pmem_free(struct pmem_dev *pdev)
+{
+	if (pdev->host)
+		munmap(pdev->host, pdev->size);
+	if (pdev->fd >= 0)
+		close(pdev->fd);
+	free(pdev);
+}
+
+int virtio_pmem__register(struct kvm *kvm, const char *path, bool readonly)
+{
+	struct pmem_dev *pdev;
+	off_t size;
+	int r;
+
+	pdev = calloc(1, sizeof(*pdev));
+	if (!pdev)
+		return -ENOMEM;
+
+	strncpy(pdev->path, path, sizeof(pdev->path) - 1);
+	pdev->readonly = readonly;
+	pdev->fd = open(path, readonly ? O_RDONLY : O_RDWR);
+	if (pdev->fd < 0) {
+		r = -errno;
+		goto err;
+	}
+
+	/* Files and block devices alike */
+	size = lseek(pdev->fd, 0, SEEK_END);
+	if (size < 0) {
+		r = -errno;
+		goto err;
+	}
+	if (!size || size % VIRTIO_PMEM_SIZE_ALIGN) {
+		pr_err("virtio-pmem: the size of %s isn't a multiple of 2MB",
+		       path);
+		r = -EINVAL;
+		goto err;
+	}
+
+	pdev->host = mmap(NULL, size, readonly ? PROT_READ : PROT_RW,
+			  MAP_SHARED | MAP_NORESERVE, pdev->fd, 0);
+	if (pdev->host == MAP_FAILED) {
+		pdev->host = NULL;
+		r = -errno;
+		goto err;
+	}
+	pdev->size = size;
+
+	list_add_tail(&pdev->list, &pmem_devs);
+
+	if (compat_id == -1)
+		compat_id = virtio_compat_add_message("virtio-pmem", "CONFIG_VIRTIO_PMEM");
+
+	return 0;
+
+err:
+	pmem_free(pdev);
+	return r;
+}
+
+int virtio_pmem_parser(const struct option *opt, const char *arg, int unset)
+{
+	struct kvm *kvm = opt->ptr;
+	bool readonly = false;
+	char *buf, *cur, *path;
+	int r;
+
+	buf = strdup(arg);
+	if (!buf)
+		die("out of memory");
+
+	cur = buf;
+	path = strsep(&cur, ",");
+	if (!path || !*path)
+		die("virtio-pmem needs a file: <file>[,ro]");
+
+	while (cur) {
+		char *param = strsep(&cur, ",");
+
+		if (!strcmp(param, "ro"))
+			readonly = true;
+		else
+			die("Unknown virtio-pmem parameter %s", param);
+	}
+
+	r = virtio_pmem__register(kvm, path, readonly);
+	if (r < 0)
+		die("Unable to map %s with virtio-pmem: %s", path, strerror(-r));
+
+	free(buf);
+	return 0;
+}
+
+int virtio_pmem__init(struct kvm *kvm)
+{
+	enum virtio_trans trans = kvm->cfg.virtio_transport;
+	enum kvm_mem_type type;
+	struct pmem_dev *pdev;
+	int r;
+
+	/* There is no legacy virtio-pmem */
+	if (trans == VIRTIO_PCI_LEGACY)
+		trans = VIRTIO_PCI;
+	else if (trans == VIRTIO_MMIO_LEGACY)
+		trans = VIRTIO_MMIO;
+
+	list_for_each_entry(pdev, &pmem_devs, list) {
+		pdev->addr = kvm__mem_end(kvm, VIRTIO_PMEM_REGION_ALIGN);
+		pdev->config = (struct virtio_pmem_config) {
+			.start	= cpu_to_le64(pdev->addr),
+			.size	= cpu_to_le64(pdev->size),
+		};
+
+		/* Guest writes to read-only files exit as MMIO and are dropped */
+		type = KVM_MEM_TYPE_DEVICE;
+		if (pdev->readonly)
+			type |= KVM_MEM_TYPE_READONLY;
+		r = kvm__register_mem(kvm, pdev->addr, pdev->size, pdev->host,
+				      type);
+		if (r < 0)
+			return r;
+
+		/* The contents are in a host file that snapshots don't keep */
+		snapshot__block("virtio-pmem");
+		r = virtio_init(kvm, pdev, &pdev->vdev, &pmem_dev_virtio_ops,
+				trans, PCI_DEVICE_ID_VIRTIO_PMEM,
+				VIRTIO_ID_PMEM, PCI_CLASS_PMEM);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+virtio_dev_init(virtio_pmem__init);
+
+int virtio_pmem__exit(struct kvm *kvm)
+{
+	struct pmem_dev *pdev, *tmp;
+
+	list_for_each_entry_safe(pdev, tmp, &pmem_devs, list) {
+		list_del(&pdev->list);
+		virtio_exit(kvm, &pdev->vdev);
+		/* What the guest wrote without asking for a flush */
+		if (!pdev->readonly && fsync(pdev->fd) < 0)
+			pr_warning("virtio-pmem: fsync of %s failed: %s",
+				   pdev->path, strerror(errno));
+		/* Guest memory stays mapped until the VM goes */
+		pdev->host = NULL;
+		pmem_free(pdev);
+	}
+
+	return 0;
+}
+virtio_dev_exit(virtio_pmem__exit);
@@ -5,6 +5,7 @@
 #include "kvm/virtio.h"
 #include "kvm/util.h"
 #include "kvm/kvm.h"
+#include "kvm/read-write.h"
 #include "kvm/threadpool.h"
 #include "kvm/guest_compat.h"
 
@@ -13,13 +14,17 @@
 
 #include <linux/list.h>
 #include <fcntl.h>
+#include <sys/random.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <pthread.h>
 #include <linux/kernel.h>
+#include <linux/sizes.h>
 
 #define NUM_VIRT_QUEUES		1
 #define VIRTIO_RNG_QUEUE_SIZE	128
+/* Bytes taken from the host at once, instead of one read per buffer */
+#define VIRTIO_RNG_POOL_SIZE	SZ_64K
 
 struct rng_dev_job {
 	struct virt_queue	*vq;
@@ -33,6 +38,13 @@ struct rng_dev {
 
 	int			fd;
 
+	/*
+	 * Only the queue job touches the pool. Bytes are handed out once,
+	 * from the end of the pool: the last pool_avail of them are unused.
+	 */
+	u8			*pool;
+	size_t			pool_avail;
+
 	/* virtio queue */
 	struct virt_queue	vqs[NUM_VIRT_QUEUES];
 	struct rng_dev_job	jobs[NUM_VIRT_QUEUES];
@@ -58,30 +70,75 @@ static u64 get_host_features(struct kvm *kvm, void *dev)
 	return 0;
 }
 
-static bool virtio_rng_do_io_request(struct kvm *kvm, struct rng_dev *rdev, struct virt_queue *queue)
+static bool virtio_rng_fill_pool(struct rng_dev *rdev)
 {
-	struct iovec iov[VIRTIO_RNG_QUEUE_SIZE];
 	ssize_t len;
-	u16 out, in, head;
 
-	head	= virt_queue__get_iov(queue, iov, &out, &in, kvm);
-	len	= readv(rdev->fd, iov, in);
-	if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+	do {
+		len = getrandom(rdev->pool, VIRTIO_RNG_POOL_SIZE, 0);
+	} while (len < 0 && errno == EINTR);
+
+	/* Kernels before 3.17 only have the device */
+	if (len < 0 && errno == ENOSYS)
+		len = read_in_full(rdev->fd, rdev->pool, VIRTIO_RNG_POOL_SIZE);
+
+	if (len <= 0)
+		return false;
+
+	/* A short fill is still random, it is moved to the end of the pool */
+	if ((size_t)len < VIRTIO_RNG_POOL_SIZE)
+		memmove(rdev->pool + VIRTIO_RNG_POOL_SIZE - len, rdev->pool, len);
+	rdev->pool_avail = len;
+
+	return true;
+}
+
+static size_t virtio_rng_copy(struct rng_dev *rdev, void *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		size_t n;
+
 		/*
-		 * The virtio 1.0 spec demands at least one byte of entropy,
-		 * so we cannot just return with 0 if something goes wrong.
-		 * The urandom(4) manpage mentions that a read from /dev/urandom
-		 * should always return at least 256 bytes of randomness, so
-		 * just retry here, with the requested size clamped to that
-		 * maximum, in case we were interrupted by a signal.
+		 * The virtio 1.0 spec demands at least one byte of entropy, so
+		 * a failed refill only ends the buffer if it already has some.
 		 */
-		iov[0].iov_len = min_t(size_t, iov[0].iov_len, 256UL);
-		len = readv(rdev->fd, iov, 1);
-		if (len < 1)
-			return false;
+		if (!rdev->pool_avail && !virtio_rng_fill_pool(rdev))
+			break;
+
+		n = min(len - done, rdev->pool_avail);
+		memcpy(buf + done, rdev->pool + VIRTIO_RNG_POOL_SIZE -
+		       rdev->pool_avail, n);
+		rdev->pool_avail -= n;
+		done += n;
 	}
 
-	virt_queue__set_used_elem(queue, head, len);
+	return done;
+}
+
+static bool virtio_rng_do_io_request(struct kvm *kvm, struct rng_dev *rdev,
+				     struct virt_queue *queue,
+				     struct virt_queue_batch *batch)
+{
+	struct iovec iov[VIRTIO_RNG_QUEUE_SIZE];
+	size_t len = 0, n;
+	u16 out, in, head, i;
+
+	head	= virt_queue__get_iov(queue, iov, &out, &in, kvm);
+	for (i = 0; i < in; i++) {
+		n = virtio_rng_copy(rdev, iov[i].iov_base, iov[i].iov_len);
+		len += n;
+		if (n < iov[i].iov_len)
+			break;
+	}
+
+	if (!len) {
+		virt_queue__unpop(queue, 1);
+		return false;
+	}
+
+	virt_queue__batch_add(batch, head, len);
 
 	return true;
 }
@@ -91,11 +148,16 @@ static void virtio_rng_do_io(struct kvm *kvm, void *param)
 	struct rng_dev_job *job	= param;
 	struct virt_queue *vq	= job->vq;
 	struct rng_dev *rdev	= job->rdev;
+	struct virt_queue_batch batch;
 
+	/* All buffers filled from the pool become visible at once */
+	virt_queue__batch_begin(&batch, vq);
 	while (virt_queue__available(vq))
-		virtio_rng_do_io_request(kvm, rdev, vq);
+		if (!virtio_rng_do_io_request(kvm, rdev, vq, &batch))
+			break;
 
-	rdev->vdev.ops->signal_vq(kvm, &rdev->vdev, vq - rdev->vqs);
+	if (virt_queue__batch_commit(&batch))
+		rdev->vdev.ops->signal_vq(kvm, &rdev->vdev, vq - rdev->vqs);
 }
 
 static int init_vq(struct kvm *kvm, void *dev, u32 vq)
@@ -186,6 +248,12 @@ int virtio_rng__init(struct kvm *kvm)
 	if (rdev == NULL)
 		return -ENOMEM;
 
+	rdev->pool = malloc(VIRTIO_RNG_POOL_SIZE);
+	if (!rdev->pool) {
+		r = -ENOMEM;
+		goto cleanup_free;
+	}
+
 	rdev->fd = open("/dev/urandom", O_RDONLY);
 	if (rdev->fd < 0) {
 		r = rdev->fd;
@@ -205,6 +273,8 @@ int virtio_rng__init(struct kvm *kvm)
 	return 0;
 cleanup:
 	close(rdev->fd);
+cleanup_free:
+	free(rdev->pool);
 	free(rdev);
 
 	return r;
@@ -218,6 +288,8 @@ int virtio_rng__exit(struct kvm *kvm)
 	list_for_each_entry_safe(rdev, tmp, &rdevs, list) {
 		list_del(&rdev->list);
 		virtio_exit(kvm, &rdev->vdev);
+		close(rdev->fd);
+		free(rdev->pool);
 		free(rdev);
 	}
 
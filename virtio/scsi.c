@@ -1,6 +1,8 @@
 #include "kvm/virtio-scsi.h"
 #include "kvm/virtio-pci-dev.h"
 #include "kvm/disk-image.h"
+#include "kvm/iovec.h"
+#include "kvm/mutex.h"
 #include "kvm/irq.h"
 #include "kvm/kvm.h"
 #include "kvm/pci.h"
@@ -10,16 +12,116 @@
 #include "kvm/virtio.h"
 #include "kvm/strbuf.h"
 
+#include <linux/byteorder.h>
 #include <linux/kernel.h>
+#include <linux/sizes.h>
+#include <linux/virtio_blk.h>
 #include <linux/virtio_scsi.h>
 #include <linux/vhost.h>
+#include <pthread.h>
 
-#define VIRTIO_SCSI_QUEUE_SIZE		128
-#define NUM_VIRT_QUEUES			3
+#define VIRTIO_SCSI_QUEUE_SIZE		256
+/* The control and event queues come before the request queues */
+#define VIRTIO_SCSI_FIRST_REQ_VQ	2
+#define VIRTIO_SCSI_MAX_QUEUES		16
+#define NUM_VIRT_QUEUES			(VIRTIO_SCSI_FIRST_REQ_VQ + VIRTIO_SCSI_MAX_QUEUES)
+
+/* The request header and the response take a descriptor each */
+#define VIRTIO_SCSI_SEG_MAX		(VIRTIO_SCSI_QUEUE_SIZE - 2)
+/* Longest transfer of the emulated target, in 512-byte sectors */
+#define VIRTIO_SCSI_MAX_SECTORS		(SZ_32M >> SECTOR_SHIFT)
+/* Keep a single UNMAP or WRITE SAME from stalling the queue */
+#define VIRTIO_SCSI_MAX_UNMAP_SECTORS	(SZ_1G >> SECTOR_SHIFT)
+#define VIRTIO_SCSI_MAX_UNMAP_DESC	256
+/* Descriptors the response may be split over */
+#define VIRTIO_SCSI_RESP_IOVS		4
+
+/* SCSI commands of the emulated target */
+#define SCSI_TEST_UNIT_READY		0x00
+#define SCSI_REQUEST_SENSE		0x03
+#define SCSI_READ_6			0x08
+#define SCSI_WRITE_6			0x0a
+#define SCSI_INQUIRY			0x12
+#define SCSI_MODE_SENSE_6		0x1a
+#define SCSI_START_STOP_UNIT		0x1b
+#define SCSI_PREVENT_ALLOW		0x1e
+#define SCSI_READ_CAPACITY_10		0x25
+#define SCSI_READ_10			0x28
+#define SCSI_WRITE_10			0x2a
+#define SCSI_VERIFY_10			0x2f
+#define SCSI_SYNCHRONIZE_CACHE_10	0x35
+#define SCSI_WRITE_SAME_10		0x41
+#define SCSI_UNMAP			0x42
+#define SCSI_MODE_SENSE_10		0x5a
+#define SCSI_READ_16			0x88
+#define SCSI_WRITE_16			0x8a
+#define SCSI_VERIFY_16			0x8f
+#define SCSI_SYNCHRONIZE_CACHE_16	0x91
+#define SCSI_WRITE_SAME_16		0x93
+#define SCSI_SERVICE_ACTION_IN_16	0x9e
+#define  SCSI_SAI_READ_CAPACITY_16	0x10
+#define SCSI_REPORT_LUNS		0xa0
+#define SCSI_READ_12			0xa8
+#define SCSI_WRITE_12			0xaa
+#define SCSI_VERIFY_12			0xaf
+
+/* SAM status codes */
+#define SCSI_STATUS_GOOD		0x00
+#define SCSI_STATUS_CHECK_CONDITION	0x02
+
+/* Sense keys, and additional sense codes in the ASC << 8 | ASCQ form */
+#define SCSI_SENSE_NO_SENSE		0x00
+#define SCSI_SENSE_MEDIUM_ERROR		0x03
+#define SCSI_SENSE_ILLEGAL_REQUEST	0x05
+#define SCSI_SENSE_DATA_PROTECT		0x07
+#define SCSI_ASC_WRITE_ERROR		0x0c00
+#define SCSI_ASC_READ_ERROR		0x1100
+#define SCSI_ASC_PARAMETER_LIST_LENGTH	0x1a00
+#define SCSI_ASC_INVALID_OPCODE		0x2000
+#define SCSI_ASC_LBA_OUT_OF_RANGE	0x2100
+#define SCSI_ASC_INVALID_FIELD_IN_CDB	0x2400
+#define SCSI_ASC_LUN_NOT_SUPPORTED	0x2500
+#define SCSI_ASC_INVALID_FIELD_IN_PARAM	0x2600
+#define SCSI_ASC_WRITE_PROTECTED	0x2700
+
+#define SCSI_FIXED_SENSE_LEN		18
 
 static LIST_HEAD(sdevs);
 static int compat_id = -1;
 
+struct scsi_dev;
+struct scsi_dev_queue;
+
+struct scsi_dev_req {
+	struct scsi_dev_queue		*queue;
+	/* Out descriptors, then in ones. Trimmed in place to the data */
+	struct iovec			iov[VIRTIO_SCSI_QUEUE_SIZE];
+	u16				out, in, head;
+	struct iovec			*data;
+	int				data_cnt;
+	size_t				data_len;
+	struct iovec			resp_iov[VIRTIO_SCSI_RESP_IOVS];
+	struct virtio_scsi_cmd_resp	resp;
+	bool				write;
+
+	u64				start;
+	size_t				stats_len;
+	int				stats_op;
+};
+
+/* A request queue of the emulated target, with its own I/O thread */
+struct scsi_dev_queue {
+	u32				id;
+	struct scsi_dev			*sdev;
+	struct mutex			mutex;
+	struct virt_queue_batch		batch;
+	struct scsi_dev_req		*reqs;
+
+	pthread_t			io_thread;
+	int				io_efd;
+	struct virtio_poll		poll;
+};
+
 struct scsi_dev {
 	struct virt_queue		vqs[NUM_VIRT_QUEUES];
 	struct virtio_scsi_config	config;
@@ -28,8 +130,758 @@ struct scsi_dev {
 	struct virtio_device		vdev;
 	struct list_head		list;
 	struct kvm			*kvm;
+
+	u32				nr_queues;
+	/* The rest is for the emulated target */
+	struct disk_image		*disk;
+	struct mutex			ctrl_lock;
+	u32				block_size;
+	u64				nr_blocks;
+	struct scsi_dev_queue		queues[VIRTIO_SCSI_MAX_QUEUES];
 };
 
+static inline void scsi_put_be16(u8 *p, u16 v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static inline void scsi_put_be32(u8 *p, u32 v)
+{
+	scsi_put_be16(p, v >> 16);
+	scsi_put_be16(p + 2, v);
+}
+
+static inline void scsi_put_be64(u8 *p, u64 v)
+{
+	scsi_put_be32(p, v >> 32);
+	scsi_put_be32(p + 4, v);
+}
+
+static inline u16 scsi_get_be16(const u8 *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static inline u32 scsi_get_be32(const u8 *p)
+{
+	return (u32)scsi_get_be16(p) << 16 | scsi_get_be16(p + 2);
+}
+
+static inline u64 scsi_get_be64(const u8 *p)
+{
+	return (u64)scsi_get_be32(p) << 32 | scsi_get_be32(p + 4);
+}
+
+static void scsi_req_sense(struct scsi_dev_req *req, u8 key, u16 asc)
+{
+	u8 *sense = req->resp.sense;
+
+	memset(sense, 0, SCSI_FIXED_SENSE_LEN);
+	sense[0] = 0x70;	/* Current error, fixed format */
+	sense[2] = key;
+	sense[7] = SCSI_FIXED_SENSE_LEN - 8;
+	sense[12] = asc >> 8;
+	sense[13] = asc;
+
+	req->resp.status = SCSI_STATUS_CHECK_CONDITION;
+	req->resp.sense_len = SCSI_FIXED_SENSE_LEN;
+}
+
+/* Hand emulated data to the guest, which may have asked for less of it */
+static void scsi_req_data_in(struct scsi_dev_req *req, void *buf,
+			     size_t len, size_t alloc_len)
+{
+	len = min(len, min(alloc_len, req->data_len));
+	if (req->write || !len)
+		return;
+
+	memcpy_toiovecend(req->data, buf, 0, len);
+	req->resp.resid = req->data_len - len;
+}
+
+static void virtio_scsi_complete(void *param, long len)
+{
+	struct scsi_dev_req *req = param;
+	struct scsi_dev_queue *queue = req->queue;
+	struct scsi_dev *sdev = queue->sdev;
+	struct virtio_scsi_cmd_resp *resp = &req->resp;
+	struct virt_queue *vq = &sdev->vqs[queue->id];
+	u32 used = sizeof(*resp);
+	bool signal;
+
+	if (req->stats_op != DISK_STATS_NR_OPS)
+		disk_stats__account(&sdev->disk->stats, req->stats_op,
+				    req->stats_len, req->start);
+
+	if (len < 0 && resp->status == SCSI_STATUS_GOOD) {
+		scsi_req_sense(req, SCSI_SENSE_MEDIUM_ERROR, req->write ?
+			       SCSI_ASC_WRITE_ERROR : SCSI_ASC_READ_ERROR);
+		resp->resid = req->data_len;
+	}
+
+	if (!req->write)
+		used += req->data_len - resp->resid;
+
+	resp->sense_len = virtio_host_to_guest_u32(vq->endian, resp->sense_len);
+	resp->resid = virtio_host_to_guest_u32(vq->endian, resp->resid);
+	memcpy_toiovecend(req->resp_iov, (void *)resp, 0, sizeof(*resp));
+
+	mutex_lock(&queue->mutex);
+	virt_queue__batch_add(&queue->batch, req->head, used);
+	signal = !disk_image__batching() &&
+		 virt_queue__batch_commit(&queue->batch);
+	mutex_unlock(&queue->mutex);
+
+	if (signal)
+		sdev->vdev.ops->signal_vq(sdev->kvm, &sdev->vdev, queue->id);
+}
+
+static void virtio_scsi_complete_batch(void *param)
+{
+	struct scsi_dev *sdev = param;
+	struct scsi_dev_queue *queue;
+	bool signal;
+	u32 i;
+
+	for (i = 0; i < sdev->nr_queues; i++) {
+		queue = &sdev->queues[i];
+		if (!__atomic_load_n(&queue->batch.nr, __ATOMIC_RELAXED))
+			continue;
+
+		mutex_lock(&queue->mutex);
+		signal = virt_queue__batch_commit(&queue->batch);
+		mutex_unlock(&queue->mutex);
+
+		if (signal)
+			sdev->vdev.ops->signal_vq(sdev->kvm, &sdev->vdev,
+						  queue->id);
+	}
+}
+
+static void scsi_inquiry_vpd(struct scsi_dev *sdev, struct scsi_dev_req *req,
+			     u8 page, u16 alloc_len)
+{
+	struct disk_image *disk = sdev->disk;
+	char serial[VIRTIO_BLK_ID_BYTES + 1] = {};
+	struct iovec iov = {
+		.iov_base	= serial,
+		.iov_len	= VIRTIO_BLK_ID_BYTES,
+	};
+	u64 unmap_blocks = VIRTIO_SCSI_MAX_UNMAP_SECTORS /
+			   (sdev->block_size >> SECTOR_SHIFT);
+	bool discard = !disk->readonly && disk->ops->discard;
+	bool zeroes = !disk->readonly && disk->ops->write_zeroes;
+	u8 buf[64] = {};
+	size_t len;
+
+	if (disk_image__get_serial(disk, &iov, 1, VIRTIO_BLK_ID_BYTES) < 0)
+		strcpy(serial, "0");
+
+	buf[1] = page;
+
+	switch (page) {
+	case 0x00:	/* Supported pages */
+		len = 4;
+		buf[len++] = 0x00;
+		buf[len++] = 0x80;
+		buf[len++] = 0x83;
+		buf[len++] = 0xb0;
+		buf[len++] = 0xb1;
+		buf[len++] = 0xb2;
+		break;
+	case 0x80:	/* Unit serial number */
+		len = 4 + strlen(serial);
+		memcpy(buf + 4, serial, len - 4);
+		break;
+	case 0x83:	/* Device identification, a T10 vendor ID */
+		buf[4] = 0x02;	/* ASCII */
+		buf[5] = 0x01;	/* T10 vendor ID, associated with the LU */
+		len = snprintf((char *)buf + 8, sizeof(buf) - 8, "%-8s%s",
+			       "KVMTOOL", serial);
+		buf[7] = len;
+		len += 8;
+		break;
+	case 0xb0:	/* Block limits */
+		len = 64;
+		scsi_put_be32(buf + 8, VIRTIO_SCSI_MAX_SECTORS /
+			      (sdev->block_size >> SECTOR_SHIFT));
+		if (discard) {
+			scsi_put_be32(buf + 20, unmap_blocks);
+			scsi_put_be32(buf + 24, VIRTIO_SCSI_MAX_UNMAP_DESC);
+			scsi_put_be32(buf + 28, max(disk->discard_sectors, 1U) *
+				      SECTOR_SIZE / sdev->block_size ?: 1);
+		}
+		if (zeroes)
+			scsi_put_be64(buf + 36, unmap_blocks);
+		break;
+	case 0xb1:	/* Block device characteristics */
+		len = 64;
+		scsi_put_be16(buf + 4, 0x0001);	/* Non-rotating */
+		break;
+	case 0xb2:	/* Logical block provisioning */
+		len = 8;
+		buf[5] = (discard ? 0x80 : 0) |		/* LBPU */
+			 (zeroes ? 0x60 : 0);		/* LBPWS, LBPWS10 */
+		buf[6] = discard ? 0x02 : 0x00;		/* Thin provisioned */
+		break;
+	default:
+		scsi_req_sense(req, SCSI_SENSE_ILLEGAL_REQUEST,
+			       SCSI_ASC_INVALID_FIELD_IN_CDB);
+		return;
+	}
+
+	scsi_put_be16(buf + 2, len - 4);
+	scsi_req_data_in(req, buf, len, alloc_len);
+}
+
+static void scsi_inquiry(struct scsi_dev *sdev, struct scsi_dev_req *req,
+			 const u8 *cdb, bool present)
+{
+	u16 alloc_len = scsi_get_be16(cdb + 3);
+	u8 buf[36] = {};
+
+	if (cdb[1] & 0x01) {
+		if (!present) {
+			scsi_req_sense(req, SCSI_SENSE_ILLEGAL_REQUEST,
+				       SCSI_ASC_LUN_NOT_SUPPORTED);
+			return;
+		}
+		scsi_inquiry_vpd(sdev, req, cdb[2], alloc_len);
+		return;
+	}
+
+	if (cdb[2]) {
+		scsi_req_sense(req, SCSI_SENSE_ILLEGAL_REQUEST,
+			       SCSI_ASC_INVALID_FIELD_IN_CDB);
+		return;
+	}
+
+	/* Other LUNs answer that there is no device there */
+	buf[0] = present ? 0x00 : 0x7f;
+	buf[2] = 0x06;		/* SPC-4 */
+	buf[3] = 0x02;		/* Response data format */
+	buf[4] = sizeof(buf) - 5;
+	buf[7] = 0x02;		/* Command queueing */
+	memcpy(buf + 8, "KVMTOOL ", 8);
+	memcpy(buf + 16, "VIRTUAL DISK    ", 16);
+	memcpy(buf + 32, "1.0 ", 4);
+
+	scsi_req_data_in(req, buf, sizeof(buf), alloc_len);
+}
+
+static void scsi_mode_sense(struct scsi_dev *sdev, struct scsi_dev_req *req,
+			    const u8 *cdb)
+{
+	bool ten = cdb[0] == SCSI_MODE_SENSE_10;
+	size_t hdr_len = ten ? 8 : 4, len = hdr_len;
+	u16 alloc_len = ten ? scsi_get_be16(cdb + 7) : cdb[4];
+	u8 page = cdb[2] & 0x3f;
+	u8 pc = cdb[2] >> 6;
+	u8 buf[64] = {};
+
+	/* Saved values aren't supported */
+	if (pc == 3) {
+		scsi_req_sense(req, SCSI_SENSE_ILLEGAL_REQUEST,
+			       SCSI_ASC_INVALID_FIELD_IN_CDB);
+		return;
+	}
+
+	if (page == 0x08 || page == 0x3f) {
+		/* Caching: writes are cached until a SYNCHRONIZE CACHE */
+		buf[len] = 0x08;
+		buf[len + 1] = 0x12;
+		if (pc != 1 && !disk_image__write_through(sdev->disk))
+			buf[len + 2] = 0x04;	/* WCE */
+		len += 20;
+	}
+
+	if (page == 0x0a || page == 0x3f) {
+		/* Control */
+		buf[len] = 0x0a;
+		buf[len + 1] = 0x0a;
+		len += 12;
+	}
+
+	if (len == hdr_len) {
+		scsi_req_sense(req, SCSI_SENSE_ILLEGAL_REQUEST,
+			       SCSI_ASC_INVALID_FIELD_IN_CDB);
+		return;
+	}
+
+	if (ten) {
+		scsi_put_be16(buf, len - 2);
+		buf[3] = sdev->disk->readonly ? 0x80 : 0;	/* WP */
+	} else {
+		buf[0] = len - 1;
+		buf[2] = sdev->disk->readonly ? 0x80 : 0;
+	}
+
+	scsi_req_data_in(req, buf, len, alloc_len);
+}
+
+static void scsi_read_capacity(struct scsi_dev *sdev, struct scsi_dev_req *req,
+			       const u8 *cdb)
+{
+	struct disk_image *disk = sdev->disk;
+	u8 buf[32] = {};
+
+	if (cdb[0] == SCSI_READ_CAPACITY_10) {
+		scsi_put_be32(buf, min_t(u64, sdev->nr_blocks - 1, 0xffffffff));
+		scsi_put_be32(buf + 4, sdev->block_size);
+		scsi_req_data_in(req, buf, 8, 8);
+		return;
+	}
+
+	scsi_put_be64(buf, sdev->nr_blocks - 1);
+	scsi_put_be32(buf + 8, sdev->block_size);
+	if (!disk->readonly && disk->ops->discard)
+		buf[14] = 0x80;		/* LBPME */
+	scsi_req_data_in(req, buf, sizeof(buf), scsi_get_be32(cdb + 10));
+}
+
+static void scsi_report_luns(struct scsi_dev_req *req, const u8 *cdb)
+{
+	u8 buf[16] = {};
+
+	/* Only LUN 0 */
+	scsi_put_be32(buf, 8);
+	scsi_req_data_in(req, buf, sizeof(buf), scsi_get_be32(cdb + 6));
+}
+
+static bool scsi_check_range(struct scsi_dev *sdev, struct scsi_dev_req *req,
+			     u64 lba, u64 nr_blocks)
+{
+	if (lba > sdev->nr_blocks || nr_blocks > sdev->nr_blocks - lba) {
+		scsi_req_sense(req, SCSI_SENSE_ILLEGAL_REQUEST,
+			       SCSI_ASC_LBA_OUT_OF_RANGE);
+		return false;
+	}
+
+	return true;
+}
+
+static bool scsi_check_writable(struct scsi_dev *sdev, struct scsi_dev_req *req)
+{
+	if (sdev->disk->readonly) {
+		scsi_req_sense(req, SCSI_SENSE_DATA_PROTECT,
+			       SCSI_ASC_WRITE_PROTECTED);
+		return false;
+	}
+
+	return true;
+}
+
+static void scsi_unmap(struct scsi_dev *sdev, struct scsi_dev_req *req,
+		       const u8 *cdb)
+{
+	u32 spb = sdev->block_size >> SECTOR_SHIFT;
+	struct iovec *iov = req->data;
+	size_t iovcount = req->data_cnt;
+	size_t len = min_t(size_t, scsi_get_be16(cdb + 7), req->data_len);
+	u8 hdr[8], desc[16];
+	u64 lba, nr_blocks;
+	u16 desc_len;
+	int r;
+
+	if (!scsi_check_writable(sdev, req))
+		return;
+
+	if (!len)
+		return;
+
+	if (len < sizeof(hdr) ||
+	    memcpy_fromiovec_safe(hdr, &iov, sizeof(hdr), &iovcount)) {
+		scsi_req_sense(req, SCSI_SENSE_ILLEGAL_REQUEST,
+			       SCSI_ASC_PARAMETER_LIST_LENGTH);
+		return;
+	}
+
+	desc_len = scsi_get_be16(hdr + 2);
+	if (desc_len > len - sizeof(hdr) ||
+	    desc_len / sizeof(desc) > VIRTIO_SCSI_MAX_UNMAP_DESC) {
+		scsi_req_sense(req, SCSI_SENSE_ILLEGAL_REQUEST,
+			       SCSI_ASC_INVALID_FIELD_IN_PARAM);
+		return;
+	}
+
+	for (; desc_len >= sizeof(desc); desc_len -= sizeof(desc)) {
+		if (memcpy_fromiovec_safe(desc, &iov, sizeof(desc), &iovcount))
+			break;
+
+		lba = scsi_get_be64(desc);
+		nr_blocks = scsi_get_be32(desc + 8);
+		if (!scsi_check_range(sdev, req, lba, nr_blocks))
+			return;
+
+		r = disk_image__discard(sdev->disk, lba * spb, nr_blocks * spb);
+		if (r < 0) {
+			scsi_req_sense(req, SCSI_SENSE_MEDIUM_ERROR,
+				       SCSI_ASC_WRITE_ERROR);
+			return;
+		}
+	}
+}
+
+/* Only zeroes can be written this way, which is what guests use it for */
+static void scsi_write_same(struct scsi_dev *sdev, struct scsi_dev_req *req,
+			    const u8 *cdb)
+{
+	u32 spb = sdev->block_size >> SECTOR_SHIFT;
+	bool ten = cdb[0] == SCSI_WRITE_SAME_10;
+	u64 lba = ten ? scsi_get_be32(cdb + 2) : scsi_get_be64(cdb + 2);
+	u64 nr_blocks = ten ? scsi_get_be16(cdb + 7) : scsi_get_be32(cdb + 10);
+	bool unmap = cdb[1] & 0x08;
+	bool ndob = !ten && (cdb[1] & 0x01);
+	u8 block[512];
+	size_t off;
+	int r;
+
+	if (!scsi_check_writable(sdev, req) ||
+	    !scsi_check_range(sdev, req, lba, nr_blocks))
+		return;
+
+	if (!sdev->disk->ops->write_zeroes || !nr_blocks ||
+	    nr_blocks * spb > VIRTIO_SCSI_MAX_UNMAP_SECTORS) {
+		scsi_req_sense(req, SCSI_SENSE_ILLEGAL_REQUEST,
+			       SCSI_ASC_INVALID_FIELD_IN_CDB);
+		return;
+	}
+
+	for (off = 0; !ndob && off < sdev->block_size; off += sizeof(block)) {
+		if (req->data_len < sdev->block_size) {
+			scsi_req_sense(req, SCSI_SENSE_ILLEGAL_REQUEST,
+				       SCSI_ASC_PARAMETER_LIST_LENGTH);
+			return;
+		}
+
+		memcpy_fromiovecend(block, req->data, off, sizeof(block));
+		if (block[0] || memcmp(block, block + 1, sizeof(block) - 1)) {
+			scsi_req_sense(req, SCSI_SENSE_ILLEGAL_REQUEST,
+				       SCSI_ASC_INVALID_FIELD_IN_CDB);
+			return;
+		}
+	}
+
+	r = disk_image__write_zeroes(sdev->disk, lba * spb, nr_blocks * spb,
+				     unmap);
+	if (r < 0)
+		scsi_req_sense(req, SCSI_SENSE_MEDIUM_ERROR,
+			       SCSI_ASC_WRITE_ERROR);
+}
+
+/* Returns true if the request was handed to the disk and completes later */
+static bool scsi_read_write(struct scsi_dev *sdev, struct scsi_dev_req *req,
+			    const u8 *cdb)
+{
+	u32 spb = sdev->block_size >> SECTOR_SHIFT;
+	u64 lba, nr_blocks;
+	size_t len;
+
+	switch (cdb[0]) {
+	case SCSI_READ_6:
+	case SCSI_WRITE_6:
+		lba = (cdb[1] & 0x1f) << 16 | scsi_get_be16(cdb + 2);
+		nr_blocks = cdb[4] ?: 256;
+		break;
+	case SCSI_READ_10:
+	case SCSI_WRITE_10:
+		lba = scsi_get_be32(cdb + 2);
+		nr_blocks = scsi_get_be16(cdb + 7);
+		break;
+	case SCSI_READ_12:
+	case SCSI_WRITE_12:
+		lba = scsi_get_be32(cdb + 2);
+		nr_blocks = scsi_get_be32(cdb + 6);
+		break;
+	default:
+		lba = scsi_get_be64(cdb + 2);
+		nr_blocks = scsi_get_be32(cdb + 10);
+		break;
+	}
+
+	if (req->write && !scsi_check_writable(sdev, req))
+		return false;
+	if (!scsi_check_range(sdev, req, lba, nr_blocks))
+		return false;
+
+	len = nr_blocks * sdev->block_size;
+	if (req->data_len < len) {
+		/* Transfer what fits, the guest sees the residual */
+		len = req->data_len - req->data_len % sdev->block_size;
+	}
+	req->resp.resid = req->data_len - len;
+	if (!len)
+		return false;
+
+	req->data_cnt = iovec_window(req->data, req->data, req->data_cnt, 0, len);
+	req->stats_op = req->write ? DISK_STATS_WRITE : DISK_STATS_READ;
+	req->stats_len = len;
+
+	if (req->write)
+		disk_image__write(sdev->disk, lba * spb, req->data,
+				  req->data_cnt, req);
+	else
+		disk_image__read(sdev->disk, lba * spb, req->data,
+				 req->data_cnt, req);
+
+	return true;
+}
+
+/* Returns true if the request completes later */
+static bool scsi_execute(struct scsi_dev *sdev, struct scsi_dev_req *req,
+			 const u8 *cdb, bool present)
+{
+	if (!present && cdb[0] != SCSI_INQUIRY &&
+	    cdb[0] != SCSI_REPORT_LUNS && cdb[0] != SCSI_REQUEST_SENSE) {
+		scsi_req_sense(req, SCSI_SENSE_ILLEGAL_REQUEST,
+			       SCSI_ASC_LUN_NOT_SUPPORTED);
+		return false;
+	}
+
+	switch (cdb[0]) {
+	case SCSI_TEST_UNIT_READY:
+	case SCSI_START_STOP_UNIT:
+	case SCSI_PREVENT_ALLOW:
+	case SCSI_VERIFY_10:
+	case SCSI_VERIFY_12:
+	case SCSI_VERIFY_16:
+		break;
+	case SCSI_REQUEST_SENSE: {
+		/* Sense data is always returned with the failed command */
+		u8 buf[SCSI_FIXED_SENSE_LEN] = { 0x70, 0, SCSI_SENSE_NO_SENSE };
+
+		buf[7] = SCSI_FIXED_SENSE_LEN - 8;
+		scsi_req_data_in(req, buf, sizeof(buf), cdb[4]);
+		break;
+	}
+	case SCSI_INQUIRY:
+		scsi_inquiry(sdev, req, cdb, present);
+		break;
+	case SCSI_MODE_SENSE_6:
+	case SCSI_MODE_SENSE_10:
+		scsi_mode_sense(sdev, req, cdb);
+		break;
+	case SCSI_READ_CAPACITY_10:
+		scsi_read_capacity(sdev, req, cdb);
+		break;
+	case SCSI_SERVICE_ACTION_IN_16:
+		if ((cdb[1] & 0x1f) != SCSI_SAI_READ_CAPACITY_16)
+			goto invalid;
+		scsi_read_capacity(sdev, req, cdb);
+		break;
+	case SCSI_REPORT_LUNS:
+		scsi_report_luns(req, cdb);
+		break;
+	case SCSI_SYNCHRONIZE_CACHE_10:
+	case SCSI_SYNCHRONIZE_CACHE_16:
+		req->stats_op = DISK_STATS_FLUSH;
+		if (disk_image__flush(sdev->disk) < 0)
+			scsi_req_sense(req, SCSI_SENSE_MEDIUM_ERROR,
+				       SCSI_ASC_WRITE_ERROR);
+		break;
+	case SCSI_UNMAP:
+		scsi_unmap(sdev, req, cdb);
+		break;
+	case SCSI_WRITE_SAME_10:
+	case SCSI_WRITE_SAME_16:
+		scsi_write_same(sdev, req, cdb);
+		break;
+	case SCSI_READ_6:
+	case SCSI_READ_10:
+	case SCSI_READ_12:
+	case SCSI_READ_16:
+	case SCSI_WRITE_6:
+	case SCSI_WRITE_10:
+	case SCSI_WRITE_12:
+	case SCSI_WRITE_16:
+		return scsi_read_write(sdev, req, cdb);
+	default:
+	invalid:
+		scsi_req_sense(req, SCSI_SENSE_ILLEGAL_REQUEST,
+			       SCSI_ASC_INVALID_OPCODE);
+		break;
+	}
+
+	return false;
+}
+
+static void virtio_scsi_do_cmd(struct scsi_dev *sdev, struct virt_queue *vq,
+			       struct scsi_dev_req *req)
+{
+	struct virtio_scsi_cmd_req cmd;
+	struct iovec *in_iov = req->iov + req->out;
+	size_t out_len = iov_size(req->iov, req->out);
+	size_t in_len = iov_size(in_iov, req->in);
+	size_t len;
+	bool present;
+	u16 lun;
+	int i;
+
+	req->resp = (struct virtio_scsi_cmd_resp) {};
+	req->stats_op = DISK_STATS_NR_OPS;
+	req->start = disk_stats__now();
+
+	/* The response has to fit in the first few in descriptors */
+	for (i = 0, len = 0; i < req->in && len < sizeof(req->resp); i++)
+		len += in_iov[i].iov_len;
+	if (len < sizeof(req->resp) || i > VIRTIO_SCSI_RESP_IOVS ||
+	    memcpy_fromiovecend((void *)&cmd, req->iov, 0,
+				min(out_len, sizeof(cmd))) ||
+	    out_len < sizeof(cmd)) {
+		pr_warning("virtio-scsi: malformed request");
+		virt_queue__set_used_elem(vq, req->head, 0);
+		return;
+	}
+	iovec_window(req->resp_iov, in_iov, i, 0, sizeof(req->resp));
+
+	/* A request only moves data one way, without VIRTIO_SCSI_F_INOUT */
+	req->write = out_len > sizeof(cmd);
+	if (req->write) {
+		req->data_len = out_len - sizeof(cmd);
+		req->data = req->iov;
+		req->data_cnt = iovec_window(req->data, req->iov, req->out,
+					     sizeof(cmd), req->data_len);
+	} else {
+		req->data_len = in_len - sizeof(req->resp);
+		req->data = in_iov;
+		req->data_cnt = iovec_window(req->data, in_iov, req->in,
+					     sizeof(req->resp), req->data_len);
+	}
+	req->resp.resid = req->data_len;
+
+	/* Single level LUN structure: 1, target, LUN */
+	lun = scsi_get_be16(cmd.lun + 2) & 0x3fff;
+	if (cmd.lun[0] != 1 || cmd.lun[1] != 0) {
+		req->resp.response = VIRTIO_SCSI_S_BAD_TARGET;
+		virtio_scsi_complete(req, 0);
+		return;
+	}
+
+	present = lun == 0;
+	if (!scsi_execute(sdev, req, cmd.cdb, present)) {
+		/* Writes that didn't reach the disk transferred nothing */
+		if (req->write && req->resp.status == SCSI_STATUS_GOOD)
+			req->resp.resid = 0;
+		virtio_scsi_complete(req, 0);
+	}
+}
+
+static void virtio_scsi_do_io(struct kvm *kvm, struct scsi_dev_queue *queue)
+{
+	struct scsi_dev *sdev = queue->sdev;
+	struct virt_queue *vq = &sdev->vqs[queue->id];
+	struct disk_plug plug;
+	struct scsi_dev_req *req;
+	u16 head;
+
+	virtio_poll__woken(&queue->poll);
+
+	do {
+		virt_queue__disable_notify(vq);
+		disk_image__plug(sdev->disk, &plug);
+		while (virt_queue__available(vq)) {
+			head		= virt_queue__pop(vq);
+			req		= &queue->reqs[head];
+			req->head	= virt_queue__get_head_iov(vq, req->iov,
+						&req->out, &req->in, head, kvm);
+
+			virtio_scsi_do_cmd(sdev, vq, req);
+		}
+		disk_image__unplug(&plug);
+	} while (virtio_poll__spin(&queue->poll, vq) ||
+		 virt_queue__enable_notify(vq));
+}
+
+static void *virtio_scsi_thread(void *p)
+{
+	struct scsi_dev_queue *queue = p;
+	u64 data;
+	int r;
+
+	kvm__set_thread_name("virtio-scsi-io");
+
+	while (1) {
+		r = read(queue->io_efd, &data, sizeof(u64));
+		if (r < 0)
+			continue;
+		virtio_scsi_do_io(queue->sdev->kvm, queue);
+	}
+
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/*
+ * Task management functions. Commands are never queued in the target, so
+ * once the disk is idle there is nothing left to abort or reset.
+ */
+static void virtio_scsi_do_ctrl(struct kvm *kvm, struct scsi_dev *sdev)
+{
+	struct virt_queue *vq = &sdev->vqs[0];
+	struct iovec iov[VIRTIO_SCSI_QUEUE_SIZE];
+	union {
+		struct virtio_scsi_ctrl_tmf_req tmf;
+		struct virtio_scsi_ctrl_an_req an;
+	} ctrl_req;
+	union {
+		struct virtio_scsi_ctrl_tmf_resp tmf;
+		struct virtio_scsi_ctrl_an_resp an;
+	} ctrl_resp;
+	u16 out, in, head;
+	size_t len;
+	u32 type;
+
+	mutex_lock(&sdev->ctrl_lock);
+	while (virt_queue__available(vq)) {
+		head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+
+		memset(&ctrl_req, 0, sizeof(ctrl_req));
+		memset(&ctrl_resp, 0, sizeof(ctrl_resp));
+		memcpy_fromiovecend((void *)&ctrl_req, iov, 0,
+				    min(iov_size(iov, out), sizeof(ctrl_req)));
+		type = virtio_guest_to_host_u32(vq->endian, ctrl_req.tmf.type);
+
+		switch (type) {
+		case VIRTIO_SCSI_T_TMF:
+			switch (virtio_guest_to_host_u32(vq->endian,
+							 ctrl_req.tmf.subtype)) {
+			case VIRTIO_SCSI_T_TMF_ABORT_TASK:
+			case VIRTIO_SCSI_T_TMF_ABORT_TASK_SET:
+			case VIRTIO_SCSI_T_TMF_CLEAR_TASK_SET:
+			case VIRTIO_SCSI_T_TMF_I_T_NEXUS_RESET:
+			case VIRTIO_SCSI_T_TMF_LOGICAL_UNIT_RESET:
+				disk_image__wait(sdev->disk);
+				ctrl_resp.tmf.response = VIRTIO_SCSI_S_FUNCTION_SUCCEEDED;
+				break;
+			default:
+				ctrl_resp.tmf.response = VIRTIO_SCSI_S_FUNCTION_REJECTED;
+				break;
+			}
+			len = sizeof(ctrl_resp.tmf);
+			break;
+		case VIRTIO_SCSI_T_AN_QUERY:
+		case VIRTIO_SCSI_T_AN_SUBSCRIBE:
+			/* No asynchronous events */
+			ctrl_resp.an.response = VIRTIO_SCSI_S_OK;
+			len = sizeof(ctrl_resp.an);
+			break;
+		default:
+			ctrl_resp.tmf.response = VIRTIO_SCSI_S_FAILURE;
+			len = sizeof(ctrl_resp.tmf);
+			break;
+		}
+
+		len = min(len, iov_size(iov + out, in));
+		memcpy_toiovec(iov + out, (void *)&ctrl_resp, len);
+		virt_queue__set_used_elem(vq, head, len);
+	}
+	mutex_unlock(&sdev->ctrl_lock);
+
+	if (virtio_queue__should_signal(vq))
+		sdev->vdev.ops->signal_vq(kvm, &sdev->vdev, 0);
+}
+
 static u8 *get_config(struct kvm *kvm, void *dev)
 {
 	struct scsi_dev *sdev = dev;
@@ -50,6 +902,11 @@ static u64 get_host_features(struct kvm *kvm, void *dev)
 	u64 features;
 	struct scsi_dev *sdev = dev;
 
+	if (!sdev->vdev.use_vhost)
+		return 1ULL << VIRTIO_RING_F_EVENT_IDX |
+		       1ULL << VIRTIO_RING_F_INDIRECT_DESC |
+		       1ULL << VIRTIO_F_ANY_LAYOUT;
+
 	r = ioctl(sdev->vhost_fd, VHOST_GET_FEATURES, &features);
 	if (r != 0)
 		die_perror("VHOST_GET_FEATURES failed");
@@ -68,7 +925,7 @@ static void notify_status(struct kvm *kvm, void *dev, u32 status)
 	struct virtio_scsi_config *conf = &sdev->config;
 	u16 endian = vdev->endian;
 
-	if (status & VIRTIO__STATUS_START) {
+	if (vdev->use_vhost && status & VIRTIO__STATUS_START) {
 		r = virtio_vhost_set_features(sdev->vhost_fd, sdev->vdev.features);
 		if (r != 0)
 			die_perror("VHOST_SET_FEATURES failed");
@@ -82,15 +939,67 @@ static void notify_status(struct kvm *kvm, void *dev, u32 status)
 	if (!(status & VIRTIO__STATUS_CONFIG))
 		return;
 
-	conf->num_queues = virtio_host_to_guest_u32(endian, NUM_VIRT_QUEUES - 2);
+	conf->num_queues = virtio_host_to_guest_u32(endian, sdev->nr_queues);
+	conf->sense_size = virtio_host_to_guest_u32(endian, VIRTIO_SCSI_SENSE_SIZE);
+	conf->cdb_size = virtio_host_to_guest_u32(endian, VIRTIO_SCSI_CDB_SIZE);
+	conf->event_info_size = virtio_host_to_guest_u32(endian, sizeof(struct virtio_scsi_event));
+
+	if (!vdev->use_vhost) {
+		/* A single disk at target 0, LUN 0 */
+		conf->seg_max = virtio_host_to_guest_u32(endian, VIRTIO_SCSI_SEG_MAX);
+		conf->max_sectors = virtio_host_to_guest_u32(endian,
+						VIRTIO_SCSI_MAX_SECTORS);
+		conf->cmd_per_lun = virtio_host_to_guest_u32(endian,
+						VIRTIO_SCSI_QUEUE_SIZE);
+		conf->max_target = 0;
+		conf->max_lun = 0;
+		return;
+	}
+
 	conf->seg_max = virtio_host_to_guest_u32(endian, VIRTIO_SCSI_CDB_SIZE - 2);
 	conf->max_sectors = virtio_host_to_guest_u32(endian, 65535);
 	conf->cmd_per_lun = virtio_host_to_guest_u32(endian, 128);
-	conf->sense_size = virtio_host_to_guest_u32(endian, VIRTIO_SCSI_SENSE_SIZE);
-	conf->cdb_size = virtio_host_to_guest_u32(endian, VIRTIO_SCSI_CDB_SIZE);
 	conf->max_target = virtio_host_to_guest_u16(endian, 255);
 	conf->max_lun = virtio_host_to_guest_u32(endian, 16383);
-	conf->event_info_size = virtio_host_to_guest_u32(endian, sizeof(struct virtio_scsi_event));
+}
+
+static int init_req_vq(struct kvm *kvm, struct scsi_dev *sdev, u32 vq)
+{
+	struct scsi_dev_queue *queue = &sdev->queues[vq - VIRTIO_SCSI_FIRST_REQ_VQ];
+	unsigned int i;
+	int r;
+
+	virt_queue__batch_begin(&queue->batch, &sdev->vqs[vq]);
+
+	queue->reqs = calloc(VIRTIO_SCSI_QUEUE_SIZE, sizeof(*queue->reqs));
+	if (!queue->reqs)
+		return -ENOMEM;
+
+	for (i = 0; i < VIRTIO_SCSI_QUEUE_SIZE; i++)
+		queue->reqs[i].queue = queue;
+
+	queue->id = vq;
+	queue->sdev = sdev;
+	mutex_init(&queue->mutex);
+	virtio_poll__init(&queue->poll, sdev->disk->poll_us);
+	queue->io_efd = eventfd(0, 0);
+	if (queue->io_efd < 0) {
+		r = -errno;
+		goto err_free_reqs;
+	}
+
+	r = -kvm__start_device_thread(&queue->io_thread, virtio_scsi_thread, queue);
+	if (r)
+		goto err_close_efd;
+
+	return 0;
+
+err_close_efd:
+	close(queue->io_efd);
+err_free_reqs:
+	free(queue->reqs);
+	queue->reqs = NULL;
+	return r;
 }
 
 static int init_vq(struct kvm *kvm, void *dev, u32 vq)
@@ -104,18 +1013,48 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 
 	virtio_init_device_vq(kvm, &sdev->vdev, queue, VIRTIO_SCSI_QUEUE_SIZE);
 
-	if (sdev->vhost_fd == 0)
-		return 0;
+	if (!sdev->vdev.use_vhost) {
+		if (vq < VIRTIO_SCSI_FIRST_REQ_VQ)
+			return 0;
+		return init_req_vq(kvm, sdev, vq);
+	}
 
+	/* Request queues don't wait on each other in the kernel either */
+	if (vq >= VIRTIO_SCSI_FIRST_REQ_VQ)
+		virtio_vhost_set_vring_worker(&sdev->vdev, sdev->vhost_fd, vq,
+					      vq);
 	virtio_vhost_set_vring(kvm, sdev->vhost_fd, vq, queue);
 	return 0;
 }
 
+static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct scsi_dev *sdev = dev;
+	struct scsi_dev_queue *queue;
+
+	if (sdev->vdev.use_vhost || vq < VIRTIO_SCSI_FIRST_REQ_VQ)
+		return;
+
+	queue = &sdev->queues[vq - VIRTIO_SCSI_FIRST_REQ_VQ];
+	if (!queue->reqs)
+		return;
+
+	close(queue->io_efd);
+	pthread_cancel(queue->io_thread);
+	pthread_join(queue->io_thread, NULL);
+
+	/* In-flight requests still point into queue->reqs */
+	disk_image__wait(sdev->disk);
+
+	free(queue->reqs);
+	queue->reqs = NULL;
+}
+
 static void notify_vq_gsi(struct kvm *kvm, void *dev, u32 vq, u32 gsi)
 {
 	struct scsi_dev *sdev = dev;
 
-	if (sdev->vhost_fd == 0)
+	if (!sdev->vdev.use_vhost)
 		return;
 
 	virtio_vhost_set_vring_irqfd(kvm, gsi, &sdev->vqs[vq]);
@@ -125,7 +1064,7 @@ static void notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd)
 {
 	struct scsi_dev *sdev = dev;
 
-	if (sdev->vhost_fd == 0)
+	if (!sdev->vdev.use_vhost)
 		return;
 
 	virtio_vhost_set_vring_kick(kvm, sdev->vhost_fd, vq, efd);
@@ -133,6 +1072,20 @@ static void notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd)
 
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
 {
+	struct scsi_dev *sdev = dev;
+	u64 data = 1;
+
+	if (sdev->vdev.use_vhost)
+		return 0;
+
+	/* The event queue only holds buffers for events we never send */
+	if (vq == 0)
+		virtio_scsi_do_ctrl(kvm, sdev);
+	else if (vq >= VIRTIO_SCSI_FIRST_REQ_VQ &&
+		 write(sdev->queues[vq - VIRTIO_SCSI_FIRST_REQ_VQ].io_efd,
+		       &data, sizeof(data)) < 0)
+		return -errno;
+
 	return 0;
 }
 
@@ -155,7 +1108,9 @@ static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
 
 static unsigned int get_vq_count(struct kvm *kvm, void *dev)
 {
-	return NUM_VIRT_QUEUES;
+	struct scsi_dev *sdev = dev;
+
+	return VIRTIO_SCSI_FIRST_REQ_VQ + sdev->nr_queues;
 }
 
 static struct virtio_ops scsi_dev_virtio_ops = {
@@ -163,6 +1118,7 @@ static struct virtio_ops scsi_dev_virtio_ops = {
 	.get_config_size	= get_config_size,
 	.get_host_features	= get_host_features,
 	.init_vq		= init_vq,
+	.exit_vq		= exit_vq,
 	.get_vq			= get_vq,
 	.get_size_vq		= get_size_vq,
 	.set_size_vq		= set_size_vq,
@@ -184,6 +1140,16 @@ static void virtio_scsi_vhost_init(struct kvm *kvm, struct scsi_dev *sdev)
 	sdev->vdev.use_vhost = true;
 }
 
+/* By default, give each vCPU its own request queue, like virtio-blk */
+static u32 virtio_scsi_nr_queues(struct kvm *kvm, struct disk_image *disk)
+{
+	int nr = disk->nr_queues;
+
+	if (nr <= 0)
+		nr = kvm->cfg.nrcpus;
+
+	return max(1, min(VIRTIO_SCSI_MAX_QUEUES, nr));
+}
 
 static int virtio_scsi_init_one(struct kvm *kvm, struct disk_image *disk)
 {
@@ -199,9 +1165,20 @@ static int virtio_scsi_init_one(struct kvm *kvm, struct disk_image *disk)
 
 	*sdev = (struct scsi_dev) {
 		.kvm			= kvm,
+		.nr_queues		= virtio_scsi_nr_queues(kvm, disk),
 	};
-	strlcpy((char *)&sdev->target.vhost_wwpn, disk->wwpn, sizeof(sdev->target.vhost_wwpn));
-	sdev->target.abi_version = VHOST_SCSI_ABI_VERSION;
+
+	if (disk->wwpn) {
+		strlcpy((char *)&sdev->target.vhost_wwpn, disk->wwpn,
+			sizeof(sdev->target.vhost_wwpn));
+		sdev->target.abi_version = VHOST_SCSI_ABI_VERSION;
+	} else {
+		sdev->disk = disk;
+		sdev->block_size = max_t(u32, disk_direct__block_size(disk),
+					 SECTOR_SIZE);
+		sdev->nr_blocks = disk->size / sdev->block_size;
+		mutex_init(&sdev->ctrl_lock);
+	}
 
 	list_add_tail(&sdev->list, &sdevs);
 
@@ -211,7 +1188,13 @@ static int virtio_scsi_init_one(struct kvm *kvm, struct disk_image *disk)
 	if (r < 0)
 		return r;
 
-	virtio_scsi_vhost_init(kvm, sdev);
+	if (disk->wwpn) {
+		virtio_scsi_vhost_init(kvm, sdev);
+	} else {
+		disk_image__set_callback(disk, virtio_scsi_complete);
+		disk_image__set_batch_callback(disk, virtio_scsi_complete_batch,
+					       sdev);
+	}
 
 	if (compat_id == -1)
 		compat_id = virtio_compat_add_message("virtio-scsi", "CONFIG_SCSI_VIRTIO");
@@ -223,9 +1206,13 @@ static int virtio_scsi_exit_one(struct kvm *kvm, struct scsi_dev *sdev)
 {
 	int r;
 
-	r = ioctl(sdev->vhost_fd, VHOST_SCSI_CLEAR_ENDPOINT, &sdev->target);
-	if (r != 0)
-		die("VHOST_SCSI_CLEAR_ENDPOINT failed %d", errno);
+	if (sdev->vdev.use_vhost) {
+		r = ioctl(sdev->vhost_fd, VHOST_SCSI_CLEAR_ENDPOINT, &sdev->target);
+		if (r != 0)
+			die("VHOST_SCSI_CLEAR_ENDPOINT failed %d", errno);
+	} else {
+		virtio_exit(kvm, &sdev->vdev);
+	}
 
 	list_del(&sdev->list);
 	free(sdev);
@@ -238,7 +1225,7 @@ int virtio_scsi_init(struct kvm *kvm)
 	int i, r = 0;
 
 	for (i = 0; i < kvm->nr_disks; i++) {
-		if (!kvm->disks[i]->wwpn)
+		if (!kvm->disks[i]->wwpn && !kvm->disks[i]->scsi)
 			continue;
 		r = virtio_scsi_init_one(kvm, kvm->disks[i]);
 		if (r < 0)
@@ -0,0 +1,511 @@
+#include "kvm/virtio-vdpa.h"
+#include "kvm/virtio-pci-dev.h"
+#include "kvm/virtio-pci.h"
+#include "kvm/virtio.h"
+#include "kvm/snapshot.h"
+#include "kvm/epoll.h"
+#include "kvm/util.h"
+#include "kvm/kvm.h"
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/vhost.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_ids.h>
+#include <linux/virtio_ring.h>
+
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define PCI_CLASS_VDPA			0xff0000
+
+/*
+ * The transport features that hold without kvmtool looking at the rings.
+ * Packed rings would need their wrap counters in VHOST_SET_VRING_BASE, and
+ * notification data is lost in the ioeventfd.
+ */
+#define VDPA_TRANSPORT_FEATURES			\
+	(1ULL << VIRTIO_RING_F_INDIRECT_DESC |	\
+	 1ULL << VIRTIO_RING_F_EVENT_IDX |	\
+	 1ULL << VIRTIO_F_VERSION_1 |		\
+	 1ULL << VIRTIO_F_IN_ORDER |		\
+	 1ULL << VIRTIO_F_ORDER_PLATFORM)
+
+/*
+ * A virtio device of the host, which kvmtool only sets up: the guest kicks
+ * it through ioeventfds and it interrupts the guest through irqfds, the
+ * config space and the status are forwarded to it.
+ */
+struct vdpa_dev {
+	struct list_head		list;
+	struct virtio_device		vdev;
+	const char			*path;
+	int				fd;
+	u32				device_id;
+	u64				features;
+	u32				nr_vqs;
+	u32				max_queue_size;
+	struct virt_queue		*vqs;
+	u32				*queue_sizes;
+	/* What the device was last told */
+	u8				status;
+
+	u32				config_size;
+	/* The config follows the header */
+	struct vhost_vdpa_config	*config;
+	int				config_fd;
+	struct kvm__epoll		config_epoll;
+};
+
+static LIST_HEAD(vdpa_devs);
+
+static u8 *get_config(struct kvm *kvm, void *dev)
+{
+	struct vdpa_dev *vdpa = dev;
+
+	/* The device changes it on its own, the link status for one */
+	vdpa->config->off = 0;
+	vdpa->config->len = vdpa->config_size;
+	if (ioctl(vdpa->fd, VHOST_VDPA_GET_CONFIG, vdpa->config) < 0)
+		pr_warning("%s: VHOST_VDPA_GET_CONFIG failed: %s", vdpa->path,
+			   strerror(errno));
+
+	return vdpa->config->buf;
+}
+
+static size_t get_config_size(struct kvm *kvm, void *dev)
+{
+	struct vdpa_dev *vdpa = dev;
+
+	return vdpa->config_size;
+}
+
+static void set_config(struct kvm *kvm, void *dev, u32 offset, u32 size)
+{
+	struct vdpa_dev *vdpa = dev;
+	struct vhost_vdpa_config *config;
+
+	config = malloc(sizeof(*config) + size);
+	if (!config) {
+		pr_warning("%s: dropping a config write", vdpa->path);
+		return;
+	}
+
+	config->off = offset;
+	config->len = size;
+	memcpy(config->buf, vdpa->config->buf + offset, size);
+	if (ioctl(vdpa->fd, VHOST_VDPA_SET_CONFIG, config) < 0)
+		pr_warning("%s: VHOST_VDPA_SET_CONFIG failed: %s", vdpa->path,
+			   strerror(errno));
+
+	free(config);
+}
+
+static u64 get_host_features(struct kvm *kvm, void *dev)
+{
+	struct vdpa_dev *vdpa = dev;
+	u64 transport = ~0ULL << VIRTIO_TRANSPORT_F_START &
+			~(~0ULL << (VIRTIO_TRANSPORT_F_END + 1));
+
+	/* ACCESS_PLATFORM is for the device, guest addresses are its IOVAs */
+	return vdpa->features & (~transport | VDPA_TRANSPORT_FEATURES);
+}
+
+static void notify_status(struct kvm *kvm, void *dev, u32 status)
+{
+	struct vdpa_dev *vdpa = dev;
+	u8 dev_status = status & VIRTIO_CONFIG_S_MASK;
+	u64 features;
+
+	if (dev_status == vdpa->status)
+		return;
+
+	/* The device checks the features when it gets FEATURES_OK */
+	if ((dev_status & VIRTIO_CONFIG_S_FEATURES_OK) &&
+	    !(vdpa->status & VIRTIO_CONFIG_S_FEATURES_OK)) {
+		features = vdpa->vdev.features |
+			   (vdpa->features & (1ULL << VIRTIO_F_ACCESS_PLATFORM));
+		if (ioctl(vdpa->fd, VHOST_SET_FEATURES, &features) < 0)
+			die_perror("VHOST_SET_FEATURES failed");
+	}
+
+	/* Zero resets the device, and the IOTLB stays */
+	if (ioctl(vdpa->fd, VHOST_VDPA_SET_STATUS, &dev_status) < 0)
+		die_perror("VHOST_VDPA_SET_STATUS failed");
+	vdpa->status = dev_status;
+
+	if (!(dev_status & VIRTIO_CONFIG_S_FEATURES_OK))
+		return;
+
+	if (ioctl(vdpa->fd, VHOST_VDPA_GET_STATUS, &dev_status) < 0 ||
+	    !(dev_status & VIRTIO_CONFIG_S_FEATURES_OK))
+		pr_warning("%s: the device refused features 0x%llx", vdpa->path,
+			   (unsigned long long)vdpa->vdev.features);
+}
+
+static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct vdpa_dev *vdpa = dev;
+
+	return virtio_vq__max_size(&vdpa->vdev, vdpa->max_queue_size);
+}
+
+static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
+{
+	struct vdpa_dev *vdpa = dev;
+
+	vdpa->queue_sizes[vq] = virtio_vq__accept_size(&vdpa->vdev,
+				get_size_vq(kvm, dev, vq), size);
+
+	return vdpa->queue_sizes[vq];
+}
+
+static int init_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct vdpa_dev *vdpa = dev;
+	struct virt_queue *queue = &vdpa->vqs[vq];
+	struct vhost_vring_state state = {
+		.index	= vq,
+		.num	= 1,
+	};
+	u32 size = vdpa->queue_sizes[vq];
+
+	if (!size)
+		size = get_size_vq(kvm, dev, vq);
+
+	virtio_init_device_vq(kvm, &vdpa->vdev, queue, size);
+	virtio_vhost_set_vring_iova(kvm, vdpa->fd, vq, queue);
+
+	if (ioctl(vdpa->fd, VHOST_VDPA_SET_VRING_ENABLE, &state) < 0)
+		die_perror("VHOST_VDPA_SET_VRING_ENABLE failed");
+
+	return 0;
+}
+
+static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct vdpa_dev *vdpa = dev;
+
+	/* The device reset that follows disables the vring */
+	virtio_vhost_reset_vring(kvm, vdpa->fd, vq, &vdpa->vqs[vq]);
+	vdpa->queue_sizes[vq] = 0;
+}
+
+static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	/* The device gets the kicks from the ioeventfd */
+	return 0;
+}
+
+static void notify_vq_gsi(struct kvm *kvm, void *dev, u32 vq, u32 gsi)
+{
+	struct vdpa_dev *vdpa = dev;
+
+	virtio_vhost_set_vring_irqfd(kvm, gsi, &vdpa->vqs[vq]);
+}
+
+static void notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd)
+{
+	struct vdpa_dev *vdpa = dev;
+
+	virtio_vhost_set_vring_kick(kvm, vdpa->fd, vq, efd);
+}
+
+static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct vdpa_dev *vdpa = dev;
+
+	return &vdpa->vqs[vq];
+}
+
+static unsigned int get_vq_count(struct kvm *kvm, void *dev)
+{
+	struct vdpa_dev *vdpa = dev;
+
+	return vdpa->nr_vqs;
+}
+
+static struct virtio_ops vdpa_dev_virtio_ops = {
+	.get_config		= get_config,
+	.get_config_size	= get_config_size,
+	.set_config		= set_config,
+	.get_host_features	= get_host_features,
+	.get_vq_count		= get_vq_count,
+	.init_vq		= init_vq,
+	.exit_vq		= exit_vq,
+	.notify_vq		= notify_vq,
+	.get_vq			= get_vq,
+	.get_size_vq		= get_size_vq,
+	.set_size_vq		= set_size_vq,
+	.notify_vq_gsi		= notify_vq_gsi,
+	.notify_vq_eventfd	= notify_vq_eventfd,
+	.notify_status		= notify_status,
+};
+
+static int virtio_vdpa__send_iotlb(struct vdpa_dev *vdpa, u8 type, u64 iova,
+				   u64 size, void *uaddr, u8 perm)
+{
+	struct vhost_msg_v2 msg = {
+		.type	= VHOST_IOTLB_MSG_V2,
+		.iotlb	= {
+			.iova	= iova,
+			.size	= size,
+			.uaddr	= (u64)(unsigned long)uaddr,
+			.perm	= perm,
+			.type	= type,
+		},
+	};
+
+	if (write(vdpa->fd, &msg, sizeof(msg)) != sizeof(msg))
+		return -errno;
+
+	return 0;
+}
+
+/* The guest puts guest physical addresses in the rings, they are the IOVAs */
+static int virtio_vdpa__map_bank(struct kvm *kvm, struct kvm_mem_bank *bank,
+				 void *data)
+{
+	struct vdpa_dev *vdpa = data;
+	u8 perm = bank->type & KVM_MEM_TYPE_READONLY ? VHOST_ACCESS_RO :
+						       VHOST_ACCESS_RW;
+
+	return virtio_vdpa__send_iotlb(vdpa, VHOST_IOTLB_UPDATE,
+				       bank->guest_phys_addr, bank->size,
+				       bank->host_addr, perm);
+}
+
+static void virtio_vdpa__map_ram(struct kvm *kvm, struct vdpa_dev *vdpa,
+				 u64 backend_features)
+{
+	bool batch = backend_features & (1ULL << VHOST_BACKEND_F_IOTLB_BATCH);
+	int r;
+
+	/* With batches, the device updates its mappings once */
+	if (batch && virtio_vdpa__send_iotlb(vdpa, VHOST_IOTLB_BATCH_BEGIN,
+					     0, 0, NULL, 0))
+		die_perror("VHOST_IOTLB_BATCH_BEGIN failed");
+
+	r = kvm__for_each_mem_bank(kvm, KVM_MEM_TYPE_RAM, virtio_vdpa__map_bank,
+				   vdpa);
+	if (r < 0)
+		die("%s: unable to map guest RAM: %s", vdpa->path, strerror(-r));
+
+	if (batch && virtio_vdpa__send_iotlb(vdpa, VHOST_IOTLB_BATCH_END,
+					     0, 0, NULL, 0))
+		die_perror("VHOST_IOTLB_BATCH_END failed");
+}
+
+static void virtio_vdpa__config_event(struct kvm *kvm, struct epoll_event *ev)
+{
+	struct vdpa_dev *vdpa = ev->data.ptr;
+	u64 tmp;
+
+	if (read(vdpa->config_fd, &tmp, sizeof(tmp)) < 0)
+		return;
+
+	vdpa->vdev.ops->signal_config(kvm, &vdpa->vdev);
+}
+
+/* Without a config interrupt, the guest still sees changes when it reads */
+static void virtio_vdpa__init_config_call(struct kvm *kvm,
+					  struct vdpa_dev *vdpa)
+{
+	struct epoll_event ev = {
+		.events		= EPOLLIN,
+		.data.ptr	= vdpa,
+	};
+	int fd;
+
+	fd = eventfd(0, EFD_CLOEXEC);
+	if (fd < 0)
+		die_perror("eventfd()");
+
+	if (ioctl(vdpa->fd, VHOST_VDPA_SET_CONFIG_CALL, &fd) < 0) {
+		pr_debug("%s: no config interrupt: %s", vdpa->path,
+			 strerror(errno));
+		close(fd);
+		return;
+	}
+
+	if (epoll__init(kvm, &vdpa->config_epoll, "vdpa-config",
+			virtio_vdpa__config_event) < 0)
+		die("Unable to start the vDPA config thread");
+
+	vdpa->config_fd = fd;
+	if (epoll_ctl(vdpa->config_epoll.fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		die_perror("EPOLL_CTL_ADD vDPA config fd");
+}
+
+static void virtio_vdpa__get(struct vdpa_dev *vdpa, unsigned long request,
+			     const char *name, void *val)
+{
+	if (ioctl(vdpa->fd, request, val) < 0)
+		die("%s: %s failed: %s", vdpa->path, name, strerror(errno));
+}
+
+static int virtio_vdpa__init_one(struct kvm *kvm, struct vdpa_dev *vdpa,
+				 enum virtio_trans trans)
+{
+	u64 backend_features;
+	u16 max_queue_size;
+	int device_id, class;
+	u8 status = 0;
+	int r;
+
+	vdpa->fd = open(vdpa->path, O_RDWR | O_CLOEXEC);
+	if (vdpa->fd < 0)
+		die("Unable to open %s: %s", vdpa->path, strerror(errno));
+
+	if (ioctl(vdpa->fd, VHOST_SET_OWNER) < 0)
+		die_perror("VHOST_SET_OWNER failed");
+
+	virtio_vdpa__get(vdpa, VHOST_GET_BACKEND_FEATURES,
+			 "VHOST_GET_BACKEND_FEATURES", &backend_features);
+	if (!(backend_features & (1ULL << VHOST_BACKEND_F_IOTLB_MSG_V2)))
+		die("%s: the device doesn't take IOTLB v2 messages", vdpa->path);
+	backend_features &= 1ULL << VHOST_BACKEND_F_IOTLB_MSG_V2 |
+			    1ULL << VHOST_BACKEND_F_IOTLB_BATCH;
+	if (ioctl(vdpa->fd, VHOST_SET_BACKEND_FEATURES, &backend_features) < 0)
+		die_perror("VHOST_SET_BACKEND_FEATURES failed");
+
+	virtio_vdpa__get(vdpa, VHOST_VDPA_GET_DEVICE_ID,
+			 "VHOST_VDPA_GET_DEVICE_ID", &vdpa->device_id);
+	virtio_vdpa__get(vdpa, VHOST_GET_FEATURES, "VHOST_GET_FEATURES",
+			 &vdpa->features);
+	virtio_vdpa__get(vdpa, VHOST_VDPA_GET_VQS_COUNT,
+			 "VHOST_VDPA_GET_VQS_COUNT", &vdpa->nr_vqs);
+	virtio_vdpa__get(vdpa, VHOST_VDPA_GET_VRING_NUM,
+			 "VHOST_VDPA_GET_VRING_NUM", &max_queue_size);
+	virtio_vdpa__get(vdpa, VHOST_VDPA_GET_CONFIG_SIZE,
+			 "VHOST_VDPA_GET_CONFIG_SIZE", &vdpa->config_size);
+
+	if (!(vdpa->features & (1ULL << VIRTIO_F_VERSION_1)))
+		die("%s: legacy vDPA devices aren't supported", vdpa->path);
+	if (vdpa->nr_vqs > VIRTIO_PCI_MAX_VQ) {
+		pr_warning("%s: using %d of its %u virtqueues", vdpa->path,
+			   VIRTIO_PCI_MAX_VQ, vdpa->nr_vqs);
+		vdpa->nr_vqs = VIRTIO_PCI_MAX_VQ;
+	}
+	vdpa->max_queue_size = max_queue_size;
+
+	vdpa->vqs = calloc(vdpa->nr_vqs, sizeof(*vdpa->vqs));
+	vdpa->queue_sizes = calloc(vdpa->nr_vqs, sizeof(*vdpa->queue_sizes));
+	vdpa->config = calloc(1, sizeof(*vdpa->config) + vdpa->config_size);
+	if (!vdpa->vqs || !vdpa->queue_sizes || !vdpa->config)
+		return -ENOMEM;
+
+	/* Start from a clean device, whoever had it before */
+	if (ioctl(vdpa->fd, VHOST_VDPA_SET_STATUS, &status) < 0)
+		die_perror("VHOST_VDPA_SET_STATUS failed");
+
+	virtio_vdpa__map_ram(kvm, vdpa, backend_features);
+	virtio_vdpa__init_config_call(kvm, vdpa);
+
+	switch (vdpa->device_id) {
+	case VIRTIO_ID_NET:
+		class = PCI_CLASS_NET;
+		break;
+	case VIRTIO_ID_BLOCK:
+		class = PCI_CLASS_BLK;
+		break;
+	default:
+		class = PCI_CLASS_VDPA;
+	}
+	device_id = PCI_DEVICE_ID_VIRTIO_BASE + vdpa->device_id;
+
+	r = virtio_init(kvm, vdpa, &vdpa->vdev, &vdpa_dev_virtio_ops, trans,
+			device_id, vdpa->device_id, class);
+	if (r < 0)
+		return r;
+
+	/* The device polls the ioeventfds itself */
+	vdpa->vdev.use_vhost = true;
+
+	return 0;
+}
+
+int virtio_vdpa__register(struct kvm *kvm, const char *path)
+{
+	struct vdpa_dev *vdpa;
+
+	vdpa = calloc(1, sizeof(*vdpa));
+	if (!vdpa)
+		return -ENOMEM;
+
+	vdpa->path = path;
+	vdpa->fd = -1;
+	vdpa->config_fd = -1;
+	list_add_tail(&vdpa->list, &vdpa_devs);
+
+	return 0;
+}
+
+int virtio_vdpa_parser(const struct option *opt, const char *arg, int unset)
+{
+	struct kvm *kvm = opt->ptr;
+	char *path = strdup(arg);
+
+	if (!path || virtio_vdpa__register(kvm, path) < 0)
+		die("Failed adding vDPA device %s", arg);
+
+	return 0;
+}
+
+int virtio_vdpa__init(struct kvm *kvm)
+{
+	enum virtio_trans trans = kvm->cfg.virtio_transport;
+	struct vdpa_dev *vdpa;
+	int r;
+
+	if (list_empty(&vdpa_devs))
+		return 0;
+
+	/* The devices only do virtio 1.0 */
+	if (trans == VIRTIO_PCI_LEGACY)
+		trans = VIRTIO_PCI;
+	else if (trans == VIRTIO_MMIO_LEGACY)
+		trans = VIRTIO_MMIO;
+
+	/* Their state is in the host device */
+	snapshot__block("vhost-vdpa");
+
+	list_for_each_entry(vdpa, &vdpa_devs, list) {
+		r = virtio_vdpa__init_one(kvm, vdpa, trans);
+		if (r < 0) {
+			virtio_vdpa__exit(kvm);
+			return r;
+		}
+	}
+
+	return 0;
+}
+virtio_dev_init(virtio_vdpa__init);
+
+int virtio_vdpa__exit(struct kvm *kvm)
+{
+	struct vdpa_dev *vdpa, *next;
+
+	list_for_each_entry_safe(vdpa, next, &vdpa_devs, list) {
+		list_del(&vdpa->list);
+
+		if (vdpa->vdev.ops)
+			virtio_exit(kvm, &vdpa->vdev);
+		if (vdpa->config_fd >= 0) {
+			epoll__exit(&vdpa->config_epoll);
+			close(vdpa->config_fd);
+		}
+		if (vdpa->fd >= 0)
+			close(vdpa->fd);
+
+		free(vdpa->config);
+		free(vdpa->queue_sizes);
+		free(vdpa->vqs);
+		free(vdpa);
+	}
+
+	return 0;
+}
+virtio_dev_exit(virtio_vdpa__exit);
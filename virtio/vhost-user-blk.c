@@ -0,0 +1,269 @@
+#include "kvm/virtio-blk.h"
+
+#include "kvm/virtio-pci-dev.h"
+#include "kvm/disk-image.h"
+#include "kvm/vhost-user.h"
+#include "kvm/util.h"
+#include "kvm/kvm.h"
+#include "kvm/pci.h"
+#include "kvm/guest_compat.h"
+#include "kvm/virtio.h"
+
+#include <linux/virtio_ring.h>
+#include <linux/virtio_blk.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+
+/*
+ * A virtio-blk device whose requests are all handled by a vhost-user backend,
+ * such as an SPDK or qemu-storage-daemon target. kvmtool only provides the
+ * transport and forwards the configuration the backend reports.
+ */
+
+#define VHOST_USER_BLK_QUEUE_SIZE	256
+#define VHOST_USER_BLK_MAX_QUEUES	16
+
+/* Request types and limits that the backend may implement */
+#define VHOST_USER_BLK_FEATURES		(1ULL << VIRTIO_BLK_F_SIZE_MAX |	\
+					 1ULL << VIRTIO_BLK_F_SEG_MAX |		\
+					 1ULL << VIRTIO_BLK_F_GEOMETRY |	\
+					 1ULL << VIRTIO_BLK_F_RO |		\
+					 1ULL << VIRTIO_BLK_F_BLK_SIZE |	\
+					 1ULL << VIRTIO_BLK_F_FLUSH |		\
+					 1ULL << VIRTIO_BLK_F_TOPOLOGY |	\
+					 1ULL << VIRTIO_BLK_F_CONFIG_WCE |	\
+					 1ULL << VIRTIO_BLK_F_DISCARD |		\
+					 1ULL << VIRTIO_BLK_F_WRITE_ZEROES |	\
+					 1ULL << VIRTIO_RING_F_EVENT_IDX |	\
+					 1ULL << VIRTIO_RING_F_INDIRECT_DESC |	\
+					 1ULL << VIRTIO_F_ANY_LAYOUT)
+
+struct vhost_user_blk_dev {
+	struct list_head		list;
+
+	struct virtio_device		vdev;
+	struct virtio_blk_config	blk_config;
+
+	u32				nr_queues;
+	struct virt_queue		vqs[VHOST_USER_BLK_MAX_QUEUES];
+	bool				started[VHOST_USER_BLK_MAX_QUEUES];
+
+	struct vhost_user		*vu;
+	struct kvm			*kvm;
+};
+
+static LIST_HEAD(vbdevs);
+static int compat_id = -1;
+
+static u8 *get_config(struct kvm *kvm, void *dev)
+{
+	struct vhost_user_blk_dev *vbdev = dev;
+
+	return ((u8 *)(&vbdev->blk_config));
+}
+
+static size_t get_config_size(struct kvm *kvm, void *dev)
+{
+	struct vhost_user_blk_dev *vbdev = dev;
+
+	return sizeof(vbdev->blk_config);
+}
+
+static u64 get_host_features(struct kvm *kvm, void *dev)
+{
+	struct vhost_user_blk_dev *vbdev = dev;
+
+	return vhost_user__get_features(vbdev->vu) &
+		(VHOST_USER_BLK_FEATURES |
+		 (vbdev->nr_queues > 1 ? 1ULL << VIRTIO_BLK_F_MQ : 0));
+}
+
+static void notify_status(struct kvm *kvm, void *dev, u32 status)
+{
+	struct vhost_user_blk_dev *vbdev = dev;
+	struct virtio_blk_config *conf = &vbdev->blk_config;
+	u32 vq;
+
+	if (status & VIRTIO__STATUS_START) {
+		vhost_user__set_features(vbdev->vu, vbdev->vdev.features);
+
+		for (vq = 0; vq < vbdev->nr_queues; vq++) {
+			if (!vbdev->started[vq])
+				continue;
+
+			vhost_user__set_vring(kvm, vbdev->vu, vq, &vbdev->vqs[vq]);
+			if (vhost_user__set_vring_enable(vbdev->vu, vq, true))
+				die("Unable to enable vhost-user vring %u", vq);
+		}
+	}
+
+	if (!(status & VIRTIO__STATUS_CONFIG))
+		return;
+
+	conf->num_queues = virtio_host_to_guest_u16(vbdev->vdev.endian,
+						    vbdev->nr_queues);
+}
+
+static int init_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct vhost_user_blk_dev *vbdev = dev;
+
+	compat__remove_message(compat_id);
+
+	/* The backend gets the vrings once the driver is ready */
+	virtio_init_device_vq(kvm, &vbdev->vdev, &vbdev->vqs[vq],
+			      VHOST_USER_BLK_QUEUE_SIZE);
+	vbdev->started[vq] = true;
+
+	return 0;
+}
+
+static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct vhost_user_blk_dev *vbdev = dev;
+
+	vhost_user__reset_vring(kvm, vbdev->vu, vq, &vbdev->vqs[vq]);
+	vbdev->started[vq] = false;
+}
+
+static void notify_vq_gsi(struct kvm *kvm, void *dev, u32 vq, u32 gsi)
+{
+	struct vhost_user_blk_dev *vbdev = dev;
+
+	virtio_vhost_set_vring_irqfd(kvm, gsi, &vbdev->vqs[vq]);
+}
+
+static void notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd)
+{
+	struct vhost_user_blk_dev *vbdev = dev;
+
+	vhost_user__set_vring_kick(vbdev->vu, vq, efd);
+}
+
+static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	return 0;
+}
+
+static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	struct vhost_user_blk_dev *vbdev = dev;
+
+	return &vbdev->vqs[vq];
+}
+
+static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
+{
+	return VHOST_USER_BLK_QUEUE_SIZE;
+}
+
+static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
+{
+	return size;
+}
+
+static unsigned int get_vq_count(struct kvm *kvm, void *dev)
+{
+	struct vhost_user_blk_dev *vbdev = dev;
+
+	return vbdev->nr_queues;
+}
+
+static struct virtio_ops vhost_user_blk_dev_virtio_ops = {
+	.get_config		= get_config,
+	.get_config_size	= get_config_size,
+	.get_host_features	= get_host_features,
+	.get_vq_count		= get_vq_count,
+	.init_vq		= init_vq,
+	.exit_vq		= exit_vq,
+	.notify_status		= notify_status,
+	.notify_vq		= notify_vq,
+	.notify_vq_gsi		= notify_vq_gsi,
+	.notify_vq_eventfd	= notify_vq_eventfd,
+	.get_vq			= get_vq,
+	.get_size_vq		= get_size_vq,
+	.set_size_vq		= set_size_vq,
+};
+
+static int vhost_user_blk__init_one(struct kvm *kvm, struct disk_image *disk)
+{
+	struct vhost_user_blk_dev *vbdev;
+	u32 nr_queues;
+	int r;
+
+	vbdev = calloc(1, sizeof(*vbdev));
+	if (!vbdev)
+		return -ENOMEM;
+
+	vbdev->kvm = kvm;
+	vbdev->vu = vhost_user__new(kvm, disk->vhost_user);
+
+	r = vhost_user__get_config(vbdev->vu, &vbdev->blk_config,
+				   sizeof(vbdev->blk_config));
+	if (r < 0)
+		die("Unable to read the configuration of vhost-user-blk backend %s",
+		    disk->vhost_user);
+
+	/* As with virtio-blk, default to one request queue per vCPU */
+	nr_queues = disk->nr_queues ? disk->nr_queues : kvm->cfg.nrcpus;
+	nr_queues = min(nr_queues, vhost_user__get_queue_num(vbdev->vu));
+	vbdev->nr_queues = max(1U, min(nr_queues, (u32)VHOST_USER_BLK_MAX_QUEUES));
+
+	list_add_tail(&vbdev->list, &vbdevs);
+
+	r = virtio_init(kvm, vbdev, &vbdev->vdev, &vhost_user_blk_dev_virtio_ops,
+			kvm->cfg.virtio_transport, PCI_DEVICE_ID_VIRTIO_BLK,
+			VIRTIO_ID_BLOCK, PCI_CLASS_BLK);
+	if (r < 0)
+		return r;
+
+	vbdev->vdev.use_vhost = true;
+
+	if (compat_id == -1)
+		compat_id = virtio_compat_add_message("virtio-blk", "CONFIG_VIRTIO_BLK");
+
+	return 0;
+}
+
+static int vhost_user_blk__exit_one(struct kvm *kvm,
+				    struct vhost_user_blk_dev *vbdev)
+{
+	list_del(&vbdev->list);
+	virtio_exit(kvm, &vbdev->vdev);
+	vhost_user__free(vbdev->vu);
+	free(vbdev);
+
+	return 0;
+}
+
+int vhost_user_blk__init(struct kvm *kvm)
+{
+	int i, r = 0;
+
+	for (i = 0; i < kvm->nr_disks; i++) {
+		if (!kvm->disks[i]->vhost_user)
+			continue;
+		r = vhost_user_blk__init_one(kvm, kvm->disks[i]);
+		if (r < 0)
+			goto cleanup;
+	}
+
+	return 0;
+cleanup:
+	vhost_user_blk__exit(kvm);
+	return r;
+}
+virtio_dev_init(vhost_user_blk__init);
+
+int vhost_user_blk__exit(struct kvm *kvm)
+{
+	while (!list_empty(&vbdevs)) {
+		struct vhost_user_blk_dev *vbdev;
+
+		vbdev = list_first_entry(&vbdevs, struct vhost_user_blk_dev, list);
+		vhost_user_blk__exit_one(kvm, vbdev);
+	}
+
+	return 0;
+}
+virtio_dev_exit(vhost_user_blk__exit);
@@ -0,0 +1,536 @@
+#include "kvm/vhost-user.h"
+#include "kvm/read-write.h"
+#include "kvm/virtio.h"
+#include "kvm/mutex.h"
+#include "kvm/util.h"
+#include "kvm/kvm.h"
+
+#include <linux/kernel.h>
+#include <linux/vhost.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * Client side of the vhost-user protocol: the same vring setup as vhost, sent
+ * as messages over a unix socket to a backend running in another process.
+ * The backend maps guest RAM through file descriptors passed along with
+ * SET_MEM_TABLE, which is why guest RAM must be shared (kvm->cfg.mem_shared).
+ */
+
+#define VHOST_USER_GET_FEATURES			1
+#define VHOST_USER_SET_FEATURES			2
+#define VHOST_USER_SET_OWNER			3
+#define VHOST_USER_SET_MEM_TABLE		5
+#define VHOST_USER_SET_VRING_NUM		8
+#define VHOST_USER_SET_VRING_ADDR		9
+#define VHOST_USER_SET_VRING_BASE		10
+#define VHOST_USER_GET_VRING_BASE		11
+#define VHOST_USER_SET_VRING_KICK		12
+#define VHOST_USER_SET_VRING_CALL		13
+#define VHOST_USER_GET_PROTOCOL_FEATURES	15
+#define VHOST_USER_SET_PROTOCOL_FEATURES	16
+#define VHOST_USER_GET_QUEUE_NUM		17
+#define VHOST_USER_SET_VRING_ENABLE		18
+#define VHOST_USER_GET_CONFIG			24
+
+#define VHOST_USER_VERSION			0x1
+#define VHOST_USER_REPLY			0x4
+#define VHOST_USER_NEED_REPLY			0x8
+
+/* Feature bit saying that the backend speaks protocol features */
+#define VHOST_USER_F_PROTOCOL_FEATURES		30
+
+/* Payload flag of SET_VRING_KICK/CALL when no file descriptor is attached */
+#define VHOST_USER_VRING_NOFD			(1ULL << 8)
+
+#define VHOST_USER_MAX_REGIONS			8
+#define VHOST_USER_MAX_VRINGS			64
+#define VHOST_USER_CONFIG_SIZE			256
+
+#define VHOST_USER_PROTOCOL_FEATURES		\
+	(1ULL << VHOST_USER_PROTOCOL_F_MQ |	\
+	 1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK |	\
+	 1ULL << VHOST_USER_PROTOCOL_F_CONFIG)
+
+struct vhost_user_region {
+	u64	guest_phys_addr;
+	u64	memory_size;
+	u64	userspace_addr;
+	u64	mmap_offset;
+};
+
+struct vhost_user_memory {
+	u32				nregions;
+	u32				padding;
+	struct vhost_user_region	regions[VHOST_USER_MAX_REGIONS];
+};
+
+struct vhost_user_config {
+	u32	offset;
+	u32	size;
+	u32	flags;
+	u8	region[VHOST_USER_CONFIG_SIZE];
+};
+
+struct vhost_user_hdr {
+	u32	request;
+	u32	flags;
+	u32	size;
+} __attribute__((packed));
+
+/* On the wire, the payload directly follows the 12 byte header */
+struct vhost_user_msg {
+	struct vhost_user_hdr	hdr;
+	union {
+		u64				u64;
+		struct vhost_vring_state	state;
+		struct vhost_vring_addr		addr;
+		struct vhost_user_memory	memory;
+		struct vhost_user_config	config;
+	} payload;
+};
+
+struct vhost_user {
+	int		fd;
+	struct mutex	mutex;
+	/* Offered by the backend */
+	u64		features;
+	/* Negotiated with the backend */
+	u64		protocol_features;
+	/* Eventfds that the guest notifies, handed over when a vring starts */
+	int		kick_fds[VHOST_USER_MAX_VRINGS];
+	u64		running;
+};
+
+static int vhost_user_send(struct vhost_user *vu, struct vhost_user_msg *msg,
+			   int *fds, int nr_fds)
+{
+	char control[CMSG_SPACE(VHOST_USER_MAX_REGIONS * sizeof(int))] = {};
+	struct iovec iov[] = {
+		{ .iov_base = &msg->hdr,	.iov_len = sizeof(msg->hdr) },
+		{ .iov_base = &msg->payload,	.iov_len = msg->hdr.size },
+	};
+	struct msghdr msgh = {
+		.msg_iov	= iov,
+		.msg_iovlen	= ARRAY_SIZE(iov),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t r;
+
+	if (nr_fds) {
+		msgh.msg_control = control;
+		msgh.msg_controllen = CMSG_SPACE(nr_fds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg->cmsg_len = CMSG_LEN(nr_fds * sizeof(int));
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		memcpy(CMSG_DATA(cmsg), fds, nr_fds * sizeof(int));
+	}
+
+	do {
+		r = sendmsg(vu->fd, &msgh, MSG_NOSIGNAL);
+	} while (r < 0 && errno == EINTR);
+
+	if (r < 0)
+		return -errno;
+	if ((size_t)r != sizeof(msg->hdr) + msg->hdr.size)
+		return -EIO;
+
+	return 0;
+}
+
+static int vhost_user_recv(struct vhost_user *vu, struct vhost_user_msg *msg)
+{
+	u32 request = msg->hdr.request;
+
+	if (read_in_full(vu->fd, &msg->hdr, sizeof(msg->hdr)) !=
+	    sizeof(msg->hdr))
+		return -EIO;
+
+	if (msg->hdr.request != request ||
+	    !(msg->hdr.flags & VHOST_USER_REPLY) ||
+	    msg->hdr.size > sizeof(msg->payload))
+		return -EPROTO;
+
+	if (msg->hdr.size &&
+	    read_in_full(vu->fd, &msg->payload, msg->hdr.size) != msg->hdr.size)
+		return -EIO;
+
+	return 0;
+}
+
+/*
+ * Send a request and, for the GET requests (@reply), read the answer back
+ * into @msg. When the backend supports REPLY_ACK, also wait for it to
+ * acknowledge the other requests so that failures are reported where they
+ * happen.
+ */
+static int vhost_user_call(struct vhost_user *vu, struct vhost_user_msg *msg,
+			   int *fds, int nr_fds, bool reply)
+{
+	bool need_ack = !reply && (vu->protocol_features &
+				   1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK);
+	int r;
+
+	msg->hdr.flags = VHOST_USER_VERSION;
+	if (need_ack)
+		msg->hdr.flags |= VHOST_USER_NEED_REPLY;
+
+	mutex_lock(&vu->mutex);
+	r = vhost_user_send(vu, msg, fds, nr_fds);
+	if (!r && (reply || need_ack))
+		r = vhost_user_recv(vu, msg);
+	mutex_unlock(&vu->mutex);
+
+	if (!r && need_ack && msg->payload.u64)
+		r = -EIO;
+
+	return r;
+}
+
+static int vhost_user_get_u64(struct vhost_user *vu, u32 request, u64 *val)
+{
+	struct vhost_user_msg msg = { .hdr.request = request };
+	int r;
+
+	r = vhost_user_call(vu, &msg, NULL, 0, true);
+	if (r)
+		return r;
+	if (msg.hdr.size != sizeof(u64))
+		return -EPROTO;
+
+	*val = msg.payload.u64;
+	return 0;
+}
+
+static int vhost_user_request(struct vhost_user *vu, u32 request)
+{
+	struct vhost_user_msg msg = { .hdr.request = request };
+
+	return vhost_user_call(vu, &msg, NULL, 0, false);
+}
+
+static int vhost_user_set_u64(struct vhost_user *vu, u32 request, u64 val)
+{
+	struct vhost_user_msg msg = {
+		.hdr		= { .request = request, .size = sizeof(u64) },
+		.payload.u64	= val,
+	};
+
+	return vhost_user_call(vu, &msg, NULL, 0, false);
+}
+
+static int vhost_user_set_state(struct vhost_user *vu, u32 request, u32 index,
+				u32 num)
+{
+	struct vhost_user_msg msg = {
+		.hdr		= {
+			.request	= request,
+			.size		= sizeof(struct vhost_vring_state),
+		},
+		.payload.state	= { .index = index, .num = num },
+	};
+
+	return vhost_user_call(vu, &msg, NULL, 0, false);
+}
+
+static int vhost_user_set_vring_fd(struct vhost_user *vu, u32 request,
+				   u32 index, int fd)
+{
+	struct vhost_user_msg msg = {
+		.hdr		= { .request = request, .size = sizeof(u64) },
+		.payload.u64	= index,
+	};
+
+	if (fd < 0) {
+		msg.payload.u64 |= VHOST_USER_VRING_NOFD;
+		return vhost_user_call(vu, &msg, NULL, 0, false);
+	}
+
+	return vhost_user_call(vu, &msg, &fd, 1, false);
+}
+
+struct vhost_user_mem_table {
+	struct vhost_user_msg	msg;
+	int			fds[VHOST_USER_MAX_REGIONS];
+};
+
+static int vhost_user_add_region(struct kvm *kvm, struct kvm_mem_bank *bank,
+				 void *data)
+{
+	struct vhost_user_mem_table *table = data;
+	struct vhost_user_memory *mem = &table->msg.payload.memory;
+
+	if (mem->nregions == VHOST_USER_MAX_REGIONS)
+		return -ENOSPC;
+
+	mem->regions[mem->nregions] = (struct vhost_user_region) {
+		.guest_phys_addr = bank->guest_phys_addr,
+		.memory_size	 = bank->size,
+		.userspace_addr	 = (unsigned long)bank->host_addr,
+		.mmap_offset	 = bank->host_addr - kvm->ram_fd_start,
+	};
+	table->fds[mem->nregions++] = kvm->ram_fd;
+
+	return 0;
+}
+
+static void vhost_user_set_mem_table(struct kvm *kvm, struct vhost_user *vu)
+{
+	struct vhost_user_mem_table table = {
+		.msg.hdr.request = VHOST_USER_SET_MEM_TABLE,
+	};
+	struct vhost_user_memory *mem = &table.msg.payload.memory;
+
+	if (kvm->ram_fd < 0)
+		die("vhost-user needs guest memory that can be shared");
+
+	if (kvm__for_each_mem_bank(kvm, KVM_MEM_TYPE_RAM, vhost_user_add_region,
+				   &table))
+		die("Too many memory regions for vhost-user");
+
+	table.msg.hdr.size = offsetof(struct vhost_user_memory, regions) +
+			 mem->nregions * sizeof(struct vhost_user_region);
+
+	if (vhost_user_call(vu, &table.msg, table.fds, mem->nregions, false))
+		die("vhost-user SET_MEM_TABLE failed");
+}
+
+static int vhost_user_connect(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	return fd;
+}
+
+struct vhost_user *vhost_user__new(struct kvm *kvm, const char *path)
+{
+	struct vhost_user *vu;
+	u64 protocol_features;
+	int i;
+
+	vu = calloc(1, sizeof(*vu));
+	if (!vu)
+		die("Failed allocating vhost-user state");
+
+	mutex_init(&vu->mutex);
+	for (i = 0; i < VHOST_USER_MAX_VRINGS; i++)
+		vu->kick_fds[i] = -1;
+
+	vu->fd = vhost_user_connect(path);
+	if (vu->fd < 0) {
+		errno = -vu->fd;
+		die_perror("Unable to connect to the vhost-user backend");
+	}
+
+	if (vhost_user_get_u64(vu, VHOST_USER_GET_FEATURES, &vu->features))
+		die("vhost-user GET_FEATURES failed");
+
+	if (vu->features & 1ULL << VHOST_USER_F_PROTOCOL_FEATURES) {
+		if (vhost_user_get_u64(vu, VHOST_USER_GET_PROTOCOL_FEATURES,
+				       &protocol_features))
+			die("vhost-user GET_PROTOCOL_FEATURES failed");
+
+		protocol_features &= VHOST_USER_PROTOCOL_FEATURES;
+		if (vhost_user_set_u64(vu, VHOST_USER_SET_PROTOCOL_FEATURES,
+				       protocol_features))
+			die("vhost-user SET_PROTOCOL_FEATURES failed");
+		vu->protocol_features = protocol_features;
+	}
+
+	if (vhost_user_request(vu, VHOST_USER_SET_OWNER))
+		die("vhost-user SET_OWNER failed");
+
+	vhost_user_set_mem_table(kvm, vu);
+
+	return vu;
+}
+
+void vhost_user__free(struct vhost_user *vu)
+{
+	if (!vu)
+		return;
+
+	close(vu->fd);
+	free(vu);
+}
+
+u64 vhost_user__get_features(struct vhost_user *vu)
+{
+	return vu->features & ~(1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+}
+
+void vhost_user__set_features(struct vhost_user *vu, u64 features)
+{
+	/* As with vhost, there is no IOTLB behind VIRTIO_F_ACCESS_PLATFORM */
+	features |= 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+	features &= vu->features & ~(1ULL << VIRTIO_F_ACCESS_PLATFORM);
+
+	if (vhost_user_set_u64(vu, VHOST_USER_SET_FEATURES, features))
+		die("vhost-user SET_FEATURES failed");
+}
+
+bool vhost_user__has_protocol_feature(struct vhost_user *vu, u32 feature)
+{
+	return vu->protocol_features & (1ULL << feature);
+}
+
+u32 vhost_user__get_queue_num(struct vhost_user *vu)
+{
+	u64 num;
+
+	if (!vhost_user__has_protocol_feature(vu, VHOST_USER_PROTOCOL_F_MQ))
+		return 1;
+
+	if (vhost_user_get_u64(vu, VHOST_USER_GET_QUEUE_NUM, &num) || !num)
+		return 1;
+
+	return min_t(u64, num, VHOST_USER_MAX_VRINGS);
+}
+
+int vhost_user__get_config(struct vhost_user *vu, void *config, u32 size)
+{
+	struct vhost_user_msg msg = {
+		.hdr		= {
+			.request	= VHOST_USER_GET_CONFIG,
+			.size		= offsetof(struct vhost_user_config, region) + size,
+		},
+		.payload.config	= { .size = size },
+	};
+	int r;
+
+	if (!vhost_user__has_protocol_feature(vu, VHOST_USER_PROTOCOL_F_CONFIG))
+		return -EOPNOTSUPP;
+	if (size > VHOST_USER_CONFIG_SIZE)
+		return -EINVAL;
+
+	r = vhost_user_call(vu, &msg, NULL, 0, true);
+	if (r)
+		return r;
+	if (msg.hdr.size != offsetof(struct vhost_user_config, region) + size ||
+	    msg.payload.config.size != size)
+		return -EPROTO;
+
+	memcpy(config, msg.payload.config.region, size);
+	return 0;
+}
+
+/*
+ * Hand a vring over to the backend. Unlike vhost, this happens once the
+ * driver is done setting up the device: the backend needs the negotiated
+ * features before the rings, and may start processing as soon as it has the
+ * kick eventfd.
+ */
+void vhost_user__set_vring(struct kvm *kvm, struct vhost_user *vu, u32 index,
+			   struct virt_queue *queue)
+{
+	struct vhost_user_msg msg = {
+		.hdr		= {
+			.request	= VHOST_USER_SET_VRING_ADDR,
+			.size		= sizeof(struct vhost_vring_addr),
+		},
+		.payload.addr	= {
+			.index		 = index,
+			.desc_user_addr	 = (u64)(unsigned long)queue->vring.desc,
+			.avail_user_addr = (u64)(unsigned long)queue->vring.avail,
+			.used_user_addr	 = (u64)(unsigned long)queue->vring.used,
+		},
+	};
+
+	if (index >= VHOST_USER_MAX_VRINGS)
+		die("vhost-user supports at most %d vrings", VHOST_USER_MAX_VRINGS);
+
+	if (queue->endian != VIRTIO_ENDIAN_HOST)
+		die("vhost-user requires the same endianness in guest and host");
+
+	queue->index = index;
+
+	if (vhost_user_set_state(vu, VHOST_USER_SET_VRING_NUM, index,
+				 queue->vring.num))
+		die("vhost-user SET_VRING_NUM failed");
+
+	if (vhost_user_set_state(vu, VHOST_USER_SET_VRING_BASE, index, 0))
+		die("vhost-user SET_VRING_BASE failed");
+
+	if (vhost_user_call(vu, &msg, NULL, 0, false))
+		die("vhost-user SET_VRING_ADDR failed");
+
+	if (vhost_user_set_vring_fd(vu, VHOST_USER_SET_VRING_CALL, index,
+				    virtio_vhost_get_call_fd(kvm, queue)))
+		die("vhost-user SET_VRING_CALL failed");
+
+	if (vhost_user_set_vring_fd(vu, VHOST_USER_SET_VRING_KICK, index,
+				    vu->kick_fds[index]))
+		die("vhost-user SET_VRING_KICK failed");
+
+	vu->running |= 1ULL << index;
+}
+
+void vhost_user__set_vring_kick(struct vhost_user *vu, u32 index, int event_fd)
+{
+	if (index < VHOST_USER_MAX_VRINGS)
+		vu->kick_fds[index] = event_fd;
+}
+
+/*
+ * Once protocol features are negotiated, vrings start disabled and only go
+ * live with SET_VRING_ENABLE. Otherwise they are enabled as soon as they are
+ * kicked and this is a no-op.
+ */
+int vhost_user__set_vring_enable(struct vhost_user *vu, u32 index, bool enable)
+{
+	if (!(vu->features & 1ULL << VHOST_USER_F_PROTOCOL_FEATURES))
+		return 0;
+
+	return vhost_user_set_state(vu, VHOST_USER_SET_VRING_ENABLE, index,
+				    enable);
+}
+
+void vhost_user__reset_vring(struct kvm *kvm, struct vhost_user *vu, u32 index,
+			     struct virt_queue *queue)
+{
+	struct vhost_user_msg msg = {
+		.hdr		= {
+			.request	= VHOST_USER_GET_VRING_BASE,
+			.size		= sizeof(struct vhost_vring_state),
+		},
+		.payload.state	= { .index = index },
+	};
+
+	if (index >= VHOST_USER_MAX_VRINGS)
+		return;
+
+	vu->kick_fds[index] = -1;
+	if (!(vu->running & 1ULL << index))
+		return;
+
+	/* Stops the vring and waits for the backend to be done with it */
+	if (vhost_user_call(vu, &msg, NULL, 0, true))
+		pr_warning("vhost-user GET_VRING_BASE failed on vring %u", index);
+
+	if (vhost_user_set_vring_fd(vu, VHOST_USER_SET_VRING_CALL, index, -1))
+		pr_warning("vhost-user SET_VRING_CALL failed on vring %u", index);
+
+	virtio_vhost_put_call_fd(kvm, queue);
+	vu->running &= ~(1ULL << index);
+}
@@ -10,12 +10,41 @@
 
 static struct kvm__epoll epoll;
 
+static u16 virtio_vhost__used_idx(struct virt_queue *queue)
+{
+	return __atomic_load_n(&queue->vring.used->idx, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * The guest acked the line, which KVM lowered. What vhost used after the
+ * guest read the ISR may have been signalled while the line was still up,
+ * and missed by the guest, so the line goes up again.
+ */
+static void virtio_vhost_resample(struct virt_queue *queue)
+{
+	u64 tmp = 1;
+
+	if (read(queue->resamplefd, &tmp, sizeof(tmp)) < 0)
+		return;
+
+	if (virtio_vhost__used_idx(queue) !=
+	    __atomic_load_n(&queue->line_used, __ATOMIC_ACQUIRE) &&
+	    write(queue->irqfd, &tmp, sizeof(tmp)) < 0)
+		pr_warning("%s: failed to write eventfd", __func__);
+}
+
+/* Relays the calls of vhost that no irqfd takes, and resamples the others */
 static void virtio_vhost_signal_vq(struct kvm *kvm, struct epoll_event *ev)
 {
 	int r;
 	u64 tmp;
 	struct virt_queue *queue = ev->data.ptr;
 
+	if (queue->irqfd_line) {
+		virtio_vhost_resample(queue);
+		return;
+	}
+
 	if (read(queue->irqfd, &tmp, sizeof(tmp)) < 0)
 		pr_warning("%s: failed to read eventfd", __func__);
 
@@ -90,25 +119,163 @@ static int virtio_vhost_get_irqfd(struct virt_queue *queue)
 	return queue->irqfd;
 }
 
-void virtio_vhost_set_vring(struct kvm *kvm, int vhost_fd, u32 index,
-			    struct virt_queue *queue)
+/*
+ * Without an MSI, the eventfd raises the interrupt line of the transport
+ * through an irqfd. The ISR then always has the queue bit, as the guest
+ * can't be told which interrupts came from vhost. Packed rings have no
+ * used index to resample with.
+ */
+static int virtio_vhost__add_line_irqfd(struct kvm *kvm,
+					struct virt_queue *queue)
 {
-	int r;
-	struct vhost_vring_addr addr = {
-		.index = index,
-		.desc_user_addr = (u64)(unsigned long)queue->vring.desc,
-		.avail_user_addr = (u64)(unsigned long)queue->vring.avail,
-		.used_user_addr = (u64)(unsigned long)queue->vring.used,
-	};
-	struct vhost_vring_state state = { .index = index };
-	struct vhost_vring_file file = {
-		.index	= index,
-		.fd	= virtio_vhost_get_irqfd(queue),
+	struct virtio_device *vdev = queue->vdev;
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.ptr = queue,
 	};
+	int gsi, resamplefd = -1, r;
+	bool level;
+
+	if (!vdev || !vdev->ops->get_irq_line || queue->packed)
+		return -ENOTSUP;
+
+	gsi = vdev->ops->get_irq_line(kvm, vdev, &level);
+	if (gsi < 0)
+		return gsi;
+
+	if (level) {
+		if (!kvm__supports_extension(kvm, KVM_CAP_IRQFD_RESAMPLE))
+			return -ENOTSUP;
+
+		resamplefd = eventfd(0, EFD_NONBLOCK);
+		if (resamplefd < 0)
+			return -errno;
+	}
+
+	queue->line_used = virtio_vhost__used_idx(queue);
+	queue->irqfd_line = true;
+	queue->resamplefd = resamplefd;
+
+	if (irq__add_irqfd(kvm, gsi, queue->irqfd, resamplefd) < 0) {
+		r = -errno;
+		goto err_close;
+	}
+
+	if (level && epoll_ctl(epoll.fd, EPOLL_CTL_ADD, resamplefd, &event) < 0) {
+		r = -errno;
+		irq__del_irqfd(kvm, gsi, queue->irqfd);
+		goto err_close;
+	}
+
+	__atomic_fetch_add(&vdev->line_irqfds, 1, __ATOMIC_RELAXED);
+	pr_debug("vhost queue %d interrupts through GSI %d", queue->index, gsi);
+
+	return 0;
+
+err_close:
+	if (resamplefd >= 0)
+		close(resamplefd);
+	queue->irqfd_line = false;
+	queue->resamplefd = -1;
+	return r;
+}
+
+static void virtio_vhost__del_line_irqfd(struct kvm *kvm,
+					 struct virt_queue *queue)
+{
+	struct virtio_device *vdev = queue->vdev;
+	bool level;
+	int gsi;
+
+	gsi = vdev->ops->get_irq_line(kvm, vdev, &level);
+	irq__del_irqfd(kvm, gsi, queue->irqfd);
+
+	if (queue->resamplefd >= 0) {
+		epoll_ctl(epoll.fd, EPOLL_CTL_DEL, queue->resamplefd, NULL);
+		close(queue->resamplefd);
+		queue->resamplefd = -1;
+	}
+
+	queue->irqfd_line = false;
+	__atomic_fetch_sub(&vdev->line_irqfds, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * The guest read the ISR of @vdev, so it looks at everything vhost used so
+ * far. Called before the ISR is cleared.
+ */
+void virtio_vhost_line_ack(struct kvm *kvm, struct virtio_device *vdev,
+			   void *dev)
+{
+	struct virt_queue *queue;
+	unsigned int i, nr;
+
+	nr = vdev->ops->get_vq_count(kvm, dev);
+	for (i = 0; i < nr; i++) {
+		queue = vdev->ops->get_vq(kvm, dev, i);
+		if (queue && queue->irqfd_line)
+			__atomic_store_n(&queue->line_used,
+					 virtio_vhost__used_idx(queue),
+					 __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Get the eventfd that vhost signals the guest through. Until the guest
+ * configures an MSI route for it, it raises the interrupt line through an
+ * irqfd, or the vhost IRQ worker turns it into an interrupt if KVM can't.
+ */
+int virtio_vhost_get_call_fd(struct kvm *kvm, struct virt_queue *queue)
+{
 	struct epoll_event event = {
 		.events = EPOLLIN,
 		.data.ptr = queue,
 	};
+	int fd, r;
+
+	if (queue->irqfd)
+		return queue->irqfd;
+
+	if (virtio_vhost_start_poll(kvm))
+		die("Unable to start vhost polling thread\n");
+
+	fd = virtio_vhost_get_irqfd(queue);
+	if (queue->gsi || !virtio_vhost__add_line_irqfd(kvm, queue))
+		return fd;
+
+	r = epoll_ctl(epoll.fd, EPOLL_CTL_ADD, fd, &event);
+	if (r < 0)
+		die_perror("EPOLL_CTL_ADD vhost call fd");
+
+	return fd;
+}
+
+/* Undo virtio_vhost_get_call_fd() and virtio_vhost_set_vring_irqfd() */
+void virtio_vhost_put_call_fd(struct kvm *kvm, struct virt_queue *queue)
+{
+	if (!queue->irqfd)
+		return;
+
+	if (queue->gsi) {
+		irq__del_irqfd(kvm, queue->gsi, queue->irqfd);
+		queue->gsi = 0;
+	} else if (queue->irqfd_line) {
+		virtio_vhost__del_line_irqfd(kvm, queue);
+	}
+
+	epoll_ctl(epoll.fd, EPOLL_CTL_DEL, queue->irqfd, NULL);
+
+	close(queue->irqfd);
+	queue->irqfd = 0;
+}
+
+static void virtio_vhost__set_vring(struct kvm *kvm, int vhost_fd, u32 index,
+				    struct virt_queue *queue,
+				    struct vhost_vring_addr *addr)
+{
+	int r;
+	struct vhost_vring_state state = { .index = index };
+	struct vhost_vring_file file = { .index	= index };
 
 	queue->index = index;
 
@@ -125,17 +292,46 @@ void virtio_vhost_set_vring(struct kvm *kvm, int vhost_fd, u32 index,
 	if (r < 0)
 		die_perror("VHOST_SET_VRING_BASE failed");
 
-	r = ioctl(vhost_fd, VHOST_SET_VRING_ADDR, &addr);
+	r = ioctl(vhost_fd, VHOST_SET_VRING_ADDR, addr);
 	if (r < 0)
 		die_perror("VHOST_SET_VRING_ADDR failed");
 
+	file.fd = virtio_vhost_get_call_fd(kvm, queue);
 	r = ioctl(vhost_fd, VHOST_SET_VRING_CALL, &file);
 	if (r < 0)
 		die_perror("VHOST_SET_VRING_CALL failed");
+}
 
-	r = epoll_ctl(epoll.fd, EPOLL_CTL_ADD, file.fd, &event);
-	if (r < 0)
-		die_perror("EPOLL_CTL_ADD vhost call fd");
+void virtio_vhost_set_vring(struct kvm *kvm, int vhost_fd, u32 index,
+			    struct virt_queue *queue)
+{
+	struct vhost_vring_addr addr = {
+		.index = index,
+		.desc_user_addr = (u64)(unsigned long)queue->vring.desc,
+		.avail_user_addr = (u64)(unsigned long)queue->vring.avail,
+		.used_user_addr = (u64)(unsigned long)queue->vring.used,
+	};
+
+	virtio_vhost__set_vring(kvm, vhost_fd, index, queue, &addr);
+}
+
+/*
+ * Same as virtio_vhost_set_vring(), for backends that translate the ring
+ * addresses through their IOTLB, vhost-vdpa for one: they get the guest
+ * physical addresses that the driver wrote, not our mapping of them.
+ */
+void virtio_vhost_set_vring_iova(struct kvm *kvm, int vhost_fd, u32 index,
+				 struct virt_queue *queue)
+{
+	struct vring_addr *va = &queue->vring_addr;
+	struct vhost_vring_addr addr = {
+		.index = index,
+		.desc_user_addr = (u64)va->desc_hi << 32 | va->desc_lo,
+		.avail_user_addr = (u64)va->avail_hi << 32 | va->avail_lo,
+		.used_user_addr = (u64)va->used_hi << 32 | va->used_lo,
+	};
+
+	virtio_vhost__set_vring(kvm, vhost_fd, index, queue, &addr);
 }
 
 void virtio_vhost_set_vring_kick(struct kvm *kvm, int vhost_fd,
@@ -152,6 +348,57 @@ void virtio_vhost_set_vring_kick(struct kvm *kvm, int vhost_fd,
 		die_perror("VHOST_SET_VRING_KICK failed");
 }
 
+/*
+ * Give vring @index, virtqueue @vq of the device, a kernel thread of its own
+ * rather than sharing the one of the device. Kernels before 6.5 don't have
+ * them, and the vring then stays on the device's thread.
+ */
+void virtio_vhost_set_vring_worker(struct virtio_device *vdev, int vhost_fd,
+				   u32 vq, u32 index)
+{
+	static bool unsupported;
+	struct vhost_worker_state state = {};
+	struct vhost_vring_worker worker = { .index = index };
+
+	/* It keeps its worker until the vhost device is closed */
+	if (unsupported || vdev->vhost_worker_vqs & (1ULL << vq))
+		return;
+
+	if (ioctl(vhost_fd, VHOST_NEW_WORKER, &state) < 0) {
+		if (errno == ENOTTY || errno == EINVAL) {
+			pr_debug("No VHOST_NEW_WORKER, vrings share a worker");
+			unsupported = true;
+		} else {
+			pr_warning("VHOST_NEW_WORKER failed: %s",
+				   strerror(errno));
+		}
+		return;
+	}
+
+	worker.worker_id = state.worker_id;
+	if (ioctl(vhost_fd, VHOST_ATTACH_VRING_WORKER, &worker) < 0) {
+		pr_warning("VHOST_ATTACH_VRING_WORKER failed: %s",
+			   strerror(errno));
+		ioctl(vhost_fd, VHOST_FREE_WORKER, &state);
+		return;
+	}
+
+	vdev->vhost_worker_vqs |= 1ULL << vq;
+}
+
+/* Have the vhost worker poll the vring for that long before sleeping */
+void virtio_vhost_set_vring_busyloop(int vhost_fd, u32 index, u32 timeout_us)
+{
+	struct vhost_vring_state state = {
+		.index	= index,
+		.num	= timeout_us,
+	};
+
+	if (ioctl(vhost_fd, VHOST_SET_VRING_BUSYLOOP_TIMEOUT, &state) < 0)
+		pr_warning("VHOST_SET_VRING_BUSYLOOP_TIMEOUT failed: %s",
+			   strerror(errno));
+}
+
 void virtio_vhost_set_vring_irqfd(struct kvm *kvm, u32 gsi,
 				  struct virt_queue *queue)
 {
@@ -160,6 +407,8 @@ void virtio_vhost_set_vring_irqfd(struct kvm *kvm, u32 gsi,
 
 	if (queue->gsi)
 		irq__del_irqfd(kvm, queue->gsi, fd);
+	else if (queue->irqfd_line)
+		virtio_vhost__del_line_irqfd(kvm, queue);
 	else
 		/* Disconnect user polling thread */
 		epoll_ctl(epoll.fd, EPOLL_CTL_DEL, fd, NULL);
@@ -184,17 +433,10 @@ void virtio_vhost_reset_vring(struct kvm *kvm, int vhost_fd, u32 index,
 	if (!queue->irqfd)
 		return;
 
-	if (queue->gsi) {
-		irq__del_irqfd(kvm, queue->gsi, queue->irqfd);
-		queue->gsi = 0;
-	}
-
-	epoll_ctl(epoll.fd, EPOLL_CTL_DEL, queue->irqfd, NULL);
-
 	if (ioctl(vhost_fd, VHOST_SET_VRING_CALL, &file))
 		perror("SET_VRING_CALL");
-	close(queue->irqfd);
-	queue->irqfd = 0;
+
+	virtio_vhost_put_call_fd(kvm, queue);
 }
 
 int virtio_vhost_set_features(int vhost_fd, u64 features)
@@ -6,14 +6,37 @@
 #include "kvm/guest_compat.h"
 #include "kvm/virtio-pci.h"
 #include "kvm/virtio.h"
+#include "kvm/iovec.h"
+#include "kvm/mutex.h"
+#include "kvm/strbuf.h"
+#include "kvm/snapshot.h"
 
 #include <linux/byteorder.h>
 #include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/sizes.h>
 #include <linux/virtio_vsock.h>
 #include <linux/vhost.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+
 #define VIRTIO_VSOCK_QUEUE_SIZE		128
 
+#define VSOCK_HOST_CID			2
+#define VSOCK_DEFAULT_GUEST_CID		3
+/* Receive buffer of each connection, which the guest gets as credit */
+#define VSOCK_CONN_BUF_SIZE		SZ_256K
+#define VSOCK_MAX_CONNS			1024
+#define VSOCK_CONN_HASH_SIZE		256
+/* Ports of the connections that host applications open */
+#define VSOCK_HOST_PORT_BASE		(1U << 30)
+#define VSOCK_CONNECT_LINE_MAX		32
+#define VSOCK_MAX_EVENTS		64
+
 static LIST_HEAD(vdevs);
 static int compat_id = -1;
 
@@ -24,6 +47,70 @@ enum {
 	VSOCK_VQ_MAX    = 3,
 };
 
+enum vsock_fd_type {
+	VSOCK_FD_KICK,
+	VSOCK_FD_LISTEN,
+	VSOCK_FD_CONN,
+};
+
+/* What an epoll event of the multiplexer points to */
+struct vsock_fd {
+	int				fd;
+	enum vsock_fd_type		type;
+};
+
+enum vsock_conn_state {
+	/* A host application is yet to send "CONNECT <port>\n" */
+	VSOCK_CONN_HANDSHAKE,
+	/* The guest is yet to answer our request */
+	VSOCK_CONN_CONNECTING,
+	VSOCK_CONN_ESTABLISHED,
+	/* The host side is gone, waiting for the guest to reset */
+	VSOCK_CONN_CLOSING,
+};
+
+/*
+ * A stream between a guest port and a unix socket. Data from the guest is
+ * written straight from its buffers to the socket, and only what the socket
+ * doesn't take right away is kept in txbuf.
+ */
+struct vsock_conn {
+	struct vsock_fd			pfd;
+	struct list_head		list;
+	struct list_head		rx_list;
+	enum vsock_conn_state		state;
+	u32				local_port;
+	u32				peer_port;
+	u32				events;
+	bool				polled;
+	bool				rx_ready;
+	bool				rx_eof;
+	/* The host application closed its end, drain what it left */
+	bool				hup;
+	u32				peer_shutdown;
+
+	/* Credit of the guest for the data we send it */
+	u32				peer_buf_alloc;
+	u32				peer_fwd_cnt;
+	u32				rx_cnt;
+
+	/* Data from the guest that has reached the socket */
+	u32				fwd_cnt;
+	u32				fwd_cnt_sent;
+	u8				*txbuf;
+	u32				tx_off;
+	u32				tx_len;
+
+	char				line[VSOCK_CONNECT_LINE_MAX];
+	u32				line_len;
+};
+
+/* Packets without payload, waiting for an RX buffer */
+struct vsock_pkt {
+	struct list_head		list;
+	struct virtio_vsock_hdr		hdr;
+};
+
 struct vsock_dev {
 	struct virt_queue		vqs[VSOCK_VQ_MAX];
 	struct virtio_vsock_config	config;
@@ -33,8 +120,742 @@ struct vsock_dev {
 	struct virtio_device		vdev;
 	struct list_head		list;
 	struct kvm			*kvm;
+
+	/* The rest is for the unix socket multiplexer */
+	const char			*uds_path;
+	struct mutex			mutex;
+	bool				started;
+	int				epoll_fd;
+	pthread_t			thread;
+	struct vsock_fd			kick;
+	struct vsock_fd			listener;
+	struct list_head		conns[VSOCK_CONN_HASH_SIZE];
+	struct list_head		handshakes;
+	struct list_head		rx_conns;
+	struct list_head		ctrl_pkts;
+	struct list_head		closed;
+	u32				nr_conns;
+	u32				next_port;
 };
 
+static struct list_head *vsock_conn_bucket(struct vsock_dev *vdev,
+					   u32 local_port, u32 peer_port)
+{
+	return &vdev->conns[(local_port ^ peer_port * 31) % VSOCK_CONN_HASH_SIZE];
+}
+
+static struct vsock_conn *vsock_conn_find(struct vsock_dev *vdev,
+					  u32 local_port, u32 peer_port)
+{
+	struct list_head *bucket = vsock_conn_bucket(vdev, local_port, peer_port);
+	struct vsock_conn *conn;
+
+	list_for_each_entry(conn, bucket, list) {
+		if (conn->local_port == local_port && conn->peer_port == peer_port)
+			return conn;
+	}
+
+	return NULL;
+}
+
+static bool vsock_port_in_use(struct vsock_dev *vdev, u32 port)
+{
+	struct vsock_conn *conn;
+	int i;
+
+	for (i = 0; i < VSOCK_CONN_HASH_SIZE; i++) {
+		list_for_each_entry(conn, &vdev->conns[i], list) {
+			if (conn->local_port == port)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+static u32 vsock_conn_credit(struct vsock_conn *conn)
+{
+	return conn->peer_buf_alloc - (conn->rx_cnt - conn->peer_fwd_cnt);
+}
+
+static void vsock_fill_hdr(struct vsock_dev *vdev, struct virtio_vsock_hdr *hdr,
+			   u32 local_port, u32 peer_port, u16 op, u32 flags)
+{
+	struct vsock_conn *conn = vsock_conn_find(vdev, local_port, peer_port);
+
+	*hdr = (struct virtio_vsock_hdr) {
+		.src_cid	= cpu_to_le64(VSOCK_HOST_CID),
+		.dst_cid	= cpu_to_le64(vdev->guest_cid),
+		.src_port	= cpu_to_le32(local_port),
+		.dst_port	= cpu_to_le32(peer_port),
+		.type		= cpu_to_le16(VIRTIO_VSOCK_TYPE_STREAM),
+		.op		= cpu_to_le16(op),
+		.flags		= cpu_to_le32(flags),
+	};
+
+	/* Every packet tells the guest how much it may send */
+	if (conn) {
+		hdr->buf_alloc = cpu_to_le32(VSOCK_CONN_BUF_SIZE);
+		hdr->fwd_cnt = cpu_to_le32(conn->fwd_cnt);
+		conn->fwd_cnt_sent = conn->fwd_cnt;
+	}
+}
+
+static void vsock_queue_ctrl(struct vsock_dev *vdev, u32 local_port,
+			     u32 peer_port, u16 op, u32 flags)
+{
+	struct vsock_pkt *pkt = malloc(sizeof(*pkt));
+
+	if (!pkt) {
+		pr_warning("virtio-vsock: dropping a control packet");
+		return;
+	}
+
+	/* The credit fields are filled in when the packet is sent */
+	pkt->hdr = (struct virtio_vsock_hdr) {
+		.src_port	= local_port,
+		.dst_port	= peer_port,
+		.op		= op,
+		.flags		= flags,
+	};
+	list_add_tail(&pkt->list, &vdev->ctrl_pkts);
+}
+
+static void vsock_conn_update_events(struct vsock_dev *vdev,
+				     struct vsock_conn *conn)
+{
+	struct epoll_event ev = { .data.ptr = &conn->pfd };
+	u32 events = 0;
+
+	if (!conn->polled)
+		return;
+
+	if (conn->state == VSOCK_CONN_HANDSHAKE)
+		events |= EPOLLIN;
+	else if (conn->state == VSOCK_CONN_ESTABLISHED && !conn->rx_ready &&
+		 !conn->rx_eof && vsock_conn_credit(conn) &&
+		 !(conn->peer_shutdown & VIRTIO_VSOCK_SHUTDOWN_RCV))
+		events |= EPOLLIN;
+	if (conn->tx_len)
+		events |= EPOLLOUT;
+
+	if (events == conn->events)
+		return;
+
+	ev.events = events;
+	if (epoll_ctl(vdev->epoll_fd, EPOLL_CTL_MOD, conn->pfd.fd, &ev) < 0)
+		pr_warning("virtio-vsock: epoll_ctl failed with %d", errno);
+	conn->events = events;
+}
+
+/* Queue the connection for the RX queue, there is something to read */
+static void vsock_conn_rx_kick(struct vsock_dev *vdev, struct vsock_conn *conn)
+{
+	if (conn->rx_ready || conn->rx_eof || !vsock_conn_credit(conn) ||
+	    conn->state != VSOCK_CONN_ESTABLISHED ||
+	    (conn->peer_shutdown & VIRTIO_VSOCK_SHUTDOWN_RCV))
+		return;
+
+	conn->rx_ready = true;
+	list_add_tail(&conn->rx_list, &vdev->rx_conns);
+	vsock_conn_update_events(vdev, conn);
+}
+
+static struct vsock_conn *vsock_conn_new(struct vsock_dev *vdev, int fd,
+					 enum vsock_conn_state state)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct vsock_conn *conn;
+
+	if (vdev->nr_conns >= VSOCK_MAX_CONNS)
+		return NULL;
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn)
+		return NULL;
+
+	conn->txbuf = malloc(VSOCK_CONN_BUF_SIZE);
+	if (!conn->txbuf) {
+		free(conn);
+		return NULL;
+	}
+
+	conn->pfd = (struct vsock_fd) { .fd = fd, .type = VSOCK_FD_CONN };
+	conn->state = state;
+	INIT_LIST_HEAD(&conn->list);
+	INIT_LIST_HEAD(&conn->rx_list);
+
+	ev.data.ptr = &conn->pfd;
+	if (epoll_ctl(vdev->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		free(conn->txbuf);
+		free(conn);
+		return NULL;
+	}
+	conn->polled = true;
+	conn->events = EPOLLIN;
+	vdev->nr_conns++;
+
+	return conn;
+}
+
+static void vsock_conn_set_ports(struct vsock_dev *vdev, struct vsock_conn *conn,
+				 u32 local_port, u32 peer_port)
+{
+	conn->local_port = local_port;
+	conn->peer_port = peer_port;
+	list_del(&conn->list);
+	list_add(&conn->list, vsock_conn_bucket(vdev, local_port, peer_port));
+}
+
+static void vsock_conn_unpoll(struct vsock_dev *vdev, struct vsock_conn *conn)
+{
+	if (!conn->polled)
+		return;
+
+	epoll_ctl(vdev->epoll_fd, EPOLL_CTL_DEL, conn->pfd.fd, NULL);
+	conn->polled = false;
+	list_del_init(&conn->rx_list);
+	conn->rx_ready = false;
+}
+
+/*
+ * Events of the current epoll_wait() batch may still point to the
+ * connection, so it is only freed once the batch is done.
+ */
+static void vsock_conn_close(struct vsock_dev *vdev, struct vsock_conn *conn)
+{
+	vsock_conn_unpoll(vdev, conn);
+	close(conn->pfd.fd);
+	conn->pfd.fd = -1;
+	list_del(&conn->list);
+	list_add(&conn->list, &vdev->closed);
+	vdev->nr_conns--;
+}
+
+static void vsock_conn_reset(struct vsock_dev *vdev, struct vsock_conn *conn)
+{
+	vsock_queue_ctrl(vdev, conn->local_port, conn->peer_port,
+			 VIRTIO_VSOCK_OP_RST, 0);
+	vsock_conn_close(vdev, conn);
+}
+
+/* The host side is gone, the guest answers with a reset */
+static void vsock_conn_hangup(struct vsock_dev *vdev, struct vsock_conn *conn)
+{
+	vsock_conn_unpoll(vdev, conn);
+	conn->state = VSOCK_CONN_CLOSING;
+	vsock_queue_ctrl(vdev, conn->local_port, conn->peer_port,
+			 VIRTIO_VSOCK_OP_SHUTDOWN, VIRTIO_VSOCK_SHUTDOWN_RCV |
+			 VIRTIO_VSOCK_SHUTDOWN_SEND);
+}
+
+static void vsock_free_closed(struct vsock_dev *vdev)
+{
+	struct vsock_conn *conn, *next;
+
+	list_for_each_entry_safe(conn, next, &vdev->closed, list) {
+		list_del(&conn->list);
+		free(conn->txbuf);
+		free(conn);
+	}
+}
+
+static void vsock_reset_all(struct vsock_dev *vdev)
+{
+	struct vsock_conn *conn, *next;
+	struct vsock_pkt *pkt, *next_pkt;
+	int i;
+
+	for (i = 0; i < VSOCK_CONN_HASH_SIZE; i++)
+		list_for_each_entry_safe(conn, next, &vdev->conns[i], list)
+			vsock_conn_close(vdev, conn);
+	list_for_each_entry_safe(conn, next, &vdev->handshakes, list)
+		vsock_conn_close(vdev, conn);
+
+	list_for_each_entry_safe(pkt, next_pkt, &vdev->ctrl_pkts, list) {
+		list_del(&pkt->list);
+		free(pkt);
+	}
+}
+
+static void vsock_flush_txbuf(struct vsock_dev *vdev, struct vsock_conn *conn)
+{
+	ssize_t r;
+
+	while (conn->tx_len) {
+		r = write(conn->pfd.fd, conn->txbuf + conn->tx_off, conn->tx_len);
+		if (r < 0) {
+			if (errno == EAGAIN)
+				break;
+			vsock_conn_hangup(vdev, conn);
+			return;
+		}
+		conn->tx_off += r;
+		conn->tx_len -= r;
+		conn->fwd_cnt += r;
+	}
+
+	if (!conn->tx_len) {
+		conn->tx_off = 0;
+		if (conn->peer_shutdown & VIRTIO_VSOCK_SHUTDOWN_SEND)
+			shutdown(conn->pfd.fd, SHUT_WR);
+	}
+
+	if (conn->fwd_cnt - conn->fwd_cnt_sent >= VSOCK_CONN_BUF_SIZE / 4)
+		vsock_queue_ctrl(vdev, conn->local_port, conn->peer_port,
+				 VIRTIO_VSOCK_OP_CREDIT_UPDATE, 0);
+
+	vsock_conn_update_events(vdev, conn);
+}
+
+/* Send guest data to the socket, keeping what doesn't fit for later */
+static void vsock_conn_send(struct vsock_dev *vdev, struct vsock_conn *conn,
+			    struct iovec *iov, int iovcnt, u32 len)
+{
+	ssize_t r = 0;
+
+	if (!conn->tx_len) {
+		r = writev(conn->pfd.fd, iov, iovcnt);
+		if (r < 0 && errno != EAGAIN) {
+			vsock_conn_hangup(vdev, conn);
+			return;
+		}
+		r = max_t(ssize_t, r, 0);
+		conn->fwd_cnt += r;
+	}
+
+	if (r < len) {
+		/* The guest never sends more than the credit we gave it */
+		if (conn->tx_len + len - r > VSOCK_CONN_BUF_SIZE) {
+			vsock_conn_reset(vdev, conn);
+			return;
+		}
+		if (conn->tx_off + conn->tx_len + len - r > VSOCK_CONN_BUF_SIZE) {
+			memmove(conn->txbuf, conn->txbuf + conn->tx_off,
+				conn->tx_len);
+			conn->tx_off = 0;
+		}
+		memcpy_fromiovecend(conn->txbuf + conn->tx_off + conn->tx_len,
+				    iov, r, len - r);
+		conn->tx_len += len - r;
+	}
+
+	vsock_flush_txbuf(vdev, conn);
+}
+
+static void vsock_guest_connect(struct vsock_dev *vdev,
+				struct virtio_vsock_hdr *hdr)
+{
+	u32 local_port = le32_to_cpu(hdr->dst_port);
+	u32 peer_port = le32_to_cpu(hdr->src_port);
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct vsock_conn *conn;
+	int fd;
+
+	if (vsock_conn_find(vdev, local_port, peer_port))
+		goto err_reset;
+
+	if ((size_t)snprintf(addr.sun_path, sizeof(addr.sun_path), "%s_%u",
+			     vdev->uds_path, local_port) >= sizeof(addr.sun_path))
+		goto err_reset;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		goto err_reset;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		goto err_close;
+
+	conn = vsock_conn_new(vdev, fd, VSOCK_CONN_ESTABLISHED);
+	if (!conn)
+		goto err_close;
+
+	vsock_conn_set_ports(vdev, conn, local_port, peer_port);
+	conn->peer_buf_alloc = le32_to_cpu(hdr->buf_alloc);
+	conn->peer_fwd_cnt = le32_to_cpu(hdr->fwd_cnt);
+	vsock_queue_ctrl(vdev, local_port, peer_port,
+			 VIRTIO_VSOCK_OP_RESPONSE, 0);
+	return;
+
+err_close:
+	close(fd);
+err_reset:
+	vsock_queue_ctrl(vdev, local_port, peer_port, VIRTIO_VSOCK_OP_RST, 0);
+}
+
+static void vsock_tx_one(struct vsock_dev *vdev, struct iovec *iov, u16 out)
+{
+	struct virtio_vsock_hdr hdr;
+	struct iovec data[VIRTIO_VSOCK_QUEUE_SIZE];
+	struct vsock_conn *conn;
+	char ok[VSOCK_CONNECT_LINE_MAX];
+	size_t len = iov_size(iov, out);
+	u32 local_port, peer_port, flags;
+	int cnt;
+	u16 op;
+
+	if (len < sizeof(hdr) ||
+	    memcpy_fromiovecend((void *)&hdr, iov, 0, sizeof(hdr)))
+		return;
+
+	op = le16_to_cpu(hdr.op);
+	local_port = le32_to_cpu(hdr.dst_port);
+	peer_port = le32_to_cpu(hdr.src_port);
+
+	if (le64_to_cpu(hdr.src_cid) != vdev->guest_cid ||
+	    le64_to_cpu(hdr.dst_cid) != VSOCK_HOST_CID ||
+	    le16_to_cpu(hdr.type) != VIRTIO_VSOCK_TYPE_STREAM) {
+		if (op != VIRTIO_VSOCK_OP_RST)
+			vsock_queue_ctrl(vdev, local_port, peer_port,
+					 VIRTIO_VSOCK_OP_RST, 0);
+		return;
+	}
+
+	if (op == VIRTIO_VSOCK_OP_REQUEST) {
+		vsock_guest_connect(vdev, &hdr);
+		return;
+	}
+
+	conn = vsock_conn_find(vdev, local_port, peer_port);
+	if (!conn) {
+		if (op != VIRTIO_VSOCK_OP_RST)
+			vsock_queue_ctrl(vdev, local_port, peer_port,
+					 VIRTIO_VSOCK_OP_RST, 0);
+		return;
+	}
+
+	conn->peer_buf_alloc = le32_to_cpu(hdr.buf_alloc);
+	conn->peer_fwd_cnt = le32_to_cpu(hdr.fwd_cnt);
+
+	switch (op) {
+	case VIRTIO_VSOCK_OP_RESPONSE:
+		if (conn->state != VSOCK_CONN_CONNECTING) {
+			vsock_conn_reset(vdev, conn);
+			break;
+		}
+		conn->state = VSOCK_CONN_ESTABLISHED;
+		len = snprintf(ok, sizeof(ok), "OK %u\n", conn->local_port);
+		if (write(conn->pfd.fd, ok, len) != (ssize_t)len)
+			vsock_conn_reset(vdev, conn);
+		else
+			vsock_conn_update_events(vdev, conn);
+		break;
+	case VIRTIO_VSOCK_OP_RW:
+		if (conn->state != VSOCK_CONN_ESTABLISHED)
+			break;
+		len = min_t(size_t, le32_to_cpu(hdr.len), len - sizeof(hdr));
+		cnt = iovec_window(data, iov, out, sizeof(hdr), len);
+		vsock_conn_send(vdev, conn, data, cnt, len);
+		break;
+	case VIRTIO_VSOCK_OP_SHUTDOWN:
+		flags = le32_to_cpu(hdr.flags);
+		conn->peer_shutdown |= flags & (VIRTIO_VSOCK_SHUTDOWN_RCV |
+						VIRTIO_VSOCK_SHUTDOWN_SEND);
+		if (conn->peer_shutdown == (VIRTIO_VSOCK_SHUTDOWN_RCV |
+					    VIRTIO_VSOCK_SHUTDOWN_SEND) ||
+		    conn->state == VSOCK_CONN_CLOSING) {
+			vsock_conn_reset(vdev, conn);
+			break;
+		}
+		if (flags & VIRTIO_VSOCK_SHUTDOWN_RCV) {
+			list_del_init(&conn->rx_list);
+			conn->rx_ready = false;
+		}
+		vsock_flush_txbuf(vdev, conn);
+		break;
+	case VIRTIO_VSOCK_OP_RST:
+		vsock_conn_close(vdev, conn);
+		break;
+	case VIRTIO_VSOCK_OP_CREDIT_REQUEST:
+		vsock_queue_ctrl(vdev, local_port, peer_port,
+				 VIRTIO_VSOCK_OP_CREDIT_UPDATE, 0);
+		break;
+	case VIRTIO_VSOCK_OP_CREDIT_UPDATE:
+		/* The new credit may let us read the socket again */
+		if (conn->hup)
+			vsock_conn_rx_kick(vdev, conn);
+		else
+			vsock_conn_update_events(vdev, conn);
+		break;
+	default:
+		vsock_conn_reset(vdev, conn);
+		break;
+	}
+}
+
+static void vsock_tx_flush(struct vsock_dev *vdev)
+{
+	struct virt_queue *vq = &vdev->vqs[VSOCK_VQ_TX];
+	struct iovec iov[VIRTIO_VSOCK_QUEUE_SIZE];
+	bool used = false;
+	u16 out, in, head;
+
+	if (!vq->enabled)
+		return;
+
+	while (virt_queue__available(vq)) {
+		head = virt_queue__get_iov(vq, iov, &out, &in, vdev->kvm);
+		vsock_tx_one(vdev, iov, out);
+		virt_queue__set_used_elem(vq, head, 0);
+		used = true;
+	}
+
+	if (used && virtio_queue__should_signal(vq))
+		vdev->vdev.ops->signal_vq(vdev->kvm, &vdev->vdev, VSOCK_VQ_TX);
+}
+
+/* Fill an RX buffer from the socket, returns the length of the packet */
+static u32 vsock_rx_data(struct vsock_dev *vdev, struct vsock_conn *conn,
+			 struct iovec *iov, u16 in)
+{
+	struct virtio_vsock_hdr hdr;
+	struct iovec data[VIRTIO_VSOCK_QUEUE_SIZE];
+	size_t room = iov_size(iov, in) - sizeof(hdr);
+	u32 len = min_t(size_t, room, vsock_conn_credit(conn));
+	ssize_t r;
+	int cnt;
+
+	if (len) {
+		cnt = iovec_window(data, iov, in, sizeof(hdr), len);
+		r = readv(conn->pfd.fd, data, cnt);
+	} else {
+		r = -1;
+		errno = EAGAIN;
+	}
+
+	if (r <= 0) {
+		if (r < 0 && errno == EAGAIN) {
+			/* Use the buffer to tell the guest about our credit */
+			vsock_fill_hdr(vdev, &hdr, conn->local_port,
+				       conn->peer_port,
+				       VIRTIO_VSOCK_OP_CREDIT_UPDATE, 0);
+		} else if (conn->hup) {
+			conn->state = VSOCK_CONN_CLOSING;
+			vsock_fill_hdr(vdev, &hdr, conn->local_port,
+				       conn->peer_port, VIRTIO_VSOCK_OP_SHUTDOWN,
+				       VIRTIO_VSOCK_SHUTDOWN_RCV |
+				       VIRTIO_VSOCK_SHUTDOWN_SEND);
+		} else {
+			/* No more data from the host, but the guest may still send */
+			conn->rx_eof = true;
+			vsock_fill_hdr(vdev, &hdr, conn->local_port,
+				       conn->peer_port, VIRTIO_VSOCK_OP_SHUTDOWN,
+				       VIRTIO_VSOCK_SHUTDOWN_SEND);
+		}
+		r = 0;
+		list_del_init(&conn->rx_list);
+		conn->rx_ready = false;
+	} else {
+		vsock_fill_hdr(vdev, &hdr, conn->local_port, conn->peer_port,
+			       VIRTIO_VSOCK_OP_RW, 0);
+		hdr.len = cpu_to_le32(r);
+		conn->rx_cnt += r;
+
+		/* A short read means the socket is drained */
+		list_del_init(&conn->rx_list);
+		if (((u32)r == len || conn->hup) && vsock_conn_credit(conn))
+			list_add_tail(&conn->rx_list, &vdev->rx_conns);
+		else
+			conn->rx_ready = false;
+	}
+
+	memcpy_toiovecend(iov, (void *)&hdr, 0, sizeof(hdr));
+	vsock_conn_update_events(vdev, conn);
+
+	return sizeof(hdr) + r;
+}
+
+static void vsock_rx_flush(struct vsock_dev *vdev)
+{
+	struct virt_queue *vq = &vdev->vqs[VSOCK_VQ_RX];
+	struct iovec iov[VIRTIO_VSOCK_QUEUE_SIZE];
+	struct virtio_vsock_hdr hdr;
+	struct vsock_conn *conn;
+	struct vsock_pkt *pkt;
+	bool used = false;
+	u16 out, in, head;
+	u32 len;
+
+	if (!vq->enabled)
+		return;
+
+	while (!list_empty(&vdev->ctrl_pkts) || !list_empty(&vdev->rx_conns)) {
+		if (!virt_queue__available(vq))
+			break;
+
+		head = virt_queue__get_iov(vq, iov, &out, &in, vdev->kvm);
+		if (iov_size(iov + out, in) < sizeof(hdr)) {
+			virt_queue__set_used_elem(vq, head, 0);
+			continue;
+		}
+
+		if (!list_empty(&vdev->ctrl_pkts)) {
+			pkt = list_first_entry(&vdev->ctrl_pkts, struct vsock_pkt,
+					       list);
+			vsock_fill_hdr(vdev, &hdr, pkt->hdr.src_port,
+				       pkt->hdr.dst_port, pkt->hdr.op,
+				       pkt->hdr.flags);
+			list_del(&pkt->list);
+			free(pkt);
+
+			memcpy_toiovecend(iov + out, (void *)&hdr, 0, sizeof(hdr));
+			len = sizeof(hdr);
+		} else {
+			conn = list_first_entry(&vdev->rx_conns, struct vsock_conn,
+						rx_list);
+			len = vsock_rx_data(vdev, conn, iov + out, in);
+		}
+
+		virt_queue__set_used_elem(vq, head, len);
+		used = true;
+	}
+
+	if (used && virtio_queue__should_signal(vq))
+		vdev->vdev.ops->signal_vq(vdev->kvm, &vdev->vdev, VSOCK_VQ_RX);
+}
+
+static void vsock_accept(struct vsock_dev *vdev)
+{
+	struct vsock_conn *conn;
+	int fd;
+
+	fd = accept4(vdev->listener.fd, NULL, NULL,
+		     SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	conn = vsock_conn_new(vdev, fd, VSOCK_CONN_HANDSHAKE);
+	if (!conn) {
+		close(fd);
+		return;
+	}
+
+	list_add(&conn->list, &vdev->handshakes);
+}
+
+/* Read "CONNECT <port>\n" a byte at a time, what follows is stream data */
+static void vsock_handshake(struct vsock_dev *vdev, struct vsock_conn *conn)
+{
+	ssize_t r;
+	u32 port;
+	char c;
+
+	while ((r = read(conn->pfd.fd, &c, 1)) == 1) {
+		if (c != '\n') {
+			if (conn->line_len == sizeof(conn->line) - 1)
+				goto err_close;
+			conn->line[conn->line_len++] = c;
+			continue;
+		}
+
+		conn->line[conn->line_len] = '\0';
+		if (sscanf(conn->line, "CONNECT %u", &port) != 1)
+			goto err_close;
+
+		do {
+			if (++vdev->next_port < VSOCK_HOST_PORT_BASE)
+				vdev->next_port = VSOCK_HOST_PORT_BASE;
+		} while (vsock_port_in_use(vdev, vdev->next_port));
+
+		vsock_conn_set_ports(vdev, conn, vdev->next_port, port);
+		conn->state = VSOCK_CONN_CONNECTING;
+		vsock_queue_ctrl(vdev, conn->local_port, port,
+				 VIRTIO_VSOCK_OP_REQUEST, 0);
+		vsock_conn_update_events(vdev, conn);
+		return;
+	}
+
+	if (r < 0 && errno == EAGAIN)
+		return;
+
+err_close:
+	vsock_conn_close(vdev, conn);
+}
+
+static void vsock_conn_event(struct vsock_dev *vdev, struct vsock_conn *conn,
+			     u32 events)
+{
+	if (conn->pfd.fd < 0)
+		return;
+
+	if (conn->state == VSOCK_CONN_HANDSHAKE) {
+		vsock_handshake(vdev, conn);
+		return;
+	}
+
+	if (events & EPOLLOUT)
+		vsock_flush_txbuf(vdev, conn);
+
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		if (conn->state == VSOCK_CONN_CONNECTING) {
+			vsock_conn_reset(vdev, conn);
+			return;
+		}
+
+		if ((events & EPOLLERR) || conn->rx_eof ||
+		    (conn->peer_shutdown & VIRTIO_VSOCK_SHUTDOWN_RCV)) {
+			vsock_conn_hangup(vdev, conn);
+			return;
+		}
+
+		/* Stop polling, the hangup would be reported over and over */
+		epoll_ctl(vdev->epoll_fd, EPOLL_CTL_DEL, conn->pfd.fd, NULL);
+		conn->polled = false;
+		conn->hup = true;
+		vsock_conn_rx_kick(vdev, conn);
+		return;
+	}
+
+	if (events & EPOLLIN)
+		vsock_conn_rx_kick(vdev, conn);
+}
+
+static void *vsock_mux_thread(void *param)
+{
+	struct vsock_dev *vdev = param;
+	struct epoll_event events[VSOCK_MAX_EVENTS];
+	struct vsock_fd *pfd;
+	int nfds, i;
+	u64 kick;
+
+	kvm__set_thread_name("virtio-vsock-mux");
+
+	for (;;) {
+		nfds = epoll_wait(vdev->epoll_fd, events, VSOCK_MAX_EVENTS, -1);
+		if (nfds < 0)
+			continue;
+
+		mutex_lock(&vdev->mutex);
+		for (i = 0; i < nfds; i++) {
+			pfd = events[i].data.ptr;
+
+			switch (pfd->type) {
+			case VSOCK_FD_KICK:
+				if (read(pfd->fd, &kick, sizeof(kick)) < 0 ||
+				    !vdev->started)
+					break;
+				vsock_tx_flush(vdev);
+				break;
+			case VSOCK_FD_LISTEN:
+				vsock_accept(vdev);
+				break;
+			case VSOCK_FD_CONN:
+				vsock_conn_event(vdev,
+						 container_of(pfd, struct vsock_conn, pfd),
+						 events[i].events);
+				break;
+			}
+		}
+
+		if (vdev->started)
+			vsock_rx_flush(vdev);
+		vsock_free_closed(vdev);
+		mutex_unlock(&vdev->mutex);
+	}
+
+	return NULL;
+}
+
 static u8 *get_config(struct kvm *kvm, void *dev)
 {
 	struct vsock_dev *vdev = dev;
@@ -55,6 +876,10 @@ static u64 get_host_features(struct kvm *kvm, void *dev)
 	u64 features;
 	struct vsock_dev *vdev = dev;
 
+	if (!vdev->vdev.use_vhost)
+		return 1ULL << VIRTIO_RING_F_EVENT_IDX |
+		       1ULL << VIRTIO_RING_F_INDIRECT_DESC;
+
 	r = ioctl(vdev->vhost_fd, VHOST_GET_FEATURES, &features);
 	if (r != 0)
 		die_perror("VHOST_GET_FEATURES failed");
@@ -82,6 +907,10 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 	if (vdev->vhost_fd == -1 || is_event_vq(vq))
 		return 0;
 
+	/* Leave RX on the device's worker, and give TX one of its own */
+	if (vq == VSOCK_VQ_TX)
+		virtio_vhost_set_vring_worker(&vdev->vdev, vdev->vhost_fd, vq,
+					      vq);
 	virtio_vhost_set_vring(kvm, vdev->vhost_fd, vq, queue);
 	return 0;
 }
@@ -104,6 +933,19 @@ static void notify_status(struct kvm *kvm, void *dev, u32 status)
 	if (status & VIRTIO__STATUS_CONFIG)
 		vdev->config.guest_cid = cpu_to_le64(vdev->guest_cid);
 
+	if (!vdev->vdev.use_vhost) {
+		/* The queues go away after a stop, and so do the streams */
+		mutex_lock(&vdev->mutex);
+		if (status & VIRTIO__STATUS_START) {
+			vdev->started = true;
+		} else if (status & VIRTIO__STATUS_STOP) {
+			vdev->started = false;
+			vsock_reset_all(vdev);
+		}
+		mutex_unlock(&vdev->mutex);
+		return;
+	}
+
 	if (status & VIRTIO__STATUS_START) {
 		start = 1;
 
@@ -124,6 +966,16 @@ static void notify_status(struct kvm *kvm, void *dev, u32 status)
 
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
 {
+	struct vsock_dev *vdev = dev;
+	u64 data = 1;
+
+	/* All the work happens in the multiplexer thread */
+	if (vdev->vdev.use_vhost || is_event_vq(vq))
+		return 0;
+
+	if (write(vdev->kick.fd, &data, sizeof(data)) < 0)
+		return -errno;
+
 	return 0;
 }
 
@@ -191,6 +1043,108 @@ static void virtio_vhost_vsock_init(struct kvm *kvm, struct vsock_dev *vdev)
 	vdev->vdev.use_vhost = true;
 }
 
+static int vsock_listen(struct vsock_dev *vdev)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd, r;
+
+	if (strlcpy(addr.sun_path, vdev->uds_path, sizeof(addr.sun_path)) >=
+	    sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	unlink(addr.sun_path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		r = -errno;
+		close(fd);
+		return r;
+	}
+
+	vdev->listener = (struct vsock_fd) { .fd = fd, .type = VSOCK_FD_LISTEN };
+	return 0;
+}
+
+/*
+ * Without vhost, guest streams to host port P are forwarded to the unix
+ * socket uds_path_P. Host applications reach the guest by connecting to
+ * uds_path and sending "CONNECT <port>\n", after which they get back
+ * "OK <host port>\n".
+ */
+static int virtio_vsock_mux_init(struct kvm *kvm, struct vsock_dev *vdev)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	int i, r;
+
+	vdev->uds_path = kvm->cfg.vsock_uds;
+	mutex_init(&vdev->mutex);
+	for (i = 0; i < VSOCK_CONN_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&vdev->conns[i]);
+	INIT_LIST_HEAD(&vdev->handshakes);
+	INIT_LIST_HEAD(&vdev->rx_conns);
+	INIT_LIST_HEAD(&vdev->ctrl_pkts);
+	INIT_LIST_HEAD(&vdev->closed);
+	vdev->next_port = VSOCK_HOST_PORT_BASE;
+
+	vdev->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (vdev->epoll_fd < 0)
+		return -errno;
+
+	vdev->kick.type = VSOCK_FD_KICK;
+	vdev->kick.fd = eventfd(0, EFD_CLOEXEC);
+	if (vdev->kick.fd < 0) {
+		r = -errno;
+		goto err_close_epoll;
+	}
+
+	r = vsock_listen(vdev);
+	if (r < 0) {
+		pr_err("virtio-vsock: cannot listen on %s", vdev->uds_path);
+		goto err_close_kick;
+	}
+
+	ev.data.ptr = &vdev->kick;
+	if (epoll_ctl(vdev->epoll_fd, EPOLL_CTL_ADD, vdev->kick.fd, &ev) < 0)
+		goto err_errno;
+	ev.data.ptr = &vdev->listener;
+	if (epoll_ctl(vdev->epoll_fd, EPOLL_CTL_ADD, vdev->listener.fd, &ev) < 0)
+		goto err_errno;
+
+	r = -pthread_create(&vdev->thread, NULL, vsock_mux_thread, vdev);
+	if (r)
+		goto err_close_listener;
+
+	return 0;
+
+err_errno:
+	r = -errno;
+err_close_listener:
+	close(vdev->listener.fd);
+	unlink(vdev->uds_path);
+err_close_kick:
+	close(vdev->kick.fd);
+err_close_epoll:
+	close(vdev->epoll_fd);
+	vdev->uds_path = NULL;
+	return r;
+}
+
+static void virtio_vsock_mux_exit(struct vsock_dev *vdev)
+{
+	pthread_cancel(vdev->thread);
+	pthread_join(vdev->thread, NULL);
+
+	vsock_reset_all(vdev);
+	vsock_free_closed(vdev);
+	close(vdev->listener.fd);
+	unlink(vdev->uds_path);
+	close(vdev->kick.fd);
+	close(vdev->epoll_fd);
+}
+
 static int virtio_vsock_init_one(struct kvm *kvm, u64 guest_cid)
 {
 	struct vsock_dev *vdev;
@@ -208,13 +1162,21 @@ static int virtio_vsock_init_one(struct kvm *kvm, u64 guest_cid)
 
 	list_add_tail(&vdev->list, &vdevs);
 
+	/* Snapshots don't keep the connections to host sockets */
+	snapshot__block("virtio-vsock");
 	r = virtio_init(kvm, vdev, &vdev->vdev, &vsock_dev_virtio_ops,
 		    kvm->cfg.virtio_transport, PCI_DEVICE_ID_VIRTIO_VSOCK,
 		    VIRTIO_ID_VSOCK, PCI_CLASS_VSOCK);
 	if (r < 0)
 	    return r;
 
-	virtio_vhost_vsock_init(kvm, vdev);
+	if (kvm->cfg.vsock_uds) {
+		r = virtio_vsock_mux_init(kvm, vdev);
+		if (r < 0)
+			return r;
+	} else {
+		virtio_vhost_vsock_init(kvm, vdev);
+	}
 
 	if (compat_id == -1)
 		compat_id = virtio_compat_add_message("virtio-vsock", "CONFIG_VIRTIO_VSOCKETS");
@@ -224,6 +1186,9 @@ static int virtio_vsock_init_one(struct kvm *kvm, u64 guest_cid)
 
 static int virtio_vsock_exit_one(struct kvm *kvm, struct vsock_dev *vdev)
 {
+	if (vdev->uds_path)
+		virtio_vsock_mux_exit(vdev);
+
 	list_del(&vdev->list);
 	free(vdev);
 
@@ -234,10 +1199,11 @@ int virtio_vsock_init(struct kvm *kvm)
 {
 	int r;
 
-	if (kvm->cfg.vsock_cid == 0)
+	if (kvm->cfg.vsock_cid == 0 && !kvm->cfg.vsock_uds)
 		return 0;
 
-	r = virtio_vsock_init_one(kvm, kvm->cfg.vsock_cid);
+	r = virtio_vsock_init_one(kvm, kvm->cfg.vsock_cid ?:
+				  VSOCK_DEFAULT_GUEST_CID);
 	if (r < 0)
 		goto cleanup;
 
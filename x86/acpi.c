@@ -0,0 +1,1048 @@
+#include "kvm/kvm.h"
+#include "kvm/acpi.h"
+#include "kvm/apic.h"
+#include "kvm/cpu-hotplug.h"
+#include "kvm/util.h"
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+
+#include <string.h>
+
+/*
+ * The static tables of ACPI: an RSDP pointing to an XSDT, which lists a FADT
+ * for hardware-reduced ACPI with an empty DSDT, the MADT and, with --numa,
+ * the SRAT and SLIT. Unlike the MP table, the MADT names vCPUs with x2APIC
+ * IDs, so guests can have more than 255 vCPUs.
+ *
+ * The DSDT has no devices, so guests keep finding PCI devices and routing
+ * their interrupts without ACPI, as the kernel command line asks. With
+ * --max-cpus, it has the processor devices and the GED through which the
+ * guest hears of the vCPUs that "lkvm cpu" plugs and unplugs.
+ */
+
+#define ACPI_OEM_ID		"KVMTLS"
+#define ACPI_OEM_TABLE_ID	"LKVM    "
+#define ACPI_CREATOR_ID		"LKVM"
+
+struct acpi_rsdp {
+	char	signature[8];
+	u8	checksum;
+	char	oem_id[6];
+	u8	revision;
+	u32	rsdt_address;
+	/* From revision 2 */
+	u32	length;
+	u64	xsdt_address;
+	u8	extended_checksum;
+	u8	reserved[3];
+} __attribute__((packed));
+
+struct acpi_table_header {
+	char	signature[4];
+	u32	length;
+	u8	revision;
+	u8	checksum;
+	char	oem_id[6];
+	char	oem_table_id[8];
+	u32	oem_revision;
+	char	creator_id[4];
+	u32	creator_revision;
+} __attribute__((packed));
+
+/* Generic Address Structure */
+struct acpi_gas {
+	u8	space_id;
+	u8	bit_width;
+	u8	bit_offset;
+	u8	access_width;
+	u64	address;
+} __attribute__((packed));
+
+/* Revision 6 */
+struct acpi_fadt {
+	struct acpi_table_header	header;
+	u32				facs;
+	u32				dsdt;
+	u8				model;
+	u8				preferred_profile;
+	u16				sci_interrupt;
+	u32				smi_command;
+	u8				acpi_enable;
+	u8				acpi_disable;
+	u8				s4_bios_request;
+	u8				pstate_control;
+	u32				pm1a_event_block;
+	u32				pm1b_event_block;
+	u32				pm1a_control_block;
+	u32				pm1b_control_block;
+	u32				pm2_control_block;
+	u32				pm_timer_block;
+	u32				gpe0_block;
+	u32				gpe1_block;
+	u8				pm1_event_length;
+	u8				pm1_control_length;
+	u8				pm2_control_length;
+	u8				pm_timer_length;
+	u8				gpe0_block_length;
+	u8				gpe1_block_length;
+	u8				gpe1_base;
+	u8				cst_control;
+	u16				c2_latency;
+	u16				c3_latency;
+	u16				flush_size;
+	u16				flush_stride;
+	u8				duty_offset;
+	u8				duty_width;
+	u8				day_alarm;
+	u8				month_alarm;
+	u8				century;
+	u16				boot_flags;
+	u8				reserved;
+	u32				flags;
+	struct acpi_gas			reset_register;
+	u8				reset_value;
+	u16				arm_boot_flags;
+	u8				minor_revision;
+	u64				xfacs;
+	u64				xdsdt;
+	struct acpi_gas			xpm1a_event_block;
+	struct acpi_gas			xpm1b_event_block;
+	struct acpi_gas			xpm1a_control_block;
+	struct acpi_gas			xpm1b_control_block;
+	struct acpi_gas			xpm2_control_block;
+	struct acpi_gas			xpm_timer_block;
+	struct acpi_gas			xgpe0_block;
+	struct acpi_gas			xgpe1_block;
+	struct acpi_gas			sleep_control;
+	struct acpi_gas			sleep_status;
+	u64				hypervisor_id;
+} __attribute__((packed));
+
+#define ACPI_FADT_LEGACY_DEVICES	(1 << 0)
+#define ACPI_FADT_8042			(1 << 1)
+
+#define ACPI_FADT_POWER_BUTTON		(1 << 4)
+#define ACPI_FADT_SLEEP_BUTTON		(1 << 5)
+#define ACPI_FADT_HW_REDUCED		(1 << 20)
+
+struct acpi_madt {
+	struct acpi_table_header	header;
+	u32				lapic_address;
+	u32				flags;
+} __attribute__((packed));
+
+#define ACPI_MADT_PCAT_COMPAT		(1 << 0)
+#define ACPI_MADT_ENABLED		(1 << 0)
+
+#define ACPI_MADT_TYPE_LAPIC		0
+#define ACPI_MADT_TYPE_IOAPIC		1
+#define ACPI_MADT_TYPE_LAPIC_NMI	4
+#define ACPI_MADT_TYPE_X2APIC		9
+#define ACPI_MADT_TYPE_X2APIC_NMI	10
+
+struct acpi_madt_lapic {
+	u8	type;
+	u8	length;
+	u8	processor_id;
+	u8	apic_id;
+	u32	flags;
+} __attribute__((packed));
+
+struct acpi_madt_ioapic {
+	u8	type;
+	u8	length;
+	u8	id;
+	u8	reserved;
+	u32	address;
+	u32	gsi_base;
+} __attribute__((packed));
+
+struct acpi_madt_lapic_nmi {
+	u8	type;
+	u8	length;
+	u8	processor_id;
+	u16	flags;
+	u8	lint;
+} __attribute__((packed));
+
+struct acpi_madt_x2apic {
+	u8	type;
+	u8	length;
+	u16	reserved;
+	u32	x2apic_id;
+	u32	flags;
+	u32	uid;
+} __attribute__((packed));
+
+struct acpi_madt_x2apic_nmi {
+	u8	type;
+	u8	length;
+	u16	flags;
+	u32	uid;
+	u8	lint;
+	u8	reserved[3];
+} __attribute__((packed));
+
+struct acpi_srat {
+	struct acpi_table_header	header;
+	u32				table_revision;
+	u64				reserved;
+} __attribute__((packed));
+
+#define ACPI_SRAT_TYPE_CPU_AFFINITY	0
+#define ACPI_SRAT_TYPE_MEMORY_AFFINITY	1
+#define ACPI_SRAT_TYPE_X2APIC_AFFINITY	2
+
+#define ACPI_SRAT_ENABLED		(1 << 0)
+
+struct acpi_srat_cpu_affinity {
+	u8	type;
+	u8	length;
+	u8	proximity_domain_lo;
+	u8	apic_id;
+	u32	flags;
+	u8	local_sapic_eid;
+	u8	proximity_domain_hi[3];
+	u32	clock_domain;
+} __attribute__((packed));
+
+struct acpi_srat_mem_affinity {
+	u8	type;
+	u8	length;
+	u32	proximity_domain;
+	u16	reserved;
+	u64	base_address;
+	u64	length_bytes;
+	u32	reserved1;
+	u32	flags;
+	u64	reserved2;
+} __attribute__((packed));
+
+struct acpi_srat_x2apic_affinity {
+	u8	type;
+	u8	length;
+	u16	reserved;
+	u32	proximity_domain;
+	u32	x2apic_id;
+	u32	flags;
+	u32	clock_domain;
+	u32	reserved1;
+} __attribute__((packed));
+
+struct acpi_slit {
+	struct acpi_table_header	header;
+	u64				localities;
+	u8				entry[];
+} __attribute__((packed));
+
+/* The FADT, MADT, SRAT and SLIT */
+#define ACPI_MAX_TABLES			4
+
+/* Where the tables are put together, in guest memory */
+struct acpi_tables {
+	struct kvm	*kvm;
+	void		*start;
+	void		*cur;
+	void		*end;
+	u64		xsdt[ACPI_MAX_TABLES];
+	u32		nr_tables;
+};
+
+#define ACPI_GPA(t, p)	(ACPI_TABLES_START + (u64)((void *)(p) - (t)->start))
+
+/* LAPIC entries can't name the 256th CPU, nor have 0xff as a UID */
+#define ACPI_MADT_LAPIC_MAX		255
+#define ACPI_ALL_PROCESSORS_U8		0xff
+#define ACPI_ALL_PROCESSORS		0xffffffff
+
+static u8 acpi_checksum(void *p, size_t len)
+{
+	u8 *b = p, sum = 0;
+
+	while (len--)
+		sum += *b++;
+
+	return -sum;
+}
+
+static void acpi_header(struct acpi_table_header *h, const char *sig,
+			u8 revision, u32 length)
+{
+	memcpy(h->signature, sig, sizeof(h->signature));
+	h->length = length;
+	h->revision = revision;
+	memcpy(h->oem_id, ACPI_OEM_ID, sizeof(h->oem_id));
+	memcpy(h->oem_table_id, ACPI_OEM_TABLE_ID, sizeof(h->oem_table_id));
+	h->oem_revision = 1;
+	memcpy(h->creator_id, ACPI_CREATOR_ID, sizeof(h->creator_id));
+	h->creator_revision = 1;
+	h->checksum = 0;
+	h->checksum = acpi_checksum(h, length);
+}
+
+/* Room for a table of @len bytes, 16-byte aligned after the previous one */
+static void *acpi_alloc(struct acpi_tables *t, u32 len)
+{
+	void *p = (void *)ALIGN((unsigned long)t->cur, 16);
+
+	if (p + len > t->end)
+		return NULL;
+
+	t->cur = p + len;
+	return p;
+}
+
+static void acpi_add_table(struct acpi_tables *t, struct acpi_table_header *h)
+{
+	t->xsdt[t->nr_tables++] = ACPI_GPA(t, h);
+}
+
+/* APIC IDs grow with the vCPUs, the first ones fit xAPIC entries */
+static u32 acpi_nr_lapics(struct kvm *kvm)
+{
+	u32 n = 0;
+
+	while (n < (u32)kvm->nrcpus &&
+	       kvm__apic_id(kvm, n) < ACPI_MADT_LAPIC_MAX)
+		n++;
+
+	return n;
+}
+
+/*
+ * AML, written in place after the DSDT header. The package length of a
+ * scope, device, method or buffer is only known at its end, where its
+ * contents move up to make room for the shortest encoding of it.
+ */
+struct aml {
+	u8	*start;
+	u8	*cur;
+	u8	*end;
+	bool	overflow;
+};
+
+#define AML_ZERO		0x00
+#define AML_ONE			0x01
+#define AML_NAME		0x08
+#define AML_BYTE_PREFIX		0x0a
+#define AML_WORD_PREFIX		0x0b
+#define AML_DWORD_PREFIX	0x0c
+#define AML_STRING_PREFIX	0x0d
+#define AML_SCOPE		0x10
+#define AML_BUFFER		0x11
+#define AML_METHOD		0x14
+#define AML_ROOT_CHAR		0x5c
+#define AML_EXT_PREFIX		0x5b
+#define AML_LOCAL0		0x60
+#define AML_ARG0		0x68
+#define AML_STORE		0x70
+#define AML_NOTIFY		0x86
+#define AML_IF			0xa0
+#define AML_ELSE		0xa1
+#define AML_RETURN		0xa4
+
+#define AML_EXT_MUTEX		0x01
+#define AML_EXT_ACQUIRE		0x23
+#define AML_EXT_RELEASE		0x27
+#define AML_EXT_OP_REGION	0x80
+#define AML_EXT_FIELD		0x81
+#define AML_EXT_DEVICE		0x82
+
+#define AML_SYSTEM_IO		0x01
+#define AML_FIELD_BYTE_ACC	0x01
+#define AML_FIELD_DWORD_ACC	0x03
+#define AML_FIELD_WRITE_ZEROS	(2 << 5)
+
+/* Device notifications of the ACPI spec */
+#define AML_NOTIFY_CHECK	1
+#define AML_NOTIFY_EJECT	3
+
+static void aml_bytes(struct aml *a, const void *p, u32 len)
+{
+	if (a->cur + len > a->end) {
+		a->overflow = true;
+		return;
+	}
+
+	memcpy(a->cur, p, len);
+	a->cur += len;
+}
+
+static void aml_byte(struct aml *a, u8 b)
+{
+	aml_bytes(a, &b, 1);
+}
+
+static void aml_op2(struct aml *a, u8 op)
+{
+	aml_byte(a, AML_EXT_PREFIX);
+	aml_byte(a, op);
+}
+
+/* A NameSeg, four characters */
+static void aml_name(struct aml *a, const char *name)
+{
+	aml_bytes(a, name, 4);
+}
+
+static void aml_int(struct aml *a, u32 val)
+{
+	if (val <= AML_ONE) {
+		aml_byte(a, val);
+	} else if (val <= 0xff) {
+		aml_byte(a, AML_BYTE_PREFIX);
+		aml_byte(a, val);
+	} else if (val <= 0xffff) {
+		aml_byte(a, AML_WORD_PREFIX);
+		aml_bytes(a, &val, 2);
+	} else {
+		aml_byte(a, AML_DWORD_PREFIX);
+		aml_bytes(a, &val, 4);
+	}
+}
+
+static void aml_string(struct aml *a, const char *s)
+{
+	aml_byte(a, AML_STRING_PREFIX);
+	aml_bytes(a, s, strlen(s) + 1);
+}
+
+/* Where the package length goes, for aml_pkg_end() */
+static u32 aml_pkg_start(struct aml *a, u8 op)
+{
+	aml_byte(a, op);
+	return a->cur - a->start;
+}
+
+static u32 aml_pkg_start2(struct aml *a, u8 op)
+{
+	aml_byte(a, AML_EXT_PREFIX);
+	return aml_pkg_start(a, op);
+}
+
+static void aml_pkg_end(struct aml *a, u32 pkg)
+{
+	u8 *p = a->start + pkg;
+	u32 body = a->cur - p, len, n;
+
+	if (a->overflow)
+		return;
+
+	/* One byte has 6 bits of length, each of up to three more adds 8 */
+	for (n = 1; n < 4; n++) {
+		len = body + n;
+		if (len < (n == 1 ? 1U << 6 : 1U << (4 + 8 * (n - 1))))
+			break;
+	}
+	len = body + n;
+
+	if (a->cur + n > a->end) {
+		a->overflow = true;
+		return;
+	}
+	memmove(p + n, p, body);
+	a->cur += n;
+
+	if (n == 1) {
+		p[0] = len;
+		return;
+	}
+
+	p[0] = (n - 1) << 6 | (len & 0xf);
+	for (len >>= 4; --n; len >>= 8)
+		*++p = len;
+}
+
+static void aml_method(struct aml *a, u32 *pkg, const char *name,
+				  u8 args)
+{
+	*pkg = aml_pkg_start(a, AML_METHOD);
+	aml_name(a, name);
+	aml_byte(a, args);
+}
+
+static void aml_acquire(struct aml *a, const char *mutex)
+{
+	aml_op2(a, AML_EXT_ACQUIRE);
+	aml_name(a, mutex);
+	aml_bytes(a, &(u16){ 0xffff }, 2);
+}
+
+static void aml_release(struct aml *a, const char *mutex)
+{
+	aml_op2(a, AML_EXT_RELEASE);
+	aml_name(a, mutex);
+}
+
+/* Store (val, name) */
+static void aml_store_int(struct aml *a, u32 val, const char *name)
+{
+	aml_byte(a, AML_STORE);
+	aml_int(a, val);
+	aml_name(a, name);
+}
+
+static void aml_cpu_name(char *name, u32 cpu)
+{
+	/* Room for the 4096 vCPUs of x2APIC IDs that KVM goes up to */
+	snprintf(name, 5, "C%03X", cpu & 0xfff);
+}
+
+/*
+ * The registers of x86/cpu-hotplug.c, and methods to read the status of a
+ * vCPU, to eject one, and to notify the guest of the vCPUs to plug or unplug.
+ */
+static void aml_cpu_hotplug_regs(struct aml *a, u32 ncpus)
+{
+	char name[5];
+	u32 pkg, ifpkg, elsepkg, i;
+
+	aml_op2(a, AML_EXT_OP_REGION);
+	aml_name(a, "CPHP");
+	aml_byte(a, AML_SYSTEM_IO);
+	aml_int(a, CPU_HOTPLUG_IOPORT);
+	aml_int(a, CPU_HOTPLUG_IOPORT_LEN);
+
+	pkg = aml_pkg_start2(a, AML_EXT_FIELD);
+	aml_name(a, "CPHP");
+	aml_byte(a, AML_FIELD_DWORD_ACC);
+	aml_name(a, "CSEL");
+	aml_byte(a, 32);
+	aml_pkg_end(a, pkg);
+
+	pkg = aml_pkg_start2(a, AML_EXT_FIELD);
+	aml_name(a, "CPHP");
+	aml_byte(a, AML_FIELD_BYTE_ACC | AML_FIELD_WRITE_ZEROS);
+	/* Offset (CPU_HOTPLUG_STATUS) */
+	aml_byte(a, 0);
+	aml_byte(a, CPU_HOTPLUG_STATUS * 8);
+	aml_name(a, "CPRS");
+	aml_byte(a, 1);
+	aml_name(a, "CINS");
+	aml_byte(a, 1);
+	aml_name(a, "CRMV");
+	aml_byte(a, 1);
+	aml_name(a, "CEJ0");
+	aml_byte(a, 1);
+	aml_pkg_end(a, pkg);
+
+	aml_op2(a, AML_EXT_MUTEX);
+	aml_name(a, "CPLK");
+	aml_byte(a, 0);
+
+	/* Method (CSTA, 1): 0xf if vCPU Arg0 is present, else 0 */
+	aml_method(a, &pkg, "CSTA", 1);
+	aml_acquire(a, "CPLK");
+	aml_byte(a, AML_STORE);
+	aml_byte(a, AML_ARG0);
+	aml_name(a, "CSEL");
+	aml_byte(a, AML_STORE);
+	aml_byte(a, AML_ZERO);
+	aml_byte(a, AML_LOCAL0);
+	ifpkg = aml_pkg_start(a, AML_IF);
+	aml_name(a, "CPRS");
+	aml_byte(a, AML_STORE);
+	aml_int(a, 0xf);
+	aml_byte(a, AML_LOCAL0);
+	aml_pkg_end(a, ifpkg);
+	aml_release(a, "CPLK");
+	aml_byte(a, AML_RETURN);
+	aml_byte(a, AML_LOCAL0);
+	aml_pkg_end(a, pkg);
+
+	/* Method (CEJT, 1): eject vCPU Arg0 */
+	aml_method(a, &pkg, "CEJT", 1);
+	aml_acquire(a, "CPLK");
+	aml_byte(a, AML_STORE);
+	aml_byte(a, AML_ARG0);
+	aml_name(a, "CSEL");
+	aml_store_int(a, 1, "CEJ0");
+	aml_release(a, "CPLK");
+	aml_pkg_end(a, pkg);
+
+	/* Method (CSCN, 0): notify the guest of each vCPU that changed */
+	aml_method(a, &pkg, "CSCN", 0);
+	aml_acquire(a, "CPLK");
+	for (i = 1; i < ncpus; i++) {
+		aml_cpu_name(name, i);
+		aml_store_int(a, i, "CSEL");
+
+		ifpkg = aml_pkg_start(a, AML_IF);
+		aml_name(a, "CINS");
+		aml_byte(a, AML_NOTIFY);
+		aml_name(a, name);
+		aml_int(a, AML_NOTIFY_CHECK);
+		aml_store_int(a, 1, "CINS");
+		aml_pkg_end(a, ifpkg);
+
+		elsepkg = aml_pkg_start(a, AML_ELSE);
+		ifpkg = aml_pkg_start(a, AML_IF);
+		aml_name(a, "CRMV");
+		aml_byte(a, AML_NOTIFY);
+		aml_name(a, name);
+		aml_int(a, AML_NOTIFY_EJECT);
+		aml_store_int(a, 1, "CRMV");
+		aml_pkg_end(a, ifpkg);
+		aml_pkg_end(a, elsepkg);
+	}
+	aml_release(a, "CPLK");
+	aml_pkg_end(a, pkg);
+}
+
+/* The processor device of a vCPU, with the same entry as the MADT has */
+static void aml_cpu_device(struct aml *a, struct kvm *kvm, u32 cpu, bool lapic)
+{
+	struct acpi_madt_x2apic x2apic = {
+		.type		= ACPI_MADT_TYPE_X2APIC,
+		.length		= sizeof(x2apic),
+		.x2apic_id	= kvm__apic_id(kvm, cpu),
+		.flags		= ACPI_MADT_ENABLED,
+		.uid		= cpu,
+	};
+	struct acpi_madt_lapic madt_lapic = {
+		.type		= ACPI_MADT_TYPE_LAPIC,
+		.length		= sizeof(madt_lapic),
+		.processor_id	= cpu,
+		.apic_id	= kvm__apic_id(kvm, cpu),
+		.flags		= ACPI_MADT_ENABLED,
+	};
+	char name[5];
+	u32 pkg, mpkg;
+
+	aml_cpu_name(name, cpu);
+	pkg = aml_pkg_start2(a, AML_EXT_DEVICE);
+	aml_name(a, name);
+
+	aml_byte(a, AML_NAME);
+	aml_name(a, "_HID");
+	aml_string(a, "ACPI0007");
+	aml_byte(a, AML_NAME);
+	aml_name(a, "_UID");
+	aml_int(a, cpu);
+
+	aml_method(a, &mpkg, "_STA", 0);
+	aml_byte(a, AML_RETURN);
+	aml_name(a, "CSTA");
+	aml_int(a, cpu);
+	aml_pkg_end(a, mpkg);
+
+	aml_byte(a, AML_NAME);
+	aml_name(a, "_MAT");
+	mpkg = aml_pkg_start(a, AML_BUFFER);
+	if (lapic) {
+		aml_int(a, sizeof(madt_lapic));
+		aml_bytes(a, &madt_lapic, sizeof(madt_lapic));
+	} else {
+		aml_int(a, sizeof(x2apic));
+		aml_bytes(a, &x2apic, sizeof(x2apic));
+	}
+	aml_pkg_end(a, mpkg);
+
+	/* The guest stops with vCPU 0 */
+	if (cpu) {
+		aml_method(a, &mpkg, "_EJ0", 1);
+		aml_name(a, "CEJT");
+		aml_int(a, cpu);
+		aml_pkg_end(a, mpkg);
+	}
+
+	aml_pkg_end(a, pkg);
+}
+
+/* A Generic Event Device, whose interrupt has the vCPUs scanned */
+static void aml_ged(struct aml *a, u32 gsi)
+{
+	u8 crs[] = {
+		/* Extended interrupt, consumer, edge, active high, one */
+		0x89, 6, 0, 0x03, 1,
+		gsi, gsi >> 8, gsi >> 16, gsi >> 24,
+		/* End tag */
+		0x79, 0,
+	};
+	u32 pkg, mpkg;
+
+	pkg = aml_pkg_start2(a, AML_EXT_DEVICE);
+	aml_name(a, "GED0");
+
+	aml_byte(a, AML_NAME);
+	aml_name(a, "_HID");
+	aml_string(a, "ACPI0013");
+
+	aml_byte(a, AML_NAME);
+	aml_name(a, "_CRS");
+	mpkg = aml_pkg_start(a, AML_BUFFER);
+	aml_int(a, sizeof(crs));
+	aml_bytes(a, crs, sizeof(crs));
+	aml_pkg_end(a, mpkg);
+
+	aml_method(a, &mpkg, "_EVT", 1);
+	aml_name(a, "CSCN");
+	aml_pkg_end(a, mpkg);
+
+	aml_pkg_end(a, pkg);
+}
+
+static void aml_cpu_hotplug(struct aml *a, struct kvm *kvm)
+{
+	u32 i, pkg, nlapics = acpi_nr_lapics(kvm);
+
+	/* Scope (\_SB) */
+	pkg = aml_pkg_start(a, AML_SCOPE);
+	aml_byte(a, AML_ROOT_CHAR);
+	aml_name(a, "_SB_");
+
+	aml_cpu_hotplug_regs(a, kvm->nrcpus);
+	for (i = 0; i < (u32)kvm->nrcpus; i++)
+		aml_cpu_device(a, kvm, i, i < nlapics);
+	aml_ged(a, cpu_hotplug__irq());
+
+	aml_pkg_end(a, pkg);
+}
+
+static int acpi_build_dsdt(struct acpi_tables *t, u64 *dsdt_addr)
+{
+	struct acpi_table_header *dsdt;
+	struct aml aml;
+	u32 len;
+
+	/* The AML goes right after the header, fitting what is left */
+	dsdt = (void *)ALIGN((unsigned long)t->cur, 16);
+	aml = (struct aml) {
+		.start	= (u8 *)&dsdt[1],
+		.cur	= (u8 *)&dsdt[1],
+		.end	= t->end,
+	};
+	if (aml.start > aml.end)
+		return -E2BIG;
+
+	if (cpu_hotplug__enabled())
+		aml_cpu_hotplug(&aml, t->kvm);
+	if (aml.overflow)
+		return -E2BIG;
+
+	len = sizeof(*dsdt) + (aml.cur - aml.start);
+	dsdt = acpi_alloc(t, len);
+	if (!dsdt)
+		return -E2BIG;
+
+	acpi_header(dsdt, "DSDT", 2, len);
+	*dsdt_addr = ACPI_GPA(t, dsdt);
+
+	return 0;
+}
+
+/*
+ * Hardware-reduced, so that guests expect neither the PM timer nor the event
+ * and control blocks that kvmtool doesn't emulate, and use the LAPIC timer.
+ */
+static int acpi_build_fadt(struct acpi_tables *t, u64 dsdt_addr)
+{
+	struct acpi_fadt *fadt = acpi_alloc(t, sizeof(*fadt));
+
+	if (!fadt)
+		return -E2BIG;
+
+	*fadt = (struct acpi_fadt) {
+		.dsdt		= dsdt_addr,
+		.xdsdt		= dsdt_addr,
+		.boot_flags	= ACPI_FADT_LEGACY_DEVICES | ACPI_FADT_8042,
+		.flags		= ACPI_FADT_HW_REDUCED |
+				  ACPI_FADT_POWER_BUTTON |
+				  ACPI_FADT_SLEEP_BUTTON,
+	};
+	acpi_header(&fadt->header, "FACP", 6, sizeof(*fadt));
+	acpi_add_table(t, &fadt->header);
+
+	return 0;
+}
+
+/* Parked vCPUs are disabled, which the guest takes as hot-pluggable */
+static u32 acpi_cpu_flags(struct kvm *kvm, u32 cpu)
+{
+	return cpu < (u32)kvm->cfg.nrcpus ? ACPI_MADT_ENABLED : 0;
+}
+
+static int acpi_build_madt(struct acpi_tables *t)
+{
+	struct kvm *kvm = t->kvm;
+	u32 ncpus = kvm->nrcpus, nlapics = acpi_nr_lapics(kvm);
+	struct acpi_madt_x2apic_nmi *x2apic_nmi;
+	struct acpi_madt_lapic_nmi *lapic_nmi;
+	struct acpi_madt_x2apic *x2apic;
+	struct acpi_madt_ioapic *ioapic;
+	struct acpi_madt_lapic *lapic;
+	struct acpi_madt *madt;
+	u32 i, len;
+	void *p;
+
+	len = sizeof(*madt) + nlapics * sizeof(*lapic) +
+	      (ncpus - nlapics) * sizeof(*x2apic) + sizeof(*ioapic) +
+	      sizeof(*lapic_nmi) +
+	      (ncpus > nlapics ? sizeof(*x2apic_nmi) : 0);
+	madt = acpi_alloc(t, len);
+	if (!madt)
+		return -E2BIG;
+	p = &madt[1];
+
+	*madt = (struct acpi_madt) {
+		.lapic_address	= APIC_ADDR(0),
+		.flags		= ACPI_MADT_PCAT_COMPAT,
+	};
+
+	for (i = 0; i < nlapics; i++) {
+		lapic = p;
+		*lapic = (struct acpi_madt_lapic) {
+			.type		= ACPI_MADT_TYPE_LAPIC,
+			.length		= sizeof(*lapic),
+			.processor_id	= i,
+			.apic_id	= kvm__apic_id(kvm, i),
+			.flags		= acpi_cpu_flags(kvm, i),
+		};
+		p += sizeof(*lapic);
+	}
+
+	for (; i < ncpus; i++) {
+		x2apic = p;
+		*x2apic = (struct acpi_madt_x2apic) {
+			.type		= ACPI_MADT_TYPE_X2APIC,
+			.length		= sizeof(*x2apic),
+			.x2apic_id	= kvm__apic_id(kvm, i),
+			.flags		= acpi_cpu_flags(kvm, i),
+			.uid		= i,
+		};
+		p += sizeof(*x2apic);
+	}
+
+	/* The same IOAPIC as in the MP table */
+	ioapic = p;
+	*ioapic = (struct acpi_madt_ioapic) {
+		.type		= ACPI_MADT_TYPE_IOAPIC,
+		.length		= sizeof(*ioapic),
+		.id		= kvm__apic_id(kvm, ncpus - 1) + 2,
+		.address	= IOAPIC_ADDR(0),
+		.gsi_base	= 0,
+	};
+	p += sizeof(*ioapic);
+
+	/* LINT1 of every CPU is the NMI */
+	lapic_nmi = p;
+	*lapic_nmi = (struct acpi_madt_lapic_nmi) {
+		.type		= ACPI_MADT_TYPE_LAPIC_NMI,
+		.length		= sizeof(*lapic_nmi),
+		.processor_id	= ACPI_ALL_PROCESSORS_U8,
+		.lint		= 1,
+	};
+	p += sizeof(*lapic_nmi);
+
+	if (ncpus > nlapics) {
+		x2apic_nmi = p;
+		*x2apic_nmi = (struct acpi_madt_x2apic_nmi) {
+			.type		= ACPI_MADT_TYPE_X2APIC_NMI,
+			.length		= sizeof(*x2apic_nmi),
+			.uid		= ACPI_ALL_PROCESSORS,
+			.lint		= 1,
+		};
+		p += sizeof(*x2apic_nmi);
+	}
+
+	acpi_header(&madt->header, "APIC", 3, len);
+	acpi_add_table(t, &madt->header);
+
+	return 0;
+}
+
+/*
+ * The RAM of each node, in the order of --numa, with the 32-bit PCI hole
+ * taken out as in kvm__init_ram(). A node across the hole has two ranges.
+ */
+static void *acpi_srat_mem(void *p, u32 node, u64 offset, u64 size)
+{
+	struct acpi_srat_mem_affinity *mem;
+	u64 base, len;
+
+	while (size) {
+		if (offset < KVM_32BIT_GAP_START) {
+			base = offset;
+			len = min(size, KVM_32BIT_GAP_START - offset);
+		} else {
+			base = offset + KVM_32BIT_GAP_SIZE;
+			len = size;
+		}
+
+		mem = p;
+		*mem = (struct acpi_srat_mem_affinity) {
+			.type			= ACPI_SRAT_TYPE_MEMORY_AFFINITY,
+			.length			= sizeof(*mem),
+			.proximity_domain	= node,
+			.base_address		= base,
+			.length_bytes		= len,
+			.flags			= ACPI_SRAT_ENABLED,
+		};
+		p += sizeof(*mem);
+		offset += len;
+		size -= len;
+	}
+
+	return p;
+}
+
+static int acpi_build_srat(struct acpi_tables *t)
+{
+	struct kvm *kvm = t->kvm;
+	u32 ncpus = kvm->nrcpus, nlapics = acpi_nr_lapics(kvm);
+	struct acpi_srat_x2apic_affinity *x2apic;
+	struct acpi_srat_cpu_affinity *lapic;
+	struct acpi_srat *srat;
+	u64 offset = 0;
+	u32 i, len;
+	void *p;
+	int node;
+
+	/* Up to two memory ranges per node */
+	len = sizeof(*srat) + nlapics * sizeof(*lapic) +
+	      (ncpus - nlapics) * sizeof(*x2apic) +
+	      2 * kvm->cfg.nr_guest_numa * sizeof(struct acpi_srat_mem_affinity);
+	srat = acpi_alloc(t, len);
+	if (!srat)
+		return -E2BIG;
+
+	*srat = (struct acpi_srat) {
+		.table_revision	= 1,
+	};
+	p = &srat[1];
+
+	for (i = 0; i < ncpus; i++) {
+		node = kvm__numa_node_of_cpu(kvm, i);
+		if (i < nlapics) {
+			lapic = p;
+			*lapic = (struct acpi_srat_cpu_affinity) {
+				.type			= ACPI_SRAT_TYPE_CPU_AFFINITY,
+				.length			= sizeof(*lapic),
+				.proximity_domain_lo	= node,
+				.apic_id		= kvm__apic_id(kvm, i),
+				.flags			= ACPI_SRAT_ENABLED,
+			};
+			p += sizeof(*lapic);
+		} else {
+			x2apic = p;
+			*x2apic = (struct acpi_srat_x2apic_affinity) {
+				.type			= ACPI_SRAT_TYPE_X2APIC_AFFINITY,
+				.length			= sizeof(*x2apic),
+				.proximity_domain	= node,
+				.x2apic_id		= kvm__apic_id(kvm, i),
+				.flags			= ACPI_SRAT_ENABLED,
+			};
+			p += sizeof(*x2apic);
+		}
+	}
+
+	for (node = 0; node < kvm->cfg.nr_guest_numa; node++) {
+		u64 size = kvm->cfg.guest_numa[node].mem_size;
+
+		p = acpi_srat_mem(p, node, offset, size);
+		offset += size;
+	}
+
+	/* Shrink the table to the ranges there are, the next one goes after */
+	len = p - (void *)srat;
+	t->cur = p;
+	acpi_header(&srat->header, "SRAT", 3, len);
+	acpi_add_table(t, &srat->header);
+
+	return 0;
+}
+
+static int acpi_build_slit(struct acpi_tables *t)
+{
+	int i, j, n = t->kvm->cfg.nr_guest_numa;
+	struct acpi_slit *slit;
+	u32 len;
+
+	len = sizeof(*slit) + n * n;
+	slit = acpi_alloc(t, len);
+	if (!slit)
+		return -E2BIG;
+
+	slit->localities = n;
+	for (i = 0; i < n; i++)
+		for (j = 0; j < n; j++)
+			slit->entry[i * n + j] = i == j ?
+						 KVM_NUMA_LOCAL_DISTANCE :
+						 KVM_NUMA_REMOTE_DISTANCE;
+
+	acpi_header(&slit->header, "SLIT", 1, len);
+	acpi_add_table(t, &slit->header);
+
+	return 0;
+}
+
+static int acpi_build_xsdt(struct acpi_tables *t, u64 *xsdt_addr)
+{
+	struct acpi_table_header *xsdt;
+	u32 len;
+
+	len = sizeof(*xsdt) + t->nr_tables * sizeof(t->xsdt[0]);
+	xsdt = acpi_alloc(t, len);
+	if (!xsdt)
+		return -E2BIG;
+
+	memcpy(&xsdt[1], t->xsdt, t->nr_tables * sizeof(t->xsdt[0]));
+	acpi_header(xsdt, "XSDT", 1, len);
+	*xsdt_addr = ACPI_GPA(t, xsdt);
+
+	return 0;
+}
+
+static int acpi__init(struct kvm *kvm)
+{
+	struct acpi_tables t = { .kvm = kvm };
+	u64 dsdt_addr, xsdt_addr;
+	struct acpi_rsdp *rsdp;
+	int r;
+
+	if (!kvm->cfg.arch.acpi)
+		return 0;
+
+	/* Firmware has that memory, and its own tables if it wants them */
+	if (kvm->cfg.firmware_filename) {
+		pr_warning("ACPI: --acpi is ignored when booting firmware");
+		return 0;
+	}
+
+	t.start = guest_flat_to_host(kvm, ACPI_TABLES_START);
+	t.end = t.start + ACPI_TABLES_SIZE;
+	memset(t.start, 0, ACPI_TABLES_SIZE);
+
+	/* At the start of the area, where guests look for it */
+	t.cur = t.start;
+	rsdp = acpi_alloc(&t, sizeof(*rsdp));
+
+	r = acpi_build_dsdt(&t, &dsdt_addr);
+	if (!r)
+		r = acpi_build_fadt(&t, dsdt_addr);
+	if (!r)
+		r = acpi_build_madt(&t);
+	if (!r && kvm->cfg.nr_guest_numa)
+		r = acpi_build_srat(&t);
+	if (!r && kvm->cfg.nr_guest_numa)
+		r = acpi_build_slit(&t);
+	if (!r)
+		r = acpi_build_xsdt(&t, &xsdt_addr);
+	if (r) {
+		pr_err("ACPI: the tables of %d vCPUs don't fit", kvm->nrcpus);
+		return r;
+	}
+
+	memcpy(rsdp->signature, "RSD PTR ", sizeof(rsdp->signature));
+	memcpy(rsdp->oem_id, ACPI_OEM_ID, sizeof(rsdp->oem_id));
+	rsdp->revision = 2;
+	rsdp->length = sizeof(*rsdp);
+	rsdp->xsdt_address = xsdt_addr;
+	/* The first checksum only covers the ACPI 1.0 part */
+	rsdp->checksum = acpi_checksum(rsdp, offsetof(struct acpi_rsdp, length));
+	rsdp->extended_checksum = acpi_checksum(rsdp, sizeof(*rsdp));
+
+	return 0;
+}
+firmware_init(acpi__init);
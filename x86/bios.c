@@ -1,6 +1,7 @@
 #include "kvm/kvm.h"
 #include "kvm/boot-protocol.h"
 #include "kvm/e820.h"
+#include "kvm/acpi.h"
 #include "kvm/interrupt.h"
 #include "kvm/util.h"
 
@@ -73,6 +74,12 @@ static void e820_setup(struct kvm *kvm)
 		.size		= VGA_RAM_BEGIN - EBDA_START,
 		.type		= E820_RESERVED,
 	};
+	if (kvm->cfg.arch.acpi && !kvm->cfg.firmware_filename)
+		mem_map[i++]	= (struct e820entry) {
+			.addr		= ACPI_TABLES_START,
+			.size		= ACPI_TABLES_SIZE,
+			.type		= E820_ACPI,
+		};
 	mem_map[i++]	= (struct e820entry) {
 		.addr		= MB_BIOS_BEGIN,
 		.size		= MB_BIOS_SIZE,
@@ -0,0 +1,153 @@
+#include "kvm/cpu-hotplug.h"
+#include "kvm/ioport.h"
+#include "kvm/irq.h"
+#include "kvm/kvm.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/mutex.h"
+#include "kvm/util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The vCPUs past --cpus are parked, and the MADT has them disabled. When
+ * one is plugged or is to be unplugged, an edge on the interrupt of the GED
+ * of the DSDT makes the guest scan the status of each, and eject those that
+ * it had to give up once they are offline.
+ */
+static u8 *cpu_status;
+static u32 cpu_sel;
+static int cpu_irq = -1;
+static DEFINE_MUTEX(cpu_hotplug_lock);
+
+bool cpu_hotplug__enabled(void)
+{
+	return cpu_status != NULL;
+}
+
+int cpu_hotplug__irq(void)
+{
+	return cpu_irq;
+}
+
+static void cpu_hotplug__io(struct kvm_cpu *vcpu, u64 addr, u8 *data,
+			    u32 len, u8 is_write, void *ptr)
+{
+	struct kvm *kvm = vcpu->kvm;
+	u8 val;
+
+	mutex_lock(&cpu_hotplug_lock);
+	switch (addr - CPU_HOTPLUG_IOPORT) {
+	case CPU_HOTPLUG_SEL:
+		if (is_write && len == 4)
+			cpu_sel = ioport__read32((u32 *)data);
+		else if (len == 4)
+			ioport__write32((u32 *)data, cpu_sel);
+		break;
+	case CPU_HOTPLUG_STATUS:
+		if (cpu_sel >= (u32)kvm->nrcpus) {
+			if (!is_write)
+				ioport__write8(data, 0);
+			break;
+		}
+		if (!is_write) {
+			ioport__write8(data, cpu_status[cpu_sel]);
+			break;
+		}
+
+		val = ioport__read8(data);
+		cpu_status[cpu_sel] &= ~(val & (CPU_HOTPLUG_INSERT |
+						CPU_HOTPLUG_REMOVE));
+		if (val & CPU_HOTPLUG_EJECT)
+			cpu_status[cpu_sel] &= ~(CPU_HOTPLUG_PRESENT |
+						 CPU_HOTPLUG_REMOVE);
+		break;
+	default:
+		if (!is_write)
+			memset(data, 0, len);
+		break;
+	}
+	mutex_unlock(&cpu_hotplug_lock);
+}
+
+static int cpu_hotplug__set(struct kvm_cpu *vcpu, u8 set)
+{
+	if (!cpu_status)
+		return -EOPNOTSUPP;
+
+	mutex_lock(&cpu_hotplug_lock);
+	cpu_status[vcpu->cpu_id] |= set;
+	mutex_unlock(&cpu_hotplug_lock);
+
+	kvm__irq_trigger(vcpu->kvm, cpu_irq);
+
+	return 0;
+}
+
+int kvm_cpu__arch_plug(struct kvm_cpu *vcpu)
+{
+	return cpu_hotplug__set(vcpu, CPU_HOTPLUG_PRESENT | CPU_HOTPLUG_INSERT);
+}
+
+int kvm_cpu__arch_unplug(struct kvm_cpu *vcpu)
+{
+	return cpu_hotplug__set(vcpu, CPU_HOTPLUG_REMOVE);
+}
+
+/* The guest ejected it, after taking it offline */
+bool kvm_cpu__arch_unplugged(struct kvm_cpu *vcpu)
+{
+	bool unplugged;
+
+	mutex_lock(&cpu_hotplug_lock);
+	unplugged = !(cpu_status[vcpu->cpu_id] & CPU_HOTPLUG_PRESENT);
+	mutex_unlock(&cpu_hotplug_lock);
+
+	return unplugged;
+}
+
+static int cpu_hotplug__init(struct kvm *kvm)
+{
+	int i, r;
+
+	if (kvm->cfg.max_cpus <= kvm->cfg.nrcpus)
+		return 0;
+
+	if (!kvm->cfg.arch.acpi)
+		die("--max-cpus needs --acpi on x86");
+
+	/* The guest has no IOAPIC, only the PIC, see kvm__arch_set_cmdline() */
+	cpu_irq = irq__alloc_line();
+	if (cpu_irq >= 16)
+		die("No legacy interrupt left for CPU hotplug");
+
+	cpu_status = calloc(kvm->cfg.max_cpus, sizeof(*cpu_status));
+	if (!cpu_status)
+		return -ENOMEM;
+	for (i = 0; i < kvm->cfg.nrcpus; i++)
+		cpu_status[i] = CPU_HOTPLUG_PRESENT;
+
+	r = kvm__register_pio(kvm, CPU_HOTPLUG_IOPORT, CPU_HOTPLUG_IOPORT_LEN,
+			      cpu_hotplug__io, NULL);
+	if (r < 0) {
+		free(cpu_status);
+		cpu_status = NULL;
+	}
+
+	return r;
+}
+/* Before the PCI devices take the legacy interrupts */
+dev_base_init(cpu_hotplug__init);
+
+static int cpu_hotplug__exit(struct kvm *kvm)
+{
+	if (!cpu_status)
+		return 0;
+
+	kvm__deregister_pio(kvm, CPU_HOTPLUG_IOPORT);
+	free(cpu_status);
+	cpu_status = NULL;
+
+	return 0;
+}
+dev_base_exit(cpu_hotplug__exit);
@@ -8,10 +8,169 @@
 
 #define	MAX_KVM_CPUID_ENTRIES		100
 
-static void filter_cpuid(struct kvm_cpuid2 *kvm_cpuid, int cpu_id)
+/* From the KVM paravirtual interface */
+#define KVM_CPUID_FEATURES		0x40000001
+#define KVM_FEATURE_CLOCKSOURCE		0
+#define KVM_FEATURE_CLOCKSOURCE2	3
+#define KVM_FEATURE_POLL_CONTROL	12
+#define KVM_FEATURE_CLOCKSOURCE_STABLE_BIT	24
+#define KVM_HINTS_REALTIME		0
+
+#define CPUID_1_ECX_TSC_DEADLINE	(1U << 24)
+#define CPUID_80000007_EDX_INVTSC	(1U << 8)
+#define CPUID_1_EDX_HTT			(1U << 28)
+
+/* Levels of the extended topology leaves 0xb and 0x1f */
+#define CPUID_TOPO_LEVEL_INVALID	0
+#define CPUID_TOPO_LEVEL_SMT		1
+#define CPUID_TOPO_LEVEL_CORE		2
+
+/* The sharing fields of the cache leaves 4 and 0x8000001d */
+#define CPUID_CACHE_TYPE(eax)		((eax) & 0x1f)
+#define CPUID_CACHE_LEVEL(eax)		(((eax) >> 5) & 0x7)
+#define CPUID_CACHE_SHARING_MASK	(0xfffU << 14)
+#define CPUID_4_CORES_MASK		(0x3fU << 26)
+
+static struct kvm_cpuid_entry2 *cpuid__find(struct kvm_cpuid2 *kvm_cpuid,
+					    u32 function, u32 index)
+{
+	unsigned int i;
+
+	for (i = 0; i < kvm_cpuid->nent; i++) {
+		if (kvm_cpuid->entries[i].function == function &&
+		    kvm_cpuid->entries[i].index == index)
+			return &kvm_cpuid->entries[i];
+	}
+
+	return NULL;
+}
+
+/* Finds the entry, or adds it if there is room */
+static struct kvm_cpuid_entry2 *cpuid__entry(struct kvm_cpuid2 *kvm_cpuid,
+					     u32 function, u32 index)
+{
+	struct kvm_cpuid_entry2 *entry;
+
+	entry = cpuid__find(kvm_cpuid, function, index);
+	if (entry || kvm_cpuid->nent == MAX_KVM_CPUID_ENTRIES)
+		return entry;
+
+	entry = &kvm_cpuid->entries[kvm_cpuid->nent++];
+	*entry = (struct kvm_cpuid_entry2) {
+		.function	= function,
+		.index		= index,
+		.flags		= KVM_CPUID_FLAG_SIGNIFCANT_INDEX,
+	};
+
+	return entry;
+}
+
+static void cpuid__set_topo_level(struct kvm_cpuid2 *kvm_cpuid, u32 function,
+				  u32 index, u32 type, u32 shift, u32 nr,
+				  u32 apic_id)
 {
+	struct kvm_cpuid_entry2 *entry = cpuid__entry(kvm_cpuid, function, index);
+
+	if (!entry)
+		die("Too many CPUID entries for --cpu-topology");
+
+	entry->eax = shift;
+	entry->ebx = nr;
+	entry->ecx = type << 8 | index;
+	entry->edx = apic_id;
+}
+
+/*
+ * With --cpu-topology, every leaf that tells the guest about threads, cores
+ * and packages agrees with the APIC IDs of kvm__apic_id(). The caches keep
+ * the geometry of the host CPU, but are shared by the threads of a core up to
+ * L2 and by the package from L3 on. Without it, the host's leaves stay.
+ */
+static void filter_cpuid_topology(struct kvm *kvm, struct kvm_cpuid2 *kvm_cpuid,
+				  int cpu_id)
+{
+	struct kvm_x86_topology *topo = &kvm->arch.topology;
+	u32 apic_id = kvm__apic_id(kvm, cpu_id);
+	u32 core_id = (cpu_id / topo->threads) % topo->cores;
+	u32 socket_id = cpu_id / (topo->threads * topo->cores);
+	struct kvm_cpuid_entry2 *entry;
+	static const u32 topo_leaves[] = { 0xb, 0x1f };
+	u32 max_leaf, sharing, function;
 	unsigned int i;
 
+	if (!topo->enabled)
+		return;
+
+	entry = cpuid__find(kvm_cpuid, 0, 0);
+	max_leaf = entry ? entry->eax : 0;
+
+	for (i = 0; i < kvm_cpuid->nent; i++) {
+		entry = &kvm_cpuid->entries[i];
+
+		switch (entry->function) {
+		case 1:
+			entry->ebx &= ~(0xff << 16);
+			entry->ebx |= min_t(u32, 1U << topo->pkg_shift, 0xff) << 16;
+			if (topo->pkg_shift)
+				entry->edx |= CPUID_1_EDX_HTT;
+			break;
+		case 4:
+		case 0x8000001d:
+			if (!CPUID_CACHE_TYPE(entry->eax))
+				break;
+			sharing = CPUID_CACHE_LEVEL(entry->eax) >= 3 ?
+				  1U << topo->pkg_shift : 1U << topo->smt_shift;
+			entry->eax &= ~CPUID_CACHE_SHARING_MASK;
+			entry->eax |= ((sharing - 1) << 14) & CPUID_CACHE_SHARING_MASK;
+			if (entry->function != 4)
+				break;
+			entry->eax &= ~CPUID_4_CORES_MASK;
+			entry->eax |= (((1U << (topo->pkg_shift - topo->smt_shift)) - 1)
+				       << 26) & CPUID_4_CORES_MASK;
+			break;
+		case 0xb:
+		case 0x1f:
+			/* Levels past the core level, rewritten below */
+			entry->eax = entry->ebx = 0;
+			entry->ecx = entry->index & 0xff;
+			entry->edx = apic_id;
+			break;
+		case 0x80000008:
+			entry->ecx &= ~0xf0ffU;
+			entry->ecx |= topo->pkg_shift << 12;
+			entry->ecx |= (topo->cores * topo->threads - 1) & 0xff;
+			break;
+		case 0x8000001e:
+			entry->eax = apic_id;
+			entry->ebx = (topo->threads - 1) << 8 | (core_id & 0xff);
+			entry->ecx = socket_id & 0xff;
+			break;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(topo_leaves); i++) {
+		function = topo_leaves[i];
+		/* 0x1f is only there if the host has it, 0xb if it's in range */
+		if (function > max_leaf ||
+		    (function == 0x1f && !cpuid__find(kvm_cpuid, 0x1f, 0)))
+			continue;
+		cpuid__set_topo_level(kvm_cpuid, function, 0,
+				      CPUID_TOPO_LEVEL_SMT, topo->smt_shift,
+				      topo->threads, apic_id);
+		cpuid__set_topo_level(kvm_cpuid, function, 1,
+				      CPUID_TOPO_LEVEL_CORE, topo->pkg_shift,
+				      topo->threads * topo->cores, apic_id);
+		cpuid__set_topo_level(kvm_cpuid, function, 2,
+				      CPUID_TOPO_LEVEL_INVALID, 0, 0, apic_id);
+	}
+}
+
+static void filter_cpuid(struct kvm *kvm, struct kvm_cpuid2 *kvm_cpuid,
+			 int cpu_id)
+{
+	unsigned int i;
+	u32 clock = 0;
+
 	/*
 	 * Filter CPUID functions that are not supported by the hypervisor.
 	 */
@@ -21,10 +180,20 @@ static void filter_cpuid(struct kvm_cpuid2 *kvm_cpuid, int cpu_id)
 		switch (entry->function) {
 		case 1:
 			entry->ebx &= ~(0xff << 24);
-			entry->ebx |= cpu_id << 24;
+			entry->ebx |= (kvm__apic_id(kvm, cpu_id) & 0xff) << 24;
 			/* Set X86_FEATURE_HYPERVISOR */
 			if (entry->index == 0)
 				entry->ecx |= (1 << 31);
+			/*
+			 * KVM_GET_SUPPORTED_CPUID leaves the TSC deadline
+			 * timer out, the in-kernel LAPIC has it with the cap.
+			 * Otherwise the guest programs its timer in periodic
+			 * or one-shot mode, which costs more exits.
+			 */
+			if (kvm__supports_extension(kvm, KVM_CAP_TSC_DEADLINE_TIMER))
+				entry->ecx |= CPUID_1_ECX_TSC_DEADLINE;
+			if (entry->ecx & CPUID_1_ECX_TSC_DEADLINE)
+				clock |= KVM_X86_CLOCK_TSC_DEADLINE;
 			break;
 		case 6:
 			/* Clear X86_FEATURE_EPB */
@@ -56,11 +225,37 @@ static void filter_cpuid(struct kvm_cpuid2 *kvm_cpuid, int cpu_id)
 			}
 			break;
 		}
+		case 0x80000007:
+			if (entry->edx & CPUID_80000007_EDX_INVTSC)
+				clock |= KVM_X86_CLOCK_INVARIANT_TSC;
+			break;
+		case KVM_CPUID_FEATURES:
+			if (entry->eax & (1 << KVM_FEATURE_CLOCKSOURCE |
+					  1 << KVM_FEATURE_CLOCKSOURCE2))
+				clock |= KVM_X86_CLOCK_KVMCLOCK;
+			if (entry->eax & (1 << KVM_FEATURE_CLOCKSOURCE_STABLE_BIT))
+				clock |= KVM_X86_CLOCK_STABLE;
+			/*
+			 * Tell the guest that its vCPUs have host CPUs of their
+			 * own, so that it loads the haltpoll cpuidle driver and
+			 * polls before halting. With POLL_CONTROL it then stops
+			 * KVM from polling a second time.
+			 */
+			if (kvm->cfg.arch.guest_haltpoll) {
+				entry->edx |= 1 << KVM_HINTS_REALTIME;
+				if (!(entry->eax & (1 << KVM_FEATURE_POLL_CONTROL)) &&
+				    !cpu_id)
+					pr_warning("KVM lacks POLL_CONTROL, the host polls halted vCPUs too");
+			}
+			break;
 		default:
 			/* Keep the CPUID function as -is */
 			break;
 		};
 	}
+
+	if (!cpu_id)
+		kvm->arch.clock_features = clock;
 }
 
 void kvm_cpu__setup_cpuid(struct kvm_cpu *vcpu)
@@ -74,7 +269,8 @@ void kvm_cpu__setup_cpuid(struct kvm_cpu *vcpu)
 	if (ioctl(vcpu->kvm->sys_fd, KVM_GET_SUPPORTED_CPUID, kvm_cpuid) < 0)
 		die_perror("KVM_GET_SUPPORTED_CPUID failed");
 
-	filter_cpuid(kvm_cpuid, vcpu->cpu_id);
+	filter_cpuid(vcpu->kvm, kvm_cpuid, vcpu->cpu_id);
+	filter_cpuid_topology(vcpu->kvm, kvm_cpuid, vcpu->cpu_id);
 
 	if (ioctl(vcpu->vcpu_fd, KVM_SET_CPUID2, kvm_cpuid) < 0)
 		die_perror("KVM_SET_CPUID2 failed");
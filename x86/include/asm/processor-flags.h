@@ -7,4 +7,10 @@
  */
 #define X86_EFLAGS_CF	0x00000001 /* Carry Flag */
 
+/*
+ * Basic CPU control in CR0
+ */
+#define X86_CR0_PE	0x00000001 /* Protection Enable */
+#define X86_CR0_PG	0x80000000 /* Paging */
+
 #endif
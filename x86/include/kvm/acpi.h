@@ -0,0 +1,14 @@
+#ifndef KVM__ACPI_H
+#define KVM__ACPI_H
+
+#include "kvm/bios.h"
+
+/*
+ * With --acpi, the RSDP and the tables it points to fill the 64KB below the
+ * BIOS, where guests look for the RSDP when they aren't told where it is.
+ */
+#define ACPI_TABLES_START	MB_FIRMWARE_BIOS_BEGIN
+#define ACPI_TABLES_SIZE	(MB_BIOS_BEGIN - MB_FIRMWARE_BIOS_BEGIN)
+#define ACPI_RSDP_ADDR		ACPI_TABLES_START
+
+#endif /* KVM__ACPI_H */
@@ -0,0 +1,28 @@
+#ifndef KVM__CPU_HOTPLUG_H
+#define KVM__CPU_HOTPLUG_H
+
+#include <stdbool.h>
+
+struct kvm;
+
+/*
+ * The registers that the AML of the DSDT uses to find the vCPUs that
+ * "lkvm cpu" plugged or asks to unplug: a dword selecting a vCPU, and the
+ * status of that one at offset 4.
+ */
+#define CPU_HOTPLUG_IOPORT	0x0af0
+#define CPU_HOTPLUG_IOPORT_LEN	8
+
+#define CPU_HOTPLUG_SEL		0
+#define CPU_HOTPLUG_STATUS	4
+
+/* INSERT and REMOVE are cleared by writing 1, EJECT takes the vCPU away */
+#define CPU_HOTPLUG_PRESENT	(1 << 0)
+#define CPU_HOTPLUG_INSERT	(1 << 1)
+#define CPU_HOTPLUG_REMOVE	(1 << 2)
+#define CPU_HOTPLUG_EJECT	(1 << 3)
+
+bool cpu_hotplug__enabled(void);
+int cpu_hotplug__irq(void);
+
+#endif /* KVM__CPU_HOTPLUG_H */
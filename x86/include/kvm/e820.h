@@ -10,6 +10,7 @@
 
 #define E820_RAM        1
 #define E820_RESERVED   2
+#define E820_ACPI       3
 
 struct e820entry {
 	u64 addr;     /* start of memory segment */
@@ -33,12 +33,48 @@
 
 #define MAX_PAGE_SIZE		SZ_4K
 
+/* Described to guests by the SRAT and SLIT of --acpi */
+#define ARCH_HAS_GUEST_NUMA	1
+#define ARCH_HAS_CPU_HOTPLUG	1
+
+/* Timers that the vCPUs were told about, in kvm->arch.clock_features */
+#define KVM_X86_CLOCK_KVMCLOCK		(1U << 0)
+#define KVM_X86_CLOCK_STABLE		(1U << 1)
+#define KVM_X86_CLOCK_INVARIANT_TSC	(1U << 2)
+#define KVM_X86_CLOCK_TSC_DEADLINE	(1U << 3)
+
+/* The --cpu-topology that the APIC IDs and CPUID follow */
+struct kvm_x86_topology {
+	bool			enabled;
+	u32			sockets;
+	u32			cores;
+	u32			threads;
+	/* Where the core and package fields of the APIC IDs start */
+	u32			smt_shift;
+	u32			pkg_shift;
+};
+
 struct kvm_arch {
 	u16			boot_selector;
 	u16			boot_ip;
 	u16			boot_sp;
 
+	/* Entry point of a kernel booted with PVH, 0 to start in real mode */
+	u32			pvh_entry;
+	u64			pvh_initrd_addr;
+	u64			pvh_initrd_size;
+
 	struct interrupt_table	interrupt_table;
+
+	u32			clock_features;
+
+	struct kvm_x86_topology	topology;
 };
 
+struct kvm;
+
+void kvm__topology_validate(struct kvm *kvm);
+void kvm__topology_init(struct kvm *kvm);
+u32 kvm__apic_id(struct kvm *kvm, u32 cpu);
+
 #endif /* KVM__KVM_ARCH_H */
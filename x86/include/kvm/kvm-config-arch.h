@@ -3,13 +3,36 @@
 
 #include "kvm/parse-options.h"
 
+#include <linux/types.h>
+
+int cpu_topology_parser(const struct option *opt, const char *arg, int unset);
+
 struct kvm_config_arch {
 	int vidmode;
+	bool acpi;
+	bool guest_haltpoll;
+	/* --cpu-topology, 0 for what the others leave */
+	u32 sockets;
+	u32 cores;
+	u32 threads;
+	bool topology_host;
 };
 
 #define OPT_ARCH_RUN(pfx, cfg)						\
 	pfx,								\
 	OPT_GROUP("BIOS options:"),					\
-	OPT_INTEGER('\0', "vidmode", &(cfg)->vidmode, "Video mode"),
+	OPT_INTEGER('\0', "vidmode", &(cfg)->vidmode, "Video mode"),	\
+	OPT_BOOLEAN('\0', "acpi", &(cfg)->acpi,				\
+		    "Describe the vCPUs with an ACPI MADT, for x2APIC IDs"	\
+		    " and more than 255 vCPUs"),				\
+	OPT_GROUP("CPU options:"),					\
+	OPT_CALLBACK('\0', "cpu-topology", NULL,			\
+		     "sockets=<n>,cores=<n>,threads=<n>|host",		\
+		     "Show the vCPUs as threads of cores of sockets, or"	\
+		     " as the host's package", cpu_topology_parser, kvm),	\
+	OPT_GROUP("Paravirtualization options:"),			\
+	OPT_BOOLEAN('\0', "guest-haltpoll", &(cfg)->guest_haltpoll,	\
+		    "Have the guest poll idle vCPUs itself. Only for"	\
+		    " vCPUs with dedicated host CPUs"),
 
 #endif /* KVM__KVM_CONFIG_ARCH_H */
@@ -25,14 +25,25 @@ struct kvm_cpu {
 	struct kvm_fpu		fpu;
 
 	struct kvm_msrs		*msrs;		/* dynamically allocated */
+	u32			tsc_khz;	/* Of the guest TSC, 0 if unknown */
 
 	u8			is_running;
 	u8			paused;
 	u8			needs_nmi;
+	u8			in_run;		/* In or entering KVM_RUN */
 
 	struct kvm_coalesced_mmio_ring	*ring;
 };
 
+/* What KVM_IPC_VCPU_REGS sends of each vCPU, see struct kvm_cpu_regs_head */
+#define KVM_CPU_REGS_ARCH	KVM_CPU_REGS_ARCH_X86
+
+struct kvm_cpu_arch_regs {
+	struct kvm_regs		regs;
+	struct kvm_sregs	sregs;
+	struct kvm_debugregs	debugregs;
+};
+
 /*
  * As these are such simple wrappers, let's have them in the header so they'll
  * be cheaper to call:
@@ -0,0 +1,48 @@
+#ifndef KVM__PVH_H
+#define KVM__PVH_H
+
+#include <linux/types.h>
+
+/*
+ * The PVH boot protocol, from xen/include/public/arch-x86/hvm/start_info.h:
+ * the kernel is entered in 32-bit protected mode, with paging off, at the
+ * address of its XEN_ELFNOTE_PHYS32_ENTRY note and with %ebx pointing to a
+ * struct hvm_start_info.
+ */
+#define XEN_ELFNOTE_PHYS32_ENTRY	18
+#define XEN_HVM_START_MAGIC_VALUE	0x336ec578
+
+/* Where the start info goes, followed by the memory map and the modules */
+#define PVH_START_INFO			0x6000
+#define PVH_CMDLINE_MAX			2048
+
+struct hvm_start_info {
+	u32	magic;
+	u32	version;
+	u32	flags;
+	u32	nr_modules;
+	u64	modlist_paddr;
+	u64	cmdline_paddr;
+	u64	rsdp_paddr;
+	/* From version 1 */
+	u64	memmap_paddr;
+	u32	memmap_entries;
+	u32	reserved;
+};
+
+struct hvm_modlist_entry {
+	u64	paddr;
+	u64	size;
+	u64	cmdline_paddr;
+	u64	reserved;
+};
+
+/* Types are those of the E820 map */
+struct hvm_memmap_table_entry {
+	u64	addr;
+	u64	size;
+	u32	type;
+	u32	reserved;
+};
+
+#endif /* KVM__PVH_H */
@@ -1,13 +1,18 @@
 #include "kvm/kvm-cpu.h"
 
+#include "kvm/pvh.h"
+#include "kvm/snapshot.h"
 #include "kvm/symbol.h"
 #include "kvm/util.h"
 #include "kvm/kvm.h"
 
 #include <asm/apicdef.h>
+#include <asm/processor-flags.h>
 #include <linux/err.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/procfs.h>
+#include <sys/user.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
@@ -101,7 +106,9 @@ struct kvm_cpu *kvm_cpu__arch_init(struct kvm *kvm, unsigned long cpu_id)
 
 	vcpu->cpu_id = cpu_id;
 
-	vcpu->vcpu_fd = ioctl(vcpu->kvm->vm_fd, KVM_CREATE_VCPU, cpu_id);
+	/* KVM takes the vCPU ID for the initial APIC ID */
+	vcpu->vcpu_fd = ioctl(vcpu->kvm->vm_fd, KVM_CREATE_VCPU,
+			      kvm__apic_id(kvm, cpu_id));
 	if (vcpu->vcpu_fd < 0)
 		die_perror("KVM_CREATE_VCPU ioctl");
 
@@ -120,6 +127,8 @@ struct kvm_cpu *kvm_cpu__arch_init(struct kvm *kvm, unsigned long cpu_id)
 	if (kvm_cpu__set_lint(vcpu))
 		die_perror("KVM_SET_LAPIC failed");
 
+	vcpu->tsc_khz = max(ioctl(vcpu->vcpu_fd, KVM_GET_TSC_KHZ), 0);
+
 	vcpu->is_running = true;
 
 	return vcpu;
@@ -191,8 +200,24 @@ static void kvm_cpu__setup_fpu(struct kvm_cpu *vcpu)
 		die_perror("KVM_SET_FPU failed");
 }
 
+/* PVH: 32-bit protected mode without paging, %ebx at the start info */
+static void kvm_cpu__setup_pvh_regs(struct kvm_cpu *vcpu)
+{
+	vcpu->regs = (struct kvm_regs) {
+		.rflags	= 0x0000000000000002ULL,
+		.rip	= vcpu->kvm->arch.pvh_entry,
+		.rbx	= PVH_START_INFO,
+	};
+
+	if (ioctl(vcpu->vcpu_fd, KVM_SET_REGS, &vcpu->regs) < 0)
+		die_perror("KVM_SET_REGS failed");
+}
+
 static void kvm_cpu__setup_regs(struct kvm_cpu *vcpu)
 {
+	if (vcpu->kvm->arch.pvh_entry)
+		return kvm_cpu__setup_pvh_regs(vcpu);
+
 	vcpu->regs = (struct kvm_regs) {
 		/* We start the guest in 16-bit real mode  */
 		.rflags	= 0x0000000000000002ULL,
@@ -209,11 +234,46 @@ static void kvm_cpu__setup_regs(struct kvm_cpu *vcpu)
 		die_perror("KVM_SET_REGS failed");
 }
 
+/* Flat 4GB segments, for the PVH entry point */
+static void kvm_cpu__setup_pvh_sregs(struct kvm_cpu *vcpu)
+{
+	struct kvm_segment code = {
+		.base		= 0,
+		.limit		= 0xffffffff,
+		.selector	= 0x10,
+		.type		= 0xb,	/* execute, read, accessed */
+		.present	= 1,
+		.db		= 1,
+		.s		= 1,
+		.g		= 1,
+	};
+	struct kvm_segment data = code;
+
+	data.selector	= 0x18;
+	data.type	= 0x3;		/* read, write, accessed */
+
+	vcpu->sregs.cs	= code;
+	vcpu->sregs.ds	= data;
+	vcpu->sregs.es	= data;
+	vcpu->sregs.fs	= data;
+	vcpu->sregs.gs	= data;
+	vcpu->sregs.ss	= data;
+
+	vcpu->sregs.cr0	= (vcpu->sregs.cr0 | X86_CR0_PE) & ~X86_CR0_PG;
+	vcpu->sregs.cr4	= 0;
+	vcpu->sregs.efer = 0;
+}
+
 static void kvm_cpu__setup_sregs(struct kvm_cpu *vcpu)
 {
 	if (ioctl(vcpu->vcpu_fd, KVM_GET_SREGS, &vcpu->sregs) < 0)
 		die_perror("KVM_GET_SREGS failed");
 
+	if (vcpu->kvm->arch.pvh_entry) {
+		kvm_cpu__setup_pvh_sregs(vcpu);
+		goto out;
+	}
+
 	vcpu->sregs.cs.selector	= vcpu->kvm->arch.boot_selector;
 	vcpu->sregs.cs.base	= selector_to_base(vcpu->kvm->arch.boot_selector);
 	vcpu->sregs.ss.selector	= vcpu->kvm->arch.boot_selector;
@@ -227,6 +287,7 @@ static void kvm_cpu__setup_sregs(struct kvm_cpu *vcpu)
 	vcpu->sregs.gs.selector	= vcpu->kvm->arch.boot_selector;
 	vcpu->sregs.gs.base	= selector_to_base(vcpu->kvm->arch.boot_selector);
 
+out:
 	if (ioctl(vcpu->vcpu_fd, KVM_SET_SREGS, &vcpu->sregs) < 0)
 		die_perror("KVM_SET_SREGS failed");
 }
@@ -444,3 +505,373 @@ void kvm_cpu__arch_nmi(struct kvm_cpu *cpu)
 
 	ioctl(cpu->vcpu_fd, KVM_NMI);
 }
+
+ssize_t kvm_cpu__get_regs(struct kvm_cpu *vcpu, void *buf, size_t size)
+{
+	struct kvm_cpu_arch_regs *regs = buf;
+
+	if (size < sizeof(*regs))
+		return -ENOSPC;
+
+	if (ioctl(vcpu->vcpu_fd, KVM_GET_REGS, &regs->regs) < 0 ||
+	    ioctl(vcpu->vcpu_fd, KVM_GET_SREGS, &regs->sregs) < 0 ||
+	    ioctl(vcpu->vcpu_fd, KVM_GET_DEBUGREGS, &regs->debugregs) < 0)
+		return -errno;
+
+	return sizeof(*regs);
+}
+
+int kvm_cpu__get_prstatus(struct kvm_cpu *vcpu, struct elf_prstatus *prs)
+{
+	struct user_regs_struct *r = (void *)&prs->pr_reg;
+	struct kvm_sregs sregs;
+	struct kvm_regs regs;
+
+	BUILD_BUG_ON(sizeof(*r) != sizeof(prs->pr_reg));
+
+	if (ioctl(vcpu->vcpu_fd, KVM_GET_REGS, &regs) < 0 ||
+	    ioctl(vcpu->vcpu_fd, KVM_GET_SREGS, &sregs) < 0)
+		return -errno;
+
+	*r = (struct user_regs_struct) {
+		.r15		= regs.r15,
+		.r14		= regs.r14,
+		.r13		= regs.r13,
+		.r12		= regs.r12,
+		.rbp		= regs.rbp,
+		.rbx		= regs.rbx,
+		.r11		= regs.r11,
+		.r10		= regs.r10,
+		.r9		= regs.r9,
+		.r8		= regs.r8,
+		.rax		= regs.rax,
+		.rcx		= regs.rcx,
+		.rdx		= regs.rdx,
+		.rsi		= regs.rsi,
+		.rdi		= regs.rdi,
+		.orig_rax	= -1ULL,
+		.rip		= regs.rip,
+		.cs		= sregs.cs.selector,
+		.eflags		= regs.rflags,
+		.rsp		= regs.rsp,
+		.ss		= sregs.ss.selector,
+		.fs_base	= sregs.fs.base,
+		.gs_base	= sregs.gs.base,
+		.ds		= sregs.ds.selector,
+		.es		= sregs.es.selector,
+		.fs		= sregs.fs.selector,
+		.gs		= sregs.gs.selector,
+	};
+
+	return 0;
+}
+
+/* Linux keeps its kernel in the upper half of the address space */
+#define KERNEL_ADDR_MIN		0xffff800000000000ULL
+
+/*
+ * The return addresses are found by following the frame pointers, so the
+ * callchains of kernels built without CONFIG_FRAME_POINTER stop early, at
+ * the first frame that doesn't look like one.
+ */
+int kvm_cpu__get_sample(struct kvm_cpu *vcpu, struct kvm_cpu_sample *sample,
+			bool callchain)
+{
+	struct kvm_translation tr;
+	u64 fp, frame[2];
+	void *host;
+
+	if (ioctl(vcpu->vcpu_fd, KVM_GET_REGS, &vcpu->regs) < 0 ||
+	    ioctl(vcpu->vcpu_fd, KVM_GET_SREGS, &vcpu->sregs) < 0)
+		return -errno;
+
+	sample->pc[0] = ip_to_flat(vcpu, vcpu->regs.rip);
+	sample->nr = 1;
+	sample->user = is_in_protected_mode(vcpu) &&
+		       (vcpu->sregs.cs.selector & 3) == 3;
+
+	if (!callchain || sample->user || !vcpu->sregs.cs.l)
+		return 0;
+
+	fp = vcpu->regs.rbp;
+	while (sample->nr < KVM_CPU_SAMPLE_FRAMES) {
+		/* The saved frame pointer and the return address, in one page */
+		if (fp < KERNEL_ADDR_MIN || fp % 8 ||
+		    fp % PAGE_SIZE > PAGE_SIZE - sizeof(frame))
+			break;
+
+		tr = (struct kvm_translation) { .linear_address = fp };
+		if (ioctl(vcpu->vcpu_fd, KVM_TRANSLATE, &tr) < 0 || !tr.valid)
+			break;
+
+		host = __guest_flat_to_host(vcpu->kvm, tr.physical_address);
+		if (!host)
+			break;
+
+		memcpy(frame, host, sizeof(frame));
+		if (frame[1] < KERNEL_ADDR_MIN)
+			break;
+
+		sample->pc[sample->nr++] = frame[1];
+
+		/* The stack grows down, callers' frames are above */
+		if (frame[0] <= fp)
+			break;
+		fp = frame[0];
+	}
+
+	return 0;
+}
+
+/* KVM_GET_MSRS and KVM_SET_MSRS take fewer than 256 at once */
+#define KVM_CPU_MSRS_BATCH	128
+
+/* Returns how many MSRs were read or written, from the start of @entries */
+static int kvm_cpu__msrs_io(struct kvm_cpu *vcpu, unsigned long req,
+			    struct kvm_msr_entry *entries, u32 nmsrs)
+{
+	struct kvm_msrs *msrs;
+	int r;
+
+	nmsrs = min_t(u32, nmsrs, KVM_CPU_MSRS_BATCH);
+	msrs = kvm_msrs__new(nmsrs);
+	msrs->nmsrs = nmsrs;
+	memcpy(msrs->entries, entries, nmsrs * sizeof(*entries));
+
+	r = ioctl(vcpu->vcpu_fd, req, msrs);
+	if (r > 0)
+		memcpy(entries, msrs->entries, r * sizeof(*entries));
+	else if (r < 0)
+		r = -errno;
+
+	free(msrs);
+	return r;
+}
+
+/* All the MSRs that KVM can save and restore, with their values */
+static struct kvm_msr_entry *kvm_cpu__get_msrs(struct kvm_cpu *vcpu,
+					       u32 *nmsrs)
+{
+	struct kvm_msr_list probe = {}, *list;
+	struct kvm_msr_entry *entries;
+	u32 i, n;
+	int r;
+
+	if (ioctl(vcpu->kvm->sys_fd, KVM_GET_MSR_INDEX_LIST, &probe) < 0 &&
+	    errno != E2BIG)
+		return NULL;
+
+	list = calloc(1, sizeof(*list) + probe.nmsrs * sizeof(list->indices[0]));
+	if (!list)
+		return NULL;
+
+	list->nmsrs = probe.nmsrs;
+	if (ioctl(vcpu->kvm->sys_fd, KVM_GET_MSR_INDEX_LIST, list) < 0) {
+		free(list);
+		return NULL;
+	}
+
+	n = list->nmsrs;
+	entries = calloc(n, sizeof(*entries));
+	if (!entries) {
+		free(list);
+		return NULL;
+	}
+	for (i = 0; i < n; i++)
+		entries[i].index = list->indices[i];
+	free(list);
+
+	/*
+	 * KVM_GET_MSRS stops at the first MSR that this vCPU doesn't have,
+	 * which is dropped before going on.
+	 */
+	for (i = 0; i < n; i += r) {
+		r = kvm_cpu__msrs_io(vcpu, KVM_GET_MSRS, &entries[i], n - i);
+		if (r < 0) {
+			free(entries);
+			errno = -r;
+			return NULL;
+		}
+
+		if (i + r < n && r < KVM_CPU_MSRS_BATCH) {
+			n--;
+			memmove(&entries[i + r], &entries[i + r + 1],
+				(n - i - r) * sizeof(*entries));
+		}
+	}
+
+	*nmsrs = n;
+	return entries;
+}
+
+static int kvm_cpu__set_msrs(struct kvm_cpu *vcpu,
+			     struct kvm_msr_entry *entries, u32 nmsrs)
+{
+	u32 i;
+	int r;
+
+	for (i = 0; i < nmsrs; i += r) {
+		r = kvm_cpu__msrs_io(vcpu, KVM_SET_MSRS, &entries[i], nmsrs - i);
+		if (r < 0)
+			return r;
+		if (r < (int)min_t(u32, nmsrs - i, KVM_CPU_MSRS_BATCH)) {
+			pr_err("vCPU %lu: unable to set MSR 0x%x",
+			       vcpu->cpu_id, entries[i + r].index);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+#define KVM_CPU_STATE(_get, _set, _field)	\
+	{ _get, _set, offsetof(struct kvm_cpu_state, _field),	\
+	  sizeof(((struct kvm_cpu_state *)0)->_field) }
+
+struct kvm_cpu_state {
+	struct kvm_regs		regs;
+	struct kvm_sregs	sregs;
+	struct kvm_xsave	xsave;
+	struct kvm_xcrs		xcrs;
+	struct kvm_lapic_state	lapic;
+	struct kvm_vcpu_events	events;
+	struct kvm_mp_state	mp_state;
+	struct kvm_debugregs	debugregs;
+	/* The guest sees its TSC run at this rate, it mustn't change */
+	u32			tsc_khz;
+};
+
+/* In the order they are restored, MSRs go between xcrs and lapic */
+static const struct {
+	unsigned long	get;
+	unsigned long	set;
+	size_t		offset;
+	size_t		size;
+} kvm_cpu_state_ioctls[] = {
+	KVM_CPU_STATE(KVM_GET_SREGS,	 KVM_SET_SREGS,		sregs),
+	KVM_CPU_STATE(KVM_GET_REGS,	 KVM_SET_REGS,		regs),
+	KVM_CPU_STATE(KVM_GET_XSAVE,	 KVM_SET_XSAVE,		xsave),
+	KVM_CPU_STATE(KVM_GET_XCRS,	 KVM_SET_XCRS,		xcrs),
+	KVM_CPU_STATE(KVM_GET_LAPIC,	 KVM_SET_LAPIC,		lapic),
+	KVM_CPU_STATE(KVM_GET_VCPU_EVENTS, KVM_SET_VCPU_EVENTS,	events),
+	KVM_CPU_STATE(KVM_GET_MP_STATE,	 KVM_SET_MP_STATE,	mp_state),
+	KVM_CPU_STATE(KVM_GET_DEBUGREGS, KVM_SET_DEBUGREGS,	debugregs),
+};
+
+#define KVM_CPU_STATE_MSRS	4
+
+int kvm_cpu__arch_save_state(struct kvm_cpu *vcpu, struct snapshot *snap)
+{
+	struct kvm_cpu_state *state;
+	struct kvm_msr_entry *msrs;
+	unsigned int i;
+	u32 nmsrs;
+	int r;
+
+	/*
+	 * The vCPU may be stopped right after an I/O exit, whose result KVM
+	 * only takes on the next KVM_RUN. kvm__pause() left immediate_exit
+	 * set, so this completes the instruction without entering the guest.
+	 */
+	vcpu->kvm_run->immediate_exit = 1;
+	r = ioctl(vcpu->vcpu_fd, KVM_RUN, 0);
+	if (r < 0 && errno != EINTR)
+		return -errno;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return -ENOMEM;
+
+	state->tsc_khz = vcpu->tsc_khz;
+	for (i = 0; i < ARRAY_SIZE(kvm_cpu_state_ioctls); i++) {
+		if (ioctl(vcpu->vcpu_fd, kvm_cpu_state_ioctls[i].get,
+			  (void *)state + kvm_cpu_state_ioctls[i].offset) < 0) {
+			r = -errno;
+			goto out;
+		}
+	}
+
+	r = snapshot__write(snap, state, sizeof(*state));
+	if (r < 0)
+		goto out;
+
+	msrs = kvm_cpu__get_msrs(vcpu, &nmsrs);
+	if (!msrs) {
+		r = -errno;
+		goto out;
+	}
+
+	r = snapshot__write(snap, &nmsrs, sizeof(nmsrs));
+	if (!r)
+		r = snapshot__write(snap, msrs, nmsrs * sizeof(*msrs));
+	free(msrs);
+
+out:
+	free(state);
+	return r;
+}
+
+int kvm_cpu__arch_restore_state(struct kvm_cpu *vcpu, struct snapshot *snap)
+{
+	struct kvm_cpu_state *state;
+	struct kvm_msr_entry *msrs = NULL;
+	unsigned int i;
+	u32 nmsrs;
+	int r;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return -ENOMEM;
+
+	r = snapshot__read(snap, state, sizeof(*state));
+	if (r < 0)
+		goto out;
+
+	r = snapshot__read(snap, &nmsrs, sizeof(nmsrs));
+	if (r < 0)
+		goto out;
+
+	msrs = calloc(nmsrs ?: 1, sizeof(*msrs));
+	if (!msrs) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = snapshot__read(snap, msrs, nmsrs * sizeof(*msrs));
+	if (r < 0)
+		goto out;
+
+	/*
+	 * Before the TSC itself is set. A host with another TSC rate has to
+	 * scale it, or clocks calibrated against the TSC would drift.
+	 */
+	if (state->tsc_khz && state->tsc_khz != vcpu->tsc_khz) {
+		if (ioctl(vcpu->vcpu_fd, KVM_SET_TSC_KHZ, state->tsc_khz) < 0)
+			pr_warning("vCPU %lu: unable to keep the TSC at %u kHz, it now runs at %u kHz",
+				   vcpu->cpu_id, state->tsc_khz, vcpu->tsc_khz);
+		else
+			vcpu->tsc_khz = state->tsc_khz;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(kvm_cpu_state_ioctls); i++) {
+		if (i == KVM_CPU_STATE_MSRS) {
+			r = kvm_cpu__set_msrs(vcpu, msrs, nmsrs);
+			if (r < 0)
+				goto out;
+		}
+
+		if (ioctl(vcpu->vcpu_fd, kvm_cpu_state_ioctls[i].set,
+			  (void *)state + kvm_cpu_state_ioctls[i].offset) < 0) {
+			r = -errno;
+			goto out;
+		}
+	}
+
+	vcpu->regs = state->regs;
+	vcpu->sregs = state->sregs;
+
+out:
+	free(msrs);
+	free(state);
+	return r;
+}
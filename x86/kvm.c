@@ -1,21 +1,30 @@
 #include "kvm/kvm.h"
+#include "kvm/acpi.h"
 #include "kvm/boot-protocol.h"
 #include "kvm/cpufeature.h"
+#include "kvm/e820.h"
 #include "kvm/interrupt.h"
+#include "kvm/irq.h"
+#include "kvm/kvm-cpu.h"
+#include "kvm/metrics.h"
 #include "kvm/mptable.h"
+#include "kvm/probe.h"
+#include "kvm/pvh.h"
+#include "kvm/snapshot.h"
+#include "kvm/strbuf.h"
 #include "kvm/util.h"
-#include "kvm/8250-serial.h"
-#include "kvm/virtio-console.h"
 
 #include <asm/bootparam.h>
 #include <linux/kvm.h>
 #include <linux/kernel.h>
 
+#include <elf.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -42,6 +51,13 @@ u64 kvm__arch_default_ram_address(void)
 
 void kvm__arch_validate_cfg(struct kvm *kvm)
 {
+	kvm__topology_validate(kvm);
+}
+
+/* Only protected VMs have private memory, which guest_memfd backs */
+int kvm__get_vm_type(struct kvm *kvm)
+{
+	return kvm->cfg.guest_memfd ? KVM_X86_SW_PROTECTED_VM : KVM_VM_TYPE;
 }
 
 bool kvm__arch_cpu_supports_vm(void)
@@ -86,6 +102,25 @@ bool kvm__arch_cpu_supports_vm(void)
 	return regs.ecx & (1 << feature);
 }
 
+/* Register @size bytes of RAM from @offset, not counting the gap */
+static void kvm__register_ram_range(struct kvm *kvm, u64 offset, u64 size)
+{
+	u64 len;
+
+	if (offset < KVM_32BIT_GAP_START) {
+		/* The RAM below the PCI gap */
+		len = min(size, KVM_32BIT_GAP_START - offset);
+		kvm__register_ram(kvm, offset, len, kvm->ram_start + offset);
+		offset += len;
+		size -= len;
+	}
+
+	/* The RAM from 4GB */
+	if (size)
+		kvm__register_ram(kvm, offset + KVM_32BIT_GAP_SIZE, size,
+				  kvm->ram_start + offset + KVM_32BIT_GAP_SIZE);
+}
+
 /*
  * Allocating RAM size bigger than 4GB requires us to leave a gap
  * in the RAM which is used for PCI MMIO, hotplug, and unconfigured
@@ -93,49 +128,139 @@ bool kvm__arch_cpu_supports_vm(void)
  *
  * If we're required to initialize RAM bigger than 4GB, we will create
  * a gap between 0xe0000000 and 0x100000000 in the guest virtual mem space.
+ *
+ * Each bank is at ram_start plus its guest physical address, and ram_start is
+ * aligned to the largest page that backs RAM. The gap and the NUMA nodes are
+ * multiples of huge pages too, so KVM can map huge pages for all of RAM.
  */
 
 void kvm__init_ram(struct kvm *kvm)
 {
-	u64	phys_start, phys_size;
-	void	*host_mem;
-
-	if (kvm->ram_size < KVM_32BIT_GAP_START) {
-		/* Use a single block of RAM for 32bit RAM */
-
-		phys_start = 0;
-		phys_size  = kvm->ram_size;
-		host_mem   = kvm->ram_start;
-
-		kvm__register_ram(kvm, phys_start, phys_size, host_mem);
-	} else {
-		/* First RAM range from zero to the PCI gap: */
+	u64 ram_size = kvm->ram_size, offset = 0, size;
+	int i;
 
-		phys_start = 0;
-		phys_size  = KVM_32BIT_GAP_START;
-		host_mem   = kvm->ram_start;
+	if (ram_size >= KVM_32BIT_GAP_START)
+		ram_size -= KVM_32BIT_GAP_SIZE;
 
-		kvm__register_ram(kvm, phys_start, phys_size, host_mem);
+	if (!kvm->cfg.nr_guest_numa) {
+		kvm__register_ram_range(kvm, 0, ram_size);
+		return;
+	}
 
-		/* Second RAM range from 4GB to the end of RAM: */
+	/* Guests only learn about their nodes from the SRAT */
+	if (!kvm->cfg.arch.acpi)
+		die("--numa needs --acpi on x86");
 
-		phys_start = KVM_32BIT_MAX_MEM_SIZE;
-		phys_size  = kvm->ram_size - phys_start;
-		host_mem   = kvm->ram_start + phys_start;
+	/* One bank per node, which --numa host= binds by bank number */
+	for (i = 0; i < kvm->cfg.nr_guest_numa; i++) {
+		size = kvm->cfg.guest_numa[i].mem_size;
+		if (kvm->cfg.nr_numa_nodes && offset < KVM_32BIT_GAP_START &&
+		    offset + size > KVM_32BIT_GAP_START)
+			die("NUMA node %d is bound to a host node, it can't span the 32-bit PCI gap",
+			    i);
 
-		kvm__register_ram(kvm, phys_start, phys_size, host_mem);
+		kvm__register_ram_range(kvm, offset, size);
+		offset += size;
 	}
 }
 
 /* Arch-specific commandline setup */
-void kvm__arch_set_cmdline(char *cmdline, bool video)
+void kvm__arch_set_cmdline(struct kvm *kvm, char *cmdline, bool video)
 {
-	strcpy(cmdline, "noapic noacpi pci=conf1 reboot=k panic=1 i8042.direct=1 "
+#ifdef CONFIG_MICRO
+	/* No i8042 to reset through, nor 8250 UARTs to probe */
+	strcpy(cmdline, "noapic pci=conf1 reboot=t panic=1 8250.nr_uarts=0 "
+				"i8042.nokbd i8042.noaux");
+#else
+	strcpy(cmdline, "noapic pci=conf1 reboot=k panic=1 i8042.direct=1 "
 				"i8042.dumbkbd=1 i8042.nopnp=1");
+#endif
+	/* The DSDT is empty, PCI and its interrupts are found without ACPI */
+	if (kvm->cfg.arch.acpi)
+		strcat(cmdline, " acpi=noirq pci=noacpi");
+	else
+		strcat(cmdline, " noacpi");
 	if (video)
 		strcat(cmdline, " video=vesafb");
-	else
+	/* The UI keys go to virtio-input, stop the guest polling the i8042 */
+	if (video && kvm->cfg.virtio_input)
+		strcat(cmdline, " i8042.nokbd i8042.noaux");
+#ifndef CONFIG_MICRO
+	else if (!video)
 		strcat(cmdline, " earlyprintk=serial i8042.noaux=1");
+#endif
+}
+
+static const struct {
+	u32		feature;
+	const char	*name;
+} kvm__clock_features[] = {
+	{ KVM_X86_CLOCK_KVMCLOCK,	"kvmclock" },
+	{ KVM_X86_CLOCK_STABLE,		"kvmclock_stable" },
+	{ KVM_X86_CLOCK_INVARIANT_TSC,	"invariant_tsc" },
+	{ KVM_X86_CLOCK_TSC_DEADLINE,	"tsc_deadline" },
+};
+
+/*
+ * Whether the guest can keep time without exits: with a TSC it can trust,
+ * or kvmclock when KVM has a stable master clock for it.
+ */
+static void kvm__collect_clock(struct kvm *kvm, struct metrics *m)
+{
+	struct kvm_clock_data clock = {};
+	unsigned int i;
+
+	metrics__family(m, "guest_clock_features", "gauge",
+			"Timers and clocks advertised to the guest, 1 if it has them");
+	for (i = 0; i < ARRAY_SIZE(kvm__clock_features); i++)
+		metrics__sample(m, !!(kvm->arch.clock_features &
+				      kvm__clock_features[i].feature),
+				"feature=\"%s\"", kvm__clock_features[i].name);
+
+	if (ioctl(kvm->vm_fd, KVM_GET_CLOCK, &clock) == 0) {
+		metrics__family(m, "kvmclock_tsc_stable", "gauge",
+				"1 if kvmclock reads don't need the guest to exit");
+		metrics__value(m, !!(clock.flags & KVM_CLOCK_TSC_STABLE));
+	}
+
+	metrics__family(m, "vcpu_tsc_khz", "gauge",
+			"Frequency of the guest TSC of each vCPU");
+	for (i = 0; kvm->cpus && i < (unsigned int)kvm->nrcpus; i++)
+		if (kvm->cpus[i] && kvm->cpus[i]->tsc_khz)
+			metrics__sample(m, kvm->cpus[i]->tsc_khz,
+					"vcpu=\"%u\"", i);
+}
+
+static struct metrics_collector kvm__clock_metrics = {
+	.collect	= kvm__collect_clock,
+};
+
+#define KVM_X2APIC_API_USE_32BIT_IDS		(1ULL << 0)
+#define KVM_X2APIC_API_DISABLE_BROADCAST_QUIRK	(1ULL << 1)
+
+/*
+ * Beyond 255 vCPUs, or fewer with a sparse --cpu-topology, APIC IDs don't fit in the xAPIC format that KVM uses by
+ * default for LAPIC state and MSI destinations, and 0xff would broadcast.
+ * This must happen before the vCPUs are created.
+ */
+static void kvm__enable_x2apic_api(struct kvm *kvm)
+{
+	struct kvm_enable_cap cap = {
+		.cap	= KVM_CAP_X2APIC_API,
+		.args	= {
+			KVM_X2APIC_API_USE_32BIT_IDS |
+			KVM_X2APIC_API_DISABLE_BROADCAST_QUIRK,
+		},
+	};
+
+	if (kvm__apic_id(kvm, kvm->cfg.max_cpus - 1) < 255)
+		return;
+
+	if (!kvm->cfg.arch.acpi)
+		pr_warning("The MP table only describes APIC IDs below 255, use --acpi");
+
+	if (ioctl(kvm->vm_fd, KVM_ENABLE_CAP, &cap) < 0)
+		pr_warning("Unable to use 32-bit APIC IDs: %s", strerror(errno));
 }
 
 /* Architecture-specific KVM init */
@@ -166,8 +291,6 @@ void kvm__arch_init(struct kvm *kvm)
 	if (kvm->ram_start == MAP_FAILED)
 		die("out of memory");
 
-	madvise(kvm->ram_start, kvm->ram_size, MADV_MERGEABLE);
-
 	ret = ioctl(kvm->vm_fd, KVM_CREATE_IRQCHIP);
 	if (ret < 0)
 		die_perror("KVM_CREATE_IRQCHIP ioctl");
@@ -175,6 +298,11 @@ void kvm__arch_init(struct kvm *kvm)
 	ret = ioctl(kvm->vm_fd, KVM_CREATE_PIT2, &pit_config);
 	if (ret < 0)
 		die_perror("KVM_CREATE_PIT2 ioctl");
+
+	kvm__topology_init(kvm);
+	kvm__enable_x2apic_api(kvm);
+
+	metrics__register(&kvm__clock_metrics);
 }
 
 void kvm__arch_delete_ram(struct kvm *kvm)
@@ -182,7 +310,7 @@ void kvm__arch_delete_ram(struct kvm *kvm)
 	munmap(kvm->ram_start, kvm->ram_size);
 }
 
-void kvm__irq_line(struct kvm *kvm, int irq, int level)
+static void kvm__irq_line_ioctl(struct kvm *kvm, int irq, int level)
 {
 	struct kvm_irq_level irq_level;
 
@@ -197,10 +325,20 @@ void kvm__irq_line(struct kvm *kvm, int irq, int level)
 		die_perror("KVM_IRQ_LINE failed");
 }
 
+void kvm__irq_line(struct kvm *kvm, int irq, int level)
+{
+	kvm__probe(irq_line, irq, level);
+	if (irq__irqfd_line(kvm, irq, level) < 0)
+		kvm__irq_line_ioctl(kvm, irq, level);
+}
+
 void kvm__irq_trigger(struct kvm *kvm, int irq)
 {
-	kvm__irq_line(kvm, irq, 1);
-	kvm__irq_line(kvm, irq, 0);
+	kvm__probe(irq_trigger, irq);
+	if (irq__irqfd_trigger(kvm, irq) < 0) {
+		kvm__irq_line_ioctl(kvm, irq, 1);
+		kvm__irq_line_ioctl(kvm, irq, 0);
+	}
 }
 
 #define BOOT_LOADER_SELECTOR	0x1000
@@ -328,7 +466,8 @@ static bool load_bzimage(struct kvm *kvm, int fd_kernel, int fd_initrd,
 		}
 
 		p = guest_flat_to_host(kvm, addr);
-		if (read_in_full(fd_initrd, p, initrd_stat.st_size) < 0)
+		if (kvm__load_image(kvm, fd_initrd, 0, p, initrd_stat.st_size) !=
+		    initrd_stat.st_size)
 			die("Failed to read initrd");
 
 		kern_boot->hdr.ramdisk_image	= addr;
@@ -346,11 +485,232 @@ static bool load_bzimage(struct kvm *kvm, int fd_kernel, int fd_initrd,
 	return true;
 }
 
+/* Guest RAM below the 32-bit gap, where PVH kernels and initrds go */
+static u64 pvh__low_ram_end(struct kvm *kvm)
+{
+	return min_t(u64, kvm->ram_size, KVM_32BIT_GAP_START);
+}
+
+/* The program header @i of an ELF32 or ELF64 file, as an ELF64 one */
+static bool pvh__read_phdr(int fd, Elf64_Ehdr *ehdr, unsigned int i,
+			   Elf64_Phdr *phdr)
+{
+	off_t off = ehdr->e_phoff + (off_t)i * ehdr->e_phentsize;
+	Elf32_Phdr phdr32;
+
+	if (ehdr->e_ident[EI_CLASS] == ELFCLASS64)
+		return pread_in_full(fd, phdr, sizeof(*phdr), off) == sizeof(*phdr);
+
+	if (pread_in_full(fd, &phdr32, sizeof(phdr32), off) != sizeof(phdr32))
+		return false;
+
+	*phdr = (Elf64_Phdr) {
+		.p_type		= phdr32.p_type,
+		.p_offset	= phdr32.p_offset,
+		.p_paddr	= phdr32.p_paddr,
+		.p_filesz	= phdr32.p_filesz,
+		.p_memsz	= phdr32.p_memsz,
+	};
+
+	return true;
+}
+
+/* Look for XEN_ELFNOTE_PHYS32_ENTRY in a PT_NOTE segment */
+static u32 pvh__find_entry(int fd, Elf64_Phdr *phdr)
+{
+	Elf64_Nhdr *nhdr;
+	u32 entry = 0;
+	u64 off = 0;
+	void *notes;
+
+	if (!phdr->p_filesz || phdr->p_filesz > SZ_1M)
+		return 0;
+
+	notes = malloc(phdr->p_filesz);
+	if (!notes)
+		return 0;
+
+	if (pread_in_full(fd, notes, phdr->p_filesz, phdr->p_offset) !=
+	    (ssize_t)phdr->p_filesz)
+		goto out;
+
+	while (off + sizeof(*nhdr) <= phdr->p_filesz) {
+		u64 name = off + sizeof(*nhdr);
+		u64 desc;
+
+		nhdr = notes + off;
+		desc = name + ALIGN(nhdr->n_namesz, 4);
+		off = desc + ALIGN(nhdr->n_descsz, 4);
+		if (off > phdr->p_filesz)
+			break;
+
+		if (nhdr->n_type == XEN_ELFNOTE_PHYS32_ENTRY &&
+		    nhdr->n_namesz == 4 && !memcmp(notes + name, "Xen", 4) &&
+		    nhdr->n_descsz >= sizeof(u32)) {
+			memcpy(&entry, notes + desc, sizeof(entry));
+			break;
+		}
+	}
+out:
+	free(notes);
+	return entry;
+}
+
+/*
+ * An uncompressed vmlinux, or another ELF kernel, is loaded where its
+ * program headers say and entered at its PVH entry point, in protected
+ * mode. That skips the real-mode setup code and the decompressor.
+ */
+static bool load_elf(struct kvm *kvm, int fd_kernel, int fd_initrd,
+		     const char *kernel_cmdline)
+{
+	u64 ram_end = pvh__low_ram_end(kvm), kernel_end = 0;
+	Elf64_Ehdr ehdr;
+	Elf64_Phdr phdr;
+	unsigned int i;
+	u32 entry = 0;
+	void *p;
+
+	if (pread_in_full(fd_kernel, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+	    memcmp(ehdr.e_ident, ELFMAG, SELFMAG))
+		return false;
+
+	/* The fields up to e_phnum are at other offsets in an ELF32 header */
+	if (ehdr.e_ident[EI_CLASS] == ELFCLASS32) {
+		Elf32_Ehdr *ehdr32 = (void *)&ehdr;
+
+		if (ehdr32->e_machine != EM_386)
+			return false;
+
+		ehdr = (Elf64_Ehdr) {
+			.e_entry	= ehdr32->e_entry,
+			.e_phoff	= ehdr32->e_phoff,
+			.e_phentsize	= ehdr32->e_phentsize,
+			.e_phnum	= ehdr32->e_phnum,
+		};
+		ehdr.e_ident[EI_CLASS] = ELFCLASS32;
+		/* Without a PVH note, it is entered at its (physical) entry */
+		entry = ehdr.e_entry;
+	} else if (ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+		   ehdr.e_machine != EM_X86_64) {
+		return false;
+	}
+
+	for (i = 0; i < ehdr.e_phnum; i++) {
+		if (!pvh__read_phdr(fd_kernel, &ehdr, i, &phdr))
+			die("Unable to read the program headers of the kernel");
+
+		if (phdr.p_type == PT_NOTE && !kvm->arch.pvh_entry)
+			kvm->arch.pvh_entry = pvh__find_entry(fd_kernel, &phdr);
+
+		if (phdr.p_type != PT_LOAD || !phdr.p_memsz)
+			continue;
+
+		if (phdr.p_filesz > phdr.p_memsz || phdr.p_paddr < BZ_KERNEL_START ||
+		    phdr.p_paddr + phdr.p_memsz > ram_end)
+			die("Kernel segment at 0x%llx doesn't fit in guest RAM",
+			    (unsigned long long)phdr.p_paddr);
+
+		p = guest_flat_to_host(kvm, phdr.p_paddr);
+		if (kvm__load_image(kvm, fd_kernel, phdr.p_offset, p,
+				    phdr.p_filesz) != (ssize_t)phdr.p_filesz)
+			die_perror("kernel read");
+		memset(p + phdr.p_filesz, 0, phdr.p_memsz - phdr.p_filesz);
+
+		kernel_end = max_t(u64, kernel_end, phdr.p_paddr + phdr.p_memsz);
+	}
+
+	if (!kvm->arch.pvh_entry)
+		kvm->arch.pvh_entry = entry;
+	if (!kvm->arch.pvh_entry) {
+		pr_warning("ELF kernel without a PVH entry point (CONFIG_PVH)");
+		return false;
+	}
+
+	p = guest_flat_to_host(kvm, BOOT_CMDLINE_OFFSET);
+	memset(p, 0, PVH_CMDLINE_MAX);
+	if (kernel_cmdline)
+		strlcpy(p, kernel_cmdline, PVH_CMDLINE_MAX);
+
+	/* As high as possible below the gap, like the bzImage loader */
+	if (fd_initrd >= 0) {
+		struct stat initrd_stat;
+		u64 addr;
+
+		if (fstat(fd_initrd, &initrd_stat))
+			die_perror("fstat");
+
+		if ((u64)initrd_stat.st_size > ram_end)
+			die("Not enough memory for initrd");
+		addr = (ram_end - initrd_stat.st_size) & ~0xfffffULL;
+		if (addr < ALIGN(kernel_end, SZ_1M))
+			die("Not enough memory for initrd");
+
+		p = guest_flat_to_host(kvm, addr);
+		if (kvm__load_image(kvm, fd_initrd, 0, p, initrd_stat.st_size) !=
+		    initrd_stat.st_size)
+			die("Failed to read initrd");
+
+		kvm->arch.pvh_initrd_addr = addr;
+		kvm->arch.pvh_initrd_size = initrd_stat.st_size;
+	}
+
+	return true;
+}
+
+/* After e820_setup(), which made the memory map that the kernel gets */
+static void pvh__setup_start_info(struct kvm *kvm)
+{
+	struct e820map *e820 = guest_flat_to_host(kvm, E820_MAP_START);
+	struct hvm_memmap_table_entry *memmap;
+	struct hvm_modlist_entry *mod;
+	struct hvm_start_info *info;
+	u64 addr = PVH_START_INFO;
+	u32 i;
+
+	info = guest_flat_to_host(kvm, addr);
+	*info = (struct hvm_start_info) {
+		.magic		= XEN_HVM_START_MAGIC_VALUE,
+		.version	= 1,
+		.cmdline_paddr	= BOOT_CMDLINE_OFFSET,
+		.rsdp_paddr	= kvm->cfg.arch.acpi ? ACPI_RSDP_ADDR : 0,
+	};
+	addr += sizeof(*info);
+
+	memmap = guest_flat_to_host(kvm, addr);
+	for (i = 0; i < e820->nr_map; i++) {
+		memmap[i] = (struct hvm_memmap_table_entry) {
+			.addr	= e820->map[i].addr,
+			.size	= e820->map[i].size,
+			.type	= e820->map[i].type,
+		};
+	}
+	info->memmap_paddr = addr;
+	info->memmap_entries = e820->nr_map;
+	addr += e820->nr_map * sizeof(*memmap);
+
+	if (kvm->arch.pvh_initrd_size) {
+		mod = guest_flat_to_host(kvm, addr);
+		*mod = (struct hvm_modlist_entry) {
+			.paddr	= kvm->arch.pvh_initrd_addr,
+			.size	= kvm->arch.pvh_initrd_size,
+		};
+		info->modlist_paddr = addr;
+		info->nr_modules = 1;
+		addr += sizeof(*mod);
+	}
+
+	BUG_ON(addr > BOOT_LOADER_SP);
+}
+
 bool kvm__arch_load_kernel_image(struct kvm *kvm, int fd_kernel, int fd_initrd,
 				 const char *kernel_cmdline)
 {
 	if (load_bzimage(kvm, fd_kernel, fd_initrd, kernel_cmdline))
 		return true;
+
+	if (load_elf(kvm, fd_kernel, fd_initrd, kernel_cmdline))
+		return true;
 	pr_warning("Kernel image is not a bzImage.");
 	pr_warning("Trying to load it as a flat binary (no cmdline support)");
 
@@ -372,6 +732,9 @@ int kvm__arch_setup_firmware(struct kvm *kvm)
 	/* standart minimal configuration */
 	setup_bios(kvm);
 
+	if (kvm->arch.pvh_entry)
+		pvh__setup_start_info(kvm);
+
 	/* FIXME: SMP, ACPI and friends here */
 
 	return 0;
@@ -382,8 +745,67 @@ int kvm__arch_free_firmware(struct kvm *kvm)
 	return 0;
 }
 
-void kvm__arch_read_term(struct kvm *kvm)
+/* The PIC, the IOAPIC, the PIT and kvmclock make the VM state */
+int kvm__arch_save_state(struct kvm *kvm, struct snapshot *snap)
 {
-	serial8250__update_consoles(kvm);
-	virtio_console__inject_interrupt(kvm);
+	struct kvm_irqchip chip;
+	struct kvm_pit_state2 pit;
+	struct kvm_clock_data clock;
+	int i, r;
+
+	for (i = KVM_IRQCHIP_PIC_MASTER; i <= KVM_IRQCHIP_IOAPIC; i++) {
+		chip = (struct kvm_irqchip) { .chip_id = i };
+		if (ioctl(kvm->vm_fd, KVM_GET_IRQCHIP, &chip) < 0)
+			return -errno;
+		r = snapshot__write(snap, &chip, sizeof(chip));
+		if (r < 0)
+			return r;
+	}
+
+	if (ioctl(kvm->vm_fd, KVM_GET_PIT2, &pit) < 0)
+		return -errno;
+	r = snapshot__write(snap, &pit, sizeof(pit));
+	if (r < 0)
+		return r;
+
+	if (ioctl(kvm->vm_fd, KVM_GET_CLOCK, &clock) < 0)
+		return -errno;
+
+	return snapshot__write(snap, &clock, sizeof(clock));
+}
+
+int kvm__arch_restore_state(struct kvm *kvm, struct snapshot *snap)
+{
+	struct kvm_irqchip chip;
+	struct kvm_pit_state2 pit;
+	struct kvm_clock_data clock;
+	u32 i;
+	int r;
+
+	for (i = KVM_IRQCHIP_PIC_MASTER; i <= KVM_IRQCHIP_IOAPIC; i++) {
+		r = snapshot__read(snap, &chip, sizeof(chip));
+		if (r < 0)
+			return r;
+		if (chip.chip_id != i)
+			return -EINVAL;
+		if (ioctl(kvm->vm_fd, KVM_SET_IRQCHIP, &chip) < 0)
+			return -errno;
+	}
+
+	r = snapshot__read(snap, &pit, sizeof(pit));
+	if (r < 0)
+		return r;
+	if (ioctl(kvm->vm_fd, KVM_SET_PIT2, &pit) < 0)
+		return -errno;
+
+	r = snapshot__read(snap, &clock, sizeof(clock));
+	if (r < 0)
+		return r;
+
+	/* Only the value is set, the flags of KVM_GET_CLOCK are for reading */
+	clock.flags = 0;
+	if (ioctl(kvm->vm_fd, KVM_SET_CLOCK, &clock) < 0)
+		return -errno;
+
+	return 0;
 }
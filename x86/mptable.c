@@ -99,6 +99,10 @@ int mptable__init(struct kvm *kvm)
 		ncpus = MPTABLE_MAX_CPUS;
 	}
 
+	/* A sparse --cpu-topology runs out of 8-bit APIC IDs sooner */
+	while (ncpus && kvm__apic_id(kvm, ncpus - 1) >= MPTABLE_MAX_CPUS)
+		ncpus--;
+
 	mpc_table = calloc(1, MPTABLE_MAX_SIZE);
 	if (!mpc_table)
 		return -ENOMEM;
@@ -120,9 +124,10 @@ int mptable__init(struct kvm *kvm)
 	mpc_cpu = (void *)&mpc_table[1];
 	for (i = 0; i < ncpus; i++) {
 		mpc_cpu->type		= MP_PROCESSOR;
-		mpc_cpu->apicid		= i;
+		mpc_cpu->apicid		= kvm__apic_id(kvm, i);
 		mpc_cpu->apicver	= KVM_APIC_VERSION;
-		mpc_cpu->cpuflag	= gen_cpu_flag(i, ncpus);
+		/* The parked vCPUs are there, disabled */
+		mpc_cpu->cpuflag	= gen_cpu_flag(i, kvm->cfg.nrcpus);
 		mpc_cpu->cpufeature	= 0x600; /* some default value */
 		mpc_cpu->featureflag	= 0x201; /* some default value */
 		mpc_cpu++;
@@ -159,7 +164,7 @@ int mptable__init(struct kvm *kvm)
 	/*
 	 * IO-APIC chip.
 	 */
-	ioapicid		= ncpus + 1;
+	ioapicid		= kvm__apic_id(kvm, ncpus - 1) + 2;
 	mpc_ioapic		= last_addr;
 	mpc_ioapic->type	= MP_IOAPIC;
 	mpc_ioapic->apicid	= ioapicid;
@@ -0,0 +1,172 @@
+#include "kvm/kvm.h"
+#include "kvm/util.h"
+
+#include <linux/kvm.h>
+
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+/*
+ * With --cpu-topology, vCPU i is thread i % threads of core (i / threads) %
+ * cores of socket i / (threads * cores), and its APIC ID has a field for
+ * each, rounded up to a power of two as on real parts.
+ */
+int cpu_topology_parser(const struct option *opt, const char *arg, int unset)
+{
+	struct kvm *kvm = opt->ptr;
+	struct kvm_config_arch *cfg = &kvm->cfg.arch;
+	char *next, *p;
+	u32 *field;
+
+	if (!strcmp(arg, "host")) {
+		cfg->topology_host = true;
+		return 0;
+	}
+
+	p = (char *)arg;
+	while (*p) {
+		if (!strncmp(p, "sockets=", 8))
+			field = &cfg->sockets;
+		else if (!strncmp(p, "cores=", 6))
+			field = &cfg->cores;
+		else if (!strncmp(p, "threads=", 8))
+			field = &cfg->threads;
+		else
+			die("Invalid CPU topology: %s", arg);
+
+		p = strchr(p, '=') + 1;
+		*field = strtoul(p, &next, 10);
+		if (next == p || !*field || (*next && *next != ','))
+			die("Invalid CPU topology: %s", arg);
+		p = *next ? next + 1 : next;
+	}
+
+	return 0;
+}
+
+/* How many CPUs a sysfs list such as "0-3,8-11" has */
+static u32 topology__count_list(const char *path)
+{
+	unsigned long first, last;
+	char buf[4096], *p;
+	u32 nr = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	p = fgets(buf, sizeof(buf), f);
+	fclose(f);
+
+	while (p && *p && *p != '\n') {
+		first = strtoul(p, &p, 10);
+		last = *p == '-' ? strtoul(p + 1, &p, 10) : first;
+		if (last >= first)
+			nr += last - first + 1;
+		if (*p != ',')
+			break;
+		p++;
+	}
+
+	return nr;
+}
+
+/* The layout of the package of the first host CPU of the vCPUs */
+static void topology__from_host(struct kvm *kvm, u32 nrcpus)
+{
+	struct kvm_config_arch *cfg = &kvm->cfg.arch;
+	char path[PATH_MAX];
+	u32 cpu = 0, threads, lps, cores;
+
+	if (kvm->cfg.nr_vcpu_pins)
+		cpu = kvm->cfg.vcpu_pins[0].cpu;
+	else if (kvm->cfg.vcpu_affinity)
+		while (cpu < NR_CPUS - 1 &&
+		       !CPU_ISSET_S(cpu, CPU_ALLOC_SIZE(NR_CPUS),
+				    kvm->cfg.vcpu_affinity))
+			cpu++;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list",
+		 cpu);
+	threads = topology__count_list(path) ?: 1;
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%u/topology/core_siblings_list",
+		 cpu);
+	lps = topology__count_list(path) ?: threads;
+
+	if (nrcpus % threads)
+		threads = 1;
+	cores = min_t(u32, max_t(u32, lps / threads, 1), nrcpus / threads);
+	while ((nrcpus / threads) % cores)
+		cores--;
+
+	cfg->threads = threads;
+	cfg->cores = cores;
+	cfg->sockets = nrcpus / (threads * cores);
+}
+
+/* Before the number of vCPUs defaults to the host's, they come from here */
+void kvm__topology_validate(struct kvm *kvm)
+{
+	struct kvm_config_arch *cfg = &kvm->cfg.arch;
+
+	if (cfg->topology_host && (cfg->sockets || cfg->cores || cfg->threads))
+		die("--cpu-topology host doesn't take a layout");
+
+	if (!kvm->cfg.nrcpus && cfg->sockets && cfg->cores && cfg->threads)
+		kvm->cfg.nrcpus = cfg->sockets * cfg->cores * cfg->threads;
+}
+
+void kvm__topology_init(struct kvm *kvm)
+{
+	struct kvm_config_arch *cfg = &kvm->cfg.arch;
+	struct kvm_x86_topology *topo = &kvm->arch.topology;
+	/* The parked vCPUs have their place in the layout too */
+	u32 nrcpus = kvm->cfg.max_cpus;
+	int max_id;
+
+	if (cfg->topology_host)
+		topology__from_host(kvm, nrcpus);
+	else if (!cfg->sockets && !cfg->cores && !cfg->threads)
+		return;
+
+	topo->sockets = cfg->sockets ?: 1;
+	topo->threads = cfg->threads ?: 1;
+	topo->cores = cfg->cores ?: nrcpus / (topo->sockets * topo->threads);
+	if (!topo->cores ||
+	    topo->sockets * topo->cores * topo->threads != nrcpus)
+		die("--cpu-topology of %u sockets, %u cores and %u threads doesn't make %u vCPUs",
+		    topo->sockets, topo->cores, topo->threads, nrcpus);
+
+	topo->smt_shift = fls_long(topo->threads - 1);
+	topo->pkg_shift = topo->smt_shift + fls_long(topo->cores - 1);
+	topo->enabled = true;
+
+	max_id = ioctl(kvm->sys_fd, KVM_CHECK_EXTENSION, KVM_CAP_MAX_VCPU_ID);
+	if (max_id > 0 && kvm__apic_id(kvm, nrcpus - 1) >= (u32)max_id)
+		die("--cpu-topology needs APIC IDs up to %u, KVM stops at %d",
+		    kvm__apic_id(kvm, nrcpus - 1), max_id - 1);
+
+	pr_debug("CPU topology: %u sockets, %u cores, %u threads",
+		 topo->sockets, topo->cores, topo->threads);
+}
+
+u32 kvm__apic_id(struct kvm *kvm, u32 cpu)
+{
+	struct kvm_x86_topology *topo = &kvm->arch.topology;
+	u32 thread, core, socket;
+
+	if (!topo->enabled)
+		return cpu;
+
+	thread = cpu % topo->threads;
+	core = (cpu / topo->threads) % topo->cores;
+	socket = cpu / (topo->threads * topo->cores);
+
+	return socket << topo->pkg_shift | core << topo->smt_shift | thread;
+}